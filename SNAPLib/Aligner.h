@@ -51,6 +51,23 @@ inline bool isOneLocation(AlignmentResult result) {
 
 extern bool doAlignerPrefetch;
 
+//
+// The seeds that one aligner looked up for a read and what it found, so that another aligner working on the same read
+// can use them rather than looking them up again.  seedOffsets, nHits and hits all have nSeeds elements, and the hits
+// are what GenomeIndex::lookupSeed returns for the seed at that offset in the forward read over the whole genome.  They
+// point into the first aligner's memory, so they're only good until it works on another read.  With a compressed overflow
+// table only the first maxHitsDecoded of each hit list were decoded, so they're no use to an aligner that reads more.  If
+// popularListsSkipped, seeds with more hits than that don't have any (see DecodedHitBuffer::skipPopularLists).
+//
+struct SeedLookups {
+    unsigned                 nSeeds;
+    unsigned                 maxHitsDecoded;
+    bool                     popularListsSkipped;
+    const unsigned          *seedOffsets;
+    const unsigned          *nHits[NUM_DIRECTIONS];
+    const GenomeLocation   **hits[NUM_DIRECTIONS];
+};
+
 class Aligner {
     public:
    
@@ -59,7 +76,7 @@ class Aligner {
         virtual AlignmentResult
     AlignRead(
         Read        *read,
-        unsigned    *genomeLocation,
+        GenomeLocation *genomeLocation,
         Direction   *hitDirection,
         int         *finalScore = NULL,
         int         *mapq = NULL,
@@ -33,6 +33,13 @@ Revision History:
 #include "FileFormat.h"
 #include "exit.h"
 #include "PairedAligner.h"
+#include "ReadTrimmer.h"
+#include "ReadScreen.h"
+#include "ReadRouter.h"
+#include "DataWriter.h"
+#include "InputOrder.h"
+#include "TraceRecorder.h"
+#include "ReadSupplierQueue.h"
 
 using std::max;
 using std::min;
@@ -43,24 +50,63 @@ using std::min;
 GenomeIndex *g_index = NULL;
 char *g_indexDirectory = NULL;
 
+//
+// And likewise the -compete index, which is guarded by the same lock.
+//
+GenomeIndex *g_competingIndex = NULL;
+char *g_competingIndexDirectory = NULL;
+
+//
+// Alignments running at the same time (snap batch) share g_index.  The one that finds it needs loading holds this from
+// when it starts the load until the index is there, so the others wait for it rather than loading their own.
+//
+class SharedIndexLock
+{
+public:
+    SharedIndexLock()
+    {
+        InitializeExclusiveLock(&lock);
+    }
+
+    ExclusiveLock lock;
+};
+
+static SharedIndexLock sharedIndexLock;
+
+//
+// With -lazy, how many seed lookups get readahead hints.  Enough for the start of a big job, and most of a small one.
+//
+static const _int64 LazyIndexReadaheadLookups = 16 * 1024 * 1024;
+
 AlignerContext::AlignerContext(int i_argc, const char **i_argv, const char *i_version, AlignerExtension* i_extension)
     :
     index(NULL),
     writerSupplier(NULL),
+    competingIndex(NULL),
+    competingWriterSupplier(NULL),
     options(NULL),
     stats(NULL),
     extension(i_extension != NULL ? i_extension : new AlignerExtension()),
     readWriter(NULL),
+    competingReadWriter(NULL),
     argc(i_argc),
     argv(i_argv),
     version(i_version),
-    perfFile(NULL)
+    perfFile(NULL),
+    perfReporter(NULL),
+    trimmer(NULL),
+    screen(NULL),
+    screenedWriterSupplier(NULL),
+    screenedReadWriter(NULL),
+    loadingIndex(false),
+    holdingIndexLock(false)
 {
 }
 
 AlignerContext::~AlignerContext()
 {
     delete extension;
+    delete screen;
     if (NULL != perfFile) {
         fclose(perfFile);
     }
@@ -78,17 +124,21 @@ void AlignerContext::runAlignment(int argc, const char **argv, const char *versi
     
     if (! extension->skipAlignment()) {
         printStatsHeader();
-        do {
+        if (0 != options->checkpointPieces) {
+            runCheckpointedAlignment();
+        } else {
+            do {
 
-            beginIteration();
+                beginIteration();
 
-            runTask();
-            
-            finishIteration();
-            
-            printStats();
+                runTask();
 
-        } while (nextIteration());
+                finishIteration();
+
+                printStats();
+
+            } while (nextIteration());
+        }
     }
 
     extension->finishAlignment();
@@ -96,25 +146,99 @@ void AlignerContext::runAlignment(int argc, const char **argv, const char *versi
     PrintWaitProfile();
 }
 
+    bool
+AlignerContext::checkCommand(int argc, const char **argv, const char *version, unsigned *argsConsumed)
+{
+    AlignerOptions *checkedOptions;
+    SetSoftExitThrows(true);
+    try {
+        checkedOptions = parseOptions(argc, argv, version, argsConsumed, isPaired());
+    } catch (const SoftExitException &) {
+        SetSoftExitThrows(false);
+        return false;
+    }
+    SetSoftExitThrows(false);
+
+    bool ok = true;
+    if (strcmp(checkedOptions->indexDir, "-") != 0 && (g_indexDirectory == NULL || strcmp(g_indexDirectory, checkedOptions->indexDir) != 0)) {
+        const size_t filenameBufferSize = MAX_PATH + 1;
+        char filenameBuffer[filenameBufferSize];
+        snprintf(filenameBuffer, filenameBufferSize, "%s%cGenomeIndex", checkedOptions->indexDir, PATH_SEP);
+        FILE *indexFile = fopen(filenameBuffer, "r");
+        if (NULL == indexFile) {
+            fprintf(stderr, "Unable to open index directory '%s'\n", checkedOptions->indexDir);
+            ok = false;
+        } else {
+            fclose(indexFile);
+        }
+    }
+
+    for (int i = 0; i < checkedOptions->nInputs; i++) {
+        const SNAPFile *input = &checkedOptions->inputs[i];
+        const char *fileNames[2] = {input->isStdio ? NULL : input->fileName, input->secondFileName};
+        for (int j = 0; j < 2; j++) {
+            if (NULL == fileNames[j]) {
+                continue;
+            }
+            FILE *inputFile = fopen(fileNames[j], "rb");
+            if (NULL == inputFile) {
+                fprintf(stderr, "Unable to open input file '%s'\n", fileNames[j]);
+                ok = false;
+            } else {
+                fclose(inputFile);
+            }
+        }
+    }
+
+    //
+    // The options are copied by value elsewhere, so they don't own their inputs array; free it here.
+    //
+    delete [] checkedOptions->inputs;
+    delete checkedOptions;
+    return ok;
+}
+
     void
 AlignerContext::initializeThread()
 {
     stats = newStats(); // separate copy per thread
     stats->extra = extension->extraStats();
+    if (options->slowReadsToReport >= 0) {
+        stats->latencies = new ReadLatencies(options->slowReadsToReport);
+    }
     readWriter = writerSupplier != NULL ? writerSupplier->getWriter() : NULL;
+    if (readWriter != NULL && InputOrder::Enabled) {
+        readWriter = InputOrder::wrap(readWriter);
+    }
+    competingReadWriter = competingWriterSupplier != NULL ? competingWriterSupplier->getWriter() : NULL;
+    screenedReadWriter = screenedWriterSupplier != NULL ? screenedWriterSupplier->getWriter() : NULL;
     extension = extension->copy();
 }
 
     void
 AlignerContext::runThread()
 {
+    PerfCounters::attach(&stats->perf);
     extension->beginThread();
+    if (readWriter != NULL && InputOrder::Enabled) {
+        InputOrder::beginThread();
+    }
     runIterationThread();
     if (readWriter != NULL) {
         readWriter->close();
         delete readWriter;
     }
+    if (competingReadWriter != NULL) {
+        competingReadWriter->close();
+        delete competingReadWriter;
+    }
+    if (screenedReadWriter != NULL) {
+        screenedReadWriter->close();
+        delete screenedReadWriter;
+    }
+    InputOrder::finishThread();
     extension->finishThread();
+    PerfCounters::detach();
 }
     
     void
@@ -130,7 +254,9 @@ AlignerContext::finishThread(AlignerContext* common)
     void
 AlignerContext::initialize()
 {
+    AcquireExclusiveLock(&sharedIndexLock.lock);
     if (g_indexDirectory == NULL || strcmp(g_indexDirectory, options->indexDir) != 0) {
+        AlignerCache::trim(0);  // they point into the old index
         delete g_index;
         g_index = NULL;
         delete g_indexDirectory;
@@ -138,20 +264,18 @@ AlignerContext::initialize()
         strcpy(g_indexDirectory, options->indexDir);
 
         if (strcmp(options->indexDir, "-") != 0) {
-            fprintf(stderr, "Loading index from directory... ");
- 
-            fflush(stdout);
-            _int64 loadStart = timeInMillis();
-            index = GenomeIndex::loadFromDirectory((char*) options->indexDir);
-            if (index == NULL) {
-                fprintf(stderr, "Index load failed, aborting.\n");
+            fprintf(stderr, "Loading index from directory...\n");
+            indexLoadStart = timeInMillis();
+            interleavingIndex = options->interleaveIndex;
+            loadingIndex = true;
+            if (!CreateSingleWaiterObject(&indexLoaded)) {
+                fprintf(stderr, "Unable to create the index load event\n");
                 soft_exit(1);
             }
-            g_index = index;
-
-            _int64 loadTime = timeInMillis() - loadStart;
-             fprintf(stderr, "%llds.  %u bases, seed size %d\n",
-                    loadTime / 1000, index->getGenome()->getCountOfBases(), index->getSeedLength());
+            holdingIndexLock = true;    // Until waitForIndex
+            if (!StartNewThread(LoadIndexThreadMain, this)) {
+                LoadIndexThreadMain(this);
+            }
          } else {
             fprintf(stderr, "no alignment, input/output only\n");
         }
@@ -159,6 +283,37 @@ AlignerContext::initialize()
         index = g_index;
     }
 
+    //
+    // The -compete index loads here, while the main one loads on its thread.
+    //
+    if (NULL != options->competingIndexDir) {
+        if (g_competingIndexDirectory == NULL || strcmp(g_competingIndexDirectory, options->competingIndexDir) != 0) {
+            AlignerCache::trim(0);  // they point into the old index too
+            delete g_competingIndex;
+            delete g_competingIndexDirectory;
+            g_competingIndexDirectory = new char [strlen(options->competingIndexDir) + 1];
+            strcpy(g_competingIndexDirectory, options->competingIndexDir);
+
+            fprintf(stderr, "Loading competing index from directory...\n");
+            _int64 loadStart = timeInMillis();
+            g_competingIndex = GenomeIndex::loadFromDirectory((char*) options->competingIndexDir, options->mapIndex, options->prefetchIndex,
+                                                              options->packGenome, &options->indexPlacement);
+            if (NULL == g_competingIndex) {
+                fprintf(stderr, "Competing index load failed, aborting.\n");
+                soft_exit(1);
+            }
+            if (options->lazyIndex && !options->prefetchIndex) {
+                g_competingIndex->setReadaheadHints(LazyIndexReadaheadLookups);
+            }
+            fprintf(stderr, "Loaded competing index in %llds.  %lld bases, seed size %d\n",
+                (timeInMillis() - loadStart) / 1000, (_int64)g_competingIndex->getGenome()->getCountOfBases(), g_competingIndex->getSeedLength());
+        }
+        competingIndex = g_competingIndex;
+    }
+    if (!holdingIndexLock) {
+        ReleaseExclusiveLock(&sharedIndexLock.lock);
+    }
+
     maxHits_ = options->maxHits;
     maxDist_ = options->maxDist;
     extraSearchDepth = options->extraSearchDepth;
@@ -171,7 +326,161 @@ AlignerContext::initialize()
         }
     }
 
+    if (NULL != options->screenFasta && NULL == screen) {
+        screen = ReadScreen::create(options->screenFasta);
+        if (NULL == screen) {
+            soft_exit(1);
+        }
+        fprintf(stderr, "Screening reads for the %lld %d-mers in '%s'\n", screen->getKmerCount(), ReadScreen::KmerLength, options->screenFasta);
+    }
+
     DataSupplier::ThreadCount = options->numThreads;
+    DataSupplier::StreamStdin = options->streamFlushMillis >= 0;
+#ifdef __linux__
+    if (options->asyncInput) {
+        DataSupplier::SetDefault(DataSupplier::LinuxAio);
+    }
+#elif defined(__APPLE__)
+    if (options->asyncInput) {
+        DataSupplier::SetDefault(DataSupplier::OsxDispatch);
+    }
+#endif
+}
+
+    void
+AlignerContext::LoadIndexThreadMain(void *param)
+{
+    AlignerContext *context = (AlignerContext *)param;
+    AlignerOptions *options = context->options;
+
+    //
+    // On Linux the NUMA memory policy is per thread, so interleaving here spreads out only the index.
+    //
+    bool interleaving = context->interleavingIndex && InterleaveMemoryAcrossNumaNodes(true);
+    if (!options->indexPlacement.isDefault()) {
+        if (options->mapIndex) {
+            fprintf(stderr, "-place doesn't work with -map, which maps the whole index\n");
+            soft_exit(1);
+        }
+        fprintf(stderr, "Placing the index: ");
+        options->indexPlacement.print(stderr);
+        fprintf(stderr, "\n");
+    }
+    context->index = GenomeIndex::loadFromDirectory((char*) options->indexDir, options->mapIndex, options->prefetchIndex, options->packGenome,
+                                                    &options->indexPlacement);
+    if (interleaving) {
+        InterleaveMemoryAcrossNumaNodes(false);
+    }
+    if (NULL != context->index && options->lazyIndex && !options->prefetchIndex) {
+        context->index->setReadaheadHints(LazyIndexReadaheadLookups);
+    }
+
+    SignalSingleWaiterObject(&context->indexLoaded);
+}
+
+    void
+AlignerContext::waitForIndex()
+{
+    if (!loadingIndex) {
+        return;
+    }
+
+    WaitForSingleWaiterObject(&indexLoaded);
+    DestroySingleWaiterObject(&indexLoaded);
+    loadingIndex = false;
+
+    if (index == NULL) {
+        fprintf(stderr, "Index load failed, aborting.\n");
+        soft_exit(1);
+    }
+    g_index = index;
+    if (holdingIndexLock) {
+        holdingIndexLock = false;
+        ReleaseExclusiveLock(&sharedIndexLock.lock);
+    }
+
+    _int64 loadTime = timeInMillis() - indexLoadStart;
+    fprintf(stderr, "Loaded index in %llds.  %lld bases, seed size %d\n",
+        loadTime / 1000, (_int64)index->getGenome()->getCountOfBases(), index->getSeedLength());
+}
+
+    void
+AlignerContext::planMemory()
+{
+    //
+    // The index, the aligners and the buffers for reading and writing are what's big, so they're what's planned for,
+    // with a fixed amount kept back for everything else (stats, the duplicate marker, the runtime).  The aligners
+    // reserve their memory up front, so that part's exact.  Each reader thread has about two buffers per input file,
+    // and compressed input needs room to decompress into as well; that's also as far as the readers may grow their
+    // read-ahead.
+    //
+    const _int64 MB = 1024 * 1024;
+    const _int64 OtherBytes = 512 * MB;
+    const _int64 ReadBufferBytes = 4 * MB;     // DataReader's buffer size
+
+    _int64 limit = GetMemoryLimit();
+    _int64 budget = options->memoryBudget > 0 ? __min(options->memoryBudget, limit) : limit;
+    _int64 indexBytes = NULL != index ? GenomeIndex::getLoadedSize(options->indexDir) : 0;
+    if (NULL != competingIndex) {
+        indexBytes += GenomeIndex::getLoadedSize(options->competingIndexDir);
+    }
+    _int64 alignerBytes = NULL != index ? (_int64) getAlignerMemoryReservation() : 0;
+    _int64 readBytes = (_int64) (2 * ReadBufferBytes * (1 + options->expansionFactor)) * (isPaired() ? 2 : 1);
+    _int64 available = budget - indexBytes - OtherBytes;
+    bool writing = NULL != options->outputFile.fileName;
+    int nOutputs = 1 + (NULL != competingIndex) + (NULL != screen);  // The -compete and -screen outputs have buffers of their own
+
+    int threads;
+    _int64 writeBytes;  // per thread
+    if (writing && options->sortOutput && 0 == options->sortMemory) {
+        //
+        // Keep all the threads if they fit with the smallest sort buffers, and give the sort buffers what's left, up to
+        // their default size.  Smaller buffers just mean more runs to merge, while fewer threads is slower all the way.
+        //
+        _int64 minSortBytes = DataWriterSupplier::SortBufferCount * DataWriterSupplier::DefaultBufferSize;
+        _int64 defaultSortBytes = DataWriterSupplier::defaultSortMemory(NULL != index ? index->getGenome() : NULL, 1);
+        threads = (int) __min((_int64) options->numThreads, available / (alignerBytes + readBytes + minSortBytes));
+        writeBytes = threads > 0 ? __min(defaultSortBytes, available / threads - alignerBytes - readBytes) : minSortBytes;
+        options->plannedSortMemory = threads > 0 ? (size_t) (writeBytes * threads) : 0;
+    } else {
+        if (writing && options->sortOutput) {
+            available -= options->sortMemory * (1LL << 30);     // -sm is for all the threads together
+            writeBytes = 0;
+        } else {
+            writeBytes = writing ? nOutputs * DataWriterSupplier::DefaultBufferCount * DataWriterSupplier::DefaultBufferSize : 0;
+        }
+        threads = (int) __min((_int64) options->numThreads, available / (alignerBytes + readBytes + writeBytes));
+    }
+
+    if (threads < 1) {
+        fprintf(stderr, "-mem: %lld MB isn't enough for the index (%lld MB), %lld MB for everything else and one thread (%lld MB)\n",
+            budget / MB, indexBytes / MB, OtherBytes / MB, (alignerBytes + readBytes + writeBytes) / MB);
+        soft_exit(1);
+    }
+
+    fprintf(stderr, "Memory plan for %lld MB%s: %lld MB for the index, %d thread%s each with %lld MB for the aligner, %lld MB for reads and %lld MB for %s, "
+        "and %lld MB for everything else\n",
+        budget / MB, options->memoryBudget > 0 && options->memoryBudget <= limit ? "" : " (the memory limit)", indexBytes / MB,
+        threads, threads == 1 ? "" : "s", alignerBytes / MB, readBytes / MB, writeBytes / MB,
+        writing && options->sortOutput ? "sorting" : "output", OtherBytes / MB);
+    if (writing && options->sortOutput && 0 != options->sortMemory) {
+        fprintf(stderr, "    and %u Gb for sorting, from -sm\n", options->sortMemory);
+    }
+
+    options->numThreads = threads;
+    DataSupplier::ThreadCount = threads;
+    DataSupplier::MaxReadBufferBytes = threads * readBytes / (isPaired() ? 2 : 1);     // for each input file
+}
+
+    bool
+AlignerContext::inputsNeedGenome()
+{
+    for (int i = 0; i < options->nInputs; i++) {
+        if (SAMFile == options->inputs[i].fileType || BAMFile == options->inputs[i].fileType || CRAMFile == options->inputs[i].fileType) {
+            return true;
+        }
+    }
+    return false;
 }
 
     void
@@ -184,54 +493,170 @@ AlignerContext::printStatsHeader()
 AlignerContext::beginIteration()
 {
     writerSupplier = NULL;
+    competingWriterSupplier = NULL;
+    screenedWriterSupplier = NULL;
     alignStart = timeInMillis();
     clipping = options->clipping;
-    totalThreads = options->numThreads;
     computeError = options->computeError;
     bindToProcessors = options->bindToProcessors;
     maxDist = maxDist_;
     maxHits = maxHits_;
     numSeedsFromCommandLine = options->numSeedsFromCommandLine;
     seedCoverage = options->seedCoverage;
+    if (0 != options->memoryBudget) {
+        waitForIndex();
+        planMemory();
+    }
+    totalThreads = options->numThreads;
+    AlignerCache::trim(totalThreads);
     if (stats != NULL) {
         delete stats;
     }
     stats = newStats();
     stats->extra = extension->extraStats();
     extension->beginIteration();
+    if (options->perfCounterFileName != NULL || options->statusFileName != NULL) {
+        perfReporter = new PerfReporter(options->perfCounterFileName, options->statusFileName, options->perfCounterInterval,
+            options->numThreads);
+    }
+    if (NULL != options->traceFileName) {
+        TraceRecorder::start();
+    }
     
+    //
+    // Readers of FASTQ and packed reads don't need the genome, so they can get started while the index finishes loading.
+    //
+    bool readBeforeIndex = loadingIndex && !inputsNeedGenome();
+    if (!readBeforeIndex) {
+        waitForIndex();
+    }
+
     readerContext.clipping = options->clipping;
     readerContext.defaultReadGroup = options->defaultReadGroup;
-    readerContext.genome = index != NULL ? index->getGenome() : NULL;
+    readerContext.genome = !readBeforeIndex && index != NULL ? index->getGenome() : NULL;
     readerContext.ignoreSecondaryAlignments = options->ignoreSecondaryAlignments;
     DataSupplier::ExpansionFactor = options->expansionFactor;
 	readerContext.header = NULL;
 	readerContext.headerLength = 0;
 	readerContext.headerBytes = 0;
+    readerContext.rangeIndex = options->rangeIndex;
+    readerContext.rangeCount = options->rangeCount;
+    readerContext.trimmer = NULL;
+    if (NULL != options->adapters || 0 != options->qualityTrimThreshold) {
+        trimmer = ReadTrimmer::create(options->adapters, options->qualityTrimThreshold);
+        if (NULL == trimmer) {
+            soft_exit(1);
+        }
+        readerContext.trimmer = trimmer;
+    }
+    readerContext.screen = screen;
 
     typeSpecificBeginIteration();
 
-    if (UnknownFileType != options->outputFile.fileType) {
-        const FileFormat* format;
-        if (SAMFile == options->outputFile.fileType) {
-            format = FileFormat::SAM[options->useM];
-        } else if (BAMFile == options->outputFile.fileType) {
-            format = FileFormat::BAM[options->useM];
-        } else {
-            //
-            // This shouldn't happen, because the command line parser should catch it.  Perhaps you've added a new output file format and just
-            // forgoten to add it here.
-            //
-            fprintf(stderr, "AlignerContext::beginIteration(): unknown file type %d for '%s'\n", options->outputFile.fileType, options->outputFile.fileName);
-            soft_exit(1);
+    if (readBeforeIndex) {
+        waitForIndex();
+        readerContext.genome = index->getGenome();    // For the writers; the readers have their own copies
+    }
+    ReadSupplierQueue::SeedOrderIndex = options->seedOrder ? index : NULL;
+
+    //
+    // With -compete, the -o output (and any -route ones) and the -compete output split the sort memory.
+    //
+    size_t plannedSortMemory = options->plannedSortMemory;
+    if (NULL != competingIndex && options->sortOutput) {
+        options->plannedSortMemory = options->getSortMemory() / 2;
+    }
+
+    if (UnknownFileType != options->outputFile.fileType && 0 == options->nOutputRoutes) {
+        writerSupplier = getOutputFormat(options->outputFile)->getWriterSupplier(options, readerContext.genome);
+    } else if (0 != options->nOutputRoutes) {
+        //
+        // The -o output (if any) and each -route one go through a router that gives each the reads its filter picks.
+        // The -route outputs are written as -o would write them, but unsorted unless they're one read group's share of
+        // the output, in which case each is sorted in its own pipeline and they split the sort memory between them.
+        //
+        ReadRoute routes[AlignerOptions::MaxOutputRoutes + 1];
+        bool sortRoute[AlignerOptions::MaxOutputRoutes];
+        int nSorted = options->sortOutput && UnknownFileType != options->outputFile.fileType ? 1 : 0;
+        for (int i = 0; i < options->nOutputRoutes; i++) {
+            routes[i].filter = ReadRouteFilter::create(options->outputRoutes[i].filter, readerContext.genome);
+            if (NULL == routes[i].filter) {
+                soft_exit(1);
+            }
+            sortRoute[i] = options->sortOutput && routes[i].filter->picksReadGroups() && FASTQFile != options->outputRoutes[i].file.fileType;
+            nSorted += sortRoute[i];
+        }
+        AlignerOptions sharedOptions = *options;
+        if (nSorted > 1) {
+            sharedOptions.plannedSortMemory = options->getSortMemory() / nSorted;
+        }
+
+        int nRoutes = 0;
+        if (UnknownFileType != options->outputFile.fileType) {
+            routes[options->nOutputRoutes].supplier = getOutputFormat(options->outputFile)->getWriterSupplier(&sharedOptions, readerContext.genome);
+            routes[options->nOutputRoutes].filter = new ReadRouteFilter(options->filterFlags);
+            routes[options->nOutputRoutes].sorted = options->sortOutput;
+            nRoutes++;
+        }
+        for (int i = 0; i < options->nOutputRoutes; i++) {
+            AlignerOptions routeOptions = sharedOptions;
+            routeOptions.outputFile = options->outputRoutes[i].file;
+            routeOptions.sortOutput = sortRoute[i];
+            routes[i].supplier = getOutputFormat(routeOptions.outputFile)->getWriterSupplier(&routeOptions, readerContext.genome);
+            routes[i].sorted = sortRoute[i];
+            nRoutes++;
+        }
+        //
+        // The -o output goes first, as it always has.
+        //
+        if (nRoutes > options->nOutputRoutes) {
+            ReadRoute main = routes[options->nOutputRoutes];
+            memmove(routes + 1, routes, options->nOutputRoutes * sizeof(ReadRoute));
+            routes[0] = main;
         }
+        writerSupplier = RouteReads(nRoutes, routes);
+    }
 
-        writerSupplier = format->getWriterSupplier(options, readerContext.genome);
+    if (NULL != writerSupplier) {
         ReadWriter* headerWriter = writerSupplier->getWriter();
         headerWriter->writeHeader(readerContext, options->sortOutput, argc, argv, version, options->rgLineContents);
         headerWriter->close();
         delete headerWriter;
     }
+
+    //
+    // The -compete output is written as -o would be, but against the competing index's genome, so its header has that
+    // genome's contigs rather than the input's or the main index's.
+    //
+    if (NULL != competingIndex) {
+        AlignerOptions competingOptions = *options;
+        competingOptions.outputFile = options->competingOutputFile;
+        competingWriterSupplier = getOutputFormat(competingOptions.outputFile)->getWriterSupplier(&competingOptions, competingIndex->getGenome());
+
+        ReaderContext competingContext = readerContext;
+        competingContext.genome = competingIndex->getGenome();
+        competingContext.headerMatchesIndex = false;
+        ReadWriter* headerWriter = competingWriterSupplier->getWriter();
+        headerWriter->writeHeader(competingContext, options->sortOutput, argc, argv, version, options->rgLineContents);
+        headerWriter->close();
+        delete headerWriter;
+    }
+    options->plannedSortMemory = plannedSortMemory;
+
+    //
+    // The reads -screen picks out are written unaligned and unsorted, as a -route output would be.
+    //
+    if (NULL != screen) {
+        AlignerOptions screenOptions = *options;
+        screenOptions.outputFile = options->screenOutputFile;
+        screenOptions.sortOutput = false;
+        screenedWriterSupplier = getOutputFormat(screenOptions.outputFile)->getWriterSupplier(&screenOptions, readerContext.genome);
+
+        ReadWriter* headerWriter = screenedWriterSupplier->getWriter();
+        headerWriter->writeHeader(readerContext, false, argc, argv, version, options->rgLineContents);
+        headerWriter->close();
+        delete headerWriter;
+    }
 }
 
     void
@@ -244,8 +669,54 @@ AlignerContext::finishIteration()
         delete writerSupplier;
         writerSupplier = NULL;
     }
+    if (NULL != competingWriterSupplier) {
+        competingWriterSupplier->close();
+        delete competingWriterSupplier;
+        competingWriterSupplier = NULL;
+    }
+    if (NULL != screenedWriterSupplier) {
+        screenedWriterSupplier->close();
+        delete screenedWriterSupplier;
+        screenedWriterSupplier = NULL;
+    }
 
     alignTime = /*timeInMillis() - alignStart -- use the time from ParallelTask.h, that may exclude memory allocation time*/ time;
+
+    if (NULL != perfReporter) {
+        perfReporter->finish(&stats->perf, alignTime);
+        delete perfReporter;
+        perfReporter = NULL;
+    }
+
+    if (NULL != options->traceFileName) {
+        TraceRecorder::write(options->traceFileName);
+    }
+
+    delete trimmer;
+    trimmer = NULL;
+    readerContext.trimmer = NULL;
+}
+
+    const FileFormat *
+AlignerContext::getOutputFormat(const SNAPFile &file)
+{
+    if (SAMFile == file.fileType) {
+        return FileFormat::SAM[options->useM];
+    } else if (BAMFile == file.fileType) {
+        return FileFormat::BAM[options->useM];
+    } else if (CRAMFile == file.fileType) {
+        return FileFormat::CRAM[options->useM];
+    } else if (FASTQFile == file.fileType) {
+        return FileFormat::FASTQ;   // Only for -route
+    }
+
+    //
+    // This shouldn't happen, because the command line parser should catch it.  Perhaps you've added a new output file format and just
+    // forgoten to add it here.
+    //
+    fprintf(stderr, "AlignerContext::beginIteration(): unknown file type %d for '%s'\n", file.fileType, file.fileName);
+    soft_exit(1);
+    return NULL;
 }
 
     bool
@@ -258,6 +729,50 @@ AlignerContext::nextIteration()
     return false;
 }
 
+    void
+AlignerContext::runCheckpointedAlignment()
+{
+    //
+    // Each piece is written under a temporary name and renamed once it's finished, so a piece's file only exists if it's
+    // complete.  A rerun of the same command finds those and starts with the first piece that isn't, throwing away whatever
+    // the killed run had written of it.
+    //
+    const char *outputFileName = options->outputFile.fileName;
+    size_t fileNameSize = strlen(outputFileName) + 64;
+    char *pieceFileName = new char[fileNameSize];
+    char *partialFileName = new char[fileNameSize];
+
+    for (unsigned piece = 0; piece < options->checkpointPieces; piece++) {
+        snprintf(pieceFileName, fileNameSize, "%s.piece%uof%u", outputFileName, piece + 1, options->checkpointPieces);
+        FILE *existingPiece = fopen(pieceFileName, "rb");
+        if (NULL != existingPiece) {
+            fclose(existingPiece);
+            fprintf(stderr, "Piece %u of %u is already in '%s', skipping it\n", piece + 1, options->checkpointPieces, pieceFileName);
+            continue;
+        }
+
+        snprintf(partialFileName, fileNameSize, "%s.partial", pieceFileName);
+        options->outputFile.fileName = partialFileName;
+        options->rangeIndex = piece;
+        options->rangeCount = options->checkpointPieces;
+
+        beginIteration();
+        runTask();
+        finishIteration();
+        printStats();
+
+        if (!MoveSingleFile(partialFileName, pieceFileName)) {
+            fprintf(stderr, "Unable to rename '%s' to '%s' after finishing it\n", partialFileName, pieceFileName);
+            soft_exit(1);
+        }
+        fprintf(stderr, "Finished piece %u of %u in '%s'\n", piece + 1, options->checkpointPieces, pieceFileName);
+    }
+
+    options->outputFile.fileName = outputFileName;
+    delete [] pieceFileName;
+    delete [] partialFileName;
+}
+
     void
 AlignerContext::printStats()
 {
@@ -296,6 +811,23 @@ AlignerContext::printStats()
 
         fprintf(perfFile,"\n");
     }
+    if (stats->lvCacheLookups > 0) {
+        fprintf(stderr, "LV cache: %lld hits in %lld lookups (%0.2f%%)\n",
+                stats->lvCacheHits, stats->lvCacheLookups, 100.0 * stats->lvCacheHits / stats->lvCacheLookups);
+    }
+    if (stats->alignmentsOverLVBudget > 0) {
+        fprintf(stderr, "%lld alignments used up their LV budget and settled for the best hit found by then\n", stats->alignmentsOverLVBudget);
+    }
+    if (stats->readsKeptFromInput > 0) {
+        fprintf(stderr, "%lld reads kept their input alignment rather than being aligned again\n", stats->readsKeptFromInput);
+    }
+    if (NULL != competingIndex) {
+        fprintf(stderr, "%lld reads aligned better to the competing index and went to its output\n", stats->readsToCompetingIndex);
+    }
+    if (NULL != screen) {
+        fprintf(stderr, "%lld reads (%0.2f%%) were screened out\n", stats->readsScreened,
+            100.0 * stats->readsScreened / max(stats->totalReads, (_int64) 1));
+    }
     // Running counts to compute a ROC curve (with error rate and %aligned above a given MAPQ)
     double totalAligned = 0;
     double totalErrors = 0;
@@ -309,12 +841,9 @@ AlignerContext::printStats()
         }
     }
 
-#if TIME_HISTOGRAM
-    fprintf(stderr, "Per-read alignment time histogram:\nlog2(ns)\tcount\ttotal time (ns)\n");
-    for (int i = 0; i < 31; i++) {
-        fprintf(stderr, "%d\t%lld\t%lld\n", i, stats->countByTimeBucket[i], stats->nanosByTimeBucket[i]);
+    if (stats->latencies != NULL) {
+        stats->latencies->print(stderr);
     }
-#endif // TIME_HISTOGRAM
 
 
     stats->printHistograms(stdout);
@@ -419,6 +948,33 @@ AlignerContext::parseOptions(
         soft_exit(1);
     }
 
+    if (options->streamFlushMillis >= 0 && options->sortOutput) {
+        fprintf(stderr,"Sorted output can't be streamed: it isn't written until all of the reads are aligned.  Drop -stream or -so.\n");
+        soft_exit(1);
+    }
+
+    if (InputOrder::Enabled && (options->sortOutput || nInputs > 1 || NULL != options->screenFasta)) {
+        fprintf(stderr,"-ordered writes the reads in the order of a single input; it doesn't go with -so, -screen or more than one input.\n");
+        soft_exit(1);
+    }
+
+    if (0 != options->checkpointPieces && (UnknownFileType == options->outputFile.fileType || options->outputFile.isStdio ||
+            options->rangeCount > 1 || 0 != options->nOutputRoutes || NULL != options->screenFasta)) {
+        fprintf(stderr,"-checkpoint needs an -o file that isn't stdout, and doesn't go with -range, -route or -screen.\n");
+        soft_exit(1);
+    }
+
+    if (NULL != options->competingIndexDir && (paired || InputOrder::Enabled || 0 != options->checkpointPieces ||
+            strcmp(options->indexDir, "-") == 0 || strcmp(options->competingIndexDir, "-") == 0)) {
+        fprintf(stderr,"-compete needs an index, is for single end reads only, and doesn't go with -ordered or -checkpoint.\n");
+        soft_exit(1);
+    }
+
+    if (options->keepMapq >= 0 && options->outputMultipleAlignments) {
+        fprintf(stderr,"-keepMapq doesn't go with -om: the reads it keeps have no secondary alignments to write.\n");
+        soft_exit(1);
+    }
+
     if (options->maxDist + options->extraSearchDepth >= MAX_K) {
         fprintf(stderr,"You specified too large of a maximum edit distance combined with extra search depth.  The must add up to less than %d.\n", MAX_K);
         fprintf(stderr,"Either reduce their sum, or change MAX_K in LandauVishkin.h and recompile.\n");
@@ -439,4 +995,95 @@ AlignerContext::parseOptions(
 
     *argsConsumed = i;
     return options;
-}
\ No newline at end of file
+}
+//
+// The cached aligners by thread number.  Each slot is only ever used by the thread with that number (and by trim, from
+// the main thread between runs), so the lock only has to cover growing the vector.
+//
+class AlignerCacheRegistry
+{
+public:
+    struct Slot {
+        Slot() : aligner(NULL), keySize(0) {}
+
+        CachedAligner* aligner;
+        size_t keySize;
+        char key[AlignerCache::MaxKeySize];
+    };
+
+    AlignerCacheRegistry()
+    {
+        InitializeExclusiveLock(&lock);
+    }
+
+    ExclusiveLock lock;
+    std::vector<Slot> slots;
+};
+
+static AlignerCacheRegistry alignerCache;
+
+    CachedAligner*
+AlignerCache::take(
+    int threadNum,
+    const void* key,
+    size_t keySize)
+{
+    _ASSERT(keySize <= MaxKeySize);
+    CachedAligner* aligner = NULL;
+    CachedAligner* stale = NULL;
+    AcquireExclusiveLock(&alignerCache.lock);
+    if (threadNum < (int) alignerCache.slots.size()) {
+        AlignerCacheRegistry::Slot* slot = &alignerCache.slots[threadNum];
+        if (slot->keySize == keySize && memcmp(slot->key, key, keySize) == 0) {
+            aligner = slot->aligner;
+        } else {
+            stale = slot->aligner;
+        }
+        slot->aligner = NULL;
+    }
+    ReleaseExclusiveLock(&alignerCache.lock);
+
+    //
+    // Free the one that doesn't match before the caller builds its replacement, so they aren't both in memory.
+    //
+    delete stale;
+    return aligner;
+}
+
+    void
+AlignerCache::give(
+    int threadNum,
+    CachedAligner* aligner,
+    const void* key,
+    size_t keySize)
+{
+    _ASSERT(keySize <= MaxKeySize && threadNum >= 0);
+    CachedAligner* replaced;
+    AcquireExclusiveLock(&alignerCache.lock);
+    if (threadNum >= (int) alignerCache.slots.size()) {
+        alignerCache.slots.resize(threadNum + 1);
+    }
+    AlignerCacheRegistry::Slot* slot = &alignerCache.slots[threadNum];
+    replaced = slot->aligner;
+    slot->aligner = aligner;
+    slot->keySize = keySize;
+    memcpy(slot->key, key, keySize);
+    ReleaseExclusiveLock(&alignerCache.lock);
+    delete replaced;
+}
+
+    void
+AlignerCache::trim(
+    int nThreads)
+{
+    std::vector<CachedAligner*> dropped;
+    AcquireExclusiveLock(&alignerCache.lock);
+    for (size_t i = __max(nThreads, 0); i < alignerCache.slots.size(); i++) {
+        dropped.push_back(alignerCache.slots[i].aligner);
+    }
+    alignerCache.slots.resize(__min((size_t) __max(nThreads, 0), alignerCache.slots.size()));
+    ReleaseExclusiveLock(&alignerCache.lock);
+    for (size_t i = 0; i < dropped.size(); i++) {
+        delete dropped[i];
+    }
+}
@@ -33,6 +33,7 @@ Revision History:
 #include "GenomeIndex.h"
 
 class AlignerExtension;
+class FileFormat;
 
 
 /*++
@@ -49,6 +50,10 @@ public:
     // running alignment
 
     void runAlignment(int argc, const char **argv, const char *version, unsigned *nArgsConsumed);
+
+    // Parse a command's options and check that its index and inputs are there, without running it.  Returns false,
+    // having written why to stderr, if they're bad.  For the daemon, which can't let a bad command exit the process.
+    bool checkCommand(int argc, const char **argv, const char *version, unsigned *nArgsConsumed);
     
     // ParallelTask template
 
@@ -68,6 +73,12 @@ public:
     
     // advance to next iteration in range, return false when past end
     bool nextIteration();
+
+    // -checkpoint: align each piece that isn't already finished, each as an iteration of its own
+    void runCheckpointedAlignment();
+
+    // the format an output file is written in
+    const FileFormat *getOutputFormat(const SNAPFile &file);
     
     // overrideable by concrete single/paired alignment subclasses
     
@@ -91,12 +102,20 @@ public:
 
     virtual bool isPaired() = 0;
 
+    // what each thread's aligners reserve, for -mem
+    virtual size_t getAlignerMemoryReservation() = 0;
+
     friend class AlignerContext2;
  
     // common state across all threads
     GenomeIndex                         *index;
     ReadWriterSupplier                  *writerSupplier;
+    GenomeIndex                         *competingIndex;            // With -compete, the second index, or NULL
+    ReadWriterSupplier                  *competingWriterSupplier;   // and where the reads that align better to it go
     ReaderContext                        readerContext;
+    ReadTrimmer                         *trimmer;   // For readerContext, with -adapter or -qtrim
+    ReadScreen                          *screen;    // For readerContext, with -screen
+    ReadWriterSupplier                  *screenedWriterSupplier;    // and where the reads it screens out go
     _int64                               alignStart;
     _int64                               alignTime;
     AlignerOptions                      *options;
@@ -114,6 +133,29 @@ public:
     const char                         **argv;
     const char                          *version;
     FILE                                *perfFile;
+    PerfReporter                        *perfReporter;
+
+    //
+    // The index loads on a thread of its own, so that the inputs can be opened and start decompressing meanwhile.
+    // Nothing can use index (or readerContext.genome) until waitForIndex has returned.
+    //
+    bool                                 loadingIndex;
+    bool                                 holdingIndexLock;  // The one that keeps other contexts from using g_index while it loads
+    bool                                 interleavingIndex;
+    _int64                               indexLoadStart;
+    SingleWaiterObject                   indexLoaded;
+
+    static void LoadIndexThreadMain(void *param);
+    void waitForIndex();
+
+    // whether any of the inputs have to have the genome to be read (SAM, BAM and CRAM map contigs by name)
+    bool inputsNeedGenome();
+
+    //
+    // With -mem, pick the number of threads and the size of the sort buffers to fit in the budget, and say what it
+    // comes to.  The index has to have loaded.
+    //
+    void planMemory();
 
 
     // iteration variables
@@ -122,6 +164,8 @@ public:
 
     // Per-thread context state used during alignment process
     ReadWriter         *readWriter;
+    ReadWriter         *competingReadWriter;
+    ReadWriter         *screenedReadWriter;
 };
 
 // abstract class for extending base context
@@ -158,3 +202,29 @@ public:
 
     virtual void finishAlignment() {}
 };
+
+//
+// The aligners each thread builds, along with the memory they're allocated from, are kept from one run to the next so
+// that chained runs and iterations don't pay to reserve, fault in and initialize them again.  A thread's run takes the
+// aligner its thread number had last time if it was built with the same parameters (the key, which is compared byte by
+// byte, so it has to be plain data with its padding zeroed), and gives it back when it's done.  They're all dropped
+// when the index changes.
+//
+struct CachedAligner
+{
+    virtual ~CachedAligner() {}
+};
+
+class AlignerCache
+{
+public:
+    static const size_t MaxKeySize = 128;
+
+    // NULL if there isn't a matching one, in which case any other one the thread had is freed
+    static CachedAligner* take(int threadNum, const void* key, size_t keySize);
+
+    static void give(int threadNum, CachedAligner* aligner, const void* key, size_t keySize);
+
+    // free the aligners of threads numbered nThreads and up
+    static void trim(int nThreads);
+};
@@ -26,8 +26,15 @@ Revision History:
 #include "options.h"
 #include "AlignerOptions.h"
 #include "FASTQ.h"
+#include "PackedReads.h"
 #include "SAM.h"
 #include "Bam.h"
+#include "DataWriter.h"
+#include "Libdeflate.h"
+#include "LongReadAligner.h"
+#include "SecondaryAlignments.h"
+#include "ReadScreen.h"
+#include "InputOrder.h"
 #include "exit.h"
 
 
@@ -46,8 +53,17 @@ AlignerOptions::AlignerOptions(
     sortOutput(false),
     noIndex(false),
     noDuplicateMarking(false),
+    opticalDuplicateDistance(DataWriterSupplier::DefaultOpticalDuplicateDistance),
     noQualityCalibration(false),
+    computeCoverage(false),
     sortMemory(0),
+    sortKeepMemory(0),
+    sortSpillDirectories(NULL),
+    compressSortSpills(false),
+    minCompressionLevel(DataWriterSupplier::DefaultCompressionLevel),
+    maxCompressionLevel(DataWriterSupplier::DefaultCompressionLevel),
+    memoryBudget(0),
+    plannedSortMemory(0),
     filterFlags(0),
     explorePopularSeeds(false),
     stopOnFirstHit(false),
@@ -57,15 +73,46 @@ AlignerOptions::AlignerOptions(
 	extra(NULL),
     rgLineContents(NULL),
     perfFileName(NULL),
+    perfCounterFileName(NULL),
+    perfCounterInterval(60),
+    statusFileName(NULL),
+    traceFileName(NULL),
+    slowReadsToReport(-1),
+    streamFlushMillis(-1),
+    seedOrder(false),
     useTimingBarrier(false),
     extraSearchDepth(2),
+    mapqToStopAt(0),
+    exactMatchMapq(0),
+    realignRadius(0),
+    keepMapq(-1),
+    orderSeedsByHits(false),
+    lvBudget(0),
+    longReadLength(LongReadAligner::DefaultMinReadLength),
+    maxIntronLength(0),
+    competingIndexDir(NULL),
+    adapters(NULL),
+    qualityTrimThreshold(0),
+    screenFasta(NULL),
     defaultReadGroup("FASTQ"),
     seedCountSpecified(false),
     numSeedsFromCommandLine(0),
     ignoreSecondaryAlignments(true),
     outputMultipleAlignments(false),
+    secondaryScoreDelta(0),
+    maxSecondaryAlignments(SecondaryAlignments::DefaultMaxSecondaryAlignments),
     preserveClipping(false),
-    expansionFactor(1.0)
+    mapIndex(false),
+    prefetchIndex(false),
+    lazyIndex(false),
+    packGenome(false),
+    interleaveIndex(false),
+    asyncInput(false),
+    expansionFactor(1.0),
+    rangeIndex(0),
+    rangeCount(1),
+    checkpointPieces(0),
+    nOutputRoutes(0)
 {
     if (forPairedEnd) {
         maxDist                 = 15;
@@ -109,11 +156,35 @@ AlignerOptions::usageMessage()
         "       with small caches or lots of cores/cache\n"
         "  -so  sort output file by alignment location\n"
         "  -sm  memory to use for sorting in Gb\n"
+        "  -sk  keep up to this many Gb of sorted output in memory for the final merge, rather than writing it to the\n"
+        "       temporary file and reading it back; the rest still goes through the file (default 0)\n"
+        "  -sd  comma separated directories (e.g., one on each disk) to write the sorted runs to in turn, rather than\n"
+        "       the temporary file next to the output\n"
+        "  -sz  compress the sorted runs that aren't kept in memory (with a fast zlib level), so there's less to write\n"
+        "       and read back for the merge\n"
+        "  -cl  compression level for BAM output, from 1 (fastest) to 9 (smallest); default 6.  Given a range like 2-8,\n"
+        "       each BGZF block is compressed at the top of it while the compression keeps up with the aligner threads, and\n"
+        "       lower the more output is waiting for it, so the output is as small as it can be without slowing alignment\n"
+        "  -mem  Fit in this many Gb (or, with no number, in the machine's memory or the container's limit, whichever is\n"
+        "       less) by working out what the index, the aligner threads, the read buffers and the sort buffers need, and\n"
+        "       then using as many threads as fit, shrinking the sort buffers (unless -sm sets them) before dropping threads.\n"
+        "       The plan is printed at startup\n"
         "  -x   explore some hits of overly popular seeds (useful for filtering)\n"
         "  -f   stop on first match within edit distance limit (filtering mode)\n"
         "  -F   filter output (a=aligned only, s=single hit only, u=unaligned only)\n"
+        "  -route  Also write the reads picked out by the filter after it to the output after that, in the same pass (up\n"
+        "       to %d times).  The filter is a comma separated list of a, s and u (as for -F) and regions like chr1 or\n"
+        "       chr1:1000-2000; pairs go if either read passes.  Outputs are SAM, BAM or CRAM as for -o, or FASTQ for a .fq\n"
+        "       or .fastq name, and aren't sorted.  For example, -route u unmapped.fq -route chr7:55000000-55300000 egfr.bam\n"
+        "       Read groups like rg:lane1 in the filter pick only those groups' reads, which splits a multiplexed run's\n"
+        "       output as it's written: -route rg:A a.bam -route rg:B b.bam.  With -so, outputs that pick read groups are\n"
+        "       sorted (with their own temporary files and share of -sm) as the -o output is\n"
         "  -S   suppress additional processing (sorted BAM output only)\n"
-        "       i=index, d=duplicate marking\n"
+        "       i=index, d=duplicate marking, q=base quality recalibration tables (written to <output>.recal.txt)\n"
+        "  -coverage  with sorted BAM output, also write the depth along each contig to <output>.bedgraph and depth,\n"
+        "       alignment and insert size metrics to <output>.metrics.txt as the output is written\n"
+        "  -od  count duplicates within this many pixels of another on the same flowcell tile as optical; 0 doesn't\n"
+        "       count them (default %d, and 2500 suits patterned flowcells)\n"
 #if     USE_DEVTEAM_OPTIONS
         "  -I   ignore IDs that don't match in the paired-end aligner\n"
         "  -E   misalign threshold (min distance from correct location to count as error)\n"
@@ -125,20 +196,128 @@ AlignerOptions::usageMessage()
         "       bases from front and back of read respectively; default: back only (-C-+)\n"
 		"  -M   indicates that CIGAR strings in the generated SAM file should use M (alignment\n"
 		"       match) rather than = and X (sequence (mis-)match)\n"
-        "  -G   specify a gap penalty to use when generating CIGAR strings\n"
+        "  -G   specify a gap penalty to use when generating CIGAR strings.  With it the CIGAR comes from an affine gap\n"
+        "       alignment where a mismatch costs 1 and an indel of n bases costs the gap penalty plus n-1, so long indels\n"
+        "       aren't broken up into lots of little ones (without it every edit costs 1)\n"
         "  -pf  specify the name of a file to contain the run speed\n"
+        "  -perf filename  append JSON lines to filename breaking down where the aligner threads' time goes (seed lookup,\n"
+        "       LV scoring, CIGAR generation, output formatting and waiting on the input and output queues) along with\n"
+        "       hash table probes and LV cache hits: one every -perfInterval seconds during the run and one at the end\n"
+        "  -perfInterval  seconds between the progress lines in the -perf and -status files, or 0 for just the final one\n"
+        "       (default 60).  The lines also have reads aligned per second, read queue depth, work pool backlog, I/O\n"
+        "       bytes and rates, and memory use\n"
+        "  -status filename  keep the latest -perf line (and nothing else) in filename while the run goes, replacing it\n"
+        "       whole each time, for schedulers and monitors to poll\n"
+        "  -trace filename  write a timeline of what each thread was doing (reading and parsing input, decompressing,\n"
+        "       aligning, compressing, writing and waiting on the queues between them) to filename in the Chrome trace\n"
+        "       format, for chrome://tracing or ui.perfetto.dev to show where the pipeline stalls.  Each thread keeps its\n"
+        "       most recent events, so long runs lose their beginnings\n"
+        "  -latency n  time each read's (or pair's) alignment, and print a histogram of the times along with the IDs of the\n"
+        "       n slowest at the end\n"
+        "  -stream ms  for pipelines, e.g. behind a basecaller: align reads from stdin as they arrive rather than waiting\n"
+        "       to fill big buffers, and write out what's been aligned whenever the input runs dry, or at least every ms\n"
+        "       milliseconds when it doesn't (-so doesn't go with it)\n"
+        "  -ordered  write the reads out in the order they came in, however many threads are aligning them, e.g. to line\n"
+        "       them up with another file.  Needs a single input (or pair of FASTQ files), and doesn't go with -so\n"
+        "  -seedOrder  align each batch of reads in the order of where their first seeds are in the index's hash tables,\n"
+        "       not the order they came in, so that lookups close together in time hit nearby memory.  The output order\n"
+        "       follows it too.  It has no effect with -ordered\n"
         "  --hp Indicates not to use huge pages (this may speed up index load and slow down alignment)\n"
+        "  -hugetlb 2M|1G  Take big allocations (like the index) from the kernel's explicit pool of 2MB or 1GB huge pages rather\n"
+        "       than relying on transparent huge pages.  The pool has to be set up first; SNAP falls back if it runs out.\n"
+        "  -map Memory map the index files rather than reading them, so concurrent SNAP runs share one copy\n"
+        "  -pre With -map, prefetch the whole index at load time rather than faulting it in during alignment\n"
+        "  -lazy Map the index (as -map) and fault in only the parts the reads touch, starting the page reads for the first\n"
+        "       seed lookups ahead of time so that they overlap.  For small jobs, like targeted panels, which then needn't wait\n"
+        "       to read the whole index.  Not with -pre\n"
+        "  -packGenome Keep the genome in memory at two bits per base, which takes about a quarter of the space at some cost in\n"
+        "       speed.  The genome isn't shared with -map in this case, though the rest of the index still is.\n"
+        "  -numa Interleave the index's memory across the machine's NUMA nodes, so that threads on every node see the same\n"
+        "       (average) latency to it rather than most of them going to a remote node.  With -map this only covers what's\n"
+        "       read in at load time, so use it with -pre.\n"
+        "  -place Put the parts of the index in different kinds of memory, as a comma separated list of part=tier, where the\n"
+        "       parts are hash, overflow and genome and the tiers are memory (the default), map (memory map it, as -map\n"
+        "       does) and node:N (NUMA node N, which can be a CXL memory expander).  For example, -place overflow=node:2,genome=map\n"
+        "       keeps the hash tables, which every seed lookup uses, in local memory.  Not with -map, and the index has to\n"
+        "       have been built by a version of SNAP that saves it in sections\n"
+        "  -libdeflate Use libdeflate (if it can be loaded) rather than zlib to decompress BAM and bgzipped input and to\n"
+        "       compress BAM and gzip output, which is faster.  Plain gzip input still uses zlib\n"
+#if defined(__linux__) || defined(__APPLE__)
+        "  -aio Read input files with many asynchronous reads in flight rather than memory mapping them, which can keep\n"
+        "       fast storage (e.g., NVMe arrays) busier\n"
+#endif
+#ifdef __linux__
+        "  -streamOutput Write output back to disk as it's written and drop it from the page cache, so that a large output\n"
+        "       file neither stalls in writeback nor pushes the index out of memory\n"
+#endif
         "  -D   Specifies the extra search depth (the edit distance beyond the best hit that SNAP uses to compute MAPQ).  Default 2\n"
+        "  -mq  Stop searching a read once its best hit has at least this MAPQ and nothing that's still unseen could bring\n"
+        "       it below that, rather than always searching -D beyond the best hit.  Saves work on high quality reads at\n"
+        "       the cost of less exact MAPQs above the threshold.  Off (0) by default\n"
+        "  -ex  Fast path for single end reads that match the genome exactly in one place: three seeds that each hit just\n"
+        "       there and a compare with the genome, with no other search.  They get the MAPQ after -ex (default %d)\n"
+        "  -orderSeeds  For single end reads: look up all of the seeds of the first pass over the read at once and use them\n"
+        "       fewest hits first, so that the search can stop sooner.  Results can differ a little from the default order\n"
+        "  -lvBudget  The most candidate locations to score (LV calls) for a read, or twice that for a pair.  A read that\n"
+        "       runs out, which happens to a few highly repetitive ones, gets the best hit found so far with a third of its\n"
+        "       MAPQ.  Off (0) by default\n"
+        "  -near  For realigning SAM or BAM (best sorted by coordinate, so that each thread's reads are close together):\n"
+        "       first search for single end reads within this many bases of where they were aligned, in the same direction,\n"
+        "       and search the whole genome only for the ones that don't get a confident hit there.  MAPQs are at most the\n"
+        "       input's, and reads with input MAPQs below %d always get the whole genome search.  Not with -om\n"
+        "  -keepMapq  For rescuing reads from SAM or BAM: write reads (or pairs, if both ends qualify) that the input has\n"
+        "       aligned with at least this MAPQ as they were, and only align the unaligned and low MAPQ ones.  Not with -om\n"
+        "  -lr  Align single end reads at least this long with the long read aligner, which chains seed hits from all along\n"
+        "       the read rather than scoring candidates with LV, for nanopore and PacBio reads.  Reads longer than 500 bases\n"
+        "       need SNAP built with LONG_READS defined (see Read.h).  0 turns it off.  Default 1000\n"
+        "  -splice  For RNA-seq: also try aligning single end reads that don't align cleanly as spanning an intron up to this\n"
+        "       long, writing the intron as an N in the CIGAR string and the strand its motif implies as XS:A.  Off by default\n"
+        "  -compete  For xenografts and other mixed samples: also align single end reads to the index in this directory, in\n"
+        "       the same pass, and write the ones that align strictly better to it (by edit distance) to the output after it\n"
+        "       instead, against its reference.  Ties and reads that align to neither stay in the -o output.  For example,\n"
+        "       snap single human.idx reads.fq -o human.bam -compete mouse.idx mouse.bam.  Not with -ordered or -checkpoint\n"
+        "  -adapter  Trim any of these (comma separated) adapter sequences, or the start of one at the end of a read, off\n"
+        "       FASTQ reads as they're read in, allowing one mismatch per 10 bases.  The trimmed bases are dropped, not clipped\n"
+        "  -qtrim  Trim the low quality tails of FASTQ reads as they're read in, BWA style, to this Phred quality\n"
+        "  -screen  Screen out the FASTQ reads that share at least %d %d-mers with the sequences in this FASTA file (phiX,\n"
+        "       rRNA or other contaminants, up to %lld bases) as they're read in, and write them to the output after it,\n"
+        "       unaligned, rather than aligning them.  Pairs are screened out if either read is.  The output is SAM, BAM or\n"
+        "       CRAM as for -o, or FASTQ for a .fq or .fastq name.  For example, -screen phix.fa phix.fq\n"
+        "  -qbin  Bin base qualities as they're written, which makes BAM output a good deal smaller: 'illumina' for\n"
+        "       Illumina's eight levels, or max:value,... with increasing maxes, writing each quality up to a max as its value\n"
+        "  -dropTags  Don't write these (comma separated) optional fields, whether they're from the input or SNAP's own\n"
+        "       (RG, PG, NM, XS and SA), e.g. -dropTags PG,OQ\n"
         "  -rg  Specify the default read group if it is not specified in the input file\n"
-        "  -sa  Include reads from SAM or BAM files with the secondary alignment (0x100) flag set; default is to drop them.\n"
-        "  -om  Output multiple equivalent alignment locations if they exist\n"
+        "  -sa  Include reads from SAM or BAM files with the secondary (0x100) or supplementary (0x800) alignment flag set;\n"
+        "       default is to drop them.\n"
+        "  -om  Output multiple equivalent alignment locations if they exist.  A number after it also writes the ones with up\n"
+        "       to that many more edits than the best\n"
+        "  -omax  The most secondary alignments to write for each read or pair with -om (at most %d).  Default %d\n"
         "  -pc  Preserve the soft clipping for reads coming from SAM or BAM files\n"
         "  -xf  Increase expansion factor for BAM and GZ files (default %.1f)\n"
+        "  -range i/N  Align only the i'th (1 to N) of N roughly equal pieces of the input, so that N machines can each\n"
+        "       take a piece of the same files.  Uncompressed FASTQ and SAM inputs that SNAP can split by position are\n"
+        "       split by bytes, so each run only reads its own piece; anything else (compressed, BAM, stdin, read pairs\n"
+        "       in files of different sizes) is read in full and split by read name.  Use -so on each piece and then\n"
+        "       'snap merge' to combine them.\n"
+        "  -checkpoint N  Align the input as N pieces in turn (split like -range), writing each to the -o file name with\n"
+        "       .pieceIofN on the end once it's finished.  Running the same command again skips the pieces that are already\n"
+        "       there, so a run that was killed (say on a preempted machine) only redoes the piece it was on.  Use -so and\n"
+        "       'snap merge' to combine the pieces, or just concatenate them for unsorted SAM.\n"
             ,
             commandLine,
             maxDist,
             seedCoverage,
             maxHits,
+            MaxOutputRoutes,
+            opticalDuplicateDistance,
+            DEFAULT_EXACT_MATCH_MAPQ,
+            MAPQ_LIMIT_FOR_SINGLE_HIT,
+            ReadScreen::MinKmerHits,
+            ReadScreen::KmerLength,
+            ReadScreen::MaxKmers,
+            SecondaryAlignments::MaxSecondaryAlignments,
+            SecondaryAlignments::DefaultMaxSecondaryAlignments,
             expansionFactor);
 
     if (extra != NULL) {
@@ -158,13 +337,16 @@ AlignerOptions::usageMessage()
                 "you think each run will have completed).\n\n");
 
     fprintf(stderr, "When specifying an input or output file, you can simply list the filename, in which case\n");
-    fprintf(stderr, "SNAP will infer the type of the file from the file extension (.sam or .bam for example),\n");
+    fprintf(stderr, "SNAP will infer the type of the file from the file extension (.sam, .bam or .cram for example),\n");
     fprintf(stderr, "or you can explicitly specify the file type by preceeding the filename with one of the\n");
     fprintf(stderr," following type specifiers (which are case sensitive):\n");
     fprintf(stderr,"    -fastq\n");
     fprintf(stderr,"    -compressedFastq\n");
+    fprintf(stderr,"    -packedReads (made from FASTQ by snap pack; inferred from .snapreads)\n");
+    fprintf(stderr,"    -compressedPackedReads (inferred from .snapreads.gz)\n");
     fprintf(stderr,"    -sam\n");
     fprintf(stderr,"    -bam\n");
+    fprintf(stderr,"    -cram (against the index's genome, which must be the one the file was written with)\n");
     fprintf(stderr,"    -pairedFastq\n");
     fprintf(stderr,"    -pairedCompressedFastq\n");
     fprintf(stderr,"    -pairedInterleavedFastq\n");
@@ -276,12 +458,60 @@ AlignerOptions::parse(
             }
             return true;
         }
+    } else if (strcmp(argv[n], "-coverage") == 0) {
+        computeCoverage = true;
+        return true;
+    } else if (strcmp(argv[n], "-od") == 0) {
+        if (n + 1 < argc && argv[n+1][0] >= '0' && argv[n+1][0] <= '9') {
+            opticalDuplicateDistance = atoi(argv[n+1]);
+            n++;
+            return true;
+        }
     } else if (strcmp(argv[n], "-sm") == 0) {
         if (n + 1 < argc && argv[n+1][0] >= '0' && argv[n+1][0] <= '9') {
             sortMemory = atoi(argv[n+1]);
             n++;
             return true;
         }
+    } else if (strcmp(argv[n], "-sk") == 0) {
+        if (n + 1 < argc && argv[n+1][0] >= '0' && argv[n+1][0] <= '9') {
+            sortKeepMemory = atoi(argv[n+1]);
+            n++;
+            return true;
+        }
+    } else if (strcmp(argv[n], "-mem") == 0) {
+        memoryBudget = -1;
+        if (n + 1 < argc && argv[n+1][0] >= '0' && argv[n+1][0] <= '9') {
+            if (atoi(argv[n+1]) > 0) {
+                memoryBudget = (_int64) atoi(argv[n+1]) * (1LL << 30);
+            }
+            n++;
+        }
+        return true;
+    } else if (strcmp(argv[n], "-sd") == 0) {
+        if (n + 1 < argc) {
+            sortSpillDirectories = argv[n+1];
+            n++;
+            return true;
+        }
+    } else if (strcmp(argv[n], "-sz") == 0) {
+        compressSortSpills = true;
+        return true;
+    } else if (strcmp(argv[n], "-cl") == 0) {
+        if (n + 1 < argc) {
+            int low, high;
+            int nRead = sscanf(argv[n+1], "%d-%d", &low, &high);
+            if (nRead == 1) {
+                high = low;
+            }
+            if (nRead >= 1 && low >= 1 && low <= high && high <= 9) {
+                minCompressionLevel = low;
+                maxCompressionLevel = high;
+                n++;
+                return true;
+            }
+        }
+        fprintf(stderr,"Must specify a compression level from 1 to 9, or a range of them like 1-9, after -cl\n");
     } else if (strcmp(argv[n], "-F") == 0) {
         if (n + 1 < argc) {
             n++;
@@ -296,6 +526,30 @@ AlignerOptions::parse(
             }
             return true;
         }
+    } else if (strcmp(argv[n], "-route") == 0) {
+        if (nOutputRoutes == MaxOutputRoutes) {
+            fprintf(stderr,"At most %d -route outputs are allowed\n", MaxOutputRoutes);
+            soft_exit(1);
+        }
+        if (n + 2 < argc) {
+            OutputRoute *route = &outputRoutes[nOutputRoutes];
+            route->filter = argv[n+1];
+            int argsConsumed;
+            if (util::stringEndsWith(argv[n+2], ".fq") || util::stringEndsWith(argv[n+2], ".fastq")) {
+                route->file.fileName = argv[n+2];
+                route->file.fileType = FASTQFile;
+                route->file.isCompressed = false;
+                argsConsumed = 1;
+            } else if (!SNAPFile::generateFromCommandLine(argv + n + 2, argc - n - 2, &argsConsumed, &route->file, false, false)) {
+                fprintf(stderr,"Must have a file specifier after the filter for -route\n");
+                soft_exit(1);
+            }
+            nOutputRoutes++;
+            n += 1 + argsConsumed;
+            return true;
+        } else {
+            fprintf(stderr,"Must specify a filter and an output after -route\n");
+        }
     } else if (strcmp(argv[n], "-x") == 0) {
         explorePopularSeeds = true;
         return true;
@@ -326,7 +580,19 @@ AlignerOptions::parse(
 		return true;
 	} else if (strcmp(argv[n], "-om") == 0) {
 		outputMultipleAlignments = true;
+        if (n + 1 < argc && argv[n+1][0] >= '0' && argv[n+1][0] <= '9') {
+            secondaryScoreDelta = atoi(argv[n+1]);
+            n++;
+        }
 		return true;
+    } else if (strcmp(argv[n], "-omax") == 0) {
+        if (n + 1 < argc && argv[n+1][0] >= '0' && argv[n+1][0] <= '9') {
+            maxSecondaryAlignments = atoi(argv[n+1]);
+            n++;
+            return true;
+        } else {
+            fprintf(stderr,"Must specify the number of secondary alignments after -omax\n");
+        }
 	} else if (strcmp(argv[n], "-xf") == 0) {
         if (n + 1 < argc) {
             n++;
@@ -374,6 +640,60 @@ AlignerOptions::parse(
         } else {
             fprintf(stderr,"Must specify the name of the perf file after -pf\n");
         }
+	} else if (strcmp(argv[n], "-perf") == 0) {
+        if (n + 1 < argc) {
+            perfCounterFileName = argv[n+1];
+            n++;
+            return true;
+        } else {
+            fprintf(stderr,"Must specify the name of the perf counter file after -perf\n");
+        }
+	} else if (strcmp(argv[n], "-perfInterval") == 0) {
+        if (n + 1 < argc && atoi(argv[n+1]) >= 0) {
+            perfCounterInterval = atoi(argv[n+1]);
+            n++;
+            return true;
+        } else {
+            fprintf(stderr,"Must specify a number of seconds (0 or more) after -perfInterval\n");
+        }
+	} else if (strcmp(argv[n], "-status") == 0) {
+        if (n + 1 < argc) {
+            statusFileName = argv[n+1];
+            n++;
+            return true;
+        } else {
+            fprintf(stderr,"Must specify the name of the status file after -status\n");
+        }
+	} else if (strcmp(argv[n], "-trace") == 0) {
+        if (n + 1 < argc) {
+            traceFileName = argv[n+1];
+            n++;
+            return true;
+        } else {
+            fprintf(stderr,"Must specify the name of the trace file after -trace\n");
+        }
+	} else if (strcmp(argv[n], "-latency") == 0) {
+        if (n + 1 < argc && atoi(argv[n+1]) >= 0) {
+            slowReadsToReport = atoi(argv[n+1]);
+            n++;
+            return true;
+        } else {
+            fprintf(stderr,"Must specify a number of reads (0 or more) after -latency\n");
+        }
+	} else if (strcmp(argv[n], "-stream") == 0) {
+        if (n + 1 < argc && atoi(argv[n+1]) >= 0) {
+            streamFlushMillis = atoi(argv[n+1]);
+            n++;
+            return true;
+        } else {
+            fprintf(stderr,"Must specify a number of milliseconds (0 or more) after -stream\n");
+        }
+	} else if (strcmp(argv[n], "-ordered") == 0) {
+        InputOrder::Enabled = true;
+        return true;
+    } else if (strcmp(argv[n], "-seedOrder") == 0) {
+        seedOrder = true;
+        return true;
 	} else if (strcmp(argv[n], "-rg") == 0) {
         if (n + 1 < argc) {
             defaultReadGroup = argv[n+1];
@@ -388,6 +708,109 @@ AlignerOptions::parse(
     } else if (strcmp(argv[n], "--hp") == 0) {
         BigAllocUseHugePages = false;
         return true;
+    } else if (strcmp(argv[n], "-hugetlb") == 0) {
+        if (n + 1 < argc) {
+            if (!_stricmp(argv[n+1], "2M")) {
+                BigAllocExplicitHugePageShift = 21;
+            } else if (!_stricmp(argv[n+1], "1G")) {
+                BigAllocExplicitHugePageShift = 30;
+            } else {
+                fprintf(stderr,"-hugetlb must be followed by 2M or 1G\n");
+                return false;
+            }
+            n++;
+            return true;
+        } else {
+            fprintf(stderr,"Must specify the huge page size (2M or 1G) after -hugetlb\n");
+        }
+    } else if (strcmp(argv[n], "-map") == 0) {
+        mapIndex = true;
+        return true;
+    } else if (strcmp(argv[n], "-pre") == 0) {
+        prefetchIndex = true;
+        return true;
+    } else if (strcmp(argv[n], "-lazy") == 0) {
+        mapIndex = true;
+        lazyIndex = true;
+        return true;
+    } else if (strcmp(argv[n], "-packGenome") == 0) {
+        packGenome = true;
+        return true;
+    } else if (strcmp(argv[n], "-numa") == 0) {
+        interleaveIndex = true;
+        return true;
+    } else if (strcmp(argv[n], "-place") == 0) {
+        if (n + 1 < argc && indexPlacement.parse(argv[n+1])) {
+            n++;
+            return true;
+        }
+        if (n + 1 >= argc) {
+            fprintf(stderr,"Must specify the index placement after -place\n");
+        }
+    } else if (strcmp(argv[n], "-range") == 0) {
+        unsigned index, count;
+        char extra;
+        if (n + 1 < argc && 2 == sscanf(argv[n+1], "%u/%u%c", &index, &count, &extra) && count > 0 && index > 0 && index <= count) {
+            rangeIndex = index - 1;
+            rangeCount = count;
+            n++;
+            return true;
+        } else {
+            fprintf(stderr,"Must specify the piece of the input as i/N (1 <= i <= N) after -range\n");
+        }
+    } else if (strcmp(argv[n], "-checkpoint") == 0) {
+        if (n + 1 < argc && atoi(argv[n+1]) > 0) {
+            checkpointPieces = atoi(argv[n+1]);
+            n++;
+            return true;
+        } else {
+            fprintf(stderr,"Must specify the number of pieces after -checkpoint\n");
+        }
+    } else if (strcmp(argv[n], "-qbin") == 0) {
+        if (n + 1 < argc && SAMFormat::SetQualityBins(argv[n+1])) {
+            n++;
+            return true;
+        } else {
+            fprintf(stderr,"Must specify 'illumina' or the bins as max:value,... after -qbin\n");
+        }
+    } else if (strcmp(argv[n], "-dropTags") == 0) {
+        if (n + 1 < argc) {
+            //
+            // Run the tags together, skipping the commas.
+            //
+            const char *tags = argv[n+1];
+            char *droppedTags = new char[strlen(tags) + 1];
+            char *next = droppedTags;
+            for (const char *tag = tags; '\0' != *tag; tag++) {
+                if (',' != *tag) {
+                    *next++ = *tag;
+                }
+            }
+            *next = '\0';
+            if (0 == (next - droppedTags) % 2) {
+                SAMFormat::DroppedTags = droppedTags;
+                n++;
+                return true;
+            }
+            delete [] droppedTags;
+        }
+        fprintf(stderr,"Must specify the comma separated two character tags after -dropTags\n");
+    } else if (strcmp(argv[n], "-libdeflate") == 0) {
+        if (!Libdeflate::load()) {
+            fprintf(stderr,"Unable to load libdeflate for -libdeflate\n");
+            return false;
+        }
+        return true;
+#if defined(__linux__) || defined(__APPLE__)
+    } else if (strcmp(argv[n], "-aio") == 0) {
+        asyncInput = true;
+        return true;
+#endif
+#ifdef __linux__
+    } else if (strcmp(argv[n], "-streamOutput") == 0) {
+        AsyncFile::StreamWrites = true;
+        return true;
+#endif
 	} else if (strcmp(argv[n], "-D") == 0) {
         if (n + 1 < argc) {
             extraSearchDepth = atoi(argv[n+1]);
@@ -396,6 +819,107 @@ AlignerOptions::parse(
         } else {
             fprintf(stderr,"Must specify the desired extra search depth after -D\n");
         }
+    } else if (strcmp(argv[n], "-near") == 0) {
+        if (n + 1 < argc && argv[n+1][0] >= '0' && argv[n+1][0] <= '9') {
+            realignRadius = atoi(argv[n+1]);
+            n++;
+            return true;
+        } else {
+            fprintf(stderr,"Must specify the search radius after -near\n");
+        }
+    } else if (strcmp(argv[n], "-keepMapq") == 0) {
+        if (n + 1 < argc && argv[n+1][0] >= '0' && argv[n+1][0] <= '9') {
+            keepMapq = atoi(argv[n+1]);
+            n++;
+            return true;
+        } else {
+            fprintf(stderr,"Must specify the MAPQ after -keepMapq\n");
+        }
+    } else if (strcmp(argv[n], "-lr") == 0) {
+        if (n + 1 < argc && argv[n+1][0] >= '0' && argv[n+1][0] <= '9') {
+            longReadLength = atoi(argv[n+1]);
+            n++;
+            return true;
+        } else {
+            fprintf(stderr,"Must specify the read length after -lr\n");
+        }
+    } else if (strcmp(argv[n], "-splice") == 0) {
+        if (n + 1 < argc && argv[n+1][0] >= '0' && argv[n+1][0] <= '9') {
+            maxIntronLength = atoi(argv[n+1]);
+            n++;
+            return true;
+        } else {
+            fprintf(stderr,"Must specify the longest intron after -splice\n");
+        }
+    } else if (strcmp(argv[n], "-compete") == 0) {
+        int argsConsumed;
+        if (n + 2 < argc && SNAPFile::generateFromCommandLine(argv + n + 2, argc - n - 2, &argsConsumed, &competingOutputFile, false, false)) {
+            competingIndexDir = argv[n+1];
+            n += 1 + argsConsumed;
+            return true;
+        } else {
+            fprintf(stderr,"Must specify an index directory and an output after -compete\n");
+        }
+    } else if (strcmp(argv[n], "-adapter") == 0) {
+        if (n + 1 < argc) {
+            adapters = argv[n+1];
+            n++;
+            return true;
+        } else {
+            fprintf(stderr,"Must specify the adapter sequences after -adapter\n");
+        }
+    } else if (strcmp(argv[n], "-qtrim") == 0) {
+        if (n + 1 < argc && argv[n+1][0] >= '0' && argv[n+1][0] <= '9') {
+            qualityTrimThreshold = atoi(argv[n+1]);
+            n++;
+            return true;
+        } else {
+            fprintf(stderr,"Must specify the quality to trim to after -qtrim\n");
+        }
+    } else if (strcmp(argv[n], "-screen") == 0) {
+        if (n + 2 < argc) {
+            screenFasta = argv[n+1];
+            int argsConsumed;
+            if (util::stringEndsWith(argv[n+2], ".fq") || util::stringEndsWith(argv[n+2], ".fastq")) {
+                screenOutputFile.fileName = argv[n+2];
+                screenOutputFile.fileType = FASTQFile;
+                screenOutputFile.isCompressed = false;
+                argsConsumed = 1;
+            } else if (!SNAPFile::generateFromCommandLine(argv + n + 2, argc - n - 2, &argsConsumed, &screenOutputFile, false, false)) {
+                fprintf(stderr,"Must have a file specifier after the FASTA file for -screen\n");
+                soft_exit(1);
+            }
+            n += 1 + argsConsumed;
+            return true;
+        } else {
+            fprintf(stderr,"Must specify a FASTA file and an output after -screen\n");
+        }
+    } else if (strcmp(argv[n], "-mq") == 0) {
+        if (n + 1 < argc && argv[n+1][0] >= '0' && argv[n+1][0] <= '9') {
+            mapqToStopAt = atoi(argv[n+1]);
+            n++;
+            return true;
+        } else {
+            fprintf(stderr,"Must specify the MAPQ to stop at after -mq\n");
+        }
+    } else if (strcmp(argv[n], "-orderSeeds") == 0) {
+        orderSeedsByHits = true;
+        return true;
+    } else if (strcmp(argv[n], "-lvBudget") == 0) {
+        if (n + 1 < argc && argv[n+1][0] >= '0' && argv[n+1][0] <= '9') {
+            lvBudget = atoi(argv[n+1]);
+            n++;
+            return true;
+        } else {
+            fprintf(stderr,"Must specify the number of LV calls after -lvBudget\n");
+        }
+    } else if (strcmp(argv[n], "-ex") == 0) {
+        exactMatchMapq = DEFAULT_EXACT_MATCH_MAPQ;
+        if (n + 1 < argc && argv[n+1][0] >= '0' && argv[n+1][0] <= '9') {
+            exactMatchMapq = atoi(argv[n+1]);
+            n++;
+        }
+        return true;
     } else if (strlen(argv[n]) >= 2 && '-' == argv[n][0] && 'C' == argv[n][1]) {
         if (strlen(argv[n]) != 4 || '-' != argv[n][2] && '+' != argv[n][2] ||
             '-' != argv[n][3] && '+' != argv[n][3]) {
@@ -435,7 +959,7 @@ AlignerOptions::passFilter(
     Read* read,
     AlignmentResult result)
 {
-    if (filterFlags == 0) {
+    if (filterFlags == 0 || nOutputRoutes > 0) {
         return true;
     }
     switch (result) {
@@ -451,6 +975,31 @@ AlignerOptions::passFilter(
     }
 }
 
+    bool
+AlignerOptions::keepsInputAlignment(
+    Read* read) const
+{
+    //
+    // FASTQ reads have no location, and 255 is SAM for no MAPQ.
+    //
+    unsigned originalMAPQ = read->getOriginalMAPQ();
+    return keepMapq >= 0 && InvalidGenomeLocation != read->getOriginalAlignedLocation() && originalMAPQ >= (unsigned)keepMapq &&
+        originalMAPQ < 255;
+}
+
+    Direction
+AlignerOptions::inputDirection(
+    Read* read)
+{
+    return (read->getOriginalSAMFlags() & SAM_REVERSE_COMPLEMENT) ? RC : FORWARD;
+}
+
+    size_t
+AlignerOptions::getSortMemory() const
+{
+    return 0 != plannedSortMemory ? plannedSortMemory : sortMemory * (1ULL << 30);
+}
+
     void
 SNAPFile::readHeader(ReaderContext& context)
 {
@@ -461,12 +1010,18 @@ SNAPFile::readHeader(ReaderContext& context)
     case BAMFile:
         return BAMReader::readHeader(fileName, context);
 
+    case CRAMFile:
+        return BAMReader::readHeader(fileName, context, DataSupplier::CramSupplier(context.genome, false));
+
     case FASTQFile:
         return FASTQReader::readHeader(fileName,  context);
         
     case InterleavedFASTQFile:
         return PairedInterleavedFASTQReader::readHeader(fileName,  context);
 
+    case PackedReadsFile:
+        return PackedReadReader::readHeader(fileName, context);
+
     default:
         _ASSERT(false);
     }
@@ -475,7 +1030,7 @@ SNAPFile::readHeader(ReaderContext& context)
     PairedReadSupplierGenerator *
 SNAPFile::createPairedReadSupplierGenerator(int numThreads, bool quicklyDropUnpairedReads, const ReaderContext& context)
 {
-    _ASSERT(fileType == SAMFile || fileType == BAMFile || fileType == InterleavedFASTQFile || secondFileName != NULL); // Caller's responsibility to check this
+    _ASSERT(fileType == SAMFile || fileType == BAMFile || fileType == CRAMFile || fileType == InterleavedFASTQFile || secondFileName != NULL); // Caller's responsibility to check this
 
     switch (fileType) {
     case SAMFile:
@@ -484,11 +1039,18 @@ SNAPFile::createPairedReadSupplierGenerator(int numThreads, bool quicklyDropUnpa
     case BAMFile:
         return BAMReader::createPairedReadSupplierGenerator(fileName,numThreads, quicklyDropUnpairedReads, context);
 
+    case CRAMFile:
+        return BAMReader::createPairedReadSupplierGenerator(fileName, numThreads, quicklyDropUnpairedReads, context, 5000,
+            DataSupplier::CramSupplier(context.genome, false));
+
     case FASTQFile:
         return PairedFASTQReader::createPairedReadSupplierGenerator(fileName, secondFileName, numThreads, context, isCompressed);
 
     case InterleavedFASTQFile:
         return PairedInterleavedFASTQReader::createPairedReadSupplierGenerator(fileName, numThreads, context, isCompressed);
+
+    case PackedReadsFile:
+        return PackedReadReader::createPairedReadSupplierGenerator(fileName, secondFileName, context, isCompressed);
         
     default:
         _ASSERT(false);
@@ -509,9 +1071,15 @@ SNAPFile::createReadSupplierGenerator(int numThreads, const ReaderContext& conte
     case BAMFile:
         return BAMReader::createReadSupplierGenerator(fileName,numThreads, context);
 
+    case CRAMFile:
+        return BAMReader::createReadSupplierGenerator(fileName, numThreads, context, DataSupplier::CramSupplier(context.genome, false));
+
     case FASTQFile:
         return FASTQReader::createReadSupplierGenerator(fileName, numThreads, context, isCompressed);
 
+    case PackedReadsFile:
+        return PackedReadReader::createReadSupplierGenerator(fileName, context, isCompressed);
+
     default:
         _ASSERT(false);
         fprintf(stderr,"SNAPFile::createReadSupplierGenerator: invalid file type (%d)\n", fileType);
@@ -545,7 +1113,8 @@ SNAPFile::generateFromCommandLine(const char **args, int nArgs, int *argsConsume
             snapFile->isStdio = true;
         }
 
-        if (!strcmp(args[0], "-fastq") || !strcmp(args[0], "-compressedFastq")) {
+        if (!strcmp(args[0], "-fastq") || !strcmp(args[0], "-compressedFastq") ||
+            !strcmp(args[0], "-packedReads") || !strcmp(args[0], "-compressedPackedReads")) {
             if (!isInput) {
                 fprintf(stderr,"%s is not a valid output file type.\n", args[0]);
                 soft_exit(1);
@@ -557,10 +1126,11 @@ SNAPFile::generateFromCommandLine(const char **args, int nArgs, int *argsConsume
             }
 
  
-            snapFile->isCompressed = !strcmp(args[0], "-compressedFastq");
+            snapFile->isCompressed = !strcmp(args[0], "-compressedFastq") || !strcmp(args[0], "-compressedPackedReads");
+            FileType fileType = (!strcmp(args[0], "-packedReads") || !strcmp(args[0], "-compressedPackedReads")) ? PackedReadsFile : FASTQFile;
 
             if (paired) {
-                snapFile->fileType = FASTQFile;
+                snapFile->fileType = fileType;
                 snapFile->secondFileName = args[2];
                 if (!strcmp("-", args[2])) {
                     if (snapFile->isStdio) {
@@ -571,7 +1141,7 @@ SNAPFile::generateFromCommandLine(const char **args, int nArgs, int *argsConsume
                 }
                 *argsConsumed = 3;
             } else {
-               snapFile->fileType = FASTQFile;
+               snapFile->fileType = fileType;
                *argsConsumed = 2;
             }
         } else if (!strcmp(args[0], "-sam")) {
@@ -581,6 +1151,10 @@ SNAPFile::generateFromCommandLine(const char **args, int nArgs, int *argsConsume
             snapFile->fileType = BAMFile;
             snapFile->isCompressed = true;
             *argsConsumed = 2;
+        } else if (!strcmp(args[0], "-cram")) {
+            snapFile->fileType = CRAMFile;
+            snapFile->isCompressed = true;
+            *argsConsumed = 2;
         } else if (!strcmp(args[0], "-pairedInterleavedFastq") || !strcmp(args[0], "-pairedCompressedInterleavedFastq")) {
             if (!paired) {
                 fprintf(stderr,"Specified %s for a single-end alignment.  To treat it as single-end, just use ordinary fastq (or compressed fastq, as appropriate)\n", args[0]);
@@ -614,22 +1188,27 @@ SNAPFile::generateFromCommandLine(const char **args, int nArgs, int *argsConsume
     } else if (util::stringEndsWith(args[0], ".bam")) {
         snapFile->fileType = BAMFile;
         snapFile->isCompressed = true;
+    } else if (util::stringEndsWith(args[0], ".cram")) {
+        snapFile->fileType = CRAMFile;
+        snapFile->isCompressed = true;
     } else if (!isInput) {
         //
         // No default output file type.
         //
-        fprintf(stderr,"You specified an output file with name '%s', which doesn't end in .sam or .bam, and doesn't have an explicit type\n", args[0]);
+        fprintf(stderr,"You specified an output file with name '%s', which doesn't end in .sam, .bam or .cram, and doesn't have an explicit type\n", args[0]);
         fprintf(stderr,"specifier.  There is no default output file type.  Consider doing something like '-o -bam %s'\n", args[0]);
         soft_exit(1);
     } else if (util::stringEndsWith(args[0], ".fq") || util::stringEndsWith(args[0], ".fastq") ||
         util::stringEndsWith(args[0], ".fq.gz") || util::stringEndsWith(args[0], ".fastq.gz") ||
-        util::stringEndsWith(args[0], ".fq.gzip") || util::stringEndsWith(args[0], ".fastq.gzip")) {
+        util::stringEndsWith(args[0], ".fq.gzip") || util::stringEndsWith(args[0], ".fastq.gzip") ||
+        util::stringEndsWith(args[0], ".snapreads") || util::stringEndsWith(args[0], ".snapreads.gz")) {
 
         // 
-        // It's a fastq input file (either by default or because it's got a .fq or .fastq extension, we don't
+        // It's a fastq (or packed read) input file (either by default or because it's got a .fq or .fastq extension, we don't
         // need to check).  See if it's also compressed.
         //
-        snapFile->fileType= FASTQFile;
+        snapFile->fileType = util::stringEndsWith(args[0], ".snapreads") || util::stringEndsWith(args[0], ".snapreads.gz") ?
+            PackedReadsFile : FASTQFile;
         if (util::stringEndsWith(args[0], ".gz") || util::stringEndsWith(args[0], ".gzip")) {
             snapFile->isCompressed = true;
         } else {
@@ -28,18 +28,22 @@ Revision History:
 #include "options.h"
 #include "Range.h"
 #include "Genome.h"
+#include "GenomeIndex.h"
 #include "Read.h"
 
 #define MAPQ_LIMIT_FOR_SINGLE_HIT 10
+#define DEFAULT_EXACT_MATCH_MAPQ 60   // For -ex
 
 struct AbstractOptions
 {
+    virtual ~AbstractOptions() {}
+
     virtual void usageMessage() = 0;
 
     virtual bool parse(const char** argv, int argc, int& n, bool *done) = 0;
 };
 
-enum FileType {UnknownFileType, SAMFile, FASTQFile, BAMFile, InterleavedFASTQFile, CRAMFile};  // Add more as needed
+enum FileType {UnknownFileType, SAMFile, FASTQFile, BAMFile, InterleavedFASTQFile, CRAMFile, PackedReadsFile};  // Add more as needed
 
 struct SNAPFile {
     SNAPFile() : fileName(NULL), secondFileName(NULL), fileType(UnknownFileType), isStdio(false) {}
@@ -55,6 +59,14 @@ struct SNAPFile {
     static bool generateFromCommandLine(const char **args, int nArgs, int *argsConsumed, SNAPFile *snapFile, bool paired, bool isInput);
 };
 
+//
+// With -route, an extra output that gets the reads that filter (see ReadRouteFilter::create) picks out.
+//
+struct OutputRoute {
+    const char         *filter;
+    SNAPFile            file;
+};
+
 struct AlignerOptions : public AbstractOptions
 {
     AlignerOptions(const char* i_commandLine, bool forPairedEnd = false);
@@ -78,8 +90,17 @@ struct AlignerOptions : public AbstractOptions
     bool                sortOutput;
     bool                noIndex;
     bool                noDuplicateMarking;
+    int                 opticalDuplicateDistance; // pixels, for counting optical duplicates; 0 for no count
     bool                noQualityCalibration;
+    bool                computeCoverage;    // With sorted BAM output, also write the depth and alignment metrics
     unsigned            sortMemory; // total output sorting buffer size in Gb
+    unsigned            sortKeepMemory; // Gb of sorted runs to keep in memory rather than in the temp file
+    const char         *sortSpillDirectories;   // comma separated directories to stripe sorted runs across, or NULL
+    bool                compressSortSpills;     // compress the sorted runs that don't stay in memory
+    int                 minCompressionLevel;    // BAM and gzip output go between these as the compression keeps up or falls behind
+    int                 maxCompressionLevel;
+    _int64              memoryBudget;   // bytes for -mem to fit threads and buffers in; -1 for all the machine or container has, 0 for no plan
+    size_t              plannedSortMemory;  // bytes of sort buffers that -mem picked, which then takes the place of sortMemory
     unsigned            filterFlags;
     bool                explorePopularSeeds;
     bool                stopOnFirstHit;
@@ -89,13 +110,49 @@ struct AlignerOptions : public AbstractOptions
     AbstractOptions    *extra; // extra options
     const char         *rgLineContents;
     const char         *perfFileName;
+    const char         *perfCounterFileName;    // JSON lines of where the aligner threads' time goes
+    int                 perfCounterInterval;    // seconds between the progress lines in it, or 0 for just the final one
+    const char         *statusFileName;         // replaced with the latest of those lines as the run goes
+    const char         *traceFileName;          // a Chrome trace of the pipeline's threads (see TraceRecorder.h)
+    int                 slowReadsToReport;      // with -latency, or -1 for no per-read timing
+    int                 streamFlushMillis;      // with -stream, the longest output is held; -1 to batch as usual
+    bool                seedOrder;              // align each batch of reads in hash table order of their first seeds
     bool                useTimingBarrier;
     unsigned            extraSearchDepth;
+    unsigned            mapqToStopAt;       // If non-zero, search only as deep as it takes to be sure of MAPQ >= this
+    int                 exactMatchMapq;     // If non-zero, single end reads that match exactly in one place skip the search and get this MAPQ
+    unsigned            realignRadius;      // If non-zero, single end reads from SAM or BAM are first searched for this close to where they were
+    int                 keepMapq;           // If not -1, reads from SAM or BAM already aligned with at least this MAPQ are written as they were
+    bool                orderSeedsByHits;   // Single end reads use their first pass's seeds fewest hits first (see BaseAligner::setOrderSeedsByHits)
+    unsigned            lvBudget;           // If non-zero, the most LV calls to spend on a read before settling for the best so far
+    unsigned            longReadLength;     // Single end reads at least this long go to the long read aligner; 0 for none
+    unsigned            maxIntronLength;    // With -splice, the longest intron a single end read can span; 0 for no spliced alignment
+    const char         *competingIndexDir;  // With -compete, a second index single end reads are also aligned to, or NULL
+    SNAPFile            competingOutputFile;    // where the reads that align better to it are written
+    const char         *adapters;           // Comma separated adapter sequences to trim from FASTQ reads, or NULL
+    int                 qualityTrimThreshold;   // Trim FASTQ read tails to this quality, or 0 for no quality trimming
+    const char         *screenFasta;        // With -screen, the sequences (phiX, rRNA) whose FASTQ reads aren't aligned, or NULL
+    SNAPFile            screenOutputFile;   // where those reads are written
     const char         *defaultReadGroup; // if not specified in input
     bool                ignoreSecondaryAlignments; // on input, default true
     bool                outputMultipleAlignments;
+    unsigned            secondaryScoreDelta;    // with -om, how many more edits than the best a secondary alignment can have
+    unsigned            maxSecondaryAlignments; // and how many of them to write per read or pair
     bool                preserveClipping;
+    bool                mapIndex;           // Memory map the index files rather than reading them in
+    bool                prefetchIndex;      // With mapIndex, fault the whole index in at load time
+    bool                lazyIndex;          // With mapIndex (and not prefetchIndex), hint readahead for the first seed lookups
+    bool                packGenome;         // Keep the genome at two bits per base
+    bool                interleaveIndex;    // Spread the index across the NUMA nodes rather than all on the loading thread's node
+    IndexPlacement      indexPlacement;     // Which parts of the index go in which memory (not with mapIndex)
+    bool                asyncInput;         // Read input files with many asynchronous reads in flight rather than memory mapping them
     float               expansionFactor;
+    unsigned            rangeIndex;         // -range i/N asks for piece i (here 0 based) of rangeCount pieces of the input
+    unsigned            rangeCount;
+    unsigned            checkpointPieces;   // With -checkpoint N, align the input as N pieces in turn, each to its own file, skipping finished ones
+    static const int    MaxOutputRoutes = 32;       // Enough for a multiplexed run's read groups
+    int                 nOutputRoutes;
+    OutputRoute         outputRoutes[MaxOutputRoutes];  // Beyond the -o output
 
     void usage();
 
@@ -110,7 +167,23 @@ struct AlignerOptions : public AbstractOptions
         FilterMultipleHits =        0x0004,
     };
 
+    //
+    // Whether to write read at all.  With -route, the outputs' filters (including -F's for the -o output) pick the reads
+    // for each output as they're written, so everything passes.
+    //
     bool passFilter(Read* read, AlignmentResult result);
+
+    //
+    // With -keepMapq, whether a read's input alignment is good enough to write as it was rather than aligning the read again.
+    //
+    bool keepsInputAlignment(Read *read) const;
+
+    static Direction inputDirection(Read *read);
+
+    //
+    // Total bytes for the sorting buffers, or 0 for the default.
+    //
+    size_t getSortMemory() const;
     
     virtual bool isPaired() { return false; }
 };
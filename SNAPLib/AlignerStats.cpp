@@ -25,6 +25,8 @@ Revision History:
 #include "stdafx.h"
 #include "options.h"
 #include "AlignerStats.h"
+#include "Read.h"
+#include "Util.h"
 
 AbstractStats::~AbstractStats()
 {}
@@ -39,7 +41,14 @@ AlignerStats::AlignerStats(AbstractStats* i_extra)
     errors(0),
     alignedAsPairs(0),
     extra(i_extra),
-    lvCalls(0)
+    lvCalls(0),
+    lvCacheLookups(0),
+    lvCacheHits(0),
+    alignmentsOverLVBudget(0),
+    readsKeptFromInput(0),
+    readsToCompetingIndex(0),
+    readsScreened(0),
+    latencies(NULL)
 {
     for (int i = 0; i <= AlignerStats::maxMapq; i++) {
         mapqHistogram[i] = 0;
@@ -52,12 +61,6 @@ AlignerStats::AlignerStats(AbstractStats* i_extra)
         probabilityMassByWeightDepth[i] = 0;
     }
 
-#if     TIME_HISTOGRAM
-    for (unsigned i = 0; i < 31; i++) {
-        countByTimeBucket[i] = nanosByTimeBucket[i] = 0;
-    }
-#endif  // TIME_HISTOGRAM
-
 }
 
 AlignerStats::~AlignerStats()
@@ -65,6 +68,7 @@ AlignerStats::~AlignerStats()
     if (extra != NULL) {
         delete extra;
     }
+    delete latencies;
 }
 
     void
@@ -90,6 +94,13 @@ AlignerStats::add(
     errors += other->errors;
     alignedAsPairs += other->alignedAsPairs;
     lvCalls += other->lvCalls;
+    lvCacheLookups += other->lvCacheLookups;
+    lvCacheHits += other->lvCacheHits;
+    alignmentsOverLVBudget += other->alignmentsOverLVBudget;
+    readsKeptFromInput += other->readsKeptFromInput;
+    readsToCompetingIndex += other->readsToCompetingIndex;
+    readsScreened += other->readsScreened;
+    perf.add(&other->perf);
 
     if (extra != NULL && other->extra != NULL) {
         extra->add(other->extra);
@@ -105,10 +116,120 @@ AlignerStats::add(
         probabilityMassByWeightDepth[i] = other->probabilityMassByWeightDepth[i];
     }
 
-#if TIME_HISTOGRAM
-    for (unsigned i = 0; i < 31; i++) {
-        countByTimeBucket[i] += other->countByTimeBucket[i];
-        nanosByTimeBucket[i] += other->nanosByTimeBucket[i];
+    if (other->latencies != NULL) {
+        if (latencies == NULL) {
+            latencies = new ReadLatencies(0);
+        }
+        latencies->add(other->latencies);
+    }
+}
+
+ReadLatencies::ReadLatencies(
+    int i_nSlowest)
+    :
+    nSlowest(i_nSlowest),
+    nSlow(0),
+    slowest(i_nSlowest > 0 ? new SlowRead[i_nSlowest] : NULL)
+{
+}
+
+ReadLatencies::~ReadLatencies()
+{
+    delete [] slowest;
+}
+
+    void
+ReadLatencies::record(
+    const Read* read,
+    _int64 nanos)
+{
+    times.record(nanos);
+
+    if (nSlow < nSlowest || (nSlowest > 0 && nanos > slowest[0].nanos)) {
+        recordSlow(nanos, read->getId(), read->getIdLength());
+    }
+}
+
+    void
+ReadLatencies::recordSlow(
+    _int64 nanos,
+    const char* id,
+    unsigned idLength)
+{
+    //
+    // Either add it to the heap, or replace its fastest.  Then sift the new one down to where it belongs.
+    //
+    int i;
+    if (nSlow < nSlowest) {
+        i = nSlow++;
+        while (i > 0 && slowest[(i - 1) / 2].nanos > nanos) {
+            slowest[i] = slowest[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+    } else {
+        i = 0;
+        for (;;) {
+            int child = 2 * i + 1;
+            if (child >= nSlow) {
+                break;
+            }
+            if (child + 1 < nSlow && slowest[child + 1].nanos < slowest[child].nanos) {
+                child++;
+            }
+            if (slowest[child].nanos >= nanos) {
+                break;
+            }
+            slowest[i] = slowest[child];
+            i = child;
+        }
+    }
+    slowest[i].nanos = nanos;
+    idLength = min(idLength, (unsigned) maxIdLength);
+    memcpy(slowest[i].id, id, idLength);
+    slowest[i].id[idLength] = '\0';
+}
+
+    void
+ReadLatencies::add(
+    const ReadLatencies* other)
+{
+    times.add(&other->times);
+
+    if (other->nSlowest > nSlowest) {
+        SlowRead* grown = new SlowRead[other->nSlowest];
+        memcpy(grown, slowest, nSlow * sizeof(SlowRead));   // a heap is still a heap with room at the end
+        delete [] slowest;
+        slowest = grown;
+        nSlowest = other->nSlowest;
+    }
+    for (int i = 0; i < other->nSlow; i++) {
+        if (nSlow < nSlowest || other->slowest[i].nanos > slowest[0].nanos) {
+            recordSlow(other->slowest[i].nanos, other->slowest[i].id, (unsigned) strlen(other->slowest[i].id));
+        }
+    }
+}
+
+static int CompareSlowReads(const void* a, const void* b)   // on the SlowReads' nanos, which come first
+{
+    _int64 nanosA = *(const _int64*) a;
+    _int64 nanosB = *(const _int64*) b;
+    return nanosA > nanosB ? -1 : nanosA < nanosB ? 1 : 0;
+}
+
+    void
+ReadLatencies::print(
+    FILE* out) const
+{
+    times.print(out, "Per-read alignment time (us)", 1000.0);
+
+    if (nSlow > 0) {
+        SlowRead* sorted = new SlowRead[nSlow];
+        memcpy(sorted, slowest, nSlow * sizeof(SlowRead));
+        qsort(sorted, nSlow, sizeof(SlowRead), CompareSlowReads);
+        fprintf(out, "Slowest %d reads:\ntime (us)\tID\n", nSlow);
+        for (int i = 0; i < nSlow; i++) {
+            fprintf(out, "%.1f\t%s\n", sorted[i].nanos / 1000.0, sorted[i].id);
+        }
+        delete [] sorted;
     }
-#endif // TIME_HISTOGRAM
 }
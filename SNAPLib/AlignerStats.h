@@ -22,11 +22,11 @@ Revision History:
 
 --*/
 
-#define     TIME_HISTOGRAM  0
-
 #pragma once
 #include "stdafx.h"
 #include "Compat.h"
+#include "PerfCounters.h"
+#include "Histogram.h"
 
 struct AbstractStats
 {
@@ -39,6 +39,43 @@ struct AbstractStats
 
 //#define TIME_STRING_DISTANCE    1
 
+class Read;
+
+//
+// Per-read alignment times, kept when they're asked for with -latency: a histogram of them, and the IDs of the slowest
+// reads (or pairs), which are the repetitive ones that set the worst case and so are what to look at when tuning
+// maxHits and maxBigHits.
+//
+struct ReadLatencies
+{
+    ReadLatencies(int i_nSlowest);
+
+    ~ReadLatencies();
+
+    Histogram times;    // in nanoseconds
+
+    void record(const Read* read, _int64 nanos);
+
+    void add(const ReadLatencies* other);
+
+    void print(FILE* out) const;
+
+private:
+    static const int maxIdLength = 63;   // longer IDs are cut off
+
+    struct SlowRead
+    {
+        _int64 nanos;
+        char id[maxIdLength + 1];
+    };
+
+    void recordSlow(_int64 nanos, const char* id, unsigned idLength);
+
+    int nSlowest;
+    int nSlow;
+    SlowRead* slowest;  // a min-heap on nanos of the nSlow (<= nSlowest) slowest so far
+};
+
 struct AlignerStats : public AbstractStats
 {
     AlignerStats(AbstractStats* i_extra = NULL);
@@ -52,18 +89,17 @@ struct AlignerStats : public AbstractStats
     _int64 errors;
     _int64 alignedAsPairs;
     _int64 lvCalls;
+    _int64 lvCacheLookups;
+    _int64 lvCacheHits;
+    _int64 alignmentsOverLVBudget;  // reads (or pairs, for the intersecting aligner) that settled for the best so far under -lvBudget
+    _int64 readsKeptFromInput;      // reads written with their input alignment under -keepMapq
+    _int64 readsToCompetingIndex;   // reads written to the -compete output
+    _int64 readsScreened;           // reads that -screen kept from the aligners
     static const unsigned maxMapq = 70;
     unsigned mapqHistogram[maxMapq+1];
     unsigned mapqErrors[maxMapq+1];
 
-#if TIME_HISTOGRAM
-    //
-    // Histogram of alignment times.  Time buckets are divided by powers-of-two nanoseconds, so time bucket 0 is 
-    // <= 1 ns, time bucket 10 is <= 1.024 us, etc.  Time bucket 30 is > 1s.
-    //
-    _int64 countByTimeBucket[31];
-    _int64 nanosByTimeBucket[31];
-#endif // TIME_HISTOGRAM
+    ReadLatencies* latencies;   // NULL unless the reads are being timed
 
 
     static const unsigned maxMaxHits = 50;
@@ -71,6 +107,8 @@ struct AlignerStats : public AbstractStats
     unsigned countOfAllHitsByWeightDepth[maxMaxHits];
     double probabilityMassByWeightDepth[maxMaxHits];
 
+    PerfCounters perf;
+
     AbstractStats* extra;
 
     virtual ~AlignerStats();
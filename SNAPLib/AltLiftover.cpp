@@ -0,0 +1,229 @@
+/*++
+
+Module Name:
+
+    AltLiftover.cpp
+
+Abstract:
+
+    The table that says where each piece of an alternate locus (ALT) contig lies on the primary assembly, which lets
+    seed lookups drop the hits on an ALT that just repeat a hit on the primary copy.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "AltLiftover.h"
+#include "GenericFile.h"
+#include "GenomeIndex.h"
+#include "exit.h"
+#include <vector>
+#include <algorithm>
+
+const char *AltLiftover::IndexFileName = "AltLiftover";
+
+AltLiftover::~AltLiftover()
+{
+    delete [] segments;
+}
+
+    AltLiftover *
+AltLiftover::loadFromFile(const char *fileName, const Genome *genome)
+{
+    GenericFile *file = GenericFile::open(fileName, GenericFile::Mode::ReadOnly);
+    if (NULL == file) {
+        fprintf(stderr, "Unable to open ALT liftover file '%s'\n", fileName);
+        return NULL;
+    }
+
+    std::vector<Segment> segments;
+    char line[1000];
+    bool worked = true;
+    for (int lineNumber = 1; worked && NULL != file->gets(line, sizeof(line)); lineNumber++) {
+        char altName[400], primaryName[400], extra[2];
+        long long altStart, primaryStart, length;
+        if ('#' == line[0] || 1 != sscanf(line, "%1s", extra)) {
+            continue;   // A comment or a blank line
+        }
+
+        if (5 != sscanf(line, "%399s %lld %399s %lld %lld %1s", altName, &altStart, primaryName, &primaryStart, &length, extra)) {
+            altStart = 0;
+            length = -1;    // The whole ALT
+            if (3 != sscanf(line, "%399s %399s %lld %1s", altName, primaryName, &primaryStart, extra)) {
+                fprintf(stderr, "%s line %d should be 'altContig altStart primaryContig primaryStart length' or 'altContig primaryContig primaryStart'\n",
+                    fileName, lineNumber);
+                worked = false;
+                break;
+            }
+        }
+
+        GenomeLocation altOffset, primaryOffset;
+        if (!genome->getOffsetOfContig(altName, &altOffset) || !genome->getOffsetOfContig(primaryName, &primaryOffset)) {
+            fprintf(stderr, "%s line %d names a contig that isn't in the genome\n", fileName, lineNumber);
+            worked = false;
+            break;
+        }
+
+        const Genome::Contig *altContig = genome->getContigAtLocation(altOffset);
+        const Genome::Contig *primaryContig = genome->getContigAtLocation(primaryOffset);
+        if (-1 == length) {
+            length = altContig->length;
+        }
+        if (altContig == primaryContig || altStart < 0 || primaryStart < 0 || length <= 0 || altStart + length > altContig->length ||
+                primaryStart + length > primaryContig->length) {
+            fprintf(stderr, "%s line %d describes a segment that doesn't fit in its contigs\n", fileName, lineNumber);
+            worked = false;
+            break;
+        }
+
+        Segment segment;
+        segment.altBegin = altOffset + (GenomeLocation)altStart;
+        segment.altEnd = segment.altBegin + (GenomeLocation)length;
+        segment.primaryBegin = primaryOffset + (GenomeLocation)primaryStart;
+        segments.push_back(segment);
+    }
+
+    file->close();
+    delete file;
+    if (!worked) {
+        return NULL;
+    }
+
+    std::sort(segments.begin(), segments.end(), Segment::compare);
+    for (size_t i = 1; i < segments.size(); i++) {
+        if (segments[i].altBegin < segments[i - 1].altEnd) {
+            fprintf(stderr, "%s has overlapping segments for ALT contig %s\n", fileName, genome->getContigAtLocation(segments[i].altBegin)->name);
+            return NULL;
+        }
+    }
+
+    AltLiftover *liftover = new AltLiftover;
+    liftover->nSegments = (int)segments.size();
+    liftover->segments = new Segment[__max(segments.size(), (size_t)1)];
+    for (int i = 0; i < liftover->nSegments; i++) {
+        liftover->segments[i] = segments[i];
+    }
+    if (liftover->nSegments > 0) {
+        liftover->firstAltLocation = liftover->segments[0].altBegin;
+    }
+
+    return liftover;
+}
+
+    bool
+AltLiftover::saveToIndexDirectory(const char *liftoverFileName, const char *directoryName)
+{
+    const Genome *genome = GenomeIndex::loadGenomeFromDirectory(directoryName);
+    if (NULL == genome) {
+        return false;
+    }
+
+    AltLiftover *liftover = loadFromFile(liftoverFileName, genome);
+    delete genome;
+    if (NULL == liftover) {
+        return false;
+    }
+    printf("%d ALT liftover segments\n", liftover->nSegments);
+    delete liftover;
+
+    //
+    // It's kept by contig name, so it's just the (now checked) file itself.
+    //
+    const unsigned filenameBufferSize = MAX_PATH+1;
+    char filenameBuffer[filenameBufferSize];
+    snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, IndexFileName);
+
+    FILE *input = fopen(liftoverFileName, "rb");
+    FILE *output = fopen(filenameBuffer, "wb");
+    if (NULL == input || NULL == output) {
+        fprintf(stderr, "Unable to copy '%s' to '%s'\n", liftoverFileName, filenameBuffer);
+        if (NULL != input) {
+            fclose(input);
+        }
+        if (NULL != output) {
+            fclose(output);
+        }
+        return false;
+    }
+
+    char buffer[64 * 1024];
+    size_t bytesRead;
+    bool worked = true;
+    while (worked && 0 != (bytesRead = fread(buffer, 1, sizeof(buffer), input))) {
+        worked = bytesRead == fwrite(buffer, 1, bytesRead, output);
+    }
+    fclose(input);
+    worked = 0 == fclose(output) && worked;
+    if (!worked) {
+        fprintf(stderr, "Error writing '%s'\n", filenameBuffer);
+    }
+
+    return worked;
+}
+
+    bool
+AltLiftover::liftToPrimary(GenomeLocation location, GenomeLocation *primaryLocation) const
+{
+    //
+    // The last segment that starts at or before location.
+    //
+    int low = 0;
+    int high = nSegments - 1;
+    while (low <= high) {
+        int mid = low + (high - low) / 2;
+        if (segments[mid].altBegin <= location) {
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+    if (high < 0 || location >= segments[high].altEnd) {
+        return false;
+    }
+
+    *primaryLocation = segments[high].primaryBegin + (location - segments[high].altBegin);
+    return true;
+}
+
+    void
+AltLiftover::dropRedundantAltHitsSlow(unsigned *nHits, const GenomeLocation **hits) const
+{
+    const GenomeLocation *list = *hits;
+    unsigned n = *nHits;
+    unsigned nDropped = 0;
+
+    while (nDropped < n - 1 && list[nDropped] >= firstAltLocation) {
+        GenomeLocation primaryLocation;
+        if (!liftToPrimary(list[nDropped], &primaryLocation)) {
+            break;  // Not on an ALT at all, or not on a part of one that lines up with the primary
+        }
+
+        //
+        // Binary search (the list is in descending order) for the first hit at or below primaryLocation + MaxSlop, and
+        // see if it's close enough.
+        //
+        GenomeLocation highest = primaryLocation + MaxSlop;
+        GenomeLocation lowest = primaryLocation > MaxSlop ? primaryLocation - MaxSlop : 0;
+        unsigned low = nDropped + 1;
+        unsigned high = n;
+        while (low < high) {
+            unsigned mid = low + (high - low) / 2;
+            if (list[mid] <= highest) {
+                high = mid;
+            } else {
+                low = mid + 1;
+            }
+        }
+        if (low == n || list[low] < lowest) {
+            break;  // This one's on the ALT alone
+        }
+
+        nDropped++;
+    }
+
+    *hits = list + nDropped;
+    *nHits = n - nDropped;
+}
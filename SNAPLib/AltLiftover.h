@@ -0,0 +1,102 @@
+/*++
+
+Module Name:
+
+    AltLiftover.h
+
+Abstract:
+
+    The table that says where each piece of an alternate locus (ALT) contig lies on the primary assembly, which lets
+    seed lookups drop the hits on an ALT that just repeat a hit on the primary copy.
+
+Environment:
+
+    User mode service.
+
+    Read only once it's loaded, so any number of aligner threads can share one.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "Genome.h"
+
+//
+// References like GRCh38 with its ALT contigs have long stretches that are in the genome twice, once on the primary
+// assembly and once on an ALT.  A read from one of them has every seed hit both copies, so the aligners score both,
+// and the two equally good alignments make the MAPQ zero.  Worse, seeds that would be unique are twice as popular,
+// and more of them get skipped for hitting too many places.
+//
+// With an AltLiftover stored in the index, each hit list that a seed lookup returns has its hits on ALTs checked
+// against the liftover.  One that the same list also has a hit for on the primary assembly, at (about) the place it
+// lifts over to, is redundant, and is dropped before the aligners ever see it.  Seeds from stretches where the ALT
+// differs from the primary still hit the ALT alone, so reads that really come from it can still align there.
+//
+// The liftover is built from a text file given to snap index -altLiftover.  Each line is a segment of an ALT that's
+// colinear with (and on the same strand as) the primary assembly:
+//
+//      altContig altStart primaryContig primaryStart length
+//
+// with zero-based starts, or just "altContig primaryContig primaryStart" for an ALT that lines up as a whole.  Blank
+// lines and ones starting with # are ignored.  Small indels between the copies are fine, since the primary hit only
+// has to be within MaxSlop of where the segment puts it; bigger ones need a new segment.  It's saved in the index
+// directory by contig name, as AltLiftover.
+//
+class AltLiftover {
+public:
+    ~AltLiftover();
+
+    //
+    // Reads a liftover file for the given genome, returning NULL (having said why) if it's malformed or names contigs
+    // that the genome doesn't have.
+    //
+    static AltLiftover *loadFromFile(const char *fileName, const Genome *genome);
+
+    //
+    // Checks liftoverFileName against the genome in an index directory, and saves it there for loadFromFile.
+    //
+    static bool saveToIndexDirectory(const char *liftoverFileName, const char *directoryName);
+
+    static const char *IndexFileName;  // The name it has in the index directory
+
+    //
+    // Takes the hits for a seed (in descending order, as lookups return them) and drops the redundant ALT hits from the
+    // front of the list.  That's where the ALT hits are, as long as the ALTs come after the primary assembly in the
+    // genome, as they do in the usual references.  Trimming from the front also keeps hits[-1] valid memory for the
+    // code that relies on it.
+    //
+    inline void dropRedundantAltHits(unsigned *nHits, const GenomeLocation **hits) const
+    {
+        if (*nHits < 2 || (*hits)[0] < firstAltLocation) {
+            return; // No ALT hits, which is almost always the case
+        }
+        dropRedundantAltHitsSlow(nHits, hits);
+    }
+
+    //
+    // Where an ALT location lies on the primary assembly.  Returns false for anything that isn't in an ALT segment.
+    //
+    bool liftToPrimary(GenomeLocation location, GenomeLocation *primaryLocation) const;
+
+    inline int getSegmentCount() const { return nSegments; }
+
+    static const GenomeLocation MaxSlop = 32;
+
+private:
+    AltLiftover() : segments(NULL), nSegments(0), firstAltLocation(0xffffffff) {}
+
+    void dropRedundantAltHitsSlow(unsigned *nHits, const GenomeLocation **hits) const;
+
+    struct Segment {
+        GenomeLocation altBegin;
+        GenomeLocation altEnd;      // exclusive
+        GenomeLocation primaryBegin;
+
+        static bool compare(const Segment &a, const Segment &b) { return a.altBegin < b.altBegin; }
+    };
+
+    Segment        *segments;       // Sorted by altBegin, and not overlapping
+    int             nSegments;
+    GenomeLocation  firstAltLocation;
+};
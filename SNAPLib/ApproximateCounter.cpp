@@ -7,34 +7,56 @@ using namespace std;
 
 ApproximateCounter::ApproximateCounter()
 {
-    buckets.resize(BUCKETS);
+    registers.resize(REGISTERS);
 }
 
 void ApproximateCounter::add(_uint64 value)
 {
     _uint64 h = hash(value);
-    unsigned bucket = (unsigned) h % BUCKETS;
-    unsigned rest = (unsigned)(h >> SHIFT);
-    unsigned long firstZero;
+    unsigned whichRegister = (unsigned) h % REGISTERS;
+    _uint64 rest = h >> SHIFT;
+    unsigned long firstOne;
     if (rest == 0) {
-        firstZero = 64 - SHIFT;
+        firstOne = 64 - SHIFT;
     } else {
-        CountTrailingZeroes(rest, firstZero);
+        CountTrailingZeroes(rest, firstOne);
     }
 
-    buckets[bucket] |= (1LL << firstZero);
+    _uint8 rank = (_uint8)(firstOne + 1);
+    if (rank > registers[whichRegister]) {
+        registers[whichRegister] = rank;
+    }
+}
+
+void ApproximateCounter::merge(const ApproximateCounter *peer)
+{
+    for (int i = 0; i < REGISTERS; i++) {
+        registers[i] = __max(registers[i], peer->registers[i]);
+    }
 }
 
 
 unsigned ApproximateCounter::getCount()
 {
-    double s = 0;
-    for (int i = 0; i < BUCKETS; i++) {
-        _uint64 r = 0;
-        while (r < 64 && (buckets[i] & (1LL << r)) != 0) {
-            r++;
+    double sum = 0;
+    int nEmpty = 0;
+    for (int i = 0; i < REGISTERS; i++) {
+        sum += ldexp(1.0, -(int)registers[i]);
+        if (registers[i] == 0) {
+            nEmpty++;
         }
-        s += r;
     }
-    return (unsigned) (BUCKETS / 0.77351 * pow(2, s / BUCKETS));
+
+    const double alpha = 0.7213 / (1 + 1.079 / REGISTERS);
+    double estimate = alpha * REGISTERS * REGISTERS / sum;
+
+    //
+    // The raw estimate is biased upward while many registers are still empty, where counting them is more accurate.
+    // The hashes are 64 bits, so there's no correction needed for counts near the hash space.
+    //
+    if (estimate <= 2.5 * REGISTERS && nEmpty > 0) {
+        estimate = REGISTERS * log((double)REGISTERS / nEmpty);
+    }
+
+    return (unsigned) (estimate + 0.5);
 }
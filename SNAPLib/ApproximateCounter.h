@@ -2,7 +2,13 @@
 
 #include "Compat.h"
 
-// Counts the number of distinct items in a stream approximately using Flajolet-Martin.
+//
+// Counts the number of distinct items in a stream approximately using HyperLogLog (Flajolet, Fusy, Gandouet and
+// Meunier, 2007).  Each register holds the longest run of trailing zeroes seen in the hashes that land in it, which
+// takes a byte rather than the 64 bit bitmap a Flajolet-Martin bucket needs, so for the same memory there are eight
+// times as many registers and the standard error is about 1.04 / sqrt(REGISTERS), or 1.6%.  Small counts use linear
+// counting on the empty registers instead, so tables with only a few distinct seeds are sized accurately as well.
+//
 class ApproximateCounter
 {
 public:
@@ -10,13 +16,16 @@ public:
 
     void add(_uint64 value);
 
+    // Fold in everything peer has seen, as if it had all been added here.
+    void merge(const ApproximateCounter *peer);
+
     unsigned getCount();
 
 private:
-    static const int SHIFT = 9;
-    static const int BUCKETS = 1 << SHIFT;
+    static const int SHIFT = 12;
+    static const int REGISTERS = 1 << SHIFT;
 
-    std::vector<_uint64> buckets;
+    std::vector<_uint8> registers;
 
     // MurmurHash3 finalization step from http://sites.google.com/site/murmurhash
     inline _uint64 hash(_uint64 value) {
@@ -40,6 +40,32 @@ using util::strnchr;
 
 BAMReader::BAMReader(const ReaderContext& i_context) : ReadReader(i_context)
 {
+    if (NULL != context.genome || NULL == context.header) {
+        return;
+    }
+
+    const char* headerEnd = context.header + context.headerLength;
+    for (const char* line = context.header; line < headerEnd; ) {
+        const char* lineEnd = (const char*) memchr(line, '\n', headerEnd - line);
+        if (NULL == lineEnd) {
+            lineEnd = headerEnd;
+        }
+        if (lineEnd - line > 4 && ! memcmp(line, "@SQ\t", 4)) {
+            for (const char* field = line + 3; field < lineEnd && '\t' == *field; ) {
+                const char* fieldEnd = field + 1;
+                while (fieldEnd < lineEnd && '\t' != *fieldEnd && '\r' != *fieldEnd) {
+                    fieldEnd++;
+                }
+                if (fieldEnd - field > 4 && ! memcmp(field, "\tSN:", 4)) {
+                    headerRefNames.push_back(field + 4);
+                    headerRefNameLengths.push_back((unsigned) (fieldEnd - field - 4));
+                    break;
+                }
+                field = fieldEnd;
+            }
+        }
+        line = lineEnd + 1;
+    }
 }
 
 BAMReader::~BAMReader()
@@ -61,11 +87,11 @@ BAMReader::getNextReadPair(
 BAMReader::init(
     const char *fileName,
     _int64 startingOffset,
-    _int64 amountOfFileToProcess)
+    _int64 amountOfFileToProcess,
+    DataSupplier* supplier)
 {
-    // todo: integrate supplier models
     // might need up to 3x extra for expanded sequence + quality + cigar data
-    data = DataSupplier::GzipBamDefault[false]->getDataReader(MAX_RECORD_LENGTH, 3.0 * DataSupplier::ExpansionFactor);
+    data = (supplier != NULL ? supplier : DataSupplier::GzipBamDefault[false])->getDataReader(MAX_RECORD_LENGTH, 3.0 * DataSupplier::ExpansionFactor);
     if (! data->init(fileName)) {
         fprintf(stderr, "Unable to read file %s\n", fileName);
         soft_exit(1);
@@ -93,10 +119,11 @@ BAMReader::init(
     void
 BAMReader::readHeader(
     const char* fileName,
-    ReaderContext& context)
+    ReaderContext& context,
+    DataSupplier* supplier)
 {
     _ASSERT(context.header == NULL);
-    DataReader* data = DataSupplier::GzipBamDefault[false]->getDataReader(MAX_RECORD_LENGTH, 3.0 * DataSupplier::ExpansionFactor);
+    DataReader* data = (supplier != NULL ? supplier : DataSupplier::GzipBamDefault[false])->getDataReader(MAX_RECORD_LENGTH, 3.0 * DataSupplier::ExpansionFactor);
     if (! data->init(fileName)) {
         fprintf(stderr, "Unable to read file %s\n", fileName);
         soft_exit(1);
@@ -134,10 +161,11 @@ BAMReader::create(
     const char *fileName,
     _int64 startingOffset,
     _int64 amountOfFileToProcess,
-    const ReaderContext& context)
+    const ReaderContext& context,
+    DataSupplier* supplier)
 {
     BAMReader* reader = new BAMReader(context);
-    reader->init(fileName, startingOffset, amountOfFileToProcess);
+    reader->init(fileName, startingOffset, amountOfFileToProcess, supplier);
     return reader;
 }
 
@@ -154,12 +182,13 @@ BAMReader::reinit(
 BAMReader::createReadSupplierGenerator(
     const char *fileName,
     int numThreads,
-    const ReaderContext& context)
+    const ReaderContext& context,
+    DataSupplier* supplier)
 {
-    BAMReader* reader = create(fileName, 0, 0, context);
+    BAMReader* reader = create(fileName, 0, 0, context, supplier);
     ReadSupplierQueue* queue = new ReadSupplierQueue((ReadReader*)reader);
     queue->startReaders();
-    return queue;
+    return RestrictToRange(queue, context);
 }
 
     PairedReadSupplierGenerator *
@@ -168,13 +197,14 @@ BAMReader::createPairedReadSupplierGenerator(
     int numThreads,
     bool quicklyDropUnmatchedReads,
     const ReaderContext& context,
-    int matchBufferSize)
+    int matchBufferSize,
+    DataSupplier* supplier)
 {
-    BAMReader* reader = create(fileName, 0, 0, context);
+    BAMReader* reader = create(fileName, 0, 0, context, supplier);
     PairedReadReader* matcher = PairedReadReader::PairMatcher(reader, false, quicklyDropUnmatchedReads);
     ReadSupplierQueue* queue = new ReadSupplierQueue(matcher);
     queue->startReaders();
-    return queue;
+    return RestrictPairsToRange(queue, context);
 }
 
 const char* BAMAlignment::CodeToSeq = "=ACMGRSVTWYHKDBN";
@@ -191,10 +221,25 @@ BAMAlignment::decodeSeq(
     _uint8* nibbles,
     int bases)
 {
-    for (int i = 0; i < bases; i++) {
-        int n = (i & 1) ? *nibbles & 0xf : *nibbles >> 4;
-        nibbles += i & 1;
-        *o_sequence++ = BAMAlignment::CodeToSeq[n];
+    int i = 0;
+#if defined(__SSSE3__) || defined(__AVX__)
+    //
+    // Expand 16 bytes (32 bases) at a time: split each byte into its high and low nibble, interleave them back into base
+    // order and then look all of them up in CodeToSeq at once with a shuffle.
+    //
+    const __m128i codeToSeq = _mm_loadu_si128((const __m128i *)CodeToSeq);
+    const __m128i lowNibble = _mm_set1_epi8(0xf);
+    for (; i + 32 <= bases; i += 32) {
+        __m128i packed = _mm_loadu_si128((const __m128i *)(nibbles + i / 2));
+        __m128i high = _mm_and_si128(_mm_srli_epi16(packed, 4), lowNibble);
+        __m128i low = _mm_and_si128(packed, lowNibble);
+        _mm_storeu_si128((__m128i *)(o_sequence + i), _mm_shuffle_epi8(codeToSeq, _mm_unpacklo_epi8(high, low)));
+        _mm_storeu_si128((__m128i *)(o_sequence + i + 16), _mm_shuffle_epi8(codeToSeq, _mm_unpackhi_epi8(high, low)));
+    }
+#endif  // SSSE3
+    for (; i < bases; i++) {
+        _uint8 packed = nibbles[i / 2];
+        o_sequence[i] = BAMAlignment::CodeToSeq[(i & 1) ? packed & 0xf : packed >> 4];
     }
 }
 
@@ -204,7 +249,21 @@ BAMAlignment::decodeQual(
     char* quality,
     int bases)
 {
-    for (int i = 0; i < bases; i++) {
+    int i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+    //
+    // Anything out of the 0-63 range (including 0xff for "no qualities") becomes '!', same as the loop below.
+    //
+    const __m128i bang = _mm_set1_epi8('!');
+    const __m128i minusOne = _mm_set1_epi8(-1);
+    const __m128i sixtyFour = _mm_set1_epi8(64);
+    for (; i + 16 <= bases; i += 16) {
+        __m128i q = _mm_loadu_si128((const __m128i *)(quality + i));
+        __m128i inRange = _mm_and_si128(_mm_cmpgt_epi8(q, minusOne), _mm_cmplt_epi8(q, sixtyFour));
+        _mm_storeu_si128((__m128i *)(o_qual + i), _mm_add_epi8(_mm_and_si128(q, inRange), bang));
+    }
+#endif  // SSE2
+    for (; i < bases; i++) {
         char q = quality[i];
         o_qual[i] = q < 0 || q >= 64 ? '!' : q + '!';
     }
@@ -220,7 +279,19 @@ BAMAlignment::decodeCigar(
     int i = 0;
     _uint32 lastOp = 99999;
     while (ops > 0 && i < cigarSize - 11) { // 9 decimal digits (28 bits) + 1 cigar char + null terminator
-        i += sprintf(o_cigar + i, "%u", *cigar >> 4);
+        //
+        // Write the count by hand; sprintf was a good part of the cost of decoding a record.
+        //
+        char digits[10];
+        int nDigits = 0;
+        _uint32 count = *cigar >> 4;
+        do {
+            digits[nDigits++] = '0' + count % 10;
+            count /= 10;
+        } while (count > 0);
+        while (nDigits > 0) {
+            o_cigar[i++] = digits[--nDigits];
+        }
         _ASSERT((*cigar & 0xf) <= 8);
         _uint32 op = *cigar & 0xf;
         o_cigar[i++] = BAMAlignment::CodeToCigar[op];
@@ -294,6 +365,26 @@ BAMAlignment::reg2bin(
     return 0;
 }
 
+    int
+BAMAlignment::reg2bin(
+    _int64 beg,
+    _int64 end,
+    int minShift,
+    int depth)
+{
+    --end;
+    int shift = minShift;
+    int first = ((1 << (depth * 3)) - 1) / 7;   // of the bins at the bottom level
+    for (int level = depth; level > 0; level--) {
+        if (beg >> shift == end >> shift) {
+            return first + (int) (beg >> shift);
+        }
+        shift += 3;
+        first -= 1 << ((level - 1) * 3);
+    }
+    return 0;
+}
+
     int
 BAMAlignment::reg2bins(
     int beg,
@@ -344,7 +435,7 @@ BAMAlignment::validate()
 BAMReader::getNextRead(
     Read *read,
     AlignmentResult *alignmentResult,
-    unsigned *genomeLocation,
+    GenomeLocation *genomeLocation,
     bool *isRC,
     unsigned *mapQ,
     unsigned *flag,
@@ -386,7 +477,7 @@ BAMReader::getNextRead(
                 }
             }
         }
-    } while (context.ignoreSecondaryAlignments && (*flag & SAM_SECONDARY));
+    } while (context.ignoreSecondaryAlignments && (*flag & (SAM_SECONDARY | SAM_SUPPLEMENTARY)));
     return true;
 }
 
@@ -397,7 +488,7 @@ BAMReader::getReadFromLine(
     char *endOfBuffer,
     Read *read,
     AlignmentResult *alignmentResult,
-    unsigned *out_genomeLocation,
+    GenomeLocation *out_genomeLocation,
     bool *isRC,
     unsigned *mapQ,
     size_t *lineLength,
@@ -410,10 +501,10 @@ BAMReader::getReadFromLine(
     _ASSERT((size_t)(endOfBuffer - line) >= bam->size());
     bam->validate();
 
-    unsigned genomeLocation = bam->getLocation(genome);
+    GenomeLocation genomeLocation = bam->getLocation(genome);
 
     if (NULL != out_genomeLocation) {
-        _ASSERT(-1 <= bam->refID && bam->refID < (int)genome->getNumContigs());
+        _ASSERT(NULL == genome || (-1 <= bam->refID && bam->refID < (int)genome->getNumContigs()));
         *out_genomeLocation = genomeLocation;
     }
 
@@ -439,12 +530,15 @@ BAMReader::getReadFromLine(
 
         const char *rnext;
         unsigned rnextLen;
-        if (bam->next_refID < 0 || bam->next_refID >= genome->getNumContigs()) {
-            rnext = "*";
-            rnextLen = 1;
-        } else {
+        if (NULL != genome && bam->next_refID >= 0 && bam->next_refID < genome->getNumContigs()) {
             rnext = genome->getContigs()[bam->next_refID].name;
             rnextLen = genome->getContigs()[bam->next_refID].nameLength;
+        } else if (NULL == genome && bam->next_refID >= 0 && bam->next_refID < headerRefNames.size()) {
+            rnext = headerRefNames[bam->next_refID];
+            rnextLen = headerRefNameLengths[bam->next_refID];
+        } else {
+            rnext = "*";
+            rnextLen = 1;
         }
         read->init(bam->read_name(), bam->l_read_name - 1, seqBuffer, qualBuffer, bam->l_seq, genomeLocation, bam->MAPQ, bam->FLAG,
             originalFrontClipping, originalBackClipping, originalFrontHardClipping, originalBackHardClipping, rnext, rnextLen, bam->next_pos + 1);
@@ -498,7 +592,7 @@ class BAMFormat : public FileFormat
 public:
     BAMFormat(bool i_useM) : useM(i_useM) {}
 
-    virtual void getSortInfo(const Genome* genome, char* buffer, _int64 bytes, unsigned* o_location, unsigned* o_readBytes, int* o_refID, int* o_pos) const;
+    virtual void getSortInfo(const Genome* genome, char* buffer, _int64 bytes, GenomeLocation* o_location, unsigned* o_readBytes, int* o_refID, int* o_pos) const;
 
     virtual ReadWriterSupplier* getWriterSupplier(AlignerOptions* options, const Genome* genome) const;
 
@@ -509,9 +603,10 @@ public:
     virtual bool writeRead(
         const Genome * genome, LandauVishkinWithCigar * lv, char * buffer, size_t bufferSpace,
         size_t * spaceUsed, size_t qnameLen, Read * read, AlignmentResult result,
-        int mapQuality, unsigned genomeLocation, Direction direction,
+        int mapQuality, GenomeLocation genomeLocation, Direction direction,
         bool hasMate = false, bool firstInPair = false, Read * mate = NULL,
-        AlignmentResult mateResult = NotFound, unsigned mateLocation = 0, Direction mateDirection = FORWARD) const;
+        AlignmentResult mateResult = NotFound, GenomeLocation mateLocation = 0, Direction mateDirection = FORWARD,
+        const SpliceJunction *splice = NULL, const SplitRecord *split = NULL) const;
 
 private:
 
@@ -519,7 +614,10 @@ private:
         char * cigarBuf, int cigarBufLen,
         const char * data, unsigned dataLength, unsigned basesClippedBefore, unsigned extraBasesClippedBefore, unsigned basesClippedAfter,
         unsigned extraBasesClippedAfter,     unsigned frontHardClipping, unsigned backHardClipping,
-        unsigned genomeLocation, bool isRC, bool useM, int * editDistance);
+        GenomeLocation genomeLocation, bool isRC, bool useM, int * editDistance, const SpliceJunction * splice);
+
+    static int computeSplicedCigarOps(const Genome * genome, LandauVishkinWithCigar * lv, char * cigarBuf, int cigarBufLen,
+        const char * data, unsigned dataLength, GenomeLocation genomeLocation, const SpliceJunction * splice, bool useM, int * used);
 
     const bool useM;
 };
@@ -531,7 +629,7 @@ BAMFormat::getSortInfo(
     const Genome* genome,
     char* buffer,
     _int64 bytes,
-    unsigned* o_location,
+    GenomeLocation* o_location,
 	unsigned* o_readBytes,
 	int* o_refID,
 	int* o_pos) const
@@ -541,7 +639,7 @@ BAMFormat::getSortInfo(
 	if (o_location != NULL) {
 		if (bam->refID < 0 || bam->refID >= genome->getNumContigs() || bam->pos < 0) {
 			if (bam->next_refID < 0 || bam->next_refID > genome->getNumContigs() || bam->next_pos < 0) {
-				*o_location = UINT32_MAX;
+				*o_location = UnalignedSortLocation;
 			} else {
 				*o_location = genome->getContigs()[bam->next_refID].beginningOffset + bam->next_pos;
 			}
@@ -567,33 +665,82 @@ BAMFormat::getWriterSupplier(
 {
     DataWriterSupplier* dataSupplier;
     GzipWriterFilterSupplier* gzipSupplier =
-        DataWriterSupplier::gzip(true, BAM_BLOCK, max(1, options->numThreads - 1), false, options->sortOutput);
+        DataWriterSupplier::gzip(true, BAM_BLOCK, max(1, options->numThreads - 1), false,
+            options->minCompressionLevel, options->maxCompressionLevel);
         // (leave a thread free for main, and let OS map threads to cores to allow system IO etc.)
     if (options->sortOutput) {
-        size_t len = strlen(options->outputFile.fileName);
         // todo: this is going to leak, but there's no easy way to free it, and it's small...
-        char* tempFileName = (char*) malloc(5 + len);
-        strcpy(tempFileName, options->outputFile.fileName);
-        strcpy(tempFileName + len, ".tmp");
+        char* tempFileName = DataWriterSupplier::sortTempFileName(options->outputFile.fileName);
         // todo: make markDuplicates optional?
         DataWriter::FilterSupplier* filters = gzipSupplier;
+        if (! options->noQualityCalibration) {
+            filters = DataWriterSupplier::qualityCalibration(options->outputFile.fileName, genome)->compose(filters);
+        }
+        if (options->computeCoverage) {
+            filters = DataWriterSupplier::coverage(options->outputFile.fileName, genome)->compose(filters);
+        }
         if (! options->noDuplicateMarking) {
-            filters = DataWriterSupplier::markDuplicates(genome)->compose(filters);
+            filters = DataWriterSupplier::markDuplicates(genome, options->opticalDuplicateDistance)->compose(filters);
         }
         if (! options->noIndex) {
-            char* indexFileName = (char*) malloc(5 + len);
-            strcpy(indexFileName, options->outputFile.fileName);
-            strcpy(indexFileName + len, ".bai");
-            filters = DataWriterSupplier::bamIndex(indexFileName, genome, gzipSupplier)->compose(filters);
+            filters = DataWriterSupplier::bamIndex(options->outputFile.fileName, genome, gzipSupplier)->compose(filters);
+        }
+        dataSupplier = DataWriterSupplier::sorted(this, genome, tempFileName,
+            options->getSortMemory(), options->sortKeepMemory * (1ULL << 30),
+            options->numThreads, options->outputFile.fileName, filters,
+            FileEncoder::gzip(gzipSupplier), options->sortSpillDirectories, options->compressSortSpills);
+    } else {
+        //
+        // Compress on the work pool rather than on the aligner threads, which just hand their filled buffers over.
+        //
+        dataSupplier = DataWriterSupplier::create(options->outputFile.fileName, gzipSupplier,
+            FileEncoder::gzip(gzipSupplier));
+    }
+    return ReadWriterSupplier::create(this, dataSupplier, genome, options->gapPenalty);
+}
+
+//
+// CRAM goes through the writers as BAM, and the file encoder turns each batch of BAM records into containers, so only
+// the writer supplier differs.  There's no index, since BAI indexes BGZF offsets.
+//
+class CRAMFormat : public BAMFormat
+{
+public:
+    CRAMFormat(bool i_useM) : BAMFormat(i_useM) {}
+
+    virtual ReadWriterSupplier* getWriterSupplier(AlignerOptions* options, const Genome* genome) const;
+};
+
+const FileFormat* FileFormat::CRAM[] = { new CRAMFormat(false), new CRAMFormat(true) };
+
+    ReadWriterSupplier*
+CRAMFormat::getWriterSupplier(
+    AlignerOptions* options,
+    const Genome* genome) const
+{
+    DataWriterSupplier* dataSupplier;
+    DataWriter::FilterSupplier* cramSupplier = DataWriterSupplier::cram();
+    if (options->sortOutput) {
+        char* tempFileName = DataWriterSupplier::sortTempFileName(options->outputFile.fileName);
+        DataWriter::FilterSupplier* filters = cramSupplier;
+        if (! options->noQualityCalibration) {
+            filters = DataWriterSupplier::qualityCalibration(options->outputFile.fileName, genome)->compose(filters);
+        }
+        if (options->computeCoverage) {
+            filters = DataWriterSupplier::coverage(options->outputFile.fileName, genome)->compose(filters);
+        }
+        if (! options->noDuplicateMarking) {
+            filters = DataWriterSupplier::markDuplicates(genome, options->opticalDuplicateDistance)->compose(filters);
         }
         dataSupplier = DataWriterSupplier::sorted(this, genome, tempFileName,
-            options->sortMemory * (1ULL << 30),
+            options->getSortMemory(), options->sortKeepMemory * (1ULL << 30),
             options->numThreads, options->outputFile.fileName, filters,
-            FileEncoder::gzip(gzipSupplier, options->numThreads, options->bindToProcessors));
+            FileEncoder::cram(genome, true), options->sortSpillDirectories, options->compressSortSpills);
     } else {
-        dataSupplier = DataWriterSupplier::create(options->outputFile.fileName, gzipSupplier);
+        dataSupplier = DataWriterSupplier::create(options->outputFile.fileName, cramSupplier,
+            FileEncoder::cram(genome, false));
     }
-    return ReadWriterSupplier::create(this, dataSupplier, genome);
+    return ReadWriterSupplier::create(this, dataSupplier, genome, options->gapPenalty);
 }
 
     bool
@@ -630,7 +777,7 @@ BAMFormat::writeHeader(
 		int numContigs = context.genome->getNumContigs();
 		bamHeader->n_ref() = numContigs;
 		BAMHeaderRefSeq* refseq = bamHeader->firstRefSeq();
-		unsigned genomeLen = context.genome->getCountOfBases();
+		GenomeLocation genomeLen = context.genome->getCountOfBases();
 		for (int i = 0; i < numContigs; i++) {
 			int len = (int)strlen(contigs[i].name) + 1;
 			cursor += BAMHeaderRefSeq::size(len);
@@ -639,9 +786,9 @@ BAMFormat::writeHeader(
 			}
 			refseq->l_name = len;
 			memcpy(refseq->name(), contigs[i].name, len);
-			unsigned start = contigs[i].beginningOffset;
-            unsigned end = ((i + 1 < numContigs) ? contigs[i+1].beginningOffset : genomeLen) - context.genome->getChromosomePadding();
-            refseq->l_ref() = end - start;
+			GenomeLocation start = contigs[i].beginningOffset;
+            GenomeLocation end = ((i + 1 < numContigs) ? contigs[i+1].beginningOffset : genomeLen) - context.genome->getChromosomePadding();
+            refseq->l_ref() = (unsigned)(end - start);
 			refseq = refseq->next();
 			_ASSERT((char*) refseq - header == cursor);
 		}
@@ -650,6 +797,27 @@ BAMFormat::writeHeader(
     return true;
 }
 
+//
+// Copy the optional fields from BAM input that aren't dropped to to, or if it's NULL just count their bytes.
+//
+    static unsigned
+CopyKeptBAMTags(
+    char* to,
+    char* aux,
+    unsigned auxLen)
+{
+    unsigned keptLen = 0;
+    for (BAMAlignAux* field = (BAMAlignAux*) aux; (char*) field < aux + auxLen; field = field->next()) {
+        if (! SAMFormat::dropsTag(field->tag)) {
+            if (to != NULL) {
+                memcpy(to + keptLen, field, field->size());
+            }
+            keptLen += (unsigned) field->size();
+        }
+    }
+    return keptLen;
+}
+
     bool
 BAMFormat::writeRead(
     const Genome * genome,
@@ -661,14 +829,16 @@ BAMFormat::writeRead(
     Read * read,
     AlignmentResult result,
     int mapQuality,
-    unsigned genomeLocation,
+    GenomeLocation genomeLocation,
     Direction direction,
     bool hasMate,
     bool firstInPair,
     Read * mate,
     AlignmentResult mateResult,
-    unsigned mateLocation,
-    Direction mateDirection) const
+    GenomeLocation mateLocation,
+    Direction mateDirection,
+    const SpliceJunction *splice,
+    const SplitRecord *split) const
 {
     const int MAX_READ = MAX_READ_LENGTH;
     const int cigarBufSize = MAX_READ;
@@ -694,7 +864,7 @@ BAMFormat::writeRead(
     unsigned extraBasesClippedBefore;
     unsigned basesClippedAfter;
     unsigned extraBasesClippedAfter;
-    int editDistance;
+    int editDistance = -1;
 
     if (! SAMFormat::createSAMLine(genome, lv, data, quality, MAX_READ, contigName, contigIndex,
         flags, positionInContig, mapQuality, mateContigName, mateContigIndex, matePositionInContig, templateLength,
@@ -709,7 +879,15 @@ BAMFormat::writeRead(
         cigarOps = computeCigarOps(genome, lv, (char*) cigarBuf, cigarBufSize * sizeof(_uint32),
                                    clippedData, clippedLength, basesClippedBefore, extraBasesClippedBefore, basesClippedAfter, extraBasesClippedAfter,
                                    read->getOriginalFrontHardClipping(), read->getOriginalBackHardClipping(),
-                                   genomeLocation, direction == RC, useM, &editDistance);
+                                   genomeLocation, direction == RC, useM, &editDistance, splice);
+    }
+    bool writeStrand = NULL != splice && 0 != splice->strand && genomeLocation != InvalidGenomeLocation && ! SAMFormat::dropsTag("XS");
+    bool writeReadGroup = read->getReadGroup() != NULL && read->getReadGroup() != READ_GROUP_FROM_AUX && ! SAMFormat::dropsTag("RG");
+    bool writeProgram = ! SAMFormat::dropsTag("PG");
+    bool writeEditDistance = ! SAMFormat::dropsTag("NM");
+    bool writeOtherAlignment = NULL != split && genomeLocation != InvalidGenomeLocation && ! SAMFormat::dropsTag("SA");
+    if (NULL != split && split->supplementary) {
+        flags |= SAM_SUPPLEMENTARY;
     }
 
     // Write the BAM entry
@@ -723,7 +901,7 @@ BAMFormat::writeRead(
             warningPrinted = true;
             fprintf(stderr, "warning: translating optional data from SAM->BAM is not yet implemented, optional data will not appear in BAM\n");
         }
-        if (read->getReadGroup() == READ_GROUP_FROM_AUX) {
+        if (read->getReadGroup() == READ_GROUP_FROM_AUX && ! SAMFormat::dropsTag("RG")) {
             for (char* p = aux; p != NULL && p < aux + auxLen; p = SAMReader::skipToBeyondNextRunOfSpacesAndTabs(p, aux + auxLen)) {
                 if (strncmp(p, "RG:Z:", 5) == 0) {
                     size_t fieldLen;
@@ -740,12 +918,15 @@ BAMFormat::writeRead(
             auxLen = 0;
         }
     }
-    size_t bamSize = BAMAlignment::size((unsigned)qnameLen + 1, cigarOps, fullLength, auxLen);
-    if (read->getReadGroup() != NULL && read->getReadGroup() != READ_GROUP_FROM_AUX) {
+    bool keepSomeTags = aux != NULL && ! auxSAM && NULL != SAMFormat::DroppedTags;
+    size_t bamSize = BAMAlignment::size((unsigned)qnameLen + 1, cigarOps, fullLength, keepSomeTags ? CopyKeptBAMTags(NULL, aux, auxLen) : auxLen);
+    if (writeReadGroup) {
         bamSize += 4 + strlen(read->getReadGroup());
     }
-    bamSize += 4; // NM:C field
-    bamSize += strlen("PGZSNAP") + 1; // PG field
+    bamSize += ! writeEditDistance ? 0 : editDistance > 255 ? 7 : 4; // NM:C field, or NM:I for the long reads that can have more edits than that
+    bamSize += writeProgram ? strlen("PGZSNAP") + 1 : 0; // PG field
+    bamSize += writeStrand ? BAMAlignAux::size('A') : 0; // XS:A for a spliced read
+    bamSize += writeOtherAlignment ? 3 + strlen(split->otherAlignment) + 1 : 0;  // SA:Z for a split one
     if (bamSize > bufferSpace) {
         return false;
     }
@@ -784,7 +965,9 @@ BAMFormat::writeRead(
     }
     memcpy(bam->qual(), quality, fullLength);
     if (aux != NULL && auxLen > 0) {
-        if (! translateReadGroupFromSAM) {
+        if (keepSomeTags) {
+            auxLen = CopyKeptBAMTags((char*) bam->firstAux(), aux, auxLen);
+        } else if (! translateReadGroupFromSAM) {
             memcpy(bam->firstAux(), aux, auxLen);
         } else {
             // hack, build just RG field from SAM opt field
@@ -797,22 +980,46 @@ BAMFormat::writeRead(
         }
     }
     // RG
-    if (read->getReadGroup() != NULL && read->getReadGroup() != READ_GROUP_FROM_AUX) {
+    if (writeReadGroup) {
         BAMAlignAux* rg = (BAMAlignAux*) (auxLen + (char*) bam->firstAux());
         rg->tag[0] = 'R'; rg->tag[1] = 'G'; rg->val_type = 'Z';
         strcpy((char*) rg->value(), read->getReadGroup());
         auxLen += (unsigned) rg->size();
     }
     // PG
-    BAMAlignAux* pg = (BAMAlignAux*) (auxLen + (char*) bam->firstAux());
-    pg->tag[0] = 'P'; pg->tag[1] = 'G'; pg->val_type = 'Z';
-    strcpy((char*) pg->value(), "SNAP");
-    auxLen += (unsigned) pg->size();
+    if (writeProgram) {
+        BAMAlignAux* pg = (BAMAlignAux*) (auxLen + (char*) bam->firstAux());
+        pg->tag[0] = 'P'; pg->tag[1] = 'G'; pg->val_type = 'Z';
+        strcpy((char*) pg->value(), "SNAP");
+        auxLen += (unsigned) pg->size();
+    }
     // NM
-    BAMAlignAux* nm = (BAMAlignAux*) (auxLen + (char*) bam->firstAux());
-    nm->tag[0] = 'N'; nm->tag[1] = 'M'; nm->val_type = 'C';
-    *(_uint8*)nm->value() = (_uint8)editDistance;
-    auxLen += (unsigned) nm->size();
+    if (writeEditDistance) {
+        BAMAlignAux* nm = (BAMAlignAux*) (auxLen + (char*) bam->firstAux());
+        nm->tag[0] = 'N'; nm->tag[1] = 'M';
+        if (editDistance > 255) {
+            nm->val_type = 'I';
+            *(_uint32*)nm->value() = (_uint32)editDistance;
+        } else {
+            nm->val_type = 'C';
+            *(_uint8*)nm->value() = (_uint8)editDistance;
+        }
+        auxLen += (unsigned) nm->size();
+    }
+    // XS
+    if (writeStrand) {
+        BAMAlignAux* xs = (BAMAlignAux*) (auxLen + (char*) bam->firstAux());
+        xs->tag[0] = 'X'; xs->tag[1] = 'S'; xs->val_type = 'A';
+        *(char*)xs->value() = splice->strand;
+        auxLen += (unsigned) xs->size();
+    }
+    // SA
+    if (writeOtherAlignment) {
+        BAMAlignAux* sa = (BAMAlignAux*) (auxLen + (char*) bam->firstAux());
+        sa->tag[0] = 'S'; sa->tag[1] = 'A'; sa->val_type = 'Z';
+        strcpy((char*) sa->value(), split->otherAlignment);
+        auxLen += (unsigned) sa->size();
+    }
 
     if (NULL != spaceUsed) {
         *spaceUsed = bamSize;
@@ -837,10 +1044,11 @@ BAMFormat::computeCigarOps(
     unsigned                    extraBasesClippedAfter,
     unsigned                    frontHardClipping,
     unsigned                    backHardClipping,
-    unsigned                    genomeLocation,
+    GenomeLocation              genomeLocation,
     bool                        isRC,
 	bool						useM,
-    int *                       editDistance
+    int *                       editDistance,
+    const SpliceJunction *      splice
 )
 {
     //
@@ -853,23 +1061,29 @@ BAMFormat::computeCigarOps(
     unsigned clippingWordsBefore = ((basesClippedBefore + extraBasesClippedBefore > 0) ? 1 : 0) + ((frontHardClipping > 0) ? 1 : 0);
     unsigned clippingWordsAfter = ((basesClippedAfter + extraBasesClippedAfter > 0) ? 1 : 0) + ((backHardClipping > 0) ? 1 : 0);
 
-    const char *reference = genome->getSubstring(genomeLocation, dataLength);
     int used;
-    if (NULL != reference) {
+    if (NULL != splice && 0 == extraBasesClippedBefore && 0 == extraBasesClippedAfter) {
+        *editDistance = computeSplicedCigarOps(genome, lv, cigarBuf + 4 * clippingWordsBefore, cigarBufLen - 4 * (clippingWordsBefore + clippingWordsAfter),
+                            data, dataLength, genomeLocation, splice, useM, &used);
+    } else {
+        char referenceBuffer[MAX_READ_LENGTH + MAX_READ_LENGTH / 4 + 2 * MAX_K];   // Only used if the genome is packed; room for TextLengthForPattern
+        unsigned referenceLength = SAMFormat::referenceLengthForCigar(genome, genomeLocation, dataLength);
+        const char *reference = genome->getSubstring(genomeLocation, referenceLength, referenceBuffer, sizeof(referenceBuffer));
+        if (NULL == reference) {
+            //
+            // Fell off the end of the chromosome.
+            //
+            return 0;
+        }
         *editDistance = lv->computeEditDistanceNormalized(
                             reference,
-                            dataLength - extraBasesClippedAfter,
+                            referenceLength - extraBasesClippedAfter,
                             data,
                             dataLength - extraBasesClippedAfter,
                             MAX_K - 1,
                             cigarBuf + 4 * clippingWordsBefore,
                             cigarBufLen - 4 * (clippingWordsBefore + clippingWordsAfter),
 						    useM, BAM_CIGAR_OPS, &used);
-    } else {
-        //
-        // Fell off the end of the chromosome.
-        //
-        return 0;
     }
 
     if (*editDistance == -2) {
@@ -908,6 +1122,70 @@ BAMFormat::computeCigarOps(
     }
 }
 
+//
+// The CIGAR ops for a spliced read, as SAMFormat::computeSplicedCigar makes its string.  Returns the edit distance (or
+// -1 or -2 as LV would), and the bytes of ops in used.
+//
+    int
+BAMFormat::computeSplicedCigarOps(
+    const Genome *              genome,
+    LandauVishkinWithCigar *    lv,
+    char *                      cigarBuf,
+    int                         cigarBufLen,
+    const char *                data,
+    unsigned                    dataLength,
+    GenomeLocation              genomeLocation,
+    const SpliceJunction *      splice,
+    bool                        useM,
+    int *                       used)
+{
+    *used = 0;
+    if (splice->readOffset == 0 || splice->readOffset >= dataLength || splice->secondLocation <= genomeLocation) {
+        return -1;
+    }
+
+    char referenceBuffer[MAX_READ_LENGTH + MAX_READ_LENGTH / 4 + 2 * MAX_K];
+    unsigned firstLength = splice->readOffset;
+    unsigned firstReferenceLength = __min(SAMFormat::referenceLengthForCigar(genome, genomeLocation, firstLength), splice->secondLocation - genomeLocation);
+    const char *reference = genome->getSubstring(genomeLocation, firstReferenceLength, referenceBuffer, sizeof(referenceBuffer));
+    if (NULL == reference) {
+        return -1;
+    }
+    int firstUsed;
+    int firstEditDistance = lv->computeEditDistanceNormalized(reference, firstReferenceLength, data, firstLength, MAX_K - 1,
+                                cigarBuf, cigarBufLen, useM, BAM_CIGAR_OPS, &firstUsed);
+    if (firstEditDistance < 0) {
+        return firstEditDistance;
+    }
+    if (firstUsed + 4 >= cigarBufLen) {
+        return -2;
+    }
+
+    unsigned firstReferenceBases = 0;
+    for (int i = 0; i < firstUsed / 4; i++) {
+        _uint32 op = ((_uint32 *)cigarBuf)[i];
+        firstReferenceBases += BAMAlignment::CigarCodeToRefBase[op & 0xf] * (op >> 4);
+    }
+    *(_uint32 *)(cigarBuf + firstUsed) = ((_uint32)(splice->secondLocation - genomeLocation - firstReferenceBases) << 4) | BAMAlignment::CigarToCode['N'];
+    firstUsed += 4;
+
+    unsigned secondLength = dataLength - firstLength;
+    unsigned secondReferenceLength = SAMFormat::referenceLengthForCigar(genome, splice->secondLocation, secondLength);
+    reference = genome->getSubstring(splice->secondLocation, secondReferenceLength, referenceBuffer, sizeof(referenceBuffer));
+    if (NULL == reference) {
+        return -1;
+    }
+    int secondUsed;
+    int secondEditDistance = lv->computeEditDistanceNormalized(reference, secondReferenceLength, data + firstLength, secondLength, MAX_K - 1,
+                                cigarBuf + firstUsed, cigarBufLen - firstUsed, useM, BAM_CIGAR_OPS, &secondUsed);
+    if (secondEditDistance < 0) {
+        return secondEditDistance;
+    }
+
+    *used = firstUsed + secondUsed;
+    return firstEditDistance + secondEditDistance;
+}
+
 class BAMFilter : public DataWriter::Filter
 {
 public:
@@ -918,7 +1196,7 @@ public:
 	virtual void inHeader(bool flag)
 	{ header = flag; }
 
-    virtual void onAdvance(DataWriter* writer, size_t batchOffset, char* data, unsigned bytes, unsigned location);
+    virtual void onAdvance(DataWriter* writer, size_t batchOffset, char* data, unsigned bytes, GenomeLocation location);
 
     virtual size_t onNextBatch(DataWriter* writer, size_t offset, size_t bytes);
 
@@ -967,7 +1245,7 @@ BAMFilter::onAdvance(
     size_t batchOffset,
     char* data,
     unsigned bytes,
-    unsigned location)
+    GenomeLocation location)
 {
     if (! header) {
         offsets.push_back(batchOffset);
@@ -1054,7 +1332,7 @@ struct DuplicateReadKey
     DuplicateReadKey(const BAMAlignment* bam, const Genome* genome)
     {
         if (bam == NULL) {
-            locations[0] = locations[1] = UINT32_MAX;
+            locations[0] = locations[1] = InvalidGenomeLocation;
             isRC[0] = isRC[1] = false;
         } else {
             locations[0] = bam->getLocation(genome);
@@ -1062,7 +1340,7 @@ struct DuplicateReadKey
             isRC[0] = (bam->FLAG & SAM_REVERSE_COMPLEMENT) != 0;
             isRC[1] = (bam->FLAG & SAM_NEXT_REVERSED) != 0;
             if (((((_uint64) locations[0]) << 1) | (isRC[0] ? 1 : 0)) > ((((_uint64) locations[1]) << 1) | (isRC[1] ? 1 : 0))) {
-                const unsigned t = locations[1];
+                const GenomeLocation t = locations[1];
                 locations[1] = locations[0];
                 locations[0] = t;
                 const bool f = isRC[1];
@@ -1097,313 +1375,1613 @@ struct DuplicateReadKey
     DuplicateReadKey(int x)
     { locations[0] = locations[1] = x; isRC[0] = isRC[1] = false; }
     bool operator==(int x) const
-    { return locations[0] == (_uint32) x && locations[1] == (_uint32) x; }
+    { return locations[0] == (GenomeLocation) x && locations[1] == (GenomeLocation) x; }
     bool operator!=(int x) const
-    { return locations[0] != (_uint32) x || locations[1] != (_uint32) x; }
-    operator _uint64()
-    { return ((_uint64) (locations[1] ^ (isRC[1] ? 1 : 0))) << 32 | (_uint64) (locations[0] ^ (isRC[0] ? 1 : 0)); }
+    { return locations[0] != (GenomeLocation) x || locations[1] != (GenomeLocation) x; }
+    operator _uint64()  // just a hash with long locations
+    { return ((_uint64) (locations[1] ^ (isRC[1] ? 1 : 0))) << 32 ^ (_uint64) (locations[0] ^ (isRC[0] ? 1 : 0)); }
 
-    unsigned locations[2];
+    GenomeLocation locations[2];
     bool isRC[2];
 };
 
-struct DuplicateMateInfo
+    static _uint64
+HashReadId(
+    const char* id)
 {
-    DuplicateMateInfo() { memset(this, 0, sizeof(DuplicateMateInfo)); }
+    // FNV-1a of the part of the ID that readIdsMatch compares, terminator included
+    _uint64 hash = 0xcbf29ce484222325ULL;
+    for (const char* p = id; ; p++) {
+        hash = (hash ^ (_uint8) *p) * 0x100000001b3ULL;
+        if (*p == 0 || *p == ' ' || *p == '/') {
+            return hash;
+        }
+    }
+}
 
-    size_t firstRunOffset; // first read in duplicate set
-    size_t firstRunEndOffset;
-    size_t bestReadOffset[4]; // file offsets of first/second/new first/old second best reads
-    int bestReadQuality[2]; // total quality of first/both best reads
-    char bestReadId[120];
+//
+// The duplicate markers remember something about each pair whose first end was in a run until they get to the run with its
+// second end.  If the second end isn't in a run they never look for it, so every so often the entries whose second end would
+// have been before doneLocation are dropped.  If that still leaves more than MaxPendingDuplicateMates (which takes lots of
+// long inserts or chimeric pairs) the ones with their second ends farthest ahead go too, and those second ends are then
+// marked on their own, as though their first ends hadn't been in a run.
+//
+static const int MaxPendingDuplicateMates = 1 << 20;
+
+    static GenomeLocation
+DuplicateMateLocation(
+    const DuplicateReadKey& key)
+{
+    // an unmapped mate is placed with the mapped one
+    return key.locations[1] != InvalidGenomeLocation ? key.locations[1] : key.locations[0];
+}
 
-    void setBestReadId(const char* id) { strncpy(bestReadId, id, sizeof(bestReadId)); }
-    const char* getBestReadId() { return bestReadId; }
-};
+template<class Map>
+    static void
+PruneDuplicateMates(
+    Map* map,
+    GenomeLocation doneLocation,
+    int* io_sizeAtLastPrune)
+{
+    // only look when the map has doubled, so that it's amortized
+    if (map->size() <= 2 * *io_sizeAtLastPrune + 1024) {
+        return;
+    }
+    VariableSizeVector<DuplicateReadKey> gone;
+    VariableSizeVector<GenomeLocation> pending;
+    for (typename Map::iterator i = map->begin(); i != map->end(); i = map->next(i)) {
+        GenomeLocation mateLocation = DuplicateMateLocation(i->key);
+        if (mateLocation < doneLocation) {
+            gone.push_back(i->key);
+        } else {
+            pending.push_back(mateLocation);
+        }
+    }
+    if (pending.size() > MaxPendingDuplicateMates) {
+        // keep half, so this doesn't happen again right away
+        GenomeLocation* middle = pending.begin() + MaxPendingDuplicateMates / 2;
+        std::nth_element(pending.begin(), middle, pending.end());
+        GenomeLocation limit = *middle;
+        for (typename Map::iterator i = map->begin(); i != map->end(); i = map->next(i)) {
+            if (DuplicateMateLocation(i->key) > limit) {
+                gone.push_back(i->key);
+            }
+        }
+    }
+    for (int i = 0; i < gone.size(); i++) {
+        map->erase(gone[i]);
+    }
+    *io_sizeAtLastPrune = map->size();
+}
 
-class BAMDupMarkFilter : public BAMFilter
+//
+// Counts of duplicates for the summary at the end, by fragment or pair (the left end stands for the pair), as Picard counts
+// them.  Optical duplicates are ones within opticalDistance pixels in both x and y of another in the set on the same tile of
+// the flowcell, which comes from Illumina read names (instrument:lane:tile:x:y or
+// instrument:run:flowcell:lane:tile:x:y).  Reads are added a run at a time, and the sets counted when the run is done.
+//
+class DuplicateStats
 {
 public:
-    BAMDupMarkFilter(const Genome* i_genome) :
-        BAMFilter(DataWriter::ModifyFilter),
-        genome(i_genome), runOffset(0), runLocation(UINT32_MAX), runCount(0), mates()
-    {}
+    DuplicateStats(int i_opticalDistance = 0) : opticalDistance(i_opticalDistance), duplicates(0), opticalDuplicates(0) {}
 
-    ~BAMDupMarkFilter()
+    void setOpticalDistance(int i_opticalDistance) { opticalDistance = i_opticalDistance; }
+
+    // reads in sets of one are fine, they just don't count
+    void addRead(const DuplicateReadKey& key, const BAMAlignment* bam);
+
+    void countSets();
+
+    void add(const DuplicateStats& other)
     {
-#ifdef USE_DEVTEAM_OPTIONS
-        if (mates.size() > 0) {
-            fprintf(stderr, "duplicate matching ended with %d unmatched reads:\n", mates.size());
-            for (MateMap::iterator i = mates.begin(); i != mates.end(); i = mates.next(i)) {
-                fprintf(stderr, "%u%s/%u%s\n", i->key.locations[0], i->key.isRC[0] ? "rc" : "", i->key.locations[1], i->key.isRC[1] ? "rc" : "");
-            }
-        }
-#endif
+        duplicates += other.duplicates;
+        opticalDuplicates += other.opticalDuplicates;
     }
 
-    static bool isDuplicate(const BAMAlignment* a, const BAMAlignment* b)
-    { return a->pos == b->pos && a->refID == b->refID &&
-        ((a->FLAG ^ b->FLAG) & (SAM_REVERSE_COMPLEMENT | SAM_NEXT_REVERSED)) == 0; }
-
-protected:
-    virtual void onRead(BAMAlignment* bam, size_t fileOffset, int batchIndex);
+    _int64 getDuplicates() const { return duplicates; }
+    _int64 getOpticalDuplicates() const { return opticalDuplicates; }
 
 private:
-    static int getTotalQuality(BAMAlignment* bam);
+    struct SetRead
+    {
+        DuplicateReadKey    key;
+        _uint64             tile; // hash of the name up to the tile, or 0 if it didn't parse
+        int                 x, y;
+    };
 
-    const Genome* genome;
-    size_t runOffset; // offset in file of first read in run
-    _uint32 runLocation; // location in genome
-    int runCount; // number of aligned reads
-    typedef VariableSizeMap<DuplicateReadKey,DuplicateMateInfo,150,MapNumericHash<DuplicateReadKey>,70,0,-2> MateMap;
-    static const _uint64 RunKey = 0xffffffffc0000000UL;
-    static const _uint64 RunRC = 0x80000000;
-    static const _uint64 RunNextRC = 0x40000000;
-    static const _uint64 RunOffset = 0x3fffffff;
-    typedef VariableSizeVector<_uint64> RunVector;
-    RunVector run;
-    MateMap mates;
+    static bool keyLess(const SetRead& a, const SetRead& b)
+    { return a.key < b.key; }
+
+    static bool tileLess(const SetRead& a, const SetRead& b)
+    { return a.tile < b.tile || (a.tile == b.tile && a.x < b.x); }
+
+    static bool parseTileLocation(const char* id, _uint64* o_tile, int* o_x, int* o_y);
+
+    int countOptical(SetRead* begin, SetRead* end);
+
+    int opticalDistance;
+    _int64 duplicates;
+    _int64 opticalDuplicates;
+    VariableSizeVector<SetRead> reads;
 };
 
     void
-BAMDupMarkFilter::onRead(BAMAlignment* lastBam, size_t lastOffset, int)
+DuplicateStats::addRead(
+    const DuplicateReadKey& key,
+    const BAMAlignment* bam)
 {
-    if ((lastBam->FLAG & SAM_SECONDARY) != 0) {
-        return; // ignore secondary aliignments; todo: mark them as dups too?
+    if ((bam->FLAG & SAM_UNMAPPED) != 0) {
+        return;
     }
-    unsigned location = lastBam->getLocation(genome);
-    unsigned nextLocation = lastBam->getNextLocation(genome);
-    unsigned logicalLocation = location != UINT32_MAX ? location : nextLocation;
-    if (logicalLocation == UINT32_MAX) {
+    // use the left end of pairs, or the first if both are at the same place
+    if ((bam->FLAG & SAM_MULTI_SEGMENT) != 0 && (bam->FLAG & SAM_NEXT_UNMAPPED) == 0 &&
+        (bam->refID > bam->next_refID || (bam->refID == bam->next_refID &&
+            (bam->pos > bam->next_pos || (bam->pos == bam->next_pos && (bam->FLAG & SAM_FIRST_SEGMENT) == 0))))) {
         return;
     }
-    if (logicalLocation == runLocation) {
-        runCount++;
-    } else {
-        // if there was more than one read with same location, then analyze the run
-        if (runCount > 1) {
-            // partition by duplicate key, find best read in each partition
-            size_t offset = runOffset;
-            run.clear();
-            // sort run by other coordinate & RC flags to get sub-runs
-            for (BAMAlignment* record = getRead(offset); record != NULL && record != lastBam; record = getNextRead(record, &offset)) {
-                // use opposite of logical location to sort records
-                _uint64 entry = record->getLocation(genome) == UINT32_MAX
-                    ? (((_uint64) UINT32_MAX) << 32) |
-                        ((record->FLAG & SAM_REVERSE_COMPLEMENT) ? RunNextRC : 0) |
-                        ((record->FLAG & SAM_NEXT_REVERSED) ? RunRC : 0)
-                    : (((_uint64) record->getNextLocation(genome)) << 32) |
-                        ((record->FLAG & SAM_REVERSE_COMPLEMENT) ? RunRC : 0) |
-                        ((record->FLAG & SAM_NEXT_REVERSED) ? RunNextRC : 0);
-                entry |= (_uint64) ((offset - runOffset) & RunOffset);
-                _ASSERT(offset - runOffset <= RunOffset);
-                run.push_back(entry);
-            }
-			if (run.size() == 0) {
-				goto done; // todo: handle runs > n buffers (but should be rare!)
-			}
-            // ensure that adjacent half-mapped pairs stay together
-            std::stable_sort(run.begin(), run.end());
-            bool foundRun = false;
-            for (RunVector::iterator i = run.begin(); i != run.end(); i++) {
-                // skip singletons
-                if ((i == run.begin() || (*i & RunKey) != (*(i-1) & RunKey)) &&
-                    (i + 1 == run.end() || (*i & RunKey) != (*(i+1) & RunKey))) {
-                    continue;
-                }
-                offset = runOffset + (*i & RunOffset);
-                BAMAlignment* record = getRead(offset);
-                _ASSERT(record->refID >= -1 && record->refID < genome->getNumContigs()); // simple sanity check
-                // skip adjacent half-mapped pairs, they're not really runs
-                if (i + 1 < run.end() && readIdsMatch(record->read_name(), getRead(runOffset + (*(i+1) & RunOffset))->read_name())) {
-                    i++;
-                    continue;
-                }
-                foundRun = true;
-                DuplicateReadKey key(record, genome);
-                MateMap::iterator f = mates.find(key);
-                DuplicateMateInfo* info;
-                if (f == mates.end()) {
-                    mates.put(key, DuplicateMateInfo());
-                    info = &mates[key];
-                    //fprintf(stderr, "add %u%s/%u%s -> %d\n", key.locations[0], key.isRC[0] ? "rc" : "", key.locations[1], key.isRC[1] ? "rc" : "", mates.size());
-                    info->firstRunOffset = runOffset;
-                    info->firstRunEndOffset = lastOffset;
-                } else {
-                    info = &f->value;
-                }
-                int totalQuality = getTotalQuality(record);
-                size_t mateOffset = 0;
-                BAMAlignment* mate = NULL;
-                // optimize case for half-mapped pairs with adjacent reads
-                mate = tryFindRead(info->firstRunOffset, info->firstRunEndOffset, record->read_name(), &mateOffset);
-                if (mate == record) {
-                    mate = NULL;
-                }
-                bool isSecond = mate != NULL;
-                if (isSecond) {
-                    totalQuality += getTotalQuality(mate);
-                }
-                if (totalQuality > info->bestReadQuality[isSecond]) {
-                    info->bestReadQuality[isSecond] = totalQuality;
-                    info->bestReadOffset[isSecond] = offset;
-                    if (isSecond) {
-                        info->bestReadOffset[2] = mateOffset;
-                    }
-                    info->setBestReadId(record->read_name());
-                }
-                if (isSecond && readIdsMatch(info->getBestReadId(), record->read_name())) {
-                    info->bestReadOffset[3] = offset;
-                }
-            }
-            if (! foundRun) {
-                goto done; // avoid useless looping
-            }
-            // go back and adjust flags
-            offset = runOffset;
-            VariableSizeVector<DuplicateMateInfo*>* failedBackpatch = NULL;
-            for (RunVector::iterator i = run.begin(); i != run.end(); i++) {
-                // skip singletons
-                if ((i == run.begin() || (*i & RunKey) != (*(i-1) & RunKey)) &&
-                    (i + 1 == run.end() || (*i & RunKey) != (*(i+1) & RunKey))) {
-                    continue;
-                }
-                offset = runOffset + (*i & RunOffset);
-                BAMAlignment* record = getRead(offset);
-                if (i + 1 < run.end() && readIdsMatch(record->read_name(), getRead(runOffset + (*(i+1) & RunOffset))->read_name())) {
-                    i++;
-                    continue;
-                }
-                DuplicateReadKey key(record, genome);
-                MateMap::iterator m = mates.find(key);
-                if (m == mates.end()) {
-                    continue; // one end in a run, other not
-                }
-                DuplicateMateInfo* minfo = &m->value;
-                bool pass = minfo->bestReadQuality[1] != 0; // 1 for second pass, 0 for first pass
-                bool isSecond = minfo->firstRunOffset != runOffset;
-                static const int index[2][2] = {{0, 3}, {2, 1}};
-                if (offset != minfo->bestReadOffset[index[pass][isSecond]]) {
-                    // Picard markDuplicates will not mark unmapped reads
-                    if ((record->FLAG & SAM_UNMAPPED) == 0) {
-                        record->FLAG |= SAM_DUPLICATE;
-                    }
-                } else if (pass == 1 && minfo->bestReadOffset[2] != 0 && minfo->bestReadOffset[0] != 0 && minfo->bestReadOffset[2] != minfo->bestReadOffset[0]) {
-                    // backpatch reads in first matelist if they're still in memory
-                    BAMAlignment* oldBest = getRead(minfo->bestReadOffset[0]);
-                    BAMAlignment* newBest = getRead(minfo->bestReadOffset[2]);
-                    if (oldBest != NULL && newBest != NULL) {
-                        oldBest->FLAG &= ~SAM_DUPLICATE;
-                        newBest->FLAG |= SAM_DUPLICATE;
-                    } else {
-                        if (failedBackpatch == NULL) {
-                            failedBackpatch = new VariableSizeVector<DuplicateMateInfo*>();
-                        }
-                        failedBackpatch->push_back(minfo);
-                    }
-                }
-            }
+    SetRead read;
+    read.key = key;
+    if (opticalDistance <= 0 || ! parseTileLocation(bam->read_name(), &read.tile, &read.x, &read.y)) {
+        read.tile = 0;
+        read.x = read.y = 0;
+    }
+    reads.push_back(read);
+}
 
-            // fixup any that failed
-            if (failedBackpatch != NULL) {
-                for (VariableSizeVector<DuplicateMateInfo*>::iterator i = failedBackpatch->begin(); i != failedBackpatch->end(); i++) {
-                    // couldn't go back and patch first set to have correct best for second set
-                    // so patch second set to have same best as first set even though it's not really the best
-                    BAMAlignment* trueBestSecond = getRead((*i)->bestReadOffset[1]);
-                    BAMAlignment* firstBestSecond = getRead((*i)->bestReadOffset[3]);
-                    _ASSERT(trueBestSecond != NULL && firstBestSecond != NULL);
-                    if (trueBestSecond != NULL && firstBestSecond != NULL) {
-                        trueBestSecond->FLAG &= ~SAM_DUPLICATE;
-                        firstBestSecond->FLAG |= ~SAM_DUPLICATE;
-                    }
-                }
-            }
+    void
+DuplicateStats::countSets()
+{
+    std::stable_sort(reads.begin(), reads.end(), keyLess);
+    for (SetRead* set = reads.begin(); set < reads.end(); ) {
+        SetRead* setEnd = set + 1;
+        while (setEnd < reads.end() && setEnd->key == set->key) {
+            setEnd++;
+        }
+        duplicates += setEnd - set - 1;
+        if (setEnd - set > 1 && opticalDistance > 0) {
+            opticalDuplicates += countOptical(set, setEnd);
+        }
+        set = setEnd;
+    }
+    reads.clear();
+}
 
-            // clean up
-            for (RunVector::iterator i = run.begin(); i != run.end(); i++) {
-                // skip singletons
-                if ((i == run.begin() || (*i & RunKey) != (*(i-1) & RunKey)) &&
-                    (i + 1 == run.end() || (*i & RunKey) != (*(i+1) & RunKey))) {
-                    continue;
-                }
-                offset = runOffset + (*i & RunOffset);
-                BAMAlignment* record = getRead(offset);
-                if (i + 1 < run.end() && readIdsMatch(record->read_name(), getRead(runOffset + (*(i+1) & RunOffset))->read_name())) {
-                    i++;
-                    continue;
-                }
-                DuplicateReadKey key(record, genome);
-                MateMap::iterator m = mates.find(key);
-                if (m != mates.end() && m->value.firstRunOffset != runOffset) {
-                    mates.erase(key);
-                    //fprintf(stderr, "erase %u%s/%u%s -> %d\n", key.locations[0], key.isRC[0] ? "rc" : "", key.locations[1], key.isRC[1] ? "rc" : "", mates.size());
-                }
+    bool
+DuplicateStats::parseTileLocation(
+    const char* id,
+    _uint64* o_tile,
+    int* o_x,
+    int* o_y)
+{
+    const char* colons[7];
+    int nColons = 0;
+    const char* p;
+    for (p = id; *p != 0 && *p != ' ' && *p != '/' && *p != '#'; p++) {
+        if (*p == ':') {
+            if (nColons == 7) {
+                return false;
             }
+            colons[nColons++] = p;
         }
-done:
-        runLocation = logicalLocation;
-        runOffset = lastOffset;
-        runCount = 1;
     }
-    // todo: preserve this across batches - need to block-copy entire memory for reads
+    if (nColons != 4 && nColons != 6) {
+        return false;
+    }
+    const char* x = colons[nColons - 2] + 1;
+    const char* y = colons[nColons - 1] + 1;
+    if (x == colons[nColons - 1] || y == p) {
+        return false;
+    }
+    *o_x = *o_y = 0;
+    for (const char* q = x; q < colons[nColons - 1]; q++) {
+        if (*q < '0' || *q > '9') {
+            return false;
+        }
+        *o_x = *o_x * 10 + (*q - '0');
+    }
+    for (const char* q = y; q < p; q++) {
+        if (*q < '0' || *q > '9') {
+            return false;
+        }
+        *o_y = *o_y * 10 + (*q - '0');
+    }
+    // FNV-1a of everything through the tile, which takes in the lane (and flowcell)
+    _uint64 hash = 0xcbf29ce484222325ULL;
+    for (const char* q = id; q < x; q++) {
+        hash = (hash ^ (_uint8) *q) * 0x100000001b3ULL;
+    }
+    *o_tile = hash | 1; // never 0
+    return true;
 }
 
     int
-BAMDupMarkFilter::getTotalQuality(
-    BAMAlignment* bam)
+DuplicateStats::countOptical(
+    SetRead* begin,
+    SetRead* end)
 {
-    int result = 0;
-    _uint8* p = (_uint8*) bam->qual();
-    for (int i = 0; i < bam->l_seq; i++) {
-        int q = *p++;
-        result += (q != 255) * q; // avoid branch?
+    //
+    // Sort by tile and x, and count the reads that are close to one before them.  That leaves one read uncounted for each
+    // cluster of them, which is the one that's there for real.
+    //
+    std::sort(begin, end, tileLess);
+    int n = 0;
+    for (SetRead* r = begin + 1; r < end; r++) {
+        if (r->tile == 0) {
+            continue;
+        }
+        for (SetRead* s = r; s > begin && (s - 1)->tile == r->tile && r->x - (s - 1)->x <= opticalDistance; s--) {
+            if (abs(r->y - (s - 1)->y) <= opticalDistance) {
+                n++;
+                break;
+            }
+        }
     }
-    return result;
+    return n;
 }
 
-class BAMDupMarkSupplier : public DataWriter::FilterSupplier
+//
+// Picks the reads to keep among the duplicates at one location, the same way whether the serial filter or the parallel merge
+// is looking at them, so that both mark the same reads.  A run of reads at the same (logical) location is split into
+// sub-runs with the same other location and orientations, and the reads in sub-runs of more than one (not counting
+// adjacent half-mapped pairs) are the candidates.  Then, a key at a time:
+//
+// - When both ends are in the same run (or the other end is unmapped and placed with this one), the pair with the best total
+//   quality is kept.
+// - Otherwise the first ends keep their best read (the first of them in order, for ties), and the second ends keep its mate,
+//   or their own best if the first end didn't keep one of theirs, such as when it wasn't in a run at all.
+//
+// So both ends of a pair always get the same flag.
+//
+class DuplicateRunMarker
 {
 public:
-    BAMDupMarkSupplier(const Genome* i_genome) :
-        FilterSupplier(DataWriter::ReadFilter), genome(i_genome) {}
+    struct Candidate
+    {
+        DuplicateReadKey    key;
+        BAMAlignment*       record; // only good while its run is in memory
+        size_t              offset; // of the record in its merge range's buffer, for the parallel merge
+        int                 group; // sub-run it's in
+        int                 quality;
+        _uint64             idHash;
+        _uint16             flag;
+        GenomeLocation      location; // logical location of its run
+        GenomeLocation      otherLocation; // and of the run with the other end
+    };
+    typedef VariableSizeVector<Candidate> CandidateVector;
 
-    virtual DataWriter::Filter* getFilter()
-    { return new BAMDupMarkFilter(genome); }
+    // what's remembered about the read that the first ends kept, until the second ends' run
+    struct KeptRead
+    {
+        DuplicateReadKey    key;
+        _uint64             idHash;
+        _uint16             flag;
+    };
+    typedef VariableSizeMap<DuplicateReadKey,KeptRead,150,MapNumericHash<DuplicateReadKey>,70,0> KeptMap;
 
-    virtual void onClosing(DataWriterSupplier* supplier) {}
-    virtual void onClosed(DataWriterSupplier* supplier) {}
+    typedef VariableSizeVector<_uint64> RunVector;
 
-private:
-    const Genome* genome;
-};
+    // add the candidates from the nRecords reads of a run (in order) to candidates, which keeps them in order
+    static void addRunCandidates(const Genome* genome, BAMAlignment** records, const size_t* offsets, int nRecords,
+        GenomeLocation runLocation, RunVector* run, CandidateVector* candidates, int* io_group);
 
-    DataWriter::FilterSupplier*
-DataWriterSupplier::markDuplicates(const Genome* genome)
-{
-    return new BAMDupMarkSupplier(genome);
-}
+    static bool isFirstEnd(const Candidate& c)
+    { return c.location < c.otherLocation; }
 
-class BAMIndexSupplier;
+    // for a key with both ends in the run
+    static void markPairs(Candidate* begin, Candidate* end, CandidateVector* scratch);
 
-class BAMIndexFilter : public BAMFilter
-{
-public:
-    BAMIndexFilter(BAMIndexSupplier* i_supplier)
-        : BAMFilter(DataWriter::ReadFilter), supplier(i_supplier) {}
+    // for a key's first ends, returns the one kept
+    static KeptRead markFirstEnds(Candidate* begin, Candidate* end);
 
-protected:
-    virtual void onRead(BAMAlignment* bam, size_t fileOffset, int batchIndex);
+    // for a key's second ends, given what the first ends kept, or NULL
+    static void markSecondEnds(Candidate* begin, Candidate* end, const KeptRead* kept);
+
+    static bool candidateKeyLess(const Candidate& a, const Candidate& b)
+    { return a.key < b.key; }
+
+    static int getTotalQuality(BAMAlignment* bam);
 
 private:
-    BAMIndexSupplier* supplier;
+    // a run entry is the other location above the RC flags and the index, which get what the location leaves
+    static const unsigned RunLocationShift = 64 - GenomeLocationBits;
+    static const _uint64 RunRC = (_uint64) 1 << (RunLocationShift - 1);
+    static const _uint64 RunNextRC = (_uint64) 1 << (RunLocationShift - 2);
+    static const _uint64 RunIndex = RunNextRC - 1;
+    static const _uint64 RunKey = ~RunIndex;
+
+    static bool candidateIdLess(const Candidate& a, const Candidate& b)
+    { return a.idHash < b.idHash; }
+
+    // the same ID isn't enough, since sometimes reads that aren't mates have it
+    static bool isMate(_uint64 idHash0, _uint16 flag0, _uint64 idHash1, _uint16 flag1)
+    { return idHash0 == idHash1 && (flag0 & flag1 & SAM_MULTI_SEGMENT) != 0 && ((flag0 ^ flag1) & SAM_FIRST_SEGMENT) != 0; }
+
+    // first of the best quality, in order
+    static Candidate* bestCandidate(Candidate* begin, Candidate* end);
+
+    // mark all the (mapped) reads as duplicates except keep1 and keep2
+    static void markAllBut(Candidate* begin, Candidate* end, const BAMAlignment* keep1, const BAMAlignment* keep2 = NULL);
 };
 
-class BAMIndexSupplier : public DataWriter::FilterSupplier
-{
+    void
+DuplicateRunMarker::addRunCandidates(
+    const Genome* genome,
+    BAMAlignment** records,
+    const size_t* offsets,
+    int nRecords,
+    GenomeLocation runLocation,
+    RunVector* run,
+    CandidateVector* candidates,
+    int* io_group)
+{
+    //
+    // Sort the run by other coordinate and RC flags to get the sub-runs, keeping adjacent half-mapped pairs together.
+    //
+    run->clear();
+    for (int i = 0; i < nRecords; i++) {
+        BAMAlignment* record = records[i];
+        // use opposite of logical location to sort records
+        _uint64 entry = record->getLocation(genome) == InvalidGenomeLocation
+            ? (((_uint64) InvalidGenomeLocation) << RunLocationShift) |
+                ((record->FLAG & SAM_REVERSE_COMPLEMENT) ? RunNextRC : 0) |
+                ((record->FLAG & SAM_NEXT_REVERSED) ? RunRC : 0)
+            : (((_uint64) record->getNextLocation(genome)) << RunLocationShift) |
+                ((record->FLAG & SAM_REVERSE_COMPLEMENT) ? RunRC : 0) |
+                ((record->FLAG & SAM_NEXT_REVERSED) ? RunNextRC : 0);
+        _ASSERT((_uint64) i <= RunIndex);
+        run->push_back(entry | (_uint64) i);
+    }
+    std::stable_sort(run->begin(), run->end());
+
+    _uint64 groupKey = 0;
+    for (RunVector::iterator i = run->begin(); i != run->end(); i++) {
+        // skip singletons
+        _uint64 runKey = *i & RunKey;
+        if ((i == run->begin() || runKey != (*(i-1) & RunKey)) &&
+            (i + 1 == run->end() || runKey != (*(i+1) & RunKey))) {
+            continue;
+        }
+        BAMAlignment* record = records[*i & RunIndex];
+        _ASSERT(record->refID >= -1 && record->refID < genome->getNumContigs()); // simple sanity check
+        // skip adjacent half-mapped pairs, they're not really runs
+        if (i + 1 < run->end() && readIdsMatch(record->read_name(), records[*(i+1) & RunIndex]->read_name())) {
+            i++;
+            continue;
+        }
+        if (i == run->begin() || runKey != groupKey) {
+            (*io_group)++;
+            groupKey = runKey;
+        }
+        Candidate candidate;
+        candidate.key = DuplicateReadKey(record, genome);
+        candidate.record = record;
+        candidate.offset = offsets != NULL ? offsets[*i & RunIndex] : 0;
+        candidate.group = *io_group;
+        candidate.quality = getTotalQuality(record);
+        candidate.idHash = HashReadId(record->read_name());
+        candidate.flag = record->FLAG;
+        candidate.location = runLocation;
+        candidate.otherLocation = candidate.key.locations[0] == runLocation ? candidate.key.locations[1] : candidate.key.locations[0];
+        if (candidate.otherLocation == InvalidGenomeLocation) {
+            candidate.otherLocation = runLocation;  // the unmapped end is placed with this one
+        }
+        candidates->push_back(candidate);
+    }
+}
+
+    DuplicateRunMarker::Candidate*
+DuplicateRunMarker::bestCandidate(
+    Candidate* begin,
+    Candidate* end)
+{
+    Candidate* best = begin;
+    for (Candidate* c = begin + 1; c < end; c++) {
+        if (c->quality > best->quality) {
+            best = c;
+        }
+    }
+    return best;
+}
+
+    void
+DuplicateRunMarker::markAllBut(
+    Candidate* begin,
+    Candidate* end,
+    const BAMAlignment* keep1,
+    const BAMAlignment* keep2)
+{
+    for (Candidate* c = begin; c < end; c++) {
+        // Picard markDuplicates will not mark unmapped reads
+        if (c->record != keep1 && c->record != keep2 && (c->record->FLAG & SAM_UNMAPPED) == 0) {
+            c->record->FLAG |= SAM_DUPLICATE;
+        }
+    }
+}
+
+    void
+DuplicateRunMarker::markPairs(
+    Candidate* begin,
+    Candidate* end,
+    CandidateVector* scratch)
+{
+    //
+    // Pair up the reads by ID and keep the pair with the best total quality.  If there aren't any pairs (which takes
+    // something odd, like a mate that was a secondary alignment), keep the best read of each sub-run.
+    //
+    scratch->clear();
+    for (Candidate* c = begin; c < end; c++) {
+        scratch->push_back(*c);
+    }
+    std::stable_sort(scratch->begin(), scratch->end(), candidateIdLess);
+    Candidate* bestPair = NULL;
+    for (Candidate* c = scratch->begin(); c + 1 < scratch->end(); c++) {
+        if (isMate(c->idHash, c->flag, (c + 1)->idHash, (c + 1)->flag)) {
+            if (bestPair == NULL || c->quality + (c + 1)->quality > bestPair->quality + (bestPair + 1)->quality) {
+                bestPair = c;
+            }
+            c++;
+        }
+    }
+    if (bestPair != NULL) {
+        markAllBut(begin, end, bestPair->record, (bestPair + 1)->record);
+        return;
+    }
+
+    for (Candidate* group = begin; group < end; ) {
+        Candidate* groupEnd = group + 1;
+        while (groupEnd < end && groupEnd->group == group->group) {
+            groupEnd++;
+        }
+        markAllBut(group, groupEnd, bestCandidate(group, groupEnd)->record);
+        group = groupEnd;
+    }
+}
+
+    DuplicateRunMarker::KeptRead
+DuplicateRunMarker::markFirstEnds(
+    Candidate* begin,
+    Candidate* end)
+{
+    Candidate* best = bestCandidate(begin, end);
+    markAllBut(begin, end, best->record);
+    KeptRead kept;
+    kept.key = best->key;
+    kept.idHash = best->idHash;
+    kept.flag = best->flag;
+    return kept;
+}
+
+    void
+DuplicateRunMarker::markSecondEnds(
+    Candidate* begin,
+    Candidate* end,
+    const KeptRead* kept)
+{
+    Candidate* keep = NULL;
+    if (kept != NULL) {
+        for (Candidate* c = begin; c < end && keep == NULL; c++) {
+            if (isMate(c->idHash, c->flag, kept->idHash, kept->flag)) {
+                keep = c;
+            }
+        }
+    }
+    if (keep == NULL) {
+        keep = bestCandidate(begin, end);
+    }
+    markAllBut(begin, end, keep->record);
+}
+
+    int
+DuplicateRunMarker::getTotalQuality(
+    BAMAlignment* bam)
+{
+    int result = 0;
+    _uint8* p = (_uint8*) bam->qual();
+    for (int i = 0; i < bam->l_seq; i++) {
+        int q = *p++;
+        result += (q != 255) * q; // avoid branch?
+    }
+    return result;
+}
+
+class BAMDupMarkFilter : public BAMFilter
+{
+public:
+    BAMDupMarkFilter(const Genome* i_genome, const volatile bool* i_markingRanges, DuplicateStats* i_stats) :
+        BAMFilter(DataWriter::ModifyFilter),
+        genome(i_genome), markingRanges(i_markingRanges), stats(i_stats), runOffset(0), runLocation(InvalidGenomeLocation), runCount(0),
+        kept(), keptAtLastPrune(0)
+    {}
+
+    ~BAMDupMarkFilter()
+    {
+#ifdef USE_DEVTEAM_OPTIONS
+        if (kept.size() > 0) {
+            fprintf(stderr, "duplicate matching ended with %d unmatched reads:\n", kept.size());
+            for (DuplicateRunMarker::KeptMap::iterator i = kept.begin(); i != kept.end(); i = kept.next(i)) {
+                fprintf(stderr, "%lld%s/%lld%s\n", (_int64) i->key.locations[0], i->key.isRC[0] ? "rc" : "", (_int64) i->key.locations[1], i->key.isRC[1] ? "rc" : "");
+            }
+        }
+#endif
+    }
+
+    static bool isDuplicate(const BAMAlignment* a, const BAMAlignment* b)
+    { return a->pos == b->pos && a->refID == b->refID &&
+        ((a->FLAG ^ b->FLAG) & (SAM_REVERSE_COMPLEMENT | SAM_NEXT_REVERSED)) == 0; }
+
+protected:
+    virtual void onRead(BAMAlignment* bam, size_t fileOffset, int batchIndex);
+
+private:
+    // mark the run of runRecords, all at runLocation
+    void markRun();
+
+    const Genome* genome;
+    const volatile bool* markingRanges; // the supplier is doing it a merge range at a time instead
+    DuplicateStats* stats; // the supplier's, since there's just the one writer
+    size_t runOffset; // offset in file of first read in run
+    GenomeLocation runLocation; // location in genome
+    int runCount; // number of aligned reads
+    VariableSizeVector<BAMAlignment*> runRecords;
+    DuplicateRunMarker::RunVector run;
+    DuplicateRunMarker::CandidateVector candidates;
+    DuplicateRunMarker::CandidateVector scratch;
+    DuplicateRunMarker::KeptMap kept; // what the first ends kept, for pairs whose second ends are still to come
+    int keptAtLastPrune;
+};
+
+    void
+BAMDupMarkFilter::onRead(BAMAlignment* lastBam, size_t lastOffset, int)
+{
+    if (*markingRanges) {
+        return;
+    }
+    if ((lastBam->FLAG & (SAM_SECONDARY | SAM_SUPPLEMENTARY)) != 0) {
+        return; // ignore secondary and supplementary aliignments; todo: mark them as dups too?
+    }
+    GenomeLocation location = lastBam->getLocation(genome);
+    GenomeLocation nextLocation = lastBam->getNextLocation(genome);
+    GenomeLocation logicalLocation = location != InvalidGenomeLocation ? location : nextLocation;
+    if (logicalLocation == InvalidGenomeLocation) {
+        return;
+    }
+    if (logicalLocation == runLocation) {
+        runCount++;
+    } else {
+        // if there was more than one read with same location, then analyze the run
+        if (runCount > 1) {
+            runRecords.clear();
+            size_t offset = runOffset;
+            for (BAMAlignment* record = getRead(offset); record != NULL && record != lastBam; record = getNextRead(record, &offset)) {
+                runRecords.push_back(record);
+            }
+            // todo: handle runs > n buffers (but should be rare!)
+            if (runRecords.size() > 0) {
+                markRun();
+            }
+        }
+        PruneDuplicateMates(&kept, logicalLocation, &keptAtLastPrune);
+        runLocation = logicalLocation;
+        runOffset = lastOffset;
+        runCount = 1;
+    }
+    // todo: preserve this across batches - need to block-copy entire memory for reads
+}
+
+    void
+BAMDupMarkFilter::markRun()
+{
+    candidates.clear();
+    int group = 0;
+    DuplicateRunMarker::addRunCandidates(genome, runRecords.begin(), NULL, runRecords.size(), runLocation, &run, &candidates, &group);
+
+    //
+    // Take the reads a key at a time.  Each key's reads are all first ends, all second ends, or all have both ends here.
+    //
+    std::stable_sort(candidates.begin(), candidates.end(), DuplicateRunMarker::candidateKeyLess);
+    for (DuplicateRunMarker::Candidate* c = candidates.begin(); c < candidates.end(); ) {
+        DuplicateRunMarker::Candidate* keyEnd = c + 1;
+        while (keyEnd < candidates.end() && keyEnd->key == c->key) {
+            keyEnd++;
+        }
+        for (DuplicateRunMarker::Candidate* d = c; d < keyEnd; d++) {
+            stats->addRead(d->key, d->record);
+        }
+        if (c->otherLocation == c->location) {
+            DuplicateRunMarker::markPairs(c, keyEnd, &scratch);
+        } else if (DuplicateRunMarker::isFirstEnd(*c)) {
+            kept.put(c->key, DuplicateRunMarker::markFirstEnds(c, keyEnd));
+        } else {
+            DuplicateRunMarker::markSecondEnds(c, keyEnd, kept.tryFind(c->key));
+            kept.erase(c->key);
+        }
+        c = keyEnd;
+    }
+    stats->countSets();
+}
+
+//
+// In the parallel merge of sorted output the supplier marks duplicates itself, a range of locations at a time, rather than
+// leaving it to its filters on the writing thread.  A run of reads at the same location never crosses ranges, so the merge
+// threads do everything they can within the range they merged, with the same rule the filter uses (see DuplicateRunMarker).
+// The second ends of pairs whose first ends were in an earlier range are left for the writing thread, which sees the ranges
+// in order, to keep the mate of whatever the first end kept.  The only state that crosses ranges is a table of those kept
+// reads (the duplicate key and a hash of the read ID), and it's pruned once their mates' ranges have gone by.
+//
+class BAMDupMarkSupplier : public DataWriter::FilterSupplier
+{
+public:
+    BAMDupMarkSupplier(const Genome* i_genome, int i_opticalDistance) :
+        FilterSupplier(DataWriter::ReadFilter), genome(i_genome), opticalDistance(i_opticalDistance), stats(i_opticalDistance),
+        markingRanges(false), ranges(NULL), nRanges(0), kept(), keptAtLastPrune(0) {}
+
+    virtual ~BAMDupMarkSupplier()
+    { delete [] ranges; }
+
+    virtual DataWriter::Filter* getFilter()
+    { return new BAMDupMarkFilter(genome, &markingRanges, &stats); }
+
+    virtual void onClosing(DataWriterSupplier* supplier) {}
+    virtual void onClosed(DataWriterSupplier* supplier);
+
+    virtual bool beginMergeRanges(int i_nRanges);
+    virtual void onRangeMerged(int range, char* records, const unsigned* lengths, int nRecords, _int64 beginLocation, _int64 endLocation);
+    virtual void onRangeWriting(int range, char* records, const unsigned* lengths, int nRecords);
+    virtual void endMergeRanges();
+
+private:
+    typedef DuplicateRunMarker::Candidate Candidate;
+    typedef DuplicateRunMarker::KeptRead KeptRead;
+
+    struct RangeState
+    {
+        RangeState() : endLocation(0) {}
+
+        DuplicateRunMarker::CandidateVector secondEnds; // for the writing thread, grouped by key
+        VariableSizeVector<KeptRead>    firstEnds; // kept reads whose mates are in a later range
+        _int64                          endLocation;
+        DuplicateStats                  stats; // for the sets in the range, added in when it's written
+    };
+
+    const Genome* genome;
+    const int opticalDistance;
+    DuplicateStats stats;
+    volatile bool markingRanges;
+    RangeState* ranges;
+    int nRanges;
+    DuplicateRunMarker::KeptMap kept; // the read kept for each key in firstEnds of a range that's been written
+    int keptAtLastPrune;
+};
+
+    bool
+BAMDupMarkSupplier::beginMergeRanges(
+    int i_nRanges)
+{
+    nRanges = i_nRanges;
+    ranges = new RangeState[nRanges];
+    for (int i = 0; i < nRanges; i++) {
+        ranges[i].stats.setOpticalDistance(opticalDistance);
+    }
+    markingRanges = true;
+    return true;
+}
+
+    void
+BAMDupMarkSupplier::onRangeMerged(
+    int range,
+    char* records,
+    const unsigned* lengths,
+    int nRecords,
+    _int64 beginLocation,
+    _int64 endLocation)
+{
+    RangeState* state = &ranges[range];
+    state->endLocation = endLocation;
+    if (nRecords == 0) {
+        return;
+    }
+
+    size_t* offsets = new size_t[nRecords];
+    BAMAlignment** bams = new BAMAlignment*[nRecords];
+    size_t offset = 0;
+    for (int i = 0; i < nRecords; i++) {
+        offsets[i] = offset;
+        bams[i] = (BAMAlignment*) (records + offset);
+        offset += lengths[i];
+    }
+
+    //
+    // Find the runs of reads at the same (logical) location, as BAMDupMarkFilter::onRead does, including the last one.
+    //
+    DuplicateRunMarker::CandidateVector candidates;
+    DuplicateRunMarker::RunVector run;
+    int group = 0;
+    GenomeLocation runLocation = InvalidGenomeLocation;
+    int runStart = 0;
+    int runCount = 0;
+    for (int i = 0; i <= nRecords; i++) {
+        GenomeLocation logicalLocation = InvalidGenomeLocation;
+        if (i < nRecords) {
+            BAMAlignment* bam = bams[i];
+            if ((bam->FLAG & (SAM_SECONDARY | SAM_SUPPLEMENTARY)) != 0) {
+                continue;
+            }
+            GenomeLocation location = bam->getLocation(genome);
+            logicalLocation = location != InvalidGenomeLocation ? location : bam->getNextLocation(genome);
+            if (logicalLocation == InvalidGenomeLocation) {
+                continue;
+            }
+            if (logicalLocation == runLocation) {
+                runCount++;
+                continue;
+            }
+        }
+        if (runCount > 1) {
+            DuplicateRunMarker::addRunCandidates(genome, bams + runStart, offsets + runStart, i - runStart, runLocation, &run, &candidates, &group);
+        }
+        runLocation = logicalLocation;
+        runStart = i;
+        runCount = 1;
+    }
+    delete [] bams;
+    delete [] offsets;
+
+    //
+    // Now take the reads a key at a time.  A key's first ends come before its second ends, since the runs were in order.
+    //
+    std::stable_sort(candidates.begin(), candidates.end(), DuplicateRunMarker::candidateKeyLess);
+    DuplicateRunMarker::CandidateVector scratch;
+    for (Candidate* c = candidates.begin(); c < candidates.end(); ) {
+        Candidate* keyEnd = c + 1;
+        while (keyEnd < candidates.end() && keyEnd->key == c->key) {
+            keyEnd++;
+        }
+        for (Candidate* d = c; d < keyEnd; d++) {
+            state->stats.addRead(d->key, d->record);
+        }
+        if (c->otherLocation == c->location) {
+            DuplicateRunMarker::markPairs(c, keyEnd, &scratch);
+            c = keyEnd;
+            continue;
+        }
+
+        Candidate* secondEnds = c;
+        while (secondEnds < keyEnd && DuplicateRunMarker::isFirstEnd(*secondEnds)) {
+            secondEnds++;
+        }
+        KeptRead keptRead;
+        bool haveKept = secondEnds > c;
+        if (haveKept) {
+            keptRead = DuplicateRunMarker::markFirstEnds(c, secondEnds);
+            if (c->otherLocation >= endLocation) {
+                state->firstEnds.push_back(keptRead);
+            }
+        }
+        if (secondEnds < keyEnd) {
+            if (! haveKept && secondEnds->otherLocation < beginLocation) {
+                for (Candidate* d = secondEnds; d < keyEnd; d++) {
+                    state->secondEnds.push_back(*d);
+                }
+            } else {
+                DuplicateRunMarker::markSecondEnds(secondEnds, keyEnd, haveKept ? &keptRead : NULL);
+            }
+        }
+        c = keyEnd;
+    }
+    state->stats.countSets();
+}
+
+    void
+BAMDupMarkSupplier::onRangeWriting(
+    int range,
+    char* records,
+    const unsigned* lengths,
+    int nRecords)
+{
+    RangeState* state = &ranges[range];
+
+    //
+    // Keep the mate of the read that the first end kept, or the best if there isn't one.
+    //
+    for (Candidate* c = state->secondEnds.begin(); c < state->secondEnds.end(); ) {
+        Candidate* keyEnd = c + 1;
+        while (keyEnd < state->secondEnds.end() && keyEnd->key == c->key) {
+            keyEnd++;
+        }
+        for (Candidate* d = c; d < keyEnd; d++) {
+            d->record = (BAMAlignment*) (records + d->offset);
+        }
+        DuplicateRunMarker::markSecondEnds(c, keyEnd, kept.tryFind(c->key));
+        kept.erase(c->key);
+        c = keyEnd;
+    }
+    state->secondEnds.clean();
+
+    for (KeptRead* k = state->firstEnds.begin(); k < state->firstEnds.end(); k++) {
+        kept.put(k->key, *k);
+    }
+    state->firstEnds.clean();
+
+    PruneDuplicateMates(&kept, (GenomeLocation) min<_int64>(state->endLocation, FileFormat::UnalignedSortLocation), &keptAtLastPrune);
+
+    stats.add(state->stats);
+}
+
+    void
+BAMDupMarkSupplier::endMergeRanges()
+{
+    delete [] ranges;
+    ranges = NULL;
+    nRanges = 0;
+    kept.clear();
+    keptAtLastPrune = 0;
+}
+
+    void
+BAMDupMarkSupplier::onClosed(
+    DataWriterSupplier* supplier)
+{
+    if (opticalDistance > 0) {
+        fprintf(stderr, "Marked %lld duplicate reads or pairs, %lld of them optical\n", stats.getDuplicates(), stats.getOpticalDuplicates());
+    } else {
+        fprintf(stderr, "Marked %lld duplicate reads or pairs\n", stats.getDuplicates());
+    }
+}
+
+    DataWriter::FilterSupplier*
+DataWriterSupplier::markDuplicates(const Genome* genome, int opticalDistance)
+{
+    return new BAMDupMarkSupplier(genome, opticalDistance);
+}
+
+//
+// Gathers the tables that GATK's BaseRecalibrator builds for base quality score recalibration, counting the bases of the
+// sorted output that are aligned to the reference and how many of them don't match, by read group and reported quality,
+// and then by cycle (position in the read in the order it was sequenced, negated for the second read of a pair) and by
+// dinucleotide context (the base before and this one, also in sequencing order).  The same reads are left out as GATK
+// leaves out: unmapped, secondary, duplicate, failed QC and MAPQ 0 or unknown, as are bases with quality below 6 and
+// ones where the read or the reference is ambiguous.  There's no list of known variant sites to mask, so real variants
+// count as errors.  It's written out as a tab-separated report when the output is closed.
+//
+// When the parallel merge hands it the ranges, the merge threads do the counting, each in tables of its own; otherwise
+// the filter does it on the writing thread.  Either way the tables are added up at the end.
+//
+class BAMQualityCalibrationSupplier : public DataWriter::FilterSupplier
+{
+public:
+    BAMQualityCalibrationSupplier(const Genome* i_genome, const char* i_reportFileName);
+
+    virtual ~BAMQualityCalibrationSupplier();
+
+    virtual DataWriter::Filter* getFilter();
+
+    virtual void onClosing(DataWriterSupplier* supplier) {}
+    virtual void onClosed(DataWriterSupplier* supplier);
+
+    virtual bool beginMergeRanges(int nRanges)
+    { countingRanges = true; return true; }
+
+    virtual void onRangeMerged(int range, char* records, const unsigned* lengths, int nRecords, _int64 beginLocation, _int64 endLocation);
+
+    static const int MinQuality = 6;
+    static const int MaxQuality = 93;
+    static const int MaxCycle = 500; // as for GATK, longer reads don't have their later cycles counted
+
+    struct Counts
+    {
+        _int64  observations;
+        _int64  errors;
+
+        void add(const Counts& other)
+        { observations += other.observations; errors += other.errors; }
+    };
+
+    struct ReadGroupTables
+    {
+        Counts  quality[MaxQuality + 1];
+        Counts  cycle[MaxQuality + 1][2 * MaxCycle + 1]; // cycle + MaxCycle
+        Counts  context[MaxQuality + 1][16]; // BASE_VALUE of the previous base * 4 + this one's
+    };
+
+    //
+    // One thread's worth of tables.
+    //
+    class Tables
+    {
+    public:
+        Tables(const Genome* i_genome) : genome(i_genome), refBuffer(NULL), refBufferSize(0) {}
+
+        ~Tables();
+
+        void addRead(BAMAlignment* bam);
+
+        void add(Tables* other);
+
+        int getNumReadGroups() const { return names.size(); }
+        const char* getReadGroupName(int i) const { return names[i]; }
+        const ReadGroupTables* getReadGroup(int i) const { return tables[i]; }
+
+    private:
+        ReadGroupTables* getReadGroup(const char* name);
+
+        const Genome* genome;
+        VariableSizeVector<char*> names;
+        VariableSizeVector<ReadGroupTables*> tables;
+        char* refBuffer; // for packed genomes
+        size_t refBufferSize;
+    };
+
+private:
+    friend class BAMQualityCalibrationFilter;
+
+    Tables* acquireTables();
+    void releaseTables(Tables* tables);
+
+    bool writeReport(Tables* total);
+
+    const Genome* genome;
+    const char* reportFileName;
+    volatile bool countingRanges;
+    ExclusiveLock lock;
+    VariableSizeVector<Tables*> allTables;
+    VariableSizeVector<Tables*> freeTables;
+};
+
+class BAMQualityCalibrationFilter : public BAMFilter
+{
+public:
+    BAMQualityCalibrationFilter(BAMQualityCalibrationSupplier* i_supplier, BAMQualityCalibrationSupplier::Tables* i_tables) :
+        BAMFilter(DataWriter::ReadFilter), supplier(i_supplier), tables(i_tables) {}
+
+protected:
+    virtual void onRead(BAMAlignment* bam, size_t fileOffset, int batchIndex)
+    {
+        if (! supplier->countingRanges) {
+            tables->addRead(bam);
+        }
+    }
+
+private:
+    BAMQualityCalibrationSupplier* supplier;
+    BAMQualityCalibrationSupplier::Tables* tables; // just for this filter, so it's never released
+};
+
+BAMQualityCalibrationSupplier::BAMQualityCalibrationSupplier(
+    const Genome* i_genome,
+    const char* i_reportFileName)
+    : FilterSupplier(DataWriter::ReadFilter), genome(i_genome), reportFileName(i_reportFileName), countingRanges(false)
+{
+    InitializeExclusiveLock(&lock);
+}
+
+BAMQualityCalibrationSupplier::~BAMQualityCalibrationSupplier()
+{
+    for (int i = 0; i < allTables.size(); i++) {
+        delete allTables[i];
+    }
+    DestroyExclusiveLock(&lock);
+}
+
+    DataWriter::Filter*
+BAMQualityCalibrationSupplier::getFilter()
+{
+    return new BAMQualityCalibrationFilter(this, acquireTables());
+}
+
+    BAMQualityCalibrationSupplier::Tables*
+BAMQualityCalibrationSupplier::acquireTables()
+{
+    AcquireExclusiveLock(&lock);
+    Tables* tables;
+    if (freeTables.size() > 0) {
+        tables = freeTables[freeTables.size() - 1];
+        freeTables.erase(freeTables.size() - 1);
+    } else {
+        tables = new Tables(genome);
+        allTables.push_back(tables);
+    }
+    ReleaseExclusiveLock(&lock);
+    return tables;
+}
+
+    void
+BAMQualityCalibrationSupplier::releaseTables(
+    Tables* tables)
+{
+    AcquireExclusiveLock(&lock);
+    freeTables.push_back(tables);
+    ReleaseExclusiveLock(&lock);
+}
+
+    void
+BAMQualityCalibrationSupplier::onRangeMerged(
+    int range,
+    char* records,
+    const unsigned* lengths,
+    int nRecords,
+    _int64 beginLocation,
+    _int64 endLocation)
+{
+    Tables* tables = acquireTables();
+    char* p = records;
+    for (int i = 0; i < nRecords; i++) {
+        tables->addRead((BAMAlignment*) p);
+        p += lengths[i];
+    }
+    releaseTables(tables);
+}
+
+BAMQualityCalibrationSupplier::Tables::~Tables()
+{
+    for (int i = 0; i < names.size(); i++) {
+        delete [] names[i];
+        BigDealloc(tables[i]);
+    }
+    delete [] refBuffer;
+}
+
+    BAMQualityCalibrationSupplier::ReadGroupTables*
+BAMQualityCalibrationSupplier::Tables::getReadGroup(
+    const char* name)
+{
+    // there aren't usually more than a few
+    for (int i = 0; i < names.size(); i++) {
+        if (strcmp(names[i], name) == 0) {
+            return tables[i];
+        }
+    }
+    char* copy = new char[strlen(name) + 1];
+    strcpy(copy, name);
+    names.push_back(copy);
+    ReadGroupTables* result = (ReadGroupTables*) BigAlloc(sizeof(ReadGroupTables));
+    memset(result, 0, sizeof(ReadGroupTables));
+    tables.push_back(result);
+    return result;
+}
+
+    void
+BAMQualityCalibrationSupplier::Tables::add(
+    Tables* other)
+{
+    for (int i = 0; i < other->names.size(); i++) {
+        ReadGroupTables* to = getReadGroup(other->names[i]);
+        const ReadGroupTables* from = other->tables[i];
+        for (int q = 0; q <= MaxQuality; q++) {
+            to->quality[q].add(from->quality[q]);
+            for (int c = 0; c < 2 * MaxCycle + 1; c++) {
+                to->cycle[q][c].add(from->cycle[q][c]);
+            }
+            for (int c = 0; c < 16; c++) {
+                to->context[q][c].add(from->context[q][c]);
+            }
+        }
+    }
+}
+
+    void
+BAMQualityCalibrationSupplier::Tables::addRead(
+    BAMAlignment* bam)
+{
+    if ((bam->FLAG & (SAM_UNMAPPED | SAM_SECONDARY | SAM_SUPPLEMENTARY | SAM_DUPLICATE | SAM_FAILED_QC)) != 0 ||
+        bam->MAPQ == 0 || bam->MAPQ == 255 || bam->refID < 0 || bam->l_seq == 0) {
+        return;
+    }
+    const _uint8* qual = (const _uint8*) bam->qual();
+    if (qual[0] == 0xff) {
+        return; // no qualities
+    }
+
+    _uint32* cigar = bam->cigar();
+    size_t refLength = 0;
+    for (int i = 0; i < bam->n_cigar_op; i++) {
+        int op = BAMAlignment::GetCigarOpCode(cigar[i]);
+        if (op == 0 || op == 2 || op == 3 || op == 7 || op == 8) { // M, D, N, =, X
+            refLength += BAMAlignment::GetCigarOpCount(cigar[i]);
+        }
+    }
+    const char* ref;
+    if (genome->isPacked()) {
+        if (refBufferSize < refLength) {
+            delete [] refBuffer;
+            refBufferSize = max(refLength, (size_t) 1024);
+            refBuffer = new char[refBufferSize];
+        }
+        ref = genome->getSubstring(bam->getLocation(genome), refLength, refBuffer, refLength);
+    } else {
+        ref = genome->getSubstring(bam->getLocation(genome), refLength);
+    }
+    if (ref == NULL) {
+        return;
+    }
+
+    const char* readGroup = "";
+    for (BAMAlignAux* aux = bam->firstAux(); aux < bam->endAux(); aux = aux->next()) {
+        if (aux->val_type == STRING_VAL_TYPE && aux->tag[0] == 'R' && aux->tag[1] == 'G') {
+            readGroup = (const char*) aux->value();
+            break;
+        }
+    }
+    ReadGroupTables* rg = getReadGroup(readGroup);
+
+    bool isRC = (bam->FLAG & SAM_REVERSE_COMPLEMENT) != 0;
+    bool isSecond = (bam->FLAG & SAM_MULTI_SEGMENT) != 0 && (bam->FLAG & SAM_LAST_SEGMENT) != 0;
+    const _uint8* seq = bam->seq();
+    int readOffset = 0;
+    for (int i = 0; i < bam->n_cigar_op; i++) {
+        int op = BAMAlignment::GetCigarOpCode(cigar[i]);
+        int count = BAMAlignment::GetCigarOpCount(cigar[i]);
+        if (op == 1 || op == 4) { // I, S
+            readOffset += count;
+            continue;
+        } else if (op == 2 || op == 3) { // D, N
+            ref += count;
+            continue;
+        } else if (op != 0 && op != 7 && op != 8) {
+            continue;
+        }
+        for (int j = 0; j < count; j++, readOffset++, ref++) {
+            int q = qual[readOffset];
+            if (q < MinQuality || q > MaxQuality) {
+                continue;
+            }
+            int base = BASE_VALUE[(_uint8) BAMAlignment::CodeToSeq[(seq[readOffset >> 1] >> ((~readOffset & 1) << 2)) & 0xf]];
+            int refBase = BASE_VALUE[(_uint8) *ref];
+            if (base > 3 || refBase > 3) {
+                continue;
+            }
+            int error = base != refBase;
+
+            rg->quality[q].observations++;
+            rg->quality[q].errors += error;
+
+            int cycle = isRC ? bam->l_seq - readOffset : readOffset + 1;
+            if (cycle <= MaxCycle) {
+                Counts* c = &rg->cycle[q][(isSecond ? -cycle : cycle) + MaxCycle];
+                c->observations++;
+                c->errors += error;
+            }
+
+            // the reverse complement of the following base is the one sequenced before this one
+            int previous = isRC ? readOffset + 1 : readOffset - 1;
+            if (previous >= 0 && previous < bam->l_seq) {
+                int previousBase = BASE_VALUE[(_uint8) BAMAlignment::CodeToSeq[(seq[previous >> 1] >> ((~previous & 1) << 2)) & 0xf]];
+                if (previousBase <= 3) {
+                    int context = isRC ? (3 - previousBase) * 4 + (3 - base) : previousBase * 4 + base; // 3 - is the complement
+                    Counts* c = &rg->context[q][context];
+                    c->observations++;
+                    c->errors += error;
+                }
+            }
+        }
+    }
+}
+
+    static double
+EmpiricalQuality(
+    const BAMQualityCalibrationSupplier::Counts& counts)
+{
+    // with a pseudocount, so no errors isn't infinitely good
+    return min(-10.0 * log10((counts.errors + 1.0) / (counts.observations + 2.0)), (double) BAMQualityCalibrationSupplier::MaxQuality);
+}
+
+    bool
+BAMQualityCalibrationSupplier::writeReport(
+    Tables* total)
+{
+    FILE* file = fopen(reportFileName, "w");
+    if (file == NULL) {
+        return false;
+    }
+    fprintf(file, "#:SNAP base quality recalibration tables\n");
+
+    fprintf(file, "#:ReadGroupTable\nReadGroup\tEventType\tEmpiricalQuality\tEstimatedQReported\tObservations\tErrors\n");
+    for (int r = 0; r < total->getNumReadGroups(); r++) {
+        const ReadGroupTables* rg = total->getReadGroup(r);
+        Counts sum = {0, 0};
+        double expectedErrors = 0;
+        for (int q = 0; q <= MaxQuality; q++) {
+            sum.add(rg->quality[q]);
+            expectedErrors += rg->quality[q].observations * pow(10.0, -q / 10.0);
+        }
+        if (sum.observations > 0) {
+            fprintf(file, "%s\tM\t%.4f\t%.4f\t%lld\t%lld\n", total->getReadGroupName(r), EmpiricalQuality(sum),
+                -10.0 * log10(expectedErrors / sum.observations), sum.observations, sum.errors);
+        }
+    }
+
+    fprintf(file, "\n#:QualityScoreTable\nReadGroup\tQualityScore\tEventType\tEmpiricalQuality\tObservations\tErrors\n");
+    for (int r = 0; r < total->getNumReadGroups(); r++) {
+        const ReadGroupTables* rg = total->getReadGroup(r);
+        for (int q = 0; q <= MaxQuality; q++) {
+            if (rg->quality[q].observations > 0) {
+                fprintf(file, "%s\t%d\tM\t%.4f\t%lld\t%lld\n", total->getReadGroupName(r), q, EmpiricalQuality(rg->quality[q]),
+                    rg->quality[q].observations, rg->quality[q].errors);
+            }
+        }
+    }
+
+    fprintf(file, "\n#:CovariateTable\nReadGroup\tQualityScore\tCovariateValue\tCovariateName\tEventType\tEmpiricalQuality\tObservations\tErrors\n");
+    for (int r = 0; r < total->getNumReadGroups(); r++) {
+        const ReadGroupTables* rg = total->getReadGroup(r);
+        for (int q = 0; q <= MaxQuality; q++) {
+            for (int c = 0; c < 16; c++) {
+                const Counts* counts = &rg->context[q][c];
+                if (counts->observations > 0) {
+                    fprintf(file, "%s\t%d\t%c%c\tContext\tM\t%.4f\t%lld\t%lld\n", total->getReadGroupName(r), q,
+                        VALUE_BASE[c / 4], VALUE_BASE[c % 4], EmpiricalQuality(*counts), counts->observations, counts->errors);
+                }
+            }
+            for (int c = 0; c < 2 * MaxCycle + 1; c++) {
+                const Counts* counts = &rg->cycle[q][c];
+                if (counts->observations > 0) {
+                    fprintf(file, "%s\t%d\t%d\tCycle\tM\t%.4f\t%lld\t%lld\n", total->getReadGroupName(r), q,
+                        c - MaxCycle, EmpiricalQuality(*counts), counts->observations, counts->errors);
+                }
+            }
+        }
+    }
+
+    bool ok = ! ferror(file);
+    return fclose(file) == 0 && ok;
+}
+
+    void
+BAMQualityCalibrationSupplier::onClosed(
+    DataWriterSupplier* supplier)
+{
+    Tables total(genome);
+    for (int i = 0; i < allTables.size(); i++) {
+        total.add(allTables[i]);
+    }
+    if (! writeReport(&total)) {
+        fprintf(stderr, "error writing %s\n", reportFileName);
+        soft_exit(1);
+    }
+}
+
+    DataWriter::FilterSupplier*
+DataWriterSupplier::qualityCalibration(
+    const char* bamFileName,
+    const Genome* genome)
+{
+    // todo: this is going to leak, but there's no easy way to free it, and it's small...
+    size_t len = strlen(bamFileName);
+    char* reportFileName = new char[11 + len];
+    strcpy(reportFileName, bamFileName);
+    strcpy(reportFileName + len, ".recal.txt");
+    return new BAMQualityCalibrationSupplier(genome, reportFileName);
+}
+
+//
+// Works out depth and alignment metrics from the sorted records as they're written, so they don't need another pass over
+// the BAM: a bedgraph of the depth along each contig, and a report with the depth histogram (like Picard's
+// CollectWgsMetrics), the alignment counts (CollectAlignmentSummaryMetrics) and the insert size distribution
+// (CollectInsertSizeMetrics).  Depth counts the aligned (M, = and X) bases of primary reads that aren't duplicates or QC
+// failures, as samtools depth does.
+//
+// The records come in order, so depth only has to be kept from the latest read's start to the end of the furthest read
+// that overlaps it.  That goes in a ring buffer, and each position is written out once the reads have moved past it.  It
+// needs the duplicates marked before it sees them, so it comes after duplicate marking.
+//
+class BAMCoverageSupplier : public DataWriter::FilterSupplier
+{
+public:
+    BAMCoverageSupplier(const Genome* i_genome, const char* i_bedGraphFileName, const char* i_metricsFileName);
+
+    virtual ~BAMCoverageSupplier();
+
+    virtual DataWriter::Filter* getFilter();
+
+    virtual void onClosing(DataWriterSupplier* supplier) {}
+    virtual void onClosed(DataWriterSupplier* supplier);
+
+    void addRead(BAMAlignment* bam);
+
+    static const unsigned MaxDepth = 1000;      // deeper bases are counted here in the histogram
+    static const int MaxInsertSize = 10000;     // and so are longer inserts
+    static const unsigned RingSize = 1 << 20;   // a read that spans more of the reference than this only counts up to here
+    static const int MinMapq = 20;
+
+private:
+    void flushBefore(_int64 pos);
+    void endRun();
+    bool writeMetrics();
+
+    const Genome* genome;
+    const char* bedGraphFileName;
+    const char* metricsFileName;
+    FILE* bedGraph;
+    ExclusiveLock lock;
+
+    // the current contig's depth, for positions from ringStart up to coveredEnd
+    unsigned* ring;
+    int currentRefID;
+    _int64 ringStart;
+    _int64 coveredEnd;
+
+    // the bedgraph line being built
+    _int64 runStart;
+    _int64 runEnd;
+    unsigned runDepth;
+
+    _int64 depthHistogram[MaxDepth + 1];   // only for depth > 0; the rest of the genome is depth 0
+    _int64 nReads;
+    _int64 nAligned;
+    _int64 nAlignedMinMapq;
+    _int64 nPaired;
+    _int64 nProperPairs;
+    _int64 nDuplicates;
+    _int64 nFailedQC;
+    _int64 insertSizes[MaxInsertSize + 1];
+};
+
+class BAMCoverageFilter : public BAMFilter
+{
+public:
+    BAMCoverageFilter(BAMCoverageSupplier* i_supplier) :
+        BAMFilter(DataWriter::ReadFilter), supplier(i_supplier) {}
+
+protected:
+    virtual void onRead(BAMAlignment* bam, size_t fileOffset, int batchIndex)
+    {
+        supplier->addRead(bam);
+    }
+
+private:
+    BAMCoverageSupplier* supplier;
+};
+
+BAMCoverageSupplier::BAMCoverageSupplier(
+    const Genome* i_genome,
+    const char* i_bedGraphFileName,
+    const char* i_metricsFileName)
+    : FilterSupplier(DataWriter::ReadFilter), genome(i_genome), bedGraphFileName(i_bedGraphFileName), metricsFileName(i_metricsFileName),
+    currentRefID(-1), ringStart(0), coveredEnd(0), runStart(0), runEnd(0), runDepth(0),
+    nReads(0), nAligned(0), nAlignedMinMapq(0), nPaired(0), nProperPairs(0), nDuplicates(0), nFailedQC(0)
+{
+    InitializeExclusiveLock(&lock);
+    ring = (unsigned*) BigAlloc(RingSize * sizeof(unsigned));
+    memset(ring, 0, RingSize * sizeof(unsigned));
+    memset(depthHistogram, 0, sizeof(depthHistogram));
+    memset(insertSizes, 0, sizeof(insertSizes));
+    bedGraph = fopen(bedGraphFileName, "w");
+    if (bedGraph == NULL) {
+        fprintf(stderr, "Unable to open %s for writing\n", bedGraphFileName);
+        soft_exit(1);
+    }
+}
+
+BAMCoverageSupplier::~BAMCoverageSupplier()
+{
+    BigDealloc(ring);
+    DestroyExclusiveLock(&lock);
+}
+
+    DataWriter::Filter*
+BAMCoverageSupplier::getFilter()
+{
+    return new BAMCoverageFilter(this);
+}
+
+    void
+BAMCoverageSupplier::addRead(
+    BAMAlignment* bam)
+{
+    if (bam->FLAG & SAM_SECONDARY) {
+        return;
+    }
+
+    //
+    // There's normally just the one writer for the sorted output, so the lock is never waited on.
+    //
+    AcquireExclusiveLock(&lock);
+    nReads++;
+    nFailedQC += (bam->FLAG & SAM_FAILED_QC) ? 1 : 0;
+    if (bam->FLAG & SAM_UNMAPPED) {
+        ReleaseExclusiveLock(&lock);
+        return;
+    }
+
+    nAligned++;
+    nAlignedMinMapq += bam->MAPQ >= MinMapq ? 1 : 0;
+    nDuplicates += (bam->FLAG & SAM_DUPLICATE) ? 1 : 0;
+    bool properPair = (bam->FLAG & SAM_MULTI_SEGMENT) && (bam->FLAG & SAM_ALL_ALIGNED);
+    nPaired += (bam->FLAG & SAM_MULTI_SEGMENT) ? 1 : 0;
+    nProperPairs += properPair ? 1 : 0;
+    if (properPair && bam->tlen > 0 && ! (bam->FLAG & SAM_DUPLICATE)) {
+        insertSizes[min(bam->tlen, MaxInsertSize)]++;   // only the leftmost end has a positive tlen, so each pair counts once
+    }
+
+    if (bam->FLAG & (SAM_DUPLICATE | SAM_FAILED_QC)) {
+        ReleaseExclusiveLock(&lock);
+        return;
+    }
+
+    if (bam->refID != currentRefID) {
+        flushBefore(coveredEnd);
+        endRun();
+        currentRefID = bam->refID;
+        ringStart = coveredEnd = 0;
+    }
+    flushBefore(bam->pos);
+
+    _int64 refPos = bam->pos;
+    _uint32* cigar = bam->cigar();
+    for (int i = 0; i < bam->n_cigar_op; i++) {
+        _uint32 op = cigar[i] & 0xf;
+        _int64 len = cigar[i] >> 4;
+        if (op == 0 || op == 7 || op == 8) { // M, = or X
+            _int64 end = min(refPos + len, ringStart + (_int64) RingSize);
+            for (_int64 p = refPos; p < end; p++) {
+                ring[p % RingSize]++;
+            }
+            coveredEnd = max(coveredEnd, end);
+        }
+        refPos += BAMAlignment::CigarCodeToRefBase[op] * len;
+    }
+    ReleaseExclusiveLock(&lock);
+}
+
+//
+// Everything before pos is done, since no later read can start before it.
+//
+    void
+BAMCoverageSupplier::flushBefore(
+    _int64 pos)
+{
+    _int64 end = min(pos, coveredEnd);
+    for (_int64 p = ringStart; p < end; p++) {
+        unsigned depth = ring[p % RingSize];
+        ring[p % RingSize] = 0;
+        if (depth == 0) {
+            endRun();
+            continue;
+        }
+        depthHistogram[min(depth, MaxDepth)]++;
+        if (depth != runDepth || p != runEnd) {
+            endRun();
+            runStart = p;
+            runDepth = depth;
+        }
+        runEnd = p + 1;
+    }
+    ringStart = max(ringStart, pos);
+}
+
+    void
+BAMCoverageSupplier::endRun()
+{
+    if (runDepth > 0) {
+        fprintf(bedGraph, "%s\t%lld\t%lld\t%u\n", genome->getContigs()[currentRefID].name, runStart, runEnd, runDepth);
+        runDepth = 0;
+    }
+}
+
+    bool
+BAMCoverageSupplier::writeMetrics()
+{
+    FILE* file = fopen(metricsFileName, "w");
+    if (file == NULL) {
+        return false;
+    }
+
+    _int64 territory = 0;
+    for (int i = 0; i < genome->getNumContigs(); i++) {
+        territory += genome->getContigs()[i].length - genome->getChromosomePadding();
+    }
+    _int64 coveredBases = 0;
+    double totalDepth = 0;
+    for (unsigned d = 1; d <= MaxDepth; d++) {
+        coveredBases += depthHistogram[d];
+        totalDepth += (double) d * depthHistogram[d];
+    }
+    _int64 zeroDepthBases = max(territory - coveredBases, (_int64) 0);
+
+    fprintf(file, "#:SNAP alignment metrics\n");
+    fprintf(file, "#:AlignmentSummary\nTOTAL_READS\tALIGNED_READS\tALIGNED_READS_MAPQ%d\tPAIRED_READS\tPROPER_PAIR_READS\tDUPLICATE_READS\tFAILED_QC_READS\n", MinMapq);
+    fprintf(file, "%lld\t%lld\t%lld\t%lld\t%lld\t%lld\t%lld\n", nReads, nAligned, nAlignedMinMapq, nPaired, nProperPairs, nDuplicates, nFailedQC);
+
+    fprintf(file, "\n#:Coverage\nGENOME_TERRITORY\tMEAN_COVERAGE\tPCT_1X\tPCT_10X\tPCT_30X\n");
+    _int64 atLeast[3] = {0, 0, 0};
+    for (unsigned d = 1; d <= MaxDepth; d++) {
+        atLeast[0] += depthHistogram[d];
+        atLeast[1] += d >= 10 ? depthHistogram[d] : 0;
+        atLeast[2] += d >= 30 ? depthHistogram[d] : 0;
+    }
+    double divisor = (double) max(territory, (_int64) 1);
+    fprintf(file, "%lld\t%.4f\t%.6f\t%.6f\t%.6f\n", territory, totalDepth / divisor, atLeast[0] / divisor, atLeast[1] / divisor, atLeast[2] / divisor);
+
+    fprintf(file, "\n#:CoverageHistogram\nCOVERAGE\tBASES\n0\t%lld\n", zeroDepthBases);
+    for (unsigned d = 1; d <= MaxDepth; d++) {
+        if (depthHistogram[d] > 0) {
+            fprintf(file, "%u\t%lld\n", d, depthHistogram[d]);
+        }
+    }
+
+    _int64 nInserts = 0;
+    double insertTotal = 0;
+    for (int i = 0; i <= MaxInsertSize; i++) {
+        nInserts += insertSizes[i];
+        insertTotal += (double) i * insertSizes[i];
+    }
+    _int64 median = 0;
+    for (_int64 seen = 0; median <= MaxInsertSize && (seen += insertSizes[median]) * 2 < nInserts; median++) {
+    }
+    fprintf(file, "\n#:InsertSize\nPAIRS\tMEAN_INSERT_SIZE\tMEDIAN_INSERT_SIZE\n%lld\t%.2f\t%lld\n", nInserts,
+        nInserts > 0 ? insertTotal / nInserts : 0.0, nInserts > 0 ? median : (_int64) 0);
+    fprintf(file, "\n#:InsertSizeHistogram\nINSERT_SIZE\tPAIRS\n");
+    for (int i = 0; i <= MaxInsertSize; i++) {
+        if (insertSizes[i] > 0) {
+            fprintf(file, "%d\t%lld\n", i, insertSizes[i]);
+        }
+    }
+
+    bool ok = ! ferror(file);
+    return fclose(file) == 0 && ok;
+}
+
+    void
+BAMCoverageSupplier::onClosed(
+    DataWriterSupplier* supplier)
+{
+    flushBefore(coveredEnd);
+    endRun();
+    bool ok = ! ferror(bedGraph);
+    if (fclose(bedGraph) != 0 || ! ok) {
+        fprintf(stderr, "error writing %s\n", bedGraphFileName);
+        soft_exit(1);
+    }
+    if (! writeMetrics()) {
+        fprintf(stderr, "error writing %s\n", metricsFileName);
+        soft_exit(1);
+    }
+}
+
+    DataWriter::FilterSupplier*
+DataWriterSupplier::coverage(
+    const char* bamFileName,
+    const Genome* genome)
+{
+    // todo: these are going to leak, but there's no easy way to free them, and they're small...
+    size_t len = strlen(bamFileName);
+    char* bedGraphFileName = new char[len + 10];
+    strcpy(bedGraphFileName, bamFileName);
+    strcpy(bedGraphFileName + len, ".bedgraph");
+    char* metricsFileName = new char[len + 13];
+    strcpy(metricsFileName, bamFileName);
+    strcpy(metricsFileName + len, ".metrics.txt");
+    return new BAMCoverageSupplier(genome, bedGraphFileName, metricsFileName);
+}
+
+class BAMIndexSupplier;
+
+class BAMIndexFilter : public BAMFilter
+{
+public:
+    BAMIndexFilter(BAMIndexSupplier* i_supplier)
+        : BAMFilter(DataWriter::ReadFilter), supplier(i_supplier) {}
+
+protected:
+    virtual void onRead(BAMAlignment* bam, size_t fileOffset, int batchIndex);
+
+private:
+    BAMIndexSupplier* supplier;
+};
+
+//
+// Builds a .bai index as the sorted BAM is written, or a .csi if some contig is too long for BAI's fixed 5 levels of
+// bins (about 512M bases).  Both have the same 16K base smallest bins (so the same linear intervals, which the CSI
+// uses to set each bin's loffset) and the same pseudo-bin of metadata past the last real bin.
+//
+class BAMIndexSupplier : public DataWriter::FilterSupplier
+{
 public:
-    BAMIndexSupplier(const char* i_indexFileName, const Genome* i_genome, GzipWriterFilterSupplier* i_gzipSupplier) :
+    BAMIndexSupplier(const char* i_indexFileName, bool i_csi, int i_depth, const Genome* i_genome, GzipWriterFilterSupplier* i_gzipSupplier) :
         FilterSupplier(DataWriter::ReadFilter),
         indexFileName(i_indexFileName),
+        csi(i_csi),
+        depth(i_depth),
+        extraBin(((1 << ((i_depth + 1) * 3)) - 1) / 7 + 1),
         genome(i_genome),
         gzipSupplier(i_gzipSupplier),
         lastRefId(-1),
@@ -1413,6 +2991,9 @@ public:
         readCounts[0] = readCounts[1] = 0;
     }
 
+    static const int MinShift = 14;
+    static const int BaiDepth = 5;
+
     virtual DataWriter::Filter* getFilter()
     { return new BAMIndexFilter(this); }
 
@@ -1430,7 +3011,7 @@ private:
         _uint64 start, end;
     };
     typedef VariableSizeVector<BAMChunk> ChunkVec;
-    typedef VariableSizeMap<_uint32,ChunkVec,150,MapNumericHash<_uint32>,80,-1,-2> BinMap;
+    typedef VariableSizeMap<_uint32,ChunkVec,150,MapNumericHash<_uint32>,80,-1> BinMap;
     typedef VariableSizeVector<_uint64> LinearMap;
     struct RefInfo {
         BinMap bins;
@@ -1445,7 +3026,13 @@ private:
 
     void addInterval(int refId, int begin, int end, _uint64 fileOffset);
 
+    // for a CSI, the virtual offset to start looking for reads that overlap the bin
+    _uint64 getBinLoffset(RefInfo* info, _uint32 bin);
+
     const char* indexFileName;
+    const bool csi;
+    const int depth;
+    const _uint32 extraBin;
     const Genome* genome;
     int lastRefId;
     _uint32 lastBin;
@@ -1468,11 +3055,30 @@ BAMIndexFilter::onRead(
 
     DataWriter::FilterSupplier*
 DataWriterSupplier::bamIndex(
-    const char* indexFileName,
+    const char* bamFileName,
     const Genome* genome,
     GzipWriterFilterSupplier* gzipSupplier)
 {
-    return new BAMIndexSupplier(indexFileName, genome, gzipSupplier);
+    //
+    // Take as many levels as it takes for the root bin to cover the longest contig, the same way samtools does.
+    //
+    _int64 maxLength = 0;
+    for (int i = 0; i < genome->getNumContigs(); i++) {
+        maxLength = max(maxLength, (_int64) genome->getContigs()[i].length);
+    }
+    maxLength += 256;
+    int depth = 0;
+    for (_int64 size = (_int64) 1 << BAMIndexSupplier::MinShift; maxLength > size; size <<= 3) {
+        depth++;
+    }
+    bool csi = depth > BAMIndexSupplier::BaiDepth;
+
+    // todo: this is going to leak, but there's no easy way to free it, and it's small...
+    size_t len = strlen(bamFileName);
+    char* indexFileName = new char[5 + len];
+    strcpy(indexFileName, bamFileName);
+    strcpy(indexFileName + len, csi ? ".csi" : ".bai");
+    return new BAMIndexSupplier(indexFileName, csi, csi ? depth : BAMIndexSupplier::BaiDepth, genome, gzipSupplier);
 }
 
     void
@@ -1484,16 +3090,22 @@ BAMIndexSupplier::onRead(
     //fprintf(stderr, "index onRead %d:%d+%d @ %lld %d\n", bam->refID, bam->pos, bam->l_ref(), fileOffset, batchIndex);
     if (bam->refID != lastRefId) {
         if (lastRefId != -1) {
-            addChunk(lastRefId, BAMAlignment::BAM_EXTRA_BIN, firstBamStart, lastBamEnd);
-            addChunk(lastRefId, BAMAlignment::BAM_EXTRA_BIN, readCounts[0], readCounts[1]);
+            addChunk(lastRefId, extraBin, firstBamStart, lastBamEnd);
+            addChunk(lastRefId, extraBin, readCounts[0], readCounts[1]);
             readCounts[0] = readCounts[1] = 0;
         }
         firstBamStart = fileOffset;
     }
     readCounts[(bam->FLAG & SAM_UNMAPPED) ? 1 : 0]++;
-    if (bam->refID != lastRefId || bam->bin != lastBin || lastRefId == -1) {
+    // the bin in the record is for BAI, so a CSI has to work out its own
+    _uint32 bin = bam->bin;
+    if (csi) {
+        int l_ref = (bam->FLAG & SAM_UNMAPPED) ? 0 : bam->l_ref();
+        bin = bam->pos < 0 ? 0 : BAMAlignment::reg2bin(bam->pos, bam->pos + max(l_ref, 1), MinShift, depth);
+    }
+    if (bam->refID != lastRefId || bin != lastBin || lastRefId == -1) {
         addChunk(lastRefId, lastBin, binStart, fileOffset);
-        lastBin = bam->bin;
+        lastBin = bin;
         lastRefId = bam->refID;
         binStart = fileOffset;
     }
@@ -1504,6 +3116,20 @@ BAMIndexSupplier::onRead(
     lastBamEnd = fileOffset + bam->size();
 }
 
+//
+// Append bytes to an index that's being built in memory.
+//
+    static void
+AppendToIndex(
+    VariableSizeVector<char>* index,
+    const void* data,
+    size_t bytes)
+{
+    for (size_t i = 0; i < bytes; i++) {
+        index->push_back(((const char*) data)[i]);
+    }
+}
+
     void
 BAMIndexSupplier::onClosed(
     DataWriterSupplier* supplier)
@@ -1511,55 +3137,112 @@ BAMIndexSupplier::onClosed(
     // add final chunk
     if (lastRefId != -1) {
         addChunk(lastRefId, lastBin, binStart, lastBamEnd);
-        addChunk(lastRefId, BAMAlignment::BAM_EXTRA_BIN, firstBamStart, lastBamEnd);
-        addChunk(lastRefId, BAMAlignment::BAM_EXTRA_BIN, readCounts[0], readCounts[1]);
+        addChunk(lastRefId, extraBin, firstBamStart, lastBamEnd);
+        addChunk(lastRefId, extraBin, readCounts[0], readCounts[1]);
     }
 
-    // write out index file
-    FILE* index = fopen(indexFileName, "wb");
-    char magic[4] = {'B', 'A', 'I', 1};
-    fwrite(magic, sizeof(magic), 1, index);
+    //
+    // Build the index in memory, since a CSI has to be compressed.  The two only differ in the header, CSI's per-bin
+    // loffset in place of BAI's linear index, and the compression.
+    //
+    VariableSizeVector<char> index(1024 * 1024);
+    if (csi) {
+        char magic[4] = {'C', 'S', 'I', 1};
+        AppendToIndex(&index, magic, sizeof(magic));
+        _int32 header[3] = {MinShift, depth, 0};    // no auxiliary data for BAM
+        AppendToIndex(&index, header, sizeof(header));
+    } else {
+        char magic[4] = {'B', 'A', 'I', 1};
+        AppendToIndex(&index, magic, sizeof(magic));
+    }
     _int32 n_ref = genome->getNumContigs();
-    fwrite(&n_ref, sizeof(n_ref), 1, index);
+    AppendToIndex(&index, &n_ref, sizeof(n_ref));
 
     for (int i = 0; i < n_ref; i++) {
         RefInfo* info = getRefInfo(i);
         _int32 n_bin, n_intv;
         if (info == NULL) {
             n_bin = 0;
-            fwrite(&n_bin, sizeof(n_bin), 1, index);
-            n_intv = 0;
-            fwrite(&n_intv, sizeof(n_intv), 1, index);
+            AppendToIndex(&index, &n_bin, sizeof(n_bin));
+            if (! csi) {
+                n_intv = 0;
+                AppendToIndex(&index, &n_intv, sizeof(n_intv));
+            }
             continue;
         }
         n_bin = info->bins.size();
-        fwrite(&n_bin, sizeof(n_bin), 1, index);
+        AppendToIndex(&index, &n_bin, sizeof(n_bin));
         for (BinMap::iterator j = info->bins.begin(); j != info->bins.end(); j = info->bins.next(j)) {
             _uint32 bin = j->key;
-            fwrite(&bin, sizeof(bin), 1, index);
+            AppendToIndex(&index, &bin, sizeof(bin));
+            if (csi) {
+                _uint64 loffset = bin != extraBin ? getBinLoffset(info, bin) : 0;
+                AppendToIndex(&index, &loffset, sizeof(loffset));
+            }
             _int32 n_chunk = j->value.size();
-            fwrite(&n_chunk, sizeof(n_chunk), 1, index);
-            if (bin != BAMAlignment::BAM_EXTRA_BIN) {
+            AppendToIndex(&index, &n_chunk, sizeof(n_chunk));
+            if (bin != extraBin) {
                 for (ChunkVec::iterator k = j->value.begin(); k != j->value.end(); k++) {
                     _uint64 chunk[2] = {gzipSupplier->toVirtualOffset(k->start), gzipSupplier->toVirtualOffset(k->end)};
-                    fwrite(&chunk, sizeof(chunk), 1, index);
+                    AppendToIndex(&index, &chunk, sizeof(chunk));
                 }
             } else {
                 _uint64 chunk[2] = {gzipSupplier->toVirtualOffset(j->value[0].start), gzipSupplier->toVirtualOffset(j->value[0].end)};
-                fwrite(&chunk, sizeof(chunk), 1, index);
+                AppendToIndex(&index, &chunk, sizeof(chunk));
                 chunk[0] = j->value[1].start;
                 chunk[1] = j->value[1].end;
-                fwrite(&chunk, sizeof(chunk), 1, index);
+                AppendToIndex(&index, &chunk, sizeof(chunk));
+            }
+        }
+        if (! csi) {
+            n_intv = info->intervals.size();
+            AppendToIndex(&index, &n_intv, sizeof(n_intv));
+            for (LinearMap::iterator m = info->intervals.begin(); m != info->intervals.end(); m++) {
+                _uint64 ioffset = gzipSupplier->toVirtualOffset(*m);
+                AppendToIndex(&index, &ioffset, sizeof(ioffset));
             }
         }
-        n_intv = info->intervals.size();
-        fwrite(&n_intv, sizeof(n_intv), 1, index);
-        for (LinearMap::iterator m = info->intervals.begin(); m != info->intervals.end(); m++) {
-            _uint64 ioffset = gzipSupplier->toVirtualOffset(*m);
-            fwrite(&ioffset, sizeof(ioffset), 1, index);
+    }
+
+    // write out index file
+    if (csi) {
+        if (! GzipWriterFilterSupplier::writeBgzfFile(indexFileName, index.begin(), index.size())) {
+            soft_exit(1);
+        }
+    } else {
+        FILE* file = fopen(indexFileName, "wb");
+        if (file == NULL || fwrite(index.begin(), 1, index.size(), file) != (size_t) index.size()) {
+            fprintf(stderr, "error writing %s\n", indexFileName);
+            soft_exit(1);
+        }
+        fclose(file);
+    }
+}
+
+    _uint64
+BAMIndexSupplier::getBinLoffset(
+    RefInfo* info,
+    _uint32 bin)
+{
+    //
+    // Find the first base of the bin, and then the first read that reaches it from the linear intervals.  An interval
+    // that no read started being the first to reach is UINT64_MAX, and the ones before it are earlier in the file, so
+    // use the nearest one at or before.  If there's none, start at the first read in the reference.
+    //
+    int level = 0;
+    _uint32 first = 0;
+    while (level < depth && bin >= first + (1u << (level * 3))) {
+        first += 1u << (level * 3);
+        level++;
+    }
+    _int64 begin = (_int64) (bin - first) << (MinShift + (depth - level) * 3);
+    for (_int64 slot = min(begin >> MinShift, (_int64) info->intervals.size() - 1); slot >= 0; slot--) {
+        if (info->intervals[(int) slot] != UINT64_MAX) {
+            return gzipSupplier->toVirtualOffset(info->intervals[(int) slot]);
         }
     }
-    fclose(index);
+    ChunkVec* metadata = info->bins.tryFind(extraBin);
+    return metadata != NULL ? gzipSupplier->toVirtualOffset((*metadata)[0].start) : 0;
 }
 
    BAMIndexSupplier::RefInfo*
@@ -1628,6 +3311,22 @@ BgzfHeader::validate(char* buffer, size_t bytes)
     return p == buffer + bytes;
 }
 
+    bool
+BgzfHeader::isBgzf(
+    size_t bytes)
+{
+    if (bytes < sizeof(BgzfHeader) || ID1 != 0x1f || ID2 != 0x8b || CM != 8 || (FLG & 4) == 0 ||
+            bytes < sizeof(BgzfHeader) + XLEN) {
+        return false;
+    }
+    for (BgzfExtra* x = firstExtra(); (char*) x + 4 <= XLEN + (char*) firstExtra(); x = x->nextExtra()) {
+        if (x->SI1 == 66 && x->SI2 == 67 && x->SLEN == 2) {
+            return true;
+        }
+    }
+    return false;
+}
+
     bool
 BgzfHeader::validate(
     size_t compressed,
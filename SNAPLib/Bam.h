@@ -105,6 +105,9 @@ struct BAMAlignment
     
     char*       read_name()
     { return sizeof(tlen) + (char*) &this->tlen; }
+
+    const char* read_name() const
+    { return sizeof(tlen) + (const char*) &this->tlen; }
     
     _uint32*    cigar()
     { return (_uint32*) (l_read_name + read_name()); }
@@ -157,18 +160,20 @@ struct BAMAlignment
 
     /* calculate bin given an alignment covering [beg,end) (zero-based, half-close-half-open) */
     static int reg2bin(int beg, int end);
+    /* the same for a CSI index, whose smallest bins are 1<<minShift and which has depth levels below the root */
+    static int reg2bin(_int64 beg, _int64 end, int minShift, int depth);
     /* calculate the list of bins that may overlap with region [beg,end) (zero-based) */
     static const int MAX_BIN = (((1<<18)-1)/7);
     static int reg2bins(int beg, int end, _uint16* list/*[MAX_BIN]*/);
 
-    // absoluate genome locations
+    // absoluate genome locations; there aren't any without a genome (e.g., for just reading out the reads)
 
-    _uint32 getLocation(const Genome* genome) const
-    { return pos < 0 || refID < 0 || refID >= genome->getNumContigs() || (FLAG & SAM_UNMAPPED)
-        ? UINT32_MAX : (genome->getContigs()[refID].beginningOffset + pos); }
+    GenomeLocation getLocation(const Genome* genome) const
+    { return genome == NULL || pos < 0 || refID < 0 || refID >= genome->getNumContigs() || (FLAG & SAM_UNMAPPED)
+        ? InvalidGenomeLocation : (genome->getContigs()[refID].beginningOffset + pos); }
 
-    _uint32 getNextLocation(const Genome* genome) const
-    { return next_pos < 0 || next_refID < 0 || (FLAG & SAM_NEXT_UNMAPPED) ? UINT32_MAX : (genome->getContigs()[next_refID].beginningOffset + next_pos); }
+    GenomeLocation getNextLocation(const Genome* genome) const
+    { return genome == NULL || next_pos < 0 || next_refID < 0 || (FLAG & SAM_NEXT_UNMAPPED) ? InvalidGenomeLocation : (genome->getContigs()[next_refID].beginningOffset + next_pos); }
 
 #ifdef VALIDATE_BAM
     void validate();
@@ -349,6 +354,9 @@ struct BgzfHeader
     bool validate(size_t compressed, size_t uncompressed);
 
     static bool validate(char* buffer, size_t bytes);
+
+    // whether this is the start of a BGZF block (as from bgzip, or SNAP's own BAM writer), looking no further than bytes
+    bool isBgzf(size_t bytes);
 };
 
 
@@ -362,14 +370,15 @@ public:
 
         virtual ~BAMReader();
 
-        void init(const char *fileName, _int64 startingOffset, _int64 amountOfFileToProcess);
+        // supplier defaults to DataSupplier::GzipBamDefault; CRAM input passes DataSupplier::CramSupplier
+        void init(const char *fileName, _int64 startingOffset, _int64 amountOfFileToProcess, DataSupplier* supplier = NULL);
 
         virtual bool getNextRead(Read *readToUpdate)
         {
             return getNextRead(readToUpdate, NULL, NULL, NULL, NULL, NULL, false, NULL);
         }
     
-        virtual bool getNextRead(Read *read, AlignmentResult *alignmentResult, unsigned *genomeLocation, bool *isRC, unsigned *mapQ,
+        virtual bool getNextRead(Read *read, AlignmentResult *alignmentResult, GenomeLocation *genomeLocation, bool *isRC, unsigned *mapQ,
                         unsigned *flag, const char **cigar)
         {
             return getNextRead(read,alignmentResult,genomeLocation,isRC,mapQ,flag,false,cigar);
@@ -391,17 +400,18 @@ public:
         void releaseBatch(DataBatch batch)
         { data->releaseBatch(batch); }
 
-        static void readHeader(const char* fileName, ReaderContext& i_context);
+        static void readHeader(const char* fileName, ReaderContext& i_context, DataSupplier* supplier = NULL);
 
         static BAMReader* create(const char *fileName, _int64 startingOffset, _int64 amountOfFileToProcess, 
-                                 const ReaderContext& context);
+                                 const ReaderContext& context, DataSupplier* supplier = NULL);
         
         virtual void reinit(_int64 startingOffset, _int64 amountOfFileToProcess);
         
-        static ReadSupplierGenerator *createReadSupplierGenerator(const char *fileName, int numThreads, const ReaderContext& context);
+        static ReadSupplierGenerator *createReadSupplierGenerator(const char *fileName, int numThreads, const ReaderContext& context,
+            DataSupplier* supplier = NULL);
         
         static PairedReadSupplierGenerator *createPairedReadSupplierGenerator(const char *fileName, int numThreads, bool quicklyDropUnmatchedReads, 
-            const ReaderContext& context, int matchBufferSize = 5000);
+            const ReaderContext& context, int matchBufferSize = 5000, DataSupplier* supplier = NULL);
 
         static const int MAX_SEQ_LENGTH = MAX_READ_LENGTH;
 
@@ -410,10 +420,10 @@ public:
 protected:
 
         virtual bool getNextRead(Read *read, AlignmentResult *alignmentResult, 
-                        unsigned *genomeLocation, bool *isRC, unsigned *mapQ, unsigned *flag, bool ignoreEndOfRange, const char **cigar);
+                        GenomeLocation *genomeLocation, bool *isRC, unsigned *mapQ, unsigned *flag, bool ignoreEndOfRange, const char **cigar);
 
         void getReadFromLine(const Genome *genome, char *line, char *endOfBuffer, Read *read, AlignmentResult *alignmentResult,
-                        unsigned *genomeLocation, bool *isRC, unsigned *mapQ, 
+                        GenomeLocation *genomeLocation, bool *isRC, unsigned *mapQ, 
                         size_t *lineLength, unsigned *flag, const char **cigar, ReadClippingType clipping);
 
 private:
@@ -421,6 +431,14 @@ private:
         char* getExtra(_int64 bytes);
 
         DataReader*         data;
+
+        //
+        // Without a genome, the names of the contigs (for the mates' RNEXT) come from the header's @SQ lines.  They point
+        // into context.header.
+        //
+        VariableSizeVector<const char*>     headerRefNames;
+        VariableSizeVector<unsigned>        headerRefNameLengths;
+
         //unsigned            n_ref; // number of reference sequences
         //unsigned*           refOffset; // array mapping ref sequence ID to contig location
         _int64              extraOffset; // offset into extra data
@@ -0,0 +1,397 @@
+/*++
+
+Module Name:
+
+    BamIndex.cpp
+
+Abstract:
+
+    Reader for BAM indices (.bai and .csi), for going straight to the reads in a region of a sorted BAM file.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "BamIndex.h"
+#include "Bam.h"
+#include "Util.h"
+#include "zlib.h"
+#include <algorithm>
+
+using std::max;
+using std::min;
+
+BAMIndex::~BAMIndex()
+{
+    delete [] refs;
+}
+
+//
+// Reads all of fileName in, or returns NULL if it can't be opened.
+//
+    static char *
+ReadWholeFile(const char *fileName, size_t *o_bytes)
+{
+    FILE *file = fopen(fileName, "rb");
+    if (NULL == file) {
+        return NULL;
+    }
+    _int64 fileSize = QueryFileSize(fileName);
+    char *data = new char[fileSize + 1];
+    *o_bytes = fread(data, 1, fileSize, file);
+    fclose(file);
+    return data;
+}
+
+//
+// A .csi is BGZF compressed.  Decompresses all of its blocks, or returns NULL if one doesn't inflate.
+//
+    static char *
+InflateWholeFile(const char *compressed, size_t compressedBytes, size_t *o_bytes)
+{
+    size_t capacity = 4 * compressedBytes + BAM_BLOCK;
+    char *data = new char[capacity];
+    size_t used = 0;
+
+    z_stream zstream;
+    memset(&zstream, 0, sizeof(zstream));
+    zstream.next_in = (Bytef *)compressed;
+    zstream.avail_in = (uInt)compressedBytes;
+    while (zstream.avail_in > 0) {
+        if (Z_OK != inflateInit2(&zstream, 15 + 16)) {
+            delete [] data;
+            return NULL;
+        }
+        int status;
+        do {
+            if (capacity - used < BAM_BLOCK) {
+                char *bigger = new char[2 * capacity];
+                memcpy(bigger, data, used);
+                delete [] data;
+                data = bigger;
+                capacity *= 2;
+            }
+            zstream.next_out = (Bytef *)(data + used);
+            zstream.avail_out = (uInt)(capacity - used);
+            status = inflate(&zstream, Z_NO_FLUSH);
+            used = capacity - zstream.avail_out;
+        } while (Z_OK == status);
+        inflateEnd(&zstream);
+        if (Z_STREAM_END != status) {
+            delete [] data;
+            return NULL;
+        }
+    }
+
+    *o_bytes = used;
+    return data;
+}
+
+    BAMIndex *
+BAMIndex::load(const char *bamFileName)
+{
+    size_t len = strlen(bamFileName);
+    char *indexFileName = new char[len + 5];
+    const char *suffixes[] = {".bai", ".csi", NULL};
+    char *data = NULL;
+    size_t bytes;
+    for (int i = 0; NULL == data && i < 3; i++) {
+        strcpy(indexFileName, bamFileName);
+        if (NULL != suffixes[i]) {
+            strcpy(indexFileName + len, suffixes[i]);
+        } else if (len > 4 && util::stringEndsWith(bamFileName, ".bam")) {
+            strcpy(indexFileName + len - 4, ".bai");
+        } else {
+            break;
+        }
+        data = ReadWholeFile(indexFileName, &bytes);
+    }
+
+    if (NULL == data) {
+        fprintf(stderr, "Couldn't find an index for %s; sort it with snap -so (or samtools index it) to make one\n", bamFileName);
+        delete [] indexFileName;
+        return NULL;
+    }
+
+    if (bytes >= sizeof(BgzfHeader) && ((BgzfHeader *)data)->isBgzf(bytes)) {
+        size_t compressedBytes = bytes;
+        char *inflated = InflateWholeFile(data, compressedBytes, &bytes);
+        delete [] data;
+        data = inflated;
+    }
+
+    BAMIndex *index = new BAMIndex();
+    if (NULL == data || ! index->parse(data, bytes)) {
+        fprintf(stderr, "Index file %s is corrupt or isn't a BAM index\n", indexFileName);
+        delete index;
+        index = NULL;
+    }
+
+    delete [] data;
+    delete [] indexFileName;
+    return index;
+}
+
+    bool
+BAMIndex::parse(const char *data, size_t bytes)
+{
+    const char *next = data;
+    const char *end = data + bytes;
+
+#define TAKE(type, o_value) {if (next + sizeof(type) > end) return false; o_value = *(const type *)next; next += sizeof(type);}
+
+    bool csi;
+    if (bytes >= 4 && 0 == memcmp(data, "BAI\1", 4)) {
+        csi = false;
+        minShift = 14;
+        depth = 5;
+        next += 4;
+    } else if (bytes >= 4 && 0 == memcmp(data, "CSI\1", 4)) {
+        csi = true;
+        next += 4;
+        _int32 l_aux;
+        TAKE(_int32, minShift);
+        TAKE(_int32, depth);
+        TAKE(_int32, l_aux);
+        if (minShift <= 0 || minShift > 30 || depth <= 0 || depth > 10 || l_aux < 0 || next + l_aux > end) {
+            return false;
+        }
+        next += l_aux;
+    } else {
+        return false;
+    }
+
+    _int32 n_ref;
+    TAKE(_int32, n_ref);
+    if (n_ref < 0) {
+        return false;
+    }
+    nRefs = n_ref;
+    refs = new Ref[nRefs];
+
+    for (int i = 0; i < nRefs; i++) {
+        Ref *ref = &refs[i];
+        _int32 n_bin;
+        TAKE(_int32, n_bin);
+        ref->firstBin = bins.size();
+        ref->nBins = n_bin;
+        for (int j = 0; j < n_bin; j++) {
+            Bin bin;
+            _int32 n_chunk;
+            TAKE(_uint32, bin.bin);
+            bin.loffset = 0;
+            if (csi) {
+                TAKE(_uint64, bin.loffset);
+            }
+            TAKE(_int32, n_chunk);
+            if (n_chunk < 0 || next + n_chunk * sizeof(Chunk) > end) {
+                return false;
+            }
+            bin.firstChunk = chunks.size();
+            bin.nChunks = n_chunk;
+            for (int k = 0; k < n_chunk; k++) {
+                Chunk chunk;
+                TAKE(_uint64, chunk.begin);
+                TAKE(_uint64, chunk.end);
+                chunks.push_back(chunk);
+            }
+            bins.push_back(bin);
+        }
+        if (n_bin > 0) {
+            std::sort(&bins[ref->firstBin], &bins[ref->firstBin] + n_bin, Bin::before);
+        }
+
+        ref->firstInterval = intervals.size();
+        ref->nIntervals = 0;
+        if (! csi) {
+            _int32 n_intv;
+            TAKE(_int32, n_intv);
+            if (n_intv < 0 || next + n_intv * sizeof(_uint64) > end) {
+                return false;
+            }
+            ref->nIntervals = n_intv;
+            for (int k = 0; k < n_intv; k++) {
+                _uint64 interval;
+                TAKE(_uint64, interval);
+                intervals.push_back(interval);
+            }
+        }
+    }
+
+#undef TAKE
+    return true;
+}
+
+    const BAMIndex::Bin *
+BAMIndex::findBin(const Ref &ref, _uint32 bin) const
+{
+    if (0 == ref.nBins) {
+        return NULL;
+    }
+    const Bin *first = &bins[ref.firstBin];
+    Bin key;
+    key.bin = bin;
+    const Bin *found = std::lower_bound(first, first + ref.nBins, key, Bin::before);
+    return found != first + ref.nBins && found->bin == bin ? found : NULL;
+}
+
+    void
+BAMIndex::getChunks(int refId, _int64 begin, _int64 end, ChunkVector *o_chunks) const
+{
+    o_chunks->clear();
+    if (refId < 0 || refId >= nRefs || end <= begin) {
+        return;
+    }
+    const Ref &ref = refs[refId];
+    begin = max(begin, (_int64)0);
+    end = min(end, ((_int64)1 << (minShift + 3 * depth)));
+
+    //
+    // Nothing that overlaps the region starts before the first read that overlaps its first window: a BAI has that in
+    // its linear index, and a CSI in the loffset of the smallest bin that holds the region's start.
+    //
+    _uint64 minOffset = 0;
+    if (ref.nIntervals > 0) {
+        _int64 window = begin >> minShift;
+        minOffset = intervals[ref.firstInterval + (int)min(window, (_int64)ref.nIntervals - 1)];
+    } else {
+        for (int level = depth; level >= 0; level--) {
+            _uint32 levelStart = ((1 << (3 * level)) - 1) / 7;
+            const Bin *bin = findBin(ref, levelStart + (_uint32)(begin >> (minShift + 3 * (depth - level))));
+            if (NULL != bin) {
+                minOffset = bin->loffset;
+                break;
+            }
+        }
+    }
+
+    //
+    // Every bin on every level that overlaps the region.
+    //
+    for (int level = 0; level <= depth; level++) {
+        _uint32 levelStart = ((1 << (3 * level)) - 1) / 7;
+        int shift = minShift + 3 * (depth - level);
+        for (_uint32 b = levelStart + (_uint32)(begin >> shift); b <= levelStart + (_uint32)((end - 1) >> shift); b++) {
+            const Bin *bin = findBin(ref, b);
+            if (NULL == bin) {
+                continue;
+            }
+            for (int k = 0; k < bin->nChunks; k++) {
+                const Chunk &chunk = chunks[bin->firstChunk + k];
+                if (chunk.end > minOffset) {
+                    o_chunks->push_back(chunk);
+                }
+            }
+        }
+    }
+
+    //
+    // Into file order, and merged with anything they overlap or share a BGZF block with, so each block is read once.
+    //
+    if (0 == o_chunks->size()) {
+        return;
+    }
+    std::sort(o_chunks->begin(), o_chunks->end(), Chunk::before);
+    int nMerged = 1;
+    for (int i = 1; i < o_chunks->size(); i++) {
+        Chunk &last = (*o_chunks)[nMerged - 1];
+        const Chunk &chunk = (*o_chunks)[i];
+        if ((chunk.begin >> 16) <= (last.end >> 16)) {
+            last.end = max(last.end, chunk.end);
+        } else {
+            (*o_chunks)[nMerged++] = chunk;
+        }
+    }
+    o_chunks->truncate(nMerged);
+}
+
+    bool
+BAMIndex::readRange(FILE *file, _uint64 begin, _uint64 end, char **io_data, size_t *io_capacity, size_t *o_bytes)
+{
+    //
+    // Read all of the compressed blocks at once: from the one begin is in to the one end is in, which is at most a
+    // block past end's block offset.
+    //
+    _int64 compressedBegin = begin >> 16;
+    _int64 compressedEnd = end >> 16;
+    size_t compressedBytes = (size_t)(compressedEnd - compressedBegin) + BAM_BLOCK;
+    char *compressed = new char[compressedBytes];
+    if (0 != _fseek64bit(file, compressedBegin, SEEK_SET)) {
+        fprintf(stderr, "BAMIndex::readRange: seek to %lld failed\n", compressedBegin);
+        delete [] compressed;
+        return false;
+    }
+    compressedBytes = fread(compressed, 1, compressedBytes, file);
+
+    z_stream zstream;
+    memset(&zstream, 0, sizeof(zstream));
+    if (Z_OK != inflateInit2(&zstream, -15)) {
+        fprintf(stderr, "BAMIndex::readRange: inflateInit2 failed\n");
+        delete [] compressed;
+        return false;
+    }
+
+    size_t used = 0;
+    size_t offset = 0;
+    bool worked = true;
+    char block[BAM_BLOCK];
+    while (worked && compressedBegin + (_int64)offset <= compressedEnd) {
+        if (offset >= compressedBytes) {
+            break;  // The end of the file
+        }
+        BgzfHeader *header = (BgzfHeader *)(compressed + offset);
+        if (! header->isBgzf(compressedBytes - offset)) {
+            if (compressedBegin + (_int64)offset == compressedEnd && 0 == (end & 0xffff)) {
+                break;  // end is the very end of the file
+            }
+            fprintf(stderr, "BAMIndex::readRange: no BGZF block at offset %lld\n", compressedBegin + (_int64)offset);
+            worked = false;
+            break;
+        }
+        size_t blockBytes = header->BSIZE() + 1;
+        size_t dataOffset = sizeof(BgzfHeader) + header->XLEN;
+        if (offset + blockBytes > compressedBytes || blockBytes < dataOffset + 8) {
+            fprintf(stderr, "BAMIndex::readRange: truncated BGZF block at offset %lld\n", compressedBegin + (_int64)offset);
+            worked = false;
+            break;
+        }
+
+        inflateReset(&zstream);
+        zstream.next_in = (Bytef *)(compressed + offset + dataOffset);
+        zstream.avail_in = (uInt)(blockBytes - dataOffset - 8);
+        zstream.next_out = (Bytef *)block;
+        zstream.avail_out = BAM_BLOCK;
+        if (Z_STREAM_END != inflate(&zstream, Z_FINISH)) {
+            fprintf(stderr, "BAMIndex::readRange: BGZF block at offset %lld doesn't inflate\n", compressedBegin + (_int64)offset);
+            worked = false;
+            break;
+        }
+        size_t blockSize = BAM_BLOCK - zstream.avail_out;
+
+        bool first = 0 == offset;
+        bool last = compressedBegin + (_int64)offset == compressedEnd;
+        size_t from = first ? (size_t)(begin & 0xffff) : 0;
+        size_t to = last ? min(blockSize, (size_t)(end & 0xffff)) : blockSize;
+        if (to > from) {
+            if (used + (to - from) > *io_capacity) {
+                size_t newCapacity = max(2 * *io_capacity, used + (to - from));
+                char *bigger = new char[newCapacity];
+                memcpy(bigger, *io_data, used);
+                delete [] *io_data;
+                *io_data = bigger;
+                *io_capacity = newCapacity;
+            }
+            memcpy(*io_data + used, block + from, to - from);
+            used += to - from;
+        }
+        offset += blockBytes;
+    }
+
+    inflateEnd(&zstream);
+    delete [] compressed;
+    *o_bytes = used;
+    return worked;
+}
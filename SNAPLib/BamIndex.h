@@ -0,0 +1,93 @@
+/*++
+
+Module Name:
+
+    BamIndex.h
+
+Abstract:
+
+    Reader for BAM indices (.bai and .csi), for going straight to the reads in a region of a sorted BAM file.
+
+Environment:
+
+    User mode service.
+
+    Thread safe once it's loaded.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "BigAlloc.h"
+#include "VariableSizeVector.h"
+
+class BAMIndex
+{
+public:
+    //
+    // Loads the index for bamFileName: <name>.bai, <name>.csi (which is what SNAP writes with -so for genomes with
+    // contigs too long for a .bai), or the name with .bam replaced by .bai.  Returns NULL, with a message, if there
+    // isn't one or it doesn't parse.
+    //
+    static BAMIndex *load(const char *bamFileName);
+
+    ~BAMIndex();
+
+    //
+    // A range of the BAM file, as BGZF virtual offsets (compressed block offset << 16 | offset in the block).
+    //
+    struct Chunk {
+        _uint64     begin;
+        _uint64     end;
+
+        static bool before(const Chunk &a, const Chunk &b) {return a.begin < b.begin;}
+    };
+    typedef VariableSizeVector<Chunk> ChunkVector;
+
+    //
+    // Fills in chunks, in file order and without overlaps, with the parts of the file that hold every read on refId
+    // that overlaps [begin, end) (zero based).  They can hold other reads too.
+    //
+    void getChunks(int refId, _int64 begin, _int64 end, ChunkVector *chunks) const;
+
+    inline int getNumRefs() const {return nRefs;}
+
+    //
+    // Decompresses the part of an open BGZF file from virtual offset begin up to end, into *o_data (which is
+    // reallocated as it needs to grow, with its size in *io_capacity).  Returns false, with a message, on failure.
+    //
+    static bool readRange(FILE *file, _uint64 begin, _uint64 end, char **io_data, size_t *io_capacity, size_t *o_bytes);
+
+private:
+    BAMIndex() : nRefs(0), refs(NULL) {}
+
+    bool parse(const char *data, size_t bytes);
+
+    struct Bin {
+        _uint32     bin;
+        _uint64     loffset;        // CSI only: where reads overlapping the bin can start
+        int         firstChunk;
+        int         nChunks;
+
+        static bool before(const Bin &a, const Bin &b) {return a.bin < b.bin;}
+    };
+
+    struct Ref {
+        int         firstBin;       // Sorted by bin number
+        int         nBins;
+        int         firstInterval;  // BAI only: the least offset of a read overlapping each 1 << minShift window
+        int         nIntervals;
+    };
+
+    const Bin *findBin(const Ref &ref, _uint32 bin) const;
+
+    int         minShift;
+    int         depth;
+    int         nRefs;
+    Ref        *refs;
+
+    VariableSizeVector<Bin>         bins;
+    ChunkVector                     chunks;
+    VariableSizeVector<_uint64>     intervals;
+};
@@ -0,0 +1,323 @@
+/*++
+
+Module Name:
+
+    BandedAligner.cpp
+
+Abstract:
+
+    Edit distance restricted to a band of diagonals.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "BandedAligner.h"
+#include "Tables.h"
+
+#if     defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+static const int LanesPerVector = 8;
+static const short Infinity = 0x7800;   // More than any real score, and adding a little to it saturates rather than wraps
+
+BandedAligner::BandedAligner() : rows(NULL), rowsSize(0), paddedText(NULL), paddedTextSize(0), patternBits(NULL), patternBitsSize(0),
+    column(NULL), columnSize(0), endScores(NULL), endScoresSize(0)
+{
+}
+
+BandedAligner::~BandedAligner()
+{
+    delete [] rows;
+    delete [] paddedText;
+    delete [] patternBits;
+    delete [] column;
+    delete [] endScores;
+}
+
+    void
+BandedAligner::reserve(int nCells, int textSize)
+{
+    if (nCells > rowsSize) {
+        delete [] rows;
+        rowsSize = nCells;
+        rows = new short[rowsSize];
+    }
+
+    if (textSize > paddedTextSize) {
+        delete [] paddedText;
+        paddedTextSize = textSize;
+        paddedText = new char[paddedTextSize];
+    }
+}
+
+    int
+BandedAligner::computeEditDistance(
+    const char *text,
+    int         textLen,
+    const char *pattern,
+    int         patternLen,
+    int         dLow,
+    int         dHigh,
+    int        *textUsed)
+{
+    if (dLow > dHigh || dHigh - dLow >= MaxPatternLength || patternLen > MaxPatternLength || textLen > MaxPatternLength) {
+        return -1;
+    }
+    if (NULL == textUsed && (textLen - patternLen < dLow || textLen - patternLen > dHigh)) {
+        return -1;  // The end isn't in the band
+    }
+
+    const int bandWidth = dHigh - dLow + 1;
+    const int nVectors = (bandWidth + LanesPerVector - 1) / LanesPerVector;
+    const int rowLength = nVectors * LanesPerVector + 2 * LanesPerVector;
+
+    //
+    // The cells of a row read the text from offset i + dLow - 1 on, so pad it with bytes that match nothing to cover
+    // however far the band hangs off either end.
+    //
+    const int textBefore = __max(0, -dLow) + LanesPerVector;
+    const int textAfter = __max(0, patternLen + dLow + nVectors * LanesPerVector - textLen) + LanesPerVector;
+    reserve(2 * rowLength, textBefore + textLen + textAfter);
+
+    memset(paddedText, 0, textBefore);
+    memcpy(paddedText + textBefore, text, textLen);
+    memset(paddedText + textBefore + textLen, 0, textAfter);
+    const char *paddedTextStart = paddedText + textBefore;
+
+    for (int i = 0; i < 2 * rowLength; i++) {
+        rows[i] = Infinity;     // Including the margins, which are never written after this
+    }
+    short *previous = rows + LanesPerVector;
+    short *current = rows + rowLength + LanesPerVector;
+
+    //
+    // Row 0 is all deletions from the text.
+    //
+    for (int index = 0; index < bandWidth; index++) {
+        int j = dLow + index;
+        if (j >= 0 && j <= textLen) {
+            previous[index] = (short)j;
+        }
+    }
+
+#if     defined(__SSE2__) || defined(_M_X64)
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i two = _mm_set1_epi16(2);
+    const __m128i four = _mm_set1_epi16(4);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i infinity = _mm_set1_epi16(Infinity);
+    const __m128i infinityInLowest1 = _mm_set_epi16(0, 0, 0, 0, 0, 0, 0, Infinity);
+    const __m128i infinityInLowest2 = _mm_set_epi16(0, 0, 0, 0, 0, 0, Infinity, Infinity);
+    const __m128i infinityInLowest4 = _mm_set_epi16(0, 0, 0, 0, Infinity, Infinity, Infinity, Infinity);
+    const __m128i laneNumbers = _mm_set_epi16(7, 6, 5, 4, 3, 2, 1, 0);
+    const __m128i laneDistances = _mm_set_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+#endif  // SSE2
+
+    for (int i = 1; i <= patternLen; i++) {
+        //
+        // The cells in the band that are in the matrix, that is, have 0 <= j <= textLen.
+        //
+        int firstIndex = __max(0, -i - dLow);
+        int lastIndex = __min(bandWidth - 1, textLen - i - dLow);
+        if (firstIndex > lastIndex) {
+            return -1;  // The band has left the matrix
+        }
+
+        const char *rowText = paddedTextStart + i + dLow - 1;
+        char patternBase = pattern[i - 1];
+
+#if     defined(__SSE2__) || defined(_M_X64)
+        const __m128i patternBases = _mm_set1_epi16((unsigned char)patternBase);
+        const __m128i firstValid = _mm_set1_epi16((short)(firstIndex - 1));
+        const __m128i lastValid = _mm_set1_epi16((short)(lastIndex + 1));
+        short carry = Infinity;
+        for (int v = 0; v < nVectors; v++) {
+            int base = v * LanesPerVector;
+
+            //
+            // From the row before: the same diagonal (a match or substitution) or the next one up (an insertion).
+            //
+            __m128i textBases = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(rowText + base)), zero);
+            __m128i substitutionCost = _mm_add_epi16(one, _mm_cmpeq_epi16(textBases, patternBases));
+            __m128i diagonal = _mm_adds_epi16(_mm_loadu_si128((const __m128i *)(previous + base)), substitutionCost);
+            __m128i up = _mm_adds_epi16(_mm_loadu_si128((const __m128i *)(previous + base + 1)), one);
+            __m128i cells = _mm_min_epi16(diagonal, up);
+
+            //
+            // From the left (a deletion), as a running minimum along the row.
+            //
+            cells = _mm_min_epi16(cells, _mm_adds_epi16(_mm_or_si128(_mm_slli_si128(cells, 2), infinityInLowest1), one));
+            cells = _mm_min_epi16(cells, _mm_adds_epi16(_mm_or_si128(_mm_slli_si128(cells, 4), infinityInLowest2), two));
+            cells = _mm_min_epi16(cells, _mm_adds_epi16(_mm_or_si128(_mm_slli_si128(cells, 8), infinityInLowest4), four));
+            cells = _mm_min_epi16(cells, _mm_adds_epi16(_mm_set1_epi16(carry), laneDistances));
+
+            __m128i indices = _mm_add_epi16(_mm_set1_epi16((short)base), laneNumbers);
+            __m128i valid = _mm_and_si128(_mm_cmpgt_epi16(indices, firstValid), _mm_cmpgt_epi16(lastValid, indices));
+            cells = _mm_or_si128(_mm_and_si128(valid, cells), _mm_andnot_si128(valid, infinity));
+
+            _mm_storeu_si128((__m128i *)(current + base), cells);
+            carry = (short)_mm_extract_epi16(cells, 7);
+        }
+#else   // SSE2
+        for (int index = 0; index < nVectors * LanesPerVector; index++) {
+            if (index < firstIndex || index > lastIndex) {
+                current[index] = Infinity;
+                continue;
+            }
+            int best = previous[index] + (rowText[index] == patternBase ? 0 : 1);
+            best = __min(best, previous[index + 1] + 1);
+            best = __min(best, current[index - 1] + 1);
+            current[index] = (short)__min(best, (int)Infinity);
+        }
+#endif  // SSE2
+
+        short *swap = previous;
+        previous = current;
+        current = swap;
+    }
+
+    if (NULL == textUsed) {
+        int score = previous[textLen - patternLen - dLow];
+        return score >= Infinity ? -1 : score;
+    }
+
+    //
+    // Pick the end in the text, preferring the main diagonal and then the ones nearest it when there's a tie.
+    //
+    int bestScore = Infinity;
+    int bestJ = -1;
+    for (int index = 0; index < bandWidth; index++) {
+        int j = patternLen + dLow + index;
+        if (previous[index] < bestScore || (previous[index] == bestScore && abs(j - patternLen) < abs(bestJ - patternLen))) {
+            bestScore = previous[index];
+            bestJ = j;
+        }
+    }
+    if (bestScore >= Infinity) {
+        return -1;
+    }
+
+    *textUsed = bestJ;
+    return bestScore;
+}
+
+    int
+BandedAligner::findPattern(
+    const char *text,
+    int         textLen,
+    const char *pattern,
+    int         patternLen,
+    int        *textEnd,
+    int        *secondBestScore,
+    int        *secondTextEnd)
+{
+    *secondBestScore = -1;
+    if (patternLen <= 0 || textLen < patternLen || patternLen > MaxPatternLength || textLen > MaxPatternLength) {
+        return -1;
+    }
+
+    //
+    // Which of the pattern's bases are each base, a bit per base, in BASE_VALUE order.  Ns (and anything else) are the
+    // fifth, which matches nothing.
+    //
+    const int nWords = (patternLen + 63) / 64;
+    if (5 * nWords > patternBitsSize) {
+        delete [] patternBits;
+        patternBitsSize = 5 * nWords;
+        patternBits = new _uint64[patternBitsSize];
+    }
+    memset(patternBits, 0, 5 * nWords * sizeof(_uint64));
+    for (int i = 0; i < patternLen; i++) {
+        int base = BASE_VALUE[(unsigned char)pattern[i]];
+        if (base < 4) {
+            patternBits[base * nWords + i / 64] |= (_uint64)1 << (i % 64);
+        }
+    }
+
+    if (textLen + 1 > endScoresSize) {
+        delete [] endScores;
+        endScoresSize = textLen + 1;
+        endScores = new int[endScoresSize];
+    }
+    if (2 * nWords > columnSize) {
+        delete [] column;
+        columnSize = 2 * nWords;
+        column = new _uint64[columnSize];
+    }
+
+    //
+    // Myers' bit vectors for the column: which rows are one more than the row above (positive) and which one less
+    // (negative).  The first column goes up by one each row, and the top row is all zeroes, so nothing comes in from
+    // above.  The bits past the end of the pattern in the last word are rows that aren't there, which is harmless
+    // because nothing in a column depends on the rows below it.
+    //
+    _uint64 *positive = column;
+    _uint64 *negative = column + nWords;
+    for (int w = 0; w < nWords; w++) {
+        positive[w] = ~(_uint64)0;
+        negative[w] = 0;
+    }
+    const int lastRowShift = (patternLen - 1) % 64;
+
+    //
+    // The change across the column in the last row of each word goes into the first row of the next, as a bit for
+    // up and one for down, which is shifted and or'd in rather than tested so that there are no branches to mispredict.
+    //
+    int score = patternLen;
+    endScores[0] = score;
+    for (int j = 0; j < textLen; j++) {
+        const _uint64 *matches = patternBits + BASE_VALUE[(unsigned char)text[j]] * nWords;
+        _uint64 carryUp = 0, carryDown = 0;
+        for (int w = 0; w < nWords; w++) {
+            _uint64 pv = positive[w];
+            _uint64 mv = negative[w];
+            _uint64 eq = matches[w];
+            _uint64 xv = eq | mv;
+            eq |= carryDown;
+            _uint64 xh = (((eq & pv) + pv) ^ pv) | eq;
+            _uint64 ph = mv | ~(xh | pv);
+            _uint64 mh = pv & xh;
+
+            int outShift = w == nWords - 1 ? lastRowShift : 63;
+            _uint64 up = (ph >> outShift) & 1;
+            _uint64 down = (mh >> outShift) & 1;
+
+            ph = (ph << 1) | carryUp;
+            mh = (mh << 1) | carryDown;
+            positive[w] = mh | ~(xv | ph);
+            negative[w] = ph & xv;
+            carryUp = up;
+            carryDown = down;
+        }
+        score += (int)carryUp - (int)carryDown;
+        endScores[j + 1] = score;
+    }
+
+    //
+    // The leftmost of the ends with the fewest edits, and then the fewest edits of any end far enough from it not to be
+    // the same alignment with the end moved along a little.
+    //
+    int bestJ = 0;
+    for (int j = 1; j <= textLen; j++) {
+        if (endScores[j] < endScores[bestJ]) {
+            bestJ = j;
+        }
+    }
+
+    int secondScore = -1;
+    for (int j = 0; j <= textLen; j++) {
+        if (abs(j - bestJ) > patternLen / 2 && (secondScore < 0 || endScores[j] < secondScore)) {
+            secondScore = endScores[j];
+            *secondTextEnd = j;
+        }
+    }
+
+    *textEnd = bestJ;
+    *secondBestScore = secondScore;
+    return endScores[bestJ];
+}
@@ -0,0 +1,78 @@
+/*++
+
+Module Name:
+
+    BandedAligner.h
+
+Abstract:
+
+    Edit distance restricted to a band of diagonals, for the long stretches of long reads that Landau-Vishkin's
+    limit on the number of edits makes it unsuitable for.
+
+Environment:
+
+    User mode service.
+
+    Not thread safe; each thread needs its own.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+
+//
+// The dynamic program for the edit distance between a pattern and a text, computed only for the cells on the
+// diagonals dLow through dHigh (diagonal d holds the cells that pair pattern offset i with text offset i + d), so the
+// time is proportional to the pattern length times the band width, however many edits there are.  That makes it the
+// right tool when the caller knows about where the alignment goes, as the long read aligner does between two
+// anchoring seed hits, but there may be more edits than LV's MAX_K.
+//
+// Each row of the band is done eight cells at a time with SSE2.  The cells' dependencies on the row before are
+// independent of each other; the dependency on the cell to the left (a deletion from the pattern) is a running
+// minimum along the row, which is done with log-step shifts within each vector and a carry from one to the next.
+//
+class BandedAligner {
+public:
+    BandedAligner();
+    ~BandedAligner();
+
+    //
+    // The edit distance between all of pattern and all of text (whose end must then be on a diagonal in the band),
+    // or, if textUsed isn't NULL, all of pattern and whichever prefix of text gives the fewest edits, which is
+    // returned in textUsed.  Returns -1 if the end isn't in the band, or if the pattern is too long for the 16 bit
+    // scores (MaxPatternLength).
+    //
+    int computeEditDistance(const char *text, int textLen, const char *pattern, int patternLen, int dLow, int dHigh,
+                            int *textUsed = NULL);
+
+    //
+    // Where in text all of pattern fits with the fewest edits, starting anywhere, for looking for a read in a window of
+    // the genome.  Returns the edits and fills in textEnd with the offset just past the end of the leftmost alignment
+    // that has that few, and secondBestScore and secondTextEnd with the same for the best alignment that ends more than
+    // half the pattern away from it (the score is -1 if there isn't one).  Returns -1 if the pattern doesn't fit or
+    // either is too long.
+    //
+    // Every diagonal is in play here, so rather than the band this runs Myers' bit-vector algorithm down each column of
+    // the text, 64 of the pattern's bases to a word, which is far less work per cell than the band's eight lanes.
+    //
+    int findPattern(const char *text, int textLen, const char *pattern, int patternLen, int *textEnd, int *secondBestScore,
+                    int *secondTextEnd);
+
+    static const int MaxPatternLength = 30000;
+
+private:
+    void reserve(int nCells, int textLen);
+
+    short      *rows;           // Two rows, each of the band width rounded up to a vector plus a vector of margin on each end
+    int         rowsSize;
+    char       *paddedText;     // The text with a band width of unmatchable bytes on each end
+    int         paddedTextSize;
+
+    _uint64    *patternBits;    // For findPattern: the pattern's bits for each base
+    int         patternBitsSize;
+    _uint64    *column;         // Its column's positive and negative bit vectors
+    int         columnSize;
+    int        *endScores;      // The edits to end at each offset in the text
+    int         endScoresSize;
+};
@@ -34,6 +34,8 @@ Revision History:
 #include "SeedSequencer.h"
 #include "exit.h"
 #include "AlignerOptions.h"
+#include "PerfCounters.h"
+#include "SAM.h"
 
 using std::min;
 
@@ -55,10 +57,11 @@ BaseAligner::BaseAligner(
     LandauVishkin<-1>*i_reverseLandauVishkin,
     AlignerStats   *i_stats,
     BigAllocator   *allocator) :
-        genomeIndex(i_genomeIndex), maxHitsToConsider(i_maxHitsToConsider), maxK(i_maxK),
+        genomeIndex(i_genomeIndex), decodedHits(i_maxHitsToConsider), maxHitsToConsider(i_maxHitsToConsider), maxK(i_maxK),
         maxReadSize(i_maxReadSize), maxSeedsToUseFromCommandLine(i_maxSeedsToUseFromCommandLine),
         maxSeedCoverage(i_maxSeedCoverage), readId(-1), extraSearchDepth(i_extraSearchDepth),
-        explorePopularSeeds(false), stopOnFirstHit(false), stats(i_stats)
+        explorePopularSeeds(false), stopOnFirstHit(false), mapqToStopAt(0), exactMatchMapq(0), lvBudget(0), realignRadius(0),
+        orderSeedsByHits(false), seedLookupsToReuse(NULL), stats(i_stats)
 /*++
 
 Routine Description:
@@ -91,10 +94,13 @@ Arguments:
     nHitsIgnoredBecauseOfTooHighPopularity = 0;
     nReadsIgnoredBecauseOfTooManyNs = 0;
     nIndelsMerged = 0;
+    nReadsOverLVBudget = 0;
 
     genome = genomeIndex->getGenome();
     seedLen = genomeIndex->getSeedLength();
 
+    decodedHits.setSkipPopularLists(!explorePopularSeeds);  // Popular seeds are ignored unless we're exploring them
+
     probDistance = new ProbabilityDistance(SNP_PROB, GAP_OPEN_PROB, GAP_EXTEND_PROB);  // Match Mason
 
     if ((i_landauVishkin == NULL) != (i_reverseLandauVishkin == NULL)) {
@@ -117,6 +123,11 @@ Arguments:
         ownLandauVishkin = false;
     }
 
+    lvVerifier = LandauVishkinVerifier(landauVishkin, reverseLandauVishkin);
+    verifier = &lvVerifier;
+    verifyBatchSize = 1;
+    batchUnpackBuffer = NULL;
+
     unsigned maxSeedsToUse;
     if (0 != maxSeedsToUseFromCommandLine) {
         maxSeedsToUse = maxSeedsToUseFromCommandLine;
@@ -145,6 +156,46 @@ Arguments:
 
     rcReadData = (char *)BigAlloc(sizeof(char) * maxReadSize);
 
+    //
+    // Packed genomes can't be read in place, so we unpack the bases we score into here.  It has room for the read, the
+    // extra MAX_K for deletions and MAX_K on either side for the reverse edit distance to look at.
+    //
+    genomeUnpackBufferSize = maxReadSize + 3 * MAX_K;
+    if (allocator) {
+        genomeUnpackBuffer = (char *)allocator->allocate(genomeUnpackBufferSize);
+    } else {
+        genomeUnpackBuffer = (char *)BigAlloc(genomeUnpackBufferSize);
+    }
+
+    if (allocator) {
+        packedSeedStorage = allocator->allocate(PackedSeeds::getStorageSize(maxReadSize));
+    } else {
+        packedSeedStorage = BigAlloc(PackedSeeds::getStorageSize(maxReadSize));
+    }
+    packedSeeds.setStorage(packedSeedStorage, maxReadSize);
+
+    if (allocator) {
+        minimizerHashes = (_uint64 *)allocator->allocate(sizeof(_uint64) * maxReadSize);
+        isMinimizer = (bool *)allocator->allocate(sizeof(bool) * maxReadSize);
+    } else {
+        minimizerHashes = (_uint64 *)BigAlloc(sizeof(_uint64) * maxReadSize);
+        isMinimizer = (bool *)BigAlloc(sizeof(bool) * maxReadSize);
+    }
+
+    maxFirstPassSeeds = maxReadSize / seedLen + 1;
+    if (allocator) {
+        firstPassStorage = allocator->allocate(getFirstPassStorageSize(maxReadSize, seedLen));
+    } else {
+        firstPassStorage = BigAlloc(getFirstPassStorageSize(maxReadSize, seedLen));
+    }
+    firstPassSeeds = (Seed *)firstPassStorage;
+    firstPassHits[FORWARD] = (const GenomeLocation **)(firstPassSeeds + maxFirstPassSeeds);
+    firstPassHits[RC] = firstPassHits[FORWARD] + maxFirstPassSeeds;
+    firstPassNHits[FORWARD] = (unsigned *)(firstPassHits[RC] + maxFirstPassSeeds);
+    firstPassNHits[RC] = firstPassNHits[FORWARD] + maxFirstPassSeeds;
+    firstPassOffsets = firstPassNHits[RC] + maxFirstPassSeeds;
+    firstPassOrder = firstPassOffsets + maxFirstPassSeeds;
+
     // treat everything but ACTG like N
     for (unsigned i = 0; i < 256; i++) {
         nTable[i] = 1;
@@ -192,7 +243,9 @@ Arguments:
 
     for (unsigned i = 0; i < maxSeedsToUse + 1; i++) {
         weightLists[i].init();
+        weightLists[i].weightNext = weightLists[i].weightPrev = &weightLists[i];
     }
+    highestUsedWeightList = 0;
 
     for (Direction rc = 0; rc < NUM_DIRECTIONS; rc++) {
         memset(candidateHashTable[rc],0,sizeof(HashTableAnchor) * candidateHashTablesSize);
@@ -201,11 +254,84 @@ Arguments:
 }
 
     AlignmentResult
-BaseAligner::AlignRead(Read *inputRead, unsigned *genomeLocation, Direction *hitDirection, int *finalScore, int *mapq, IdPairVector* secondary)
+BaseAligner::AlignRead(Read *inputRead, GenomeLocation *genomeLocation, Direction *hitDirection, int *finalScore, int *mapq, IdPairVector* secondary)
 {
     return AlignRead(inputRead, genomeLocation, hitDirection, finalScore, mapq, secondary, 0, 0, FORWARD /*This is ignored when searchRadius = 0*/);
 }
 
+    void
+BaseAligner::AlignReads(
+    Read           **inputReads,
+    unsigned         nReads,
+    AlignmentResult *results,
+    GenomeLocation  *genomeLocations,
+    Direction       *hitDirections,
+    int             *finalScores,
+    int             *mapqs,
+    IdPairVector    *secondary,
+    _int64          *alignTicks)
+{
+    if (doAlignerPrefetch) {
+        //
+        // AlignRead's first pass uses the seeds that start every seedLen bases, and it's only the first of those that
+        // gets no prefetch from within AlignRead, so getting them all to the cache here is what takes the first lookups
+        // for each read off the critical path.  This is just a hint, so there's no need to worry about seeds that
+        // AlignRead will end up not using.
+        //
+        for (unsigned i = 0; i < nReads; i++) {
+            unsigned readLen = inputReads[i]->getDataLength();
+            const char *readData = inputReads[i]->getData();
+            for (unsigned offset = 0; offset + seedLen <= readLen; offset += seedLen) {
+                if (Seed::DoesTextRepresentASeed(readData + offset, seedLen)) {
+                    genomeIndex->prefetchSeed(Seed(readData + offset, seedLen));
+                }
+            }
+        }
+    }
+
+    for (unsigned i = 0; i < nReads; i++) {
+        _int64 start = NULL == alignTicks ? 0 : PerfTicks();
+        genomeLocations[i] = InvalidGenomeLocation;
+        if (0 == realignRadius || NULL != secondary ||
+                !alignNearOriginalLocation(inputReads[i], &results[i], &genomeLocations[i], &hitDirections[i], &finalScores[i], &mapqs[i])) {
+            results[i] = AlignRead(inputReads[i], &genomeLocations[i], &hitDirections[i], &finalScores[i], &mapqs[i], NULL == secondary ? NULL : &secondary[i]);
+        }
+        if (NULL != alignTicks) {
+            alignTicks[i] = PerfTicks() - start;
+        }
+    }
+}
+
+    bool
+BaseAligner::alignNearOriginalLocation(
+    Read            *read,
+    AlignmentResult *result,
+    GenomeLocation  *genomeLocation,
+    Direction       *hitDirection,
+    int             *finalScore,
+    int             *mapq)
+{
+    //
+    // Only reads whose input alignment was confident in the first place (with the whole genome to choose from) can skip
+    // the whole genome search, and then they keep the lower of the two MAPQs, since the local search can't see what
+    // else there is.  FASTQ reads have no location, and 255 is SAM for no MAPQ.
+    //
+    unsigned originalMAPQ = read->getOriginalMAPQ();
+    if (InvalidGenomeLocation == read->getOriginalAlignedLocation() || originalMAPQ < MAPQ_LIMIT_FOR_SINGLE_HIT || originalMAPQ >= 255) {
+        return false;
+    }
+
+    Direction originalDirection = (read->getOriginalSAMFlags() & SAM_REVERSE_COMPLEMENT) ? RC : FORWARD;
+    *result = AlignRead(read, genomeLocation, hitDirection, finalScore, mapq, NULL, realignRadius, read->getOriginalAlignedLocation(),
+        originalDirection);
+    if (SingleHit != *result) {
+        *genomeLocation = InvalidGenomeLocation;
+        return false;
+    }
+
+    *mapq = __min((unsigned)*mapq, originalMAPQ);
+    return true;
+}
 
 #ifdef  _DEBUG
 bool _DumpAlignments = false;
@@ -214,13 +340,13 @@ bool _DumpAlignments = false;
     AlignmentResult
 BaseAligner::AlignRead(
     Read      *inputRead,
-    unsigned  *genomeLocation,
+    GenomeLocation *genomeLocation,
     Direction *hitDirection,
     int       *finalScore,
     int       *mapq,
     IdPairVector* secondary,
     unsigned   searchRadius,
-    unsigned   searchLocation,
+    GenomeLocation searchLocation,
     Direction  searchDirection)
 /*++
 
@@ -255,8 +381,9 @@ Return Value:
     //
     int unusedMapq;
     int unusedFinalScore;
+    decodedHits.reset();
     firstPassSeedsNotSkipped[FORWARD] = firstPassSeedsNotSkipped[RC] = 0;
-    smallestSkippedSeed[FORWARD] = smallestSkippedSeed[RC] = InvalidGenomeLocation;
+    smallestSkippedSeed[FORWARD] = smallestSkippedSeed[RC] = 0xffffffff;
     highestWeightListChecked = 0;
 
     Direction localHitDirection; // This is just a place to write into if the caller didn't want to know the direction
@@ -289,17 +416,18 @@ Return Value:
     popularSeedsSkipped = 0;
 
     // Range of genome locations to search in.
-    unsigned minLocation = 0;
-    unsigned maxLocation = 0xFFFFFFFF;
+    GenomeLocation minLocation = 0;
+    GenomeLocation maxLocation = InvalidGenomeLocation;
     if (searchRadius != 0) {
         minLocation = (searchLocation > searchRadius) ? searchLocation - searchRadius : 0;
-        maxLocation = (searchLocation < 0xFFFFFFFF - searchRadius) ? searchLocation + searchRadius : 0xFFFFFFFF;
+        maxLocation = (searchLocation < InvalidGenomeLocation - searchRadius) ? searchLocation + searchRadius : InvalidGenomeLocation;
     }
 
     AlignmentResult finalResult;
 
     if (secondary != NULL) {
         secondary->clear();
+        secondaryCandidates.reset();
     }
 
     //
@@ -353,6 +481,13 @@ Return Value:
         return NotFound;
     }
 
+    if (0 != exactMatchMapq && 0 == countOfNs && 0 == searchRadius && NULL == secondary && NULL == seedLookupsToReuse &&
+            1 == genomeIndex->getMinimizerWindow() && tryExactMatch(inputRead, genomeLocation, hitDirection, finalScore, mapq)) {
+        return SingleHit;
+    }
+
+    packedSeeds.pack(readData, readLen);
+
     //
     // Block off any seeds that would contain an N.
     //
@@ -371,6 +506,19 @@ Return Value:
         }
     }
 
+    //
+    // And, if the index only has minimizers, any seeds that aren't, since they'd never be found.
+    //
+    unsigned minimizerWindow = genomeIndex->getMinimizerWindow();
+    if (minimizerWindow > 1) {
+        packedSeeds.findMinimizers(seedLen, minimizerWindow, minimizerHashes, isMinimizer);
+        for (unsigned i = 0; i + seedLen <= readLen; i++) {
+            if (!isMinimizer[i]) {
+                SetSeedUsed(i);
+            }
+        }
+    }
+
     Read reverseComplimentRead;
     Read *read[NUM_DIRECTIONS];
     read[FORWARD] = inputRead;
@@ -400,7 +548,46 @@ Return Value:
 
     scoreLimit = maxK + extraSearchDepth; // For MAPQ computation
 
+    if (searchRadius != 0) {
+        //
+        // Only searchDirection's locations can be candidates, so there's nothing unseen in the other direction to keep
+        // the search going for.
+        //
+        lowestPossibleScoreOfAnyUnseenLocation[OppositeDirection(searchDirection)] = scoreLimit + 1;
+    }
+
+    if (0 != mapqToStopAt) {
+        highestEditProbability = GAP_OPEN_PROB;
+        const char *quality = inputRead->getQuality();
+        for (unsigned i = 0; i < readLen; i++) {
+            highestEditProbability = __max(highestEditProbability, lv_phredToProbability[(unsigned char)quality[i]]);
+        }
+    }
+
+    GenomeLocation minSeedLoc = (minLocation < readLen ? 0 : minLocation - readLen);
+    GenomeLocation maxSeedLoc = (maxLocation > InvalidGenomeLocation - readLen ? InvalidGenomeLocation : maxLocation + readLen);
+
+    unsigned nFirstPassSeeds = 0;
+    unsigned nFirstPassSeedsUsed = 0;
+    if (orderSeedsByHits && NULL == seedLookupsToReuse) {
+        nFirstPassSeeds = lookUpFirstPassSeeds(nPossibleSeeds, minSeedLoc, maxSeedLoc);
+    }
+
     while (nSeedsApplied[FORWARD] + nSeedsApplied[RC] < maxSeedsToUse) {
+        //
+        // If the first pass's seeds were looked up in advance, take the next of them in their order.  They're all unused
+        // seeds, so the code below goes straight to using it.  Once they're gone, go on to the second pass rather than
+        // filling in between them.
+        //
+        unsigned whichFirstPassSeed = nFirstPassSeeds;
+        if (nFirstPassSeedsUsed < nFirstPassSeeds) {
+            whichFirstPassSeed = firstPassOrder[nFirstPassSeedsUsed];
+            nFirstPassSeedsUsed++;
+            nextSeedToTest = firstPassOffsets[whichFirstPassSeed];
+        } else if (nFirstPassSeeds > 0 && 0 == wrapCount) {
+            nextSeedToTest = nPossibleSeeds;
+        }
+
         //
         // Choose the next seed to use.  Choose the first one that isn't used
         //
@@ -430,8 +617,9 @@ Return Value:
                     secondary);
 
 #ifdef  _DEBUG
-                if (_DumpAlignments) printf("\tFinal result score %d MAPQ %d (%e probability of best candidate, %e probability of all candidates)  at %u\n", *finalScore, *mapq, probabilityOfBestCandidate, probabilityOfAllCandidates, *genomeLocation);
+                if (_DumpAlignments) printf("\tFinal result score %d MAPQ %d (%e probability of best candidate, %e probability of all candidates)  at %lld\n", *finalScore, *mapq, probabilityOfBestCandidate, probabilityOfAllCandidates, (_int64)*genomeLocation);
 #endif  // _DEBUG
+                emitSecondaryAlignments(secondary, finalResult, *genomeLocation, *hitDirection);
                 return finalResult;
             }
             nextSeedToTest = GetWrappedNextSeedToTest(seedLen, wrapCount);
@@ -456,18 +644,41 @@ Return Value:
 
         SetSeedUsed(nextSeedToTest);
 
-        if (!Seed::DoesTextRepresentASeed(read[FORWARD]->getData() + nextSeedToTest, seedLen)) {
+        if (!packedSeeds.isSeed(nextSeedToTest, seedLen)) {
             continue;
         }
 
-        Seed seed(read[FORWARD]->getData() + nextSeedToTest, seedLen);
+        Seed seed = packedSeeds.getSeed(nextSeedToTest, seedLen);
 
         unsigned        nHits[NUM_DIRECTIONS];      // Number of times this seed hits in the genome
-        const unsigned  *hits[NUM_DIRECTIONS];      // The actual hits (of size nHits)
+        const GenomeLocation *hits[NUM_DIRECTIONS]; // The actual hits (of size nHits)
+        bool reused = false;
 
-        unsigned minSeedLoc = (minLocation < readLen ? 0 : minLocation - readLen);
-        unsigned maxSeedLoc = (maxLocation > 0xFFFFFFFF - readLen ? 0xFFFFFFFF : maxLocation + readLen);
-        genomeIndex->lookupSeed(seed, minSeedLoc, maxSeedLoc, &nHits[0], &hits[0], &nHits[1], &hits[1]);
+        if (whichFirstPassSeed < nFirstPassSeeds) {
+            for (Direction dir = FORWARD; dir < NUM_DIRECTIONS; dir++) {
+                nHits[dir] = firstPassNHits[dir][whichFirstPassSeed];
+                hits[dir] = firstPassHits[dir][whichFirstPassSeed];
+            }
+            reused = true;
+        } else if (NULL != seedLookupsToReuse && 0 == minSeedLoc && InvalidGenomeLocation == maxSeedLoc &&
+                seedLookupsToReuse->maxHitsDecoded >= decodedHits.getMaxHitsPerList() &&
+                (!seedLookupsToReuse->popularListsSkipped || !explorePopularSeeds)) {
+            for (unsigned i = 0; i < seedLookupsToReuse->nSeeds; i++) {
+                if (seedLookupsToReuse->seedOffsets[i] == nextSeedToTest) {
+                    for (Direction dir = FORWARD; dir < NUM_DIRECTIONS; dir++) {
+                        nHits[dir] = seedLookupsToReuse->nHits[dir][i];
+                        hits[dir] = seedLookupsToReuse->hits[dir][i];
+                    }
+                    reused = true;
+                    break;
+                }
+            }
+        }
+
+        if (!reused) {
+            PerfTimer timer(PerfCounters::SeedLookup);
+            genomeIndex->lookupSeed(seed, minSeedLoc, maxSeedLoc, &nHits[0], &hits[0], &nHits[1], &hits[1], &decodedHits);
+        }
 
         nHashTableLookups++;
         lookupsThisRun++;
@@ -562,7 +773,7 @@ Return Value:
                         //
                         // Find the genome location where the beginning of the read would hit, given a match on this seed.
                         //
-                        unsigned genomeLocationOfThisHit = hits[direction][i] - offset;
+                        GenomeLocation genomeLocationOfThisHit = hits[direction][i] - offset;
                         if (genomeLocationOfThisHit < minLocation ||
                                 genomeLocationOfThisHit > maxLocation ||
                                 hits[direction][i] < offset) {
@@ -607,6 +818,14 @@ Return Value:
 
 
         if (appliedEitherSeed) {
+            //
+            // Scoring is a good while, so get the hash table entry for the next seed (if it's the obvious one) on its way.
+            //
+            if (doAlignerPrefetch && nFirstPassSeedsUsed >= nFirstPassSeeds && nextSeedToTest < nPossibleSeeds && !IsSeedUsed(nextSeedToTest) &&
+                    packedSeeds.isSeed(nextSeedToTest, seedLen)) {
+                genomeIndex->prefetchSeed(packedSeeds.getSeed(nextSeedToTest, seedLen));
+            }
+
             //
             // And finally, try scoring.
             //
@@ -620,8 +839,9 @@ Return Value:
                         secondary)) {
 
 #ifdef  _DEBUG
-                if (_DumpAlignments) printf("\tFinal result score %d MAPQ %d at %u\n", *finalScore, *mapq, *genomeLocation);
+                if (_DumpAlignments) printf("\tFinal result score %d MAPQ %d at %lld\n", *finalScore, *mapq, (_int64)*genomeLocation);
 #endif  // _DEBUG
+                emitSecondaryAlignments(secondary, finalResult, *genomeLocation, *hitDirection);
                 return finalResult;
             }
         }
@@ -643,19 +863,242 @@ Return Value:
             secondary);
 
 #ifdef  _DEBUG
-    if (_DumpAlignments) printf("\tFinal result score %d MAPQ %d (%e probability of best candidate, %e probability of all candidates) at %u\n", *finalScore, *mapq, probabilityOfBestCandidate, probabilityOfAllCandidates, *genomeLocation);
+    if (_DumpAlignments) printf("\tFinal result score %d MAPQ %d (%e probability of best candidate, %e probability of all candidates) at %lld\n", *finalScore, *mapq, probabilityOfBestCandidate, probabilityOfAllCandidates, (_int64)*genomeLocation);
 #endif  // _DEBUG
 
+        emitSecondaryAlignments(secondary, finalResult, *genomeLocation, *hitDirection);
         return finalResult;
 }
 
+    size_t
+BaseAligner::getFirstPassStorageSize(unsigned maxReadSize, unsigned seedLen)
+{
+    return (sizeof(Seed) + NUM_DIRECTIONS * (sizeof(GenomeLocation *) + sizeof(unsigned)) + 2 * sizeof(unsigned)) * (maxReadSize / seedLen + 1);
+}
+
+    unsigned
+BaseAligner::lookUpFirstPassSeeds(unsigned nPossibleSeeds, GenomeLocation minSeedLoc, GenomeLocation maxSeedLoc)
+{
+    //
+    // Pick the seeds the same way AlignRead's own first pass would: every seedLen bases, except that a seed that can't
+    // be used moves the rest along to the next one that can.
+    //
+    unsigned nSeeds = 0;
+    unsigned offset = 0;
+    while (offset < nPossibleSeeds && nSeeds < maxFirstPassSeeds) {
+        if (IsSeedUsed(offset) || !packedSeeds.isSeed(offset, seedLen)) {
+            offset++;
+            continue;
+        }
+        firstPassSeeds[nSeeds] = packedSeeds.getSeed(offset, seedLen);
+        firstPassOffsets[nSeeds] = offset;
+        nSeeds++;
+        offset += seedLen;
+    }
+
+    if (0 == nSeeds) {
+        return 0;
+    }
+
+    {
+        PerfTimer timer(PerfCounters::SeedLookup, nSeeds);
+        genomeIndex->lookupSeeds(firstPassSeeds, nSeeds, minSeedLoc, maxSeedLoc, firstPassNHits[FORWARD], firstPassHits[FORWARD],
+            firstPassNHits[RC], firstPassHits[RC], &decodedHits);
+    }
+
+    //
+    // Order them by total hits with an insertion sort, which is quick for this few and keeps ties in read order.
+    //
+    for (unsigned i = 0; i < nSeeds; i++) {
+        _int64 hitsOfThisOne = (_int64)firstPassNHits[FORWARD][i] + firstPassNHits[RC][i];
+        unsigned j = i;
+        while (j > 0 && (_int64)firstPassNHits[FORWARD][firstPassOrder[j - 1]] + firstPassNHits[RC][firstPassOrder[j - 1]] > hitsOfThisOne) {
+            firstPassOrder[j] = firstPassOrder[j - 1];
+            j--;
+        }
+        firstPassOrder[j] = i;
+    }
+
+    return nSeeds;
+}
+
+    bool
+BaseAligner::tryExactMatch(Read *read, GenomeLocation *genomeLocation, Direction *hitDirection, int *finalScore, int *mapq)
+/*++
+
+Routine Description:
+
+    The fast path for a read that matches the genome exactly in one place, which is most of them in good Illumina data.
+    It looks up three seeds from the start, middle and end of the read, and if each has just the one hit and they're
+    all on the same diagonal, compares the read with the genome there.  A read that gets past that can't have another
+    location within an edit of this one (that would have hit at least two of the seeds), so it goes down as a single
+    hit without building any candidates or running LV.  Anything else returns false and goes through the full search.
+
+    It needs the read's reverse complement in rcReadData.
+
+--*/
+{
+    const unsigned nExactMatchSeeds = 3;
+    unsigned readLen = read->getDataLength();
+    if (readLen < nExactMatchSeeds * seedLen) {
+        return false;
+    }
+
+    const char *readData = read->getData();
+    unsigned seedOffsets[nExactMatchSeeds] = {0, (readLen - seedLen) / 2, readLen - seedLen};
+    GenomeLocation diagonal = InvalidGenomeLocation;
+    Direction direction = FORWARD;
+    for (unsigned i = 0; i < nExactMatchSeeds; i++) {
+        if (!Seed::DoesTextRepresentASeed(readData + seedOffsets[i], seedLen)) {
+            return false;
+        }
+
+        unsigned nHits[NUM_DIRECTIONS];
+        const GenomeLocation *hits[NUM_DIRECTIONS];
+        genomeIndex->lookupSeed(Seed(readData + seedOffsets[i], seedLen), &nHits[FORWARD], &hits[FORWARD], &nHits[RC], &hits[RC], &decodedHits);
+        nHashTableLookups++;
+        if (1 != nHits[FORWARD] + nHits[RC]) {
+            return false;
+        }
+
+        //
+        // The RC seed is at the mirror image offset in the RC read, as in AlignRead.
+        //
+        Direction seedDirection = 1 == nHits[FORWARD] ? FORWARD : RC;
+        unsigned offset = FORWARD == seedDirection ? seedOffsets[i] : readLen - seedLen - seedOffsets[i];
+        if (hits[seedDirection][0] < offset) {
+            return false;
+        }
+        GenomeLocation seedDiagonal = hits[seedDirection][0] - offset;
+        if (0 == i) {
+            diagonal = seedDiagonal;
+            direction = seedDirection;
+        } else if (seedDiagonal != diagonal || seedDirection != direction) {
+            return false;
+        }
+    }
+
+    const char *reference = genome->getSubstring(diagonal, readLen, genomeUnpackBuffer, genomeUnpackBufferSize);
+    if (NULL == reference || 0 != memcmp(reference, FORWARD == direction ? readData : rcReadData, readLen)) {
+        return false;
+    }
+
+    *genomeLocation = diagonal;
+    *hitDirection = direction;
+    *finalScore = 0;
+    *mapq = exactMatchMapq;
+    return true;
+}
+
+    void
+BaseAligner::emitSecondaryAlignments(IdPairVector *secondary, AlignmentResult result, GenomeLocation location, Direction direction)
+{
+    if (NULL == secondary) {
+        return;
+    }
+    if (NotFound == result) {
+        secondaryCandidates.reset();
+        return;
+    }
+    IdPair primary(location, direction);
+    secondaryCandidates.emit(secondary, &primary, 1, maxMergeDist);
+}
+
+    void
+BaseAligner::setCandidateVerifier(CandidateVerifier *newVerifier)
+{
+    verifier = NULL == newVerifier ? &lvVerifier : newVerifier;
+    verifyBatchSize = __max(1u, __min(verifier->getBatchSize(), hashTableElementSize));
+
+    if (NULL != batchUnpackBuffer) {
+        BigDealloc(batchUnpackBuffer);
+        batchUnpackBuffer = NULL;
+    }
+    if (verifyBatchSize > 1) {
+        batchUnpackBuffer = (char *)BigAlloc(verifyBatchSize * genomeUnpackBufferSize);
+    }
+}
+
+    void
+BaseAligner::prepareToVerify(
+    Read             *read[NUM_DIRECTIONS],
+    HashTableElement *element,
+    unsigned          candidateIndex,
+    char             *unpackBuffer,
+    VerifyRequest    *request)
+{
+    Candidate *candidate = &element->candidates[candidateIndex];
+    GenomeLocation genomeLocation = element->baseGenomeLocation + candidateIndex;
+
+    //
+    // We're about to run edit distance computation on the genome.  Launch a prefetch for it
+    // so that it's in cache when we do (or at least on the way).
+    //
+    if (doAlignerPrefetch) {
+        genomeIndex->prefetchGenomeData(genomeLocation, read[element->direction]->getDataLength() + MAX_K);
+    }
+
+    unsigned readDataLength = read[element->direction]->getDataLength();
+    unsigned genomeDataLength = readDataLength + MAX_K; // Leave extra space in case the read has deletions
+    const char *data = genome->getSubstring(genomeLocation, genomeDataLength, unpackBuffer, genomeUnpackBufferSize);
+    if (NULL == data) {
+        //
+        // We're up against the end of a chromosome.  Reduce the extra space enough that it isn't too
+        // long.  We're willing to reduce it to less than the length of a read, because the read could
+        // butt up against the end of the chromosome and have insertions in it.
+        //
+        const Genome::Contig *contig = genome->getContigAtLocation(genomeLocation);
+
+        GenomeLocation endOffset;
+        if (genomeLocation + readDataLength + MAX_K >= genome->getCountOfBases()) {
+            endOffset = genome->getCountOfBases();
+        } else {
+            const Genome::Contig *nextContig = genome->getNextContigAfterLocation(genomeLocation);
+            _ASSERT(NULL != contig && contig->beginningOffset <= genomeLocation && contig != nextContig);
+
+            endOffset = nextContig->beginningOffset;
+        }
+        genomeDataLength = (unsigned)(endOffset - genomeLocation - 1);
+        if (genomeDataLength >= readDataLength - MAX_K) {
+            data = genome->getSubstring(genomeLocation, genomeDataLength, unpackBuffer, genomeUnpackBufferSize);
+            _ASSERT(NULL != data);
+        }
+    }
+
+    request->genomeData = data;
+    if (NULL == data) {
+        return;
+    }
+
+    Read *readToScore = read[element->direction];
+    int seedOffset = candidate->seedOffset;
+    int tailStart = seedOffset + seedLen;
+    _ASSERT(candidate->seedOffset + seedLen <= readToScore->getDataLength());
+    _ASSERT(!memcmp(data+seedOffset, readToScore->getData() + seedOffset, seedLen));
+
+    request->genomeDataLength = genomeDataLength;
+    request->readData = readToScore->getData();
+    request->readQuality = readToScore->getQuality();
+    request->reversedReadData = reversedRead[element->direction];
+    request->reversedReadQuality = read[OppositeDirection(element->direction)]->getQuality();
+    request->readLength = readToScore->getDataLength();
+    request->seedOffset = seedOffset;
+    request->seedLength = seedLen;
+
+    // NB: This cacheKey computation MUST match the one in IntersectingPairedEndAligner or all hell will break loose.
+    // The key doesn't say how much genome there is, so don't use the cache for the short windows at contig ends.
+    request->cacheKey = genomeDataLength != readDataLength + MAX_K || (_uint64)genomeLocation + tailStart >= ((_uint64)1 << GenomeLocationBits) ? 0 :
+        (genomeLocation + tailStart) | (((_uint64) element->direction) << GenomeLocationBits) | (((_uint64) readId) << (GenomeLocationBits + 1)) |
+        (((_uint64)tailStart) << (GenomeLocationBits + 2));
+}
+
     bool
 BaseAligner::score(
     bool             forceResult,
     Read            *read[NUM_DIRECTIONS],
     AlignmentResult *result,
     int             *finalScore,
-    unsigned        *singleHitGenomeLocation,
+    GenomeLocation  *singleHitGenomeLocation,
     Direction       *hitDirection,
     int             *mapq,
     IdPairVector    *secondary)
@@ -789,6 +1232,25 @@ Return Value:
             return false;
         }
 
+        if (0 != lvBudget && lvScores >= lvBudget) {
+            //
+            // This read has had all of the scoring it's allowed.  Settle for the best we've got, but with less confidence,
+            // since something we haven't scored might have been better.  It's decided by the count of LV calls rather than
+            // by time, so it comes out the same on every run.
+            //
+            nReadsOverLVBudget++;
+            *finalScore = bestScore;
+            if (bestScore <= maxK) {
+                *singleHitGenomeLocation = bestScoreGenomeLocation;
+                *mapq = computeMAPQ(probabilityOfAllCandidates, probabilityOfBestCandidate, bestScore, popularSeedsSkipped) / OverLVBudgetMapqDivisor;
+                *result = *mapq >= MAPQ_LIMIT_FOR_SINGLE_HIT ? SingleHit : MultipleHits;
+            } else {
+                *result = NotFound;
+                *mapq = 0;
+            }
+            return true;
+        }
+
         HashTableElement *elementToScore = weightLists[weightListToCheck].weightNext;
         _ASSERT(!elementToScore->allExtantCandidatesScored);
         _ASSERT(elementToScore->candidatesUsed != 0);
@@ -797,125 +1259,67 @@ Return Value:
         if (doAlignerPrefetch) {
             //
             // Our prefetch pipeline is one loop out we get the genome data for the next loop, and two loops out we get the element to score.
+            // The genome data is all of it that any of the next element's candidates could look at, so that scoring them all costs
+            // one round of misses rather than one per candidate.
             //
             _mm_prefetch((const char *)(elementToScore->weightNext->weightNext), _MM_HINT_T2);   // prefetch the next element, it's likely to be the next thing we score.
-            genome->prefetchData(elementToScore->weightNext->baseGenomeLocation);
+            genome->prefetchData(elementToScore->weightNext->baseGenomeLocation, hashTableElementSize + read[FORWARD]->getDataLength() + MAX_K);
         }
 
         if (elementToScore->lowestPossibleScore <= scoreLimit) {
 
-            unsigned long candidateIndexToScore;
-            _uint64 candidatesMask = elementToScore->candidatesUsed;
-            while (_BitScanForward64(&candidateIndexToScore,candidatesMask)) {
-                _uint64 candidateBit = ((_uint64)1 << candidateIndexToScore);
-                candidatesMask &= ~candidateBit;
-                if ((elementToScore->candidatesScored & candidateBit) != 0) {
-                    // Already scored it, or marked it as scored due to using ProbabilityDistance
-                    continue;
-                }
-
-                bool anyNearbyCandidatesAlreadyScored = elementToScore->candidatesScored != 0;
-
-                elementToScore->candidatesScored |= candidateBit;
-                _ASSERT(candidateIndexToScore < hashTableElementSize);
-                Candidate *candidateToScore = &elementToScore->candidates[candidateIndexToScore];
-
-                unsigned genomeLocation = elementToScore->baseGenomeLocation + candidateIndexToScore;
-                unsigned elementGenomeLocation = genomeLocation;    // This is the genome location prior to any adjustments for indels
-
-                //
-                // We're about to run edit distance computation on the genome.  Launch a prefetch for it
-                // so that it's in cache when we do (or at least on the way).
-                //
-                if (doAlignerPrefetch) {
-                    genomeIndex->prefetchGenomeData(genomeLocation);
+            //
+            // The candidates go to the verifier a batch at a time, and come back to be handled one at a time, in the
+            // same order as if each were verified on its own (see CandidateVerifier.h).
+            //
+            _uint64 candidatesMask = elementToScore->candidatesUsed & ~elementToScore->candidatesScored; // Some may be marked as scored due to using ProbabilityDistance
+            unsigned nVerifying = 0;
+            unsigned nextToVerify = 0;
+            unsigned verifyLimit = scoreLimit;
+            while (nextToVerify < nVerifying || 0 != candidatesMask) {
+                if (nextToVerify == nVerifying) {
+                    unsigned long candidateIndex;
+                    nVerifying = 0;
+                    nextToVerify = 0;
+                    while (nVerifying < verifyBatchSize && _BitScanForward64(&candidateIndex, candidatesMask)) {
+                        candidatesMask &= ~((_uint64)1 << candidateIndex);
+                        verifyCandidateIndices[nVerifying] = candidateIndex;
+                        prepareToVerify(read, elementToScore, candidateIndex,
+                            1 == verifyBatchSize ? genomeUnpackBuffer : batchUnpackBuffer + nVerifying * genomeUnpackBufferSize, &verifyRequests[nVerifying]);
+                        nVerifying++;
+                    }
+                    verifyLimit = scoreLimit;
+                    verifier->verify(verifyRequests, nVerifying, verifyLimit, verifyResults);
                 }
 
-                unsigned score = -1;
-                double matchProbability = 0;
-                unsigned readDataLength = read[elementToScore->direction]->getDataLength();
-                unsigned genomeDataLength = readDataLength + MAX_K; // Leave extra space in case the read has deletions
-                const char *data = genome->getSubstring(genomeLocation, genomeDataLength);
-                if (NULL == data) {
+                unsigned candidateIndexToScore = verifyCandidateIndices[nextToVerify];
+                VerifyResult *verified = &verifyResults[nextToVerify];
+                if (verifyLimit != scoreLimit) {
                     //
-                    // We're up against the end of a chromosome.  Reduce the extra space enough that it isn't too
-                    // long.  We're willing to reduce it to less than the length of a read, because the read could
-                    // butt up against the end of the chromosome and have insertions in it.
+                    // Candidates ahead of this one in the batch moved the limit.
                     //
-                    const Genome::Contig *contig = genome->getContigAtLocation(genomeLocation);
-
-                    unsigned endOffset;
-                    if (genomeLocation + readDataLength + MAX_K >= genome->getCountOfBases()) {
-                        endOffset = genome->getCountOfBases();
-                    } else {
-                        const Genome::Contig *nextContig = genome->getNextContigAfterLocation(genomeLocation);
-                        _ASSERT(NULL != contig && contig->beginningOffset <= genomeLocation && contig != nextContig);
-
-                        endOffset = nextContig->beginningOffset;
-                    }
-                    genomeDataLength = endOffset - genomeLocation - 1;
-                    if (genomeDataLength >= readDataLength - MAX_K) {
-                        data = genome->getSubstring(genomeLocation, genomeDataLength);
-                        _ASSERT(NULL != data);
+                    if (-1 != verified->score && (unsigned)verified->score > scoreLimit) {
+                        verified->score = -1;
+                        verified->matchProbability = 0;
+                        verified->genomeLocationOffset = 0;
+                    } else if (-1 == verified->score && scoreLimit > verifyLimit) {
+                        verifier->verify(&verifyRequests[nextToVerify], 1, scoreLimit, verified);
                     }
                 }
+                nextToVerify++;
 
-                if (data != NULL) {
-                    Read *readToScore = read[elementToScore->direction];
-
-                    _ASSERT(candidateToScore->seedOffset + seedLen <= readToScore->getDataLength());
-
-                    //
-                    // Compute the distance separately in the forward and backward directions from the seed, to allow
-                    // arbitrary offsets at both the start and end.
-                    //
-                    double matchProb1, matchProb2;
-                    int score1, score2;
-                    // First, do the forward direction from where the seed aligns to past of it
-                    int readLen = readToScore->getDataLength();
-                    int seedLen = genomeIndex->getSeedLength();
-                    int seedOffset = candidateToScore->seedOffset; // Since the data is reversed
-                    int tailStart = seedOffset + seedLen;
-
-                    _ASSERT(!memcmp(data+seedOffset, readToScore->getData() + seedOffset, seedLen));
-
-                    // NB: This cacheKey computation MUST match the one in IntersectingPairedEndAligner or all hell will break loose.
-                    _uint64 cacheKey = (genomeLocation + tailStart) | (((_uint64) elementToScore->direction) << 32) | (((_uint64) readId) << 33) | (((_uint64)tailStart) << 34);
-
-                    score1 = landauVishkin->computeEditDistance(data + tailStart, genomeDataLength - tailStart, readToScore->getData() + tailStart, readToScore->getQuality() + tailStart, readLen - tailStart,
-                        scoreLimit, &matchProb1, cacheKey);
+                _uint64 candidateBit = ((_uint64)1 << candidateIndexToScore);
+                bool anyNearbyCandidatesAlreadyScored = elementToScore->candidatesScored != 0;
 
-                    if (score1 == -1) {
-                        score = -1;
-                    } else {
-                        // The tail of the read matched; now let's reverse the reference genome data and match the head
-                        int limitLeft = scoreLimit - score1;
-                        int genomeLocationOffset;
-                        score2 = reverseLandauVishkin->computeEditDistance(data + seedOffset, seedOffset + MAX_K, reversedRead[elementToScore->direction] + readLen - seedOffset,
-                                                                                    read[OppositeDirection(elementToScore->direction)]->getQuality() + readLen - seedOffset, seedOffset, limitLeft, &matchProb2, cacheKey,
-                                                                                    &genomeLocationOffset);
-
-                        if (score2 == -1) {
-                            score = -1;
-                        } else {
-                            score = score1 + score2;
-                            // Map probabilities for substrings can be multiplied, but make sure to count seed too
-                            matchProbability = matchProb1 * matchProb2 * pow(1 - SNP_PROB, seedLen);
+                elementToScore->candidatesScored |= candidateBit;
+                _ASSERT(candidateIndexToScore < hashTableElementSize);
+                Candidate *candidateToScore = &elementToScore->candidates[candidateIndexToScore];
 
-                            //
-                            // Adjust the genome location based on any indels that we found.
-                            //
-                            genomeLocation += genomeLocationOffset;
+                GenomeLocation elementGenomeLocation = elementToScore->baseGenomeLocation + candidateIndexToScore;    // This is the genome location prior to any adjustments for indels
+                GenomeLocation genomeLocation = elementGenomeLocation + verified->genomeLocationOffset;   // Adjusted for any indels that we found
+                unsigned score = verified->score;
+                double matchProbability = verified->matchProbability;
 
-                            //
-                            // We could mark as scored anything in between the old and new genome offsets, but it's probably not worth the effort since this is
-                            // so rare and all it would do is same time.
-                            //
-                        }
-                    }
-                } else { // if we had genome data to compare against
-                    matchProbability = 0;
-                }
 #ifdef TRACE_ALIGNER
                 printf("Computing distance at %u (RC) with limit %d: %d (prob %g)\n",
                         genomeLocation, scoreLimit, score, matchProbability);
@@ -923,7 +1327,7 @@ Return Value:
 
 
 #ifdef  _DEBUG
-                if (_DumpAlignments) printf("Scored %9u weight %2d limit %d, result %2d %s\n", genomeLocation, elementToScore->weight, scoreLimit, score, elementToScore->direction ? "RC" : "");
+                if (_DumpAlignments) printf("Scored %9lld weight %2d limit %d, result %2d %s\n", (_int64)genomeLocation, elementToScore->weight, scoreLimit, score, elementToScore->direction ? "RC" : "");
 #endif  // _DEBUG
 
                 candidateToScore->score = score;
@@ -962,7 +1366,7 @@ Return Value:
                 // one, and you're at the right place with no branches.
                 //
                 HashTableElement *nearbyElement;
-                unsigned nearbyGenomeLocation;
+                GenomeLocation nearbyGenomeLocation;
                 if (-1 != score) {
                     nearbyGenomeLocation = elementGenomeLocation + (2*(elementGenomeLocation % hashTableElementSize / (hashTableElementSize/2)) - 1) * (hashTableElementSize/2);
                     _ASSERT((elementGenomeLocation % hashTableElementSize >= (hashTableElementSize/2) ? elementGenomeLocation + (hashTableElementSize/2) : elementGenomeLocation - (hashTableElementSize/2)) == nearbyGenomeLocation);   // Assert that the logic in the above comment is right.
@@ -1003,6 +1407,10 @@ Return Value:
                 elementToScore->matchProbabilityForBestScore = matchProbability;
                 elementToScore->bestScore = score;
 
+                if (secondary != NULL && score <= maxK) {
+                    secondaryCandidates.add(score, matchProbability, IdPair(genomeLocation, elementToScore->direction));
+                }
+
                 const double EPSILON = 1e-14;
                 if (bestScore > score ||
                     (bestScore == score && matchProbability > probabilityOfBestCandidate + EPSILON)) {
@@ -1030,14 +1438,7 @@ Return Value:
 
                     lvScoresAfterBestFound = 0;
 
-                    if (secondary != NULL) {
-                        secondary->clear();
-                    }
-
                 } else {
-                    if (secondary != NULL && bestScore == score && matchProbability >= probabilityOfBestCandidate - EPSILON) {
-                        secondary->push_back(IdPair(genomeLocation, elementToScore->direction));
-                    }
                     if (secondBestScore > score) {
                         //
                         // A new second best.
@@ -1060,6 +1461,9 @@ Return Value:
 
                 // Update scoreLimit since we may have improved bestScore or secondBestScore
                 scoreLimit = min(bestScore, maxK) + extraSearchDepth;
+                if (0 != mapqToStopAt && bestScore <= maxK) {
+                    scoreLimit = bestScore + mapqSearchDepth();
+                }
             }   // While candidates exist in the element
         }   // If the element could possibly affect the result
 
@@ -1076,14 +1480,53 @@ Return Value:
     return false;
 }
 
+    unsigned
+BaseAligner::mapqSearchDepth()
+/*++
+
+Routine Description:
+
+    With mapqToStopAt set, work out how far beyond bestScore the search still needs to go.  Once the best candidate's
+    MAPQ is at least mapqToStopAt, a location d edits worse than it can have at most about highestEditProbability^d
+    times its match probability.  We assume there might be one such location for every one we've scored so far (a read
+    that's hit a lot of candidates is from a repetitive region, so is likely to have more), and stop at the first depth
+    where all of those together couldn't pull the MAPQ below mapqToStopAt.  If the MAPQ is already below it, we need
+    the full depth to get it right.
+
+Return Value:
+
+    The depth to search beyond bestScore, which is never more than extraSearchDepth.
+
+--*/
+{
+    if (computeMAPQ(probabilityOfAllCandidates, probabilityOfBestCandidate, bestScore, popularSeedsSkipped) < (int)mapqToStopAt) {
+        return extraSearchDepth;
+    }
+
+    //
+    // MAPQ is at least mapqToStopAt as long as probabilityOfBestCandidate / (probabilityOfAllCandidates + unseen) is at
+    // least 1 - 10^(-mapqToStopAt/10), which bounds the unseen mass.
+    //
+    double unseenMassAllowed = probabilityOfBestCandidate / (1.0 - mapqToErrorProbability(mapqToStopAt)) - probabilityOfAllCandidates;
+    double unseenMass = probabilityOfBestCandidate * (lvScores + 1);
+
+    for (unsigned depth = 1; depth <= extraSearchDepth; depth++) {
+        unseenMass *= highestEditProbability;
+        if (unseenMass <= unseenMassAllowed) {
+            return depth - 1;
+        }
+    }
+
+    return extraSearchDepth;
+}
 
     void
-BaseAligner::prefetchHashTableBucket(unsigned genomeLocation, Direction direction)
+BaseAligner::prefetchHashTableBucket(GenomeLocation genomeLocation, Direction direction)
 {
     HashTableAnchor *hashTable = candidateHashTable[direction];
 
-    unsigned lowOrderGenomeLocation = genomeLocation % hashTableElementSize;
-    unsigned highOrderGenomeLocation = genomeLocation - lowOrderGenomeLocation;
+    unsigned lowOrderGenomeLocation = (unsigned)(genomeLocation % hashTableElementSize);
+    GenomeLocation highOrderGenomeLocation = genomeLocation - lowOrderGenomeLocation;
 
     unsigned hashTableIndex = hash(highOrderGenomeLocation) % candidateHashTablesSize;
 
@@ -1092,14 +1535,14 @@ BaseAligner::prefetchHashTableBucket(unsigned genomeLocation, Direction directio
 
     bool
 BaseAligner::findElement(
-    unsigned         genomeLocation,
+    GenomeLocation   genomeLocation,
     Direction        direction,
     HashTableElement **hashTableElement)
 {
     HashTableAnchor *hashTable = candidateHashTable[direction];
 
-    unsigned lowOrderGenomeLocation = genomeLocation % hashTableElementSize;
-    unsigned highOrderGenomeLocation = genomeLocation - lowOrderGenomeLocation;
+    unsigned lowOrderGenomeLocation = (unsigned)(genomeLocation % hashTableElementSize);
+    GenomeLocation highOrderGenomeLocation = genomeLocation - lowOrderGenomeLocation;
 
     unsigned hashTableIndex = hash(highOrderGenomeLocation) % candidateHashTablesSize;
     HashTableAnchor *anchor = &hashTable[hashTableIndex];
@@ -1122,7 +1565,7 @@ BaseAligner::findElement(
 
     void
 BaseAligner::findCandidate(
-    unsigned         genomeLocation,
+    GenomeLocation   genomeLocation,
     Direction        direction,
     Candidate        **candidate,
     HashTableElement **hashTableElement)
@@ -1141,7 +1584,7 @@ Arguments:
 
 --*/
 {
-    unsigned lowOrderGenomeLocation = genomeLocation % hashTableElementSize;
+    unsigned lowOrderGenomeLocation = (unsigned)(genomeLocation % hashTableElementSize);
 
     if (!findElement(genomeLocation, direction, hashTableElement)) {
         *hashTableElement = NULL;
@@ -1162,7 +1605,7 @@ bool doAlignerPrefetch = true;
 
     void
 BaseAligner::allocateNewCandidate(
-    unsigned    genomeLocation,
+    GenomeLocation genomeLocation,
     Direction   direction,
     unsigned    lowestPossibleScore,
     int         seedOffset,
@@ -1180,8 +1623,8 @@ Return Value:
 {
     HashTableAnchor *hashTable = candidateHashTable[direction];
 
-    unsigned lowOrderGenomeLocation = genomeLocation % hashTableElementSize;
-    unsigned highOrderGenomeLocation = genomeLocation - lowOrderGenomeLocation;
+    unsigned lowOrderGenomeLocation = (unsigned)(genomeLocation % hashTableElementSize);
+    GenomeLocation highOrderGenomeLocation = genomeLocation - lowOrderGenomeLocation;
 
     unsigned hashTableIndex = hash(highOrderGenomeLocation) % candidateHashTablesSize;
 
@@ -1277,6 +1720,11 @@ Return Value:
 {
     delete probDistance;
 
+    if (NULL != batchUnpackBuffer) {
+        BigDealloc(batchUnpackBuffer);      // Not from the allocator, since the batch size comes later
+        batchUnpackBuffer = NULL;
+    }
+
     if (hadBigAllocator) {
         //
         // Since these got allocated with the alloator rather than new, we want to call
@@ -1310,6 +1758,21 @@ Return Value:
         reversedRead[FORWARD] = NULL;
         reversedRead[RC] = NULL;
 
+        BigDealloc(genomeUnpackBuffer);
+        genomeUnpackBuffer = NULL;
+
+        BigDealloc(packedSeedStorage);
+        packedSeedStorage = NULL;
+
+        BigDealloc(minimizerHashes);
+        minimizerHashes = NULL;
+
+        BigDealloc(isMinimizer);
+        isMinimizer = NULL;
+
+        BigDealloc(firstPassStorage);
+        firstPassStorage = NULL;
+
         BigDealloc(seedUsedAsAllocated);
         seedUsed = NULL;
 
@@ -1356,12 +1819,17 @@ BaseAligner::Candidate::init()
 
     void
 BaseAligner::clearCandidates() {
+    //
+    // The candidate hash table goes stale with the epoch, and the element pool is just handed out again from the start.
+    // Nothing goes on a weight list above highestUsedWeightList (and it only comes down past lists that are empty),
+    // so those are the only ones that need emptying.  That's the most seeds any candidate matched, not maxSeedsToUse.
+    //
     hashTableEpoch++;
     nUsedHashTableElements = 0;
-    highestUsedWeightList = 0;
-    for (unsigned i = 1; i < numWeightLists; i++) {
+    for (unsigned i = 1; i <= highestUsedWeightList; i++) {
         weightLists[i].weightNext = weightLists[i].weightPrev = &weightLists[i];
     }
+    highestUsedWeightList = 0;
 }
 
     void
@@ -1418,13 +1886,17 @@ BaseAligner::getBigAllocatorReservation(bool ownLandauVishkin, unsigned maxHitsT
     size_t hashTableElementPoolSize = maxHitsToConsider * maxSeedsToUse * 2 ;   // *2 for RC
 
     return
-        sizeof(_uint64) * 14                                        + // allow for alignment
+        sizeof(_uint64) * 15                                        + // allow for alignment
         sizeof(BaseAligner)                                         + // our own member variables
         (ownLandauVishkin ?
             LandauVishkin<>::getBigAllocatorReservation() +
             LandauVishkin<-1>::getBigAllocatorReservation() : 0)    + // our LandauVishkin objects
         sizeof(char) * maxReadSize * 2                              + // rcReadData
         sizeof(char) * maxReadSize * 4 + 2 * MAX_K                  + // reversed read (both)
+        sizeof(char) * (maxReadSize + 3 * MAX_K)                    + // genome unpack buffer
+        PackedSeeds::getStorageSize(maxReadSize)                    + // packed seeds
+        (sizeof(_uint64) + sizeof(bool)) * maxReadSize              + // minimizer scratch
+        getFirstPassStorageSize(maxReadSize, seedLen)               + // first pass seeds
         sizeof(BYTE) * (maxReadSize + 7 + 128) / 8                  + // seed used
         sizeof(HashTableElement) * hashTableElementPoolSize         + // hash table element pool
         sizeof(HashTableAnchor) * candidateHashTablesSize * 2       + // candidate hash table (both)
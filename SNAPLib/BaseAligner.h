@@ -33,6 +33,9 @@ Revision History:
 #include "ProbabilityDistance.h"
 #include "AlignerStats.h"
 #include "directions.h"
+#include "Seed.h"
+#include "SecondaryAlignments.h"
+#include "CandidateVerifier.h"
 
 
 
@@ -57,7 +60,7 @@ public:
         virtual AlignmentResult
     AlignRead(
         Read        *inputRead,
-        unsigned    *genomeLocation,
+        GenomeLocation *genomeLocation,
         Direction   *hitDirection,
         int         *finalScore = NULL,
         int         *mapq = NULL,
@@ -71,15 +74,36 @@ public:
         AlignmentResult
     AlignRead(
         Read        *inputRead,
-        unsigned    *genomeLocation,
+        GenomeLocation *genomeLocation,
         Direction   *hitDirection,
         int         *finalScore,
         int         *mapq,
         IdPairVector*secondary,
         unsigned     searchRadius,       // If non-zero, constrain search around searchLocation in direction searchRC.
-        unsigned     searchLocation,
+        GenomeLocation searchLocation,
         Direction    searchDirection);
         
+    //
+    // Aligns a batch of reads, getting the same results as calling AlignRead on each of them in turn.  Before aligning
+    // any of them it gets the hash table entries for all of their first pass seeds on their way, so the misses for each
+    // read's first lookups overlap with aligning the reads ahead of it rather than stalling it.  secondary is either NULL
+    // or an array of nReads vectors, and so is alignTicks, which gets how long (in PerfTicks) each read took.  Batches
+    // much bigger than readsPerBatch just get their prefetches evicted before they're used.
+    //
+    static const unsigned readsPerBatch = 16;
+
+        void
+    AlignReads(
+        Read           **inputReads,
+        unsigned         nReads,
+        AlignmentResult *results,
+        GenomeLocation  *genomeLocations,
+        Direction       *hitDirections,
+        int             *finalScores,
+        int             *mapqs,
+        IdPairVector    *secondary = NULL,
+        _int64          *alignTicks = NULL);
+
     //
     // Statistics gathering.
     //
@@ -89,6 +113,7 @@ public:
     _int64 getNHitsIgnoredBecauseOfTooHighPopularity() const {return nHitsIgnoredBecauseOfTooHighPopularity;}
     _int64 getNReadsIgnoredBecauseOfTooManyNs() const {return nReadsIgnoredBecauseOfTooManyNs;}
     _int64 getNIndelsMerged() const {return nIndelsMerged;}
+    _int64 getNReadsOverLVBudget() const {return nReadsOverLVBudget;}
     void addIgnoredReads(_int64 newlyIgnoredReads) {nReadsIgnoredBecauseOfTooManyNs += newlyIgnoredReads;}
 
     const char *getRCTranslationTable() const {return rcTranslationTable;}
@@ -110,11 +135,58 @@ public:
     void operator delete(void *ptr, BigAllocator *allocator) {/* do nothing.  Memory gets cleaned up when the allocator is deleted.*/}
  
     inline bool getExplorePopularSeeds() {return explorePopularSeeds;}
-    inline void setExplorePopularSeeds(bool newValue) {explorePopularSeeds = newValue;}
+    inline void setExplorePopularSeeds(bool newValue) {explorePopularSeeds = newValue; decodedHits.setSkipPopularLists(!newValue);}
 
     inline bool getStopOnFirstHit() {return stopOnFirstHit;}
     inline void setStopOnFirstHit(bool newValue) {stopOnFirstHit = newValue;}
 
+    //
+    // Use these lookups (or none if lookups is NULL) for any of the seeds they cover, rather than looking those seeds up
+    // in the index again.  It's the caller's job to make sure that they're for the read being aligned, and to turn them
+    // off again afterward.
+    //
+    inline void setSeedLookupsToReuse(const SeedLookups *lookups) {seedLookupsToReuse = lookups;}
+
+    inline unsigned getMapqToStopAt() {return mapqToStopAt;}
+    inline void setMapqToStopAt(unsigned newValue) {mapqToStopAt = newValue;}
+
+    //
+    // If non-zero, reads that match exactly in one place take the fast path and get this MAPQ.
+    //
+    inline void setExactMatchMapq(int newValue) {exactMatchMapq = newValue;}
+
+    //
+    // If non-zero, AlignReads first searches for reads from SAM or BAM input within this many bases of where they were
+    // aligned before, and only searches the whole genome for the ones that don't get a confident hit there.
+    //
+    inline void setRealignRadius(unsigned newValue) {realignRadius = newValue;}
+
+    //
+    // If set, the seeds of the first pass over a read are all looked up before any of them are used, and then used in
+    // order of how many hits they have, fewest first.
+    //
+    inline void setOrderSeedsByHits(bool newValue) {orderSeedsByHits = newValue;}
+
+    //
+    // If non-zero, the most locations to score for a read.  One that runs out settles for the best hit so far with a
+    // lowered MAPQ, which caps the time that highly repetitive reads can take.
+    //
+    inline void setLVBudget(unsigned newValue) {lvBudget = newValue;}
+
+    //
+    // With a secondary vector: the most secondary alignments to return, and how much worse than the best they can be.
+    //
+    inline void setSecondaryAlignmentLimits(unsigned maxSecondary, unsigned scoreDelta) {secondaryCandidates.setLimits(maxSecondary, scoreDelta);}
+
+    // for an aligner that's kept from one run to the next
+    inline void setStats(AlignerStats *newStats) {stats = newStats;}
+
+    //
+    // The backend that score hands candidates to for their edit distances, or NULL for the aligner's own LV.  The caller
+    // owns it, and it has to outlive its use here.  Batches are never bigger than a hash table element.
+    //
+    void setCandidateVerifier(CandidateVerifier *newVerifier);
+
     static size_t getBigAllocatorReservation(bool ownLandauVishkin, unsigned maxHitsToConsider, unsigned maxReadSize, unsigned seedLen, unsigned numSeedsFromCommandLine, double seedCoverage);
 
 private:
@@ -125,6 +197,9 @@ private:
     LandauVishkin<-1> *reverseLandauVishkin;
     bool ownLandauVishkin;
 
+    LandauVishkinVerifier lvVerifier;
+    CandidateVerifier *verifier;    // lvVerifier unless it's been set
+
     ProbabilityDistance *probDistance;
 
     // Maximum distance to merge candidates that differ in indels over.
@@ -137,6 +212,7 @@ private:
     _int64 nHitsIgnoredBecauseOfTooHighPopularity;
     _int64 nReadsIgnoredBecauseOfTooManyNs;
     _int64 nIndelsMerged;
+    _int64 nReadsOverLVBudget;
 
     //
     // A bitvector indexed by offset in the read indicating whether this seed is used.
@@ -181,11 +257,11 @@ private:
         _uint64             candidatesUsed;    // Really candidates we still need to score
         _uint64             candidatesScored;
 
-        unsigned             baseGenomeLocation;
+        GenomeLocation       baseGenomeLocation;
         unsigned             weight;
         unsigned             lowestPossibleScore;
         unsigned             bestScore;
-        unsigned             bestScoreGenomeLocation;
+        GenomeLocation       bestScoreGenomeLocation;
         Direction            direction;
         bool                 allExtantCandidatesScored;
         double               matchProbabilityForBestScore;
@@ -221,9 +297,9 @@ private:
     HashTableElement *weightLists;
     unsigned highestUsedWeightList;
 
-    static inline unsigned hash(unsigned key) {
+    static inline unsigned hash(GenomeLocation key) {
         key = key * 131;    // Believe it or not, we spend a long time computing the hash, so we're better off with more table entries and a dopey function.
-        return key;
+        return (unsigned)key;
     }
 
     static const unsigned UnusedScoreValue = 0xffff;
@@ -242,9 +318,9 @@ private:
     unsigned mostSeedsContainingAnyParticularBase[NUM_DIRECTIONS];
     unsigned nSeedsApplied[NUM_DIRECTIONS];
     unsigned bestScore;
-    unsigned bestScoreGenomeLocation;
+    GenomeLocation bestScoreGenomeLocation;
     unsigned secondBestScore;
-    unsigned secondBestScoreGenomeLocation;
+    GenomeLocation secondBestScoreGenomeLocation;
     int      secondBestScoreDirection;
     unsigned scoreLimit;
     unsigned lvScores;
@@ -259,27 +335,36 @@ private:
     double totalProbabilityByDepth[AlignerStats::maxMaxHits];
     void updateProbabilityMass();
 
+    //
+    // For mapqToStopAt: the most that one more edit can multiply a location's match probability by for this read, which
+    // is the chance of a mismatch at its worst quality base or of opening a gap, whichever is bigger.
+    //
+    double highestEditProbability;
+
+    unsigned mapqSearchDepth();
+
         bool
     score(
         bool             forceResult,
         Read            *read[NUM_DIRECTIONS],
         AlignmentResult *result,
         int             *finalScore,
-        unsigned        *singleHitGenomeLocation,
+        GenomeLocation  *singleHitGenomeLocation,
         Direction       *hitDirection,
         int             *mapq,
         IdPairVector    *secondary = NULL);
     
     void clearCandidates();
 
-    bool findElement(unsigned genomeLocation, Direction direction, HashTableElement **hashTableElement);
-    void findCandidate(unsigned genomeLocation, Direction direction, Candidate **candidate, HashTableElement **hashTableElement);
-    void allocateNewCandidate(unsigned genomeLoation, Direction direction, unsigned lowestPossibleScore, int seedOffset, Candidate **candidate, HashTableElement **hashTableElement);
+    bool findElement(GenomeLocation genomeLocation, Direction direction, HashTableElement **hashTableElement);
+    void findCandidate(GenomeLocation genomeLocation, Direction direction, Candidate **candidate, HashTableElement **hashTableElement);
+    void allocateNewCandidate(GenomeLocation genomeLoation, Direction direction, unsigned lowestPossibleScore, int seedOffset, Candidate **candidate, HashTableElement **hashTableElement);
     void incrementWeight(HashTableElement *element);
-    void prefetchHashTableBucket(unsigned genomeLocation, Direction direction);
+    void prefetchHashTableBucket(GenomeLocation genomeLocation, Direction direction);
 
     const Genome *genome;
     GenomeIndex *genomeIndex;
+    DecodedHitBuffer decodedHits;   // For the current read's lookups if the index has a compressed overflow table, and for skipping popular seeds
     unsigned seedLen;
     unsigned maxHitsToConsider;
     unsigned maxK;
@@ -293,6 +378,51 @@ private:
     char *rcReadQuality;
     char *reversedRead[NUM_DIRECTIONS];
 
+    char *genomeUnpackBuffer;       // Where we unpack genome data to score if the genome is packed
+    size_t genomeUnpackBufferSize;
+
+    //
+    // The batch of candidates that score is verifying, all from one hash table element.  A batch of more than one gets
+    // a genomeUnpackBufferSize slot of batchUnpackBuffer per candidate, since their genome data is all needed at once.
+    //
+    unsigned verifyBatchSize;
+    char *batchUnpackBuffer;
+    VerifyRequest verifyRequests[hashTableElementSize];
+    VerifyResult verifyResults[hashTableElementSize];
+    unsigned verifyCandidateIndices[hashTableElementSize];
+
+    //
+    // Fills in the request for one of the element's candidates, with its genome data unpacked into unpackBuffer if
+    // the genome needs it.
+    //
+    void prepareToVerify(Read *read[NUM_DIRECTIONS], HashTableElement *element, unsigned candidateIndex, char *unpackBuffer,
+                         VerifyRequest *request);
+
+    PackedSeeds packedSeeds;        // The read being aligned, to take its seeds from
+    void *packedSeedStorage;
+    _uint64 *minimizerHashes;       // Scratch space for finding the read's minimizers, if the index only has those
+    bool *isMinimizer;
+
+    //
+    // The seeds of the first pass over a read start every seedLen bases (stepping over any that have Ns), so they don't
+    // overlap, and so the bound that lowestPossibleScoreOfAnyUnseenLocation comes from holds whatever order they're used
+    // in.  With orderSeedsByHits, lookUpFirstPassSeeds looks them all up in one batch (which overlaps their cache misses)
+    // and sorts them so that AlignRead uses the ones with the fewest hits first.  Those cost the least to apply and do
+    // the most to narrow the candidates, and seeds with no hits at all raise the bound for nothing, so reads tend to
+    // reach the stopping criteria after fewer seeds and fewer LV calls.  Returns the number of first pass seeds.
+    //
+    bool orderSeedsByHits;
+    unsigned maxFirstPassSeeds;
+    void *firstPassStorage;         // Holds all of the arrays below
+    Seed *firstPassSeeds;
+    const GenomeLocation **firstPassHits[NUM_DIRECTIONS];
+    unsigned *firstPassNHits[NUM_DIRECTIONS];
+    unsigned *firstPassOffsets;
+    unsigned *firstPassOrder;       // Indices into the others, in the order to use them
+
+    static size_t getFirstPassStorageSize(unsigned maxReadSize, unsigned seedLen);
+    unsigned lookUpFirstPassSeeds(unsigned nPossibleSeeds, GenomeLocation minSeedLoc, GenomeLocation maxSeedLoc);
+
     unsigned nTable[256];
 
     int readId;
@@ -307,5 +437,31 @@ private:
     bool stopOnFirstHit;      // Whether to stop the first time a location matches with less than
                               // maxK edit distance (useful when using SNAP for filtering only).
 
+    unsigned mapqToStopAt;    // If non-zero, cut the search short once the best hit's MAPQ is sure to be at least this
+
+    int exactMatchMapq;       // If non-zero, try tryExactMatch first and give what it finds this MAPQ
+
+    unsigned lvBudget;        // If non-zero, the most locations score will compute LV for on one read
+
+    bool tryExactMatch(Read *read, GenomeLocation *genomeLocation, Direction *hitDirection, int *finalScore, int *mapq);
+
+    unsigned realignRadius;   // If non-zero, AlignReads tries alignNearOriginalLocation first
+
+    //
+    // Searches within realignRadius of where the read was aligned in its input, in the same direction.  If that gives a
+    // single confident hit, fills in the results and returns true; otherwise the read needs the whole genome search.
+    //
+    bool alignNearOriginalLocation(Read *read, AlignmentResult *result, GenomeLocation *genomeLocation, Direction *hitDirection, int *finalScore,
+                                   int *mapq);
+
+    const SeedLookups *seedLookupsToReuse;
+
+    SecondaryAlignments secondaryCandidates;    // The read's best scored candidates, for the secondary vector
+
+    //
+    // Turns the candidates into the secondary alignments once the read has its result.
+    //
+    void emitSecondaryAlignments(IdPairVector *secondary, AlignmentResult result, GenomeLocation location, Direction direction);
+
     AlignerStats *stats;
 };
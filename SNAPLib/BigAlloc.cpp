@@ -27,6 +27,12 @@ Revision History:
 
 bool BigAllocUseHugePages = true;
 
+#ifdef  USE_HUGETLB
+unsigned BigAllocExplicitHugePageShift = 21;
+#else   // USE_HUGETLB
+unsigned BigAllocExplicitHugePageShift = 0;
+#endif  // USE_HUGETLB
+
 
 #ifdef PROFILE_BIGALLOC
 
@@ -311,6 +317,18 @@ bool BigCommit(
 
 #else /* no _MSC_VER */
 
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+//
+// How the memory for an allocation came, which we keep in the (otherwise zero) low bits of the size at the start of it,
+// so BigDealloc can keep the counts of how much memory is of each kind.
+//
+enum BigAllocationKind {SmallPageAllocation = 0, ExplicitHugePageAllocation = 1, TransparentHugePageAllocation = 2, NBigAllocationKinds = 3};
+static const size_t BigAllocationKindMask = 3;
+static volatile _int64 BigAllocBytesInUse[NBigAllocationKinds];
+
 #ifdef PROFILE_BIGALLOC
 void *BigAllocInternal(
 #else
@@ -327,31 +345,66 @@ void *BigAlloc(
     if (sizeToAllocate % ALIGN_SIZE != 0) {
         sizeToAllocate += ALIGN_SIZE - (sizeToAllocate % ALIGN_SIZE);
     }
-    if (sizeAllocated != NULL) {
-      *sizeAllocated = sizeToAllocate - sizeof(size_t);
-    }
 
     int flags = MAP_PRIVATE|MAP_ANONYMOUS;
-#ifdef USE_HUGETLB
-    flags |= MAP_HUGETLB;
-#endif
-    char *mem = (char *) mmap(NULL, sizeToAllocate, PROT_READ|PROT_WRITE, flags, -1, 0);
-    if (mem == MAP_FAILED) {
-        perror("mmap");
-        soft_exit(1);
-    }
+    char *mem = (char *)MAP_FAILED;
+    BigAllocationKind kind = SmallPageAllocation;
 
-#if (defined(MADV_HUGEPAGE) && !defined(USE_HUGETLB))
-    // Tell Linux to use huge pages for this range
-    if (BigAllocUseHugePages) {
-        if (madvise(mem, sizeToAllocate, MADV_HUGEPAGE) == -1) {
-            fprintf(stderr, "WARNING: failed to enable huge pages -- your kernel may not support it\n"); 
+#ifdef MAP_HUGETLB
+    if (BigAllocUseHugePages && 0 != BigAllocExplicitHugePageShift) {
+        //
+        // Only use explicit huge pages for allocations of at least one of them, because they can't be shared with
+        // anything else and the kernel has a limited number of them.
+        //
+        size_t hugePageSize = (size_t)1 << BigAllocExplicitHugePageShift;
+        if (sizeToAllocate >= hugePageSize) {
+            size_t hugeSizeToAllocate = ((sizeToAllocate + hugePageSize - 1) / hugePageSize) * hugePageSize;
+            mem = (char *) mmap(NULL, hugeSizeToAllocate, PROT_READ|PROT_WRITE, flags | MAP_HUGETLB | (BigAllocExplicitHugePageShift << MAP_HUGE_SHIFT), -1, 0);
+            if (mem != MAP_FAILED) {
+                sizeToAllocate = hugeSizeToAllocate;
+                kind = ExplicitHugePageAllocation;
+            } else {
+                static bool warningPrinted = false;
+                if (!warningPrinted) {
+                    //
+                    // This isn't thread safe, so you might get more than one of these.
+                    //
+                    warningPrinted = true;
+                    fprintf(stderr, "BigAlloc: WARNING: unable to allocate %lldMB of memory in %lldMB huge pages (%d), falling back to ordinary pages.  Check /proc/sys/vm/nr_hugepages (or the 1GB page pool).\n",
+                        (_int64)(hugeSizeToAllocate / (1024 * 1024)), (_int64)(hugePageSize / (1024 * 1024)), errno);
+                }
+            }
         }
     }
+#endif  // MAP_HUGETLB
+
+    if (MAP_FAILED == mem) {
+        mem = (char *) mmap(NULL, sizeToAllocate, PROT_READ|PROT_WRITE, flags, -1, 0);
+        if (mem == MAP_FAILED) {
+            perror("mmap");
+            soft_exit(1);
+        }
+
+#ifdef MADV_HUGEPAGE
+        // Tell Linux to use huge pages for this range
+        if (BigAllocUseHugePages) {
+            if (madvise(mem, sizeToAllocate, MADV_HUGEPAGE) == -1) {
+                fprintf(stderr, "WARNING: failed to enable huge pages -- your kernel may not support it\n"); 
+            } else {
+                kind = TransparentHugePageAllocation;
+            }
+        }
 #endif
+    }
+
+    if (sizeAllocated != NULL) {
+      *sizeAllocated = sizeToAllocate - sizeof(size_t);
+    }
+
+    InterlockedAdd64AndReturnNewValue(&BigAllocBytesInUse[kind], sizeToAllocate);
 
-    // Remember the size allocated in the first sizeof(size_t) bytes
-    *((size_t *) mem) = sizeToAllocate;
+    // Remember the size allocated (and its kind) in the first sizeof(size_t) bytes
+    *((size_t *) mem) = sizeToAllocate | kind;
     return (void *) (mem + sizeof(size_t));
 }
 
@@ -361,7 +414,9 @@ void BigDealloc(void *memory)
     if (NULL == memory) return;
     // Figure out the size we had allocated
     char *startAddress = ((char *) memory) - sizeof(size_t);
-    size_t sizeAllocated = *((size_t *) startAddress);
+    size_t sizeAllocated = *((size_t *) startAddress) & ~BigAllocationKindMask;
+    BigAllocationKind kind = (BigAllocationKind)(*((size_t *) startAddress) & BigAllocationKindMask);
+    InterlockedAdd64AndReturnNewValue(&BigAllocBytesInUse[kind], -(_int64)sizeAllocated);
     if (munmap(startAddress, sizeAllocated) != 0) {
         perror("munmap");
         soft_exit(1);
@@ -498,6 +553,32 @@ void PrintBigAllocProfile()
             AllocProfile[i].total * 1e-6, AllocProfile[i].count, AllocProfile[i].caller);
     }
 #endif
+
+#ifndef _MSC_VER
+    //
+    // Say how much of what's allocated now is on huge pages.  Memory that we madvised can still be on small pages if the
+    // kernel couldn't find any huge ones, so also report how much of the process's anonymous memory really is on them.
+    //
+    const _int64 MB = 1024 * 1024;
+    if (0 != BigAllocBytesInUse[ExplicitHugePageAllocation] + BigAllocBytesInUse[TransparentHugePageAllocation] + BigAllocBytesInUse[SmallPageAllocation]) {
+        fprintf(stderr, "BigAlloc: %lldMB in explicit huge pages, %lldMB advised to use transparent huge pages, %lldMB in small pages",
+            BigAllocBytesInUse[ExplicitHugePageAllocation] / MB, BigAllocBytesInUse[TransparentHugePageAllocation] / MB, BigAllocBytesInUse[SmallPageAllocation] / MB);
+
+        FILE *smaps = fopen("/proc/self/smaps_rollup", "r");
+        if (NULL != smaps) {
+            char line[256];
+            _int64 anonHugePagesKB;
+            while (NULL != fgets(line, sizeof(line), smaps)) {
+                if (1 == sscanf(line, "AnonHugePages: %lld kB", &anonHugePagesKB)) {
+                    fprintf(stderr, " (%lldMB of the process is on transparent huge pages)", anonHugePagesKB / 1024);
+                    break;
+                }
+            }
+            fclose(smaps);
+        }
+        fprintf(stderr, "\n");
+    }
+#endif  // _MSC_VER
 }
 
 void* zalloc(void* opaque, unsigned items, unsigned size)
@@ -119,6 +119,14 @@ private:
 
 extern bool BigAllocUseHugePages;
 
+//
+// On Linux, BigAlloc normally asks for transparent huge pages with madvise, which the kernel may or may not provide.
+// Setting this to 21 (2MB) or 30 (1GB) makes it take allocations of at least that size from the explicit hugetlbfs pool
+// of pages of that size instead (which has to have been set up, with /proc/sys/vm/nr_hugepages or the like), falling back
+// to the normal way if the pool is too small.  0 means don't.  It's ignored on Windows, which always uses large pages.
+//
+extern unsigned BigAllocExplicitHugePageShift;
+
 
 // trivial per-thread heap for use in zalloc
 struct ThreadHeap
@@ -0,0 +1,198 @@
+/*++
+
+Module Name:
+
+    CandidateVerifier.cpp
+
+Abstract:
+
+    The backends that BaseAligner::score hands candidate locations to for their edit distances.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "CandidateVerifier.h"
+
+    void
+LandauVishkinVerifier::verify(
+    const VerifyRequest *requests,
+    unsigned             nRequests,
+    unsigned             scoreLimit,
+    VerifyResult        *o_results)
+{
+    for (unsigned i = 0; i < nRequests; i++) {
+        const VerifyRequest *request = &requests[i];
+        VerifyResult *result = &o_results[i];
+        result->score = -1;
+        result->matchProbability = 0;
+        result->genomeLocationOffset = 0;
+        if (NULL == request->genomeData) {
+            continue;
+        }
+
+        //
+        // Compute the distance separately in the forward and backward directions from the seed, to allow
+        // arbitrary offsets at both the start and end.  First the forward direction from the end of the seed.
+        //
+        int readLen = request->readLength;
+        int seedOffset = request->seedOffset;
+        int tailStart = seedOffset + request->seedLength;
+        double matchProb1, matchProb2;
+
+        int score1 = landauVishkin->computeEditDistance(request->genomeData + tailStart, request->genomeDataLength - tailStart,
+            request->readData + tailStart, request->readQuality + tailStart, readLen - tailStart, scoreLimit, &matchProb1, request->cacheKey);
+        if (score1 == -1) {
+            continue;
+        }
+
+        //
+        // The tail of the read matched; now reverse the reference genome data and match the head.
+        //
+        int limitLeft = scoreLimit - score1;
+        int genomeLocationOffset;
+        int score2 = reverseLandauVishkin->computeEditDistance(request->genomeData + seedOffset, seedOffset + MAX_K,
+            request->reversedReadData + readLen - seedOffset, request->reversedReadQuality + readLen - seedOffset, seedOffset, limitLeft,
+            &matchProb2, request->cacheKey, &genomeLocationOffset);
+        if (score2 == -1) {
+            continue;
+        }
+
+        result->score = score1 + score2;
+        // Map probabilities for substrings can be multiplied, but make sure to count seed too
+        result->matchProbability = matchProb1 * matchProb2 * lv_perfectMatchProbability[request->seedLength];
+        result->genomeLocationOffset = genomeLocationOffset;
+    }
+}
+
+//
+// How many of the first length bases of a and b differ.
+//
+static inline unsigned CountMismatches(const char *a, const char *b, unsigned length)
+{
+    unsigned mismatches = 0;
+    for (unsigned i = 0; i < length; i++) {
+        mismatches += a[i] != b[i] ? 1 : 0;
+    }
+    return mismatches;
+}
+
+    void
+SimdBatchVerifier::verify(
+    const VerifyRequest *requests,
+    unsigned             nRequests,
+    unsigned             scoreLimit,
+    VerifyResult        *o_results)
+{
+    if (nRequests < (unsigned)minLanes) {
+        LandauVishkinVerifier::verify(requests, nRequests, scoreLimit, o_results);
+        return;
+    }
+
+    unsigned laneRequests[BatchedEditDistance::Lanes];
+    int nLanes = 0;
+    for (unsigned whichRequest = 0; whichRequest < nRequests; whichRequest++) {
+        const VerifyRequest *request = &requests[whichRequest];
+        VerifyResult *result = &o_results[whichRequest];
+        result->score = -1;
+        result->matchProbability = 0;
+        result->genomeLocationOffset = 0;
+        if (NULL == request->genomeData) {
+            continue;
+        }
+
+        //
+        // The mismatches on the main diagonal are an alignment, so a candidate with no more of them than the limit is
+        // within it, and LV is quick with those.  It's the rest that are worth a lane.
+        //
+        if (request->genomeDataLength >= request->readLength &&
+            CountMismatches(request->readData, request->genomeData, request->readLength) <= scoreLimit) {
+            LandauVishkinVerifier::verify(request, 1, scoreLimit, result);
+            continue;
+        }
+
+        laneRequests[nLanes++] = whichRequest;
+        if (BatchedEditDistance::Lanes == nLanes) {
+            verifyInLanes(requests, laneRequests, nLanes, scoreLimit, o_results);
+            nLanes = 0;
+        }
+    }
+
+    if (nLanes > 0) {
+        verifyInLanes(requests, laneRequests, nLanes, scoreLimit, o_results);
+    }
+}
+
+    void
+SimdBatchVerifier::verifyInLanes(
+    const VerifyRequest *requests,
+    unsigned            *laneRequests,
+    int                  nLanes,
+    unsigned             scoreLimit,
+    VerifyResult        *o_results)
+{
+    const int Lanes = BatchedEditDistance::Lanes;
+    const char *texts[Lanes];
+    int textLens[Lanes];
+    const char *patterns[Lanes];
+    int patternLens[Lanes];
+    int forwardDistances[Lanes];
+    int reverseDistances[Lanes];
+    int k = (int)__min(scoreLimit, (unsigned)MAX_K - 1);   // as LV limits it
+
+    //
+    // First the forward distances from the end of the seed.
+    //
+    if (nLanes >= minLanes) {
+        for (int lane = 0; lane < nLanes; lane++) {
+            const VerifyRequest *request = &requests[laneRequests[lane]];
+            int tailStart = request->seedOffset + request->seedLength;
+            texts[lane] = request->genomeData + tailStart;
+            textLens[lane] = (int)request->genomeDataLength - tailStart;
+            patterns[lane] = request->readData + tailStart;
+            patternLens[lane] = (int)request->readLength - tailStart;
+        }
+        batchedEditDistance.computeEditDistances(1, texts, textLens, patterns, patternLens, nLanes, k, forwardDistances);
+
+        //
+        // Then the reverse distances back from the start of the seed, for the ones that are still within the limit.
+        //
+        int nReverseLanes = 0;
+        for (int lane = 0; lane < nLanes; lane++) {
+            if (forwardDistances[lane] > k) {
+                continue;
+            }
+            const VerifyRequest *request = &requests[laneRequests[lane]];
+            texts[nReverseLanes] = request->genomeData + request->seedOffset;
+            textLens[nReverseLanes] = (int)request->seedOffset + MAX_K;
+            patterns[nReverseLanes] = request->reversedReadData + request->readLength - request->seedOffset;
+            patternLens[nReverseLanes] = (int)request->seedOffset;
+            laneRequests[nReverseLanes] = laneRequests[lane];
+            forwardDistances[nReverseLanes] = forwardDistances[lane];
+            nReverseLanes++;
+        }
+        nLanes = nReverseLanes;
+
+        if (nLanes >= minLanes) {
+            batchedEditDistance.computeEditDistances(-1, texts, textLens, patterns, patternLens, nLanes, k, reverseDistances);
+            int nLeft = 0;
+            for (int lane = 0; lane < nLanes; lane++) {
+                if (forwardDistances[lane] + reverseDistances[lane] <= (int)scoreLimit) {
+                    laneRequests[nLeft++] = laneRequests[lane];
+                }
+            }
+            nLanes = nLeft;
+        }
+    }
+
+    //
+    // LV has the same distances for the ones that are left (and decides the ones there were too few of to be worth a
+    // pass), and gets their probabilities and offsets.
+    //
+    for (int lane = 0; lane < nLanes; lane++) {
+        LandauVishkinVerifier::verify(&requests[laneRequests[lane]], 1, scoreLimit, &o_results[laneRequests[lane]]);
+    }
+}
@@ -0,0 +1,135 @@
+/*++
+
+Module Name:
+
+    CandidateVerifier.h
+
+Abstract:
+
+    The backends that BaseAligner::score hands candidate locations to for their edit distances.
+
+Environment:
+
+    User mode service.
+
+    Not thread safe; like the LandauVishkin objects they use, each aligner has its own.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "LandauVishkin.h"
+
+//
+// One candidate for a verifier to score.  The read (in the candidate's direction) matches the genome exactly for
+// seedLength bases at seedOffset, and its edit distance is the forward distance from the end of the seed to the end of
+// the read plus the reverse distance from the start of the seed back to the start of the read.  The reverse distance
+// looks at up to MAX_K bases before genomeData, for deletions there.
+//
+struct VerifyRequest
+{
+    const char *genomeData;             // NULL for a candidate too close to the end of the genome to score, which gets -1
+    unsigned    genomeDataLength;
+    const char *readData;
+    const char *readQuality;
+    const char *reversedReadData;       // the read reversed, for the reverse distance
+    const char *reversedReadQuality;    // and its qualities, which are the opposite direction's reversed
+    unsigned    readLength;
+    unsigned    seedOffset;
+    unsigned    seedLength;
+    _uint64     cacheKey;               // for the LV cache, or 0 not to use it
+};
+
+struct VerifyResult
+{
+    int         score;                  // -1 if it's more than the limit
+    double      matchProbability;       // 0 if the score is -1
+    int         genomeLocationOffset;   // how far the alignment starts from the candidate, from any indels before the seed
+};
+
+//
+// BaseAligner::score takes the candidates of a hash table element a batch at a time, up to getBatchSize() of them,
+// and verifies them all at the scoreLimit it had when it started the batch.  It then goes through the results in
+// order.  A score is the same at any limit it's within, so one over a limit that earlier candidates in the batch
+// lowered is taken as -1, and only a -1 whose limit has since gone up is verified again.  That way a backend with a
+// batch size above one gets the same alignments, just with some scores that didn't turn out to be needed.
+//
+// The LV backend is the default, one candidate at a time.  The SIMD backend scores a batch's candidates together in
+// the lanes of a vector and only runs LV on the ones that come out within the limit.  A device backend (CUDA or OpenCL, say) would ship each
+// batch's genome windows and reads to the device and bring back the results, and would want batches as big as an
+// element allows.
+//
+class CandidateVerifier
+{
+public:
+    virtual ~CandidateVerifier() {}
+
+    virtual unsigned getBatchSize() = 0;
+
+    virtual void verify(const VerifyRequest *requests, unsigned nRequests, unsigned scoreLimit, VerifyResult *o_results) = 0;
+};
+
+class LandauVishkinVerifier : public CandidateVerifier
+{
+public:
+    LandauVishkinVerifier(LandauVishkin<1> *i_landauVishkin = NULL, LandauVishkin<-1> *i_reverseLandauVishkin = NULL) :
+        landauVishkin(i_landauVishkin), reverseLandauVishkin(i_reverseLandauVishkin) {}
+
+    virtual unsigned getBatchSize() {return 1;}
+
+    virtual void verify(const VerifyRequest *requests, unsigned nRequests, unsigned scoreLimit, VerifyResult *o_results);
+
+private:
+    LandauVishkin<1> *landauVishkin;
+    LandauVishkin<-1> *reverseLandauVishkin;
+};
+
+//
+// A stand-in for a device backend: it takes batches of up to batchSize candidates, as one would, but scores them on
+// the host with LV.  It's what the batching in BaseAligner::score is checked with, and where a device backend would
+// start from.
+//
+class HostBatchVerifier : public LandauVishkinVerifier
+{
+public:
+    HostBatchVerifier(LandauVishkin<1> *i_landauVishkin, LandauVishkin<-1> *i_reverseLandauVishkin, unsigned i_batchSize) :
+        LandauVishkinVerifier(i_landauVishkin, i_reverseLandauVishkin), batchSize(i_batchSize) {}
+
+    virtual unsigned getBatchSize() {return batchSize;}
+
+private:
+    unsigned batchSize;
+};
+
+//
+// Computes the batch's forward and then reverse edit distances BatchedEditDistance::Lanes candidates at a time, and
+// runs LV only on the candidates whose two distances come to no more than the limit, for their match probabilities and
+// indel offsets.  BatchedEditDistance finds the distances LV does, so the results are LandauVishkinVerifier's, but the
+// candidates that are well over the limit each take a lane of a vector pass rather than an LV run.  The ones with few
+// enough mismatches on the main diagonal are sure to be within the limit and go straight to LV, as do the candidates of
+// a batch or a pass with fewer than minLanes of them, since a vector pass costs more than a few LV runs.
+//
+class SimdBatchVerifier : public LandauVishkinVerifier
+{
+public:
+    static const int DefaultMinLanes = 4;
+
+    SimdBatchVerifier(LandauVishkin<1> *i_landauVishkin, LandauVishkin<-1> *i_reverseLandauVishkin, unsigned i_batchSize = BatchedEditDistance::Lanes,
+                      int i_minLanes = DefaultMinLanes) :
+        LandauVishkinVerifier(i_landauVishkin, i_reverseLandauVishkin), batchSize(i_batchSize), minLanes(i_minLanes) {}
+
+    virtual unsigned getBatchSize() {return batchSize;}
+
+    virtual void verify(const VerifyRequest *requests, unsigned nRequests, unsigned scoreLimit, VerifyResult *o_results);
+
+private:
+    //
+    // Verifies requests[laneRequests[0..nLanes)], which can be up to Lanes of them.  It uses laneRequests as scratch.
+    //
+    void verifyInLanes(const VerifyRequest *requests, unsigned *laneRequests, int nLanes, unsigned scoreLimit, VerifyResult *o_results);
+
+    unsigned batchSize;
+    int minLanes;
+    BatchedEditDistance batchedEditDistance;
+};
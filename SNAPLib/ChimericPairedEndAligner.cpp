@@ -49,7 +49,9 @@ ChimericPairedEndAligner::ChimericPairedEndAligner(
         unsigned            extraSearchDepth,
         PairedEndAligner    *underlyingPairedEndAligner_,
         BigAllocator        *allocator)
- :  underlyingPairedEndAligner(underlyingPairedEndAligner_), forceSpacing(forceSpacing_), lv(0), reverseLV(0)
+ :  underlyingPairedEndAligner(underlyingPairedEndAligner_), forceSpacing(forceSpacing_), lv(LVCacheSize), reverseLV(LVCacheSize),
+    maxSecondary(SecondaryAlignments::DefaultMaxSecondaryAlignments), genome(index->getGenome()), seedLength(index->getSeedLength()),
+    splitReads(false), mateRescue(false), minSpacing(0), maxSpacing(0), windowBuffer(NULL), windowBufferSize(0)
 {
     // Create single-end aligners.
     singleAligner = new (allocator) BaseAligner(index, maxHits, maxK, maxReadSize,
@@ -77,6 +79,7 @@ ChimericPairedEndAligner::getBigAllocatorReservation(
 ChimericPairedEndAligner::~ChimericPairedEndAligner()
 {
     singleAligner->~BaseAligner();
+    delete [] windowBuffer;
 }
 
 #ifdef _DEBUG
@@ -87,6 +90,8 @@ extern bool _DumpAlignments;
 void ChimericPairedEndAligner::align(Read *read0, Read *read1, PairedAlignmentResult *result, IdPairVector* secondary)
 {
 	result->status[0] = result->status[1] = NotFound;
+    result->isSplit[0] = result->isSplit[1] = false;
+    result->mateRescued = false;
     if (secondary != NULL) {
         secondary->clear();
     }
@@ -95,10 +100,14 @@ void ChimericPairedEndAligner::align(Read *read0, Read *read1, PairedAlignmentRe
         return;
     }
 
-    _int64 start = timeInNanos();
     //
-    // Let the LVs use the cache that we built up.
+    // The LVs' caches are shared by the intersecting aligner and the single-end aligner below, and are only good for this
+    // pair, since their keys identify the read by which of the pair it is.
     //
+    lv.clearCache();
+    reverseLV.clearCache();
+
+    _int64 start = timeInNanos();
     underlyingPairedEndAligner->align(read0, read1, result, secondary); 
     _int64 end = timeInNanos();
 
@@ -127,30 +136,65 @@ void ChimericPairedEndAligner::align(Read *read0, Read *read1, PairedAlignmentRe
     // chimeric and so we should just align them with the single end aligner and apply a MAPQ penalty.
     //
     Read *read[NUM_READS_PER_PAIR] = {read0, read1};
-    IdPairVector* singleSecondary[2] = {NULL, NULL};
-    if (secondary != NULL) {
-        singleSecondary[0] = new IdPairVector;
-        singleSecondary[1] = new IdPairVector;
+    for (int r = 0; r < NUM_READS_PER_PAIR; r++) {
+        singleAligner->setReadId(r);    // So its LV cache keys match the intersecting aligner's
+
+        //
+        // The intersecting aligner has already looked up seeds from this read in the whole genome, so let the single
+        // aligner use those hits rather than looking the same seeds up again.
+        //
+        SeedLookups lookups;
+        singleAligner->setSeedLookupsToReuse(underlyingPairedEndAligner->getSeedLookups(r, &lookups) ? &lookups : NULL);
+        result->status[r] = singleAligner->AlignRead(read[r], &result->location[r], &result->direction[r], &result->score[r], &result->mapq[r],
+                                                     secondary != NULL ? &singleSecondary[r] : NULL);
+        singleAligner->setSeedLookupsToReuse(NULL);
+
+        //
+        // An end that's sure of its place may have a mate near it that didn't align together with it because it has too
+        // many errors to seed.  The first end's mate gets looked for before it's aligned on its own, and the second's
+        // only if the first didn't align anywhere.
+        //
+        if (mateRescue && SingleHit == result->status[r] && result->mapq[r] >= MinMapqToRescueFrom &&
+            (0 == r || NotFound == result->status[0]) && rescueMate(read[1 - r], 1 - r, result)) {
+            result->mateRescued = true;
+            result->fromAlignTogether = false;
+            return;
+        }
     }
+
     for (int r = 0; r < NUM_READS_PER_PAIR; r++) {
-        result->status[r] = singleAligner->AlignRead(read[r], &result->location[r], &result->direction[r], &result->score[r], &result->mapq[r], singleSecondary[r]);
         result->mapq[r] /= 3;   // Heavy quality penalty for chimeric reads
     }
-    if (secondary != NULL && singleSecondary[0]->size() + singleSecondary[1]->size() > 0) {
+
+    //
+    // A read that still doesn't align cleanly may be chimeric itself, spanning the breakpoint.  Its pieces' alignments
+    // account for all of it, so they don't get the penalty.
+    //
+    if (splitReads) {
+        for (int r = 0; r < NUM_READS_PER_PAIR; r++) {
+            int wholeScore = NotFound == result->status[r] ? -1 : result->score[r];
+            if ((wholeScore < 0 || wholeScore > SplitPenalty) && alignSplit(read[r], r, wholeScore, result)) {
+                singleSecondary[r].clear();     // They were for the whole read
+            }
+        }
+    }
+    if (secondary != NULL && singleSecondary[0].size() + singleSecondary[1].size() > 0) {
         // loop through all combinations of secondary alignments
         secondary->clear();
-        for (int i = -1; i < singleSecondary[0]->size(); i++) {
-            for (int j = -1; j < singleSecondary[1]->size(); j++) {
+        unsigned nPairs = 0;
+        for (int i = -1; i < singleSecondary[0].size() && nPairs < maxSecondary; i++) {
+            for (int j = -1; j < singleSecondary[1].size() && nPairs < maxSecondary; j++) {
                 if (i > -1 || j > -1) {
+                    nPairs++;
                     if (i == -1) {
                         secondary->push_back(IdPair(result->location[0], result->direction[0]));
                     } else {
-                        secondary->push_back((*singleSecondary[0])[i]);
+                        secondary->push_back(singleSecondary[0][i]);
                     }
                     if (j == -1) {
                         secondary->push_back(IdPair(result->location[1], result->direction[1]));
                     } else {
-                        secondary->push_back((*singleSecondary[1])[j]);
+                        secondary->push_back(singleSecondary[1][j]);
                     }
                 }
             }
@@ -166,4 +210,362 @@ void ChimericPairedEndAligner::align(Read *read0, Read *read1, PairedAlignmentRe
     }
 #endif // _DEBUG
                     
+}
+
+    bool
+ChimericPairedEndAligner::alignSplit(Read *read, int whichRead, int wholeScore, PairedAlignmentResult *result)
+{
+    unsigned readLen = read->getDataLength();
+    unsigned minPiece = __max(MinSplitPiece, seedLength);
+    if (readLen < 2 * minPiece) {
+        return false;
+    }
+
+    readData = read->getData();
+    const char *quality = read->getQuality();
+    for (unsigned i = 0; i < readLen; i++) {
+        rcReadData[i] = COMPLEMENT[(unsigned char)readData[readLen - 1 - i]];
+    }
+
+    //
+    // Where the pieces meet for each try.  Halves are the surest when the breakpoint's anywhere near the middle, and the
+    // others are for when it's nearer an end, which would leave too much of the other side in one of the halves.
+    //
+    const int nTries = 3;
+    unsigned tryBreaks[nTries] = {readLen / 2, __max(minPiece, readLen / 4), __min(readLen - minPiece, readLen - readLen / 4)};
+
+    //
+    // The LV caches' keys are a read's location and which of the pair it is, so the pieces can't share them.
+    //
+    int maxK = singleAligner->getMaxK();
+    bool found = false;
+    int bestCost = 0;
+    unsigned bestBreak = 0;
+    GenomeLocation bestLocation[2];
+    Direction bestDirection[2];
+    int bestMapq[2];
+    int bestEdits[2];
+    for (int whichTry = 0; whichTry < nTries; whichTry++) {
+        unsigned pieceBreak = tryBreaks[whichTry];
+        unsigned pieceStart[2] = {0, pieceBreak};
+        unsigned pieceEnd[2] = {pieceBreak, readLen};
+        GenomeLocation location[2];
+        Direction direction[2];
+        int mapq[2];
+        bool aligned = true;
+        for (int p = 0; p < 2 && aligned; p++) {
+            unsigned length = pieceEnd[p] - pieceStart[p];
+            Read piece;
+            piece.init(read->getId(), read->getIdLength(), readData + pieceStart[p], quality + pieceStart[p], length);
+            lv.clearCache();
+            reverseLV.clearCache();
+            singleAligner->setMaxK(__min(maxK, (int)(length / SplitPieceErrorRate)));
+            int score;
+            aligned = SingleHit == singleAligner->AlignRead(&piece, &location[p], &direction[p], &score, &mapq[p]);
+        }
+        singleAligner->setMaxK(maxK);
+        if (!aligned) {
+            continue;
+        }
+
+        //
+        // Pieces on the same strand close enough together to be one alignment with an indel aren't a split read; the
+        // whole read didn't align for some other reason.
+        //
+        if (direction[0] == direction[1]) {
+            _int64 gap = FORWARD == direction[0] ? ((_int64)location[1] - pieceBreak) - (_int64)location[0] :
+                                                   ((_int64)location[1] + readLen) - ((_int64)location[0] + pieceBreak);
+            if (gap >= -(_int64)maxK && gap <= (_int64)maxK) {
+                continue;
+            }
+        }
+
+        if (!projectReference(location[0], direction[0], pieceStart[0], pieceEnd[0], readLen, projectedReference[0]) ||
+            !projectReference(location[1], direction[1], pieceStart[1], pieceEnd[1], readLen, projectedReference[1])) {
+            continue;
+        }
+
+        //
+        // Slide the break along the read, keeping count of the mismatches before it against the front piece's place and
+        // after it against the back's.
+        //
+        int mismatchesBefore = 0;
+        int mismatchesAfter = 0;
+        for (unsigned i = 0; i < readLen; i++) {
+            mismatchesAfter += readData[i] != projectedReference[1][i];
+        }
+
+        unsigned newBreak = 0;
+        int fewestMismatches = 0;
+        for (unsigned offset = 0; offset + minPiece <= readLen; offset++) {
+            if (offset >= minPiece && (0 == newBreak || mismatchesBefore + mismatchesAfter < fewestMismatches)) {
+                newBreak = offset;
+                fewestMismatches = mismatchesBefore + mismatchesAfter;
+            }
+            mismatchesBefore += readData[offset] != projectedReference[0][offset];
+            mismatchesAfter -= readData[offset] != projectedReference[1][offset];
+        }
+
+        //
+        // Moving the break moves the start of the front piece if it's reverse complemented, and of the back one if not.
+        //
+        if (RC == direction[0]) {
+            location[0] += (_int64)pieceBreak - newBreak;
+        }
+        if (FORWARD == direction[1]) {
+            location[1] += (_int64)newBreak - pieceBreak;
+        }
+        pieceStart[1] = pieceEnd[0] = newBreak;
+
+        int edits[2];
+        for (int p = 0; p < 2; p++) {
+            unsigned length = pieceEnd[p] - pieceStart[p];
+            edits[p] = scorePiece(readLen, pieceStart[p], length, location[p], direction[p], length / SplitPieceErrorRate);
+        }
+        if (edits[0] < 0 || edits[1] < 0) {
+            continue;
+        }
+
+        int cost = edits[0] + edits[1] + SplitPenalty;
+        if (!found || cost < bestCost) {
+            found = true;
+            bestCost = cost;
+            bestBreak = newBreak;
+            for (int p = 0; p < 2; p++) {
+                bestLocation[p] = location[p];
+                bestDirection[p] = direction[p];
+                bestMapq[p] = mapq[p];
+                bestEdits[p] = edits[p];
+            }
+        }
+
+        if (bestCost <= SplitPenalty) {
+            break;  // As good as it gets
+        }
+    }
+
+    if (!found || (wholeScore >= 0 && bestCost >= wholeScore)) {
+        return false;
+    }
+
+    //
+    // The longer piece is the primary alignment.
+    //
+    int primary = 2 * bestBreak >= readLen ? 0 : 1;
+    int other = 1 - primary;
+    result->status[whichRead] = SingleHit;
+    result->location[whichRead] = bestLocation[primary];
+    result->direction[whichRead] = bestDirection[primary];
+    result->mapq[whichRead] = bestMapq[primary];
+    result->score[whichRead] = bestEdits[0] + bestEdits[1];
+    result->isSplit[whichRead] = true;
+
+    SplitAlignment *split = &result->split[whichRead];
+    split->readOffset = bestBreak;
+    split->primaryIsFront = 0 == primary;
+    split->primaryScore = bestEdits[primary];
+    split->otherLocation = bestLocation[other];
+    split->otherDirection = bestDirection[other];
+    split->otherMapq = bestMapq[other];
+    split->otherScore = bestEdits[other];
+
+    return true;
+}
+
+    bool
+ChimericPairedEndAligner::rescueMate(Read *mate, int whichMate, PairedAlignmentResult *result)
+{
+    int anchor = 1 - whichMate;
+    unsigned readLen = mate->getDataLength();
+    int maxK = singleAligner->getMaxK();
+    if (readLen < seedLength || maxSpacing <= minSpacing) {
+        return false;
+    }
+
+    Direction direction = FORWARD == result->direction[anchor] ? RC : FORWARD;
+    const char *pattern = mate->getData();
+    const char *quality = mate->getQuality();
+    if (RC == direction) {
+        for (unsigned i = 0; i < readLen; i++) {
+            rcReadData[i] = COMPLEMENT[(unsigned char)pattern[readLen - 1 - i]];
+            rcQuality[i] = quality[readLen - 1 - i];
+        }
+        pattern = rcReadData;
+        quality = rcQuality;
+    }
+
+    const Genome::Contig *contig = genome->getContigAtLocation(result->location[anchor]);
+    if (NULL == contig) {
+        return false;
+    }
+    _int64 contigStart = contig->beginningOffset;
+    _int64 contigEnd = contigStart + contig->length;
+
+    //
+    // The mate starts from minSpacing to maxSpacing away from the other end, on one side or the other, and can run over by
+    // its length and the indels it's allowed.  The two windows are searched separately so that the stretch within
+    // minSpacing, where the intersecting aligner wouldn't have paired it, isn't.
+    //
+    int bestScore = -1, secondScore = -1;
+    _int64 bestEnd = 0, secondEnd = 0;
+    for (int side = 0; side < 2; side++) {
+        _int64 firstStart = (_int64)result->location[anchor] + (0 == side ? -(_int64)maxSpacing : (_int64)minSpacing);
+        _int64 windowStart = __max(contigStart, firstStart - maxK);
+        _int64 windowEnd = __min(contigEnd, firstStart + (maxSpacing - minSpacing) + readLen + maxK);
+        if (windowEnd - windowStart < (_int64)readLen || windowEnd - windowStart > BandedAligner::MaxPatternLength) {
+            continue;
+        }
+
+        size_t windowLength = (size_t)(windowEnd - windowStart);
+        if (genome->isPacked() && windowLength > windowBufferSize) {
+            delete [] windowBuffer;
+            windowBufferSize = windowLength;
+            windowBuffer = new char[windowBufferSize];
+        }
+        const char *text = genome->getSubstring(windowStart, windowLength, windowBuffer, windowBufferSize);
+        if (NULL == text) {
+            continue;
+        }
+
+        int end, sideSecondScore, sideSecondEnd;
+        int score = bandedAligner.findPattern(text, (int)windowLength, pattern, readLen, &end, &sideSecondScore, &sideSecondEnd);
+        if (score < 0) {
+            continue;
+        }
+
+        //
+        // Whichever of the two sides' best and next best isn't the best overall may be the next best.
+        //
+        if (bestScore < 0 || score < bestScore) {
+            if (bestScore >= 0) {
+                secondScore = bestScore;
+                secondEnd = bestEnd;
+            }
+            bestScore = score;
+            bestEnd = windowStart + end;
+        } else if (secondScore < 0 || score < secondScore) {
+            secondScore = score;
+            secondEnd = windowStart + end;
+        }
+        if (sideSecondScore >= 0 && (secondScore < 0 || sideSecondScore < secondScore)) {
+            secondScore = sideSecondScore;
+            secondEnd = windowStart + sideSecondEnd;
+        }
+    }
+
+    if (bestScore < 0 || bestScore > maxK) {
+        return false;
+    }
+
+    GenomeLocation location;
+    double probability;
+    int score = placeMate(pattern, quality, readLen, bestEnd, bestScore, maxK, &location, &probability);
+    if (score < 0) {
+        return false;
+    }
+
+    double secondProbability = 0.0;
+    GenomeLocation secondLocation;
+    if (secondScore < 0 || secondScore > maxK ||
+        placeMate(pattern, quality, readLen, secondEnd, secondScore, maxK, &secondLocation, &secondProbability) < 0) {
+        secondProbability = 0.0;
+    }
+
+    result->status[whichMate] = SingleHit;
+    result->location[whichMate] = location;
+    result->direction[whichMate] = direction;
+    result->score[whichMate] = score;
+    result->mapq[whichMate] = __min(result->mapq[anchor], computeMAPQ(probability + secondProbability, probability, score, 0));
+    return true;
+}
+
+    int
+ChimericPairedEndAligner::placeMate(
+    const char *pattern,
+    const char *quality,
+    unsigned    readLen,
+    _int64      end,
+    int         score,
+    int         k,
+    GenomeLocation *location,
+    double     *matchProbability)
+{
+    //
+    // The alignment starts readLen before its end less the net indels, which can't be more than its edits.  Try the
+    // ones nearest no indels first, and stop at one that LV finds as good as the banded aligner did.
+    //
+    int bestScore = -1;
+    for (int shift = 0; shift <= 2 * score; shift++) {
+        _int64 start = end - readLen + (shift % 2 == 0 ? shift / 2 : -(shift + 1) / 2);
+        if (start < 0) {
+            continue;
+        }
+        const char *text = genome->getSubstring(start, readLen + k, referenceBuffer, sizeof(referenceBuffer));
+        if (NULL == text) {
+            continue;
+        }
+        double probability;
+        int lvScore = lv.computeEditDistance(text, readLen + k, pattern, quality, readLen, k, &probability);
+        if (lvScore >= 0 && (bestScore < 0 || lvScore < bestScore)) {
+            bestScore = lvScore;
+            *location = (GenomeLocation)start;
+            *matchProbability = probability;
+            if (bestScore <= score) {
+                break;
+            }
+        }
+    }
+    return bestScore;
+}
+
+    bool
+ChimericPairedEndAligner::projectReference(
+    GenomeLocation location,
+    Direction   direction,
+    unsigned    pieceStart,
+    unsigned    pieceEnd,
+    unsigned    readLen,
+    char       *projected)
+{
+    if (FORWARD == direction) {
+        if (location < pieceStart) {
+            return false;
+        }
+        const char *text = genome->getSubstring(location - pieceStart, readLen, referenceBuffer, sizeof(referenceBuffer));
+        if (NULL == text) {
+            return false;
+        }
+        memcpy(projected, text, readLen);
+    } else {
+        //
+        // The piece's last base lines up with location, and the read's bases before it with the ones after that.
+        //
+        if (location + pieceEnd < readLen) {
+            return false;
+        }
+        const char *text = genome->getSubstring(location + pieceEnd - readLen, readLen, referenceBuffer, sizeof(referenceBuffer));
+        if (NULL == text) {
+            return false;
+        }
+        for (unsigned i = 0; i < readLen; i++) {
+            projected[i] = COMPLEMENT[(unsigned char)text[readLen - 1 - i]];
+        }
+    }
+    return true;
+}
+
+    int
+ChimericPairedEndAligner::scorePiece(unsigned readLen, unsigned offset, unsigned length, GenomeLocation location, Direction direction, int k)
+{
+    const char *pattern = FORWARD == direction ? readData + offset : rcReadData + (readLen - offset - length);
+    unsigned textLength = length + k;
+    const char *text = genome->getSubstring(location, textLength, referenceBuffer, sizeof(referenceBuffer));
+    if (NULL == text) {
+        textLength = length;    // Up against the end of the genome
+        text = genome->getSubstring(location, textLength, referenceBuffer, sizeof(referenceBuffer));
+        if (NULL == text) {
+            return -1;
+        }
+    }
+    return lv.computeEditDistance(text, textLength, pattern, length, k);
 }
@@ -26,6 +26,7 @@ Revision History:
 
 #include "PairedEndAligner.h"
 #include "BaseAligner.h"
+#include "BandedAligner.h"
 #include "BigAlloc.h"
 
 class ChimericPairedEndAligner : public PairedEndAligner {
@@ -56,19 +57,136 @@ public:
         PairedAlignmentResult *result,
         IdPairVector          *secondary = NULL);
 
+    virtual void prefetchPair(
+        Read                  *read0,
+        Read                  *read1)
+    {
+        underlyingPairedEndAligner->prefetchPair(read0, read1);
+    }
+
     void *operator new(size_t size) {return BigAlloc(size);}
     void operator delete(void *ptr) {BigDealloc(ptr);}
 
+    virtual void setSecondaryAlignmentLimits(unsigned maxSecondary_, unsigned scoreDelta)
+    {
+        maxSecondary = maxSecondary_;
+        singleAligner->setSecondaryAlignmentLimits(maxSecondary, scoreDelta);
+        underlyingPairedEndAligner->setSecondaryAlignmentLimits(maxSecondary, scoreDelta);
+    }
+
     virtual _int64 getLocationsScored() const {
         return underlyingPairedEndAligner->getLocationsScored() + singleAligner->getLocationsScored();
     }
 
+    virtual void setLVBudget(unsigned lvBudget)
+    {
+        singleAligner->setLVBudget(lvBudget);
+        underlyingPairedEndAligner->setLVBudget(lvBudget);
+    }
+
+    //
+    // A pair whose ends are both aligned singly and both run out counts twice.
+    //
+    virtual _int64 getAlignmentsOverLVBudget() const {
+        return underlyingPairedEndAligner->getAlignmentsOverLVBudget() + singleAligner->getNReadsOverLVBudget();
+    }
+
+    //
+    // How many LV computations looked in the shared cache, and how many found their answer there.
+    //
+    _int64 getLVCacheLookups() const {return lv.getCacheLookups() + reverseLV.getCacheLookups();}
+    _int64 getLVCacheHits() const {return lv.getCacheHits() + reverseLV.getCacheHits();}
+
+    //
+    // Whether reads that get aligned singly and don't align cleanly get another try as two pieces aligned separately, for
+    // the ones that span a translocation, inversion or big deletion.  Off unless asked for.
+    //
+    void setSplitReads(bool splitReads_) {splitReads = splitReads_;}
+
+    //
+    // Whether, when one end of a pair that didn't align together aligns confidently on its own, the other gets looked for
+    // in the windows the spacing allows on either side of it before it's aligned on its own, which finds mates with too
+    // many errors to seed and saves seeding the ones it finds.  Off unless asked for.  The spacing is the underlying
+    // aligner's, and has to be kept in step with it.
+    //
+    void setMateRescue(bool mateRescue_) {mateRescue = mateRescue_;}
+    void setSpacing(unsigned minSpacing_, unsigned maxSpacing_) {minSpacing = minSpacing_; maxSpacing = maxSpacing_;}
+
+    static const int MinMapqToRescueFrom = 10;  // How sure the one end has to be of its place to look for the other near it
+
+    static const unsigned MinSplitPiece = 25;       // The fewest bases either piece of a split read can have
+    static const unsigned SplitPieceErrorRate = 12; // Each piece can have an edit in this many bases, and no more
+    static const int SplitPenalty = 4;              // What splitting costs, in edits
+
 private:
-   
+
+    //
+    // Aligns the read as a piece from the front and one from the back, each on its own, tried at a few places between them,
+    // and then moves the break to wherever the mismatches against the two places add up to the least.  If that costs
+    // less than wholeScore (or wholeScore is -1 because the read didn't align as a whole) and the two pieces aren't just
+    // one alignment with an indel, fills in the read's result and returns true.
+    //
+    bool alignSplit(Read *read, int whichRead, int wholeScore, PairedAlignmentResult *result);
+
+    //
+    // Looks for mate, in the direction opposite the other end's, in the windows of the genome that the spacing allows
+    // around where the other end aligned, with bandedAligner.  If it's there with no more than maxK edits, fills in its
+    // result, with a MAPQ no more than the other end's, and returns true.
+    //
+    bool rescueMate(Read *mate, int whichMate, PairedAlignmentResult *result);
+
+    //
+    // Where the alignment of the readLen bases of pattern that the banded aligner found ending at end starts, found by
+    // scoring the starts that the score's worth of indels allow with LV.  Returns LV's score, or -1 if none is within k.
+    //
+    int placeMate(const char *pattern, const char *quality, unsigned readLen, _int64 end, int score, int k,
+                  GenomeLocation *location, double *matchProbability);
+
+    //
+    // The genome under the whole read, going by a piece of it (the bases from pieceStart to pieceEnd) that aligned at
+    // location in direction: for each of the read's bases, as it was read, the base it lines up with.  False if that's
+    // off either end of the genome.
+    //
+    bool projectReference(GenomeLocation location, Direction direction, unsigned pieceStart, unsigned pieceEnd, unsigned readLen,
+                          char *projected);
+
+    //
+    // The edits in the length bases of the read from offset, aligned at location in direction, or -1 if more than k.
+    //
+    int scorePiece(unsigned readLen, unsigned offset, unsigned length, GenomeLocation location, Direction direction, int k);
+
+    const Genome *genome;
+    unsigned    seedLength;
+    bool        splitReads;
     bool        forceSpacing;
+    bool        mateRescue;
+    unsigned    minSpacing;
+    unsigned    maxSpacing;
     BaseAligner *singleAligner;
     PairedEndAligner *underlyingPairedEndAligner;
 
+    //
+    // Shared by singleAligner and the underlying aligner, with a cache of results that's cleared for each pair.
+    //
+    static const unsigned LVCacheSize = 2048;
+
     LandauVishkin<1> lv;
     LandauVishkin<-1> reverseLV;
+
+    //
+    // The single end aligner's secondary alignments for each read, kept here so that they're only allocated when they
+    // grow rather than for every pair.
+    //
+    IdPairVector singleSecondary[NUM_READS_PER_PAIR];
+    unsigned maxSecondary;  // Pairs made from them
+
+    const char *readData;   // The read being split, and its reverse complement
+    char rcReadData[MAX_READ_LENGTH];
+    char projectedReference[NUM_READS_PER_PAIR][MAX_READ_LENGTH];     // Under each piece's place, for the whole read
+    char referenceBuffer[MAX_READ_LENGTH + MAX_K + 2];                  // For packed genomes
+
+    BandedAligner bandedAligner;
+    char        rcQuality[MAX_READ_LENGTH];    // The mate's quality backward, when it's looked for reverse complemented
+    char       *windowBuffer;                   // A window around the other end, for packed genomes
+    size_t      windowBufferSize;
 };
@@ -30,12 +30,21 @@ Revision History:
 #include <aio.h>
 #include <err.h>
 #include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <limits.h>
+#ifdef __linux__
+#include <linux/futex.h>
 #endif
+#else   // _MSC_VER
+#include <psapi.h>
+#endif  // _MSC_VER
 #include "exit.h"
 #ifdef PROFILE_WAIT
 #include <map>
 #endif
 #include "DataWriter.h"
+#include "GenericFile.h"
 
 using std::min;
 using std::max;
@@ -222,6 +231,20 @@ void BindThreadToProcessor(unsigned processorNumber) // This hard binds a thread
     }
 }
 
+bool InterleaveMemoryAcrossNumaNodes(bool interleave)
+{
+    if (interleave) {
+        fprintf(stderr,"Interleaving memory across NUMA nodes isn't supported on Windows\n");
+    }
+    return !interleave;
+}
+
+bool MoveMemoryToNumaNode(void *address, size_t bytes, int node)
+{
+    fprintf(stderr,"Moving memory to a NUMA node isn't supported on Windows\n");
+    return false;
+}
+
 int InterlockedIncrementAndReturnNewValue(volatile int *valueToIncrement)
 {
     return InterlockedIncrement((volatile long *)valueToIncrement);
@@ -242,6 +265,11 @@ _uint64 InterlockedCompareExchange64AndReturnOldValue(volatile _uint64 *valueToU
     return (_uint64) InterlockedCompareExchange(valueToUpdate, replacementValue, desiredPreviousValue);
 }
 
+void* InterlockedCompareExchangePointerAndReturnOldValue(volatile void **valueToUpdate, void* replacementValue, void* desiredPreviousValue)
+{
+    return InterlockedCompareExchangePointer((volatile PVOID *)valueToUpdate, replacementValue, desiredPreviousValue);
+}
+
 struct WrapperThreadContext {
     ThreadMainFunction      mainFunction;
     void                    *mainFunctionParameter;
@@ -296,6 +324,17 @@ unsigned GetNumberOfProcessors()
     return systemInfo->dwNumberOfProcessors;
 }
 
+_int64 GetMemoryLimit()
+{
+    MEMORYSTATUSEX memoryStatus;
+    memoryStatus.dwLength = sizeof(memoryStatus);
+    if (!GlobalMemoryStatusEx(&memoryStatus)) {
+        fprintf(stderr, "GlobalMemoryStatusEx failed, %d\n", GetLastError());
+        soft_exit(1);
+    }
+    return memoryStatus.ullTotalPhys;
+}
+
 _int64 QueryFileSize(const char *fileName) {
     HANDLE hFile = CreateFile(fileName,GENERIC_READ,FILE_SHARE_READ,NULL,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,NULL);
     if (INVALID_HANDLE_VALUE == hFile) {
@@ -327,6 +366,35 @@ MoveSingleFile(
     return MoveFile(oldFileName, newFileName) ? true : false;
 }
 
+    void
+GetProcessUsage(
+    ProcessUsage *o_usage)
+{
+    o_usage->residentBytes = o_usage->peakResidentBytes = o_usage->cpuMillis = -1;
+    o_usage->bytesRead = o_usage->bytesWritten = -1;
+    o_usage->storageBytesRead = o_usage->storageBytesWritten = -1;
+
+    PROCESS_MEMORY_COUNTERS memory;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &memory, sizeof(memory))) {
+        o_usage->residentBytes = memory.WorkingSetSize;
+        o_usage->peakResidentBytes = memory.PeakWorkingSetSize;
+    }
+    FILETIME creationTime, exitTime, kernelTime, userTime;
+    if (GetProcessTimes(GetCurrentProcess(), &creationTime, &exitTime, &kernelTime, &userTime)) {
+        ULARGE_INTEGER kernel, user;    // both in 100ns units
+        kernel.LowPart = kernelTime.dwLowDateTime;
+        kernel.HighPart = kernelTime.dwHighDateTime;
+        user.LowPart = userTime.dwLowDateTime;
+        user.HighPart = userTime.dwHighDateTime;
+        o_usage->cpuMillis = (kernel.QuadPart + user.QuadPart) / 10000;
+    }
+    IO_COUNTERS io;
+    if (GetProcessIoCounters(GetCurrentProcess(), &io)) {
+        o_usage->bytesRead = io.ReadTransferCount;
+        o_usage->bytesWritten = io.WriteTransferCount;
+    }
+}
+
 class LargeFileHandle
 {
 public:
@@ -421,8 +489,16 @@ OpenMemoryMappedFile(
     size_t length,
     void** o_contents,
     bool write,
-    bool sequential)
+    bool sequential,
+    bool populate,
+    bool hugePages,
+    size_t guardBytes)
 {
+    if (guardBytes != 0) {
+        fprintf(stderr, "OpenMemoryMappedFile: guard bytes are not supported on Windows (%s)\n", filename);
+        return NULL;
+    }
+
     MemoryMappedFile* result = new MemoryMappedFile();
     result->fileHandle = CreateFile(filename, (write ? GENERIC_WRITE : 0) | GENERIC_READ, 0, NULL, OPEN_EXISTING,
         FILE_ATTRIBUTE_NORMAL | (sequential ? FILE_FLAG_SEQUENTIAL_SCAN : FILE_FLAG_RANDOM_ACCESS), NULL);
@@ -447,6 +523,16 @@ OpenMemoryMappedFile(
         delete result;
         return NULL;
     }
+
+    if (populate) {
+        //
+        // There's no MAP_POPULATE equivalent, so just touch every page.
+        //
+        volatile char sum = 0;
+        for (size_t i = 0; i < length; i += 4096) {
+            sum += ((volatile char *)*o_contents)[i];
+        }
+    }
     return result;
 }
 
@@ -464,6 +550,17 @@ CloseMemoryMappedFile(
     }
 }
 
+    void
+AdviseWillNeed(const void *address, size_t length)
+{
+}
+
+    bool
+FillMemoryMappedRange(void *address, size_t length, char value)
+{
+    return false;
+}
+
 class WindowsAsyncFile : public AsyncFile
 {
 public:
@@ -664,6 +761,11 @@ int _fseek64bit(FILE *stream, _int64 offset, int origin)
     return _fseeki64(stream,offset,origin);
 }
 
+_int64 _ftell64bit(FILE *stream)
+{
+    return _ftelli64(stream);
+}
+
 int getpagesize()
 {
     SYSTEM_INFO systemInfo;
@@ -912,6 +1014,160 @@ _int64 timeInNanos()
     return ((_int64) ts.tv_sec) * 1000000000 + (_int64) ts.tv_nsec;
 }
 
+#ifdef __linux__
+
+//
+// The locks and events are futex words.  Most holds in SNAP are short (queue and buffer bookkeeping), so a thread
+// that finds one unavailable spins for a little while before it takes the trip into the kernel to park.
+//
+static const int SpinsBeforeParking = 100;
+
+static inline void SpinPause()
+{
+#if defined(__SSE2__) || defined(_M_X64)
+    _mm_pause();
+#endif
+}
+
+static inline void FutexWait(volatile int *word, int expected, const timespec *timeout)
+{
+    syscall(SYS_futex, (int *)word, FUTEX_WAIT_PRIVATE, expected, timeout, NULL, 0);
+}
+
+static inline void FutexWake(volatile int *word, int count)
+{
+    syscall(SYS_futex, (int *)word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+void AcquireUnderlyingExclusiveLock(UnderlyingExclusiveLock *lock)
+{
+    int state = __sync_val_compare_and_swap(&lock->state, 0, 1);
+    if (state == 0) {
+        return;
+    }
+    for (int i = 0; i < SpinsBeforeParking; i++) {
+        SpinPause();
+        if (lock->state == 0 && (state = __sync_val_compare_and_swap(&lock->state, 0, 1)) == 0) {
+            return;
+        }
+    }
+
+    //
+    // Mark the lock as waited for and park until it's released.  A thread that gets it this way leaves it marked,
+    // since there may be others still parked, so its release will wake the next one.
+    //
+    if (state != 2) {
+        state = __sync_lock_test_and_set(&lock->state, 2);
+    }
+    while (state != 0) {
+        FutexWait(&lock->state, 2, NULL);
+        state = __sync_lock_test_and_set(&lock->state, 2);
+    }
+}
+
+void ReleaseUnderlyingExclusiveLock(UnderlyingExclusiveLock *lock)
+{
+    if (__sync_fetch_and_sub(&lock->state, 1) != 1) {
+        __sync_lock_release(&lock->state);
+        FutexWake(&lock->state, 1);
+    }
+}
+
+bool InitializeUnderlyingExclusiveLock(UnderlyingExclusiveLock *lock)
+{
+    lock->state = 0;
+    return true;
+}
+
+bool DestroyUnderlyingExclusiveLock(UnderlyingExclusiveLock *lock)
+{
+    return true;
+}
+
+//
+// set is the futex word; waiters counts the threads that are (or are about to be) parked on it, so that setting it
+// only makes a system call when someone needs waking.  Both sides update one and then read the other with a full
+// barrier in between, so either the setter sees the waiter or the waiter's futex wait sees the word already set.
+//
+class SingleWaiterObjectImpl {
+protected:
+    volatile int set;
+    volatile int waiters;
+
+    void wake(int count) {
+        set = 1;
+        __sync_synchronize();
+        if (waiters > 0) {
+            FutexWake(&set, count);
+        }
+    }
+
+public:
+    bool init() {
+        set = 0;
+        waiters = 0;
+        return true;
+    }
+
+    void reset() {
+        set = 0;
+    }
+
+    void signal() {
+        wake(1);
+    }
+
+    void wait() {
+        for (int i = 0; i < SpinsBeforeParking && !set; i++) {
+            SpinPause();
+        }
+        if (!set) {
+            __sync_fetch_and_add(&waiters, 1);
+            while (!set) {
+                FutexWait(&set, 0, NULL);
+            }
+            __sync_fetch_and_sub(&waiters, 1);
+        }
+        __sync_synchronize();
+    }
+
+    bool waitWithTimeout(_int64 timeoutInMillis) {
+        //
+        // A zero timeout is a poll (the work pool's helpers make lots of them), so it doesn't spin or park.
+        //
+        if (set || timeoutInMillis <= 0) {
+            __sync_synchronize();
+            return set != 0;
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        _int64 deadline = (_int64) now.tv_sec * 1000000000 + now.tv_nsec + timeoutInMillis * 1000000;
+
+        __sync_fetch_and_add(&waiters, 1);
+        while (!set) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            _int64 remaining = deadline - ((_int64) now.tv_sec * 1000000000 + now.tv_nsec);
+            if (remaining <= 0) {
+                break;
+            }
+            struct timespec timeout;
+            timeout.tv_sec = remaining / 1000000000;
+            timeout.tv_nsec = remaining % 1000000000;
+            FutexWait(&set, 0, &timeout);
+        }
+        __sync_fetch_and_sub(&waiters, 1);
+        __sync_synchronize();
+        return set != 0;
+    }
+
+    bool destroy() {
+        return true;
+    }
+};
+
+#else   // __linux__
+
 void AcquireUnderlyingExclusiveLock(UnderlyingExclusiveLock *lock)
 {
     pthread_mutex_lock(lock);
@@ -987,12 +1243,21 @@ public:
         return !timedOut;
     }
 
+    void reset() {
+        pthread_mutex_lock(&lock);
+        set = false;
+        pthread_mutex_unlock(&lock);
+    }
+
     bool destroy() {
         pthread_cond_destroy(&cond);
         pthread_mutex_destroy(&lock);
+        return true;
     }
 };
 
+#endif  // __linux__
+
 bool CreateSingleWaiterObject(SingleWaiterObject *waiter)
 {
     SingleWaiterObjectImpl *obj = new SingleWaiterObjectImpl;
@@ -1026,9 +1291,23 @@ bool WaitForSingleWaiterObject(SingleWaiterObject *waiter)
 
 void ResetSingleWaiterObject(SingleWaiterObject *waiter)
 {
-    (*waiter)->init();
+    (*waiter)->reset();
 }
 
+#ifdef __linux__
+class EventObjectImpl : public SingleWaiterObjectImpl
+{
+public:
+    void signalAll()
+    {
+        wake(INT_MAX);
+    }
+    void blockAll()
+    {
+        set = 0;
+    }
+};
+#else   // __linux__
 class EventObjectImpl : public SingleWaiterObjectImpl
 {
 public:
@@ -1046,6 +1325,7 @@ public:
         pthread_mutex_unlock(&lock);
     }
 };
+#endif  // __linux__
 
 void CreateEventObject(EventObject *newEvent)
 {
@@ -1111,6 +1391,11 @@ _uint64 InterlockedCompareExchange64AndReturnOldValue(volatile _uint64 *valueToU
   return (_uint64) __sync_val_compare_and_swap((volatile _int64 *) valueToUpdate, desiredPreviousValue, replacementValue);
 }
 
+void* InterlockedCompareExchangePointerAndReturnOldValue(volatile void **valueToUpdate, void* replacementValue, void* desiredPreviousValue)
+{
+  return __sync_val_compare_and_swap((void * volatile *) valueToUpdate, desiredPreviousValue, replacementValue);
+}
+
 namespace {
 
 // POSIX thread functions need to return void*, so we wrap the ThreadMainFunction in our API
@@ -1154,6 +1439,118 @@ unsigned GetNumberOfProcessors()
     return (unsigned) sysconf(_SC_NPROCESSORS_ONLN);
 }
 
+_int64 GetMemoryLimit()
+{
+    _int64 limit = (_int64) sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+
+    //
+    // cgroup v2 has "max" when there's no limit, and v1 has a huge number, so either way a limit is only taken if it's a
+    // number and less than the machine's.
+    //
+    const char *limitFiles[] = {"/sys/fs/cgroup/memory.max", "/sys/fs/cgroup/memory/memory.limit_in_bytes"};
+    for (int i = 0; i < sizeof(limitFiles) / sizeof(limitFiles[0]); i++) {
+        FILE *limitFile = fopen(limitFiles[i], "r");
+        if (NULL != limitFile) {
+            long long cgroupLimit;
+            if (1 == fscanf(limitFile, "%lld", &cgroupLimit) && cgroupLimit > 0 && cgroupLimit < limit) {
+                limit = cgroupLimit;
+            }
+            fclose(limitFile);
+        }
+    }
+    return limit;
+}
+
+bool InterleaveMemoryAcrossNumaNodes(bool interleave)
+{
+#if defined(__linux__) && defined(SYS_set_mempolicy)
+    const int MPOL_DEFAULT_POLICY = 0;      // These are from linux/mempolicy.h, which we don't want to depend on
+    const int MPOL_INTERLEAVE_POLICY = 3;
+
+    if (!interleave) {
+        return 0 == syscall(SYS_set_mempolicy, MPOL_DEFAULT_POLICY, NULL, 0);
+    }
+
+    //
+    // Get the online nodes, which the kernel lists as ranges like "0-1,3".
+    //
+    const unsigned maxNodes = 1024;
+    const unsigned bitsPerWord = sizeof(unsigned long) * 8;
+    unsigned long nodeMask[maxNodes / bitsPerWord];
+    memset(nodeMask, 0, sizeof(nodeMask));
+    unsigned nNodes = 0;
+
+    FILE *onlineNodes = fopen("/sys/devices/system/node/online", "r");
+    if (NULL != onlineNodes) {
+        unsigned first, last;
+        while (1 <= fscanf(onlineNodes, "%u", &first)) {
+            last = first;
+            if (1 != fscanf(onlineNodes, "-%u", &last)) {
+                last = first;
+            }
+            for (unsigned node = first; node <= last && node < maxNodes; node++) {
+                nodeMask[node / bitsPerWord] |= 1ul << (node % bitsPerWord);
+                nNodes++;
+            }
+            if (',' != fgetc(onlineNodes)) {
+                break;
+            }
+        }
+        fclose(onlineNodes);
+    }
+
+    if (nNodes < 2) {
+        fprintf(stderr,"This machine has only one NUMA node, so there's nothing to interleave across\n");
+        return false;
+    }
+
+    if (0 != syscall(SYS_set_mempolicy, MPOL_INTERLEAVE_POLICY, nodeMask, maxNodes)) {
+        perror("set_mempolicy");
+        return false;
+    }
+    return true;
+#else   // __linux__ && SYS_set_mempolicy
+    if (interleave) {
+        fprintf(stderr,"Interleaving memory across NUMA nodes isn't supported on this platform\n");
+    }
+    return !interleave;
+#endif  // __linux__ && SYS_set_mempolicy
+}
+
+bool MoveMemoryToNumaNode(void *address, size_t bytes, int node)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+    const int MPOL_BIND_POLICY = 2;         // These are from linux/mempolicy.h too
+    const unsigned MPOL_MF_MOVE_FLAG = 1 << 1;
+    const unsigned maxNodes = 1024;
+    const unsigned bitsPerWord = sizeof(unsigned long) * 8;
+
+    if (node < 0 || (unsigned)node >= maxNodes) {
+        fprintf(stderr,"NUMA node %d is out of range\n", node);
+        return false;
+    }
+    if (0 == bytes) {
+        return true;
+    }
+
+    unsigned long nodeMask[maxNodes / bitsPerWord];
+    memset(nodeMask, 0, sizeof(nodeMask));
+    nodeMask[node / bitsPerWord] |= 1ul << (node % bitsPerWord);
+
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t begin = (size_t)address & ~(pageSize - 1);
+    size_t end = ((size_t)address + bytes + pageSize - 1) & ~(pageSize - 1);
+    if (0 != syscall(SYS_mbind, begin, end - begin, MPOL_BIND_POLICY, nodeMask, maxNodes, MPOL_MF_MOVE_FLAG)) {
+        perror("mbind");
+        return false;
+    }
+    return true;
+#else   // __linux__ && SYS_mbind
+    fprintf(stderr,"Moving memory to a NUMA node isn't supported on this platform\n");
+    return false;
+#endif  // __linux__ && SYS_mbind
+}
+
 void SleepForMillis(unsigned millis)
 {
   usleep(millis*1000);
@@ -1186,6 +1583,57 @@ MoveSingleFile(
     return rename(from, to) == 0;
 }
 
+    void
+GetProcessUsage(
+    ProcessUsage *o_usage)
+{
+    o_usage->residentBytes = o_usage->peakResidentBytes = o_usage->cpuMillis = -1;
+    o_usage->bytesRead = o_usage->bytesWritten = -1;
+    o_usage->storageBytesRead = o_usage->storageBytesWritten = -1;
+
+#ifdef __linux__
+    char line[256];
+    long long value;
+    FILE *status = fopen("/proc/self/status", "r");
+    if (status != NULL) {
+        while (fgets(line, sizeof(line), status) != NULL) {
+            if (sscanf(line, "VmRSS: %lld kB", &value) == 1) {
+                o_usage->residentBytes = value * 1024;
+            } else if (sscanf(line, "VmHWM: %lld kB", &value) == 1) {
+                o_usage->peakResidentBytes = value * 1024;
+            }
+        }
+        fclose(status);
+    }
+    //
+    // Some containers don't let a process read its own io file, in which case the I/O counts just stay unknown.
+    //
+    FILE *io = fopen("/proc/self/io", "r");
+    if (io != NULL) {
+        while (fgets(line, sizeof(line), io) != NULL) {
+            if (sscanf(line, "rchar: %lld", &value) == 1) {
+                o_usage->bytesRead = value;
+            } else if (sscanf(line, "wchar: %lld", &value) == 1) {
+                o_usage->bytesWritten = value;
+            } else if (sscanf(line, "read_bytes: %lld", &value) == 1) {
+                o_usage->storageBytesRead = value;
+            } else if (sscanf(line, "write_bytes: %lld", &value) == 1) {
+                o_usage->storageBytesWritten = value;
+            }
+        }
+        fclose(io);
+    }
+#endif  // __linux__
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifndef __linux__
+        o_usage->peakResidentBytes = usage.ru_maxrss;   // bytes on OS X
+#endif  // __linux__
+        o_usage->cpuMillis = (_int64)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000 +
+            (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000;
+    }
+}
+
 class LargeFileHandle
 {
 public:
@@ -1252,19 +1700,50 @@ OpenMemoryMappedFile(
     size_t length,
     void** o_contents,
     bool write,
-    bool sequential)
+    bool sequential,
+    bool populate,
+    bool hugePages,
+    size_t guardBytes)
 {
     int fd = open(filename, write ? O_CREAT | O_RDWR : O_RDONLY);
     if (fd < 0) {
         warn("OpenMemoryMappedFile %s failed", filename);
         return NULL;
     }
-    // todo: large page support
     size_t page = getpagesize();
     size_t extra = offset % page;
-    void* map = mmap(NULL, length + extra, (write ? PROT_WRITE : 0) | PROT_READ, MAP_PRIVATE, fd, offset - extra);
+    size_t guard = ((guardBytes + page - 1) / page) * page;
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    if (populate) {
+        flags |= MAP_POPULATE;
+    }
+#endif
+
+    void* map;
+    char* reservation = NULL;
+    size_t reservationLength = 0;
+    if (guard > 0) {
+        //
+        // Reserve zero-filled anonymous memory for the contents plus the guard on each side, and then map the file
+        // over the middle of it.  Whatever's left after the end of the file's last page stays anonymous memory.
+        //
+        reservationLength = guard + length + extra + guard;
+        reservation = (char*)mmap(NULL, reservationLength, PROT_READ, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (reservation == MAP_FAILED) {
+            warn("OpenMemoryMappedFile %s reservation failed", filename);
+            close(fd);
+            return NULL;
+        }
+        map = mmap(reservation + guard, length + extra, (write ? PROT_WRITE : 0) | PROT_READ, flags | MAP_FIXED, fd, offset - extra);
+    } else {
+        map = mmap(NULL, length + extra, (write ? PROT_WRITE : 0) | PROT_READ, flags, fd, offset - extra);
+    }
     if (map == NULL || map == MAP_FAILED) {
         warn("OpenMemoryMappedFile %s mmap failed", filename);
+        if (NULL != reservation) {
+            munmap(reservation, reservationLength);
+        }
         close(fd);
         return NULL;
     }
@@ -1272,10 +1751,25 @@ OpenMemoryMappedFile(
     if (e < 0) {
         warn("OpenMemoryMappedFile %s madvise failed", filename);
     }
+#ifndef MAP_POPULATE
+    if (populate && madvise(map, length + extra, MADV_WILLNEED) < 0) {
+        warn("OpenMemoryMappedFile %s madvise(MADV_WILLNEED) failed", filename);
+    }
+#endif
+#ifdef MADV_HUGEPAGE
+    if (hugePages && madvise(map, length + extra, MADV_HUGEPAGE) < 0) {
+        fprintf(stderr, "WARNING: failed to enable huge pages for mapped file %s -- your kernel or file system may not support it\n", filename);
+    }
+#endif
     MemoryMappedFile* result = new MemoryMappedFile();
     result->fd = fd;
-    result->map = map;
-    result->length = length + extra;
+    if (NULL != reservation) {
+        result->map = reservation;
+        result->length = reservationLength;
+    } else {
+        result->map = map;
+        result->length = length + extra;
+    }
     *o_contents = (char*)map + extra;
     return result;
 }
@@ -1289,6 +1783,31 @@ CloseMemoryMappedFile(
     if (e != 0 || e2 != 0) {
         fprintf(stderr, "CloseMemoryMapped file failed\n");
     }
+    delete mappedFile;
+}
+
+    void
+AdviseWillNeed(const void *address, size_t length)
+{
+    static const size_t page = getpagesize();
+    size_t begin = (size_t)address & ~(page - 1);
+    size_t end = ((size_t)address + length + page - 1) & ~(page - 1);
+    madvise((void *)begin, end - begin, MADV_WILLNEED);     // Just a hint, so failure doesn't matter
+}
+
+    bool
+FillMemoryMappedRange(void *address, size_t length, char value)
+{
+    static const size_t page = getpagesize();
+    size_t begin = (size_t)address & ~(page - 1);
+    size_t end = ((size_t)address + length + page - 1) & ~(page - 1);
+    if (0 != mprotect((void *)begin, end - begin, PROT_READ | PROT_WRITE)) {
+        warn("FillMemoryMappedRange: mprotect failed");
+        return false;
+    }
+    memset(address, value, length);
+    mprotect((void *)begin, end - begin, PROT_READ);  // Only to catch stray writes, so failure doesn't matter
+    return true;
 }
 
 #ifdef __linux__
@@ -1314,11 +1833,15 @@ public:
         virtual bool waitForCompletion();
     
     private:
+        void streamOut(size_t offset, size_t length);
+
         PosixAsyncFile*     file;
         bool                writing;
         SingleWaiterObject  ready;
         struct aiocb        aiocb;
         size_t*             result;
+        size_t              writebackOffset;    // the last write, whose writeback streamOut started
+        size_t              writebackLength;
     };
 
     virtual AsyncFile::Writer* getWriter();
@@ -1380,7 +1903,7 @@ PosixAsyncFile::getWriter()
 }
 
 PosixAsyncFile::Writer::Writer(PosixAsyncFile* i_file)
-    : file(i_file), writing(false)
+    : file(i_file), writing(false), writebackOffset(0), writebackLength(0)
 {
     memset(&aiocb, 0, sizeof(aiocb));
     if (! CreateSingleWaiterObject(&ready)) {
@@ -1393,10 +1916,36 @@ PosixAsyncFile::Writer::Writer(PosixAsyncFile* i_file)
 PosixAsyncFile::Writer::close()
 {
     waitForCompletion();
+    if (StreamWrites) {
+        streamOut(0, 0);    // finish off the last one
+    }
     DestroySingleWaiterObject(&ready);
     return true;
 }
 
+//
+// Start writing back a write that's just finished, and wait for the one before it, which has had a whole batch's time
+// to get to disk, so that it can be dropped from the page cache.  (Pages shared with another writer's write at either
+// end are only dropped once they're clean.)  It's all advice, so errors don't matter; a real I/O error shows up when
+// the file's closed.
+//
+    void
+PosixAsyncFile::Writer::streamOut(
+    size_t offset,
+    size_t length)
+{
+    if (length > 0) {
+        sync_file_range(file->fd, offset, length, SYNC_FILE_RANGE_WRITE);
+    }
+    if (writebackLength > 0) {
+        sync_file_range(file->fd, writebackOffset, writebackLength,
+            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(file->fd, writebackOffset, writebackLength, POSIX_FADV_DONTNEED);
+    }
+    writebackOffset = offset;
+    writebackLength = length;
+}
+
     void
 sigev_ready(
     union sigval val)
@@ -1458,6 +2007,9 @@ PosixAsyncFile::Writer::waitForCompletion()
         if (result != NULL) {
             *result = max((ssize_t)0, ret);
         }
+        if (StreamWrites && ret > 0) {
+            streamOut(aiocb.aio_offset, ret);
+        }
     }
     return true;
 }
@@ -1702,6 +2254,15 @@ int _fseek64bit(FILE *stream, _int64 offset, int origin)
 #endif
 }
 
+_int64 _ftell64bit(FILE *stream)
+{
+#ifdef __APPLE__
+    return ftello(stream);
+#else
+    return ftello64(stream);
+#endif
+}
+
 FileMapper::FileMapper()
 {
     fd = -1;
@@ -1809,11 +2370,16 @@ FileMapper::prefetch(size_t currentRead)
 
 #endif  // _MSC_VER
 
+bool AsyncFile::StreamWrites = false;
+
 AsyncFile* AsyncFile::open(const char* filename, bool write)
 {
     if (!strcmp("-", filename) && write) {
         return StdoutAsyncFile::open("-", true);
     }
+    if (GenericFile::IsRemote(filename) && write) {
+        return StdoutAsyncFile::openRemote(filename);
+    }
 #ifdef _MSC_VER
     return WindowsAsyncFile::open(filename, write);
 #else
@@ -1823,4 +2389,23 @@ AsyncFile* AsyncFile::open(const char* filename, bool write)
     return OsxAsyncFile::open(filename, write);
 #endif
 #endif
+}
+
+    const char *
+CpuDispatchLevel()
+{
+#ifdef  SNAP_CPU_DISPATCH_CLONES
+    //
+    // These are the features that decide between the levels, so this is what the loader will have picked.
+    //
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512dq")) {
+        return "AVX-512";
+    } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2") && __builtin_cpu_supports("fma")) {
+        return "AVX2";
+    } else if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt")) {
+        return "SSE4.2";
+    }
+#endif  // SNAP_CPU_DISPATCH_CLONES
+    return "the build's target";
 }
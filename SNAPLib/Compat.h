@@ -135,7 +135,16 @@ inline bool _BitScanForward64(unsigned long *result, _uint64 x) {
 // We implement SingleWaiterObject using a mutex because POSIX unnamed semaphores don't work on OS X
 class SingleWaiterObjectImpl;
 
+#ifdef __linux__
+//
+// On Linux the lock is a futex word (0 free, 1 held, 2 held and maybe waited for) that spins briefly before parking.
+//
+struct UnderlyingExclusiveLock {
+    volatile int state;
+};
+#else   // __linux__
 typedef pthread_mutex_t UnderlyingExclusiveLock;
+#endif  // __linux__
 typedef SingleWaiterObjectImpl *SingleWaiterObject;
 
 class EventObjectImpl;
@@ -303,6 +312,27 @@ void SleepForMillis(unsigned millis);
 
 unsigned GetNumberOfProcessors();
 
+//
+// The most memory this process can use: the machine's physical memory, or less if it's in a container (a cgroup) with a
+// lower limit.
+//
+_int64 GetMemoryLimit();
+
+//
+// Spread the memory that the process allocates or faults in from now on round robin across all of the machine's NUMA
+// nodes, rather than putting it on the node of the thread that first touches it; or, with interleave false, go back to
+// the default.  This is for data like the index that's shared by threads on every node.  Returns false (having printed
+// why) if it couldn't be done.
+//
+bool InterleaveMemoryAcrossNumaNodes(bool interleave);
+
+//
+// Move the pages holding bytes bytes at address to NUMA node node (which may be memory without processors, like a CXL
+// expander), and keep them there.  Pages that are only partly in the range move too.  Returns false (having printed why)
+// if it couldn't be done.
+//
+bool MoveMemoryToNumaNode(void *address, size_t bytes, int node);
+
 _int64 QueryFileSize(const char *fileName);
 
 // returns true on success
@@ -311,6 +341,23 @@ bool DeleteSingleFile(const char* filename); // DeleteFile is a Windows macro...
 // returns true on success
 bool MoveSingleFile(const char* oldFileName, const char* newFileName);
 
+//
+// The process's resident memory, the processor time it has used, and the bytes it has read and written both through
+// system calls and (where the platform keeps track) from and to storage.  Anything the platform doesn't supply is -1.
+//
+struct ProcessUsage
+{
+    _int64 residentBytes;
+    _int64 peakResidentBytes;
+    _int64 cpuMillis;       // user and kernel, on all threads
+    _int64 bytesRead;
+    _int64 bytesWritten;
+    _int64 storageBytesRead;
+    _int64 storageBytesWritten;
+};
+
+void GetProcessUsage(ProcessUsage *o_usage);
+
 class LargeFileHandle;
 
 // open binary file, supports "r" for read, "w" for rewrite/create, "a" for append
@@ -325,14 +372,34 @@ void CloseLargeFile(LargeFileHandle* file);
 
 // open and close memory mapped files
 // currently just readonly, could add flags for r/w if necessary
+//
+// populate reads the whole mapping into memory before returning (MAP_POPULATE on Linux), hugePages asks the OS to back
+// the mapping with huge pages where it's able to, and guardBytes surrounds the mapped contents with at least that much
+// readable, zero-filled address space on either side (for data structures that expect to be able to read a little past
+// their ends).  guardBytes isn't supported on Windows, where the open fails if it's nonzero.
+//
 
 class MemoryMappedFile;
 
-MemoryMappedFile* OpenMemoryMappedFile(const char* filename, size_t offset, size_t length, void** o_contents, bool write = false, bool sequential = false);
+MemoryMappedFile* OpenMemoryMappedFile(const char* filename, size_t offset, size_t length, void** o_contents, bool write = false, bool sequential = false,
+                                       bool populate = false, bool hugePages = false, size_t guardBytes = 0);
 
 // closes and deallocates the file structure
 void CloseMemoryMappedFile(MemoryMappedFile* mappedFile);
 
+//
+// Starts reading in the pages of a memory mapped file that hold this range, without waiting for them, so that several
+// page faults can overlap rather than each one stalling in turn.  Only a hint; it does nothing on Windows.
+//
+void AdviseWillNeed(const void *address, size_t length);
+
+//
+// Sets length bytes at address, which is in (or in the guard around) a read-only OpenMemoryMappedFile mapping, to value.
+// The mapping is private, so only the pages it touches are copied, and the file itself isn't changed.  Returns false if
+// it can't, which is always on Windows (where there's no guard to write into either).
+//
+bool FillMemoryMappedRange(void *address, size_t length, char value);
+
 class AsyncFile
 {
 public:
@@ -343,10 +410,14 @@ public:
     // free resources; must have destroyed all readers & writers first
     virtual bool close() = 0;
 
+    virtual ~AsyncFile() {}
+
     // abstract class for asynchronous writes
     class Writer
     {
     public:
+        virtual ~Writer() {}
+
         // waits for all writes to complete, frees resources
         virtual bool close() = 0;
 
@@ -364,6 +435,8 @@ public:
     class Reader
     {
     public:
+        virtual ~Reader() {}
+
         // waits for alls reads to complete, frees resources
         virtual bool close() = 0;
 
@@ -376,6 +449,12 @@ public:
 
     // get a new reader, e.g. for another thread to use
     virtual Reader* getReader() = 0;
+
+    //
+    // Push what's written out to disk as it goes and drop it from the page cache once it's there, rather than leaving
+    // the kernel to write it back in bursts and letting it push out the (memory mapped) index.  Linux only.
+    //
+    static bool StreamWrites;
 };
 
 
@@ -393,10 +472,40 @@ public:
 #endif
 
 //
-// 64 bit version of fseek.
+// SNAP_CPU_DISPATCH on a function definition builds it for each x86-64 level (SSE4.2 and POPCNT, AVX2 and BMI2, and
+// AVX-512) as well as for the build's target, and the loader picks the best one the processor has when the program
+// starts.  That way one binary gets the newer instructions on the machines that have them and still runs on the ones
+// that don't.  Everything the function inlines is built for each level too, so it belongs on the hot functions that do
+// a lot of work per call (calls to them are indirect) rather than the little ones they inline.
+//
+// It needs gcc's ifunc support, so it's only on Linux; elsewhere the functions are just built for the target.  Code in
+// them can't use #ifdef __AVX2__ and the like to find out which level it's being built for, since those describe the
+// build's target; see LVCountMatchingBases for how to write code that gets better with the level.
+//
+#if     defined(__GNUC__) && !defined(__clang__) && defined(__linux__) && defined(__x86_64__) && !defined(SNAP_NO_CPU_DISPATCH)
+#if     __GNUC__ >= 11
+#define SNAP_CPU_DISPATCH __attribute__((target_clones("arch=x86-64-v4", "arch=x86-64-v3", "arch=x86-64-v2", "default")))
+#define SNAP_CPU_DISPATCH_CLONES 1
+#elif   __GNUC__ >= 6
+#define SNAP_CPU_DISPATCH __attribute__((target_clones("avx512bw", "avx2", "sse4.2", "default")))
+#define SNAP_CPU_DISPATCH_CLONES 1
+#endif
+#endif
+#ifndef SNAP_CPU_DISPATCH_CLONES
+#define SNAP_CPU_DISPATCH   /* nothing */
+#endif
+
+//
+// The level that SNAP_CPU_DISPATCH functions run at on this processor, for messages.
+//
+const char *CpuDispatchLevel();
+
+//
+// 64 bit versions of fseek and ftell.
 //
 
 int _fseek64bit(FILE *stream, _int64 offset, int origin);
+_int64 _ftell64bit(FILE *stream);
 
 #ifndef _MSC_VER
 
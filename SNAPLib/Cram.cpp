@@ -0,0 +1,642 @@
+/*++
+
+Module Name:
+
+    Cram.cpp
+
+Abstract:
+
+    Shared pieces of the CRAM 3.0 writer and reader: the integer encodings, block and container framing, the
+    reference lookups and the block codecs.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "Cram.h"
+#include "Bam.h"
+#include "Genome.h"
+#include "exit.h"
+#include "zlib.h"
+
+using std::min;
+
+const char* Cram::DataSeriesKeys[Cram::NumDataSeries] = {
+    "BF", "CF", "RI", "RL", "AP", "RG", "RN", "MF", "NS", "NP", "TS", "NF", "TL", "FN", "FC", "FP", "DL", "BB", "QQ", "BS",
+    "IN", "RS", "PD", "HC", "SC", "MQ", "BA", "QS"
+};
+
+const _uint8 Cram::FileMagic[4] = {'C', 'R', 'A', 'M'};
+
+//
+// The end of file container CRAM 3.0 requires: no records, and a compression header block with three empty maps.
+//
+const _uint8 Cram::EofContainer[38] = {
+    0x0f, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0x0f, 0xe0, 0x45, 0x4f, 0x46, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00,
+    0x05, 0xbd, 0xd9, 0x4f, 0x00, 0x01, 0x00, 0x06, 0x06, 0x01, 0x00, 0x01, 0x00, 0x01, 0x00, 0xee, 0x63, 0x01, 0x4b
+};
+
+// each reference base's four substitutes take codes 0-3 in ACGTN order
+const _uint8 Cram::SubstitutionMatrix[5] = {0x1b, 0x1b, 0x1b, 0x1b, 0x1b};
+
+    void
+CramBuffer::grow(
+    size_t needed)
+{
+    size_t newSize = max(needed, max((size_t) 4096, size * 2));
+    _uint8* newData = (_uint8*) realloc(data, newSize);
+    if (newData == NULL) {
+        fprintf(stderr, "Unable to allocate %lld bytes for CRAM buffer\n", (_int64) newSize);
+        soft_exit(1);
+    }
+    data = newData;
+    size = newSize;
+}
+
+    void
+CramBuffer::putITF8(
+    _int32 value)
+{
+    _uint32 v = (_uint32) value;
+    _uint8* p = reserve(5);
+    if (v < 0x80) {
+        p[0] = (_uint8) v;
+        used += 1;
+    } else if (v < 0x4000) {
+        p[0] = (_uint8) ((v >> 8) | 0x80);
+        p[1] = (_uint8) v;
+        used += 2;
+    } else if (v < 0x200000) {
+        p[0] = (_uint8) ((v >> 16) | 0xc0);
+        p[1] = (_uint8) (v >> 8);
+        p[2] = (_uint8) v;
+        used += 3;
+    } else if (v < 0x10000000) {
+        p[0] = (_uint8) ((v >> 24) | 0xe0);
+        p[1] = (_uint8) (v >> 16);
+        p[2] = (_uint8) (v >> 8);
+        p[3] = (_uint8) v;
+        used += 4;
+    } else {
+        p[0] = (_uint8) (0xf0 | ((v >> 28) & 0x0f));
+        p[1] = (_uint8) (v >> 20);
+        p[2] = (_uint8) (v >> 12);
+        p[3] = (_uint8) (v >> 4);
+        p[4] = (_uint8) (v & 0x0f);
+        used += 5;
+    }
+}
+
+    void
+CramBuffer::putLTF8(
+    _int64 value)
+{
+    _uint64 v = (_uint64) value;
+    //
+    // The number of leading 1 bits in the first byte is the number of bytes that follow; what's left of the first byte
+    // holds the top bits.
+    //
+    int extra;
+    if (v < 0x80) {
+        extra = 0;
+    } else if (v < 0x4000) {
+        extra = 1;
+    } else if (v < 0x200000) {
+        extra = 2;
+    } else if (v < 0x10000000) {
+        extra = 3;
+    } else if (v < 0x800000000ULL) {
+        extra = 4;
+    } else if (v < 0x40000000000ULL) {
+        extra = 5;
+    } else if (v < 0x2000000000000ULL) {
+        extra = 6;
+    } else if (v < 0x100000000000000ULL) {
+        extra = 7;
+    } else {
+        extra = 8;
+    }
+    _uint8* p = reserve(9);
+    _uint8 prefix = (_uint8) (0xff00 >> extra);
+    p[0] = extra == 8 ? 0xff : (_uint8) (prefix | (extra == 7 ? 0 : (v >> (8 * extra))));
+    for (int i = 1; i <= extra; i++) {
+        p[i] = (_uint8) (v >> (8 * (extra - i)));
+    }
+    used += 1 + extra;
+}
+
+    _int32
+CramCursor::getInt32()
+{
+    const _uint8* b = getBytes(4);
+    if (b == NULL) {
+        return 0;
+    }
+    return (_int32) (b[0] | (b[1] << 8) | (b[2] << 16) | ((_uint32) b[3] << 24));
+}
+
+    _int32
+CramCursor::getITF8()
+{
+    _uint32 b0 = getByte();
+    if ((b0 & 0x80) == 0) {
+        return (_int32) b0;
+    }
+    if ((b0 & 0x40) == 0) {
+        return (_int32) (((b0 & 0x3f) << 8) | getByte());
+    }
+    if ((b0 & 0x20) == 0) {
+        _uint32 v = (b0 & 0x1f) << 16;
+        v |= getByte() << 8;
+        return (_int32) (v | getByte());
+    }
+    if ((b0 & 0x10) == 0) {
+        _uint32 v = (b0 & 0x0f) << 24;
+        v |= getByte() << 16;
+        v |= getByte() << 8;
+        return (_int32) (v | getByte());
+    }
+    _uint32 v = (b0 & 0x0f) << 28;
+    v |= getByte() << 20;
+    v |= getByte() << 12;
+    v |= getByte() << 4;
+    return (_int32) (v | (getByte() & 0x0f));
+}
+
+    _int64
+CramCursor::getLTF8()
+{
+    _uint8 b0 = getByte();
+    int extra = 0;
+    while (extra < 8 && (b0 & (0x80 >> extra))) {
+        extra++;
+    }
+    _uint64 v = extra >= 7 ? 0 : (b0 & (0x7f >> extra));
+    for (int i = 0; i < extra; i++) {
+        v = (v << 8) | getByte();
+    }
+    return (_int64) v;
+}
+
+    void
+Cram::putContainerHeader(
+    CramBuffer* out,
+    const ContainerHeader& header,
+    const _int32* landmarks)
+{
+    size_t start = out->used;
+    out->putInt32(header.length);
+    out->putITF8(header.refId);
+    out->putITF8(header.start);
+    out->putITF8(header.span);
+    out->putITF8(header.nRecords);
+    out->putLTF8(header.recordCounter);
+    out->putLTF8(header.bases);
+    out->putITF8(header.nBlocks);
+    out->putITF8(header.nLandmarks);
+    for (int i = 0; i < header.nLandmarks; i++) {
+        out->putITF8(landmarks[i]);
+    }
+    out->putInt32((_int32) crc32(crc32(0, NULL, 0), out->data + start, (uInt) (out->used - start)));
+}
+
+    bool
+Cram::getContainerHeader(
+    CramCursor* in,
+    ContainerHeader* o_header)
+{
+    const _uint8* start = in->p;
+    o_header->length = in->getInt32();
+    o_header->refId = in->getITF8();
+    o_header->start = in->getITF8();
+    o_header->span = in->getITF8();
+    o_header->nRecords = in->getITF8();
+    o_header->recordCounter = in->getLTF8();
+    o_header->bases = in->getLTF8();
+    o_header->nBlocks = in->getITF8();
+    o_header->nLandmarks = in->getITF8();
+    o_header->landmarks = in->p;
+    for (int i = 0; i < o_header->nLandmarks && in->ok; i++) {
+        in->getITF8();
+    }
+    _uint32 crc = (_uint32) crc32(crc32(0, NULL, 0), start, (uInt) (in->p - start));
+    return in->ok && o_header->length >= 0 && o_header->nLandmarks >= 0 && (_uint32) in->getInt32() == crc && in->ok;
+}
+
+    void
+Cram::putBlock(
+    CramBuffer* out,
+    int method,
+    int contentType,
+    int contentId,
+    const void* data,
+    size_t compressedBytes,
+    size_t rawBytes)
+{
+    size_t start = out->used;
+    out->putByte((_uint8) method);
+    out->putByte((_uint8) contentType);
+    out->putITF8(contentId);
+    out->putITF8((_int32) compressedBytes);
+    out->putITF8((_int32) rawBytes);
+    out->append(data, compressedBytes);
+    out->putInt32((_int32) crc32(crc32(0, NULL, 0), out->data + start, (uInt) (out->used - start)));
+}
+
+    bool
+Cram::getBlock(
+    CramCursor* in,
+    Block* o_block)
+{
+    const _uint8* start = in->p;
+    o_block->method = in->getByte();
+    o_block->contentType = in->getByte();
+    o_block->contentId = in->getITF8();
+    _int32 compressedBytes = in->getITF8();
+    _int32 rawBytes = in->getITF8();
+    if (! in->ok || compressedBytes < 0 || rawBytes < 0) {
+        return false;
+    }
+    o_block->compressedBytes = compressedBytes;
+    o_block->rawBytes = rawBytes;
+    o_block->data = in->getBytes(compressedBytes);
+    if (! in->ok) {
+        return false;
+    }
+    _uint32 crc = (_uint32) crc32(crc32(0, NULL, 0), start, (uInt) (in->p - start));
+    return (_uint32) in->getInt32() == crc && in->ok;
+}
+
+//
+// rANS 4x8, the entropy coder htslib uses for CRAM 3.0 qualities and names by default: four interleaved states over
+// 12 bit frequencies, order 0 or with the previous symbol as context.  The frequency tables are run length encoded on
+// symbol number.
+//
+static const int RansFrequencyBits = 12;
+static const _uint32 RansLowerBound = 1 << 23;
+
+struct RansSymbol
+{
+    _uint16 freq;
+    _uint16 start;
+};
+
+    static bool
+ReadRansFrequencies(
+    CramCursor* in,
+    RansSymbol* symbols,    // [256]
+    _uint8* lookup)         // [1 << RansFrequencyBits]
+{
+    int j = in->getByte();
+    int x = 0;
+    int rle = 0;
+    do {
+        int f = in->getByte();
+        if (f >= 128) {
+            f = ((f & 0x7f) << 8) | in->getByte();
+        }
+        if (j > 255 || x + f > (1 << RansFrequencyBits)) {
+            return false;
+        }
+        symbols[j].freq = (_uint16) f;
+        symbols[j].start = (_uint16) x;
+        memset(lookup + x, j, f);
+        x += f;
+        if (rle == 0 && in->remaining() > 0 && *in->p == j + 1) {
+            j = in->getByte();
+            rle = in->getByte();
+        } else if (rle > 0) {
+            rle--;
+            j++;
+        } else {
+            j = in->getByte();
+        }
+    } while (j != 0 && in->ok);
+    return in->ok;
+}
+
+    static inline _uint8
+RansDecode(
+    _uint32* state,
+    const RansSymbol* symbols,
+    const _uint8* lookup,
+    CramCursor* in)
+{
+    _uint32 m = *state & ((1 << RansFrequencyBits) - 1);
+    _uint8 c = lookup[m];
+    *state = symbols[c].freq * (*state >> RansFrequencyBits) + m - symbols[c].start;
+    while (*state < RansLowerBound && in->remaining() > 0) {
+        *state = (*state << 8) | in->getByte();
+    }
+    return c;
+}
+
+    static bool
+RansUncompress(
+    const _uint8* data,
+    size_t bytes,
+    _uint8* out,
+    size_t outBytes)
+{
+    CramCursor in(data, bytes);
+    int order = in.getByte();
+    _uint32 compressedBytes = (_uint32) in.getInt32();
+    _uint32 rawBytes = (_uint32) in.getInt32();
+    if (! in.ok || rawBytes != outBytes || compressedBytes > in.remaining() || order > 1) {
+        return false;
+    }
+    if (rawBytes == 0) {
+        return true;
+    }
+
+    _uint32 state[4];
+    if (order == 0) {
+        RansSymbol symbols[256];
+        _uint8 lookup[1 << RansFrequencyBits];
+        memset(symbols, 0, sizeof(symbols));
+        memset(lookup, 0, sizeof(lookup));
+        if (! ReadRansFrequencies(&in, symbols, lookup)) {
+            return false;
+        }
+        for (int k = 0; k < 4; k++) {
+            state[k] = (_uint32) in.getInt32();
+        }
+        size_t i = 0;
+        for (; i + 4 <= outBytes; i += 4) {
+            for (int k = 0; k < 4; k++) {
+                out[i + k] = RansDecode(&state[k], symbols, lookup, &in);
+            }
+        }
+        for (int k = 0; i + k < outBytes; k++) {
+            out[i + k] = RansDecode(&state[k], symbols, lookup, &in);
+        }
+        return in.ok;
+    }
+
+    RansSymbol* symbols = (RansSymbol*) calloc(256 * 256, sizeof(RansSymbol));
+    _uint8* lookup = (_uint8*) calloc(256, 1 << RansFrequencyBits);
+    if (symbols == NULL || lookup == NULL) {
+        fprintf(stderr, "Unable to allocate rANS tables\n");
+        soft_exit(1);
+    }
+    bool ok = true;
+    int context = in.getByte();
+    int rle = 0;
+    do {
+        ok = context <= 255 && ReadRansFrequencies(&in, symbols + 256 * context, lookup + (context << RansFrequencyBits));
+        if (rle == 0 && in.remaining() > 0 && *in.p == context + 1) {
+            context = in.getByte();
+            rle = in.getByte();
+        } else if (rle > 0) {
+            rle--;
+            context++;
+        } else {
+            context = in.getByte();
+        }
+    } while (ok && context != 0 && in.ok);
+
+    if (ok) {
+        for (int k = 0; k < 4; k++) {
+            state[k] = (_uint32) in.getInt32();
+        }
+        //
+        // Each state decodes its own quarter of the output, and the last one the remainder too.
+        //
+        size_t quarter = outBytes / 4;
+        _uint8 last[4] = {0, 0, 0, 0};
+        for (size_t i = 0; i < quarter; i++) {
+            for (int k = 0; k < 4; k++) {
+                last[k] = out[i + k * quarter] = RansDecode(&state[k], symbols + 256 * last[k], lookup + (last[k] << RansFrequencyBits), &in);
+            }
+        }
+        for (size_t i = 4 * quarter; i < outBytes; i++) {
+            last[3] = out[i] = RansDecode(&state[3], symbols + 256 * last[3], lookup + (last[3] << RansFrequencyBits), &in);
+        }
+    }
+    free(symbols);
+    free(lookup);
+    return ok && in.ok;
+}
+
+    bool
+Cram::uncompressBlock(
+    const Block& block,
+    CramBuffer* out)
+{
+    out->clear();
+    _uint8* to = out->reserve(block.rawBytes + 1);  // + 1 so that empty blocks still have a buffer
+    switch (block.method) {
+    case RawMethod:
+        if (block.compressedBytes != block.rawBytes) {
+            return false;
+        }
+        memcpy(to, block.data, block.rawBytes);
+        break;
+
+    case GzipMethod:
+    {
+        z_stream zstream;
+        memset(&zstream, 0, sizeof(zstream));
+        if (inflateInit2(&zstream, 15 + 32) != Z_OK) { // gzip or zlib header
+            return false;
+        }
+        zstream.next_in = (Bytef*) block.data;
+        zstream.avail_in = (uInt) block.compressedBytes;
+        zstream.next_out = to;
+        zstream.avail_out = (uInt) block.rawBytes;
+        int status = inflate(&zstream, Z_FINISH);
+        bool ok = status == Z_STREAM_END && zstream.total_out == block.rawBytes;
+        inflateEnd(&zstream);
+        if (! ok) {
+            return false;
+        }
+        break;
+    }
+
+    case Rans4x8Method:
+        if (! RansUncompress(block.data, block.compressedBytes, to, block.rawBytes)) {
+            return false;
+        }
+        break;
+
+    default:
+        fprintf(stderr, "CRAM block compression method %d (bzip2 or lzma) isn't supported\n", block.method);
+        soft_exit(1);
+    }
+    out->used = block.rawBytes;
+    return true;
+}
+
+    _int64
+Cram::ContigLength(
+    const Genome* genome,
+    int contig)
+{
+    const Genome::Contig* contigs = genome->getContigs();
+    GenomeLocation end = contig + 1 < genome->getNumContigs() ? contigs[contig + 1].beginningOffset : genome->getCountOfBases();
+    return (_int64) (end - contigs[contig].beginningOffset) - genome->getChromosomePadding();
+}
+
+    _int64
+Cram::CopyReference(
+    const Genome* genome,
+    int contig,
+    _int64 pos,
+    _int64 length,
+    char* o_bases)
+{
+    _int64 contigLength = ContigLength(genome, contig);
+    if (pos < 0 || pos >= contigLength) {
+        return 0;
+    }
+    length = min(length, contigLength - pos);
+
+    //
+    // getSubstring won't hand out a piece that crosses the end of a contig, so go a padding's worth at a time, which it
+    // always will.
+    //
+    size_t piece = max((size_t) 1, min((size_t) 4096, (size_t) genome->getChromosomePadding()));
+    char unpackBuffer[4096];
+    GenomeLocation base = genome->getContigs()[contig].beginningOffset + pos;
+    for (_int64 done = 0; done < length; ) {
+        size_t n = (size_t) min((_int64) piece, length - done);
+        const char* bases = genome->getSubstring(base + done, n, unpackBuffer, n);
+        if (bases == NULL) {
+            return done;
+        }
+        for (size_t i = 0; i < n; i++) {
+            o_bases[done + i] = bases[i] & ~0x20;    // upper case
+        }
+        done += n;
+    }
+    return length;
+}
+
+    int
+Cram::ReferenceLength(
+    BAMAlignment* bam)
+{
+    int length = 0;
+    _uint32* cigar = bam->cigar();
+    for (int i = 0; i < bam->n_cigar_op; i++) {
+        int op = BAMAlignment::GetCigarOpCode(cigar[i]);
+        if (op == 0 || op == 2 || op == 3 || op == 7 || op == 8) {
+            length += BAMAlignment::GetCigarOpCount(cigar[i]);
+        }
+    }
+    return length;
+}
+
+//
+// MD5 (RFC 1321).
+//
+static const _uint32 Md5Shift[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+static const _uint32 Md5Sine[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+Cram::Md5::Md5()
+    : bytes(0)
+{
+    state[0] = 0x67452301;
+    state[1] = 0xefcdab89;
+    state[2] = 0x98badcfe;
+    state[3] = 0x10325476;
+}
+
+    void
+Cram::Md5::transform(
+    const _uint8* block)
+{
+    _uint32 m[16];
+    for (int i = 0; i < 16; i++) {
+        m[i] = block[4 * i] | (block[4 * i + 1] << 8) | (block[4 * i + 2] << 16) | ((_uint32) block[4 * i + 3] << 24);
+    }
+    _uint32 a = state[0], b = state[1], c = state[2], d = state[3];
+    for (int i = 0; i < 64; i++) {
+        _uint32 f;
+        int g;
+        if (i < 16) {
+            f = (b & c) | (~b & d);
+            g = i;
+        } else if (i < 32) {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) & 15;
+        } else if (i < 48) {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) & 15;
+        } else {
+            f = c ^ (b | ~d);
+            g = (7 * i) & 15;
+        }
+        _uint32 rotated = a + f + Md5Sine[i] + m[g];
+        a = d;
+        d = c;
+        c = b;
+        b += (rotated << Md5Shift[i]) | (rotated >> (32 - Md5Shift[i]));
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+    void
+Cram::Md5::update(
+    const void* data,
+    size_t count)
+{
+    const _uint8* p = (const _uint8*) data;
+    size_t buffered = (size_t) (bytes & 63);
+    bytes += count;
+    if (buffered > 0) {
+        size_t n = min(count, 64 - buffered);
+        memcpy(buffer + buffered, p, n);
+        p += n;
+        count -= n;
+        if (buffered + n < 64) {
+            return;
+        }
+        transform(buffer);
+    }
+    for (; count >= 64; p += 64, count -= 64) {
+        transform(p);
+    }
+    memcpy(buffer, p, count);
+}
+
+    void
+Cram::Md5::final(
+    _uint8 o_digest[16])
+{
+    _uint64 bits = bytes * 8;
+    static const _uint8 padding[64] = {0x80};
+    size_t buffered = (size_t) (bytes & 63);
+    update(padding, buffered < 56 ? 56 - buffered : 120 - buffered);
+    _uint8 length[8];
+    for (int i = 0; i < 8; i++) {
+        length[i] = (_uint8) (bits >> (8 * i));
+    }
+    update(length, 8);
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 4; j++) {
+            o_digest[4 * i + j] = (_uint8) (state[i] >> (8 * j));
+        }
+    }
+}
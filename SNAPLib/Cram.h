@@ -0,0 +1,246 @@
+/*++
+
+Module Name:
+
+    Cram.h
+
+Abstract:
+
+    Shared pieces of the CRAM 3.0 writer and reader: the integer encodings, block and container framing, the
+    reference lookups and the block codecs.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+
+class Genome;
+struct BAMAlignment;
+
+//
+// A growable byte buffer the CRAM structures are assembled in.  Pointers into it are good only until it next grows.
+//
+class CramBuffer
+{
+public:
+    CramBuffer() : data(NULL), used(0), size(0) {}
+
+    ~CramBuffer() { free(data); }
+
+    void clear() { used = 0; }
+
+    // make room for bytes more, and return where they go
+    _uint8* reserve(size_t bytes)
+    {
+        if (used + bytes > size) {
+            grow(used + bytes);
+        }
+        return data + used;
+    }
+
+    void append(const void* bytes, size_t count)
+    {
+        memcpy(reserve(count), bytes, count);
+        used += count;
+    }
+
+    void putByte(_uint8 value)
+    {
+        *reserve(1) = value;
+        used++;
+    }
+
+    void putInt32(_int32 value)
+    {
+        _uint8* p = reserve(4);
+        p[0] = (_uint8) value; p[1] = (_uint8) (value >> 8); p[2] = (_uint8) (value >> 16); p[3] = (_uint8) (value >> 24);
+        used += 4;
+    }
+
+    void putITF8(_int32 value);
+
+    void putLTF8(_int64 value);
+
+    _uint8* data;
+    size_t used;
+    size_t size;
+
+private:
+    void grow(size_t needed);
+};
+
+//
+// Reads the same encodings back out of a buffer.  Running off the end sets ok to false and returns zeroes, so callers
+// can check once after a whole structure.
+//
+struct CramCursor
+{
+    CramCursor() : p(NULL), end(NULL), ok(true) {}
+
+    CramCursor(const _uint8* i_p, size_t bytes) : p(i_p), end(i_p + bytes), ok(true) {}
+
+    _uint8 getByte()
+    {
+        if (p >= end) {
+            ok = false;
+            return 0;
+        }
+        return *p++;
+    }
+
+    _int32 getInt32();
+
+    _int32 getITF8();
+
+    _int64 getLTF8();
+
+    const _uint8* getBytes(size_t count)
+    {
+        if ((size_t) (end - p) < count) {
+            ok = false;
+            p = end;
+            return NULL;
+        }
+        const _uint8* result = p;
+        p += count;
+        return result;
+    }
+
+    size_t remaining() const { return end - p; }
+
+    const _uint8* p;
+    const _uint8* end;
+    bool ok;
+};
+
+class Cram
+{
+public:
+    enum BlockMethod { RawMethod = 0, GzipMethod = 1, Bzip2Method = 2, LzmaMethod = 3, Rans4x8Method = 4 };
+
+    enum ContentType { FileHeaderContent = 0, CompressionHeaderContent = 1, SliceHeaderContent = 2, ExternalContent = 4, CoreContent = 5 };
+
+    enum EncodingId { NullEncoding = 0, ExternalEncoding = 1, HuffmanEncoding = 3, ByteArrayLenEncoding = 4, ByteArrayStopEncoding = 5,
+        BetaEncoding = 6, SubexpEncoding = 7, GammaEncoding = 9 };
+
+    // CF, the per-record compression flags
+    static const int QualityAsArray = 1;
+    static const int Detached = 2;
+    static const int MateDownstream = 4;
+    static const int UnknownBases = 8;
+
+    // MF, the mate flags of a detached record
+    static const int MateReverse = 1;
+    static const int MateUnmapped = 2;
+
+    // container reference ids for containers of unmapped reads, and of reads on several references
+    static const int UnmappedRef = -1;
+    static const int MultipleRefs = -2;
+
+    //
+    // The record data series, in the order their keys are listed in DataSeriesKeys.  The writer puts each of them in its
+    // own external block, whose content id is the series plus one.
+    //
+    enum DataSeries { BF, CF, RI, RL, AP, RG, RN, MF, NS, NP, TS, NF, TL, FN, FC, FP, DL, BB, QQ, BS, IN, RS, PD, HC, SC,
+        MQ, BA, QS, NumDataSeries };
+
+    static const char* DataSeriesKeys[NumDataSeries];
+
+    static const _uint8 FileMagic[4];
+
+    static const _uint8 EofContainer[38];
+
+    //
+    // A container header.  length is the bytes of blocks that follow it; getContainerHeader checks the CRC.
+    //
+    struct ContainerHeader
+    {
+        _int32 length;
+        _int32 refId;
+        _int32 start;
+        _int32 span;
+        _int32 nRecords;
+        _int64 recordCounter;
+        _int64 bases;
+        _int32 nBlocks;
+        _int32 nLandmarks;
+        const _uint8* landmarks;    // ITF8s, in the cursor's buffer
+    };
+
+    static void putContainerHeader(CramBuffer* out, const ContainerHeader& header, const _int32* landmarks);
+
+    static bool getContainerHeader(CramCursor* in, ContainerHeader* o_header);
+
+    //
+    // A block with its CRC.  The writer compresses with gzip when that's smaller.
+    //
+    static void putBlock(CramBuffer* out, int method, int contentType, int contentId, const void* data, size_t compressedBytes, size_t rawBytes);
+
+    struct Block
+    {
+        int method;
+        int contentType;
+        int contentId;
+        const _uint8* data;
+        size_t compressedBytes;
+        size_t rawBytes;
+    };
+
+    static bool getBlock(CramCursor* in, Block* o_block);
+
+    // uncompress into out (replacing what's there); the method has to be raw, gzip or rANS
+    static bool uncompressBlock(const Block& block, CramBuffer* out);
+
+    //
+    // The 5 byte substitution matrix the writer uses, which codes the other bases in ACGTN order for each reference base.
+    //
+    static const _uint8 SubstitutionMatrix[5];
+
+    static int BaseIndex(char base)     // 0-4 for ACGTN, -1 for anything else
+    {
+        switch (base) {
+        case 'A': return 0;
+        case 'C': return 1;
+        case 'G': return 2;
+        case 'T': return 3;
+        case 'N': return 4;
+        default: return -1;
+        }
+    }
+
+    //
+    // Reference lookups by contig index; a contig's length is without the padding at its end.  CopyReference
+    // upper-cases the bases and stops at the end of the contig, returning how many it copied.
+    //
+    static _int64 ContigLength(const Genome* genome, int contig);
+
+    static _int64 CopyReference(const Genome* genome, int contig, _int64 pos, _int64 length, char* o_bases);
+
+    // the number of reference bases a BAM record's CIGAR covers (M, D, N, = and X)
+    static int ReferenceLength(BAMAlignment* bam);
+
+    //
+    // MD5, as the @SQ M5 tag and the slice header use.
+    //
+    class Md5
+    {
+    public:
+        Md5();
+
+        void update(const void* data, size_t bytes);
+
+        void final(_uint8 o_digest[16]);
+
+    private:
+        void transform(const _uint8* block);
+
+        _uint32 state[4];
+        _uint64 bytes;
+        _uint8 buffer[64];
+    };
+};
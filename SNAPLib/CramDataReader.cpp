@@ -0,0 +1,1508 @@
+/*++
+
+Module Name:
+
+    CramDataReader.cpp
+
+Abstract:
+
+    CRAM 3.0 input.  The reader decodes each container against the genome into BAM records, behind a BAM header made
+    from the CRAM one, so that BAMReader reads it like any other BAM file.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "Cram.h"
+#include "Bam.h"
+#include "DataReader.h"
+#include "GenericFile.h"
+#include "Genome.h"
+#include "Read.h"
+#include "VariableSizeVector.h"
+#include "exit.h"
+
+using std::max;
+using std::min;
+
+//
+// One data series' (or tag's) encoding, from a compression header.
+//
+struct CramEncoding
+{
+    CramEncoding()
+        : codec(Cram::NullEncoding), contentId(-1), stop(0), offset(0), parameter(0), nCodes(0),
+          symbols(NULL), lengths(NULL), codes(NULL), lengthEncoding(NULL), valueEncoding(NULL)
+    {}
+
+    ~CramEncoding() { clear(); }
+
+    void clear();
+
+    // the codec id and its parameters; codecs we don't know are kept by id, and only fail if they're used
+    bool parse(CramCursor* in);
+
+    int codec;
+    int contentId;      // external block, for EXTERNAL and BYTE_ARRAY_STOP
+    _uint8 stop;
+    _int32 offset;
+    _int32 parameter;   // bits for BETA, k for SUBEXP
+
+    // canonical Huffman codes, in order of length and then symbol
+    int nCodes;
+    _int32* symbols;
+    int* lengths;
+    _uint32* codes;
+
+    // BYTE_ARRAY_LEN
+    CramEncoding* lengthEncoding;
+    CramEncoding* valueEncoding;
+};
+
+    void
+CramEncoding::clear()
+{
+    delete [] symbols;
+    delete [] lengths;
+    delete [] codes;
+    delete lengthEncoding;
+    delete valueEncoding;
+    symbols = NULL;
+    lengths = NULL;
+    codes = NULL;
+    lengthEncoding = NULL;
+    valueEncoding = NULL;
+    nCodes = 0;
+    codec = Cram::NullEncoding;
+}
+
+    bool
+CramEncoding::parse(
+    CramCursor* in)
+{
+    clear();
+    codec = in->getITF8();
+    _int32 bytes = in->getITF8();
+    const _uint8* data = in->getBytes(max(0, bytes));
+    if (! in->ok) {
+        return false;
+    }
+    CramCursor params(data, bytes);
+    switch (codec) {
+    case Cram::ExternalEncoding:
+        contentId = params.getITF8();
+        break;
+
+    case Cram::HuffmanEncoding:
+    {
+        nCodes = params.getITF8();
+        if (nCodes < 0 || nCodes > (int) params.remaining()) {
+            return false;
+        }
+        symbols = new _int32[nCodes];
+        lengths = new int[nCodes];
+        codes = new _uint32[nCodes];
+        for (int i = 0; i < nCodes; i++) {
+            symbols[i] = params.getITF8();
+        }
+        if (params.getITF8() != nCodes) {
+            return false;
+        }
+        for (int i = 0; i < nCodes; i++) {
+            lengths[i] = params.getITF8();
+            if (lengths[i] < 0 || lengths[i] > 31) {
+                return false;
+            }
+        }
+        //
+        // Order by length, then symbol, and hand out the codes counting up.
+        //
+        for (int i = 1; i < nCodes; i++) {
+            for (int j = i; j > 0 && (lengths[j] < lengths[j - 1] || (lengths[j] == lengths[j - 1] && symbols[j] < symbols[j - 1])); j--) {
+                std::swap(lengths[j], lengths[j - 1]);
+                std::swap(symbols[j], symbols[j - 1]);
+            }
+        }
+        _uint32 code = 0;
+        for (int i = 0; i < nCodes; i++) {
+            if (i > 0) {
+                code = (code + 1) << (lengths[i] - lengths[i - 1]);
+            }
+            codes[i] = code;
+        }
+        break;
+    }
+
+    case Cram::ByteArrayLenEncoding:
+        lengthEncoding = new CramEncoding();
+        valueEncoding = new CramEncoding();
+        if (! (lengthEncoding->parse(&params) && valueEncoding->parse(&params))) {
+            return false;
+        }
+        break;
+
+    case Cram::ByteArrayStopEncoding:
+        stop = params.getByte();
+        contentId = params.getITF8();
+        break;
+
+    case Cram::BetaEncoding:
+    case Cram::SubexpEncoding:
+        offset = params.getITF8();
+        parameter = params.getITF8();
+        break;
+
+    case Cram::GammaEncoding:
+        offset = params.getITF8();
+        break;
+
+    default:
+        break;
+    }
+    return params.ok;
+}
+
+class CramDataReader : public DataReader
+{
+public:
+    CramDataReader(const Genome* i_genome, double i_extraFactor, bool autoRelease);
+
+    virtual ~CramDataReader();
+
+    virtual bool init(const char* fileName);
+
+    virtual char* readHeader(_int64* io_headerSize);
+
+    virtual void reinit(_int64 startingOffset, _int64 amountOfFileToProcess);
+
+    virtual bool getData(char** o_buffer, _int64* o_validBytes, _int64* o_startBytes = NULL);
+
+    virtual void advance(_int64 bytes);
+
+    virtual void nextBatch();
+
+    virtual bool isEOF();
+
+    virtual DataBatch getBatch();
+
+    virtual void releaseBatch(DataBatch batch);
+
+    virtual _int64 getFileOffset();
+
+    virtual void getExtra(char** o_extra, _int64* o_length);
+
+private:
+    //
+    // A batch is one container's records (and the first batch the BAM header too), with room for BAMReader's extra data
+    // for each one.
+    //
+    struct Entry
+    {
+        CramBuffer data;
+        char* extra;
+        _int64 extraBytes;
+        _int64 offset;
+        _int64 fileOffset;
+        _uint32 batchID;
+        bool inUse;
+        bool releasePending;    // released while it was still the current batch
+        bool isEOF;
+    };
+
+    static const int MaxEntries = 64;
+
+    static const unsigned ReleaseWaitInMillis = 5;
+
+    int getFreeEntry();
+
+    void fillEntry(Entry* entry, bool withHeader);
+
+    // open the file and read through the header container
+    void open();
+
+    // make at least bytes of the file available at inputStart; false if it ends first
+    bool fill(size_t bytes);
+
+    // false at the end of the file
+    bool readContainerHeader(Cram::ContainerHeader* o_header, size_t* o_headerBytes);
+
+    void decodeContainer(const Cram::ContainerHeader& header, const _uint8* body, Entry* entry);
+
+    void parseCompressionHeader(const CramBuffer& data);
+
+    void decodeSlice(CramCursor* in, Entry* entry);
+
+    // the reference under a record, and how many of its bases there are (which can be fewer than asked for)
+    const char* getReference(int cramRef, _int64 pos, _int64 length, _int64* o_available);
+
+    // decoding data series values from the slice's blocks
+    struct SliceBlock
+    {
+        int contentId;
+        CramBuffer data;
+        size_t cursor;
+    };
+
+    SliceBlock* findBlock(int contentId);
+
+    _uint32 readBits(int bits);
+
+    _int32 decodeInt(const CramEncoding& encoding, int series);
+
+    _uint8 decodeByte(const CramEncoding& encoding, int series);
+
+    void decodeBytes(const CramEncoding& encoding, int series, int count, CramBuffer* out);    // count single bytes
+
+    void decodeByteArray(const CramEncoding& encoding, int series, CramBuffer* out);
+
+    void fail(const char* what);
+
+    const Genome* genome;
+    const double extraFactor;
+    const char* fileName;
+
+    GenericFile* file;
+    CramBuffer input;
+    size_t inputStart;
+    _int64 inputFileOffset;     // of input.data
+    bool inputEOF;
+    bool started;
+
+    CramBuffer bamHeader;
+    VariableSizeVector<int> contigs;    // genome contig of each CRAM reference, or -1
+    CramBuffer readGroups;              // the @RG IDs, each null terminated
+    VariableSizeVector<int> readGroupOffsets;
+
+    // the current compression header
+    bool readNamesIncluded;
+    bool apDelta;
+    char substitutions[5][4];
+    CramBuffer tagDictionary;
+    VariableSizeVector<int> tagLineOffsets;
+    VariableSizeVector<int> tagLineCounts;
+    CramEncoding series[Cram::NumDataSeries];
+    VariableSizeVector<_int32> tagKeys;
+    VariableSizeVector<CramEncoding*> tagEncodings;
+    int nTagEncodings;
+
+    // the current slice
+    VariableSizeVector<SliceBlock*> blocks;
+    int nBlocks;
+    CramBuffer core;
+    size_t coreBit;
+    CramBuffer scratch;
+    int sliceRef;
+    _int64 sliceStart;
+    int embeddedRef;
+
+    // building records
+    struct Feature
+    {
+        char code;
+        int pos;            // 1-based, in the read
+        _int32 value;
+        size_t dataOffset;  // into featureData
+        int dataBytes;
+    };
+    VariableSizeVector<Feature> features;
+    CramBuffer featureData;
+    CramBuffer name;
+    CramBuffer bases;
+    CramBuffer qualities;
+    CramBuffer aux;
+    CramBuffer value;
+    CramBuffer reference;
+    VariableSizeVector<_uint32> cigar;
+    VariableSizeVector<size_t> recordOffsets;
+    VariableSizeVector<int> mates;      // downstream mate of each record in the slice, or -1
+    VariableSizeVector<int> heads;      // first record of each one's mate chain
+
+    VariableSizeVector<Entry*> entries;
+    int current;
+    _uint32 nextBatchID;
+    ExclusiveLock lock;
+    EventObject releaseEvent;
+};
+
+CramDataReader::CramDataReader(
+    const Genome* i_genome,
+    double i_extraFactor,
+    bool autoRelease)
+    :
+    DataReader(autoRelease),
+    genome(i_genome),
+    extraFactor(i_extraFactor),
+    fileName(NULL),
+    file(NULL),
+    inputStart(0),
+    inputFileOffset(0),
+    inputEOF(false),
+    started(false),
+    nTagEncodings(0),
+    nBlocks(0),
+    coreBit(0),
+    current(-1),
+    nextBatchID(1)
+{
+    InitializeExclusiveLock(&lock);
+    CreateEventObject(&releaseEvent);
+}
+
+CramDataReader::~CramDataReader()
+{
+    if (file != NULL) {
+        file->close();
+        delete file;
+    }
+    for (int i = 0; i < entries.size(); i++) {
+        free(entries[i]->extra);
+        delete entries[i];
+    }
+    for (int i = 0; i < tagEncodings.size(); i++) {
+        delete tagEncodings[i];
+    }
+    for (int i = 0; i < blocks.size(); i++) {
+        delete blocks[i];
+    }
+    DestroyEventObject(&releaseEvent);
+    DestroyExclusiveLock(&lock);
+}
+
+    void
+CramDataReader::fail(
+    const char* what)
+{
+    fprintf(stderr, "CRAM file %s: %s\n", fileName, what);
+    soft_exit(1);
+}
+
+    bool
+CramDataReader::init(
+    const char* i_fileName)
+{
+    fileName = i_fileName;
+    file = GenericFile::open(fileName, GenericFile::ReadOnly);
+    if (file == NULL) {
+        return false;
+    }
+    open();
+    return true;
+}
+
+    bool
+CramDataReader::fill(
+    size_t bytes)
+{
+    size_t available = input.used - inputStart;
+    if (available >= bytes) {
+        return true;
+    }
+    memmove(input.data, input.data + inputStart, available);
+    inputFileOffset += inputStart;
+    inputStart = 0;
+    input.used = available;
+    while (input.used < bytes && ! inputEOF) {
+        size_t want = max(bytes - input.used, (size_t) 4 * 1024 * 1024);
+        size_t n = file->read(input.reserve(want), want);
+        if (n == (size_t) -1) {
+            fail("read failed");
+        }
+        if (n == 0) {
+            inputEOF = true;
+        }
+        input.used += n;
+    }
+    return input.used >= bytes;
+}
+
+    bool
+CramDataReader::readContainerHeader(
+    Cram::ContainerHeader* o_header,
+    size_t* o_headerBytes)
+{
+    if (! fill(1)) {
+        return false;
+    }
+    //
+    // A container header is a few dozen bytes, except for how many landmarks it has, so try more until it parses.
+    //
+    for (size_t probe = 64; ; probe *= 2) {
+        bool whole = fill(probe);
+        CramCursor in(input.data + inputStart, input.used - inputStart);
+        if (Cram::getContainerHeader(&in, o_header)) {
+            *o_headerBytes = in.p - (input.data + inputStart);
+            return true;
+        }
+        if (! whole || probe > 1024 * 1024) {
+            fail("truncated or corrupt container header");
+        }
+    }
+}
+
+    void
+CramDataReader::open()
+{
+    if (! fill(26)) {
+        fail("too short for a CRAM file");
+    }
+    const _uint8* definition = input.data + inputStart;
+    if (memcmp(definition, Cram::FileMagic, sizeof(Cram::FileMagic)) != 0) {
+        fail("not a CRAM file");
+    }
+    if (definition[4] != 3 || definition[5] != 0) {
+        fprintf(stderr, "CRAM file %s is version %d.%d; only 3.0 is supported\n", fileName, definition[4], definition[5]);
+        soft_exit(1);
+    }
+    inputStart += 26;
+
+    //
+    // The header container holds the SAM header, as a length and the text.
+    //
+    Cram::ContainerHeader header;
+    size_t headerBytes;
+    if (! readContainerHeader(&header, &headerBytes) || ! fill(headerBytes + header.length)) {
+        fail("no header container");
+    }
+    CramCursor in(input.data + inputStart + headerBytes, header.length);
+    Cram::Block block;
+    if (! Cram::getBlock(&in, &block) || block.contentType != Cram::FileHeaderContent || ! Cram::uncompressBlock(block, &scratch)) {
+        fail("bad header block");
+    }
+    inputStart += headerBytes + header.length;
+    CramCursor text(scratch.data, scratch.used);
+    _int32 textLength = text.getInt32();
+    const char* samText = (const char*) text.getBytes(max(0, textLength));
+    if (! text.ok) {
+        fail("bad header text");
+    }
+    while (textLength > 0 && samText[textLength - 1] == 0) {
+        textLength--;
+    }
+
+    //
+    // Make the BAM header: the same text, and a reference for each @SQ line.  Records refer to genome contigs, which the
+    // CRAM references are looked up in by name.
+    //
+    bamHeader.clear();
+    bamHeader.putInt32(BAMHeader::BAM_MAGIC);
+    bamHeader.putInt32(textLength);
+    bamHeader.append(samText, textLength);
+    size_t nRefOffset = bamHeader.used;
+    bamHeader.putInt32(0);
+    int nRefs = 0;
+    contigs.clear();
+    readGroups.clear();
+    readGroupOffsets.clear();
+    for (const char* line = samText; line < samText + textLength; ) {
+        const char* lineEnd = (const char*) memchr(line, '\n', samText + textLength - line);
+        if (lineEnd == NULL) {
+            lineEnd = samText + textLength;
+        }
+        bool sq = lineEnd - line > 4 && memcmp(line, "@SQ\t", 4) == 0;
+        bool rg = lineEnd - line > 4 && memcmp(line, "@RG\t", 4) == 0;
+        const char* name = NULL;
+        size_t nameLength = 0;
+        _int32 length = 0;
+        for (const char* field = line; field != NULL && field < lineEnd; ) {
+            const char* fieldEnd = (const char*) memchr(field, '\t', lineEnd - field);
+            if (fieldEnd == NULL) {
+                fieldEnd = lineEnd;
+            }
+            if (fieldEnd - field > 3 && field[2] == ':') {
+                if ((sq && field[0] == 'S' && field[1] == 'N') || (rg && field[0] == 'I' && field[1] == 'D')) {
+                    name = field + 3;
+                    nameLength = fieldEnd - name;
+                } else if (sq && field[0] == 'L' && field[1] == 'N') {
+                    length = atoi(field + 3);
+                }
+            }
+            field = fieldEnd < lineEnd ? fieldEnd + 1 : NULL;
+        }
+        while (nameLength > 0 && name[nameLength - 1] == '\r') {
+            nameLength--;
+        }
+        if (sq && name != NULL) {
+            bamHeader.putInt32((_int32) nameLength + 1);
+            bamHeader.append(name, nameLength);
+            bamHeader.putByte(0);
+            bamHeader.putInt32(length);
+            GenomeLocation offset;
+            const char* contigName = (const char*) bamHeader.data + bamHeader.used - 5 - nameLength;
+            int contig = -1;
+            if (genome != NULL && genome->getOffsetOfContig(contigName, &offset)) {
+                contig = (int) (genome->getContigAtLocation(offset) - genome->getContigs());
+            }
+            contigs.push_back(contig);
+            nRefs++;
+        } else if (rg && name != NULL) {
+            readGroupOffsets.push_back((int) readGroups.used);
+            readGroups.append(name, nameLength);
+            readGroups.putByte(0);
+        }
+        line = lineEnd + 1;
+    }
+    memcpy(bamHeader.data + nRefOffset, &nRefs, sizeof(nRefs));
+}
+
+    char*
+CramDataReader::readHeader(
+    _int64* io_headerSize)
+{
+    *io_headerSize = bamHeader.used;
+    return (char*) bamHeader.data;
+}
+
+    void
+CramDataReader::reinit(
+    _int64 startingOffset,
+    _int64 amountOfFileToProcess)
+{
+    if (startingOffset != 0 || amountOfFileToProcess != 0) {
+        fprintf(stderr, "CRAM input can only be read whole, not from offset %lld\n", startingOffset);
+        soft_exit(1);
+    }
+    if (started) {
+        // back to the beginning
+        file->close();
+        delete file;
+        file = GenericFile::open(fileName, GenericFile::ReadOnly);
+        if (file == NULL) {
+            fail("can't reopen");
+        }
+        input.clear();
+        inputStart = 0;
+        inputFileOffset = 0;
+        inputEOF = false;
+        open();
+    }
+    started = true;
+
+    AcquireExclusiveLock(&lock);
+    for (int i = 0; i < entries.size(); i++) {
+        entries[i]->inUse = false;
+        entries[i]->releasePending = false;
+    }
+    current = -1;
+    ReleaseExclusiveLock(&lock);
+
+    //
+    // The first batch is the BAM header along with the first container.
+    //
+    int first = getFreeEntry();
+    fillEntry(entries[first], true);
+    current = first;
+}
+
+    int
+CramDataReader::getFreeEntry()
+{
+    AcquireExclusiveLock(&lock);
+    for (bool waited = false; ; waited = true) {
+        for (int i = 0; i < entries.size(); i++) {
+            if (! entries[i]->inUse) {
+                entries[i]->inUse = true;
+                entries[i]->releasePending = false;
+                ReleaseExclusiveLock(&lock);
+                return i;
+            }
+        }
+        if (entries.size() < 2 || (waited && entries.size() < MaxEntries)) {
+            Entry* entry = new Entry();
+            entry->extra = NULL;
+            entry->extraBytes = 0;
+            entry->inUse = true;
+            entry->releasePending = false;
+            entries.push_back(entry);
+            ReleaseExclusiveLock(&lock);
+            return entries.size() - 1;
+        }
+        PreventEventWaitersFromProceeding(&releaseEvent);
+        ReleaseExclusiveLock(&lock);
+        _int64 start = timeInNanos();
+        if (entries.size() < MaxEntries) {
+            WaitForEventWithTimeout(&releaseEvent, ReleaseWaitInMillis);
+        } else {
+            WaitForEvent(&releaseEvent);
+        }
+        InterlockedAdd64AndReturnNewValue(&ReleaseWaitTime, timeInNanos() - start);
+        AcquireExclusiveLock(&lock);
+    }
+}
+
+    void
+CramDataReader::fillEntry(
+    Entry* entry,
+    bool withHeader)
+{
+    entry->data.clear();
+    entry->offset = 0;
+    entry->isEOF = false;
+    entry->batchID = nextBatchID++;
+    entry->fileOffset = inputFileOffset + inputStart;
+    if (withHeader) {
+        entry->data.append(bamHeader.data, bamHeader.used);
+    }
+    while (true) {
+        Cram::ContainerHeader header;
+        size_t headerBytes;
+        if (! readContainerHeader(&header, &headerBytes)) {
+            entry->isEOF = true;
+            break;
+        }
+        if (! fill(headerBytes + header.length)) {
+            fail("truncated container");
+        }
+        // again, since fill may have moved the buffer
+        CramCursor in(input.data + inputStart, headerBytes);
+        Cram::getContainerHeader(&in, &header);
+        const _uint8* body = input.data + inputStart + headerBytes;
+        if (header.nRecords > 0) {
+            decodeContainer(header, body, entry);
+        }
+        inputStart += headerBytes + header.length;
+        if (header.nRecords > 0) {
+            break;
+        }
+    }
+
+    // BAMReader takes space for the decoded sequence, qualities and CIGAR of each record
+    _int64 extra = max((_int64) (extraFactor * entry->data.used), (_int64) 0);
+    for (size_t offset = withHeader ? bamHeader.used : 0; offset < entry->data.used; ) {
+        BAMAlignment* bam = (BAMAlignment*) (entry->data.data + offset);
+        offset += bam->size();
+        extra += MAX_READ_LENGTH + 2 * bam->l_seq;
+    }
+    if (extra > entry->extraBytes) {
+        free(entry->extra);
+        entry->extra = (char*) malloc(extra);
+        if (entry->extra == NULL) {
+            fprintf(stderr, "Unable to allocate %lld bytes for CRAM reader\n", extra);
+            soft_exit(1);
+        }
+        entry->extraBytes = extra;
+    }
+}
+
+    void
+CramDataReader::parseCompressionHeader(
+    const CramBuffer& data)
+{
+    CramCursor in(data.data, data.used);
+
+    //
+    // The preservation map.
+    //
+    readNamesIncluded = true;
+    apDelta = true;
+    const _uint8* matrix = Cram::SubstitutionMatrix;
+    tagDictionary.clear();
+    _int32 bytes = in.getITF8();
+    const _uint8* mapEnd = in.p + max(0, bytes);
+    _int32 n = in.getITF8();
+    for (int i = 0; i < n && in.ok; i++) {
+        const _uint8* key = in.getBytes(2);
+        if (key == NULL) {
+            break;
+        }
+        if (key[0] == 'R' && key[1] == 'N') {
+            readNamesIncluded = in.getByte() != 0;
+        } else if (key[0] == 'A' && key[1] == 'P') {
+            apDelta = in.getByte() != 0;
+        } else if (key[0] == 'R' && key[1] == 'R') {
+            in.getByte();   // we always have the genome
+        } else if (key[0] == 'S' && key[1] == 'M') {
+            matrix = in.getBytes(5);
+        } else if (key[0] == 'T' && key[1] == 'D') {
+            _int32 tdBytes = in.getITF8();
+            const _uint8* td = in.getBytes(max(0, tdBytes));
+            if (td != NULL) {
+                tagDictionary.append(td, tdBytes);
+            }
+        } else {
+            break;  // can't tell how big it is
+        }
+    }
+    if (! in.ok || mapEnd > in.end) {
+        fail("bad preservation map");
+    }
+    in.p = mapEnd;
+
+    static const char* Bases = "ACGTN";
+    for (int r = 0; r < 5; r++) {
+        for (int m = 0, alternative = 0; alternative < 5; alternative++) {
+            if (alternative != r) {
+                substitutions[r][(matrix[r] >> (6 - 2 * m)) & 3] = Bases[alternative];
+                m++;
+            }
+        }
+    }
+    tagLineOffsets.clear();
+    tagLineCounts.clear();
+    for (size_t start = 0; start < tagDictionary.used; ) {
+        const _uint8* lineEnd = (const _uint8*) memchr(tagDictionary.data + start, 0, tagDictionary.used - start);
+        size_t end = lineEnd == NULL ? tagDictionary.used : lineEnd - tagDictionary.data;
+        tagLineOffsets.push_back((int) start);
+        tagLineCounts.push_back((int) ((end - start) / 3));
+        start = end + 1;
+    }
+
+    //
+    // The data series encodings, and the tags'.
+    //
+    for (int i = 0; i < Cram::NumDataSeries; i++) {
+        series[i].clear();
+    }
+    bytes = in.getITF8();
+    n = in.getITF8();
+    CramEncoding ignored;
+    for (int i = 0; i < n && in.ok; i++) {
+        const _uint8* key = in.getBytes(2);
+        CramEncoding* encoding = &ignored;
+        for (int j = 0; key != NULL && j < Cram::NumDataSeries; j++) {
+            if (key[0] == Cram::DataSeriesKeys[j][0] && key[1] == Cram::DataSeriesKeys[j][1]) {
+                encoding = &series[j];
+                break;
+            }
+        }
+        if (! encoding->parse(&in)) {
+            fail("bad data series encoding");
+        }
+    }
+
+    bytes = in.getITF8();
+    n = in.getITF8();
+    tagKeys.clear();
+    nTagEncodings = 0;
+    for (int i = 0; i < n && in.ok; i++) {
+        tagKeys.push_back(in.getITF8());
+        if (nTagEncodings == tagEncodings.size()) {
+            tagEncodings.push_back(new CramEncoding());
+        }
+        if (! tagEncodings[nTagEncodings++]->parse(&in)) {
+            fail("bad tag encoding");
+        }
+    }
+    if (! in.ok) {
+        fail("bad compression header");
+    }
+}
+
+    void
+CramDataReader::decodeContainer(
+    const Cram::ContainerHeader& header,
+    const _uint8* body,
+    Entry* entry)
+{
+    CramCursor in(body, header.length);
+    Cram::Block block;
+    if (! Cram::getBlock(&in, &block) || block.contentType != Cram::CompressionHeaderContent || ! Cram::uncompressBlock(block, &scratch)) {
+        fail("bad compression header block");
+    }
+    parseCompressionHeader(scratch);
+
+    if (header.nLandmarks == 0) {
+        decodeSlice(&in, entry);
+        return;
+    }
+    CramCursor landmarks(header.landmarks, 5 * header.nLandmarks);
+    for (int i = 0; i < header.nLandmarks; i++) {
+        _int32 landmark = landmarks.getITF8();
+        if (landmark < 0 || landmark >= header.length) {
+            fail("bad slice offset");
+        }
+        CramCursor slice(body + landmark, header.length - landmark);
+        decodeSlice(&slice, entry);
+    }
+}
+
+    CramDataReader::SliceBlock*
+CramDataReader::findBlock(
+    int contentId)
+{
+    for (int i = 0; i < nBlocks; i++) {
+        if (blocks[i]->contentId == contentId) {
+            return blocks[i];
+        }
+    }
+    char message[64];
+    sprintf(message, "no block with content id %d", contentId);
+    fail(message);
+    return NULL;
+}
+
+    _uint32
+CramDataReader::readBits(
+    int bits)
+{
+    _uint32 result = 0;
+    for (int i = 0; i < bits; i++) {
+        if (coreBit >= 8 * core.used) {
+            fail("ran off the end of the core block");
+        }
+        result = (result << 1) | ((core.data[coreBit >> 3] >> (7 - (coreBit & 7))) & 1);
+        coreBit++;
+    }
+    return result;
+}
+
+    _int32
+CramDataReader::decodeInt(
+    const CramEncoding& encoding,
+    int seriesIndex)
+{
+    switch (encoding.codec) {
+    case Cram::ExternalEncoding:
+    {
+        SliceBlock* block = findBlock(encoding.contentId);
+        CramCursor in(block->data.data + block->cursor, block->data.used - block->cursor);
+        _int32 result = in.getITF8();
+        if (! in.ok) {
+            fail("ran off the end of an external block");
+        }
+        block->cursor = in.p - block->data.data;
+        return result;
+    }
+
+    case Cram::HuffmanEncoding:
+    {
+        if (encoding.nCodes == 1 && encoding.lengths[0] == 0) {
+            return encoding.symbols[0];
+        }
+        _uint32 code = 0;
+        int length = 0;
+        for (int i = 0; i < encoding.nCodes; ) {
+            code = (code << 1) | readBits(1);
+            length++;
+            for (; i < encoding.nCodes && encoding.lengths[i] == length; i++) {
+                if (encoding.codes[i] == code) {
+                    return encoding.symbols[i];
+                }
+            }
+        }
+        fail("bad Huffman code");
+        return 0;
+    }
+
+    case Cram::BetaEncoding:
+        return (_int32) readBits(encoding.parameter) - encoding.offset;
+
+    case Cram::SubexpEncoding:
+    {
+        int ones = 0;
+        while (readBits(1) == 1) {
+            ones++;
+        }
+        int bits = ones == 0 ? encoding.parameter : ones + encoding.parameter - 1;
+        _int32 result = (_int32) readBits(bits);
+        if (ones != 0) {
+            result += 1 << bits;
+        }
+        return result - encoding.offset;
+    }
+
+    case Cram::GammaEncoding:
+    {
+        int zeros = 0;
+        while (readBits(1) == 0) {
+            zeros++;
+        }
+        return (_int32) (((_uint32) 1 << zeros) | readBits(zeros)) - encoding.offset;
+    }
+
+    default:
+        char message[80];
+        sprintf(message, "data series %s uses unsupported encoding %d", seriesIndex >= 0 ? Cram::DataSeriesKeys[seriesIndex] : "(tag)", encoding.codec);
+        fail(message);
+        return 0;
+    }
+}
+
+    _uint8
+CramDataReader::decodeByte(
+    const CramEncoding& encoding,
+    int seriesIndex)
+{
+    if (encoding.codec == Cram::ExternalEncoding) {
+        SliceBlock* block = findBlock(encoding.contentId);
+        if (block->cursor >= block->data.used) {
+            fail("ran off the end of an external block");
+        }
+        return block->data.data[block->cursor++];
+    }
+    return (_uint8) decodeInt(encoding, seriesIndex);
+}
+
+    void
+CramDataReader::decodeBytes(
+    const CramEncoding& encoding,
+    int seriesIndex,
+    int count,
+    CramBuffer* out)
+{
+    _uint8* to = out->reserve(count);
+    if (encoding.codec == Cram::ExternalEncoding) {
+        SliceBlock* block = findBlock(encoding.contentId);
+        if (block->data.used - block->cursor < (size_t) count) {
+            fail("ran off the end of an external block");
+        }
+        memcpy(to, block->data.data + block->cursor, count);
+        block->cursor += count;
+    } else {
+        for (int i = 0; i < count; i++) {
+            to[i] = decodeByte(encoding, seriesIndex);
+        }
+    }
+    out->used += count;
+}
+
+    void
+CramDataReader::decodeByteArray(
+    const CramEncoding& encoding,
+    int seriesIndex,
+    CramBuffer* out)
+{
+    if (encoding.codec == Cram::ByteArrayLenEncoding) {
+        _int32 length = decodeInt(*encoding.lengthEncoding, seriesIndex);
+        if (length < 0) {
+            fail("negative byte array length");
+        }
+        decodeBytes(*encoding.valueEncoding, seriesIndex, length, out);
+    } else if (encoding.codec == Cram::ByteArrayStopEncoding) {
+        SliceBlock* block = findBlock(encoding.contentId);
+        const _uint8* start = block->data.data + block->cursor;
+        const _uint8* stop = (const _uint8*) memchr(start, encoding.stop, block->data.used - block->cursor);
+        if (stop == NULL) {
+            fail("ran off the end of an external block");
+        }
+        out->append(start, stop - start);
+        block->cursor += stop - start + 1;
+    } else {
+        decodeInt(encoding, seriesIndex);   // fails, with the series' name
+    }
+}
+
+    const char*
+CramDataReader::getReference(
+    int cramRef,
+    _int64 pos,
+    _int64 length,
+    _int64* o_available)
+{
+    *o_available = 0;
+    if (embeddedRef >= 0 && cramRef == sliceRef) {
+        SliceBlock* block = findBlock(embeddedRef);
+        _int64 offset = pos - (sliceStart - 1);
+        if (offset >= 0 && offset < (_int64) block->data.used) {
+            *o_available = min(length, (_int64) block->data.used - offset);
+            return (const char*) block->data.data + offset;
+        }
+        return NULL;
+    }
+    if (cramRef < 0 || cramRef >= contigs.size() || contigs[cramRef] < 0) {
+        return NULL;
+    }
+    reference.clear();
+    *o_available = Cram::CopyReference(genome, contigs[cramRef], pos, length, (char*) reference.reserve(length + 1));
+    return (const char*) reference.data;
+}
+
+    void
+CramDataReader::decodeSlice(
+    CramCursor* in,
+    Entry* entry)
+{
+    Cram::Block block;
+    if (! Cram::getBlock(in, &block) || block.contentType != Cram::SliceHeaderContent || ! Cram::uncompressBlock(block, &scratch)) {
+        fail("bad slice header");
+    }
+    CramCursor header(scratch.data, scratch.used);
+    sliceRef = header.getITF8();
+    sliceStart = header.getITF8();
+    _int32 span = header.getITF8();
+    _int32 nRecords = header.getITF8();
+    _int64 recordCounter = header.getLTF8();
+    _int32 nSliceBlocks = header.getITF8();
+    _int32 nIds = header.getITF8();
+    for (int i = 0; i < nIds && header.ok; i++) {
+        header.getITF8();
+    }
+    embeddedRef = header.getITF8();
+    const _uint8* md5 = header.getBytes(16);
+    if (! header.ok || nRecords < 0 || nSliceBlocks < 0) {
+        fail("bad slice header");
+    }
+    _uint8 expectedMd5[16];
+    memcpy(expectedMd5, md5, 16);
+
+    nBlocks = 0;
+    core.clear();
+    coreBit = 0;
+    for (int i = 0; i < nSliceBlocks; i++) {
+        if (! Cram::getBlock(in, &block)) {
+            fail("bad block");
+        }
+        if (block.contentType == Cram::CoreContent) {
+            if (! Cram::uncompressBlock(block, &core)) {
+                fail("bad core block");
+            }
+            continue;
+        }
+        if (nBlocks == blocks.size()) {
+            blocks.push_back(new SliceBlock());
+        }
+        SliceBlock* sliceBlock = blocks[nBlocks++];
+        sliceBlock->contentId = block.contentId;
+        sliceBlock->cursor = 0;
+        if (! Cram::uncompressBlock(block, &sliceBlock->data)) {
+            fail("bad external block");
+        }
+    }
+
+    //
+    // Check that the genome is the reference the file was written against.
+    //
+    static const _uint8 NoMd5[16] = {0};
+    if (sliceRef >= 0 && span > 0 && embeddedRef < 0 && memcmp(expectedMd5, NoMd5, 16) != 0) {
+        _int64 available;
+        const char* ref = getReference(sliceRef, sliceStart - 1, span, &available);
+        if (ref == NULL || available != span) {
+            fail("a reference it uses isn't in the genome");
+        }
+        Cram::Md5 digest;
+        digest.update(ref, span);
+        _uint8 actual[16];
+        digest.final(actual);
+        if (memcmp(actual, expectedMd5, 16) != 0) {
+            fail("the genome doesn't match the reference it was written against (slice MD5 differs)");
+        }
+    }
+
+    recordOffsets.clear();
+    mates.clear();
+    heads.clear();
+    _int64 lastPos = sliceStart;
+    for (int i = 0; i < nRecords; i++) {
+        _int32 flag = decodeInt(series[Cram::BF], Cram::BF);
+        _int32 cf = decodeInt(series[Cram::CF], Cram::CF);
+        int cramRef = sliceRef == Cram::MultipleRefs ? decodeInt(series[Cram::RI], Cram::RI) : sliceRef;
+        _int32 readLength = decodeInt(series[Cram::RL], Cram::RL);
+        _int32 ap = decodeInt(series[Cram::AP], Cram::AP);
+        _int64 pos = apDelta ? lastPos + ap : ap;   // 1 based
+        lastPos = pos;
+        _int32 readGroup = decodeInt(series[Cram::RG], Cram::RG);
+        name.clear();
+        if (readNamesIncluded) {
+            decodeByteArray(series[Cram::RN], Cram::RN, &name);
+        }
+        int mateRef = -1;
+        _int32 matePos = 0, templateLength = 0;
+        mates.push_back(-1);
+        heads.push_back(i);
+        if (cf & Cram::Detached) {
+            _int32 mateFlags = decodeInt(series[Cram::MF], Cram::MF);
+            flag &= ~(SAM_NEXT_REVERSED | SAM_NEXT_UNMAPPED);
+            flag |= ((mateFlags & Cram::MateReverse) ? SAM_NEXT_REVERSED : 0) | ((mateFlags & Cram::MateUnmapped) ? SAM_NEXT_UNMAPPED : 0);
+            if (! readNamesIncluded) {
+                decodeByteArray(series[Cram::RN], Cram::RN, &name);
+            }
+            mateRef = decodeInt(series[Cram::NS], Cram::NS);
+            matePos = decodeInt(series[Cram::NP], Cram::NP);
+            templateLength = decodeInt(series[Cram::TS], Cram::TS);
+        } else if (cf & Cram::MateDownstream) {
+            _int32 next = decodeInt(series[Cram::NF], Cram::NF);
+            if (next < 0 || i + next + 1 >= nRecords) {
+                fail("bad mate link");
+            }
+            mates[i] = i + next + 1;
+        }
+        if (name.used == 0) {
+            char generated[32];
+            sprintf(generated, "%lld", recordCounter + heads[i]);
+            name.append(generated, strlen(generated));
+        }
+
+        //
+        // Tags are kept as their BAM values.
+        //
+        aux.clear();
+        _int32 tagLine = decodeInt(series[Cram::TL], Cram::TL);
+        if (tagLine < 0 || tagLine >= tagLineOffsets.size()) {
+            if (tagLine != 0 || tagLineOffsets.size() != 0) {
+                fail("bad tag line");
+            }
+        } else {
+            const _uint8* keys = tagDictionary.data + tagLineOffsets[tagLine];
+            for (int t = 0; t < tagLineCounts[tagLine]; t++) {
+                _int32 key = (keys[3 * t] << 16) | (keys[3 * t + 1] << 8) | keys[3 * t + 2];
+                int e = 0;
+                while (e < nTagEncodings && tagKeys[e] != key) {
+                    e++;
+                }
+                if (e == nTagEncodings) {
+                    fail("tag with no encoding");
+                }
+                aux.append(keys + 3 * t, 3);
+                decodeByteArray(*tagEncodings[e], -1, &aux);
+            }
+        }
+        if (readGroup >= 0 && readGroup < readGroupOffsets.size()) {
+            const char* id = (const char*) readGroups.data + readGroupOffsets[readGroup];
+            aux.append("RGZ", 3);
+            aux.append(id, strlen(id) + 1);
+        }
+
+        bases.clear();
+        qualities.clear();
+        cigar.clear();
+        int mapq = 0;
+        bool unknownBases = (cf & Cram::UnknownBases) != 0;
+        memset(qualities.reserve(readLength), 0xff, readLength);
+        qualities.used = readLength;
+        if (! (flag & SAM_UNMAPPED)) {
+            //
+            // The features, then the bases: the reference, except where a feature says otherwise.
+            //
+            features.clear();
+            featureData.clear();
+            _int32 nFeatures = decodeInt(series[Cram::FN], Cram::FN);
+            int featurePos = 0;
+            _int64 refLength = readLength;
+            for (int f = 0; f < nFeatures; f++) {
+                Feature feature;
+                feature.code = (char) decodeByte(series[Cram::FC], Cram::FC);
+                featurePos += decodeInt(series[Cram::FP], Cram::FP);
+                feature.pos = featurePos;
+                feature.value = 0;
+                feature.dataOffset = featureData.used;
+                switch (feature.code) {
+                case 'B':
+                    featureData.putByte(decodeByte(series[Cram::BA], Cram::BA));
+                    feature.value = decodeByte(series[Cram::QS], Cram::QS);
+                    break;
+                case 'X':
+                    feature.value = decodeByte(series[Cram::BS], Cram::BS);
+                    break;
+                case 'I':
+                    decodeByteArray(series[Cram::IN], Cram::IN, &featureData);
+                    break;
+                case 'S':
+                    decodeByteArray(series[Cram::SC], Cram::SC, &featureData);
+                    break;
+                case 'b':
+                    decodeByteArray(series[Cram::BB], Cram::BB, &featureData);
+                    break;
+                case 'q':
+                    decodeByteArray(series[Cram::QQ], Cram::QQ, &featureData);
+                    break;
+                case 'i':
+                    featureData.putByte(decodeByte(series[Cram::BA], Cram::BA));
+                    break;
+                case 'Q':
+                    feature.value = decodeByte(series[Cram::QS], Cram::QS);
+                    break;
+                case 'D':
+                    feature.value = decodeInt(series[Cram::DL], Cram::DL);
+                    refLength += feature.value;
+                    break;
+                case 'N':
+                    feature.value = decodeInt(series[Cram::RS], Cram::RS);
+                    refLength += feature.value;
+                    break;
+                case 'H':
+                    feature.value = decodeInt(series[Cram::HC], Cram::HC);
+                    break;
+                case 'P':
+                    feature.value = decodeInt(series[Cram::PD], Cram::PD);
+                    break;
+                default:
+                    fail("unknown read feature");
+                }
+                feature.dataBytes = (int) (featureData.used - feature.dataOffset);
+                features.push_back(feature);
+            }
+            mapq = decodeInt(series[Cram::MQ], Cram::MQ);
+
+            _int64 available;
+            const char* ref = getReference(cramRef, pos - 1, refLength, &available);
+            char* seq = (char*) bases.reserve(readLength);
+            _uint8* qual = qualities.data;
+            int readPos = 1;
+            _int64 refPos = 0;  // from pos
+#define ADD_CIGAR(op, count) \
+            if (cigar.size() > 0 && (cigar[cigar.size() - 1] & 0xf) == (op)) { cigar[cigar.size() - 1] += (count) << 4; } else { cigar.push_back(((count) << 4) | (op)); }
+#define REF_BASE(at) ((at) < available ? ref[at] : 'N')
+            for (int f = 0; f <= features.size(); f++) {
+                //
+                // Reference matches up to the next feature, or the end of the read.
+                //
+                int upTo = f < features.size() ? features[f].pos : readLength + 1;
+                if (upTo > readPos) {
+                    int n = min(upTo, readLength + 1) - readPos;
+                    for (int j = 0; j < n; j++) {
+                        seq[readPos - 1 + j] = REF_BASE(refPos + j);
+                    }
+                    if (n > 0) {
+                        ADD_CIGAR(0, n);
+                    }
+                    readPos += n;
+                    refPos += n;
+                }
+                if (f == features.size()) {
+                    break;
+                }
+                Feature& feature = features[f];
+                const char* data = (const char*) featureData.data + feature.dataOffset;
+                int n = feature.dataBytes;
+                if (readPos + (feature.code == 'X' || feature.code == 'B' ? 1 : n) - 1 > readLength &&
+                    (feature.code == 'X' || feature.code == 'B' || feature.code == 'b' || feature.code == 'I' || feature.code == 'S' || feature.code == 'i')) {
+                    fail("read feature past the end of the read");
+                }
+                switch (feature.code) {
+                case 'X':
+                {
+                    int r = Cram::BaseIndex(REF_BASE(refPos));
+                    seq[readPos - 1] = substitutions[r < 0 ? 4 : r][feature.value & 3];
+                    ADD_CIGAR(0, 1);
+                    readPos++;
+                    refPos++;
+                    break;
+                }
+                case 'B':
+                    seq[readPos - 1] = data[0];
+                    qual[readPos - 1] = (_uint8) feature.value;
+                    ADD_CIGAR(0, 1);
+                    readPos++;
+                    refPos++;
+                    break;
+                case 'b':
+                    memcpy(seq + readPos - 1, data, n);
+                    ADD_CIGAR(0, n);
+                    readPos += n;
+                    refPos += n;
+                    break;
+                case 'q':
+                    memcpy(qual + feature.pos - 1, data, min(n, readLength - feature.pos + 1));
+                    break;
+                case 'Q':
+                    qual[feature.pos - 1] = (_uint8) feature.value;
+                    break;
+                case 'I':
+                case 'i':
+                case 'S':
+                    memcpy(seq + readPos - 1, data, n);
+                    if (n > 0) {
+                        ADD_CIGAR(feature.code == 'S' ? 4 : 1, n);
+                    }
+                    readPos += n;
+                    break;
+                case 'D':
+                case 'N':
+                    ADD_CIGAR(feature.code == 'D' ? 2 : 3, feature.value);
+                    refPos += feature.value;
+                    break;
+                case 'H':
+                    ADD_CIGAR(5, feature.value);
+                    break;
+                case 'P':
+                    ADD_CIGAR(6, feature.value);
+                    break;
+                }
+            }
+#undef REF_BASE
+#undef ADD_CIGAR
+            bases.used = readLength;
+        } else if (! unknownBases) {
+            decodeBytes(series[Cram::BA], Cram::BA, readLength, &bases);
+        }
+        if (cf & Cram::QualityAsArray) {
+            qualities.clear();
+            decodeBytes(series[Cram::QS], Cram::QS, readLength, &qualities);
+        }
+        int seqLength = unknownBases ? 0 : readLength;
+
+        //
+        // And the BAM record.
+        //
+        if (name.used > 254) {
+            fail("read name too long for BAM");
+        }
+        size_t size = BAMAlignment::size((unsigned) name.used + 1, cigar.size(), seqLength, (unsigned) aux.used);
+        recordOffsets.push_back(entry->data.used);
+        BAMAlignment* bam = (BAMAlignment*) entry->data.reserve(size);
+        bam->block_size = (_int32) (size - sizeof(bam->block_size));
+        bam->refID = cramRef >= 0 && cramRef < contigs.size() ? contigs[cramRef] : -1;
+        bam->pos = (_int32) pos - 1;
+        bam->l_read_name = (_uint8) (name.used + 1);
+        bam->MAPQ = (_uint8) mapq;
+        bam->n_cigar_op = (_uint16) cigar.size();
+        bam->FLAG = (_uint16) flag;
+        bam->l_seq = seqLength;
+        bam->next_refID = mateRef >= 0 && mateRef < contigs.size() ? contigs[mateRef] : -1;
+        bam->next_pos = matePos - 1;
+        bam->tlen = templateLength;
+        memcpy(bam->read_name(), name.data, name.used);
+        bam->read_name()[name.used] = 0;
+        if (cigar.size() > 0) {
+            memcpy(bam->cigar(), cigar.begin(), cigar.size() * sizeof(_uint32));
+        }
+        if (seqLength > 0) {
+            BAMAlignment::encodeSeq(bam->seq(), (char*) bases.data, seqLength);
+            memcpy(bam->qual(), qualities.data, seqLength);
+        }
+        memcpy(bam->firstAux(), aux.data, aux.used);
+        int refLength = Cram::ReferenceLength(bam);
+        bam->bin = (_uint16) BAMAlignment::reg2bin(bam->pos, bam->pos + max(1, refLength));
+        entry->data.used += size;
+        if (mates[i] >= 0) {
+            heads[mates[i]] = heads[i];
+        }
+    }
+
+    //
+    // Fill in the mate fields of records linked to their mates in the slice: each one points to the next in its chain,
+    // and the last back to the first.
+    //
+    for (int i = 0; i < nRecords; i++) {
+        if (mates[i] < 0 && heads[i] == i) {
+            continue;
+        }
+        int next = mates[i] >= 0 ? mates[i] : heads[i];
+        BAMAlignment* bam = (BAMAlignment*) (entry->data.data + recordOffsets[i]);
+        BAMAlignment* mate = (BAMAlignment*) (entry->data.data + recordOffsets[next]);
+        bam->next_refID = mate->refID;
+        bam->next_pos = mate->pos;
+        bam->FLAG &= ~(SAM_NEXT_REVERSED | SAM_NEXT_UNMAPPED);
+        bam->FLAG |= ((mate->FLAG & SAM_REVERSE_COMPLEMENT) ? SAM_NEXT_REVERSED : 0) | ((mate->FLAG & SAM_UNMAPPED) ? SAM_NEXT_UNMAPPED : 0);
+        bam->tlen = 0;
+        if (! (bam->FLAG & SAM_UNMAPPED) && ! (mate->FLAG & SAM_UNMAPPED) && bam->refID == mate->refID) {
+            _int64 bamEnd = bam->pos + max(1, Cram::ReferenceLength(bam));
+            _int64 mateEnd = mate->pos + max(1, Cram::ReferenceLength(mate));
+            _int32 length = (_int32) (max(bamEnd, mateEnd) - min(bam->pos, mate->pos));
+            bam->tlen = bam->pos < mate->pos || (bam->pos == mate->pos && i < next) ? length : -length;
+        }
+    }
+}
+
+    bool
+CramDataReader::getData(
+    char** o_buffer,
+    _int64* o_validBytes,
+    _int64* o_startBytes)
+{
+    Entry* entry = entries[current];
+    if (entry->offset >= (_int64) entry->data.used) {
+        return false;
+    }
+    *o_buffer = (char*) entry->data.data + entry->offset;
+    *o_validBytes = entry->data.used - entry->offset;
+    if (o_startBytes != NULL) {
+        *o_startBytes = *o_validBytes;
+    }
+    return true;
+}
+
+    void
+CramDataReader::advance(
+    _int64 bytes)
+{
+    Entry* entry = entries[current];
+    entry->offset = min((_int64) entry->data.used, entry->offset + max((_int64) 0, bytes));
+}
+
+    void
+CramDataReader::nextBatch()
+{
+    Entry* entry = entries[current];
+    DataBatch prior(entry->batchID);
+    if (entry->isEOF) {
+        if (autoRelease) {
+            releaseBatch(prior);
+        }
+        return;
+    }
+    int next = getFreeEntry();
+    fillEntry(entries[next], false);
+
+    AcquireExclusiveLock(&lock);
+    int old = current;
+    current = next;
+    if (entries[old]->releasePending) {
+        entries[old]->inUse = false;
+        AllowEventWaitersToProceed(&releaseEvent);
+    }
+    ReleaseExclusiveLock(&lock);
+
+    if (autoRelease) {
+        releaseBatch(prior);
+    }
+}
+
+    bool
+CramDataReader::isEOF()
+{
+    return entries[current]->isEOF;
+}
+
+    DataBatch
+CramDataReader::getBatch()
+{
+    return DataBatch(entries[current]->batchID);
+}
+
+    void
+CramDataReader::releaseBatch(
+    DataBatch batch)
+{
+    AcquireExclusiveLock(&lock);
+    for (int i = 0; i < entries.size(); i++) {
+        Entry* entry = entries[i];
+        if (entry->inUse && entry->batchID == batch.batchID) {
+            if (i == current) {
+                entry->releasePending = true;
+            } else {
+                entry->inUse = false;
+                AllowEventWaitersToProceed(&releaseEvent);
+            }
+        }
+    }
+    ReleaseExclusiveLock(&lock);
+}
+
+    _int64
+CramDataReader::getFileOffset()
+{
+    return entries[current]->fileOffset;
+}
+
+    void
+CramDataReader::getExtra(
+    char** o_extra,
+    _int64* o_length)
+{
+    Entry* entry = entries[max(0, current)];
+    *o_extra = entry->extra;
+    *o_length = entry->extraBytes;
+}
+
+class CramDataSupplier : public DataSupplier
+{
+public:
+    CramDataSupplier(const Genome* i_genome, bool autoRelease) : DataSupplier(autoRelease), genome(i_genome) {}
+
+    virtual DataReader* getDataReader(_int64 overflowBytes, double extraFactor)
+    { return new CramDataReader(genome, extraFactor, autoRelease); }
+
+private:
+    const Genome* genome;
+};
+
+    DataSupplier*
+DataSupplier::CramSupplier(
+    const Genome* genome,
+    bool autoRelease)
+{
+    return new CramDataSupplier(genome, autoRelease);
+}
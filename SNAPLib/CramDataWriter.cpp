@@ -0,0 +1,790 @@
+/*++
+
+Module Name:
+
+    CramDataWriter.cpp
+
+Abstract:
+
+    Reference-based CRAM 3.0 output.  The aligner writes BAM records as usual, and a FileEncoder turns each batch of
+    them into CRAM containers on its own pool of threads.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "Cram.h"
+#include "Bam.h"
+#include "DataWriter.h"
+#include "Genome.h"
+#include "Libdeflate.h"
+#include "VariableSizeVector.h"
+#include "exit.h"
+#include "zlib.h"
+
+using std::max;
+using std::min;
+
+//
+// Every record is written detached (with its mate's position and flags, rather than a link to the mate), with its name,
+// and against the reference: a mapped read's bases are what differ from the reference under its CIGAR.  Each data
+// series goes into its own external block, and each tag into one of its own, so that each block is all the same kind
+// of data for gzip.
+//
+class CramContainerEncoder : public FileEncoder::Codec
+{
+public:
+    CramContainerEncoder(const Genome* i_genome, bool i_sorted)
+        : Codec(0), genome(i_genome), sorted(i_sorted), recordCounter(0)
+    {}
+
+    virtual void* createThreadState();
+
+    virtual void deleteThreadState(void* state);
+
+    virtual size_t encodeChunk(void* state, char* toBuffer, size_t toSize, char* fromBuffer, size_t fromUsed, double backlog);
+
+    static const int MaxContainerRecords = 10000;
+
+private:
+    struct TagSeries
+    {
+        _int32 key;     // tag name and type, which is also the content id of its block
+        CramBuffer data;
+    };
+
+    struct TagLine
+    {
+        size_t offset;  // into tagLines
+        int nTags;
+    };
+
+    struct ThreadState
+    {
+        CramBuffer series[Cram::NumDataSeries];
+        VariableSizeVector<TagSeries*> tags;
+        int nTags;                      // in use in this container
+        CramBuffer tagLines;            // the tag dictionary: each line's 3 byte tag keys, then a 0
+        VariableSizeVector<TagLine> lines;
+        CramBuffer recordTags;          // the current record's keys
+        CramBuffer reference;
+        CramBuffer bases;
+        CramBuffer compressed;
+        CramBuffer header;              // compression and slice headers, as they're being put together
+        CramBuffer maps;
+        CramBuffer blocks;              // the container's blocks
+        CramBuffer output;
+        z_stream zstream;
+        Libdeflate::Compressor* libdeflate;
+    };
+
+    void encodeHeader(ThreadState* state, char* header, size_t bytes);
+
+    void encodeContainer(ThreadState* state, char* records, size_t bytes, int nRecords);
+
+    void encodeRecord(ThreadState* state, BAMAlignment* bam, int containerRef, const char* ref, _int64 refStart, _int64 refBases,
+        bool apDelta, _int32* io_lastPos);
+
+    // the index of the record's tag line, with its tags added to their series
+    int encodeTags(ThreadState* state, BAMAlignment* bam);
+
+    // add a block to state->blocks, gzipped if that's smaller
+    void putCompressedBlock(ThreadState* state, int contentId, CramBuffer* data);
+
+    static void putExternalEncoding(CramBuffer* out, int contentId);
+
+    static size_t HeaderSize(char* header, size_t bytes);
+
+    const Genome* genome;
+    const bool sorted;
+    volatile _int64 recordCounter;
+};
+
+// where a tab-prefixed field starts in a header line that isn't null terminated, or NULL
+    static const char*
+FindField(
+    const char* line,
+    size_t lineLength,
+    const char* field)
+{
+    size_t fieldLength = strlen(field);
+    for (size_t i = 0; i + fieldLength <= lineLength; i++) {
+        if (memcmp(line + i, field, fieldLength) == 0) {
+            return line + i;
+        }
+    }
+    return NULL;
+}
+
+    void*
+CramContainerEncoder::createThreadState()
+{
+    ThreadState* state = new ThreadState();
+    state->nTags = 0;
+    memset(&state->zstream, 0, sizeof(state->zstream));
+    if (deflateInit2(&state->zstream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16 /* gzip */, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        fprintf(stderr, "CramContainerEncoder: deflateInit2 failed\n");
+        soft_exit(1);
+    }
+    state->libdeflate = Libdeflate::isLoaded() ? Libdeflate::allocCompressor(6) : NULL;
+    return state;
+}
+
+    void
+CramContainerEncoder::deleteThreadState(
+    void* p)
+{
+    ThreadState* state = (ThreadState*) p;
+    deflateEnd(&state->zstream);
+    Libdeflate::freeCompressor(state->libdeflate);
+    for (int i = 0; i < state->tags.size(); i++) {
+        delete state->tags[i];
+    }
+    delete state;
+}
+
+    size_t
+CramContainerEncoder::HeaderSize(
+    char* header,
+    size_t bytes)
+{
+    BAMHeader* bamHeader = (BAMHeader*) header;
+    size_t size = bamHeader->size();
+    if (size > bytes) {
+        fprintf(stderr, "CRAM writer: BAM header isn't all in one batch\n");
+        soft_exit(1);
+    }
+    BAMHeaderRefSeq* refSeq = bamHeader->firstRefSeq();
+    for (int i = 0; i < bamHeader->n_ref(); i++) {
+        refSeq = refSeq->next();
+    }
+    return (char*) refSeq - header;
+}
+
+    size_t
+CramContainerEncoder::encodeChunk(
+    void* p,
+    char* toBuffer,
+    size_t toSize,
+    char* fromBuffer,
+    size_t fromUsed,
+    double backlog)
+{
+    ThreadState* state = (ThreadState*) p;
+    state->output.clear();
+    char* from = fromBuffer;
+    char* end = fromBuffer + fromUsed;
+
+    //
+    // The header comes in a batch of its own, ahead of any records.  A record can't start with the BAM magic number since
+    // its block size would be far too big.
+    //
+    if (fromUsed >= sizeof(BAMHeader) && ((BAMHeader*) from)->magic == BAMHeader::BAM_MAGIC) {
+        size_t headerBytes = HeaderSize(from, fromUsed);
+        encodeHeader(state, from, headerBytes);
+        from += headerBytes;
+    }
+
+    while (from < end) {
+        char* first = from;
+        int ref = ((BAMAlignment*) from)->refID;
+        int n = 0;
+        while (from < end && n < MaxContainerRecords) {
+            BAMAlignment* bam = (BAMAlignment*) from;
+            if (sorted && n > 0 && bam->refID != ref) {
+                break;
+            }
+            from += bam->size();
+            n++;
+        }
+        _ASSERT(from <= end);
+        encodeContainer(state, first, from - first, n);
+    }
+
+    if (state->output.used > toSize) {
+        fprintf(stderr, "CRAM writer: %lld bytes of containers didn't fit in a %lld byte write buffer\n", (_int64) state->output.used, (_int64) toSize);
+        soft_exit(1);
+    }
+    memcpy(toBuffer, state->output.data, state->output.used);
+    return state->output.used;
+}
+
+    void
+CramContainerEncoder::encodeHeader(
+    ThreadState* state,
+    char* header,
+    size_t bytes)
+{
+    BAMHeader* bamHeader = (BAMHeader*) header;
+
+    //
+    // The file definition: magic number, version 3.0 and a 20 byte file id, which we leave empty.
+    //
+    state->output.append(Cram::FileMagic, sizeof(Cram::FileMagic));
+    state->output.putByte(3);
+    state->output.putByte(0);
+    memset(state->output.reserve(20), 0, 20);
+    state->output.used += 20;
+
+    //
+    // The SAM header goes into a container of its own.  CRAM wants an M5 tag on every @SQ line, the MD5 of the upper case
+    // contig, so that readers can check that they have the right reference.
+    //
+    CramBuffer& text = state->header;
+    text.clear();
+    text.putInt32(0);   // the length, filled in below
+    const char* p = bamHeader->text();
+    const char* textEnd = p + bamHeader->l_text;
+    while (p < textEnd && *p != 0) {
+        const char* lineEnd = (const char*) memchr(p, '\n', textEnd - p);
+        if (lineEnd == NULL) {
+            lineEnd = textEnd;
+        }
+        size_t lineLength = lineEnd - p;
+        while (lineLength > 0 && (p[lineLength - 1] == '\r' || p[lineLength - 1] == 0)) {
+            lineLength--;
+        }
+        text.append(p, lineLength);
+        if (lineLength > 4 && memcmp(p, "@SQ\t", 4) == 0 && FindField(p, lineLength, "\tM5:") == NULL) {
+            const char* name = FindField(p, lineLength, "\tSN:");
+            if (name != NULL) {
+                name += 4;
+                size_t nameLength = 0;
+                while (name + nameLength < p + lineLength && name[nameLength] != '\t') {
+                    nameLength++;
+                }
+                char* contigName = new char[nameLength + 1];
+                memcpy(contigName, name, nameLength);
+                contigName[nameLength] = 0;
+                GenomeLocation offset;
+                if (genome->getOffsetOfContig(contigName, &offset)) {
+                    int contig = (int) (genome->getContigAtLocation(offset) - genome->getContigs());
+                    Cram::Md5 md5;
+                    static const _int64 Piece = 1 << 20;
+                    char* bases = new char[Piece];
+                    _int64 length = Cram::ContigLength(genome, contig);
+                    for (_int64 pos = 0; pos < length; pos += Piece) {
+                        _int64 n = Cram::CopyReference(genome, contig, pos, Piece, bases);
+                        md5.update(bases, (size_t) n);
+                    }
+                    delete [] bases;
+                    _uint8 digest[16];
+                    md5.final(digest);
+                    char m5[4 + 32 + 1];
+                    strcpy(m5, "\tM5:");
+                    for (int i = 0; i < 16; i++) {
+                        sprintf(m5 + 4 + 2 * i, "%02x", digest[i]);
+                    }
+                    text.append(m5, strlen(m5));
+                }
+                delete [] contigName;
+            }
+        }
+        text.putByte('\n');
+        p = lineEnd + 1;
+    }
+    _int32 textLength = (_int32) (text.used - 4);
+    memcpy(text.data, &textLength, 4);
+
+    state->blocks.clear();
+    Cram::putBlock(&state->blocks, Cram::RawMethod, Cram::FileHeaderContent, 0, text.data, text.used, text.used);
+    Cram::ContainerHeader container;
+    memset(&container, 0, sizeof(container));
+    container.length = (_int32) state->blocks.used;
+    container.nBlocks = 1;
+    Cram::putContainerHeader(&state->output, container, NULL);
+    state->output.append(state->blocks.data, state->blocks.used);
+}
+
+    void
+CramContainerEncoder::encodeContainer(
+    ThreadState* state,
+    char* records,
+    size_t bytes,
+    int nRecords)
+{
+    //
+    // One reference (or all unmapped), or a mix, in which case each record says which.  The single reference case is the
+    // one that sorted output gets, and its positions are written as deltas from the previous record.
+    //
+    BAMAlignment* first = (BAMAlignment*) records;
+    int ref = first->refID;
+    bool singleRef = true;
+    bool ascending = true;
+    _int64 minPos = INT64_MAX, maxEnd = 0, bases = 0;
+    _int32 lastPos = first->pos;
+    for (char* p = records; p < records + bytes; ) {
+        BAMAlignment* bam = (BAMAlignment*) p;
+        if (bam->refID >= genome->getNumContigs()) {
+            fprintf(stderr, "CRAM writer: record has reference id %d, but the genome has only %d contigs\n", bam->refID, genome->getNumContigs());
+            soft_exit(1);
+        }
+        singleRef &= bam->refID == ref;
+        ascending &= bam->pos >= lastPos;
+        lastPos = bam->pos;
+        if (bam->pos >= 0) {
+            minPos = min(minPos, (_int64) bam->pos);
+            maxEnd = max(maxEnd, (_int64) bam->pos + max(1, Cram::ReferenceLength(bam)));
+        }
+        bases += bam->l_seq;
+        p += bam->size();
+    }
+    int containerRef = ! singleRef ? Cram::MultipleRefs : ref < 0 ? Cram::UnmappedRef : ref;
+    _int32 start = 0, span = 0;
+    if (containerRef >= 0 && minPos < maxEnd) {
+        maxEnd = min(maxEnd, Cram::ContigLength(genome, containerRef));
+        start = (_int32) (minPos + 1);
+        span = (_int32) max((_int64) 0, maxEnd - minPos);
+    }
+    bool apDelta = containerRef >= 0 && ascending;
+
+    //
+    // The slice's reference, for single reference containers; the others look up each record's as they go.
+    //
+    _uint8 md5[16];
+    memset(md5, 0, sizeof(md5));
+    _int64 refBases = 0;
+    if (span > 0) {
+        state->reference.clear();
+        refBases = Cram::CopyReference(genome, containerRef, start - 1, span, (char*) state->reference.reserve(span));
+        span = (_int32) refBases;
+        Cram::Md5 digest;
+        digest.update(state->reference.data, (size_t) refBases);
+        digest.final(md5);
+    }
+
+    for (int i = 0; i < Cram::NumDataSeries; i++) {
+        state->series[i].clear();
+    }
+    for (int i = 0; i < state->nTags; i++) {
+        state->tags[i]->data.clear();
+    }
+    state->nTags = 0;
+    state->tagLines.clear();
+    state->lines.clear();
+
+    _int32 apLast = start;
+    for (char* p = records; p < records + bytes; ) {
+        BAMAlignment* bam = (BAMAlignment*) p;
+        encodeRecord(state, bam, containerRef, (const char*) state->reference.data, start - 1, refBases, apDelta, &apLast);
+        p += bam->size();
+    }
+
+    //
+    // The compression header: the preservation map, then the encodings of the data series and the tags.
+    //
+    CramBuffer& header = state->header;
+    CramBuffer& map = state->maps;
+    header.clear();
+    map.clear();
+    map.append("RN", 2);
+    map.putByte(1);
+    map.append("AP", 2);
+    map.putByte(apDelta ? 1 : 0);
+    map.append("RR", 2);
+    map.putByte(1);
+    map.append("SM", 2);
+    map.append(Cram::SubstitutionMatrix, sizeof(Cram::SubstitutionMatrix));
+    map.append("TD", 2);
+    map.putITF8((_int32) state->tagLines.used);
+    map.append(state->tagLines.data, state->tagLines.used);
+    header.putITF8((_int32) map.used + 1);
+    header.putByte(5);      // entries
+    header.append(map.data, map.used);
+
+    map.clear();
+    int nSeries = 0;
+    for (int i = 0; i < Cram::NumDataSeries; i++) {
+        if (i == Cram::NF || i == Cram::BB || i == Cram::QQ) {
+            continue;   // never written
+        }
+        map.append(Cram::DataSeriesKeys[i], 2);
+        if (i == Cram::RN || i == Cram::IN || i == Cram::SC) {
+            CramBuffer id;
+            id.putITF8(i + 1);
+            map.putITF8(Cram::ByteArrayStopEncoding);
+            map.putITF8((_int32) id.used + 1);
+            map.putByte(0);
+            map.append(id.data, id.used);
+        } else {
+            putExternalEncoding(&map, i + 1);
+        }
+        nSeries++;
+    }
+    CramBuffer count;
+    count.putITF8(nSeries);
+    header.putITF8((_int32) (count.used + map.used));
+    header.append(count.data, count.used);
+    header.append(map.data, map.used);
+
+    map.clear();
+    for (int i = 0; i < state->nTags; i++) {
+        map.putITF8(state->tags[i]->key);
+        CramBuffer encodings;
+        putExternalEncoding(&encodings, state->tags[i]->key);   // lengths and values share the tag's block
+        putExternalEncoding(&encodings, state->tags[i]->key);
+        map.putITF8(Cram::ByteArrayLenEncoding);
+        map.putITF8((_int32) encodings.used);
+        map.append(encodings.data, encodings.used);
+    }
+    count.clear();
+    count.putITF8(state->nTags);
+    header.putITF8((_int32) (count.used + map.used));
+    header.append(count.data, count.used);
+    header.append(map.data, map.used);
+
+    state->blocks.clear();
+    Cram::putBlock(&state->blocks, Cram::RawMethod, Cram::CompressionHeaderContent, 0, header.data, header.used, header.used);
+    _int32 landmark = (_int32) state->blocks.used;
+
+    //
+    // The slice header, then the (empty) core block and the external blocks.
+    //
+    int nExternal = 0;
+    for (int i = 0; i < Cram::NumDataSeries; i++) {
+        nExternal += state->series[i].used > 0;
+    }
+    for (int i = 0; i < state->nTags; i++) {
+        nExternal += state->tags[i]->data.used > 0;
+    }
+    _int64 counter = InterlockedAdd64AndReturnNewValue(&recordCounter, nRecords) - nRecords;
+    header.clear();
+    header.putITF8(containerRef);
+    header.putITF8(start);
+    header.putITF8(span);
+    header.putITF8(nRecords);
+    header.putLTF8(counter);
+    header.putITF8(1 + nExternal);
+    header.putITF8(1 + nExternal);
+    header.putITF8(0);
+    for (int i = 0; i < Cram::NumDataSeries; i++) {
+        if (state->series[i].used > 0) {
+            header.putITF8(i + 1);
+        }
+    }
+    for (int i = 0; i < state->nTags; i++) {
+        if (state->tags[i]->data.used > 0) {
+            header.putITF8(state->tags[i]->key);
+        }
+    }
+    header.putITF8(-1);     // no embedded reference
+    header.append(md5, sizeof(md5));
+    Cram::putBlock(&state->blocks, Cram::RawMethod, Cram::SliceHeaderContent, 0, header.data, header.used, header.used);
+    Cram::putBlock(&state->blocks, Cram::RawMethod, Cram::CoreContent, 0, NULL, 0, 0);
+    for (int i = 0; i < Cram::NumDataSeries; i++) {
+        if (state->series[i].used > 0) {
+            putCompressedBlock(state, i + 1, &state->series[i]);
+        }
+    }
+    for (int i = 0; i < state->nTags; i++) {
+        if (state->tags[i]->data.used > 0) {
+            putCompressedBlock(state, state->tags[i]->key, &state->tags[i]->data);
+        }
+    }
+
+    Cram::ContainerHeader container;
+    container.length = (_int32) state->blocks.used;
+    container.refId = containerRef;
+    container.start = start;
+    container.span = span;
+    container.nRecords = nRecords;
+    container.recordCounter = counter;
+    container.bases = bases;
+    container.nBlocks = 3 + nExternal;
+    container.nLandmarks = 1;
+    Cram::putContainerHeader(&state->output, container, &landmark);
+    state->output.append(state->blocks.data, state->blocks.used);
+}
+
+    void
+CramContainerEncoder::putExternalEncoding(
+    CramBuffer* out,
+    int contentId)
+{
+    CramBuffer id;
+    id.putITF8(contentId);
+    out->putITF8(Cram::ExternalEncoding);
+    out->putITF8((_int32) id.used);
+    out->append(id.data, id.used);
+}
+
+    void
+CramContainerEncoder::putCompressedBlock(
+    ThreadState* state,
+    int contentId,
+    CramBuffer* data)
+{
+    size_t room = data->used + data->used / 8 + 1024;
+    _uint8* to = state->compressed.reserve(room);
+    size_t compressed = 0;
+    if (state->libdeflate != NULL) {
+        compressed = Libdeflate::compress(state->libdeflate, false, (const char*) data->data, data->used, (char*) to, room);
+    } else {
+        deflateReset(&state->zstream);
+        state->zstream.next_in = data->data;
+        state->zstream.avail_in = (uInt) data->used;
+        state->zstream.next_out = to;
+        state->zstream.avail_out = (uInt) room;
+        if (deflate(&state->zstream, Z_FINISH) == Z_STREAM_END) {
+            compressed = room - state->zstream.avail_out;
+        }
+    }
+    if (compressed > 0 && compressed < data->used) {
+        Cram::putBlock(&state->blocks, Cram::GzipMethod, Cram::ExternalContent, contentId, to, compressed, data->used);
+    } else {
+        Cram::putBlock(&state->blocks, Cram::RawMethod, Cram::ExternalContent, contentId, data->data, data->used, data->used);
+    }
+}
+
+    int
+CramContainerEncoder::encodeTags(
+    ThreadState* state,
+    BAMAlignment* bam)
+{
+    state->recordTags.clear();
+    char* end = (char*) bam->endAux();
+    for (char* p = (char*) bam->firstAux(); p + 3 < end; ) {
+        BAMAlignAux* aux = (BAMAlignAux*) p;
+        size_t valueBytes;
+        switch (aux->val_type) {
+        case STRING_VAL_TYPE:
+        case HEX_VAL_TYPE:
+        {
+            const char* terminator = (const char*) memchr(aux->value(), 0, end - (char*) aux->value());
+            valueBytes = (terminator == NULL ? end : terminator + 1) - (char*) aux->value();
+            break;
+        }
+        case ARRAY_VAL_TYPE:
+            valueBytes = aux->size() - 3;
+            break;
+        default:
+            valueBytes = BAMAlignAux::valueSize(aux->val_type);
+            break;
+        }
+        valueBytes = min(valueBytes, (size_t) (end - (char*) aux->value()));
+
+        _int32 key = (aux->tag[0] << 16) | (aux->tag[1] << 8) | (_uint8) aux->val_type;
+        TagSeries* series = NULL;
+        for (int i = 0; i < state->nTags; i++) {
+            if (state->tags[i]->key == key) {
+                series = state->tags[i];
+                break;
+            }
+        }
+        if (series == NULL) {
+            if (state->nTags == state->tags.size()) {
+                state->tags.push_back(new TagSeries());
+            }
+            series = state->tags[state->nTags++];
+            series->key = key;
+            _ASSERT(series->data.used == 0);
+        }
+        series->data.putITF8((_int32) valueBytes);
+        series->data.append(aux->value(), valueBytes);
+        state->recordTags.append(aux, 3);
+        p = (char*) aux->value() + valueBytes;
+    }
+
+    int nTags = (int) (state->recordTags.used / 3);
+    for (int i = 0; i < state->lines.size(); i++) {
+        if (state->lines[i].nTags == nTags && memcmp(state->tagLines.data + state->lines[i].offset, state->recordTags.data, 3 * nTags) == 0) {
+            return i;
+        }
+    }
+    TagLine line;
+    line.offset = state->tagLines.used;
+    line.nTags = nTags;
+    state->lines.push_back(line);
+    state->tagLines.append(state->recordTags.data, state->recordTags.used);
+    state->tagLines.putByte(0);
+    return state->lines.size() - 1;
+}
+
+    void
+CramContainerEncoder::encodeRecord(
+    ThreadState* state,
+    BAMAlignment* bam,
+    int containerRef,
+    const char* ref,
+    _int64 refStart,
+    _int64 refBases,
+    bool apDelta,
+    _int32* io_lastPos)
+{
+    CramBuffer* series = state->series;
+    bool hasQualities = bam->l_seq > 0 && (_uint8) bam->qual()[0] != 0xff;
+    int cf = Cram::Detached | (hasQualities ? Cram::QualityAsArray : 0) | (bam->l_seq == 0 ? Cram::UnknownBases : 0);
+    series[Cram::BF].putITF8(bam->FLAG);
+    series[Cram::CF].putITF8(cf);
+    if (containerRef == Cram::MultipleRefs) {
+        series[Cram::RI].putITF8(bam->refID);
+    }
+    series[Cram::RL].putITF8(bam->l_seq);
+    _int32 pos = bam->pos + 1;
+    series[Cram::AP].putITF8(apDelta ? pos - *io_lastPos : pos);
+    *io_lastPos = pos;
+    series[Cram::RG].putITF8(-1);   // read groups stay in RG tags
+    series[Cram::RN].append(bam->read_name(), max(0, bam->l_read_name - 1));
+    series[Cram::RN].putByte(0);
+    series[Cram::MF].putITF8(((bam->FLAG & SAM_NEXT_REVERSED) ? Cram::MateReverse : 0) | ((bam->FLAG & SAM_NEXT_UNMAPPED) ? Cram::MateUnmapped : 0));
+    series[Cram::NS].putITF8(bam->next_refID);
+    series[Cram::NP].putITF8(bam->next_pos + 1);
+    series[Cram::TS].putITF8(bam->tlen);
+    series[Cram::TL].putITF8(encodeTags(state, bam));
+
+    char* bases = (char*) state->bases.reserve(bam->l_seq + 32);
+    BAMAlignment::decodeSeq(bases, bam->seq(), bam->l_seq);
+    const _uint8* qualities = (const _uint8*) bam->qual();
+
+    if (bam->FLAG & SAM_UNMAPPED) {
+        series[Cram::BA].append(bases, bam->l_seq);
+    } else {
+        //
+        // Multiple reference containers look up each record's reference.
+        //
+        if (containerRef == Cram::MultipleRefs) {
+            int length = Cram::ReferenceLength(bam);
+            state->reference.clear();
+            refStart = bam->pos;
+            refBases = Cram::CopyReference(genome, bam->refID, bam->pos, length, (char*) state->reference.reserve(length + 1));
+            ref = (const char*) state->reference.data;
+        }
+
+        //
+        // The read features, with each one's position in the read as a delta from the one before.
+        //
+        int nFeatures = 0;
+        int lastFeature = 0;
+        int readPos = 0;
+        _int64 refPos = bam->pos;
+        _uint32* cigar = bam->cigar();
+#define FEATURE(code, at) \
+        series[Cram::FC].putByte(code); series[Cram::FP].putITF8((at) + 1 - lastFeature); lastFeature = (at) + 1; nFeatures++;
+        for (int i = 0; i < bam->n_cigar_op; i++) {
+            int op = BAMAlignment::GetCigarOpCode(cigar[i]);
+            int count = BAMAlignment::GetCigarOpCount(cigar[i]);
+            switch (op) {
+            case 0: // M
+            case 7: // =
+            case 8: // X
+                for (int j = 0; j < count && readPos + j < bam->l_seq; j++) {
+                    _int64 refIndex = refPos + j - refStart;
+                    char readBase = bases[readPos + j];
+                    if (refIndex >= 0 && refIndex < refBases) {
+                        char refBase = ref[refIndex];
+                        if (readBase == refBase || readBase == '=') {
+                            continue;
+                        }
+                        int r = Cram::BaseIndex(refBase), b = Cram::BaseIndex(readBase);
+                        if (r >= 0 && b >= 0) {
+                            FEATURE('X', readPos + j);
+                            series[Cram::BS].putByte((_uint8) (b < r ? b : b - 1));
+                            continue;
+                        }
+                    }
+                    FEATURE('B', readPos + j);
+                    series[Cram::BA].putByte(readBase);
+                    series[Cram::QS].putByte(qualities[readPos + j]);
+                }
+                readPos += count;
+                refPos += count;
+                break;
+
+            case 1: // I
+            case 4: // S
+            {
+                int n = max(0, min(count, bam->l_seq - readPos));
+                FEATURE(op == 1 ? 'I' : 'S', readPos);
+                CramBuffer* to = &series[op == 1 ? Cram::IN : Cram::SC];
+                to->append(bases + readPos, n);
+                to->putByte(0);
+                readPos += count;
+                break;
+            }
+
+            case 2: // D
+            case 3: // N
+                FEATURE(op == 2 ? 'D' : 'N', readPos);
+                series[op == 2 ? Cram::DL : Cram::RS].putITF8(count);
+                refPos += count;
+                break;
+
+            case 5: // H
+                FEATURE('H', readPos);
+                series[Cram::HC].putITF8(count);
+                break;
+
+            case 6: // P
+                FEATURE('P', readPos);
+                series[Cram::PD].putITF8(count);
+                break;
+            }
+        }
+#undef FEATURE
+        series[Cram::FN].putITF8(nFeatures);
+        series[Cram::MQ].putITF8(bam->MAPQ);
+    }
+    if (hasQualities) {
+        series[Cram::QS].append(qualities, bam->l_seq);
+    }
+}
+
+//
+// CRAM output has no filtering of its own; its supplier just ends the file with an EOF container when it's closed.
+//
+class CramWriterFilter : public DataWriter::Filter
+{
+public:
+    CramWriterFilter() : DataWriter::Filter(DataWriter::ReadFilter) {}
+
+    virtual void onAdvance(DataWriter* writer, size_t batchOffset, char* data, unsigned bytes, GenomeLocation location) {}
+
+    virtual size_t onNextBatch(DataWriter* writer, size_t offset, size_t bytes) { return bytes; }
+};
+
+class CramWriterFilterSupplier : public DataWriter::FilterSupplier
+{
+public:
+    CramWriterFilterSupplier() : FilterSupplier(DataWriter::ReadFilter) {}
+
+    virtual DataWriter::Filter* getFilter() { return new CramWriterFilter(); }
+
+    virtual void onClosing(DataWriterSupplier* supplier);
+
+    virtual void onClosed(DataWriterSupplier* supplier) {}
+};
+
+    void
+CramWriterFilterSupplier::onClosing(
+    DataWriterSupplier* supplier)
+{
+    // a closing supplier's writers have no encoder, so this goes out as is
+    DataWriter* writer = supplier->getWriter();
+    char* buffer;
+    size_t bytes;
+    if (! (writer->getBuffer(&buffer, &bytes) && bytes >= sizeof(Cram::EofContainer))) {
+        fprintf(stderr, "no space to write CRAM end of file container\n");
+        soft_exit(1);
+    }
+    memcpy(buffer, Cram::EofContainer, sizeof(Cram::EofContainer));
+    writer->advance(sizeof(Cram::EofContainer));
+    writer->close();
+    delete writer;
+}
+
+    DataWriter::FilterSupplier*
+DataWriterSupplier::cram()
+{
+    return new CramWriterFilterSupplier();
+}
+
+    FileEncoder*
+FileEncoder::cram(
+    const Genome* genome,
+    bool sorted)
+{
+    return new FileEncoder(new CramContainerEncoder(genome, sorted));
+}
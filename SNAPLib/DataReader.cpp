@@ -25,7 +25,22 @@ Environment:
 #include "DataReader.h"
 #include "Bam.h"
 #include "zlib.h"
+#include "Libdeflate.h"
+#include "GenericFile.h"
 #include "exit.h"
+#include "TraceRecorder.h"
+
+#ifdef __linux__
+#include <aio.h>
+#include <poll.h>
+#endif
+
+#ifdef __APPLE__
+#include <dispatch/dispatch.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 using std::max;
 using std::min;
@@ -40,6 +55,11 @@ using std::string;
 // This class contains the generic implementation, it must be subclassed to implement
 // startIo() and waitForBuffer(), which do the actual IO.
 //
+// How far ahead of the consumer it reads adapts to the storage: every time nextBatch has to wait for a read the
+// read-ahead doubles (adding buffers if it needs them, up to maxBuffers), and each run of batches that never waited
+// lets it back down by one.  Slow or far away storage ends up with many reads going, and fast local storage with few,
+// so the buffers it never needs are never touched.
+//
 class ReadBasedDataReader : public DataReader
 {
 public:
@@ -81,8 +101,21 @@ protected:
     // must hold the lock to call
     virtual void addBuffer();
 
+    // must hold the lock to call; the buffers that are being read or are waiting for the consumer
+    unsigned buffersAhead();
+
+    // must hold the lock to call; whether startIo should start filling another buffer
+    bool shouldReadAhead()
+    {
+        return nextBufferForReader != -1 && buffersAhead() < readAhead;
+    }
+
     static const unsigned bufferSize = 4 * 1024 * 1024 - 4096;
 
+    static const unsigned MinReadAhead = 2;             // the buffer the consumer's on and one being read
+    static const _int64 ReadAheadWaitNanos = 100000;    // a wait for input longer than this means the reads fell behind
+    static const unsigned QuietBatchesToShrink = 16;    // batches in a row without a wait before reading less ahead
+
     enum BufferState {Empty, Reading, Full, InUse};
 
     struct BufferInfo
@@ -101,6 +134,8 @@ protected:
 
     unsigned            nBuffers;
     const unsigned      maxBuffers;
+    unsigned            readAhead;      // the most buffers to have reading or waiting for the consumer at once
+    unsigned            quietBatches;   // since the consumer last waited for a read
     _int64              extraBytes;
     _int64              overflowBytes;
     BufferInfo*         bufferInfo;
@@ -121,7 +156,10 @@ ReadBasedDataReader::ReadBasedDataReader(
     _int64 i_overflowBytes,
     double extraFactor,
     bool autoRelease)
-    : DataReader(autoRelease), nBuffers(i_nBuffers), overflowBytes(i_overflowBytes), maxBuffers(4 * i_nBuffers)
+    : DataReader(autoRelease), nBuffers(i_nBuffers), overflowBytes(i_overflowBytes),
+      maxBuffers(DataSupplier::MaxReadBufferBytes == 0 ? 4 * i_nBuffers :
+        max(i_nBuffers, (unsigned) (DataSupplier::MaxReadBufferBytes / ((bufferSize + i_overflowBytes) * (1.0 + extraFactor))))),
+      readAhead(min(i_nBuffers, 2 * MinReadAhead)), quietBatches(0)
 {
     //
     // Initialize the buffer info struct.
@@ -289,11 +327,35 @@ ReadBasedDataReader::nextBatch()
             }
         }
         first = false;
-        startIo();
         AcquireExclusiveLock(&lock);
+        startIo();
     }
+    bool waited = false;
     if (bufferInfo[nextBufferForConsumer].state != Full) {
+        _int64 start = timeInNanos();
         waitForBuffer(nextBufferForConsumer);
+        waited = timeInNanos() - start > ReadAheadWaitNanos;    // a read that's done but not yet collected is quick
+    }
+    if (waited) {
+        quietBatches = 0;
+        if (readAhead < maxBuffers) {
+            //
+            // Read further ahead.  The consumers may be holding on to most of the buffers, so add as many as it takes
+            // to have something to read into.
+            //
+            readAhead = min(maxBuffers, 2 * readAhead);
+            unsigned ahead = buffersAhead(), free = 0;
+            for (int i = nextBufferForReader; i != -1; i = bufferInfo[i].next) {
+                free++;
+            }
+            for (; ahead + free < readAhead && nBuffers < maxBuffers; free++) {
+                addBuffer();
+            }
+            startIo();
+        }
+    } else if (++quietBatches >= QuietBatchesToShrink) {
+        readAhead = max(MinReadAhead, readAhead - 1);
+        quietBatches = 0;
     }
     bufferInfo[nextBufferForConsumer].offset = overflow;
     //fprintf(stderr,"emitting buffer starting at 0x%llx\n", info->fileOffset);
@@ -397,6 +459,18 @@ ReadBasedDataReader::getExtra(
 }
     
 
+    unsigned
+ReadBasedDataReader::buffersAhead()
+{
+    unsigned ahead = 0;
+    for (int i = nextBufferForConsumer; i != -1; i = bufferInfo[i].next) {
+        if (bufferInfo[i].state != InUse) {
+            ahead++;
+        }
+    }
+    return ahead;
+}
+
     void
 ReadBasedDataReader::addBuffer()
 {
@@ -440,6 +514,8 @@ public:
 
     virtual char* readHeader(_int64* io_headerSize);
 
+    virtual bool isDataReady();
+
  protected:
     
     // must hold the lock to call
@@ -449,6 +525,8 @@ public:
     virtual void waitForBuffer(unsigned bufferNumber);
 
 private:
+    size_t readStdin(char* buffer, size_t amountToRead, bool* o_eof);
+
     //
     // Because reads don't necessarily divide evenly into buffers, we have to assure that
     // the buffers that we read can overlap.  In file-IO based readers, we do this by reading
@@ -498,6 +576,13 @@ StdioDataReader::init(const char * i_fileName)
     }
 #endif // _MSC_VER
 
+    if (DataSupplier::StreamStdin) {
+        //
+        // readStdin goes around stdio to get at whatever has arrived, so stdio mustn't have read ahead of it.
+        //
+        setvbuf(stdin, NULL, _IONBF, 0);
+    }
+
     return true;
 }
 
@@ -548,16 +633,56 @@ StdioDataReader::readHeader(_int64 *io_headerSize)
     return info->buffer;
 }
 
+//
+// Whether a read from stdin would return straight away.  Where we can't tell, say no, so that streaming only waits for
+// input when it has nothing else to hand on.
+//
+    static bool
+StdinHasInput()
+{
+#ifdef __linux__
+    struct pollfd pending;
+    pending.fd = fileno(stdin);
+    pending.events = POLLIN;
+    return poll(&pending, 1, 0) > 0;
+#else
+    return false;
+#endif
+}
+
+    bool
+StdioDataReader::isDataReady()
+{
+    if (! DataSupplier::StreamStdin) {
+        return true;
+    }
+    //
+    // Either there's more in this buffer, or nextBatch has a filled one to move on to (or the end of the input to
+    // report), or stdin has something for it to read.
+    //
+    AcquireExclusiveLock(&lock);
+    bool ready = hitEOF;
+    if (! ready && nextBufferForConsumer != -1) {
+        BufferInfo* info = &bufferInfo[nextBufferForConsumer];
+        ready = info->isEOF || info->offset < info->nBytesThatMayBeginARead || info->next != -1;
+    }
+    ReleaseExclusiveLock(&lock);
+    return ready || StdinHasInput();
+}
+
 void
 StdioDataReader::startIo()
 {
     started = true;
 
     //
-    // Synchronously read data into whatever buffers are ready.
+    // Synchronously read data into whatever buffers are ready.  When streaming, only wait for input if the consumer
+    // doesn't have any buffers yet; otherwise just take what has already arrived.
     //
-    AcquireExclusiveLock(&lock);
-    while (nextBufferForReader != -1) {
+    while (shouldReadAhead()) {
+        if (DataSupplier::StreamStdin && nextBufferForConsumer != -1 && ! hitEOF && ! StdinHasInput()) {
+            break;
+        }
         // remove from free list
         BufferInfo* info = &bufferInfo[nextBufferForReader];
         _ASSERT(info->state == Empty);
@@ -582,7 +707,6 @@ StdioDataReader::startIo()
             info->nBytesThatMayBeginARead = 0;
             info->isEOF = true;
             info->state = Full;
-            ReleaseExclusiveLock(&lock);
             return;
         }
 
@@ -606,22 +730,14 @@ StdioDataReader::startIo()
         // We have to run this holding the lock, because otherwise there's no way to make the overflow buffer work properly.  
         //
 
-        size_t bytesRead = fread(info->buffer + bufferOffset, 1, amountToRead, stdin);
+        bool eof;
+        size_t bytesRead = readStdin(info->buffer + bufferOffset, amountToRead, &eof);
         //fprintf(stderr,"StdioDataReader:startIO(): Read offset 0x%llx into buffer at 0x%llx, size %d, copied 0x%x overflow bytes, start at 0x%llx, tid %d\n", readOffset, info->buffer, bytesRead, bufferOffset, readOffset - bufferOffset, GetCurrentThreadId());
 
         readOffset += bytesRead;
 
-        if (bytesRead != amountToRead) {
-            if (feof(stdin)) {
-                info->isEOF = true;
-                hitEOF = true;
-            } else {
-                fprintf(stderr,"StdinDataReader: Error reading stdin (but not EOF).\n");
-                soft_exit(1);
-            }
-        } else {
-            info->isEOF = false;
-        }
+        info->isEOF = eof;
+        hitEOF = eof;
 
         info->validBytes = (unsigned)(bytesRead + bufferOffset);
 
@@ -643,9 +759,60 @@ StdioDataReader::startIo()
         //fprintf(stderr, "startIo thread %x reset releaseEvent\n", GetCurrentThreadId());
         PreventEventWaitersFromProceeding(&releaseEvent);
     }
-    ReleaseExclusiveLock(&lock);
 }
  
+//
+// Reads up to amountToRead bytes from stdin.  Ordinarily that waits for all of them (or EOF).  When streaming, it only
+// waits for more than overflowBytes, which is enough for the buffer to begin a read past the part that overlaps the
+// next one, and beyond that takes only what has already arrived, so buffers are small when the input is trickling in
+// and full when it's keeping up.
+//
+    size_t
+StdioDataReader::readStdin(
+    char* buffer,
+    size_t amountToRead,
+    bool* o_eof)
+{
+    *o_eof = false;
+    if (! DataSupplier::StreamStdin) {
+        size_t bytesRead = fread(buffer, 1, amountToRead, stdin);
+        if (bytesRead != amountToRead) {
+            if (! feof(stdin)) {
+                fprintf(stderr,"StdinDataReader: Error reading stdin (but not EOF).\n");
+                soft_exit(1);
+            }
+            *o_eof = true;
+        }
+        return bytesRead;
+    }
+
+    int fd = fileno(stdin);
+    size_t bytesRead = 0;
+    while (bytesRead < amountToRead) {
+        if (bytesRead > (size_t) overflowBytes && ! StdinHasInput()) {
+            break;
+        }
+#ifdef _MSC_VER
+        int n = _read(fd, buffer + bytesRead, (unsigned) __min(amountToRead - bytesRead, (size_t) INT_MAX));
+#else
+        ssize_t n = read(fd, buffer + bytesRead, amountToRead - bytesRead);
+#endif
+        if (n == 0) {
+            *o_eof = true;
+            break;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr,"StdinDataReader: Error reading stdin (but not EOF).\n");
+            soft_exit(1);
+        }
+        bytesRead += n;
+    }
+    return bytesRead;
+}
+
     void
 StdioDataReader::waitForBuffer(
     unsigned bufferNumber)
@@ -738,101 +905,1072 @@ public:
     // must hold the lock to call
     virtual void waitForBuffer(unsigned bufferNumber);
 
-    // must hold the lock to call
-    virtual void addBuffer();
+    // must hold the lock to call
+    virtual void addBuffer();
+
+    OVERLAPPED          *bufferLaps;
+
+    const char*         fileName;
+    LARGE_INTEGER       fileSize;
+    HANDLE              hFile;
+  
+    LARGE_INTEGER       readOffset;
+    _int64              endingOffset;
+
+};
+
+WindowsOverlappedDataReader::WindowsOverlappedDataReader(unsigned i_nBuffers, _int64 i_overflowBytes, double extraFactor, bool autoRelease) :
+    ReadBasedDataReader(i_nBuffers, i_overflowBytes, extraFactor, autoRelease), fileName(NULL), hFile(INVALID_HANDLE_VALUE), endingOffset(0)
+{
+    readOffset.QuadPart = 0;
+    bufferLaps = (OVERLAPPED *)BigAlloc(sizeof(OVERLAPPED) * i_nBuffers);
+    for (unsigned i = 0; i < i_nBuffers; i++) {
+        bufferLaps[i].hEvent = CreateEvent(NULL,TRUE,FALSE,NULL);
+        if (NULL == bufferLaps[i].hEvent) {
+            fprintf(stderr,"WindowsOverlappedDataReader: Unable to create event\n");
+            soft_exit(1);
+        }
+    }
+}
+
+WindowsOverlappedDataReader::~WindowsOverlappedDataReader()
+{
+    for (unsigned i = 0; i < nBuffers; i++) {
+       CloseHandle(bufferLaps[i].hEvent);
+    }
+    BigDealloc(bufferLaps);
+    bufferLaps = NULL;
+    CloseHandle(hFile);
+}
+
+bool
+WindowsOverlappedDataReader::init(const char* i_fileName)
+{
+    fileName = i_fileName;
+    hFile = CreateFile(fileName,GENERIC_READ,FILE_SHARE_READ,NULL,OPEN_EXISTING,FILE_FLAG_OVERLAPPED,NULL);
+    if (INVALID_HANDLE_VALUE == hFile) {
+        return false;
+    }
+
+    if (!GetFileSizeEx(hFile,&fileSize)) {
+        fprintf(stderr,"WindowsOverlappedDataReader: unable to get file size of '%s', %d\n",fileName,GetLastError());
+        return false;
+    }
+    return true;
+}
+
+    char*
+WindowsOverlappedDataReader::readHeader(
+    _int64* io_headerSize)
+{
+    BufferInfo *info = &bufferInfo[0];
+    info->fileOffset = 0;
+    info->offset = 0;
+    bufferLaps[0].Offset = 0;
+    bufferLaps[0].OffsetHigh = 0;
+    _ASSERT(nextBufferForReader == 0 && nextBufferForConsumer == -1 && lastBufferForConsumer == -1 && info->next == 1 && info->previous == -1);
+    nextBufferForReader = 1;
+    nextBufferForConsumer = lastBufferForConsumer = 0;
+    info->next = info->previous = -1;
+
+    if (*io_headerSize > bufferSize) {
+        fprintf(stderr,"WindowsOverlappedDataReader: trying to read too many bytes at once: %lld\n", *io_headerSize);
+        soft_exit(1);
+    }
+
+    if (!ReadFile(hFile,info->buffer,(DWORD)*io_headerSize,(DWORD *)&info->validBytes,&bufferLaps[0])) {
+        if (GetLastError() != ERROR_IO_PENDING) {
+            fprintf(stderr,"WindowsOverlappedReader::init: unable to read header of '%s', %d\n",fileName,GetLastError());
+            return NULL;
+        }
+    }
+
+    if (!GetOverlappedResult(hFile,&bufferLaps[0], (DWORD *)&info->validBytes,TRUE)) {
+        fprintf(stderr,"WindowsOverlappedReader::init: error reading header of '%s', %d\n",fileName,GetLastError());
+        return NULL;
+    }
+
+    *io_headerSize = info->validBytes;
+    return info->buffer;
+}
+
+    void
+WindowsOverlappedDataReader::reinit(
+    _int64 i_startingOffset,
+    _int64 amountOfFileToProcess)
+{
+    _ASSERT(INVALID_HANDLE_VALUE != hFile);  // Must call init() before reinit()
+
+    AcquireExclusiveLock(&lock);
+
+    //
+    // First let any pending IO complete.
+    //
+    for (unsigned i = 0; i < nBuffers; i++) {
+        if (bufferInfo[i].state == Reading) {
+            waitForBuffer(i);
+        }
+        bufferInfo[i].state = Empty;
+        bufferInfo[i].isEOF= false;
+        bufferInfo[i].offset = 0;
+        bufferInfo[i].next = i < nBuffers - 1 ? i + 1 : -1;
+        bufferInfo[i].previous = i > 0 ? i - 1 : -1;
+    }
+
+    nextBufferForConsumer = -1; 
+    lastBufferForConsumer = -1;
+    nextBufferForReader = 0;
+
+    readOffset.QuadPart = i_startingOffset;
+    if (amountOfFileToProcess == 0) {
+        //
+        // This means just read the whole file.
+        //
+        endingOffset = fileSize.QuadPart;
+    } else {
+        endingOffset = min(fileSize.QuadPart,i_startingOffset + amountOfFileToProcess);
+    }
+
+    //
+    // Kick off IO, wait for the first buffer to be read
+    //
+    startIo();
+    waitForBuffer(nextBufferForConsumer);
+
+    ReleaseExclusiveLock(&lock);
+}
+
+        void
+WindowsOverlappedDataReader::startIo()
+{
+    //
+    // Launch reads on whatever buffers are ready.
+    //
+    AcquireExclusiveLock(&lock);
+    while (shouldReadAhead()) {
+        // remove from free list
+        BufferInfo* info = &bufferInfo[nextBufferForReader];
+        OVERLAPPED *bufferLap = &bufferLaps[nextBufferForReader];
+        _ASSERT(info->state == Empty);
+        int index = nextBufferForReader;
+        nextBufferForReader = info->next;
+        info->batchID = nextBatchID++;
+        // add to end of consumer list
+        if (lastBufferForConsumer != -1) {
+            _ASSERT(bufferInfo[lastBufferForConsumer].next == -1);
+            bufferInfo[lastBufferForConsumer].next = index;
+        }
+        info->next = -1;
+        info->previous = lastBufferForConsumer;
+        lastBufferForConsumer = index;
+	if (nextBufferForConsumer == -1) {
+            nextBufferForConsumer = index;
+	}
+
+        if (readOffset.QuadPart >= fileSize.QuadPart || readOffset.QuadPart >= endingOffset) {
+            info->validBytes = 0;
+            info->nBytesThatMayBeginARead = 0;
+            info->isEOF = true;
+            info->state = Full;
+            SetEvent(bufferLap->hEvent);
+            ReleaseExclusiveLock(&lock);
+            return;
+        }
+
+        unsigned amountToRead;
+        _int64 finalOffset = min(fileSize.QuadPart, endingOffset + overflowBytes);
+        _int64 finalStartOffset = min(fileSize.QuadPart, endingOffset);
+        amountToRead = (unsigned)min(finalOffset - readOffset.QuadPart, (_int64) bufferSize);   // Cast OK because can't be longer than unsigned bufferSize
+        info->isEOF = readOffset.QuadPart + amountToRead == finalOffset;
+        info->nBytesThatMayBeginARead = (unsigned)min(bufferSize - overflowBytes, finalStartOffset - readOffset.QuadPart);
+
+        _ASSERT(amountToRead >= info->nBytesThatMayBeginARead && (!info->isEOF || finalOffset == readOffset.QuadPart + amountToRead));
+        ResetEvent(bufferLap->hEvent);
+        bufferLap->Offset = readOffset.LowPart;
+        bufferLap->OffsetHigh = readOffset.HighPart;
+        info->fileOffset = readOffset.QuadPart;
+
+        readOffset.QuadPart += info->nBytesThatMayBeginARead;
+        info->state = Reading;
+        info->offset = 0;
+         
+        //fprintf(stderr, "startIo on %d at %lld for %uB\n", index, readOffset, amountToRead);
+        ReleaseExclusiveLock(&lock);
+        if (!ReadFile(
+                hFile,
+                info->buffer,
+                amountToRead,
+                (DWORD *)&info->validBytes,
+                bufferLap)) {
+
+            if (GetLastError() != ERROR_IO_PENDING) {
+                fprintf(stderr,"WindowsOverlappedDataReader::startIo(): readFile failed, %d\n",GetLastError());
+                soft_exit(1);
+            }
+        }
+        AcquireExclusiveLock(&lock);
+    }
+    if (nextBufferForConsumer == -1) {
+        //fprintf(stderr, "startIo thread %x reset releaseEvent\n", GetCurrentThreadId());
+        ResetEvent(releaseEvent);
+    }
+    ReleaseExclusiveLock(&lock);
+}
+
+    void
+WindowsOverlappedDataReader::waitForBuffer(
+    unsigned bufferNumber)
+{
+    _ASSERT(bufferNumber >= 0 && bufferNumber < nBuffers);
+    BufferInfo *info = &bufferInfo[bufferNumber];
+    OVERLAPPED *bufferLap = &bufferLaps[bufferNumber];
+
+    while (info->state == InUse) {
+        //fprintf(stderr, "WindowsOverlappedDataReader::waitForBuffer %d InUse...\n", bufferNumber);
+        // must already have lock to call, release & wait & reacquire
+        ReleaseExclusiveLock(&lock);
+        _int64 start = timeInNanos();
+        DWORD waitTime;
+        if (releaseWaitInMillis > 0xffffffff) {
+            waitTime = INFINITE;
+        } else {
+            waitTime = (DWORD)releaseWaitInMillis;
+        }
+        DWORD result = WaitForSingleObject(releaseEvent, waitTime);
+        InterlockedAdd64AndReturnNewValue(&ReleaseWaitTime, timeInNanos() - start);
+        AcquireExclusiveLock(&lock);
+        if (result == WAIT_TIMEOUT) {
+            // this isn't going to directly make this buffer available, but will reduce pressure
+            addBuffer();
+        }
+    }
+
+    if (info->state == Full) {
+        return;
+    }
+
+    if (info->state != Reading) {
+        startIo();
+    }
+
+    _int64 start = timeInNanos();
+    if (!GetOverlappedResult(hFile, bufferLap, (DWORD *)&info->validBytes,TRUE)) {
+        fprintf(stderr,"Error reading FASTQ file, %d\n",GetLastError());
+        soft_exit(1);
+    }
+    InterlockedAdd64AndReturnNewValue(&ReadWaitTime, timeInNanos() - start);
+
+    info->state = Full;
+    info->buffer[info->validBytes] = 0;
+    ResetEvent(bufferLap->hEvent);
+}
+
+void
+WindowsOverlappedDataReader::addBuffer()
+{
+    if (nBuffers == maxBuffers) {
+        fprintf(stderr, "WindowsOverlappedDataReader: addBuffer at limit\n");
+        return;
+    }
+    _ASSERT(nBuffers < maxBuffers);
+
+    bufferLaps[nBuffers].hEvent = CreateEvent(NULL,TRUE,FALSE,NULL);
+    if (NULL == bufferLaps[nBuffers].hEvent) {
+        fprintf(stderr,"WindowsOverlappedDataReader: Unable to create event\n");
+        soft_exit(1);
+    }
+
+    ReadBasedDataReader::addBuffer();
+}
+
+class WindowsOverlappedDataSupplier : public DataSupplier
+{
+public:
+    WindowsOverlappedDataSupplier(bool autoRelease) : DataSupplier(autoRelease) {}
+    virtual DataReader* getDataReader(_int64 overflowBytes, double extraFactor = 0.0)
+    {
+        int buffers = autoRelease ? 2 : (ThreadCount + max(ThreadCount * 3 / 4, 3));
+        return new WindowsOverlappedDataReader(buffers, overflowBytes, extraFactor, autoRelease);
+    }
+};
+
+DataSupplier* DataSupplier::WindowsOverlapped[2] =
+{ new WindowsOverlappedDataSupplier(false), new WindowsOverlappedDataSupplier(true) };
+
+#endif // _MSC_VER
+
+#ifdef __linux__
+//
+// Linux AIO
+//
+//
+// Like the Windows overlapped reader, this keeps a read outstanding into every empty buffer rather than reading one
+// buffer at a time, so there are as many reads in flight as there are buffers waiting to be filled.  It uses POSIX
+// asynchronous IO, which needs nothing beyond librt.  The buffers overlap by overflowBytes, so reads don't start on
+// sector boundaries and the file can't be opened O_DIRECT.
+//
+class LinuxAioDataReader : public ReadBasedDataReader
+{
+public:
+
+    LinuxAioDataReader(unsigned i_nBuffers, _int64 i_overflowBytes, double extraFactor, bool autoRelease);
+
+    virtual ~LinuxAioDataReader();
+
+    virtual bool init(const char* i_fileName);
+
+    virtual void reinit(_int64 startingOffset, _int64 amountOfFileToProcess);
+
+    virtual char* readHeader(_int64* io_headerSize);
+
+ protected:
+
+    // must hold the lock to call
+    virtual void startIo();
+
+    // must hold the lock to call
+    virtual void waitForBuffer(unsigned bufferNumber);
+
+    struct aiocb        *bufferControlBlocks;   // One for each buffer that there could ever be (maxBuffers)
+
+    const char*         fileName;
+    int                 fd;
+    _int64              fileSize;
+
+    _int64              readOffset;
+    _int64              endingOffset;
+};
+
+LinuxAioDataReader::LinuxAioDataReader(unsigned i_nBuffers, _int64 i_overflowBytes, double extraFactor, bool autoRelease) :
+    ReadBasedDataReader(i_nBuffers, i_overflowBytes, extraFactor, autoRelease), fileName(NULL), fd(-1), fileSize(0), readOffset(0), endingOffset(0)
+{
+    bufferControlBlocks = new struct aiocb[maxBuffers];
+    memset(bufferControlBlocks, 0, sizeof(struct aiocb) * maxBuffers);
+}
+
+LinuxAioDataReader::~LinuxAioDataReader()
+{
+    //
+    // Don't let the base class free buffers that reads are still going into.
+    //
+    for (unsigned i = 0; i < nBuffers; i++) {
+        if (bufferInfo[i].state == Reading) {
+            const struct aiocb *controlBlock = &bufferControlBlocks[i];
+            while (EINPROGRESS == aio_error(controlBlock)) {
+                aio_suspend(&controlBlock, 1, NULL);
+            }
+            aio_return(&bufferControlBlocks[i]);
+        }
+    }
+    delete [] bufferControlBlocks;
+    bufferControlBlocks = NULL;
+    if (-1 != fd) {
+        close(fd);
+    }
+}
+
+bool
+LinuxAioDataReader::init(const char* i_fileName)
+{
+    fileName = i_fileName;
+    fd = open(fileName, O_RDONLY);
+    if (-1 == fd) {
+        return false;
+    }
+
+    struct stat sb;
+    if (0 != fstat(fd, &sb)) {
+        fprintf(stderr,"LinuxAioDataReader: unable to get file size of '%s', %d\n",fileName,errno);
+        return false;
+    }
+    fileSize = sb.st_size;
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return true;
+}
+
+    char*
+LinuxAioDataReader::readHeader(
+    _int64* io_headerSize)
+{
+    BufferInfo *info = &bufferInfo[0];
+    info->fileOffset = 0;
+    info->offset = 0;
+    _ASSERT(nextBufferForReader == 0 && nextBufferForConsumer == -1 && lastBufferForConsumer == -1 && info->next == 1 && info->previous == -1);
+    nextBufferForReader = 1;
+    nextBufferForConsumer = lastBufferForConsumer = 0;
+    info->next = info->previous = -1;
+
+    if (*io_headerSize > bufferSize) {
+        fprintf(stderr,"LinuxAioDataReader: trying to read too many bytes at once: %lld\n", *io_headerSize);
+        soft_exit(1);
+    }
+
+    ssize_t bytesRead = pread(fd, info->buffer, (size_t)*io_headerSize, 0);
+    if (bytesRead < 0) {
+        fprintf(stderr,"LinuxAioDataReader::readHeader: unable to read header of '%s', %d\n",fileName,errno);
+        return NULL;
+    }
+
+    info->validBytes = (unsigned)bytesRead;
+    *io_headerSize = info->validBytes;
+    return info->buffer;
+}
+
+    void
+LinuxAioDataReader::reinit(
+    _int64 i_startingOffset,
+    _int64 amountOfFileToProcess)
+{
+    _ASSERT(-1 != fd);  // Must call init() before reinit()
+
+    AcquireExclusiveLock(&lock);
+
+    //
+    // First let any pending IO complete.
+    //
+    for (unsigned i = 0; i < nBuffers; i++) {
+        if (bufferInfo[i].state == Reading) {
+            waitForBuffer(i);
+        }
+        bufferInfo[i].state = Empty;
+        bufferInfo[i].isEOF= false;
+        bufferInfo[i].offset = 0;
+        bufferInfo[i].next = i < nBuffers - 1 ? i + 1 : -1;
+        bufferInfo[i].previous = i > 0 ? i - 1 : -1;
+    }
+
+    nextBufferForConsumer = -1;
+    lastBufferForConsumer = -1;
+    nextBufferForReader = 0;
+
+    readOffset = i_startingOffset;
+    if (amountOfFileToProcess == 0) {
+        //
+        // This means just read the whole file.
+        //
+        endingOffset = fileSize;
+    } else {
+        endingOffset = min(fileSize,i_startingOffset + amountOfFileToProcess);
+    }
+
+    //
+    // Kick off IO, wait for the first buffer to be read
+    //
+    startIo();
+    waitForBuffer(nextBufferForConsumer);
+
+    ReleaseExclusiveLock(&lock);
+}
+
+    void
+LinuxAioDataReader::startIo()
+{
+    //
+    // Launch reads on whatever buffers are ready.
+    //
+    while (shouldReadAhead()) {
+        // remove from free list
+        BufferInfo* info = &bufferInfo[nextBufferForReader];
+        _ASSERT(info->state == Empty);
+        int index = nextBufferForReader;
+        nextBufferForReader = info->next;
+        info->batchID = nextBatchID++;
+        // add to end of consumer list
+        if (lastBufferForConsumer != -1) {
+            _ASSERT(bufferInfo[lastBufferForConsumer].next == -1);
+            bufferInfo[lastBufferForConsumer].next = index;
+        }
+        info->next = -1;
+        info->previous = lastBufferForConsumer;
+        lastBufferForConsumer = index;
+        if (nextBufferForConsumer == -1) {
+            nextBufferForConsumer = index;
+        }
+
+        if (readOffset >= fileSize || readOffset >= endingOffset) {
+            info->validBytes = 0;
+            info->nBytesThatMayBeginARead = 0;
+            info->isEOF = true;
+            info->state = Full;
+            return;
+        }
+
+        unsigned amountToRead;
+        _int64 finalOffset = min(fileSize, endingOffset + overflowBytes);
+        _int64 finalStartOffset = min(fileSize, endingOffset);
+        amountToRead = (unsigned)min(finalOffset - readOffset, (_int64) bufferSize);   // Cast OK because can't be longer than unsigned bufferSize
+        info->isEOF = readOffset + amountToRead == finalOffset;
+        info->nBytesThatMayBeginARead = (unsigned)min(bufferSize - overflowBytes, finalStartOffset - readOffset);
+
+        _ASSERT(amountToRead >= info->nBytesThatMayBeginARead && (!info->isEOF || finalOffset == readOffset + amountToRead));
+        info->fileOffset = readOffset;
+
+        readOffset += info->nBytesThatMayBeginARead;
+        info->state = Reading;
+        info->offset = 0;
+
+        struct aiocb *controlBlock = &bufferControlBlocks[index];
+        memset(controlBlock, 0, sizeof(*controlBlock));
+        controlBlock->aio_fildes = fd;
+        controlBlock->aio_offset = info->fileOffset;
+        controlBlock->aio_buf = info->buffer;
+        controlBlock->aio_nbytes = amountToRead;
+        controlBlock->aio_sigevent.sigev_notify = SIGEV_NONE;
+
+        if (0 != aio_read(controlBlock)) {
+            fprintf(stderr,"LinuxAioDataReader::startIo(): aio_read failed, %d\n",errno);
+            soft_exit(1);
+        }
+    }
+    if (nextBufferForConsumer == -1) {
+        PreventEventWaitersFromProceeding(&releaseEvent);
+    }
+}
+
+    void
+LinuxAioDataReader::waitForBuffer(
+    unsigned bufferNumber)
+{
+    _ASSERT(bufferNumber >= 0 && bufferNumber < nBuffers);
+    BufferInfo *info = &bufferInfo[bufferNumber];
+
+    while (info->state == InUse) {
+        // must already have lock to call, release & wait & reacquire
+        ReleaseExclusiveLock(&lock);
+        _int64 start = timeInNanos();
+        WaitForEvent(&releaseEvent);
+        InterlockedAdd64AndReturnNewValue(&ReleaseWaitTime, timeInNanos() - start);
+        AcquireExclusiveLock(&lock);
+    }
+
+    if (info->state != Reading) {
+        if (info->state == Full) {
+            return;
+        }
+        startIo();
+        if (info->state == Full) {
+            return;     // It was past the end of the file, so there was nothing to read
+        }
+    }
+
+    _int64 start = timeInNanos();
+    const struct aiocb *controlBlock = &bufferControlBlocks[bufferNumber];
+    int error;
+    while (EINPROGRESS == (error = aio_error(controlBlock))) {
+        aio_suspend(&controlBlock, 1, NULL);
+    }
+    ssize_t bytesRead = aio_return(&bufferControlBlocks[bufferNumber]);
+    if (0 != error || bytesRead < 0) {
+        fprintf(stderr,"Error reading input file '%s', %d\n",fileName,error);
+        soft_exit(1);
+    }
+    InterlockedAdd64AndReturnNewValue(&ReadWaitTime, timeInNanos() - start);
+
+    info->validBytes = (unsigned)bytesRead;
+    info->state = Full;
+    info->buffer[info->validBytes] = 0;
+}
+
+class LinuxAioDataSupplier : public DataSupplier
+{
+public:
+    LinuxAioDataSupplier(bool autoRelease) : DataSupplier(autoRelease) {}
+    virtual DataReader* getDataReader(_int64 overflowBytes, double extraFactor = 0.0)
+    {
+        int buffers = autoRelease ? 2 : (ThreadCount + max(ThreadCount * 3 / 4, 3));
+        return new LinuxAioDataReader(buffers, overflowBytes, extraFactor, autoRelease);
+    }
+};
+
+DataSupplier* DataSupplier::LinuxAio[2] =
+{ new LinuxAioDataSupplier(false), new LinuxAioDataSupplier(true) };
+
+#endif // __linux__
+
+#ifdef __APPLE__
+//
+// macOS dispatch
+//
+//
+// The Mac counterpart of the Linux AIO reader.  POSIX AIO on the Mac allows only a handful of requests per process, so
+// instead each buffer's read is a pread handed to a concurrent dispatch queue, which runs as many at once as the
+// storage keeps up with, and the reader waits on a dispatch semaphore for the buffer it needs.  Before handing off
+// a read it tells the kernel about the range with F_RDADVISE, so the fetch has started by the time a worker gets to it.
+//
+class OsxDispatchDataReader : public ReadBasedDataReader
+{
+public:
+
+    OsxDispatchDataReader(unsigned i_nBuffers, _int64 i_overflowBytes, double extraFactor, bool autoRelease);
+
+    virtual ~OsxDispatchDataReader();
+
+    virtual bool init(const char* i_fileName);
+
+    virtual void reinit(_int64 startingOffset, _int64 amountOfFileToProcess);
+
+    virtual char* readHeader(_int64* io_headerSize);
+
+ protected:
+
+    // must hold the lock to call
+    virtual void startIo();
+
+    // must hold the lock to call
+    virtual void waitForBuffer(unsigned bufferNumber);
+
+    struct ReadRequest {
+        int                     fd;
+        char*                   buffer;
+        off_t                   offset;
+        size_t                  amountToRead;
+        ssize_t                 bytesRead;      // -1 if it failed
+        int                     error;
+        dispatch_semaphore_t    done;
+    };
+
+    static void ReadMain(void* context);
+
+    ReadRequest*        requests;               // One for each buffer that there could ever be (maxBuffers)
+    dispatch_queue_t    queue;
+
+    const char*         fileName;
+    int                 fd;
+    _int64              fileSize;
+
+    _int64              readOffset;
+    _int64              endingOffset;
+};
+
+OsxDispatchDataReader::OsxDispatchDataReader(unsigned i_nBuffers, _int64 i_overflowBytes, double extraFactor, bool autoRelease) :
+    ReadBasedDataReader(i_nBuffers, i_overflowBytes, extraFactor, autoRelease), fileName(NULL), fd(-1), fileSize(0), readOffset(0), endingOffset(0)
+{
+    requests = new ReadRequest[maxBuffers];
+    for (unsigned i = 0; i < maxBuffers; i++) {
+        requests[i].done = dispatch_semaphore_create(0);
+    }
+    queue = dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0);
+}
+
+OsxDispatchDataReader::~OsxDispatchDataReader()
+{
+    //
+    // Don't let the base class free buffers that reads are still going into.
+    //
+    for (unsigned i = 0; i < nBuffers; i++) {
+        if (bufferInfo[i].state == Reading) {
+            dispatch_semaphore_wait(requests[i].done, DISPATCH_TIME_FOREVER);
+        }
+    }
+    for (unsigned i = 0; i < maxBuffers; i++) {
+        dispatch_release(requests[i].done);
+    }
+    delete [] requests;
+    requests = NULL;
+    if (-1 != fd) {
+        close(fd);
+    }
+}
+
+bool
+OsxDispatchDataReader::init(const char* i_fileName)
+{
+    fileName = i_fileName;
+    fd = open(fileName, O_RDONLY);
+    if (-1 == fd) {
+        return false;
+    }
+
+    struct stat sb;
+    if (0 != fstat(fd, &sb)) {
+        fprintf(stderr,"OsxDispatchDataReader: unable to get file size of '%s', %d\n",fileName,errno);
+        return false;
+    }
+    fileSize = sb.st_size;
+
+    fcntl(fd, F_RDAHEAD, 1);
+    return true;
+}
+
+    char*
+OsxDispatchDataReader::readHeader(
+    _int64* io_headerSize)
+{
+    BufferInfo *info = &bufferInfo[0];
+    info->fileOffset = 0;
+    info->offset = 0;
+    _ASSERT(nextBufferForReader == 0 && nextBufferForConsumer == -1 && lastBufferForConsumer == -1 && info->next == 1 && info->previous == -1);
+    nextBufferForReader = 1;
+    nextBufferForConsumer = lastBufferForConsumer = 0;
+    info->next = info->previous = -1;
+
+    if (*io_headerSize > bufferSize) {
+        fprintf(stderr,"OsxDispatchDataReader: trying to read too many bytes at once: %lld\n", *io_headerSize);
+        soft_exit(1);
+    }
+
+    ssize_t bytesRead = pread(fd, info->buffer, (size_t)*io_headerSize, 0);
+    if (bytesRead < 0) {
+        fprintf(stderr,"OsxDispatchDataReader::readHeader: unable to read header of '%s', %d\n",fileName,errno);
+        return NULL;
+    }
+
+    info->validBytes = (unsigned)bytesRead;
+    *io_headerSize = info->validBytes;
+    return info->buffer;
+}
+
+    void
+OsxDispatchDataReader::reinit(
+    _int64 i_startingOffset,
+    _int64 amountOfFileToProcess)
+{
+    _ASSERT(-1 != fd);  // Must call init() before reinit()
+
+    AcquireExclusiveLock(&lock);
+
+    //
+    // First let any pending IO complete.
+    //
+    for (unsigned i = 0; i < nBuffers; i++) {
+        if (bufferInfo[i].state == Reading) {
+            waitForBuffer(i);
+        }
+        bufferInfo[i].state = Empty;
+        bufferInfo[i].isEOF= false;
+        bufferInfo[i].offset = 0;
+        bufferInfo[i].next = i < nBuffers - 1 ? i + 1 : -1;
+        bufferInfo[i].previous = i > 0 ? i - 1 : -1;
+    }
+
+    nextBufferForConsumer = -1;
+    lastBufferForConsumer = -1;
+    nextBufferForReader = 0;
+
+    readOffset = i_startingOffset;
+    if (amountOfFileToProcess == 0) {
+        //
+        // This means just read the whole file.
+        //
+        endingOffset = fileSize;
+    } else {
+        endingOffset = min(fileSize,i_startingOffset + amountOfFileToProcess);
+    }
+
+    //
+    // Kick off IO, wait for the first buffer to be read
+    //
+    startIo();
+    waitForBuffer(nextBufferForConsumer);
+
+    ReleaseExclusiveLock(&lock);
+}
+
+    void
+OsxDispatchDataReader::startIo()
+{
+    //
+    // Launch reads on whatever buffers are ready.
+    //
+    while (shouldReadAhead()) {
+        // remove from free list
+        BufferInfo* info = &bufferInfo[nextBufferForReader];
+        _ASSERT(info->state == Empty);
+        int index = nextBufferForReader;
+        nextBufferForReader = info->next;
+        info->batchID = nextBatchID++;
+        // add to end of consumer list
+        if (lastBufferForConsumer != -1) {
+            _ASSERT(bufferInfo[lastBufferForConsumer].next == -1);
+            bufferInfo[lastBufferForConsumer].next = index;
+        }
+        info->next = -1;
+        info->previous = lastBufferForConsumer;
+        lastBufferForConsumer = index;
+        if (nextBufferForConsumer == -1) {
+            nextBufferForConsumer = index;
+        }
+
+        if (readOffset >= fileSize || readOffset >= endingOffset) {
+            info->validBytes = 0;
+            info->nBytesThatMayBeginARead = 0;
+            info->isEOF = true;
+            info->state = Full;
+            return;
+        }
+
+        unsigned amountToRead;
+        _int64 finalOffset = min(fileSize, endingOffset + overflowBytes);
+        _int64 finalStartOffset = min(fileSize, endingOffset);
+        amountToRead = (unsigned)min(finalOffset - readOffset, (_int64) bufferSize);   // Cast OK because can't be longer than unsigned bufferSize
+        info->isEOF = readOffset + amountToRead == finalOffset;
+        info->nBytesThatMayBeginARead = (unsigned)min(bufferSize - overflowBytes, finalStartOffset - readOffset);
+
+        _ASSERT(amountToRead >= info->nBytesThatMayBeginARead && (!info->isEOF || finalOffset == readOffset + amountToRead));
+        info->fileOffset = readOffset;
+
+        readOffset += info->nBytesThatMayBeginARead;
+        info->state = Reading;
+        info->offset = 0;
+
+        struct radvisory advice;
+        advice.ra_offset = info->fileOffset;
+        advice.ra_count = (int)amountToRead;
+        fcntl(fd, F_RDADVISE, &advice);     // Only a hint, so it doesn't matter if it fails
+
+        ReadRequest *request = &requests[index];
+        request->fd = fd;
+        request->buffer = info->buffer;
+        request->offset = info->fileOffset;
+        request->amountToRead = amountToRead;
+        dispatch_async_f(queue, request, ReadMain);
+    }
+    if (nextBufferForConsumer == -1) {
+        PreventEventWaitersFromProceeding(&releaseEvent);
+    }
+}
+
+    void
+OsxDispatchDataReader::ReadMain(
+    void* context)
+{
+    ReadRequest *request = (ReadRequest *)context;
+    size_t totalRead = 0;
+    request->error = 0;
+    while (totalRead < request->amountToRead) {
+        ssize_t bytesRead = pread(request->fd, request->buffer + totalRead, request->amountToRead - totalRead, request->offset + totalRead);
+        if (bytesRead < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            request->error = errno;
+            break;
+        }
+        if (0 == bytesRead) {
+            break;
+        }
+        totalRead += bytesRead;
+    }
+    request->bytesRead = 0 == request->error ? (ssize_t)totalRead : -1;
+    dispatch_semaphore_signal(request->done);
+}
+
+    void
+OsxDispatchDataReader::waitForBuffer(
+    unsigned bufferNumber)
+{
+    _ASSERT(bufferNumber >= 0 && bufferNumber < nBuffers);
+    BufferInfo *info = &bufferInfo[bufferNumber];
+
+    while (info->state == InUse) {
+        // must already have lock to call, release & wait & reacquire
+        ReleaseExclusiveLock(&lock);
+        _int64 start = timeInNanos();
+        WaitForEvent(&releaseEvent);
+        InterlockedAdd64AndReturnNewValue(&ReleaseWaitTime, timeInNanos() - start);
+        AcquireExclusiveLock(&lock);
+    }
+
+    if (info->state != Reading) {
+        if (info->state == Full) {
+            return;
+        }
+        startIo();
+        if (info->state == Full) {
+            return;     // It was past the end of the file, so there was nothing to read
+        }
+    }
+
+    _int64 start = timeInNanos();
+    ReadRequest *request = &requests[bufferNumber];
+    dispatch_semaphore_wait(request->done, DISPATCH_TIME_FOREVER);
+    if (request->bytesRead < 0) {
+        fprintf(stderr,"Error reading input file '%s', %d\n",fileName,request->error);
+        soft_exit(1);
+    }
+    InterlockedAdd64AndReturnNewValue(&ReadWaitTime, timeInNanos() - start);
+
+    info->validBytes = (unsigned)request->bytesRead;
+    info->state = Full;
+    info->buffer[info->validBytes] = 0;
+}
+
+class OsxDispatchDataSupplier : public DataSupplier
+{
+public:
+    OsxDispatchDataSupplier(bool autoRelease) : DataSupplier(autoRelease) {}
+    virtual DataReader* getDataReader(_int64 overflowBytes, double extraFactor = 0.0)
+    {
+        int buffers = autoRelease ? 2 : (ThreadCount + max(ThreadCount * 3 / 4, 3));
+        return new OsxDispatchDataReader(buffers, overflowBytes, extraFactor, autoRelease);
+    }
+};
+
+DataSupplier* DataSupplier::OsxDispatch[2] =
+{ new OsxDispatchDataSupplier(false), new OsxDispatchDataSupplier(true) };
+
+#endif // __APPLE__
+
+//
+// Remote
+//
+//
+// Reads files that GenericFile opens from somewhere other than the local filesystem, such as HDFS.  Each read from
+// there takes a long time, but the service behind it can do a lot of them at once, so like the AIO reader this keeps a
+// read going into every empty buffer.  GenericFile reads are synchronous, so a small pool of threads per reader issues
+// them, each as a positioned read of its own range of the file.
+//
+class RemoteDataReader : public ReadBasedDataReader
+{
+public:
+
+    RemoteDataReader(unsigned i_nBuffers, _int64 i_overflowBytes, double extraFactor, bool autoRelease);
+
+    virtual ~RemoteDataReader();
+
+    virtual bool init(const char* i_fileName);
+
+    virtual void reinit(_int64 startingOffset, _int64 amountOfFileToProcess);
+
+    virtual char* readHeader(_int64* io_headerSize);
+
+ protected:
+
+    // must hold the lock to call
+    virtual void startIo();
+
+    // must hold the lock to call
+    virtual void waitForBuffer(unsigned bufferNumber);
+
+private:
+
+    static void ReaderThreadMain(void* param);
+
+    void readerThread();
 
-    OVERLAPPED          *bufferLaps;
+    static const unsigned maxReaderThreads = 16;
 
+    GenericFile*        file;
     const char*         fileName;
-    LARGE_INTEGER       fileSize;
-    HANDLE              hFile;
-  
-    LARGE_INTEGER       readOffset;
+    _int64              fileSize;
+
+    _int64              readOffset;
     _int64              endingOffset;
 
+    unsigned*           amountToRead;           // For each buffer (maxBuffers) that's Reading, how much to read into it
+    int*                pendingReads;           // Ring of buffers waiting for a reader thread to pick them up
+    unsigned            firstPendingRead;
+    unsigned            nPendingReads;
+
+    EventObject         readPending;            // Set when there's a pending read or the reader threads should stop
+    EventObject         readDone;               // Set when a reader thread has finished a read or exited
+    unsigned            nReaderThreadsRunning;
+    bool                stopping;
 };
 
-WindowsOverlappedDataReader::WindowsOverlappedDataReader(unsigned i_nBuffers, _int64 i_overflowBytes, double extraFactor, bool autoRelease) :
-    ReadBasedDataReader(i_nBuffers, i_overflowBytes, extraFactor, autoRelease), fileName(NULL), hFile(INVALID_HANDLE_VALUE), endingOffset(0)
+RemoteDataReader::RemoteDataReader(unsigned i_nBuffers, _int64 i_overflowBytes, double extraFactor, bool autoRelease) :
+    ReadBasedDataReader(i_nBuffers, i_overflowBytes, extraFactor, autoRelease), file(NULL), fileName(NULL), fileSize(0),
+    readOffset(0), endingOffset(0), firstPendingRead(0), nPendingReads(0), nReaderThreadsRunning(0), stopping(false)
 {
-    readOffset.QuadPart = 0;
-    bufferLaps = (OVERLAPPED *)BigAlloc(sizeof(OVERLAPPED) * i_nBuffers);
-    for (unsigned i = 0; i < i_nBuffers; i++) {
-        bufferLaps[i].hEvent = CreateEvent(NULL,TRUE,FALSE,NULL);
-        if (NULL == bufferLaps[i].hEvent) {
-            fprintf(stderr,"WindowsOverlappedDataReader: Unable to create event\n");
-            soft_exit(1);
-        }
-    }
+    amountToRead = new unsigned[maxBuffers];
+    pendingReads = new int[maxBuffers];
+    CreateEventObject(&readPending);
+    CreateEventObject(&readDone);
 }
 
-WindowsOverlappedDataReader::~WindowsOverlappedDataReader()
+RemoteDataReader::~RemoteDataReader()
 {
-    for (unsigned i = 0; i < nBuffers; i++) {
-       CloseHandle(bufferLaps[i].hEvent);
+    //
+    // Stop the reader threads, letting any reads that are going finish first, because they're into our buffers.
+    //
+    AcquireExclusiveLock(&lock);
+    stopping = true;
+    AllowEventWaitersToProceed(&readPending);
+    while (nReaderThreadsRunning > 0) {
+        PreventEventWaitersFromProceeding(&readDone);
+        ReleaseExclusiveLock(&lock);
+        WaitForEvent(&readDone);
+        AcquireExclusiveLock(&lock);
     }
-    BigDealloc(bufferLaps);
-    bufferLaps = NULL;
-    CloseHandle(hFile);
+    ReleaseExclusiveLock(&lock);
+
+    if (NULL != file) {
+        file->close();
+        delete file;
+        file = NULL;
+    }
+    delete [] amountToRead;
+    delete [] pendingReads;
+    DestroyEventObject(&readPending);
+    DestroyEventObject(&readDone);
 }
 
 bool
-WindowsOverlappedDataReader::init(const char* i_fileName)
+RemoteDataReader::init(const char* i_fileName)
 {
     fileName = i_fileName;
-    hFile = CreateFile(fileName,GENERIC_READ,FILE_SHARE_READ,NULL,OPEN_EXISTING,FILE_FLAG_OVERLAPPED,NULL);
-    if (INVALID_HANDLE_VALUE == hFile) {
+    file = GenericFile::open(fileName, GenericFile::ReadOnly);
+    if (NULL == file) {
         return false;
     }
 
-    if (!GetFileSizeEx(hFile,&fileSize)) {
-        fprintf(stderr,"WindowsOverlappedDataReader: unable to get file size of '%s', %d\n",fileName,GetLastError());
+    fileSize = file->getSize();
+    if (fileSize < 0) {
+        fprintf(stderr,"RemoteDataReader: unable to get file size of '%s'\n",fileName);
         return false;
     }
+
+    //
+    // There's no point in more threads than there can ever be buffers to read into.
+    //
+    unsigned nReaderThreads = __min(maxBuffers, maxReaderThreads);
+    for (unsigned i = 0; i < nReaderThreads; i++) {
+        AcquireExclusiveLock(&lock);
+        nReaderThreadsRunning++;
+        ReleaseExclusiveLock(&lock);
+        if (!StartNewThread(ReaderThreadMain, this)) {
+            fprintf(stderr,"RemoteDataReader: unable to start reader thread\n");
+            soft_exit(1);
+        }
+    }
     return true;
 }
 
     char*
-WindowsOverlappedDataReader::readHeader(
+RemoteDataReader::readHeader(
     _int64* io_headerSize)
 {
     BufferInfo *info = &bufferInfo[0];
     info->fileOffset = 0;
     info->offset = 0;
-    bufferLaps[0].Offset = 0;
-    bufferLaps[0].OffsetHigh = 0;
     _ASSERT(nextBufferForReader == 0 && nextBufferForConsumer == -1 && lastBufferForConsumer == -1 && info->next == 1 && info->previous == -1);
     nextBufferForReader = 1;
     nextBufferForConsumer = lastBufferForConsumer = 0;
     info->next = info->previous = -1;
 
     if (*io_headerSize > bufferSize) {
-        fprintf(stderr,"WindowsOverlappedDataReader: trying to read too many bytes at once: %lld\n", *io_headerSize);
+        fprintf(stderr,"RemoteDataReader: trying to read too many bytes at once: %lld\n", *io_headerSize);
         soft_exit(1);
     }
 
-    if (!ReadFile(hFile,info->buffer,(DWORD)*io_headerSize,(DWORD *)&info->validBytes,&bufferLaps[0])) {
-        if (GetLastError() != ERROR_IO_PENDING) {
-            fprintf(stderr,"WindowsOverlappedReader::init: unable to read header of '%s', %d\n",fileName,GetLastError());
-            return NULL;
-        }
-    }
-
-    if (!GetOverlappedResult(hFile,&bufferLaps[0], (DWORD *)&info->validBytes,TRUE)) {
-        fprintf(stderr,"WindowsOverlappedReader::init: error reading header of '%s', %d\n",fileName,GetLastError());
+    size_t bytesRead = file->readAt(info->buffer, (size_t)*io_headerSize, 0);
+    if (bytesRead == (size_t)-1) {
+        fprintf(stderr,"RemoteDataReader::readHeader: unable to read header of '%s'\n",fileName);
         return NULL;
     }
 
+    info->validBytes = (unsigned)bytesRead;
     *io_headerSize = info->validBytes;
     return info->buffer;
 }
 
     void
-WindowsOverlappedDataReader::reinit(
+RemoteDataReader::reinit(
     _int64 i_startingOffset,
     _int64 amountOfFileToProcess)
 {
-    _ASSERT(INVALID_HANDLE_VALUE != hFile);  // Must call init() before reinit()
+    _ASSERT(NULL != file);  // Must call init() before reinit()
 
     AcquireExclusiveLock(&lock);
 
@@ -850,18 +1988,18 @@ WindowsOverlappedDataReader::reinit(
         bufferInfo[i].previous = i > 0 ? i - 1 : -1;
     }
 
-    nextBufferForConsumer = -1; 
+    nextBufferForConsumer = -1;
     lastBufferForConsumer = -1;
     nextBufferForReader = 0;
 
-    readOffset.QuadPart = i_startingOffset;
+    readOffset = i_startingOffset;
     if (amountOfFileToProcess == 0) {
         //
         // This means just read the whole file.
         //
-        endingOffset = fileSize.QuadPart;
+        endingOffset = fileSize;
     } else {
-        endingOffset = min(fileSize.QuadPart,i_startingOffset + amountOfFileToProcess);
+        endingOffset = min(fileSize,i_startingOffset + amountOfFileToProcess);
     }
 
     //
@@ -873,17 +2011,15 @@ WindowsOverlappedDataReader::reinit(
     ReleaseExclusiveLock(&lock);
 }
 
-        void
-WindowsOverlappedDataReader::startIo()
+    void
+RemoteDataReader::startIo()
 {
     //
-    // Launch reads on whatever buffers are ready.
+    // Queue reads for whatever buffers are ready.
     //
-    AcquireExclusiveLock(&lock);
-    while (nextBufferForReader != -1) {
+    while (shouldReadAhead()) {
         // remove from free list
         BufferInfo* info = &bufferInfo[nextBufferForReader];
-        OVERLAPPED *bufferLap = &bufferLaps[nextBufferForReader];
         _ASSERT(info->state == Empty);
         int index = nextBufferForReader;
         nextBufferForReader = info->next;
@@ -896,142 +2032,136 @@ WindowsOverlappedDataReader::startIo()
         info->next = -1;
         info->previous = lastBufferForConsumer;
         lastBufferForConsumer = index;
-	if (nextBufferForConsumer == -1) {
+        if (nextBufferForConsumer == -1) {
             nextBufferForConsumer = index;
-	}
+        }
 
-        if (readOffset.QuadPart >= fileSize.QuadPart || readOffset.QuadPart >= endingOffset) {
+        if (readOffset >= fileSize || readOffset >= endingOffset) {
             info->validBytes = 0;
             info->nBytesThatMayBeginARead = 0;
             info->isEOF = true;
             info->state = Full;
-            SetEvent(bufferLap->hEvent);
-            ReleaseExclusiveLock(&lock);
             return;
         }
 
-        unsigned amountToRead;
-        _int64 finalOffset = min(fileSize.QuadPart, endingOffset + overflowBytes);
-        _int64 finalStartOffset = min(fileSize.QuadPart, endingOffset);
-        amountToRead = (unsigned)min(finalOffset - readOffset.QuadPart, (_int64) bufferSize);   // Cast OK because can't be longer than unsigned bufferSize
-        info->isEOF = readOffset.QuadPart + amountToRead == finalOffset;
-        info->nBytesThatMayBeginARead = (unsigned)min(bufferSize - overflowBytes, finalStartOffset - readOffset.QuadPart);
+        _int64 finalOffset = min(fileSize, endingOffset + overflowBytes);
+        _int64 finalStartOffset = min(fileSize, endingOffset);
+        amountToRead[index] = (unsigned)min(finalOffset - readOffset, (_int64) bufferSize);   // Cast OK because can't be longer than unsigned bufferSize
+        info->isEOF = readOffset + amountToRead[index] == finalOffset;
+        info->nBytesThatMayBeginARead = (unsigned)min(bufferSize - overflowBytes, finalStartOffset - readOffset);
 
-        _ASSERT(amountToRead >= info->nBytesThatMayBeginARead && (!info->isEOF || finalOffset == readOffset.QuadPart + amountToRead));
-        ResetEvent(bufferLap->hEvent);
-        bufferLap->Offset = readOffset.LowPart;
-        bufferLap->OffsetHigh = readOffset.HighPart;
-        info->fileOffset = readOffset.QuadPart;
+        _ASSERT(amountToRead[index] >= info->nBytesThatMayBeginARead && (!info->isEOF || finalOffset == readOffset + amountToRead[index]));
+        info->fileOffset = readOffset;
 
-        readOffset.QuadPart += info->nBytesThatMayBeginARead;
+        readOffset += info->nBytesThatMayBeginARead;
         info->state = Reading;
         info->offset = 0;
-         
-        //fprintf(stderr, "startIo on %d at %lld for %uB\n", index, readOffset, amountToRead);
-        ReleaseExclusiveLock(&lock);
-        if (!ReadFile(
-                hFile,
-                info->buffer,
-                amountToRead,
-                (DWORD *)&info->validBytes,
-                bufferLap)) {
 
-            if (GetLastError() != ERROR_IO_PENDING) {
-                fprintf(stderr,"WindowsOverlappedDataReader::startIo(): readFile failed, %d\n",GetLastError());
-                soft_exit(1);
-            }
-        }
-        AcquireExclusiveLock(&lock);
+        _ASSERT(nPendingReads < maxBuffers);
+        pendingReads[(firstPendingRead + nPendingReads) % maxBuffers] = index;
+        nPendingReads++;
+        AllowEventWaitersToProceed(&readPending);
     }
     if (nextBufferForConsumer == -1) {
-        //fprintf(stderr, "startIo thread %x reset releaseEvent\n", GetCurrentThreadId());
-        ResetEvent(releaseEvent);
+        PreventEventWaitersFromProceeding(&releaseEvent);
     }
-    ReleaseExclusiveLock(&lock);
 }
 
     void
-WindowsOverlappedDataReader::waitForBuffer(
+RemoteDataReader::waitForBuffer(
     unsigned bufferNumber)
 {
     _ASSERT(bufferNumber >= 0 && bufferNumber < nBuffers);
     BufferInfo *info = &bufferInfo[bufferNumber];
-    OVERLAPPED *bufferLap = &bufferLaps[bufferNumber];
 
     while (info->state == InUse) {
-        //fprintf(stderr, "WindowsOverlappedDataReader::waitForBuffer %d InUse...\n", bufferNumber);
         // must already have lock to call, release & wait & reacquire
         ReleaseExclusiveLock(&lock);
         _int64 start = timeInNanos();
-        DWORD waitTime;
-        if (releaseWaitInMillis > 0xffffffff) {
-            waitTime = INFINITE;
-        } else {
-            waitTime = (DWORD)releaseWaitInMillis;
-        }
-        DWORD result = WaitForSingleObject(releaseEvent, waitTime);
+        WaitForEvent(&releaseEvent);
         InterlockedAdd64AndReturnNewValue(&ReleaseWaitTime, timeInNanos() - start);
         AcquireExclusiveLock(&lock);
-        if (result == WAIT_TIMEOUT) {
-            // this isn't going to directly make this buffer available, but will reduce pressure
-            addBuffer();
-        }
-    }
-
-    if (info->state == Full) {
-        return;
     }
 
     if (info->state != Reading) {
+        if (info->state == Full) {
+            return;
+        }
         startIo();
+        if (info->state == Full) {
+            return;     // It was past the end of the file, so there was nothing to read
+        }
     }
 
     _int64 start = timeInNanos();
-    if (!GetOverlappedResult(hFile, bufferLap, (DWORD *)&info->validBytes,TRUE)) {
-        fprintf(stderr,"Error reading FASTQ file, %d\n",GetLastError());
-        soft_exit(1);
+    while (info->state == Reading) {
+        PreventEventWaitersFromProceeding(&readDone);
+        ReleaseExclusiveLock(&lock);
+        WaitForEvent(&readDone);
+        AcquireExclusiveLock(&lock);
     }
     InterlockedAdd64AndReturnNewValue(&ReadWaitTime, timeInNanos() - start);
+}
 
-    info->state = Full;
-    info->buffer[info->validBytes] = 0;
-    ResetEvent(bufferLap->hEvent);
+    void
+RemoteDataReader::ReaderThreadMain(
+    void* param)
+{
+    ((RemoteDataReader*)param)->readerThread();
 }
 
-void
-WindowsOverlappedDataReader::addBuffer()
+    void
+RemoteDataReader::readerThread()
 {
-    if (nBuffers == maxBuffers) {
-        fprintf(stderr, "WindowsOverlappedDataReader: addBuffer at limit\n");
-        return;
-    }
-    _ASSERT(nBuffers < maxBuffers);
+    AcquireExclusiveLock(&lock);
+    while (!stopping) {
+        if (0 == nPendingReads) {
+            PreventEventWaitersFromProceeding(&readPending);
+            ReleaseExclusiveLock(&lock);
+            WaitForEvent(&readPending);
+            AcquireExclusiveLock(&lock);
+            continue;
+        }
 
-    bufferLaps[nBuffers].hEvent = CreateEvent(NULL,TRUE,FALSE,NULL);
-    if (NULL == bufferLaps[nBuffers].hEvent) {
-        fprintf(stderr,"WindowsOverlappedDataReader: Unable to create event\n");
-        soft_exit(1);
+        int index = pendingReads[firstPendingRead];
+        firstPendingRead = (firstPendingRead + 1) % maxBuffers;
+        nPendingReads--;
+        BufferInfo* info = &bufferInfo[index];
+        _ASSERT(info->state == Reading);
+        char* buffer = info->buffer;
+        _int64 offset = info->fileOffset;
+        unsigned amount = amountToRead[index];
+
+        ReleaseExclusiveLock(&lock);
+        size_t bytesRead = file->readAt(buffer, amount, offset);
+        AcquireExclusiveLock(&lock);
+
+        if (bytesRead == (size_t)-1) {
+            fprintf(stderr,"Error reading input file '%s' at offset %lld\n", fileName, offset);
+            soft_exit(1);
+        }
+        info->validBytes = (unsigned)bytesRead;
+        info->buffer[info->validBytes] = 0;
+        info->state = Full;
+        AllowEventWaitersToProceed(&readDone);
     }
 
-    ReadBasedDataReader::addBuffer();
+    nReaderThreadsRunning--;
+    AllowEventWaitersToProceed(&readDone);
+    ReleaseExclusiveLock(&lock);
 }
 
-class WindowsOverlappedDataSupplier : public DataSupplier
+class RemoteDataSupplier : public DataSupplier
 {
 public:
-    WindowsOverlappedDataSupplier(bool autoRelease) : DataSupplier(autoRelease) {}
+    RemoteDataSupplier(bool autoRelease) : DataSupplier(autoRelease) {}
     virtual DataReader* getDataReader(_int64 overflowBytes, double extraFactor = 0.0)
     {
         int buffers = autoRelease ? 2 : (ThreadCount + max(ThreadCount * 3 / 4, 3));
-        return new WindowsOverlappedDataReader(buffers, overflowBytes, extraFactor, autoRelease);
+        return new RemoteDataReader(buffers, overflowBytes, extraFactor, autoRelease);
     }
 };
 
-DataSupplier* DataSupplier::WindowsOverlapped[2] =
-{ new WindowsOverlappedDataSupplier(false), new WindowsOverlappedDataSupplier(true) };
-
-#endif // _MSC_VER
-
 //
 // Decompress
 //
@@ -1042,6 +2172,9 @@ static const int ENABLE_ZLIB_GZIP = 32;
 static const double MIN_FACTOR = 1.2;
 static const double MAX_FACTOR = 10.0;
 
+static const int MAX_DECOMPRESS_THREADS = 16;   // the most pieces a BGZF batch is decompressed in at once, per input file
+static const int READ_AHEAD_FOR_NORMAL_PRIORITY = 1; // batches queued behind the one being read past which decompression isn't urgent
+
 class DecompressDataReader : public DataReader
 {
 public:
@@ -1087,8 +2220,7 @@ private:
 
     static void decompressThreadContinuous(void *context);
 
-    friend class DecompressManager;
-    friend class DecompressWorker;
+    friend class DecompressStage;
 
     enum EntryState
     {
@@ -1124,6 +2256,7 @@ private:
     const _int64 overflowBytes; // overflow between batches
     const _int64 totalExtra; // total extra data
     const int chunkSize; // max size of decompressed data
+    bool blocked; // input is BGZF blocks that can be decompressed separately, either because it's BAM or it just turned out that way
     _int64 offset; // into current entry
     bool threadStarted; // whether thread has been started
     bool eof; // true when we've read to eof of previous
@@ -1135,6 +2268,7 @@ private:
     int count; // # of entries
     Entry* first; // first ready buffer, NULL if none, currently being read by client
     Entry* last; // last ready buffer, NULL if none
+    volatile int nQueued; // # of ready entries behind first, i.e., that the client hasn't started reading
     EventObject readyEvent; // signalled by bg thread when first goes NULL->non-NULL
     Entry* available; // first non-ready buffer (head of freelist), NULL if none
     EventObject availableEvent; // signalled by main thread when available goes NULL->non-NULL
@@ -1152,7 +2286,7 @@ DecompressDataReader::DecompressDataReader(
     int i_chunkSize)
     : DataReader(autoRelease), inner(i_inner), count(i_count), offset(i_overflowBytes),
     totalExtra(i_totalExtra), extraBytes(i_extraBytes), overflowBytes(i_overflowBytes),
-    chunkSize(i_chunkSize), threadStarted(false), eof(false), stopping(false)
+    chunkSize(i_chunkSize), blocked(i_chunkSize > 0), threadStarted(false), eof(false), stopping(false)
 {
     entries = new Entry[count];
     for (int i = 0; i < count; i++) {
@@ -1164,6 +2298,7 @@ DecompressDataReader::DecompressDataReader(
     }
     available = entries;
     first = last = NULL;
+    nQueued = 0;
     CreateEventObject(&readyEvent);
     PreventEventWaitersFromProceeding(&readyEvent);
     CreateEventObject(&availableEvent);
@@ -1235,8 +2370,19 @@ DecompressDataReader::reinit(
     }
     // todo: transform start/amount to add for compression? I don't think so...
     inner->reinit(startingOffset, amountOfFileToProcess);
+
+    //
+    // A gzip file that's a series of BGZF blocks (e.g., from bgzip) can be inflated a block at a time on several threads the
+    // same way as BAM, rather than as one stream on the decompress thread.
+    //
+    char* compressed;
+    _int64 compressedBytes;
+    if (! blocked && inner->getData(&compressed, &compressedBytes) && ((BgzfHeader*) compressed)->isBgzf(compressedBytes)) {
+        blocked = true;
+    }
+
     threadStarted = true;
-    if (! StartNewThread(chunkSize > 0 ? decompressThread : decompressThreadContinuous, this)) {
+    if (! StartNewThread(blocked ? decompressThread : decompressThreadContinuous, this)) {
         fprintf(stderr, "failed to start decompressThread\n");
         soft_exit(1);
     }
@@ -1360,22 +2506,24 @@ DecompressDataReader::decompress(
     zstream->avail_in = (uInt)inputBytes;
     zstream->next_out = (Bytef*) output;
     zstream->avail_out = (uInt)outputBytes;
-    if (heap != NULL) {
-        zstream->zalloc = zalloc;
-        zstream->zfree = zfree;
-        zstream->opaque = heap;
-    } else {
-        zstream->zalloc = NULL;
-        zstream->zfree = NULL;
-    }
     uInt oldAvailOut, oldAvailIn;
     int block = 0;
     bool multiBlock = true;
     int status;
     do {
-            if (mode != ContinueMultiBlock || block != 0) {
+        if (mode != ContinueMultiBlock || block != 0) {
+            //
+            // Only set the allocator when starting a stream, since zlib fails a stream whose allocator has been
+            // changed (or reset to NULL, which means its own) since inflateInit.
+            //
             if (heap != NULL) {
                 heap->reset();
+                zstream->zalloc = zalloc;
+                zstream->zfree = zfree;
+                zstream->opaque = heap;
+            } else {
+                zstream->zalloc = NULL;
+                zstream->zfree = NULL;
             }
             status = inflateInit2(zstream, windowBits | ENABLE_ZLIB_GZIP);
             if (status < 0) {
@@ -1384,7 +2532,7 @@ DecompressDataReader::decompress(
             }
         }
         oldAvailOut = zstream->avail_out;
-        oldAvailIn = zstream->avail_out;
+        oldAvailIn = zstream->avail_in;
         status = inflate(zstream, mode == SingleBlock ? Z_NO_FLUSH : Z_FINISH);
         // fprintf(stderr, "decompress block #%d %lld -> %lld = %d\n", block, zstream.next_in - lastIn, zstream.next_out - lastOut, status);
         block++;
@@ -1433,60 +2581,145 @@ DecompressDataReader::findPointer(
 
 typedef VariableSizeVector<_int64> OffsetVector;
 
-class DecompressWorker : public ParallelWorker
+//
+// Decompresses the BGZF blocks of a batch on the work pool.  Each of a batch's pieces does every nPieces'th block,
+// and the reader's decompress thread helps with them until the last one's finished.
+//
+class DecompressStage : public WorkPool::Stage
 {
 public:
-    DecompressWorker();
+    DecompressStage(OffsetVector* i_inputs, OffsetVector* i_outputs, WorkPool::Priority i_priority)
+        : WorkPool::Stage(i_priority), inputs(i_inputs), outputs(i_outputs), entry(NULL), piecesLeft(0)
+    {
+        CreateEventObject(&done);
+    }
+
+    virtual ~DecompressStage()
+    {
+        deleteThreadStates();
+        DestroyEventObject(&done);
+    }
+
+    virtual void* createThreadState();
+
+    virtual void deleteThreadState(void* state);
+
+    virtual void run(void* state, void* item);
 
-    virtual void step();
+    virtual void finished(void* item);
+
+    // decompress all of entry's blocks, and return when they're done
+    void decompressEntry(DecompressDataReader::Entry* i_entry, int nPieces);
 
 private:
-    z_stream zstream;
-    ThreadHeap heap;
-};
-    
-class DecompressManager: public ParallelWorkerManager
-{
-public:
-    DecompressManager(OffsetVector* i_inputs, OffsetVector* i_outputs)
-        : inputs(i_inputs), outputs(i_outputs)
-    {}
+    struct ThreadState
+    {
+        ThreadState() : heap(BAM_BLOCK), libdeflate(Libdeflate::isLoaded() ? Libdeflate::allocDecompressor() : NULL)
+        {
+            zstream.zalloc = zalloc;
+            zstream.zfree = zfree;
+            zstream.opaque = &heap;
+        }
+
+        ~ThreadState()
+        {
+            Libdeflate::freeDecompressor(libdeflate);
+        }
+
+        z_stream zstream;
+        ThreadHeap heap;
+        Libdeflate::Decompressor* libdeflate; // NULL unless libdeflate is loaded
+    };
 
-    virtual ParallelWorker* createWorker()
-    { return new DecompressWorker(); }
+    struct Piece
+    {
+        int first;
+        int step;
+    };
 
     OffsetVector* inputs;
     OffsetVector* outputs;
     DecompressDataReader::Entry* entry;
-
-    friend class DecompressWorker;
+    Piece pieces[MAX_DECOMPRESS_THREADS];
+    volatile int piecesLeft;
+    EventObject done;
 };
 
-DecompressWorker::DecompressWorker()
-    : heap(BAM_BLOCK)
+    void*
+DecompressStage::createThreadState()
+{
+    return new ThreadState();
+}
+
+    void
+DecompressStage::deleteThreadState(
+    void* state)
 {
-    zstream.zalloc = zalloc;
-    zstream.zfree = zfree;
-    zstream.opaque = &heap;
+    delete (ThreadState*) state;
 }
 
     void
-DecompressWorker::step()
+DecompressStage::decompressEntry(
+    DecompressDataReader::Entry* i_entry,
+    int nPieces)
 {
-    DecompressManager* manager = (DecompressManager*) getManager();
-    for (int i = getThreadNum(); i < manager->inputs->size() - 1; i += getNumThreads()) {
+    entry = i_entry;
+    nPieces = max(1, min(nPieces, min(MAX_DECOMPRESS_THREADS, (int) inputs->size() - 1)));
+    piecesLeft = nPieces;
+    PreventEventWaitersFromProceeding(&done);
+    WorkPool* pool = WorkPool::get();
+    for (int i = 0; i < nPieces; i++) {
+        pieces[i].first = i;
+        pieces[i].step = nPieces;
+        pool->submit(this, &pieces[i]);
+    }
+    WorkPool::helpUntil(&done);
+}
+
+    void
+DecompressStage::run(
+    void* threadState,
+    void* item)
+{
+    ThreadState* state = (ThreadState*) threadState;
+    Piece* piece = (Piece*) item;
+    TraceScope trace("decompress");
+    for (int i = piece->first; i < inputs->size() - 1; i += piece->step) {
+        if (state->libdeflate != NULL) {
+            size_t outputUsed;
+            if (! Libdeflate::decompress(state->libdeflate,
+                    entry->compressed + (*inputs)[i],
+                    (*inputs)[i + 1] - (*inputs)[i],
+                    entry->decompressed + (*outputs)[i],
+                    (*outputs)[i + 1] - (*outputs)[i],
+                    &outputUsed) ||
+                outputUsed != (*outputs)[i + 1] - (*outputs)[i]) {
+                fprintf(stderr, "GzipDataReader: libdeflate failed to decompress a BGZF block\n");
+                soft_exit(1);
+            }
+            continue;
+        }
         _int64 inputUsed, outputUsed;
-        DecompressDataReader::decompress(&zstream,
-            &heap,
-            manager->entry->compressed + (*manager->inputs)[i],
-            (*manager->inputs)[i + 1] - (*manager->inputs)[i],
+        DecompressDataReader::decompress(&state->zstream,
+            &state->heap,
+            entry->compressed + (*inputs)[i],
+            (*inputs)[i + 1] - (*inputs)[i],
             &inputUsed,
-            manager->entry->decompressed + (*manager->outputs)[i],
-            (*manager->outputs)[i + 1] - (*manager->outputs)[i],
+            entry->decompressed + (*outputs)[i],
+            (*outputs)[i + 1] - (*outputs)[i],
             &outputUsed,
             DecompressDataReader::SingleBlock);
-        _ASSERT(inputUsed == (*manager->inputs)[i + 1] - (*manager->inputs)[i] &&
-            outputUsed == (*manager->outputs)[i + 1] - (*manager->outputs)[i]);
+        _ASSERT(inputUsed == (*inputs)[i + 1] - (*inputs)[i] &&
+            outputUsed == (*outputs)[i + 1] - (*outputs)[i]);
+    }
+}
+
+    void
+DecompressStage::finished(
+    void* item)
+{
+    if (0 == InterlockedDecrementAndReturnNewValue(&piecesLeft)) {
+        AllowEventWaitersToProceed(&done);
     }
 }
 
@@ -1496,9 +2729,13 @@ DecompressDataReader::decompressThread(
 {
     DecompressDataReader* reader = (DecompressDataReader*) context;
     OffsetVector inputs, outputs;
-    DecompressManager manager(&inputs, &outputs);
-    ParallelCoworker coworker(min(4, DataSupplier::ThreadCount), false, &manager);
-    coworker.start();
+    //
+    // Both files of a pair decompress on the same pool, and the pairs can only go as fast as the file that's behind.
+    // So once the client has a whole batch waiting beyond the one it's reading, this reader's blocks go in at normal
+    // priority, and the other file's (or anything else that's holding things up) run first.
+    //
+    DecompressStage needed(&inputs, &outputs, WorkPool::Urgent);
+    DecompressStage ahead(&inputs, &outputs, WorkPool::Normal);
     // keep reading & decompressing entries until stopped
     bool stop = false;
     while (! stop) {
@@ -1550,15 +2787,13 @@ DecompressDataReader::decompressThread(
             entry->decompressedStart = output - reader->overflowBytes;
             entry->batch = reader->inner->getBatch();
             reader->inner->nextBatch(); // start reading next batch
-            // decompress all chunks synchronously on multiple threads
-            manager.entry = entry;
-            coworker.step();
+            // decompress all chunks on the work pool, and wait for them
+            (reader->nQueued >= READ_AHEAD_FOR_NORMAL_PRIORITY ? &ahead : &needed)->decompressEntry(entry, DataSupplier::ThreadCount);
         }
         // make buffer available for clients & go on to next
         //fprintf(stderr, "decompressThread #%d %d:%d ready\n", index, entry->batch.fileID, entry->batch.batchID);
         reader->enqueueReady(entry);
     }
-    coworker.stop();
     AllowEventWaitersToProceed(&reader->decompressThreadDone);
 }
 
@@ -1600,6 +2835,7 @@ DecompressDataReader::decompressThreadContinuous(
             entry->batch = reader->inner->getBatch();
             reader->inner->advance(entry->compressedValid);
             reader->inner->nextBatch(); // start reading next batch
+            TraceScope trace("decompress");
             decompress(&zstream, NULL,
                 entry->compressed, entry->compressedValid, &compressedRead,
                 entry->decompressed + reader->overflowBytes, reader->extraBytes - reader->overflowBytes, &decompressedWritten,
@@ -1642,6 +2878,9 @@ DecompressDataReader::popReady()
                 PreventEventWaitersFromProceeding(&readyEvent);
             }
             first = first->next;
+            if (first != NULL) {
+                nQueued--;  // the client's moving on to it
+            }
             _ASSERT(first == NULL || first->state == EntryReady);
             ReleaseExclusiveLock(&lock);
             return;
@@ -1664,6 +2903,7 @@ DecompressDataReader::enqueueReady(Entry* entry)
     } else {
         last->next = entry;
         last = entry;
+        nQueued++;
     }
     ReleaseExclusiveLock(&lock);
 }
@@ -1729,8 +2969,9 @@ DecompressDataReaderSupplier::getDataReader(
     // adjust extra factor for compression ratio
     double expand = MAX_FACTOR * DataSupplier::ExpansionFactor;
     double totalFactor = expand * (1.0 + extraFactor);
-    // get inner reader with no overflow since zlib can't deal with it
-    DataReader* data = inner->getDataReader(blockSize, totalFactor);
+    // get inner reader with enough overflow that a whole BGZF block always fits at the end of a batch, in case a gzip
+    // file turns out to be BGZF; the continuous decompressor just carries on through the overlap
+    DataReader* data = inner->getDataReader(BAM_BLOCK, totalFactor);
     // compute how many extra bytes are owned by this layer
     char* p;
     _int64 totalExtra;
@@ -2220,10 +3461,65 @@ DataSupplier* DataSupplier::Stdio[2] =
 DataSupplier* DataSupplier::GzipStdio[2] = 
 { DataSupplier::Gzip(DataSupplier::Stdio[false], false), DataSupplier::Gzip(DataSupplier::Stdio[false], true) };
 
+DataSupplier* DataSupplier::Remote[2] =
+{ new RemoteDataSupplier(false), new RemoteDataSupplier(true) };
+
+DataSupplier* DataSupplier::GzipRemote[2] =
+{ DataSupplier::Gzip(DataSupplier::Remote[false], false), DataSupplier::Gzip(DataSupplier::Remote[false], true) };
+
+    DataSupplier*
+DataSupplier::ForFile(
+    const char* fileName,
+    bool gzip,
+    bool autoRelease)
+{
+    if (!strcmp(fileName, "-")) {
+        return gzip ? GzipStdio[autoRelease] : Stdio[autoRelease];
+    } else if (GenericFile::IsRemote(fileName)) {
+        return gzip ? GzipRemote[autoRelease] : Remote[autoRelease];
+    } else {
+        return gzip ? GzipDefault[autoRelease] : Default[autoRelease];
+    }
+}
+
+    _int64
+DataSupplier::InputFileSize(
+    const char* fileName)
+{
+    if (!GenericFile::IsRemote(fileName)) {
+        return QueryFileSize(fileName);
+    }
+
+    GenericFile* file = GenericFile::open(fileName, GenericFile::ReadOnly);
+    _int64 size = NULL == file ? -1 : file->getSize();
+    if (size < 0) {
+        fprintf(stderr,"Unable to get the size of '%s'\n", fileName);
+        soft_exit(1);
+    }
+    file->close();
+    delete file;
+    return size;
+}
+
+    void
+DataSupplier::SetDefault(
+    DataSupplier* raw[2])
+{
+    for (int autoRelease = 0; autoRelease < 2; autoRelease++) {
+        Default[autoRelease] = raw[autoRelease];
+        GzipDefault[autoRelease] = Gzip(raw[false], 0 != autoRelease);
+        GzipBamDefault[autoRelease] = GzipBam(raw[false], 0 != autoRelease);
+    }
+}
+
 
 int DataSupplier::ThreadCount = 1;
 
 double DataSupplier::ExpansionFactor = 1.0;
 
+bool DataSupplier::StreamStdin = false;
+
+_int64 DataSupplier::MaxReadBufferBytes = 0;
+
 volatile _int64 DataReader::ReadWaitTime = 0;
 volatile _int64 DataReader::ReleaseWaitTime = 0;
@@ -24,6 +24,9 @@ Revision History:
 
 #include "Compat.h"
 #include "VariableSizeMap.h"
+
+class Genome;
+
 //
 // This defines a family of composable classes for efficiently reading data with flow control.
 //
@@ -117,6 +120,10 @@ public:
     // whether current batch is last in file
     virtual bool isEOF() = 0;
 
+    // whether getData (after nextBatch, if this batch is used up) would return without waiting for more input
+    // to arrive; readers that can't tell say true
+    virtual bool isDataReady() { return true; }
+
     // get current batch identifier
     virtual DataBatch getBatch() = 0;
 
@@ -159,6 +166,9 @@ public:
     static DataSupplier* Gzip(DataSupplier* inner, bool autoRelease);
     static DataSupplier* StdioSupplier(bool autoRelease);
 
+    // decodes CRAM against genome into a BAM header and records, for BAMReader
+    static DataSupplier* CramSupplier(const Genome* genome, bool autoRelease);
+
     // memmap works on both platforms (but better on Linux)
     static DataSupplier* MemMap[2];
 
@@ -167,6 +177,16 @@ public:
     static DataSupplier* WindowsOverlapped[2];
 #endif
 
+#ifdef __linux__
+    // many reads in flight at once using POSIX AIO, for storage that a single synchronous reader can't keep busy
+    static DataSupplier* LinuxAio[2];
+#endif
+
+#ifdef __APPLE__
+    // the Mac's equivalent of LinuxAio: preads run on a dispatch queue, with the kernel told about each range ahead
+    static DataSupplier* OsxDispatch[2];
+#endif
+
     // default raw data supplier for platform
     static DataSupplier* Default[2];
     static DataSupplier* GzipDefault[2];
@@ -174,12 +194,31 @@ public:
     static DataSupplier* GzipStdio[2];
     static DataSupplier* Stdio[2];
 
+    // files in remote storage that GenericFile can open (HDFS), read with many ranges in flight at once
+    static DataSupplier* Remote[2];
+    static DataSupplier* GzipRemote[2];
+
+    // the supplier to read fileName with: stdio for "-", remote for remote files, otherwise the default
+    static DataSupplier* ForFile(const char* fileName, bool gzip, bool autoRelease);
+
+    // QueryFileSize, but for remote files as well
+    static _int64 InputFileSize(const char* fileName);
+
+    // make raw (e.g. MemMap, LinuxAio or OsxDispatch) the default, including under the gzip and BAM suppliers
+    static void SetDefault(DataSupplier* raw[2]);
+
     // hack: must be set to communicate thread count into suppliers
     static int ThreadCount;
 
     // hack: global for additional expansion factor
     static double ExpansionFactor;
 
+    // stdin readers hand on whatever input has arrived rather than waiting to fill a buffer (for -stream)
+    static bool StreamStdin;
+
+    // the most buffer memory each file reader can grow its read-ahead to; 0 for four times what it starts with
+    static _int64 MaxReadBufferBytes;
+
 protected:
     const bool autoRelease;
 };
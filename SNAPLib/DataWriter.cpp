@@ -22,7 +22,16 @@ Environment:
 #include "DataWriter.h"
 #include "ParallelTask.h"
 #include "exit.h"
+#include "PerfCounters.h"
 #include "Bam.h"
+#include "InputOrder.h"
+#include "TraceRecorder.h"
+#include "GenericFile.h"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 using std::min;
 using std::max;
@@ -42,16 +51,34 @@ private:
     friend class FileEncoder;
     void advance(size_t physical, size_t logical, size_t* o_physical, size_t* o_logical);
 
+    bool readyToPlace(AsyncDataWriter* writer, size_t logicalOffset);
+    AsyncDataWriter* placed(size_t logicalOffset, size_t logicalUsed);
+
     const char* filename;
     AsyncFile* file;
     DataWriter::FilterSupplier* filterSupplier;
     FileEncoder* encoder;
     const int bufferCount;
     const size_t bufferSize;
-    ExclusiveLock lock;
-    size_t sharedOffset;
-    size_t sharedLogical;
+    ExclusiveLock lock;     // only for reserving both offsets at once
+    volatile _int64 sharedOffset;
+    volatile _int64 sharedLogical;
     bool closing;
+
+    //
+    // With -ordered, encoded batches go into the file in the order their logical offsets were reserved, which is the
+    // input's, rather than the order they finish encoding in.  A writer whose next batch isn't next waits here, and
+    // the writer that places the batch before it finishes its batches for it.
+    //
+    struct WaitingWriter
+    {
+        AsyncDataWriter* writer;
+        size_t logicalOffset;
+    };
+    bool placeInOrder;
+    ExclusiveLock placeLock;
+    size_t nextLogicalToPlace;
+    VariableSizeVector<WaitingWriter> waitingToPlace;
 };
 
 class AsyncDataWriter : public DataWriter
@@ -67,16 +94,18 @@ public:
             delete batches[i].file;
         }
         BigDealloc(batches[0].buffer); // all in one big block
-        delete [] batches;
         if (encoder != NULL) {
-            delete encoder;
+            for (int i = 0; i < count; i++) {
+                delete [] batches[i].encodedSizes;
+            }
         }
+        delete [] batches;
         DestroyExclusiveLock(&lock);
     }
 
     virtual bool getBuffer(char** o_buffer, size_t* o_size);
 
-    virtual void advance(unsigned bytes, unsigned location = 0);
+    virtual void advance(unsigned bytes, GenomeLocation location = 0);
 
     virtual bool getBatch(int relative, char** o_buffer, size_t* o_size, size_t* o_used, size_t* o_offset, size_t* o_logicalUsed = 0, size_t* o_logicalOffset = NULL);
 
@@ -101,6 +130,8 @@ private:
         size_t logicalUsed;
         size_t logicalOffset;
         EventObject encoded;
+        FileEncoder::Job job;
+        size_t* encodedSizes;   // of each chunk
     };
     Batch* batches;
     const int count;
@@ -108,151 +139,257 @@ private:
     AsyncDataWriterSupplier* supplier;
     int current;
     FileEncoder* encoder;
+    int encoderBatch;   // the last batch handed to the encoder, whose buffer is no longer ours
+    int finishBatch;    // the next batch the encoder is to write out
     ExclusiveLock lock;
 
     friend class FileEncoder;
 };
 
 FileEncoder::FileEncoder(
-    int numThreads,
-    bool bindToProcessors,
-    ParallelWorkerManager* i_manager)
+    Codec* i_codec)
     :
-    encoderRunning(false),
-    coworker(numThreads == 0 ? NULL
-        : new ParallelCoworker(numThreads, bindToProcessors, i_manager, FileEncoder::outputReadyCallback, this))
-{}
-
-    void
-FileEncoder::initialize(
-    AsyncDataWriter* i_writer)
+    WorkPool::Stage(WorkPool::Normal),
+    codec(i_codec),
+    queueHead(NULL),
+    queueTail(NULL),
+    tasksActive(0)
 {
-    writer = i_writer;
-    lock = &writer->lock;
-    encoderBatch = writer->count - 1;
-    if (coworker != NULL) {
-        coworker->getManager()->initialize(this);
-        coworker->start();
-    }
+    InitializeExclusiveLock(&lock);
+    CreateEventObject(&tasksDone);
 }
 
-    void
-FileEncoder::inputReady()
+FileEncoder::~FileEncoder()
 {
-    AcquireExclusiveLock(lock);
-    if (! encoderRunning) {
-        checkForInput();
+    //
+    // The writers have all been closed, so everything's been encoded, but the last tasks may not have finished with us.
+    //
+    AcquireExclusiveLock(&lock);
+    _ASSERT(queueHead == NULL);
+    while (tasksActive > 0) {
+        PreventEventWaitersFromProceeding(&tasksDone);
+        ReleaseExclusiveLock(&lock);
+        WaitForEvent(&tasksDone);
+        AcquireExclusiveLock(&lock);
     }
-    ReleaseExclusiveLock(lock);
+    ReleaseExclusiveLock(&lock);
+    deleteThreadStates();
+
+    DestroyEventObject(&tasksDone);
+    DestroyExclusiveLock(&lock);
+    delete codec;
 }
 
     void
-FileEncoder::close()
+FileEncoder::enqueue(
+    Job* job)
 {
-    // wait for pending encodes
-    AcquireExclusiveLock(lock);
-    int start = encoderBatch;
-    int pending = (writer->current + writer->count - start) % writer->count;
-    ReleaseExclusiveLock(lock);
-    for (int i = 0; i < pending; i++) {
-        WaitForEvent(&writer->batches[(start + i) % writer->count].encoded);
+    AsyncDataWriter::Batch* batch = &job->writer->batches[job->batch];
+    if (codec->chunkSize == 0) {
+        job->nChunks = batch->used > 0 ? 1 : 0;
+    } else {
+        job->nChunks = (int) ((batch->used + codec->chunkSize - 1) / codec->chunkSize);
+    }
+    job->nextChunk = 0;
+    job->chunksLeft = job->nChunks;
+    job->encoded = false;
+    job->next = NULL;
+    if (job->nChunks == 0) {
+        // nothing to encode, but it still has to be finished in its turn
+        job->encoded = true;
+        finishBatches(job->writer);
+        return;
+    }
+
+    AcquireExclusiveLock(&lock);
+    if (queueTail == NULL) {
+        queueHead = job;
+    } else {
+        queueTail->next = job;
+    }
+    queueTail = job;
+    int nChunks = job->nChunks;
+    tasksActive += nChunks;
+    ReleaseExclusiveLock(&lock);
+
+    // a task per chunk, each taking whichever is next in the queue
+    WorkPool* pool = WorkPool::get();
+    for (int i = 0; i < nChunks; i++) {
+        pool->submit(this, NULL);
     }
-    coworker->stop();
 }
 
-    void
-FileEncoder::outputReadyCallback(
-    void *p)
+    void*
+FileEncoder::createThreadState()
 {
-    ((FileEncoder*) p)->outputReady();
+    ThreadState* state = new ThreadState();
+    state->codecState = codec->createThreadState();
+    state->scratchSize = codec->chunkSize;   // whole batch codecs grow it to the biggest writer buffer they see
+    state->scratch = state->scratchSize > 0 ? (char*) BigAlloc(state->scratchSize) : NULL;
+    return state;
 }
 
     void
-FileEncoder::outputReady()
+FileEncoder::deleteThreadState(
+    void* threadState)
 {
-    AcquireExclusiveLock(lock);
-
-    encoderRunning = false;
-
-    // begin writing the buffer to disk
-    AsyncDataWriter::Batch* write = &writer->batches[encoderBatch];
-    writer->supplier->advance(write->used, 0, &write->fileOffset, &write->logicalOffset);
-    //fprintf(stderr, "outputReady write batch %d @%lld:%lld\n", encoderBatch, write->fileOffset, write->used);
-    if (! write->file->beginWrite(write->buffer, write->used, write->fileOffset, NULL)) {
-        fprintf(stderr, "error: file write %lld bytes at offset %lld failed\n", write->used, write->fileOffset);
-        soft_exit(1);
+    ThreadState* state = (ThreadState*) threadState;
+    if (state->scratch != NULL) {
+        BigDealloc(state->scratch);
     }
-    AllowEventWaitersToProceed(&write->encoded);
-
-    // check for more work
-    checkForInput();
-
-    ReleaseExclusiveLock(lock);
+    codec->deleteThreadState(state->codecState);
+    delete state;
 }
 
     void
-FileEncoder::checkForInput()
+FileEncoder::run(
+    void* threadState,
+    void* item)
 {
-    // look for another block ready to encode
-    while (true) {
-        int nextBatch = (encoderBatch + 1) % writer->count;
-        if (nextBatch == writer->current) {
-            break;
+    ThreadState* state = (ThreadState*) threadState;
+
+    AcquireExclusiveLock(&lock);
+    _ASSERT(queueHead != NULL);
+    Job* job = queueHead;
+    int chunk = job->nextChunk++;
+    if (job->nextChunk == job->nChunks) {
+        queueHead = job->next;
+        if (queueHead == NULL) {
+            queueTail = NULL;
         }
-        encoderBatch = nextBatch;
-        AsyncDataWriter::Batch* encode = &writer->batches[encoderBatch];
-        if (encode->used > 0) {
-            encoderRunning = true;
-            coworker->step();
-            break;
+    }
+    ReleaseExclusiveLock(&lock);
+
+    //
+    // Encode into scratch and copy it back over the chunk's own input, which nothing else reads.  The chunks are
+    // packed together once they're all done.
+    //
+    AsyncDataWriter::Batch* batch = &job->writer->batches[job->batch];
+    size_t offset, bytes, room;
+    if (codec->chunkSize == 0) {
+        offset = 0;
+        bytes = batch->used;
+        room = job->writer->bufferSize;
+        if (room > state->scratchSize) {
+            if (state->scratch != NULL) {
+                BigDealloc(state->scratch);
+            }
+            state->scratchSize = room;
+            state->scratch = (char*) BigAlloc(state->scratchSize);
         }
+    } else {
+        offset = chunk * codec->chunkSize;
+        bytes = min(codec->chunkSize, batch->used - offset);
+        room = min(codec->chunkSize, job->writer->bufferSize - offset);
     }
-}
 
-    void
-FileEncoder::setupEncode(
-    int relative)
-{
-    encoderBatch = (writer->current + relative + writer->count) % writer->count;
+    //
+    // The writer only waits once its other buffers are all with us, so how many of them are gives the backlog.  It's read
+    // without the writer's lock, so it may be a little stale, which is fine for a hint.  This batch isn't written out
+    // yet, so the writer has at least one, and at most all but the one it's filling.
+    //
+    AsyncDataWriter* writer = job->writer;
+    int waiting = (writer->encoderBatch - writer->finishBatch + writer->count) % writer->count + 1;
+    double backlog = writer->count > 2 ? (double) (waiting - 1) / (writer->count - 2) : 1.0;
+    backlog = max(0.0, min(1.0, backlog));
+
+    size_t encoded = codec->encodeChunk(state->codecState, state->scratch, room, batch->buffer + offset, bytes, backlog);
+    _ASSERT(encoded <= room); // can't grow past the chunk's slot
+    memcpy(batch->buffer + offset, state->scratch, encoded);
+    batch->encodedSizes[chunk] = encoded;
+
+    if (0 == InterlockedDecrementAndReturnNewValue(&job->chunksLeft)) {
+        job->encoded = true;
+        finishBatches(job->writer);
+    }
 }
 
     void
-FileEncoder::getEncodeBatch(
-    char** o_batch,
-    size_t* o_batchSize,
-    size_t* o_batchUsed)
+FileEncoder::finished(
+    void* item)
 {
-    AsyncDataWriter::Batch* batch = &writer->batches[encoderBatch];
-    *o_batch = batch->buffer;
-    *o_batchSize = writer->bufferSize;
-    *o_batchUsed = batch->used;
-    //fprintf(stderr, "getEncodeBatch #%d: %lld/%lld\n", encoderBatch, batch->used, writer->bufferSize);
+    AcquireExclusiveLock(&lock);
+    tasksActive--;
+    if (tasksActive == 0) {
+        AllowEventWaitersToProceed(&tasksDone);
+    }
+    ReleaseExclusiveLock(&lock);
 }
 
     void
-FileEncoder::getOffsets(
-    size_t* o_logicalOffset,
-    size_t* o_physicalOffset)
+FileEncoder::finishBatches(
+    AsyncDataWriter* writer)
 {
-    // logical has already been set correctly in batch
-    *o_logicalOffset = writer->batches[encoderBatch].logicalOffset;
-    // physical is not yet updated, use shared
-    *o_physicalOffset = writer->supplier->sharedOffset;
+    //
+    // With -ordered, placing one writer's batch can let another writer's go, which can let a third's go, and so on, so
+    // take them in turn rather than recursing.
+    //
+    while (writer != NULL) {
+        writer = placeBatches(writer);
+    }
 }
 
-    void
-FileEncoder::setEncodedBatchSize(
-    size_t newSize)
+    AsyncDataWriter*
+FileEncoder::placeBatches(
+    AsyncDataWriter* writer)
 {
-    size_t old = writer->batches[encoderBatch].used;
-//fprintf(stderr, "setEncodedBatchSize #%d %lld -> %lld\n", encoderBatch, old, newSize);
-    if (newSize != old) {
-        AcquireExclusiveLock(lock);
-        AsyncDataWriter::Batch* batch = &writer->batches[encoderBatch];
-        batch->logicalUsed = batch->used;
-        batch->used = newSize;
-        ReleaseExclusiveLock(lock);
+    //
+    // The batches are only signalled once the writer's lock is released, since a close() waiting for the last of them
+    // may delete the writer as soon as it sees it.
+    //
+    AsyncDataWriter::Batch* batches = writer->batches;
+    const int count = writer->count;
+    AsyncDataWriterSupplier* supplier = writer->supplier;
+    AsyncDataWriter* resume = NULL;
+    int first, finished = 0;
+
+    AcquireExclusiveLock(&writer->lock);
+    first = writer->finishBatch;
+    while (true) {
+        AsyncDataWriter::Batch* write = &writer->batches[writer->finishBatch];
+        if (! write->job.encoded) {
+            break;
+        }
+        size_t logicalOffset = write->logicalOffset;
+        size_t logicalUsed = write->logicalUsed;    // as reserved in nextBatch
+        if (supplier->placeInOrder && logicalUsed > 0 && ! supplier->readyToPlace(writer, logicalOffset)) {
+            break;
+        }
+        write->job.encoded = false;
+
+        // pack the chunks together; each one moves down, never over a later one
+        size_t used = 0;
+        for (int i = 0; i < write->job.nChunks; i++) {
+            memmove(write->buffer + used, write->buffer + i * codec->chunkSize, write->encodedSizes[i]);
+            used += write->encodedSizes[i];
+        }
+
+        // the logical offset was assigned in nextBatch, when the batch was handed off
+        size_t ignoreLogical;
+        supplier->advance(used, 0, &write->fileOffset, &ignoreLogical);
+        codec->onBatchEncoded(write->buffer, used, write->logicalOffset, write->used, write->fileOffset,
+            write->encodedSizes, write->job.nChunks);
+        write->logicalUsed = write->used;
+        write->used = used;
+
+        //fprintf(stderr, "finishBatches write batch %d @%lld:%lld\n", writer->finishBatch, write->fileOffset, write->used);
+        if (used > 0 && ! write->file->beginWrite(write->buffer, write->used, write->fileOffset, NULL)) {
+            fprintf(stderr, "error: file write %lld bytes at offset %lld failed\n", write->used, write->fileOffset);
+            soft_exit(1);
+        }
+        writer->finishBatch = (writer->finishBatch + 1) % writer->count;
+        finished++;
+        if (supplier->placeInOrder && logicalUsed > 0) {
+            // if another writer's waiting for this one, this writer's next batch can't be next
+            resume = supplier->placed(logicalOffset, logicalUsed);
+        }
+    }
+    ReleaseExclusiveLock(&writer->lock);
+
+    for (int i = 0; i < finished; i++) {
+        AllowEventWaitersToProceed(&batches[(first + i) % count].encoded);
     }
+    return resume;
 }
 
 AsyncDataWriter::AsyncDataWriter(
@@ -268,7 +405,9 @@ AsyncDataWriter::AsyncDataWriter(
     supplier(i_supplier),
     count(i_count),
     bufferSize(i_bufferSize),
-    current(0)
+    current(0),
+    encoderBatch(i_count - 1),
+    finishBatch(0)
 {
     _ASSERT(count >= 2);
     char* block = (char*) BigAlloc(count * bufferSize);
@@ -287,13 +426,15 @@ AsyncDataWriter::AsyncDataWriter(
         if (encoder != NULL) {
             CreateEventObject(&batches[i].encoded);
             AllowEventWaitersToProceed(&batches[i].encoded); // initialize so empty bufs are available
+            batches[i].job.writer = this;
+            batches[i].job.batch = i;
+            batches[i].job.encoded = false;
+            size_t chunkSize = encoder->codec->chunkSize == 0 ? bufferSize : encoder->codec->chunkSize;
+            batches[i].encodedSizes = new size_t[(bufferSize + chunkSize - 1) / chunkSize];
         }
     }
 
     InitializeExclusiveLock(&lock);
-    if (encoder != NULL) {
-        encoder->initialize(this);
-    }
 }
     
     bool
@@ -309,7 +450,7 @@ AsyncDataWriter::getBuffer(
     void
 AsyncDataWriter::advance(
     unsigned bytes,
-    unsigned location)
+    GenomeLocation location)
 {
     _ASSERT(bytes <= bufferSize - batches[current].used);
     char* data = batches[current].buffer + batches[current].used;
@@ -335,7 +476,7 @@ AsyncDataWriter::getBatch(
     if (relative < 1 - count || relative > count - 1) {
         return false;
     }
-    if (encoder != NULL && relative <= ((encoder->encoderBatch - current + count) % count) - count) {
+    if (encoder != NULL && relative <= ((encoderBatch - current + count) % count) - count) {
         return false;
     }
     int index = (current + relative + count) % count; // ensure non-negative
@@ -358,6 +499,7 @@ AsyncDataWriter::getBatch(
     }
     if (relative >= 0) {
         if (encoder != NULL) {
+            PerfTimer timer(PerfCounters::QueueWait);
             WaitForEvent(&batch->encoded);
         }
         batch->file->waitForCompletion();
@@ -368,14 +510,18 @@ AsyncDataWriter::getBatch(
     bool
 AsyncDataWriter::nextBatch()
 {
+    TraceScope trace("write batch");
     _int64 start = timeInNanos();
     if (encoder != NULL) {
-        WaitForEvent(&batches[(current + 1) % count].encoded);
+        PerfTimer timer(PerfCounters::QueueWait);
+        WorkPool::helpUntil(&batches[(current + 1) % count].encoded);
     }
+    InputOrder::waitForTurn(); // with -ordered, until no other thread can still write anything that comes before this
     acquireLock();
     int written = current;
     Batch* write = &batches[written];
     write->logicalUsed = write->used;
+    PerfCounters::forThisThread()->writeBatchBytes.record(write->used);
     current = (current + 1) % count;
     //fprintf(stderr, "nextBatch reset %d used=0\n", current);
     batches[current].used = 0;
@@ -383,8 +529,8 @@ AsyncDataWriter::nextBatch()
     bool newSize = filter != NULL && (filter->filterType == TransformFilter || filter->filterType == ResizeFilter);
     if (newSize) {
         // advisory only
-        write->fileOffset = supplier->sharedOffset;
-        write->logicalOffset = supplier->sharedLogical;
+        write->fileOffset = (size_t)supplier->sharedOffset;
+        write->logicalOffset = (size_t)supplier->sharedLogical;
     } else {
         supplier->advance(encoder == NULL ? write->used : 0, write->logicalUsed, &write->fileOffset, &write->logicalOffset);
     }
@@ -396,7 +542,7 @@ AsyncDataWriter::nextBatch()
 	    }
         if (newBuffer) {
             // current has used>0, written has logicalUsed>0, for compressed & uncompressed data respectively
-            batches[current].used = write->used;
+            batches[current].used = filter->filterType == CopyFilter ? n : write->used;
             batches[current].fileOffset = write->fileOffset;
             batches[current].logicalUsed = 0;
             batches[current].logicalOffset = write->logicalOffset;
@@ -421,7 +567,8 @@ AsyncDataWriter::nextBatch()
         }
     } else {
         PreventEventWaitersFromProceeding(&write->encoded);
-        encoder->inputReady();
+        encoderBatch = written;
+        encoder->enqueue(&write->job);
     }
     if (! batches[current].file->waitForCompletion()) {
         fprintf(stderr, "error: file write failed\n");
@@ -436,7 +583,10 @@ AsyncDataWriter::close()
 {
     nextBatch(); // ensure last buffer gets written
     if (encoder != NULL) {
-        encoder->close();
+        // wait for pending encodes
+        for (int i = 0; i < count; i++) {
+            WorkPool::helpUntil(&batches[i].encoded);
+        }
         for (int i = 0; i < count; i++) {
             DestroyEventObject(&batches[i].encoded);
         }
@@ -460,7 +610,9 @@ AsyncDataWriterSupplier::AsyncDataWriterSupplier(
     bufferSize(i_bufferSize),
     sharedOffset(0),
     sharedLogical(0),
-    closing(false)
+    closing(false),
+    placeInOrder(InputOrder::Enabled && i_encoder != NULL),
+    nextLogicalToPlace(0)
 {
     file = AsyncFile::open(filename, true);
     if (file == NULL) {
@@ -468,6 +620,7 @@ AsyncDataWriterSupplier::AsyncDataWriterSupplier(
         soft_exit(1);
     }
     InitializeExclusiveLock(&lock);
+    InitializeExclusiveLock(&placeLock);
 }
 
     DataWriter*
@@ -486,10 +639,15 @@ AsyncDataWriterSupplier::close()
         filterSupplier->onClosing(this);
     }
     file->close();
+    if (encoder != NULL) {
+        delete encoder; // all its writers are closed
+        encoder = NULL;
+    }
     if (filterSupplier != NULL) {
         filterSupplier->onClosed(this);
     }
     DestroyExclusiveLock(&lock);
+    DestroyExclusiveLock(&placeLock);
 }
     void
 AsyncDataWriterSupplier::advance(
@@ -498,13 +656,69 @@ AsyncDataWriterSupplier::advance(
     size_t* o_physical,
     size_t* o_logical)
 {
-    AcquireExclusiveLock(&lock);
-    *o_physical = sharedOffset;
-    sharedOffset += physical;
-    *o_logical = sharedLogical;
-    sharedLogical += logical;
+    //
+    // With an encoder, the logical offset's reserved when a batch is handed off and the physical one when it's been
+    // encoded, so each call only moves one of them and can do it with an interlocked add.  Moving both at once takes
+    // the lock, so that batches are in the same order in the file as in the logical data, which translation relies on.
+    // The offset that isn't moving is only advisory.
+    //
+    if (0 == logical) {
+        *o_physical = (size_t)(InterlockedAdd64AndReturnNewValue(&sharedOffset, (_int64)physical) - (_int64)physical);
+        *o_logical = (size_t)sharedLogical;
+    } else if (0 == physical) {
+        *o_logical = (size_t)(InterlockedAdd64AndReturnNewValue(&sharedLogical, (_int64)logical) - (_int64)logical);
+        *o_physical = (size_t)sharedOffset;
+    } else {
+        AcquireExclusiveLock(&lock);
+        *o_physical = (size_t)(InterlockedAdd64AndReturnNewValue(&sharedOffset, (_int64)physical) - (_int64)physical);
+        *o_logical = (size_t)(InterlockedAdd64AndReturnNewValue(&sharedLogical, (_int64)logical) - (_int64)logical);
+        ReleaseExclusiveLock(&lock);
+    }
     //fprintf(stderr, "advance %lld + %lld = %lld, logical %lld + %lld = %lld\n", *o_physical, physical, sharedOffset, *o_logical, logical, sharedLogical);
-    ReleaseExclusiveLock(&lock);
+}
+
+    bool
+AsyncDataWriterSupplier::readyToPlace(
+    AsyncDataWriter* writer,
+    size_t logicalOffset)
+{
+    AcquireExclusiveLock(&placeLock);
+    bool ready = logicalOffset == nextLogicalToPlace;
+    if (! ready) {
+        // the batch stays at the head of its writer until it's placed, so the writer's only ever here once
+        bool alreadyWaiting = false;
+        for (int i = 0; i < waitingToPlace.size(); i++) {
+            alreadyWaiting |= waitingToPlace[i].writer == writer;
+        }
+        if (! alreadyWaiting) {
+            WaitingWriter waiting;
+            waiting.writer = writer;
+            waiting.logicalOffset = logicalOffset;
+            waitingToPlace.push_back(waiting);
+        }
+    }
+    ReleaseExclusiveLock(&placeLock);
+    return ready;
+}
+
+    AsyncDataWriter*
+AsyncDataWriterSupplier::placed(
+    size_t logicalOffset,
+    size_t logicalUsed)
+{
+    AsyncDataWriter* next = NULL;
+    AcquireExclusiveLock(&placeLock);
+    _ASSERT(logicalOffset == nextLogicalToPlace);
+    nextLogicalToPlace = logicalOffset + logicalUsed;
+    for (int i = 0; i < waitingToPlace.size(); i++) {
+        if (waitingToPlace[i].logicalOffset == nextLogicalToPlace) {
+            next = waitingToPlace[i].writer;
+            waitingToPlace.erase(i);
+            break;
+        }
+    }
+    ReleaseExclusiveLock(&placeLock);
+    return next;
 }
 
     DataWriterSupplier*
@@ -533,7 +747,7 @@ public:
 		b->inHeader(flag);
 	}
 
-    virtual void onAdvance(DataWriter* writer, size_t batchOffset, char* data, unsigned bytes, unsigned location)
+    virtual void onAdvance(DataWriter* writer, size_t batchOffset, char* data, unsigned bytes, GenomeLocation location)
     {
         a->onAdvance(writer, batchOffset, data, bytes, location);
         b->onAdvance(writer, batchOffset, data, bytes, location);
@@ -575,6 +789,31 @@ public:
         b->onClosed(supplier);
     }
 
+    virtual bool beginMergeRanges(int nRanges)
+    {
+        bool ra = a->beginMergeRanges(nRanges);
+        bool rb = b->beginMergeRanges(nRanges);
+        return ra || rb;
+    }
+
+    virtual void onRangeMerged(int range, char* records, const unsigned* lengths, int nRecords, _int64 beginLocation, _int64 endLocation)
+    {
+        a->onRangeMerged(range, records, lengths, nRecords, beginLocation, endLocation);
+        b->onRangeMerged(range, records, lengths, nRecords, beginLocation, endLocation);
+    }
+
+    virtual void onRangeWriting(int range, char* records, const unsigned* lengths, int nRecords)
+    {
+        a->onRangeWriting(range, records, lengths, nRecords);
+        b->onRangeWriting(range, records, lengths, nRecords);
+    }
+
+    virtual void endMergeRanges()
+    {
+        a->endMergeRanges();
+        b->endMergeRanges();
+    }
+
 private:
     DataWriter::FilterSupplier* a;
     DataWriter::FilterSupplier* b;
@@ -591,22 +830,35 @@ volatile _int64 DataWriter::WaitTime = 0;
 volatile _int64 DataWriter::FilterTime = 0;
 
 
-StdoutAsyncFile::StdoutAsyncFile()
+StdoutAsyncFile::StdoutAsyncFile(GenericFile *i_remote) : remote(i_remote)
 {
-    if (anyCreated) {
-        fprintf(stderr,"You can only ever write to stdout once per SNAP run (even if you're doing multiple runs with the comma syntax\n");
-        soft_exit(1);
-    }
-    anyCreated = true;
+    if (NULL == remote) {
+        if (anyCreated) {
+            fprintf(stderr,"You can only ever write to stdout once per SNAP run (even if you're doing multiple runs with the comma syntax\n");
+            soft_exit(1);
+        }
+        anyCreated = true;
 
 #ifdef _MSC_VER
-    int result = _setmode( _fileno( stdout ), _O_BINARY );  // puts stdout in to non-translated mode, so if we're writing compressed data windows' CRLF processing doesn't destroy it.
-    if (-1 == result) {
-        fprintf(stderr,"StdoutAsyncFile::freopen to change to untranslated mode failed\n");
-        soft_exit(1);
-    }
+        int result = _setmode( _fileno( stdout ), _O_BINARY );  // puts stdout in to non-translated mode, so if we're writing compressed data windows' CRLF processing doesn't destroy it.
+        if (-1 == result) {
+            fprintf(stderr,"StdoutAsyncFile::freopen to change to untranslated mode failed\n");
+            soft_exit(1);
+        }
 #endif // _MSC_VER
 
+#ifdef __linux__
+        //
+        // The consumer writes straight to the file descriptor rather than through stdio, so push out anything stdio has
+        // already buffered to keep it in order.  If stdout's a pipe, make it big enough to hold a whole write, so that the
+        // consumer makes one system call per buffer rather than trading 64K at a time with whatever's downstream.  That's
+        // only a hint, so it's fine if the kernel won't do it.
+        //
+        fflush(stdout);
+        fcntl(fileno(stdout), F_SETPIPE_SZ, (int)MaxPipeSize);
+#endif // __linux__
+    }
+
     writeElementQueue->next = writeElementQueue->prev = writeElementQueue;
     highestOffsetCompleted = 0;
 
@@ -616,6 +868,8 @@ StdoutAsyncFile::StdoutAsyncFile()
     PreventEventWaitersFromProceeding(&unexaminedElementsOnQueue);
     PreventEventWaitersFromProceeding(&elementsCompleted);
 
+    CreateSingleWaiterObject(&consumerThreadDone);
+
     closing = false;
 
     StartNewThread(ConsumerThreadMain, this);
@@ -631,6 +885,17 @@ StdoutAsyncFile::open(const char *filename, bool write)
 
     return new StdoutAsyncFile();
 }
+
+    StdoutAsyncFile *
+StdoutAsyncFile::openRemote(const char *filename)
+{
+    GenericFile *remote = GenericFile::open(filename, GenericFile::WriteOnly);
+    if (NULL == remote) {
+        return NULL;
+    }
+
+    return new StdoutAsyncFile(remote);
+}
 class StdoutAsyncFileWriter : public AsyncFile::Writer
 {
 public:
@@ -693,6 +958,7 @@ StdoutAsyncFile::~StdoutAsyncFile()
     DestroyExclusiveLock(&lock);
     DestroyEventObject(&unexaminedElementsOnQueue);
     DestroyEventObject(&elementsCompleted);
+    DestroySingleWaiterObject(&consumerThreadDone);
 }
 
     bool 
@@ -705,6 +971,12 @@ StdoutAsyncFile::close()
 
     WaitForSingleWaiterObject(&consumerThreadDone);
 
+    if (NULL != remote) {
+        remote->close();    // flushes it
+        delete remote;
+        remote = NULL;
+    }
+
     return true;
 }
 
@@ -757,7 +1029,7 @@ StdoutAsyncFile::beginWrite(void *buffer, size_t length, size_t offset, size_t *
         // It isn't the first thing on the queue.  Figure out where it goes.
         //
         WriteElement *possiblePredecessor = writeElementQueue->next;
-        while (possiblePredecessor->next != writeElementQueue && possiblePredecessor->next->offset > offset) {
+        while (possiblePredecessor->next != writeElementQueue && possiblePredecessor->next->offset < offset) {
             possiblePredecessor = possiblePredecessor->next;
         }
         _ASSERT(possiblePredecessor->offset < offset);
@@ -782,7 +1054,9 @@ StdoutAsyncFile::waitForCompletion(size_t offset)
     void
 StdoutAsyncFile::runConsumer()
 {
+#ifndef __linux__
     size_t maxWriteSize = 1024 * 1024;
+#endif  // __linux__
 
     AcquireExclusiveLock(&lock);
     for (;;) {
@@ -797,9 +1071,13 @@ StdoutAsyncFile::runConsumer()
 
         if (isQueueEmpty() || writeElementQueue->next->offset != highestOffsetCompleted) {
             //
-            // Wait for work.
+            // Wait for work.  Push out what stdio is holding first, so that whatever's downstream of us in a pipeline
+            // gets everything written so far rather than waiting for stdio's buffer to fill.
             //
             ReleaseExclusiveLock(&lock);
+            if (NULL == remote) {
+                fflush(stdout);
+            }
             WaitForEvent(&unexaminedElementsOnQueue);
             AcquireExclusiveLock(&lock);
             PreventEventWaitersFromProceeding(&unexaminedElementsOnQueue);
@@ -814,6 +1092,33 @@ StdoutAsyncFile::runConsumer()
         ReleaseExclusiveLock(&lock);
         size_t bytesLeftToWrite = element->length;
         size_t totalBytesWritten = 0;
+        if (NULL != remote) {
+            totalBytesWritten = remote->write(element->buffer, bytesLeftToWrite);
+            if (totalBytesWritten != bytesLeftToWrite) {
+                fprintf(stderr,"StdoutAsyncFile::runConsumer(): write to remote file failed\n");
+                soft_exit(1);
+            }
+            bytesLeftToWrite = 0;
+        }
+#ifdef __linux__
+        //
+        // Hand the whole buffer to the kernel at once, which saves stdio's copy into its own buffer and its locking.
+        // (vmsplice would save the copy into the pipe too, but the pages would still belong to the pipe after we tell
+        // the writer its buffer is free, and the writer reuses it straight away.)
+        //
+        while (bytesLeftToWrite > 0) {
+            ssize_t bytesWritten = write(fileno(stdout), (char *)element->buffer + totalBytesWritten, bytesLeftToWrite);
+            if (bytesWritten < 0) {
+                if (EINTR == errno) {
+                    continue;
+                }
+                fprintf(stderr,"StdoutAsyncFile::runConsumer(): write failed %d\n", errno);
+                soft_exit(1);
+            }
+            bytesLeftToWrite -= bytesWritten;
+            totalBytesWritten += bytesWritten;
+        }
+#else   // __linux__
         while (bytesLeftToWrite > 0) {
             size_t bytesToWrite = __min(bytesLeftToWrite, maxWriteSize);
             size_t bytesWritten = fwrite((char *)element->buffer + totalBytesWritten, 1, bytesToWrite, stdout);
@@ -833,6 +1138,7 @@ StdoutAsyncFile::runConsumer()
             bytesLeftToWrite -= bytesWritten;
             totalBytesWritten += bytesWritten;
         }
+#endif  // __linux__
 
         if (NULL != element->o_bytesWritten) {
             *element->o_bytesWritten = totalBytesWritten;
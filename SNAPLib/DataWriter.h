@@ -37,7 +37,7 @@ public:
     {
         ReadFilter, // reads data but does not modify it
         ModifyFilter, // modifies data in place
-        CopyFilter, // copies data into new buffer, same size
+        CopyFilter, // copies data into new buffer, same size or smaller (the rest of its file space is left unwritten)
         TransformFilter, // copies data into new buffer, possibly different size
         ResizeFilter, // rewrites data in same buffer, possibly different size
     };
@@ -56,7 +56,7 @@ public:
 		virtual void inHeader(bool flag) {} // default do nothing
 
         // called when a chunk of data (i.e. a single read) has been written into the file
-        virtual void onAdvance(DataWriter* writer, size_t batchOffset, char* data, unsigned bytes, unsigned location) = 0;
+        virtual void onAdvance(DataWriter* writer, size_t batchOffset, char* data, unsigned bytes, GenomeLocation location) = 0;
 
         // called when a batch has been completed, after advancing to the next
         // e.g. so use getBatch(-1, ...) to get the one that was just completed
@@ -82,6 +82,18 @@ public:
         // called when entire file is done; onClosing before file is closed, onClosed after
         virtual void onClosing(DataWriterSupplier* supplier) = 0;
         virtual void onClosed(DataWriterSupplier* supplier) = 0;
+
+        //
+        // Optional hooks for the parallel merge of sorted output, which merges ranges of locations into memory on
+        // several threads and then writes them out in order.  If beginMergeRanges returns true, the supplier gets each
+        // range from onRangeMerged, on the thread that merged it and in any order, and then from onRangeWriting, in
+        // order on the writing thread just before its records go to the writer.  Its filters should leave alone
+        // whatever it does there.  endMergeRanges comes after the last range is written.
+        //
+        virtual bool beginMergeRanges(int nRanges) { return false; }
+        virtual void onRangeMerged(int range, char* records, const unsigned* lengths, int nRecords, _int64 beginLocation, _int64 endLocation) {}
+        virtual void onRangeWriting(int range, char* records, const unsigned* lengths, int nRecords) {}
+        virtual void endMergeRanges() {}
     };
 
     DataWriter(Filter* i_filter) : filter(i_filter) {}
@@ -96,7 +108,7 @@ public:
 
     // advance within current buffer, reducing available space
     // should be called on each read, with the location
-    virtual void advance(unsigned bytes, unsigned location = 0) = 0;
+    virtual void advance(unsigned bytes, GenomeLocation location = 0) = 0;
 
     // get complete data buffer in batch, relative==0 is current, relative==-1 is previous, etc.
     // if negative gets old data written, else waits for write to complete so you can write into it
@@ -121,6 +133,8 @@ class FileFormat;
 class Genome;
 class GzipWriterFilterSupplier;
 class FileEncoder;
+class DataSupplier;
+class GenericFile;
 
 // creates writers for multiple threads
 class DataWriterSupplier
@@ -132,94 +146,216 @@ public:
 
     // call when all threads are done, all filters destroyed
     virtual void close() = 0;
+
+    // buffers per writer (i.e., per thread), as create() makes them unless told otherwise and as sorted() makes them
+    static const int DefaultBufferCount = 4;
+    static const size_t DefaultBufferSize = 16 * 1024 * 1024;
+    static const int SortBufferCount = 3;
     
     static DataWriterSupplier* create(
         const char* filename,
         DataWriter::FilterSupplier* filterSupplier = NULL,
         FileEncoder* encoder = NULL,
-        int count = 4, size_t bufferSize = 16 * 1024 * 1024);
+        int count = DefaultBufferCount, size_t bufferSize = DefaultBufferSize);
     
     static DataWriterSupplier* sorted(
         const FileFormat* format,
         const Genome* genome,
         const char* tempFileName,
         size_t tempBufferMemory,
+        size_t keepMemory,      // sorted runs are kept in memory instead of the temp file until they add up to this
         int numThreads,
         const char* sortedFileName,
         DataWriter::FilterSupplier* sortedFilterSupplier,
+        FileEncoder* encoder = NULL,
+        const char* spillDirectories = NULL,   // comma separated; sorted runs go to a file in each in turn, not the temp file
+        bool compressSpills = false);           // compress the runs in the spill files (next to the temp file if no directories)
+
+    //
+    // The buffer memory sorted() uses in all when tempBufferMemory is 0, which grows with the genome and the threads.
+    //
+    static size_t defaultSortMemory(const Genome* genome, int numThreads);
+
+    //
+    // The (malloc'd) name of the temp file to sort outputFileName through.  It goes next to the output, except for a
+    // remote output, which can't be read back or renamed as the sort needs, so it goes in the current directory.
+    //
+    static char* sortTempFileName(const char* outputFileName);
+
+    //
+    // Merge already sorted files (e.g., the pieces from -range) into one, using only the first one's header.  headerBytes
+    // gives the size of each one's header as inputSupplier reads it (i.e., decompressed for BAM).
+    //
+    static bool mergeSortedFiles(
+        const FileFormat* format,
+        const Genome* genome,
+        DataSupplier* inputSupplier,
+        int nInputs,
+        const char** inputFileNames,
+        const size_t* headerBytes,
+        const char* outputFileName,
+        DataWriter::FilterSupplier* filterSupplier,
         FileEncoder* encoder = NULL);
 
-    // defaults follow BAM output spec
-    static GzipWriterFilterSupplier* gzip(bool bamFormat, size_t chunkSize, int numThreads, bool bindToProcessors, bool multiThreaded);
+    //
+    // defaults follow BAM output spec; the compression itself is done by a FileEncoder::gzip given to the writer supplier.
+    // Each chunk is compressed at a level between minLevel and maxLevel (zlib's 1 to 9): maxLevel while the encoder
+    // keeps up with the writers, and lower the further behind it gets.
+    //
+    static const int DefaultCompressionLevel = 6;   // what Z_DEFAULT_COMPRESSION means to zlib
+
+    static GzipWriterFilterSupplier* gzip(bool bamFormat, size_t chunkSize, int numThreads, bool bindToProcessors,
+        int minLevel = DefaultCompressionLevel, int maxLevel = DefaultCompressionLevel);
+
+    //
+    // Duplicates within opticalDistance pixels of another on the same flowcell tile (going by Illumina read names) are
+    // counted as optical in the summary; 0 doesn't look.  Picard uses 100, or 2500 for patterned flowcells.
+    //
+    static const int DefaultOpticalDuplicateDistance = 100;
+
+    static DataWriter::FilterSupplier* markDuplicates(const Genome* genome, int opticalDistance);
 
-    static DataWriter::FilterSupplier* markDuplicates(const Genome* genome);
+    // writes bamFileName.recal.txt, the tables for base quality recalibration; it needs to come after duplicate marking
+    static DataWriter::FilterSupplier* qualityCalibration(const char* bamFileName, const Genome* genome);
 
-    static DataWriter::FilterSupplier* bamIndex(const char* indexFileName, const Genome* genome, GzipWriterFilterSupplier* gzipSupplier);
+    // writes bamFileName.bedgraph, the depth along each contig, and bamFileName.metrics.txt; it also needs to come after duplicate marking
+    static DataWriter::FilterSupplier* coverage(const char* bamFileName, const Genome* genome);
+
+    // writes the CRAM end of file container when the file is closed; the encoding is done by a FileEncoder::cram
+    static DataWriter::FilterSupplier* cram();
+
+    // writes bamFileName.bai, or bamFileName.csi if the genome has a contig too long for BAI
+    static DataWriter::FilterSupplier* bamIndex(const char* bamFileName, const Genome* genome, GzipWriterFilterSupplier* gzipSupplier);
 };
 
 class AsyncDataWriter;
 
-class FileEncoder
+//
+// Encodes (i.e., compresses) the batches of one or more writers on the work pool, so the threads that fill the batches
+// don't wait for it.  nextBatch cuts the batch into fixed size chunks and queues it, and the writer goes on with its
+// next buffer; it only waits (helping the pool) when all of its buffers are still queued or being encoded.  Whichever
+// thread encodes the last chunk of a batch writes out that writer's finished batches in order.
+//
+// The supplier the encoder is passed to owns it, and deletes it when it's closed.
+//
+class FileEncoder : public WorkPool::Stage
 {
 public:
-    FileEncoder(int numThreads, bool bindToProcessors, ParallelWorkerManager* i_supplier);
-
-    ~FileEncoder()
+    //
+    // The encoding itself.  encodeChunk is called on all of the encoder's threads at once, each with its own state, and
+    // must not make a chunk bigger.  onBatchEncoded is called for each writer's batches in order, after the chunks have
+    // been packed together, with where the batch starts in the logical (unencoded) and physical (file) streams.
+    //
+    // A chunkSize of 0 hands each batch over whole, as one chunk, which may then come out as big as the writer's buffer
+    // (i.e., bigger than it went in); for formats like CRAM whose units are records and not bytes.
+    //
+    // backlog says how far behind the encoding is, for codecs that can trade size for speed: 0 when the chunk's batch is
+    // the only one its writer has waiting, rising to 1 when the writer has handed over all of its other buffers and will
+    // have to wait for this one once it fills the buffer it's on.
+    //
+    class Codec
     {
-        if (coworker != NULL) {
-            _ASSERT(! encoderRunning); coworker->stop(); delete coworker;
-        }
-    }
+    public:
+        Codec(size_t i_chunkSize) : chunkSize(i_chunkSize) {}
 
-    static FileEncoder* gzip(GzipWriterFilterSupplier* filterSupplier, int numThreads, bool bindToProcessor, size_t chunkSize = 65536, bool bam = true);
+        virtual ~Codec() {}
 
-    // post-construction initialization
-    void initialize(AsyncDataWriter* i_writer);
+        virtual void* createThreadState() = 0;
 
-    // called by writer when there is data to encode; threadsafe
-    void inputReady();
+        virtual void deleteThreadState(void* state) = 0;
 
-    void close();
+        virtual size_t encodeChunk(void* state, char* toBuffer, size_t toSize, char* fromBuffer, size_t fromUsed, double backlog) = 0;
 
-    // called by supplier to get/set information about current batch
+        virtual void onBatchEncoded(char* batch, size_t used, size_t logicalOffset, size_t logicalUsed, size_t physicalOffset,
+            const size_t* chunkSizes, int nChunks) {}
 
-    void setupEncode(int relative);
-    
-    void getEncodeBatch(char** o_batch, size_t* o_batchSize, size_t* o_batchUsed);
+        const size_t chunkSize;
+    };
 
-    void getOffsets(size_t* o_logicalOffset, size_t* o_physicalOffset);
+    //
+    // Every queued chunk is submitted to the pool straight away, so the pool's backlog shows how far behind the encoding
+    // is, and the aligner threads help with it when it's more than the pool can keep up with.
+    //
+    FileEncoder(Codec* i_codec);
 
-    void setEncodedBatchSize(size_t newSize);
+    // all of the writers must have been closed
+    ~FileEncoder();
 
-private:
-    // static callback for encoder; threadsafe
-    static void outputReadyCallback(void *p);
+    static FileEncoder* gzip(GzipWriterFilterSupplier* filterSupplier);
 
-    // called by encoder when a block of data has been encoded; threadsafe
-    void outputReady();
+    //
+    // Turns each batch of BAM records into CRAM containers against genome, with the file definition and header
+    // container in place of the BAM header.  Sorted output gets a container per run of records on one contig.
+    //
+    static FileEncoder* cram(const Genome* genome, bool sorted);
 
-    // scans writer and kicks off encoder if there is something ready; must hold lock
-    void checkForInput();
+    // a batch waiting to be encoded, which the pool takes a chunk at a time
+    struct Job
+    {
+        AsyncDataWriter* writer;
+        int batch;
+        int nChunks;
+        int nextChunk;
+        volatile int chunksLeft;
+        bool encoded;   // but not yet written, since an earlier batch isn't done
+        Job* next;
+    };
 
-    AsyncDataWriter* writer;
-    ParallelCoworker* coworker;
-    ExclusiveLock* lock;
-    bool encoderRunning;
-    int encoderBatch;
+    // WorkPool::Stage; each task encodes whichever chunk is next in the queue
+    virtual void* createThreadState();
+    virtual void deleteThreadState(void* state);
+    virtual void run(void* state, void* item);
+    virtual void finished(void* item);
 
+private:
     friend class AsyncDataWriter;
+
+    // called by the writer when a batch is ready to encode; threadsafe
+    void enqueue(Job* job);
+
+
+    // called when the last chunk of a batch is done; writes out the writer's batches that are ready, in order
+    void finishBatches(AsyncDataWriter* writer);
+
+    // writes out the writer's batches that can go, and returns another writer that was waiting for them, if any
+    AsyncDataWriter* placeBatches(AsyncDataWriter* writer);
+
+    struct ThreadState
+    {
+        void* codecState;
+        char* scratch;
+        size_t scratchSize;
+    };
+
+    Codec* codec;
+    ExclusiveLock lock;
+    Job* queueHead;
+    Job* queueTail;
+    int tasksActive;        // submitted, and not yet finished; as many as there are chunks, until they start
+    EventObject tasksDone;  // set when none are active
 };
 
+//
+// Writes to a stream that can only be appended to, taking positioned writes that can come in any order from any number
+// of writers and putting them out in order from its own thread.  That's stdout, or an HDFS (remote) file: HDFS files
+// are append-only, and a client's writes are pipelined to the data nodes, so rather than have each writer wait its
+// turn, the writers keep compressing and queueing batches, as many as their buffers allow, while this appends them.
+//
 class StdoutAsyncFile : public AsyncFile
 {
 public:
-    StdoutAsyncFile();
+    StdoutAsyncFile(GenericFile *i_remote = NULL);
     virtual ~StdoutAsyncFile();
 
     bool close();
 
     static StdoutAsyncFile *open(const char *filename, bool write);
 
+    //
+    // For a GenericFile::IsRemote output.  Returns NULL if it can't be created.
+    //
+    static StdoutAsyncFile *openRemote(const char *filename);
+
     AsyncFile::Writer* getWriter();
     AsyncFile::Reader* getReader();
 
@@ -261,8 +397,12 @@ private:
 
     bool                closing;
 
+    GenericFile        *remote;         // NULL for stdout
+
     static void ConsumerThreadMain(void *param);
     void runConsumer();
 
     static bool anyCreated;              // Because there's no way to multiplex stdout, you only get one per run of SNAP
+
+    static const size_t MaxPipeSize = 1024 * 1024;  // What we ask for if stdout is a pipe; unprivileged processes can't go higher by default
 };
@@ -0,0 +1,345 @@
+/*++
+
+Module Name:
+
+    DistanceHistogram.cpp
+
+Abstract:
+
+    Histograms of the edit distances between reads and the reference, for error profiles of runs and of simulated data.
+    This replaces the old DistanceHist tool.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "DistanceHistogram.h"
+#include "Genome.h"
+#include "Read.h"
+#include "SAM.h"
+#include "AlignerOptions.h"
+#include "LandauVishkin.h"
+#include "ParallelTask.h"
+#include "WGsim.h"
+#include "Tables.h"
+#include "exit.h"
+
+namespace {
+
+//
+// Distances are counted up to maxK, and anything further (or that can't be compared at all because it runs off the
+// reference) goes in the last slot.
+//
+const int MaxDistanceSlots = MAX_K + 1;
+
+struct DistanceHistContext : public TaskContextBase
+{
+    ReadSupplierGenerator  *readSupplierGenerator;
+    const Genome           *genome;
+    bool                    useAlignments;      // Rather than the wgsim IDs
+    int                     maxK;
+    char                    minQuality;         // Skip reads with any quality below this
+    unsigned                minMAPQ;
+
+    _uint64                 counts[MaxDistanceSlots];
+    _uint64                 countsWithoutIndels[MaxDistanceSlots];
+    _uint64                 nSkipped;
+
+    void initializeThread() {}
+    void runThread();
+    void finishThread(DistanceHistContext *common);
+
+    //
+    // The edit distance of the pattern against the reference at location, or -1 if it's more than k.  Sets needsIndels
+    // if the distance is less than the number of mismatches with the bases lined up as they are, so that only an
+    // alignment with indels gets it.
+    //
+    int distanceAt(LandauVishkin<1> *lv, GenomeLocation location, const char *pattern, unsigned patternLength, int k, bool *needsIndels);
+
+    void addDistance(int distance, bool needsIndels);
+};
+
+    int
+DistanceHistContext::distanceAt(
+    LandauVishkin<1>   *lv,
+    GenomeLocation      location,
+    const char         *pattern,
+    unsigned            patternLength,
+    int                 k,
+    bool               *needsIndels)
+{
+    //
+    // Give the aligner room for deletions, unless that runs off the end of the contig.
+    //
+    unsigned textLength = patternLength + k;
+    const char *text = genome->getSubstring(location, textLength);
+    if (NULL == text) {
+        textLength = patternLength;
+        text = genome->getSubstring(location, textLength);
+        if (NULL == text) {
+            return -1;
+        }
+    }
+
+    int distance = lv->computeEditDistance(text, textLength, pattern, patternLength, k);
+    if (distance < 0) {
+        return -1;
+    }
+
+    int mismatches = 0;
+    for (unsigned i = 0; i < patternLength; i++) {
+        mismatches += text[i] != pattern[i];
+    }
+    *needsIndels = mismatches != distance;
+
+    return distance;
+}
+
+    void
+DistanceHistContext::addDistance(int distance, bool needsIndels)
+{
+    int slot = distance < 0 ? MaxDistanceSlots - 1 : distance;
+    counts[slot]++;
+    if (distance >= 0 && !needsIndels) {
+        countsWithoutIndels[slot]++;
+    }
+}
+
+    void
+DistanceHistContext::runThread()
+{
+    ReadSupplier *readSupplier = readSupplierGenerator->generateNewReadSupplier();
+    LandauVishkin<1> lv;
+    char *rcBuffer = new char[MAX_READ_LENGTH];
+
+    Read *read;
+    while (NULL != (read = readSupplier->getNextRead())) {
+        if (0 != minQuality) {
+            const char *quality = read->getQuality();
+            unsigned i;
+            for (i = 0; i < read->getDataLength() && quality[i] >= minQuality; i++) {
+                // This loop body intentionally left blank.
+            }
+            if (i < read->getDataLength()) {
+                nSkipped++;
+                continue;
+            }
+        }
+
+        bool needsIndels = false;
+        if (useAlignments) {
+            GenomeLocation location = read->getOriginalAlignedLocation();
+            if (InvalidGenomeLocation == location || read->getOriginalMAPQ() < minMAPQ) {
+                nSkipped++;
+                continue;
+            }
+
+            //
+            // The clipping is in the reference's orientation, and the location is of the first base after it.
+            //
+            if (read->getOriginalSAMFlags() & SAM_REVERSE_COMPLEMENT) {
+                read->becomeRC();
+            }
+            unsigned clipping = read->getOriginalFrontClipping() + read->getOriginalBackClipping();
+            if (clipping >= read->getDataLength()) {
+                nSkipped++;
+                continue;
+            }
+            int distance = distanceAt(&lv, location, read->getData() + read->getOriginalFrontClipping(), read->getDataLength() - clipping,
+                maxK, &needsIndels);
+            addDistance(distance, needsIndels);
+        } else {
+            //
+            // We don't care where (or whether) it's aligned, just where the ID says it's from.  A read might be from either
+            // end of the fragment and on either strand, so take the closest.  The wrong ones are mostly far away, so once
+            // there's a candidate the others only need to be computed as far as it.
+            //
+            GenomeLocation low = InvalidGenomeLocation, high = InvalidGenomeLocation;
+            wgsimReadMisaligned(read, 0, genome, 0, &low, &high);
+            unsigned readLength = read->getDataLength();
+            if (InvalidGenomeLocation == low || 0 == readLength || readLength > MAX_READ_LENGTH) {
+                nSkipped++;
+                continue;
+            }
+
+            const char *data = read->getData();
+            for (unsigned i = 0; i < readLength; i++) {
+                rcBuffer[readLength - i - 1] = COMPLEMENT[(unsigned char)data[i]];
+            }
+
+            GenomeLocation locations[2] = {low, high + 1 >= low + readLength ? high + 1 - readLength : low};
+            int bestDistance = -1;
+            bool bestNeedsIndels = false;
+            for (int whichLocation = 0; whichLocation < (locations[0] == locations[1] ? 1 : 2); whichLocation++) {
+                for (int rc = 0; rc < 2; rc++) {
+                    bool candidateNeedsIndels;
+                    int distance = distanceAt(&lv, locations[whichLocation], rc ? rcBuffer : data, readLength,
+                        bestDistance < 0 ? maxK : bestDistance, &candidateNeedsIndels);
+                    if (distance >= 0 && (bestDistance < 0 || distance < bestDistance || (distance == bestDistance && !candidateNeedsIndels))) {
+                        bestDistance = distance;
+                        bestNeedsIndels = candidateNeedsIndels;
+                    }
+                }
+            }
+            addDistance(bestDistance, bestNeedsIndels);
+        }
+    }
+
+    delete [] rcBuffer;
+    delete readSupplier;
+}
+
+    void
+DistanceHistContext::finishThread(DistanceHistContext *common)
+{
+    for (int i = 0; i < MaxDistanceSlots; i++) {
+        common->counts[i] += counts[i];
+        common->countsWithoutIndels[i] += countsWithoutIndels[i];
+    }
+    common->nSkipped += nSkipped;
+}
+
+} // namespace
+
+    static void
+DistanceHistUsage()
+{
+    fprintf(stderr,
+            "Usage: snap distancehist <index-dir> <input> [<options>]\n"
+            "Prints a histogram of the edit distances between the reads and the reference.  For SAM or BAM input that's where\n"
+            "each read is aligned (unaligned and secondary alignments are skipped); for FASTQ, it's where the read's wgsim style ID\n"
+            "says it came from, like the reads from snap simulate.  The second column counts all of the reads at each distance, and\n"
+            "the third the ones that get it without any indels.\n"
+            "Options:\n"
+            "  -k   the largest distance to compute (default and maximum %d); reads further away are counted together\n"
+            "  -q   skip reads with any base quality below this (Phred, default 0)\n"
+            "  -mq  skip alignments with MAPQ below this (default 0)\n"
+            "  -wgsim  use the wgsim IDs of the reads in a SAM or BAM file, rather than where they're aligned\n"
+            "  -t   number of threads (default is the number of processors)\n",
+            MAX_K - 1);
+    soft_exit(1);
+}
+
+    void
+DistanceHistogram::runDistanceHist(
+    int argc,
+    const char **argv)
+{
+    if (argc < 2) {
+        DistanceHistUsage();
+    }
+
+    const char *indexDir = argv[0];
+    const char *inputFileName = argv[1];
+    int maxK = MAX_K - 1;
+    int minQuality = 0;
+    unsigned minMAPQ = 0;
+    bool useWgsimIds = false;
+    unsigned nThreads = GetNumberOfProcessors();
+
+    for (int n = 2; n < argc; n++) {
+        if (!strcmp(argv[n], "-wgsim")) {
+            useWgsimIds = true;
+        } else if (n + 1 < argc && !strcmp(argv[n], "-k")) {
+            maxK = atoi(argv[++n]);
+        } else if (n + 1 < argc && !strcmp(argv[n], "-q")) {
+            minQuality = atoi(argv[++n]);
+        } else if (n + 1 < argc && !strcmp(argv[n], "-mq")) {
+            minMAPQ = atoi(argv[++n]);
+        } else if (n + 1 < argc && !strcmp(argv[n], "-t")) {
+            nThreads = atoi(argv[++n]);
+        } else {
+            DistanceHistUsage();
+        }
+    }
+    if (maxK < 0 || maxK > MAX_K - 1 || minQuality < 0 || minQuality > 93 || 0 == nThreads) {
+        DistanceHistUsage();
+    }
+
+    SNAPFile input;
+    int argsConsumed;
+    if (!SNAPFile::generateFromCommandLine(&inputFileName, 1, &argsConsumed, &input, false, true)) {
+        fprintf(stderr, "snap distancehist: can't read '%s'\n", inputFileName);
+        soft_exit(1);
+    }
+    bool alignedInput = SAMFile == input.fileType || BAMFile == input.fileType || CRAMFile == input.fileType;
+
+    static const char *genomeSuffix = "Genome";
+    size_t filenameLen = strlen(indexDir) + 1 + strlen(genomeSuffix) + 1;
+    char *fileName = new char[filenameLen];
+    snprintf(fileName, filenameLen, "%s%c%s", indexDir, PATH_SEP, genomeSuffix);
+    _int64 start = timeInMillis();
+    fprintf(stderr, "Loading genome...");
+    const Genome *genome = Genome::loadFromFile(fileName, 0);
+    if (NULL == genome) {
+        fprintf(stderr, "Unable to load genome from file '%s'\n", fileName);
+        soft_exit(1);
+    }
+    delete [] fileName;
+    fprintf(stderr, "%llds.\n", (timeInMillis() + 500 - start) / 1000);
+
+    DataSupplier::ThreadCount = nThreads;
+
+    ReaderContext readerContext;
+    readerContext.clipping = NoClipping;
+    readerContext.defaultReadGroup = "";
+    readerContext.rangeIndex = 0;
+    readerContext.rangeCount = 1;
+    readerContext.trimmer = NULL;
+    readerContext.screen = NULL;
+    readerContext.genome = genome;
+    readerContext.ignoreSecondaryAlignments = true;
+    readerContext.header = NULL;
+    readerContext.headerLength = 0;
+    readerContext.headerBytes = 0;
+
+    input.readHeader(readerContext);
+
+    DistanceHistContext common;
+    common.totalThreads = nThreads;
+    common.bindToProcessors = false;
+    common.readSupplierGenerator = input.createReadSupplierGenerator(nThreads, readerContext);
+    common.genome = genome;
+    common.useAlignments = alignedInput && !useWgsimIds;
+    common.maxK = maxK;
+    common.minQuality = 0 == minQuality ? 0 : (char)(minQuality + 33);
+    common.minMAPQ = minMAPQ;
+    memset(common.counts, 0, sizeof(common.counts));
+    memset(common.countsWithoutIndels, 0, sizeof(common.countsWithoutIndels));
+    common.nSkipped = 0;
+
+    start = timeInMillis();
+    ParallelTask<DistanceHistContext> task(&common);
+    task.run();
+
+    //
+    // Leave off the long tail of empty rows at the end.
+    //
+    int lastRow = 0;
+    for (int i = 0; i <= maxK; i++) {
+        if (0 != common.counts[i]) {
+            lastRow = i;
+        }
+    }
+
+    _uint64 totalReads = 0;
+    printf("edits\treads\twithout indels\n");
+    for (int i = 0; i <= lastRow; i++) {
+        printf("%d\t%lld\t%lld\n", i, common.counts[i], common.countsWithoutIndels[i]);
+        totalReads += common.counts[i];
+    }
+    if (0 != common.counts[MaxDistanceSlots - 1]) {
+        printf("More\t%lld\n", common.counts[MaxDistanceSlots - 1]);
+        totalReads += common.counts[MaxDistanceSlots - 1];
+    }
+
+    _int64 elapsed = __max(timeInMillis() - start, (_int64)1);
+    fprintf(stderr, "Compared %lld reads (skipped %lld) in %llds, %lld reads/s\n", totalReads, common.nSkipped, (elapsed + 500) / 1000,
+        (_int64)totalReads * 1000 / elapsed);
+
+    delete common.readSupplierGenerator;
+    delete genome;
+}
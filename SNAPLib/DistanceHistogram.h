@@ -0,0 +1,32 @@
+/*++
+
+Module Name:
+
+    DistanceHistogram.h
+
+Abstract:
+
+    Histograms of the edit distances between reads and the reference, for error profiles of runs and of simulated data.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+
+//
+// snap distancehist <index-dir> <input> [options]
+//
+// For SAM and BAM input each aligned read is compared with the reference where it's aligned; for FASTQ (or with -wgsim)
+// it's compared with where its wgsim style ID says it came from, on whichever end and strand is closest.  The reads are
+// read and compared on all of the processors, and the distances come from the Landau-Vishkin aligner the aligners use.
+//
+class DistanceHistogram
+{
+public:
+    static void runDistanceHist(int argc, const char **argv);
+};
@@ -25,132 +25,396 @@ Revision History:
 #include "stdafx.h"
 #include "Compat.h"
 #include "FASTA.h"
+#include "BigAlloc.h"
+#include "zlib.h"
+#include <vector>
 
 using namespace std;
 
-    const Genome *
-ReadFASTAGenome(
-    const char *fileName,
-    const char *pieceNameTerminatorCharacters,
-    bool spaceIsAPieceNameTerminator,
-    unsigned chromosomePaddingSize)
-{
+//
+// The FASTA loader works in two parallel passes over the file, which is mapped (or, for gzipped FASTA, inflated into
+// memory).  The file is split into one chunk per thread.  The first pass finds the contig header lines that start in each
+// chunk and counts the bases in between, which is enough to lay out the whole genome, contigs and padding included.  The
+// second pass then copies each chunk's bases straight to where they go, upper casing them as it goes.
+//
+// A chunk usually starts in the middle of a line.  The bytes before its first line start (its prefix) are bases unless
+// they're the end of a header line that started in an earlier chunk, which isn't known until the first pass is done.
+//
+struct FASTAChunkContext {
+    SingleWaiterObject  *doneObject;
+    volatile int        *runningThreadCount;
+    const char          *contents;
+    size_t               start;
+    size_t               end;
+    bool                 copyBases;             // false for the first pass, which just counts
+
     //
-    // We need to know a bound on the size of the genome before we create the Genome object.
-    // A bound is the number of bytes in the FASTA file, because we store at most one base per
-    // byte.  Get the file size to use for this bound.
+    // Filled in by the first pass.
     //
-    _int64 fileSize = QueryFileSize(fileName);
+    _int64               prefixBases;
+    bool                 hasLineStart;          // Whether any line starts in this chunk
+    bool                 endsInHeader;          // Whether the last line that starts in the chunk is a header that runs past it
+    _int64               leadingBases;          // Bases from the first line start to the first header (or the chunk end)
+    std::vector<size_t>  headerOffsets;         // Where the '>' of each header line that starts in this chunk is
+    std::vector<_int64>  contigBases;           // Bases in the chunk after each header
 
-    if (fileSize >> 32 != 0) {
-        fprintf(stderr,"This tool only works with genomes with 2^32 bases or fewer.\n");
-        return NULL;
-    }
+    //
+    // Filled in between the passes.
+    //
+    bool                 prefixIsHeader;
+    char                *firstDestination;      // Where the bases before the chunk's first header go
+    char               **contigDestinations;    // Where the bases after each of its headers go
+};
 
-    FILE *fastaFile = fopen(fileName, "r");
-    if (fastaFile == NULL) {
-        fprintf(stderr,"Unable to open FASTA file '%s' (even though we already got its size)\n",fileName);
-        return NULL;
-    }
+//
+// Upper cases bases, but makes N (either case) into n.  This is so we don't match the N from the genome with N in reads
+// (where we just do a straight text comparison).
+//
+static char FASTABaseTranslation[256];
 
-    const size_t lineBufferSize = 4096;
-    char lineBuffer[lineBufferSize];
+static void InitializeFASTABaseTranslation()
+{
+    for (unsigned i = 0; i < 256; i++) {
+        FASTABaseTranslation[i] = toupper(i);
+    }
+    FASTABaseTranslation['N'] = FASTABaseTranslation['n'] = 'n';
+}
 
-    //
-    // Count the chromosomes
-    //
-    unsigned nChromosomes = 0;
+    static void
+ScanFASTAChunk(FASTAChunkContext *context)
+{
+    const char *contents = context->contents;
+    size_t pos = context->start;
+    char *destination = context->firstDestination;
+    bool copyingPrefix = context->copyBases && !context->prefixIsHeader;
+    _int64 bases = 0;
 
-    while (NULL != fgets(lineBuffer,lineBufferSize,fastaFile)) {
-        if (lineBuffer[0] == '>') {
-            nChromosomes++;
+    while (pos < context->end && 0 != pos && '\n' != contents[pos - 1]) {
+        char base = contents[pos++];
+        if ('\n' != base && '\r' != base) {
+            if (copyingPrefix) {
+                *destination++ = FASTABaseTranslation[(unsigned char)base];
+            }
+            bases++;
         }
     }
-    rewind(fastaFile);
 
-    Genome *genome = new Genome((unsigned) fileSize + (nChromosomes+1) * chromosomePaddingSize, (unsigned)fileSize + (nChromosomes+1) * chromosomePaddingSize, chromosomePaddingSize);
-
-    char *paddingBuffer = new char[chromosomePaddingSize+1];
-    for (unsigned i = 0; i < chromosomePaddingSize; i++) {
-        paddingBuffer[i] = 'n';
+    if (!context->copyBases) {
+        context->prefixBases = bases;
+        context->hasLineStart = pos < context->end;
+        context->endsInHeader = false;
+        context->headerOffsets.clear();
+        context->contigBases.clear();
     }
-    paddingBuffer[chromosomePaddingSize] = '\0';
 
-    while (NULL != fgets(lineBuffer,lineBufferSize,fastaFile)) {
-        if (lineBuffer[0] == '>') {
-            //
-            // A new chromosome.  Add in the padding first.
-            //
-            genome->addData(paddingBuffer);
+    bases = 0;
+    unsigned whichContig = 0;
+    while (pos < context->end) {
+        //
+        // We're at the start of a line.
+        //
+        const char *newline = (const char *)memchr(contents + pos, '\n', context->end - pos);
+        size_t lineEnd = NULL == newline ? context->end : newline - contents;
 
-            //
-            // Now supply the chromosome name.
-            //
-            if (NULL != pieceNameTerminatorCharacters) {
-                for (int i = 0; i < strlen(pieceNameTerminatorCharacters); i++) {
-                    char *terminator = strchr(lineBuffer+1, pieceNameTerminatorCharacters[i]);
-                    if (NULL != terminator) {
-                        *terminator = '\0';
-                    }
+        if ('>' == contents[pos]) {
+            if (context->copyBases) {
+                destination = context->contigDestinations[whichContig];
+            } else {
+                if (0 == whichContig) {
+                    context->leadingBases = bases;
+                } else {
+                    context->contigBases.push_back(bases);
                 }
+                context->headerOffsets.push_back(pos);
+                context->endsInHeader = NULL == newline;
             }
-            if (spaceIsAPieceNameTerminator) {
-                char *terminator = strchr(lineBuffer, ' ');
-                if (NULL != terminator) {
-                    *terminator = '\0';
+            whichContig++;
+            bases = 0;
+        } else {
+            if (context->copyBases) {
+                for (size_t i = pos; i < lineEnd; i++) {
+                    if ('\r' != contents[i]) {
+                        *destination++ = FASTABaseTranslation[(unsigned char)contents[i]];
+                    }
                 }
-                terminator = strchr(lineBuffer, '\t');
-                if (NULL != terminator) {
-                    *terminator = '\0';
+            } else {
+                for (size_t i = pos; i < lineEnd; i++) {
+                    bases += '\r' != contents[i];
                 }
             }
-            char *terminator = strchr(lineBuffer, '\n');
-            if (NULL != terminator) {
-                *terminator = '\0';
-            }
-            terminator = strchr(lineBuffer, '\r');
-            if (NULL != terminator) {
-                *terminator = '\0';
-            }
-            genome->startContig(lineBuffer+1);
+            context->endsInHeader = false;
+        }
+        pos = lineEnd + 1;
+    }
+
+    if (!context->copyBases) {
+        if (0 == whichContig) {
+            context->leadingBases = bases;
         } else {
-            //
-            // Convert it to upper case and truncate the newline before adding it to the genome.
-            //
+            context->contigBases.push_back(bases);
+        }
+    }
+}
 
-            char *newline = strchr(lineBuffer, '\n');
-            if (NULL != newline) {
-                *newline = 0;
-            }
+    static void
+FASTAChunkThreadMain(void *param)
+{
+    FASTAChunkContext *context = (FASTAChunkContext *)param;
 
-            //
-            // But convert any 'N' to 'n'.  This is so we don't match the N from the genome with N
-            // in reads (where we just do a straight text comparison.
-            //
-            size_t lineLen = strlen(lineBuffer);
+    ScanFASTAChunk(context);
 
-			for (unsigned i = 0; i < lineLen; i++) {
-              lineBuffer[i] = toupper(lineBuffer[i]);
-            }
+    if (0 == InterlockedDecrementAndReturnNewValue(context->runningThreadCount)) {
+        SignalSingleWaiterObject(context->doneObject);
+    }
+}
 
-			for (unsigned i = 0; i < lineLen; i++) {
-                if ('N' == lineBuffer[i]) {
-                    lineBuffer[i] = 'n';
-                }
+    static void
+RunFASTAChunkThreads(FASTAChunkContext *chunks, unsigned nChunks, bool copyBases)
+{
+    SingleWaiterObject doneObject;
+    CreateSingleWaiterObject(&doneObject);
+    volatile int runningThreadCount = nChunks;
+    for (unsigned i = 0; i < nChunks; i++) {
+        chunks[i].doneObject = &doneObject;
+        chunks[i].runningThreadCount = &runningThreadCount;
+        chunks[i].copyBases = copyBases;
+        StartNewThread(FASTAChunkThreadMain, &chunks[i]);
+    }
+
+    WaitForSingleWaiterObject(&doneObject);
+    DestroySingleWaiterObject(&doneObject);
+}
+
+//
+// Reads a gzipped FASTA file into memory.  The caller frees the result with BigDealloc.
+//
+    static char *
+InflateFASTAFile(const char *fileName, _int64 compressedSize, size_t *o_size)
+{
+    gzFile file = gzopen(fileName, "rb");
+    if (NULL == file) {
+        fprintf(stderr,"Unable to open FASTA file '%s'\n", fileName);
+        return NULL;
+    }
+
+    size_t bufferSize = __max((size_t)compressedSize * 4, (size_t)1024 * 1024);
+    char *buffer = (char *)BigAlloc(bufferSize);
+    size_t size = 0;
+    for (;;) {
+        if (size == bufferSize) {
+            char *newBuffer = (char *)BigAlloc(bufferSize * 2);
+            memcpy(newBuffer, buffer, size);
+            BigDealloc(buffer);
+            buffer = newBuffer;
+            bufferSize *= 2;
+        }
+
+        unsigned amountToRead = (unsigned)__min(bufferSize - size, (size_t)1024 * 1024 * 1024);
+        int amountRead = gzread(file, buffer + size, amountToRead);
+        if (amountRead < 0) {
+            int error;
+            fprintf(stderr,"Error decompressing FASTA file '%s': %s\n", fileName, gzerror(file, &error));
+            gzclose(file);
+            BigDealloc(buffer);
+            return NULL;
+        }
+        if (0 == amountRead) {
+            break;
+        }
+        size += amountRead;
+    }
+
+    gzclose(file);
+    *o_size = size;
+    return buffer;
+}
+
+//
+// Gets the contig name from the header line at contents, the same way that the old line by line loader did.
+//
+    static void
+GetFASTAContigName(const char *contents, size_t size, const char *pieceNameTerminatorCharacters, bool spaceIsAPieceNameTerminator,
+                   char *lineBuffer, size_t lineBufferSize)
+{
+    size_t lineLength = 0;
+    while (lineLength < size && lineLength < lineBufferSize - 1 && '\n' != contents[lineLength]) {
+        lineBuffer[lineLength] = contents[lineLength];
+        lineLength++;
+    }
+    lineBuffer[lineLength] = '\0';
+
+    if (NULL != pieceNameTerminatorCharacters) {
+        for (int i = 0; i < strlen(pieceNameTerminatorCharacters); i++) {
+            char *terminator = strchr(lineBuffer+1, pieceNameTerminatorCharacters[i]);
+            if (NULL != terminator) {
+                *terminator = '\0';
             }
-            genome->addData(lineBuffer);
         }
     }
+    if (spaceIsAPieceNameTerminator) {
+        char *terminator = strchr(lineBuffer, ' ');
+        if (NULL != terminator) {
+            *terminator = '\0';
+        }
+        terminator = strchr(lineBuffer, '\t');
+        if (NULL != terminator) {
+            *terminator = '\0';
+        }
+    }
+    char *terminator = strchr(lineBuffer, '\r');
+    if (NULL != terminator) {
+        *terminator = '\0';
+    }
+}
+
+    Genome *
+ReadFASTAGenome(
+    const char *fileName,
+    const char *pieceNameTerminatorCharacters,
+    bool spaceIsAPieceNameTerminator,
+    unsigned chromosomePaddingSize,
+    unsigned maxThreads)
+{
+    _int64 fileSize = QueryFileSize(fileName);
+
+    //
+    // Get the whole file into memory, by mapping it unless it's compressed.
+    //
+    const char *contents;
+    size_t size;
+    MemoryMappedFile *mappedFile = NULL;
+    char *inflatedContents = NULL;
+    size_t nameLength = strlen(fileName);
+    if (nameLength > 3 && !_stricmp(fileName + nameLength - 3, ".gz")) {
+        inflatedContents = InflateFASTAFile(fileName, fileSize, &size);
+        if (NULL == inflatedContents) {
+            return NULL;
+        }
+        contents = inflatedContents;
+    } else if (0 == fileSize) {
+        contents = "";
+        size = 0;
+    } else {
+        void *mappedContents;
+        mappedFile = OpenMemoryMappedFile(fileName, 0, fileSize, &mappedContents, false, true);
+        if (NULL == mappedFile) {
+            fprintf(stderr,"Unable to open FASTA file '%s' (even though we already got its size)\n",fileName);
+            return NULL;
+        }
+        contents = (const char *)mappedContents;
+        size = fileSize;
+    }
+
+    InitializeFASTABaseTranslation();
+
+    //
+    // Give each thread at least a megabyte, so small files don't get cut up into lots of tiny pieces.
+    //
+    const size_t minChunkSize = 1024 * 1024;
+    unsigned nChunks = (unsigned)__max((size_t)1, __min((size_t)__min(GetNumberOfProcessors(), maxThreads), size / minChunkSize));
+    FASTAChunkContext *chunks = new FASTAChunkContext[nChunks];
+    for (unsigned i = 0; i < nChunks; i++) {
+        chunks[i].contents = contents;
+        chunks[i].start = size / nChunks * i;
+        chunks[i].end = (i == nChunks - 1) ? size : size / nChunks * (i + 1);
+        chunks[i].prefixIsHeader = false;
+        chunks[i].firstDestination = NULL;
+        chunks[i].contigDestinations = NULL;
+    }
+
+    RunFASTAChunkThreads(chunks, nChunks, false);
 
     //
-    // And finally add padding at the end of the genome.
+    // Work out which prefixes are really the ends of header lines, and add up the length of each contig and of whatever
+    // comes before the first one.
     //
-    genome->addData(paddingBuffer);
-    genome->fillInContigLengths();
-    genome->sortContigsByName();
+    std::vector<size_t> headerOffsets;
+    std::vector<_int64> contigLengths;
+    _int64 leadingLength = 0;
+    bool inHeader = false;
+    for (unsigned i = 0; i < nChunks; i++) {
+        chunks[i].prefixIsHeader = inHeader;
+        _int64 *currentLength = contigLengths.empty() ? &leadingLength : &contigLengths.back();
+        *currentLength += (inHeader ? 0 : chunks[i].prefixBases) + chunks[i].leadingBases;
+        for (size_t j = 0; j < chunks[i].headerOffsets.size(); j++) {
+            headerOffsets.push_back(chunks[i].headerOffsets[j]);
+            contigLengths.push_back(chunks[i].contigBases[j]);
+        }
+        if (chunks[i].hasLineStart) {
+            inHeader = chunks[i].endsInHeader;
+        }
+    }
+
+    _int64 totalLength = leadingLength + (_int64)chromosomePaddingSize * (headerOffsets.size() + 1);
+    for (size_t i = 0; i < contigLengths.size(); i++) {
+        totalLength += contigLengths[i];
+    }
+
+    Genome *genome = NULL;
+    if (totalLength >> 32 != 0) {
+        fprintf(stderr,"This tool only works with genomes with 2^32 bases or fewer.\n");
+    } else {
+        //
+        // Lay out the genome, putting in the padding and contig names but leaving the bases for the threads to fill in.
+        //
+        genome = new Genome((GenomeLocation)totalLength, (GenomeLocation)totalLength, chromosomePaddingSize);
+
+        char *paddingBuffer = new char[chromosomePaddingSize+1];
+        for (unsigned i = 0; i < chromosomePaddingSize; i++) {
+            paddingBuffer[i] = 'n';
+        }
+        paddingBuffer[chromosomePaddingSize] = '\0';
+
+        const size_t lineBufferSize = 4096;
+        char lineBuffer[lineBufferSize];
+
+        char *leadingDestination = genome->addUninitializedData(leadingLength);
+        char **contigDestinations = new char *[headerOffsets.size() + 1];
+        for (size_t i = 0; i < headerOffsets.size(); i++) {
+            genome->addData(paddingBuffer);
+            GetFASTAContigName(contents + headerOffsets[i], size - headerOffsets[i], pieceNameTerminatorCharacters, spaceIsAPieceNameTerminator,
+                               lineBuffer, lineBufferSize);
+            genome->startContig(lineBuffer+1);
+            contigDestinations[i] = genome->addUninitializedData(contigLengths[i]);
+        }
+
+        //
+        // And finally add padding at the end of the genome.
+        //
+        genome->addData(paddingBuffer);
+
+        //
+        // Now tell each chunk where its bases go, and copy them in.
+        //
+        char *destination = leadingDestination;
+        size_t whichContig = 0;
+        for (unsigned i = 0; i < nChunks; i++) {
+            chunks[i].firstDestination = destination;
+            chunks[i].contigDestinations = contigDestinations + whichContig;
+            destination += (chunks[i].prefixIsHeader ? 0 : chunks[i].prefixBases) + chunks[i].leadingBases;
+            for (size_t j = 0; j < chunks[i].headerOffsets.size(); j++) {
+                destination = contigDestinations[whichContig] + chunks[i].contigBases[j];
+                whichContig++;
+            }
+        }
+
+        RunFASTAChunkThreads(chunks, nChunks, true);
+
+        genome->fillInContigLengths();
+        genome->sortContigsByName();
+
+        delete [] contigDestinations;
+        delete [] paddingBuffer;
+    }
+
+    delete [] chunks;
+    if (NULL != mappedFile) {
+        CloseMemoryMappedFile(mappedFile);
+    }
+    if (NULL != inflatedContents) {
+        BigDealloc(inflatedContents);
+    }
 
-    fclose(fastaFile);
-    delete [] paddingBuffer;
     return genome;
 }
 
@@ -163,9 +427,9 @@ bool AppendFASTAGenome(const Genome *genome, FILE *fasta, const char *prefix="")
     const Genome::Contig *contigs = genome->getContigs();
     for (int i = 0; i < nContigs; ++i) {
         const Genome::Contig &contig = contigs[i];
-        unsigned start = contig.beginningOffset;
-        unsigned end = i + 1 < nContigs ? contigs[i + 1].beginningOffset : genome->getCountOfBases();
-        unsigned size = end - start;
+        GenomeLocation start = contig.beginningOffset;
+        GenomeLocation end = i + 1 < nContigs ? contigs[i + 1].beginningOffset : genome->getCountOfBases();
+        unsigned size = (unsigned)(end - start);
         const char *bases = genome->getSubstring(start, size);
 
         fprintf(fasta, ">%s%s\n", prefix, contig.name);
@@ -26,8 +26,12 @@ Revision History:
 
 #include "Genome.h"
 
-    const Genome *
-ReadFASTAGenome(const char *fileName, const char *pieceNameTerminatorCharacters, bool spaceIsAPieceNameTerminator, unsigned chromosomePaddingSize);
+//
+// Reads a FASTA file (which may be gzipped if its name ends in .gz) into a genome, using up to maxThreads threads.
+//
+    Genome *
+ReadFASTAGenome(const char *fileName, const char *pieceNameTerminatorCharacters, bool spaceIsAPieceNameTerminator, unsigned chromosomePaddingSize,
+                unsigned maxThreads = 1);
 
 //
 // The FASTA appending functions return whether the write was successful.
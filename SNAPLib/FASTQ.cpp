@@ -32,6 +32,17 @@ Revision History:
 #include "Read.h"
 #include "Util.h"
 #include "exit.h"
+#include "ReadTrimmer.h"
+#include "ReadScreen.h"
+#include "FileFormat.h"
+#include "DataWriter.h"
+#include "GzipDataWriter.h"
+#include "Bam.h"
+#include "InputOrder.h"
+
+#if     defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
 
 using std::min;
 using util::strnchr;
@@ -186,6 +197,92 @@ FASTQReader::skipPartialRecord(DataReader *data)
     return true;
 }
 
+//
+// Find up to maxToFind newlines in the buffer, stopping early at a NUL (the same place strnchr stops).  Returns the number
+// found.  With SSE2 this looks at 64 bytes at a time, making bitmasks of the newlines and NULs in them and picking the
+// newlines out of the mask, so finding the four line ends of a read costs a handful of compares rather than one per byte.
+//
+    static inline unsigned
+findNewlines(char *buffer, _int64 validBytes, unsigned maxToFind, char **newlines)
+{
+    unsigned nFound = 0;
+    _int64 offset = 0;
+
+#if     defined(__SSE2__) || defined(_M_X64)
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+    for (; offset + 64 <= validBytes; offset += 64) {
+        _uint64 newlineBits = 0;
+        _uint64 zeroBits = 0;
+        for (int i = 0; i < 4; i++) {
+            __m128i block = _mm_loadu_si128((const __m128i *)(buffer + offset + 16 * i));
+            newlineBits |= (_uint64)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(block, newline)) << (16 * i);
+            zeroBits |= (_uint64)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(block, zero)) << (16 * i);
+        }
+
+        if (0 != zeroBits) {
+            newlineBits &= (zeroBits & (~zeroBits + 1)) - 1;  // Only the newlines before the first NUL
+        }
+
+        while (0 != newlineBits) {
+            unsigned long bit;
+            CountTrailingZeroes(newlineBits, bit);
+            newlines[nFound++] = buffer + offset + bit;
+            if (nFound == maxToFind) {
+                return nFound;
+            }
+            newlineBits &= newlineBits - 1;
+        }
+
+        if (0 != zeroBits) {
+            return nFound;
+        }
+    }
+#endif  // SSE2
+
+    for (; offset < validBytes; offset++) {
+        if (buffer[offset] == '\n') {
+            newlines[nFound++] = buffer + offset;
+            if (nFound == maxToFind) {
+                return nFound;
+            }
+        } else if (buffer[offset] == 0) {
+            break;
+        }
+    }
+
+    return nFound;
+}
+
+//
+// Whether every character of a quality string is printable ASCII ('!' through '~').  Bytes with the high bit set are
+// negative as signed chars, so the one signed compare against '!' catches them too.
+//
+    static inline bool
+isValidQualityString(const char *quality, unsigned length)
+{
+    unsigned i = 0;
+
+#if     defined(__SSE2__) || defined(_M_X64)
+    const __m128i lowest = _mm_set1_epi8('!');
+    const __m128i highest = _mm_set1_epi8('~');
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(quality + i));
+        if (0 != _mm_movemask_epi8(_mm_or_si128(_mm_cmplt_epi8(block, lowest), _mm_cmpgt_epi8(block, highest)))) {
+            return false;
+        }
+    }
+#endif  // SSE2
+
+    for (; i < length; i++) {
+        if (quality[i] < '!' || quality[i] > '~') {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 //
 // Try to parse a read starting at a given position pos, updating readToUpdate with it.
 // Returns 0 if the parse failed or the first position past the read if it succeeds. In
@@ -214,7 +311,7 @@ FASTQReader::getNextRead(Read *readToUpdate)
     return true;
 }
 
-    _int64
+    SNAP_CPU_DISPATCH _int64
 FASTQReader::getReadFromBuffer(char *buffer, _int64 validBytes, Read *readToUpdate, const char *fileName, DataReader *data, const ReaderContext &context)
 {
     //
@@ -222,11 +319,18 @@ FASTQReader::getReadFromBuffer(char *buffer, _int64 validBytes, Read *readToUpda
     //
     char* lines[nLinesPerFastqQuery];
     unsigned lineLengths[nLinesPerFastqQuery];
+    char* newLines[nLinesPerFastqQuery];
     char* scan = buffer;
 
+    //
+    // Find all of the line ends at once.  A CR following a newline is skipped below, but since it isn't a newline
+    // itself that doesn't change where the next one is.
+    //
+    unsigned nNewLines = findNewlines(buffer, validBytes, nLinesPerFastqQuery, newLines);
+
     for (unsigned i = 0; i < nLinesPerFastqQuery; i++) {
 
-        char *newLine = strnchr(scan, '\n', validBytes - (scan - buffer));
+        char *newLine = (i < nNewLines) ? newLines[i] : NULL;
         if (NULL == newLine) {
             if (validBytes - (scan - buffer) == 1 && *scan == 0x1a && data->isEOF()) {
                 // sometimes DOS files will have extra ^Z at end
@@ -258,8 +362,25 @@ FASTQReader::getReadFromBuffer(char *buffer, _int64 validBytes, Read *readToUpda
         scan = newLine + (newLine[1] == '\r' ? 2 : 1);
     }
 
+    if (lineLengths[3] != lineLengths[1]) {
+        fprintf(stderr, "FASTQ record has %d bases but %d quality scores at %s:%lld\n", lineLengths[1], lineLengths[3], fileName, data->getFileOffset());
+        soft_exit(1);
+    }
+
+    if (!isValidQualityString(lines[3], lineLengths[3])) {
+        fprintf(stderr, "FASTQ record has a quality score that isn't printable ASCII at %s:%lld\n", fileName, data->getFileOffset());
+        soft_exit(1);
+    }
+
     const char *id = lines[0] + 1; // The '@' on the first line is not part of the ID
-    readToUpdate->init(id, (unsigned) lineLengths[0] - 1, lines[1], lines[3], lineLengths[1]);
+    unsigned length = lineLengths[1];
+    if (NULL != context.trimmer) {
+        length = context.trimmer->trimmedLength(lines[1], lines[3], length);
+    }
+    readToUpdate->init(id, (unsigned) lineLengths[0] - 1, lines[1], lines[3], length);
+    if (NULL != context.screen) {
+        readToUpdate->setScreened(context.screen->matches(readToUpdate->getData(), length));
+    }
     readToUpdate->clip(context.clipping);
     readToUpdate->setBatch(data->getBatch());
     readToUpdate->setReadGroup(context.defaultReadGroup);
@@ -449,32 +570,92 @@ PairedInterleavedFASTQReader::reinit(_int64 startingOffset, _int64 amountOfFileT
 // FASTQWriter
 //
 
-    FASTQWriter *
-FASTQWriter::Factory(const char *filename)
+    DataWriterSupplier *
+FASTQWriter::createSupplier(const char *fileName)
 {
-    FILE *file = fopen(filename,"wb");
-    if (NULL == file) {
-        return NULL;
+    if (util::stringEndsWith(fileName, ".gz")) {
+        GzipWriterFilterSupplier *gzipSupplier = DataWriterSupplier::gzip(true, BAM_BLOCK, 1, false);
+        return DataWriterSupplier::create(fileName, gzipSupplier, FileEncoder::gzip(gzipSupplier));
     }
 
-    return new FASTQWriter(file);
+    return DataWriterSupplier::create(fileName);
+}
+
+FASTQWriter::FASTQWriter(DataWriterSupplier *supplier) : writer(supplier->getWriter())
+{
+}
+
+FASTQWriter::~FASTQWriter()
+{
+    writer->close();
+    delete writer;
 }
 
     bool
-FASTQWriter::writeRead(Read *read)
+FASTQWriter::writeRead(Read *read, int mateNumber)
 {
-    size_t len = read->getIdLength() + 2 * (read->getDataLength() + 2) /* @ and + */ + 10 /* crlf + padding + null */;
+    char *buffer = getSpace(recordSize(read));
+    if (NULL == buffer) {
+        return false;
+    }
 
-    if (bufferSize - bufferOffset <= len) {
-        flushBuffer();
+    writer->advance((unsigned)formatRead(buffer, read, mateNumber));
+    return true;
+}
+
+    bool
+FASTQWriter::writePair(Read *read0, Read *read1)
+{
+    char *buffer = getSpace(recordSize(read0) + recordSize(read1));
+    if (NULL == buffer) {
+        return false;
     }
 
-    size_t bytesUsed = snprintf(buffer + bufferOffset, bufferSize - bufferOffset, "@%.*s\n%.*s\n+\n%.*s\n", read->getIdLength(), read->getId(), read->getDataLength(), read->getData(), read->getDataLength(), read->getQuality());
- 
-    bufferOffset += bytesUsed;
+    size_t used = formatRead(buffer, read0, 1);
+    used += formatRead(buffer + used, read1, 2);
+    writer->advance((unsigned)used);
     return true;
 }
 
+    size_t
+FASTQWriter::formatRead(char *buffer, Read *read, int mateNumber)
+{
+    char *next = buffer;
+    *next++ = '@';
+    memcpy(next, read->getId(), read->getIdLength());
+    next += read->getIdLength();
+    if (0 != mateNumber) {
+        *next++ = '/';
+        *next++ = (char)('0' + mateNumber);
+    }
+    *next++ = '\n';
+    memcpy(next, read->getData(), read->getDataLength());
+    next += read->getDataLength();
+    memcpy(next, "\n+\n", 3);
+    next += 3;
+    memcpy(next, read->getQuality(), read->getDataLength());
+    next += read->getDataLength();
+    *next++ = '\n';
+
+    return next - buffer;
+}
+
+    char *
+FASTQWriter::getSpace(size_t bytes)
+{
+    char *buffer;
+    size_t size;
+    if (!writer->getBuffer(&buffer, &size) || size < bytes) {
+        writer->nextBatch();
+        if (!writer->getBuffer(&buffer, &size) || size < bytes) {
+            fprintf(stderr, "FASTQWriter: %lld byte read doesn't fit in a write buffer\n", (_int64)bytes);
+            return NULL;
+        }
+    }
+
+    return buffer;
+}
+
 
 PairedFASTQReader::~PairedFASTQReader()
 {
@@ -521,6 +702,147 @@ PairedFASTQReader::getNextReadPair(Read *read0, Read *read1)
     return worked;
 }
 
+struct FASTQRecordIndexThreadContext {
+    FASTQRecordIndex           *index;
+    DataSupplier               *supplier;
+    const char                 *fileName;
+    const ReaderContext        *context;
+    _int64                     *firstRecordOffsets;
+    _int64                     *recordsBefore;
+    _int64                      nChunks;
+    volatile _int64            *nextChunk;
+    volatile int               *runningThreadCount;
+    SingleWaiterObject         *doneObject;
+};
+
+    FASTQRecordIndex *
+FASTQRecordIndex::create(
+    DataSupplier *supplier,
+    const char *fileName,
+    int numThreads,
+    const ReaderContext& context)
+{
+    FASTQRecordIndex *index = new FASTQRecordIndex;
+    index->fileSize = DataSupplier::InputFileSize(fileName);
+    index->nChunks = __max(index->fileSize / ChunkBytes, (_int64)1);
+    index->firstRecordOffsets = new _int64[index->nChunks + 1];
+    index->recordsBefore = new _int64[index->nChunks + 1];
+
+    numThreads = (int)__min((_int64)numThreads, index->nChunks);
+    FASTQRecordIndexThreadContext *threadContexts = new FASTQRecordIndexThreadContext[numThreads];
+    SingleWaiterObject doneObject;
+    CreateSingleWaiterObject(&doneObject);
+    volatile int runningThreadCount = numThreads;
+    volatile _int64 nextChunk = 0;
+
+    for (int i = 0; i < numThreads; i++) {
+        threadContexts[i].index = index;
+        threadContexts[i].supplier = supplier;
+        threadContexts[i].fileName = fileName;
+        threadContexts[i].context = &context;
+        threadContexts[i].firstRecordOffsets = index->firstRecordOffsets;
+        threadContexts[i].recordsBefore = index->recordsBefore;
+        threadContexts[i].nChunks = index->nChunks;
+        threadContexts[i].nextChunk = &nextChunk;
+        threadContexts[i].runningThreadCount = &runningThreadCount;
+        threadContexts[i].doneObject = &doneObject;
+        StartNewThread(BuildThreadMain, &threadContexts[i]);
+    }
+
+    WaitForSingleWaiterObject(&doneObject);
+    DestroySingleWaiterObject(&doneObject);
+    delete [] threadContexts;
+
+    //
+    // The threads left each chunk's count in the slot after it; add them up.
+    //
+    index->firstRecordOffsets[index->nChunks] = index->fileSize;
+    index->recordsBefore[0] = 0;
+    for (_int64 chunk = 0; chunk < index->nChunks; chunk++) {
+        index->recordsBefore[chunk + 1] += index->recordsBefore[chunk];
+    }
+    index->nRecords = index->recordsBefore[index->nChunks];
+
+    return index;
+}
+
+    void
+FASTQRecordIndex::BuildThreadMain(void *param)
+{
+    FASTQRecordIndexThreadContext *context = (FASTQRecordIndexThreadContext *)param;
+    FASTQReader *reader = FASTQReader::create(context->supplier, context->fileName, 0, ChunkBytes, *context->context);
+    Read read;
+
+    _int64 chunk;
+    while ((chunk = InterlockedAdd64AndReturnNewValue(context->nextChunk, 1) - 1) < context->nChunks) {
+        //
+        // Find where this chunk's first record and the next one's are, and count what's in between.
+        //
+        _int64 recordOffset = 0;
+        if (chunk > 0) {
+            reader->reinit(chunk * ChunkBytes, ChunkBytes);
+            recordOffset = reader->getFileOffset();
+        }
+
+        _int64 nextRecordOffset = DataSupplier::InputFileSize(context->fileName);
+        if (chunk + 1 < context->nChunks) {
+            reader->reinit((chunk + 1) * ChunkBytes, ChunkBytes);
+            nextRecordOffset = reader->getFileOffset();
+        }
+
+        _int64 nRecords = 0;
+        reader->reinitAtRecord(recordOffset, nextRecordOffset - recordOffset);
+        while (reader->getNextRead(&read)) {
+            nRecords++;
+        }
+
+        context->firstRecordOffsets[chunk] = recordOffset;
+        context->recordsBefore[chunk + 1] = nRecords;
+    }
+
+    delete reader;
+
+    if (0 == InterlockedDecrementAndReturnNewValue(context->runningThreadCount)) {
+        SignalSingleWaiterObject(context->doneObject);
+    }
+}
+
+    _int64
+FASTQRecordIndex::getRecordOffset(
+    FASTQReader *reader,
+    _int64 recordNumber) const
+{
+    if (recordNumber >= nRecords) {
+        return fileSize;
+    }
+
+    //
+    // The last chunk that starts at or before the record.
+    //
+    _int64 low = 0, high = nChunks - 1;
+    while (low < high) {
+        _int64 middle = (low + high + 1) / 2;
+        if (recordsBefore[middle] <= recordNumber) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+
+    reader->reinitAtRecord(firstRecordOffsets[low], firstRecordOffsets[low + 1] - firstRecordOffsets[low]);
+    Read read;
+    for (_int64 i = recordsBefore[low]; i < recordNumber; i++) {
+        reader->getNextRead(&read);
+    }
+    return reader->getFileOffset();
+}
+
+FASTQRecordIndex::~FASTQRecordIndex()
+{
+    delete [] firstRecordOffsets;
+    delete [] recordsBefore;
+}
+
     PairedReadSupplierGenerator *
 PairedFASTQReader::createPairedReadSupplierGenerator(
     const char *fileName0,
@@ -530,13 +852,15 @@ PairedFASTQReader::createPairedReadSupplierGenerator(
     bool gzip)
 {
     //
-    // Decide whether to use the range splitter or a queue based on whether the files are the same size.
+    // Uncompressed files are range split: by offset if they're the same size, which means that the mates are at the same
+    // offsets in both, and otherwise by record number.  Anything else, and -ordered (since the ranges don't come out in
+    // any particular order), needs the queue.
     //
-    if (QueryFileSize(fileName0) != QueryFileSize(fileName1) || gzip) {
+    bool isStdin = !strcmp(fileName0, "-") || !strcmp(fileName1, "-");
+    if (gzip || isStdin || InputOrder::Enabled) {
         fprintf(stderr,"FASTQ using supplier queue\n");
-        DataSupplier* dataSupplier = gzip ? DataSupplier::GzipDefault[false] : DataSupplier::Default[false];
-        ReadReader *reader1 = FASTQReader::create(dataSupplier, fileName0,0,QueryFileSize(fileName0),context);
-        ReadReader *reader2 = FASTQReader::create(dataSupplier, fileName1,0,QueryFileSize(fileName1),context);
+        ReadReader *reader1 = FASTQReader::create(DataSupplier::ForFile(fileName0, gzip, false), fileName0,0,DataSupplier::InputFileSize(fileName0),context);
+        ReadReader *reader2 = FASTQReader::create(DataSupplier::ForFile(fileName1, gzip, false), fileName1,0,DataSupplier::InputFileSize(fileName1),context);
         if (NULL == reader1 || NULL == reader2) {
             delete reader1;
             delete reader2;
@@ -544,10 +868,13 @@ PairedFASTQReader::createPairedReadSupplierGenerator(
         }
         ReadSupplierQueue *queue = new ReadSupplierQueue(reader1,reader2); 
         queue->startReaders();
-        return queue;
-    } else {
+        return RestrictPairsToRange(queue, context);
+    } else if (DataSupplier::InputFileSize(fileName0) == DataSupplier::InputFileSize(fileName1)) {
         fprintf(stderr,"FASTQ using range splitter\n");
         return new RangeSplittingPairedReadSupplierGenerator(fileName0, fileName1, FASTQFile, numThreads, false, context);
+    } else {
+        fprintf(stderr,"FASTQ using record splitter\n");
+        return new RecordSplittingPairedReadSupplierGenerator(fileName0, fileName1, numThreads, context);
     }
 }
 
@@ -559,9 +886,10 @@ FASTQReader::createReadSupplierGenerator(
     bool gzip)
 {
     bool isStdin = !strcmp(fileName,"-");
-    if (! gzip && !isStdin) {
+    if (! gzip && !isStdin && ! InputOrder::Enabled) {
         //
-        // Single ended uncompressed FASTQ files can be handled by a range splitter.
+        // Single ended uncompressed FASTQ files can be handled by a range splitter (unless they have to come out in
+        // order).
         //
         return new RangeSplittingReadSupplierGenerator(fileName, false, numThreads, context);
     } else {
@@ -576,7 +904,7 @@ FASTQReader::createReadSupplierGenerator(
                 fastq = FASTQReader::create(DataSupplier::Stdio[false], fileName, 0, 0, context);
             }
         } else {
-            fastq = FASTQReader::create(DataSupplier::GzipDefault[false], fileName, 0, QueryFileSize(fileName), context);
+            fastq = FASTQReader::create(DataSupplier::ForFile(fileName, gzip, false), fileName, 0, DataSupplier::InputFileSize(fileName), context);
         }
         if (fastq == NULL) {
             delete fastq;
@@ -584,7 +912,7 @@ FASTQReader::createReadSupplierGenerator(
         }
         ReadSupplierQueue *queue = new ReadSupplierQueue(fastq);
         queue->startReaders();
-        return queue;
+        return RestrictToRange(queue, context);
     }
 }
     
@@ -597,7 +925,7 @@ PairedInterleavedFASTQReader::createPairedReadSupplierGenerator(
 {
      bool isStdin = !strcmp(fileName,"-");
  
-     if (gzip || isStdin) {
+     if (gzip || isStdin || InputOrder::Enabled) {
         fprintf(stderr,"PairedInterleavedFASTQ using supplier queue\n");
         DataSupplier *dataSupplier;
         if (isStdin) {
@@ -607,10 +935,10 @@ PairedInterleavedFASTQReader::createPairedReadSupplierGenerator(
                 dataSupplier = DataSupplier::Stdio[false];
             }
         } else {
-            dataSupplier = DataSupplier::GzipDefault[false];
+            dataSupplier = DataSupplier::ForFile(fileName, gzip, false);
         }
         
-        PairedReadReader *reader = PairedInterleavedFASTQReader::create(dataSupplier, fileName,0,(stdin ? 0 : QueryFileSize(fileName)),context);
+        PairedReadReader *reader = PairedInterleavedFASTQReader::create(dataSupplier, fileName,0,(stdin ? 0 : DataSupplier::InputFileSize(fileName)),context);
  
         if (NULL == reader ) {
             delete reader;
@@ -618,9 +946,127 @@ PairedInterleavedFASTQReader::createPairedReadSupplierGenerator(
         }
         ReadSupplierQueue *queue = new ReadSupplierQueue(reader); 
         queue->startReaders();
-        return queue;
+        return RestrictPairsToRange(queue, context);
     } else {
         fprintf(stderr,"PairedInterleavedFASTQ using range splitter\n");
         return new RangeSplittingPairedReadSupplierGenerator(fileName, NULL, InterleavedFASTQFile, numThreads, false, context);
     }
 }
+
+//
+// FASTQ output, for the reads that -route sends to a .fq file (e.g., the unaligned ones, for something else to look at).
+// Reads are written as they came in, whatever their alignment, and pairs are interleaved.  There's no header and no
+// sorting.
+//
+class FASTQFormat : public FileFormat
+{
+public:
+    virtual void getSortInfo(const Genome* genome, char* buffer, _int64 bytes, GenomeLocation* o_location, unsigned* o_readBytes, int* o_refID, int* o_pos) const;
+
+    virtual ReadWriterSupplier* getWriterSupplier(AlignerOptions* options, const Genome* genome) const;
+
+    virtual bool writeHeader(
+        const ReaderContext& context, char *header, size_t headerBufferSize, size_t *headerActualSize,
+        bool sorted, int argc, const char **argv, const char *version, const char *rgLine) const;
+
+    virtual bool writeRead(
+        const Genome * genome, LandauVishkinWithCigar * lv, char * buffer, size_t bufferSpace,
+        size_t * spaceUsed, size_t qnameLen, Read * read, AlignmentResult result,
+        int mapQuality, GenomeLocation genomeLocation, Direction direction,
+        bool hasMate = false, bool firstInPair = false, Read * mate = NULL,
+        AlignmentResult mateResult = NotFound, GenomeLocation mateLocation = 0, Direction mateDirection = FORWARD,
+        const SpliceJunction *splice = NULL, const SplitRecord *split = NULL) const;
+
+    virtual bool writesMatesInOrder() const {return true;}
+
+    virtual bool writesSupplementaryAlignments() const {return false;}
+};
+
+const FileFormat* FileFormat::FASTQ = new FASTQFormat();
+
+    void
+FASTQFormat::getSortInfo(
+    const Genome* genome,
+    char* buffer,
+    _int64 bytes,
+    GenomeLocation* o_location,
+    unsigned* o_readBytes,
+    int* o_refID,
+    int* o_pos) const
+{
+    fprintf(stderr, "FASTQ output can't be sorted\n");
+    soft_exit(1);
+}
+
+    ReadWriterSupplier*
+FASTQFormat::getWriterSupplier(
+    AlignerOptions* options,
+    const Genome* genome) const
+{
+    if (options->sortOutput) {
+        fprintf(stderr, "FASTQ output can't be sorted\n");
+        soft_exit(1);
+    }
+    return ReadWriterSupplier::create(this, DataWriterSupplier::create(options->outputFile.fileName), genome);
+}
+
+    bool
+FASTQFormat::writeHeader(
+    const ReaderContext& context,
+    char *header,
+    size_t headerBufferSize,
+    size_t *headerActualSize,
+    bool sorted,
+    int argc,
+    const char **argv,
+    const char *version,
+    const char *rgLine) const
+{
+    *headerActualSize = 0;
+    return true;
+}
+
+    bool
+FASTQFormat::writeRead(
+    const Genome * genome,
+    LandauVishkinWithCigar * lv,
+    char * buffer,
+    size_t bufferSpace,
+    size_t * spaceUsed,
+    size_t qnameLen,
+    Read * read,
+    AlignmentResult result,
+    int mapQuality,
+    GenomeLocation genomeLocation,
+    Direction direction,
+    bool hasMate,
+    bool firstInPair,
+    Read * mate,
+    AlignmentResult mateResult,
+    GenomeLocation mateLocation,
+    Direction mateDirection,
+    const SpliceJunction *splice,
+    const SplitRecord *split) const
+{
+    unsigned length = read->getUnclippedLength();
+    size_t size = 1 + qnameLen + 1 + length + 3 + length + 1;   // @id\nbases\n+\nqualities\n
+    if (size > bufferSpace) {
+        return false;
+    }
+
+    char *next = buffer;
+    *next++ = '@';
+    memcpy(next, read->getId(), qnameLen);
+    next += qnameLen;
+    *next++ = '\n';
+    memcpy(next, read->getUnclippedData(), length);
+    next += length;
+    memcpy(next, "\n+\n", 3);
+    next += 3;
+    memcpy(next, read->getUnclippedQuality(), length);
+    next += length;
+    *next++ = '\n';
+
+    *spaceUsed = size;
+    return true;
+}
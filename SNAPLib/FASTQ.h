@@ -52,14 +52,26 @@ public:
         virtual bool getNextRead(Read *readToUpdate);
 
         virtual void reinit(_int64 startingOffset, _int64 amountOfFileToProcess);
+
+        // For a range that's known to start with a record, so there's nothing to skip (and no chance of skipping a record
+        // that skipPartialRecord doesn't recognize)
+        void reinitAtRecord(_int64 startingOffset, _int64 amountOfFileToProcess)
+        { data->reinit(startingOffset, amountOfFileToProcess); }
         
         void releaseBatch(DataBatch batch)
         { data->releaseBatch(batch); }
 
+        virtual bool isReadReady()
+        { return data->isDataReady(); }
+
         static _int64 getReadFromBuffer(char *buffer, _int64 bufferSize, Read *readToUpdate, const char *fileName, DataReader *data, const ReaderContext &context);    // Returns the number of bytes consumed.
 
         static bool skipPartialRecord(DataReader *data);
 
+        // Where in the file the next record starts
+        _int64 getFileOffset()
+        { return data->getFileOffset(); }
+
 private:
 
         static const int maxReadSizeInBytes = MAX_READ_LENGTH * 2 + 1000;    // Read as in sequencer read, not read-from-the-filesystem.  +1000 is for ID string, + line, newlines, etc.
@@ -107,6 +119,9 @@ public:
         void releaseBatch(DataBatch batch)
         { data->releaseBatch(batch); }
 
+        virtual bool isReadReady()
+        { return data->isDataReady(); }
+
 private:
 
     static const int maxReadSizeInBytes = MAX_READ_LENGTH * 2 + 1000;    // Read as in sequencer read, not read-from-the-filesystem.  +1000 is for ID string, + line, newlines, etc.
@@ -155,39 +170,78 @@ private:
         FASTQReader *readers[2];
 };
 
-
-class FASTQWriter { 
+//
+// Record numbers in an uncompressed FASTQ file, so that a pair of FASTQ files whose mates aren't at the same offsets
+// in both (because the reads were trimmed, say, so the files aren't the same size) can still be range split: a range is a
+// run of record numbers, which each thread finds in both files itself.  Building it reads the whole file once, ChunkBytes at
+// a time on numThreads threads, counting the records from the first one that skipPartialRecord finds in each chunk up to the
+// first one it finds in the next, so that every record is counted in exactly one chunk.  Finding a record then only has to
+// read forward from the first record in its chunk.  The last chunk takes the file's odd bytes, so each one is long enough
+// to have a record start in it.
+//
+class FASTQRecordIndex {
 public:
-        ~FASTQWriter() {flushBuffer(); delete [] buffer; fclose(outputFile);}
-        static FASTQWriter *Factory(const char *filename);
+        ~FASTQRecordIndex();
+
+        static FASTQRecordIndex *create(DataSupplier *supplier, const char *fileName, int numThreads, const ReaderContext& context);
+
+        _int64 getRecordCount() const
+        { return nRecords; }
 
-        bool writeRead(Read *readToWrite);
+        //
+        // The offset where record recordNumber starts, or the file size if it's the count of records, found by reading
+        // forward with reader, which is left wherever it ends up.
+        //
+        _int64 getRecordOffset(FASTQReader *reader, _int64 recordNumber) const;
+
+        static const _int64 ChunkBytes = 4 * 1024 * 1024;
 
 private:
+        FASTQRecordIndex() : firstRecordOffsets(NULL), recordsBefore(NULL) {}
 
-        void flushBuffer()
-        {
-            if (0 == bufferOffset) {
-                return;
-            }
-            if (1 != fwrite(buffer, bufferOffset, 1, outputFile)) {
-                fprintf(stderr,"FASTQWriter: error writing file\n");
-            }
+        static void BuildThreadMain(void *param);
 
-            bufferOffset = 0;
-        }
+        _int64      fileSize;
+        _int64      nChunks;
+        _int64      nRecords;
+        _int64     *firstRecordOffsets;     // Of the first record in each chunk, and the file size at the end
+        _int64     *recordsBefore;          // Records that start in the chunks before each one, and in all of them at the end
+};
 
-        FASTQWriter(FILE *i_outputFile) : outputFile(i_outputFile) {
-            bufferSize = 20 * 1024 * 1024;
-            buffer = new char[bufferSize];
-            bufferOffset = 0;
-        }
 
-        FILE *outputFile;
+class DataWriter;
+class DataWriterSupplier;
+
+//
+// Writes reads as FASTQ through a DataWriter, so any number of threads can write to the same file, each with its own
+// FASTQWriter, and gzipped output is compressed on the work pool rather than by the threads doing the writing.
+//
+class FASTQWriter {
+public:
+        //
+        // Opens fileName for FASTQWriters to write to.  If it ends in .gz it's compressed as BGZF (which is also gzip,
+        // but in blocks that can be compressed in parallel).  The caller closes and deletes it once its writers are gone.
+        //
+        static DataWriterSupplier *createSupplier(const char *fileName);
+
+        FASTQWriter(DataWriterSupplier *supplier);
+        ~FASTQWriter();
+
+        //
+        // A mateNumber of 1 or 2 adds /1 or /2 to the read's ID.  writePair writes both reads into the same batch, so
+        // they stay next to each other in the file even when other threads are writing to it too.
+        //
+        bool writeRead(Read *read, int mateNumber = 0);
+        bool writePair(Read *read0, Read *read1);
+
+private:
+
+        static size_t recordSize(Read *read) {return read->getIdLength() + 2 * read->getDataLength() + 8;}    // @, /1, + and four newlines
+        static size_t formatRead(char *buffer, Read *read, int mateNumber);
+
+        char *getSpace(size_t bytes);
 
-        char *buffer;
-        size_t bufferSize;
-        size_t bufferOffset;
+        DataWriter *writer;
 };
 
 
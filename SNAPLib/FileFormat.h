@@ -44,7 +44,10 @@ public:
     // reading
     //
 
-    virtual void getSortInfo(const Genome* genome, char* buffer, _int64 bytes, unsigned* o_location, unsigned* o_readBytes, int* o_refID = NULL, int* o_pos = NULL) const = 0;
+    // A read with neither a location nor a mate's sorts at UnalignedSortLocation, after all of the real ones.
+    static const GenomeLocation UnalignedSortLocation = (GenomeLocation)(((_uint64)1 << GenomeLocationBits) - 1);
+
+    virtual void getSortInfo(const Genome* genome, char* buffer, _int64 bytes, GenomeLocation* o_location, unsigned* o_readBytes, int* o_refID = NULL, int* o_pos = NULL) const = 0;
 
     /*
 
@@ -81,9 +84,22 @@ public:
     virtual bool writeRead(
         const Genome * genome, LandauVishkinWithCigar * lv, char * buffer, size_t bufferSpace, 
         size_t * spaceUsed, size_t qnameLen, Read * read, AlignmentResult result, 
-        int mapQuality, unsigned genomeLocation, Direction direction,
+        int mapQuality, GenomeLocation genomeLocation, Direction direction,
         bool hasMate = false, bool firstInPair = false, Read * mate = NULL, 
-        AlignmentResult mateResult = NotFound, unsigned mateLocation = 0, Direction mateDirection = FORWARD) const = 0; 
+        AlignmentResult mateResult = NotFound, GenomeLocation mateLocation = 0, Direction mateDirection = FORWARD,
+        const SpliceJunction *splice = NULL, const SplitRecord *split = NULL) const = 0;
+
+    //
+    // Whether a pair's reads must be written in the order they were read (rather than by location, so that they sort
+    // together), for formats that only pair reads up by their order.
+    //
+    virtual bool writesMatesInOrder() const {return false;}
+
+    //
+    // Whether the format has supplementary alignments, for the pieces of split reads besides the primary one.  A format
+    // that only has the reads themselves would just get them again.
+    //
+    virtual bool writesSupplementaryAlignments() const {return true;}
 
     //
     // formats
@@ -91,6 +107,7 @@ public:
 
     static const FileFormat* SAM[2]; // 0 for =, 1 for M (useM flag)
     static const FileFormat* BAM[2];
+    static const FileFormat* CRAM[2];   // BAM records, written out as CRAM containers
     static const FileFormat* FASTQ;
     static const FileFormat* FASTQZ;
 };
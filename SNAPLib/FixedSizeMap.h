@@ -4,6 +4,10 @@
 #include "BigAlloc.h"
 #include "exit.h"
 
+#if     defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
 
 //
 // A hash function for numeric types.
@@ -22,22 +26,32 @@ public:
 // A fixed-size hash map that allows for efficient clearing and reuse through epochs
 // and does not perform any memory allocation.
 //
-// This class only allows the capacity to be a power of 2.
+// This class only allows the capacity to be a power of 2 (and rounds it up to at least GroupSize).
 //
-// Use epoch + 1 as a tombstone for deleted values
+// It's laid out like a Swiss table: the slots are in groups of GroupSize, and each slot has a control byte that's
+// either Empty, Deleted or seven bits of its key's hash.  A lookup hashes to a group and compares all of that group's
+// control bytes with the key's seven bits at once (with SSE2 where it's available), so it only looks at the keys
+// that are likely to match, and it's done as soon as it sees a group with an Empty slot.  Groups are probed
+// quadratically.
 //
-// K must be a numeric type that supports shift, mask and xor operators.
+// Each group also has the epoch in which its control bytes were last written, and a group from an earlier epoch is
+// all Empty no matter what its control bytes say.  So clear() just starts a new epoch, which makes it cheap enough to
+// do for every read; a group's control bytes get reset the first time something's put in it in the new epoch.
 //
 template< typename K, typename V, typename Hash = NumericHash<K> >
 class FixedSizeMap
 {
 public:
-    FixedSizeMap(unsigned capacity_ = 16): entries(NULL), size(0) {
+    FixedSizeMap(unsigned capacity_ = 16): entries(NULL), control(NULL), groupEpochs(NULL), size(0) {
         reserve(capacity_);
     }
 
     ~FixedSizeMap() {
         delete[] entries;
+        if (NULL != control) {
+            BigDealloc(control);
+            BigDealloc(groupEpochs);
+        }
     }
 
     void reserve(unsigned capacity) {
@@ -51,30 +65,33 @@ public:
                 soft_exit(1);
             }
             delete[] entries;
+            BigDealloc(control);
+            BigDealloc(groupEpochs);
         }
-        this->capacity = capacity;
-        this->mask = capacity - 1;
-        entries = new Entry[capacity];
-        for (unsigned i = 0; i < capacity; i++) {
-            entries[i].epoch = 0;
+        this->capacity = __max(capacity, GroupSize);
+        nGroups = this->capacity / GroupSize;
+        groupMask = nGroups - 1;
+        entries = new Entry[this->capacity];
+        control = (unsigned char *)BigAlloc(this->capacity);
+        groupEpochs = (unsigned *)BigAlloc(nGroups * sizeof(*groupEpochs));
+        for (unsigned i = 0; i < nGroups; i++) {
+            groupEpochs[i] = 0;
         }
         epoch = 1;
-
-        clearBloomFilter();
     }
 
     void clear() {
         size = 0;
-        epoch += 2;
-        if (epoch > 100000000) {
-            // Reset the epoch of every bucket to 0 and the current epoch to 1
-            for (unsigned i = 0; i < capacity; i++) {
-                entries[i].epoch = 0;
+        epoch++;
+        if (0 == epoch) {
+            //
+            // Wrapped around, so there could be groups that look like they're from now.  Clear them for real.
+            //
+            for (unsigned i = 0; i < nGroups; i++) {
+                groupEpochs[i] = 0;
             }
             epoch = 1;
         }
-
-        clearBloomFilter();
     }
 
     void resize(unsigned size)
@@ -83,85 +100,77 @@ public:
         _ASSERT(size <= capacity);
     }
 
-    static const unsigned MaxQuadraticProbes = 4;
-
     inline V get(K key) {
-        unsigned pos = hash(key) & mask;
-#if     0
+        Entry *entry = find(key);
+        return NULL == entry ? V() : entry->value;
+    }
+
+    inline void put(K key, V value) {
+        _uint64 hashValue = mixedHash(key);
+        unsigned char tag = tagOf(hashValue);
+        unsigned group = groupOf(hashValue);
+
         //
-        // Prefetch the data.  If it hits in the Bloom Filter then we can overlap the cache fetch
-        // with the Bloom Filter computation, making the latter essentially free.  If it's not in the
-        // Bloom Filter, then this will bring the cache line in for the add that's doubtless coming
-        // soon after.
+        // Look for the key, remembering the first free slot on the way in case it's not there.
         //
-        _mm_prefetch((const char *)(&entries[pos]),_MM_HINT_T2);
+        int freeSlot = -1;
+        for (unsigned probe = 1; probe <= nGroups; probe++) {
+            if (groupEpochs[group] != epoch) {
+                if (-1 == freeSlot) {
+                    memset(control + group * GroupSize, Empty, GroupSize);
+                    groupEpochs[group] = epoch;
+                    freeSlot = group * GroupSize;
+                }
+                break;
+            }
 
-        if (!checkBloomFilter(key)) {
-            //
-            // Not in the Bloom Filter means not in the cache.
-            //
-            return V();
-        }
-#endif  // 0
-
-        unsigned i = 1;
-        while (true) {
-            if (entries[pos].epoch < epoch) {
-                return V();
-            } else if (entries[pos].key == key && entries[pos].epoch == epoch) {
-                return entries[pos].value;
-            } else {
-                pos = (pos + (i <= MaxQuadraticProbes ? i : 1)) & mask;
-                i++;
-                if (i > capacity + MaxQuadraticProbes) {
-                    return V();
+            const unsigned char *groupControl = control + group * GroupSize;
+            for (unsigned matches = matchingSlots(groupControl, tag); 0 != matches; matches &= matches - 1) {
+                Entry *entry = &entries[group * GroupSize + lowestSlot(matches)];
+                if (entry->key == key) {
+                    entry->value = value;
+                    return;
                 }
             }
-        }
-    }
 
-    inline void put(K key, V value) {
-        _ASSERT(size < capacity);
-//        addToBloomFilter(key);
-
-        unsigned pos = hash(key) & mask;
-        unsigned i = 1;
-
-        while (true) {
-            if (entries[pos].epoch != epoch) {
-                entries[pos].key = key;
-                entries[pos].value = value;
-                entries[pos].epoch = epoch;
-                size++;
-                return;
-            } else if (entries[pos].key == key) {
-                entries[pos].value = value;
-                return;
-            } else {
-                pos = (pos + (i <= MaxQuadraticProbes ? i : 1)) & mask;
-                i++;
-                _ASSERT(i <= capacity + MaxQuadraticProbes); // todo: overlow condition?
+            unsigned freeSlots = matchingSlots(groupControl, Empty);
+            if (-1 == freeSlot) {
+                unsigned emptyOrDeleted = freeSlots | matchingSlots(groupControl, Deleted);
+                if (0 != emptyOrDeleted) {
+                    freeSlot = group * GroupSize + lowestSlot(emptyOrDeleted);
+                }
             }
+            if (0 != freeSlots) {
+                break;
+            }
+            group = (group + probe) & groupMask;
         }
+
+        if (-1 == freeSlot) {
+            fprintf(stderr,"FixedSizeMap overflowed.  Code bug.\n");
+            soft_exit(1);
+        }
+
+        control[freeSlot] = tag;
+        entries[freeSlot].key = key;
+        entries[freeSlot].value = value;
+        size++;
     }
 
     inline void erase(K key) {
-        _ASSERT(size <= capacity);
-        unsigned pos = hash(key) & mask;
-        unsigned i = 1;
-        while (true) {
-            if (entries[pos].epoch < epoch) {
-                return;
-            } else if (entries[pos].key == key && entries[pos].epoch == epoch) {
-                entries[pos].epoch = epoch + 1; // mark with tombstone
-                size--;
-                return;
-            } else {
-                pos = (pos + (i <= MaxQuadraticProbes ? i : 1)) & mask;
-                i++;
-                _ASSERT(i <= capacity + MaxQuadraticProbes); // todo: overlow condition?
-            }
+        Entry *entry = find(key);
+        if (NULL == entry) {
+            return;
         }
+
+        //
+        // A lookup stops at a group with an Empty slot, so if this group already has one no lookup can be relying on
+        // it being full and the slot can go back to Empty.  Otherwise it has to be a tombstone.
+        //
+        unsigned slot = (unsigned)(entry - entries);
+        const unsigned char *groupControl = control + (slot & ~(GroupSize - 1));
+        control[slot] = 0 != matchingSlots(groupControl, Empty) ? Empty : Deleted;
+        size--;
     }
 
     inline int getSize() { return size; }
@@ -183,7 +192,7 @@ public:
         if (x < final) {
             do {
                 x++;
-            } while (x < final && x->epoch != epoch);
+            } while (x < final && !isFull((unsigned)(x - entries)));
         }
         return x;
     }
@@ -204,81 +213,97 @@ public:
     }
 
 private:
-    //
-    // To avoid cache misses on failed lookups, we have a cheezy Bloom filter.  It's fixed at 512 bits (which is 64 bytes, typically
-    // a cache line), and two features.
-    //
-    static const unsigned bloomFilterFeatureSizeInBits = 9; // Must be >=3.  Using 9 results in 64 bytes of Bloom Filter, which is cache-line sized (though not necessarily aligned)
-    static const unsigned bloomFilterSizeInChar = (1 << (bloomFilterFeatureSizeInBits - 3));
-    static const _uint64 bloomFilterFeatureMask = (1 << bloomFilterFeatureSizeInBits) - 1;
+    static const unsigned GroupSize = 16;
+    static const unsigned char Empty = 0x80;
+    static const unsigned char Deleted = 0xfe;  // Full slots have the high bit clear
 
-    unsigned char bloomFilter[bloomFilterSizeInChar];
+    struct Entry {
+        K key;
+        V value;
 
-    static inline void getBloomFilterFeatures(K key, unsigned *feature0Word, unsigned *feature0Bit, unsigned *feature1Word, unsigned *feature1Bit)
-    {
-        //
-        // We know the bloom filter is 2^bloomFilterFeatureSizeInBits bits wide.  Use alternating bloomFilterFeatureSizeInBits bit chunks from the key to build up each of the features.
-        //
-        _uint64 feature[2] = {0, 0};
+        void *operator new[](size_t size) {return BigAlloc(size);}
+        void operator delete[](void *ptr) {BigDealloc(ptr);}
+    };
 
-        for (int i = 0; i < sizeof(K) * 8; i += bloomFilterFeatureSizeInBits * 2) {
-            feature[0] ^= ((key >> i) & bloomFilterFeatureMask);
-            feature[1] ^= ((key >> (i+bloomFilterFeatureSizeInBits)) & bloomFilterFeatureMask);
-        }
+    //
+    // NumericHash's low bits are poor, so spread them all over before taking the tag from the top bits and the group
+    // from the middle ones.
+    //
+    inline _uint64 mixedHash(K key) {
+        return hash(key) * 0x9e3779b97f4a7c15ull;
+    }
 
-        *feature0Word = feature[0] / 8;
-        *feature0Bit = feature[0] % 8;
-        *feature1Word = feature[1] / 8;
-        *feature1Bit = feature[1] % 8;
+    static inline unsigned char tagOf(_uint64 hashValue) {
+        return (unsigned char)(hashValue >> 57);
+    }
 
-        _ASSERT(*feature0Word < bloomFilterSizeInChar && *feature1Word < bloomFilterSizeInChar);
+    inline unsigned groupOf(_uint64 hashValue) const {
+        return (unsigned)(hashValue >> 32) & groupMask;
     }
 
     //
-    // false means that this entry is NOT in the cache.  true means we can't say for sure.
+    // A bit for each slot in the group whose control byte is value.
     //
-    inline bool checkBloomFilter(K key)
-    {
-        unsigned feature0Word, feature0Bit, feature1Word, feature1Bit;
-
-        getBloomFilterFeatures(key, &feature0Word, &feature0Bit, &feature1Word, &feature1Bit);
+    static inline unsigned matchingSlots(const unsigned char *groupControl, unsigned char value) {
+#if     defined(__SSE2__) || defined(_M_X64)
+        __m128i controlBytes = _mm_loadu_si128((const __m128i *)groupControl);
+        return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(controlBytes, _mm_set1_epi8((char)value)));
+#else   // SSE2
+        unsigned matches = 0;
+        for (unsigned i = 0; i < GroupSize; i++) {
+            matches |= (groupControl[i] == value ? 1 : 0) << i;
+        }
+        return matches;
+#endif  // SSE2
+    }
 
-        return (bloomFilter[feature0Word] & (1 << feature0Bit)) && (bloomFilter[feature1Word] & (1 << feature1Bit));
+    static inline unsigned lowestSlot(unsigned matches) {
+        unsigned long slot;
+        CountTrailingZeroes((_uint64)matches, slot);
+        return (unsigned)slot;
     }
 
-    inline void addToBloomFilter(K key)
-    {
-        unsigned feature0Word, feature0Bit, feature1Word, feature1Bit;
+    inline bool isFull(unsigned slot) const {
+        return groupEpochs[slot / GroupSize] == epoch && !(control[slot] & 0x80);
+    }
 
-        getBloomFilterFeatures(key, &feature0Word, &feature0Bit, &feature1Word, &feature1Bit);
+    inline Entry *find(K key) {
+        _uint64 hashValue = mixedHash(key);
+        unsigned char tag = tagOf(hashValue);
+        unsigned group = groupOf(hashValue);
 
-        bloomFilter[feature0Word] |= 1 << feature0Bit;
-        bloomFilter[feature1Word] |= 1 << feature1Bit;
-    }
+        for (unsigned probe = 1; probe <= nGroups; probe++) {
+            if (groupEpochs[group] != epoch) {
+                return NULL;    // The whole group is Empty
+            }
 
-    void clearBloomFilter()
-    {
-       memset(bloomFilter, 0, bloomFilterSizeInChar * sizeof(bloomFilter[0]));
-    }
+            const unsigned char *groupControl = control + group * GroupSize;
+            for (unsigned matches = matchingSlots(groupControl, tag); 0 != matches; matches &= matches - 1) {
+                Entry *entry = &entries[group * GroupSize + lowestSlot(matches)];
+                if (entry->key == key) {
+                    return entry;
+                }
+            }
 
-    struct Entry {
-        K key;
-        V value;
-        int epoch;
+            if (0 != matchingSlots(groupControl, Empty)) {
+                return NULL;
+            }
+            group = (group + probe) & groupMask;
+        }
 
-        void *operator new[](size_t size) {return BigAlloc(size);}
-        void operator delete[](void *ptr) {BigDealloc(ptr);}
-    };
+        return NULL;
+    }
 
     Entry *entries;
+    unsigned char *control;         // One per entry
+    unsigned *groupEpochs;          // One per group
     unsigned capacity;
+    unsigned nGroups;
+    unsigned groupMask;
     unsigned size;
-    int mask;
-    int epoch;
+    unsigned epoch;
     Hash hash;
 
-
-
     bool isPowerOf2(int n) {
         while (n > 0) {
             if (n == 1) {
@@ -292,4 +317,3 @@ private:
         return false;
     }
 };
-
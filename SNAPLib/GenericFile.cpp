@@ -27,9 +27,80 @@ Revision History:
 #include "GenericFile.h"
 #include "GenericFile_HDFS.h"
 #include "GenericFile_stdio.h"
+#include "exit.h"
 
 const char *GenericFile::HDFS_PREFIX = "hdfs:/";
 
+struct ParallelReadContext
+{
+	GenericFile *file;
+	char *buffer;
+	size_t count;
+	_int64 offset;
+	size_t chunkSize;
+	int nChunks;
+	volatile int nextChunk;
+	volatile _int64 bytesRead;
+	volatile int nThreadsRunning;
+	SingleWaiterObject done;
+};
+
+static void ParallelReadThreadMain(void *param)
+{
+	ParallelReadContext *context = (ParallelReadContext *) param;
+
+	int chunk;
+	while ((chunk = InterlockedIncrementAndReturnNewValue(&context->nextChunk) - 1) < context->nChunks) {
+		size_t chunkOffset = chunk * context->chunkSize;
+		size_t amountToRead = __min(context->chunkSize, context->count - chunkOffset);
+		size_t bytesRead = context->file->readAt(context->buffer + chunkOffset, amountToRead, context->offset + chunkOffset);
+		if (bytesRead != (size_t) -1) {
+			InterlockedAdd64AndReturnNewValue(&context->bytesRead, bytesRead);
+		}
+	}
+
+	if (0 == InterlockedDecrementAndReturnNewValue(&context->nThreadsRunning)) {
+		SignalSingleWaiterObject(&context->done);
+	}
+}
+
+size_t GenericFile::readAtInParallel(void *ptr, size_t count, _int64 offset)
+{
+	int nChunks = (int) ((count + ParallelReadChunkSize - 1) / ParallelReadChunkSize);
+	if (nChunks <= 1) {
+		return readAt(ptr, count, offset);
+	}
+
+	ParallelReadContext context;
+	context.file = this;
+	context.buffer = (char *) ptr;
+	context.count = count;
+	context.offset = offset;
+	context.chunkSize = ParallelReadChunkSize;
+	context.nChunks = nChunks;
+	context.nextChunk = 0;
+	context.bytesRead = 0;
+	CreateSingleWaiterObject(&context.done);
+
+	int nThreads = __min(nChunks, MaxParallelReads);
+	context.nThreadsRunning = nThreads;
+	for (int i = 0; i < nThreads; i++) {
+		if (!StartNewThread(ParallelReadThreadMain, &context)) {
+			fprintf(stderr, "GenericFile::readAtInParallel: unable to start thread\n");
+			soft_exit(1);
+		}
+	}
+
+	WaitForSingleWaiterObject(&context.done);
+	DestroySingleWaiterObject(&context.done);
+	return (size_t) context.bytesRead;
+}
+
+bool GenericFile::IsRemote(const char *fileName)
+{
+	return NULL != fileName && 0 == strncmp(fileName, HDFS_PREFIX, strlen(HDFS_PREFIX));
+}
+
 GenericFile::GenericFile()
 {
 	_filename = NULL;
@@ -48,7 +119,7 @@ GenericFile *GenericFile::open(const char *filename, Mode mode)
 
 	GenericFile *retval = NULL;
 
-	if (0 == strncmp(filename, HDFS_PREFIX, strlen(HDFS_PREFIX))) {
+	if (IsRemote(filename)) {
 		retval = GenericFile_HDFS::open(filename, mode);
 	} else {
 		retval = GenericFile_stdio::open(filename, mode);
@@ -23,6 +23,8 @@ Revision History:
 
 #pragma once
 
+#include "Compat.h"
+
 class GenericFile
 {
 public:
@@ -51,6 +53,29 @@ public:
 	// Advance forward or back by byteOffset bytes in the file.
 	virtual int advance(long byteOffset) = 0;
 
+	// Move to byte 'offset' of the file.  Returns 0 on success.
+	virtual int seek(_int64 offset) = 0;
+
+	// Read 'count' bytes starting at 'offset' without using or moving the file position, so
+	// several threads can read different parts of the file at once.  Returns the number of
+	// bytes read (short only at end of file), or -1 on error.
+	virtual size_t readAt(void *ptr, size_t count, _int64 offset) = 0;
+
+	// The size of the file in bytes, or -1 if it can't be found.
+	virtual _int64 getSize() = 0;
+
+	// Like read, but for big reads, which are split into chunks that several threads fetch at once
+	// with readAt, because one request at a time can't keep the network or a fast disk busy.
+	virtual size_t readInParallel(void *ptr, size_t count) { return read(ptr, count); }
+
+	// Append 'count' bytes from 'ptr' to a file opened WriteOnly.  Returns the number of bytes
+	// written, which is short only on error.
+	virtual size_t write(const void *ptr, size_t count) = 0;
+
+	// Whether fileName names a file that GenericFile::open opens somewhere other than the
+	// local filesystem (that is, in HDFS).
+	static bool IsRemote(const char *fileName);
+
     // Close the file.
 	virtual void close() = 0;
 
@@ -58,6 +83,14 @@ public:
 
 protected:
 	GenericFile();
+
+	// Read 'count' bytes at 'offset' as chunks of ParallelReadChunkSize, with up to MaxParallelReads
+	// of them going at once.  Returns the number of bytes read, which is short if any chunk was.
+	size_t readAtInParallel(void *ptr, size_t count, _int64 offset);
+
+	static const size_t ParallelReadChunkSize = 8 * 1024 * 1024;
+	static const int MaxParallelReads = 16;
+
 	Mode _mode;
 	char *_filename;
 };
@@ -161,6 +161,76 @@ int GenericFile_HDFS::advance(long offset)
 	return hdfsSeek(_fs, _file, currOffset + offset);
 }
 
+int GenericFile_HDFS::seek(_int64 offset)
+{
+	return hdfsSeek(_fs, _file, offset);
+}
+
+size_t GenericFile_HDFS::readAt(void *ptr, size_t count, _int64 offset)
+{
+	size_t totalRead = 0;
+
+	while (totalRead < count) {
+		// hdfsPread is a positioned read, so unlike hdfsRead it's safe to use from several threads at once.
+		tSize readSize = (tSize) __min(count - totalRead, (size_t) 0x40000000);
+		tSize retval = hdfsPread(_fs, _file, offset + totalRead, ((char *) ptr) + totalRead, readSize);
+
+		if (retval < 0) {
+			perror("hdfsPread");
+			return (size_t) -1;
+		} else if (retval == 0) {
+			break;
+		}
+		totalRead += retval;
+	}
+
+	return totalRead;
+}
+
+_int64 GenericFile_HDFS::getSize()
+{
+	hdfsFileInfo *info = hdfsGetPathInfo(_fs, _filename);
+	if (NULL == info) {
+		return -1;
+	}
+
+	_int64 size = info->mSize;
+	hdfsFreeFileInfo(info, 1);
+	return size;
+}
+
+size_t GenericFile_HDFS::readInParallel(void *ptr, size_t count)
+{
+	tOffset currOffset = hdfsTell(_fs, _file);
+	size_t totalRead = readAtInParallel(ptr, count, currOffset);
+
+	// The positioned reads don't move the file position, so move it past what they read.
+	if (0 != hdfsSeek(_fs, _file, currOffset + totalRead)) {
+		perror("hdfsSeek");
+		return (size_t) -1;
+	}
+	return totalRead;
+}
+
+size_t GenericFile_HDFS::write(const void *ptr, size_t count)
+{
+	size_t totalWritten = 0;
+
+	while (totalWritten < count) {
+		// Like hdfsRead, hdfsWrite takes a signed 32-bit length
+		tSize writeSize = (tSize) __min(count - totalWritten, (size_t) INT_MAX);
+		tSize retval = hdfsWrite(_fs, _file, ((const char *) ptr) + totalWritten, writeSize);
+
+		if (retval <= 0) {
+			perror("hdfsWrite");
+			return totalWritten;
+		}
+		totalWritten += retval;
+	}
+
+	return totalWritten;
+}
+
 void GenericFile_HDFS::close()
 {
 	if (_mode == Mode::WriteOnly) {
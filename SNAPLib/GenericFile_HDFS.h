@@ -35,6 +35,11 @@ public:
 	virtual size_t read(void *ptr, size_t count);
 	virtual char *gets(char *buf, size_t count);
 	virtual int advance(long offset);
+	virtual int seek(_int64 offset);
+	virtual size_t readAt(void *ptr, size_t count, _int64 offset);
+	virtual _int64 getSize();
+	virtual size_t readInParallel(void *ptr, size_t count);
+	virtual size_t write(const void *ptr, size_t count);
 	virtual void close();
 	virtual ~GenericFile_HDFS();
 
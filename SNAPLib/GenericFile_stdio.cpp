@@ -74,6 +74,84 @@ int GenericFile_stdio::advance(long offset)
 {
 	return _fseek64bit(_file, offset, SEEK_CUR);
 }
+
+int GenericFile_stdio::seek(_int64 offset)
+{
+	return _fseek64bit(_file, offset, SEEK_SET);
+}
+
+size_t GenericFile_stdio::readAt(void *ptr, size_t count, _int64 offset)
+{
+	size_t totalRead = 0;
+
+	while (totalRead < count) {
+#ifdef _MSC_VER
+		// An overlapped read at an offset doesn't use the file pointer, so it's safe from any thread.
+		OVERLAPPED overlapped;
+		memset(&overlapped, 0, sizeof(overlapped));
+		overlapped.Offset = (DWORD) (offset + totalRead);
+		overlapped.OffsetHigh = (DWORD) ((offset + totalRead) >> 32);
+		DWORD bytesRead;
+		DWORD readSize = (DWORD) __min(count - totalRead, (size_t) 0x40000000);
+		if (!ReadFile((HANDLE) _get_osfhandle(_fileno(_file)), ((char *) ptr) + totalRead, readSize, &bytesRead, &overlapped)) {
+			if (GetLastError() == ERROR_HANDLE_EOF) {
+				return totalRead;
+			}
+			return (size_t) -1;
+		}
+#else
+		ssize_t bytesRead = pread(fileno(_file), ((char *) ptr) + totalRead, count - totalRead, offset + totalRead);
+		if (bytesRead < 0) {
+			return (size_t) -1;
+		}
+#endif
+		if (bytesRead == 0) {
+			return totalRead;
+		}
+		totalRead += bytesRead;
+	}
+
+	return totalRead;
+}
+
+size_t GenericFile_stdio::readInParallel(void *ptr, size_t count)
+{
+	// Readahead keeps one sequential stream going, but a fast (NVMe) disk needs several
+	// requests at once to reach its full speed, so big reads go out as chunks in parallel.
+	if (count <= ParallelReadChunkSize) {
+		return read(ptr, count);
+	}
+
+	_int64 currOffset = _ftell64bit(_file);
+	size_t totalRead = readAtInParallel(ptr, count, currOffset);
+
+	// The positioned reads don't move the file position, so move it past what they read.
+	if (0 != _fseek64bit(_file, currOffset + totalRead, SEEK_SET)) {
+		return (size_t) -1;
+	}
+	return totalRead;
+}
+
+size_t GenericFile_stdio::write(const void *ptr, size_t count)
+{
+	return fwrite(ptr, 1, count, _file);
+}
+
+_int64 GenericFile_stdio::getSize()
+{
+#ifdef _MSC_VER
+	struct _stat64 sb;
+	if (0 != _fstat64(_fileno(_file), &sb)) {
+		return -1;
+	}
+#else
+	struct stat sb;
+	if (0 != fstat(fileno(_file), &sb)) {
+		return -1;
+	}
+#endif
+	return sb.st_size;
+}
  
 void GenericFile_stdio::close()
 {
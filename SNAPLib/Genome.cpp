@@ -27,10 +27,21 @@ Revision History:
 #include "GenericFile.h"
 #include "Compat.h"
 #include "BigAlloc.h"
+#include "Tables.h"
 #include "exit.h"
 
-Genome::Genome(unsigned i_maxBases, unsigned nBasesStored, unsigned i_chromosomePadding)
-    : maxBases(i_maxBases), minOffset(0), maxOffset(i_maxBases), chromosomePadding(i_chromosomePadding)
+//
+// SNAPs with only 32 bit locations wrote the header's locations with %d, so ones of 2^31 and up may be negative.
+//
+static GenomeLocation ParseHeaderLocation(const char *text)
+{
+    _int64 value = strtoll(text, NULL, 10);
+    return (GenomeLocation)(value < 0 ? value + ((_int64)1 << 32) : value);
+}
+
+Genome::Genome(GenomeLocation i_maxBases, GenomeLocation nBasesStored, unsigned i_chromosomePadding)
+    : maxBases(i_maxBases), minOffset(0), maxOffset(i_maxBases), mappedFile(NULL), packedBases(NULL), ambiguousRuns(NULL), nAmbiguousRuns(0),
+      chromosomePadding(i_chromosomePadding)
 {
     bases = ((char *) BigAlloc(nBasesStored + 2 * N_PADDING)) + N_PADDING;
     if (NULL == bases) {
@@ -50,10 +61,18 @@ Genome::Genome(unsigned i_maxBases, unsigned nBasesStored, unsigned i_chromosome
     nContigs = 0;
     contigs = new Contig[maxContigs];
     contigsByName = NULL;
+    contigAtGranule = NULL;
+    excludedContigs = NULL;
 }
 
     void
 Genome::addData(const char *data, size_t len)
+{
+    memcpy(addUninitializedData(len),data,len);
+}
+
+    char *
+Genome::addUninitializedData(size_t len)
 {
     if ((size_t)nBases + len > maxBases) {
         fprintf(stderr,"Tried to write beyond allocated genome size (or tried to write into a genome that was loaded from a file).\n");
@@ -61,8 +80,9 @@ Genome::addData(const char *data, size_t len)
         soft_exit(1);
     }
 
-    memcpy(bases + nBases,data,len);
-    nBases += (unsigned)len;
+    char *data = bases + nBases;
+    nBases += (GenomeLocation)len;
+    return data;
 }
 
     void
@@ -71,6 +91,24 @@ Genome::addData(const char *data)
     addData(data, strlen(data));
 }
 
+    void
+Genome::appendGenome(const Genome *other)
+{
+    _ASSERT(0 == other->minOffset && other->maxOffset == other->nBases && NULL == other->packedBases);
+
+    //
+    // Anything before other's first contig is the padding that FASTA puts in front of every contig.  If we already have bases
+    // they end with padding of our own, so skip it to keep the layout the same as if it had all come from one FASTA file.
+    //
+    GenomeLocation copiedThrough = (0 != nBases && 0 != other->nContigs) ? other->contigs[0].beginningOffset : 0;
+    for (int i = 0; i < other->nContigs; i++) {
+        addData(other->bases + copiedThrough, other->contigs[i].beginningOffset - copiedThrough);
+        copiedThrough = other->contigs[i].beginningOffset;
+        startContig(other->contigs[i].name);
+    }
+    addData(other->bases + copiedThrough, other->nBases - copiedThrough);
+}
+
     void
 Genome::startContig(const char *contigName)
 {
@@ -105,9 +143,22 @@ Genome::startContig(const char *contigName)
 }
 
 
+Genome::Genome(unsigned i_chromosomePadding, MemoryMappedFile *i_mappedFile)
+    : bases(NULL), nBases(0), maxBases(0), minOffset(0), maxOffset(0), nContigs(0), maxContigs(0), contigs(NULL), contigsByName(NULL),
+      contigAtGranule(NULL), excludedContigs(NULL), mappedFile(i_mappedFile), packedBases(NULL), ambiguousRuns(NULL), nAmbiguousRuns(0), chromosomePadding(i_chromosomePadding)
+{
+}
+
 Genome::~Genome()
 {
-    BigDealloc(bases - N_PADDING);
+    if (NULL != packedBases) {
+        BigDealloc(packedBases);
+        delete [] ambiguousRuns;
+    } else if (NULL != mappedFile) {
+        CloseMemoryMappedFile(mappedFile);
+    } else if (NULL != bases) {
+        BigDealloc(bases - N_PADDING);
+    }
     for (int i = 0; i < nContigs; i++) {
         delete [] contigs[i].name;
         contigs[i].name = NULL;
@@ -117,6 +168,8 @@ Genome::~Genome()
     if (contigsByName) {
         delete [] contigsByName;
     }
+    delete [] contigAtGranule;
+    delete [] excludedContigs;
     contigs = NULL;
 }
 
@@ -129,13 +182,21 @@ Genome::saveToFile(const char *fileName) const
     //  the contigs themselves, rounded up to 4K, followed by the bases.
     //
 
-    FILE *saveFile = fopen(fileName,"wb");
-    if (saveFile == NULL) {
-        fprintf(stderr,"Genome::saveToFile: unable to open file '%s'\n",fileName);
+    if (NULL != packedBases) {
+        fprintf(stderr,"Genome::saveToFile: can't save a packed genome\n");
         return false;
-    } 
+    }
 
-    fprintf(saveFile,"%d %d\n",nBases,nContigs);
+    //
+    // Lay the header out in memory, so that it and the bases can all go out with positioned writes.  Contig names can't
+    // have spaces in the file, since loading splits the offset from the name at the first one.
+    //
+    size_t headerBufferSize = 64;
+    for (int i = 0; i < nContigs; i++) {
+        headerBufferSize += strlen(contigs[i].name) + 32;
+    }
+    char *header = new char[headerBufferSize];
+    size_t headerSize = snprintf(header, headerBufferSize, "%lld %d\n", (_int64)nBases, nContigs);
     char *curChar = NULL;
 
     for (int i = 0; i < nContigs; i++) {
@@ -143,24 +204,68 @@ Genome::saveToFile(const char *fileName) const
          curChar = contigs[i].name + n;
          if (*curChar == ' '){ *curChar = '_'; }
         }
-        fprintf(saveFile,"%d %s\n",contigs[i].beginningOffset,contigs[i].name);
+        headerSize += snprintf(header + headerSize, headerBufferSize - headerSize, "%lld %s\n", (_int64)contigs[i].beginningOffset, contigs[i].name);
     }
 
-    if (nBases != fwrite(bases,1,nBases,saveFile)) {
-        fprintf(stderr,"Genome::saveToFile: fwrite failed\n");
-        fclose(saveFile);
+    AsyncFile *saveFile = AsyncFile::open(fileName, true);
+    if (saveFile == NULL) {
+        fprintf(stderr,"Genome::saveToFile: unable to open file '%s'\n",fileName);
+        delete [] header;
         return false;
     }
 
-    fclose(saveFile);
+    //
+    // The bases are most of a genome file (3GB for a human one), and one write at a time doesn't keep a fast disk busy.  So
+    // keep several chunks' writes going at once, each writer waiting for its last one before it starts its next.
+    //
+    const size_t chunkSize = 16 * 1024 * 1024;
+    const int nWriters = 8;
+    AsyncFile::Writer *writers[nWriters];
+    size_t bytesWritten[nWriters];
+    size_t bytesExpected[nWriters];
+    for (int i = 0; i < nWriters; i++) {
+        writers[i] = saveFile->getWriter();
+        bytesWritten[i] = bytesExpected[i] = 0;
+    }
+
+    bool worked = writers[0]->beginWrite(header, headerSize, 0, &bytesWritten[0]);
+    bytesExpected[0] = headerSize;
+    int whichWriter = 1;
+    for (size_t chunkStart = 0; worked && chunkStart < nBases; chunkStart += chunkSize) {
+        AsyncFile::Writer *writer = writers[whichWriter];
+        worked = writer->waitForCompletion() && bytesWritten[whichWriter] == bytesExpected[whichWriter];
+        bytesExpected[whichWriter] = __min(chunkSize, (size_t)nBases - chunkStart);
+        worked = worked && writer->beginWrite(bases + chunkStart, bytesExpected[whichWriter], headerSize + chunkStart, &bytesWritten[whichWriter]);
+        whichWriter = (whichWriter + 1) % nWriters;
+    }
+
+    for (int i = 0; i < nWriters; i++) {
+        worked = writers[i]->waitForCompletion() && bytesWritten[i] == bytesExpected[i] && worked;
+        writers[i]->close();
+        delete writers[i];
+    }
+    worked = saveFile->close() && worked;
+    delete saveFile;
+    delete [] header;
+
+    if (!worked) {
+        fprintf(stderr,"Genome::saveToFile: write failed\n");
+        return false;
+    }
     return true;
 }
 
     const Genome *
-Genome::loadFromFile(const char *fileName, unsigned chromosomePadding, unsigned i_minOffset, unsigned length)
+Genome::loadFromFile(const char *fileName, unsigned chromosomePadding, GenomeLocation i_minOffset, GenomeLocation length, bool packed)
 {    
+    if (packed && (0 != i_minOffset || 0 != length)) {
+        fprintf(stderr,"Genome::loadFromFile: only whole genomes can be packed\n");
+        return NULL;
+    }
+
     GenericFile *loadFile;
-    unsigned nBases,nContigs;
+    GenomeLocation nBases;
+    unsigned nContigs;
 
     if (!openFileAndGetSizes(fileName,&loadFile,&nBases,&nContigs)) {
         //
@@ -178,14 +283,14 @@ Genome::loadFromFile(const char *fileName, unsigned chromosomePadding, unsigned
         length = __min(length,nBases - i_minOffset);
     }
 
-    Genome *genome = new Genome(nBases,length, chromosomePadding);
+    Genome *genome = packed ? new Genome(chromosomePadding, NULL) : new Genome(nBases,length, chromosomePadding);
    
     genome->nBases = nBases;
     genome->nContigs = genome->maxContigs = nContigs;
     genome->contigs = new Contig[nContigs];
     genome->minOffset = i_minOffset;
     if (i_minOffset >= nBases) {
-        fprintf(stderr,"Genome::loadFromFile: specified minOffset %u >= nBases %u\n",i_minOffset,nBases);
+        fprintf(stderr,"Genome::loadFromFile: specified minOffset %lld >= nBases %lld\n",(_int64)i_minOffset,(_int64)nBases);
     }
 
  
@@ -212,7 +317,7 @@ Genome::loadFromFile(const char *fileName, unsigned chromosomePadding, unsigned
 	  }
 	}
 
-    genome->contigs[i].beginningOffset = atoi(contigNameBuffer);
+    genome->contigs[i].beginningOffset = ParseHeaderLocation(contigNameBuffer);
 	contigNameBuffer[n] = ' '; 
 	n++; // increment n so we start copying at the position after the space
 	contigSize = strlen(contigNameBuffer + n) - 1; //don't include the final \n
@@ -242,15 +347,28 @@ Genome::loadFromFile(const char *fileName, unsigned chromosomePadding, unsigned
     }
     */
 
-	printf("advancing %u\n", i_minOffset);
+	printf("advancing %lld\n", (_int64)i_minOffset);
 	if (0 != loadFile->advance(i_minOffset)) {
         fprintf(stderr,"Genome::loadFromFile: _fseek64bit failed\n");
         soft_exit(1);
     }
 
+    if (packed) {
+        bool worked = genome->readPackedBases(loadFile);
+        loadFile->close();
+        delete loadFile;
+        if (!worked) {
+            delete genome;
+            return NULL;
+        }
+        genome->fillInContigLengths();
+        genome->sortContigsByName();
+        return genome;
+    }
+
 	long retval;
-    if (length != (retval = loadFile->read(genome->bases,length))) {
-        fprintf(stderr,"Genome::loadFromFile: fread of bases failed; wanted %u, got %d\n", length, retval);
+    if (length != (retval = (long)loadFile->readInParallel(genome->bases,length))) {
+        fprintf(stderr,"Genome::loadFromFile: fread of bases failed; wanted %lld, got %ld\n", (_int64)length, retval);
 		loadFile->close();
 		delete loadFile;
         delete genome;
@@ -264,6 +382,189 @@ Genome::loadFromFile(const char *fileName, unsigned chromosomePadding, unsigned
     return genome;
 }
 
+    bool
+Genome::readPackedBases(GenericFile *loadFile)
+{
+    maxBases = maxOffset = nBases;
+    packedBases = (unsigned char *)BigAlloc((nBases + 3) / 4);
+    memset(packedBases, 0, (nBases + 3) / 4);
+
+    std::vector<AmbiguousRun> runs;
+    const size_t chunkSize = 16 * 1024 * 1024;
+    char *chunk = new char[chunkSize];
+    for (GenomeLocation chunkStart = 0; chunkStart < nBases; ) {
+        size_t amountToRead = __min(chunkSize, (size_t)(nBases - chunkStart));
+        size_t amountRead = loadFile->readInParallel(chunk, amountToRead);
+        if (amountRead != amountToRead) {
+            fprintf(stderr,"Genome::loadFromFile: fread of bases failed; wanted %lld, got %lld\n", (_int64)amountToRead, (_int64)amountRead);
+            delete [] chunk;
+            return false;
+        }
+
+        for (size_t i = 0; i < amountRead; i++) {
+            GenomeLocation location = chunkStart + (GenomeLocation)i;
+            int value = BASE_VALUE[(unsigned char)chunk[i]];
+            if (value > 3) {
+                if (runs.size() > 0 && runs.back().start + runs.back().length == location && runs.back().base == chunk[i]) {
+                    runs.back().length++;
+                } else {
+                    AmbiguousRun run;
+                    run.start = location;
+                    run.length = 1;
+                    run.base = chunk[i];
+                    runs.push_back(run);
+                }
+                value = 0;
+            }
+            packedBases[location / 4] |= value << (2 * (location % 4));
+        }
+
+        chunkStart += (GenomeLocation)amountRead;
+    }
+    delete [] chunk;
+
+    nAmbiguousRuns = (unsigned)runs.size();
+    ambiguousRuns = new AmbiguousRun[__max(nAmbiguousRuns, 1u)];
+    for (unsigned i = 0; i < nAmbiguousRuns; i++) {
+        ambiguousRuns[i] = runs[i];
+    }
+
+    return true;
+}
+
+    void
+Genome::unpackBases(_int64 start, size_t length, char *buffer) const
+{
+    //
+    // Anything outside of the genome is padding.
+    //
+    _int64 end = start + (_int64)length;
+    _int64 packedStart = __max(start, (_int64)0);
+    _int64 packedEnd = __min(end, (_int64)nBases);
+    if (packedStart >= packedEnd) {
+        memset(buffer, 'n', length);
+        return;
+    }
+    memset(buffer, 'n', (size_t)(packedStart - start));
+    memset(buffer + (packedEnd - start), 'n', (size_t)(end - packedEnd));
+
+    char *nextBase = buffer + (packedStart - start);
+    _int64 location = packedStart;
+    while (location < packedEnd && 0 != location % 4) {
+        *nextBase++ = VALUE_BASE[(packedBases[location / 4] >> (2 * (location % 4))) & 3];
+        location++;
+    }
+    while (location + 4 <= packedEnd) {
+        memcpy(nextBase, UNPACKED_GENOME_BYTES + 4 * packedBases[location / 4], 4);
+        nextBase += 4;
+        location += 4;
+    }
+    while (location < packedEnd) {
+        *nextBase++ = VALUE_BASE[(packedBases[location / 4] >> (2 * (location % 4))) & 3];
+        location++;
+    }
+
+    //
+    // Now put back anything that wasn't ACGT, starting with the last run that begins at or before packedStart.
+    //
+    unsigned low = 0;
+    unsigned high = nAmbiguousRuns;
+    while (low < high) {
+        unsigned mid = low + (high - low) / 2;
+        if (ambiguousRuns[mid].start <= packedStart) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    for (unsigned i = low > 0 ? low - 1 : 0; i < nAmbiguousRuns && ambiguousRuns[i].start < packedEnd; i++) {
+        _int64 runStart = __max((_int64)ambiguousRuns[i].start, packedStart);
+        _int64 runEnd = __min((_int64)ambiguousRuns[i].start + ambiguousRuns[i].length, packedEnd);
+        if (runStart < runEnd) {
+            memset(buffer + (runStart - start), ambiguousRuns[i].base, (size_t)(runEnd - runStart));
+        }
+    }
+}
+
+    const Genome *
+Genome::mapFromFile(const char *fileName, unsigned chromosomePadding, bool prefetch, bool hugePages)
+{
+    _int64 fileSize = QueryFileSize(fileName);
+    char *contents;
+
+    //
+    // Ask for N_PADDING of guard on either side, so that there's room to put the 'n' padding that the constructor puts around
+    // the bases on either side of them once we know where they start.
+    //
+    MemoryMappedFile *mapped = OpenMemoryMappedFile(fileName, 0, (size_t)fileSize, (void **)&contents, false, false, prefetch, hugePages, N_PADDING);
+    if (NULL == mapped) {
+        fprintf(stderr,"Genome::mapFromFile: unable to map '%s', reading it instead\n", fileName);
+        return loadFromFile(fileName, chromosomePadding);
+    }
+
+    Genome *genome = new Genome(chromosomePadding, mapped);
+
+    //
+    // The header is the same as what loadFromFile parses: a line with the base and contig counts, and then one line per contig
+    // with its offset and name.  The bases follow immediately after.
+    //
+    const char *fileEnd = contents + fileSize;
+    const char *line = contents;
+    const char *lineEnd = (const char *)memchr(line, '\n', fileEnd - line);
+    unsigned nContigs;
+    if (NULL == lineEnd || 1 != sscanf(line, "%*s %d", &nContigs)) {
+        fprintf(stderr,"Genome::mapFromFile: unable to read header\n");
+        delete genome;
+        return NULL;
+    }
+    GenomeLocation nBases = ParseHeaderLocation(line);
+
+    genome->nContigs = genome->maxContigs = nContigs;
+    genome->contigs = new Contig[nContigs];
+    for (unsigned i = 0; i < nContigs; i++) {
+        line = lineEnd + 1;
+        lineEnd = (const char *)memchr(line, '\n', fileEnd - line);
+        const char *space = NULL == lineEnd ? NULL : (const char *)memchr(line, ' ', lineEnd - line);
+        if (NULL == space) {
+            fprintf(stderr,"Unable to read contig description\n");
+            genome->nContigs = i;
+            delete genome;
+            return NULL;
+        }
+
+        genome->contigs[i].beginningOffset = ParseHeaderLocation(line);
+        size_t contigSize = lineEnd - (space + 1);
+        genome->contigs[i].name = new char[contigSize + 1];
+        genome->contigs[i].nameLength = (unsigned)contigSize;
+        memcpy(genome->contigs[i].name, space + 1, contigSize);
+        genome->contigs[i].name[contigSize] = '\0';
+    }
+
+    genome->bases = (char *)lineEnd + 1;
+    if (genome->bases + nBases > fileEnd) {
+        fprintf(stderr,"Genome::mapFromFile: file is truncated, expected %lld bases\n", (_int64)nBases);
+        delete genome;
+        return NULL;
+    }
+
+    //
+    // The bases come straight after the header and are the end of the file, so what's on either side of them is the end of
+    // the header (which we're done with) and the guard.  Make both 'n' like the padding in a genome that's been read in.
+    //
+    if (!FillMemoryMappedRange(genome->bases - N_PADDING, N_PADDING, 'n') ||
+        !FillMemoryMappedRange(genome->bases + nBases, N_PADDING, 'n')) {
+        fprintf(stderr,"Genome::mapFromFile: unable to pad '%s', reading it instead\n", fileName);
+        delete genome;
+        return loadFromFile(fileName, chromosomePadding);
+    }
+
+    genome->nBases = genome->maxBases = genome->maxOffset = nBases;
+    genome->fillInContigLengths();
+    genome->sortContigsByName();
+    return genome;
+}
+
     bool
 contigComparator(
     const Genome::Contig& a,
@@ -284,7 +585,7 @@ Genome::sortContigsByName()
 }
 
     bool
-Genome::openFileAndGetSizes(const char *filename, GenericFile **file, unsigned *nBases, unsigned *nContigs)
+Genome::openFileAndGetSizes(const char *filename, GenericFile **file, GenomeLocation *nBases, unsigned *nContigs)
 {
 	*file = GenericFile::open(filename, GenericFile::Mode::ReadOnly);
     if (*file == NULL) {
@@ -295,22 +596,24 @@ Genome::openFileAndGetSizes(const char *filename, GenericFile **file, unsigned *
     char linebuf[2000];
 	char *retval = (*file)->gets(linebuf, sizeof(linebuf));
 
-    if (NULL == retval || 2 != sscanf(linebuf,"%d %d\n",nBases,nContigs)) {
+    if (NULL == retval || 1 != sscanf(linebuf,"%*s %d\n",nContigs)) {
 		(*file)->close();
 		delete *file;
         *file = NULL;
         fprintf(stderr,"Genome::openFileAndGetSizes: unable to read header\n");
         return false;
     }
+    *nBases = ParseHeaderLocation(linebuf);
     return true;
 }
 
 
     bool 
-Genome::getSizeFromFile(const char *fileName, unsigned *nBases, unsigned *nContigs)
+Genome::getSizeFromFile(const char *fileName, GenomeLocation *nBases, unsigned *nContigs)
 {
 	GenericFile *file;
-    unsigned localNBases, localnContigs;
+    GenomeLocation localNBases;
+    unsigned localnContigs;
     
     if (!openFileAndGetSizes(fileName,&file,nBases ? nBases : &localNBases, nContigs ? nContigs : &localnContigs)) {
         return false;
@@ -323,7 +626,7 @@ Genome::getSizeFromFile(const char *fileName, unsigned *nBases, unsigned *nConti
 
 
     bool
-Genome::getOffsetOfContig(const char *contigName, unsigned *offset, int * index) const
+Genome::getOffsetOfContig(const char *contigName, GenomeLocation *offset, int * index) const
 {
     if (contigsByName) {
         int low = 0;
@@ -363,138 +666,93 @@ Genome::getOffsetOfContig(const char *contigName, unsigned *offset, int * index)
 
 
     const Genome::Contig *
-Genome::getContigAtLocation(unsigned location) const
+Genome::getContigAtLocation(GenomeLocation location) const
 {
     _ASSERT(location < nBases);
-    int low = 0;
-    int high = nContigs - 1;
-    while (low <= high) {
-        int mid = (low + high) / 2;
-        if (contigs[mid].beginningOffset <= location &&
-                (mid == nContigs-1 || contigs[mid+1].beginningOffset > location)) {
-            return &contigs[mid];
-        } else if (contigs[mid].beginningOffset <= location) {
-            low = mid + 1;
-        } else {
-            high = mid - 1;
-        }
-    }
-    return NULL; // Should not be reached
+    int contigIndex = getContigIndexAtLocation(location);
+    return contigIndex < 0 ? NULL : &contigs[contigIndex];
 }
 
     const Genome::Contig *
-Genome::getNextContigAfterLocation(unsigned location) const
+Genome::getNextContigAfterLocation(GenomeLocation location) const
 {
     _ASSERT(location < nBases);
-    if (nContigs > 0 && location < contigs[0].beginningOffset) {
-            return &contigs[0];
-    }
-
-    int low = 0;
-    int high = nContigs - 1;
-    while (low <= high) {
-        int mid = (low + high) / 2;
-        if (contigs[mid].beginningOffset <= location &&
-                (mid == nContigs-1 || contigs[mid+1].beginningOffset > location)) {
-            if (mid >= nContigs - 1) {
-                //
-                // This location landed in the last contig, so return NULL for the next one.
-                //
-                return NULL;
-            } else {
-                return &contigs[mid+1];
-            }
-        } else if (contigs[mid].beginningOffset <= location) {
-            low = mid + 1;
-        } else {
-            high = mid - 1;
-        }
-    }
-    return NULL; // Should not be reached
+    int contigIndex = getContigIndexAtLocation(location);
+    return contigIndex + 1 < nContigs ? &contigs[contigIndex + 1] : NULL;     // NULL if location is in the last contig
 }
 
-//
-// Makes a copy of a Genome, but with only one of the sex chromosomes.
-//
-// The fate of the mitochondrion is that of the X chromosome.
-//
     Genome *
-Genome::copy(bool copyX, bool copyY, bool copyM) const
+Genome::copyContigs(int firstContig, int nContigsToCopy) const
 {
-    Genome *newCopy = new Genome(getCountOfBases(),getCountOfBases(), chromosomePadding);
+    _ASSERT(0 == minOffset && maxOffset == nBases && NULL == packedBases);
+    _ASSERT(firstContig >= 0 && nContigsToCopy > 0 && firstContig + nContigsToCopy <= nContigs);
 
-    if (NULL == newCopy) {
-        fprintf(stderr,"Genome::copy: failed to allocate space for copy.\n");
-        return NULL;
+    //
+    // Each contig has the padding in front of it, and the last one has padding after it too.  Copying from the padding in
+    // front of the first contig to the start of the one after the last (or the end) picks up all of that.
+    //
+    GenomeLocation copyStart = contigs[firstContig].beginningOffset - chromosomePadding;
+    GenomeLocation copyEnd = firstContig + nContigsToCopy < nContigs ? contigs[firstContig + nContigsToCopy].beginningOffset : nBases;
+    GenomeLocation copySize = copyEnd - copyStart;
+
+    Genome *newCopy = new Genome(copySize, copySize, chromosomePadding);
+    GenomeLocation copiedThrough = copyStart;
+    for (int i = firstContig; i < firstContig + nContigsToCopy; i++) {
+        newCopy->addData(bases + copiedThrough, contigs[i].beginningOffset - copiedThrough);
+        copiedThrough = contigs[i].beginningOffset;
+        newCopy->startContig(contigs[i].name);
     }
+    newCopy->addData(bases + copiedThrough, copyEnd - copiedThrough);
 
-    const Genome::Contig *currentContig = NULL;
-    const Genome::Contig *nextContig = getContigAtLocation(0);
-
-    unsigned offsetInReference = 0;
-    while (offsetInReference < getCountOfBases()) {
-        if (NULL != nextContig && offsetInReference >= nextContig->beginningOffset) {
-            //
-            // Start of a new contig.  See if we want to skip it.
-            //
-            currentContig = nextContig;
-            nextContig = getNextContigAfterLocation(offsetInReference + 1);
-            if ((!copyX && !strcmp(currentContig->name,"chrX")) ||
-                (!copyY && !strcmp(currentContig->name,"chrY")) ||
-                (!copyM && !strcmp(currentContig->name,"chrM"))) {
-                //
-                // Yes, skip over this contig.
-                //
-                nextContig = getNextContigAfterLocation(offsetInReference + 1);
-                if (NULL == nextContig) {
-                    //
-                    // The chromosome that we're skipping was the last one, so we're done.
-                    //
-                    break;
-                } else {
-                    offsetInReference = nextContig->beginningOffset;
-                    continue;
-                }
-            } // If skipping this chromosome
-
-            newCopy->startContig(currentContig->name);
-        } // If new contig beginning
-
-        const size_t maxCopySize = 10000;
-        char dataBuffer[maxCopySize + 1];
+    newCopy->fillInContigLengths();
+    newCopy->sortContigsByName();
+    return newCopy;
+}
 
-        unsigned amountToCopy = maxCopySize;
-        if (nextContig && nextContig->beginningOffset < offsetInReference + amountToCopy) {
-            amountToCopy = nextContig->beginningOffset - offsetInReference;
-        }
+    bool
+Genome::excludeContig(const char *contigName)
+{
+    GenomeLocation offset;
+    if (!getOffsetOfContig(contigName, &offset)) {
+        return false;
+    }
 
-        if (getCountOfBases() < offsetInReference + amountToCopy) {
-            amountToCopy = getCountOfBases() - offsetInReference;
+    if (NULL == excludedContigs) {
+        excludedContigs = new bool[nContigs];
+        for (int i = 0; i < nContigs; i++) {
+            excludedContigs[i] = false;
         }
-
-        memcpy(dataBuffer,getSubstring(offsetInReference,amountToCopy), amountToCopy);
-        dataBuffer[amountToCopy] = '\0';
-
-        newCopy->addData(dataBuffer);
-
-        offsetInReference += amountToCopy;
     }
-
-    newCopy->fillInContigLengths();
-    newCopy->sortContigsByName();
-    return newCopy;
+    excludedContigs[getContigIndexAtLocation(offset)] = true;
+    return true;
 }
 
-unsigned DistanceBetweenGenomeLocations(unsigned locationA, unsigned locationB) 
+GenomeLocation DistanceBetweenGenomeLocations(GenomeLocation locationA, GenomeLocation locationB) 
 {
-    unsigned largerGenomeOffset = __max(locationA, locationB);
-    unsigned smallerGenomeOffset = __min(locationA, locationB);
+    GenomeLocation largerGenomeOffset = __max(locationA, locationB);
+    GenomeLocation smallerGenomeOffset = __min(locationA, locationB);
 
     return largerGenomeOffset - smallerGenomeOffset;
 }
 
 void Genome::fillInContigLengths()
 {
+    //
+    // Build the contig lookup table.  It has an entry for the granule holding nBases itself, since that's a legal
+    // offset for getSubstring.
+    //
+    delete [] contigAtGranule;
+    size_t nGranules = ((size_t)nBases >> ContigLookupGranularityShift) + 1;
+    contigAtGranule = new int[nGranules];
+    int contigIndex = -1;
+    for (size_t granule = 0; granule < nGranules; granule++) {
+        GenomeLocation granuleStart = (GenomeLocation)(granule << ContigLookupGranularityShift);
+        while (contigIndex + 1 < nContigs && contigs[contigIndex + 1].beginningOffset <= granuleStart) {
+            contigIndex++;
+        }
+        contigAtGranule[granule] = contigIndex;
+    }
+
     if (nContigs == 0) return;
 
     for (int i = 0; i < nContigs - 1; i++) {
@@ -504,7 +762,7 @@ void Genome::fillInContigLengths()
     contigs[nContigs-1].length = nBases - contigs[nContigs-1].beginningOffset;
 }
 
-const Genome::Contig *Genome::getContigForRead(unsigned location, unsigned readLength, unsigned *extraBasesClippedBefore) const 
+const Genome::Contig *Genome::getContigForRead(GenomeLocation location, unsigned readLength, unsigned *extraBasesClippedBefore) const 
 {
     const Contig *contig = getContigAtLocation(location);
 
@@ -522,7 +780,7 @@ const Genome::Contig *Genome::getContigForRead(unsigned location, unsigned readL
         contig = getNextContigAfterLocation(location);
         _ASSERT(NULL != contig);
         _ASSERT(contig->beginningOffset > location && contig->beginningOffset < location + readLength);
-        *extraBasesClippedBefore = contig->beginningOffset - location;
+        *extraBasesClippedBefore = (unsigned)(contig->beginningOffset - location);
     } else {
         *extraBasesClippedBefore = 0;
     }
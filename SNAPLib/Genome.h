@@ -26,7 +26,28 @@ Revision History:
 #include "Compat.h"
 #include "GenericFile.h"
 
-const unsigned InvalidGenomeLocation = 0xffffffff;
+//
+// A location in the genome, which is a count of bases from the start of the first contig, padding included.  Everything that
+// stores or passes locations (the genome, the index's hash and overflow tables, seed lookups and the aligners' hit lists)
+// uses this type so there's one place to widen it.  It's 32 bits by default, which limits the genome to a little less than 4G
+// bases.  Building with LONG_GENOME_LOCATIONS makes it 64 bits, which doubles the size of the hash and overflow tables' values;
+// the index records which it was built with, and each kind of SNAP only loads its own (see GenomeIndex.h).
+//
+// Locations only use the low GenomeLocationBits bits, so that keys made of a location and something else (the LV cache's
+// and the sort's merge) still fit in 64.  With long locations that's 40, which is a genome of a trillion bases.
+//
+//#define LONG_GENOME_LOCATIONS
+#ifdef LONG_GENOME_LOCATIONS
+typedef _uint64 GenomeLocation;
+
+const GenomeLocation InvalidGenomeLocation = 0xffffffffffffffff;
+const unsigned GenomeLocationBits = 40;
+#else   // LONG_GENOME_LOCATIONS
+typedef unsigned GenomeLocation;
+
+const GenomeLocation InvalidGenomeLocation = 0xffffffff;
+const unsigned GenomeLocationBits = 32;
+#endif  // LONG_GENOME_LOCATIONS
 
 class Genome {
 public:
@@ -40,8 +61,8 @@ public:
         // to the bound.
         //
         Genome(
-            unsigned             i_maxBases,
-            unsigned             nBasesStored,
+            GenomeLocation       i_maxBases,
+            GenomeLocation       nBasesStored,
             unsigned             i_chromosomePadding);
 
         void startContig(
@@ -52,6 +73,18 @@ public:
 
         void addData(const char *data, size_t len);
 
+        //
+        // Add len bases without filling them in, and return where they go, so that the caller can fill them in later (the
+        // FASTA loader uses this to copy in many contigs' worth of bases at once).
+        //
+        char *addUninitializedData(size_t len);
+
+        //
+        // Add all of another (whole, not sliced) genome's bases and contigs after the ones already here, dropping its leading
+        // padding if there's already padding at the end of this one.
+        //
+        void appendGenome(const Genome *other);
+
         const unsigned getChromosomePadding() const {return chromosomePadding;}
 
         ~Genome();
@@ -64,12 +97,24 @@ public:
         //
         // minOffset and length are used to read in only a part of a whole genome.
         //
-        static const Genome *loadFromFile(const char *fileName, unsigned chromosomePadding, unsigned i_minOffset = 0, unsigned length = 0);
+        // A packed genome keeps two bits per base plus a list of the runs of anything else (mostly N), which takes about a
+        // quarter of the memory.  Its bases aren't addressable in place, so they have to be read with the version of
+        // getSubstring that unpacks into a buffer.  Only whole genomes can be packed.
+        //
+        static const Genome *loadFromFile(const char *fileName, unsigned chromosomePadding, GenomeLocation i_minOffset = 0, GenomeLocation length = 0,
+                                          bool packed = false);
                                                                   // This loads from a genome save
                                                                   // file, not a FASTA file.  Use
                                                                   // FASTA.h for FASTA loads.
 
-        static bool getSizeFromFile(const char *fileName, unsigned *nBases, unsigned *nContigs);
+        //
+        // Like loadFromFile, but memory maps the genome save file rather than reading it, so the bases are shared with any other
+        // process that has the same genome mapped.  prefetch reads the whole file in before returning, and hugePages asks
+        // for it to be backed by huge pages if the OS can.  Falls back to loadFromFile if the file can't be mapped.
+        //
+        static const Genome *mapFromFile(const char *fileName, unsigned chromosomePadding, bool prefetch, bool hugePages);
+
+        static bool getSizeFromFile(const char *fileName, GenomeLocation *nBases, unsigned *nContigs);
 
         bool saveToFile(const char *fileName) const;
 
@@ -77,89 +122,94 @@ public:
         // Methods to read the genome.
         //
         inline const char *getSubstring(size_t offset, size_t lengthNeeded) const {
+            _ASSERT(NULL == packedBases);   // Packed genomes have to use the version that unpacks into a buffer
+            return isValidSubstring(offset, lengthNeeded) ? bases + (offset - minOffset) : NULL;
+        }
+
+        //
+        // Like getSubstring, but also works for packed genomes, by unpacking the bases into unpackBuffer along with as many
+        // of the bases on either side of them as fit evenly (the aligners' reverse edit distance looks before the start).
+        // For an unpacked genome it just returns a pointer into the genome and leaves the buffer alone.
+        //
+        inline const char *getSubstring(size_t offset, size_t lengthNeeded, char *unpackBuffer, size_t unpackBufferSize) const {
+            if (NULL == packedBases) {
+                return getSubstring(offset, lengthNeeded);
+            }
+
+            if (!isValidSubstring(offset, lengthNeeded)) {
+                return NULL;
+            }
+
+            _ASSERT(lengthNeeded <= unpackBufferSize);
+            size_t contextSize = (unpackBufferSize - lengthNeeded) / 2;
+            unpackBases((_int64)offset - (_int64)contextSize, unpackBufferSize, unpackBuffer);
+            return unpackBuffer + contextSize;
+        }
+
+        inline bool isPacked() const {return NULL != packedBases;}
+
+        //
+        // The memory holding the bases (packed or not, with any padding), for moving it to other memory.
+        //
+        inline void getBasesMemory(void **address, size_t *bytes) const {
+            if (NULL != packedBases) {
+                *address = packedBases;
+                *bytes = (size_t)(nBases + 3) / 4;
+            } else {
+                *address = bases - N_PADDING;
+                *bytes = (size_t)nBases + 2 * N_PADDING;
+            }
+        }
+
+        //
+        // Whether getSubstring would give the caller these bases, which it doesn't if they run off the genome or across a
+        // contig boundary.
+        //
+        inline bool isValidSubstring(size_t offset, size_t lengthNeeded) const {
             if (offset > nBases || offset + lengthNeeded > nBases + N_PADDING) {
                 // The first part of the test is for the unsigned version of a negative offset.
-                return NULL;
+                return false;
             }
 
             if (lengthNeeded <= chromosomePadding) {
-                return bases + (offset - minOffset);
+                return true;
             }
 
             _ASSERT(offset >= minOffset && offset + lengthNeeded <= maxOffset + N_PADDING); // If the caller asks for a genome slice, it's only legal to look within it.
 
             if (lengthNeeded == 0) {
-                return bases + (offset - minOffset);
+                return true;
             }
 
             //
             // See if the substring crosses a contig (chromosome) boundary.  If so, disallow it.
             //
+            int contigIndex = getContigIndexAtLocation((GenomeLocation)offset);
+            return contigIndex + 1 >= nContigs || contigs[contigIndex + 1].beginningOffset > offset + lengthNeeded - 1;
+        }
 
-            if (nContigs > 100) {
-                //
-                // Start by special casing the last contig (it makes the rest of the code easier).
-                //
-                if (contigs[nContigs - 1].beginningOffset <= offset) {
-                    //
-                    // Because it starts in the last contig, it's OK because we already checked overflow
-                // of the whole genome.
-                //
-                return bases + (offset-minOffset);
-            }
+        inline GenomeLocation getCountOfBases() const {return nBases;}
 
-                int min = 0;
-                int max = nContigs - 2;
-                while (min <= max) {
-                    int i = (min + max) / 2;
-                    if (contigs[i].beginningOffset <= offset) {
-                        if (contigs[i+1].beginningOffset > offset) {
-                            if (contigs[i+1].beginningOffset <= offset + lengthNeeded - 1) {
-                                return NULL;    // This crosses a contig boundary.
-                            } else {
-                                return bases + (offset-minOffset);
-                            }
-                        } else {
-                            min = i+1;
-                    }
-                } else {
-                        max = i-1;
-                    }
-                }
+        bool getOffsetOfContig(const char *contigName, GenomeLocation *offset, int* index = NULL) const;
 
-                _ASSERT(false && "NOTREACHED");
-                return NULL;
-            } else {
-                //
-                // Use linear rather than binary search for small numbers of contigs, because binary search
-                // confuses the branch predictor, and so is slower even though it uses many fewer instructions.
-                //
-                for (int i = 0 ; i < nContigs; i++) {
-                    if (offset + lengthNeeded - 1 >= contigs[i].beginningOffset) {
-                        if (offset < contigs[i].beginningOffset) {
-                            return NULL;        // crosses a contig boundary.
-                        } else {
-                            return bases + (offset-minOffset);
-                        }
-                    }
+        //
+        // Launch prefetches for the cache lines holding length bases starting at genomeOffset.
+        //
+        inline void prefetchData(GenomeLocation genomeOffset, unsigned length = 128) const {
+            if (NULL != packedBases) {
+                for (unsigned i = 0; i < (length + 3) / 4; i += 64) {
+                    _mm_prefetch((const char *)packedBases + genomeOffset / 4 + i, _MM_HINT_T2);
                 }
-                _ASSERT(false && "NOTREACHED");
-                return NULL;
+                return;
+            }
+            for (unsigned i = 0; i < length; i += 64) {
+                _mm_prefetch(bases + genomeOffset + i,_MM_HINT_T2);
             }
-        }
-
-        inline unsigned getCountOfBases() const {return nBases;}
-
-        bool getOffsetOfContig(const char *contigName, unsigned *offset, int* index = NULL) const;
-
-        inline void prefetchData(unsigned genomeOffset) const {
-            _mm_prefetch(bases + genomeOffset,_MM_HINT_T2);
-            _mm_prefetch(bases + genomeOffset + 64,_MM_HINT_T2);
         }
 
         struct Contig {
-            unsigned     beginningOffset;
-            unsigned     length;
+            GenomeLocation beginningOffset;
+            GenomeLocation length;
             unsigned     nameLength;
             char        *name;
         };
@@ -168,12 +218,31 @@ public:
 
         inline int getNumContigs() const { return nContigs; }
 
-        const Contig *getContigAtLocation(unsigned location) const;
-        const Contig *getContigForRead(unsigned location, unsigned readLength, unsigned *extraBasesClippedBefore) const;
-        const Contig *getNextContigAfterLocation(unsigned location) const;
+        const Contig *getContigAtLocation(GenomeLocation location) const;
+        const Contig *getContigForRead(GenomeLocation location, unsigned readLength, unsigned *extraBasesClippedBefore) const;
+        const Contig *getNextContigAfterLocation(GenomeLocation location) const;
+
+        //
+        // Makes a genome of just the contigs in [firstContig, firstContig + nContigsToCopy), in offset order and with the
+        // same padding, as if they'd been the only ones in the FASTA file.
+        //
+        Genome *copyContigs(int firstContig, int nContigsToCopy) const;
 
-        Genome *copy() const {return copy(true,true,true);}
-        Genome *copyGenomeOneSex(bool useY, bool useM) const {return copy(!useY,useY,useM);}
+        //
+        // Masks a contig out of the genome, say chrY and chrM when indexing a female reference, without copying the rest
+        // of the genome to drop it.  Its bases and locations stay where they are, so the contig list (and so the SAM/BAM
+        // header) is the same either way; the indexer just doesn't index any seeds in it, so nothing aligns there.
+        // Returns false if there's no such contig.
+        //
+        bool excludeContig(const char *contigName);
+
+        inline bool isLocationExcluded(GenomeLocation location) const {
+            if (NULL == excludedContigs) {
+                return false;
+            }
+            int contigIndex = getContigIndexAtLocation(location);
+            return contigIndex >= 0 && excludedContigs[contigIndex];
+        }
 
         //
         // These are only public so creators of new genomes (i.e., FASTA) can use them.
@@ -188,11 +257,11 @@ private:
         //
         // The actual genome.
         char        *bases;       // Will point to offset N_PADDING in an array of nBases + 2 * N_PADDING
-        unsigned     nBases;
-        unsigned     maxBases;
+        GenomeLocation nBases;
+        GenomeLocation maxBases;
 
-        unsigned     minOffset;
-        unsigned     maxOffset;
+        GenomeLocation minOffset;
+        GenomeLocation maxOffset;
 
         //
         // A genome is made up of a bunch of contigs, typically chromosomes.  Contigs have names,
@@ -204,12 +273,58 @@ private:
         Contig      *contigs;    // This is always in order (it's not possible to express it otherwise in FASTA).
 
         Contig      *contigsByName;
-        Genome *copy(bool copyX, bool copyY, bool copyM) const;
 
-        static bool openFileAndGetSizes(const char *filename, GenericFile **file, unsigned *nBases, unsigned *nContigs);
+        //
+        // For each ContigLookupGranularity bases of the genome, the index of the contig that the first of them is in (or -1
+        // if that's before the first contig).  This gets us to the contig for any location in a step or two without
+        // searching, no matter how many contigs there are.  It's built by fillInContigLengths.
+        //
+        static const unsigned ContigLookupGranularityShift = 12;
+        static const GenomeLocation ContigLookupGranularity = 1 << ContigLookupGranularityShift;
+
+        int         *contigAtGranule;
+
+        bool        *excludedContigs;   // Indexed like contigs, or NULL if none are excluded
+
+        inline int getContigIndexAtLocation(GenomeLocation location) const {
+            _ASSERT(location <= nBases && NULL != contigAtGranule);
+            int i = contigAtGranule[location >> ContigLookupGranularityShift];
+            while (i + 1 < nContigs && contigs[i + 1].beginningOffset <= location) {
+                i++;
+            }
+            return i;
+        }
+
+        MemoryMappedFile    *mappedFile;    // Non-NULL if bases point into a mapped save file rather than memory we allocated
+
+        //
+        // For packed genomes bases is NULL, and instead packedBases has four bases per byte, low bits first, with the values
+        // from BASE_VALUE.  Anything that isn't ACGT is stored as an A, and is put back from ambiguousRuns, which is sorted.
+        //
+        struct AmbiguousRun {
+            GenomeLocation  start;
+            unsigned        length;
+            char            base;
+        };
+
+        unsigned char       *packedBases;
+        AmbiguousRun        *ambiguousRuns;
+        unsigned             nAmbiguousRuns;
+
+        //
+        // Fills in buffer with length bases starting at start, which may be before or after the genome, in which case
+        // it gets the same 'n' padding as unpacked genomes have.
+        //
+        void unpackBases(_int64 start, size_t length, char *buffer) const;
+
+        bool readPackedBases(GenericFile *loadFile);
+
+        Genome(unsigned i_chromosomePadding, MemoryMappedFile *i_mappedFile);    // For mapFromFile, doesn't allocate bases
+
+        static bool openFileAndGetSizes(const char *filename, GenericFile **file, GenomeLocation *nBases, unsigned *nContigs);
 
 
         const unsigned chromosomePadding;
 };
 
-unsigned DistanceBetweenGenomeLocations(unsigned locationA, unsigned locationB);
+GenomeLocation DistanceBetweenGenomeLocations(GenomeLocation locationA, GenomeLocation locationB);
@@ -33,7 +33,10 @@ Revision History:
 #include "Genome.h"
 #include "GenomeIndex.h"
 #include "HashTable.h"
+#include "IndexAutotune.h"
 #include "Seed.h"
+#include "SeedFilter.h"
+#include "Util.h"
 #include "exit.h"
 
 using namespace std;
@@ -48,10 +51,12 @@ static void usage()
 {
     fprintf(stderr,
             "Usage: snap index <input.fa> <output-dir> [<options>]\n"
+            "input.fa may be gzipped, in which case its name must end in .gz\n"
             "Options:\n"
-            "  -s               Seed size (default: %d)\n"
+            "  -s               Seed size (default: %d).  Seeds can be up to 32 bases, or 64 in a SNAP built with LONG_SEEDS.\n"
             "  -h               Hash table slack (default: %.1f)\n"
-            "  -hg19            Use pre-computed table bias for hg19, which results in better speed, balance, and memory footprint but may not work for other references.\n"
+            "  -bias source     Size the hash tables with the bias table saved by an earlier build of the same reference with the same seed\n"
+            "                   and key sizes, rather than computing it.  source is that build's index directory or its BiasTable file.\n"
             "  -Ofactor         Specify the size of the overflow space.  This will change the memory footprint, but may be needed for some genomes.\n"
             "                   Larger numbers use more memory but work better with more repetitive genomes.  Smaller numbers reduce the memory\n"
             "                   footprint, but may cause the index build to fail.  Making -O larger than necessary will not affect the resuting\n"
@@ -62,21 +67,89 @@ static void usage()
             "               the FASTA header line '>chr1|Chromosome 1' would generate a chromosome named 'chr1'.  There's a separate flag for\n"
             "               indicating that a space is a terminator.\n"
             " -bSpace       Indicates that the space character is a terminator for chromosome names (see -B above).  This may be used in addition\n"
-            "               to other terminators specified by -B.  -B and -bSpace are case sensitive.\n",
+            "               to other terminators specified by -B.  -B and -bSpace are case sensitive.\n"
             " -pPadding         Specify the number of Ns to put as padding between chromosomes.  This must be as large as the largest\n"
             "                   edit distance you'll ever use, and there's a performance advantage to have it be bigger than any\n"
             "                   read you'll process.  Default is %d\n"
             " -HHistogramFile   Build a histogram of seed popularity.  This is just for information, it's not used by SNAP.\n"
             " -exact            Compute hash table sizes exactly.  This will slow down index build, but may be necessary in some cases\n"
-            " -keysize          The number of bytes to use for the hash table key.  Larger values increase SNAP's memory footprint, but allow larger seeds.  Default: %d\n",
+            " -keysize          The number of bytes to use for the hash table key.  Larger values increase SNAP's memory footprint, but allow larger seeds.  Default: %d\n"
+            " -append           Add the contigs in input.fa to the existing index in output-dir rather than building a new one.  This is\n"
+            "                   much faster than a rebuild for small additions like decoys.  The index's seed size, key size and padding\n"
+            "                   are kept, and the options that only affect building the main tables are ignored.\n"
+            " -mem GB           Limit the memory used by the build to about this many gigabytes by building and writing out the hash tables\n"
+            "                   a group at a time.  Each group takes another pass over the genome, so smaller limits make the build slower.\n"
+            "                   Aligning with the resulting index gives the same results either way.  Default is no limit.\n"
+            " -bucketized       Lay the hash tables out in cache line sized buckets, so that most seed lookups take one cache miss rather\n"
+            "                   than two or more.  This makes the hash tables a little bigger, and the index can't be read by older SNAPs.\n"
+            " -quotientedKeys   Store only the part of each hash table key that its slot doesn't already give away, which makes the\n"
+            "                   hash tables a sixth to a quarter smaller at a little cost in lookup time.  Can't be used with -bucketized,\n"
+            "                   and the index can't be read by older SNAPs.\n"
+            " -compressOverflow Delta encode the long hit lists in the overflow table once the index is built (or appended to).  This\n"
+            "                   makes the overflow table smaller, at some cost in lookup time for popular seeds, and the index can't be\n"
+            "                   read by older SNAPs.\n"
+            " -minimizer w      Only index the seeds that are the minimizers of runs of w adjacent seed locations (2 <= w <= 50), and only\n"
+            "                   look those up when aligning.  Every stretch of w locations keeps at least one seed, so the index is around\n"
+            "                   2/(w+1) as large and reads take that many fewer lookups, at some cost in sensitivity for reads with many\n"
+            "                   differences from the reference.  The index can't be read by older SNAPs, and -bias must come from a build\n"
+            "                   with the same window.\n"
+            " -altLiftover file Save a table of where the ALT contigs line up with the primary assembly (see AltLiftover.h for the\n"
+            "                   format) with the index, so that seed hits on an ALT that repeat one on the primary are dropped\n"
+            "                   when aligning.  Reads from stretches that are in both then get the MAPQ of the primary alone,\n"
+            "                   rather than zero.  Works with -append too, for adding ALTs to an existing index.\n"
+            " -seedFilter       Save a Bloom filter of the index's seeds with it (about %d bits per distinct seed), which lets the aligners\n"
+            "                   rule out most seeds that aren't in the genome, such as ones with sequencing errors, without a hash table\n"
+            "                   lookup.  Works with -append too, for adding one to an existing index.\n"
+            " -shard i n        Index only the i'th of n (0 <= i < n) roughly equal runs of whole contigs, in FASTA order.  Building all\n"
+            "                   n shards into separate directories splits a reference that's too big for one machine's memory, so that\n"
+            "                   each machine can align all of the reads against its shard.  Each shard's MAPQs only know about its own\n"
+            "                   contigs, so the shards' results for a read need to be compared to pick the best.\n"
+            " -autotune len     Before building the index, try each seed size (and the smallest key size for it) on a sample of the genome,\n"
+            "                   aligning simulated reads of length len, and build with the one that aligns the most reads correctly,\n"
+            "                   or the fastest one that's about as good.  This replaces -s and -keysize, and prints what each\n"
+            "                   candidate did.\n"
+            " -exclude c1,c2... Don't index the named contigs (for example chrY,chrM for a female reference), so that nothing aligns to\n"
+            "                   them.  They're still in the genome and the SAM/BAM header, so the output is laid out the same as with\n"
+            "                   the full index, and the genome isn't copied to leave them out.\n",
             DEFAULT_SEED_SIZE,
             DEFAULT_SLACK,
             DEFAULT_PADDING,
-            DEFAULT_KEY_BYTES);
+            DEFAULT_KEY_BYTES,
+            SeedFilter::DefaultBitsPerKey);
     soft_exit(1);
 }
 
 
+//
+// Masks out each contig in the comma separated list.  A shard only has some of the contigs, so names that aren't in it are
+// fine then; otherwise they're probably typos.
+//
+    static void
+ExcludeContigs(Genome *genome, const char *contigNames, bool isShard)
+{
+    const char *nameStart = contigNames;
+    for (;;) {
+        const char *nameEnd = strchr(nameStart, ',');
+        size_t nameLength = NULL == nameEnd ? strlen(nameStart) : nameEnd - nameStart;
+        char *name = new char[nameLength + 1];
+        memcpy(name, nameStart, nameLength);
+        name[nameLength] = '\0';
+
+        if (genome->excludeContig(name)) {
+            printf("Excluding contig %s\n", name);
+        } else if (!isShard) {
+            fprintf(stderr, "-exclude: there's no contig named '%s'\n", name);
+            soft_exit(1);
+        }
+        delete [] name;
+
+        if (NULL == nameEnd) {
+            break;
+        }
+        nameStart = nameEnd + 1;
+    }
+}
+
     void
 GenomeIndex::runIndexer(
     int argc,
@@ -93,7 +166,7 @@ GenomeIndex::runIndexer(
 
     int seedLen = DEFAULT_SEED_SIZE;
     double slack = DEFAULT_SLACK;
-    bool computeBias = true;
+    const char *biasTableSource = NULL;
     _uint64 overflowTableFactor = 50;
     const char *pieceNameTerminatorCharacters = NULL;
     bool spaceIsAPieceNameTerminator = false;
@@ -101,6 +174,18 @@ GenomeIndex::runIndexer(
     unsigned chromosomePadding = DEFAULT_PADDING;
     bool forceExact = false;
     unsigned keySizeInBytes = DEFAULT_KEY_BYTES;
+    _uint64 maxMemoryInGB = 0;
+    bool appendToIndex = false;
+    bool bucketizedHashTables = false;
+    bool quotientedKeys = false;
+    bool compressOverflowTable = false;
+    unsigned minimizerWindow = 1;
+    const char *altLiftoverFileName = NULL;
+    bool buildSeedFilter = false;
+    int whichShard = 0;
+    int nShards = 1;
+    const char *excludedContigNames = NULL;
+    unsigned autotuneReadLength = 0;
 
     for (int n = 2; n < argc; n++) {
         if (strcmp(argv[n], "-s") == 0) {
@@ -119,8 +204,15 @@ GenomeIndex::runIndexer(
             }
         } else if (strcmp(argv[n], "-exact") == 0) {
             forceExact = true;
+        } else if (strcmp(argv[n], "-bias") == 0) {
+            if (n + 1 < argc) {
+                biasTableSource = argv[n+1];
+                n++;
+            } else {
+                usage();
+            }
         } else if (strcmp(argv[n], "-hg19") == 0) {
-            computeBias = false;
+            fprintf(stderr, "-hg19 is no longer supported, computing the bias table instead.  Use -bias to reuse one from an earlier build.\n");
         } else if (argv[n][0] == '-' && argv[n][1] == 'H') {
             histogramFileName = argv[n] + 2;
         } else if (argv[n][0] == '-' && argv[n][1] == 'O') {
@@ -144,10 +236,75 @@ GenomeIndex::runIndexer(
         } else if (strcmp(argv[n], "-keysize") == 0) {
             if (n + 1 < argc) {
                 keySizeInBytes = atoi(argv[n+1]);
-                if (keySizeInBytes < 4 || keySizeInBytes > 8) {
-                    fprintf(stderr, "Key size must be between 4 and 8 inclusive\n");
+                if (keySizeInBytes < 4 || keySizeInBytes > LargestKeySize) {
+                    fprintf(stderr, "Key size must be between 4 and %d inclusive\n", LargestKeySize);
+                    soft_exit(1);
+                }
+                n++;
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[n], "-append") == 0) {
+            appendToIndex = true;
+        } else if (strcmp(argv[n], "-bucketized") == 0) {
+            bucketizedHashTables = true;
+        } else if (strcmp(argv[n], "-quotientedKeys") == 0) {
+            quotientedKeys = true;
+        } else if (strcmp(argv[n], "-compressOverflow") == 0) {
+            compressOverflowTable = true;
+        } else if (strcmp(argv[n], "-seedFilter") == 0) {
+            buildSeedFilter = true;
+        } else if (strcmp(argv[n], "-minimizer") == 0) {
+            if (n + 1 < argc) {
+                minimizerWindow = atoi(argv[n+1]);
+                if (minimizerWindow < 2 || minimizerWindow > 50) {
+                    fprintf(stderr, "-minimizer window must be between 2 and 50 inclusive\n");
+                    soft_exit(1);
+                }
+                n++;
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[n], "-altLiftover") == 0) {
+            if (n + 1 < argc) {
+                altLiftoverFileName = argv[n+1];
+                n++;
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[n], "-mem") == 0) {
+            if (n + 1 < argc) {
+                maxMemoryInGB = atoi(argv[n+1]);
+                if (0 == maxMemoryInGB) {
+                    fprintf(stderr, "-mem must be followed by a positive number of gigabytes\n");
+                    soft_exit(1);
+                }
+                n++;
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[n], "-shard") == 0) {
+            if (n + 2 < argc) {
+                whichShard = atoi(argv[n+1]);
+                nShards = atoi(argv[n+2]);
+                if (nShards < 1 || whichShard < 0 || whichShard >= nShards) {
+                    fprintf(stderr, "-shard must be followed by i and n with 0 <= i < n\n");
                     soft_exit(1);
                 }
+                n += 2;
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[n], "-exclude") == 0) {
+            if (n + 1 < argc) {
+                excludedContigNames = argv[n+1];
+                n++;
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[n], "-autotune") == 0) {
+            if (n + 1 < argc) {
+                autotuneReadLength = atoi(argv[n+1]);
                 n++;
             } else {
                 usage();
@@ -162,36 +319,166 @@ GenomeIndex::runIndexer(
         }
     }
 
-    if (seedLen < 16 || seedLen > 32) {
-        // Seeds are stored in 64 bits, so they can't be larger than 32 bases for now.
-        fprintf(stderr, "Seed length must be between 16 and 32, inclusive\n");
+    if (seedLen < 16 || seedLen > (int)LargestSeedSize) {
+        //
+        // Seeds are stored in 64 bits, so they can't be larger than 32 bases unless SNAP is built with LONG_SEEDS.
+        //
+        fprintf(stderr, "Seed length must be between 16 and %d, inclusive\n", LargestSeedSize);
         soft_exit(1);
     }
 
-    if (seedLen < 19 && !computeBias) {
-        fprintf(stderr,"For hg19, you must use seed sizes between 19 and 25 (and not specifying -hg19 won't help, it'll just take longer to fail).\n");
+    if (quotientedKeys && bucketizedHashTables) {
+        fprintf(stderr, "-quotientedKeys and -bucketized can't be used together\n");
         soft_exit(1);
     }
 
+    if (appendToIndex) {
+        _int64 appendStart = timeInMillis();
+        if (!GenomeIndex::AppendToIndexDirectory(fastaFile, outputDir, pieceNameTerminatorCharacters, spaceIsAPieceNameTerminator, maxThreads)) {
+            fprintf(stderr, "Appending to the genome index failed\n");
+            soft_exit(1);
+        }
+        printf("Index append took %llds\n", (timeInMillis() + 500 - appendStart) / 1000);
+        if (compressOverflowTable && !GenomeIndex::CompressOverflowTable(outputDir)) {
+            fprintf(stderr, "Compressing the overflow table failed\n");
+            soft_exit(1);
+        }
+        if (NULL != altLiftoverFileName && !AltLiftover::saveToIndexDirectory(altLiftoverFileName, outputDir)) {
+            fprintf(stderr, "Saving the ALT liftover failed\n");
+            soft_exit(1);
+        }
+        if (buildSeedFilter && !GenomeIndex::BuildSeedFilter(outputDir, SeedFilter::DefaultBitsPerKey, maxThreads)) {
+            fprintf(stderr, "Building the seed filter failed\n");
+            soft_exit(1);
+        }
+        return;
+    }
+
     printf("Hash table slack %lf\nLoading FASTA file '%s' into memory...", slack, fastaFile);
     _int64 start = timeInMillis();
-    const Genome *genome = ReadFASTAGenome(fastaFile, pieceNameTerminatorCharacters, spaceIsAPieceNameTerminator, chromosomePadding);
+    Genome *genome = ReadFASTAGenome(fastaFile, pieceNameTerminatorCharacters, spaceIsAPieceNameTerminator, chromosomePadding, maxThreads);
     if (NULL == genome) {
         fprintf(stderr, "Unable to read FASTA file\n");
         soft_exit(1);
     }
     printf("%llds\n", (timeInMillis() + 500 - start) / 1000);
-    unsigned nBases = genome->getCountOfBases();
-    if (!GenomeIndex::BuildIndexToDirectory(genome, seedLen, slack, computeBias, outputDir, overflowTableFactor, maxThreads, chromosomePadding, forceExact, keySizeInBytes, histogramFileName)) {
+
+    if (nShards > 1) {
+        Genome *shard = CopyShard(genome, whichShard, nShards);
+        if (NULL == shard) {
+            fprintf(stderr, "Shard %d of %d has no contigs; use fewer shards\n", whichShard, nShards);
+            soft_exit(1);
+        }
+        delete genome;
+        genome = shard;
+    }
+
+    if (NULL != excludedContigNames) {
+        ExcludeContigs(genome, excludedContigNames, nShards > 1);
+    }
+
+    if (0 != autotuneReadLength) {
+        IndexAutotuner::BuildOptions buildOptions;
+        buildOptions.slack = slack;
+        buildOptions.overflowTableFactor = overflowTableFactor;
+        buildOptions.maxThreads = maxThreads;
+        buildOptions.chromosomePadding = chromosomePadding;
+        buildOptions.bucketizedHashTables = bucketizedHashTables;
+        buildOptions.quotientedKeys = quotientedKeys;
+        buildOptions.minimizerWindow = minimizerWindow;
+        if (!IndexAutotuner::Run(genome, autotuneReadLength, outputDir, buildOptions, &seedLen, &keySizeInBytes)) {
+            soft_exit(1);
+        }
+        biasTableSource = NULL;     // For the seed size it was made with, which may not be the one we've picked
+    }
+
+    GenomeLocation nBases = genome->getCountOfBases();
+    if (!GenomeIndex::BuildIndexToDirectory(genome, seedLen, slack, biasTableSource, outputDir, overflowTableFactor, maxThreads, chromosomePadding, forceExact, keySizeInBytes, maxMemoryInGB, histogramFileName, bucketizedHashTables, minimizerWindow,
+            quotientedKeys)) {
         fprintf(stderr, "Genome index build failed\n");
         soft_exit(1);
     }
     _int64 end = timeInMillis();
     printf("Index build and save took %llds (%lld bases/s)\n",
            (end - start) / 1000, (_int64) nBases / max((end - start) / 1000, (_int64) 1)); 
+
+    if (compressOverflowTable && !GenomeIndex::CompressOverflowTable(outputDir)) {
+        fprintf(stderr, "Compressing the overflow table failed\n");
+        soft_exit(1);
+    }
+
+    if (NULL != altLiftoverFileName && !AltLiftover::saveToIndexDirectory(altLiftoverFileName, outputDir)) {
+        fprintf(stderr, "Saving the ALT liftover failed\n");
+        soft_exit(1);
+    }
+
+    if (buildSeedFilter && !GenomeIndex::BuildSeedFilter(outputDir, SeedFilter::DefaultBitsPerKey, maxThreads)) {
+        fprintf(stderr, "Building the seed filter failed\n");
+        soft_exit(1);
+    }
+}
+
+    Genome *
+GenomeIndex::CopyShard(const Genome *genome, int whichShard, int nShards)
+{
+    //
+    // A contig belongs to the shard whose share of the genome it starts in, so every contig is in exactly one shard and the
+    // shards are as even as whole contigs allow.
+    //
+    const Genome::Contig *contigs = genome->getContigs();
+    int nContigs = genome->getNumContigs();
+    _uint64 nBases = genome->getCountOfBases();
+    int firstContig = -1;
+    int nContigsInShard = 0;
+    for (int i = 0; i < nContigs; i++) {
+        if ((int)((_uint64)contigs[i].beginningOffset * nShards / nBases) == whichShard) {
+            if (-1 == firstContig) {
+                firstContig = i;
+            }
+            nContigsInShard++;
+        }
+    }
+
+    if (0 == nContigsInShard) {
+        return NULL;
+    }
+
+    printf("Shard %d of %d is contigs %s through %s\n", whichShard, nShards, contigs[firstContig].name, contigs[firstContig + nContigsInShard - 1].name);
+    return genome->copyContigs(firstContig, nContigsInShard);
 }
 
 SNAPHashTable** GenomeIndex::allocateHashTables(
+    unsigned*       o_nTables,
+    size_t          capacity,
+    double          slack,
+    int             seedLen,
+    unsigned        hashTableKeySize,
+    double*         biasTable,
+    bool            bucketized)
+{
+    BigAllocUseHugePages = false;   // Huge pages just slow down allocation and don't help much for hash table build, so don't use them.
+
+    unsigned nHashTablesToBuild;
+    unsigned *hashTableSizes = computeHashTableSizes(&nHashTablesToBuild, capacity, slack, seedLen, hashTableKeySize, biasTable);
+
+    SNAPHashTable **hashTables = new SNAPHashTable*[nHashTablesToBuild];
+
+    for (unsigned i = 0; i < nHashTablesToBuild; i++) {
+        hashTables[i] = new SNAPHashTable(hashTableSizes[i], hashTableKeySize, bucketized);
+
+        if (NULL == hashTables[i]) {
+            fprintf(stderr, "IndexBuilder: unable to allocate HashTable %d of %d\n", i+1, nHashTablesToBuild);
+            soft_exit(1);
+        }
+    }
+
+    delete [] hashTableSizes;
+    *o_nTables = nHashTablesToBuild;
+    return hashTables;
+}
+
+    unsigned *
+GenomeIndex::computeHashTableSizes(
     unsigned*       o_nTables,
     size_t          capacity,
     double          slack,
@@ -201,8 +488,6 @@ SNAPHashTable** GenomeIndex::allocateHashTables(
 {
     _ASSERT(NULL != biasTable);
 
-    BigAllocUseHugePages = false;   // Huge pages just slow down allocation and don't help much for hash table build, so don't use them.
-
     if (slack <= 0) {
         fprintf(stderr, "allocateHashTables: must have positive slack for the hash table to work.  0.3 is probably OK, 0.1 is minimal, less will wreak havoc with perf.\n");
         soft_exit(1);
@@ -213,8 +498,8 @@ SNAPHashTable** GenomeIndex::allocateHashTables(
         soft_exit(1);
     }
 
-    if (hashTableKeySize < 4 || hashTableKeySize > 8) {
-        fprintf(stderr, "allocateHashTables: key size must be 4-8 inclusive\n");
+    if (hashTableKeySize < 4 || hashTableKeySize > LargestKeySize) {
+        fprintf(stderr, "allocateHashTables: key size must be 4-%d inclusive\n", LargestKeySize);
         soft_exit(1);
     }
 
@@ -244,11 +529,11 @@ SNAPHashTable** GenomeIndex::allocateHashTables(
     //
     size_t hashTableSize = (size_t) ((double)capacity * (slack + 1.0) / nHashTablesToBuild);
     
-    SNAPHashTable **hashTables = new SNAPHashTable*[nHashTablesToBuild];
-    
+    unsigned *hashTableSizes = new unsigned[nHashTablesToBuild];
+
     for (unsigned i = 0; i < nHashTablesToBuild; i++) {
         //
-        // Create the actual hash tables.  It turns out that the human genome is highly non-uniform in its
+        // Size the actual hash tables.  It turns out that the human genome is highly non-uniform in its
         // sequences of bases, so we bias the hash table sizes based on their popularity (which is emperically
         // measured), or use the estimates that we generated and passed in as "biasTable."
         //
@@ -257,21 +542,84 @@ SNAPHashTable** GenomeIndex::allocateHashTables(
         if (biasedSize < 100) {
             biasedSize = 100;
         }
-        hashTables[i] = new SNAPHashTable(biasedSize, hashTableKeySize);
-
-        if (NULL == hashTables[i]) {
-            fprintf(stderr, "IndexBuilder: unable to allocate HashTable %d of %d\n", i+1, nHashTablesToBuild);
-            soft_exit(1);
-        }
+        hashTableSizes[i] = biasedSize;
     }
 
     *o_nTables = nHashTablesToBuild;
-    return hashTables;
+    return hashTableSizes;
 }
 
+//
+// Says which genome locations a minimizer index keeps, for callers that walk through a range of them in order.  It
+// works out the minimizers a batch of locations at a time, looking far enough either side of the batch to see every
+// run of window locations that includes one of them, so that which seeds are kept doesn't depend on how the genome
+// is split among the threads.
+//
+class MinimizerSampler
+{
+public:
+    MinimizerSampler(const Genome *i_genome, unsigned i_seedLen, unsigned i_window) :
+        genome(i_genome), seedLen(i_seedLen), window(i_window), batchStart(0), batchEnd(0), lookBehind(0),
+        hashes(NULL), isMinimizer(NULL)
+    {
+        if (window > 1) {
+            hashes = new _uint64[batchSize + 2 * window];
+            isMinimizer = new bool[batchSize + 2 * window];
+        }
+    }
+
+    ~MinimizerSampler()
+    {
+        delete [] hashes;
+        delete [] isMinimizer;
+    }
+
+    //
+    // Locations have to come in ascending order.
+    //
+    bool isKept(GenomeLocation location)
+    {
+        if (window <= 1) {
+            return true;
+        }
+        if (location < batchStart || location >= batchEnd) {
+            fillBatch(location);
+        }
+        return isMinimizer[location - batchStart + lookBehind];
+    }
+
+private:
+    static const unsigned batchSize = 64 * 1024;
+
+    void fillBatch(GenomeLocation start)
+    {
+        GenomeLocation countOfBases = genome->getCountOfBases();
+        batchStart = start;
+        batchEnd = (GenomeLocation)__min((_uint64)start + batchSize, (_uint64)countOfBases);
+        lookBehind = (unsigned)__min((GenomeLocation)(window - 1), start);
+        GenomeLocation end = (GenomeLocation)__min((_uint64)batchEnd + window - 1, (_uint64)countOfBases);
+        unsigned nLocations = (unsigned)(end - (start - lookBehind));
+        for (unsigned i = 0; i < nLocations; i++) {
+            const char *bases = genome->isLocationExcluded(start - lookBehind + i) ? NULL : genome->getSubstring(start - lookBehind + i, seedLen);
+            hashes[i] = NULL != bases && Seed::DoesTextRepresentASeed(bases, seedLen) ? Seed(bases, seedLen).hash64() : Seed::NotASeedHash;
+        }
+        Seed::FindMinimizers(hashes, nLocations, window, isMinimizer);
+    }
+
+    const Genome *genome;
+    unsigned seedLen;
+    unsigned window;
+    GenomeLocation batchStart;
+    GenomeLocation batchEnd;
+    unsigned lookBehind;
+    _uint64 *hashes;
+    bool *isMinimizer;
+};
+
     bool
-GenomeIndex::BuildIndexToDirectory(const Genome *genome, int seedLen, double slack, bool computeBias, const char *directoryName, _uint64 overflowTableFactor,
-                                    unsigned maxThreads, unsigned chromosomePaddingSize, bool forceExact, unsigned hashTableKeySize, const char *histogramFileName)
+GenomeIndex::BuildIndexToDirectory(const Genome *genome, int seedLen, double slack, const char *biasTableSource, const char *directoryName, _uint64 overflowTableFactor,
+                                    unsigned maxThreads, unsigned chromosomePaddingSize, bool forceExact, unsigned hashTableKeySize, _uint64 maxMemoryInGB,
+                                    const char *histogramFileName, bool bucketizedHashTables, unsigned minimizerWindow, bool quotientedKeys)
 {
     bool buildHistogram = (histogramFileName != NULL);
     FILE *histogramFile;
@@ -292,192 +640,139 @@ GenomeIndex::BuildIndexToDirectory(const Genome *genome, int seedLen, double sla
     GenomeIndex *index = new GenomeIndex();
     index->genome = NULL;   // We always delete the index when we're done, but we delete the genome first to save space during the overflow table build.
 
-    unsigned countOfBases = genome->getCountOfBases();
-    if (countOfBases > 0xfffffff0) {
-        fprintf(stderr, "Genome is too big for SNAP.  Must be some headroom beneath 2^32 bases.\n");
+    GenomeLocation countOfBases = genome->getCountOfBases();
+    if (countOfBases > MaxHashTableValue || (_uint64)countOfBases > ((_uint64)1 << GenomeLocationBits) - 16) {
+        fprintf(stderr, "Genome is too big for SNAP.  Must be some headroom beneath 2^%d bases%s.\n", GenomeLocationBits,
+            sizeof(GenomeLocation) > 4 ? "" : " (or build SNAP with LONG_GENOME_LOCATIONS, see Genome.h)");
         return false;
     }
 
-    // Compute bias table sizes, unless we're using the precomputed ones hardcoded in BiasTables.cpp
-    double *biasTable = NULL;
-    if (computeBias) {
-        unsigned nHashTables = 1 << ((max((unsigned)seedLen, hashTableKeySize * 4) - hashTableKeySize * 4) * 2);
-        biasTable = new double[nHashTables];
-        ComputeBiasTable(genome, seedLen, biasTable, maxThreads, forceExact, hashTableKeySize);
-    } else {
-        biasTable = hg19_biasTables[hashTableKeySize][seedLen];
-        if (NULL == biasTable) {
-            fprintf(stderr, "-hg19 not available for this seed length/key size pair.\n");
+    //
+    // Compute the bias table, unless we were given one saved by an earlier build.  Either way, save it with the index
+    // so that later builds of the same reference can skip computing it.
+    //
+    unsigned nBiasTableEntries = 1 << ((max((unsigned)seedLen, hashTableKeySize * 4) - hashTableKeySize * 4) * 2);
+    double *biasTable = new double[nBiasTableEntries];
+    if (NULL != biasTableSource) {
+        if (!loadBiasTable(biasTableSource, biasTable, nBiasTableEntries, seedLen, hashTableKeySize)) {
+            delete [] biasTable;
             return false;
         }
+    } else {
+        ComputeBiasTable(genome, seedLen, biasTable, maxThreads, forceExact, hashTableKeySize, minimizerWindow);
     }
 
-    printf("Allocating memory for hash and overflow tables...");
-    _int64 start = timeInMillis();
-    unsigned nHashTables;
-    SNAPHashTable** hashTables = index->hashTables =
-        allocateHashTables(&nHashTables, countOfBases, slack, seedLen, hashTableKeySize, biasTable);
-    index->nHashTables = nHashTables;
+    if (!saveBiasTable(directoryName, biasTable, nBiasTableEntries, seedLen, hashTableKeySize)) {
+        delete [] biasTable;
+        return false;
+    }
 
     //
     // Set up the hash tables.  Each table has a key value of the lower 32 bits of the seed, and data
     // of two integers.  There is one integer each for the seed and its reverse complement (i.e., what you'd
-    // get from the complementary DNA strand, A<->T and G<->C with the string order reversed).  
+    // get from the complementary DNA strand, A<->T and G<->C with the string order reversed).
     // The first integer is always for the version of the seed with "lower" value, using an arbitrary
     // total order that we define in Seed.h.  Some seeds are their own reverse complements (e.g.,
     // AGCT), in which case only the first integer is used.
     //
+    BigAllocUseHugePages = false;   // Huge pages just slow down allocation and don't help much for hash table build, so don't use them.
 
-    //
-    // We want to use all 32 bits of the key space for the hash table (i.e., all possible combinations of 16 bases).
-    // However, the hash table needs to have some key + data value that we promise never to use so that it'll know
-    // what is a free entry.  We provide that here: -1 key and -1 in each integer.  (Well, they're unsigned, but you
-    // get the idea).
-    //
-    unsigned unusedKeyValue = InvalidGenomeLocation;
-    unsigned unusedDataValue[2];
-    unusedDataValue[0] = InvalidGenomeLocation;
-    unusedDataValue[1] = InvalidGenomeLocation;
+    unsigned nHashTables;
+    unsigned *hashTableSizes = computeHashTableSizes(&nHashTables, countOfBases, slack, seedLen, hashTableKeySize, biasTable);
+    index->nHashTables = nHashTables;
+    SNAPHashTable** hashTables = index->hashTables = new SNAPHashTable*[nHashTables];
+    for (unsigned i = 0; i < nHashTables; i++) {
+        hashTables[i] = NULL;
+    }
 
     // Don't create *too* many overflow entries because they consume significant memory.
     // It would be good to grow these dynamically instead of living with a fixed-size array.
-    unsigned nOverflowEntries = __min((unsigned)((_uint64)countOfBases * overflowTableFactor / (_uint64) 1000), 0xfffffffd - countOfBases);
-    unsigned nOverflowBackpointers = (unsigned)__min((_uint64)countOfBases, (_uint64)nOverflowEntries * (_uint64)6);
-
-  
-    OverflowEntry *overflowEntries = new OverflowEntry[nOverflowEntries];
-    if (NULL == overflowEntries) {
-        fprintf(stderr,"Unable to allocate oveflow entries.\n");
-        soft_exit(1);
-    }
-
-    OverflowBackpointer *overflowBackpointers = new OverflowBackpointer[nOverflowBackpointers];
-    if (NULL == overflowBackpointers) {
-        fprintf(stderr,"Unable to allocate overflow backpointers\n");
-        soft_exit(1);
-    }
-  
-    printf("%llds\n%d nOverflowEntries, %lld bytes, %u nOverflowBackpointers, %lld bytes\nBuilding hash tables.\n", 
-        (timeInMillis() + 500 - start) / 1000,
-        nOverflowEntries, (_int64)nOverflowEntries * sizeof(OverflowEntry), nOverflowBackpointers, (_int64) nOverflowBackpointers * sizeof(OverflowBackpointer));
-  
-    start = timeInMillis();
-    volatile unsigned nextOverflowBackpointer = 0;
-
-    volatile _int64 nonSeeds = 0;
-    volatile unsigned nextOverflowIndex = 0;
-    volatile _int64 countOfDuplicateOverflows = 0;     // Number of extra hits on duplicate indices.  This should come out once we implement the overflow table.
-    volatile _int64 bothComplementsUsed = 0;    // Number of hash buckets where both complements are used
-    volatile _int64 noBaseAvailable = 0;        // Number of places where getSubstring returned null.
-    volatile _int64 nBasesProcessed = 0;
-    volatile int runningThreadCount;
-
-    SingleWaiterObject doneObject;
-    CreateSingleWaiterObject(&doneObject);
+    //
+    // Overflow entries and backpointers are counted in unsigneds even with 64 bit locations.
+    //
+    unsigned nOverflowEntries = (unsigned)__min(__min((_uint64)countOfBases * overflowTableFactor / (_uint64) 1000, (_uint64)(InvalidGenomeLocation - 2 - countOfBases)),
+                                                (_uint64)0xfffffffd);
+    unsigned nOverflowBackpointers = (unsigned)__min(__min((_uint64)countOfBases, (_uint64)nOverflowEntries * (_uint64)6), (_uint64)0xfffffff0);
 
     unsigned nThreads = __min(GetNumberOfProcessors(), maxThreads);
-    BuildHashTablesThreadContext *threadContexts = new BuildHashTablesThreadContext[nThreads];
 
-    ExclusiveLock *hashTableLocks = new ExclusiveLock[nHashTables];
-    for (unsigned i = 0; i < nHashTables; i++) {
-        InitializeExclusiveLock(&hashTableLocks[i]);
-    }
-
-    runningThreadCount = nThreads;
+    //
+    // Each round covers basesPerThreadPerRound bases per thread, which bounds the memory used to pass seed
+    // locations from the classify phase to the insert phase at 8 bytes/base.
+    //
+    const unsigned basesPerThreadPerRound = 1024 * 1024;
 
-    unsigned nextChunkToProcess = 0;
-    for (unsigned i = 0; i < nThreads; i++) {
-        threadContexts[i].doneObject = &doneObject;
-        threadContexts[i].genome = genome;
-        threadContexts[i].genomeChunkStart = nextChunkToProcess;
-        if (i == nThreads - 1) {
-            nextChunkToProcess = countOfBases - seedLen - 1;
-        } else {
-            nextChunkToProcess += (countOfBases - seedLen) / nThreads;
+    //
+    // Split the hash tables into groups that are built and written out one at a time, so that only one group's hash tables,
+    // overflow entries and part of the overflow table are in memory at once.  Without -mem there's just one group.  The genome
+    // and the round buffers are needed throughout, so they come off the top of the budget.  Repeats can cluster in a few
+    // tables, so each group gets the whole overflow entry and backpointer budget (so any genome that fits without -mem fits
+    // with it), and those come off the top too; only the overflow table itself, which is sized by what each group actually
+    // uses, is split along with the hash tables.
+    //
+    const double hashTableBytesPerSlot = SNAPHashTable::GetBytesPerSlot(hashTableKeySize, bucketizedHashTables);
+    _uint64 totalHashTableBytes = 0;
+    for (unsigned i = 0; i < nHashTables; i++) {
+        totalHashTableBytes += (_uint64)(hashTableSizes[i] * hashTableBytesPerSlot);
+    }
+    _uint64 overflowBuilderBytes = (_uint64)nOverflowEntries * sizeof(OverflowEntry) + (_uint64)nOverflowBackpointers * sizeof(OverflowBackpointer);
+    _uint64 totalOverflowTableBytes = ((_uint64)nOverflowEntries + nOverflowBackpointers) * sizeof(GenomeLocation);
+
+    unsigned nGroups = 1;
+    if (0 != maxMemoryInGB) {
+        _uint64 fixedBytes = (_uint64)countOfBases + (_uint64)nThreads * basesPerThreadPerRound * (sizeof(unsigned) + sizeof(GenomeLocation)) +
+            overflowBuilderBytes;
+        _uint64 budget = maxMemoryInGB * 1024 * 1024 * 1024;
+        if (budget <= fixedBytes) {
+            fprintf(stderr, "-mem %lld is too small: the genome, build buffers and overflow entries alone need %lld MB\n", maxMemoryInGB, fixedBytes / (1024 * 1024));
+            return false;
+        }
+        nGroups = (unsigned)__min((_uint64)nHashTables, (totalHashTableBytes + totalOverflowTableBytes + (budget - fixedBytes) - 1) / (budget - fixedBytes));
+        if (nGroups > 1) {
+            printf("Building the index in %d passes to stay within %lld GB\n", nGroups, maxMemoryInGB);
         }
-        threadContexts[i].genomeChunkEnd = nextChunkToProcess;
-        threadContexts[i].nBasesProcessed = &nBasesProcessed;
-        threadContexts[i].index = index;
-        threadContexts[i].runningThreadCount = &runningThreadCount;
-        threadContexts[i].seedLen = seedLen;
-        threadContexts[i].noBaseAvailable = &noBaseAvailable;
-        threadContexts[i].nonSeeds = &nonSeeds;
-        threadContexts[i].nextOverflowIndex = &nextOverflowIndex;
-        threadContexts[i].countOfDuplicateOverflows = &countOfDuplicateOverflows;
-        threadContexts[i].bothComplementsUsed = &bothComplementsUsed;
-        threadContexts[i].nOverflowEntries = nOverflowEntries;
-        threadContexts[i].overflowEntries = overflowEntries;
-        threadContexts[i].overflowBackpointers = overflowBackpointers;
-        threadContexts[i].nOverflowBackpointers = nOverflowBackpointers;
-        threadContexts[i].nextOverflowBackpointer = &nextOverflowBackpointer;
-        threadContexts[i].hashTableLocks = hashTableLocks;
-        threadContexts[i].hashTableKeySize = hashTableKeySize;
-
-        StartNewThread(BuildHashTablesWorkerThreadMain, &threadContexts[i]);
-    }
-
-    WaitForSingleWaiterObject(&doneObject);
-    DestroySingleWaiterObject(&doneObject);
-
-    if ((_int64)nextOverflowIndex * 3 + (_int64)countOfDuplicateOverflows + (_int64)genome->getCountOfBases() > 0xfffffff0) {
-        fprintf(stderr,"Ran out of overflow table namespace. This genome cannot be indexed with this seed size.  Try a larger one.\n");
-        exit(1);
-    }
-
-    size_t totalUsedHashTableElements = 0;
-    for (unsigned j = 0; j < index->nHashTables; j++) {
-        totalUsedHashTableElements += hashTables[j]->GetUsedElementCount();
-//        printf("HashTable[%d] has %lld used elements, loading %lld%%\n",j,(_int64)hashTables[j]->GetUsedElementCount(),
-//                (_int64)hashTables[j]->GetUsedElementCount() * 100 / (_int64)hashTables[j]->GetTableSize());
     }
 
-    printf("%d(%lld%%) overflow entries, %d overflow backpointers, %d(%lld%%) duplicate overflows, %d(%lld%%) bad seeds, %d both complements used %d no string\n",
-        nextOverflowIndex,
-        ((_int64)nextOverflowIndex)*100 / countOfBases,
-        nextOverflowBackpointer,
-        countOfDuplicateOverflows,
-        (_int64)countOfDuplicateOverflows * 100 / countOfBases,
-        (int) nonSeeds,
-        (_int64)nonSeeds *100 / countOfBases,
-        bothComplementsUsed,
-        noBaseAvailable);
-
-    printf("Hash table build took %llds\nSaving genome...",(timeInMillis() + 500 - start) / 1000);
-    start = timeInMillis();
-
     //
-    // Save the genome to the directory and delete it to free up a little memory for the overflow table build.  We need all we can get.
+    // The overflow table and hash tables are written as each group is finished, so open them now.  The genome is needed for
+    // every pass, so save it first and get rid of it once the last pass is through with it.
     //
-    
     const unsigned filenameBufferSize = MAX_PATH+1;
     char filenameBuffer[filenameBufferSize];
-    
+
+    snprintf(filenameBuffer,filenameBufferSize,"%s%c%s",directoryName,PATH_SEP,SeedFilter::IndexFileName);
+    remove(filenameBuffer);     // A seed filter left from an earlier index in this directory wouldn't have this one's seeds
+
+    printf("Saving genome...");
+    _int64 start = timeInMillis();
     snprintf(filenameBuffer,filenameBufferSize,"%s%cGenome",directoryName,PATH_SEP);
     if (!genome->saveToFile(filenameBuffer)) {
         fprintf(stderr,"GenomeIndex::saveToDirectory: Failed to save the genome itself\n");
         return false;
     }
+    printf("%llds\n", (timeInMillis() + 500 - start) / 1000);
 
-    delete genome;
-    genome = NULL;
+    snprintf(filenameBuffer,filenameBufferSize,"%s%cOverflowTable",directoryName,PATH_SEP);
+    FILE* fOverflowTable = fopen(filenameBuffer, "wb");
+    if (fOverflowTable == NULL) {
+        fprintf(stderr,"Unable to open overflow table file, '%s', %d\n",filenameBuffer,errno);
+        return false;
+    }
 
-    printf("%llds\nBuilding overflow table.\n", (timeInMillis() + 500 - start) / 1000);
-    start = timeInMillis();
-    fflush(stdout);
+    snprintf(filenameBuffer,filenameBufferSize,"%s%cGenomeIndexHash",directoryName,PATH_SEP);
+    FILE *tablesFile = fopen(filenameBuffer, "wb");
+    if (NULL == tablesFile) {
+        fprintf(stderr, "Unable to open hash table file '%s'\n", filenameBuffer);
+        soft_exit(1);
+    }
 
     //
-    // Now build the real overflow table and simultaneously fixup the hash table entries.
-    // Its format is one unsigned of the number of genome locations matching the
-    // particular seed, followed by that many genome offsets.  The count of entries is
-    // 3 * the entries in our overflow builder table, plus the number of surplus
-    // overflows.  The 3 is one for the count, and one for each of the entries that went
-    // onto the backpointer list when the overflow entry was first created.
+    // Keep track of where each hash table goes in GenomeIndexHash and of everything's checksums, for GenomeIndexSections.
     //
-    index->overflowTableSize = nextOverflowIndex * 3 + (unsigned)countOfDuplicateOverflows;
-    index->overflowTable = (unsigned *)BigAlloc(index->overflowTableSize * sizeof(*index->overflowTable),&index->overflowTableVirtualAllocSize);
-
-    unsigned nBackpointersProcessed = 0;
-    _int64 lastPrintTime = timeInMillis();
+    IndexSection overflowSection;
+    IndexSection *hashTableSections = new IndexSection[nHashTables];
+    util::Checksum overflowChecksum;
+    vector<PopularityBreakpoint> popularity;
 
     const unsigned maxHistogramEntry = 500000;
     unsigned countOfTooBigForHistogram = 0;
@@ -492,68 +787,327 @@ GenomeIndex::BuildIndexToDirectory(const Genome *genome, int seedLen, double sla
         }
     }
 
-    unsigned overflowTableIndex = 0;
-    for (unsigned i = 0 ; i < nextOverflowIndex; i++) {
-        OverflowEntry *overflowEntry = &overflowEntries[i];
-
-        _ASSERT(overflowEntry->nInstances >= 2);
+    volatile _int64 nonSeeds = 0;
+    volatile _int64 countOfDuplicateOverflows = 0;     // Number of extra hits on duplicate indices.  This should come out once we implement the overflow table.
+    volatile _int64 bothComplementsUsed = 0;    // Number of hash buckets where both complements are used
+    volatile _int64 noBaseAvailable = 0;        // Number of places where getSubstring returned null.
+    _uint64 totalOverflowEntriesUsed = 0;
+    _uint64 totalOverflowBackpointersUsed = 0;
+    size_t totalUsedHashTableElements = 0;
+    index->overflowTableSize = 0;
 
-        if (timeInMillis() - lastPrintTime > 60 * 1000) {
-            printf("%d/%d duplicate seeds, %d/%d backpointers processed\n",i,nextOverflowIndex,nBackpointersProcessed,nextOverflowBackpointer-1);
-            lastPrintTime = timeInMillis();
-        }
+    BuildHashTablesThreadContext *threadContexts = new BuildHashTablesThreadContext[nThreads];
+    for (unsigned i = 0; i < nThreads; i++) {
+        threadContexts[i].locationOwners = new unsigned[basesPerThreadPerRound];
+        threadContexts[i].locationsByOwner = new GenomeLocation[basesPerThreadPerRound];
+        threadContexts[i].ownerOffsets = new unsigned[nThreads + 1];
+        threadContexts[i].ownerCursors = new unsigned[nThreads];
+    }
 
+    unsigned groupEndTable = 0;
+    _uint64 hashTableBytesSoFar = 0;
+    for (unsigned whichGroup = 0; whichGroup < nGroups; whichGroup++) {
         //
-        // If we're building a histogram, update it.
+        // Take tables until this group has its share of the total.
         //
-        if (buildHistogram) {
-            totalNonSingletonSeeds += overflowEntry->nInstances;
-            if (overflowEntry->nInstances > maxHistogramEntry) {
-                countOfTooBigForHistogram++;
-                sumOfTooBigForHistogram += overflowEntry->nInstances;
-            } else {
-                histogram[overflowEntry->nInstances]++;
+        unsigned groupFirstTable = groupEndTable;
+        _uint64 groupHashTableBytes = 0;
+        while (groupEndTable < nHashTables && (groupEndTable == groupFirstTable || whichGroup == nGroups - 1 ||
+               (hashTableBytesSoFar + groupHashTableBytes) * nGroups < totalHashTableBytes * (whichGroup + 1))) {
+            groupHashTableBytes += (_uint64)(hashTableSizes[groupEndTable] * hashTableBytesPerSlot);
+            groupEndTable++;
+        }
+        hashTableBytesSoFar += groupHashTableBytes;
+
+        printf("Allocating memory for hash and overflow tables...");
+        start = timeInMillis();
+        for (unsigned i = groupFirstTable; i < groupEndTable; i++) {
+            hashTables[i] = new SNAPHashTable(hashTableSizes[i], hashTableKeySize, bucketizedHashTables, quotientedKeys);
+            if (NULL == hashTables[i]) {
+                fprintf(stderr, "IndexBuilder: unable to allocate HashTable %d of %d\n", i+1, nHashTables);
+                soft_exit(1);
             }
-            largestSeed = __max(largestSeed, overflowEntry->nInstances);
         }
 
+        OverflowEntry *overflowEntries = new OverflowEntry[nOverflowEntries];
+        if (NULL == overflowEntries) {
+            fprintf(stderr,"Unable to allocate oveflow entries.\n");
+            soft_exit(1);
+        }
+
+        OverflowBackpointer *overflowBackpointers = new OverflowBackpointer[nOverflowBackpointers];
+        if (NULL == overflowBackpointers) {
+            fprintf(stderr,"Unable to allocate overflow backpointers\n");
+            soft_exit(1);
+        }
+
+        printf("%llds\n%d nOverflowEntries, %lld bytes, %u nOverflowBackpointers, %lld bytes\nBuilding hash tables.\n",
+            (timeInMillis() + 500 - start) / 1000,
+            nOverflowEntries, (_int64)nOverflowEntries * sizeof(OverflowEntry), nOverflowBackpointers, (_int64) nOverflowBackpointers * sizeof(OverflowBackpointer));
+
+        start = timeInMillis();
+        volatile unsigned nextOverflowBackpointer = 0;
+        volatile unsigned nextOverflowIndex = 0;
+        _int64 groupDuplicateOverflowsStart = countOfDuplicateOverflows;
+
+        //
+        // Tables outside this group have no owner, so the classify phase drops their seeds.
+        //
+        unsigned *hashTableOwner = AssignHashTablesToThreads(hashTables, nHashTables, groupFirstTable, groupEndTable, nThreads);
+
+        for (unsigned i = 0; i < nThreads; i++) {
+            threadContexts[i].whichThread = i;
+            threadContexts[i].nThreads = nThreads;
+            threadContexts[i].allContexts = threadContexts;
+            threadContexts[i].hashTableOwner = hashTableOwner;
+            threadContexts[i].countSkippedSeeds = (0 == whichGroup);
+            threadContexts[i].genome = genome;
+            threadContexts[i].index = index;
+            threadContexts[i].seedLen = seedLen;
+            threadContexts[i].minimizerWindow = minimizerWindow;
+            threadContexts[i].noBaseAvailable = &noBaseAvailable;
+            threadContexts[i].nonSeeds = &nonSeeds;
+            threadContexts[i].nextOverflowIndex = &nextOverflowIndex;
+            threadContexts[i].countOfDuplicateOverflows = &countOfDuplicateOverflows;
+            threadContexts[i].bothComplementsUsed = &bothComplementsUsed;
+            threadContexts[i].nOverflowEntries = nOverflowEntries;
+            threadContexts[i].overflowEntries = overflowEntries;
+            threadContexts[i].overflowBackpointers = overflowBackpointers;
+            threadContexts[i].nOverflowBackpointers = nOverflowBackpointers;
+            threadContexts[i].nextOverflowBackpointer = &nextOverflowBackpointer;
+            threadContexts[i].hashTableKeySize = hashTableKeySize;
+        }
+
+        const _int64 printPeriod = 100000000;
+        GenomeLocation lastSeedLocation = countOfBases > (unsigned)seedLen + 1 ? countOfBases - seedLen - 1 : 0;
+        for (GenomeLocation roundStart = 0; roundStart < lastSeedLocation; ) {
+            GenomeLocation roundEnd = (GenomeLocation)__min((_uint64)roundStart + (_uint64)basesPerThreadPerRound * nThreads, (_uint64)lastSeedLocation);
+            //
+            // The first (roundEnd - roundStart) % nThreads chunks get one base more than the rest, so that none is longer than
+            // the threads' basesPerThreadPerRound sized buffers.
+            //
+            GenomeLocation nextChunkToProcess = roundStart;
+            GenomeLocation chunkLength = (roundEnd - roundStart) / nThreads;
+            unsigned nLongerChunks = (unsigned)((roundEnd - roundStart) % nThreads);
+            for (unsigned i = 0; i < nThreads; i++) {
+                threadContexts[i].genomeChunkStart = nextChunkToProcess;
+                nextChunkToProcess += chunkLength + (i < nLongerChunks ? 1 : 0);
+                threadContexts[i].genomeChunkEnd = nextChunkToProcess;
+                _ASSERT(threadContexts[i].genomeChunkEnd - threadContexts[i].genomeChunkStart <= basesPerThreadPerRound);
+            }
+            _ASSERT(nextChunkToProcess == roundEnd);
+
+            RunBuildHashTablesPhase(BuildHashTablesClassifyThreadMain, threadContexts, nThreads);
+            RunBuildHashTablesPhase(BuildHashTablesInsertThreadMain, threadContexts, nThreads);
+
+            if (roundEnd / printPeriod > roundStart / printPeriod) {
+                fprintf(stderr, "Indexing %lld / %lld\n", (roundEnd / printPeriod) * printPeriod, (_int64)countOfBases);
+            }
+            roundStart = roundEnd;
+        }
+
+        delete [] hashTableOwner;
+
+        _int64 groupDuplicateOverflows = countOfDuplicateOverflows - groupDuplicateOverflowsStart;
+        _int64 overflowTableSizeAfterGroup = (_int64)index->overflowTableSize + (_int64)nextOverflowIndex * 3 + groupDuplicateOverflows;
+        if ((_uint64)overflowTableSizeAfterGroup + countOfBases > MaxHashTableValue || overflowTableSizeAfterGroup > 0xfffffff0) {
+            fprintf(stderr,"Ran out of overflow table namespace. This genome cannot be indexed with this seed size.  Try a larger one.\n");
+            exit(1);
+        }
+
+        for (unsigned j = groupFirstTable; j < groupEndTable; j++) {
+            totalUsedHashTableElements += hashTables[j]->GetUsedElementCount();
+    //        printf("HashTable[%d] has %lld used elements, loading %lld%%\n",j,(_int64)hashTables[j]->GetUsedElementCount(),
+    //                (_int64)hashTables[j]->GetUsedElementCount() * 100 / (_int64)hashTables[j]->GetTableSize());
+        }
+        totalOverflowEntriesUsed += nextOverflowIndex;
+        totalOverflowBackpointersUsed += nextOverflowBackpointer;
+
+        printf("Hash table build took %llds\n",(timeInMillis() + 500 - start) / 1000);
+
+        if (whichGroup == nGroups - 1) {
+            //
+            // Delete the genome to free up a little memory for the overflow table build.  We need all we can get.
+            //
+            delete genome;
+            genome = NULL;
+        }
+
+        printf("Building overflow table.\n");
+        start = timeInMillis();
+        fflush(stdout);
+
         //
-        // Start by patching up the hash table.
-        //
-        *overflowEntry->hashTableEntry = overflowTableIndex + countOfBases;
+        // Now build the real overflow table and simultaneously fixup the hash table entries.
+        // Its format is one unsigned of the number of genome locations matching the
+        // particular seed, followed by that many genome offsets.  The count of entries is
+        // 3 * the entries in our overflow builder table, plus the number of surplus
+        // overflows.  The 3 is one for the count, and one for each of the entries that went
+        // onto the backpointer list when the overflow entry was first created.  Each group's
+        // part of the overflow table follows the previous groups'.
+        //
+        unsigned groupOverflowTableBase = index->overflowTableSize;
+        unsigned groupOverflowTableSize = nextOverflowIndex * 3 + (unsigned)groupDuplicateOverflows;
+        size_t groupOverflowTableVirtualAllocSize;
+        GenomeLocation *groupOverflowTable = (GenomeLocation *)BigAlloc(__max(groupOverflowTableSize, 1u) * sizeof(*groupOverflowTable), &groupOverflowTableVirtualAllocSize);
 
         //
-        // Now fill in the overflow table. First, the count of instances of this seed in the genome.
+        // Lay the lists out shortest first, so that the lookups can tell how popular a seed is from where its list is, without
+        // reading it (see overflowPopularity).  Nothing uses the overflow entries' indices from here on (the hash table entries
+        // are found through hashTableEntry), so they can be put in any order.
         //
-        _ASSERT(overflowTableIndex + overflowEntry->nInstances + 1 <= index->overflowTableSize);
-        index->overflowTable[overflowTableIndex] = overflowEntry->nInstances;
-        overflowTableIndex++;
+        sort(overflowEntries, overflowEntries + nextOverflowIndex);
 
         //
-        // Followed by the actual addresses in the genome.
+        // Walk the overflow entries once to lay them out in the overflow table and split them among the threads, so that the
+        // threads can then each fill in their part of the table independently.
         //
-        nBackpointersProcessed += overflowEntry->nInstances;
-        for (unsigned j = 0; j < overflowEntry->nInstances; j++) {
-            _ASSERT(-1 != overflowEntry->backpointerIndex);
-            OverflowBackpointer *backpointer = &overflowBackpointers[overflowEntry->backpointerIndex];
-            index->overflowTable[overflowTableIndex] = backpointer->genomeOffset;
-            overflowTableIndex++;
-            
-            overflowEntry->backpointerIndex = backpointer->nextIndex;
+        FinalizeOverflowTableThreadContext *finalizeContexts = new FinalizeOverflowTableThreadContext[nThreads];
+        unsigned overflowTableIndex = 0;
+        unsigned whichThread = 0;
+        finalizeContexts[0].firstEntry = 0;
+        finalizeContexts[0].firstOverflowTableIndex = 0;
+        finalizeContexts[0].largestEntry = 0;
+        for (unsigned i = 0 ; i < nextOverflowIndex; i++) {
+            OverflowEntry *overflowEntry = &overflowEntries[i];
+
+            _ASSERT(overflowEntry->nInstances >= 2);
+
+            //
+            // If we're building a histogram, update it.
+            //
+            if (buildHistogram) {
+                totalNonSingletonSeeds += overflowEntry->nInstances;
+                if (overflowEntry->nInstances > maxHistogramEntry) {
+                    countOfTooBigForHistogram++;
+                    sumOfTooBigForHistogram += overflowEntry->nInstances;
+                } else {
+                    histogram[overflowEntry->nInstances]++;
+                }
+                largestSeed = __max(largestSeed, overflowEntry->nInstances);
+            }
+
+            if (whichThread + 1 < nThreads && (_uint64)overflowTableIndex * nThreads >= (_uint64)groupOverflowTableSize * (whichThread + 1)) {
+                finalizeContexts[whichThread].endEntry = i;
+                whichThread++;
+                finalizeContexts[whichThread].firstEntry = i;
+                finalizeContexts[whichThread].firstOverflowTableIndex = overflowTableIndex;
+                finalizeContexts[whichThread].largestEntry = 0;
+            }
+
+            if (0 == i || overflowEntry->nInstances != overflowEntries[i - 1].nInstances) {
+                PopularityBreakpoint breakpoint;
+                breakpoint.offset = groupOverflowTableBase + overflowTableIndex;
+                breakpoint.nHits = overflowEntry->nInstances;
+                popularity.push_back(breakpoint);
+            }
+
+            finalizeContexts[whichThread].largestEntry = __max(finalizeContexts[whichThread].largestEntry, overflowEntry->nInstances);
+            overflowTableIndex += overflowEntry->nInstances + 1;  // +1 for the count
+        }
+        _ASSERT(overflowTableIndex == groupOverflowTableSize);    // We used exactly what we expected to use.
+
+        finalizeContexts[whichThread].endEntry = nextOverflowIndex;
+        for (unsigned i = whichThread + 1; i < nThreads; i++) {
+            finalizeContexts[i].firstEntry = finalizeContexts[i].endEntry = nextOverflowIndex;
+            finalizeContexts[i].firstOverflowTableIndex = overflowTableIndex;
+            finalizeContexts[i].largestEntry = 0;
         }
 
+        SingleWaiterObject finalizeDoneObject;
+        CreateSingleWaiterObject(&finalizeDoneObject);
+        volatile int runningFinalizeThreadCount = nThreads;
+        for (unsigned i = 0; i < nThreads; i++) {
+            finalizeContexts[i].doneObject = &finalizeDoneObject;
+            finalizeContexts[i].runningThreadCount = &runningFinalizeThreadCount;
+            finalizeContexts[i].overflowEntries = overflowEntries;
+            finalizeContexts[i].overflowBackpointers = overflowBackpointers;
+            finalizeContexts[i].overflowTableIndexBias = countOfBases + groupOverflowTableBase;
+            finalizeContexts[i].overflowTable = groupOverflowTable;
+
+            StartNewThread(FinalizeOverflowTableWorkerThreadMain, &finalizeContexts[i]);
+        }
+
+        WaitForSingleWaiterObject(&finalizeDoneObject);
+        DestroySingleWaiterObject(&finalizeDoneObject);
+        delete [] finalizeContexts;
+
+        delete [] overflowEntries;
+        overflowEntries = NULL;
+
+        delete [] overflowBackpointers;
+        overflowBackpointers = NULL;
+
+        printf("Overflow table build took %llds\nSaving genome index...", (timeInMillis() + 500 - start)/1000);
+        start = timeInMillis();
+
         //
-        // Now sort them, because the multi thread insertion results in random order, but SNAP expects them to be in descending order.
+        // Write out this group's part of the overflow table and its hash tables, and free them.
         //
-        qsort(&index->overflowTable[overflowTableIndex - overflowEntry->nInstances], overflowEntry->nInstances, sizeof(index->overflowTable[0]), BackwardsUnsignedCompare);
+        const unsigned writeSize = 32 * 1024 * 1024;
+        for (size_t writeOffset = 0; writeOffset < groupOverflowTableSize * sizeof(*groupOverflowTable); ) {
+            unsigned amountToWrite = (unsigned)__min((size_t)writeSize,(size_t)groupOverflowTableSize * sizeof(*groupOverflowTable) - writeOffset);
+            size_t amountWritten = fwrite(((char *)groupOverflowTable) + writeOffset, 1, amountToWrite, fOverflowTable);
+            if (amountWritten < amountToWrite) {
+                fprintf(stderr,"GenomeIndex::saveToDirectory: fwrite failed, %d\n",errno);
+                fclose(fOverflowTable);
+                return false;
+            }
+            overflowChecksum.add(((char *)groupOverflowTable) + writeOffset, amountWritten);
+            writeOffset += amountWritten;
+        }
+        BigDealloc(groupOverflowTable);
+        index->overflowTableSize += groupOverflowTableSize;
+
+        for (unsigned i = groupFirstTable; i < groupEndTable; i++) {
+            hashTableSections[i].offset = _ftell64bit(tablesFile);
+            if (!hashTables[i]->saveToFile(tablesFile)) {
+                fprintf(stderr,"GenomeIndex::saveToDirectory: Failed to save hash table %d\n",i);
+                return false;
+            }
+            hashTableSections[i].bytes = _ftell64bit(tablesFile) - hashTableSections[i].offset;
+            hashTableSections[i].checksum = hashTables[i]->GetChecksum();
+            delete hashTables[i];
+            hashTables[i] = NULL;
+        }
+
+        fprintf(stderr, "%llds\n", (timeInMillis() + 500 - start) / 1000);
+    } // for each group
+
+    for (unsigned i = 0; i < nThreads; i++) {
+        delete [] threadContexts[i].locationOwners;
+        delete [] threadContexts[i].locationsByOwner;
+        delete [] threadContexts[i].ownerOffsets;
+        delete [] threadContexts[i].ownerCursors;
+    }
+    delete [] threadContexts;
+    delete [] hashTableSizes;
+
+#ifdef _MSC_VER
+    //
+    // The loader reads the overflow table in page multiples, so pad it out to one.
+    //
+    size_t overflowTableBytes = (size_t)index->overflowTableSize * sizeof(GenomeLocation);
+    for (size_t i = overflowTableBytes; i % 4096 != 0; i++) {
+        fputc(0, fOverflowTable);
     }
-    _ASSERT(overflowTableIndex == index->overflowTableSize);    // We used exactly what we expected to use.
+#endif  // _MSC_VER
 
-    delete [] overflowEntries;
-    overflowEntries = NULL;
+    fclose(fOverflowTable);
+    fOverflowTable = NULL;
+    fclose(tablesFile);
+    tablesFile = NULL;
 
-    delete [] overflowBackpointers;
-    overflowBackpointers = NULL;
+    printf("%lld(%lld%%) overflow entries, %lld overflow backpointers, %lld(%lld%%) duplicate overflows, %d(%lld%%) bad seeds, %lld both complements used %lld no string\n",
+        totalOverflowEntriesUsed,
+        (_int64)totalOverflowEntriesUsed*100 / countOfBases,
+        totalOverflowBackpointersUsed,
+        countOfDuplicateOverflows,
+        (_int64)countOfDuplicateOverflows * 100 / countOfBases,
+        (int) nonSeeds,
+        (_int64)nonSeeds *100 / countOfBases,
+        bothComplementsUsed,
+        noBaseAvailable);
 
     if (buildHistogram) {
         histogram[1] = (unsigned)(totalUsedHashTableElements - totalNonSingletonSeeds);
@@ -567,20 +1121,29 @@ GenomeIndex::BuildIndexToDirectory(const Genome *genome, int seedLen, double sla
         delete [] histogram;
     }
 
-    //
-    // Now save out the part of the index that's independent of the genome itself.
-    //
-    printf("Overflow table build took %llds\nSaving genome index...", (timeInMillis() + 500 - start)/1000);
-    start = timeInMillis();
-
     //
     // The save format is:
-    //  file 'GenomeIndex' contains in order major version, minor version, nHashTables, overflowTableSize, seedLen, chromosomePaddingSize.
+    //  file 'GenomeIndex' contains in order major version, minor version, nHashTables, overflowTableSize, seedLen, chromosomePaddingSize,
+    //  hashTableKeySize and, for minimizer indices, the minimizer window.
     //  File 'overflowTable' overflowTableSize bytes of the overflow table.
     //  Each hash table is saved in file base name 'GenomeIndexHash%d' where %d is the
     //  table number.
+    //  File 'GenomeIndexSections' has the size and checksum of the overflow table and the offset, size and checksum of each hash table.
+    //  File 'OverflowTablePopularity' has where the length of the overflow table's lists changes (see overflowPopularity).
     //  And the genome itself is already saved in the same directory in its own format.
     //
+    // The overflow table and hash tables have been written out by now, and this is last because it's the only one with
+    // totals across all of the groups.
+    //
+    overflowSection.offset = 0;
+    overflowSection.bytes = (_int64)index->overflowTableSize * sizeof(GenomeLocation);
+    overflowSection.checksum = overflowChecksum.value();
+    bool savedSections = saveSections(directoryName, overflowSection, hashTableSections, nHashTables);
+    delete [] hashTableSections;
+    if (!savedSections || !savePopularity(directoryName, popularity)) {
+        return false;
+    }
+
     snprintf(filenameBuffer,filenameBufferSize,"%s%cGenomeIndex",directoryName,PATH_SEP);
 
     FILE *indexFile = fopen(filenameBuffer,"w");
@@ -589,79 +1152,209 @@ GenomeIndex::BuildIndexToDirectory(const Genome *genome, int seedLen, double sla
         return false;
     }
 
-    fprintf(indexFile,"%d %d %d %d %d %d %d", GenomeIndexFormatMajorVersion, GenomeIndexFormatMinorVersion, index->nHashTables, index->overflowTableSize, seedLen, chromosomePaddingSize, hashTableKeySize);
+    unsigned minorVersion = (bucketizedHashTables ? GenomeIndexFormatBucketizedMinorVersion : GenomeIndexFormatMinorVersion) |
+        GenomeIndexFormatSectionsMinorVersion | GenomeIndexFormatFastRangeMinorVersion | GenomeIndexFormatLocationsMinorVersion;
+    if (minimizerWindow > 1) {
+        minorVersion |= GenomeIndexFormatMinimizerMinorVersion;
+    }
+    if (quotientedKeys) {
+        minorVersion |= GenomeIndexFormatQuotientedKeysMinorVersion;
+    }
+    fprintf(indexFile,"%d %d %d %d %d %d %d", GenomeIndexFormatMajorVersion,
+        minorVersion, index->nHashTables, index->overflowTableSize, seedLen, chromosomePaddingSize, hashTableKeySize);
+    if (minimizerWindow > 1) {
+        fprintf(indexFile, " %d", minimizerWindow);
+    }
 
     fclose(indexFile);
 
-    snprintf(filenameBuffer,filenameBufferSize,"%s%cOverflowTable",directoryName,PATH_SEP);
-    FILE* fOverflowTable = fopen(filenameBuffer, "wb");
-    if (fOverflowTable == NULL) {
-        fprintf(stderr,"Unable to open overflow table file, '%s', %d\n",filenameBuffer,errno);
+    delete index;
+    delete [] biasTable;
+
+    return true;
+}
+
+    bool
+GenomeIndex::saveBiasTable(const char *directoryName, const double *biasTable, unsigned nHashTables, int seedLen, unsigned hashTableKeySize)
+{
+    const unsigned filenameBufferSize = MAX_PATH+1;
+    char filenameBuffer[filenameBufferSize];
+    snprintf(filenameBuffer,filenameBufferSize,"%s%cBiasTable",directoryName,PATH_SEP);
+
+    FILE *biasTableFile = fopen(filenameBuffer, "w");
+    if (NULL == biasTableFile) {
+        fprintf(stderr,"Unable to open file '%s' for write.\n",filenameBuffer);
         return false;
     }
 
-    const unsigned writeSize = 32 * 1024 * 1024;
-    for (size_t writeOffset = 0; writeOffset < index->overflowTableSize * sizeof(*index->overflowTable); ) {
-        unsigned amountToWrite = (unsigned)__min((size_t)writeSize,(size_t)index->overflowTableSize * sizeof(*index->overflowTable) - writeOffset);
-#ifdef _MSC_VER
-        if (amountToWrite % 4096) {
-            amountToWrite = ((amountToWrite + 4095) / 4096) * 4096;
-            if (amountToWrite + writeOffset > index->overflowTableVirtualAllocSize) {
-                fprintf(stderr,"GenomeIndex::saveToDirectory: overflow table virtual alloc size doesn't appear to be a multiple of the page size %lld\n",
-                    (_int64) index->overflowTableVirtualAllocSize);
-            }
-        }
-#endif
-        size_t amountWritten = fwrite(((char *)index->overflowTable) + writeOffset, 1, amountToWrite, fOverflowTable);
-        if (amountWritten < amountToWrite) {
-            fprintf(stderr,"GenomeIndex::saveToDirectory: fwrite failed, %d\n",errno);
-            fclose(fOverflowTable);
+    //
+    // A header line of the seed size, key size and table count, then one bias per line.  %.17g round trips doubles exactly, so a
+    // build that loads this gets exactly the table sizes that the build that computed it did.
+    //
+    fprintf(biasTableFile, "%d %d %d\n", seedLen, hashTableKeySize, nHashTables);
+    for (unsigned i = 0; i < nHashTables; i++) {
+        fprintf(biasTableFile, "%.17g\n", biasTable[i]);
+    }
+
+    if (0 != fclose(biasTableFile)) {
+        fprintf(stderr,"Error writing bias table file '%s'\n", filenameBuffer);
+        return false;
+    }
+
+    return true;
+}
+
+    bool
+GenomeIndex::loadBiasTable(const char *source, double *biasTable, unsigned nHashTables, int seedLen, unsigned hashTableKeySize)
+{
+    //
+    // source can be either an index directory or the bias table file itself.
+    //
+    const unsigned filenameBufferSize = MAX_PATH+1;
+    char filenameBuffer[filenameBufferSize];
+    snprintf(filenameBuffer,filenameBufferSize,"%s%cBiasTable",source,PATH_SEP);
+
+    FILE *biasTableFile = fopen(filenameBuffer, "r");
+    if (NULL == biasTableFile) {
+        snprintf(filenameBuffer,filenameBufferSize,"%s",source);
+        biasTableFile = fopen(filenameBuffer, "r");
+        if (NULL == biasTableFile) {
+            fprintf(stderr,"Unable to open bias table '%s' (or '%s%cBiasTable')\n", source, source, PATH_SEP);
             return false;
         }
-        writeOffset += amountWritten;
     }
-    fclose(fOverflowTable);
-    fOverflowTable = NULL;
 
-    snprintf(filenameBuffer,filenameBufferSize,"%s%cGenomeIndexHash",directoryName,PATH_SEP);
-    FILE *tablesFile = fopen(filenameBuffer, "wb");
-    if (NULL == tablesFile) {
-        fprintf(stderr, "Unable to open hash table file '%s'\n", filenameBuffer);
-        soft_exit(1);
+    int fileSeedLen;
+    unsigned fileKeySize, fileNHashTables;
+    if (3 != fscanf(biasTableFile, "%d %u %u", &fileSeedLen, &fileKeySize, &fileNHashTables)) {
+        fprintf(stderr,"Bias table file '%s' has a corrupt header\n", filenameBuffer);
+        fclose(biasTableFile);
+        return false;
     }
 
-    for (unsigned i = 0; i < index->nHashTables; i++) {
-        if (!hashTables[i]->saveToFile(tablesFile)) {
-            fprintf(stderr,"GenomeIndex::saveToDirectory: Failed to save hash table %d\n",i);
+    if (fileSeedLen != seedLen || fileKeySize != hashTableKeySize || fileNHashTables != nHashTables) {
+        fprintf(stderr,"Bias table '%s' is for seed size %d and key size %d, but this build uses seed size %d and key size %d\n",
+            filenameBuffer, fileSeedLen, fileKeySize, seedLen, hashTableKeySize);
+        fclose(biasTableFile);
+        return false;
+    }
+
+    for (unsigned i = 0; i < nHashTables; i++) {
+        if (1 != fscanf(biasTableFile, "%lf", &biasTable[i])) {
+            fprintf(stderr,"Bias table file '%s' is truncated\n", filenameBuffer);
+            fclose(biasTableFile);
             return false;
         }
     }
 
-    fclose(tablesFile);
+    fclose(biasTableFile);
+    printf("Using bias table from '%s'\n", filenameBuffer);
+    return true;
+}
 
-    delete index;
-    if (computeBias && biasTable != NULL) {
-        delete[] biasTable;
+    void
+GenomeIndex::FinalizeOverflowTableWorkerThreadMain(void *param)
+{
+    FinalizeOverflowTableThreadContext *context = (FinalizeOverflowTableThreadContext *)param;
+
+    GenomeLocation *scratch = new GenomeLocation[__max(context->largestEntry, 1u)];
+    unsigned overflowTableIndex = context->firstOverflowTableIndex;
+
+    for (unsigned i = context->firstEntry; i < context->endEntry; i++) {
+        OverflowEntry *overflowEntry = &context->overflowEntries[i];
+
+        //
+        // Start by patching up the hash table.
+        //
+        *overflowEntry->hashTableEntry = overflowTableIndex + context->overflowTableIndexBias;
+
+        //
+        // Now fill in the overflow table. First, the count of instances of this seed in the genome.
+        //
+        context->overflowTable[overflowTableIndex] = overflowEntry->nInstances;
+        overflowTableIndex++;
+
+        //
+        // Followed by the actual addresses in the genome.
+        //
+        GenomeLocation *locations = &context->overflowTable[overflowTableIndex];
+        for (unsigned j = 0; j < overflowEntry->nInstances; j++) {
+            _ASSERT(-1 != overflowEntry->backpointerIndex);
+            OverflowBackpointer *backpointer = &context->overflowBackpointers[overflowEntry->backpointerIndex];
+            context->overflowTable[overflowTableIndex] = backpointer->genomeOffset;
+            overflowTableIndex++;
+
+            overflowEntry->backpointerIndex = backpointer->nextIndex;
+        }
+
+        //
+        // Now sort them, because the multi thread insertion results in random order, but SNAP expects them to be in descending order.
+        //
+        SortLocationsBackwards(locations, overflowEntry->nInstances, scratch);
+    }
+
+    delete [] scratch;
+
+    if (0 == InterlockedDecrementAndReturnNewValue(context->runningThreadCount)) {
+        SignalSingleWaiterObject(context->doneObject);
     }
-    
-    fprintf(stderr, "%llds\n", (timeInMillis() + 500 - start) / 1000);
-    
-    return true;
 }
 
-//
-// A comparison method for qsort that sorts unsigned ints backwards (SNAP expects them to be backwards due to 
-// a historical artifact).
-//
-int
-GenomeIndex::BackwardsUnsignedCompare(const void *first, const void *second)
+    void
+GenomeIndex::SortLocationsBackwards(GenomeLocation *values, unsigned nValues, GenomeLocation *scratch)
 {
-    if (*(const unsigned *) first > *(const unsigned *)second) {
-        return -1;
-    } else if (*(const unsigned *) first == *(const unsigned *)second) {
-        return 0;
-    } else {
-        return 1;
+    //
+    // Most repeated seeds only have a handful of instances, for which insertion sort is fastest.
+    //
+    const unsigned insertionSortLimit = 32;
+    if (nValues <= insertionSortLimit) {
+        for (unsigned i = 1; i < nValues; i++) {
+            GenomeLocation value = values[i];
+            unsigned j = i;
+            while (j > 0 && values[j - 1] < value) {
+                values[j] = values[j - 1];
+                j--;
+            }
+            values[j] = value;
+        }
+        return;
+    }
+
+    //
+    // Otherwise do an LSD radix sort, a byte at a time, bouncing between values and scratch and copying back
+    // at the end if the result landed in scratch.  Buckets are numbered from the top down to get descending order.
+    //
+    GenomeLocation *from = values;
+    GenomeLocation *to = scratch;
+    for (unsigned shift = 0; shift < sizeof(GenomeLocation) * 8; shift += 8) {
+        unsigned bucketStart[257];
+        for (unsigned i = 0; i <= 256; i++) {
+            bucketStart[i] = 0;
+        }
+
+        for (unsigned i = 0; i < nValues; i++) {
+            bucketStart[255 - ((from[i] >> shift) & 0xff) + 1]++;
+        }
+
+        if (bucketStart[255 - ((from[0] >> shift) & 0xff) + 1] == nValues) {
+            continue;   // Every value has the same byte here, so this pass wouldn't change anything.
+        }
+
+        for (unsigned i = 1; i <= 256; i++) {
+            bucketStart[i] += bucketStart[i - 1];
+        }
+
+        for (unsigned i = 0; i < nValues; i++) {
+            to[bucketStart[255 - ((from[i] >> shift) & 0xff)]++] = from[i];
+        }
+
+        GenomeLocation *temp = from;
+        from = to;
+        to = temp;
+    }
+
+    if (from != values) {
+        memcpy(values, from, nValues * sizeof(*values));
     }
 }
 
@@ -671,7 +1364,7 @@ GenomeIndex::AddOverflowBackpointer(
     OverflowBackpointer *overflowBackpointers,
     unsigned             nOverflowBackpointers,
     volatile unsigned   *nextOverflowBackpointer,
-    unsigned             genomeOffset)
+    GenomeLocation       genomeOffset)
 {
     unsigned overflowBackpointerIndex = (unsigned)InterlockedIncrementAndReturnNewValue((volatile int *)nextOverflowBackpointer) - 1;
     if (nOverflowBackpointers <= overflowBackpointerIndex) {
@@ -687,157 +1380,1626 @@ GenomeIndex::AddOverflowBackpointer(
 }
 
 
-GenomeIndex::GenomeIndex() : nHashTables(0), hashTables(NULL), overflowTable(NULL), genome(NULL)
-{
+GenomeIndex::GenomeIndex() : minimizerWindow(1), nHashTables(0), hashTables(NULL), overflowTable(NULL), compressedOverflowTable(false), mappedOverflowTable(NULL),
+    mappedHashTables(NULL), mainBaseCount(0), auxiliaryTable(NULL), auxiliaryOverflowTableSize(0), auxiliaryOverflowTable(NULL), altLiftover(NULL),
+    seedFilter(NULL), readaheadHintsLeft(0), genome(NULL)
+{
+}
+
+    const Genome *
+GenomeIndex::loadGenomeFromDirectory(const char *directoryName)
+{
+    const unsigned filenameBufferSize = MAX_PATH+1;
+    char filenameBuffer[filenameBufferSize];
+
+    //
+    // The only thing needed from GenomeIndex is the chromosome padding.
+    //
+    snprintf(filenameBuffer,filenameBufferSize,"%s%cGenomeIndex",directoryName,PATH_SEP);
+    GenericFile *indexFile = GenericFile::open(filenameBuffer, GenericFile::Mode::ReadOnly);
+    if (NULL == indexFile) {
+        fprintf(stderr,"Unable to open file '%s' for read.\n",filenameBuffer);
+        return NULL;
+    }
+
+    char indexFileBuf[1000];
+    size_t bytesRead = indexFile->read(indexFileBuf, sizeof(indexFileBuf) - 1);
+    indexFile->close();
+    delete indexFile;
+    indexFileBuf[min(bytesRead, sizeof(indexFileBuf) - 1)] = '\0';
+
+    unsigned majorVersion, minorVersion, nHashTables, overflowTableSize, seedLen, chromosomePadding;
+    if (6 != sscanf(indexFileBuf,"%d %d %d %d %d %d", &majorVersion, &minorVersion, &nHashTables, &overflowTableSize, &seedLen, &chromosomePadding) ||
+        majorVersion != GenomeIndexFormatMajorVersion) {
+        fprintf(stderr,"'%s' isn't a genome index this version of SNAP can read\n", filenameBuffer);
+        return NULL;
+    }
+
+    snprintf(filenameBuffer,filenameBufferSize,"%s%cGenome",directoryName,PATH_SEP);
+    const Genome *genome = Genome::mapFromFile(filenameBuffer, chromosomePadding, false, false);
+    if (NULL == genome) {
+        fprintf(stderr,"Unable to load the genome from '%s'\n", filenameBuffer);
+    }
+    return genome;
+}
+
+    _int64
+GenomeIndex::getLoadedSize(const char *directoryName)
+{
+    const unsigned filenameBufferSize = MAX_PATH+1;
+    char filenameBuffer[filenameBufferSize];
+
+    const char *fileNames[] = {"Genome", "GenomeIndexHash", "OverflowTable", SeedFilter::IndexFileName};
+    _int64 size = 0;
+    for (int i = 0; i < sizeof(fileNames) / sizeof(fileNames[0]); i++) {
+        snprintf(filenameBuffer,filenameBufferSize,"%s%c%s",directoryName,PATH_SEP,fileNames[i]);
+        FILE *file = fopen(filenameBuffer, "rb");
+        if (NULL != file) {     // The seed filter is optional
+            fclose(file);
+            size += QueryFileSize(filenameBuffer);
+        }
+    }
+    return size;
+}
+
+const char *IndexPlacement::PartNames[IndexPlacement::NParts] = {"hash", "overflow", "genome"};
+
+    bool
+IndexPlacement::isDefault() const
+{
+    for (int i = 0; i < NParts; i++) {
+        if (Memory != tier[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+    bool
+IndexPlacement::parse(const char *spec)
+{
+    const char *next = spec;
+    while ('\0' != *next) {
+        const char *equals = strchr(next, '=');
+        if (NULL == equals) {
+            fprintf(stderr,"Index placement '%s' should be a list of part=tier\n", spec);
+            return false;
+        }
+
+        int part;
+        for (part = 0; part < NParts; part++) {
+            if (strlen(PartNames[part]) == (size_t)(equals - next) && !strncmp(next, PartNames[part], equals - next)) {
+                break;
+            }
+        }
+        if (NParts == part) {
+            fprintf(stderr,"Unknown index part in placement '%s'; the parts are hash, overflow and genome\n", spec);
+            return false;
+        }
+
+        const char *value = equals + 1;
+        const char *end = strchr(value, ',');
+        size_t valueLength = NULL == end ? strlen(value) : end - value;
+        int nodeNumber, nConsumed;
+        if (6 == valueLength && !strncmp(value, "memory", 6)) {
+            tier[part] = Memory;
+        } else if (3 == valueLength && !strncmp(value, "map", 3)) {
+            tier[part] = Map;
+        } else if (1 == sscanf(value, "node:%d%n", &nodeNumber, &nConsumed) && (size_t)nConsumed == valueLength && nodeNumber >= 0) {
+            tier[part] = Node;
+            node[part] = nodeNumber;
+        } else {
+            fprintf(stderr,"Unknown tier in index placement '%s'; the tiers are memory, map and node:N\n", spec);
+            return false;
+        }
+
+        next = NULL == end ? value + valueLength : end + 1;
+    }
+
+    return true;
+}
+
+    void
+IndexPlacement::print(FILE *out) const
+{
+    for (int i = 0; i < NParts; i++) {
+        if (Node == tier[i]) {
+            fprintf(out, "%s%s on node %d", 0 == i ? "" : ", ", PartNames[i], node[i]);
+        } else {
+            fprintf(out, "%s%s %s", 0 == i ? "" : ", ", PartNames[i], Map == tier[i] ? "mapped" : "in memory");
+        }
+    }
+}
+
+    GenomeIndex *
+GenomeIndex::loadFromDirectory(char *directoryName, bool map, bool prefetch, bool packGenome, const IndexPlacement *placement)
+{
+    GenomeIndex *index = new GenomeIndex();
+
+    const unsigned filenameBufferSize = MAX_PATH+1;
+    char filenameBuffer[filenameBufferSize];
+    
+    snprintf(filenameBuffer,filenameBufferSize,"%s%cGenomeIndex",directoryName,PATH_SEP);
+
+	GenericFile *indexFile = GenericFile::open(filenameBuffer, GenericFile::Mode::ReadOnly);
+
+    if (NULL == indexFile) {
+        fprintf(stderr,"Unable to open file '%s' for read.\n",filenameBuffer);
+        return NULL;
+    }
+
+	char indexFileBuf[1000];
+	indexFile->read(indexFileBuf, sizeof(indexFileBuf));
+
+    unsigned seedLen;
+    unsigned majorVersion, minorVersion, chromosomePadding;
+    int nRead;
+    if (7 != (nRead = sscanf(indexFileBuf,"%d %d %d %d %d %d %d", &majorVersion, &minorVersion, &index->nHashTables, &index->overflowTableSize, &seedLen, &chromosomePadding, &index->hashTableKeySize))) {
+        if (3 == nRead || 6 == nRead) {
+            fprintf(stderr, "Indices built by versions before 0.16.28 are no longer supported.  Please rebuild your index.\n");
+        } else {
+            fprintf(stderr,"GenomeIndex::LoadFromDirectory: didn't read initial values\n");
+        }
+		indexFile->close();		
+		delete indexFile;
+        delete index;
+        return NULL;
+    }
+	indexFile->close();
+	delete indexFile;
+
+    if (majorVersion != GenomeIndexFormatMajorVersion) {
+        fprintf(stderr,"This genome index appears to be from a different version of SNAP than this, and so we can't read it.  Index version %d, SNAP index format version %d\n",
+            majorVersion, GenomeIndexFormatMajorVersion);
+        soft_exit(1);
+    }
+
+    if (minorVersion & ~GenomeIndexFormatAllMinorVersionBits) {
+        fprintf(stderr,"This genome index is from a newer version of SNAP than this, and so we can't read it.  Index version %d.%d, SNAP index format version %d.%d\n",
+            majorVersion, minorVersion, GenomeIndexFormatMajorVersion, GenomeIndexFormatAllMinorVersionBits);
+        soft_exit(1);
+    }
+
+    if ((minorVersion & GenomeIndexFormatLongLocationsMinorVersion) != GenomeIndexFormatLocationsMinorVersion) {
+        fprintf(stderr,"This genome index has %d bit genome locations, but this SNAP uses %d bit ones.  Either rebuild the index, or use a SNAP built %s LONG_GENOME_LOCATIONS (see Genome.h).\n",
+            (minorVersion & GenomeIndexFormatLongLocationsMinorVersion) ? 64 : 32, (int)sizeof(GenomeLocation) * 8,
+            (minorVersion & GenomeIndexFormatLongLocationsMinorVersion) ? "with" : "without");
+        soft_exit(1);
+    }
+    index->compressedOverflowTable = 0 != (minorVersion & GenomeIndexFormatCompressedOverflowMinorVersion);
+
+    if (minorVersion & GenomeIndexFormatMinimizerMinorVersion) {
+        unsigned fields[7];
+        if (8 != sscanf(indexFileBuf, "%d %d %d %d %d %d %d %d", &fields[0], &fields[1], &fields[2], &fields[3], &fields[4], &fields[5], &fields[6],
+                &index->minimizerWindow) || index->minimizerWindow < 2) {
+            fprintf(stderr,"GenomeIndex::LoadFromDirectory: didn't read the minimizer window\n");
+            delete index;
+            return NULL;
+        }
+    }
+
+    if (0 == seedLen) {
+        fprintf(stderr,"GenomeIndex::LoadFromDirectory: saw seed size of 0.\n");
+        delete index;
+        return NULL;
+    }
+    index->seedLen = seedLen;
+
+    if (!loadPopularity(directoryName, &index->overflowPopularity)) {
+        delete index;
+        return NULL;
+    }
+
+    if (map) {
+        if (!index->mapTables(directoryName, prefetch)) {
+            delete index;
+            return NULL;
+        }
+
+        snprintf(filenameBuffer,filenameBufferSize,"%s%cGenome",directoryName,PATH_SEP);
+        if (packGenome) {
+            index->genome = Genome::loadFromFile(filenameBuffer, chromosomePadding, 0, 0, true);
+        } else {
+            index->genome = Genome::mapFromFile(filenameBuffer, chromosomePadding, prefetch, BigAllocUseHugePages);
+        }
+        if (NULL == index->genome) {
+            fprintf(stderr,"GenomeIndex::loadFromDirectory: Failed to map the genome itself\n");
+            delete index;
+            return NULL;
+        }
+
+        if (!index->loadAuxiliaryTables(directoryName)) {
+            delete index;
+            return NULL;
+        }
+
+        return index->checkOverflowTableSize();
+    }
+
+    if (NULL != placement && placement->isDefault()) {
+        placement = NULL;
+    }
+
+    if (minorVersion & GenomeIndexFormatSectionsMinorVersion) {
+        if (!index->loadSectionsInParallel(directoryName, chromosomePadding, packGenome, placement) ||
+                (NULL != placement && !index->moveSectionsToNodes(placement)) || !index->loadAuxiliaryTables(directoryName)) {
+            delete index;
+            return NULL;
+        }
+
+        return index->checkOverflowTableSize();
+    }
+
+    if (NULL != placement) {
+        fprintf(stderr,"This index was built before its parts were saved as sections, so they can't be placed separately.  Rebuild it, or use -map.\n");
+        delete index;
+        return NULL;
+    }
+
+    if (!index->readOverflowTable(directoryName, NULL)) {
+        delete index;
+        return NULL;
+    }
+
+    index->hashTables = new SNAPHashTable*[index->nHashTables];
+
+    for (unsigned i = 0; i < index->nHashTables; i++) {
+        index->hashTables[i] = NULL; // We need to do this so the destructor doesn't crash if loading a hash table fails.
+    }
+
+    snprintf(filenameBuffer,filenameBufferSize,"%s%cGenomeIndexHash",directoryName,PATH_SEP);
+	GenericFile *tablesFile = GenericFile::open(filenameBuffer, GenericFile::Mode::ReadOnly);
+    if (NULL == tablesFile) {
+        fprintf(stderr,"Unable to open genome hash table file '%s'\n", filenameBuffer);
+        soft_exit(1);
+    }
+
+    for (unsigned i = 0; i < index->nHashTables; i++) {
+        if (NULL == (index->hashTables[i] = SNAPHashTable::loadFromFile(tablesFile))) {
+            fprintf(stderr,"GenomeIndex::loadFromDirectory: Failed to load hash table %d\n",i);
+            delete index;
+            return NULL;
+        }
+    }
+
+	tablesFile->close();
+	delete tablesFile;
+    tablesFile = NULL;
+
+    snprintf(filenameBuffer,filenameBufferSize,"%s%cGenome",directoryName,PATH_SEP);
+    if (NULL == (index->genome = Genome::loadFromFile(filenameBuffer, chromosomePadding, 0, 0, packGenome))) {
+        fprintf(stderr,"GenomeIndex::loadFromDirectory: Failed to load the genome itself\n");
+        delete index;
+        return NULL;
+    }
+
+    if (!index->loadAuxiliaryTables(directoryName)) {
+        delete index;
+        return NULL;
+    }
+
+    return index->checkOverflowTableSize();
+}
+
+    GenomeIndex *
+GenomeIndex::checkOverflowTableSize()
+{
+    if ((_uint64)mainBaseCount + overflowTableSize > MaxHashTableValue) {
+        fprintf(stderr,"\nThis index has too many overflow entries to be valid.  Some early versions of SNAP\n"
+                        "allowed building indices with too small of a seed size, and this appears to be such\n"
+                        "an index.  You can no longer build indices like this, and you also can't use them\n"
+                        "because they are corrupt and would produce incorrect results.  Please use an index\n"
+                        "built with a larger seed size.  For hg19, the seed size must be at least 19.\n"
+                        "For other reference genomes this quantity will vary.\n");
+        soft_exit(1);
+    }
+
+    return this;
+}
+
+    bool
+GenomeIndex::saveSections(const char *directoryName, const IndexSection &overflowTable, const IndexSection *hashTables, unsigned nHashTables)
+{
+    const unsigned filenameBufferSize = MAX_PATH+1;
+    char filenameBuffer[filenameBufferSize];
+    snprintf(filenameBuffer,filenameBufferSize,"%s%cGenomeIndexSections",directoryName,PATH_SEP);
+
+    FILE *sectionsFile = fopen(filenameBuffer, "w");
+    if (NULL == sectionsFile) {
+        fprintf(stderr,"Unable to open file '%s' for write.\n",filenameBuffer);
+        return false;
+    }
+
+    //
+    // One line per section of its file, offset, size in the file and checksum.
+    //
+    fprintf(sectionsFile, "OverflowTable %lld %lld %llx\n", overflowTable.offset, overflowTable.bytes, overflowTable.checksum);
+    for (unsigned i = 0; i < nHashTables; i++) {
+        fprintf(sectionsFile, "GenomeIndexHash %lld %lld %llx\n", hashTables[i].offset, hashTables[i].bytes, hashTables[i].checksum);
+    }
+
+    if (0 != fclose(sectionsFile)) {
+        fprintf(stderr,"Error writing index sections file '%s'\n", filenameBuffer);
+        return false;
+    }
+
+    return true;
+}
+
+    bool
+GenomeIndex::loadSections(const char *directoryName, IndexSection *overflowTable, IndexSection *hashTables, unsigned nHashTables)
+{
+    const unsigned filenameBufferSize = MAX_PATH+1;
+    char filenameBuffer[filenameBufferSize];
+    snprintf(filenameBuffer,filenameBufferSize,"%s%cGenomeIndexSections",directoryName,PATH_SEP);
+
+    GenericFile *sectionsFile = GenericFile::open(filenameBuffer, GenericFile::Mode::ReadOnly);
+    if (NULL == sectionsFile) {
+        fprintf(stderr,"Unable to open file '%s' for read.\n",filenameBuffer);
+        return false;
+    }
+
+    char line[200];
+    char name[100];
+    bool worked = true;
+    for (unsigned i = 0; worked && i <= nHashTables; i++) {
+        IndexSection *section = 0 == i ? overflowTable : &hashTables[i - 1];
+        worked = NULL != sectionsFile->gets(line, sizeof(line)) &&
+            4 == sscanf(line, "%99s %lld %lld %llx", name, &section->offset, &section->bytes, &section->checksum) &&
+            0 == strcmp(name, 0 == i ? "OverflowTable" : "GenomeIndexHash") && section->offset >= 0 && section->bytes >= 0;
+    }
+
+    sectionsFile->close();
+    delete sectionsFile;
+    if (!worked) {
+        fprintf(stderr,"'%s' is truncated or corrupt.  Please rebuild the index.\n", filenameBuffer);
+    }
+    return worked;
+}
+
+    bool
+GenomeIndex::savePopularity(const char *directoryName, const vector<PopularityBreakpoint> &popularity)
+{
+    const unsigned filenameBufferSize = MAX_PATH+1;
+    char filenameBuffer[filenameBufferSize];
+    snprintf(filenameBuffer,filenameBufferSize,"%s%cOverflowTablePopularity",directoryName,PATH_SEP);
+
+    FILE *popularityFile = fopen(filenameBuffer, "w");
+    if (NULL == popularityFile) {
+        fprintf(stderr,"Unable to open file '%s' for write.\n",filenameBuffer);
+        return false;
+    }
+
+    //
+    // The number of breakpoints, and then one line for each with its offset and the length of the lists from there.
+    //
+    fprintf(popularityFile, "%lld\n", (_int64)popularity.size());
+    for (size_t i = 0; i < popularity.size(); i++) {
+        fprintf(popularityFile, "%llu %u\n", (_uint64)popularity[i].offset, popularity[i].nHits);
+    }
+
+    if (0 != fclose(popularityFile)) {
+        fprintf(stderr,"Error writing overflow table popularity file '%s'\n", filenameBuffer);
+        return false;
+    }
+
+    return true;
+}
+
+    bool
+GenomeIndex::loadPopularity(const char *directoryName, vector<PopularityBreakpoint> *popularity)
+{
+    const unsigned filenameBufferSize = MAX_PATH+1;
+    char filenameBuffer[filenameBufferSize];
+    snprintf(filenameBuffer,filenameBufferSize,"%s%cOverflowTablePopularity",directoryName,PATH_SEP);
+
+    popularity->clear();
+    GenericFile *popularityFile = GenericFile::open(filenameBuffer, GenericFile::Mode::ReadOnly);
+    if (NULL == popularityFile) {
+        //
+        // An index from before there was one.  It just doesn't skip any lists.
+        //
+        return true;
+    }
+
+    char line[200];
+    _int64 nBreakpoints;
+    bool worked = NULL != popularityFile->gets(line, sizeof(line)) && 1 == sscanf(line, "%lld", &nBreakpoints) && nBreakpoints >= 0;
+    for (_int64 i = 0; worked && i < nBreakpoints; i++) {
+        PopularityBreakpoint breakpoint;
+        _uint64 offset;
+        worked = NULL != popularityFile->gets(line, sizeof(line)) && 2 == sscanf(line, "%llu %u", &offset, &breakpoint.nHits) &&
+            (0 == i || offset > (*popularity)[i - 1].offset);
+        breakpoint.offset = (GenomeLocation)offset;
+        popularity->push_back(breakpoint);
+    }
+
+    popularityFile->close();
+    delete popularityFile;
+    if (!worked) {
+        fprintf(stderr,"'%s' is truncated or corrupt.  Please rebuild the index.\n", filenameBuffer);
+        popularity->clear();
+    }
+    return worked;
+}
+
+    void
+GenomeIndex::findPopularRanges(DecodedHitBuffer *decodedHits) const
+{
+    //
+    // In each run of breakpoints with increasing lengths, the lists from the first one that's longer than maxHitsPerList
+    // to the end of the run are popular.
+    //
+    decodedHits->popularRanges.clear();
+    size_t nBreakpoints = overflowPopularity.size();
+    for (size_t runBegin = 0; runBegin < nBreakpoints; ) {
+        size_t runEnd = runBegin + 1;
+        while (runEnd < nBreakpoints && overflowPopularity[runEnd].nHits >= overflowPopularity[runEnd - 1].nHits) {
+            runEnd++;
+        }
+
+        for (size_t i = runBegin; i < runEnd; i++) {
+            if (overflowPopularity[i].nHits > decodedHits->maxHitsPerList) {
+                DecodedHitBuffer::PopularRange range;
+                range.begin = overflowPopularity[i].offset;
+                range.end = runEnd < nBreakpoints ? overflowPopularity[runEnd].offset : overflowTableSize;
+                range.minHits = overflowPopularity[i].nHits;
+                decodedHits->popularRanges.push_back(range);
+                break;
+            }
+        }
+        runBegin = runEnd;
+    }
+    decodedHits->popularRangesIndex = this;
+}
+
+    bool
+GenomeIndex::readOverflowTable(const char *directoryName, const IndexSection *section)
+{
+    const unsigned filenameBufferSize = MAX_PATH+1;
+    char filenameBuffer[filenameBufferSize];
+
+    overflowTable = (GenomeLocation *)BigAlloc(overflowTableSize * sizeof(*overflowTable),&overflowTableVirtualAllocSize);
+
+    snprintf(filenameBuffer,filenameBufferSize,"%s%cOverflowTable",directoryName,PATH_SEP);
+    GenericFile *fOverflowTable = GenericFile::open(filenameBuffer, GenericFile::Mode::ReadOnly);
+
+    if (NULL == fOverflowTable) {
+        fprintf(stderr,"Unable to open overflow table file, '%s', %d\n",filenameBuffer,errno);
+        return false;
+    }
+
+    const unsigned readSize = 256 * 1024 * 1024;
+    for (size_t readOffset = 0; readOffset < overflowTableSize * sizeof(*overflowTable); ) {
+        int amountToRead = (unsigned)__min((size_t)readSize,(size_t)overflowTableSize * sizeof(*overflowTable) - readOffset);
+#ifdef _MSC_VER
+        if (amountToRead % 4096) {
+            amountToRead = ((amountToRead + 4095) / 4096) * 4096;
+            if (amountToRead + readOffset > overflowTableVirtualAllocSize) {
+                fprintf(stderr,"GenomeIndex::loadFromDirectory: overflow table virtual alloc size doesn't appear to be a multiple of the page size %lld\n",
+                    (_int64) overflowTableVirtualAllocSize);
+            }
+        }
+#endif
+        int amountRead = (int)fOverflowTable->readInParallel(((char*) overflowTable) + readOffset, amountToRead);
+        if (amountRead < amountToRead) {
+            fprintf(stderr,"GenomeIndex::loadFromDirectory: read failed (amountToRead = %d, amountRead = %d, readOffset %lld), %d\n",amountToRead, amountRead, readOffset, errno);
+			fOverflowTable->close();
+			delete fOverflowTable;
+            return false;
+        }
+        readOffset += amountRead;
+    }
+
+	fOverflowTable->close();
+	delete fOverflowTable;
+
+    if (NULL != section) {
+        util::Checksum checksum;
+        checksum.add(overflowTable, overflowTableSize * sizeof(*overflowTable));
+        if (section->bytes != (_int64)overflowTableSize * (_int64)sizeof(*overflowTable) || checksum.value() != section->checksum) {
+            fprintf(stderr,"The overflow table in '%s' is corrupt (its size or checksum is wrong).  Please rebuild the index.\n", filenameBuffer);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+    bool
+GenomeIndex::readHashTable(const char *directoryName, unsigned whichTable, const IndexSection *section)
+{
+    const unsigned filenameBufferSize = MAX_PATH+1;
+    char filenameBuffer[filenameBufferSize];
+    snprintf(filenameBuffer,filenameBufferSize,"%s%cGenomeIndexHash",directoryName,PATH_SEP);
+
+    //
+    // Each table gets its own handle on the file, so that they can be read at the same time.
+    //
+    GenericFile *tablesFile = GenericFile::open(filenameBuffer, GenericFile::Mode::ReadOnly);
+    if (NULL == tablesFile) {
+        fprintf(stderr,"Unable to open genome hash table file '%s'\n", filenameBuffer);
+        return false;
+    }
+
+    if (0 != tablesFile->seek(section->offset)) {
+        fprintf(stderr,"GenomeIndex::loadFromDirectory: unable to seek to hash table %d in '%s'\n", whichTable, filenameBuffer);
+        tablesFile->close();
+        delete tablesFile;
+        return false;
+    }
+
+    hashTables[whichTable] = SNAPHashTable::loadFromFile(tablesFile);
+    tablesFile->close();
+    delete tablesFile;
+
+    if (NULL == hashTables[whichTable]) {
+        fprintf(stderr,"GenomeIndex::loadFromDirectory: Failed to load hash table %d\n", whichTable);
+        return false;
+    }
+
+    if (hashTables[whichTable]->GetChecksum() != section->checksum) {
+        fprintf(stderr,"Hash table %d in '%s' is corrupt (its checksum is wrong).  Please rebuild the index.\n", whichTable, filenameBuffer);
+        return false;
+    }
+
+    return true;
+}
+
+    bool
+GenomeIndex::loadSectionsInParallel(const char *directoryName, unsigned chromosomePadding, bool packGenome, const IndexPlacement *placement)
+{
+    IndexSection overflowSection;
+    IndexSection *hashTableSections = new IndexSection[nHashTables];
+    if (!loadSections(directoryName, &overflowSection, hashTableSections, nHashTables)) {
+        delete [] hashTableSections;
+        return false;
+    }
+
+    hashTables = new SNAPHashTable*[nHashTables];
+    for (unsigned i = 0; i < nHashTables; i++) {
+        hashTables[i] = NULL; // We need to do this so the destructor doesn't crash if loading a hash table fails.
+    }
+
+    //
+    // Mapping is quick, so the parts that are mapped are done here, and the threads only read the rest.  Mapped parts
+    // aren't read, so they aren't checked against their checksums either.
+    //
+    if (NULL != placement) {
+        bool worked = true;
+        if (IndexPlacement::Map == placement->tier[IndexPlacement::OverflowTable]) {
+            worked = mapOverflowTable(directoryName, false);
+        }
+        if (worked && IndexPlacement::Map == placement->tier[IndexPlacement::HashTables]) {
+            worked = mapHashTables(directoryName, false);
+        }
+        if (worked && IndexPlacement::Map == placement->tier[IndexPlacement::GenomePart]) {
+            const unsigned filenameBufferSize = MAX_PATH+1;
+            char filenameBuffer[filenameBufferSize];
+            snprintf(filenameBuffer,filenameBufferSize,"%s%cGenome",directoryName,PATH_SEP);
+            if (packGenome) {
+                genome = Genome::loadFromFile(filenameBuffer, chromosomePadding, 0, 0, true);
+            } else {
+                genome = Genome::mapFromFile(filenameBuffer, chromosomePadding, false, BigAllocUseHugePages);
+            }
+            worked = NULL != genome;
+            if (!worked) {
+                fprintf(stderr,"GenomeIndex::loadFromDirectory: Failed to map the genome itself\n");
+            }
+        }
+        if (!worked) {
+            delete [] hashTableSections;
+            return false;
+        }
+    }
+
+    LoadSectionsContext context;
+    context.index = this;
+    context.directoryName = directoryName;
+    context.overflowSection = &overflowSection;
+    context.hashTableSections = hashTableSections;
+    context.chromosomePadding = chromosomePadding;
+    context.packGenome = packGenome;
+    context.placement = placement;
+    context.nSections = 2 + nHashTables;
+    context.nextSection = 0;
+    context.nFailed = 0;
+    CreateSingleWaiterObject(&context.doneObject);
+
+    unsigned nThreads = __min((unsigned)context.nSections, MaxSectionLoadThreads);
+    context.runningThreadCount = nThreads;
+    for (unsigned i = 0; i < nThreads; i++) {
+        if (!StartNewThread(LoadSectionsThreadMain, &context)) {
+            fprintf(stderr,"GenomeIndex::loadFromDirectory: unable to start thread\n");
+            soft_exit(1);
+        }
+    }
+
+    WaitForSingleWaiterObject(&context.doneObject);
+    DestroySingleWaiterObject(&context.doneObject);
+    delete [] hashTableSections;
+
+    return 0 == context.nFailed;
+}
+
+    void
+GenomeIndex::LoadSectionsThreadMain(void *param)
+{
+    LoadSectionsContext *context = (LoadSectionsContext *)param;
+    GenomeIndex *index = context->index;
+
+    //
+    // The genome goes first because it's the biggest single piece, and then the others fill in around it.
+    //
+    int section;
+    while ((section = InterlockedIncrementAndReturnNewValue(&context->nextSection) - 1) < context->nSections) {
+        IndexPlacement::Part part = 0 == section ? IndexPlacement::GenomePart : 1 == section ? IndexPlacement::OverflowTable : IndexPlacement::HashTables;
+        if (NULL != context->placement && IndexPlacement::Map == context->placement->tier[part]) {
+            continue;
+        }
+
+        bool worked;
+        if (0 == section) {
+            const unsigned filenameBufferSize = MAX_PATH+1;
+            char filenameBuffer[filenameBufferSize];
+            snprintf(filenameBuffer,filenameBufferSize,"%s%cGenome",context->directoryName,PATH_SEP);
+            index->genome = Genome::loadFromFile(filenameBuffer, context->chromosomePadding, 0, 0, context->packGenome);
+            worked = NULL != index->genome;
+            if (!worked) {
+                fprintf(stderr,"GenomeIndex::loadFromDirectory: Failed to load the genome itself\n");
+            }
+        } else if (1 == section) {
+            worked = index->readOverflowTable(context->directoryName, context->overflowSection);
+        } else {
+            worked = index->readHashTable(context->directoryName, section - 2, &context->hashTableSections[section - 2]);
+        }
+
+        if (!worked) {
+            InterlockedIncrementAndReturnNewValue(&context->nFailed);
+        }
+    }
+
+    if (0 == InterlockedDecrementAndReturnNewValue(&context->runningThreadCount)) {
+        SignalSingleWaiterObject(&context->doneObject);
+    }
+}
+
+    bool
+GenomeIndex::moveSectionsToNodes(const IndexPlacement *placement)
+{
+    bool worked = true;
+    if (IndexPlacement::Node == placement->tier[IndexPlacement::HashTables]) {
+        for (unsigned i = 0; i < nHashTables && worked; i++) {
+            worked = MoveMemoryToNumaNode(hashTables[i]->GetTableMemory(), hashTables[i]->GetTableBytes(), placement->node[IndexPlacement::HashTables]);
+        }
+    }
+    if (worked && IndexPlacement::Node == placement->tier[IndexPlacement::OverflowTable]) {
+        worked = MoveMemoryToNumaNode(overflowTable, (size_t)overflowTableSize * sizeof(*overflowTable), placement->node[IndexPlacement::OverflowTable]);
+    }
+    if (worked && IndexPlacement::Node == placement->tier[IndexPlacement::GenomePart]) {
+        void *bases;
+        size_t bytes;
+        genome->getBasesMemory(&bases, &bytes);
+        worked = MoveMemoryToNumaNode(bases, bytes, placement->node[IndexPlacement::GenomePart]);
+    }
+
+    if (!worked) {
+        fprintf(stderr,"GenomeIndex::loadFromDirectory: unable to move the index to the NUMA nodes it was placed on\n");
+    }
+    return worked;
+}
+
+struct AuxiliarySeedLocation {
+    SeedBases       seedBases;          // The canonical (not bigger than its reverse complement) version of the seed
+    GenomeLocation  genomeLocation;
+    bool            usingComplement;
+
+    bool operator<(const AuxiliarySeedLocation &other) const {
+        return seedBases < other.seedBases || (seedBases == other.seedBases && genomeLocation < other.genomeLocation);
+    }
+};
+
+    bool
+GenomeIndex::AppendToIndexDirectory(const char *fastaFile, const char *directoryName, const char *pieceNameTerminatorCharacters,
+                                    bool spaceIsAPieceNameTerminator, unsigned maxThreads)
+{
+    //
+    // Map rather than read the existing index, since we only look up the seeds that occur in the new contigs.
+    //
+    printf("Loading existing index from '%s'...", directoryName);
+    _int64 start = timeInMillis();
+    GenomeIndex *index = loadFromDirectory((char *)directoryName, true, false);
+    if (NULL == index) {
+        fprintf(stderr, "Unable to load the index to append to\n");
+        return false;
+    }
+    const Genome *oldGenome = index->genome;
+    unsigned seedLen = index->seedLen;
+    printf("%llds\nLoading FASTA file '%s'...", (timeInMillis() + 500 - start) / 1000, fastaFile);
+
+    const Genome *newContigs = ReadFASTAGenome(fastaFile, pieceNameTerminatorCharacters, spaceIsAPieceNameTerminator, oldGenome->getChromosomePadding(), maxThreads);
+    if (NULL == newContigs) {
+        fprintf(stderr, "Unable to read FASTA file\n");
+        delete index;
+        return false;
+    }
+
+    _uint64 totalBases = (_uint64)oldGenome->getCountOfBases() + newContigs->getCountOfBases();
+    if (totalBases > MaxHashTableValue || totalBases > ((_uint64)1 << GenomeLocationBits) - 16) {
+        fprintf(stderr, "Genome is too big for SNAP.  Must be some headroom beneath 2^%d bases.\n", GenomeLocationBits);
+        delete newContigs;
+        delete index;
+        return false;
+    }
+
+    Genome *genome = new Genome((GenomeLocation)totalBases, (GenomeLocation)totalBases, oldGenome->getChromosomePadding());
+    genome->appendGenome(oldGenome);
+    genome->appendGenome(newContigs);
+    genome->fillInContigLengths();
+    genome->sortContigsByName();
+    delete newContigs;
+    printf("%llds\nIndexing %lld appended bases.\n", (timeInMillis() + 500 - start) / 1000, totalBases - index->mainBaseCount);
+    start = timeInMillis();
+
+    //
+    // Collect every seed that's past the part of the genome the main tables cover (which includes anything appended before),
+    // and sort them so that all of the locations of a seed are together.
+    //
+    vector<AuxiliarySeedLocation> seedLocations;
+    GenomeLocation nBases = genome->getCountOfBases();
+    MinimizerSampler sampler(genome, seedLen, index->minimizerWindow);
+    for (GenomeLocation genomeLocation = index->mainBaseCount; genomeLocation + seedLen < nBases; genomeLocation++) {
+        const char *bases = genome->getSubstring(genomeLocation, seedLen);
+        if (NULL == bases || !Seed::DoesTextRepresentASeed(bases, seedLen) || !sampler.isKept(genomeLocation)) {
+            continue;
+        }
+
+        Seed seed(bases, seedLen);
+        AuxiliarySeedLocation seedLocation;
+        seedLocation.usingComplement = seed.isBiggerThanItsReverseComplement();
+        if (seedLocation.usingComplement) {
+            seed = ~seed;
+        }
+        seedLocation.seedBases = seed.getBases();
+        seedLocation.genomeLocation = genomeLocation;
+        seedLocations.push_back(seedLocation);
+    }
+    sort(seedLocations.begin(), seedLocations.end());
+
+    size_t nDistinctSeeds = 0;
+    for (size_t i = 0; i < seedLocations.size(); i++) {
+        if (0 == i || seedLocations[i].seedBases != seedLocations[i-1].seedBases) {
+            nDistinctSeeds++;
+        }
+    }
+
+    //
+    // Each distinct seed gets an entry with its complete hit list for each direction: the new locations plus whatever the main
+    // tables have for it.  The new locations are all bigger than the old ones, so putting them first keeps the list descending.
+    // References into the auxiliary overflow table start at the size of the whole genome.  The auxiliary table's keys are
+    // whole seeds, so they take 8 bytes unless the seeds are longer than 32 bases.
+    //
+    const double auxiliarySlack = 0.3;
+    unsigned auxiliaryKeySize = __max(8u, (2 * seedLen + 7) / 8);
+    SNAPHashTable *auxiliaryTable = new SNAPHashTable((unsigned)(nDistinctSeeds * (1.0 + auxiliarySlack)) + 100, auxiliaryKeySize, index->hashTables[0]->IsBucketized(),
+        index->hasQuotientedKeys());
+    vector<GenomeLocation> auxiliaryOverflowTable;
+    vector<GenomeLocation> hitList;
+    DecodedHitBuffer decodedHits;
+
+    for (size_t first = 0; first < seedLocations.size(); ) {
+        size_t end = first;
+        while (end < seedLocations.size() && seedLocations[end].seedBases == seedLocations[first].seedBases) {
+            end++;
+        }
+
+        Seed seed(seedLocations[first].seedBases, 0);
+        SeedBases lowBases = seed.getLowBases(index->hashTableKeySize);
+        GenomeLocation *mainEntry = index->hashTables[seed.getHighBases(index->hashTableKeySize)]->Lookup(lowBases);
+
+        GenomeLocation newEntry[2];
+        for (int direction = 0; direction < 2; direction++) {
+            hitList.clear();
+            for (size_t i = end; i > first; i--) {  // Backwards, since seedLocations within a seed are in ascending location order
+                if (seedLocations[i-1].usingComplement == (direction == 1)) {
+                    hitList.push_back(seedLocations[i-1].genomeLocation);
+                }
+            }
+
+            if (NULL != mainEntry) {
+                unsigned nMainHits;
+                const GenomeLocation *mainHits;
+                decodedHits.reset();
+                index->fillInLookedUpResults(mainEntry + direction, index->mainBaseCount, index->overflowTable, index->overflowTableSize, 0, InvalidGenomeLocation,
+                    &nMainHits, &mainHits, &decodedHits);
+                for (unsigned i = 0; i < nMainHits; i++) {
+                    hitList.push_back(mainHits[i]);
+                }
+            }
+
+            if (hitList.size() == 0) {
+                newEntry[direction] = UnusedHashTableValue;
+            } else if (hitList.size() == 1) {
+                newEntry[direction] = hitList[0];
+            } else {
+                newEntry[direction] = nBases + (GenomeLocation)auxiliaryOverflowTable.size();
+                auxiliaryOverflowTable.push_back((GenomeLocation)hitList.size());
+                auxiliaryOverflowTable.insert(auxiliaryOverflowTable.end(), hitList.begin(), hitList.end());
+            }
+        }
+
+        if (!auxiliaryTable->Insert(seedLocations[first].seedBases, newEntry)) {
+            fprintf(stderr, "GenomeIndex::AppendToIndexDirectory: auxiliary hash table is full\n");
+            soft_exit(1);
+        }
+
+        first = end;
+    }
+
+    if ((_uint64)nBases + auxiliaryOverflowTable.size() > MaxHashTableValue || auxiliaryOverflowTable.size() > 0xfffffff0) {
+        fprintf(stderr, "Ran out of overflow table namespace appending to the index.  The index needs to be rebuilt.\n");
+        return false;
+    }
+
+    printf("%lld distinct seeds, %lld auxiliary overflow entries, %llds\nSaving...", (_int64)nDistinctSeeds, (_int64)auxiliaryOverflowTable.size(),
+        (timeInMillis() + 500 - start) / 1000);
+    start = timeInMillis();
+
+    //
+    // Write the new genome next to the old one, because the old one is still mapped.  The auxiliary index file goes last, since
+    // it's what tells the loader to look for the others, and any old one comes out first so a failure part way through
+    // doesn't leave it describing the new files.
+    //
+    const unsigned filenameBufferSize = MAX_PATH+1;
+    char filenameBuffer[filenameBufferSize];
+    char genomeFilenameBuffer[filenameBufferSize];
+
+    snprintf(filenameBuffer,filenameBufferSize,"%s%cAuxiliaryIndex",directoryName,PATH_SEP);
+    remove(filenameBuffer);
+
+    snprintf(filenameBuffer,filenameBufferSize,"%s%cGenome.new",directoryName,PATH_SEP);
+    if (!genome->saveToFile(filenameBuffer)) {
+        fprintf(stderr,"GenomeIndex::AppendToIndexDirectory: Failed to save the genome\n");
+        return false;
+    }
+
+    snprintf(filenameBuffer,filenameBufferSize,"%s%cAuxiliaryIndexHash",directoryName,PATH_SEP);
+    if (!auxiliaryTable->saveToFile(filenameBuffer)) {
+        fprintf(stderr,"GenomeIndex::AppendToIndexDirectory: Failed to save the auxiliary hash table\n");
+        return false;
+    }
+
+    snprintf(filenameBuffer,filenameBufferSize,"%s%cAuxiliaryOverflowTable",directoryName,PATH_SEP);
+    FILE *overflowFile = fopen(filenameBuffer, "wb");
+    if (NULL == overflowFile ||
+        (auxiliaryOverflowTable.size() > 0 &&
+         auxiliaryOverflowTable.size() != fwrite(&auxiliaryOverflowTable[0], sizeof(GenomeLocation), auxiliaryOverflowTable.size(), overflowFile))) {
+        fprintf(stderr,"GenomeIndex::AppendToIndexDirectory: Failed to write '%s'\n", filenameBuffer);
+        return false;
+    }
+    fclose(overflowFile);
+
+    GenomeLocation mainBaseCount = index->mainBaseCount;
+    delete index;   // Unmaps the old genome so we can replace it
+    index = NULL;
+    delete auxiliaryTable;
+    delete genome;
+
+    snprintf(filenameBuffer,filenameBufferSize,"%s%cGenome.new",directoryName,PATH_SEP);
+    snprintf(genomeFilenameBuffer,filenameBufferSize,"%s%cGenome",directoryName,PATH_SEP);
+    remove(genomeFilenameBuffer);
+    if (0 != rename(filenameBuffer, genomeFilenameBuffer)) {
+        fprintf(stderr,"GenomeIndex::AppendToIndexDirectory: unable to rename '%s' to '%s', %d\n", filenameBuffer, genomeFilenameBuffer, errno);
+        return false;
+    }
+
+    snprintf(filenameBuffer,filenameBufferSize,"%s%cAuxiliaryIndex",directoryName,PATH_SEP);
+    FILE *auxiliaryIndexFile = fopen(filenameBuffer, "w");
+    if (NULL == auxiliaryIndexFile) {
+        fprintf(stderr,"Unable to open file '%s' for write.\n",filenameBuffer);
+        return false;
+    }
+    fprintf(auxiliaryIndexFile, "%llu %u", (_uint64)mainBaseCount, (unsigned)auxiliaryOverflowTable.size());
+    fclose(auxiliaryIndexFile);
+
+    printf("%llds\n", (timeInMillis() + 500 - start) / 1000);
+    return true;
+}
+
+    bool
+GenomeIndex::CompressOverflowTable(const char *directoryName)
+{
+    printf("Compressing the overflow table in '%s'...", directoryName);
+    _int64 start = timeInMillis();
+    GenomeIndex *index = loadFromDirectory((char *)directoryName, false, false);
+    if (NULL == index) {
+        fprintf(stderr, "Unable to load the index to compress\n");
+        return false;
+    }
+
+    if (index->compressedOverflowTable) {
+        printf("it's already compressed.\n");
+        delete index;
+        return true;
+    }
+
+    //
+    // Find every hit list that the hash tables refer to, and re-encode them in the order they're in now.
+    //
+    vector<unsigned> oldOffsets;
+    for (unsigned i = 0; i < index->nHashTables; i++) {
+        SNAPHashTable *table = index->hashTables[i];
+        for (size_t slot = 0; slot < table->GetTableSize(); slot++) {
+            GenomeLocation *values = table->GetValuesOfSlot(slot);
+            for (unsigned whichValue = 0; NULL != values && whichValue < 2; whichValue++) {
+                if (values[whichValue] >= index->mainBaseCount && values[whichValue] != UnusedHashTableValue) {
+                    oldOffsets.push_back((unsigned)(values[whichValue] - index->mainBaseCount));
+                }
+            }
+        }
+    }
+    sort(oldOffsets.begin(), oldOffsets.end());
+    oldOffsets.erase(unique(oldOffsets.begin(), oldOffsets.end()), oldOffsets.end());
+
+    vector<GenomeLocation> newOverflowTable;
+    vector<unsigned> newOffsets;
+    for (size_t i = 0; i < oldOffsets.size(); i++) {
+        const GenomeLocation *list = index->overflowTable + oldOffsets[i];
+        newOffsets.push_back((unsigned)newOverflowTable.size());
+        encodeHitList(list + 1, (unsigned)list[0], &newOverflowTable);
+    }
+
+    for (unsigned i = 0; i < index->nHashTables; i++) {
+        SNAPHashTable *table = index->hashTables[i];
+        for (size_t slot = 0; slot < table->GetTableSize(); slot++) {
+            GenomeLocation *values = table->GetValuesOfSlot(slot);
+            for (unsigned whichValue = 0; NULL != values && whichValue < 2; whichValue++) {
+                if (values[whichValue] >= index->mainBaseCount && values[whichValue] != UnusedHashTableValue) {
+                    size_t which = lower_bound(oldOffsets.begin(), oldOffsets.end(), values[whichValue] - index->mainBaseCount) - oldOffsets.begin();
+                    values[whichValue] = index->mainBaseCount + newOffsets[which];
+                }
+            }
+        }
+    }
+
+    //
+    // The lists are in the same order, so the popularity breakpoints just move to where their lists went.  They're all at
+    // the start of a list.
+    //
+    for (size_t i = 0; i < index->overflowPopularity.size(); i++) {
+        size_t which = lower_bound(oldOffsets.begin(), oldOffsets.end(), index->overflowPopularity[i].offset) - oldOffsets.begin();
+        index->overflowPopularity[i].offset = which < newOffsets.size() ? newOffsets[which] : (GenomeLocation)newOverflowTable.size();
+    }
+
+    printf("%lld entries down to %lld, %llds\nSaving...", (_int64)index->overflowTableSize, (_int64)newOverflowTable.size(),
+        (timeInMillis() + 500 - start) / 1000);
+    start = timeInMillis();
+
+    //
+    // The index was read rather than mapped, so we can write over its files.  They only make sense together, so if this
+    // fails part way through the index has to be rebuilt.
+    //
+    const unsigned filenameBufferSize = MAX_PATH+1;
+    char filenameBuffer[filenameBufferSize];
+
+    snprintf(filenameBuffer,filenameBufferSize,"%s%cOverflowTable",directoryName,PATH_SEP);
+    FILE *overflowFile = fopen(filenameBuffer, "wb");
+    if (NULL == overflowFile ||
+        (newOverflowTable.size() > 0 &&
+         newOverflowTable.size() != fwrite(&newOverflowTable[0], sizeof(GenomeLocation), newOverflowTable.size(), overflowFile))) {
+        fprintf(stderr,"GenomeIndex::CompressOverflowTable: Failed to write '%s'\n", filenameBuffer);
+        return false;
+    }
+    fclose(overflowFile);
+
+    snprintf(filenameBuffer,filenameBufferSize,"%s%cGenomeIndexHash",directoryName,PATH_SEP);
+    FILE *tablesFile = fopen(filenameBuffer, "wb");
+    if (NULL == tablesFile) {
+        fprintf(stderr, "Unable to open hash table file '%s'\n", filenameBuffer);
+        return false;
+    }
+
+    IndexSection *hashTableSections = new IndexSection[index->nHashTables];
+    for (unsigned i = 0; i < index->nHashTables; i++) {
+        hashTableSections[i].offset = _ftell64bit(tablesFile);
+        if (!index->hashTables[i]->saveToFile(tablesFile)) {
+            fprintf(stderr,"GenomeIndex::CompressOverflowTable: Failed to save hash table %d\n",i);
+            fclose(tablesFile);
+            delete [] hashTableSections;
+            return false;
+        }
+        hashTableSections[i].bytes = _ftell64bit(tablesFile) - hashTableSections[i].offset;
+        hashTableSections[i].checksum = index->hashTables[i]->GetChecksum();
+    }
+    fclose(tablesFile);
+
+    IndexSection overflowSection;
+    util::Checksum overflowChecksum;
+    if (newOverflowTable.size() > 0) {
+        overflowChecksum.add(&newOverflowTable[0], newOverflowTable.size() * sizeof(GenomeLocation));
+    }
+    overflowSection.offset = 0;
+    overflowSection.bytes = (_int64)newOverflowTable.size() * sizeof(GenomeLocation);
+    overflowSection.checksum = overflowChecksum.value();
+    bool savedSections = saveSections(directoryName, overflowSection, hashTableSections, index->nHashTables);
+    delete [] hashTableSections;
+    if (!savedSections || !savePopularity(directoryName, index->overflowPopularity)) {
+        return false;
+    }
+
+    snprintf(filenameBuffer,filenameBufferSize,"%s%cGenomeIndex",directoryName,PATH_SEP);
+    FILE *indexFile = fopen(filenameBuffer,"w");
+    if (indexFile == NULL) {
+        fprintf(stderr,"Unable to open file '%s' for write.\n",filenameBuffer);
+        return false;
+    }
+
+    unsigned minorVersion = GenomeIndexFormatCompressedOverflowMinorVersion | GenomeIndexFormatSectionsMinorVersion;
+    if (index->hashTables[0]->IsBucketized()) {
+        minorVersion |= GenomeIndexFormatBucketizedMinorVersion;
+    }
+    if (index->hashTables[0]->UsesFastRange()) {
+        minorVersion |= GenomeIndexFormatFastRangeMinorVersion;
+    }
+    if (index->minimizerWindow > 1) {
+        minorVersion |= GenomeIndexFormatMinimizerMinorVersion;
+    }
+    if (index->hasQuotientedKeys()) {
+        minorVersion |= GenomeIndexFormatQuotientedKeysMinorVersion;
+    }
+    minorVersion |= GenomeIndexFormatLocationsMinorVersion;
+    fprintf(indexFile,"%d %d %d %d %d %d %d", GenomeIndexFormatMajorVersion, minorVersion, index->nHashTables, (unsigned)newOverflowTable.size(),
+        index->seedLen, index->genome->getChromosomePadding(), index->hashTableKeySize);
+    if (index->minimizerWindow > 1) {
+        fprintf(indexFile, " %d", index->minimizerWindow);
+    }
+    fclose(indexFile);
+
+    delete index;
+
+    printf("%llds\n", (timeInMillis() + 500 - start) / 1000);
+    return true;
+}
+
+static void IndexStatsUsage()
+{
+    fprintf(stderr,
+            "Usage: snap indexstats <index-dir> [<options>]\n"
+            "Prints the sizes of the parts of an index, how full its hash tables are, how far lookups probe in them and how many\n"
+            "hits its seeds have, for choosing the aligners' -h (maxHits).\n"
+            "Options:\n"
+            " -tMaxThreads      Specify the maximum number of threads to use. Default is the number of cores.\n"
+            " -HHistogramFile   Write the whole histogram of seed popularity, in the format of index -H.\n");
+    soft_exit(1);
+}
+
+    void
+GenomeIndex::runIndexStats(
+    int argc,
+    const char **argv)
+{
+    if (argc < 1) {
+        IndexStatsUsage();
+    }
+
+    const char *directoryName = argv[0];
+    unsigned maxThreads = GetNumberOfProcessors();
+    const char *histogramFileName = NULL;
+
+    for (int n = 1; n < argc; n++) {
+        if (argv[n][0] == '-' && argv[n][1] == 't') {
+            maxThreads = atoi(argv[n]+2);
+            if (maxThreads < 1 || maxThreads > 1000000) {
+                fprintf(stderr,"maxThreads must be between 1 and 1000000 inclusive (and you need not to leave a space after '-t')\n");
+                soft_exit(1);
+            }
+        } else if (argv[n][0] == '-' && argv[n][1] == 'H' && argv[n][2] != '\0') {
+            histogramFileName = argv[n] + 2;
+        } else {
+            fprintf(stderr, "Invalid argument: %s\n\n", argv[n]);
+            IndexStatsUsage();
+        }
+    }
+
+    if (!PrintIndexStats(directoryName, maxThreads, histogramFileName)) {
+        soft_exit(1);
+    }
+}
+
+    void
+GenomeIndex::IndexStatsThreadMain(void *param)
+{
+    IndexStatsThreadContext *context = (IndexStatsThreadContext *)param;
+    const GenomeIndex *index = context->index;
+    const _uint64 nRanges = context->firstRangeOfTable[index->nHashTables];
+
+    unsigned whichTable = 0;
+    _uint64 range;
+    while ((range = (_uint64)(InterlockedAdd64AndReturnNewValue(context->nextSlotRange, 1) - 1)) < nRanges) {
+        //
+        // Each thread gets ranges in increasing order, so its table only moves forward.
+        //
+        while (context->firstRangeOfTable[whichTable + 1] <= range) {
+            whichTable++;
+        }
+
+        const SNAPHashTable *table = index->hashTables[whichTable];
+        size_t beginSlot = (size_t)(range - context->firstRangeOfTable[whichTable]) * SlotsPerStatsRange;
+        SeedCountIterator iterator(table, beginSlot, __min(beginSlot + SlotsPerStatsRange, table->GetTableSize()));
+
+        SeedBases key;
+        const GenomeLocation *values;
+        unsigned probes;
+        while (iterator.next(&key, &values, &probes)) {
+            context->nEntries++;
+            context->totalProbes += probes;
+            context->maxProbes = __max(context->maxProbes, probes);
+            context->probeCounts[__min(probes, MaxProbesCounted)]++;
+
+            //
+            // The entry has the hits of both the seed and its reverse complement, either of which may not be in the genome.
+            //
+            for (unsigned whichValue = 0; whichValue < 2; whichValue++) {
+                GenomeLocation value = values[whichValue];
+                if (UnusedHashTableValue == value) {
+                    continue;
+                }
+
+                unsigned nHits = value < index->mainBaseCount ? 1 : index->overflowTable[value - index->mainBaseCount] & ~CompressedHitListFlag;
+                if (nHits <= MaxExactHitCount) {
+                    context->hitCounts[nHits]++;
+                } else {
+                    context->largeHitCounts->push_back(nHits);
+                }
+            }
+        }
+    }
+
+    if (0 == InterlockedDecrementAndReturnNewValue(context->runningThreadCount)) {
+        SignalSingleWaiterObject(context->doneObject);
+    }
+}
+
+    bool
+GenomeIndex::PrintIndexStats(const char *directoryName, unsigned maxThreads, const char *histogramFileName)
+{
+    printf("Loading index from '%s'...", directoryName);
+    _int64 start = timeInMillis();
+    GenomeIndex *index = loadFromDirectory((char *)directoryName, true, false);
+    if (NULL == index) {
+        fprintf(stderr, "Unable to load the index\n");
+        return false;
+    }
+    printf("%llds\nScanning %d hash tables on %d threads...", (timeInMillis() + 500 - start) / 1000, index->nHashTables, maxThreads);
+    start = timeInMillis();
+
+    _uint64 *firstRangeOfTable = new _uint64[index->nHashTables + 1];
+    firstRangeOfTable[0] = 0;
+    for (unsigned i = 0; i < index->nHashTables; i++) {
+        firstRangeOfTable[i + 1] = firstRangeOfTable[i] + (index->hashTables[i]->GetTableSize() + SlotsPerStatsRange - 1) / SlotsPerStatsRange;
+    }
+
+    SingleWaiterObject doneObject;
+    CreateSingleWaiterObject(&doneObject);
+    volatile int runningThreadCount = maxThreads;
+    volatile _int64 nextSlotRange = 0;
+
+    IndexStatsThreadContext *contexts = new IndexStatsThreadContext[maxThreads];
+    for (unsigned i = 0; i < maxThreads; i++) {
+        contexts[i].doneObject = &doneObject;
+        contexts[i].runningThreadCount = &runningThreadCount;
+        contexts[i].index = index;
+        contexts[i].nextSlotRange = &nextSlotRange;
+        contexts[i].firstRangeOfTable = firstRangeOfTable;
+        contexts[i].hitCounts = new _uint64[MaxExactHitCount + 1];
+        memset(contexts[i].hitCounts, 0, sizeof(_uint64) * (MaxExactHitCount + 1));
+        contexts[i].largeHitCounts = new vector<unsigned>;
+        memset(contexts[i].probeCounts, 0, sizeof(contexts[i].probeCounts));
+        contexts[i].nEntries = 0;
+        contexts[i].totalProbes = 0;
+        contexts[i].maxProbes = 0;
+        StartNewThread(IndexStatsThreadMain, &contexts[i]);
+    }
+
+    WaitForSingleWaiterObject(&doneObject);
+    DestroySingleWaiterObject(&doneObject);
+
+    //
+    // Add up the threads' counts into the first one's.
+    //
+    IndexStatsThreadContext *totals = &contexts[0];
+    for (unsigned i = 1; i < maxThreads; i++) {
+        for (unsigned j = 0; j <= MaxExactHitCount; j++) {
+            totals->hitCounts[j] += contexts[i].hitCounts[j];
+        }
+        totals->largeHitCounts->insert(totals->largeHitCounts->end(), contexts[i].largeHitCounts->begin(), contexts[i].largeHitCounts->end());
+        for (unsigned j = 0; j <= MaxProbesCounted; j++) {
+            totals->probeCounts[j] += contexts[i].probeCounts[j];
+        }
+        totals->nEntries += contexts[i].nEntries;
+        totals->totalProbes += contexts[i].totalProbes;
+        totals->maxProbes = __max(totals->maxProbes, contexts[i].maxProbes);
+    }
+    sort(totals->largeHitCounts->begin(), totals->largeHitCounts->end());
+    printf("%llds\n\n", (timeInMillis() + 500 - start) / 1000);
+
+    const Genome *genome = index->genome;
+    const double GB = 1024.0 * 1024.0 * 1024.0;
+    printf("Seed length %d, key size %d bytes, %d %shash tables, %d contigs, %lld bases%s\n", index->seedLen, index->hashTableKeySize,
+        index->nHashTables, index->hashTables[0]->IsBucketized() ? "bucketized " : (index->hasQuotientedKeys() ? "quotiented " : ""),
+        genome->getNumContigs(), (_int64)genome->getCountOfBases(),
+        index->minimizerWindow > 1 ? ", minimizers only" : "");
+
+    //
+    // Memory per section.
+    //
+    _uint64 slots = 0, usedSlots = 0, hashTableBytes = 0;
+    double minLoad = 1.0, maxLoad = 0.0;
+    for (unsigned i = 0; i < index->nHashTables; i++) {
+        SNAPHashTable *table = index->hashTables[i];
+        slots += table->GetTableSize();
+        usedSlots += table->GetUsedElementCount();
+        hashTableBytes += (_uint64)(table->GetTableSize() * table->GetBytesPerSlot());
+        double load = 0 == table->GetTableSize() ? 0.0 : (double)table->GetUsedElementCount() / table->GetTableSize();
+        minLoad = __min(minLoad, load);
+        maxLoad = __max(maxLoad, load);
+    }
+
+    printf("\nMemory:\n");
+    printf("  genome           %8.2f GB\n", (double)genome->getCountOfBases() / GB);
+    printf("  hash tables      %8.2f GB\n", hashTableBytes / GB);
+    printf("  overflow table   %8.2f GB%s\n", (_uint64)index->overflowTableSize * sizeof(GenomeLocation) / GB,
+        index->compressedOverflowTable ? " (compressed)" : "");
+    if (NULL != index->auxiliaryTable) {
+        printf("  auxiliary tables %8.2f GB\n", (index->auxiliaryTable->GetTableSize() * index->auxiliaryTable->GetBytesPerSlot() +
+            (_uint64)index->auxiliaryOverflowTableSize * sizeof(GenomeLocation)) / GB);
+    }
+
+    printf("\nHash tables: %lld slots, %lld used, load factor %.3f (from %.3f to %.3f)\n", slots, usedSlots,
+        0 == slots ? 0.0 : (double)usedSlots / slots, minLoad, maxLoad);
+    printf("%s past the home %s to find a seed: mean %.3f, max %u\n", index->hashTables[0]->IsBucketized() ? "Buckets" : "Probes",
+        index->hashTables[0]->IsBucketized() ? "bucket" : "slot", 0 == totals->nEntries ? 0.0 : (double)totals->totalProbes / totals->nEntries,
+        totals->maxProbes);
+    printf("  %-8s%14s%10s\n", "probes", "seeds", "percent");
+    for (unsigned i = 0; i <= MaxProbesCounted; i++) {
+        if (0 != totals->probeCounts[i]) {
+            char label[20];
+            snprintf(label, sizeof(label), i < MaxProbesCounted ? "%u" : "%u+", i);
+            printf("  %-8s%14lld%9.3f%%\n", label, totals->probeCounts[i], 100.0 * totals->probeCounts[i] / totals->nEntries);
+        }
+    }
+
+    //
+    // Seed popularity, in powers of two, with what fraction of the seeds and of their hits have at most that many hits.
+    //
+    _uint64 nSeeds = 0, nLocations = 0;
+    unsigned largestSeed = 0;
+    for (unsigned i = 1; i <= MaxExactHitCount; i++) {
+        nSeeds += totals->hitCounts[i];
+        nLocations += (_uint64)i * totals->hitCounts[i];
+        if (0 != totals->hitCounts[i]) {
+            largestSeed = i;
+        }
+    }
+    for (size_t i = 0; i < totals->largeHitCounts->size(); i++) {
+        nSeeds++;
+        nLocations += (*totals->largeHitCounts)[i];
+        largestSeed = __max(largestSeed, (*totals->largeHitCounts)[i]);
+    }
+
+    printf("\nSeeds by number of hits: %lld seeds, %lld locations, largest seed %u hits\n", nSeeds, nLocations, largestSeed);
+    printf("  %-22s%14s%10s%12s%12s\n", "hits", "seeds", "percent", "cum seeds", "cum hits");
+
+    _uint64 cumulativeSeeds = 0, cumulativeLocations = 0;
+    size_t nextLarge = 0;
+    for (_uint64 low = 1; low <= 0xffffffff; low *= 2) {
+        _uint64 high = low * 2 - 1;
+        _uint64 seedsInBucket = 0;
+        for (_uint64 i = low; i <= __min(high, (_uint64)MaxExactHitCount); i++) {
+            seedsInBucket += totals->hitCounts[i];
+            cumulativeLocations += i * totals->hitCounts[i];
+        }
+        while (nextLarge < totals->largeHitCounts->size() && (*totals->largeHitCounts)[nextLarge] <= high) {
+            seedsInBucket++;
+            cumulativeLocations += (*totals->largeHitCounts)[nextLarge];
+            nextLarge++;
+        }
+        if (0 == seedsInBucket) {
+            continue;
+        }
+        cumulativeSeeds += seedsInBucket;
+
+        char label[40];
+        snprintf(label, sizeof(label), low == high ? "%lld" : "%lld-%lld", low, high);
+        printf("  %-22s%14lld%9.3f%%%11.3f%%%11.3f%%\n", label, seedsInBucket, 100.0 * seedsInBucket / nSeeds,
+            100.0 * cumulativeSeeds / nSeeds, 100.0 * cumulativeLocations / nLocations);
+    }
+
+    bool worked = true;
+    if (NULL != histogramFileName) {
+        FILE *histogramFile = fopen(histogramFileName, "w");
+        if (NULL == histogramFile) {
+            fprintf(stderr, "Unable to open histogram file '%s'\n", histogramFileName);
+            worked = false;
+        } else {
+            for (unsigned i = 1; i <= MaxExactHitCount; i++) {
+                if (totals->hitCounts[i] != 0) {
+                    fprintf(histogramFile, "%d\t%lld\n", i, totals->hitCounts[i]);
+                }
+            }
+            for (size_t i = 0; i < totals->largeHitCounts->size(); ) {
+                size_t j;
+                for (j = i; j < totals->largeHitCounts->size() && (*totals->largeHitCounts)[j] == (*totals->largeHitCounts)[i]; j++) {
+                    // This loop body intentionally left blank.
+                }
+                fprintf(histogramFile, "%d\t%lld\n", (*totals->largeHitCounts)[i], (_int64)(j - i));
+                i = j;
+            }
+            fclose(histogramFile);
+        }
+    }
+
+    for (unsigned i = 0; i < maxThreads; i++) {
+        delete [] contexts[i].hitCounts;
+        delete contexts[i].largeHitCounts;
+    }
+    delete [] contexts;
+    delete [] firstRangeOfTable;
+    delete index;
+
+    return worked;
+}
+
+    void
+GenomeIndex::BuildSeedFilterThreadMain(void *param)
+{
+    BuildSeedFilterThreadContext *context = (BuildSeedFilterThreadContext *)param;
+    const GenomeIndex *index = context->index;
+    const _uint64 nRanges = context->firstRangeOfTable[index->nHashTables];
+
+    unsigned whichTable = 0;
+    _uint64 range;
+    while ((range = (_uint64)(InterlockedAdd64AndReturnNewValue(context->nextSlotRange, 1) - 1)) < nRanges) {
+        while (context->firstRangeOfTable[whichTable + 1] <= range) {
+            whichTable++;
+        }
+
+        //
+        // The filter has whole seeds, which are the table number above the table's key (see Seed::getHighBases).
+        //
+        const SNAPHashTable *table = index->hashTables[whichTable];
+        SeedBases highBases = index->hashTableKeySize >= sizeof(SeedBases) ? (SeedBases)0 : (SeedBases)whichTable << (index->hashTableKeySize * 8);
+        size_t beginSlot = (size_t)(range - context->firstRangeOfTable[whichTable]) * SlotsPerStatsRange;
+        size_t endSlot = __min(beginSlot + SlotsPerStatsRange, table->GetTableSize());
+        for (size_t slot = beginSlot; slot < endSlot; slot++) {
+            if (NULL != table->GetValuesOfSlot(slot)) {
+                context->filter->Insert(highBases | table->GetKeyOfSlot(slot));
+            }
+        }
+    }
+
+    if (0 == InterlockedDecrementAndReturnNewValue(context->runningThreadCount)) {
+        SignalSingleWaiterObject(context->doneObject);
+    }
+}
+
+    bool
+GenomeIndex::BuildSeedFilter(const char *directoryName, unsigned bitsPerKey, unsigned maxThreads)
+{
+    printf("Building the seed filter for '%s'...", directoryName);
+    _int64 start = timeInMillis();
+    GenomeIndex *index = loadFromDirectory((char *)directoryName, true, false);
+    if (NULL == index) {
+        fprintf(stderr, "Unable to load the index to build its seed filter\n");
+        return false;
+    }
+
+    _uint64 nSeeds = 0;
+    _uint64 *firstRangeOfTable = new _uint64[index->nHashTables + 1];
+    firstRangeOfTable[0] = 0;
+    for (unsigned i = 0; i < index->nHashTables; i++) {
+        nSeeds += index->hashTables[i]->GetUsedElementCount();
+        firstRangeOfTable[i + 1] = firstRangeOfTable[i] + (index->hashTables[i]->GetTableSize() + SlotsPerStatsRange - 1) / SlotsPerStatsRange;
+    }
+
+    SeedFilter *filter = new SeedFilter(nSeeds, bitsPerKey);
+
+    SingleWaiterObject doneObject;
+    CreateSingleWaiterObject(&doneObject);
+    volatile int runningThreadCount = maxThreads;
+    volatile _int64 nextSlotRange = 0;
+
+    BuildSeedFilterThreadContext *contexts = new BuildSeedFilterThreadContext[maxThreads];
+    for (unsigned i = 0; i < maxThreads; i++) {
+        contexts[i].doneObject = &doneObject;
+        contexts[i].runningThreadCount = &runningThreadCount;
+        contexts[i].index = index;
+        contexts[i].filter = filter;
+        contexts[i].nextSlotRange = &nextSlotRange;
+        contexts[i].firstRangeOfTable = firstRangeOfTable;
+        StartNewThread(BuildSeedFilterThreadMain, &contexts[i]);
+    }
+
+    WaitForSingleWaiterObject(&doneObject);
+    DestroySingleWaiterObject(&doneObject);
+    delete [] contexts;
+    delete [] firstRangeOfTable;
+    delete index;
+
+    const unsigned filenameBufferSize = MAX_PATH+1;
+    char filenameBuffer[filenameBufferSize];
+    snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, SeedFilter::IndexFileName);
+    bool worked = filter->saveToFile(filenameBuffer);
+    if (worked) {
+        printf("%lld seeds in %lld bytes with %d probes, %llds\n", nSeeds, filter->GetSizeInBytes(), filter->GetNProbes(), (timeInMillis() + 500 - start) / 1000);
+    }
+    delete filter;
+
+    return worked;
 }
 
-    GenomeIndex *
-GenomeIndex::loadFromDirectory(char *directoryName)
+    bool
+GenomeIndex::loadAuxiliaryTables(const char *directoryName)
 {
-    GenomeIndex *index = new GenomeIndex();
-
     const unsigned filenameBufferSize = MAX_PATH+1;
     char filenameBuffer[filenameBufferSize];
-    
-    snprintf(filenameBuffer,filenameBufferSize,"%s%cGenomeIndex",directoryName,PATH_SEP);
-
-	GenericFile *indexFile = GenericFile::open(filenameBuffer, GenericFile::Mode::ReadOnly);
 
-    if (NULL == indexFile) {
-        fprintf(stderr,"Unable to open file '%s' for read.\n",filenameBuffer);
-        return NULL;
+    snprintf(filenameBuffer,filenameBufferSize,"%s%c%s",directoryName,PATH_SEP,AltLiftover::IndexFileName);
+    GenericFile *altLiftoverFile = GenericFile::open(filenameBuffer, GenericFile::Mode::ReadOnly);
+    if (NULL != altLiftoverFile) {
+        altLiftoverFile->close();
+        delete altLiftoverFile;
+        if (NULL == (altLiftover = AltLiftover::loadFromFile(filenameBuffer, genome))) {
+            return false;
+        }
     }
 
-	char indexFileBuf[1000];
-	indexFile->read(indexFileBuf, sizeof(indexFileBuf));
-
-    unsigned seedLen;
-    unsigned majorVersion, minorVersion, chromosomePadding;
-    int nRead;
-    if (7 != (nRead = sscanf(indexFileBuf,"%d %d %d %d %d %d %d", &majorVersion, &minorVersion, &index->nHashTables, &index->overflowTableSize, &seedLen, &chromosomePadding, &index->hashTableKeySize))) {
-        if (3 == nRead || 6 == nRead) {
-            fprintf(stderr, "Indices built by versions before 0.16.28 are no longer supported.  Please rebuild your index.\n");
-        } else {
-            fprintf(stderr,"GenomeIndex::LoadFromDirectory: didn't read initial values\n");
+    snprintf(filenameBuffer,filenameBufferSize,"%s%c%s",directoryName,PATH_SEP,SeedFilter::IndexFileName);
+    GenericFile *seedFilterFile = GenericFile::open(filenameBuffer, GenericFile::Mode::ReadOnly);
+    if (NULL != seedFilterFile) {
+        seedFilterFile->close();
+        delete seedFilterFile;
+        if (NULL == (seedFilter = SeedFilter::loadFromFile(filenameBuffer))) {
+            return false;
         }
-		indexFile->close();		
-		delete indexFile;
-        delete index;
-        return NULL;
     }
-	indexFile->close();
-	delete indexFile;
 
-    if (majorVersion != GenomeIndexFormatMajorVersion) {
-        fprintf(stderr,"This genome index appears to be from a different version of SNAP than this, and so we can't read it.  Index version %d, SNAP index format version %d\n",
-            majorVersion, GenomeIndexFormatMajorVersion);
-        soft_exit(1);
+    snprintf(filenameBuffer,filenameBufferSize,"%s%cAuxiliaryIndex",directoryName,PATH_SEP);
+    GenericFile *auxiliaryIndexFile = GenericFile::open(filenameBuffer, GenericFile::Mode::ReadOnly);
+    if (NULL == auxiliaryIndexFile) {
+        //
+        // Nothing's been appended to this index, so the main tables cover the whole genome.
+        //
+        mainBaseCount = genome->getCountOfBases();
+        return true;
     }
 
-    if (0 == seedLen) {
-        fprintf(stderr,"GenomeIndex::LoadFromDirectory: saw seed size of 0.\n");
-        delete index;
-        return NULL;
+    char auxiliaryIndexFileBuf[100];
+    size_t bytesRead = auxiliaryIndexFile->read(auxiliaryIndexFileBuf, sizeof(auxiliaryIndexFileBuf) - 1);
+    auxiliaryIndexFileBuf[bytesRead] = '\0';
+    auxiliaryIndexFile->close();
+    delete auxiliaryIndexFile;
+
+    _uint64 fileMainBaseCount;
+    if (2 != sscanf(auxiliaryIndexFileBuf, "%llu %u", &fileMainBaseCount, &auxiliaryOverflowTableSize) || fileMainBaseCount > genome->getCountOfBases()) {
+        fprintf(stderr,"GenomeIndex::loadFromDirectory: invalid auxiliary index file '%s'\n", filenameBuffer);
+        return false;
     }
-    index->seedLen = seedLen;
-    index->overflowTable = (unsigned *)BigAlloc(index->overflowTableSize * sizeof(*(index->overflowTable)),&index->overflowTableVirtualAllocSize);
+    mainBaseCount = (GenomeLocation)fileMainBaseCount;
 
-    snprintf(filenameBuffer,filenameBufferSize,"%s%cOverflowTable",directoryName,PATH_SEP);
-    GenericFile *fOverflowTable = GenericFile::open(filenameBuffer, GenericFile::Mode::ReadOnly);
+    snprintf(filenameBuffer,filenameBufferSize,"%s%cAuxiliaryIndexHash",directoryName,PATH_SEP);
+    if (NULL == (auxiliaryTable = SNAPHashTable::loadFromFile(filenameBuffer))) {
+        fprintf(stderr,"GenomeIndex::loadFromDirectory: Failed to load auxiliary hash table '%s'\n", filenameBuffer);
+        return false;
+    }
 
-    if (NULL == fOverflowTable) {
-        fprintf(stderr,"Unable to open overflow table file, '%s', %d\n",filenameBuffer,errno);
-        delete index;
-        return NULL;
+    snprintf(filenameBuffer,filenameBufferSize,"%s%cAuxiliaryOverflowTable",directoryName,PATH_SEP);
+    GenericFile *auxiliaryOverflowFile = GenericFile::open(filenameBuffer, GenericFile::Mode::ReadOnly);
+    if (NULL == auxiliaryOverflowFile) {
+        fprintf(stderr,"Unable to open auxiliary overflow table file, '%s'\n", filenameBuffer);
+        return false;
     }
 
-    const unsigned readSize = 32 * 1024 * 1024;
-    for (size_t readOffset = 0; readOffset < index->overflowTableSize * sizeof(*(index->overflowTable)); ) {
-        int amountToRead = (unsigned)__min((size_t)readSize,(size_t)index->overflowTableSize * sizeof(*(index->overflowTable)) - readOffset);
-#ifdef _MSC_VER
-        if (amountToRead % 4096) {
-            amountToRead = ((amountToRead + 4095) / 4096) * 4096;
-            if (amountToRead + readOffset > index->overflowTableVirtualAllocSize) {
-                fprintf(stderr,"GenomeIndex::loadFromDirectory: overflow table virtual alloc size doesn't appear to be a multiple of the page size %lld\n",
-                    (_int64) index->overflowTableVirtualAllocSize);
-            }
-        }
-#endif
-        int amountRead = fOverflowTable->read(((char*) index->overflowTable) + readOffset, amountToRead);
-        if (amountRead < amountToRead) {
-            fprintf(stderr,"GenomeIndex::loadFromDirectory: read failed (amountToRead = %d, amountRead = %d, readOffset %lld), %d\n",amountToRead, amountRead, readOffset, errno);
-			fOverflowTable->close();
-			delete fOverflowTable;
-            delete index;
-            return NULL;
-        }
-        readOffset += amountRead;
+    auxiliaryOverflowTable = new GenomeLocation[__max(auxiliaryOverflowTableSize, 1u)];
+    size_t auxiliaryOverflowBytes = (size_t)auxiliaryOverflowTableSize * sizeof(*auxiliaryOverflowTable);
+    bytesRead = auxiliaryOverflowFile->read(auxiliaryOverflowTable, auxiliaryOverflowBytes);
+    auxiliaryOverflowFile->close();
+    delete auxiliaryOverflowFile;
+    if (bytesRead != auxiliaryOverflowBytes) {
+        fprintf(stderr,"GenomeIndex::loadFromDirectory: auxiliary overflow table '%s' is truncated\n", filenameBuffer);
+        return false;
     }
 
-	fOverflowTable->close();
-	delete fOverflowTable;
-    fOverflowTable = NULL;
+    return true;
+}
 
-    index->hashTables = new SNAPHashTable*[index->nHashTables];
+    bool
+GenomeIndex::mapTables(const char *directoryName, bool prefetch)
+{
+    if (!mapOverflowTable(directoryName, prefetch)) {
+        return false;
+    }
 
-    for (unsigned i = 0; i < index->nHashTables; i++) {
-        index->hashTables[i] = NULL; // We need to do this so the destructor doesn't crash if loading a hash table fails.
+    hashTables = new SNAPHashTable*[nHashTables];
+    for (unsigned i = 0; i < nHashTables; i++) {
+        hashTables[i] = NULL;
     }
 
-    snprintf(filenameBuffer,filenameBufferSize,"%s%cGenomeIndexHash",directoryName,PATH_SEP);
-	GenericFile *tablesFile = GenericFile::open(filenameBuffer, GenericFile::Mode::ReadOnly);
-    if (NULL == tablesFile) {
-        fprintf(stderr,"Unable to open genome hash table file '%s'\n", filenameBuffer);
-        soft_exit(1);
+    return mapHashTables(directoryName, prefetch);
+}
+
+    bool
+GenomeIndex::mapOverflowTable(const char *directoryName, bool prefetch)
+{
+    const unsigned filenameBufferSize = MAX_PATH+1;
+    char filenameBuffer[filenameBufferSize];
+
+    //
+    // The overflow table and hash table files are in exactly the in-memory format, so we just point at the mapped contents.
+    // Seed lookups hit the hash tables at random, so don't ask for sequential readahead.
+    //
+    snprintf(filenameBuffer,filenameBufferSize,"%s%cOverflowTable",directoryName,PATH_SEP);
+    size_t overflowTableBytes = (size_t)overflowTableSize * sizeof(*overflowTable);
+    if ((size_t)QueryFileSize(filenameBuffer) < overflowTableBytes) {
+        fprintf(stderr,"GenomeIndex::loadFromDirectory: overflow table file '%s' is smaller than the expected %lld bytes\n", filenameBuffer, (_int64)overflowTableBytes);
+        return false;
     }
 
-    for (unsigned i = 0; i < index->nHashTables; i++) {
-        if (NULL == (index->hashTables[i] = SNAPHashTable::loadFromFile(tablesFile))) {
-            fprintf(stderr,"GenomeIndex::loadFromDirectory: Failed to load hash table %d\n",i);
-            delete index;
-            return NULL;
+    if (0 != overflowTableBytes) {
+        mappedOverflowTable = OpenMemoryMappedFile(filenameBuffer, 0, overflowTableBytes, (void **)&overflowTable, false, false, prefetch, BigAllocUseHugePages);
+        if (NULL == mappedOverflowTable) {
+            fprintf(stderr,"Unable to map overflow table file, '%s'\n",filenameBuffer);
+            return false;
         }
     }
 
-	tablesFile->close();
-	delete tablesFile;
-    tablesFile = NULL;
+    return true;
+}
 
-    snprintf(filenameBuffer,filenameBufferSize,"%s%cGenome",directoryName,PATH_SEP);
-    if (NULL == (index->genome = Genome::loadFromFile(filenameBuffer, chromosomePadding))) {
-        fprintf(stderr,"GenomeIndex::loadFromDirectory: Failed to load the genome itself\n");
-        delete index;
-        return NULL;
+    bool
+GenomeIndex::mapHashTables(const char *directoryName, bool prefetch)
+{
+    const unsigned filenameBufferSize = MAX_PATH+1;
+    char filenameBuffer[filenameBufferSize];
+
+    snprintf(filenameBuffer,filenameBufferSize,"%s%cGenomeIndexHash",directoryName,PATH_SEP);
+    size_t tablesFileSize = (size_t)QueryFileSize(filenameBuffer);
+    char *tablesContents;
+    mappedHashTables = OpenMemoryMappedFile(filenameBuffer, 0, tablesFileSize, (void **)&tablesContents, false, false, prefetch, BigAllocUseHugePages);
+    if (NULL == mappedHashTables) {
+        fprintf(stderr,"Unable to map genome hash table file '%s'\n", filenameBuffer);
+        return false;
     }
 
-    if ((_int64)index->genome->getCountOfBases() + (_int64)index->overflowTableSize > 0xfffffff0) {
-        fprintf(stderr,"\nThis index has too many overflow entries to be valid.  Some early versions of SNAP\n"
-                        "allowed building indices with too small of a seed size, and this appears to be such\n"
-                        "an index.  You can no longer build indices like this, and you also can't use them\n"
-                        "because they are corrupt and would produce incorrect results.  Please use an index\n"
-                        "built with a larger seed size.  For hg19, the seed size must be at least 19.\n"
-                        "For other reference genomes this quantity will vary.\n");
-        soft_exit(1);
+    size_t tablesOffset = 0;
+    for (unsigned i = 0; i < nHashTables; i++) {
+        size_t bytesConsumed;
+        if (NULL == (hashTables[i] = SNAPHashTable::loadFromMemory(tablesContents + tablesOffset, tablesFileSize - tablesOffset, &bytesConsumed))) {
+            fprintf(stderr,"GenomeIndex::loadFromDirectory: Failed to map hash table %d\n",i);
+            return false;
+        }
+        tablesOffset += bytesConsumed;
     }
 
-    return index;
+    return true;
 }
 
     void
-GenomeIndex::lookupSeed(Seed seed, unsigned *nHits, const unsigned **hits, unsigned *nRCHits, const unsigned **rcHits)
+GenomeIndex::lookupSeed(Seed seed, unsigned *nHits, const GenomeLocation **hits, unsigned *nRCHits, const GenomeLocation **rcHits, DecodedHitBuffer *decodedHits)
 {
-    return lookupSeed(seed, 0, 0xFFFFFFFF, nHits, hits, nRCHits, rcHits);
+    return lookupSeed(seed, 0, InvalidGenomeLocation, nHits, hits, nRCHits, rcHits, decodedHits);
 }
 
-    void
+    SNAP_CPU_DISPATCH void
 GenomeIndex::lookupSeed(
     Seed              seed,
-    unsigned          minLocation,
-    unsigned          maxLocation,
+    GenomeLocation    minLocation,
+    GenomeLocation    maxLocation,
     unsigned         *nHits,
-    const unsigned  **hits,
+    const GenomeLocation **hits,
     unsigned         *nRCHits,
-    const unsigned  **rcHits)
+    const GenomeLocation **rcHits,
+    DecodedHitBuffer *decodedHits)
 {
     bool lookedUpComplement;
 
@@ -846,15 +3008,217 @@ GenomeIndex::lookupSeed(
         seed = ~seed;
     }
 
-    _ASSERT(seed.getHighBases(hashTableKeySize) < nHashTables);
-    _uint64 lowBases = seed.getLowBases(hashTableKeySize);
-    unsigned *entry = hashTables[seed.getHighBases(hashTableKeySize)]->Lookup(lowBases);
+    GenomeLocation overflowBase;
+    const GenomeLocation *overflowTableToUse;
+    unsigned overflowTableSizeToUse;
+    GenomeLocation *entry;
+    switch (hashTableKeySize) {
+        case 4: entry = lookupCanonicalSeed<4>(seed, &overflowBase, &overflowTableToUse, &overflowTableSizeToUse); break;
+        case 5: entry = lookupCanonicalSeed<5>(seed, &overflowBase, &overflowTableToUse, &overflowTableSizeToUse); break;
+        case 6: entry = lookupCanonicalSeed<6>(seed, &overflowBase, &overflowTableToUse, &overflowTableSizeToUse); break;
+        case 7: entry = lookupCanonicalSeed<7>(seed, &overflowBase, &overflowTableToUse, &overflowTableSizeToUse); break;
+        case 8: entry = lookupCanonicalSeed<8>(seed, &overflowBase, &overflowTableToUse, &overflowTableSizeToUse); break;
+        default: entry = lookupCanonicalSeed<0>(seed, &overflowBase, &overflowTableToUse, &overflowTableSizeToUse); break;
+    }
     if (NULL == entry) {
         *nHits = 0;
         *nRCHits = 0;
+        PerfCounters::forThisThread()->seedHits.record(0);
         return;
     }
 
+    fillInBothLookedUpResults(seed, lookedUpComplement, entry, overflowBase, overflowTableToUse, overflowTableSizeToUse, minLocation, maxLocation,
+        nHits, hits, nRCHits, rcHits, decodedHits);
+    PerfCounters::forThisThread()->seedHits.record((_int64) *nHits + *nRCHits);
+}
+
+    SNAP_CPU_DISPATCH void
+GenomeIndex::lookupSeeds(
+    const Seed       *seeds,
+    unsigned          nSeeds,
+    GenomeLocation    minLocation,
+    GenomeLocation    maxLocation,
+    unsigned         *nHits,
+    const GenomeLocation **hits,
+    unsigned         *nRCHits,
+    const GenomeLocation **rcHits,
+    DecodedHitBuffer *decodedHits)
+{
+    switch (hashTableKeySize) {
+        case 4: lookupSeedsWithKeySize<4>(seeds, nSeeds, minLocation, maxLocation, nHits, hits, nRCHits, rcHits, decodedHits); break;
+        case 5: lookupSeedsWithKeySize<5>(seeds, nSeeds, minLocation, maxLocation, nHits, hits, nRCHits, rcHits, decodedHits); break;
+        case 6: lookupSeedsWithKeySize<6>(seeds, nSeeds, minLocation, maxLocation, nHits, hits, nRCHits, rcHits, decodedHits); break;
+        case 7: lookupSeedsWithKeySize<7>(seeds, nSeeds, minLocation, maxLocation, nHits, hits, nRCHits, rcHits, decodedHits); break;
+        case 8: lookupSeedsWithKeySize<8>(seeds, nSeeds, minLocation, maxLocation, nHits, hits, nRCHits, rcHits, decodedHits); break;
+        default: lookupSeedsWithKeySize<0>(seeds, nSeeds, minLocation, maxLocation, nHits, hits, nRCHits, rcHits, decodedHits); break;
+    }
+}
+
+template <unsigned KeyBytes>
+    void
+GenomeIndex::lookupSeedsWithKeySize(
+    const Seed       *seeds,
+    unsigned          nSeeds,
+    GenomeLocation    minLocation,
+    GenomeLocation    maxLocation,
+    unsigned         *nHits,
+    const GenomeLocation **hits,
+    unsigned         *nRCHits,
+    const GenomeLocation **rcHits,
+    DecodedHitBuffer *decodedHits)
+{
+    //
+    // Work in groups small enough to keep the per-seed state on the stack.  That's still plenty of misses in flight.
+    //
+    const unsigned maxBatchSize = 32;
+
+    for (unsigned batchStart = 0; batchStart < nSeeds; batchStart += maxBatchSize) {
+        unsigned batchSize = __min(maxBatchSize, nSeeds - batchStart);
+        Seed canonicalSeeds[maxBatchSize];
+        bool lookedUpComplement[maxBatchSize];
+        GenomeLocation *entries[maxBatchSize];
+        GenomeLocation overflowBases[maxBatchSize];
+        const GenomeLocation *overflowTablesToUse[maxBatchSize];
+        unsigned overflowTableSizesToUse[maxBatchSize];
+
+        //
+        // First launch the hash table prefetches for every seed.  While readahead hints are wanted, start reading in the
+        // seeds' hash table pages too, since with a lazily mapped index the cache misses might be page faults.
+        //
+        bool hintReadahead = readaheadHintsLeft > 0 && InterlockedAdd64AndReturnNewValue(&readaheadHintsLeft, -(_int64)batchSize) + batchSize > 0;
+        for (unsigned i = 0; i < batchSize; i++) {
+            canonicalSeeds[i] = seeds[batchStart + i];
+            lookedUpComplement[i] = canonicalSeeds[i].isBiggerThanItsReverseComplement();
+            if (lookedUpComplement[i]) {
+                canonicalSeeds[i] = ~canonicalSeeds[i];
+            }
+            if (NULL != auxiliaryTable) {
+                auxiliaryTable->Prefetch(canonicalSeeds[i].getBases());
+            }
+            if (NULL != seedFilter) {
+                seedFilter->Prefetch(canonicalSeeds[i].getBases());
+            } else {
+                hashTables[canonicalSeeds[i].getHighBases(hashTableKeySize)]->Prefetch<KeyBytes>(canonicalSeeds[i].getLowBases(hashTableKeySize));
+            }
+            if (hintReadahead) {
+                hashTables[canonicalSeeds[i].getHighBases(hashTableKeySize)]->AdviseWillNeed<KeyBytes>(canonicalSeeds[i].getLowBases(hashTableKeySize));
+            }
+        }
+
+        //
+        // With a seed filter, that was the filter's blocks, and only the seeds that get through it need their hash table entries.
+        //
+        if (NULL != seedFilter) {
+            for (unsigned i = 0; i < batchSize; i++) {
+                if (seedFilter->MightContain(canonicalSeeds[i].getBases())) {
+                    hashTables[canonicalSeeds[i].getHighBases(hashTableKeySize)]->Prefetch<KeyBytes>(canonicalSeeds[i].getLowBases(hashTableKeySize));
+                }
+            }
+        }
+
+        //
+        // Then find the entries, and launch prefetches for the hit lists of any that have them (and that the caller will look at).
+        //
+        bool mightSkipPopularLists = NULL != decodedHits && decodedHits->skipPopularLists && minLocation == 0 && maxLocation == InvalidGenomeLocation;
+        for (unsigned i = 0; i < batchSize; i++) {
+            entries[i] = lookupCanonicalSeed<KeyBytes>(canonicalSeeds[i], &overflowBases[i], &overflowTablesToUse[i], &overflowTableSizesToUse[i]);
+            if (NULL != entries[i]) {
+                for (unsigned whichHalf = 0; whichHalf < 2; whichHalf++) {
+                    GenomeLocation value = entries[i][whichHalf];
+                    unsigned minHits;
+                    if (value >= overflowBases[i] && value != UnusedHashTableValue && value - overflowBases[i] < overflowTableSizesToUse[i] &&
+                            !(mightSkipPopularLists && overflowTablesToUse[i] == overflowTable && isKnownPopular(value - overflowBases[i], decodedHits, &minHits))) {
+                        _mm_prefetch((const char *)&overflowTablesToUse[i][value - overflowBases[i]], _MM_HINT_T0);
+                    }
+                }
+            }
+        }
+
+        //
+        // And finally fill in the results.
+        //
+        PerfCounters *perf = PerfCounters::forThisThread();
+        for (unsigned i = 0; i < batchSize; i++) {
+            unsigned which = batchStart + i;
+            if (NULL == entries[i]) {
+                nHits[which] = 0;
+                nRCHits[which] = 0;
+            } else {
+                fillInBothLookedUpResults(canonicalSeeds[i], lookedUpComplement[i], entries[i], overflowBases[i], overflowTablesToUse[i],
+                    overflowTableSizesToUse[i], minLocation, maxLocation, &nHits[which], &hits[which], &nRCHits[which], &rcHits[which], decodedHits);
+            }
+            perf->seedHits.record((_int64) nHits[which] + nRCHits[which]);
+        }
+    }
+}
+
+    void
+GenomeIndex::prefetchSeed(Seed seed) const
+{
+    if (seed.isBiggerThanItsReverseComplement()) {
+        seed = ~seed;
+    }
+    if (NULL != auxiliaryTable) {
+        auxiliaryTable->Prefetch(seed.getBases());
+    }
+    if (NULL != seedFilter) {
+        seedFilter->Prefetch(seed.getBases());
+    }
+    hashTables[seed.getHighBases(hashTableKeySize)]->Prefetch(seed.getLowBases(hashTableKeySize));
+}
+
+    _uint64
+GenomeIndex::getSeedLookupKey(Seed seed) const
+{
+    if (seed.isBiggerThanItsReverseComplement()) {
+        seed = ~seed;
+    }
+    _uint64 whichTable = seed.getHighBases(hashTableKeySize);
+    return (whichTable << 32) | hashTables[whichTable]->GetHomeSlot(seed.getLowBases(hashTableKeySize));
+}
+
+template <unsigned KeyBytes>
+    GenomeLocation *
+GenomeIndex::lookupCanonicalSeed(Seed seed, GenomeLocation *overflowBase, const GenomeLocation **overflowTableToUse, unsigned *overflowTableSizeToUse)
+{
+    GenomeLocation *entry;
+    if (NULL != auxiliaryTable && NULL != (entry = auxiliaryTable->Lookup(seed.getBases()))) {
+        *overflowBase = genome->getCountOfBases();
+        *overflowTableToUse = auxiliaryOverflowTable;
+        *overflowTableSizeToUse = auxiliaryOverflowTableSize;
+        return entry;
+    }
+
+    if (NULL != seedFilter && !seedFilter->MightContain(seed.getBases())) {
+        PerfCounters::forThisThread()->seedFilterRejections++;
+        return NULL;
+    }
+
+    _ASSERT(seed.getHighBases(hashTableKeySize) < nHashTables);
+    SeedBases lowBases = seed.getLowBases(hashTableKeySize);
+    entry = hashTables[seed.getHighBases(hashTableKeySize)]->Lookup<KeyBytes>(lowBases);
+    *overflowBase = mainBaseCount;
+    *overflowTableToUse = overflowTable;
+    *overflowTableSizeToUse = overflowTableSize;
+    return entry;
+}
+
+    void
+GenomeIndex::fillInBothLookedUpResults(
+    Seed              seed,
+    bool              lookedUpComplement,
+    GenomeLocation   *entry,
+    GenomeLocation    overflowBase,
+    const GenomeLocation *overflowTableToUse,
+    unsigned          overflowTableSizeToUse,
+    GenomeLocation    minLocation,
+    GenomeLocation    maxLocation,
+    unsigned         *nHits,
+    const GenomeLocation **hits,
+    unsigned         *nRCHits,
+    const GenomeLocation **rcHits,
+    DecodedHitBuffer *decodedHits)
+{
     //
     // Fill in the caller's answers for the main and complement of the seed looked up.
     // Because of our hash table design, we may have had to take the complement before the
@@ -862,38 +3226,48 @@ GenomeIndex::lookupSeed(
     // Also, if the seed is its own reverse complement, we need to fill the same hits
     // in both return arrays.
     //
-    fillInLookedUpResults((lookedUpComplement ? entry + 1 : entry), minLocation, maxLocation, nHits, hits);
+    fillInLookedUpResults((lookedUpComplement ? entry + 1 : entry), overflowBase, overflowTableToUse, overflowTableSizeToUse, minLocation, maxLocation, nHits, hits, decodedHits);
+    if (NULL != altLiftover) {
+        altLiftover->dropRedundantAltHits(nHits, hits);
+    }
     if (seed.isOwnReverseComplement()) {
       *nRCHits = *nHits;
       *rcHits = *hits;
     } else {
-      fillInLookedUpResults((lookedUpComplement ? entry : entry + 1), minLocation, maxLocation, nRCHits, rcHits);
+      fillInLookedUpResults((lookedUpComplement ? entry : entry + 1), overflowBase, overflowTableToUse, overflowTableSizeToUse, minLocation, maxLocation, nRCHits, rcHits, decodedHits);
+      if (NULL != altLiftover) {
+          altLiftover->dropRedundantAltHits(nRCHits, rcHits);
+      }
     }
 }
 
     void
 GenomeIndex::fillInLookedUpResults(
-    unsigned        *subEntry,
-    unsigned         minLocation,
-    unsigned         maxLocation,
+    GenomeLocation  *subEntry,
+    GenomeLocation   overflowBase,
+    const GenomeLocation *overflowTable,
+    unsigned         overflowTableSize,
+    GenomeLocation   minLocation,
+    GenomeLocation   maxLocation,
     unsigned        *nHits, 
-    const unsigned **hits)
+    const GenomeLocation **hits,
+    DecodedHitBuffer *decodedHits)
 {
     //
     // WARNING: the code in the IntersectingPairedEndAligner relies on being able to look at 
     // hits[-1].  It doesn't care about the value, but it must not be a bogus pointer.  This
     // is true with the current layout (where it will either be the hit count, the key or
     // forward pointer in the hash table entry or some intermediate hit in the case where the
-    // search is constrained by minLocation/maxLocation).  If you change this, be sure to look
-    // at the code and fix it.
+    // search is constrained by minLocation/maxLocation, and DecodedHitBuffer::allocate leaves
+    // room for it in decoded lists).  If you change this, be sure to look at the code and fix it.
     //
-    if (*subEntry < genome->getCountOfBases()) {
+    if (*subEntry < overflowBase) {
         //
         // It's a singleton.
         //
         *nHits = (*subEntry >= minLocation && *subEntry <= maxLocation) ? 1 : 0;
         *hits = subEntry;
-    } else if (*subEntry == 0xfffffffe) {
+    } else if (*subEntry == UnusedHashTableValue) {
         //
         // It's unused, the other complement must exist.
         //
@@ -903,11 +3277,34 @@ GenomeIndex::fillInLookedUpResults(
         // Multiple hits.  Recall that the overflow table format is first a count of
         // the number of hits for that seed, followed by the list of hits.
         //
-        unsigned overflowTableOffset = *subEntry - genome->getCountOfBases();
+        unsigned overflowTableOffset = (unsigned)(*subEntry - overflowBase);
 
         _ASSERT(overflowTableOffset < overflowTableSize);
 
-        int hitCount = overflowTable[overflowTableOffset];
+        unsigned minHits;
+        if (NULL != decodedHits && decodedHits->skipPopularLists && overflowTable == this->overflowTable && minLocation == 0 &&
+                maxLocation == InvalidGenomeLocation && isKnownPopular(overflowTableOffset, decodedHits, &minHits)) {
+            //
+            // The caller is going to ignore this seed, so don't bother reading its list.  hits[-1] is still valid memory,
+            // but the caller mustn't look at the hits themselves.
+            //
+            *nHits = minHits;
+            *hits = subEntry;
+            return;
+        }
+
+        PerfCounters::forThisThread()->overflowTableLookups++;
+
+        if (compressedOverflowTable && overflowTable == this->overflowTable && (overflowTable[overflowTableOffset] & CompressedHitListFlag)) {
+            if (NULL == decodedHits) {
+                fprintf(stderr, "GenomeIndex: looking up a seed in an index with a compressed overflow table requires a DecodedHitBuffer\n");
+                soft_exit(1);
+            }
+            decodeCompressedHitList(&overflowTable[overflowTableOffset], minLocation, maxLocation, decodedHits, nHits, hits);
+            return;
+        }
+
+        int hitCount = (int)overflowTable[overflowTableOffset];
 
         _ASSERT(hitCount >= 2);
         _ASSERT(hitCount + overflowTableOffset < overflowTableSize);
@@ -921,7 +3318,7 @@ GenomeIndex::fillInLookedUpResults(
             // of the knowledge that the hit list is sorted in descending order. Specifically,
             // we'll do a binary search to find the first hit that is <= maxLocation, and then
             // a linear search forward from that to find the other ones (assuming they are few).
-            unsigned *allHits = &overflowTable[overflowTableOffset + 1];
+            const GenomeLocation *allHits = &overflowTable[overflowTableOffset + 1];
             int low = 0;
             int high = hitCount - 1;
             while (low < high - 32) {
@@ -936,14 +3333,184 @@ GenomeIndex::fillInLookedUpResults(
             while (low < hitCount && allHits[low] > maxLocation) {
                 low++;
             }
-            int end = low;
-            while (end < hitCount && allHits[end] >= minLocation) {
-                end++;
+            int end = low;
+            while (end < hitCount && allHits[end] >= minLocation) {
+                end++;
+            }
+            *nHits = end - low;
+            *hits = allHits + low;
+        }
+    }
+}
+
+    void
+GenomeIndex::encodeHitList(const GenomeLocation *hits, unsigned nHits, std::vector<GenomeLocation> *output)
+{
+    _ASSERT(nHits >= 2 && nHits < CompressedHitListFlag);
+
+    unsigned nBlocks = (nHits + HitsPerCompressedBlock - 1) / HitsPerCompressedBlock;
+    std::vector<unsigned char> deltas;
+    std::vector<GenomeLocation> blockOffsets;
+    for (unsigned block = 0; block < nBlocks; block++) {
+        blockOffsets.push_back((GenomeLocation)deltas.size());
+        unsigned blockEnd = __min(nHits, (block + 1) * HitsPerCompressedBlock);
+        for (unsigned i = block * HitsPerCompressedBlock + 1; i < blockEnd; i++) {
+            _ASSERT(hits[i] < hits[i-1]);
+            GenomeLocation delta = hits[i-1] - hits[i];
+            while (delta >= 0x80) {
+                deltas.push_back((unsigned char)(delta | 0x80));
+                delta >>= 7;
+            }
+            deltas.push_back((unsigned char)delta);
+        }
+    }
+
+    size_t compressedSize = 1 + 2 * nBlocks + (deltas.size() + sizeof(GenomeLocation) - 1) / sizeof(GenomeLocation);
+    if (compressedSize >= 1 + (size_t)nHits) {
+        //
+        // Not worth it, leave it flat.
+        //
+        output->push_back(nHits);
+        output->insert(output->end(), hits, hits + nHits);
+        return;
+    }
+
+    size_t start = output->size();
+    output->push_back(nHits | CompressedHitListFlag);
+    for (unsigned block = 0; block < nBlocks; block++) {
+        output->push_back(hits[block * HitsPerCompressedBlock]);
+    }
+    output->insert(output->end(), blockOffsets.begin(), blockOffsets.end());
+    output->resize(start + compressedSize, 0);
+    if (deltas.size() > 0) {
+        memcpy(&(*output)[start + 1 + 2 * nBlocks], &deltas[0], deltas.size());
+    }
+}
+
+    void
+GenomeIndex::decodeCompressedHitList(
+    const GenomeLocation *list,
+    GenomeLocation    minLocation,
+    GenomeLocation    maxLocation,
+    DecodedHitBuffer *decodedHits,
+    unsigned         *nHits,
+    const GenomeLocation **hits)
+{
+    unsigned hitCount = (unsigned)(list[0] & ~CompressedHitListFlag);
+    unsigned nBlocks = (hitCount + HitsPerCompressedBlock - 1) / HitsPerCompressedBlock;
+    const GenomeLocation *firstHits = list + 1;
+    const GenomeLocation *blockOffsets = firstHits + nBlocks;
+    const unsigned char *deltas = (const unsigned char *)(blockOffsets + nBlocks);
+
+    bool unrestricted = minLocation == 0 && maxLocation == InvalidGenomeLocation;
+    unsigned startBlock = 0;
+    if (!unrestricted) {
+        //
+        // Find the first block that starts at or below maxLocation.  The first hit in range may be at the end of the block
+        // before it, so start there.
+        //
+        unsigned low = 0;
+        unsigned high = nBlocks;
+        while (low < high) {
+            unsigned mid = low + (high - low) / 2;
+            if (firstHits[mid] <= maxLocation) {
+                high = mid;
+            } else {
+                low = mid + 1;
+            }
+        }
+        startBlock = low > 0 ? low - 1 : 0;
+    }
+
+    unsigned maxToDecode = __min(hitCount - startBlock * HitsPerCompressedBlock, decodedHits->getMaxHitsPerList());
+    GenomeLocation *decoded = decodedHits->allocate(maxToDecode);
+    unsigned nInRange = 0;
+    bool finished = false;
+
+    for (unsigned block = startBlock; block < nBlocks && !finished; block++) {
+        GenomeLocation hit = firstHits[block];
+        const unsigned char *nextDelta = deltas + blockOffsets[block];
+        unsigned hitsInBlock = __min(HitsPerCompressedBlock, hitCount - block * HitsPerCompressedBlock);
+        for (unsigned i = 0; ; ) {
+            if (hit < minLocation || (unrestricted && nInRange == maxToDecode)) {
+                //
+                // Either we're past the range, or we already know the count and nobody will look at the rest.
+                //
+                finished = true;
+                break;
+            }
+            if (hit <= maxLocation) {
+                if (nInRange < maxToDecode) {
+                    decoded[nInRange] = hit;
+                }
+                nInRange++;
+            }
+
+            if (++i == hitsInBlock) {
+                break;
             }
-            *nHits = end - low;
-            *hits = allHits + low;
+
+            GenomeLocation delta = 0;
+            unsigned shift = 0;
+            unsigned char byte;
+            do {
+                byte = *nextDelta++;
+                delta |= (GenomeLocation)(byte & 0x7f) << shift;
+                shift += 7;
+            } while (byte & 0x80);
+            hit -= delta;
+        }
+    }
+
+    *nHits = unrestricted ? hitCount : nInRange;
+    *hits = decoded;
+}
+
+DecodedHitBuffer::~DecodedHitBuffer()
+{
+    while (NULL != firstChunk) {
+        Chunk *next = firstChunk->next;
+        delete [] (char *)firstChunk;
+        firstChunk = next;
+    }
+}
+
+    void
+DecodedHitBuffer::reset()
+{
+    //
+    // Keep the chunks around for next time, allocate() starts over at the first one.
+    //
+    currentChunk = NULL;
+}
+
+    GenomeLocation *
+DecodedHitBuffer::allocate(unsigned nHits)
+{
+    unsigned needed = nHits + 1;    // Including the one before the first hit
+
+    if (NULL == currentChunk || currentChunk->size - currentChunk->used < needed) {
+        Chunk *next = (NULL == currentChunk) ? firstChunk : currentChunk->next;
+        if (NULL == next || next->size < needed) {
+            unsigned size = __max(DefaultChunkSize, needed);
+            Chunk *newChunk = (Chunk *)new char[sizeof(Chunk) + (size - 1) * sizeof(GenomeLocation)];
+            newChunk->size = size;
+            newChunk->next = next;
+            if (NULL == currentChunk) {
+                firstChunk = newChunk;
+            } else {
+                currentChunk->next = newChunk;
+            }
+            next = newChunk;
         }
+        next->used = 0;
+        currentChunk = next;
     }
+
+    GenomeLocation *hits = currentChunk->hits + currentChunk->used + 1;
+    hits[-1] = 0;
+    currentChunk->used += needed;
+    return hits;
 }
 
 GenomeIndex::~GenomeIndex()
@@ -958,142 +3525,109 @@ GenomeIndex::~GenomeIndex()
     delete [] hashTables;
     hashTables = NULL;
 
-    if (NULL != overflowTable) {
+    if (NULL != mappedOverflowTable) {
+        CloseMemoryMappedFile(mappedOverflowTable);
+        mappedOverflowTable = NULL;
+    } else if (NULL != overflowTable) {
         BigDealloc(overflowTable);
-        overflowTable = NULL;
     }
+    overflowTable = NULL;
+
+    if (NULL != mappedHashTables) {
+        CloseMemoryMappedFile(mappedHashTables);    // The hash tables that pointed into it are already gone.
+        mappedHashTables = NULL;
+    }
+
+    delete auxiliaryTable;
+    auxiliaryTable = NULL;
+    delete [] auxiliaryOverflowTable;
+    auxiliaryOverflowTable = NULL;
+    delete altLiftover;
+    altLiftover = NULL;
+    delete seedFilter;
+    seedFilter = NULL;
 
     delete genome;
     genome = NULL;
 }
 
     void
-GenomeIndex::ComputeBiasTable(const Genome* genome, int seedLen, double* table, unsigned maxThreads, bool forceExact, unsigned hashTableKeySize)
+GenomeIndex::ComputeBiasTable(const Genome* genome, int seedLen, double* table, unsigned maxThreads, bool forceExact, unsigned hashTableKeySize,
+                              unsigned minimizerWindow)
 /**
  * Fill in table with the table size biases for a given genome and seed size.
  * We assume that table is already of the correct size for our seed size
  * (namely 4**(seedLen-hashTableKeySize*4)), and just fill in the values.
  *
  * If the genome is less than 2^20 bases, we count the seeds in each table exactly;
- * otherwise, we estimate them using Flajolet-Martin approximate counters.
+ * otherwise, we estimate them using HyperLogLog approximate counters.
+ *
+ * Either way the work is done in two parallel phases without any locks.  First each thread
+ * scans its chunk of the genome, either adding seeds to its own set of approximate counters
+ * or (for exact counting) sorting them by the thread that owns their hash table.  Then each
+ * thread produces the counts for the hash tables it owns, by merging every thread's counters
+ * or by sorting the seeds it was handed and counting the distinct ones.
  */
 {
     _int64 start = timeInMillis();
     fprintf(stderr, "Computing bias table.\n");
 
     unsigned nHashTables = ((unsigned)seedLen <= (hashTableKeySize * 4) ? 1 : 1 << (((unsigned)seedLen - hashTableKeySize * 4) * 2));
-    unsigned countOfBases = genome->getCountOfBases();
+    GenomeLocation countOfBases = genome->getCountOfBases();
 
-    static const unsigned GENOME_SIZE_FOR_EXACT_COUNT = 1 << 20;  // Needs to be a power of 2 for hash sets
+    static const unsigned GENOME_SIZE_FOR_EXACT_COUNT = 1 << 20;
 
     bool computeExactly = (countOfBases < GENOME_SIZE_FOR_EXACT_COUNT) || forceExact;
-    if (countOfBases >= (1 << 30) && forceExact) {
-        fprintf(stderr,"You can't use -exact for genomes with >= 2^30 bases.\n");
-        soft_exit(1);
-    }
-    FixedSizeVector<int> numExactSeeds(nHashTables, 0);
-    vector<ApproximateCounter> approxCounters(nHashTables);
-
-    _int64 validSeeds = 0;
-
-    if (computeExactly) {
-        FixedSizeSet<_int64> exactSeedsSeen(2 * (forceExact ? FirstPowerOf2GreaterThanOrEqualTo(countOfBases) : GENOME_SIZE_FOR_EXACT_COUNT));
-        for (unsigned i = 0; i < (unsigned)(countOfBases - seedLen); i++) {
-            if (i % 10000000 == 0) {
-                fprintf(stderr, "Bias computation: %lld / %lld\n",(_int64)i, (_int64)countOfBases);
-            }
-            const char *bases = genome->getSubstring(i,seedLen);
-            //
-            // Check it for NULL, because Genome won't return strings that cross contig boundaries.
-            //
-            if (NULL == bases) {
-                continue;
-            }
-
-            //
-            // We don't build seeds out of sections of the genome that contain 'N.'  If this is one, skip it.
-            //
-            if (!Seed::DoesTextRepresentASeed(bases, seedLen)) {
-                continue;
-            }
-
-            Seed seed(bases, seedLen);
-            validSeeds++;
-
-            //
-            // Figure out if we're using this base or its complement.
-            //
-            Seed rc = ~seed;
-            bool usingComplement = seed.isBiggerThanItsReverseComplement();
-            if (usingComplement) {
-                seed = ~seed;       // Couldn't resist using ~ for this.
-            }
-
-            _ASSERT(seed.getHighBases(hashTableKeySize) < nHashTables);
-             if (!exactSeedsSeen.contains(seed.getBases())) {
-                exactSeedsSeen.add(seed.getBases());
-                numExactSeeds[seed.getHighBases(hashTableKeySize)]++;
-            }
-        }
-    } else {
-        //
-        // Run through the table in parallel.
-        //
-        unsigned nThreads = __min(GetNumberOfProcessors(), maxThreads);
-        volatile int runningThreadCount = nThreads;
-        volatile _int64 nBasesProcessed = 0;
-        SingleWaiterObject doneObject;
-
-        ExclusiveLock *locks;
-        locks = new ExclusiveLock[nHashTables];
-        for (unsigned i = 0; i < nHashTables; i++) {
-            InitializeExclusiveLock(&locks[i]);
-        }
-
-        CreateSingleWaiterObject(&doneObject);
+    FixedSizeVector<_uint64> seedCounts(nHashTables, 0);
 
-        ComputeBiasTableThreadContext *contexts = new ComputeBiasTableThreadContext[nThreads];
-        unsigned nextChunkToProcess = 0;
-        for (unsigned i = 0; i < nThreads; i++) {
-            contexts[i].approxCounters = &approxCounters;
-            contexts[i].doneObject = &doneObject;
-            contexts[i].genomeChunkStart = nextChunkToProcess;
-            if (i == nThreads - 1) {
-                nextChunkToProcess = countOfBases - seedLen - 1;
-            } else {
-                nextChunkToProcess += (countOfBases - seedLen) / nThreads;
-            }
-            contexts[i].genomeChunkEnd = nextChunkToProcess;
-            contexts[i].nHashTables = nHashTables;
-            contexts[i].hashTableKeySize = hashTableKeySize;
-            contexts[i].runningThreadCount = &runningThreadCount;
-            contexts[i].genome = genome;
-            contexts[i].nBasesProcessed = &nBasesProcessed;
-            contexts[i].seedLen = seedLen;
-            contexts[i].validSeeds = &validSeeds;
-            contexts[i].approximateCounterLocks = locks;
+    unsigned nThreads = __min(GetNumberOfProcessors(), maxThreads);
+    volatile _int64 nBasesProcessed = 0;
 
-            StartNewThread(ComputeBiasTableWorkerThreadMain, &contexts[i]);
+    ComputeBiasTableThreadContext *contexts = new ComputeBiasTableThreadContext[nThreads];
+    GenomeLocation nextChunkToProcess = 0;
+    GenomeLocation lastSeedLocation = countOfBases > (unsigned)seedLen ? countOfBases - seedLen : 0;
+    for (unsigned i = 0; i < nThreads; i++) {
+        contexts[i].whichThread = i;
+        contexts[i].nThreads = nThreads;
+        contexts[i].allContexts = contexts;
+        contexts[i].genomeChunkStart = nextChunkToProcess;
+        if (i == nThreads - 1) {
+            nextChunkToProcess = lastSeedLocation;
+        } else {
+            nextChunkToProcess += lastSeedLocation / nThreads;
         }
- 
-        WaitForSingleWaiterObject(&doneObject);
-        DestroySingleWaiterObject(&doneObject);
+        contexts[i].genomeChunkEnd = nextChunkToProcess;
+        contexts[i].nHashTables = nHashTables;
+        contexts[i].hashTableKeySize = hashTableKeySize;
+        contexts[i].computeExactly = computeExactly;
+        contexts[i].approxCounters = computeExactly ? NULL : new std::vector<ApproximateCounter>(nHashTables);
+        contexts[i].seedsByOwner = computeExactly ? new std::vector<SeedBases>[nThreads] : NULL;
+        contexts[i].seedCounts = &seedCounts[0];
+        contexts[i].genome = genome;
+        contexts[i].nBasesProcessed = &nBasesProcessed;
+        contexts[i].seedLen = seedLen;
+        contexts[i].minimizerWindow = minimizerWindow;
+        contexts[i].validSeeds = 0;
+    }
+
+    RunComputeBiasTablePhase(ComputeBiasTableWorkerThreadMain, contexts, nThreads);
+    RunComputeBiasTablePhase(ComputeBiasTableCountThreadMain, contexts, nThreads);
 
-        for (unsigned i = 0; i < nHashTables; i++) {
-            DestroyExclusiveLock(&locks[i]);
-        }
-        delete [] locks;
+    _int64 validSeeds = 0;
+    for (unsigned i = 0; i < nThreads; i++) {
+        validSeeds += contexts[i].validSeeds;
+        delete contexts[i].approxCounters;
+        delete [] contexts[i].seedsByOwner;
     }
-
+    delete [] contexts;
 
     double distinctSeeds = 0;
     for (unsigned i = 0; i < nHashTables; i++) {
-        distinctSeeds += computeExactly ? numExactSeeds[i] : approxCounters[i].getCount();
+        distinctSeeds += seedCounts[i];
     }
 
     for (unsigned i = 0; i < nHashTables; i++) {
-        _uint64 count = computeExactly ? numExactSeeds[i] : approxCounters[i].getCount();
-        table[i] = (count / distinctSeeds) * ((double)validSeeds / countOfBases) * nHashTables;
+        table[i] = (seedCounts[i] / distinctSeeds) * ((double)validSeeds / countOfBases) * nHashTables;
     }
 
     // printf("Bias table:\n");
@@ -1104,187 +3638,273 @@ GenomeIndex::ComputeBiasTable(const Genome* genome, int seedLen, double* table,
     fprintf(stderr, "Computed bias table in %llds\n", (timeInMillis() + 500 - start) / 1000);
 }
 
-struct PerCounterBatch {
-    PerCounterBatch() : nUsed(0) {}
-    static const unsigned nSeedsPerBatch = 1000;
-
-    unsigned nUsed;
-    _uint64 lowBases[nSeedsPerBatch];
-
-    bool addSeed(_uint64 seedLowBases) {
-        _ASSERT(nUsed < nSeedsPerBatch);
-        lowBases[nUsed] = seedLowBases;
-        nUsed++;
-        return nUsed >= nSeedsPerBatch;
-    }
+    void
+GenomeIndex::RunComputeBiasTablePhase(ThreadMainFunction threadMain, ComputeBiasTableThreadContext *threadContexts, unsigned nThreads)
+{
+    SingleWaiterObject doneObject;
+    CreateSingleWaiterObject(&doneObject);
+    volatile int runningThreadCount = nThreads;
 
-    void apply(ApproximateCounter *counter) {
-        for (unsigned i = 0; i < nUsed; i++) {
-            counter->add(lowBases[i]);
-        }
-        nUsed = 0;
+    for (unsigned i = 0; i < nThreads; i++) {
+        threadContexts[i].doneObject = &doneObject;
+        threadContexts[i].runningThreadCount = &runningThreadCount;
+        StartNewThread(threadMain, &threadContexts[i]);
     }
-};
 
+    WaitForSingleWaiterObject(&doneObject);
+    DestroySingleWaiterObject(&doneObject);
+}
 
     void
 GenomeIndex::ComputeBiasTableWorkerThreadMain(void *param)
 {
     ComputeBiasTableThreadContext *context = (ComputeBiasTableThreadContext *)param;
 
-    unsigned countOfBases = context->genome->getCountOfBases();
+    GenomeLocation countOfBases = context->genome->getCountOfBases();
+    unsigned nThreads = context->nThreads;
     _int64 validSeeds = 0;
+    MinimizerSampler sampler(context->genome, context->seedLen, context->minimizerWindow);
 
     //
-    // Batch the insertions into the approximate counters, because otherwise we spend all of
-    // our time acquiring and releasing locks.
+    // Only report progress every so often, so the threads aren't all fighting over nBasesProcessed.
     //
- 
-    PerCounterBatch *batches = new PerCounterBatch[context->nHashTables];
-
-    _uint64 unrecordedSkippedSeeds = 0;
-
     const _uint64 printBatchSize = 100000000;
-    for (unsigned i = context->genomeChunkStart; i < context->genomeChunkEnd; i++) {
-
-            const char *bases = context->genome->getSubstring(i, context->seedLen);
-            //
-            // Check it for NULL, because Genome won't return strings that cross contig boundaries.
-            //
-            if (NULL == bases) {
-                continue;
+    const unsigned basesPerProgressUpdate = 1000000;
+    unsigned unrecordedBases = 0;
+
+    for (GenomeLocation i = context->genomeChunkStart; i < context->genomeChunkEnd; i++) {
+        if (++unrecordedBases == basesPerProgressUpdate) {
+            _int64 basesProcessed = InterlockedAdd64AndReturnNewValue(context->nBasesProcessed, unrecordedBases);
+            if ((_uint64)basesProcessed / printBatchSize > ((_uint64)basesProcessed - unrecordedBases) / printBatchSize) {
+                fprintf(stderr, "Bias computation: %lld / %lld\n",(basesProcessed/printBatchSize)*printBatchSize, (_int64)countOfBases);
             }
+            unrecordedBases = 0;
+        }
 
-            //
-            // We don't build seeds out of sections of the genome that contain 'N.'  If this is one, skip it.
-            //
-            if (!Seed::DoesTextRepresentASeed(bases, context->seedLen)) {
-                unrecordedSkippedSeeds++;
-                continue;
-            }
+        //
+        // Contigs masked out with -exclude don't get indexed, so they don't count toward the hash table sizes either.
+        //
+        if (context->genome->isLocationExcluded(i)) {
+            continue;
+        }
 
-            Seed seed(bases, context->seedLen);
-            validSeeds++;
+        const char *bases = context->genome->getSubstring(i, context->seedLen);
+        //
+        // Check it for NULL, because Genome won't return strings that cross contig boundaries.
+        //
+        if (NULL == bases) {
+            continue;
+        }
 
+        //
+        // We don't build seeds out of sections of the genome that contain 'N.'  If this is one, skip it.
+        //
+        if (!Seed::DoesTextRepresentASeed(bases, context->seedLen)) {
+            continue;
+        }
 
-            //
-            // Figure out if we're using this base or its complement.
-            //
-            Seed rc = ~seed;
-            bool usingComplement = seed.isBiggerThanItsReverseComplement();
-            if (usingComplement) {
-                seed = ~seed;       // Couldn't resist using ~ for this.
-            }
+        //
+        // Nor, in a minimizer index, out of the ones that aren't minimizers.
+        //
+        if (!sampler.isKept(i)) {
+            continue;
+        }
 
-            unsigned whichHashTable = seed.getHighBases(context->hashTableKeySize);
+        Seed seed(bases, context->seedLen);
+        validSeeds++;
 
-            _ASSERT(whichHashTable < context->nHashTables);
+        //
+        // Figure out if we're using this base or its complement.
+        //
+        bool usingComplement = seed.isBiggerThanItsReverseComplement();
+        if (usingComplement) {
+            seed = ~seed;       // Couldn't resist using ~ for this.
+        }
 
-            if (batches[whichHashTable].addSeed(seed.getLowBases(context->hashTableKeySize))) {
-                PerCounterBatch *batch = &batches[whichHashTable];
-                AcquireExclusiveLock(&context->approximateCounterLocks[whichHashTable]);
-                batch->apply(&(*context->approxCounters)[whichHashTable]);    
-                ReleaseExclusiveLock(&context->approximateCounterLocks[whichHashTable]);
+        unsigned whichHashTable = seed.getHighBases(context->hashTableKeySize);
 
-                _int64 basesProcessed = InterlockedAdd64AndReturnNewValue(context->nBasesProcessed, PerCounterBatch::nSeedsPerBatch + unrecordedSkippedSeeds);
+        _ASSERT(whichHashTable < context->nHashTables);
 
-                if ((_uint64)basesProcessed / printBatchSize > ((_uint64)basesProcessed - PerCounterBatch::nSeedsPerBatch - unrecordedSkippedSeeds)/printBatchSize) {
-                    fprintf(stderr, "Bias computation: %lld / %lld\n",(basesProcessed/printBatchSize)*printBatchSize, (_int64)countOfBases);
-                }
-                unrecordedSkippedSeeds= 0;  // We've now recorded them.
-            }
+        if (context->computeExactly) {
+            context->seedsByOwner[whichHashTable % nThreads].push_back(seed.getBases());
+        } else {
+            (*context->approxCounters)[whichHashTable].add(FoldSeedBases(seed.getLowBases(context->hashTableKeySize)));
+        }
     }
 
-    for (unsigned i = 0; i < context->nHashTables; i++) {
-        _int64 basesProcessed = InterlockedAdd64AndReturnNewValue(context->nBasesProcessed, batches[i].nUsed + unrecordedSkippedSeeds);
+    InterlockedAdd64AndReturnNewValue(context->nBasesProcessed, unrecordedBases);
 
-        if ((_uint64)basesProcessed / printBatchSize > ((_uint64)basesProcessed - batches[i].nUsed - unrecordedSkippedSeeds)/printBatchSize) {
-            fprintf(stderr, "Bias computation: %lld / %lld\n",(basesProcessed/printBatchSize)*printBatchSize, (_int64)countOfBases);
-        }
+    context->validSeeds = validSeeds;
+
+    if (0 == InterlockedDecrementAndReturnNewValue(context->runningThreadCount)) {
+        SignalSingleWaiterObject(context->doneObject);
+    }
+}
 
-        unrecordedSkippedSeeds = 0; // All except the first time through the loop this will be 0.
+    void
+GenomeIndex::ComputeBiasTableCountThreadMain(void *param)
+{
+    ComputeBiasTableThreadContext *context = (ComputeBiasTableThreadContext *)param;
 
-        AcquireExclusiveLock(&context->approximateCounterLocks[i]);
-        batches[i].apply(&(*context->approxCounters)[i]);
-        ReleaseExclusiveLock(&context->approximateCounterLocks[i]);
+    unsigned nThreads = context->nThreads;
+    unsigned whichThread = context->whichThread;
 
+    if (context->computeExactly) {
+        //
+        // Gather up all of the seeds for the tables we own, sort them and count each distinct one against
+        // its table.  Equal seeds have equal high bases, so they all land in the same table.
+        //
+        size_t nSeeds = 0;
+        for (unsigned i = 0; i < nThreads; i++) {
+            nSeeds += context->allContexts[i].seedsByOwner[whichThread].size();
+        }
 
-    }
+        std::vector<SeedBases> seeds;
+        seeds.reserve(nSeeds);
+        for (unsigned i = 0; i < nThreads; i++) {
+            std::vector<SeedBases> *theirSeeds = &context->allContexts[i].seedsByOwner[whichThread];
+            seeds.insert(seeds.end(), theirSeeds->begin(), theirSeeds->end());
+            std::vector<SeedBases>().swap(*theirSeeds);   // Free it now, rather than holding everything until we're all done.
+        }
 
-    delete [] batches;
+        std::sort(seeds.begin(), seeds.end());
 
-    InterlockedAdd64AndReturnNewValue(context->validSeeds, validSeeds);
+        unsigned highBaseShift = context->hashTableKeySize * 8;
+        for (size_t i = 0; i < seeds.size(); i++) {
+            if (i == 0 || seeds[i] != seeds[i-1]) {
+                unsigned whichHashTable = highBaseShift >= sizeof(SeedBases) * 8 ? 0 : (unsigned)LowWord(seeds[i] >> highBaseShift);
+                _ASSERT(whichHashTable < context->nHashTables && whichHashTable % nThreads == whichThread);
+                context->seedCounts[whichHashTable]++;
+            }
+        }
+    } else {
+        //
+        // HyperLogLog counters merge exactly, so take the max of everyone's registers for each table we own.
+        //
+        for (unsigned whichHashTable = whichThread; whichHashTable < context->nHashTables; whichHashTable += nThreads) {
+            ApproximateCounter *counter = &(*context->approxCounters)[whichHashTable];
+            for (unsigned i = 0; i < nThreads; i++) {
+                if (i != whichThread) {
+                    counter->merge(&(*context->allContexts[i].approxCounters)[whichHashTable]);
+                }
+            }
+            context->seedCounts[whichHashTable] = counter->getCount();
+        }
+    }
 
     if (0 == InterlockedDecrementAndReturnNewValue(context->runningThreadCount)) {
         SignalSingleWaiterObject(context->doneObject);
     }
 }
 
-struct PerHashTableBatch {
-    PerHashTableBatch() : nUsed(0) {}
+struct HashTableSizeAndIndex {
+    size_t      size;
+    unsigned    whichHashTable;
+};
 
-    static const unsigned nSeedsPerBatch = 1000;
+    int
+HashTableSizeDescending(const void *first, const void *second)
+{
+    size_t firstSize = ((const HashTableSizeAndIndex *)first)->size;
+    size_t secondSize = ((const HashTableSizeAndIndex *)second)->size;
+    if (firstSize > secondSize) {
+        return -1;
+    } else if (firstSize == secondSize) {
+        return 0;
+    } else {
+        return 1;
+    }
+}
 
-    unsigned nUsed;
+    unsigned *
+GenomeIndex::AssignHashTablesToThreads(SNAPHashTable **hashTables, unsigned nHashTables, unsigned firstTable, unsigned endTable, unsigned nThreads)
+{
+    //
+    // The hash tables are sized by the bias table, so their sizes are a good proxy for how many seeds each will get.
+    // Give each thread about the same total amount of table by handing out the biggest remaining table to the least
+    // loaded thread.  Tables outside of [firstTable, endTable) don't get an owner.
+    //
+    unsigned nTablesToAssign = endTable - firstTable;
+    HashTableSizeAndIndex *tables = new HashTableSizeAndIndex[nTablesToAssign];
+    for (unsigned i = 0; i < nTablesToAssign; i++) {
+        tables[i].size = hashTables[firstTable + i]->GetTableSize();
+        tables[i].whichHashTable = firstTable + i;
+    }
+    qsort(tables, nTablesToAssign, sizeof(*tables), HashTableSizeDescending);
 
-    struct Entry {
-        bool usingComplement;
-        _uint64 lowBases;
-        unsigned genomeLocation;
-    };
+    unsigned *hashTableOwner = new unsigned[nHashTables];
+    for (unsigned i = 0; i < nHashTables; i++) {
+        hashTableOwner[i] = BuildHashTablesThreadContext::NoOwner;
+    }
 
-    Entry entries[nSeedsPerBatch];
+    _uint64 *threadLoad = new _uint64[nThreads];
+    for (unsigned i = 0; i < nThreads; i++) {
+        threadLoad[i] = 0;
+    }
 
-    bool addSeed(unsigned genomeLocation, _uint64 seedLowBases, bool seedUsingComplement) {
-        _ASSERT(nUsed < nSeedsPerBatch);
-        entries[nUsed].lowBases = seedLowBases;
-        entries[nUsed].usingComplement = seedUsingComplement;
-        entries[nUsed].genomeLocation = genomeLocation;
-        nUsed++;
-        return nUsed >= nSeedsPerBatch;
+    for (unsigned i = 0; i < nTablesToAssign; i++) {
+        unsigned leastLoadedThread = 0;
+        for (unsigned j = 1; j < nThreads; j++) {
+            if (threadLoad[j] < threadLoad[leastLoadedThread]) {
+                leastLoadedThread = j;
+            }
+        }
+        hashTableOwner[tables[i].whichHashTable] = leastLoadedThread;
+        threadLoad[leastLoadedThread] += tables[i].size;
     }
 
-    void clear()
-    {
-        nUsed = 0;
+    delete [] threadLoad;
+    delete [] tables;
+    return hashTableOwner;
+}
+
+    void
+GenomeIndex::RunBuildHashTablesPhase(ThreadMainFunction threadMain, BuildHashTablesThreadContext *threadContexts, unsigned nThreads)
+{
+    SingleWaiterObject doneObject;
+    CreateSingleWaiterObject(&doneObject);
+    volatile int runningThreadCount = nThreads;
+
+    for (unsigned i = 0; i < nThreads; i++) {
+        threadContexts[i].doneObject = &doneObject;
+        threadContexts[i].runningThreadCount = &runningThreadCount;
+        StartNewThread(threadMain, &threadContexts[i]);
     }
-};
 
+    WaitForSingleWaiterObject(&doneObject);
+    DestroySingleWaiterObject(&doneObject);
+}
 
-    void 
-GenomeIndex::BuildHashTablesWorkerThreadMain(void *param)
+    void
+GenomeIndex::BuildHashTablesClassifyThreadMain(void *param)
 {
     BuildHashTablesThreadContext *context = (BuildHashTablesThreadContext *)param;
 
-    unsigned countOfBases = context->genome->getCountOfBases();
     const Genome *genome = context->genome;
     unsigned seedLen = context->seedLen;
+    unsigned nThreads = context->nThreads;
     _int64 noBaseAvailable = 0;
     _int64 nonSeeds = 0;
-    _int64 bothComplementsUsed = 0;
-    _int64 countOfDuplicateOverflows = 0;
- 
-    GenomeIndex *index = context->index;
-    unsigned nHashTables = index->nHashTables;
+    MinimizerSampler sampler(genome, seedLen, context->minimizerWindow);
 
-    //
-    // Batch the insertions into the hash tables, because otherwise we spend all of
-    // our time acquiring and releasing locks.
-    //
- 
-    PerHashTableBatch *batches = new PerHashTableBatch[index->nHashTables];
+    for (unsigned i = 0; i <= nThreads; i++) {
+        context->ownerOffsets[i] = 0;
+    }
 
-    const _int64 printPeriod = 100000000;
-    _uint64 unrecordedSkippedSeeds = 0;
+    for (GenomeLocation genomeLocation = context->genomeChunkStart; genomeLocation < context->genomeChunkEnd; genomeLocation++) {
+        unsigned *owner = &context->locationOwners[genomeLocation - context->genomeChunkStart];
+        *owner = BuildHashTablesThreadContext::NoOwner;
+
+        if (genome->isLocationExcluded(genomeLocation)) {
+            continue;
+        }
 
-    for (unsigned genomeLocation = context->genomeChunkStart; genomeLocation < context->genomeChunkEnd; genomeLocation++) {
         const char *bases = genome->getSubstring(genomeLocation, seedLen);
         //
         // Check it for NULL, because Genome won't return strings that cross contig boundaries.
         //
         if (NULL == bases) {
             noBaseAvailable++;
-            unrecordedSkippedSeeds++;
             continue;
         }
 
@@ -1293,95 +3913,109 @@ GenomeIndex::BuildHashTablesWorkerThreadMain(void *param)
         //
         if (!Seed::DoesTextRepresentASeed(bases, seedLen)) {
             nonSeeds++;
-            unrecordedSkippedSeeds++;
+            continue;
+        }
+
+        if (!sampler.isKept(genomeLocation)) {
             continue;
         }
 
         Seed seed(bases, seedLen);
+        if (seed.isBiggerThanItsReverseComplement()) {
+            seed = ~seed;
+        }
 
-        //
-        // Figure out if we're using this base or its complement.
-        //
-        bool usingComplement = seed.isBiggerThanItsReverseComplement();
-        if (usingComplement) {
-            seed = ~seed;       // Couldn't resist using ~ for this.
+        *owner = context->hashTableOwner[seed.getHighBases(context->hashTableKeySize)];
+        if (BuildHashTablesThreadContext::NoOwner != *owner) {
+            context->ownerOffsets[*owner + 1]++;
         }
+    }
 
-       unsigned whichHashTable = seed.getHighBases(context->hashTableKeySize);
-       _ASSERT(whichHashTable < index->nHashTables);
- 
-         if (batches[whichHashTable].addSeed(genomeLocation, seed.getLowBases(context->hashTableKeySize), usingComplement)) {
-            AcquireExclusiveLock(&context->hashTableLocks[whichHashTable]);
-            for (unsigned i = 0; i < batches[whichHashTable].nUsed; i++) {
-                ApplyHashTableUpdate(context, whichHashTable, batches[whichHashTable].entries[i].genomeLocation, 
-                    batches[whichHashTable].entries[i].lowBases, batches[whichHashTable].entries[i].usingComplement,
-                    &bothComplementsUsed, &countOfDuplicateOverflows);
-            }
-            ReleaseExclusiveLock(&context->hashTableLocks[whichHashTable]);
+    //
+    // Turn the counts into offsets, and then drop the locations into their owners' sections.
+    //
+    for (unsigned i = 0; i < nThreads; i++) {
+        context->ownerOffsets[i + 1] += context->ownerOffsets[i];
+        context->ownerCursors[i] = context->ownerOffsets[i];
+    }
 
-            _int64 newNBasesProcessed = InterlockedAdd64AndReturnNewValue(context->nBasesProcessed, batches[whichHashTable].nUsed + unrecordedSkippedSeeds);
+    for (GenomeLocation genomeLocation = context->genomeChunkStart; genomeLocation < context->genomeChunkEnd; genomeLocation++) {
+        unsigned owner = context->locationOwners[genomeLocation - context->genomeChunkStart];
+        if (BuildHashTablesThreadContext::NoOwner != owner) {
+            context->locationsByOwner[context->ownerCursors[owner]++] = genomeLocation;
+        }
+    }
 
-            if ((unsigned)(newNBasesProcessed / printPeriod) > (unsigned)((newNBasesProcessed - batches[whichHashTable].nUsed - unrecordedSkippedSeeds) / printPeriod)) {
-                fprintf(stderr, "Indexing %lld / %lld\n", (newNBasesProcessed / printPeriod) * printPeriod, countOfBases);
-            }
-            unrecordedSkippedSeeds = 0;
-            batches[whichHashTable].clear();
-        } // If we filled a batch
-    } // For each genome base in our area
+    if (context->countSkippedSeeds) {
+        InterlockedAdd64AndReturnNewValue(context->noBaseAvailable, noBaseAvailable);
+        InterlockedAdd64AndReturnNewValue(context->nonSeeds, nonSeeds);
+    }
 
-    //
-    // Now apply the updates from the batches that were left over
-    //
+    if (0 == InterlockedDecrementAndReturnNewValue(context->runningThreadCount)) {
+        SignalSingleWaiterObject(context->doneObject);
+    }
+}
 
-    for (unsigned whichHashTable = 0; whichHashTable < nHashTables; whichHashTable++) {
-        _int64 basesProcessed = InterlockedAdd64AndReturnNewValue(context->nBasesProcessed, batches[whichHashTable].nUsed + unrecordedSkippedSeeds);
+    void
+GenomeIndex::BuildHashTablesInsertThreadMain(void *param)
+{
+    BuildHashTablesThreadContext *context = (BuildHashTablesThreadContext *)param;
 
-        if ((_uint64)basesProcessed / printPeriod > ((_uint64)basesProcessed - batches[whichHashTable].nUsed - unrecordedSkippedSeeds)/printPeriod) {
-            fprintf(stderr, "Indexing %lld / %lld\n",(basesProcessed/printPeriod)*printPeriod, (_int64)countOfBases);
-        }
+    const Genome *genome = context->genome;
+    unsigned seedLen = context->seedLen;
+    unsigned whichThread = context->whichThread;
+    _int64 bothComplementsUsed = 0;
+    _int64 countOfDuplicateOverflows = 0;
+
+    for (unsigned i = 0; i < context->nThreads; i++) {
+        const BuildHashTablesThreadContext *classifier = &context->allContexts[i];
+        for (unsigned j = classifier->ownerOffsets[whichThread]; j < classifier->ownerOffsets[whichThread + 1]; j++) {
+            GenomeLocation genomeLocation = classifier->locationsByOwner[j];
+
+            //
+            // The classify phase already checked that this is a valid seed, so just rebuild it rather than having passed it along.
+            //
+            Seed seed(genome->getSubstring(genomeLocation, seedLen), seedLen);
+            bool usingComplement = seed.isBiggerThanItsReverseComplement();
+            if (usingComplement) {
+                seed = ~seed;       // Couldn't resist using ~ for this.
+            }
 
-        unrecordedSkippedSeeds = 0; // All except the first time through the loop this will be 0.        
-        AcquireExclusiveLock(&context->hashTableLocks[whichHashTable]);
-        for (unsigned i = 0; i < batches[whichHashTable].nUsed; i++) {
-            ApplyHashTableUpdate(context, whichHashTable, batches[whichHashTable].entries[i].genomeLocation, 
-                batches[whichHashTable].entries[i].lowBases, batches[whichHashTable].entries[i].usingComplement,
+            unsigned whichHashTable = seed.getHighBases(context->hashTableKeySize);
+            _ASSERT(whichHashTable < context->index->nHashTables && context->hashTableOwner[whichHashTable] == whichThread);
+
+            ApplyHashTableUpdate(context, whichHashTable, genomeLocation, seed.getLowBases(context->hashTableKeySize), usingComplement,
                 &bothComplementsUsed, &countOfDuplicateOverflows);
         }
-        ReleaseExclusiveLock(&context->hashTableLocks[whichHashTable]);
     }
 
-    InterlockedAdd64AndReturnNewValue(context->noBaseAvailable, noBaseAvailable);
-    InterlockedAdd64AndReturnNewValue(context->nonSeeds, nonSeeds);
     InterlockedAdd64AndReturnNewValue(context->bothComplementsUsed, bothComplementsUsed);
     InterlockedAdd64AndReturnNewValue(context->countOfDuplicateOverflows, countOfDuplicateOverflows);
 
-    delete [] batches;
-
     if (0 == InterlockedDecrementAndReturnNewValue(context->runningThreadCount)) {
         SignalSingleWaiterObject(context->doneObject);
     }
-
 }
 
     void 
-GenomeIndex::ApplyHashTableUpdate(BuildHashTablesThreadContext *context, _uint64 whichHashTable, unsigned genomeLocation, _uint64 lowBases, bool usingComplement,
+GenomeIndex::ApplyHashTableUpdate(BuildHashTablesThreadContext *context, _uint64 whichHashTable, GenomeLocation genomeLocation, SeedBases lowBases, bool usingComplement,
                 _int64 *bothComplementsUsed, _int64 *countOfDuplicateOverflows)
 {
     GenomeIndex *index = context->index;
-    unsigned countOfBases = context->genome->getCountOfBases();
+    GenomeLocation countOfBases = context->genome->getCountOfBases();
     SNAPHashTable *hashTable = index->hashTables[whichHashTable];
-    unsigned *entry = hashTable->SlowLookup(lowBases);  // use SlowLookup because we might have overflowed the table.
+    GenomeLocation *entry = hashTable->SlowLookup(lowBases);  // use SlowLookup because we might have overflowed the table.
     if (NULL == entry) {
         //
         // We haven't yet seen either this seed or its complement.  Make a new hash table
         // entry.
         //
-        unsigned newEntry[2];
+        GenomeLocation newEntry[2];
         if (!usingComplement) {
             newEntry[0] = genomeLocation;
-            newEntry[1] = 0xfffffffe; // Use 0xfffffffe for unused, because we gave 0xffffffff to the hash table package.
+            newEntry[1] = UnusedHashTableValue; // Not InvalidGenomeLocation, because we gave that to the hash table package.
         } else{
-            newEntry[0] = 0xfffffffe; // Use 0xfffffffe for unused, because we gave 0xffffffff to the hash table package.
+            newEntry[0] = UnusedHashTableValue; // Not InvalidGenomeLocation, because we gave that to the hash table package.
             newEntry[1] = genomeLocation;
         }
 
@@ -1390,7 +4024,7 @@ GenomeIndex::ApplyHashTableUpdate(BuildHashTablesThreadContext *context, _uint64
                 fprintf(stderr, "HashTable[%d] has %lld used elements\n",j,(_int64)index->hashTables[j]->GetUsedElementCount());
             }
             fprintf(stderr, "IndexBuilder: exceeded size of hash table %d.\n"
-                    "If you're indexing a non-human genome, make sure not to pass the -hg19 option.  Otheriwse, use -exact or increase slack with -h.\n",
+                    "If you used -bias, make sure the bias table came from the same reference.  Otheriwse, use -exact or increase slack with -h.\n",
                     whichHashTable);
             soft_exit(1);
         }
@@ -1401,7 +4035,7 @@ GenomeIndex::ApplyHashTableUpdate(BuildHashTablesThreadContext *context, _uint64
         // it in the overflow table.
         //
         int entryIndex = usingComplement ? 1 : 0;
-        if (0xfffffffe == entry[entryIndex]) {
+        if (UnusedHashTableValue == entry[entryIndex]) {
             entry[entryIndex] = genomeLocation;
             (*bothComplementsUsed)++;
         } else if (entry[entryIndex] < countOfBases) {
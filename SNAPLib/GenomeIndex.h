@@ -28,6 +28,110 @@ Revision History:
 #include "Seed.h"
 #include "Genome.h"
 #include "ApproximateCounter.h"
+#include "AltLiftover.h"
+#include "SeedFilter.h"
+
+class GenomeIndex;
+
+//
+// Space for hit lists decoded from a compressed overflow table.  Each thread doing lookups passes its own, and the hits it hands
+// back stay valid until reset() is called, typically when the caller starts on its next read.  Lookups in indices without
+// compressed overflow tables never use it.
+//
+// Only the first maxHitsPerList hits of any list are decoded (nHits still says how many there are), so callers must not look
+// further into a list than that.  The aligners ignore hits past their popular seed limits anyway, so they set it to that.
+//
+// Callers that ignore seeds with more than maxHitsPerList hits altogether can also set skipPopularLists.  Then a lookup over
+// the whole genome of a seed that the index can tell has more hits than that just from where its list is (see
+// GenomeIndex::overflowPopularity) doesn't read the list at all.  It comes back with nHits set to a lower bound on the
+// length of the list, which is still more than maxHitsPerList, and no hits.  That saves a cache miss for every popular seed.
+// It uses the buffer whether or not the overflow table is compressed.
+//
+class DecodedHitBuffer {
+public:
+    DecodedHitBuffer(unsigned i_maxHitsPerList = 0xffffffff) : maxHitsPerList(i_maxHitsPerList), skipPopularLists(false), popularRangesIndex(NULL),
+        firstChunk(NULL), currentChunk(NULL) {}
+    ~DecodedHitBuffer();
+
+    void setMaxHitsPerList(unsigned i_maxHitsPerList) {maxHitsPerList = i_maxHitsPerList; popularRangesIndex = NULL;}
+    unsigned getMaxHitsPerList() const {return maxHitsPerList;}
+
+    void setSkipPopularLists(bool i_skipPopularLists) {skipPopularLists = i_skipPopularLists;}
+    bool getSkipPopularLists() const {return skipPopularLists;}
+
+    void reset();
+
+    //
+    // Returns space for nHits hits.  Like hit lists in the overflow table, the element before the first is valid memory.
+    //
+    GenomeLocation *allocate(unsigned nHits);
+
+private:
+    struct Chunk {
+        Chunk      *next;
+        unsigned    size;
+        unsigned    used;
+        GenomeLocation hits[1]; // Really size of them
+    };
+
+    static const unsigned DefaultChunkSize = 64 * 1024;
+
+    //
+    // A range of offsets in the overflow table where every list has at least minHits hits, which is more than maxHitsPerList.
+    // They're worked out from the index the first time it's used with skipPopularLists (or a new maxHitsPerList).
+    //
+    struct PopularRange {
+        GenomeLocation  begin;
+        GenomeLocation  end;
+        unsigned        minHits;
+    };
+
+    friend class GenomeIndex;
+
+    unsigned    maxHitsPerList;
+    bool        skipPopularLists;
+    const GenomeIndex *popularRangesIndex;  // The index that popularRanges are for, or NULL if they need to be worked out
+    std::vector<PopularRange> popularRanges;
+    Chunk      *firstChunk;
+    Chunk      *currentChunk;
+};
+
+//
+// Where each part of the index goes when it's loaded, for machines with more than one kind of memory.  The hash tables
+// take a cache miss or two on every seed lookup, so they want the fastest memory there is, but the overflow table is
+// only read for seeds with more than one hit, and the genome only for the candidates that survive, so they can stand
+// slower, bigger memory.  Memory expanders (CXL) and persistent memory in memory mode show up as NUMA nodes without
+// processors, so putting a part on node N puts it there; mapping it leaves it in the page cache (or on the SSD, if
+// there's not room) and shares it with other processes.  Only parts in the indexed sections format (see IndexSection)
+// can be placed one at a time; -map still maps everything.
+//
+struct IndexPlacement {
+    enum Tier { Memory, Map, Node };
+    enum Part { HashTables, OverflowTable, GenomePart, NParts };
+
+    Tier    tier[NParts];
+    int     node[NParts];   // For Node
+
+    IndexPlacement() {
+        for (int i = 0; i < NParts; i++) {
+            tier[i] = Memory;
+            node[i] = 0;
+        }
+    }
+
+    bool isDefault() const;
+
+    //
+    // Parse a comma separated list of part=tier, where part is hash, overflow or genome and tier is memory, map or
+    // node:N, like "overflow=node:2,genome=map".  Parts that aren't mentioned stay where they were.  Returns false
+    // (having printed why) if it doesn't parse.
+    //
+    bool parse(const char *spec);
+
+    void print(FILE *out) const;
+
+    static const char *PartNames[NParts];
+};
 
 class GenomeIndex {
 public:
@@ -42,12 +146,74 @@ public:
     // the only way to get one is to build it into a directory and then load it from the directory.
     // NB: This deletes the Genome that's passed into it.
     //
+    // The bias table used to size the hash tables is saved in the directory.  If biasTableSource is non-NULL, it's read from
+    // there (an index directory or a saved bias table file) rather than being computed.  bucketizedHashTables selects
+    // SNAPHashTable's cache line bucket layout for the hash tables, and quotientedKeys its quotiented keys.  A minimizerWindow of more than one indexes only
+    // the seeds that are minimizers of runs of that many seed locations (see Seed::FindMinimizers), rather than all of
+    // them.
+    //
     static bool BuildIndexToDirectory(const Genome *genome, int seedLen, double slack,
-                                      bool computeBias, const char *directory, _uint64 overflowTableFactor,
+                                      const char *biasTableSource, const char *directory, _uint64 overflowTableFactor,
                                       unsigned maxThreads, unsigned chromosomePaddingSize, bool forceExact, 
-                                      unsigned hashTableKeySize, const char *histogramFileName = NULL);
+                                      unsigned hashTableKeySize, _uint64 maxMemoryInGB = 0, const char *histogramFileName = NULL,
+                                      bool bucketizedHashTables = false, unsigned minimizerWindow = 1, bool quotientedKeys = false);
+
+    //
+    // Add the contigs in a FASTA file to an existing index without rebuilding it.  The new contigs' seeds go in an auxiliary
+    // table that lookupSeed consults before the main tables, so this only costs time proportional to the new contigs (plus
+    // rewriting the genome).  Appending again rebuilds the auxiliary table to cover all of the appended contigs.
+    //
+    static bool AppendToIndexDirectory(const char *fastaFile, const char *directoryName, const char *pieceNameTerminatorCharacters,
+                                       bool spaceIsAPieceNameTerminator, unsigned maxThreads);
+
+    //
+    // Rewrite an index's overflow table so that its long hit lists are delta encoded, which makes the table (and what needs to
+    // be in memory for the popular seeds) smaller at the cost of decoding the hits at lookup time.
+    //
+    static bool CompressOverflowTable(const char *directoryName);
+
+    //
+    // Build a SeedFilter of the seeds in an existing index's main hash tables and save it with the index, so that lookups of
+    // seeds that aren't in the genome can usually skip the hash tables.  The tables are scanned on maxThreads threads.
+    //
+    static bool BuildSeedFilter(const char *directoryName, unsigned bitsPerKey, unsigned maxThreads);
+
+    //
+    // The whichShard'th of nShards runs of whole contigs in genome, for indexing a reference in pieces on separate machines
+    // (index -shard).  NULL if the shard would have no contigs, which happens when there are more shards than big contigs.
+    //
+    static Genome *CopyShard(const Genome *genome, int whichShard, int nShards);
+
+    //
+    // Print statistics about an existing index, for tuning the seed size, maxHits and maxBigHits without rebuilding it: its
+    // parts' sizes, how full its hash tables are and how far lookups probe in them, and how many hits its seeds have.  The
+    // tables are scanned on maxThreads threads.  If histogramFileName isn't NULL the whole seed popularity histogram is
+    // written there, in the format that index -H uses (though this counts a seed and its reverse complement separately even
+    // when they share a hash table entry).
+    //
+    static void runIndexStats(int argc, const char **argv);
+    static bool PrintIndexStats(const char *directoryName, unsigned maxThreads, const char *histogramFileName);
 
-    static GenomeIndex *loadFromDirectory(char *directoryName);
+    //
+    // If map is set, the index files are memory mapped rather than read into private memory, so that several SNAP processes
+    // using the same index share one copy of it in the page cache.  prefetch (only meaningful with map) faults the whole
+    // index in at load time rather than on demand during alignment.  packGenome loads the genome packed (see Genome::loadFromFile)
+    // rather than reading or mapping it.  If placement isn't NULL (and map isn't set), it says where each part of the index
+    // goes.
+    //
+    static GenomeIndex *loadFromDirectory(char *directoryName, bool map = false, bool prefetch = false, bool packGenome = false,
+                                          const IndexPlacement *placement = NULL);
+
+    //
+    // Map just the genome from an index directory, for things like merging sorted output that need the contigs and not the
+    // hash tables.  Returns NULL (having said why) on failure.
+    //
+    static const Genome *loadGenomeFromDirectory(const char *directoryName);
+
+    //
+    // About how much memory loading the index in a directory takes, from the sizes of its files, for planning with -mem.
+    //
+    static _int64 getLoadedSize(const char *directoryName);
 
     inline const Genome *getGenome() {return genome;}
 
@@ -56,72 +222,282 @@ public:
     // It guarantees that if the lookup succeeds that hits[-1] and rcHits[-1] are valid memory with 
     // arbirtary values.
     //
-    void lookupSeed(Seed seed, unsigned *nHits, const unsigned **hits, unsigned *nRCHits, const unsigned **rcHits);
+    // If the index's overflow table is compressed, the hits are decoded into decodedHits, which is then required.
+    //
+    void lookupSeed(Seed seed, unsigned *nHits, const GenomeLocation **hits, unsigned *nRCHits, const GenomeLocation **rcHits,
+                    DecodedHitBuffer *decodedHits = NULL);
 
     //
     // Looks up a seed and its reverse complement, restricting the search to a given range of locations,
-    // and returns the number and list of hits for each.
+    // and returns the number and list of hits for each.  With a compressed overflow table only the part
+    // of the hit list that's in range is decoded.
+    //
+    void lookupSeed(Seed seed, GenomeLocation minLocation, GenomeLocation maxLocation,
+                    unsigned *nHits, const GenomeLocation **hits, unsigned *nRCHits, const GenomeLocation **rcHits,
+                    DecodedHitBuffer *decodedHits = NULL);
+
     //
-    void lookupSeed(Seed seed, unsigned minLocation, unsigned maxLocation,
-                    unsigned *nHits, const unsigned **hits, unsigned *nRCHits, const unsigned **rcHits);
+    // Looks up a batch of seeds, getting the same results as calling lookupSeed on each of them.  It prefetches all of the
+    // seeds' hash table entries before resolving any of them, and then all of their overflow table hit lists, so that the
+    // cache misses for the seeds overlap rather than being taken one after another.  The result arrays have nSeeds elements.
+    //
+    void lookupSeeds(const Seed *seeds, unsigned nSeeds, GenomeLocation minLocation, GenomeLocation maxLocation,
+                     unsigned *nHits, const GenomeLocation **hits, unsigned *nRCHits, const GenomeLocation **rcHits,
+                     DecodedHitBuffer *decodedHits = NULL);
+
+    //
+    // Prefetches the hash table entry that looking up this seed will use, for callers that know their next seed well
+    // before they need its hits.
+    //
+    void prefetchSeed(Seed seed) const;
+
+    //
+    // Where looking up this seed starts in the hash tables, as one number that orders lookups by table and then by slot
+    // within it (i.e., by address).
+    //
+    _uint64 getSeedLookupKey(Seed seed) const;
+
+    //
+    // For an index that's memory mapped and faulted in as it's used: ask for the hash table pages of the next this many
+    // seeds that lookupSeeds looks up to be read in ahead of time, so the first lookups' page faults overlap rather
+    // than stalling one after another.  Past that the index is mostly in memory and the hints would just cost a system
+    // call apiece.
+    //
+    void setReadaheadHints(_int64 nLookups) {readaheadHintsLeft = nLookups;}
     
     //
-    // This issues a compiler prefetch for the genome data.
+    // This issues compiler prefetches for length bases of genome data, which callers about to score a read make
+    // the whole window it'll be compared against.
     //
-    inline void prefetchGenomeData(unsigned genomeOffset) const {
-        genome->prefetchData(genomeOffset);
+    inline void prefetchGenomeData(GenomeLocation genomeOffset, unsigned length = 128) const {
+        genome->prefetchData(genomeOffset, length);
     }
 
     inline int getSeedLength() const { return seedLen; }
 
+    //
+    // More than one if the index only has the seeds that are minimizers of runs of this many seed locations, in which
+    // case looking up any others is a waste of time.
+    //
+    inline unsigned getMinimizerWindow() const { return minimizerWindow; }
+
+    //
+    // NULL unless the index was built with -altLiftover.
+    //
+    inline const AltLiftover *getAltLiftover() const { return altLiftover; }
+
+    //
+    // Whether the index was built with -quotientedKeys.  Tables too small to gain from it aren't quotiented, so this
+    // looks at all of them.
+    //
+    inline bool hasQuotientedKeys() const {
+        for (unsigned i = 0; i < nHashTables; i++) {
+            if (NULL != hashTables[i] && hashTables[i]->HasQuotientedKeys()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
     ~GenomeIndex();
 
     //
     // Allocate set of hash tables indexed by seeds with bias
     //
     static SNAPHashTable** allocateHashTables(unsigned* o_nTables, size_t capacity, double slack,
-        int seedLen, unsigned hashTableKeySize, double* biasTable = NULL);
+        int seedLen, unsigned hashTableKeySize, double* biasTable = NULL, bool bucketized = false);
+
+    //
+    // The sizes that allocateHashTables would use, without allocating anything.  The caller frees the returned array.
+    //
+    static unsigned *computeHashTableSizes(unsigned* o_nTables, size_t capacity, double slack,
+        int seedLen, unsigned hashTableKeySize, double* biasTable);
     
 private:
 
     static const unsigned GenomeIndexFormatMajorVersion = 2;
+    //
+    // The minor version is a set of bits for the optional formats; a plain index is minor version 0.
+    //
     static const unsigned GenomeIndexFormatMinorVersion = 0;
+    static const unsigned GenomeIndexFormatBucketizedMinorVersion = 1;           // The hash tables use the bucketized layout
+    static const unsigned GenomeIndexFormatCompressedOverflowMinorVersion = 2;   // The overflow table's long hit lists are compressed
+    static const unsigned GenomeIndexFormatMinimizerMinorVersion = 4;            // Only minimizers are indexed, and the window follows the key size
+    static const unsigned GenomeIndexFormatSectionsMinorVersion = 8;             // GenomeIndexSections has the sections' offsets and checksums
+    static const unsigned GenomeIndexFormatFastRangeMinorVersion = 16;           // The hash tables find home slots with fastrange rather than a modulo
+    static const unsigned GenomeIndexFormatQuotientedKeysMinorVersion = 32;      // Some of the hash tables have quotiented keys
+    static const unsigned GenomeIndexFormatLongLocationsMinorVersion = 64;       // Locations are 64 bits, from a SNAP built with LONG_GENOME_LOCATIONS
+    static const unsigned GenomeIndexFormatAllMinorVersionBits = 127;
+
+    //
+    // The location size is the one bit that a SNAP has to match rather than just understand, since the hash and overflow
+    // tables are read straight into GenomeLocations.
+    //
+    static const unsigned GenomeIndexFormatLocationsMinorVersion = sizeof(GenomeLocation) > 4 ? GenomeIndexFormatLongLocationsMinorVersion : 0;
+
+    //
+    // A hash table value is a genome location if it's less than the number of bases, and otherwise the number of bases
+    // plus an index into the overflow table.  The top two values are taken: InvalidGenomeLocation marks an empty slot to
+    // SNAPHashTable, and UnusedHashTableValue is the half of an entry whose seed only occurs in the other direction.  The
+    // bases and overflow table together have to stay under MaxHashTableValue.
+    //
+    static const GenomeLocation UnusedHashTableValue = InvalidGenomeLocation - 1;
+    static const GenomeLocation MaxHashTableValue = InvalidGenomeLocation - 15;
+
+    //
+    // A section of the index: the overflow table, or one of the hash tables in GenomeIndexHash.  Indices with
+    // GenomeIndexFormatSectionsMinorVersion list them in GenomeIndexSections, so that the loader can read them (and the
+    // genome) on separate threads, each from its own offset, and check each one against its checksum.
+    //
+    struct IndexSection {
+        _int64      offset;         // In its file
+        _int64      bytes;          // In its file, including any header
+        _uint64     checksum;       // util::Checksum of the overflow table's entries, or SNAPHashTable::GetChecksum
+    };
+
+    static bool saveSections(const char *directoryName, const IndexSection &overflowTable, const IndexSection *hashTables, unsigned nHashTables);
+    static bool loadSections(const char *directoryName, IndexSection *overflowTable, IndexSection *hashTables, unsigned nHashTables);
+
+    //
+    // Read the overflow table or one hash table into memory, checking it against its section if there is one.
+    //
+    bool readOverflowTable(const char *directoryName, const IndexSection *section);
+    bool readHashTable(const char *directoryName, unsigned whichTable, const IndexSection *section);
+
+    bool loadSectionsInParallel(const char *directoryName, unsigned chromosomePadding, bool packGenome, const IndexPlacement *placement);
+
+    //
+    // Move the parts that placement puts on a NUMA node there, once they're loaded.
+    //
+    bool moveSectionsToNodes(const IndexPlacement *placement);
+
+    struct LoadSectionsContext {
+        GenomeIndex                     *index;
+        const char                      *directoryName;
+        const IndexSection              *overflowSection;
+        const IndexSection              *hashTableSections;
+        unsigned                         chromosomePadding;
+        bool                             packGenome;
+        const IndexPlacement            *placement;         // Mapped parts are already done, and the threads skip them
+        int                              nSections;          // Section 0 is the genome, 1 the overflow table, and then the hash tables in order
+        volatile int                     nextSection;
+        volatile int                     nFailed;
+        volatile int                     runningThreadCount;
+        SingleWaiterObject               doneObject;
+    };
+
+    static void LoadSectionsThreadMain(void *param);
+    static const unsigned MaxSectionLoadThreads = 8;
+
+    //
+    // In a compressed overflow table each hit list still starts with its count, but if CompressedHitListFlag is set in the count
+    // it's followed by the first hit of each block of HitsPerCompressedBlock hits, the byte offset of each block's deltas, and
+    // then each block's remaining hits as varint encoded differences from the hit before.  Lists that wouldn't get smaller are
+    // left as they are.  References into the table are still in units of GenomeLocations, and each list starts on one.
+    //
+    static const unsigned CompressedHitListFlag = 0x80000000;
+    static const unsigned HitsPerCompressedBlock = 64;
+
+    static void encodeHitList(const GenomeLocation *hits, unsigned nHits, std::vector<GenomeLocation> *output);
+    void decodeCompressedHitList(const GenomeLocation *list, GenomeLocation minLocation, GenomeLocation maxLocation, DecodedHitBuffer *decodedHits,
+                                 unsigned *nHits, const GenomeLocation **hits);
     
-    static const unsigned largestBiasTable = 32;    // Can't be bigger than the biggest seed size, which is set in Seed.h.  Bigger than 32 means a new Seed structure.
-    static const unsigned largestKeySize = 8;
-    static double *hg19_biasTables[largestKeySize+1][largestBiasTable+1];
+    static bool saveBiasTable(const char *directoryName, const double *biasTable, unsigned nHashTables, int seedLen, unsigned hashTableKeySize);
+    static bool loadBiasTable(const char *source, double *biasTable, unsigned nHashTables, int seedLen, unsigned hashTableKeySize);
+
+    bool mapTables(const char *directoryName, bool prefetch);
+    bool mapOverflowTable(const char *directoryName, bool prefetch);
+    bool mapHashTables(const char *directoryName, bool prefetch);   // Into hashTables, which must already be allocated
+    GenomeIndex *checkOverflowTableSize();
 
-    static void ComputeBiasTable(const Genome* genome, int seedSize, double* table, unsigned maxThreads, bool forceExact, unsigned hashTableKeySize);
+    static void ComputeBiasTable(const Genome* genome, int seedSize, double* table, unsigned maxThreads, bool forceExact, unsigned hashTableKeySize,
+                                 unsigned minimizerWindow);
 
     struct ComputeBiasTableThreadContext {
         SingleWaiterObject              *doneObject;
         volatile int                    *runningThreadCount;
-        unsigned                         genomeChunkStart;
-        unsigned                         genomeChunkEnd;
+        unsigned                         whichThread;
+        unsigned                         nThreads;
+        ComputeBiasTableThreadContext   *allContexts;
+        GenomeLocation                   genomeChunkStart;
+        GenomeLocation                   genomeChunkEnd;
         unsigned                         nHashTables;
         unsigned                         hashTableKeySize;
-        std::vector<ApproximateCounter> *approxCounters;
+        bool                             computeExactly;
+        std::vector<ApproximateCounter> *approxCounters;    // This thread's own counters, one per hash table, if !computeExactly
+        std::vector<SeedBases>          *seedsByOwner;      // If computeExactly, nThreads vectors of the seeds this thread found for each thread's tables
+        _uint64                         *seedCounts;        // Shared, but each thread only fills in the tables it owns (whichHashTable % nThreads == whichThread)
         const Genome                    *genome;
         volatile _int64                 *nBasesProcessed;
         unsigned                         seedLen;
-        volatile _int64                 *validSeeds;
-
-        ExclusiveLock                   *approximateCounterLocks;
+        unsigned                         minimizerWindow;
+        _int64                           validSeeds;
     };
 
+    static void RunComputeBiasTablePhase(ThreadMainFunction threadMain, ComputeBiasTableThreadContext *threadContexts, unsigned nThreads);
     static void ComputeBiasTableWorkerThreadMain(void *param);
+    static void ComputeBiasTableCountThreadMain(void *param);
+
+    //
+    // PrintIndexStats hands out ranges of SlotsPerStatsRange slots, going through the tables in order, to threads that take
+    // the next one until they're all done.  Each thread has its own counts, which are added up at the end.
+    //
+    static const unsigned SlotsPerStatsRange = 1 << 20;
+    static const unsigned MaxExactHitCount = 65536;     // Seeds with more hits than this are kept in a list
+    static const unsigned MaxProbesCounted = 16;        // Lookups that probe further are counted together
+
+    struct IndexStatsThreadContext {
+        SingleWaiterObject              *doneObject;
+        volatile int                    *runningThreadCount;
+        const GenomeIndex               *index;
+        volatile _int64                 *nextSlotRange;
+        const _uint64                   *firstRangeOfTable;     // nHashTables + 1 of them
+        _uint64                         *hitCounts;             // Number of seeds with each number of hits up to MaxExactHitCount
+        std::vector<unsigned>           *largeHitCounts;        // The hit counts of the seeds with more
+        _uint64                          probeCounts[MaxProbesCounted + 1];
+        _uint64                          nEntries;
+        _uint64                          totalProbes;
+        unsigned                         maxProbes;
+    };
+
+    static void IndexStatsThreadMain(void *param);
+
+    //
+    // BuildSeedFilter hands out ranges of slots the same way.
+    //
+    struct BuildSeedFilterThreadContext {
+        SingleWaiterObject              *doneObject;
+        volatile int                    *runningThreadCount;
+        const GenomeIndex               *index;
+        SeedFilter                      *filter;
+        volatile _int64                 *nextSlotRange;
+        const _uint64                   *firstRangeOfTable;     // nHashTables + 1 of them
+    };
+
+    static void BuildSeedFilterThreadMain(void *param);
 
     struct OverflowEntry;
     struct OverflowBackpointer;
 
+    //
+    // The hash tables are built in rounds.  In each round every thread first scans its chunk of the genome and sorts
+    // the seed locations it sees by the thread that owns the seed's hash table (the classify phase), and then every thread
+    // inserts the seeds for the tables it owns from all of the other threads' lists (the insert phase).  Since each hash table
+    // (and hence each overflow entry) is only ever touched by its owner, the inserts don't need any locks.
+    //
     struct BuildHashTablesThreadContext {
         SingleWaiterObject              *doneObject;
         volatile int                    *runningThreadCount;
-        unsigned                         genomeChunkStart;
-        unsigned                         genomeChunkEnd;
+        unsigned                         whichThread;
+        unsigned                         nThreads;
+        BuildHashTablesThreadContext    *allContexts;       // The contexts of every thread, indexed by whichThread
+        const unsigned                  *hashTableOwner;    // The thread that inserts into each hash table, or NoOwner if it's not being built this pass
+        bool                             countSkippedSeeds; // Only count seeds that aren't seeds once, not every pass
+        GenomeLocation                   genomeChunkStart;
+        GenomeLocation                   genomeChunkEnd;
         const Genome                    *genome;
-        volatile _int64                 *nBasesProcessed;
         unsigned                         seedLen;
+        unsigned                         minimizerWindow;
         volatile _int64                 *noBaseAvailable;
         volatile _int64                 *nonSeeds;
         volatile unsigned               *nextOverflowIndex;
@@ -135,20 +511,54 @@ private:
         volatile _int64                 *countOfDuplicateOverflows;
         unsigned                         hashTableKeySize;
 
-        ExclusiveLock                   *hashTableLocks;
-        ExclusiveLock                   *overflowTableLock;
+        //
+        // Output of the classify phase.  locationOwners is per base in the chunk (NoOwner if it's not a seed); locationsByOwner
+        // holds the seed locations grouped by owner, with owner i's in [ownerOffsets[i], ownerOffsets[i+1]).
+        //
+        static const unsigned            NoOwner = 0xffffffff;
+        unsigned                        *locationOwners;
+        GenomeLocation                  *locationsByOwner;
+        unsigned                        *ownerOffsets;
+        unsigned                        *ownerCursors;
     };
 
-    static void BuildHashTablesWorkerThreadMain(void *param);
-    static void ApplyHashTableUpdate(BuildHashTablesThreadContext *context, _uint64 whichHashTable, unsigned genomeLocation, _uint64 lowBases, bool usingComplement,
+    static void BuildHashTablesClassifyThreadMain(void *param);
+    static void BuildHashTablesInsertThreadMain(void *param);
+    static void RunBuildHashTablesPhase(ThreadMainFunction threadMain, BuildHashTablesThreadContext *threadContexts, unsigned nThreads);
+    static unsigned *AssignHashTablesToThreads(SNAPHashTable **hashTables, unsigned nHashTables, unsigned firstTable, unsigned endTable, unsigned nThreads);
+    static void ApplyHashTableUpdate(BuildHashTablesThreadContext *context, _uint64 whichHashTable, GenomeLocation genomeLocation, SeedBases lowBases, bool usingComplement,
                     _int64 *bothComplementsUsed, _int64 *countOfDuplicateOverflows);
 
-    static int BackwardsUnsignedCompare(const void *, const void *);
+    //
+    // Once the hash tables are built, the overflow table is filled in in parallel.  Each thread takes a contiguous range of
+    // overflow entries (chosen so every thread has about the same number of locations to copy) whose place in the overflow
+    // table was computed up front, and so can patch the hash table and sort its locations without coordinating with the others.
+    //
+    struct FinalizeOverflowTableThreadContext {
+        SingleWaiterObject              *doneObject;
+        volatile int                    *runningThreadCount;
+        OverflowEntry                   *overflowEntries;
+        OverflowBackpointer             *overflowBackpointers;
+        unsigned                         firstEntry;
+        unsigned                         endEntry;
+        unsigned                         firstOverflowTableIndex;   // Where firstEntry's count goes in the overflow table
+        unsigned                         largestEntry;              // Most instances in any of this thread's entries, for sizing the sort buffer
+        GenomeLocation                   overflowTableIndexBias;    // What to add to an index in overflowTable to get a hash table entry
+        GenomeLocation                  *overflowTable;
+    };
+
+    static void FinalizeOverflowTableWorkerThreadMain(void *param);
+
+    //
+    // SNAP expects the locations for each seed to be in descending order (a historical artifact).
+    //
+    static void SortLocationsBackwards(GenomeLocation *values, unsigned nValues, GenomeLocation *scratch);
 
     GenomeIndex();
 
     int seedLen;
     unsigned hashTableKeySize;
+    unsigned minimizerWindow;
     unsigned nHashTables;
     SNAPHashTable **hashTables;
     const Genome *genome;
@@ -160,7 +570,83 @@ private:
     //
     unsigned overflowTableSize;
     size_t overflowTableVirtualAllocSize;
-    unsigned *overflowTable;
+    GenomeLocation *overflowTable;
+    bool compressedOverflowTable;
+
+    //
+    // The overflow table is laid out with the lists in increasing order of length, one run for each group of hash tables
+    // that the build did separately, and overflowPopularity has where the length changes: each breakpoint says that the
+    // lists from its offset up to the next breakpoint have nHits hits.  The lookups use it to tell how long a list is from
+    // its offset alone (see DecodedHitBuffer::skipPopularLists).  A run ends where the length goes down, or at the end of
+    // the table.  It's saved in the index's OverflowTablePopularity file, and is empty for indices built before there was
+    // one, which just means no lists are skipped.
+    //
+    struct PopularityBreakpoint {
+        GenomeLocation  offset;     // In the overflow table
+        unsigned        nHits;
+    };
+
+    std::vector<PopularityBreakpoint> overflowPopularity;
+
+    static bool savePopularity(const char *directoryName, const std::vector<PopularityBreakpoint> &popularity);
+    static bool loadPopularity(const char *directoryName, std::vector<PopularityBreakpoint> *popularity);
+
+    //
+    // Fills in decodedHits->popularRanges for its maxHitsPerList from overflowPopularity.
+    //
+    void findPopularRanges(DecodedHitBuffer *decodedHits) const;
+
+    //
+    // Whether the main overflow table list at overflowTableOffset is known to have more than decodedHits->maxHitsPerList hits
+    // without looking at it, and if so a lower bound on how many.  Only for lookups over the whole genome with
+    // skipPopularLists set.
+    //
+    inline bool isKnownPopular(GenomeLocation overflowTableOffset, DecodedHitBuffer *decodedHits, unsigned *minHits) const {
+        if (decodedHits->popularRangesIndex != this) {
+            findPopularRanges(decodedHits);
+        }
+        for (size_t i = 0; i < decodedHits->popularRanges.size(); i++) {
+            const DecodedHitBuffer::PopularRange &range = decodedHits->popularRanges[i];
+            if (overflowTableOffset >= range.begin && overflowTableOffset < range.end) {
+                *minHits = range.minHits;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    //
+    // Non-NULL if the overflow table/hash tables point into mapped index files rather than BigAlloc'ed memory.
+    //
+    MemoryMappedFile *mappedOverflowTable;
+    MemoryMappedFile *mappedHashTables;
+
+    //
+    // Seeds from contigs added with AppendToIndexDirectory live in auxiliaryTable, keyed by the whole (canonical) seed.  A seed
+    // that's there has its complete hit lists there, including any hits from the main tables, so if the lookup finds it
+    // the main tables aren't consulted.  mainBaseCount is the genome size when the main tables were built, which is where
+    // their overflow table references start; the auxiliary table's start at the current genome size.  auxiliaryTable is
+    // NULL for an index that's never been appended to.
+    //
+    GenomeLocation mainBaseCount;
+    SNAPHashTable *auxiliaryTable;
+    unsigned auxiliaryOverflowTableSize;
+    GenomeLocation *auxiliaryOverflowTable;
+
+    bool loadAuxiliaryTables(const char *directoryName);
+
+    //
+    // Used to drop the hits on ALT contigs that repeat ones on the primary assembly from every hit list we return.
+    //
+    AltLiftover *altLiftover;
+
+    //
+    // NULL unless the index has a SeedFilter file.  It only covers the main hash tables, so it's checked after the auxiliary
+    // table.
+    //
+    SeedFilter *seedFilter;
+
+    volatile _int64 readaheadHintsLeft;
 
     //
     // We have to build the overflow table in two stages.  While we're walking the genome, we first
@@ -174,13 +660,15 @@ private:
 
     struct OverflowBackpointer {
         unsigned                 nextIndex;
-        unsigned                 genomeOffset;
+        GenomeLocation           genomeOffset;
     };
 
     struct OverflowEntry {
-        unsigned                *hashTableEntry;
+        GenomeLocation          *hashTableEntry;
         unsigned                 backpointerIndex;
         unsigned                 nInstances;
+
+        bool operator<(const OverflowEntry &peer) const {return nInstances < peer.nInstances;}   // For laying out the overflow table
     };
 
     static void AddOverflowBackpointer(
@@ -188,10 +676,30 @@ private:
                     OverflowBackpointer *overflowBackpointers,
                     unsigned             nOverflowBackpointers,
                     volatile unsigned   *nextOverflowBackpointer,
-                    unsigned             genomeOffset);
+                    GenomeLocation       genomeOffset);
+
+    //
+    // Finds the hash table entry for a seed that's already been turned into the form that's in the table (the smaller of it and
+    // its reverse complement), and says which overflow table its references are into.  Returns NULL if the seed isn't there.
+    // KeyBytes is hashTableKeySize when it's one of the common sizes, so the main tables' lookups are specialized for it (see
+    // SNAPHashTable::Lookup), or 0.  lookupSeed and lookupSeeds choose it with a switch once per call.
+    //
+    template <unsigned KeyBytes> GenomeLocation *lookupCanonicalSeed(Seed seed, GenomeLocation *overflowBase, const GenomeLocation **overflowTableToUse,
+                                                                     unsigned *overflowTableSizeToUse);
+
+    template <unsigned KeyBytes> void lookupSeedsWithKeySize(const Seed *seeds, unsigned nSeeds, GenomeLocation minLocation, GenomeLocation maxLocation,
+                                                             unsigned *nHits, const GenomeLocation **hits, unsigned *nRCHits, const GenomeLocation **rcHits,
+                                                             DecodedHitBuffer *decodedHits);
+
+    void fillInBothLookedUpResults(Seed seed, bool lookedUpComplement, GenomeLocation *entry, GenomeLocation overflowBase, const GenomeLocation *overflowTableToUse,
+                                   unsigned overflowTableSizeToUse, GenomeLocation minLocation, GenomeLocation maxLocation,
+                                   unsigned *nHits, const GenomeLocation **hits, unsigned *nRCHits, const GenomeLocation **rcHits, DecodedHitBuffer *decodedHits);
 
-    void fillInLookedUpResults(unsigned *subEntry, unsigned minLocation, unsigned maxLocation,
-                               unsigned *nHits, const unsigned **hits);
+    //
+    // overflowBase says where references into the overflow table start for the table that subEntry came from.
+    //
+    void fillInLookedUpResults(GenomeLocation *subEntry, GenomeLocation overflowBase, const GenomeLocation *overflowTable, unsigned overflowTableSize,
+                               GenomeLocation minLocation, GenomeLocation maxLocation, unsigned *nHits, const GenomeLocation **hits, DecodedHitBuffer *decodedHits);
 
 };
 
@@ -24,7 +24,9 @@ Environment:
 #include "RangeSplitter.h"
 #include "Bam.h"
 #include "zlib.h"
+#include "Libdeflate.h"
 #include "exit.h"
+#include "TraceRecorder.h"
 
 using std::min;
 using std::max;
@@ -32,164 +34,132 @@ using std::pair;
 
 class GzipWriterFilterSupplier;
 
-class GzipCompressWorkerManager : public ParallelWorkerManager
+//
+// Compresses each chunk into its own gzip member (a BGZF block for BAM) on the encoder's threads, and records where each
+// one landed so the index can translate logical offsets.
+//
+class GzipChunkEncoder : public FileEncoder::Codec
 {
 public:
-    GzipCompressWorkerManager(GzipWriterFilterSupplier* i_filterSupplier)
-        : filterSupplier(i_filterSupplier), buffer(NULL),
-        chunkSize(i_filterSupplier->chunkSize), bam(i_filterSupplier->bamFormat)
+    GzipChunkEncoder(GzipWriterFilterSupplier* i_filterSupplier)
+        : Codec(i_filterSupplier->chunkSize), filterSupplier(i_filterSupplier), bam(i_filterSupplier->bamFormat)
     {}
 
-    virtual ~GzipCompressWorkerManager();
+    virtual void* createThreadState();
 
-    virtual void initialize(void* i_writer);
+    virtual void deleteThreadState(void* state);
 
-    virtual ParallelWorker* createWorker();
+    virtual size_t encodeChunk(void* state, char* toBuffer, size_t toSize, char* fromBuffer, size_t fromUsed, double backlog);
 
-    virtual void beginStep();
+    virtual void onBatchEncoded(char* batch, size_t used, size_t logicalOffset, size_t logicalUsed, size_t physicalOffset,
+        const size_t* chunkSizes, int nChunks);
 
-    virtual void finishStep();
+    // uses libdeflate rather than zstream if it's non-NULL, in which case it has to have been made for level
+    static size_t compressChunk(z_stream& zstream, Libdeflate::Compressor* libdeflate, int level, bool bamFormat, char* toBuffer, size_t toSize, char* fromBuffer, size_t fromUsed);
 
 private:
-    VariableSizeVector<size_t> sizes;
-    volatile int nChunks;
-    const size_t chunkSize;
-    const bool bam;
-    FileEncoder* encoder;
-    GzipWriterFilterSupplier* filterSupplier;
-    char* input;
-    size_t inputSize;
-    size_t inputUsed;
-    char* buffer;
-    VariableSizeVector< pair<_uint64,_uint64> > translation;
-
-    friend class GzipCompressWorker;
-};
-
-class GzipCompressWorker : public ParallelWorker
-{
-public:
-    GzipCompressWorker() : heap(NULL) {}
-
-    virtual ~GzipCompressWorker() { delete heap; }
-
-    virtual void step();
-
-    static size_t compressChunk(z_stream& zstream, bool bamFormat, char* toBuffer, size_t toSize, char* fromBuffer, size_t fromUsed);
+    struct ThreadState
+    {
+        z_stream zstream;
+        ThreadHeap* heap;
+        Libdeflate::Compressor* libdeflate[10];   // by level, made when the level's first used
+    };
 
-private:
-    z_stream zstream;
-    ThreadHeap* heap;
+    GzipWriterFilterSupplier* filterSupplier;
+    const bool bam;
 };
 
-// used for case where each thread compresses by itself
-
 class GzipWriterFilter : public DataWriter::Filter
 {
 public:
     GzipWriterFilter(GzipWriterFilterSupplier* i_supplier);
 
-    virtual void onAdvance(DataWriter* writer, size_t batchOffset, char* data, unsigned bytes, unsigned location);
+    virtual void onAdvance(DataWriter* writer, size_t batchOffset, char* data, unsigned bytes, GenomeLocation location);
 
     virtual size_t onNextBatch(DataWriter* writer, size_t offset, size_t bytes);
 
 private:
 
     GzipWriterFilterSupplier* supplier;
-    // if doing inline compression, filled in with minimally initialized objects
-    GzipCompressWorkerManager* manager;
-    ParallelWorker* worker;
-    FileEncoder* encoder;
 };
 
-GzipCompressWorkerManager::~GzipCompressWorkerManager()
+    void*
+GzipChunkEncoder::createThreadState()
 {
-    if (buffer != NULL) {
-        delete buffer;
+    ThreadState* state = new ThreadState();
+    state->heap = new ThreadHeap(chunkSize * 8); // appears to use 4*chunkSize per run
+    state->zstream.zalloc = zalloc;
+    state->zstream.zfree = zfree;
+    state->zstream.opaque = state->heap;
+    for (int i = 0; i < 10; i++) {
+        state->libdeflate[i] = NULL;
     }
+    return state;
 }
 
     void
-GzipCompressWorkerManager::initialize(
-    void* i_encoder)
+GzipChunkEncoder::deleteThreadState(
+    void* p)
 {
-    encoder = (FileEncoder*) i_encoder;
-}
-
-    ParallelWorker*
-GzipCompressWorkerManager::createWorker()
-{
-    return new GzipCompressWorker();
+    ThreadState* state = (ThreadState*) p;
+    delete state->heap;
+    for (int i = 0; i < 10; i++) {
+        if (state->libdeflate[i] != NULL) {
+            Libdeflate::freeCompressor(state->libdeflate[i]);
+        }
+    }
+    delete state;
 }
 
-    void
-GzipCompressWorkerManager::beginStep()
+    size_t
+GzipChunkEncoder::encodeChunk(
+    void* p,
+    char* toBuffer,
+    size_t toSize,
+    char* fromBuffer,
+    size_t fromUsed,
+    double backlog)
 {
-    if (filterSupplier->closing) {
-        nChunks = 0;
-        return;
-    }
-    encoder->getEncodeBatch(&input, &inputSize, &inputUsed);
-    nChunks = (int) ((inputUsed + chunkSize - 1) / chunkSize);
-    sizes.clear();
-    sizes.extend(nChunks);
-
-    if (buffer == NULL) {
-        buffer = (char*) BigAlloc(inputSize);
+    ThreadState* state = (ThreadState*) p;
+    TraceScope trace("compress");
+    int level = filterSupplier->levelFor(backlog);
+    Libdeflate::Compressor* libdeflate = NULL;
+    if (Libdeflate::isLoaded()) {
+        if (state->libdeflate[level] == NULL) {
+            state->libdeflate[level] = Libdeflate::allocCompressor(level);
+        }
+        libdeflate = state->libdeflate[level];
     }
+    return compressChunk(state->zstream, libdeflate, level, bam, toBuffer, toSize, fromBuffer, fromUsed);
 }
 
     void
-GzipCompressWorkerManager::finishStep()
+GzipChunkEncoder::onBatchEncoded(
+    char* batch,
+    size_t used,
+    size_t logicalOffset,
+    size_t logicalUsed,
+    size_t physicalOffset,
+    const size_t* chunkSizes,
+    int nChunks)
 {
-    if (filterSupplier->closing) {
-        return;
-    }
-    size_t toUsed = 0, logicalOffset, physicalOffset;
-    encoder->getOffsets(&logicalOffset, &physicalOffset);
+    _ASSERT((! bam) || BgzfHeader::validate(batch, used));
+    VariableSizeVector< pair<_uint64,_uint64> > translation(nChunks);
+    size_t toUsed = 0;
     for (int i = 0; i < nChunks; i++) {
         translation.push_back(pair<_uint64,_uint64>(logicalOffset, physicalOffset + toUsed));
-        _ASSERT(i * chunkSize < inputUsed);
-        _ASSERT(sizes[i] <= chunkSize);
-        size_t logicalChunk = min(chunkSize, inputUsed - i * chunkSize);
-        logicalOffset += logicalChunk;
-        _ASSERT(((BgzfHeader*)(buffer + i * chunkSize))->validate(sizes[i], logicalChunk));
-        memcpy(input + toUsed, buffer + i * chunkSize, sizes[i]);
-        toUsed += sizes[i];
+        _ASSERT(i * chunkSize < logicalUsed);
+        logicalOffset += min(chunkSize, logicalUsed - i * chunkSize);
+        toUsed += chunkSizes[i];
     }
-    _ASSERT(BgzfHeader::validate(input, toUsed));
-    encoder->setEncodedBatchSize(toUsed);
     filterSupplier->addTranslations(&translation);
-    translation.clear();
 }
 
-    void
-GzipCompressWorker::step()
-{
-    GzipCompressWorkerManager* supplier = (GzipCompressWorkerManager*) getManager();
-    if (heap == NULL) {
-        heap = new ThreadHeap(supplier->chunkSize * 8); // appears to use 4*chunkSize per run
-        zstream.zalloc = zalloc;
-        zstream.zfree = zfree;
-        zstream.opaque = heap;
-    }
-    //fprintf(stderr, "zip task thread %d begin\n", GetCurrentThreadId());
-    _int64 start = timeInMillis();
-    int begin = (getThreadNum() * supplier->nChunks) / getNumThreads();
-    int end = ((1 + getThreadNum()) * supplier->nChunks) / getNumThreads();
-    for (int i = begin; i < end; i++) {
-        size_t bytes = min(supplier->chunkSize, supplier->inputUsed - i * supplier->chunkSize);
-        supplier->sizes[i] = compressChunk(zstream, supplier->bam,
-            supplier->buffer + i * supplier->chunkSize, supplier->chunkSize,
-            supplier->input + i * supplier->chunkSize, bytes);
-        _ASSERT(supplier->sizes[i] <= supplier->chunkSize); // can't grow!
-    }
-}
-
-
     size_t
-GzipCompressWorker::compressChunk(
+GzipChunkEncoder::compressChunk(
     z_stream& zstream,
+    Libdeflate::Compressor* libdeflate,
+    int level,
     bool bamFormat,
     char* toBuffer,
     size_t toSize,
@@ -200,6 +170,14 @@ GzipCompressWorker::compressChunk(
         fprintf(stderr, "exceeded BAM chunk size\n");
         soft_exit(1);
     }
+    if (libdeflate != NULL) {
+        size_t toUsed = Libdeflate::compress(libdeflate, bamFormat, fromBuffer, fromUsed, toBuffer, toSize);
+        if (toUsed == 0) {
+            fprintf(stderr, "GzipWriterFilter: libdeflate output didn't fit in the chunk\n");
+            soft_exit(1);
+        }
+        return toUsed;
+    }
     if (zstream.opaque != NULL) {
         ((ThreadHeap*)zstream.opaque)->reset();
     }
@@ -243,7 +221,7 @@ GzipCompressWorker::compressChunk(
     uInt oldAvail;
     int status;
 
-    status = deflateInit2(&zstream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, windowBits | GZIP_ENCODING, 8, Z_DEFAULT_STRATEGY);
+    status = deflateInit2(&zstream, level, Z_DEFLATED, windowBits | GZIP_ENCODING, 8, Z_DEFAULT_STRATEGY);
     if (status < 0) {
         fprintf(stderr, "GzipWriterFilter: deflateInit2 failed with %d\n", status);
         soft_exit(1);
@@ -290,7 +268,7 @@ GzipCompressWorker::compressChunk(
 }
 
 GzipWriterFilter::GzipWriterFilter(GzipWriterFilterSupplier* i_supplier)
-    : DataWriter::Filter(DataWriter::ResizeFilter), supplier(i_supplier), manager(NULL), worker(NULL)
+    : DataWriter::Filter(DataWriter::ResizeFilter), supplier(i_supplier)
 {}
 
 
@@ -300,7 +278,7 @@ GzipWriterFilter::onAdvance(
     size_t batchOffset,
     char* data,
     unsigned bytes,
-    unsigned location)
+    GenomeLocation location)
 {
     // nothing
 }
@@ -311,26 +289,10 @@ GzipWriterFilter::onNextBatch(
     size_t offset,
     size_t bytes)
 {
+    // the writer's FileEncoder does the compression once the batch is handed off
     char* fromBuffer;
-    size_t fromSize, fromUsed, physicalOffset, logicalOffset;
-    writer->getBatch(-1, &fromBuffer, &fromSize, &fromUsed, &physicalOffset, NULL, &logicalOffset);
-    if (fromUsed == 0 || supplier->multiThreaded || supplier->closing) {
-        return fromUsed;
-    }
-    // do compress buffer synchronously in-place
-    if (manager == NULL) {
-        manager = new GzipCompressWorkerManager(supplier);
-        worker = manager->createWorker();
-        encoder = new FileEncoder(0, false, manager);
-        encoder->initialize((AsyncDataWriter*) writer);
-        manager->initialize(encoder);
-        manager->configure(worker, 0, 1);
-    }
-    encoder->setupEncode(-1);
-    manager->beginStep();
-    worker->step();
-    manager->finishStep();
-    writer->getBatch(-1, &fromBuffer, &fromSize, &fromUsed, &physicalOffset, NULL, &logicalOffset);
+    size_t fromSize, fromUsed;
+    writer->getBatch(-1, &fromBuffer, &fromSize, &fromUsed);
     return fromUsed;
 }
 
@@ -340,9 +302,10 @@ DataWriterSupplier::gzip(
     size_t chunkSize,
     int numThreads,
     bool bindToProcessors,
-    bool multiThreaded)
+    int minLevel,
+    int maxLevel)
 {
-    return new GzipWriterFilterSupplier(bamFormat, chunkSize, numThreads, bindToProcessors, multiThreaded);
+    return new GzipWriterFilterSupplier(bamFormat, chunkSize, numThreads, bindToProcessors, minLevel, maxLevel);
 }
 
     DataWriter::Filter*
@@ -379,23 +342,109 @@ GzipWriterFilterSupplier::onClosing(
         size_t used;
         writer->getBatch(-1, &ignore, NULL, &used, (size_t*) &last.second, NULL, (size_t*) &last.first);
         last.second += used;
-        translation.push_back(last);
 
         writer->close();
         delete writer;
+
+        mergeSegments();
+        translation.push_back(last);    // after everything else
+    } else {
+        mergeSegments();
     }
+}
 
-    // sort translations
-    std::sort(translation.begin(), translation.end(), translationComparator);
+    void
+GzipWriterFilterSupplier::mergeSegments()
+{
+    //
+    // There's one segment per batch rather than per chunk, so sorting them is cheap.
+    //
+    int nSegments = 0, nTranslations = 0;
+    for (TranslationSegment* segment = segments; segment != NULL; segment = segment->next) {
+        nSegments++;
+        nTranslations += segment->entries.size();
+    }
+    TranslationSegment** sorted = new TranslationSegment*[__max(nSegments, 1)];
+    int i = 0;
+    for (TranslationSegment* segment = segments; segment != NULL; segment = segment->next) {
+        sorted[i++] = segment;
+    }
+    std::sort(sorted, sorted + nSegments, segmentComparator);
+
+    translation.reserve(translation.size() + nTranslations + 1);
+    for (i = 0; i < nSegments; i++) {
+        _ASSERT(translation.size() == 0 || translation[translation.size() - 1].first < sorted[i]->entries[0].first);
+        translation.append(&sorted[i]->entries);
+    }
+    delete [] sorted;
+    freeSegments();
+}
+
+    void
+GzipWriterFilterSupplier::freeSegments()
+{
+    while (segments != NULL) {
+        TranslationSegment* segment = segments;
+        segments = segment->next;
+        delete segment;
+    }
+}
+
+    bool
+GzipWriterFilterSupplier::writeBgzfFile(
+    const char* fileName,
+    const char* data,
+    size_t bytes)
+{
+    FILE* file = fopen(fileName, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "unable to create %s\n", fileName);
+        return false;
+    }
+
+    //
+    // Leave room in each block for data that doesn't compress.
+    //
+    static const size_t ChunkSize = 0xff00;
+    z_stream zstream;
+    zstream.zalloc = Z_NULL;
+    zstream.zfree = Z_NULL;
+    zstream.opaque = NULL;
+    char* block = new char[BAM_BLOCK];
+    bool ok = true;
+    for (size_t offset = 0; ok && offset < bytes; offset += ChunkSize) {
+        size_t used = GzipChunkEncoder::compressChunk(zstream, NULL, Z_DEFAULT_COMPRESSION, true, block, BAM_BLOCK,
+            (char*) data + offset, min(ChunkSize, bytes - offset));
+        ok = fwrite(block, 1, used, file) == used;
+    }
+    delete [] block;
+
+    static const _uint8 eof[] = {
+        0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00, 0x42, 0x43,
+        0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+    };
+    ok = ok && fwrite(eof, 1, sizeof(eof), file) == sizeof(eof);
+    ok = (fclose(file) == 0) && ok;
+    if (! ok) {
+        fprintf(stderr, "error writing %s\n", fileName);
+    }
+    return ok;
 }
 
     void
 GzipWriterFilterSupplier::addTranslations(
     VariableSizeVector< pair<_uint64,_uint64> >* moreTranslations)
 {
-    AcquireExclusiveLock(&lock);
-    translation.append(moreTranslations);
-    ReleaseExclusiveLock(&lock);
+    if (moreTranslations->size() == 0) {
+        return;
+    }
+    TranslationSegment* segment = new TranslationSegment;
+    segment->entries = *moreTranslations;   // takes over its entries
+    TranslationSegment* head;
+    do {
+        head = segments;
+        segment->next = head;
+    } while (InterlockedCompareExchangePointerAndReturnOldValue((volatile void**) &segments, segment, head) != head);
 }
 
 
@@ -426,13 +475,17 @@ GzipWriterFilterSupplier::translationComparator(
     return a.first < b.first;
 }
 
+    bool
+GzipWriterFilterSupplier::segmentComparator(
+    const TranslationSegment* a,
+    const TranslationSegment* b)
+{
+    return a->entries[0].first < b->entries[0].first;
+}
+
     FileEncoder*
 FileEncoder::gzip(
-    GzipWriterFilterSupplier* filterSupplier,
-    int numThreads,
-    bool bindToProcessor,
-    size_t chunkSize,
-    bool bam)
+    GzipWriterFilterSupplier* filterSupplier)
 {
-    return new FileEncoder(numThreads, bindToProcessor, new GzipCompressWorkerManager(filterSupplier));
+    return new FileEncoder(new GzipChunkEncoder(filterSupplier));
 }
@@ -35,26 +35,24 @@ using std::pair;
 class GzipWriterFilterSupplier : public DataWriter::FilterSupplier
 {
 public:
-    GzipWriterFilterSupplier(bool i_bamFormat, size_t i_chunkSize, int i_numThreads, bool i_bindToProcessors, bool i_multiThreaded)
+    GzipWriterFilterSupplier(bool i_bamFormat, size_t i_chunkSize, int i_numThreads, bool i_bindToProcessors, int i_minLevel, int i_maxLevel)
     :
         FilterSupplier(DataWriter::ResizeFilter),
         bamFormat(i_bamFormat),
         chunkSize(i_chunkSize),
         numThreads(i_numThreads),
         bindToProcessors(i_bindToProcessors),
-        multiThreaded(i_multiThreaded),
+        minLevel(i_minLevel),
+        maxLevel(i_maxLevel),
+        segments(NULL),
         closing(false)
-    {
-        InitializeExclusiveLock(&lock);
-    }
+    {}
 
     virtual ~GzipWriterFilterSupplier()
     {
-        DestroyExclusiveLock(&lock);
+        freeSegments();
     }
 
-    const bool multiThreaded;
-
     virtual DataWriter::Filter* getFilter();
 
     virtual void onClosing(DataWriterSupplier* supplier);
@@ -64,6 +62,20 @@ public:
     
     bool translate(_uint64 logical, _uint64* o_physical, _uint64* delta);
 
+    //
+    // Write data to a new file as BGZF blocks with an end of file marker, the way a CSI index is stored.
+    //
+    static bool writeBgzfFile(const char* fileName, const char* data, size_t bytes);
+
+    //
+    // The level to compress a chunk at given the encoder's backlog (0 to 1, as FileEncoder::Codec::encodeChunk gets it):
+    // maxLevel with no backlog, stepping down evenly to minLevel when the writer is about to wait.
+    //
+    int levelFor(double backlog) const
+    {
+        return maxLevel - (int) (backlog * (maxLevel - minLevel) + 0.5);
+    }
+
     // translate to BAM virtual offset format
     _uint64 toVirtualOffset(_uint64 logical)
     {
@@ -79,22 +91,34 @@ public:
 
 private:
     friend class GzipWriterFilter;
-    friend class GzipCompressWorkerManager;
-
-    void addTranslation(_uint64 logical, _uint64 physical)
+    friend class GzipChunkEncoder;
+
+    //
+    // Each encoded batch's translations, which are in order and cover a range of logical offsets no other batch's do.
+    // They're pushed on a list without locking as batches finish, and put together in order of their first logical
+    // offsets when the file's closed.
+    //
+    struct TranslationSegment
     {
-        AcquireExclusiveLock(&lock);
-        translation.push_back(pair<_uint64,_uint64>(logical, physical));
-        ReleaseExclusiveLock(&lock);
-    }
+        VariableSizeVector< pair<_uint64,_uint64> > entries;
+        TranslationSegment* next;
+    };
+
+    void mergeSegments();
+
+    void freeSegments();
 
     static bool translationComparator(const pair<_uint64,_uint64>& a, const pair<_uint64,_uint64>& b);
 
+    static bool segmentComparator(const TranslationSegment* a, const TranslationSegment* b);
+
     const bool bamFormat;
     const size_t chunkSize;
     const int numThreads;
     const bool bindToProcessors;
-    ExclusiveLock lock;
-    VariableSizeVector< pair<_uint64,_uint64> > translation;
+    const int minLevel;
+    const int maxLevel;
+    TranslationSegment* volatile segments;
+    VariableSizeVector< pair<_uint64,_uint64> > translation;     // all of them, once they're merged
     bool closing;
 };
@@ -21,10 +21,13 @@ Environment:
 #include "BigAlloc.h"
 #include "exit.h"
 #include "Genome.h"
+#include "Util.h"
 
 SNAPHashTable::SNAPHashTable(
     unsigned i_tableSize,
-    unsigned i_keySizeInBytes)
+    unsigned i_keySizeInBytes,
+    bool     i_bucketized,
+    bool     i_quotiented)
 /*++
 
 Routine Description:
@@ -32,34 +35,78 @@ Routine Description:
     Constructor for a new, empty closed hash table.
 
 Arguments:
-    tableSize           - How many slots should the table have.
+    tableSize           - How many slots should the table have.  Bucketized tables round this up to a whole number of buckets.
+    keySizeInBytes      - Size of the keys, 4-8 bytes (up to 16 with LONG_SEEDS)
+    bucketized          - Whether to use the cache line bucket layout rather than the classic one
+    quotiented          - Whether to store hash remainders rather than keys, if it saves space
 --*/
 {
     keySizeInBytes = i_keySizeInBytes;
-    elementSize = keySizeInBytes + dataSizeInBytes;
     tableSize = i_tableSize;
+    bucketized = i_bucketized;
     usedElementCount = 0;
     Table = NULL;
+    ownsTable = true;
+    fastRange = true;
+    escapedKeys = NULL;
+    escapedKeysSize = 0;
+    nEscapedKeys = 0;
+
+    unsigned quotientedRemainderBits, quotientedKeyBytes;
+    quotiented = i_quotiented && !bucketized && tableSize > 0 &&
+        getQuotientedLayout(tableSize, keySizeInBytes, &quotientedRemainderBits, &quotientedKeyBytes);
 
     if (tableSize <= 0) {
         tableSize = 0;
+        storedKeyBytes = keySizeInBytes;
+        elementSize = keySizeInBytes + dataSizeInBytes;
+        entriesPerBucket = 0;
+        nBuckets = 0;
         return;
     }
 
-    Table = (Entry *)BigAlloc(tableSize * elementSize,&virtualAllocSize);
+    setLayout();
+
+    Table = (Entry *)BigAlloc(getTableBytes(),&virtualAllocSize);
 
     //
     // Run through the table and set all of the value1s to InvalidGenomeLocation, which means
-    // unused.
+    // unused.  In a bucketized table this also zeroes the padding at the end of each bucket.
     //
 
+    if (bucketized) {
+        memset(Table, 0, getTableBytes());
+    }
+
     for (unsigned i = 0; i < tableSize; i++) {
-        Entry *entry = getEntry(i);
+        Entry *entry = bucketized ? getBucketEntry(i / entriesPerBucket, i % entriesPerBucket) : getEntry(i);
         clearKey(entry);
         entry->value1 = InvalidGenomeLocation;
     }
 }
 
+    void
+SNAPHashTable::setLayout()
+{
+    storedKeyBytes = keySizeInBytes;
+    if (quotiented) {
+        getQuotientedLayout(tableSize, keySizeInBytes, &remainderBits, &storedKeyBytes);
+        remainderMask = ((_uint64)1 << remainderBits) - 1;
+        keyMask = keySizeInBytes >= sizeof(_uint64) ? ~(_uint64)0 : ((_uint64)1 << (keySizeInBytes * 8)) - 1;
+        escapeDisplacement = (1 << (storedKeyBytes * 8 - remainderBits)) - 1;
+    }
+
+    elementSize = storedKeyBytes + dataSizeInBytes;
+    if (bucketized) {
+        entriesPerBucket = BucketSize / elementSize;
+        nBuckets = (tableSize + entriesPerBucket - 1) / entriesPerBucket;
+        tableSize = nBuckets * entriesPerBucket;
+    } else {
+        entriesPerBucket = 0;
+        nBuckets = 0;
+    }
+}
+
 SNAPHashTable *SNAPHashTable::loadFromFile(char *loadFileName)
 /*++
 
@@ -93,8 +140,8 @@ SNAPHashTable *SNAPHashTable::loadFromFile(GenericFile *loadFile)
     SNAPHashTable *table = new SNAPHashTable();
 
     unsigned fileMagic;
-	if (sizeof(magic) != loadFile->read(&fileMagic, sizeof(magic))) {
-        fprintf(stderr,"Magic number mismatch on hash table load.  %d != %d\n", fileMagic, magic);
+	if (sizeof(magic) != loadFile->read(&fileMagic, sizeof(magic)) || !table->setLayoutFromMagic(fileMagic)) {
+        fprintf(stderr,"Magic number mismatch on hash table load.  %d != %d\n", fileMagic, fastRangeMagic);
         soft_exit(1);
     }
  
@@ -115,8 +162,8 @@ SNAPHashTable *SNAPHashTable::loadFromFile(GenericFile *loadFile)
         soft_exit(1);
     }
 
-    if (table->keySizeInBytes < 4 || table->keySizeInBytes > 8) {
-        fprintf(stderr,"SNAPHashTable::SNAPHashTable Key size must be between 4 and 8 inclusive.  Perhaps this is an old format hash table and needs to be rebuilt.\n");
+    if (table->keySizeInBytes < 4 || table->keySizeInBytes > LargestKeySize) {
+        fprintf(stderr,"SNAPHashTable::SNAPHashTable Key size must be between 4 and %d inclusive.  Perhaps this is an old format hash table and needs to be rebuilt, or it needs a SNAP built with LONG_SEEDS.\n", LargestKeySize);
         soft_exit(1);
     }
 
@@ -128,10 +175,11 @@ SNAPHashTable *SNAPHashTable::loadFromFile(GenericFile *loadFile)
 
     if (dataSizeInBytes != dataSize) {
         //
-        // DataSizeInBytes is in the file in order to support bigger genome locations if we ever want to handle genomes larger than ~3B bases.
-        // For now, the code doesn't support it, so just fail because it wasn't what was expected.
+        // DataSizeInBytes is twice the size of a GenomeLocation, which is 8 bytes unless SNAP was built with LONG_GENOME_LOCATIONS,
+        // when it's 16.  A table built by the other kind of SNAP can't be read by this one.
         //
-        fprintf(stderr,"SNAPHashTable::SNAPHashTable data size in bytes must be 8.  Perhaps you have a hash table from a future version of SNAP?  Or else it's corrupt.\n");
+        fprintf(stderr,"SNAPHashTable::SNAPHashTable data size in bytes is %d, but this SNAP needs %d.  The hash table is either from a SNAP built %s LONG_GENOME_LOCATIONS, or corrupt.\n",
+            dataSize, dataSizeInBytes, 8 == dataSizeInBytes ? "with" : "without");
         soft_exit(1);
     }
 
@@ -140,18 +188,32 @@ SNAPHashTable *SNAPHashTable::loadFromFile(GenericFile *loadFile)
         soft_exit(1);
     }
 
-    table->elementSize = table->keySizeInBytes + table->dataSizeInBytes;
+    unsigned quotientedRemainderBits, quotientedKeyBytes;
+    if (table->quotiented && !getQuotientedLayout(table->tableSize, table->keySizeInBytes, &quotientedRemainderBits, &quotientedKeyBytes)) {
+        fprintf(stderr,"SNAPHashTable::SNAPHashTable quotiented hash table with key size %d is too small to be quotiented; it's corrupt\n", table->keySizeInBytes);
+        soft_exit(1);
+    }
 
-    table->Table = (Entry *)BigAlloc(table->tableSize * table->elementSize, &table->virtualAllocSize);
+    if (table->bucketized) {
+        unsigned padBytes;
+        if (sizeof(padBytes) != loadFile->read(&padBytes, sizeof(padBytes)) || (padBytes > 0 && 0 != loadFile->advance(padBytes))) {
+            fprintf(stderr,"SNAPHashTable::SNAPHashTable unable to read bucketized table header\n");
+            soft_exit(1);
+        }
+    }
 
-    size_t maxReadSize = 100 * 1024 * 1024;
+    table->setLayout();
+
+    table->Table = (Entry *)BigAlloc(table->getTableBytes(), &table->virtualAllocSize);
+
+    size_t maxReadSize = 256 * 1024 * 1024;
     size_t readOffset = 0;
-    while (readOffset < table->tableSize * table->elementSize) {
+    while (readOffset < table->getTableBytes()) {
 
-        size_t amountToRead = __min(table->tableSize * table->elementSize - readOffset,
+        size_t amountToRead = __min(table->getTableBytes() - readOffset,
 			__min(maxReadSize,table->virtualAllocSize - readOffset));
 
-        size_t bytesRead = loadFile->read((char*)table->Table + readOffset, amountToRead);
+        size_t bytesRead = loadFile->readInParallel((char*)table->Table + readOffset, amountToRead);
 
         if (bytesRead < amountToRead) {
             fprintf(stderr,"SNAPHashTable::SNAPHashTable: generic io read failed, %d, %lu, %lu\n", errno, bytesRead, amountToRead);
@@ -161,12 +223,141 @@ SNAPHashTable *SNAPHashTable::loadFromFile(GenericFile *loadFile)
         readOffset += bytesRead;
     }
 
+    if (table->quotiented) {
+        if (sizeof(table->escapedKeysSize) != loadFile->read(&table->escapedKeysSize, sizeof(table->escapedKeysSize)) ||
+            sizeof(table->nEscapedKeys) != loadFile->read(&table->nEscapedKeys, sizeof(table->nEscapedKeys)) ||
+            table->nEscapedKeys > table->escapedKeysSize || (table->escapedKeysSize & (table->escapedKeysSize - 1)) != 0) {
+            fprintf(stderr,"SNAPHashTable::SNAPHashTable unable to read escaped key table header\n");
+            soft_exit(1);
+        }
+        if (table->escapedKeysSize > 0) {
+            table->escapedKeys = new EscapedKey[table->escapedKeysSize];
+            size_t escapedKeyBytes = table->escapedKeysSize * sizeof(EscapedKey);
+            if (escapedKeyBytes != loadFile->read(table->escapedKeys, escapedKeyBytes)) {
+                fprintf(stderr,"SNAPHashTable::SNAPHashTable unable to read escaped key table\n");
+                soft_exit(1);
+            }
+        }
+    }
+
+    return table;
+}
+
+_uint64 SNAPHashTable::GetChecksum() const
+{
+    util::Checksum checksum;
+    checksum.add(Table, getTableBytes());
+    if (escapedKeysSize > 0) {
+        checksum.add(escapedKeys, escapedKeysSize * sizeof(EscapedKey));
+    }
+    return checksum.value();
+}
+
+SNAPHashTable *SNAPHashTable::loadFromMemory(char *memory, size_t bytesAvailable, size_t *bytesConsumed)
+{
+    //
+    // The saved header is magic, tableSize, usedElementCount, keySizeInBytes and dataSizeInBytes, packed with no padding.
+    // Bucketized tables follow it with a count of padding bytes and then the padding, which puts the table on a cache line
+    // boundary within the file and so within a mapping of it.  Quotiented tables follow the table with the size and count
+    // of their escaped key table and then the table.
+    //
+    const size_t headerSize = sizeof(magic) + sizeof(size_t) + sizeof(size_t) + sizeof(unsigned) + sizeof(unsigned);
+    if (bytesAvailable < headerSize) {
+        fprintf(stderr,"SNAPHashTable::loadFromMemory: truncated hash table header\n");
+        soft_exit(1);
+    }
+
+    SNAPHashTable *table = new SNAPHashTable();
+
+    unsigned fileMagic, dataSize;
+    char *header = memory;
+    memcpy(&fileMagic, header, sizeof(fileMagic));                              header += sizeof(fileMagic);
+    memcpy(&table->tableSize, header, sizeof(table->tableSize));                header += sizeof(table->tableSize);
+    memcpy(&table->usedElementCount, header, sizeof(table->usedElementCount));  header += sizeof(table->usedElementCount);
+    memcpy(&table->keySizeInBytes, header, sizeof(table->keySizeInBytes));      header += sizeof(table->keySizeInBytes);
+    memcpy(&dataSize, header, sizeof(dataSize));                                header += sizeof(dataSize);
+
+    if (!table->setLayoutFromMagic(fileMagic)) {
+        fprintf(stderr,"Magic number mismatch on hash table load.  %d != %d\n", fileMagic, fastRangeMagic);
+        soft_exit(1);
+    }
+
+    size_t fullHeaderSize = headerSize;
+    if (table->bucketized) {
+        unsigned padBytes;
+        if (bytesAvailable < headerSize + sizeof(padBytes)) {
+            fprintf(stderr,"SNAPHashTable::loadFromMemory: truncated hash table header\n");
+            soft_exit(1);
+        }
+        memcpy(&padBytes, header, sizeof(padBytes));
+        fullHeaderSize += sizeof(padBytes) + padBytes;
+        header += sizeof(padBytes) + padBytes;
+    }
+
+    if (table->keySizeInBytes < 4 || table->keySizeInBytes > LargestKeySize) {
+        fprintf(stderr,"SNAPHashTable::loadFromMemory Key size must be between 4 and %d inclusive.  Perhaps this is an old format hash table and needs to be rebuilt, or it needs a SNAP built with LONG_SEEDS.\n", LargestKeySize);
+        soft_exit(1);
+    }
+
+    if (dataSizeInBytes != dataSize) {
+        fprintf(stderr,"SNAPHashTable::loadFromMemory data size in bytes is %d, but this SNAP needs %d.  The hash table is either from a SNAP built %s LONG_GENOME_LOCATIONS, or corrupt.\n",
+            dataSize, dataSizeInBytes, 8 == dataSizeInBytes ? "with" : "without");
+        soft_exit(1);
+    }
+
+    if (table->tableSize <= 0) {
+        fprintf(stderr,"SNAPHashTable::loadFromMemory Zero or negative hash table size\n");
+        soft_exit(1);
+    }
+
+    unsigned quotientedRemainderBits, quotientedKeyBytes;
+    if (table->quotiented && !getQuotientedLayout(table->tableSize, table->keySizeInBytes, &quotientedRemainderBits, &quotientedKeyBytes)) {
+        fprintf(stderr,"SNAPHashTable::loadFromMemory quotiented hash table with key size %d is too small to be quotiented; it's corrupt\n", table->keySizeInBytes);
+        soft_exit(1);
+    }
+
+    table->setLayout();
+    table->virtualAllocSize = table->getTableBytes();
+
+    if (bytesAvailable < fullHeaderSize || bytesAvailable - fullHeaderSize < table->virtualAllocSize) {
+        fprintf(stderr,"SNAPHashTable::loadFromMemory: hash table is truncated, %lld bytes needed but only %lld available\n",
+            (_int64)(fullHeaderSize + table->virtualAllocSize), (_int64)bytesAvailable);
+        soft_exit(1);
+    }
+
+    table->Table = (Entry *)header;
+    table->ownsTable = false;
+    *bytesConsumed = fullHeaderSize + table->virtualAllocSize;
+
+    if (table->quotiented) {
+        char *escapedKeysHeader = memory + *bytesConsumed;
+        size_t escapedKeysHeaderSize = sizeof(table->escapedKeysSize) + sizeof(table->nEscapedKeys);
+        if (bytesAvailable - *bytesConsumed < escapedKeysHeaderSize) {
+            fprintf(stderr,"SNAPHashTable::loadFromMemory: truncated escaped key table header\n");
+            soft_exit(1);
+        }
+        memcpy(&table->escapedKeysSize, escapedKeysHeader, sizeof(table->escapedKeysSize));
+        memcpy(&table->nEscapedKeys, escapedKeysHeader + sizeof(table->escapedKeysSize), sizeof(table->nEscapedKeys));
+        *bytesConsumed += escapedKeysHeaderSize;
+
+        if (table->nEscapedKeys > table->escapedKeysSize || (table->escapedKeysSize & (table->escapedKeysSize - 1)) != 0 ||
+            (bytesAvailable - *bytesConsumed) / sizeof(EscapedKey) < table->escapedKeysSize) {
+            fprintf(stderr,"SNAPHashTable::loadFromMemory: escaped key table is corrupt or truncated\n");
+            soft_exit(1);
+        }
+        table->escapedKeys = table->escapedKeysSize > 0 ? (EscapedKey *)(memory + *bytesConsumed) : NULL;
+        *bytesConsumed += table->escapedKeysSize * sizeof(EscapedKey);
+    }
+
     return table;
 }
 
 SNAPHashTable::~SNAPHashTable()
 {
-    BigDealloc(Table);
+    if (ownsTable) {
+        BigDealloc(Table);
+        delete [] escapedKeys;
+    }
 }
 
     bool
@@ -187,7 +378,8 @@ SNAPHashTable::saveToFile(const char *saveFileName)
 bool
 SNAPHashTable::saveToFile(FILE *saveFile) 
 {
-    if (1 != fwrite(&magic,sizeof(magic), 1, saveFile)) {
+    unsigned fileMagic = getMagic();
+    if (1 != fwrite(&fileMagic,sizeof(fileMagic), 1, saveFile)) {
         fprintf(stderr,"SNAPHashTable::SNAPHashTable fwrite magic number failed\n");
         return false;
     }    
@@ -212,10 +404,24 @@ SNAPHashTable::saveToFile(FILE *saveFile)
         return false;
     }
 
+    if (bucketized) {
+        //
+        // Pad so the table starts on a cache line boundary in the file, so that it's aligned when the file is mapped.
+        //
+        _int64 tableOffset = _ftell64bit(saveFile) + sizeof(unsigned);
+        unsigned padBytes = (unsigned)((BucketSize - tableOffset % BucketSize) % BucketSize);
+        char padding[BucketSize];
+        memset(padding, 0, sizeof(padding));
+        if (1 != fwrite(&padBytes, sizeof(padBytes), 1, saveFile) || (padBytes > 0 && 1 != fwrite(padding, padBytes, 1, saveFile))) {
+            fprintf(stderr,"SNAPHashTable::SNAPHashTable fwrite bucket padding failed\n");
+            return false;
+        }
+    }
+
     size_t maxWriteSize = 100 * 1024 * 1024;
     size_t writeOffset = 0;
-    while (writeOffset < tableSize * elementSize) {
-        size_t amountToWrite = __min(maxWriteSize,tableSize * elementSize - writeOffset);
+    while (writeOffset < getTableBytes()) {
+        size_t amountToWrite = __min(maxWriteSize,getTableBytes() - writeOffset);
         size_t bytesWritten = fwrite((char*)Table + writeOffset, 1, amountToWrite, saveFile);
         if (bytesWritten < amountToWrite) {
             fprintf(stderr,"SNAPHashTable::saveToFile: fwrite failed, %d\n",errno);
@@ -225,18 +431,42 @@ SNAPHashTable::saveToFile(FILE *saveFile)
         writeOffset += bytesWritten;
     }
 
+    if (quotiented) {
+        if (1 != fwrite(&escapedKeysSize, sizeof(escapedKeysSize), 1, saveFile) || 1 != fwrite(&nEscapedKeys, sizeof(nEscapedKeys), 1, saveFile) ||
+            (escapedKeysSize > 0 && escapedKeysSize != fwrite(escapedKeys, sizeof(EscapedKey), escapedKeysSize, saveFile))) {
+            fprintf(stderr,"SNAPHashTable::saveToFile: fwrite of escaped keys failed, %d\n",errno);
+            return false;
+        }
+    }
+
     return true;
 }
     
-_int64 nCallsToGetEntryForKey = 0;
-_int64 nProbesInGetEntryForKey = 0;
-
 SNAPHashTable::Entry *
-SNAPHashTable::getEntryForKey(__in _uint64 key) const
+SNAPHashTable::getEntryForKey(__in SeedBases key) const
 {
-    nCallsToGetEntryForKey++;
+    if (quotiented) {
+        _uint64 slot;
+        unsigned nProbes;
+        return findQuotientedSlot(key, &slot, &nProbes) ? getEntry(slot) : NULL;
+    }
 
-    _uint64 tableIndex = hash(key) % tableSize;
+    if (bucketized) {
+        _uint64 bucketIndex = homeIndex(hash(key), nBuckets);
+        for (size_t nBucketsProbed = 0; nBucketsProbed < nBuckets; nBucketsProbed++) {
+            for (unsigned i = 0; i < entriesPerBucket; i++) {
+                Entry *entry = getBucketEntry(bucketIndex, i);
+                if (entry->value1 == InvalidGenomeLocation || isKeyEqual(entry, key)) {
+                    PerfCounters::forThisThread()->hashTableProbes += nBucketsProbed;
+                    return entry;
+                }
+            }
+            bucketIndex = (bucketIndex + 1 == nBuckets) ? 0 : bucketIndex + 1;
+        }
+        return NULL;    // The table is full.
+    }
+
+    _uint64 tableIndex = homeIndex(hash(key), tableSize);
 
     bool wrapped = false;
     unsigned nProbes = 1;
@@ -246,8 +476,6 @@ SNAPHashTable::getEntryForKey(__in _uint64 key) const
     //
     Entry *entry = getEntry(tableIndex);
     while (!isKeyEqual(entry, key) && entry->value1 != InvalidGenomeLocation) {
-        nProbesInGetEntryForKey++;
-
         if (nProbes < QUADRATIC_CHAINING_DEPTH) {
             tableIndex += nProbes * nProbes;
         } else {
@@ -267,16 +495,39 @@ SNAPHashTable::getEntryForKey(__in _uint64 key) const
         entry = getEntry(tableIndex);
     }
 
-    nProbesInGetEntryForKey++;
+    PerfCounters::forThisThread()->hashTableProbes += nProbes - 1;
 
     return entry;
 }
 
 bool
-SNAPHashTable::Insert(_uint64 key, const unsigned *data)
+SNAPHashTable::Insert(SeedBases key, const GenomeLocation *data)
 {
     _ASSERT(data[0] != InvalidGenomeLocation); // This is the unused value that represents an empty hash table.  You can't use it.
 
+    if (quotiented) {
+        _uint64 slot;
+        unsigned nProbes;
+        if (!findQuotientedSlot(key, &slot, &nProbes)) {
+            return false;
+        }
+
+        Entry *entry = getEntry(slot);
+        if (entry->value1 == InvalidGenomeLocation) {
+            if (nProbes < escapeDisplacement) {
+                setStoredKey(entry, (quotientHash(LowWord(key)) & remainderMask) | ((_uint64)nProbes << remainderBits));
+            } else {
+                setStoredKey(entry, (_uint64)escapeDisplacement << remainderBits);
+                addEscapedKey(slot, LowWord(key));
+            }
+            usedElementCount++;
+        }
+
+        entry->value1 = data[0];
+        entry->value2 = data[1];
+        return true;
+    }
+
     Entry *entry = getEntryForKey(key);
     if (NULL == entry) {
         return false;
@@ -300,8 +551,8 @@ SNAPHashTable::GetHashTableMemorySize()
     return virtualAllocSize;
 }
 
-unsigned *
-SNAPHashTable::SlowLookup(_uint64 key)
+GenomeLocation *
+SNAPHashTable::SlowLookup(SeedBases key)
 {
     Entry *entry = getEntryForKey(key);
 
@@ -312,5 +563,229 @@ SNAPHashTable::SlowLookup(_uint64 key)
     return &entry->value1;
 }
 
+    bool
+SeedCountIterator::next(SeedBases *o_key, const GenomeLocation **o_values, unsigned *o_probes)
+{
+    for (; slot < endSlot; slot++) {
+        const GenomeLocation *values = table->GetValuesOfSlot(slot);
+        if (NULL == values) {
+            continue;
+        }
+
+        SeedBases key = table->GetKeyOfSlot(slot);
+
+        //
+        // Follow the same probe sequence as Lookup until it gets here.
+        //
+        unsigned probes = 0;
+        if (table->bucketized) {
+            _uint64 homeBucket = table->homeIndex(SNAPHashTable::hash(key), table->nBuckets);
+            probes = (unsigned)((slot / table->entriesPerBucket + table->nBuckets - homeBucket) % table->nBuckets);
+        } else {
+            _uint64 tableIndex = table->quotiented ? table->quotientedHome(table->quotientHash(LowWord(key))) :
+                table->homeIndex(SNAPHashTable::hash(key), table->tableSize);
+            while (tableIndex != slot && probes <= table->tableSize + SNAPHashTable::QUADRATIC_CHAINING_DEPTH) {
+                probes++;
+                tableIndex = table->nextProbe(tableIndex, probes);
+            }
+        }
+
+        *o_key = key;
+        *o_values = values;
+        *o_probes = probes;
+        slot++;
+        return true;
+    }
+
+    return false;
+}
+
+    bool
+SNAPHashTable::getQuotientedLayout(size_t tableSize, unsigned keySizeInBytes, unsigned *o_remainderBits, unsigned *o_storedKeyBytes)
+{
+    if (keySizeInBytes > sizeof(_uint64) || 0 == tableSize) {
+        return false;
+    }
+
+    //
+    // The most top 32 bit values that fastrange sends to any one slot.
+    //
+    _uint64 highValuesPerHome = (((_uint64)1 << 32) + tableSize - 1) / tableSize;
+    unsigned homeBits = 0;
+    while (((_uint64)1 << homeBits) < highValuesPerHome) {
+        homeBits++;
+    }
+
+    *o_remainderBits = keySizeInBytes * 8 - 32 + homeBits;
+    *o_storedKeyBytes = (*o_remainderBits + MinDisplacementBits + 7) / 8;
+    return *o_storedKeyBytes < keySizeInBytes;
+}
+
+    _uint64
+SNAPHashTable::unhashQuotient(_uint64 hashValue) const
+{
+    //
+    // Each step of quotientHash undoes itself or is a multiply by an odd number, whose inverse mod 2^64 (and so mod any
+    // smaller power of two) Newton's method finds in five steps.
+    //
+    _uint64 inverse1 = QuotientMultiplier1, inverse2 = QuotientMultiplier2;
+    for (int i = 0; i < 5; i++) {
+        inverse1 *= 2 - QuotientMultiplier1 * inverse1;
+        inverse2 *= 2 - QuotientMultiplier2 * inverse2;
+    }
+
+    unsigned shift = keySizeInBytes * 4;
+    hashValue ^= hashValue >> shift;
+    hashValue = (hashValue * inverse2) & keyMask;
+    hashValue ^= hashValue >> shift;
+    hashValue = (hashValue * inverse1) & keyMask;
+    hashValue ^= hashValue >> shift;
+    return hashValue;
+}
+
+    _uint64
+SNAPHashTable::probeDistance(unsigned nProbes)
+{
+    _uint64 distance = 0;
+    for (unsigned i = 1; i <= nProbes && i < QUADRATIC_CHAINING_DEPTH; i++) {
+        distance += i * i;
+    }
+    if (nProbes >= QUADRATIC_CHAINING_DEPTH) {
+        distance += nProbes - QUADRATIC_CHAINING_DEPTH + 1;
+    }
+    return distance;
+}
+
+    bool
+SNAPHashTable::findQuotientedSlot(SeedBases key, _uint64 *o_slot, unsigned *o_nProbes) const
+{
+    _uint64 hashValue = quotientHash(LowWord(key));
+    _uint64 remainder = hashValue & remainderMask;
+    _uint64 tableIndex = quotientedHome(hashValue);
+    for (unsigned nProbes = 0; nProbes <= tableSize + QUADRATIC_CHAINING_DEPTH; nProbes++) {
+        if (nProbes > 0) {
+            tableIndex = nextProbe(tableIndex, nProbes);
+        }
+        Entry *entry = getEntry(tableIndex);
+        bool found = entry->value1 == InvalidGenomeLocation;
+        if (!found) {
+            _uint64 storedKey = getStoredKey(entry);
+            unsigned displacement = (unsigned)(storedKey >> remainderBits);
+            found = nProbes < escapeDisplacement ? displacement == nProbes && (storedKey & remainderMask) == remainder :
+                displacement == escapeDisplacement && getEscapedKey(tableIndex) == LowWord(key);
+        }
+        if (found) {
+            PerfCounters::forThisThread()->hashTableProbes += nProbes;
+            *o_slot = tableIndex;
+            *o_nProbes = nProbes;
+            return true;
+        }
+    }
+    return false;
+}
+
+    SeedBases
+SNAPHashTable::getQuotientedKeyOfSlot(size_t slot) const
+{
+    _uint64 storedKey = getStoredKey(getEntry(slot));
+    unsigned displacement = (unsigned)(storedKey >> remainderBits);
+    if (displacement == escapeDisplacement) {
+        return (SeedBases)getEscapedKey(slot);
+    }
+
+    //
+    // Walk back to the home slot, find the first of the top 32 bit hash values that fastrange sends there, and then the one
+    // after it with the low bits in the remainder.
+    //
+    _uint64 home = (slot + tableSize - probeDistance(displacement) % tableSize) % tableSize;
+    unsigned lowHashBits = keySizeInBytes * 8 - 32;
+    _uint64 homeBitsMask = ((_uint64)1 << (remainderBits - lowHashBits)) - 1;
+    _uint64 firstHighValue = ((home << 32) + tableSize - 1) / tableSize;
+    _uint64 highValue = firstHighValue + (((storedKey >> lowHashBits) - firstHighValue) & homeBitsMask);
+    _uint64 hashValue = (highValue << lowHashBits) | (storedKey & (((_uint64)1 << lowHashBits) - 1));
+    return (SeedBases)unhashQuotient(hashValue);
+}
+
+    _uint64
+SNAPHashTable::getEscapedKey(_uint64 slot) const
+{
+    _ASSERT(escapedKeysSize > 0);
+    for (_uint64 i = hash(slot) & (escapedKeysSize - 1); ; i = (i + 1) & (escapedKeysSize - 1)) {
+        EscapedKey escapedKey;
+        memcpy(&escapedKey, escapedKeys + i, sizeof(escapedKey));
+        if (escapedKey.slot == slot) {
+            return escapedKey.key;
+        }
+        _ASSERT(escapedKey.slot != NoEscapedSlot);  // Every slot that says it's escaped is in here
+        if (escapedKey.slot == NoEscapedSlot) {
+            return 0;
+        }
+    }
+}
+
+    void
+SNAPHashTable::addEscapedKey(_uint64 slot, _uint64 key)
+{
+    _ASSERT(ownsTable);
+
+    //
+    // Keep it no more than half full, so that finding a slot's key takes a probe or two.
+    //
+    if ((nEscapedKeys + 1) * 2 > escapedKeysSize) {
+        EscapedKey *oldEscapedKeys = escapedKeys;
+        size_t oldEscapedKeysSize = escapedKeysSize;
+        escapedKeysSize = __max((size_t)64, escapedKeysSize * 2);
+        escapedKeys = new EscapedKey[escapedKeysSize];
+        for (size_t i = 0; i < escapedKeysSize; i++) {
+            escapedKeys[i].slot = NoEscapedSlot;
+            escapedKeys[i].key = 0;
+        }
+        nEscapedKeys = 0;
+        for (size_t i = 0; i < oldEscapedKeysSize; i++) {
+            if (oldEscapedKeys[i].slot != NoEscapedSlot) {
+                addEscapedKey(oldEscapedKeys[i].slot, oldEscapedKeys[i].key);
+            }
+        }
+        delete [] oldEscapedKeys;
+    }
+
+    _uint64 i = hash(slot) & (escapedKeysSize - 1);
+    while (escapedKeys[i].slot != NoEscapedSlot) {
+        i = (i + 1) & (escapedKeysSize - 1);
+    }
+    escapedKeys[i].slot = slot;
+    escapedKeys[i].key = key;
+    nEscapedKeys++;
+}
+
+    unsigned
+SNAPHashTable::getMagic() const
+{
+    if (quotiented) {
+        return quotientedMagic;
+    }
+    if (fastRange) {
+        return bucketized ? fastRangeBucketizedMagic : fastRangeMagic;
+    }
+    return bucketized ? bucketizedMagic : magic;
+}
+
+    bool
+SNAPHashTable::setLayoutFromMagic(unsigned fileMagic)
+{
+    if (fileMagic != magic && fileMagic != bucketizedMagic && fileMagic != fastRangeMagic && fileMagic != fastRangeBucketizedMagic &&
+        fileMagic != quotientedMagic) {
+        return false;
+    }
+    bucketized = fileMagic == bucketizedMagic || fileMagic == fastRangeBucketizedMagic;
+    fastRange = fileMagic == fastRangeMagic || fileMagic == fastRangeBucketizedMagic || fileMagic == quotientedMagic;
+    quotiented = fileMagic == quotientedMagic;
+    return true;
+}
+
 const unsigned SNAPHashTable::magic = 0xb111b010;
-const unsigned SNAPHashTable::dataSizeInBytes = 8;
+const unsigned SNAPHashTable::bucketizedMagic = 0xb111b011;
+const unsigned SNAPHashTable::fastRangeMagic = 0xb111b012;
+const unsigned SNAPHashTable::fastRangeBucketizedMagic = 0xb111b013;
+const unsigned SNAPHashTable::quotientedMagic = 0xb111b014;
+const unsigned SNAPHashTable::dataSizeInBytes;
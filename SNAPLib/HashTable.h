@@ -23,14 +23,27 @@ Environment:
 #include "Compat.h"
 #include "GenericFile.h"
 #include "Genome.h"
+#include "PerfCounters.h"
+#include "SeedBases.h"
 
 
 class SNAPHashTable {
     public:
 
+        //
+        // A bucketized table packs as many entries as fit into each 64 byte, cache line aligned bucket, and chains through
+        // whole buckets rather than individual entries, so that a lookup almost always touches just one cache line.  It
+        // takes somewhat more memory than the classic layout when the entry size doesn't divide 64 evenly.
+        //
+        // A quotiented table stores only part of each key's hash in its entry (see the comment on quotientHash), which
+        // saves one to three bytes an entry in tables big enough for it to matter.  It's for the classic layout with keys of
+        // at most 8 bytes, and is quietly ignored otherwise or when it wouldn't save anything, so check HasQuotientedKeys().
+        //
         SNAPHashTable(
             unsigned      i_tableSize,
-            unsigned      i_keySizeInBytes);
+            unsigned      i_keySizeInBytes,
+            bool          i_bucketized = false,
+            bool          i_quotiented = false);
 
         //
         // Load from file.
@@ -39,6 +52,13 @@ class SNAPHashTable {
 
         static SNAPHashTable *loadFromFile(GenericFile *loadFile);
 
+        //
+        // Use a table that's already in memory in its saved format (typically because its file is memory mapped) without
+        // copying it.  The memory must outlive the table, which is read only.  Sets bytesConsumed to the size of the saved
+        // table so the caller can find the next one in a file with several.
+        //
+        static SNAPHashTable *loadFromMemory(char *memory, size_t bytesAvailable, size_t *bytesConsumed);
+
         ~SNAPHashTable();
 
         bool saveToFile(const char *saveFileName);
@@ -48,14 +68,28 @@ class SNAPHashTable {
         //
         // Fails if either the table is full or key already exists.
         //
-        bool Insert(_uint64 key, const unsigned *data);
+        bool Insert(SeedBases key, const GenomeLocation *data);
 
         size_t GetUsedElementCount() const {return usedElementCount;}
         size_t GetTableSize() const {return tableSize;}
 
         _uint64 GetHashTableMemorySize();
 
+        //
+        // Where the entries are, and how many bytes of them, for moving them to other memory.
+        //
+        void *GetTableMemory() const {return Table;}
+        size_t GetTableBytes() const {return getTableBytes();}
+
+        //
+        // A util::Checksum of the table's entries, which indices keep so that they can check a table when they load it.
+        //
+        _uint64 GetChecksum() const;
+
         unsigned GetKeySizeInBytes() const {return keySizeInBytes;}
+        bool IsBucketized() const {return bucketized;}
+        bool UsesFastRange() const {return fastRange;}
+        bool HasQuotientedKeys() const {return quotiented;}
         unsigned GetDataSizeInBytes() const {return dataSizeInBytes;}
 
         static inline _uint64 hash(_uint64 key) {
@@ -73,32 +107,58 @@ class SNAPHashTable {
             return key;
         }
 
-        inline unsigned *Lookup(_uint64 key) const {
-            _ASSERT(keySizeInBytes == 8 || (key & ~((((_uint64)1) << (keySizeInBytes * 8)) - 1)) == 0);    // High bits of the key aren't set.
-            _uint64 tableIndex = hash(key) % tableSize;
-            Entry *entry = getEntry(tableIndex);
-            if (isKeyEqual(entry, key) && entry->value1 != InvalidGenomeLocation) {
+        static inline _uint64 hash(const LongSeedBases &key) {
+            return hash(FoldSeedBases(key));
+        }
+
+        //
+        // The number of bytes of table each slot costs, for sizing tables before they're allocated.
+        //
+        static inline double GetBytesPerSlot(unsigned keySizeInBytes, bool bucketized) {
+            unsigned elementSize = keySizeInBytes + dataSizeInBytes;
+            return bucketized ? (double)BucketSize / (BucketSize / elementSize) : (double)elementSize;
+        }
+
+        //
+        // The same for this table, which is less for a quotiented one.
+        //
+        inline double GetBytesPerSlot() const {
+            return bucketized ? (double)BucketSize / entriesPerBucket : (double)elementSize;
+        }
+
+        //
+        // Callers that know the table's key size at compile time can say so with KeyBytes (which must then match
+        // GetKeySizeInBytes()), so that key compares become a single integer compare and entries are a constant stride
+        // apart.  GenomeIndex picks the instantiation once per batch of lookups.  The default of 0 works for any key size.
+        //
+        template <unsigned KeyBytes = 0> inline GenomeLocation *Lookup(SeedBases key) const {
+            _ASSERT(keySizeInBytes >= sizeof(key) || (key >> (keySizeInBytes * 8)) == (SeedBases)0);    // High bits of the key aren't set.
+            _ASSERT(0 == KeyBytes || KeyBytes == keySizeInBytes);
+            if (bucketized) {
+                return BucketizedLookup<KeyBytes>(key);
+            }
+            if (quotiented) {
+                return QuotientedLookup(key);
+            }
+            _uint64 tableIndex = homeIndex(hash(key), tableSize);
+            Entry *entry = getEntry<KeyBytes>(tableIndex);
+            if (isKeyEqual<KeyBytes>(entry, key) && entry->value1 != InvalidGenomeLocation) {
                 return &(entry->value1);
             } else {
                 unsigned nProbes = 0;
                 Entry* entry;
-                unsigned value1;
+                GenomeLocation value1;
                 do {
                     nProbes++;
                     if (nProbes > tableSize + QUADRATIC_CHAINING_DEPTH) {
                         return NULL;
                     }
-                    if (nProbes < QUADRATIC_CHAINING_DEPTH) {
-                        tableIndex = (tableIndex + nProbes * nProbes) % tableSize;
-                    } else {
-                        tableIndex = (tableIndex + 1) % tableSize;
-                    }
-                    entry = getEntry(tableIndex);
+                    tableIndex = nextProbe(tableIndex, nProbes);
+                    entry = getEntry<KeyBytes>(tableIndex);
                     value1 = entry->value1;
-                } while (!isKeyEqual(entry, key) && value1 != InvalidGenomeLocation);
+                } while (!isKeyEqual<KeyBytes>(entry, key) && value1 != InvalidGenomeLocation);
 
-                extern _int64 nProbesInGetEntryForKey;
-                nProbesInGetEntryForKey += nProbes;
+                PerfCounters::forThisThread()->hashTableProbes += nProbes;
 
                 if (value1 == InvalidGenomeLocation) {
                     return NULL;
@@ -108,42 +168,296 @@ class SNAPHashTable {
             }
         }
 
+        //
+        // Start pulling the memory that Lookup(key) will look at first into the cache, without waiting for it.
+        //
+        template <unsigned KeyBytes = 0> inline void Prefetch(SeedBases key) const {
+            if (0 == tableSize) {
+                return;
+            }
+            if (bucketized) {
+                _mm_prefetch((const char *)getBucketEntry<KeyBytes>(homeIndex(hash(key), nBuckets), 0), _MM_HINT_T0);
+            } else if (quotiented) {
+                const char *entry = (const char *)getEntry(quotientedHome(quotientHash(LowWord(key))));
+                _mm_prefetch(entry, _MM_HINT_T0);
+                _mm_prefetch(entry + elementSize - 1, _MM_HINT_T0);
+            } else {
+                const char *entry = (const char *)getEntry<KeyBytes>(homeIndex(hash(key), tableSize));
+                _mm_prefetch(entry, _MM_HINT_T0);
+                _mm_prefetch(entry + getElementSize<KeyBytes>() - 1, _MM_HINT_T0);   // Entries can straddle cache lines
+            }
+        }
+
+        //
+        // The slot (from 0 to GetTableSize() - 1) that Lookup(key) looks at first, so that callers can put lookups that
+        // touch neighbouring memory together.
+        //
+        inline _uint64 GetHomeSlot(SeedBases key) const {
+            if (0 == tableSize) {
+                return 0;
+            }
+            if (bucketized) {
+                return homeIndex(hash(key), nBuckets) * entriesPerBucket;
+            } else if (quotiented) {
+                return quotientedHome(quotientHash(LowWord(key)));
+            } else {
+                return homeIndex(hash(key), tableSize);
+            }
+        }
+
+        //
+        // For a table that's memory mapped: start reading in the page that key's entry (or the start of its bucket) is on.
+        //
+        template <unsigned KeyBytes = 0> inline void AdviseWillNeed(SeedBases key) const {
+            if (0 == tableSize) {
+                return;
+            }
+            if (bucketized) {
+                ::AdviseWillNeed(getBucketEntry<KeyBytes>(homeIndex(hash(key), nBuckets), 0), getElementSize<KeyBytes>());
+            } else if (quotiented) {
+                ::AdviseWillNeed(getEntry(quotientedHome(quotientHash(LowWord(key)))), elementSize);
+            } else {
+                ::AdviseWillNeed(getEntry<KeyBytes>(homeIndex(hash(key), tableSize)), getElementSize<KeyBytes>());
+            }
+        }
+
+        //
+        // The values of one slot of the table (with slot running from 0 to GetTableSize() - 1), or NULL if it's unused.
+        // For walking the whole table, as when rewriting the values in place.
+        //
+        inline GenomeLocation *GetValuesOfSlot(size_t slot) const {
+            _ASSERT(slot < tableSize);
+            Entry *entry = bucketized ? getBucketEntry(slot / entriesPerBucket, (unsigned)(slot % entriesPerBucket)) : getEntry(slot);
+            return entry->value1 == InvalidGenomeLocation ? NULL : &(entry->value1);
+        }
+
+        //
+        // The key of a slot that GetValuesOfSlot says is used.
+        //
+        inline SeedBases GetKeyOfSlot(size_t slot) const {
+            _ASSERT(slot < tableSize);
+            if (quotiented) {
+                return getQuotientedKeyOfSlot(slot);
+            }
+            Entry *entry = bucketized ? getBucketEntry(slot / entriesPerBucket, (unsigned)(slot % entriesPerBucket)) : getEntry(slot);
+            SeedBases key = 0;
+            memcpy(&key, entry->key, keySizeInBytes);
+            return key;
+        }
+
         //
         // A version of Lookup that works properly when the table is (nearly) full and the key being looked up isn't
         // there.  It's, as you might imagine, slower than Lookup.
         //
-        unsigned *SlowLookup(_uint64 key);
+        GenomeLocation *SlowLookup(SeedBases key);
 
 private:
 
-        SNAPHashTable() {}
+        SNAPHashTable() : Table(NULL), bucketized(false), entriesPerBucket(0), nBuckets(0), fastRange(false), quotiented(false),
+            escapedKeys(NULL), escapedKeysSize(0), nEscapedKeys(0), ownsTable(true) {}
 
         static const unsigned QUADRATIC_CHAINING_DEPTH = 5; // Chain quadratically for this long, then linerarly  Set to 0 for linear chaining
+        static const unsigned BucketSize = 64;              // One cache line
 
         struct Entry {
-            unsigned        value1;
-            unsigned        value2;
+            GenomeLocation  value1;
+            GenomeLocation  value2;
             unsigned char   key[1]; // Actual size of key determined by keySizeInBytes
         };
 
         // Free Entries have value1 == InvalidGenomeLocation
-        
-        inline Entry *getEntry(_uint64 whichEntry) const {
-            return (Entry *) ((char *)Table + elementSize * whichEntry);
+
+        //
+        // The entry accessors and key compare take the key size as a template argument for the same reason Lookup does, with
+        // the same meaning for 0.
+        //
+        template <unsigned KeyBytes = 0> inline unsigned getElementSize() const {
+            return 0 == KeyBytes ? elementSize : KeyBytes + dataSizeInBytes;
         }
 
+        template <unsigned KeyBytes = 0> inline Entry *getEntry(_uint64 whichEntry) const {
+            return (Entry *) ((char *)Table + getElementSize<KeyBytes>() * whichEntry);
+        }
 
-        inline bool isKeyEqual(const Entry *entry, _uint64 key) const 
+        template <unsigned KeyBytes = 0> inline Entry *getBucketEntry(_uint64 whichBucket, unsigned whichEntryInBucket) const {
+            return (Entry *) ((char *)Table + BucketSize * whichBucket + getElementSize<KeyBytes>() * whichEntryInBucket);
+        }
+
+        //
+        // Lookup for the bucketized layout.  Each bucket fills from the front and nothing is ever deleted, so an empty entry
+        // means the key isn't in the table.  Full buckets chain linearly into the next one.
+        //
+        template <unsigned KeyBytes> inline GenomeLocation *BucketizedLookup(SeedBases key) const {
+            _uint64 bucketIndex = homeIndex(hash(key), nBuckets);
+            for (size_t nBucketsProbed = 0; nBucketsProbed < nBuckets; nBucketsProbed++) {
+                for (unsigned i = 0; i < entriesPerBucket; i++) {
+                    Entry *entry = getBucketEntry<KeyBytes>(bucketIndex, i);
+                    if (entry->value1 == InvalidGenomeLocation) {
+                        return NULL;
+                    }
+                    if (isKeyEqual<KeyBytes>(entry, key)) {
+                        return &(entry->value1);
+                    }
+                }
+                bucketIndex = (bucketIndex + 1 == nBuckets) ? 0 : bucketIndex + 1;
+            }
+            return NULL;
+        }
+
+        //
+        // The slot (or bucket) where a key with this hash value starts its probe sequence.  Tables built by older versions
+        // reduce the hash with a modulo, which is a 64 bit divide on every lookup.  Newer ones use Lemire's fastrange, which
+        // maps the high 32 bits of the hash onto the table with a multiply and a shift.  The murmur finalizer mixes the
+        // high bits as well as the low ones, and table sizes are always less than 2^32, so it fits in 64 bits.
+        //
+        inline _uint64 homeIndex(_uint64 hashValue, size_t nSlots) const {
+            _ASSERT(nSlots <= 0xffffffff);
+            return fastRange ? ((hashValue >> 32) * nSlots) >> 32 : hashValue % nSlots;
+        }
+
+        //
+        // The slot after tableIndex in the probe sequence, which is quadratic for QUADRATIC_CHAINING_DEPTH probes and then linear.
+        // nProbes counts from 1 for the first step away from home.  The steps are smaller than the table except in tiny tables, so
+        // this wraps by subtraction rather than dividing.
+        //
+        inline _uint64 nextProbe(_uint64 tableIndex, unsigned nProbes) const {
+            tableIndex += nProbes < QUADRATIC_CHAINING_DEPTH ? nProbes * nProbes : 1;
+            while (tableIndex >= tableSize) {
+                tableIndex -= tableSize;
+            }
+            return tableIndex;
+        }
+
+        //
+        // The size of the table itself, not counting the header it's saved with.
+        //
+        inline size_t getTableBytes() const {
+            return bucketized ? nBuckets * BucketSize : tableSize * elementSize;
+        }
+
+        //
+        // Sets the derived sizes from tableSize, keySizeInBytes, bucketized and quotiented.
+        //
+        void setLayout();
+
+        //
+        // A quotiented table hashes each key with a bijection on its 8 * keySizeInBytes bits, and takes the home slot from
+        // the top 32 bits of the hash with fastrange.  Given the home, those top bits are one of at most 2^homeBits
+        // consecutive values, so the home and their low homeBits bits pin them down, and the entry only needs the hash's
+        // low remainderBits bits: the ones below the top 32, plus homeBits.  Rather than the home itself, the entry holds how
+        // many probes past home it is, in the rest of its stored key bytes above the remainder.  A lookup that's made n
+        // probes can then only match an entry that's n probes from its home, which is to say from the same home, and has the
+        // same remainder.
+        //
+        // The few entries that are escapeDisplacement or more probes from home store escapeDisplacement, and have their
+        // whole key in escapedKeys, a little open addressed table by slot.  Lookups only go there once they've probed that
+        // far themselves.
+        //
+        inline _uint64 quotientHash(_uint64 key) const {
+            unsigned shift = keySizeInBytes * 4;
+            key ^= key >> shift;
+            key = (key * QuotientMultiplier1) & keyMask;
+            key ^= key >> shift;
+            key = (key * QuotientMultiplier2) & keyMask;
+            key ^= key >> shift;
+            return key;
+        }
+
+        _uint64 unhashQuotient(_uint64 hashValue) const;
+
+        inline _uint64 quotientedHome(_uint64 hashValue) const {
+            return ((hashValue >> (keySizeInBytes * 8 - 32)) * tableSize) >> 32;
+        }
+
+        inline _uint64 getStoredKey(const Entry *entry) const {
+            _uint64 storedKey = 0;
+            memcpy(&storedKey, entry->key, storedKeyBytes);
+            return storedKey;
+        }
+
+        inline void setStoredKey(Entry *entry, _uint64 storedKey) {
+            memcpy(entry->key, &storedKey, storedKeyBytes);
+        }
+
+        inline GenomeLocation *QuotientedLookup(SeedBases key) const {
+            _uint64 hashValue = quotientHash(LowWord(key));
+            _uint64 remainder = hashValue & remainderMask;
+            _uint64 tableIndex = quotientedHome(hashValue);
+            for (unsigned nProbes = 0; nProbes <= tableSize + QUADRATIC_CHAINING_DEPTH; nProbes++) {
+                if (nProbes > 0) {
+                    tableIndex = nextProbe(tableIndex, nProbes);
+                }
+                Entry *entry = getEntry(tableIndex);
+                if (entry->value1 == InvalidGenomeLocation) {
+                    PerfCounters::forThisThread()->hashTableProbes += nProbes;
+                    return NULL;
+                }
+                _uint64 storedKey = getStoredKey(entry);
+                unsigned displacement = (unsigned)(storedKey >> remainderBits);
+                if (nProbes < escapeDisplacement ? displacement == nProbes && (storedKey & remainderMask) == remainder :
+                        displacement == escapeDisplacement && getEscapedKey(tableIndex) == LowWord(key)) {
+                    PerfCounters::forThisThread()->hashTableProbes += nProbes;
+                    return &(entry->value1);
+                }
+            }
+            return NULL;
+        }
+
+        //
+        // Finds the slot for a key in a quotiented table as getEntryForKey does, along with how many probes past home it is.
+        // Returns false if the table is full.
+        //
+        bool findQuotientedSlot(SeedBases key, _uint64 *o_slot, unsigned *o_nProbes) const;
+
+        SeedBases getQuotientedKeyOfSlot(size_t slot) const;
+
+        //
+        // How far along the probe sequence from home nProbes probes go, before wrapping around the table.
+        //
+        static _uint64 probeDistance(unsigned nProbes);
+
+        //
+        // The table's layout for a quotiented table of this size, or false if it wouldn't be any smaller than the full keys.
+        //
+        static bool getQuotientedLayout(size_t tableSize, unsigned keySizeInBytes, unsigned *o_remainderBits, unsigned *o_storedKeyBytes);
+
+        struct EscapedKey {
+            _uint64     slot;       // NoEscapedSlot if this one's unused
+            _uint64     key;
+        };
+
+        static const _uint64 NoEscapedSlot = 0xffffffffffffffff;
+        static const unsigned MinDisplacementBits = 4;
+        static const _uint64 QuotientMultiplier1 = 0xff51afd7ed558ccd;  // The murmur finalizer's; any odd numbers would do
+        static const _uint64 QuotientMultiplier2 = 0xc4ceb9fe1a85ec53;
+
+        //
+        // The escaped key table may be in a memory mapped file at any alignment, so its entries are copied out.
+        //
+        _uint64 getEscapedKey(_uint64 slot) const;
+        void addEscapedKey(_uint64 slot, _uint64 key);
+
+
+        //
+        // Keys are stored as the low bytes of the SeedBases (which is little endian), and the rest of the key is zero, so a
+        // key of at most 8 bytes can be compared as one _uint64.
+        //
+        template <unsigned KeyBytes = 0> inline bool isKeyEqual(const Entry *entry, SeedBases key) const
         {
-            return !memcmp(entry->key, &key, keySizeInBytes);
+            if (0 == KeyBytes || KeyBytes > sizeof(_uint64)) {
+                return !memcmp(entry->key, &key, 0 == KeyBytes ? keySizeInBytes : KeyBytes);
+            }
+            _uint64 storedKey = 0;
+            memcpy(&storedKey, entry->key, KeyBytes);
+            return storedKey == LowWord(key);
         }
 
         inline void clearKey(Entry *entry)
         {
-            memset(entry->key, 0 , keySizeInBytes);
+            memset(entry->key, 0 , storedKeyBytes);
         }
 
-        inline void setKey(Entry *entry, _uint64 key)
+        inline void setKey(Entry *entry, SeedBases key)
         {
             memcpy(entry->key, &key, keySizeInBytes);
         }
@@ -151,19 +465,64 @@ private:
         Entry *Table;
         size_t tableSize;
         unsigned keySizeInBytes;
-        static const unsigned dataSizeInBytes;
+        static const unsigned dataSizeInBytes = 2 * sizeof(GenomeLocation);
         unsigned elementSize;
         size_t usedElementCount;
 
+        bool bucketized;
+        unsigned entriesPerBucket;  // Only meaningful if bucketized
+        size_t nBuckets;            // Only meaningful if bucketized
+        bool fastRange;             // Home slots come from fastrange rather than a modulo (see homeIndex)
+
+        bool quotiented;            // Entries hold a hash remainder rather than the key (see quotientHash)
+        unsigned storedKeyBytes;    // The size of each entry's key field, which is keySizeInBytes unless quotiented
+        unsigned remainderBits;     // The rest are only meaningful if quotiented
+        _uint64 remainderMask;
+        _uint64 keyMask;
+        unsigned escapeDisplacement;
+        EscapedKey *escapedKeys;
+        size_t escapedKeysSize;     // A power of two, or zero if there aren't any
+        size_t nEscapedKeys;
+
         size_t virtualAllocSize;
+        bool ownsTable;         // False if Table points into memory that belongs to someone else (see loadFromMemory)
 
         //
         // Returns either the entry for this key, or else the entry where the key would be
         // inserted if it's not in the table.
         //
-        Entry* getEntryForKey(__in _uint64 key) const;
+        Entry* getEntryForKey(__in SeedBases key) const;
 
         friend class SeedCountIterator;
 
         static const unsigned magic;
+        static const unsigned bucketizedMagic;
+        static const unsigned fastRangeMagic;
+        static const unsigned fastRangeBucketizedMagic;
+        static const unsigned quotientedMagic;
+
+        //
+        // The magic number for a table's layout, and the layout for a magic number (false if it isn't one of ours).
+        //
+        unsigned getMagic() const;
+        bool setLayoutFromMagic(unsigned fileMagic);
+};
+
+//
+// Walks the used slots in a range of a table, for looking over the contents of an index (as snap indexstats does).  Gives
+// each one's key and pair of values, and how far past the key's home a lookup has to go to find it: probes past its home
+// slot, or for a bucketized table buckets past its home bucket.  Different ranges of a table can be walked on different
+// threads at once.
+//
+class SeedCountIterator {
+public:
+    SeedCountIterator(const SNAPHashTable *i_table, size_t i_beginSlot, size_t i_endSlot) :
+        table(i_table), slot(i_beginSlot), endSlot(i_endSlot) {}
+
+    bool next(SeedBases *o_key, const GenomeLocation **o_values, unsigned *o_probes);
+
+private:
+    const SNAPHashTable *table;
+    size_t               slot;
+    size_t               endSlot;
 };
@@ -6,7 +6,7 @@ Module Name:
 
 Abstract:
 
-    Cheezy histogram class
+    Log-linear histogram class
 
 Authors:
 
@@ -21,6 +21,8 @@ Environment:
 
 Revision History:
 
+    Replaced the linear and exponential buckets with log-linear ones, so one kind does for everything
+
 --*/
 
 #include "stdafx.h"
@@ -28,80 +30,102 @@ Revision History:
 #include "Histogram.h"
 #include "exit.h"
 
-Histogram::Histogram(unsigned i_nBuckets, bool i_isExponential) :
-    nBuckets(i_nBuckets), isExponential(i_isExponential)
+Histogram::Histogram()
 {
-    _ASSERT(nBuckets > 0);
-
-    buckets = new Bucket[nBuckets];
-    if (NULL == buckets) {
-        fprintf(stderr,"Histogram: unable to allocate buckets.\n");
-        soft_exit(1);
-    }
-
-    buckets[0].maxValue = 1;
-    buckets[0].count = 0;
+    clear();
+}
 
-    for (unsigned i = 1; i < nBuckets; i++) {
-        if (isExponential) {
-            buckets[i].maxValue = buckets[i-1].maxValue * 2;
-        } else {
-            buckets[i].maxValue = buckets[i-1].maxValue +1;
-        }
-        buckets[i].count = 0;
-    }
+    void
+Histogram::clear()
+{
+    count = 0;
+    total = 0;
+    maxValue = 0;
+    memset(buckets, 0, sizeof(buckets));
 }
 
-    unsigned
-Histogram::getBucketCount(unsigned whichBucket) const
+    void
+Histogram::add(const Histogram* other)
 {
-    _ASSERT(whichBucket < nBuckets);
-    return buckets[whichBucket].count;
+    if (other->count == 0) {
+        return;
+    }
+    for (int i = 0; i < NBuckets; i++) {
+        buckets[i] += other->buckets[i];
+    }
+    count += other->count;
+    total += other->total;
+    maxValue = __max(maxValue, other->maxValue);
 }
 
-    unsigned
-Histogram::getBucketMax(unsigned whichBucket) const
+    _int64
+Histogram::getBucketMin(int whichBucket)
 {
-    _ASSERT(whichBucket < nBuckets);
-    return buckets[whichBucket].maxValue;
+    _ASSERT(whichBucket >= 0 && whichBucket < NBuckets);
+    if (whichBucket < 2 * SubBuckets) {
+        return whichBucket;
+    }
+    int shift = whichBucket / SubBuckets - 1;
+    return (_int64) (whichBucket % SubBuckets + SubBuckets) << shift;
 }
 
-    unsigned
-Histogram::getBucketMin(unsigned whichBucket) const
+    _int64
+Histogram::getBucketMax(int whichBucket)
 {
-    _ASSERT(whichBucket < nBuckets);
-    if (0 == whichBucket) {
-        return 0;
+    _ASSERT(whichBucket >= 0 && whichBucket < NBuckets);
+    if (whichBucket < 2 * SubBuckets) {
+        return whichBucket;
     }
-    return buckets[whichBucket-1].maxValue + 1;
+    int shift = whichBucket / SubBuckets - 1;
+    return ((_int64) (whichBucket % SubBuckets + SubBuckets + 1) << shift) - 1;
 }
 
-    void
-Histogram::addToCount(unsigned value, unsigned amountToAdd)
+    _int64
+Histogram::getPercentile(double fraction) const
 {
-    for (unsigned i = 0 ; i < nBuckets; i++) {  // It is called "cheezy" after all
-        if (value <= buckets[i].maxValue) {
-            buckets[i].count += amountToAdd;
-            return;
+    if (count == 0) {
+        return 0;
+    }
+    _int64 rank = (_int64) ceil(fraction * count);
+    rank = __min(__max(rank, (_int64) 1), count);
+    _int64 seen = 0;
+    for (int i = 0; i < NBuckets - 1; i++) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            return __min(getBucketMax(i), maxValue);
         }
     }
-    //
-    // Overflow.  Just drop it.
-    //
+    return maxValue;
 }
 
-    void
-Histogram::print() const
+static const double ReportedFractions[] = {0.5, 0.9, 0.99, 0.999};
+static const char* ReportedNames[] = {"p50", "p90", "p99", "p999"};
+static const int NReported = sizeof(ReportedFractions) / sizeof(ReportedFractions[0]);
+
+    int
+Histogram::formatJson(char* buffer, size_t bufferSize, const char* name, double scale) const
 {
-    printf("MaxValue    Count\n");
-    printf("-------- --------\n");
-    for (unsigned i = 0; i < nBuckets; i++) {
-        printf("%8d %8d\n",buckets[i].maxValue, buckets[i].count);
+    int used = snprintf(buffer, bufferSize, "\"%s\":{\"count\":%lld,\"mean\":%.6g", name, count, getMean() / scale);
+    for (int i = 0; i < NReported; i++) {
+        used += snprintf(buffer + used, bufferSize - __min((size_t) used, bufferSize), ",\"%s\":%.6g",
+            ReportedNames[i], getPercentile(ReportedFractions[i]) / scale);
     }
+    used += snprintf(buffer + used, bufferSize - __min((size_t) used, bufferSize), ",\"max\":%.6g}", maxValue / scale);
+    return used;
 }
 
-Histogram::~Histogram()
+    void
+Histogram::print(FILE* out, const char* title, double scale) const
 {
-    delete [] buckets;
-    buckets = NULL;
+    fprintf(out, "%s: %lld, mean %.6g", title, count, getMean() / scale);
+    for (int i = 0; i < NReported; i++) {
+        fprintf(out, ", %s %.6g", ReportedNames[i], getPercentile(ReportedFractions[i]) / scale);
+    }
+    fprintf(out, ", max %.6g\n", maxValue / scale);
+    fprintf(out, "up to\tcount\n");
+    for (int i = 0; i < NBuckets; i++) {
+        if (buckets[i] != 0) {
+            fprintf(out, "%.6g\t%lld\n", (i == NBuckets - 1 ? maxValue : getBucketMax(i)) / scale, buckets[i]);
+        }
+    }
 }
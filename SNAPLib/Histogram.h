@@ -6,7 +6,7 @@ Module Name:
 
 Abstract:
 
-    Header for cheezy histogram class
+    Header for the log-linear histogram class used for latencies, sizes and counts
 
 Authors:
 
@@ -17,39 +17,100 @@ Environment:
     User mode service.
 
     This class is NOT thread safe.  It's the caller's responsibility to ensure that
-    at most one thread uses an instance at any time.
+    at most one thread uses an instance at any time.  Each thread keeps its own (in its
+    PerfCounters, say) and they're added together afterward.
 
 Revision History:
 
+    Replaced the linear and exponential buckets with log-linear ones, so one kind does for everything
+
 --*/
 
 #pragma once
 
+#include "Compat.h"
+
+//
+// Buckets values the way HdrHistogram does: each power of two is split into SubBuckets equal parts, so every bucket is
+// within 1/SubBuckets of its values (and values below SubBuckets get one each, so small counts are exact).  Recording is
+// a bit scan, a shift and an add, with no searching, and the buckets are a fixed array, so adding one histogram into
+// another is just adding the arrays.  Values past MaxValue all go into the last bucket, though the largest value is
+// kept exactly.
+//
 class Histogram {
 public:
-    Histogram(unsigned i_nBuckets, bool i_isExponential);
-
-    ~Histogram();
-
-    unsigned getNBuckets() const {return nBuckets;}
-    bool getIsExponential() const {return isExponential;}
-    unsigned getBucketCount(unsigned whichBucket) const;
-    unsigned getBucketMax(unsigned whichBucket) const;
-    unsigned getBucketMin(unsigned whichBucket) const;
-
-    void print() const;
-
-    void addToCount(unsigned value, unsigned amountToAdd = 1);
+    static const int SubBucketBits = 4;
+    static const int SubBuckets = 1 << SubBucketBits;
+    static const int MaxValueBits = 40;     // A bit over 18 minutes of nanoseconds, or 6 minutes of 3GHz ticks
+    static const _int64 MaxValue = ((_int64) 1 << MaxValueBits) - 1;
+    static const int NBuckets = SubBuckets + (MaxValueBits - SubBucketBits) * SubBuckets;
+
+    Histogram();
+
+    void clear();
+
+    void record(_int64 value)
+    {
+        value = __max(value, (_int64) 0);
+        buckets[bucketFor(value)]++;
+        count++;
+        total += value;
+        maxValue = __max(maxValue, value);
+    }
+
+    void add(const Histogram* other);
+
+    _int64 getCount() const {return count;}
+    _int64 getTotal() const {return total;}
+    _int64 getMax() const {return maxValue;}
+    double getMean() const {return count == 0 ? 0.0 : (double) total / count;}
+
+    //
+    // The smallest value that at least fraction (0 to 1) of the values are no bigger than, to within a bucket: it's
+    // the top of the bucket the value is in, or the largest value if that's less.  0 if there's nothing.
+    //
+    _int64 getPercentile(double fraction) const;
+
+    //
+    // The counts, percentiles and largest value as JSON object members (without the braces), with the values divided
+    // by scale (ticks per second, say, to turn ticks into seconds).  Returns the length, as snprintf does.
+    //
+    int formatJson(char* buffer, size_t bufferSize, const char* name, double scale = 1.0) const;
+
+    //
+    // A line of percentiles, then the buckets that have anything in them.
+    //
+    void print(FILE* out, const char* title, double scale = 1.0) const;
+
+    static int bucketFor(_int64 value)
+    {
+        if (value < SubBuckets) {
+            return (int) value;
+        }
+        if (value > MaxValue) {
+            return NBuckets - 1;
+        }
+        int highBit;
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanReverse64(&index, (unsigned __int64) value);
+        highBit = (int) index;
+#else
+        highBit = 63 - __builtin_clzll((unsigned long long) value);
+#endif
+        int shift = highBit - SubBucketBits;
+        return shift * SubBuckets + (int) (value >> shift);
+    }
+
+    // the range of values in a bucket
+    static _int64 getBucketMin(int whichBucket);
+    static _int64 getBucketMax(int whichBucket);
+
+    _int64 getBucketCount(int whichBucket) const {return buckets[whichBucket];}
 
 private:
-
-    unsigned nBuckets;
-    bool isExponential;
-
-    struct Bucket {
-        unsigned    maxValue;
-        unsigned    count;
-    };
-
-    Bucket *buckets;
+    _int64 count;
+    _int64 total;
+    _int64 maxValue;
+    _int64 buckets[NBuckets];
 };
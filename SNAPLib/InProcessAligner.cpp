@@ -0,0 +1,182 @@
+/*++
+
+Module Name:
+
+    InProcessAligner.cpp
+
+Abstract:
+
+    Aligning reads that are already in memory, for programs that link SNAPLib.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "InProcessAligner.h"
+#include "BaseAligner.h"
+#include "BigAlloc.h"
+#include "IntersectingPairedEndAligner.h"
+#include "ChimericPairedEndAligner.h"
+
+InProcessSingleAligner::InProcessSingleAligner(GenomeIndex *i_index, const AlignerOptions *options) :
+    index(i_index), maxDist(options->maxDist)
+{
+    allocator = new BigAllocator(BaseAligner::getBigAllocatorReservation(true, options->maxHits, MAX_READ_LENGTH, index->getSeedLength(),
+        options->numSeedsFromCommandLine, options->seedCoverage));
+
+    aligner = new (allocator) BaseAligner(
+            index,
+            options->maxHits,
+            options->maxDist,
+            MAX_READ_LENGTH,
+            options->numSeedsFromCommandLine,
+            options->seedCoverage,
+            options->extraSearchDepth,
+            NULL,               // LV
+            NULL,               // reverse LV
+            NULL,               // stats
+            allocator);
+
+    aligner->setExplorePopularSeeds(options->explorePopularSeeds);
+    aligner->setStopOnFirstHit(options->stopOnFirstHit);
+    aligner->setMapqToStopAt(options->mapqToStopAt);
+    aligner->setExactMatchMapq(options->exactMatchMapq);
+    aligner->setOrderSeedsByHits(options->orderSeedsByHits);
+    aligner->setLVBudget(options->lvBudget);
+}
+
+InProcessSingleAligner::~InProcessSingleAligner()
+{
+    aligner->~BaseAligner();    // The allocator owns the memory
+    delete allocator;
+}
+
+    void
+InProcessSingleAligner::alignReads(Read **reads, unsigned nReads, SingleAlignmentResult *results)
+{
+    //
+    // A batch at a time, like the single aligner context, so that the aligner can overlap the reads' memory stalls.
+    //
+    const unsigned batchSize = BaseAligner::readsPerBatch;
+    Read *readsToAlign[batchSize];
+    unsigned whichResult[batchSize];
+    AlignmentResult statuses[batchSize];
+    GenomeLocation locations[batchSize];
+    Direction directions[batchSize];
+    int scores[batchSize];
+    int mapqs[batchSize];
+
+    for (unsigned batchStart = 0; batchStart < nReads; batchStart += batchSize) {
+        unsigned nInBatch = __min(batchSize, nReads - batchStart);
+        unsigned nToAlign = 0;
+        for (unsigned i = batchStart; i < batchStart + nInBatch; i++) {
+            Read *read = reads[i];
+            if (read->getDataLength() >= MinReadLength && (int)read->countOfNs() <= maxDist) {
+                readsToAlign[nToAlign] = read;
+                whichResult[nToAlign] = i;
+                nToAlign++;
+            } else {
+                results[i].status = NotFound;
+                results[i].location = InvalidGenomeLocation;
+                results[i].direction = FORWARD;
+                results[i].score = -1;
+                results[i].mapq = 0;
+            }
+        }
+
+        aligner->AlignReads(readsToAlign, nToAlign, statuses, locations, directions, scores, mapqs);
+        allocator->checkCanaries();
+
+        for (unsigned i = 0; i < nToAlign; i++) {
+            SingleAlignmentResult *result = &results[whichResult[i]];
+            result->status = statuses[i];
+            result->location = locations[i];
+            result->direction = directions[i];
+            result->score = scores[i];
+            result->mapq = mapqs[i];
+        }
+    }
+}
+
+InProcessPairedAligner::InProcessPairedAligner(GenomeIndex *i_index, const PairedAlignerOptions *options) :
+    index(i_index), maxDist(options->maxDist)
+{
+    size_t memoryPoolSize = IntersectingPairedEndAligner::getBigAllocatorReservation(index, options->intersectingAlignerMaxHits, MAX_READ_LENGTH,
+        index->getSeedLength(), options->numSeedsFromCommandLine, options->seedCoverage, options->maxDist, options->extraSearchDepth,
+        options->maxCandidatePoolSize);
+    memoryPoolSize += ChimericPairedEndAligner::getBigAllocatorReservation(index, MAX_READ_LENGTH, options->maxHits, index->getSeedLength(),
+        options->numSeedsFromCommandLine, options->seedCoverage, options->maxDist, options->extraSearchDepth, options->maxCandidatePoolSize);
+
+    allocator = new BigAllocator(memoryPoolSize);
+
+    intersectingAligner = new (allocator) IntersectingPairedEndAligner(index, MAX_READ_LENGTH, options->maxHits, options->maxDist,
+        options->numSeedsFromCommandLine, options->seedCoverage, options->minSpacing, options->maxSpacing, options->intersectingAlignerMaxHits,
+        options->extraSearchDepth, options->maxCandidatePoolSize, allocator);
+
+    aligner = new (allocator) ChimericPairedEndAligner(
+        index,
+        MAX_READ_LENGTH,
+        options->maxHits,
+        options->maxDist,
+        options->numSeedsFromCommandLine,
+        options->seedCoverage,
+        options->forceSpacing,
+        options->extraSearchDepth,
+        intersectingAligner,
+        allocator);
+
+    aligner->setLVBudget(options->lvBudget);
+}
+
+InProcessPairedAligner::~InProcessPairedAligner()
+{
+    aligner->~ChimericPairedEndAligner();
+    intersectingAligner->~IntersectingPairedEndAligner();
+    delete allocator;
+}
+
+    bool
+InProcessPairedAligner::isUseful(Read *read) const
+{
+    return read->getDataLength() >= MinReadLength && (int)read->countOfNs() <= maxDist;
+}
+
+    void
+InProcessPairedAligner::alignPairs(Read **reads0, Read **reads1, unsigned nPairs, PairedAlignmentResult *results)
+{
+    const unsigned batchSize = PairedEndAligner::pairsPerBatch;
+    Read *readsToAlign[NUM_READS_PER_PAIR][batchSize];
+    unsigned whichResult[batchSize];
+    PairedAlignmentResult batchResults[batchSize];
+
+    for (unsigned batchStart = 0; batchStart < nPairs; batchStart += batchSize) {
+        unsigned nInBatch = __min(batchSize, nPairs - batchStart);
+        unsigned nToAlign = 0;
+        for (unsigned i = batchStart; i < batchStart + nInBatch; i++) {
+            if (isUseful(reads0[i]) || isUseful(reads1[i])) {
+                readsToAlign[0][nToAlign] = reads0[i];
+                readsToAlign[1][nToAlign] = reads1[i];
+                whichResult[nToAlign] = i;
+                nToAlign++;
+            } else {
+                memset(&results[i], 0, sizeof(results[i]));
+                for (int r = 0; r < NUM_READS_PER_PAIR; r++) {
+                    results[i].status[r] = NotFound;
+                    results[i].location[r] = InvalidGenomeLocation;
+                    results[i].direction[r] = FORWARD;
+                    results[i].score[r] = -1;
+                }
+            }
+        }
+
+        aligner->alignPairs(readsToAlign[0], readsToAlign[1], nToAlign, batchResults);
+        allocator->checkCanaries();
+
+        for (unsigned i = 0; i < nToAlign; i++) {
+            results[whichResult[i]] = batchResults[i];
+        }
+    }
+}
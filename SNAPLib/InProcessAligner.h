@@ -0,0 +1,93 @@
+/*++
+
+Module Name:
+
+    InProcessAligner.h
+
+Abstract:
+
+    Aligning reads that are already in memory, for programs that link SNAPLib rather than writing FASTQ for snap and
+    reading back its SAM.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "Read.h"
+#include "GenomeIndex.h"
+#include "AlignerOptions.h"
+#include "PairedAligner.h"
+#include "PairedEndAligner.h"
+
+class BaseAligner;
+class BigAllocator;
+class IntersectingPairedEndAligner;
+class ChimericPairedEndAligner;
+
+//
+// Using these takes an index from GenomeIndex::loadFromDirectory, which can be shared by any number of aligners and has to
+// outlast them, and options made with the AlignerOptions or PairedAlignerOptions constructor (which fills in the same
+// defaults as the command line) and then changed as needed.  Only the options that affect how reads are aligned are used;
+// the ones for input, output and filtering aren't.
+//
+// Each aligner has its own memory, reserved when it's made, and isn't thread safe, so each aligning thread needs its own.
+// Make them once and reuse them, since making one is much slower than aligning a read.
+//
+// Reads are set up with Read::init, pointing at the caller's buffers, which only need to last through the call.  Like snap,
+// reads shorter than MinReadLength or with more than maxDist Ns come back NotFound without being aligned.
+//
+
+struct SingleAlignmentResult {
+    AlignmentResult status;         // SingleHit or CertainHit if aligned, MultipleHit if it matches but not confidently, or NotFound
+    GenomeLocation  location;       // In the whole genome; Genome::getContigAtLocation turns it into a contig and offset
+    Direction       direction;
+    int             score;          // Edit distance, if it aligned
+    int             mapq;
+};
+
+class InProcessSingleAligner {
+public:
+    InProcessSingleAligner(GenomeIndex *i_index, const AlignerOptions *options);
+
+    ~InProcessSingleAligner();
+
+    void alignReads(Read **reads, unsigned nReads, SingleAlignmentResult *results);
+
+    static const unsigned MinReadLength = 50;
+
+private:
+
+    GenomeIndex    *index;
+    int             maxDist;
+    BigAllocator   *allocator;
+    BaseAligner    *aligner;
+};
+
+class InProcessPairedAligner {
+public:
+    InProcessPairedAligner(GenomeIndex *i_index, const PairedAlignerOptions *options);
+
+    ~InProcessPairedAligner();
+
+    //
+    // A pair is only skipped if neither end is worth aligning.
+    //
+    void alignPairs(Read **reads0, Read **reads1, unsigned nPairs, PairedAlignmentResult *results);
+
+    static const unsigned MinReadLength = InProcessSingleAligner::MinReadLength;
+
+private:
+
+    bool isUseful(Read *read) const;
+
+    GenomeIndex                    *index;
+    int                             maxDist;
+    BigAllocator                   *allocator;
+    IntersectingPairedEndAligner   *intersectingAligner;
+    ChimericPairedEndAligner       *aligner;
+};
@@ -0,0 +1,245 @@
+/*++
+
+Module Name:
+
+    IndexAutotune.cpp
+
+Abstract:
+
+    Picking the seed and hash table key sizes for an index build by trying them on a sample of the genome (index -autotune).
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "IndexAutotune.h"
+#include "GenomeIndex.h"
+#include "InProcessAligner.h"
+#include "ReadSimulator.h"
+#include "SeedBases.h"
+#include "WGsim.h"
+#include "exit.h"
+
+const double IndexAutotuner::AccuracyTolerance = 0.005;
+
+    Genome *
+IndexAutotuner::MakeSample(const Genome *genome, unsigned readLength, unsigned chromosomePadding)
+{
+    //
+    // Pieces much shorter than a read's worth of seeds wouldn't say much, so skip contigs that can't give one.
+    //
+    const unsigned minPieceLength = 1024 * 1024;
+    const Genome::Contig *contigs = genome->getContigs();
+    int sampleContigs[MaxSampleContigs];
+    int nSampleContigs = 0;
+    for (int i = 0; i < genome->getNumContigs() && nSampleContigs < MaxSampleContigs; i++) {
+        if (contigs[i].length > minPieceLength + readLength + chromosomePadding) {
+            sampleContigs[nSampleContigs++] = i;
+        }
+    }
+    if (0 == nSampleContigs) {
+        return NULL;
+    }
+
+    unsigned pieceLength = __max(SampleBases / nSampleContigs, minPieceLength);
+    GenomeLocation sampleSize = chromosomePadding;
+    for (int i = 0; i < nSampleContigs; i++) {
+        sampleSize += __min(pieceLength, contigs[sampleContigs[i]].length - chromosomePadding) + chromosomePadding;
+    }
+
+    Genome *sample = new Genome(sampleSize, sampleSize, chromosomePadding);
+    char *padding = new char[chromosomePadding + 1];
+    memset(padding, 'n', chromosomePadding);
+    padding[chromosomePadding] = '\0';
+    for (int i = 0; i < nSampleContigs; i++) {
+        //
+        // A contig's length takes in the padding after it, so its bases are in the first length - padding.  The middle is
+        // least likely to be telomere or centromere Ns.
+        //
+        const Genome::Contig *contig = &contigs[sampleContigs[i]];
+        GenomeLocation contigBases = contig->length - chromosomePadding;
+        unsigned length = (unsigned)__min(pieceLength, contigBases);
+        sample->addData(padding);
+        sample->startContig(contig->name);
+        sample->addData(genome->getSubstring(contig->beginningOffset + (contigBases - length) / 2, length), length);
+    }
+    sample->addData(padding);
+    delete [] padding;
+
+    sample->fillInContigLengths();
+    sample->sortContigsByName();
+    return sample;
+}
+
+    bool
+IndexAutotuner::TryCandidate(
+    const Genome *genome,
+    unsigned readLength,
+    const char *directoryName,
+    const BuildOptions &buildOptions,
+    Result *result)
+{
+    //
+    // Building an index consumes its genome, so each candidate needs its own sample.  The one that comes back with the
+    // index is laid out the same, so it's what the reads come from.
+    //
+    printf("\nTrying seed size %d with %d byte keys\n", result->seedLen, result->keySizeInBytes);
+    if (!GenomeIndex::BuildIndexToDirectory(MakeSample(genome, readLength, buildOptions.chromosomePadding), result->seedLen, buildOptions.slack, NULL, directoryName, buildOptions.overflowTableFactor,
+            buildOptions.maxThreads, buildOptions.chromosomePadding, false, result->keySizeInBytes, 0, NULL, buildOptions.bucketizedHashTables,
+            buildOptions.minimizerWindow, buildOptions.quotientedKeys)) {
+        return false;
+    }
+
+    const unsigned filenameBufferSize = MAX_PATH+1;
+    char filenameBuffer[filenameBufferSize];
+    snprintf(filenameBuffer, filenameBufferSize, "%s", directoryName);
+    GenomeIndex *index = GenomeIndex::loadFromDirectory(filenameBuffer);
+    if (NULL == index) {
+        fprintf(stderr, "Unable to load the sample index back from %s\n", directoryName);
+        return false;
+    }
+    const Genome *sample = index->getGenome();
+
+    //
+    // The genome grows linearly with the sample, and so, near enough, do the hash and overflow tables.
+    //
+    const char *tableFiles[] = {"GenomeIndexHash", "OverflowTable"};
+    _int64 sampleTableBytes = 0;
+    for (int i = 0; i < 2; i++) {
+        snprintf(filenameBuffer, filenameBufferSize, "%s%c%s", directoryName, PATH_SEP, tableFiles[i]);
+        sampleTableBytes += QueryFileSize(filenameBuffer);
+    }
+    _uint64 genomeBases = genome->getCountOfBases();
+    result->indexBytes = (_int64)((double)sampleTableBytes * genomeBases / sample->getCountOfBases()) + genomeBases;
+
+    ReadSimulator::Options simulatorOptions;
+    simulatorOptions.readLength = readLength;
+    ReadSimulator simulator(sample, simulatorOptions);
+    AlignerOptions alignerOptions("snap index -autotune");
+
+    char *ids = new char[SampleReads * ReadSimulator::MaxIdLength];
+    char *bases = new char[SampleReads * readLength];
+    char *qualities = new char[readLength];
+    memset(qualities, simulatorOptions.quality, readLength);
+    Read *reads = new Read[SampleReads];
+    Read **readPointers = new Read *[SampleReads];
+    for (unsigned i = 0; i < SampleReads; i++) {
+        char *data[2] = {bases + i * readLength, NULL};
+        unsigned lengths[2];
+        unsigned idLength = simulator.generate(i, ids + i * ReadSimulator::MaxIdLength, data, lengths);
+        if (0 == idLength) {
+            soft_exit(1);
+        }
+        reads[i].init(ids + i * ReadSimulator::MaxIdLength, idLength, data[0], qualities, lengths[0]);
+        readPointers[i] = &reads[i];
+    }
+
+    SingleAlignmentResult *results = new SingleAlignmentResult[SampleReads];
+    _int64 start = timeInMillis();
+    {
+        InProcessSingleAligner aligner(index, &alignerOptions);
+        aligner.alignReads(readPointers, SampleReads, results);
+    }
+    _int64 elapsed = __max(timeInMillis() - start, (_int64)1);
+
+    unsigned nCorrect = 0;
+    unsigned nMisaligned = 0;
+    for (unsigned i = 0; i < SampleReads; i++) {
+        if (SingleHit == results[i].status) {
+            if (wgsimReadMisaligned(&reads[i], results[i].location, sample, alignerOptions.maxDist)) {
+                nMisaligned++;
+            } else {
+                nCorrect++;
+            }
+        }
+    }
+    result->correct = (double)nCorrect / SampleReads;
+    result->misaligned = (double)nMisaligned / SampleReads;
+    result->readsPerSecond = (double)SampleReads * 1000 / elapsed;
+
+    delete [] results;
+    delete [] readPointers;
+    delete [] reads;
+    delete [] qualities;
+    delete [] bases;
+    delete [] ids;
+    delete index;
+    return true;
+}
+
+    bool
+IndexAutotuner::Run(
+    const Genome *genome,
+    unsigned readLength,
+    const char *directoryName,
+    const BuildOptions &buildOptions,
+    int *o_seedLen,
+    unsigned *o_keySizeInBytes)
+{
+    if (readLength < InProcessSingleAligner::MinReadLength || readLength > MAX_READ_LENGTH) {
+        fprintf(stderr, "-autotune read length must be between %d and %d\n", InProcessSingleAligner::MinReadLength, MAX_READ_LENGTH);
+        return false;
+    }
+
+    Genome *sample = MakeSample(genome, readLength, buildOptions.chromosomePadding);
+    if (NULL == sample) {
+        fprintf(stderr, "-autotune needs a contig of at least a megabase to sample\n");
+        return false;
+    }
+    printf("Autotuning on a %lld base sample from %d contigs\n", (_int64)sample->getCountOfBases(), sample->getNumContigs());
+    delete sample;
+
+    //
+    // Seeds much more than half a read long leave too few per read to get past errors.  The key size leaves the two bases
+    // above the key to pick the hash table, so there are 16 of them (one for 16 base seeds).  The smallest key that fits
+    // would make smaller entries, but for long seeds it splits a sample into so many little tables that some of them
+    // overflow the bias table's estimate.
+    //
+    const int candidateSeedLens[] = {16, 20, 24, 28, 32};
+    const int nCandidates = sizeof(candidateSeedLens) / sizeof(candidateSeedLens[0]);
+    Result results[nCandidates];
+    int nResults = 0;
+    for (int i = 0; i < nCandidates; i++) {
+        int seedLen = candidateSeedLens[i];
+        unsigned keySizeInBytes = __max(4u, (unsigned)(seedLen - 4) / 4);
+        if (seedLen > (int)LargestSeedSize || (unsigned)seedLen * 2 > readLength || keySizeInBytes > LargestKeySize) {
+            continue;
+        }
+        results[nResults].seedLen = seedLen;
+        results[nResults].keySizeInBytes = keySizeInBytes;
+        if (TryCandidate(genome, readLength, directoryName, buildOptions, &results[nResults])) {
+            nResults++;
+        }
+    }
+
+    if (0 == nResults) {
+        fprintf(stderr, "-autotune couldn't build any of the candidate indices\n");
+        return false;
+    }
+
+    double bestCorrect = 0;
+    for (int i = 0; i < nResults; i++) {
+        bestCorrect = __max(bestCorrect, results[i].correct);
+    }
+    int best = -1;
+    for (int i = 0; i < nResults; i++) {
+        if (results[i].correct >= bestCorrect - AccuracyTolerance && (-1 == best || results[i].readsPerSecond > results[best].readsPerSecond)) {
+            best = i;
+        }
+    }
+
+    printf("\nSeed  Key bytes  Index size (GB)  Correct  Misaligned  Reads/s (1 thread)\n");
+    for (int i = 0; i < nResults; i++) {
+        printf("%4d  %9d  %15.1f  %6.2f%%  %9.3f%%  %18.0f%s\n", results[i].seedLen, results[i].keySizeInBytes,
+            (double)results[i].indexBytes / (1024 * 1024 * 1024), results[i].correct * 100, results[i].misaligned * 100,
+            results[i].readsPerSecond, i == best ? "  <- using this" : "");
+    }
+    printf("\n");
+
+    *o_seedLen = results[best].seedLen;
+    *o_keySizeInBytes = results[best].keySizeInBytes;
+    return true;
+}
@@ -0,0 +1,77 @@
+/*++
+
+Module Name:
+
+    IndexAutotune.h
+
+Abstract:
+
+    Picking the seed and hash table key sizes for an index build by trying them on a sample of the genome (index -autotune).
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "Genome.h"
+
+//
+// Each candidate seed size, with a key size that splits the index into a few hash tables, gets an index of a sample of
+// the genome built in the output directory.  Simulated reads of the target length from the sample are then aligned
+// against it, to see how many land in the right place and how fast.  Indexing part of the genome leaves out most of its
+// repeats, so the absolute numbers are better than the whole genome will give, but the candidates compare about the
+// same way.  The index sizes are scaled up to the whole genome.
+//
+// The candidate that gets the most reads right wins, unless a faster one is within AccuracyTolerance of it.  The slack,
+// overflow factor and other build options are the ones given on the command line, for every candidate.
+//
+class IndexAutotuner
+{
+public:
+    struct BuildOptions {
+        double      slack;
+        _uint64     overflowTableFactor;
+        unsigned    maxThreads;
+        unsigned    chromosomePadding;
+        bool        bucketizedHashTables;
+        bool        quotientedKeys;
+        unsigned    minimizerWindow;
+    };
+
+    //
+    // Returns false if no candidate could be tried, with a message.  The output directory is left with the last
+    // candidate's index in it, for the real build to replace.
+    //
+    static bool Run(const Genome *genome, unsigned readLength, const char *directoryName, const BuildOptions &buildOptions,
+        int *o_seedLen, unsigned *o_keySizeInBytes);
+
+    static const unsigned SampleBases = 32 * 1024 * 1024;
+    static const unsigned SampleReads = 20000;
+    static const double AccuracyTolerance;     // Of the reads aligned correctly
+
+private:
+
+    //
+    // A genome of up to MaxSampleContigs equal pieces from the middles of the first contigs that are long enough, under
+    // the same names, so that the simulated reads' IDs say where they came from.  NULL if there aren't any.
+    //
+    static Genome *MakeSample(const Genome *genome, unsigned readLength, unsigned chromosomePadding);
+
+    static const int MaxSampleContigs = 8;
+
+    struct Result {
+        int         seedLen;
+        unsigned    keySizeInBytes;
+        _int64      indexBytes;         // Scaled up to the whole genome
+        double      correct;            // Fraction of the reads aligned to where they came from
+        double      misaligned;         // Fraction aligned confidently somewhere else
+        double      readsPerSecond;     // On one thread
+    };
+
+    static bool TryCandidate(const Genome *genome, unsigned readLength, const char *directoryName, const BuildOptions &buildOptions,
+        Result *result);
+};
@@ -0,0 +1,257 @@
+/*++
+
+Module Name:
+
+    InputOrder.cpp
+
+Abstract:
+
+    Writing the output in the same order as the input, however many threads are aligning (-ordered).
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "InputOrder.h"
+#include "ParallelTask.h"
+#include "PerfCounters.h"
+
+bool InputOrder::Enabled = false;
+
+struct InputOrderThread
+{
+    _int64              sequence;   // The slice this thread's output is up to; everything it writes from now on is from it or later
+    EventObject         turn;       // Signalled whenever another thread moves on, for this thread to check again
+    InputOrderThread   *next;
+    InputOrderThread   *prev;
+};
+
+//
+// The aligning threads, in no particular order.  There's one per thread, so a linear scan to find the furthest behind
+// is cheap next to filling a writer buffer.
+//
+class InputOrderThreads
+{
+public:
+    InputOrderThreads()
+    {
+        InitializeExclusiveLock(&lock);
+        threads.next = threads.prev = &threads;
+    }
+
+    ExclusiveLock       lock;
+    InputOrderThread    threads;
+
+    //
+    // Wakes the other threads to check whether it's their turn.  Called with the lock held.
+    //
+    void wakeOthers(InputOrderThread *thread)
+    {
+        for (InputOrderThread *other = threads.next; other != &threads; other = other->next) {
+            if (other != thread) {
+                AllowEventWaitersToProceed(&other->turn);
+            }
+        }
+    }
+};
+
+static InputOrderThreads inputOrderThreads;
+
+static PERF_THREAD_LOCAL InputOrderThread *currentThread = NULL;
+
+    void
+InputOrder::beginThread()
+{
+    //
+    // A thread starts out at slice 0, which is as far behind as anything can be, until it writes its first read.  It has
+    // to be on the list before it takes any slices: a thread that's taken a later slice than this one will have is
+    // sure to see it then.
+    //
+    InputOrderThread *thread = new InputOrderThread;
+    thread->sequence = 0;
+    CreateEventObject(&thread->turn);
+
+    AcquireExclusiveLock(&inputOrderThreads.lock);
+    thread->next = &inputOrderThreads.threads;
+    thread->prev = inputOrderThreads.threads.prev;
+    thread->prev->next = thread;
+    thread->next->prev = thread;
+    ReleaseExclusiveLock(&inputOrderThreads.lock);
+
+    currentThread = thread;
+}
+
+    void
+InputOrder::finishThread()
+{
+    InputOrderThread *thread = currentThread;
+    if (NULL == thread) {
+        return;
+    }
+    currentThread = NULL;
+
+    AcquireExclusiveLock(&inputOrderThreads.lock);
+    thread->prev->next = thread->next;
+    thread->next->prev = thread->prev;
+    inputOrderThreads.wakeOthers(thread);
+    ReleaseExclusiveLock(&inputOrderThreads.lock);
+
+    DestroyEventObject(&thread->turn);
+    delete thread;
+}
+
+    void
+InputOrder::movedTo(
+    _int64 sequence)
+{
+    InputOrderThread *thread = currentThread;
+    if (NULL == thread) {
+        return;
+    }
+
+    AcquireExclusiveLock(&inputOrderThreads.lock);
+    _ASSERT(sequence >= thread->sequence);
+    thread->sequence = sequence;
+    inputOrderThreads.wakeOthers(thread);
+    ReleaseExclusiveLock(&inputOrderThreads.lock);
+}
+
+    void
+InputOrder::waitForTurn()
+{
+    InputOrderThread *thread = currentThread;
+    if (NULL == thread) {
+        return;
+    }
+
+    //
+    // The other threads only ever move on, so once none of them is behind this one none of them ever will be.  Only
+    // this thread closes its own event, under the lock, so a wakeup can't be lost between checking and waiting.
+    //
+    AcquireExclusiveLock(&inputOrderThreads.lock);
+    for (;;) {
+        bool behind = false;
+        for (InputOrderThread *other = inputOrderThreads.threads.next; other != &inputOrderThreads.threads; other = other->next) {
+            if (other->sequence < thread->sequence) {
+                behind = true;
+                break;
+            }
+        }
+        if (! behind) {
+            break;
+        }
+        PreventEventWaitersFromProceeding(&thread->turn);
+        ReleaseExclusiveLock(&inputOrderThreads.lock);
+        {
+            PerfTimer timer(PerfCounters::QueueWait);
+            WorkPool::helpUntil(&thread->turn);
+        }
+        AcquireExclusiveLock(&inputOrderThreads.lock);
+    }
+    ReleaseExclusiveLock(&inputOrderThreads.lock);
+}
+
+//
+// Sends each slice's output to the file before any of the next one's, so that a writer batch never holds output from
+// two slices, and tells the others when the thread's moved on.
+//
+class InputOrderReadWriter : public ReadWriter
+{
+public:
+    InputOrderReadWriter(ReadWriter *i_inner) : inner(i_inner), sequence(-1) {}
+
+    virtual ~InputOrderReadWriter()
+    {
+        delete inner;
+    }
+
+    virtual bool writeHeader(const ReaderContext& context, bool sorted, int argc, const char **argv, const char *version, const char *rgLine)
+    {
+        return inner->writeHeader(context, sorted, argc, argv, version, rgLine);
+    }
+
+    virtual bool writeRead(Read *read, AlignmentResult result, int mapQuality, GenomeLocation genomeLocation, Direction direction,
+        const SpliceJunction *splice)
+    {
+        moveTo(read);
+        return inner->writeRead(read, result, mapQuality, genomeLocation, direction, splice);
+    }
+
+    virtual bool writeReads(int count, Read **reads, AlignmentResult *results, int *mapQualities, GenomeLocation *genomeLocations,
+        Direction *directions, const SpliceJunction **splices);
+
+    virtual bool writePair(Read *read0, Read *read1, PairedAlignmentResult *result)
+    {
+        moveTo(read0);
+        return inner->writePair(read0, read1, result);
+    }
+
+    virtual bool flush()
+    {
+        return inner->flush();
+    }
+
+    virtual void close()
+    {
+        inner->close();
+    }
+
+private:
+
+    void moveTo(Read *read)
+    {
+        //
+        // The thread's slices only go up, so anything else is a read that didn't come through a queue (-1), which
+        // goes with what's being written now.
+        //
+        _int64 readSequence = read->getInputSequence();
+        if (readSequence > sequence) {
+            if (sequence >= 0) {
+                inner->flush();
+            }
+            sequence = readSequence;
+            InputOrder::movedTo(sequence);
+        }
+    }
+
+    ReadWriter     *inner;
+    _int64          sequence;
+};
+
+    bool
+InputOrderReadWriter::writeReads(
+    int count,
+    Read **reads,
+    AlignmentResult *results,
+    int *mapQualities,
+    GenomeLocation *genomeLocations,
+    Direction *directions,
+    const SpliceJunction **splices)
+{
+    //
+    // Hand the inner writer each run of reads from the same slice together.
+    //
+    bool worked = true;
+    int first = 0;
+    while (first < count) {
+        moveTo(reads[first]);
+        int n = 1;
+        while (first + n < count && reads[first + n]->getInputSequence() <= sequence) {
+            n++;
+        }
+        worked &= inner->writeReads(n, reads + first, results + first, mapQualities + first, genomeLocations + first,
+            directions + first, NULL == splices ? NULL : splices + first);
+        first += n;
+    }
+    return worked;
+}
+
+    ReadWriter *
+InputOrder::wrap(
+    ReadWriter *inner)
+{
+    return new InputOrderReadWriter(inner);
+}
@@ -0,0 +1,60 @@
+/*++
+
+Module Name:
+
+    InputOrder.h
+
+Abstract:
+
+    Writing the output in the same order as the input, however many threads are aligning (-ordered).
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "Read.h"
+
+//
+// The reads all come through a ReadSupplierQueue, which numbers its slices in the order they were read, and each read
+// carries its slice's number.  Each aligning thread works through its slices in increasing order, so it can say which
+// slice its output is up to: the writer wrapped by wrap() moves it on, sending what's buffered for the earlier slice to
+// the file first, whenever a read from a later one comes along.
+//
+// A thread only hands a buffer to the file once every other thread is up to the same slice or a later one, so that
+// nothing from an earlier slice can still turn up after it.  That makes the reorder buffer the aligning threads' own
+// writer buffers: a thread that gets ahead waits with its buffer full rather than piling up more output, and the
+// thread that's furthest behind never waits.
+//
+class InputOrder
+{
+public:
+    static bool Enabled;
+
+    //
+    // Called on each aligning thread before it takes any reads, and once it's written its last.  Nothing's ordered
+    // for threads that haven't begun, like the one that writes the header.
+    //
+    static void beginThread();
+    static void finishThread();
+
+    //
+    // Called by the data writers before reserving a batch's place in the file.
+    //
+    static void waitForTurn();
+
+    //
+    // Wraps the thread's writer so that it moves the thread on as it sees reads from later slices.  Takes over inner.
+    //
+    static ReadWriter *wrap(ReadWriter *inner);
+
+private:
+
+    static void movedTo(_int64 sequence);
+
+    friend class InputOrderReadWriter;
+};
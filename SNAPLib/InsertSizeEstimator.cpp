@@ -0,0 +1,105 @@
+/*++
+
+Module Name:
+
+    InsertSizeEstimator.cpp
+
+Abstract:
+
+    Learns a library's spacing between paired ends from its first confidently paired reads.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "InsertSizeEstimator.h"
+#include "Util.h"
+
+InsertSizeEstimator::InsertSizeEstimator(unsigned i_minSpacing, unsigned i_maxSpacing, unsigned i_nSamplesNeeded) :
+    minSpacing(i_minSpacing), maxSpacing(i_maxSpacing), nSamplesNeeded(__max(1, i_nSamplesNeeded)), nSamples(0),
+    estimated(false), estimatedMinSpacing(i_minSpacing), estimatedMaxSpacing(i_maxSpacing)
+{
+    samples = new unsigned[nSamplesNeeded];
+    InitializeExclusiveLock(&lock);
+}
+
+InsertSizeEstimator::~InsertSizeEstimator()
+{
+    DestroyExclusiveLock(&lock);
+    delete [] samples;
+}
+
+    bool
+InsertSizeEstimator::isGoodSample(const PairedAlignmentResult *result)
+{
+    return result->alignedAsPair && result->fromAlignTogether &&
+        SingleHit == result->status[0] && SingleHit == result->status[1] &&
+        result->mapq[0] >= MinMAPQ && result->mapq[1] >= MinMAPQ &&
+        result->direction[0] != result->direction[1];
+}
+
+    unsigned
+InsertSizeEstimator::spacingOf(const PairedAlignmentResult *result)
+{
+    return (unsigned)(result->location[0] > result->location[1] ? result->location[0] - result->location[1] : result->location[1] - result->location[0]);
+}
+
+    void
+InsertSizeEstimator::addSamples(const unsigned *spacings, unsigned nSpacings)
+{
+    if (estimated || 0 == nSpacings) {
+        return;
+    }
+
+    AcquireExclusiveLock(&lock);
+    if (!estimated) {
+        unsigned nToCopy = __min(nSpacings, nSamplesNeeded - nSamples);
+        memcpy(samples + nSamples, spacings, nToCopy * sizeof(*samples));
+        nSamples += nToCopy;
+        if (nSamples == nSamplesNeeded) {
+            estimate();
+        }
+    }
+    ReleaseExclusiveLock(&lock);
+}
+
+    void
+InsertSizeEstimator::getSpacing(unsigned *o_minSpacing, unsigned *o_maxSpacing) const
+{
+    if (estimated) {
+        *o_minSpacing = estimatedMinSpacing;
+        *o_maxSpacing = estimatedMaxSpacing;
+    } else {
+        *o_minSpacing = minSpacing;
+        *o_maxSpacing = maxSpacing;
+    }
+}
+
+    void
+InsertSizeEstimator::estimate()
+{
+    std::sort(samples, samples + nSamples);
+    _int64 lowerQuartile = samples[nSamples / 4];
+    _int64 upperQuartile = samples[(nSamples * 3) / 4];
+    _int64 fence = (upperQuartile - lowerQuartile) * FenceInterquartileRanges;
+
+    //
+    // A library so tight that its quartiles coincide would otherwise get a window of a single spacing.
+    //
+    fence = __max(fence, (_int64)(upperQuartile / 10 + 1));
+
+    estimatedMinSpacing = (unsigned)__max((_int64)minSpacing, lowerQuartile - fence);
+    estimatedMaxSpacing = (unsigned)__min((_int64)maxSpacing, upperQuartile + fence);
+    if (estimatedMinSpacing > estimatedMaxSpacing) {
+        estimatedMinSpacing = minSpacing;
+        estimatedMaxSpacing = maxSpacing;
+    }
+
+    fprintf(stderr, "Estimated spacing between paired ends from %u pairs: quartiles %lld and %lld, searching %u to %u\n",
+        nSamples, lowerQuartile, upperQuartile, estimatedMinSpacing, estimatedMaxSpacing);
+
+    estimated = true;
+}
@@ -0,0 +1,79 @@
+/*++
+
+Module Name:
+
+    InsertSizeEstimator.h
+
+Abstract:
+
+    Learns a library's spacing between paired ends from its first confidently paired reads, so that the paired
+    aligner can search a window that fits the library rather than one wide enough for any library.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "PairedEndAligner.h"
+
+//
+// The aligning threads all feed the same estimator.  Once it has enough samples it works out a window from their
+// quartiles (the same outlier bounds as a box plot's fences, only wider) clamped to the range from the command line,
+// and stops taking samples.  Until then, and for ever if the input runs out first, the window is the whole range.
+//
+class InsertSizeEstimator {
+public:
+    InsertSizeEstimator(unsigned i_minSpacing, unsigned i_maxSpacing, unsigned i_nSamplesNeeded = DefaultSamplesNeeded);
+
+    ~InsertSizeEstimator();
+
+    //
+    // Only pairs that were aligned together, with both ends confidently placed facing each other, are worth
+    // counting.  Anything else might be a chimera, or a repeat that happened to land within the range.
+    //
+    static bool isGoodSample(const PairedAlignmentResult *result);
+
+    static unsigned spacingOf(const PairedAlignmentResult *result);
+
+    //
+    // Thread safe.  Extra samples past the number needed are ignored.
+    //
+    void addSamples(const unsigned *spacings, unsigned nSpacings);
+
+    //
+    // Whether the window's been worked out yet; if so there's no point in collecting more samples.
+    //
+    bool isEstimated() const { return estimated; }
+
+    //
+    // The learned window, or the whole range if there isn't one yet.
+    //
+    void getSpacing(unsigned *o_minSpacing, unsigned *o_maxSpacing) const;
+
+    static const unsigned DefaultSamplesNeeded = 10000;
+    static const int MinMAPQ = 30;
+    static const unsigned FenceInterquartileRanges = 4;    // How far past the quartiles the window reaches
+
+private:
+
+    void estimate();
+
+    const unsigned  minSpacing;
+    const unsigned  maxSpacing;
+    const unsigned  nSamplesNeeded;
+
+    unsigned       *samples;
+    unsigned        nSamples;
+    ExclusiveLock   lock;
+
+    //
+    // Volatile so that a thread that sees estimated set also sees the window it goes with.
+    //
+    volatile bool       estimated;
+    volatile unsigned   estimatedMinSpacing;
+    volatile unsigned   estimatedMaxSpacing;
+};
@@ -25,6 +25,7 @@ Revision History:
 #include "SeedSequencer.h"
 #include "mapq.h"
 #include "exit.h"
+#include "PerfCounters.h"
 
 #ifdef  _DEBUG
 extern bool _DumpAlignments;    // From BaseAligner.cpp
@@ -43,9 +44,9 @@ IntersectingPairedEndAligner::IntersectingPairedEndAligner(
         unsigned      extraSearchDepth_,
         unsigned      maxCandidatePoolSize,
         BigAllocator  *allocator) :
-    index(index_), maxReadSize(maxReadSize_), maxHits(maxHits_), maxK(maxK_), numSeedsFromCommandLine(__min(MAX_MAX_SEEDS,numSeedsFromCommandLine_)), minSpacing(minSpacing_), maxSpacing(maxSpacing_),
+    index(index_), decodedHits(maxBigHits_), maxReadSize(maxReadSize_), maxHits(maxHits_), maxK(maxK_), numSeedsFromCommandLine(__min(MAX_MAX_SEEDS,numSeedsFromCommandLine_)), minSpacing(minSpacing_), maxSpacing(maxSpacing_),
     landauVishkin(NULL), reverseLandauVishkin(NULL), maxBigHits(maxBigHits_), maxMergeDistance(31), seedCoverage(seedCoverage_) /*also should be a parameter*/,
-    extraSearchDepth(extraSearchDepth_), nLocationsScored(0)
+    extraSearchDepth(extraSearchDepth_), minReadLength(50), nLocationsScored(0), lvBudget(0), nPairsOverLVBudget(0)
 {
     unsigned maxSeedsToUse;
     if (0 != numSeedsFromCommandLine) {
@@ -67,6 +68,8 @@ IntersectingPairedEndAligner::IntersectingPairedEndAligner(
 
     nTable['N'] = 1;
 
+    decodedHits.setSkipPopularLists(true);  // Seeds with maxBigHits or more hits are ignored
+
     seedLen = index->getSeedLength();
 
     genome = index->getGenome();
@@ -102,10 +105,23 @@ IntersectingPairedEndAligner::allocateDynamicMemory(BigAllocator *allocator, uns
                                                     unsigned maxEditDistanceToConsider, unsigned maxExtraSearchDepth, unsigned maxCandidatePoolSize)
 {
     seedUsed = (BYTE *) allocator->allocate(100 + (maxReadSize + 7) / 8);
+    minimizerHashes = (_uint64 *)allocator->allocate(sizeof(_uint64) * maxReadSize);
+    isMinimizer = (bool *)allocator->allocate(sizeof(bool) * maxReadSize);
+
+    seedsToLookUp = (Seed *)allocator->allocate(sizeof(Seed) * maxSeedsToUse);
+    seedsBeginDisjointHitSet = (bool *)allocator->allocate(sizeof(bool) * maxSeedsToUse);
+    for (unsigned whichRead = 0; whichRead < NUM_READS_PER_PAIR; whichRead++) {
+        offsetsOfSeedsToLookUp[whichRead] = (unsigned *)allocator->allocate(sizeof(unsigned) * maxSeedsToUse);
+        for (Direction dir = 0; dir < NUM_DIRECTIONS; dir++) {
+            lookedUpNHits[whichRead][dir] = (unsigned *)allocator->allocate(sizeof(unsigned) * maxSeedsToUse);
+            lookedUpHits[whichRead][dir] = (const GenomeLocation **)allocator->allocate(sizeof(const GenomeLocation *) * maxSeedsToUse);
+        }
+    }
 
     for (unsigned whichRead = 0; whichRead < NUM_READS_PER_PAIR; whichRead++) {
         rcReadData[whichRead] = (char *)allocator->allocate(maxReadSize);
         rcReadQuality[whichRead] = (char *)allocator->allocate(maxReadSize);
+        packedSeeds[whichRead].setStorage(allocator->allocate(PackedSeeds::getStorageSize(maxReadSize)), maxReadSize);
 
         for (Direction dir = 0; dir < NUM_DIRECTIONS; dir++) {
             reversedRead[whichRead][dir] = (char *)allocator->allocate(maxReadSize);
@@ -121,10 +137,123 @@ IntersectingPairedEndAligner::allocateDynamicMemory(BigAllocator *allocator, uns
 
     for (unsigned i = 0; i < NUM_READS_PER_PAIR; i++) {
         scoringMateCandidates[i] = (ScoringMateCandidate *) allocator->allocate(sizeof(ScoringMateCandidate) * scoringCandidatePoolSize / NUM_READS_PER_PAIR);
+        scoringMateLocations[i] = (GenomeLocation *) allocator->allocate(sizeof(GenomeLocation) * scoringCandidatePoolSize / NUM_READS_PER_PAIR);
+        scoringMateBestPossibleScores[i] = (unsigned *) allocator->allocate(sizeof(unsigned) * scoringCandidatePoolSize / NUM_READS_PER_PAIR);
     }
 
     mergeAnchorPoolSize = scoringCandidatePoolSize;
     mergeAnchorPool = (MergeAnchor *)allocator->allocate(sizeof(MergeAnchor) * mergeAnchorPoolSize);
+
+    genomeUnpackBufferSize = maxReadSize + 3 * MAX_K;  // The read, MAX_K for deletions and MAX_K either side for the reverse LV
+    genomeUnpackBuffer = (char *)allocator->allocate(genomeUnpackBufferSize);
+}
+
+    unsigned
+IntersectingPairedEndAligner::lowestBestPossibleScoreOfMatesAtOrBelow(unsigned whichSetPair, unsigned nMates, GenomeLocation highestLocation, unsigned limit)
+{
+    const GenomeLocation *locations = scoringMateLocations[whichSetPair];
+    const unsigned *bestPossibleScores = scoringMateBestPossibleScores[whichSetPair];
+    unsigned lowest = limit;
+    int i = (int)nMates - 1;
+
+#if (defined(__SSE2__) || defined(_M_X64)) && !defined(LONG_GENOME_LOCATIONS)
+    //
+    // Four at a time for as long as none of them is above highestLocation.  SSE2 only has signed compares, so flip the top bits of the
+    // locations to compare them unsigned.  The scores are small, so they compare fine signed.  Long locations don't fit four to a
+    // register, so they just take the loop below.
+    //
+    const __m128i signBits = _mm_set1_epi32(0x80000000);
+    const __m128i highest = _mm_xor_si128(_mm_set1_epi32(highestLocation), signBits);
+    __m128i lowestSoFar = _mm_set1_epi32(limit);
+    for (; i >= 3; i -= 4) {
+        __m128i theseLocations = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(locations + i - 3)), signBits);
+        if (0 != _mm_movemask_epi8(_mm_cmpgt_epi32(theseLocations, highest))) {
+            break;
+        }
+        __m128i theseScores = _mm_loadu_si128((const __m128i *)(bestPossibleScores + i - 3));
+        __m128i lower = _mm_cmplt_epi32(theseScores, lowestSoFar);
+        lowestSoFar = _mm_or_si128(_mm_and_si128(lower, theseScores), _mm_andnot_si128(lower, lowestSoFar));
+    }
+
+    unsigned lanes[4];
+    _mm_storeu_si128((__m128i *)lanes, lowestSoFar);
+    lowest = __min(__min(lanes[0], lanes[1]), __min(lanes[2], lanes[3]));
+#endif  // SSE2
+
+    for (; i >= 0; i--) {
+        if (locations[i] > highestLocation) {
+            break;
+        }
+        lowest = __min(lowest, bestPossibleScores[i]);
+    }
+
+    return lowest;
+}
+
+    void
+IntersectingPairedEndAligner::prefetchCandidateWindows(ScoringCandidate *candidate, unsigned readWithFewerHits, unsigned readWithMoreHits)
+{
+    //
+    // Mates are scored in the order they're stored in (decreasing index), starting at scoringMateCandidateIndex, for as long as
+    // they're within maxSpacing.  Only the first few are worth fetching this early; most candidates don't get past them.
+    //
+    const unsigned maxMatesToPrefetch = 4;
+
+    //
+    // The reverse LV looks up to MAX_K before the location, and the forward one MAX_K past the end of the read.
+    //
+    GenomeLocation fewerLocation = candidate->readWithFewerHitsGenomeLocation;
+    index->prefetchGenomeData(fewerLocation > MAX_K ? fewerLocation - MAX_K : 0, reads[readWithFewerHits][FORWARD]->getDataLength() + 2 * MAX_K);
+
+    const GenomeLocation *mateLocations = scoringMateLocations[candidate->whichSetPair];
+    unsigned mateLength = reads[readWithMoreHits][FORWARD]->getDataLength() + 2 * MAX_K;
+    unsigned mateIndex = candidate->scoringMateCandidateIndex;
+    for (unsigned i = 0; i < maxMatesToPrefetch && isWithin(mateLocations[mateIndex], fewerLocation, maxSpacing); i++) {
+        index->prefetchGenomeData(mateLocations[mateIndex] > MAX_K ? mateLocations[mateIndex] - MAX_K : 0, mateLength);
+        if (0 == mateIndex) {
+            break;
+        }
+        mateIndex--;
+    }
+}
+
+    bool
+IntersectingPairedEndAligner::getSeedLookups(unsigned whichRead, SeedLookups *lookups) const
+{
+    lookups->nSeeds = countOfHashTableLookups[whichRead];
+    lookups->maxHitsDecoded = decodedHits.getMaxHitsPerList();
+    lookups->popularListsSkipped = decodedHits.getSkipPopularLists();
+    lookups->seedOffsets = offsetsOfSeedsToLookUp[whichRead];
+    for (Direction dir = FORWARD; dir < NUM_DIRECTIONS; dir++) {
+        lookups->nHits[dir] = lookedUpNHits[whichRead][dir];
+        lookups->hits[dir] = lookedUpHits[whichRead][dir];
+    }
+    return true;
+}
+
+    void
+IntersectingPairedEndAligner::prefetchPair(
+    Read                  *read0,
+    Read                  *read1)
+{
+    if (!doAlignerPrefetch) {
+        return;
+    }
+
+    //
+    // Phase 1 of align starts by looking up the seeds every seedLen bases, so get their hash table entries on their way.
+    // It's only a hint, so it doesn't matter if align ends up spacing the seeds differently.
+    //
+    Read *reads[NUM_READS_PER_PAIR] = {read0, read1};
+    for (unsigned whichRead = 0; whichRead < NUM_READS_PER_PAIR; whichRead++) {
+        unsigned readLen = reads[whichRead]->getDataLength();
+        const char *readData = reads[whichRead]->getData();
+        for (unsigned offset = 0; offset + seedLen <= readLen; offset += seedLen) {
+            if (Seed::DoesTextRepresentASeed(readData + offset, seedLen)) {
+                index->prefetchSeed(Seed(readData + offset, seedLen));
+            }
+        }
+    }
 }
 
     void
@@ -136,6 +265,11 @@ IntersectingPairedEndAligner::align(
 {
     result->nLVCalls = 0;
     result->nSmallHits = 0;
+    decodedHits.reset();
+    if (secondary != NULL) {
+        secondary->clear();
+        secondaryCandidates.reset();
+    }
 
     unsigned maxSeeds;
     if (numSeedsFromCommandLine != 0) {
@@ -162,7 +296,7 @@ IntersectingPairedEndAligner::align(
 
     Read rcReads[NUM_READS_PER_PAIR];
 
-    unsigned bestResultGenomeLocation[NUM_READS_PER_PAIR];
+    GenomeLocation bestResultGenomeLocation[NUM_READS_PER_PAIR];
     Direction bestResultDirection[NUM_READS_PER_PAIR];
     unsigned bestResultScore[NUM_READS_PER_PAIR];
     unsigned popularSeedsSkipped[NUM_READS_PER_PAIR];
@@ -173,7 +307,7 @@ IntersectingPairedEndAligner::align(
     //
     // Don't bother if one or both reads are too short.
     //
-    if (read0->getDataLength() < 50 || read1->getDataLength() < 50) {
+    if (read0->getDataLength() < minReadLength || read1->getDataLength() < minReadLength) {
          return;
     }
 
@@ -218,9 +352,11 @@ IntersectingPairedEndAligner::align(
     }
 
     //
-    // Build the reverse data for both reads in both directions for the backwards LV to use.
+    // Build the reverse data for both reads in both directions for the backwards LV to use, and pack the reads for
+    // the seeds to come from.
     //
     for (unsigned whichRead = 0; whichRead < NUM_READS_PER_PAIR; whichRead++) {
+        packedSeeds[whichRead].pack(reads[whichRead][FORWARD]->getData(), readLen[whichRead]);
         for (Direction dir = 0; dir < NUM_DIRECTIONS; dir++) {
             Read *read = reads[whichRead][dir];
 
@@ -245,18 +381,33 @@ IntersectingPairedEndAligner::align(
 
     //
     // Phase 1: do the hash table lookups for each of the seeds for each of the reads and add them to the hit sets.
+    // Which seeds we use doesn't depend on what the lookups find, so we pick all of a read's seeds first and then look
+    // them up as a batch, which lets the index overlap their cache misses.
     //
     for (unsigned whichRead = 0; whichRead < NUM_READS_PER_PAIR; whichRead++) {
         unsigned nextSeedToTest = 0;
         unsigned wrapCount = 0;
         unsigned nPossibleSeeds = readLen[whichRead] - seedLen + 1;
         memset(seedUsed, 0, (__max(readLen[0], readLen[1]) + 7) / 8);
-        bool beginsDisjointHitSet[NUM_DIRECTIONS] = {true, true};
+        bool beginsDisjointHitSet = true;
+
+        //
+        // If the index only has minimizers, the other seeds would never be found, so don't bother looking them up.
+        //
+        unsigned minimizerWindow = index->getMinimizerWindow();
+        if (minimizerWindow > 1) {
+            packedSeeds[whichRead].findMinimizers(seedLen, minimizerWindow, minimizerHashes, isMinimizer);
+            for (unsigned i = 0; i < nPossibleSeeds; i++) {
+                if (!isMinimizer[i]) {
+                    SetSeedUsed(i);
+                }
+            }
+        }
 
         while (countOfHashTableLookups[whichRead] < nPossibleSeeds && countOfHashTableLookups[whichRead] < maxSeeds) {
             if (nextSeedToTest >= nPossibleSeeds) {
                 wrapCount++;
-				beginsDisjointHitSet[FORWARD] = beginsDisjointHitSet[RC] = true;
+                beginsDisjointHitSet = true;
                 if (wrapCount >= seedLen) {
                     //
                     // There aren't enough valid seeds in this read to reach our target.
@@ -283,7 +434,7 @@ IntersectingPairedEndAligner::align(
 
             SetSeedUsed(nextSeedToTest);
 
-            if (!Seed::DoesTextRepresentASeed(reads[whichRead][FORWARD]->getData() + nextSeedToTest, seedLen)) {
+            if (!packedSeeds[whichRead].isSeed(nextSeedToTest, seedLen)) {
                 //
                 // It's got Ns in it, so just skip it.
                 //
@@ -291,31 +442,13 @@ IntersectingPairedEndAligner::align(
                 continue;
             }
 
-            Seed seed(reads[whichRead][FORWARD]->getData() + nextSeedToTest, seedLen);
-            //
-            // Find all instances of this seed in the genome.
-            //
-            unsigned nHits[NUM_DIRECTIONS];
-            const unsigned *hits[NUM_DIRECTIONS];
-
-            index->lookupSeed(seed, 0, InvalidGenomeLocation, &nHits[FORWARD], &hits[FORWARD], &nHits[RC], &hits[RC]);
+            unsigned whichSeed = countOfHashTableLookups[whichRead];
+            seedsToLookUp[whichSeed] = packedSeeds[whichRead].getSeed(nextSeedToTest, seedLen);
+            offsetsOfSeedsToLookUp[whichRead][whichSeed] = nextSeedToTest;
+            seedsBeginDisjointHitSet[whichSeed] = beginsDisjointHitSet;
+            beginsDisjointHitSet = false;
 
             countOfHashTableLookups[whichRead]++;
-            for (Direction dir = FORWARD; dir < NUM_DIRECTIONS; dir++) {
-                unsigned offset;
-                if (dir == FORWARD) {
-                    offset = nextSeedToTest;
-                } else {
-                    offset = readLen[whichRead] - seedLen - nextSeedToTest;
-                }
-                if (nHits[dir] < maxBigHits) {
-                    totalHashTableHits[whichRead][dir] += nHits[dir];
-                    hashTableHitSets[whichRead][dir]->recordLookup(offset, nHits[dir], hits[dir], beginsDisjointHitSet[dir]);
-                    beginsDisjointHitSet[dir]= false;
-                } else {
-                    popularSeedsSkipped[whichRead]++;
-                }
-            }
 
             //
             // If we don't have enough seeds left to reach the end of the read, space out the seeds more-or-less evenly.
@@ -328,6 +461,39 @@ IntersectingPairedEndAligner::align(
                 nextSeedToTest += seedLen;
             }
         } // while we need to lookup seeds for this read
+
+        //
+        // Find all instances of the seeds in the genome.
+        //
+        {
+            PerfTimer timer(PerfCounters::SeedLookup, countOfHashTableLookups[whichRead]);
+            index->lookupSeeds(seedsToLookUp, countOfHashTableLookups[whichRead], 0, InvalidGenomeLocation,
+                lookedUpNHits[whichRead][FORWARD], lookedUpHits[whichRead][FORWARD], lookedUpNHits[whichRead][RC], lookedUpHits[whichRead][RC], &decodedHits);
+        }
+
+        bool beginsDisjointHitSetForDirection[NUM_DIRECTIONS] = {true, true};
+        for (unsigned whichSeed = 0; whichSeed < countOfHashTableLookups[whichRead]; whichSeed++) {
+            if (seedsBeginDisjointHitSet[whichSeed]) {
+                beginsDisjointHitSetForDirection[FORWARD] = beginsDisjointHitSetForDirection[RC] = true;
+            }
+
+            for (Direction dir = FORWARD; dir < NUM_DIRECTIONS; dir++) {
+                unsigned offset;
+                if (dir == FORWARD) {
+                    offset = offsetsOfSeedsToLookUp[whichRead][whichSeed];
+                } else {
+                    offset = readLen[whichRead] - seedLen - offsetsOfSeedsToLookUp[whichRead][whichSeed];
+                }
+                unsigned nHits = lookedUpNHits[whichRead][dir][whichSeed];
+                if (nHits < maxBigHits) {
+                    totalHashTableHits[whichRead][dir] += nHits;
+                    hashTableHitSets[whichRead][dir]->recordLookup(offset, nHits, lookedUpHits[whichRead][dir][whichSeed], beginsDisjointHitSetForDirection[dir]);
+                    beginsDisjointHitSetForDirection[dir] = false;
+                } else {
+                    popularSeedsSkipped[whichRead]++;
+                }
+            }
+        }
     } // for each read
 
     readWithMoreHits = totalHashTableHits[0][FORWARD] + totalHashTableHits[0][RC] > totalHashTableHits[1][FORWARD] + totalHashTableHits[1][RC] ? 0 : 1;
@@ -358,8 +524,8 @@ IntersectingPairedEndAligner::align(
         }
 
         unsigned            lastSeedOffsetForReadWithFewerHits;
-        unsigned            lastGenomeLocationForReadWithFewerHits;
-        unsigned            lastGenomeLocationForReadWithMoreHits;
+        GenomeLocation      lastGenomeLocationForReadWithFewerHits;
+        GenomeLocation      lastGenomeLocationForReadWithMoreHits;
         unsigned            lastSeedOffsetForReadWithMoreHits;
 
         bool                outOfMoreHitsLocations = false;
@@ -402,7 +568,7 @@ IntersectingPairedEndAligner::align(
 
             if ((lastGenomeLocationForReadWithMoreHits + maxSpacing < lastGenomeLocationForReadWithFewerHits || outOfMoreHitsLocations) &&
                 (0 == lowestFreeScoringMateCandidate[whichSetPair] ||
-                !isWithin(scoringMateCandidates[whichSetPair][lowestFreeScoringMateCandidate[whichSetPair]-1].readWithMoreHitsGenomeLocation, lastGenomeLocationForReadWithFewerHits, maxSpacing))) {
+                !isWithin(scoringMateLocations[whichSetPair][lowestFreeScoringMateCandidate[whichSetPair]-1], lastGenomeLocationForReadWithFewerHits, maxSpacing))) {
                 //
                 // No mates for the hit on the read with fewer hits.  Skip to the next candidate.
                 //
@@ -427,7 +593,7 @@ IntersectingPairedEndAligner::align(
             // Add all of the mate candidates for this fewer side hit.
             //
 
-            unsigned previousMoreHitsLocation = lastGenomeLocationForReadWithMoreHits;
+            GenomeLocation previousMoreHitsLocation = lastGenomeLocationForReadWithMoreHits;
             while (lastGenomeLocationForReadWithMoreHits + maxSpacing >= lastGenomeLocationForReadWithFewerHits && !outOfMoreHitsLocations) {
                 unsigned bestPossibleScoreForReadWithMoreHits = setPair[readWithMoreHits]->computeBestPossibleScoreForCurrentHit();
 
@@ -435,8 +601,9 @@ IntersectingPairedEndAligner::align(
                     fprintf(stderr,"Ran out of scoring candidate pool entries.  Perhaps trying with a larger value of -mcp will help.\n");
                     soft_exit(1);
                 }
-                scoringMateCandidates[whichSetPair][lowestFreeScoringMateCandidate[whichSetPair]].init(
-                                lastGenomeLocationForReadWithMoreHits, bestPossibleScoreForReadWithMoreHits, lastSeedOffsetForReadWithMoreHits);
+                scoringMateCandidates[whichSetPair][lowestFreeScoringMateCandidate[whichSetPair]].init(lastSeedOffsetForReadWithMoreHits);
+                scoringMateLocations[whichSetPair][lowestFreeScoringMateCandidate[whichSetPair]] = lastGenomeLocationForReadWithMoreHits;
+                scoringMateBestPossibleScores[whichSetPair][lowestFreeScoringMateCandidate[whichSetPair]] = bestPossibleScoreForReadWithMoreHits;
 
 #ifdef _DEBUG
                 if (_DumpAlignments) {
@@ -464,13 +631,8 @@ IntersectingPairedEndAligner::align(
             //
             unsigned bestPossibleScoreForReadWithFewerHits = setPair[readWithFewerHits]->computeBestPossibleScoreForCurrentHit();
 
-            unsigned lowestBestPossibleScoreOfAnyPossibleMate = maxK + extraSearchDepth;
-            for (int i = lowestFreeScoringMateCandidate[whichSetPair] - 1; i >= 0; i--) {
-                if (scoringMateCandidates[whichSetPair][i].readWithMoreHitsGenomeLocation > lastGenomeLocationForReadWithFewerHits + maxSpacing) {
-                    break;
-                }
-                lowestBestPossibleScoreOfAnyPossibleMate = __min(lowestBestPossibleScoreOfAnyPossibleMate, scoringMateCandidates[whichSetPair][i].bestPossibleScore);
-            }
+            unsigned lowestBestPossibleScoreOfAnyPossibleMate = lowestBestPossibleScoreOfMatesAtOrBelow(whichSetPair, lowestFreeScoringMateCandidate[whichSetPair],
+                                                                        lastGenomeLocationForReadWithFewerHits + maxSpacing, maxK + extraSearchDepth);
 
             if (lowestBestPossibleScoreOfAnyPossibleMate + bestPossibleScoreForReadWithFewerHits <= maxK + extraSearchDepth) {
                 //
@@ -513,10 +675,34 @@ IntersectingPairedEndAligner::align(
     //
     unsigned currentBestPossibleScoreList = 0;
     scoreLimit = maxK + extraSearchDepth;
+
     //
-    // Loop until we've scored all of the candidates, or proven that what's left must have too high of a score to be interesting.
+    // Get the genome windows for the first few candidates we'll score on their way to the cache.  After that, each candidate
+    // prefetches for the one behind it on its list while it's being scored, which keeps the lookahead bounded.
     //
+    const unsigned candidatesToPrefetch = 4;
+    if (doAlignerPrefetch) {
+        unsigned nPrefetched = 0;
+        for (unsigned list = 0; list <= maxUsedBestPossibleScoreList && list <= scoreLimit && nPrefetched < candidatesToPrefetch; list++) {
+            for (ScoringCandidate *candidate = scoringCandidates[list]; NULL != candidate && nPrefetched < candidatesToPrefetch; candidate = candidate->scoreListNext) {
+                prefetchCandidateWindows(candidate, readWithFewerHits, readWithMoreHits);
+                nPrefetched++;
+            }
+        }
+    }
+    //
+    // Loop until we've scored all of the candidates, or proven that what's left must have too high of a score to be interesting,
+    // or used up the pair's LV budget.
+    //
+    _int64 lvScoreLimit = 0 == lvBudget ? -1 : nLocationsScored + (_int64)lvBudget * NUM_READS_PER_PAIR;
+    bool overLVBudget = false;
     while (currentBestPossibleScoreList <= maxUsedBestPossibleScoreList && currentBestPossibleScoreList <= scoreLimit) {
+        if (lvScoreLimit >= 0 && nLocationsScored >= lvScoreLimit) {
+            overLVBudget = true;
+            nPairsOverLVBudget++;
+            break;
+        }
+
         if (scoringCandidates[currentBestPossibleScoreList] == NULL) {
             //
             // No more candidates on this list.  Skip to the next one.
@@ -531,6 +717,16 @@ IntersectingPairedEndAligner::align(
         //
         ScoringCandidate *candidate = scoringCandidates[currentBestPossibleScoreList];
 
+        if (doAlignerPrefetch) {
+            ScoringCandidate *upcoming = candidate;
+            for (unsigned i = 0; i < candidatesToPrefetch && NULL != upcoming; i++) {
+                upcoming = upcoming->scoreListNext;
+            }
+            if (NULL != upcoming) {
+                prefetchCandidateWindows(upcoming, readWithFewerHits, readWithMoreHits);
+            }
+        }
+
         unsigned fewerEndScore;
         double fewerEndMatchProbability;
         int fewerEndGenomeLocationOffset;
@@ -557,8 +753,10 @@ IntersectingPairedEndAligner::align(
             for (;;) {
 
                 ScoringMateCandidate *mate = &scoringMateCandidates[candidate->whichSetPair][mateIndex];
-                _ASSERT(isWithin(mate->readWithMoreHitsGenomeLocation, candidate->readWithFewerHitsGenomeLocation, maxSpacing));
-                if (!isWithin(mate->readWithMoreHitsGenomeLocation, candidate->readWithFewerHitsGenomeLocation, minSpacing) && mate->bestPossibleScore <= scoreLimit - fewerEndScore) {
+                GenomeLocation mateLocation = scoringMateLocations[candidate->whichSetPair][mateIndex];
+                unsigned mateBestPossibleScore = scoringMateBestPossibleScores[candidate->whichSetPair][mateIndex];
+                _ASSERT(isWithin(mateLocation, candidate->readWithFewerHitsGenomeLocation, maxSpacing));
+                if (!isWithin(mateLocation, candidate->readWithFewerHitsGenomeLocation, minSpacing) && mateBestPossibleScore <= scoreLimit - fewerEndScore) {
                     //
                     // It's within the range and not necessarily too poor of a match.  Consider it.
                     //
@@ -568,18 +766,18 @@ IntersectingPairedEndAligner::align(
                     // use now, score it.
                     //
                     if (mate->score == -2 || mate->score == -1 && mate->scoreLimit < scoreLimit - fewerEndScore) {
-                        scoreLocation(readWithMoreHits, setPairDirection[candidate->whichSetPair][readWithMoreHits], mate->readWithMoreHitsGenomeLocation,
+                        scoreLocation(readWithMoreHits, setPairDirection[candidate->whichSetPair][readWithMoreHits], mateLocation,
                             mate->seedOffset, scoreLimit - fewerEndScore, &mate->score, &mate->matchProbability,
                             &mate->genomeOffset);
 #ifdef _DEBUG
                         if (_DumpAlignments) {
                             printf("Scored mate candidate %d, set pair %d, read %d, location %u, seed offset %d, score limit %d, score %d, offset %d\n",
-                                (int)(mate - scoringMateCandidates[candidate->whichSetPair]), candidate->whichSetPair, readWithMoreHits, mate->readWithMoreHitsGenomeLocation,
+                                (int)(mate - scoringMateCandidates[candidate->whichSetPair]), candidate->whichSetPair, readWithMoreHits, mateLocation,
                                 mate->seedOffset, scoreLimit - fewerEndScore, mate->score, mate->genomeOffset);
                         }
 #endif // _DEBUG
 
-                        _ASSERT(-1 == mate->score || mate->score >= mate->bestPossibleScore);
+                        _ASSERT(-1 == mate->score || mate->score >= mateBestPossibleScore);
 
                         mate->scoreLimit = scoreLimit - fewerEndScore;
                     }
@@ -638,14 +836,14 @@ IntersectingPairedEndAligner::align(
 
                             firstFreeMergeAnchor++;
 
-                            mergeAnchor->init(mate->readWithMoreHitsGenomeLocation + mate->genomeOffset, candidate->readWithFewerHitsGenomeLocation + fewerEndGenomeLocationOffset,
+                            mergeAnchor->init(mateLocation + mate->genomeOffset, candidate->readWithFewerHitsGenomeLocation + fewerEndGenomeLocationOffset,
                                 pairProbability, pairScore);
 
                             merged = false;
                             oldPairProbability = 0;
                             candidate->mergeAnchor = mergeAnchor;
                         } else {
-                            merged = mergeAnchor->checkMerge(mate->readWithMoreHitsGenomeLocation + mate->genomeOffset, candidate->readWithFewerHitsGenomeLocation + fewerEndGenomeLocationOffset,
+                            merged = mergeAnchor->checkMerge(mateLocation + mate->genomeOffset, candidate->readWithFewerHitsGenomeLocation + fewerEndGenomeLocationOffset,
                                 pairProbability, pairScore, &oldPairProbability);
                         }
 
@@ -659,6 +857,15 @@ IntersectingPairedEndAligner::align(
 
                             bool isBestHit = false;
 
+                            if (secondary != NULL && pairScore <= maxK) {
+                                IdPair pairs[NUM_READS_PER_PAIR];
+                                pairs[readWithFewerHits].id = candidate->readWithFewerHitsGenomeLocation + fewerEndGenomeLocationOffset;
+                                pairs[readWithMoreHits].id = mateLocation + mate->genomeOffset;
+                                pairs[readWithFewerHits].value = setPairDirection[candidate->whichSetPair][readWithFewerHits];
+                                pairs[readWithMoreHits].value = setPairDirection[candidate->whichSetPair][readWithMoreHits];
+                                secondaryCandidates.add(pairScore, pairProbability, pairs[0], pairs[1]);
+                            }
+
                             const double EPSILON = 1e-14;
                             if (pairScore <= maxK && (pairScore < bestPairScore ||
                                 (pairScore == bestPairScore && pairProbability > probabilityOfBestPair + EPSILON))) {
@@ -668,7 +875,7 @@ IntersectingPairedEndAligner::align(
                                 bestPairScore = pairScore;
                                 probabilityOfBestPair = pairProbability;
                                 bestResultGenomeLocation[readWithFewerHits] = candidate->readWithFewerHitsGenomeLocation + fewerEndGenomeLocationOffset;
-                                bestResultGenomeLocation[readWithMoreHits] = mate->readWithMoreHitsGenomeLocation + mate->genomeOffset;
+                                bestResultGenomeLocation[readWithMoreHits] = mateLocation + mate->genomeOffset;
                                 bestResultScore[readWithFewerHits] = fewerEndScore;
                                 bestResultScore[readWithMoreHits] = mate->score;
                                 bestResultDirection[readWithFewerHits] = setPairDirection[candidate->whichSetPair][readWithFewerHits];
@@ -677,19 +884,6 @@ IntersectingPairedEndAligner::align(
                                 scoreLimit = bestPairScore + extraSearchDepth;
 
                                 isBestHit = true;
-
-                                if (secondary != NULL) {
-                                    secondary->clear();
-                                }
-                            } else if (secondary != NULL && pairScore <= maxK && pairScore == bestPairScore && pairProbability >= probabilityOfBestPair - EPSILON) {
-                                // equivalent to best, add to secondary alignment list
-                                IdPair pairs[2];
-                                pairs[readWithFewerHits].id = candidate->readWithFewerHitsGenomeLocation + fewerEndGenomeLocationOffset;
-                                pairs[readWithMoreHits].id = mate->readWithMoreHitsGenomeLocation + mate->genomeOffset;
-                                pairs[readWithFewerHits].value = setPairDirection[candidate->whichSetPair][readWithFewerHits];
-                                pairs[readWithMoreHits].value = setPairDirection[candidate->whichSetPair][readWithMoreHits];
-                                secondary->push_back(pairs[0]);
-                                secondary->push_back(pairs[1]);
                             }
 
                             probabilityOfAllPairs += pairProbability;
@@ -697,7 +891,7 @@ IntersectingPairedEndAligner::align(
                             if (_DumpAlignments) {
                                 printf("Added %e (= %e * %e) @ (%u, %u), giving new probability of all pairs %e, score %d = %d + %d%s\n",
                                     pairProbability, mate->matchProbability , fewerEndMatchProbability,
-                                    candidate->readWithFewerHitsGenomeLocation + fewerEndGenomeLocationOffset, mate->readWithMoreHitsGenomeLocation + mate->genomeOffset,
+                                    candidate->readWithFewerHitsGenomeLocation + fewerEndGenomeLocationOffset, mateLocation + mate->genomeOffset,
                                     probabilityOfAllPairs,
                                     pairScore, fewerEndScore, mate->score, isBestHit ? " New best hit" : "");
                             }
@@ -713,7 +907,7 @@ IntersectingPairedEndAligner::align(
                     }// if the mate has a non -1 score
                 }
 
-                if (mateIndex == 0 || !isWithin(scoringMateCandidates[candidate->whichSetPair][mateIndex-1].readWithMoreHitsGenomeLocation, candidate->readWithFewerHitsGenomeLocation, maxSpacing)) {
+                if (mateIndex == 0 || !isWithin(scoringMateLocations[candidate->whichSetPair][mateIndex-1], candidate->readWithFewerHitsGenomeLocation, maxSpacing)) {
                     //
                     // Out of mate candidates.
                     //
@@ -752,9 +946,20 @@ doneScoring:
             result->location[whichRead] = bestResultGenomeLocation[whichRead];
             result->direction[whichRead] = bestResultDirection[whichRead];
             result->mapq[whichRead] = computeMAPQ(probabilityOfAllPairs, probabilityOfBestPair, bestResultScore[whichRead], popularSeedsSkipped[0] + popularSeedsSkipped[1]);
+            if (overLVBudget) {
+                result->mapq[whichRead] /= OverLVBudgetMapqDivisor;   // Something we didn't get to might have been better
+            }
             result->status[whichRead] = result->mapq[whichRead] > 10 ? SingleHit : MultipleHits;
             result->score[whichRead] = bestResultScore[whichRead];
         }
+
+        if (secondary != NULL) {
+            IdPair primary[NUM_READS_PER_PAIR];
+            for (unsigned whichRead = 0; whichRead < NUM_READS_PER_PAIR; whichRead++) {
+                primary[whichRead] = IdPair(bestResultGenomeLocation[whichRead], bestResultDirection[whichRead]);
+            }
+            secondaryCandidates.emit(secondary, primary, NUM_READS_PER_PAIR, maxMergeDistance);
+        }
 #ifdef  _DEBUG
             if (_DumpAlignments) {
                 printf("Returned %u %s %u %s with MAPQ %d and %d, probability of all pairs %e, probability of best pair %e\n",
@@ -769,7 +974,7 @@ doneScoring:
 IntersectingPairedEndAligner::scoreLocation(
     unsigned             whichRead,
     Direction            direction,
-    unsigned             genomeLocation,
+    GenomeLocation       genomeLocation,
     unsigned             seedOffset,
     unsigned             scoreLimit,
     unsigned            *score,
@@ -781,7 +986,7 @@ IntersectingPairedEndAligner::scoreLocation(
     Read *readToScore = reads[whichRead][direction];
     unsigned readDataLength = readToScore->getDataLength();
     unsigned genomeDataLength = readDataLength + MAX_K; // Leave extra space in case the read has deletions
-    const char *data = genome->getSubstring(genomeLocation, genomeDataLength);
+    const char *data = genome->getSubstring(genomeLocation, genomeDataLength, genomeUnpackBuffer, genomeUnpackBufferSize);
     if (NULL == data) {
         //
         // We're up against the end of a contig.  Reduce the extra space enough that it isn't too
@@ -790,7 +995,7 @@ IntersectingPairedEndAligner::scoreLocation(
         //
         const Genome::Contig *contig = genome->getContigAtLocation(genomeLocation);
 
-        unsigned endOffset;
+        GenomeLocation endOffset;
         if (genomeLocation + readDataLength + MAX_K >= genome->getCountOfBases()) {
             endOffset = genome->getCountOfBases();
         } else {
@@ -799,9 +1004,9 @@ IntersectingPairedEndAligner::scoreLocation(
 
             endOffset = nextContig->beginningOffset;
         }
-        genomeDataLength = endOffset - genomeLocation - 1;
+        genomeDataLength = (unsigned)(endOffset - genomeLocation - 1);
         if (genomeDataLength >= readDataLength - MAX_K) {
-            data = genome->getSubstring(genomeLocation, genomeDataLength);
+            data = genome->getSubstring(genomeLocation, genomeDataLength, genomeUnpackBuffer, genomeUnpackBufferSize);
             _ASSERT(NULL != data);
         }
     }
@@ -826,7 +1031,10 @@ IntersectingPairedEndAligner::scoreLocation(
     _ASSERT(!memcmp(data+seedOffset, readToScore->getData() + seedOffset, seedLen));    // that the seed actually matches
 
     // NB: This cacheKey computation MUST match the one in BaseAligner or all hell will break loose.
-    _uint64 cacheKey = (genomeLocation + tailStart) | (((_uint64) direction) << 32) | (((_uint64) whichRead) << 33) | (((_uint64)tailStart) << 34);
+    // The key doesn't say how much genome there is, so don't use the cache for the short windows at contig ends.
+    _uint64 cacheKey = genomeDataLength != readDataLength + MAX_K || (_uint64)genomeLocation + tailStart >= ((_uint64)1 << GenomeLocationBits) ? 0 :
+        (genomeLocation + tailStart) | (((_uint64) direction) << GenomeLocationBits) | (((_uint64) whichRead) << (GenomeLocationBits + 1)) |
+        (((_uint64)tailStart) << (GenomeLocationBits + 2));
 
     score1 = landauVishkin->computeEditDistance(data + tailStart, genomeDataLength - tailStart, readToScore->getData() + tailStart, readToScore->getQuality() + tailStart, readLen - tailStart,
         scoreLimit, &matchProb1, cacheKey);
@@ -844,7 +1052,7 @@ IntersectingPairedEndAligner::scoreLocation(
             *score = score1 + score2;
             _ASSERT(*score <= scoreLimit);
             // Map probabilities for substrings can be multiplied, but make sure to count seed too
-            *matchProbability = matchProb1 * matchProb2 * pow(1 - SNP_PROB, seedLen);
+            *matchProbability = matchProb1 * matchProb2 * lv_perfectMatchProbability[seedLen];
         }
     }
 
@@ -871,7 +1079,7 @@ IntersectingPairedEndAligner::HashTableHitSet::init()
     lookupListHead->nextLookupWithRemainingMembers = lookupListHead->prevLookupWithRemainingMembers = lookupListHead;
 }
     void
-IntersectingPairedEndAligner::HashTableHitSet::recordLookup(unsigned seedOffset, unsigned nHits, const unsigned *hits, bool beginsDisjointHitSet)
+IntersectingPairedEndAligner::HashTableHitSet::recordLookup(unsigned seedOffset, unsigned nHits, const GenomeLocation *hits, bool beginsDisjointHitSet)
 {
     _ASSERT(nLookupsUsed < maxSeeds);
     if (beginsDisjointHitSet) {
@@ -942,21 +1150,87 @@ IntersectingPairedEndAligner::HashTableHitSet::computeBestPossibleScoreForCurren
 	return bestPossibleScoreSoFar;
 }
 
+//
+// Returns the index of the first of hits[start..nHits-1] that's no bigger than maxLocation, or nHits if there isn't one.  Hits are sorted
+// from largest to smallest, and the one we want is usually only a few past start, so look at the first few directly (several at a time
+// with SSE2), then gallop out by doubling steps and finish with a binary search over the last step.  That touches memory near start rather
+// than probing the middle of what can be a very long list first.
+//
+    static inline unsigned
+FindFirstHitAtOrBelow(const GenomeLocation *hits, unsigned start, unsigned nHits, GenomeLocation maxLocation)
+{
+    const unsigned nearbyHits = 8;
+    unsigned i = start;
+
+#if (defined(__SSE2__) || defined(_M_X64)) && !defined(LONG_GENOME_LOCATIONS)
+    //
+    // SSE2 only has signed compares, so flip the top bits to compare unsigned.  (This is for 32 bit locations.)
+    //
+    const __m128i signBits = _mm_set1_epi32(0x80000000);
+    const __m128i maxLocationFlipped = _mm_xor_si128(_mm_set1_epi32(maxLocation), signBits);
+    for (; i + 4 <= nHits && i < start + nearbyHits; i += 4) {
+        __m128i these = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(hits + i)), signBits);
+        int tooBigMask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(these, maxLocationFlipped)));
+        if (tooBigMask != 0xf) {
+            unsigned long firstSmallEnough;
+            _BitScanForward64(&firstSmallEnough, ~tooBigMask & 0xf);
+            return i + firstSmallEnough;
+        }
+    }
+#endif  // SSE2
+
+    for (; i < nHits && i < start + nearbyHits; i++) {
+        if (hits[i] <= maxLocation) {
+            return i;
+        }
+    }
+
+    if (i >= nHits) {
+        return nHits;
+    }
+
+    //
+    // Everything before i is too big.  Gallop until we find something that isn't.
+    //
+    unsigned step = nearbyHits;
+    unsigned tooBig = i - 1;
+    while (i < nHits && hits[i] > maxLocation) {
+        tooBig = i;
+        i += step;
+        step *= 2;
+    }
+
+    //
+    // Now hits[tooBig] is too big, and either hits[i] is small enough or i is off the end.  Binary search between them.
+    //
+    unsigned limit = __min(i, nHits);
+    while (limit - tooBig > 1) {
+        unsigned probe = tooBig + (limit - tooBig) / 2;
+        if (hits[probe] > maxLocation) {
+            tooBig = probe;
+        } else {
+            limit = probe;
+        }
+    }
+
+    return limit;
+}
+
 	bool
-IntersectingPairedEndAligner::HashTableHitSet::getNextHitLessThanOrEqualTo(unsigned maxGenomeOffsetToFind, unsigned *actualGenomeOffsetFound, unsigned *seedOffsetFound)
+IntersectingPairedEndAligner::HashTableHitSet::getNextHitLessThanOrEqualTo(GenomeLocation maxGenomeOffsetToFind, GenomeLocation *actualGenomeOffsetFound, unsigned *seedOffsetFound)
 {
 #if 0
     //
     // The verison of the code that searches each lookup serially.
     //
     bool anyFound = false;
-    unsigned bestOffsetFound = 0;
+    GenomeLocation bestOffsetFound = 0;
 	for (HashTableLookup *lookup = lookupListHead->nextLookupWithRemainingMembers; lookup != lookupListHead; lookup = lookup->nextLookupWithRemainingMembers) {
         //
         // Binary search from the current starting offset to either the right place or the end.
         //
         int limit[2] = {(int)lookup->currentHitForIntersection, (int)lookup->nHits - 1};
-        unsigned maxGenomeOffsetToFindThisSeed = maxGenomeOffsetToFind + lookup->seedOffset;
+        GenomeLocation maxGenomeOffsetToFindThisSeed = maxGenomeOffsetToFind + lookup->seedOffset;
         if (lookup->nHits != 0 && lookup->hits[lookup->nHits - 1] <= maxGenomeOffsetToFindThisSeed) {
             for (;;) { // We don't need to check the loop exit condition (which is that limit[0] > limit[1]) becuase we'll always find an answer
                _ASSERT(limit[0] <= limit[1]);
@@ -989,7 +1263,7 @@ IntersectingPairedEndAligner::HashTableHitSet::getNextHitLessThanOrEqualTo(unsig
                     anyFound = true;
 
                     unsigned seedOffset[2] = {lookup->seedOffset, *seedOffsetFound};
-                    unsigned mostRecentLocation[2] = {lookup->hits[probe] - lookup->seedOffset, mostRecentLocationReturned};
+                    GenomeLocation mostRecentLocation[2] = {lookup->hits[probe] - lookup->seedOffset, mostRecentLocationReturned};
                     //
                     // Compute the difference between the two halves of the inequality in the normal version of the if statement, using
                     // 64-bit numbers to store the 32 bit values.  The difference will be strictly positive if the left half of the
@@ -1136,13 +1410,13 @@ IntersectingPairedEndAligner::HashTableHitSet::getNextHitLessThanOrEqualTo(unsig
 
 
     bool anyFound = false;
-    unsigned bestOffsetFound = 0;
+    GenomeLocation bestOffsetFound = 0;
     lookup = lookupHeader;
     for (;;) {
         //
         // Each iteration of this loop is one probe in one of the searches for the
         //
-        unsigned maxGenomeOffsetToFindThisSeed = maxGenomeOffsetToFind + lookup->seedOffset;
+        GenomeLocation maxGenomeOffsetToFindThisSeed = maxGenomeOffsetToFind + lookup->seedOffset;
         _ASSERT(!(lookup->nHits == 0 || lookup->hits[lookup->nHits - 1] > maxGenomeOffsetToFindThisSeed));
         _ASSERT(lookup->limit[0] <= lookup->limit[1]);
         int probe = (lookup->limit[0] + lookup->limit[1]) / 2;
@@ -1175,7 +1449,7 @@ IntersectingPairedEndAligner::HashTableHitSet::getNextHitLessThanOrEqualTo(unsig
             anyFound = true;
 
             unsigned seedOffset[2] = {lookup->seedOffset, *seedOffsetFound};
-            unsigned mostRecentLocation[2] = {lookup->hits[probe] - lookup->seedOffset, mostRecentLocationReturned};
+            GenomeLocation mostRecentLocation[2] = {lookup->hits[probe] - lookup->seedOffset, mostRecentLocationReturned};
 
             _int64 condition = getSignBit64((_int64)(lookup->hits[probe] - lookup->seedOffset) -  (_int64)bestOffsetFound - 1);
 
@@ -1236,7 +1510,7 @@ IntersectingPairedEndAligner::HashTableHitSet::getNextHitLessThanOrEqualTo(unsig
     // the simple version with the outer loops reversed.
     //
     bool anyFound = false;
-    unsigned bestOffsetFound = 0;
+    GenomeLocation bestOffsetFound = 0;
     unsigned nLiveLookups = 0;
 
     //
@@ -1271,7 +1545,7 @@ IntersectingPairedEndAligner::HashTableHitSet::getNextHitLessThanOrEqualTo(unsig
         // We could store these in the lookup object rather than recomputing them every time.
         //
         int probe = (lookup->limit[0] + lookup->limit[1]) / 2;
-        unsigned maxGenomeOffsetToFindThisSeed = maxGenomeOffsetToFind + lookup->seedOffset;
+        GenomeLocation maxGenomeOffsetToFindThisSeed = maxGenomeOffsetToFind + lookup->seedOffset;
         //
         // Recall that the hit sets are sorted from largest to smallest, so the strange looking logic is actually right.
         // We're evaluating the expression "lookup->hits[probe] <= maxGenomeOffsetToFindThisSeed && (probe == 0 || lookup->hits[probe-1] > maxGenomeOffsetToFindThisSeed)"
@@ -1334,45 +1608,24 @@ IntersectingPairedEndAligner::HashTableHitSet::getNextHitLessThanOrEqualTo(unsig
 
 #else   // The traditional version
     bool anyFound = false;
-    unsigned bestOffsetFound = 0;
+    GenomeLocation bestOffsetFound = 0;
     for (unsigned i = 0; i < nLookupsUsed; i++) {
         //
-        // Binary search from the current starting offset to either the right place or the end.
+        // Find the first hit from the current starting offset on that's small enough.  Recall that the hit sets are sorted from largest
+        // to smallest.  We only use it if it's the first hit in the whole set that's small enough, which it always is except when we're
+        // asked for a larger location than last time.
         //
-        int limit[2] = {(int)lookups[i].currentHitForIntersection, (int)lookups[i].nHits - 1};
-        unsigned maxGenomeOffsetToFindThisSeed = maxGenomeOffsetToFind + lookups[i].seedOffset;
-        while (limit[0] <= limit[1]) {
-            unsigned probe = (limit[0] + limit[1]) / 2;
-            if (doAlignerPrefetch) { // not clear this helps.  We're probably not far enough ahead.
-                _mm_prefetch((const char *)&lookups[i].hits[(limit[0] + probe) / 2 - 1], _MM_HINT_T2);
-                _mm_prefetch((const char *)&lookups[i].hits[(limit[1] + probe) / 2 + 1], _MM_HINT_T2);
-            }
-            //
-            // Recall that the hit sets are sorted from largest to smallest, so the strange looking logic is actually right.
-            // We're evaluating the expression "lookups[i].hits[probe] <= maxGenomeOffsetToFindThisSeed && (probe == 0 || lookups[i].hits[probe-1] > maxGenomeOffsetToFindThisSeed)"
-            // It's written in this strange way just so the profile tool will show us where the time's going.
-            //
-            unsigned clause1 = lookups[i].hits[probe] <= maxGenomeOffsetToFindThisSeed;
-            unsigned clause2 = probe == 0;
-
-            if (clause1 && (clause2 || lookups[i].hits[probe-1] > maxGenomeOffsetToFindThisSeed)) {
-                if (lookups[i].hits[probe] - lookups[i].seedOffset >  bestOffsetFound) {
-					anyFound = true;
-                    mostRecentLocationReturned = *actualGenomeOffsetFound = bestOffsetFound = lookups[i].hits[probe] - lookups[i].seedOffset;
-                    *seedOffsetFound = lookups[i].seedOffset;
-                }
-                lookups[i].currentHitForIntersection = probe;
-                break;
-            }
+        GenomeLocation maxGenomeOffsetToFindThisSeed = maxGenomeOffsetToFind + lookups[i].seedOffset;
+        unsigned probe = FindFirstHitAtOrBelow(lookups[i].hits, lookups[i].currentHitForIntersection, lookups[i].nHits, maxGenomeOffsetToFindThisSeed);
 
-            if (lookups[i].hits[probe] > maxGenomeOffsetToFindThisSeed) {   // Recode this without the if to avoid the hard-to-predict branch.
-                limit[0] = probe + 1;
-            } else {
-                limit[1] = probe - 1;
+        if (probe < lookups[i].nHits && (probe == 0 || probe > lookups[i].currentHitForIntersection || lookups[i].hits[probe-1] > maxGenomeOffsetToFindThisSeed)) {
+            if (lookups[i].hits[probe] - lookups[i].seedOffset >  bestOffsetFound) {
+				anyFound = true;
+                mostRecentLocationReturned = *actualGenomeOffsetFound = bestOffsetFound = lookups[i].hits[probe] - lookups[i].seedOffset;
+                *seedOffsetFound = lookups[i].seedOffset;
             }
-        } // While we're looking
-
-        if (limit[0] > limit[1]) {
+            lookups[i].currentHitForIntersection = probe;
+        } else {
             lookups[i].currentHitForIntersection = lookups[i].nHits;    // We're done with this lookup.
         }
     } // For each lookup
@@ -1384,7 +1637,7 @@ IntersectingPairedEndAligner::HashTableHitSet::getNextHitLessThanOrEqualTo(unsig
 
 
     bool
-IntersectingPairedEndAligner::HashTableHitSet::getFirstHit(unsigned *genomeLocation, unsigned *seedOffsetFound)
+IntersectingPairedEndAligner::HashTableHitSet::getFirstHit(GenomeLocation *genomeLocation, unsigned *seedOffsetFound)
 {
     bool anyFound = false;
     *genomeLocation = 0;
@@ -1400,12 +1653,12 @@ IntersectingPairedEndAligner::HashTableHitSet::getFirstHit(unsigned *genomeLocat
 }
 
     bool
-IntersectingPairedEndAligner::HashTableHitSet::getNextLowerHit(unsigned *genomeLocation, unsigned *seedOffsetFound)
+IntersectingPairedEndAligner::HashTableHitSet::getNextLowerHit(GenomeLocation *genomeLocation, unsigned *seedOffsetFound)
 {
     //
     // Look through all of the lookups and find the one with the highest location smaller than the current one.
     //
-    unsigned foundLocation = 0;
+    GenomeLocation foundLocation = 0;
     bool anyFound = false;
 
     //
@@ -1438,7 +1691,7 @@ IntersectingPairedEndAligner::HashTableHitSet::getNextLowerHit(unsigned *genomeL
 }
 
             bool
-IntersectingPairedEndAligner::MergeAnchor::checkMerge(unsigned newMoreHitLocation, unsigned newFewerHitLocation, double newMatchProbability, int newPairScore,
+IntersectingPairedEndAligner::MergeAnchor::checkMerge(GenomeLocation newMoreHitLocation, GenomeLocation newFewerHitLocation, double newMatchProbability, int newPairScore,
                         double *oldMatchProbability)
 {
     if (locationForReadWithMoreHits == InvalidGenomeLocation || !doesRangeMatch(newMoreHitLocation, newFewerHitLocation)) {
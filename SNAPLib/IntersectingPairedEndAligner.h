@@ -28,6 +28,7 @@ Revision History:
 #include "directions.h"
 #include "LandauVishkin.h"
 #include "FixedSizeMap.h"
+#include "SecondaryAlignments.h"
 
 const unsigned DEFAULT_INTERSECTING_ALIGNER_MAX_HITS = 16000;
 const unsigned DEFAULT_MAX_CANDIDATE_POOL_SIZE = 1000000;
@@ -57,6 +58,29 @@ public:
         reverseLandauVishkin = reverseLandauVishkin_;
     }
     
+    //
+    // Pairs with an end shorter than this (50 by default) aren't aligned.  The spliced aligner gives this pieces of reads.
+    //
+    void setMinReadLength(unsigned minReadLength_)
+    {
+        minReadLength = minReadLength_;
+    }
+
+    //
+    // Changes the spacing allowed between the ends from that given to the constructor.  The spliced aligner's depends on
+    // the lengths of the pieces it hands in.
+    //
+    void setSpacing(unsigned minSpacing_, unsigned maxSpacing_)
+    {
+        minSpacing = minSpacing_;
+        maxSpacing = maxSpacing_;
+    }
+
+    virtual void setSecondaryAlignmentLimits(unsigned maxSecondary, unsigned scoreDelta)
+    {
+        secondaryCandidates.setLimits(maxSecondary, scoreDelta);
+    }
+
     virtual ~IntersectingPairedEndAligner();
     
     virtual void align(
@@ -65,6 +89,10 @@ public:
         PairedAlignmentResult *result,
         IdPairVector          *secondary);
 
+    virtual void prefetchPair(
+        Read                  *read0,
+        Read                  *read1);
+
     static size_t getBigAllocatorReservation(GenomeIndex * index, unsigned maxBigHitsToConsider, unsigned maxReadSize, unsigned seedLen, unsigned maxSeedsFromCommandLine, 
                                              double seedCoverage, unsigned maxEditDistanceToConsider, unsigned maxExtraSearchDepth, unsigned maxCandidatePoolSize);
 
@@ -78,6 +106,17 @@ public:
          return nLocationsScored;
      }
 
+    virtual void setLVBudget(unsigned lvBudget_)
+    {
+        lvBudget = lvBudget_;
+    }
+
+    virtual _int64 getAlignmentsOverLVBudget() const {
+        return nPairsOverLVBudget;
+    }
+
+    virtual bool getSeedLookups(unsigned whichRead, SeedLookups *lookups) const;
+
 
 private:
 
@@ -89,8 +128,9 @@ private:
                                unsigned maxEditDistanceToConsider, unsigned maxExtraSearchDepth, unsigned maxCandidatePoolSize);
 
     GenomeIndex *   index;
+    DecodedHitBuffer decodedHits;   // For this pair's lookups if the index has a compressed overflow table, and for skipping popular seeds
     const Genome *  genome;
-    unsigned        genomeSize;
+    GenomeLocation  genomeSize;
     unsigned        maxReadSize;
     unsigned        maxHits;
     unsigned        maxBigHits;
@@ -103,13 +143,17 @@ private:
     unsigned        maxSpacing;
     unsigned        seedLen;
     unsigned        maxMergeDistance;
+    unsigned        minReadLength;
+    SecondaryAlignments secondaryCandidates;    // The pair's best scored candidates, for the secondary vector
     _int64          nLocationsScored;
+    unsigned        lvBudget;           // Per read, so a pair gets twice this; 0 for no limit
+    _int64          nPairsOverLVBudget;
 
 
     struct HashTableLookup {
         unsigned        seedOffset;
         unsigned        nHits;
-        const unsigned  *hits;
+        const GenomeLocation *hits;
         unsigned        whichDisjointHitSet;
 
         //
@@ -163,25 +207,25 @@ private:
 		// seed for it not to hit, and since the reads are disjoint there can't be a case
 		// where the same difference caused two seeds to miss).
         //
-        void recordLookup(unsigned seedOffset, unsigned nHits, const unsigned *hits, bool beginsDisjointHitSet);
+        void recordLookup(unsigned seedOffset, unsigned nHits, const GenomeLocation *hits, bool beginsDisjointHitSet);
 
         //
         // This efficiently works through the set looking for the next hit at or below this address.
         // A HashTableHitSet only allows a single iteration through its address space per call to
         // init().
         //
-        bool    getNextHitLessThanOrEqualTo(unsigned maxGenomeOffsetToFind, unsigned *actualGenomeOffsetFound, unsigned *seedOffsetFound);
+        bool    getNextHitLessThanOrEqualTo(GenomeLocation maxGenomeOffsetToFind, GenomeLocation *actualGenomeOffsetFound, unsigned *seedOffsetFound);
 
         //
         // Walk down just one step, don't binary search.
         //
-        bool getNextLowerHit(unsigned *genomeLocation, unsigned *seedOffsetFound);
+        bool getNextLowerHit(GenomeLocation *genomeLocation, unsigned *seedOffsetFound);
 
 
         //
         // Find the highest genome address.
         //
-        bool    getFirstHit(unsigned *genomeLocation, unsigned *seedOffsetFound);
+        bool    getFirstHit(GenomeLocation *genomeLocation, unsigned *seedOffsetFound);
 
 		unsigned computeBestPossibleScoreForCurrentHit();
 
@@ -197,7 +241,7 @@ private:
         HashTableLookup lookupListHead[1];
         unsigned        maxSeeds;
         unsigned        nLookupsUsed;
-        unsigned        mostRecentLocationReturned;
+        GenomeLocation  mostRecentLocationReturned;
 		unsigned		maxMergeDistance;
 
         // This is effectively a local in getNextHitLessThanOrEqualTo, but since it's dynamically sized we put it here.
@@ -216,7 +260,7 @@ private:
     // of close-together hits and to track potential mate pairs.
     //
     struct HitLocation {
-        unsigned        genomeLocation;
+        GenomeLocation  genomeLocation;
         int             genomeLocationOffset;   // This is needed because we might get an offset back from scoring (because it's really scoring a range).
         unsigned        seedOffset;
         bool            isScored;           // Mate pairs are sometimes not scored when they're inserted, because they
@@ -237,7 +281,7 @@ private:
         // right next to one another not to be matches.  There's really no way around this while avoiding
         // matching things that are possibly much more than maxMatchDistance apart.
         //
-        unsigned        genomeLocationOfNearestMatchedCandidate;
+        GenomeLocation  genomeLocationOfNearestMatchedCandidate;
     };
 
 
@@ -249,6 +293,11 @@ private:
     Read rcReads[NUM_READS_PER_PAIR][NUM_DIRECTIONS];
 
     char *reversedRead[NUM_READS_PER_PAIR][NUM_DIRECTIONS]; // The reversed data for each read for forward and RC.  This is used in the backwards LV
+    PackedSeeds packedSeeds[NUM_READS_PER_PAIR];            // Each read's bases, to take its seeds from
+    _uint64 *minimizerHashes;                               // Scratch space for finding a read's minimizers, if the index only has those
+    bool *isMinimizer;
+    char *genomeUnpackBuffer;                               // Where we unpack the genome data we score if the genome is packed
+    size_t genomeUnpackBufferSize;
 
     LandauVishkin<> *landauVishkin;
     LandauVishkin<-1> *reverseLandauVishkin;
@@ -266,6 +315,16 @@ private:
         seedUsed[indexInRead / 8] |= (1 << (indexInRead % 8));
     }
 
+    //
+    // The seeds chosen for one read, to be looked up as a batch, and the results of the lookups.  Each has room for
+    // maxSeedsToUse.
+    //
+    Seed             *seedsToLookUp;
+    unsigned         *offsetsOfSeedsToLookUp[NUM_READS_PER_PAIR];
+    bool             *seedsBeginDisjointHitSet;    // A wrap happened just before choosing this seed
+    unsigned         *lookedUpNHits[NUM_READS_PER_PAIR][NUM_DIRECTIONS];
+    const GenomeLocation **lookedUpHits[NUM_READS_PER_PAIR][NUM_DIRECTIONS];
+
     //
     // "Local probability" means the probability that each end is correct given that the pair itself is correct.
     // Consider the example where there's exactly one decent match for one read, but the other one has several
@@ -278,7 +337,7 @@ private:
     void scoreLocation(
             unsigned             whichRead,
             Direction            direction,
-            unsigned             genomeLocation,
+            GenomeLocation       genomeLocation,
             unsigned             seedOffset,
             unsigned             scoreLimit,
             unsigned            *score,
@@ -292,11 +351,11 @@ private:
     //
     struct MergeAnchor {
         double      matchProbability;
-        unsigned    locationForReadWithMoreHits;
-        unsigned    locationForReadWithFewerHits;
+        GenomeLocation locationForReadWithMoreHits;
+        GenomeLocation locationForReadWithFewerHits;
         int         pairScore;
 
-        void init(unsigned locationForReadWithMoreHits_, unsigned locationForReadWithFewerHits_, double matchProbability_, int pairScore_) {
+        void init(GenomeLocation locationForReadWithMoreHits_, GenomeLocation locationForReadWithFewerHits_, double matchProbability_, int pairScore_) {
             locationForReadWithMoreHits = locationForReadWithMoreHits_;
             locationForReadWithFewerHits = locationForReadWithFewerHits_;
             matchProbability = matchProbability_;
@@ -306,9 +365,9 @@ private:
         //
         // Returns whether this candidate is a match for this merge anchor.
         //
-        bool doesRangeMatch(unsigned newMoreHitLocation, unsigned newFewerHitLocation) {
-            unsigned deltaMore = DistanceBetweenGenomeLocations(locationForReadWithMoreHits, newMoreHitLocation);
-            unsigned deltaFewer = DistanceBetweenGenomeLocations(locationForReadWithFewerHits, newFewerHitLocation);
+        bool doesRangeMatch(GenomeLocation newMoreHitLocation, GenomeLocation newFewerHitLocation) {
+            GenomeLocation deltaMore = DistanceBetweenGenomeLocations(locationForReadWithMoreHits, newMoreHitLocation);
+            GenomeLocation deltaFewer = DistanceBetweenGenomeLocations(locationForReadWithFewerHits, newFewerHitLocation);
 
             return deltaMore < 50 && deltaFewer < 50;
         }
@@ -317,7 +376,7 @@ private:
         //
         // Returns true and sets oldMatchProbability if this should be eliminated due to a match.
         //
-        bool checkMerge(unsigned newMoreHitLocation, unsigned newFewerHitLocation, double newMatchProbability, int newPairScore, 
+        bool checkMerge(GenomeLocation newMoreHitLocation, GenomeLocation newFewerHitLocation, double newMatchProbability, int newPairScore, 
                         double *oldMatchProbability); 
     };
 
@@ -330,19 +389,17 @@ private:
     struct ScoringMateCandidate {
         //
         // These are kept in arrays in decreasing genome order, one for each set pair, so you can find the next largest location by just looking one
-        // index lower, and vice versa.
+        // index lower, and vice versa.  The genome location and best possible score are in their own arrays (scoringMateLocations and
+        // scoringMateBestPossibleScores, with the same indices), because they're what gets scanned to find the mates in range of each hit on the
+        // other end, and that way the scan only touches those and can do several at a time.
         //
         double                  matchProbability;
-        unsigned                readWithMoreHitsGenomeLocation;
-        unsigned                bestPossibleScore;
         unsigned                score;
         unsigned                scoreLimit;             // The scoreLimit with which score was computed
         unsigned                seedOffset;
         int                     genomeOffset;
 
-        void init(unsigned readWithMoreHitsGenomeLocation_, unsigned bestPossibleScore_, unsigned seedOffset_) {
-            readWithMoreHitsGenomeLocation = readWithMoreHitsGenomeLocation_;
-            bestPossibleScore = bestPossibleScore_;
+        void init(unsigned seedOffset_) {
             seedOffset = seedOffset_;
             score = -2;
             scoreLimit = -1;
@@ -355,13 +412,13 @@ private:
         ScoringCandidate *      scoreListNext;              // This is a singly-linked list
         MergeAnchor *           mergeAnchor;
         unsigned                scoringMateCandidateIndex;  // Index into the array of scoring mate candidates where we should look 
-        unsigned                readWithFewerHitsGenomeLocation;
+        GenomeLocation          readWithFewerHitsGenomeLocation;
         unsigned                whichSetPair;
         unsigned                seedOffset;
 
         unsigned                bestPossibleScore;
 
-        void init(unsigned readWithFewerHitsGenomeLocation_, unsigned whichSetPair_, unsigned scoringMateCandidateIndex_, unsigned seedOffset_,
+        void init(GenomeLocation readWithFewerHitsGenomeLocation_, unsigned whichSetPair_, unsigned scoringMateCandidateIndex_, unsigned seedOffset_,
                   unsigned bestPossibleScore_, ScoringCandidate *scoreListNext_)
         {
             readWithFewerHitsGenomeLocation = readWithFewerHitsGenomeLocation_;
@@ -395,8 +452,22 @@ private:
     // The scoring mates.  The each set scoringCandidatePoolSize / 2.
     //
     ScoringMateCandidate * scoringMateCandidates[NUM_SET_PAIRS];
+    GenomeLocation * scoringMateLocations[NUM_SET_PAIRS];
+    unsigned * scoringMateBestPossibleScores[NUM_SET_PAIRS];
     unsigned lowestFreeScoringMateCandidate[NUM_SET_PAIRS];
 
+    //
+    // The lowest best possible score of any of the first nMates mates of a set pair that's at or below highestLocation (they're in decreasing
+    // genome order, so those are the ones from the end of the list back to the first one above it), or limit if there's none lower.
+    //
+    unsigned lowestBestPossibleScoreOfMatesAtOrBelow(unsigned whichSetPair, unsigned nMates, GenomeLocation highestLocation, unsigned limit);
+
+    //
+    // Launches prefetches for the genome windows that scoring candidate and (a bounded number of) its mates will be
+    // compared against, so that they're on their way to the cache while the candidates ahead of them are scored.
+    //
+    void prefetchCandidateWindows(ScoringCandidate *candidate, unsigned readWithFewerHits, unsigned readWithMoreHits);
+
     //
     // Merge anchors.  Again, we allocate an upper bound number of them, which is the same as the number of scoring candidates.
     //
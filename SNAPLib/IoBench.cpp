@@ -0,0 +1,558 @@
+/*++
+
+Module Name:
+
+    IoBench.cpp
+
+Abstract:
+
+    The throughput of the input and output stacks on their own, without aligning anything.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "IoBench.h"
+#include "Genome.h"
+#include "Read.h"
+#include "AlignerOptions.h"
+#include "DataReader.h"
+#include "DataWriter.h"
+#include "GzipDataWriter.h"
+#include "GenericFile.h"
+#include "FileFormat.h"
+#include "ParallelTask.h"
+#include "VariableSizeVector.h"
+#include "Bam.h"
+#include "Util.h"
+#include "exit.h"
+
+namespace {
+
+const int DefaultWriteMB = 512;
+
+//
+// A raw data supplier to try, and what it's called in the report.
+//
+struct Backend {
+    const char     *name;
+    DataSupplier  **suppliers;      // [autoRelease], like DataSupplier::MemMap
+};
+
+//
+// A record for the write stages to write: where it is in the loaded input, and where it goes for sorting.
+//
+struct IoBenchRecord {
+    _int64          offset;
+    unsigned        length;
+    GenomeLocation  location;
+};
+
+struct ParseContext : public TaskContextBase
+{
+    ReadSupplierGenerator  *readSupplierGenerator;
+
+    _int64                  nReads;
+    _int64                  nBases;
+
+    void initializeThread() {}
+    void runThread();
+    void finishThread(ParseContext *common);
+};
+
+    void
+ParseContext::runThread()
+{
+    ReadSupplier *readSupplier = readSupplierGenerator->generateNewReadSupplier();
+    if (NULL == readSupplier) {
+        return;     // The other threads already have the whole input
+    }
+    Read *read;
+    while (NULL != (read = readSupplier->getNextRead())) {
+        nReads++;
+        nBases += read->getDataLength();
+    }
+    delete readSupplier;
+}
+
+    void
+ParseContext::finishThread(ParseContext *common)
+{
+    common->nReads += nReads;
+    common->nBases += nBases;
+}
+
+struct WriteContext : public TaskContextBase
+{
+    DataWriterSupplier     *writerSupplier;
+    const char             *data;
+    const IoBenchRecord    *records;
+    _int64                  nRecords;
+
+    void initializeThread() {}
+    void runThread();
+    void finishThread(WriteContext *common) {}
+};
+
+//
+// Each thread writes its own share of the records, the way the aligner threads each write their own reads.
+//
+    void
+WriteContext::runThread()
+{
+    DataWriter *writer = writerSupplier->getWriter();
+    _int64 end = nRecords * (threadNum + 1) / totalThreads;
+    for (_int64 i = nRecords * threadNum / totalThreads; i < end; i++) {
+        const IoBenchRecord *record = &records[i];
+        char *buffer;
+        size_t size;
+        if (!writer->getBuffer(&buffer, &size) || size < record->length) {
+            if (!writer->nextBatch() || !writer->getBuffer(&buffer, &size) || size < record->length) {
+                fprintf(stderr, "snap iobench: unable to write a %u byte record\n", record->length);
+                soft_exit(1);
+            }
+        }
+        memcpy(buffer, data + record->offset, record->length);
+        writer->advance(record->length, record->location);
+    }
+    writer->close();
+    delete writer;
+}
+
+//
+// Keeps every page that a reader hands back from being optimized away, so that memory mapping has to bring them in.
+//
+volatile unsigned TouchedBytes = 0;
+
+//
+// One reader straight through the file, as fast as it will go.  Returns the bytes it got (decompressed, if the
+// supplier decompresses).
+//
+    _int64
+ReadThrough(
+    DataSupplier   *supplier,
+    const char     *fileName)
+{
+    DataReader *reader = supplier->getDataReader(MAX_READ_LENGTH * 8);
+    if (!reader->init(fileName)) {
+        fprintf(stderr, "snap iobench: unable to open '%s'\n", fileName);
+        soft_exit(1);
+    }
+    reader->reinit(0, 0);
+
+    _int64 bytes = 0;
+    unsigned touched = 0;
+    char *buffer;
+    _int64 validBytes, startBytes;
+    for (;;) {
+        if (!reader->getData(&buffer, &validBytes, &startBytes)) {
+            reader->nextBatch();
+            if (!reader->getData(&buffer, &validBytes, &startBytes)) {
+                break;
+            }
+        }
+        for (_int64 i = 0; i < startBytes; i += 4096) {
+            touched += buffer[i];
+        }
+        bytes += startBytes;
+        reader->advance(startBytes);
+    }
+    TouchedBytes += touched;
+
+    delete reader;
+    return bytes;
+}
+
+//
+// Read the first maxBytes of the (decompressed) input into memory as whole lines, and split them into records for the
+// write stages: SAM records (after the header) with their locations, or otherwise lines.
+//
+    char *
+LoadRecords(
+    DataSupplier                       *supplier,
+    const char                         *fileName,
+    _int64                              maxBytes,
+    bool                                sam,
+    const Genome                       *genome,
+    _int64                             *o_headerBytes,
+    VariableSizeVector<IoBenchRecord>  *records)
+{
+    char *data = (char *)BigAlloc(maxBytes + 1);
+    DataReader *reader = supplier->getDataReader(MAX_READ_LENGTH * 8);
+    if (!reader->init(fileName)) {
+        fprintf(stderr, "snap iobench: unable to open '%s'\n", fileName);
+        soft_exit(1);
+    }
+    reader->reinit(0, 0);
+
+    _int64 bytes = 0;
+    char *buffer;
+    _int64 validBytes, startBytes;
+    while (bytes < maxBytes) {
+        if (!reader->getData(&buffer, &validBytes, &startBytes)) {
+            reader->nextBatch();
+            if (!reader->getData(&buffer, &validBytes, &startBytes)) {
+                break;
+            }
+        }
+        _int64 amount = __min(startBytes, maxBytes - bytes);
+        memcpy(data + bytes, buffer, amount);
+        bytes += amount;
+        reader->advance(startBytes);
+    }
+    delete reader;
+
+    while (bytes > 0 && data[bytes - 1] != '\n') {
+        bytes--;    // Leave off the partial line at the end
+    }
+    data[bytes] = '\0';
+
+    _int64 offset = 0;
+    if (sam) {
+        while (offset < bytes && '@' == data[offset]) {
+            offset = (const char *)memchr(data + offset, '\n', bytes - offset) - data + 1;
+        }
+    }
+    *o_headerBytes = offset;
+
+    while (offset < bytes) {
+        IoBenchRecord record;
+        record.offset = offset;
+        record.length = (unsigned)((const char *)memchr(data + offset, '\n', bytes - offset) - data + 1 - offset);
+        record.location = 0;
+        if (sam && NULL != genome) {
+            FileFormat::SAM[false]->getSortInfo(genome, data + offset, bytes - offset, &record.location, NULL);
+        }
+        records->push_back(record);
+        offset += record.length;
+    }
+
+    return data;
+}
+
+    void
+PrintStageHeader()
+{
+    printf("%-8s %-12s %10s %9s %10s %12s %9s %6s\n", "stage", "config", "MB", "seconds", "MB/s", "reads/s", "CPU s", "cores");
+}
+
+//
+// Print a stage's line, given what it moved and the time and processor usage from before it started.  reads is -1
+// for stages that only see bytes.
+//
+    void
+PrintStage(
+    const char     *stage,
+    const char     *config,
+    _int64          bytes,
+    _int64          reads,
+    _int64          startMillis,
+    const ProcessUsage *startUsage)
+{
+    _int64 elapsed = __max(timeInMillis() - startMillis, (_int64)1);
+    ProcessUsage usage;
+    GetProcessUsage(&usage);
+
+    double seconds = elapsed / 1000.0;
+    printf("%-8s %-12s %10.1f %9.2f %10.1f ", stage, config, bytes / 1048576.0, seconds, bytes / 1048576.0 / seconds);
+    if (reads >= 0) {
+        printf("%12.0f ", reads / seconds);
+    } else {
+        printf("%12s ", "-");
+    }
+    if (usage.cpuMillis >= 0 && startUsage->cpuMillis >= 0) {
+        double cpuSeconds = (usage.cpuMillis - startUsage->cpuMillis) / 1000.0;
+        printf("%9.2f %6.1f\n", cpuSeconds, cpuSeconds / seconds);
+    } else {
+        printf("%9s %6s\n", "-", "-");
+    }
+    fflush(stdout);
+}
+
+} // namespace
+
+    static void
+IoBenchUsage()
+{
+    fprintf(stderr,
+            "Usage: snap iobench <input> [<options>]\n"
+            "Measures how fast SNAP can read, decompress, parse and write data apart from aligning it.  The input is read\n"
+            "straight through each raw input backend, then through decompression (for gzipped FASTQ or SAM, and BAM), and\n"
+            "then parsed into reads on all of the threads.  With -o, the input's records are also written back out plain,\n"
+            "BGZF compressed, and for SAM with -index, sorted.  Each stage's line gives its MB/s (of the file for reading\n"
+            "and parsing, and of the uncompressed records otherwise), reads/s, and processor time in seconds and cores.\n"
+            "The first pass over the input brings it into the page cache, so later ones measure the backends and not the\n"
+            "storage unless the input is bigger than memory; use -b to try just one.  Stdin (-) can only be parsed once.\n"
+            "Options:\n"
+            "  -index <dir>  the index to parse SAM, BAM or CRAM input with, and to sort SAM records by\n"
+            "  -o <file>     where the write stages write (deleted afterward); without it they're skipped\n"
+            "  -b <backend>  only try this input backend (one of the ones that the first column of the report lists)\n"
+            "  -mb <n>       how many MB of the input the write stages write (default %d)\n"
+            "  -t <n>        number of threads (default is the number of processors)\n",
+            DefaultWriteMB);
+    soft_exit(1);
+}
+
+    void
+IoBench::runIoBench(
+    int argc,
+    const char **argv)
+{
+    if (argc < 1) {
+        IoBenchUsage();
+    }
+
+    const char *inputFileName = argv[0];
+    const char *indexDir = NULL;
+    const char *outputFileName = NULL;
+    const char *onlyBackend = NULL;
+    _int64 writeMB = DefaultWriteMB;
+    unsigned nThreads = GetNumberOfProcessors();
+
+    for (int n = 1; n < argc; n++) {
+        if (n + 1 < argc && !strcmp(argv[n], "-index")) {
+            indexDir = argv[++n];
+        } else if (n + 1 < argc && !strcmp(argv[n], "-o")) {
+            outputFileName = argv[++n];
+        } else if (n + 1 < argc && !strcmp(argv[n], "-b")) {
+            onlyBackend = argv[++n];
+        } else if (n + 1 < argc && !strcmp(argv[n], "-mb")) {
+            writeMB = atoi(argv[++n]);
+        } else if (n + 1 < argc && !strcmp(argv[n], "-t")) {
+            nThreads = atoi(argv[++n]);
+        } else {
+            IoBenchUsage();
+        }
+    }
+    if (0 == nThreads || writeMB <= 0) {
+        IoBenchUsage();
+    }
+
+    SNAPFile input;
+    int argsConsumed;
+    if (!SNAPFile::generateFromCommandLine(&inputFileName, 1, &argsConsumed, &input, false, true)) {
+        fprintf(stderr, "snap iobench: can't read '%s'\n", inputFileName);
+        soft_exit(1);
+    }
+    bool alignedInput = SAMFile == input.fileType || BAMFile == input.fileType || CRAMFile == input.fileType;
+    if (alignedInput && NULL == indexDir) {
+        fprintf(stderr, "snap iobench: SAM, BAM and CRAM input needs -index to be parsed\n");
+        soft_exit(1);
+    }
+
+    const Genome *genome = NULL;
+    if (NULL != indexDir) {
+        static const char *genomeSuffix = "Genome";
+        size_t filenameLen = strlen(indexDir) + 1 + strlen(genomeSuffix) + 1;
+        char *fileName = new char[filenameLen];
+        snprintf(fileName, filenameLen, "%s%c%s", indexDir, PATH_SEP, genomeSuffix);
+        genome = Genome::loadFromFile(fileName, 0);
+        if (NULL == genome) {
+            fprintf(stderr, "Unable to load genome from file '%s'\n", fileName);
+            soft_exit(1);
+        }
+        delete [] fileName;
+    }
+
+    DataSupplier::ThreadCount = nThreads;
+
+    //
+    // The raw backends that can read this input.  Stdin and remote files each have only the one.
+    //
+    Backend backends[4];
+    int nBackends = 0;
+    if (input.isStdio) {
+        backends[nBackends].name = "stdio";
+        backends[nBackends++].suppliers = DataSupplier::Stdio;
+    } else if (GenericFile::IsRemote(input.fileName)) {
+        backends[nBackends].name = "remote";
+        backends[nBackends++].suppliers = DataSupplier::Remote;
+    } else {
+        backends[nBackends].name = "mmap";
+        backends[nBackends++].suppliers = DataSupplier::MemMap;
+#ifdef _MSC_VER
+        backends[nBackends].name = "overlapped";
+        backends[nBackends++].suppliers = DataSupplier::WindowsOverlapped;
+#endif
+#ifdef __linux__
+        backends[nBackends].name = "aio";
+        backends[nBackends++].suppliers = DataSupplier::LinuxAio;
+#endif
+#ifdef __APPLE__
+        backends[nBackends].name = "dispatch";
+        backends[nBackends++].suppliers = DataSupplier::OsxDispatch;
+#endif
+    }
+
+    bool bgzf = BAMFile == input.fileType;
+    bool gzip = input.isCompressed && !bgzf;
+    bool inflate = (gzip || bgzf) && !input.isStdio;
+    DataSupplier *originalDefault[2] = {DataSupplier::Default[false], DataSupplier::Default[true]};
+
+    fprintf(stderr, "Benchmarking '%s' on %u threads\n", input.fileName, nThreads);
+    PrintStageHeader();
+
+    bool anyBackend = false;
+    for (int i = 0; i < nBackends; i++) {
+        if (NULL != onlyBackend && strcmp(onlyBackend, backends[i].name)) {
+            continue;
+        }
+        anyBackend = true;
+        DataSupplier::SetDefault(backends[i].suppliers);
+
+        ProcessUsage startUsage;
+        _int64 start;
+        _int64 fileBytes = 0;
+        if (!input.isStdio) {
+            GetProcessUsage(&startUsage);
+            start = timeInMillis();
+            fileBytes = ReadThrough(backends[i].suppliers[true], input.fileName);
+            PrintStage("read", backends[i].name, fileBytes, -1, start, &startUsage);
+        }
+
+        if (inflate) {
+            DataSupplier *decompressor = bgzf ? DataSupplier::GzipBam(backends[i].suppliers[false], true) :
+                DataSupplier::Gzip(backends[i].suppliers[false], true);
+            GetProcessUsage(&startUsage);
+            start = timeInMillis();
+            _int64 bytes = ReadThrough(decompressor, input.fileName);
+            PrintStage("inflate", backends[i].name, bytes, -1, start, &startUsage);
+            delete decompressor;
+        }
+
+        ReaderContext readerContext;
+        readerContext.clipping = NoClipping;
+        readerContext.defaultReadGroup = "";
+        readerContext.rangeIndex = 0;
+        readerContext.rangeCount = 1;
+        readerContext.trimmer = NULL;
+        readerContext.screen = NULL;
+        readerContext.genome = genome;
+        readerContext.ignoreSecondaryAlignments = true;
+        readerContext.header = NULL;
+        readerContext.headerLength = 0;
+        readerContext.headerBytes = 0;
+
+        GetProcessUsage(&startUsage);
+        start = timeInMillis();
+        input.readHeader(readerContext);
+
+        ParseContext common;
+        common.totalThreads = nThreads;
+        common.bindToProcessors = false;
+        common.readSupplierGenerator = input.createReadSupplierGenerator(nThreads, readerContext);
+        common.nReads = 0;
+        common.nBases = 0;
+        ParallelTask<ParseContext> task(&common);
+        task.run();
+        delete common.readSupplierGenerator;
+        PrintStage("parse", backends[i].name, input.isStdio ? common.nBases : fileBytes, common.nReads, start, &startUsage);
+
+        if (input.isStdio) {
+            break;  // It's used up
+        }
+    }
+    if (!anyBackend) {
+        fprintf(stderr, "snap iobench: there's no '%s' backend for this input\n", onlyBackend);
+        soft_exit(1);
+    }
+    DataSupplier::SetDefault(originalDefault);
+
+    if (NULL == outputFileName) {
+        delete genome;
+        return;
+    }
+    if (input.isStdio || (SAMFile != input.fileType && FASTQFile != input.fileType && InterleavedFASTQFile != input.fileType)) {
+        fprintf(stderr, "snap iobench: the write stages need FASTQ or SAM input from a file, so they're skipped\n");
+        delete genome;
+        return;
+    }
+
+    //
+    // Load the records to write, and write them out each way in turn.
+    //
+    bool sam = SAMFile == input.fileType;
+    _int64 maxBytes = writeMB * 1024 * 1024;
+    if (!input.isCompressed) {
+        maxBytes = __min(maxBytes, DataSupplier::InputFileSize(input.fileName));
+    }
+    _int64 headerBytes;
+    VariableSizeVector<IoBenchRecord> records;
+    char *data = LoadRecords(DataSupplier::ForFile(input.fileName, input.isCompressed, true), input.fileName, maxBytes, sam, genome,
+        &headerBytes, &records);
+    if (0 == records.size()) {
+        fprintf(stderr, "snap iobench: there are no records to write\n");
+        BigDealloc(data);
+        delete genome;
+        return;
+    }
+    _int64 recordBytes = 0;
+    for (int i = 0; i < records.size(); i++) {
+        recordBytes += records[i].length;
+    }
+
+    static const char *configs[] = {"plain", "bgzf", "sorted"};
+    for (int config = 0; config < 3; config++) {
+        DataWriterSupplier *writerSupplier;
+        char *tempFileName = NULL;
+        if (0 == config) {
+            writerSupplier = DataWriterSupplier::create(outputFileName);
+        } else if (1 == config) {
+            GzipWriterFilterSupplier *gzipSupplier = DataWriterSupplier::gzip(true, BAM_BLOCK, nThreads, false);
+            writerSupplier = DataWriterSupplier::create(outputFileName, gzipSupplier, FileEncoder::gzip(gzipSupplier));
+        } else {
+            if (!sam || NULL == genome) {
+                continue;
+            }
+            tempFileName = DataWriterSupplier::sortTempFileName(outputFileName);
+            writerSupplier = DataWriterSupplier::sorted(FileFormat::SAM[false], genome, tempFileName, 0, 0, nThreads, outputFileName, NULL);
+        }
+
+        ProcessUsage startUsage;
+        GetProcessUsage(&startUsage);
+        _int64 start = timeInMillis();
+
+        //
+        // The sorter keeps the first thing written as the header, so there has to be one.
+        //
+        static const char *defaultHeader = "@HD\tVN:1.6\n";
+        const char *header = 0 != headerBytes ? data : defaultHeader;
+        size_t headerLength = 0 != headerBytes ? (size_t)headerBytes : strlen(defaultHeader);
+        DataWriter *headerWriter = writerSupplier->getWriter();
+        char *buffer;
+        size_t size;
+        headerWriter->inHeader(true);
+        if (!headerWriter->getBuffer(&buffer, &size) || size < headerLength) {
+            fprintf(stderr, "snap iobench: the header is too big to write\n");
+            soft_exit(1);
+        }
+        memcpy(buffer, header, headerLength);
+        headerWriter->advance((unsigned)headerLength, 0);
+        headerWriter->nextBatch();
+        headerWriter->inHeader(false);
+        headerWriter->close();
+        delete headerWriter;
+
+        WriteContext common;
+        common.totalThreads = nThreads;
+        common.bindToProcessors = false;
+        common.writerSupplier = writerSupplier;
+        common.data = data;
+        common.records = &records[0];
+        common.nRecords = records.size();
+        ParallelTask<WriteContext> task(&common);
+        task.run();
+
+        writerSupplier->close();
+        delete writerSupplier;
+        free(tempFileName);
+        PrintStage("write", configs[config], headerLength + recordBytes, records.size(), start, &startUsage);
+    }
+
+    DeleteSingleFile(outputFileName);
+    BigDealloc(data);
+    delete genome;
+}
@@ -0,0 +1,34 @@
+/*++
+
+Module Name:
+
+    IoBench.h
+
+Abstract:
+
+    The throughput of the input and output stacks on their own, without aligning anything.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+
+//
+// snap iobench <input> [options]
+//
+// Reads the input straight through each of the platform's raw data suppliers, through the decompressing supplier on
+// top of each if it's compressed, and then parses it into reads on all of the processors.  With an output file, it
+// also writes the input's records back out plain, BGZF compressed and (for SAM, with an index) sorted.  Each stage
+// reports its MB/s, reads/s and processor time, so comparing them with an alignment run's rate shows whether that run
+// is held up by storage, by decompression or parsing, by writing, or by the aligners themselves.
+//
+class IoBench
+{
+public:
+    static void runIoBench(int argc, const char **argv);
+};
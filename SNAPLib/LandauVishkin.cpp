@@ -6,12 +6,13 @@
 #include "BaseAligner.h"
 #include "Bam.h"
 #include "exit.h"
+#include "Util.h"
 
 using std::make_pair;
 using std::min;
 
  
-LandauVishkinWithCigar::LandauVishkinWithCigar()
+LandauVishkinWithCigar::LandauVishkinWithCigar() : gapPenalty(0), affineTraceback(NULL), affineTracebackSize(0)
 {
     for (int i = 0; i < MAX_K+1; i++) {
         for (int j = 0; j < 2*MAX_K+1; j++) {
@@ -20,6 +21,11 @@ LandauVishkinWithCigar::LandauVishkinWithCigar()
     }
 }
 
+LandauVishkinWithCigar::~LandauVishkinWithCigar()
+{
+    delete [] affineTraceback;
+}
+
 /*++
     Write cigar to buffer, return true if it fits
     null-terminates buffer if it returns false (i.e. fills up buffer)
@@ -47,12 +53,20 @@ bool writeCigar(char** o_buf, int* o_buflen, int count, char code, CigarFormat f
             *(*o_buf - 1) = '\0';
             return false;
         }
-        int written = snprintf(*o_buf, *o_buflen, "%d%c", count, code);
+        //
+        // By hand rather than with snprintf, which was a good part of the cost of writing a SAM record.
+        //
+        char op[22];
+        char* end = util::formatDecimal(op, (_uint64) count);
+        *end++ = code;
+        int written = (int)(end - op);
         if (written > *o_buflen - 1) {
-            *o_buf = '\0';
+            **o_buf = '\0';
             return false;
         } else {
+            memcpy(*o_buf, op, written);
             *o_buf += written;
+            **o_buf = '\0';
             *o_buflen -= written;
             return true;
         }
@@ -128,7 +142,7 @@ static const int PrevDelta[3][3] =
     {0, -1, +1},    // d == 0
     {-1, 0, +1}};   // d > 0
 
-int LandauVishkinWithCigar::computeEditDistance(
+SNAP_CPU_DISPATCH int LandauVishkinWithCigar::computeEditDistance(
     const char* text, int textLen,
     const char* pattern, int patternLen,
     int k,
@@ -438,6 +452,26 @@ done1:
     return -1;
 }
 
+//
+// How many bytes at the start of a and b are the same, looking at no more than length of them.
+//
+static inline int countMatchingPrefix(const char *a, const char *b, int length)
+{
+    int i = 0;
+    for (; i + 8 <= length; i += 8) {
+        _uint64 x = *(const _uint64 *)(a + i) ^ *(const _uint64 *)(b + i);
+        if (x) {
+            unsigned long zeroes;
+            CountTrailingZeroes(x, zeroes);
+            return i + (int)(zeroes >> 3);
+        }
+    }
+    while (i < length && a[i] == b[i]) {
+        i++;
+    }
+    return i;
+}
+
 int LandauVishkinWithCigar::computeEditDistanceNormalized(
     const char* text, int textLen,
     const char* pattern, int patternLen,
@@ -445,21 +479,83 @@ int LandauVishkinWithCigar::computeEditDistanceNormalized(
     char *cigarBuf, int cigarBufLen, bool useM, 
     CigarFormat format, int* cigarBufUsed)
 {
+    PerfTimer timer(PerfCounters::CigarGeneration);
     if (format != BAM_CIGAR_OPS && format != COMPACT_CIGAR_STRING) {
         fprintf(stderr, "LandauVishkinWithCigar::computeEditDistanceNormalized invalid parameter\n");
         soft_exit(1);
     }
+    if (0 == gapPenalty && textLen >= patternLen && NULL != text) {
+        //
+        // Most reads are an exact match or have one mismatch and no indels.  LV would find the same answer for those (it
+        // looks for a substitution before any indel, and with at most one edit there's nothing to normalize), so just
+        // write it straight into the caller's format rather than going through BAM ops and a second pass.
+        //
+        int matchedBefore = countMatchingPrefix(pattern, text, patternLen);
+        int matchedAfter = 0;
+        if (matchedBefore < patternLen) {
+            matchedAfter = countMatchingPrefix(pattern + matchedBefore + 1, text + matchedBefore + 1, patternLen - matchedBefore - 1);
+        }
+        if (matchedBefore == patternLen || matchedBefore + 1 + matchedAfter == patternLen) {
+            char *cigarBufStart = cigarBuf;
+            if (format == COMPACT_CIGAR_STRING && cigarBufLen > 0) {
+                *cigarBuf = '\0';   // In case there's nothing to write
+            }
+            bool fits;
+            if (useM || matchedBefore == patternLen) {
+                fits = writeCigar(&cigarBuf, &cigarBufLen, patternLen, useM ? 'M' : '=', format);
+            } else {
+                fits = writeCigar(&cigarBuf, &cigarBufLen, matchedBefore, '=', format) &&
+                       writeCigar(&cigarBuf, &cigarBufLen, 1, 'X', format) &&
+                       writeCigar(&cigarBuf, &cigarBufLen, matchedAfter, '=', format);
+            }
+            if (!fits) {
+                return -2;
+            }
+            if (cigarBufUsed != NULL) {
+                *cigarBufUsed = format == BAM_CIGAR_OPS ? (int)(cigarBuf - cigarBufStart) : (int)(cigarBuf - cigarBufStart) + 1;
+            }
+            return matchedBefore == patternLen ? 0 : 1;
+        }
+    }
+
     int bamBufLen = (format == BAM_CIGAR_OPS ? 1 : 2) * cigarBufLen; // should be enough
     char* bamBuf = (char*) alloca(bamBufLen);
     int bamBufUsed, textUsed;
-    int score = computeEditDistance(text, textLen, pattern, patternLen, k, bamBuf, bamBufLen,
+    int score;
+    _uint32* bamOps = (_uint32*) bamBuf;
+    int bamOpCount;
+    bool hasIndels = false;
+    if (patternLen > MaxUntiledPatternLength) {
+        //
+        // The tiles' indels are as early as they can go within each tile, which is as much normalizing as makes sense
+        // for the noisy long reads that are this long.
+        //
+        score = computeTiledBamOps(text, textLen, pattern, patternLen, k, bamOps, bamBufLen / sizeof(_uint32), useM, &bamOpCount);
+        if (score < 0) {
+            return score;
+        }
+        bamBufUsed = bamOpCount * sizeof(_uint32);
+        goto copyOut;
+    }
+
+    if (0 != gapPenalty) {
+        //
+        // The affine gap alignment already puts its indels as early as it can, so there's no second pass.
+        //
+        score = computeAffineGapBamOps(text, textLen, pattern, patternLen, k, bamOps, bamBufLen / sizeof(_uint32), useM, &bamOpCount);
+        if (score < 0) {
+            return score;
+        }
+        bamBufUsed = bamOpCount * sizeof(_uint32);
+        goto copyOut;
+    }
+
+    score = computeEditDistance(text, textLen, pattern, patternLen, k, bamBuf, bamBufLen,
         useM, BAM_CIGAR_OPS, &bamBufUsed, &textUsed);
     if (score < 0) {
         return score;
     }
-    _uint32* bamOps = (_uint32*) bamBuf;
-    int bamOpCount = bamBufUsed / sizeof(_uint32);
-    bool hasIndels = false;
+    bamOpCount = bamBufUsed / sizeof(_uint32);
     for (int i = 0; i < bamOpCount && ! hasIndels; i++) {
         char c = BAMAlignment::CodeToCigar[BAMAlignment::GetCigarOpCode(bamOps[i])];
         hasIndels = c == 'I' || c == 'D';
@@ -497,6 +593,7 @@ int LandauVishkinWithCigar::computeEditDistanceNormalized(
                 score, textUsed, bamBufUsed, text2, pattern2);
         }
     }
+copyOut:
     // copy out cigar info
     if (format == BAM_CIGAR_OPS) {
         memcpy(cigarBuf, bamOps, bamBufUsed);
@@ -515,6 +612,275 @@ int LandauVishkinWithCigar::computeEditDistanceNormalized(
     return score;
 }
 
+    int
+LandauVishkinWithCigar::computeTiledBamOps(
+    const char* text, int textLen,
+    const char* pattern, int patternLen,
+    int k,
+    _uint32 *bamOps, int bamOpsSize, bool useM, int *bamOpsUsed)
+{
+    //
+    // A tile that has more than k edits is retried at half the size, down to one small enough that it can't.
+    //
+    const int TileLength = 256;
+    const int MinTileLength = 16;
+    _uint32 tileOps[2 * TileLength + 2];
+
+    int editDistance = 0;
+    int nOps = 0;
+    int patternOffset = 0;
+    int textOffset = 0;
+    int tileLength = TileLength;
+    while (patternOffset < patternLen) {
+        int tilePatternLen = __min(tileLength, patternLen - patternOffset);
+        int tileTextLen = __max(0, __min(textLen - textOffset, tilePatternLen + k));  // LV can count text it doesn't have as mismatches
+        int nTileOps;
+        int score;
+        if (0 == tileTextLen) {
+            //
+            // The text ran out, so the rest of the pattern is an insertion.
+            //
+            tileOps[0] = ((patternLen - patternOffset) << 4) | BAMAlignment::CigarToCode['I'];
+            nTileOps = 1;
+            score = patternLen - patternOffset;
+            tilePatternLen = patternLen - patternOffset;
+        } else if (0 != gapPenalty) {
+            score = computeAffineGapBamOps(text + textOffset, tileTextLen, pattern + patternOffset, tilePatternLen, __min(k, tilePatternLen),
+                tileOps, sizeof(tileOps) / sizeof(tileOps[0]), useM, &nTileOps);
+        } else {
+            int tileOpsBytes;
+            score = computeEditDistance(text + textOffset, tileTextLen, pattern + patternOffset, tilePatternLen, k,
+                (char *)tileOps, sizeof(tileOps), useM, BAM_CIGAR_OPS, &tileOpsBytes);
+            nTileOps = tileOpsBytes / sizeof(_uint32);
+        }
+
+        if (score == -1 && tileLength > MinTileLength) {
+            tileLength /= 2;
+            continue;
+        }
+        if (score < 0) {
+            return score;
+        }
+
+        for (int i = 0; i < nTileOps; i++) {
+            textOffset += BAMAlignment::CigarCodeToRefBase[tileOps[i] & 0xf] * (tileOps[i] >> 4);
+            if (nOps > 0 && (bamOps[nOps - 1] & 0xf) == (tileOps[i] & 0xf)) {
+                bamOps[nOps - 1] += tileOps[i] & ~0xf;
+            } else {
+                if (nOps == bamOpsSize) {
+                    return -2;
+                }
+                bamOps[nOps++] = tileOps[i];
+            }
+        }
+
+        editDistance += score;
+        patternOffset += tilePatternLen;
+        tileLength = TileLength;
+    }
+
+    *bamOpsUsed = nOps;
+    return editDistance;
+}
+
+//
+// Gotoh's affine gap alignment, restricted to the band of diagonals within k of the main one (like LV, the alignment
+// starts at the start of both strings and may end anywhere in the text).  There are three ways to end up at each cell:
+// having just aligned a pattern base with a text base (M), in the middle of an insertion (I, consuming pattern bases)
+// or in the middle of a deletion (D, consuming text bases).  The traceback byte for a cell says which of those the
+// best path came from, and whether the I and D states there opened their gap or extended it.
+//
+static const unsigned char AffineFromM = 0;
+static const unsigned char AffineFromI = 1;
+static const unsigned char AffineFromD = 2;
+static const unsigned char AffineFromMask = 3;
+static const unsigned char AffineIOpened = 4;
+static const unsigned char AffineDOpened = 8;
+
+    int
+LandauVishkinWithCigar::computeAffineGapBamOps(
+    const char* text, int textLen,
+    const char* pattern, int patternLen,
+    int k,
+    _uint32 *bamOps, int bamOpsSize, bool useM, int *bamOpsUsed)
+{
+    const int Infinity = 0x3fffffff;
+    const int open = (int)gapPenalty;
+    const int bandWidth = 2 * k + 1;
+
+    size_t tracebackSizeNeeded = (size_t)(patternLen + 1) * bandWidth;
+    if (tracebackSizeNeeded > affineTracebackSize) {
+        delete [] affineTraceback;
+        affineTracebackSize = tracebackSizeNeeded;
+        affineTraceback = new unsigned char[affineTracebackSize];
+    }
+
+    //
+    // The best costs for the previous and current rows (pattern offsets), indexed by diagonal (text offset - pattern
+    // offset + k).  There's an extra Infinity on each end so the neighbors of the edge of the band need no special case.
+    //
+    int rowStorage[2][3][2 * MAX_K + 3];
+    int (*previous)[2 * MAX_K + 3] = rowStorage[0];
+    int (*current)[2 * MAX_K + 3] = rowStorage[1];
+    const int H = 0, I = 1, D = 2;
+
+    for (int state = 0; state < 3; state++) {
+        for (int d = 0; d < bandWidth + 2; d++) {
+            previous[state][d] = current[state][d] = Infinity;
+        }
+    }
+
+    //
+    // Row 0: nothing but a deletion from the read.
+    //
+    for (int j = 0; j <= __min(k, textLen); j++) {
+        previous[D][j + k + 1] = j == 0 ? Infinity : open + j - 1;
+        previous[H][j + k + 1] = j == 0 ? 0 : previous[D][j + k + 1];
+        affineTraceback[j + k] = j == 0 ? AffineFromM : (AffineFromD | (j == 1 ? AffineDOpened : 0));
+    }
+
+    for (int i = 1; i <= patternLen; i++) {
+        int firstJ = __max(0, i - k);
+        int lastJ = __min(textLen, i + k);
+        if (firstJ > lastJ) {
+            return -1;  // The text has run out
+        }
+        unsigned char *traceback = affineTraceback + (size_t)i * bandWidth;
+
+        for (int d = 0; d < bandWidth + 2; d++) {
+            current[H][d] = current[I][d] = current[D][d] = Infinity;
+        }
+
+        for (int j = firstJ; j <= lastJ; j++) {
+            int d = j - i + k + 1;  // The index into the row arrays; the cell above is d + 1 and the one to the left d - 1
+            unsigned char action = 0;
+
+            int openI = previous[H][d + 1] + open;
+            int extendI = previous[I][d + 1] + 1;
+            if (openI <= extendI) {
+                current[I][d] = openI;
+                action |= AffineIOpened;
+            } else {
+                current[I][d] = extendI;
+            }
+
+            int openD = current[H][d - 1] + open;
+            int extendD = current[D][d - 1] + 1;
+            if (openD <= extendD) {
+                current[D][d] = openD;
+                action |= AffineDOpened;
+            } else {
+                current[D][d] = extendD;
+            }
+
+            //
+            // Prefer the match when there's a tie, since tracing back from the end that pushes the indels as early
+            // as they can go.
+            //
+            int best = j == 0 ? Infinity : previous[H][d] + (pattern[i - 1] == text[j - 1] ? 0 : 1);
+            action |= AffineFromM;
+            if (current[I][d] < best) {
+                best = current[I][d];
+                action = (action & ~AffineFromMask) | AffineFromI;
+            }
+            if (current[D][d] < best) {
+                best = current[D][d];
+                action = (action & ~AffineFromMask) | AffineFromD;
+            }
+            current[H][d] = __min(best, Infinity);
+            current[I][d] = __min(current[I][d], Infinity);
+            current[D][d] = __min(current[D][d], Infinity);
+            traceback[d - 1] = action;
+        }
+
+        int (*swap)[2 * MAX_K + 3] = previous;
+        previous = current;
+        current = swap;
+    }
+
+    //
+    // Pick where in the text to end, preferring the main diagonal and then the ones nearest it.
+    //
+    int bestJ = -1;
+    int bestCost = Infinity;
+    for (int offset = 0; offset <= k; offset++) {
+        for (int sign = 1; sign >= -1; sign -= 2) {
+            int j = patternLen + sign * offset;
+            if (j >= 0 && j <= textLen && previous[H][j - patternLen + k + 1] < bestCost) {
+                bestCost = previous[H][j - patternLen + k + 1];
+                bestJ = j;
+            }
+            if (0 == offset) {
+                break;
+            }
+        }
+    }
+    if (bestJ < 0) {
+        return -1;
+    }
+
+    //
+    // Trace back to the start, writing the ops from the end of bamOps toward its beginning and counting the edits.
+    //
+    int i = patternLen, j = bestJ;
+    int state = H;
+    int editDistance = 0;
+    int nOps = 0;
+    char lastOp = '\0';
+    while (i > 0 || j > 0) {
+        unsigned char action = affineTraceback[(size_t)i * bandWidth + j - i + k];
+        char op;
+        if (H == state) {
+            unsigned char from = action & AffineFromMask;
+            if (AffineFromI == from) {
+                state = I;
+                continue;
+            } else if (AffineFromD == from) {
+                state = D;
+                continue;
+            }
+            op = pattern[i - 1] == text[j - 1] ? '=' : 'X';
+            if ('X' == op) {
+                editDistance++;
+            }
+            if (useM) {
+                op = 'M';
+            }
+            i--;
+            j--;
+        } else if (I == state) {
+            op = 'I';
+            editDistance++;
+            if (action & AffineIOpened) {
+                state = H;
+            }
+            i--;
+        } else {
+            op = 'D';
+            editDistance++;
+            if (action & AffineDOpened) {
+                state = H;
+            }
+            j--;
+        }
+
+        if (op == lastOp) {
+            bamOps[bamOpsSize - nOps] += 1 << 4;
+        } else {
+            if (nOps == bamOpsSize) {
+                return -2;
+            }
+            nOps++;
+            bamOps[bamOpsSize - nOps] = (1 << 4) | BAMAlignment::CigarToCode[op];
+            lastOp = op;
+        }
+    }
+
+    memmove(bamOps, bamOps + bamOpsSize - nOps, nOps * sizeof(_uint32));
+    *bamOpsUsed = nOps;
+    return editDistance;
+}
+
     int
 LandauVishkinWithCigar::linearizeCompactBinary(
     _uint16* o_linear,
@@ -564,6 +930,160 @@ LandauVishkinWithCigar::linearizeCompactBinary(
     return ir;
 }
 
+//
+// Fillers for the parts of the batched rows and columns past the ends of the patterns and texts (and for unused
+// lanes).  They match no base and not each other, so anything aligned against them is a mismatch.
+//
+static const unsigned char BatchedPatternFiller = 0xfe;
+static const unsigned char BatchedTextFiller = 0xff;
+static const unsigned char BatchedInfinity = 0xff;     // Adding to it saturates rather than wraps
+
+BatchedEditDistance::BatchedEditDistance() : rows(NULL), rowsSize(0), columns(NULL), columnsSize(0)
+{
+}
+
+BatchedEditDistance::~BatchedEditDistance()
+{
+    delete [] rows;
+    delete [] columns;
+}
+
+    void
+BatchedEditDistance::reserve(int nRows, int nColumns)
+{
+    if (nRows * Lanes > rowsSize) {
+        delete [] rows;
+        rowsSize = nRows * Lanes;
+        rows = new unsigned char[rowsSize];
+    }
+
+    if (nColumns * Lanes > columnsSize) {
+        delete [] columns;
+        columnsSize = nColumns * Lanes;
+        columns = new unsigned char[columnsSize];
+    }
+}
+
+    SNAP_CPU_DISPATCH void
+BatchedEditDistance::computeEditDistances(
+    int                 textDirection,
+    const char * const *texts,
+    const int          *textLens,
+    const char * const *patterns,
+    const int          *patternLens,
+    int                 nPairs,
+    int                 k,
+    int                *o_distances)
+{
+    _ASSERT(nPairs > 0 && nPairs <= Lanes && k >= 0 && k < MAX_K && (1 == textDirection || -1 == textDirection));
+
+    int maxPatternLen = 0;
+    for (int lane = 0; lane < nPairs; lane++) {
+        maxPatternLen = __max(maxPatternLen, patternLens[lane]);
+        o_distances[lane] = k + 1;
+    }
+
+    //
+    // Cell (i, j) is pattern[0..i) against text[0..j), and the band has the cells with j - i = d for -k <= d <= k.  Row i's
+    // cell on diagonal d compares pattern[i - 1] with text[i + d - 1], which is in column i + d + k here: the columns
+    // start k + 1 before the text (for the diagonals below the main one in the first rows, whose cells are all off the
+    // start of the text) and go k past the longest pattern.
+    //
+    const int bandWidth = 2 * k + 1;
+    const int nColumns = maxPatternLen + bandWidth;
+    reserve(__max(maxPatternLen, 1), nColumns);
+    memset(rows, BatchedPatternFiller, maxPatternLen * Lanes);
+    memset(columns, BatchedTextFiller, nColumns * Lanes);
+    for (int lane = 0; lane < nPairs; lane++) {
+        for (int i = 0; i < patternLens[lane]; i++) {
+            rows[i * Lanes + lane] = patterns[lane][i];
+        }
+
+        int textToUse = __min(textLens[lane], maxPatternLen + k);
+        unsigned char *column = columns + (k + 1) * Lanes + lane;
+        if (1 == textDirection) {
+            for (int j = 0; j < textToUse; j++) {
+                column[j * Lanes] = texts[lane][j];
+            }
+        } else {
+            for (int j = 0; j < textToUse; j++) {
+                column[j * Lanes] = texts[lane][-1 - j];
+            }
+        }
+    }
+
+    //
+    // The band's cells are in cells[1..bandWidth], with cells[0] and cells[bandWidth + 1] always infinite for the
+    // neighbors of its edges.  Row 0 is d deletions for d >= 0, and nothing is below the main diagonal.  Each row is
+    // computed in place: cell d needs the previous row's d (diagonally up and left) and d + 1 (straight up), which haven't
+    // been overwritten yet, and this row's d - 1 (to the left), which has.
+    //
+    unsigned char rowMinimum[Lanes];
+#if     defined(__SSE2__) || defined(_M_X64)
+    __m128i cells[2 * MAX_K + 3];
+    const __m128i one = _mm_set1_epi8(1);
+    const __m128i infinity = _mm_set1_epi8((char)BatchedInfinity);
+    for (int index = 0; index <= bandWidth + 1; index++) {
+        cells[index] = (index >= k + 1 && index <= bandWidth) ? _mm_set1_epi8((char)(index - k - 1)) : infinity;
+    }
+#else   // SSE2
+    unsigned char cells[2 * MAX_K + 3][Lanes];
+    for (int index = 0; index <= bandWidth + 1; index++) {
+        memset(cells[index], (index >= k + 1 && index <= bandWidth) ? index - k - 1 : BatchedInfinity, Lanes);
+    }
+#endif  // SSE2
+
+    for (int i = 0; ; i++) {
+        if (i > 0) {
+            const unsigned char *rowPattern = rows + (i - 1) * Lanes;
+            const unsigned char *rowText = columns + i * Lanes;
+#if     defined(__SSE2__) || defined(_M_X64)
+            const __m128i patternBases = _mm_loadu_si128((const __m128i *)rowPattern);
+            __m128i left = infinity;
+            __m128i minimum = infinity;
+            for (int index = 1; index <= bandWidth; index++) {
+                __m128i textBases = _mm_loadu_si128((const __m128i *)(rowText + (index - 1) * Lanes));
+                __m128i substitutionCost = _mm_andnot_si128(_mm_cmpeq_epi8(textBases, patternBases), one);
+                __m128i cell = _mm_min_epu8(_mm_adds_epu8(cells[index], substitutionCost), _mm_adds_epu8(cells[index + 1], one));
+                cell = _mm_min_epu8(cell, _mm_adds_epu8(left, one));
+                cells[index] = left = cell;
+                minimum = _mm_min_epu8(minimum, cell);
+            }
+            _mm_storeu_si128((__m128i *)rowMinimum, minimum);
+#else   // SSE2
+            memset(rowMinimum, BatchedInfinity, Lanes);
+            for (int lane = 0; lane < Lanes; lane++) {
+                int left = BatchedInfinity;
+                for (int index = 1; index <= bandWidth; index++) {
+                    int best = cells[index][lane] + (rowText[(index - 1) * Lanes + lane] == rowPattern[lane] ? 0 : 1);
+                    best = __min(best, cells[index + 1][lane] + 1);
+                    best = __min(best, left + 1);
+                    cells[index][lane] = left = __min(best, (int)BatchedInfinity);
+                    rowMinimum[lane] = __min(rowMinimum[lane], cells[index][lane]);
+                }
+            }
+#endif  // SSE2
+        } else {
+            memset(rowMinimum, 0, Lanes);
+        }
+
+        //
+        // A row's minimum never goes down from one row to the next, so a pair whose minimum is over k is done too.
+        //
+        bool anyLeft = false;
+        for (int lane = 0; lane < nPairs; lane++) {
+            if (i == patternLens[lane]) {
+                o_distances[lane] = __min((int)rowMinimum[lane], k + 1);
+            } else if (i < patternLens[lane] && rowMinimum[lane] <= k) {
+                anyLeft = true;
+            }
+        }
+        if (!anyLeft) {
+            break;
+        }
+    }
+}
+
     void 
 setLVProbabilities(double *i_indelProbabilities, double *i_phredToProbability, double mutationProbability)
 {
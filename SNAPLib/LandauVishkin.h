@@ -3,6 +3,14 @@
 #include "FixedSizeMap.h"
 #include "BigAlloc.h"
 #include "exit.h"
+#include "PerfCounters.h"
+
+#if     defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+#if     defined(__SSSE3__) || defined(__AVX__)
+#include <tmmintrin.h>
+#endif
 
 const int MAX_K = 63;
 
@@ -33,111 +41,97 @@ struct LVResult {
 };
 
 //
-// A cache that operates in two phases: loading and looking up.  During loading,
-// it remembers the cache entries but doesn't actually put them in the cache.
-// During look-up phase, it checks the cache for entries, but doesn't add more.
-// The idea is to load during the single-end phase of paired-end alignments,
-// and to look-up during alignTogether, when we're likely to be computing many
-// of the same LV scores that we did in single-end.  
+// A cache of LV results, so that when the same read is scored against the same place in the genome more than once
+// (in paired-end alignment the intersecting aligner and the chimeric fallback's single-end aligner share their
+// LandauVishkin objects and so their caches) it only gets computed once.
 //
-// The idea behind using two phases (rather than the more obvious design where the
-// cache is loaded and looked-up simultaneously) is to optimize cache performance.
-// Becuase some alignments will do lots of LV calls, the size of the hash table
-// in the FixedSizeMap is big, which in turn means that roughly every reference to 
-// it (both inserting and looking up) is a cache miss, which if left unchecked would
-// result in essentially no benefit from the cache.  Doing it in two phases, however
-// means that in the ordinary case where alignTogether isn't called, we do very little
-// work.  In the case where it is called, we can size the hash table appropriately
-// in order to avoid making it too big, and so reduce cache missing.  We can also
-// prefetch the hash table buckets so as to reduce the time wasted on cache missing
-// during the load-in to the cache.
+// It's direct mapped: each key has one slot, and putting a result there replaces whatever was in it, so it never
+// needs to grow or be probed.  Clearing it just starts a new epoch; entries from earlier epochs don't match.  That
+// makes clearing free, so it can be done for every read.
+//
+// The keys must identify the whole computation: the text, the pattern and which direction it's run in.  The aligners
+// use the genome location, the read, its direction and where in it the seed is; see the callers.  The location takes
+// the low GenomeLocationBits bits (see Genome.h) and the rest go above it.
 //
 
 class LandauVishkinCache {
 public:
-    LandauVishkinCache(unsigned cacheSize_) : cacheSize(cacheSize_)
+    LandauVishkinCache(unsigned cacheSize) : epoch(1), nLookups(0), nHits(0)
     {
-        map = new FixedSizeMap<_uint64, LVResult>();
-        map->reserve(cacheSize);
+        for (log2Size = 1; ((unsigned)1 << log2Size) < cacheSize; log2Size++) {
+            // Just round up to a power of two
+        }
 
-        inLoadPhase = true;
-        toBeInserted = new LVResultKeyPair[cacheSize];
+        entries = new Entry[(size_t)1 << log2Size];
+        for (size_t i = 0; i < ((size_t)1 << log2Size); i++) {
+            entries[i].epoch = 0;
+        }
     }
 
     ~LandauVishkinCache()
     {
-        delete map;
-        delete [] toBeInserted;
+        delete [] entries;
     }
 
     inline void put(_uint64 cacheKey, LVResult result)
     {
-        if (!inLoadPhase) {
-            return;
-        }
-
-        _ASSERT(countToBeInserted < cacheSize);
-
-        toBeInserted[countToBeInserted].cacheKey = cacheKey;
-        toBeInserted[countToBeInserted].result = result;
-        countToBeInserted++;
-
-        // Should we prefetch the next location in toBeInserted here??
-    }
-    
-    inline void clear()
-    {
-        inLoadPhase = true;
-        countToBeInserted = 0;
-        //
-        // Don't bother clearing the map.  That happens when (if) we switch phases.
-        //
+        Entry *entry = &entries[slotForKey(cacheKey)];
+        entry->cacheKey = cacheKey;
+        entry->epoch = epoch;
+        entry->result = result;
     }
 
-    inline void enterLookupPhase()
+    inline void clear()
     {
-        _ASSERT(inLoadPhase);
-
-        map->clear();
-
-        map->resize(countToBeInserted);
-
-        //
-        // maybe we should work this loop in such a way that we're prefetching several
-        // ahead of where we're inserting in the map.
-        //
-        for (unsigned i = 0; i < countToBeInserted; i++) {
-            map->put(toBeInserted[i].cacheKey, toBeInserted[i].result);
+        epoch++;
+        if (0 == epoch) {
+            //
+            // Wrapped around, so there could be entries that look like they're from now.  Clear them for real.
+            //
+            for (size_t i = 0; i < ((size_t)1 << log2Size); i++) {
+                entries[i].epoch = 0;
+            }
+            epoch = 1;
         }
-
-        inLoadPhase = false;
     }
 
     inline LVResult get(_uint64 cacheKey)
     {
-        if (inLoadPhase) {
+        PerfCounters *perf = PerfCounters::forThisThread();
+        nLookups++;
+        perf->lvCacheLookups++;
+        Entry *entry = &entries[slotForKey(cacheKey)];
+        if (entry->epoch != epoch || entry->cacheKey != cacheKey) {
             return LVResult();
         }
 
-        LVResult result =  map->get(cacheKey);
-
-        return result;
+        nHits++;
+        perf->lvCacheHits++;
+        return entry->result;
     }
 
+    inline _int64 getLookups() const {return nLookups;}
+    inline _int64 getHits() const {return nHits;}
+
 private:
-    unsigned cacheSize;
-    bool inLoadPhase;
 
-    unsigned countToBeInserted;
+    inline size_t slotForKey(_uint64 cacheKey) const
+    {
+        return (size_t)((cacheKey * 0x9e3779b97f4a7c15ull) >> (64 - log2Size));
+    }
 
-    struct LVResultKeyPair {
+    struct Entry {
         _uint64     cacheKey;
+        unsigned    epoch;
         LVResult    result;
     };
-    LVResultKeyPair *toBeInserted;
 
-    FixedSizeMap<_uint64, LVResult> *map;
+    Entry      *entries;
+    unsigned    log2Size;
+    unsigned    epoch;
 
+    _int64      nLookups;
+    _int64      nHits;
 };
 
 static inline void memsetint(int* p, int value, int count)
@@ -152,6 +146,76 @@ static inline void memsetint(int* p, int value, int count)
   }
 }
 
+//
+// Counts how many bases match going forward from p and in TEXT_DIRECTION from t (so for -1, t points at the "first" base
+// and the ones after it are below it), up to at most maxLength (and just returns maxLength if that's not positive).
+//
+// It does sixteen at a time with SSE while there are whole blocks of sixteen left, and then the rest eight at a time.
+// Going backwards needs the text block byte reversed, which is one instruction with SSSE3 but four without it, and then
+// it's slower than eight at a time with a byte swap, so without SSSE3 the reverse direction is all eight at a time.
+// The eight at a time loop reads up to seven bytes past maxLength (but ignores them), as it always has.
+//
+// In builds with SNAP_CPU_DISPATCH the reverse is a generic vector shuffle, which the compiler makes into the one
+// SSSE3 instruction in the clones for processors that have it (which all of the levels above the baseline do).
+//
+template<int TEXT_DIRECTION> static inline int LVCountMatchingBases(const char *p, const char *t, int maxLength)
+{
+    int matched = 0;
+#if     defined(__SSE2__) || defined(_M_X64)
+#if     !defined(__SSSE3__) && !defined(__AVX__) && !defined(SNAP_CPU_DISPATCH_CLONES)
+    if (TEXT_DIRECTION == 1)
+#endif  // !SSSE3
+    {
+        for (; matched + 16 <= maxLength; matched += 16, p += 16, t += 16 * TEXT_DIRECTION) {
+            __m128i textBlock;
+#if     defined(__SSSE3__) || defined(__AVX__)
+            if (TEXT_DIRECTION == -1) {
+                textBlock = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(t - 15)),
+                                             _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+            } else
+#elif   defined(SNAP_CPU_DISPATCH_CLONES)
+            if (TEXT_DIRECTION == -1) {
+                typedef char ByteVector __attribute__((vector_size(16)));
+                const ByteVector reverse = {15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0};
+                textBlock = (__m128i)__builtin_shuffle((ByteVector)_mm_loadu_si128((const __m128i *)(t - 15)), reverse);
+            } else
+#endif  // SSSE3
+            {
+                textBlock = _mm_loadu_si128((const __m128i *)t);
+            }
+            unsigned mismatches = ~(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), textBlock)) & 0xffff;
+            if (mismatches) {
+                unsigned long zeroes;
+                CountTrailingZeroes(mismatches, zeroes);
+                return matched + (int)zeroes;
+            }
+        }
+    }
+#endif  // SSE2
+
+    while (matched < maxLength) {
+        _uint64 x;
+        if (TEXT_DIRECTION == 1) {
+            x = *((_uint64*) p) ^ *((_uint64*) t);
+        } else {
+            _uint64 T = *(_uint64 *)(t - 7);
+            _uint64 tSwap = ByteSwapUI64(T);
+            x = *((_uint64*) p) ^ tSwap;
+        }
+
+        if (x) {
+            unsigned long zeroes;
+            CountTrailingZeroes(x, zeroes);
+            zeroes >>= 3;
+            return __min(matched + (int)zeroes, maxLength);
+        }
+        matched += 8;
+        p += 8;
+        t += 8 * TEXT_DIRECTION;
+    }
+    return maxLength;
+}
+
 // Computes the edit distance between two strings without returning the edits themselves.
 // Set TEXT_DIRECTION to -1 to run backwards through the text.
 template<int TEXT_DIRECTION = 1> class LandauVishkin {
@@ -163,7 +227,9 @@ public:
         soft_exit(1);
     }
 
-    memsetint(L[0], -2, (MAX_K+1)*(2*MAX_K+1));
+    memsetint(smallBand.L[0], -2, (SmallBandK+1)*(2*SmallBandK+1));
+    memsetint(mediumBand.L[0], -2, (MediumBandK+1)*(2*MediumBandK+1));
+    memsetint(fullBand.L[0], -2, (MAX_K+1)*(2*MAX_K+1));
 
     if (cacheSize > 0) {
         cache = new LandauVishkinCache(cacheSize);
@@ -179,14 +245,6 @@ public:
         dTable[i] = d;
     }
 }
-/*
-    void pushBackCacheStats()
-    {
-        if (NULL != cache) {
-            cache->pushBackCacheStats();
-        }
-    }
-*/
     static size_t getBigAllocatorReservation() {return sizeof(LandauVishkin<TEXT_DIRECTION>);} // maybe we should worry about allocating the cache with a BigAllocator, but not for now.
 
     ~LandauVishkin()
@@ -196,17 +254,16 @@ public:
     }
 }
 
-    void enterCacheLookupPhase()
-    {
-        if (NULL != cache) {
-            cache->enterLookupPhase();
-        }
-    }
+    //
+    // How many times computeEditDistance looked in the cache, and how many it found its answer there.
+    //
+    _int64 getCacheLookups() const {return NULL == cache ? 0 : cache->getLookups();}
+    _int64 getCacheHits() const {return NULL == cache ? 0 : cache->getHits();}
 
     // Compute the edit distance between two strings, if it is <= k, or return -1 otherwise.
     // For LandauVishkin instances with a cache, the cacheKey should be a unique identifier for
     // the text and pattern combination (e.g. (readID << 33) | direction << 32 | genomeLocation).
-    int computeEditDistance(
+    inline int computeEditDistance(
             const char* text,
             int textLen, 
             const char* pattern,
@@ -217,6 +274,7 @@ public:
             _uint64 cacheKey = 0,
             int *netIndel = NULL)   // the net of insertions and deletions in the alignment.  Negative for insertions, positive for deleteions (and 0 if there are non in net).  Filled in only if matchProbability is non-NULL
 {
+    PerfTimer timer(PerfCounters::LVScoring);
     int localNetIndel;
     if (NULL == netIndel) {
         //
@@ -250,6 +308,54 @@ public:
             return old.result;
         }
     }
+
+    //
+    // Run the rest in the smallest band that's big enough for k.
+    //
+    if (k < SmallBandK) {
+        return computeEditDistanceInBand(&smallBand, text, textLen, pattern, qualityString, patternLen, k, matchProbability, cacheKey, netIndel);
+    } else if (k < MediumBandK) {
+        return computeEditDistanceInBand(&mediumBand, text, textLen, pattern, qualityString, patternLen, k, matchProbability, cacheKey, netIndel);
+    }
+    return computeEditDistanceInBand(&fullBand, text, textLen, pattern, qualityString, patternLen, k, matchProbability, cacheKey, netIndel);
+}
+
+private:
+
+    //
+    // The tables for computing edit distances of up to KMAX - 1.  L is indexed by edit count and then diagonal (offset
+    // by KMAX so that it can be negative), and A says how each cell of L was reached.  The cells of L outside the
+    // diagonals that a row uses are never written, and stay at -2 from the constructor, which is what stops the search
+    // from going outside the band.
+    //
+    template<int KMAX> struct Band {
+        int  L[KMAX+1][2 * KMAX + 1];
+        char A[KMAX+1][2 * KMAX + 1];
+    };
+
+    //
+    // Most runs use a k of about 15 (or less), and the cells they touch in a table sized for MAX_K are spread over a lot
+    // more memory than the cells themselves.  So there are bands sized for the common values of k as well as for MAX_K,
+    // and each call uses the smallest one that will do.  Their sizes are compile time constants in the code for each, so
+    // the indexing is cheap, and the small band fits in a handful of cache lines.
+    //
+    static const int SmallBandK = 16;
+    static const int MediumBandK = 32;
+
+    template<int KMAX> SNAP_CPU_DISPATCH int computeEditDistanceInBand(
+            Band<KMAX> *band,
+            const char* text,
+            int textLen,
+            const char* pattern,
+            const char *qualityString,
+            int patternLen,
+            int k,
+            double *matchProbability,
+            _uint64 cacheKey,
+            int *netIndel)
+{
+    _ASSERT(k < KMAX);
+
     if (NULL != matchProbability) {
         //
         // Start with perfect match probability and work our way down.
@@ -259,33 +365,9 @@ public:
     if (TEXT_DIRECTION == -1) {
         text--; // so now it points at the "first" character of t, not after it.
     }
-    const char* p = pattern;
-    const char* t = text;
     int end = __min(patternLen, textLen);
-    const char* pend = pattern + end;
-    while (p < pend) {
-        _uint64 x;
-        if (TEXT_DIRECTION == 1) {
-            x = *((_uint64*) p) ^ *((_uint64*) t);
-        } else {
-            _uint64 T = *(_uint64 *)(t - 7);
-            _uint64 tSwap = ByteSwapUI64(T);
-            x = *((_uint64*) p) ^ tSwap;
-        }
-
-        if (x) {
-            unsigned long zeroes;
-            CountTrailingZeroes(x, zeroes);
-            zeroes >>= 3;
-            L[0][MAX_K] = __min((int)(p - pattern) + (int)zeroes, end);
-            goto done1;
-        }
-        p += 8;
-        t += 8 * TEXT_DIRECTION;
-    }
-    L[0][MAX_K] = end;
-    done1:
-    if (L[0][MAX_K] == end) {
+    band->L[0][KMAX] = LVCountMatchingBases<TEXT_DIRECTION>(pattern, text, end);
+    if (band->L[0][KMAX] == end) {
         int result = (patternLen > end ? patternLen - end : 0); // Could need some deletions at the end
         if (NULL != matchProbability) {
             *matchProbability = lv_perfectMatchProbability[patternLen];    // Becuase the chance of a perfect match is < 1
@@ -307,48 +389,24 @@ public:
         // dTable is just precomputed d = (d > 0 ? -d : -d+1) to save the branch misprediction from (d > 0)
         int i =0;
         for (int d = 0; d != e+1 ; i++, d = dTable[i]) {
-            int best = L[e-1][MAX_K+d] + 1; // up
-            A[e][MAX_K+d] = 'X';
-            int left = L[e-1][MAX_K+d-1];
+            int best = band->L[e-1][KMAX+d] + 1; // up
+            band->A[e][KMAX+d] = 'X';
+            int left = band->L[e-1][KMAX+d-1];
             if (left > best) {
                 best = left;
-                A[e][MAX_K+d] = 'D';
+                band->A[e][KMAX+d] = 'D';
             }
-            int right = L[e-1][MAX_K+d+1] + 1;
+            int right = band->L[e-1][KMAX+d+1] + 1;
             if (right > best) {
                 best = right;
-                A[e][MAX_K+d] = 'I';
+                band->A[e][KMAX+d] = 'I';
             }
 
             const char* p = pattern + best;
             const char* t = (text + d * TEXT_DIRECTION) + best * TEXT_DIRECTION;
             if (*p == *t) {
                 int end = __min(patternLen, textLen - d);
-                const char* pend = pattern + end;
-
-                while (true) {
-                    _uint64 x;
-                    if (TEXT_DIRECTION == 1) {
-                        x = *((_uint64*) p) ^ *((_uint64*) t);
-                    } else {
-                        _uint64 T = *(_uint64 *)(t - 7);
-                        _uint64 tSwap = ByteSwapUI64(T);
-                        x = *((_uint64*) p) ^ tSwap;
-                    }
-                    if (x) {
-                        unsigned long zeroes;
-                        CountTrailingZeroes(x, zeroes);
-                        zeroes >>= 3;
-                        best = __min((int)(p - pattern) + (int)zeroes, end);
-                        break;
-                    }
-                    p += 8;
-                    if (p >= pend) {
-                        best = end;
-                        break;
-                    }
-                    t += 8 * TEXT_DIRECTION;
-                }
+                best += LVCountMatchingBases<TEXT_DIRECTION>(p, t, end - best);
             }
 
             if (best == patternLen) {
@@ -360,7 +418,7 @@ public:
                     //
                     int straightMismatches = 0;
 #if     0   // It's faster to just use the backtracker, because it doesn't look at every base, only the changed ones.
-                    for (int i = L[0][MAX_K]; i < end && straightMismatches <= e; i++) { // do this 8 at a time, like in the other loops!
+                    for (int i = band->L[0][KMAX]; i < end && straightMismatches <= e; i++) { // do this 8 at a time, like in the other loops!
                         if (pattern[i] != text[i * TEXT_DIRECTION]) {
                             straightMismatches++;
                             *matchProbability *= lv_phredToProbability[qualityString[i]];
@@ -377,26 +435,26 @@ public:
                         *matchProbability = 1.0;
                         int curD = d;
                         for (int curE = e; curE >= 1; curE--) {
-                            backtraceAction[curE] = A[curE][MAX_K+curD];
+                            backtraceAction[curE] = band->A[curE][KMAX+curD];
                             if (backtraceAction[curE] == 'I') {
                                 backtraceD[curE] = curD + 1;
-                                backtraceMatched[curE] = L[curE][MAX_K+curD] - L[curE-1][MAX_K+curD+1] - 1;
+                                backtraceMatched[curE] = band->L[curE][KMAX+curD] - band->L[curE-1][KMAX+curD+1] - 1;
                             } else if (backtraceAction[curE] == 'D') {
                                 backtraceD[curE] = curD - 1;
-                                backtraceMatched[curE] = L[curE][MAX_K+curD] - L[curE-1][MAX_K+curD-1];
+                                backtraceMatched[curE] = band->L[curE][KMAX+curD] - band->L[curE-1][KMAX+curD-1];
                             } else { // backtraceAction[curE] == 'X'
                                 backtraceD[curE] = curD;
-                                backtraceMatched[curE] = L[curE][MAX_K+curD] - L[curE-1][MAX_K+curD] - 1;
+                                backtraceMatched[curE] = band->L[curE][KMAX+curD] - band->L[curE-1][KMAX+curD] - 1;
                             }
                             curD = backtraceD[curE];
         #ifdef TRACE_LV
-                            printf("%d %d: %d %c %d %d\n", curE, curD, L[curE][MAX_K+curD], 
+                            printf("%d %d: %d %c %d %d\n", curE, curD, band->L[curE][KMAX+curD], 
                                 backtraceAction[curE], backtraceD[curE], backtraceMatched[curE]);
         #endif
                         }
 
                         int curE = 1;
-                        int offset = L[0][MAX_K+0];
+                        int offset = band->L[0][KMAX+0];
                         _ASSERT(*netIndel == 0);
                         while (curE <= e) {
                             // First write the action, possibly with a repeat if it occurred multiple times with no exact matches
@@ -442,7 +500,7 @@ public:
                 return e;
             } // if best == patternLen (i.e., we're done)
 
-            L[e][MAX_K+d] = best;
+            band->L[e][KMAX+d] = best;
         }
     }
 
@@ -453,6 +511,8 @@ public:
 }
 
 
+public:
+
     // Version that does not requre match probability and quality string
     inline int computeEditDistance(
             const char* text,
@@ -480,7 +540,9 @@ public:
  
 private:
     // TODO: For long reads, we should include a version that only has L be 2 x (2*MAX_K+1) cells
-    int L[MAX_K+1][2 * MAX_K + 1];
+    Band<SmallBandK>    smallBand;
+    Band<MediumBandK>   mediumBand;
+    Band<MAX_K>         fullBand;
 
     //
     // Table of d values for the inner loop in computeEditDistance.  This allows us to avoid the line d = (d > 0 ? -d : -d+1), which causes
@@ -488,9 +550,6 @@ private:
     //
     int dTable[2 * (MAX_K + 1) + 1];
     
-    // Action we did to get to each position: 'D' = deletion, 'I' = insertion, 'X' = substitution.  This is needed to compute match probability.
-    char A[MAX_K+1][2 * MAX_K + 1];
-
     // Arrays for backtracing the actions required to match two strings
     char backtraceAction[MAX_K+1];
     int  backtraceMatched[MAX_K+1];
@@ -502,6 +561,46 @@ private:
 void setLVProbabilities(double *i_indelProbabilities, double *i_phredToProbability, double mutationProbability);
 void initializeLVProbabilitiesToPhredPlus33();
 
+//
+// Computes the edit distances of up to Lanes text and pattern pairs at once, each pair in its own byte of a vector, for
+// callers with a batch of candidates to check against one limit.  Each distance is the one LandauVishkin's
+// computeEditDistance finds (the whole pattern against some prefix of the text, going backwards through the text for a
+// textDirection of -1) if it's at most k, and k + 1 if it isn't.  There's no match probability or net indel, so the
+// pairs that are within k still need LV for those; what it saves is LV's runs on the ones that aren't.
+//
+// It's a DP over the 2k + 1 diagonals within k of the main one, a pattern base at a time, and it stops as soon as
+// every pair has either come to the end of its pattern or gone over k everywhere in the band.
+//
+class BatchedEditDistance {
+public:
+    static const int Lanes = 16;
+
+    BatchedEditDistance();
+    ~BatchedEditDistance();
+
+    void computeEditDistances(
+            int                 textDirection,
+            const char * const *texts,
+            const int          *textLens,
+            const char * const *patterns,
+            const int          *patternLens,
+            int                 nPairs,
+            int                 k,
+            int                *o_distances);
+
+private:
+    void reserve(int nRows, int nColumns);
+
+    //
+    // The patterns a base (row) at a time and the texts a base (column) at a time, Lanes bytes each, so that one load
+    // gets the base that every pair needs at a cell.
+    //
+    unsigned char  *rows;
+    int             rowsSize;
+    unsigned char  *columns;
+    int             columnsSize;
+};
+
 
 // Computes the edit distance between two strings and returns a CIGAR string for the edits.
 
@@ -533,6 +632,26 @@ enum LinearCigarFlags
 class LandauVishkinWithCigar {
 public:
     LandauVishkinWithCigar();
+    ~LandauVishkinWithCigar();
+
+    //
+    // With a non-zero gap penalty, computeEditDistanceNormalized produces its CIGAR with an affine gap alignment rather
+    // than Landau-Vishkin: a mismatch costs 1 and an indel of n bases costs gapPenalty + n - 1.  The alignment is
+    // restricted to within k of the main diagonal, and the result is still the number of edits (the NM value).
+    //
+    void setGapPenalty(unsigned i_gapPenalty) {gapPenalty = i_gapPenalty;}
+
+    //
+    // Patterns longer than this (which only long read builds have) get their CIGARs from computeEditDistanceNormalized a
+    // tile at a time, with k applying to each tile rather than to the whole thing, since a long read can have many
+    // more than MAX_K edits.  Their text should be TextLengthForPattern long, to leave room for the alignment to have
+    // more deletions than insertions.
+    //
+    static const int MaxUntiledPatternLength = 1000;
+
+    static inline int TextLengthForPattern(int patternLen) {
+        return patternLen <= MaxUntiledPatternLength ? patternLen : patternLen + patternLen / 4;
+    }
 
     // Compute the edit distance between two strings and write the CIGAR string in cigarBuf.
     // Returns -1 if the edit distance exceeds k or -2 if we run out of space in cigarBuf.
@@ -554,6 +673,30 @@ public:
 
     static void printLinear(char* buffer, int bufferSize, unsigned variant);
 private:
+    //
+    // Fills in bamOps with the affine gap alignment of pattern against the start of text.  Returns the number of edits,
+    // or -1 if they can't be aligned within k of the diagonal or -2 if they don't fit in bamOps.
+    //
+    int computeAffineGapBamOps(const char* text, int textLen, const char* pattern, int patternLen, int k,
+                               _uint32 *bamOps, int bamOpsSize, bool useM, int *bamOpsUsed);
+
+    //
+    // Fills in bamOps with the alignment of a pattern longer than MaxUntiledPatternLength, made by aligning it a tile
+    // at a time, each one starting in the text where the one before ended.  Returns the number of edits, or -1 if
+    // some part of it can't be aligned within k or -2 if it doesn't fit in bamOps.
+    //
+    int computeTiledBamOps(const char* text, int textLen, const char* pattern, int patternLen, int k,
+                           _uint32 *bamOps, int bamOpsSize, bool useM, int *bamOpsUsed);
+
+    unsigned gapPenalty;
+
+    //
+    // One byte per cell of the band for each pattern base (plus one), saying how the affine gap alignment got there.
+    // It grows as needed.
+    //
+    unsigned char  *affineTraceback;
+    size_t          affineTracebackSize;
+
     int L[MAX_K+1][2 * MAX_K + 1];
     
     // Action we did to get to each position: 'D' = deletion, 'I' = insertion, 'X' = substitution.
@@ -0,0 +1,165 @@
+/*++
+
+Module Name:
+
+    Libdeflate.cpp
+
+Abstract:
+
+    Optional use of libdeflate in place of zlib for whole gzip blocks.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "Libdeflate.h"
+#include "zlib.h"
+
+#ifndef _MSC_VER
+#include <dlfcn.h>
+#endif
+
+Libdeflate::AllocCompressorFunction     Libdeflate::allocCompressorFunction = NULL;
+Libdeflate::FreeCompressorFunction      Libdeflate::freeCompressorFunction = NULL;
+Libdeflate::CompressFunction            Libdeflate::deflateCompressFunction = NULL;
+Libdeflate::CompressFunction            Libdeflate::gzipCompressFunction = NULL;
+Libdeflate::AllocDecompressorFunction   Libdeflate::allocDecompressorFunction = NULL;
+Libdeflate::FreeDecompressorFunction    Libdeflate::freeDecompressorFunction = NULL;
+Libdeflate::DecompressFunction          Libdeflate::gzipDecompressFunction = NULL;
+
+    bool
+Libdeflate::load()
+{
+    if (isLoaded()) {
+        return true;
+    }
+
+#ifdef _MSC_VER
+    HMODULE library = LoadLibraryA("libdeflate.dll");
+    if (NULL == library) {
+        return false;
+    }
+#define LOOKUP(name) GetProcAddress(library, name)
+#else   // _MSC_VER
+    void *library = dlopen("libdeflate.so.0", RTLD_NOW);
+    if (NULL == library) {
+        library = dlopen("libdeflate.so", RTLD_NOW);
+        if (NULL == library) {
+            return false;
+        }
+    }
+#define LOOKUP(name) dlsym(library, name)
+#endif  // _MSC_VER
+
+    AllocCompressorFunction allocCompressor = (AllocCompressorFunction)LOOKUP("libdeflate_alloc_compressor");
+    FreeCompressorFunction freeCompressor = (FreeCompressorFunction)LOOKUP("libdeflate_free_compressor");
+    CompressFunction deflateCompress = (CompressFunction)LOOKUP("libdeflate_deflate_compress");
+    CompressFunction gzipCompress = (CompressFunction)LOOKUP("libdeflate_gzip_compress");
+    AllocDecompressorFunction allocDecompressor = (AllocDecompressorFunction)LOOKUP("libdeflate_alloc_decompressor");
+    FreeDecompressorFunction freeDecompressor = (FreeDecompressorFunction)LOOKUP("libdeflate_free_decompressor");
+    DecompressFunction gzipDecompress = (DecompressFunction)LOOKUP("libdeflate_gzip_decompress");
+#undef LOOKUP
+
+    if (NULL == allocCompressor || NULL == freeCompressor || NULL == deflateCompress || NULL == gzipCompress ||
+        NULL == allocDecompressor || NULL == freeDecompressor || NULL == gzipDecompress) {
+        return false;
+    }
+
+    allocCompressorFunction = allocCompressor;
+    freeCompressorFunction = freeCompressor;
+    deflateCompressFunction = deflateCompress;
+    gzipCompressFunction = gzipCompress;
+    allocDecompressorFunction = allocDecompressor;
+    freeDecompressorFunction = freeDecompressor;
+    gzipDecompressFunction = gzipDecompress;    // Last, since it's what isLoaded() checks
+    return true;
+}
+
+    Libdeflate::Compressor *
+Libdeflate::allocCompressor(int level)
+{
+    _ASSERT(isLoaded());
+    return (*allocCompressorFunction)(level);
+}
+
+    void
+Libdeflate::freeCompressor(Compressor *compressor)
+{
+    if (NULL != compressor) {
+        (*freeCompressorFunction)(compressor);
+    }
+}
+
+    Libdeflate::Decompressor *
+Libdeflate::allocDecompressor()
+{
+    _ASSERT(isLoaded());
+    return (*allocDecompressorFunction)();
+}
+
+    void
+Libdeflate::freeDecompressor(Decompressor *decompressor)
+{
+    if (NULL != decompressor) {
+        (*freeDecompressorFunction)(decompressor);
+    }
+}
+
+    size_t
+Libdeflate::compress(
+    Compressor     *compressor,
+    bool            bamFormat,
+    const char     *input,
+    size_t          inputBytes,
+    char           *output,
+    size_t          outputBytes)
+{
+    if (!bamFormat) {
+        return (*gzipCompressFunction)(compressor, input, inputBytes, output, outputBytes);
+    }
+
+    //
+    // A BGZF block is a gzip member with a 6 byte extra field holding the block size, the same header that the zlib
+    // path has deflateSetHeader write.
+    //
+    static const size_t headerSize = 18;
+    static const size_t trailerSize = 8;
+    if (outputBytes < headerSize + trailerSize) {
+        return 0;
+    }
+
+    size_t compressedBytes = (*deflateCompressFunction)(compressor, input, inputBytes, output + headerSize, outputBytes - headerSize - trailerSize);
+    if (0 == compressedBytes) {
+        return 0;
+    }
+
+    size_t totalBytes = headerSize + compressedBytes + trailerSize;
+    if (totalBytes > 0x10000) {
+        return 0;   // BSIZE won't fit
+    }
+
+    static const _uint8 header[16] = {0x1f, 0x8b, 0x08, 0x04, 0, 0, 0, 0, 0, 0, 0x06, 0x00, 'B', 'C', 0x02, 0x00};
+    memcpy(output, header, sizeof(header));
+    *(_uint16 *)(output + 16) = (_uint16)(totalBytes - 1);
+
+    char *trailer = output + headerSize + compressedBytes;
+    *(_uint32 *)trailer = (_uint32)crc32(crc32(0, NULL, 0), (const Bytef *)input, (uInt)inputBytes);
+    *(_uint32 *)(trailer + 4) = (_uint32)inputBytes;
+
+    return totalBytes;
+}
+
+    bool
+Libdeflate::decompress(
+    Decompressor   *decompressor,
+    const char     *input,
+    size_t          inputBytes,
+    char           *output,
+    size_t          outputBytes,
+    size_t         *o_outputUsed)
+{
+    return 0 == (*gzipDecompressFunction)(decompressor, input, inputBytes, output, outputBytes, o_outputUsed);    // 0 is LIBDEFLATE_SUCCESS
+}
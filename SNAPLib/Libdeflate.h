@@ -0,0 +1,76 @@
+/*++
+
+Module Name:
+
+    Libdeflate.h
+
+Abstract:
+
+    Optional use of libdeflate in place of zlib for whole gzip blocks.
+
+Environment:
+
+    User mode service.
+
+    Compressors and decompressors are NOT thread safe; each thread needs its own.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+
+//
+// libdeflate compresses and decompresses a whole buffer in one call, and is a good deal faster than zlib at it.  That fits
+// BGZF (BAM, and bgzipped FASTQ or SAM) where every block is at most 64KB and its sizes are known up front, and the
+// gzip writer, which compresses independent chunks.  Streaming gzip input still has to go through zlib.
+//
+// The library is loaded at run time rather than linked, so SNAP builds and runs without it.  Until load() succeeds
+// everything uses zlib.
+//
+class Libdeflate
+{
+public:
+    //
+    // Try to load the shared library.  Returns false if it can't be found, in which case zlib stays in use.
+    //
+    static bool load();
+
+    static bool isLoaded() {return NULL != gzipDecompressFunction;}
+
+    struct Compressor;
+    struct Decompressor;
+
+    static Compressor *allocCompressor(int level);
+    static void freeCompressor(Compressor *compressor);
+
+    static Decompressor *allocDecompressor();
+    static void freeDecompressor(Decompressor *decompressor);
+
+    //
+    // Compress into a single gzip member, or for bamFormat a BGZF block (gzip with the BC extra field set to its size).
+    // Returns the compressed size, or 0 if it didn't fit in outputBytes.
+    //
+    static size_t compress(Compressor *compressor, bool bamFormat, const char *input, size_t inputBytes, char *output, size_t outputBytes);
+
+    //
+    // Decompress exactly one gzip member (such as a BGZF block).  Returns false on bad data or if it doesn't fit.
+    //
+    static bool decompress(Decompressor *decompressor, const char *input, size_t inputBytes, char *output, size_t outputBytes, size_t *o_outputUsed);
+
+private:
+    typedef Compressor *(*AllocCompressorFunction)(int);
+    typedef void (*FreeCompressorFunction)(Compressor *);
+    typedef size_t (*CompressFunction)(Compressor *, const void *, size_t, void *, size_t);
+    typedef Decompressor *(*AllocDecompressorFunction)();
+    typedef void (*FreeDecompressorFunction)(Decompressor *);
+    typedef int (*DecompressFunction)(Decompressor *, const void *, size_t, void *, size_t, size_t *);
+
+    static AllocCompressorFunction      allocCompressorFunction;
+    static FreeCompressorFunction       freeCompressorFunction;
+    static CompressFunction             deflateCompressFunction;    // raw deflate, for BGZF where we write our own header
+    static CompressFunction             gzipCompressFunction;
+    static AllocDecompressorFunction    allocDecompressorFunction;
+    static FreeDecompressorFunction     freeDecompressorFunction;
+    static DecompressFunction           gzipDecompressFunction;
+};
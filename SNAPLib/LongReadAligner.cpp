@@ -0,0 +1,395 @@
+/*++
+
+Module Name:
+
+    LongReadAligner.cpp
+
+Abstract:
+
+    The aligner for long, noisy reads: sampled seeds, chained anchors and banded gap filling.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "LongReadAligner.h"
+#include "AlignerOptions.h"
+#include "PerfCounters.h"
+#include "Seed.h"
+#include "Tables.h"
+#include <algorithm>
+#include <math.h>
+
+static const unsigned LookupBatchSize = 32;
+static const int MaxEditPercent = 30;       // Chains that fill in with more edits than this are taken to be wrong
+
+LongReadAligner::LongReadAligner(GenomeIndex *i_genomeIndex, unsigned i_maxHitsToConsider) :
+    genomeIndex(i_genomeIndex), genome(i_genomeIndex->getGenome()), seedLen(i_genomeIndex->getSeedLength()),
+    maxHitsToConsider(i_maxHitsToConsider), decodedHits(i_maxHitsToConsider), rcReadData(NULL), rcReadDataSize(0),
+    referenceBuffer(NULL), referenceBufferSize(0), reversedReadBuffer(NULL), reversedReadBufferSize(0),
+    reversedReferenceBuffer(NULL), reversedReferenceBufferSize(0)
+{
+}
+
+LongReadAligner::~LongReadAligner()
+{
+    delete [] rcReadData;
+    delete [] referenceBuffer;
+    delete [] reversedReadBuffer;
+    delete [] reversedReferenceBuffer;
+}
+
+    void
+LongReadAligner::reserveBuffer(char **buffer, unsigned *size, unsigned needed)
+{
+    if (needed > *size) {
+        delete [] *buffer;
+        *size = __max(needed, 2 * *size);
+        *buffer = new char[*size];
+    }
+}
+
+    const char *
+LongReadAligner::getReference(GenomeLocation location, unsigned length)
+{
+    if (!genome->isPacked()) {
+        return genome->getSubstring(location, length);
+    }
+    reserveBuffer(&referenceBuffer, &referenceBufferSize, __max(length, 1u));
+    return genome->getSubstring(location, length, referenceBuffer, referenceBufferSize);
+}
+
+    AlignmentResult
+LongReadAligner::AlignRead(Read *read, GenomeLocation *genomeLocation, Direction *direction, int *score, int *mapq)
+{
+    *genomeLocation = InvalidGenomeLocation;
+    *direction = FORWARD;
+    *score = -1;
+    *mapq = 0;
+
+    unsigned readLen = read->getDataLength();
+    if (readLen < seedLen) {
+        return NotFound;
+    }
+
+    findAnchors(read);
+
+    int bestScore = 0;
+    int bestAnchor = -1;
+    Direction bestDirection = FORWARD;
+    for (Direction dir = 0; dir < NUM_DIRECTIONS; dir++) {
+        chain(&anchors[dir]);
+        for (int i = 0; i < anchors[dir].size(); i++) {
+            if (anchors[dir][i].chainScore > bestScore) {
+                bestScore = anchors[dir][i].chainScore;
+                bestAnchor = i;
+                bestDirection = dir;
+            }
+        }
+    }
+    if (-1 == bestAnchor) {
+        return NotFound;
+    }
+
+    //
+    // The best chain's anchors, and the part of the genome it covers.
+    //
+    unsigned nChainAnchors = 0;
+    GenomeLocation chainStart = 0;
+    for (int i = bestAnchor; i != -1; i = anchors[bestDirection][i].previous) {
+        nChainAnchors++;
+        chainStart = anchors[bestDirection][i].genomeLocation;
+    }
+    GenomeLocation chainEnd = anchors[bestDirection][bestAnchor].genomeLocation;
+    if (nChainAnchors < MinChainAnchors) {
+        return NotFound;
+    }
+
+    //
+    // The next best chain is the best that ends anywhere other than where the read could overlap the best, in
+    // either direction.  The rest of the anchors around the best chain are mostly pieces of it.
+    //
+    int secondBestScore = 0;
+    GenomeLocation nearStart = chainStart > readLen ? chainStart - readLen : 0;
+    GenomeLocation nearEnd = chainEnd + readLen;
+    for (Direction dir = 0; dir < NUM_DIRECTIONS; dir++) {
+        for (int i = 0; i < anchors[dir].size(); i++) {
+            const Anchor &anchor = anchors[dir][i];
+            if (dir == bestDirection && anchor.genomeLocation >= nearStart && anchor.genomeLocation <= nearEnd) {
+                continue;
+            }
+            secondBestScore = __max(secondBestScore, anchor.chainScore);
+        }
+    }
+
+    const char *readData = read->getData();
+    if (RC == bestDirection) {
+        reserveBuffer(&rcReadData, &rcReadDataSize, readLen);
+        for (unsigned i = 0; i < readLen; i++) {
+            rcReadData[i] = COMPLEMENT[(unsigned char)readData[readLen - 1 - i]];
+        }
+        readData = rcReadData;
+    }
+
+    GenomeLocation location;
+    int editDistance = fillInChain(readData, readLen, &anchors[bestDirection], bestAnchor, &location);
+    if (editDistance * 100 > MaxEditPercent * (int)readLen) {
+        return NotFound;
+    }
+
+    //
+    // minimap2's MAPQ: 40 * (1 - second best/best) * min(1, anchors/10) * ln(best), capped at 60.
+    //
+    double mapqEstimate = 40.0 * (1.0 - (double)secondBestScore / bestScore) * __min(1.0, nChainAnchors / 10.0) * log((double)bestScore);
+    *mapq = (int)__max(0.0, __min(60.0, mapqEstimate));
+    *genomeLocation = location;
+    *direction = bestDirection;
+    *score = editDistance;
+
+    return *mapq >= MAPQ_LIMIT_FOR_SINGLE_HIT ? SingleHit : MultipleHits;
+}
+
+    void
+LongReadAligner::findAnchors(Read *read)
+{
+    PerfTimer timer(PerfCounters::SeedLookup);
+
+    anchors[FORWARD].clear();
+    anchors[RC].clear();
+
+    const char *readData = read->getData();
+    unsigned readLen = read->getDataLength();
+
+    //
+    // Sample the seeds often enough that a long enough stretch between errors gets one.  With a minimizer index only
+    // the minimizers hit anything, and there's no telling which those are without looking, so try them all.
+    //
+    unsigned spacing = genomeIndex->getMinimizerWindow() > 1 ? 1 : __max(1u, seedLen / 4);
+
+    Seed seeds[LookupBatchSize];
+    unsigned offsets[LookupBatchSize];
+    unsigned nHits[LookupBatchSize];
+    const GenomeLocation *hits[LookupBatchSize];
+    unsigned nRCHits[LookupBatchSize];
+    const GenomeLocation *rcHits[LookupBatchSize];
+    unsigned nSeeds = 0;
+
+    for (unsigned offset = 0; offset + seedLen <= readLen; offset += spacing) {
+        if (Seed::DoesTextRepresentASeed(readData + offset, seedLen)) {
+            seeds[nSeeds] = Seed(readData + offset, seedLen);
+            offsets[nSeeds] = offset;
+            nSeeds++;
+        }
+        if (nSeeds < LookupBatchSize && offset + spacing + seedLen <= readLen) {
+            continue;
+        }
+
+        genomeIndex->lookupSeeds(seeds, nSeeds, 0, InvalidGenomeLocation, nHits, hits, nRCHits, rcHits, &decodedHits);
+        for (unsigned i = 0; i < nSeeds; i++) {
+            //
+            // The RC seed is at readLen - seedLen - offset in the RC read (see BaseAligner::AlignRead).
+            //
+            for (Direction dir = 0; dir < NUM_DIRECTIONS; dir++) {
+                unsigned n = FORWARD == dir ? nHits[i] : nRCHits[i];
+                if (n > maxHitsToConsider) {
+                    continue;   // Too popular to be worth chaining
+                }
+                const GenomeLocation *dirHits = FORWARD == dir ? hits[i] : rcHits[i];
+                Anchor anchor;
+                anchor.readOffset = FORWARD == dir ? offsets[i] : readLen - seedLen - offsets[i];
+                anchor.contigIndex = -1;
+                anchor.chainScore = 0;
+                anchor.previous = -1;
+                for (unsigned j = 0; j < n; j++) {
+                    anchor.genomeLocation = dirHits[j];
+                    anchors[dir].push_back(anchor);
+                }
+            }
+        }
+        nSeeds = 0;
+        decodedHits.reset();   // The hits have all been copied out
+    }
+}
+
+    int
+LongReadAligner::gapCost(int gap, int seedLen)
+{
+    //
+    // minimap2's 0.01 * seedLen * gap + log2(gap) / 2, rounded up so that even a one base indel costs something.
+    //
+    if (0 == gap) {
+        return 0;
+    }
+    int log2Gap = 0;
+    for (int i = gap; i > 1; i >>= 1) {
+        log2Gap++;
+    }
+    return (gap * seedLen + 99) / 100 + log2Gap / 2;
+}
+
+    void
+LongReadAligner::chain(AnchorVector *anchors)
+{
+    int nAnchors = anchors->size();
+    if (0 == nAnchors) {
+        return;
+    }
+
+    std::sort(anchors->begin(), anchors->end(), Anchor::compare);
+
+    //
+    // They're in genome order now, so the contigs can be filled in with one walk through the contig table.
+    //
+    const Genome::Contig *contigs = genome->getContigs();
+    int nContigs = genome->getNumContigs();
+    int contigIndex = 0;
+    for (int i = 0; i < nAnchors; i++) {
+        Anchor &anchor = (*anchors)[i];
+        while (contigIndex + 1 < nContigs && contigs[contigIndex + 1].beginningOffset <= anchor.genomeLocation) {
+            contigIndex++;
+        }
+        anchor.contigIndex = contigIndex;
+    }
+
+    for (int i = 0; i < nAnchors; i++) {
+        Anchor &anchor = (*anchors)[i];
+        anchor.chainScore = (int)seedLen;
+        anchor.previous = -1;
+
+        int stop = __max(0, i - (int)ChainLookback);
+        for (int j = i - 1; j >= stop; j--) {
+            const Anchor &before = (*anchors)[j];
+            GenomeLocation genomeDistance = anchor.genomeLocation - before.genomeLocation;
+            if (before.contigIndex != anchor.contigIndex || genomeDistance > MaxChainGap) {
+                break;  // Everything further back is even further away
+            }
+            if (0 == genomeDistance || before.readOffset >= anchor.readOffset || anchor.readOffset - before.readOffset > MaxChainGap) {
+                continue;
+            }
+
+            int readDistance = (int)(anchor.readOffset - before.readOffset);
+            int gain = __min((int)seedLen, __min(readDistance, (int)genomeDistance));
+            int score = before.chainScore + gain - gapCost(abs((int)genomeDistance - readDistance), seedLen);
+            if (score > anchor.chainScore) {
+                anchor.chainScore = score;
+                anchor.previous = j;
+            }
+        }
+    }
+}
+
+    int
+LongReadAligner::fillInChain(const char *readData, unsigned readLen, AnchorVector *anchors, int lastAnchor, GenomeLocation *genomeLocation)
+{
+    chainAnchors.clear();
+    for (int i = lastAnchor; i != -1; i = (*anchors)[i].previous) {
+        chainAnchors.push_back(i);
+    }
+
+    //
+    // Extend back to the start of the read from the first anchor.
+    //
+    const Anchor &first = (*anchors)[chainAnchors[chainAnchors.size() - 1]];
+    unsigned genomeBasesUsed;
+    int editDistance = extend(readData, first.readOffset, first.genomeLocation, true, &genomeBasesUsed);
+    *genomeLocation = first.genomeLocation - genomeBasesUsed;
+
+    //
+    // Then fill in the gaps from the end of what's been aligned to the next anchor.  Anchors on the same diagonal
+    // as that end just add to it, and ones that overlap it on a different diagonal are left out.
+    //
+    unsigned alignedRead = first.readOffset + seedLen;
+    GenomeLocation alignedGenome = first.genomeLocation + seedLen;
+    for (int k = chainAnchors.size() - 2; k >= 0; k--) {
+        const Anchor &anchor = (*anchors)[chainAnchors[k]];
+        if (anchor.readOffset <= alignedRead && anchor.genomeLocation - anchor.readOffset == alignedGenome - alignedRead) {
+            if (anchor.readOffset + seedLen > alignedRead) {
+                alignedGenome += anchor.readOffset + seedLen - alignedRead;
+                alignedRead = anchor.readOffset + seedLen;
+            }
+            continue;
+        }
+        if (anchor.readOffset < alignedRead || anchor.genomeLocation < alignedGenome) {
+            continue;
+        }
+
+        int readGap = (int)(anchor.readOffset - alignedRead);
+        int genomeGap = (int)(anchor.genomeLocation - alignedGenome);
+        int gapEdits = -1;
+        const char *reference = getReference(alignedGenome, genomeGap);
+        if (NULL != reference) {
+            int diagonal = genomeGap - readGap;
+            gapEdits = bandedAligner.computeEditDistance(reference, genomeGap, readData + alignedRead, readGap,
+                __min(0, diagonal) - BandSlack, __max(0, diagonal) + BandSlack);
+        }
+        editDistance += gapEdits >= 0 ? gapEdits : __max(readGap, genomeGap);
+
+        alignedRead = anchor.readOffset + seedLen;
+        alignedGenome = anchor.genomeLocation + seedLen;
+    }
+
+    //
+    // And extend forward from the last one to the end of the read.
+    //
+    if (alignedRead < readLen) {
+        editDistance += extend(readData + alignedRead, readLen - alignedRead, alignedGenome, false, &genomeBasesUsed);
+    }
+
+    return editDistance;
+}
+
+    int
+LongReadAligner::extend(const char *readData, unsigned length, GenomeLocation genomeLocation, bool backward, unsigned *genomeBasesUsed)
+{
+    *genomeBasesUsed = 0;
+    if (0 == length) {
+        return 0;
+    }
+
+    //
+    // Allow for the read's end to have drifted an eighth of its length off the diagonal, but don't go out of the contig.
+    //
+    int halfBand = BandSlack + (int)(length / 8);
+    unsigned textLen = length + halfBand;
+    const Genome::Contig *contig = genome->getContigAtLocation(backward ? genomeLocation - 1 : genomeLocation);
+    if (NULL == contig) {
+        return length;
+    }
+    unsigned available = (unsigned)(backward ? genomeLocation - contig->beginningOffset : contig->beginningOffset + contig->length - genomeLocation);
+    textLen = __min(textLen, available);
+
+    const char *text = 0 == textLen ? NULL : getReference(backward ? genomeLocation - textLen : genomeLocation, textLen);
+    if (NULL == text) {
+        return length;
+    }
+
+    const char *pattern = readData;
+    if (backward) {
+        reserveBuffer(&reversedReadBuffer, &reversedReadBufferSize, length);
+        reserveBuffer(&reversedReferenceBuffer, &reversedReferenceBufferSize, textLen);
+        for (unsigned i = 0; i < length; i++) {
+            reversedReadBuffer[i] = readData[length - 1 - i];
+        }
+        for (unsigned i = 0; i < textLen; i++) {
+            reversedReferenceBuffer[i] = text[textLen - 1 - i];
+        }
+        pattern = reversedReadBuffer;
+        text = reversedReferenceBuffer;
+    }
+
+    int textUsed;
+    int editDistance = bandedAligner.computeEditDistance(text, textLen, pattern, length, -halfBand, halfBand, &textUsed);
+    if (editDistance < 0) {
+        //
+        // Too long, or it ran into the end of the contig.  Call it all edits, straight down the diagonal.
+        //
+        *genomeBasesUsed = __min(length, textLen);
+        return length;
+    }
+
+    *genomeBasesUsed = textUsed;
+    return editDistance;
+}
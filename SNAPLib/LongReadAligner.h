@@ -0,0 +1,112 @@
+/*++
+
+Module Name:
+
+    LongReadAligner.h
+
+Abstract:
+
+    The aligner for long (thousands to hundreds of thousands of bases), noisy reads like those from nanopore and
+    PacBio sequencers.
+
+Environment:
+
+    User mode service.
+
+    Not thread safe; each aligner thread needs its own.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "GenomeIndex.h"
+#include "Read.h"
+#include "BandedAligner.h"
+#include "VariableSizeVector.h"
+
+//
+// BaseAligner assumes a read has few enough edits that most of its seeds hit the right place and LV can score it with
+// at most MAX_K of them; neither holds for long reads, which can have ten percent errors.  This aligner instead looks
+// up seeds sampled all along the read (in the same index), keeps their hits as anchors, and chains colinear anchors:
+// each anchor's chain score is the best over the anchors a little before it in both the read and the genome of their
+// score plus the bases it adds, less a penalty growing with the difference in the distances (the indels it takes to
+// get from one to the other).  The best chain says where the read goes, and its score against the next best chain
+// somewhere else gives the MAPQ, as in minimap2.
+//
+// The edit distance comes from filling in the chain: the stretches between consecutive anchors are aligned with a
+// BandedAligner around the diagonals the anchors fix, and the ends of the read are extended out from the first and
+// last anchors.  The writers make the CIGAR the same way they do for short reads, with LV in tiles.
+//
+class LongReadAligner {
+public:
+    LongReadAligner(GenomeIndex *i_genomeIndex, unsigned i_maxHitsToConsider);
+    ~LongReadAligner();
+
+    AlignmentResult AlignRead(Read *read, GenomeLocation *genomeLocation, Direction *direction, int *score, int *mapq);
+
+    //
+    // Reads at least this long go to this aligner rather than BaseAligner unless -lr says otherwise.  They need a build
+    // with LONG_READS defined (see Read.h), since MAX_READ_LENGTH is 500 otherwise.
+    //
+    static const unsigned DefaultMinReadLength = 1000;
+
+    static const unsigned MaxChainGap = 5000;       // The furthest apart in the read or the genome that two anchors in a chain can be
+    static const unsigned ChainLookback = 64;       // How many of the anchors before one in the genome its chain can come from
+    static const unsigned MinChainAnchors = 3;
+    static const int BandSlack = 32;                // Diagonals beyond the ones the anchors fix that a gap's alignment can use
+
+private:
+    struct Anchor {
+        unsigned        readOffset;     // In the read in the anchor's direction
+        GenomeLocation  genomeLocation;
+        int             contigIndex;
+        int             chainScore;
+        int             previous;       // The anchor before this one in its best chain, or -1
+
+        static bool compare(const Anchor &a, const Anchor &b) {
+            return a.genomeLocation < b.genomeLocation || (a.genomeLocation == b.genomeLocation && a.readOffset < b.readOffset);
+        }
+    };
+
+    typedef VariableSizeVector<Anchor> AnchorVector;
+
+    void findAnchors(Read *read);
+    void chain(AnchorVector *anchors);
+    static int gapCost(int gap, int seedLen);
+
+    //
+    // The edit distance of the read in this direction between the chain's anchors, plus the extensions at its ends,
+    // and the genome location at which the alignment of the whole read starts.
+    //
+    int fillInChain(const char *readData, unsigned readLen, AnchorVector *anchors, int lastAnchor, GenomeLocation *genomeLocation);
+
+    //
+    // Aligns all length bases of readData with the genome starting at (or, backward, ending just before) genomeLocation,
+    // returning the edit distance and the number of genome bases used.
+    //
+    int extend(const char *readData, unsigned length, GenomeLocation genomeLocation, bool backward, unsigned *genomeBasesUsed);
+
+    const char *getReference(GenomeLocation location, unsigned length);
+    void reserveBuffer(char **buffer, unsigned *size, unsigned needed);
+
+    GenomeIndex        *genomeIndex;
+    const Genome       *genome;
+    unsigned            seedLen;
+    unsigned            maxHitsToConsider;
+    DecodedHitBuffer    decodedHits;
+    BandedAligner       bandedAligner;
+
+    AnchorVector        anchors[NUM_DIRECTIONS];
+
+    char               *rcReadData;
+    unsigned            rcReadDataSize;
+    char               *referenceBuffer;        // For packed genomes
+    unsigned            referenceBufferSize;
+    char               *reversedReadBuffer;     // For extending backward
+    unsigned            reversedReadBufferSize;
+    char               *reversedReferenceBuffer;
+    unsigned            reversedReferenceBufferSize;
+
+    VariableSizeVector<int> chainAnchors;       // The best chain's anchors, last first
+};
@@ -0,0 +1,124 @@
+/*++
+
+Module Name:
+
+    LoserTree.h
+
+Abstract:
+
+    A tournament tree of losers, for merging many sorted runs.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+
+//
+// Picks the smallest of the current keys of nSources sources.  The keys are all in one array, and each internal node
+// of the tree holds the source that lost the match there, so replacing the winner's key is one comparison per level on
+// the way back up, against the losers it would have met, with no looking at the other side of each match.  That makes
+// it better than a heap for a k-way merge, which does two comparisons per level and moves entries around.
+//
+// Keys have to be distinct for the merge to be stable, so callers fold the source into the low bits of the key (a
+// location and the run it came from, say).  A source that's done gets Exhausted, which loses to everything.
+//
+class LoserTree
+{
+public:
+    static const _uint64 Exhausted = 0xffffffffffffffffULL;
+
+    LoserTree(int i_nSources) : nSources(i_nSources)
+    {
+        _ASSERT(nSources > 0);
+        keys = new _uint64[nSources];
+        losers = new int[nSources];
+        for (int i = 0; i < nSources; i++) {
+            keys[i] = Exhausted;
+            losers[i] = i;
+        }
+    }
+
+    ~LoserTree()
+    {
+        delete [] keys;
+        delete [] losers;
+    }
+
+    //
+    // Set each source's first key, and then build() before anything else.
+    //
+    void set(int source, _uint64 key)
+    {
+        keys[source] = key;
+    }
+
+    void build()
+    {
+        //
+        // Source i is leaf nSources + i, and node j's children are 2j and 2j + 1, so playing the matches from the
+        // bottom up leaves each node's winner in winners[j].  losers[0] is the overall winner.
+        //
+        int* winners = new int[2 * nSources];
+        for (int i = 0; i < nSources; i++) {
+            winners[nSources + i] = i;
+        }
+        for (int j = nSources - 1; j > 0; j--) {
+            int left = winners[2 * j], right = winners[2 * j + 1];
+            if (keys[right] < keys[left]) {
+                winners[j] = right;
+                losers[j] = left;
+            } else {
+                winners[j] = left;
+                losers[j] = right;
+            }
+        }
+        losers[0] = winners[1];
+        delete [] winners;
+    }
+
+    int winner() const
+    { return losers[0]; }
+
+    _uint64 winnerKey() const
+    { return keys[losers[0]]; }
+
+    //
+    // The smallest key of all but the winner's, which is the best of the ones it beat on its way up.  Merging can take
+    // records from the winner without going back to the tree until it gets past this.
+    //
+    _uint64 runnerUpKey() const
+    {
+        _uint64 best = Exhausted;
+        for (int j = (nSources + losers[0]) / 2; j > 0; j /= 2) {
+            best = __min(best, keys[losers[j]]);
+        }
+        return best;
+    }
+
+    //
+    // Give the winner its next key (or Exhausted), and find the new winner.
+    //
+    void replaceWinner(_uint64 key)
+    {
+        int winner = losers[0];
+        keys[winner] = key;
+        for (int j = (nSources + winner) / 2; j > 0; j /= 2) {
+            if (keys[losers[j]] < keys[winner]) {
+                int t = losers[j];
+                losers[j] = winner;
+                winner = t;
+            }
+        }
+        losers[0] = winner;
+    }
+
+private:
+    int         nSources;
+    _uint64*    keys;       // the current key of each source
+    int*        losers;     // of the match at each internal node, and the overall winner in [0]
+};
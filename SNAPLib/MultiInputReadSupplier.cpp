@@ -59,6 +59,7 @@ MultiInputReadSupplier::getNextRead()
         }
         _ASSERT(nextReadSupplier < nRemainingReadSuppliers);
 
+        nextReadSupplier = findReadySupplier(nextReadSupplier);
         ActiveRead* active = &activeReadSuppliers[nextReadSupplier];
         DataBatch last = active->lastBatch;
         Read *read;
@@ -95,6 +96,26 @@ MultiInputReadSupplier::getNextRead()
     }
 }
 
+    int
+MultiInputReadSupplier::findReadySupplier(
+    int start)
+{
+    //
+    // Each input has its own reader threads filling its own buffers, so they all read in parallel.  Rather than
+    // wait on an input whose reader has fallen behind (a gzipped file, or one on a slower disk) take from the next
+    // one that has reads ready.  If none of them do, wait on the one we'd have used anyway.
+    //
+    for (int i = 0; i < nRemainingReadSuppliers; i++) {
+        int candidate = (start + i) % nRemainingReadSuppliers;
+        ActiveRead *active = &activeReadSuppliers[candidate];
+        if (NULL != active->firstReadInNextBatch || readSuppliers[active->index]->isReadReady()) {
+            return candidate;
+        }
+    }
+
+    return start;
+}
+
     void
 MultiInputReadSupplier::releaseBatch(
     DataBatch batch)
@@ -137,9 +158,23 @@ MultiInputPairedReadSupplier::getNextReadPair(Read **read0, Read **read1)
 
     _ASSERT(nextReadSupplier < nRemainingReadSuppliers);
 
+    nextReadSupplier = findReadySupplier(nextReadSupplier);
     ActiveRead* active = &activeReadSuppliers[nextReadSupplier];
-    bool hasReads = pairedReadSuppliers[active->index]->getNextReadPair(read0, read1);
-    bool nextBatch = hasReads && ((*read0)->getBatch() != active->lastBatch[0] || (*read1)->getBatch() != active->lastBatch[1]);
+    bool hasReads;
+    bool nextBatch;
+    if (active->firstReadInNextBatch[0] != NULL) {
+        //
+        // We came back to a supplier that stopped at the start of a new batch.
+        //
+        *read0 = active->firstReadInNextBatch[0];
+        *read1 = active->firstReadInNextBatch[1];
+        active->firstReadInNextBatch[0] = active->firstReadInNextBatch[1] = NULL;
+        hasReads = true;
+        nextBatch = false;
+    } else {
+        hasReads = pairedReadSuppliers[active->index]->getNextReadPair(read0, read1);
+        nextBatch = hasReads && ((*read0)->getBatch() != active->lastBatch[0] || (*read1)->getBatch() != active->lastBatch[1]);
+    }
     if (nextBatch) {
         active->firstReadInNextBatch[0] = *read0;
         active->firstReadInNextBatch[1] = *read1;
@@ -151,6 +186,7 @@ MultiInputPairedReadSupplier::getNextReadPair(Read **read0, Read **read1)
                 nextReadSupplier = (nextReadSupplier + 1) % nRemainingReadSuppliers;
                 nextBatch = false;
             }
+            nextReadSupplier = findReadySupplier(nextReadSupplier);
             active = &activeReadSuppliers[nextReadSupplier];
             if (active->firstReadInNextBatch[0] != NULL) {
                 _ASSERT(active->firstReadInNextBatch[1] != NULL);
@@ -184,6 +220,24 @@ MultiInputPairedReadSupplier::getNextReadPair(Read **read0, Read **read1)
     return true;
 }
 
+    int
+MultiInputPairedReadSupplier::findReadySupplier(
+    int start)
+{
+    //
+    // The same as for single ended reads.
+    //
+    for (int i = 0; i < nRemainingReadSuppliers; i++) {
+        int candidate = (start + i) % nRemainingReadSuppliers;
+        ActiveRead *active = &activeReadSuppliers[candidate];
+        if (NULL != active->firstReadInNextBatch[0] || pairedReadSuppliers[active->index]->isReadReady()) {
+            return candidate;
+        }
+    }
+
+    return start;
+}
+
     void
 MultiInputPairedReadSupplier::releaseBatch(
     DataBatch batch)
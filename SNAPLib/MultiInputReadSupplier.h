@@ -44,6 +44,9 @@ private:
         Read*       firstReadInNextBatch;
     };
 
+    // the first of the remaining suppliers from start on that won't make us wait, or start if they all would
+    int findReadySupplier(int start);
+
     int                 nRemainingReadSuppliers;
     int                 nReadSuppliers;
     int                 nextReadSupplier;
@@ -70,6 +73,8 @@ private:
         Read*       firstReadInNextBatch[2];
     };
 
+    int findReadySupplier(int start);
+
     int                 nRemainingReadSuppliers;
     int                 nReadSuppliers;
     int                 nextReadSupplier;
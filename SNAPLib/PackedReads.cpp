@@ -0,0 +1,457 @@
+/*++
+
+Module Name:
+
+    PackedReads.cpp
+
+Abstract:
+
+    Reader and writer for SNAP's packed binary read files, and snap pack, which makes them from FASTQ.
+
+Environment:
+
+    User mode service.
+
+    The reader and writer are NOT thread safe.  It's the caller's responsibility to ensure that at most one thread
+    uses an instance at any time.
+
+--*/
+
+#include "stdafx.h"
+#include "PackedReads.h"
+#include "Compat.h"
+#include "Tables.h"
+#include "FASTQ.h"
+#include "ReadSupplierQueue.h"
+#include "RangeSplitter.h"
+#include "Util.h"
+#include "exit.h"
+
+const char PackedReadFileHeader::Magic[8] = {'S', 'N', 'A', 'P', 'R', 'E', 'A', 'D'};
+
+const char PackedReadWriter::DefaultQualityBins[16] = {
+    '!', '#', '%', '\'', '*', '-', '0', '3', '5', '7', ':', '<', '?', 'B', 'F', 'I'     // Phred 0, 2, 4, 6, 9, 12, 15, 18, 20, 22, 25, 27, 30, 33, 37, 40
+};
+
+PackedReadReader::PackedReadReader(
+    DataReader* i_data,
+    const ReaderContext& i_context)
+    :
+    ReadReader(i_context),
+    data(i_data),
+    fileName(NULL),
+    qualitiesBinned(false),
+    extraOffset(0)
+{
+}
+
+PackedReadReader::~PackedReadReader()
+{
+    delete data;
+    data = NULL;
+}
+
+    PackedReadReader*
+PackedReadReader::create(
+    DataSupplier* supplier,
+    const char *fileName,
+    const ReaderContext& context)
+{
+    //
+    // Unpacked, a read takes up to about three times the space it does in the file (with binned qualities).
+    //
+    DataReader* data = supplier->getDataReader(maxRecordSizeInBytes, 3.0 * DataSupplier::ExpansionFactor);
+    PackedReadReader* reader = new PackedReadReader(data, context);
+    reader->fileName = fileName;
+    if (! data->init(fileName)) {
+        fprintf(stderr, "Unable to initialize PackedReadReader for file %s\n", fileName);
+        soft_exit(1);
+    }
+    reader->reinit(0, strcmp(fileName, "-") ? DataSupplier::InputFileSize(fileName) : 0);
+    return reader;
+}
+
+    void
+PackedReadReader::readHeader(
+    const char* fileName,
+    ReaderContext& context)
+{
+    // There's no SAM header to pass on; the file's own header is checked when it's opened
+    context.header = NULL;
+    context.headerLength = context.headerBytes = 0;
+}
+
+    void
+PackedReadReader::reinit(
+    _int64 startingOffset,
+    _int64 amountOfFileToProcess)
+{
+    if (0 != startingOffset) {
+        fprintf(stderr, "PackedReadReader: packed read files can only be read from the start\n");
+        soft_exit(1);
+    }
+
+    data->reinit(startingOffset, amountOfFileToProcess);
+    extraOffset = 0;
+
+    char* buffer;
+    _int64 bytes;
+    PackedReadFileHeader header;
+    if (! data->getData(&buffer, &bytes) || bytes < (_int64) sizeof(header) ||
+            memcmp(buffer, PackedReadFileHeader::Magic, sizeof(PackedReadFileHeader::Magic))) {
+        fprintf(stderr, "%s isn't a SNAP packed read file\n", fileName);
+        soft_exit(1);
+    }
+    memcpy(&header, buffer, sizeof(header));
+    if (header.version != PackedReadFileHeader::CurrentVersion) {
+        fprintf(stderr, "%s is a version %u packed read file, but this SNAP only reads version %u\n", fileName, header.version,
+            PackedReadFileHeader::CurrentVersion);
+        soft_exit(1);
+    }
+
+    qualitiesBinned = (header.flags & PackedReadFileHeader::QualitiesBinned) != 0;
+    for (unsigned i = 0; i < 256; i++) {
+        binnedQualityPairs[i][0] = header.qualityBins[i & 0xf];
+        binnedQualityPairs[i][1] = header.qualityBins[i >> 4];
+    }
+
+    data->advance(sizeof(header));
+}
+
+    char*
+PackedReadReader::getExtra(
+    _int64 bytes)
+{
+    char* extra;
+    _int64 limit;
+    data->getExtra(&extra, &limit);
+    if (NULL == extra || limit - extraOffset < bytes) {
+        fprintf(stderr, "error: not enough space for unpacking reads - increase expansion factor, currently -xf %.1f\n", DataSupplier::ExpansionFactor);
+        soft_exit(1);
+    }
+    char* result = extra + extraOffset;
+    extraOffset += bytes;
+    return result;
+}
+
+    bool
+PackedReadReader::getNextRead(Read *readToUpdate)
+{
+    char* buffer;
+    _int64 bytes;
+    if (! data->getData(&buffer, &bytes)) {
+        data->nextBatch();
+        if (! data->getData(&buffer, &bytes)) {
+            return false;
+        }
+        extraOffset = 0;
+    }
+
+    PackedReadRecord record;
+    if (bytes < (_int64) sizeof(record)) {
+        fprintf(stderr, "Truncated packed read file %s at offset %lld\n", fileName, data->getFileOffset());
+        soft_exit(1);
+    }
+    memcpy(&record, buffer, sizeof(record));
+    if (record.readLength > MAX_READ_LENGTH || record.nExceptions > record.readLength ||
+            record.recordSize != PackedReadRecord::size(record.idLength, record.readLength, record.nExceptions, qualitiesBinned)) {
+        fprintf(stderr, "Corrupt packed read file %s at offset %lld\n", fileName, data->getFileOffset());
+        soft_exit(1);
+    }
+    if (bytes < (_int64) record.recordSize) {
+        fprintf(stderr, "Truncated packed read file %s at offset %lld\n", fileName, data->getFileOffset());
+        soft_exit(1);
+    }
+
+    const char *id = buffer + sizeof(record);
+    const _uint8 *packedBases = (const _uint8 *)(id + record.idLength);
+    const char *exceptionOffsets = (const char *)(packedBases + (record.readLength + 3) / 4);
+    const char *exceptionBases = exceptionOffsets + record.nExceptions * sizeof(_uint32);
+    const _uint8 *packedQualities = (const _uint8 *)(exceptionBases + record.nExceptions);
+
+    unsigned readLength = record.readLength;
+    char *bases = getExtra(readLength);
+    char *qualities = getExtra(readLength);
+
+    unsigned nFullBytes = readLength / 4;
+    for (unsigned i = 0; i < nFullBytes; i++) {
+        memcpy(bases + 4 * i, UNPACKED_GENOME_BYTES + 4 * packedBases[i], 4);
+    }
+    for (unsigned i = 4 * nFullBytes; i < readLength; i++) {
+        bases[i] = UNPACKED_GENOME_BYTES[4 * packedBases[nFullBytes] + i % 4];
+    }
+
+    for (unsigned i = 0; i < record.nExceptions; i++) {
+        _uint32 offset;
+        memcpy(&offset, exceptionOffsets + i * sizeof(offset), sizeof(offset));
+        if (offset >= readLength) {
+            fprintf(stderr, "Corrupt packed read file %s at offset %lld\n", fileName, data->getFileOffset());
+            soft_exit(1);
+        }
+        bases[offset] = exceptionBases[i];
+    }
+
+    if (qualitiesBinned) {
+        for (unsigned i = 0; i < readLength / 2; i++) {
+            memcpy(qualities + 2 * i, binnedQualityPairs[packedQualities[i]], 2);
+        }
+        if (readLength % 2) {
+            qualities[readLength - 1] = binnedQualityPairs[packedQualities[readLength / 2]][0];
+        }
+    } else {
+        memcpy(qualities, packedQualities, readLength);
+    }
+
+    readToUpdate->init(id, record.idLength, bases, qualities, readLength);
+    readToUpdate->clip(context.clipping);
+    readToUpdate->setBatch(data->getBatch());
+    readToUpdate->setReadGroup(context.defaultReadGroup);
+
+    data->advance(record.recordSize);
+    return true;
+}
+
+    ReadSupplierGenerator *
+PackedReadReader::createReadSupplierGenerator(
+    const char *fileName,
+    const ReaderContext& context,
+    bool gzip)
+{
+    ReadReader *reader = PackedReadReader::create(DataSupplier::ForFile(fileName, gzip, false), fileName, context);
+    ReadSupplierQueue *queue = new ReadSupplierQueue(reader);
+    queue->startReaders();
+    return RestrictToRange(queue, context);
+}
+
+    PairedReadSupplierGenerator *
+PackedReadReader::createPairedReadSupplierGenerator(
+    const char *fileName0,
+    const char *fileName1,
+    const ReaderContext& context,
+    bool gzip)
+{
+    ReadReader *reader0 = PackedReadReader::create(DataSupplier::ForFile(fileName0, gzip, false), fileName0, context);
+    ReadReader *reader1 = PackedReadReader::create(DataSupplier::ForFile(fileName1, gzip, false), fileName1, context);
+    ReadSupplierQueue *queue = new ReadSupplierQueue(reader0, reader1);
+    queue->startReaders();
+    return RestrictPairsToRange(queue, context);
+}
+
+//
+// PackedReadWriter
+//
+
+PackedReadWriter::PackedReadWriter(
+    FILE *i_outputFile,
+    bool i_binQualities)
+    :
+    outputFile(i_outputFile),
+    binQualities(i_binQualities)
+{
+    bufferSize = 20 * 1024 * 1024;
+    buffer = new char[bufferSize];
+
+    //
+    // Each quality goes to the nearest bin, ties going to the lower one, except that only '#' goes to '#' so that
+    // clipping (which looks for it) clips just what it would have.
+    //
+    for (int q = 0; q < 256; q++) {
+        int best = 0;
+        for (int bin = 1; bin < 16; bin++) {
+            if ((DefaultQualityBins[bin] == '#') == (q == '#') && abs(q - DefaultQualityBins[bin]) < abs(q - DefaultQualityBins[best])) {
+                best = bin;
+            }
+        }
+        qualityBin[q] = (char)best;
+    }
+
+    PackedReadFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PackedReadFileHeader::Magic, sizeof(header.magic));
+    header.version = PackedReadFileHeader::CurrentVersion;
+    header.flags = binQualities ? PackedReadFileHeader::QualitiesBinned : 0;
+    memcpy(header.qualityBins, DefaultQualityBins, sizeof(header.qualityBins));
+    memcpy(buffer, &header, sizeof(header));
+    bufferOffset = sizeof(header);
+}
+
+PackedReadWriter::~PackedReadWriter()
+{
+    flushBuffer();
+    delete [] buffer;
+    fclose(outputFile);
+}
+
+    PackedReadWriter *
+PackedReadWriter::Factory(
+    const char *fileName,
+    bool binQualities)
+{
+    FILE *file = fopen(fileName, "wb");
+    if (NULL == file) {
+        return NULL;
+    }
+
+    return new PackedReadWriter(file, binQualities);
+}
+
+    bool
+PackedReadWriter::flushBuffer()
+{
+    if (0 == bufferOffset) {
+        return true;
+    }
+    bool worked = 1 == fwrite(buffer, bufferOffset, 1, outputFile);
+    if (! worked) {
+        fprintf(stderr, "PackedReadWriter: error writing file\n");
+    }
+
+    bufferOffset = 0;
+    return worked;
+}
+
+    bool
+PackedReadWriter::writeRead(Read *read)
+{
+    const char *bases = read->getUnclippedData();
+    const char *qualities = read->getUnclippedQuality();
+    unsigned readLength = read->getUnclippedLength();
+
+    if (read->getIdLength() > 65535) {
+        fprintf(stderr, "PackedReadWriter: read ID '%.*s...' is too long\n", 100, read->getId());
+        return false;
+    }
+
+    unsigned nExceptions = 0;
+    for (unsigned i = 0; i < readLength; i++) {
+        nExceptions += BASE_VALUE[(unsigned char)bases[i]] > 3;
+    }
+
+    size_t size = PackedReadRecord::size(read->getIdLength(), readLength, nExceptions, binQualities);
+    if (bufferSize - bufferOffset < size && ! flushBuffer()) {
+        return false;
+    }
+
+    PackedReadRecord record;
+    record.recordSize = (_uint32)size;
+    record.readLength = readLength;
+    record.nExceptions = nExceptions;
+    record.idLength = (_uint16)read->getIdLength();
+    record.reserved = 0;
+
+    char *p = buffer + bufferOffset;
+    memcpy(p, &record, sizeof(record));
+    p += sizeof(record);
+    memcpy(p, read->getId(), record.idLength);
+    p += record.idLength;
+
+    _uint8 *packedBases = (_uint8 *)p;
+    memset(packedBases, 0, (readLength + 3) / 4);
+    for (unsigned i = 0; i < readLength; i++) {
+        packedBases[i / 4] |= BASE_VALUE_NO_N[(unsigned char)bases[i]] << (2 * (i % 4));
+    }
+    p += (readLength + 3) / 4;
+
+    char *exceptionBases = p + nExceptions * sizeof(_uint32);
+    for (_uint32 i = 0; i < readLength; i++) {
+        if (BASE_VALUE[(unsigned char)bases[i]] > 3) {
+            memcpy(p, &i, sizeof(i));
+            p += sizeof(i);
+            *exceptionBases = bases[i];
+            exceptionBases++;
+        }
+    }
+    p = exceptionBases;
+
+    if (binQualities) {
+        _uint8 *packedQualities = (_uint8 *)p;
+        memset(packedQualities, 0, (readLength + 1) / 2);
+        for (unsigned i = 0; i < readLength; i++) {
+            packedQualities[i / 2] |= qualityBin[(unsigned char)qualities[i]] << (4 * (i % 2));
+        }
+        p += (readLength + 1) / 2;
+    } else {
+        memcpy(p, qualities, readLength);
+        p += readLength;
+    }
+
+    _ASSERT((size_t)(p - (buffer + bufferOffset)) == size);
+    bufferOffset += size;
+    return true;
+}
+
+    static void
+PackUsage()
+{
+    fprintf(stderr,
+            "Usage: snap pack [-b] <input> <output>\n"
+            "Converts a FASTQ file (gzipped if its name ends in .gz, or - for stdin) into a SNAP packed read file, which\n"
+            "has two bits for each base and which the aligner reads without any text parsing.  Give the output a name\n"
+            "ending in .snapreads (or gzip it, to .snapreads.gz) and use it as input to snap single or paired just like a\n"
+            "FASTQ, including as one of a pair of files.  Reads keep their order, so the two files of a pair stay matched.\n"
+            "Options:\n"
+            "  -b   bin the quality scores to sixteen levels (including all eight of Illumina's), which halves their size.\n"
+            "       Alignments of binned reads can have different MAPQs and quality-based clipping from the originals.\n");
+    soft_exit(1);
+}
+
+    void
+PackedReadWriter::runPacker(
+    int argc,
+    const char **argv)
+{
+    bool binQualities = false;
+    int n = 0;
+    if (n < argc && !strcmp(argv[n], "-b")) {
+        binQualities = true;
+        n++;
+    }
+    if (argc - n != 2) {
+        PackUsage();
+    }
+    const char *inputFileName = argv[n];
+    const char *outputFileName = argv[n + 1];
+
+    ReaderContext context;
+    context.genome = NULL;
+    context.defaultReadGroup = "";
+    context.clipping = NoClipping;
+    context.paired = false;
+    context.ignoreSecondaryAlignments = true;
+    context.header = NULL;
+    context.headerLength = 0;
+    context.headerBytes = 0;
+    context.headerMatchesIndex = false;
+    context.rangeIndex = 0;
+    context.rangeCount = 1;
+    context.trimmer = NULL;
+    context.screen = NULL;
+
+    bool isStdin = !strcmp(inputFileName, "-");
+    bool gzip = util::stringEndsWith(inputFileName, ".gz") || util::stringEndsWith(inputFileName, ".gzip");
+    FASTQReader *reader = FASTQReader::create(DataSupplier::ForFile(inputFileName, gzip, true), inputFileName, 0,
+        isStdin ? 0 : DataSupplier::InputFileSize(inputFileName), context);
+
+    PackedReadWriter *writer = PackedReadWriter::Factory(outputFileName, binQualities);
+    if (NULL == writer) {
+        fprintf(stderr, "Unable to open output file '%s'\n", outputFileName);
+        soft_exit(1);
+    }
+
+    _int64 nReads = 0;
+    Read read;
+    while (reader->getNextRead(&read)) {
+        if (! writer->writeRead(&read)) {
+            soft_exit(1);
+        }
+        nReads++;
+    }
+
+    bool worked = writer->flushBuffer();
+    delete writer;
+    delete reader;
+    if (! worked) {
+        soft_exit(1);
+    }
+    fprintf(stderr, "Packed %lld reads into %s\n", nReads, outputFileName);
+}
@@ -0,0 +1,136 @@
+/*++
+
+Module Name:
+
+    PackedReads.h
+
+Abstract:
+
+    SNAP's own binary read file format: reads with their bases two bits apiece and their qualities optionally binned
+    to four bits, which the aligner can take as input without any text parsing.  snap pack makes them from FASTQ.
+
+Environment:
+
+    User mode service.
+
+    The reader and writer are NOT thread safe.  It's the caller's responsibility to ensure that at most one thread
+    uses an instance at any time.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "Read.h"
+#include "DataReader.h"
+
+//
+// A packed read file is a PackedReadFileHeader followed by one record per read.  Each record is a PackedReadRecord
+// and then, in order:
+//      the ID (idLength bytes, not null terminated)
+//      the bases, four to a byte, first base in the low bits, using the values of BASE_VALUE (that is, the same way
+//          as a packed genome, so UNPACKED_GENOME_BYTES unpacks them)
+//      the offsets (_uint32 each) of the nExceptions bases that aren't A, C, G or T, which are packed as A
+//      those bases themselves (one byte each)
+//      the qualities, one byte each, or with QualitiesBinned two to a byte (first in the low nibble) as indices into
+//          the header's qualityBins
+// There's no way to find the start of a record from the middle of the file, so it can't be range split; it's read by
+// one thread into a ReadSupplierQueue, which is fine because there's so little work in unpacking it.  It can be
+// gzipped (as .snapreads.gz) like FASTQ.
+//
+struct PackedReadFileHeader {
+    char        magic[8];
+    _uint32     version;
+    _uint32     flags;
+    char        qualityBins[16];    // The quality (Phred+33) that each binned code stands for
+
+    static const char Magic[8];
+    static const _uint32 CurrentVersion = 1;
+    static const _uint32 QualitiesBinned = 0x1;
+};
+
+struct PackedReadRecord {
+    _uint32     recordSize;         // Including this header
+    _uint32     readLength;
+    _uint32     nExceptions;
+    _uint16     idLength;
+    _uint16     reserved;
+
+    static size_t size(unsigned idLength, unsigned readLength, unsigned nExceptions, bool qualitiesBinned) {
+        return sizeof(PackedReadRecord) + idLength + (readLength + 3) / 4 + nExceptions * (sizeof(_uint32) + 1) +
+            (qualitiesBinned ? (readLength + 1) / 2 : readLength);
+    }
+};
+
+class PackedReadReader : public ReadReader {
+public:
+
+        PackedReadReader(DataReader* i_data, const ReaderContext& i_context);
+
+        virtual ~PackedReadReader();
+
+        static PackedReadReader* create(DataSupplier* supplier, const char *fileName, const ReaderContext& i_context);
+
+        static void readHeader(const char* fileName, ReaderContext& context);
+
+        static ReadSupplierGenerator *createReadSupplierGenerator(const char *fileName, const ReaderContext& context, bool gzip);
+
+        static PairedReadSupplierGenerator *createPairedReadSupplierGenerator(const char *fileName0, const char *fileName1,
+            const ReaderContext& context, bool gzip);
+
+        virtual bool getNextRead(Read *readToUpdate);
+
+        virtual void reinit(_int64 startingOffset, _int64 amountOfFileToProcess);
+
+        void releaseBatch(DataBatch batch)
+        { data->releaseBatch(batch); }
+
+        virtual bool isReadReady()
+        { return data->isDataReady(); }
+
+private:
+
+        static const int maxRecordSizeInBytes = sizeof(PackedReadRecord) + 65535 + MAX_READ_LENGTH * 7;    // the biggest ID, and every base an exception
+
+        char* getExtra(_int64 bytes);
+
+        DataReader*         data;
+        const char*         fileName;
+        bool                qualitiesBinned;
+        char                binnedQualityPairs[256][2];     // the two qualities that each byte of binned qualities stands for
+        _int64              extraOffset;                    // how much of the current batch's extra space we've used
+};
+
+class PackedReadWriter {
+public:
+        ~PackedReadWriter();
+
+        static PackedReadWriter *Factory(const char *fileName, bool binQualities);
+
+        bool writeRead(Read *readToWrite);
+
+        //
+        // snap pack [-b] <input.fq> <output.snapreads>
+        //
+        static void runPacker(int argc, const char **argv);
+
+        //
+        // The default bins, which are the eight Illumina uses plus enough in between to make sixteen.  '#' has one to
+        // itself, so clipping works the same on binned qualities.
+        //
+        static const char DefaultQualityBins[16];
+
+private:
+
+        PackedReadWriter(FILE *i_outputFile, bool i_binQualities);
+
+        bool flushBuffer();
+
+        FILE *outputFile;
+        bool binQualities;
+        char qualityBin[256];   // the code for each quality
+
+        char *buffer;
+        size_t bufferSize;
+        size_t bufferOffset;
+};
@@ -48,6 +48,7 @@ Revision History:
 #include "Util.h"
 #include "IntersectingPairedEndAligner.h"
 #include "exit.h"
+#include "TraceRecorder.h"
 
 using namespace std;
 
@@ -55,6 +56,7 @@ using util::stringEndsWith;
 
 static const int DEFAULT_MIN_SPACING = 50;
 static const int DEFAULT_MAX_SPACING = 1000;
+static const int DEFAULT_MATCHER_MEMORY = 4;    // GB
 
 struct PairedAlignerStats : public AlignerStats
 {
@@ -232,7 +234,12 @@ PairedAlignerOptions::PairedAlignerOptions(const char* i_commandLine)
     forceSpacing(false),
     intersectingAlignerMaxHits(DEFAULT_INTERSECTING_ALIGNER_MAX_HITS),
     maxCandidatePoolSize(DEFAULT_MAX_CANDIDATE_POOL_SIZE),
-    quicklyDropUnpairedReads(true)
+    quicklyDropUnpairedReads(true),
+    matcherMemory(DEFAULT_MATCHER_MEMORY),
+    estimateSpacing(false),
+    resultCacheEntries(0),
+    splitReads(false),
+    mateRescue(false)
 {
 }
 
@@ -251,11 +258,27 @@ void PairedAlignerOptions::usageMessage()
         "       discard it.  Specifying this flag may cause large memory usage for some input files,\n"
         "       but may be necessary for some strangely formatted input files.  You'll also need to specify this\n"
         "       flag for SAM/BAM files that were aligned by a single-end aligner.\n"
+        "  -mm  Memory in GB for reads in SAM/BAM input whose mates haven't been seen yet (default: %d).  Past this\n"
+        "       they're kept in a temporary file instead, which matters for coordinate sorted input where mates can be\n"
+        "       far apart.\n"
+        "  -es  Estimate the spacing between paired ends from the first %u confidently paired reads, and narrow the\n"
+        "       range from -s to fit it.  Pairs that don't fit are aligned as though they were chimeric.  Ignored with -fs.\n"
+        "  -dupCache Remember the results of this many recent pairs per thread, and reuse them for pairs whose bases and\n"
+        "       qualities are identical rather than aligning them again.  Worth it on libraries with lots of duplicates,\n"
+        "       like amplicon panels.  Ignored with -om.  (default: 0, off)\n"
+        "  -split  Look for reads in pairs that don't align together that align as two pieces in different places, as\n"
+        "       across a structural variant's breakpoint, and write the shorter piece as a supplementary alignment\n"
+        "       (flag 0x800), with SA tags linking the two.  Ignored with -fs.\n"
+        "  -rescue  When one read of a pair that doesn't align together aligns confidently on its own, look for its mate\n"
+        "       in the windows the spacing allows on either side of it before aligning the mate on its own.  Finds mates\n"
+        "       with too many errors for their seeds to hit, and is cheaper than aligning them.  Ignored with -fs.\n"
         ,
         DEFAULT_MIN_SPACING,
         DEFAULT_MAX_SPACING,
         DEFAULT_INTERSECTING_ALIGNER_MAX_HITS,
-        DEFAULT_MAX_CANDIDATE_POOL_SIZE);
+        DEFAULT_MAX_CANDIDATE_POOL_SIZE,
+        DEFAULT_MATCHER_MEMORY,
+        InsertSizeEstimator::DefaultSamplesNeeded);
 }
 
 bool PairedAlignerOptions::parse(const char** argv, int argc, int& n, bool *done)
@@ -280,9 +303,32 @@ bool PairedAlignerOptions::parse(const char** argv, int argc, int& n, bool *done
     } else if (strcmp(argv[n], "-fs") == 0) {
         forceSpacing = true;
         return true;    
+    } else if (strcmp(argv[n], "-es") == 0) {
+        estimateSpacing = true;
+        return true;
+    } else if (strcmp(argv[n], "-dupCache") == 0) {
+        if (n + 1 < argc) {
+            resultCacheEntries = atoi(argv[n+1]);
+            n += 1;
+            return true;
+        }
+        return false;
+    } else if (strcmp(argv[n], "-split") == 0) {
+        splitReads = true;
+        return true;
+    } else if (strcmp(argv[n], "-rescue") == 0) {
+        mateRescue = true;
+        return true;
     } else if (strcmp(argv[n], "-ku") == 0) {
         quicklyDropUnpairedReads = false;
         return true;
+    } else if (strcmp(argv[n], "-mm") == 0) {
+        if (n + 1 < argc) {
+            matcherMemory = atoi(argv[n+1]);
+            n += 1;
+            return true;
+        } 
+        return false;
     } else if (strcmp(argv[n], "-mcp") == 0) {
         if (n + 1 < argc) {
             maxCandidatePoolSize = atoi(argv[n+1]);
@@ -295,7 +341,7 @@ bool PairedAlignerOptions::parse(const char** argv, int argc, int& n, bool *done
 }
 
 PairedAlignerContext::PairedAlignerContext(AlignerExtension* i_extension)
-    : AlignerContext( 0,  NULL, NULL, i_extension)
+    : AlignerContext( 0,  NULL, NULL, i_extension), spacingEstimator(NULL)
 {
 }
 
@@ -310,6 +356,15 @@ void PairedAlignerContext::initialize()
     intersectingAlignerMaxHits = options2->intersectingAlignerMaxHits;
     ignoreMismatchedIDs = options2->ignoreMismatchedIDs;
     quicklyDropUnpairedReads = options2->quicklyDropUnpairedReads;
+    //
+    // Forcing the spacing means pairs outside it aren't aligned at all rather than rescued as chimeras, so then only the
+    // range the user asked for will do.
+    //
+    estimateSpacing = options2->estimateSpacing && !forceSpacing;
+    resultCacheEntries = options2->resultCacheEntries;
+    splitReads = options2->splitReads;
+    mateRescue = options2->mateRescue;
+    PairedReadReader::MatcherMemoryLimit = (_int64)options2->matcherMemory * (1ULL << 30);
 }
 
 AlignerStats* PairedAlignerContext::newStats()
@@ -317,6 +372,14 @@ AlignerStats* PairedAlignerContext::newStats()
     return new PairedAlignerStats();
 }
 
+size_t PairedAlignerContext::getAlignerMemoryReservation()
+{
+    return IntersectingPairedEndAligner::getBigAllocatorReservation(index, intersectingAlignerMaxHits, MAX_READ_LENGTH, index->getSeedLength(),
+            numSeedsFromCommandLine, seedCoverage, maxDist, extraSearchDepth, maxCandidatePoolSize) +
+        ChimericPairedEndAligner::getBigAllocatorReservation(index, MAX_READ_LENGTH, maxHits, index->getSeedLength(), numSeedsFromCommandLine,
+            seedCoverage, maxDist, extraSearchDepth, maxCandidatePoolSize);
+}
+
 void PairedAlignerContext::runTask()
 {
     ParallelTask<PairedAlignerContext> task(this);
@@ -324,6 +387,42 @@ void PairedAlignerContext::runTask()
 }
 
 
+//
+// A thread's aligners and the memory they live in, kept for the thread's next run if it's built the same way.
+//
+struct CachedPairedAligner : public CachedAligner
+{
+    CachedPairedAligner(BigAllocator* i_allocator, IntersectingPairedEndAligner* i_intersectingAligner, ChimericPairedEndAligner* i_aligner)
+        : allocator(i_allocator), intersectingAligner(i_intersectingAligner), aligner(i_aligner) {}
+
+    virtual ~CachedPairedAligner()
+    {
+        aligner->~ChimericPairedEndAligner();
+        intersectingAligner->~IntersectingPairedEndAligner();
+        delete allocator;
+    }
+
+    BigAllocator* allocator;
+    IntersectingPairedEndAligner* intersectingAligner;
+    ChimericPairedEndAligner* aligner;
+};
+
+struct PairedAlignerKey
+{
+    GenomeIndex* index;
+    int maxHits;
+    unsigned maxDist;
+    int maxReadSize;
+    unsigned numSeeds;
+    double seedCoverage;
+    unsigned extraSearchDepth;
+    int minSpacing;
+    int maxSpacing;
+    bool forceSpacing;
+    unsigned intersectingAlignerMaxHits;
+    unsigned maxCandidatePoolSize;
+};
+
 void PairedAlignerContext::runIterationThread()
 {
     PairedReadSupplier *supplier = pairedReadSupplierGenerator->generateNewPairedReadSupplier();
@@ -357,6 +456,7 @@ void PairedAlignerContext::runIterationThread()
                 soft_exit(1);
             }
             stats->totalReads += 2;
+            stats->perf.reads += 2;
             writePair(read0, read1, &result);
         }
         delete supplier;
@@ -364,30 +464,72 @@ void PairedAlignerContext::runIterationThread()
     }
 
     int maxReadSize = MAX_READ_LENGTH;
-    size_t memoryPoolSize = IntersectingPairedEndAligner::getBigAllocatorReservation(index, intersectingAlignerMaxHits, maxReadSize, index->getSeedLength(), 
-                                                                numSeedsFromCommandLine, seedCoverage, maxDist, extraSearchDepth, maxCandidatePoolSize);
-
-    memoryPoolSize += ChimericPairedEndAligner::getBigAllocatorReservation(index, maxReadSize, maxHits, index->getSeedLength(), numSeedsFromCommandLine, seedCoverage, maxDist,
-                                                    extraSearchDepth, maxCandidatePoolSize);
-
-    BigAllocator *allocator = new BigAllocator(memoryPoolSize);
+    PairedAlignerKey key;
+    memset(&key, 0, sizeof(key));   // so the padding compares equal
+    key.index = index;
+    key.maxHits = maxHits;
+    key.maxDist = maxDist;
+    key.maxReadSize = maxReadSize;
+    key.numSeeds = numSeedsFromCommandLine;
+    key.seedCoverage = seedCoverage;
+    key.extraSearchDepth = extraSearchDepth;
+    key.minSpacing = minSpacing;
+    key.maxSpacing = maxSpacing;
+    key.forceSpacing = forceSpacing;
+    key.intersectingAlignerMaxHits = intersectingAlignerMaxHits;
+    key.maxCandidatePoolSize = maxCandidatePoolSize;
+
+    CachedPairedAligner *cached = (CachedPairedAligner *) AlignerCache::take(threadNum, &key, sizeof(key));
+    if (NULL == cached) {
+        size_t memoryPoolSize = IntersectingPairedEndAligner::getBigAllocatorReservation(index, intersectingAlignerMaxHits, maxReadSize, index->getSeedLength(), 
+                                                                    numSeedsFromCommandLine, seedCoverage, maxDist, extraSearchDepth, maxCandidatePoolSize);
+
+        memoryPoolSize += ChimericPairedEndAligner::getBigAllocatorReservation(index, maxReadSize, maxHits, index->getSeedLength(), numSeedsFromCommandLine, seedCoverage, maxDist,
+                                                        extraSearchDepth, maxCandidatePoolSize);
+
+        BigAllocator *allocator = new BigAllocator(memoryPoolSize);
     
-    IntersectingPairedEndAligner *intersectingAligner = new (allocator) IntersectingPairedEndAligner(index, maxReadSize, maxHits, maxDist, numSeedsFromCommandLine, 
-                                                                seedCoverage, minSpacing, maxSpacing, intersectingAlignerMaxHits, extraSearchDepth, 
-                                                                maxCandidatePoolSize, allocator);
-
-
-    ChimericPairedEndAligner *aligner = new (allocator) ChimericPairedEndAligner(
-        index,
-        maxReadSize,
-        maxHits,
-        maxDist,
-        numSeedsFromCommandLine,
-        seedCoverage,
-        forceSpacing,
-        extraSearchDepth,
-        intersectingAligner,
-        allocator);
+        IntersectingPairedEndAligner *intersectingAligner = new (allocator) IntersectingPairedEndAligner(index, maxReadSize, maxHits, maxDist, numSeedsFromCommandLine, 
+                                                                    seedCoverage, minSpacing, maxSpacing, intersectingAlignerMaxHits, extraSearchDepth, 
+                                                                    maxCandidatePoolSize, allocator);
+
+
+        ChimericPairedEndAligner *aligner = new (allocator) ChimericPairedEndAligner(
+            index,
+            maxReadSize,
+            maxHits,
+            maxDist,
+            numSeedsFromCommandLine,
+            seedCoverage,
+            forceSpacing,
+            extraSearchDepth,
+            intersectingAligner,
+            allocator);
+
+        cached = new CachedPairedAligner(allocator, intersectingAligner, aligner);
+    }
+    BigAllocator *allocator = cached->allocator;
+    ChimericPairedEndAligner *aligner = cached->aligner;
+    IntersectingPairedEndAligner *intersectingAligner = cached->intersectingAligner;
+
+    //
+    // A reused aligner might still have the window learned on the last run's library.
+    //
+    intersectingAligner->setSpacing(minSpacing, maxSpacing);
+    aligner->setSpacing(minSpacing, maxSpacing);
+    bool spacingNarrowed = false;
+    aligner->setSecondaryAlignmentLimits(options->maxSecondaryAlignments, options->secondaryScoreDelta);
+    aligner->setLVBudget(options->lvBudget);
+    aligner->setSplitReads(splitReads);
+    aligner->setMateRescue(mateRescue);
+
+    //
+    // The aligner's counts are cumulative, so a reused one's have to be taken from where they were when it was given back.
+    //
+    _int64 lvCallsAtStart = aligner->getLocationsScored();
+    _int64 lvCacheLookupsAtStart = aligner->getLVCacheLookups();
+    _int64 lvCacheHitsAtStart = aligner->getLVCacheHits();
+    _int64 overLVBudgetAtStart = aligner->getAlignmentsOverLVBudget();
 
     allocator->checkCanaries();
 
@@ -403,88 +545,267 @@ void PairedAlignerContext::runIterationThread()
     }
 #endif  // _MSC_VER
 
-    // Align the reads.
-    Read *read0;
-    Read *read1;
-    IdPairVector* secondary = options->outputMultipleAlignments ? new IdPairVector : NULL;
-    while (supplier->getNextReadPair(&read0,&read1)) {
-        // Check that the two IDs form a pair; they will usually be foo/1 and foo/2 for some foo.
-        if (!ignoreMismatchedIDs) {
-			Read::checkIdMatch(read0, read1);
-		}
-
-        stats->totalReads += 2;
-
-        // Skip the pair if there are too many Ns or 2s.
-        int maxDist = this->maxDist;
-        bool useful0 = read0->getDataLength() >= 50 && (int)read0->countOfNs() <= maxDist;
-        bool useful1 = read1->getDataLength() >= 50 && (int)read1->countOfNs() <= maxDist;
-        if (!useful0 && !useful1) {
-            PairedAlignmentResult result;
-            result.status[0] = NotFound;
-            result.status[1] = NotFound;
-            result.location[0] = InvalidGenomeLocation;
-            result.location[1] = InvalidGenomeLocation;
-            writePair(read0, read1, &result);
-            continue;
-        } else {
-            // Here one the reads might still be hopeless, but maybe we can align the other.
-            stats->usefulReads += (useful0 && useful1) ? 2 : 1;
+    //
+    // Align the pairs, a batch at a time so that the aligner can overlap their memory stalls.  The supplier only keeps a
+    // pair valid until it's asked for the next one, so the batch holds copies.  Pairs that get filtered out rather than
+    // aligned stay in the batch so that everything is written in the order it came in.
+    //
+    const unsigned batchSize = PairedEndAligner::pairsPerBatch;
+    ReadWithOwnMemory batch[NUM_READS_PER_PAIR][batchSize];
+    bool shouldAlign[batchSize];
+    bool isKept[batchSize];
+    bool isScreened[batchSize];     // -screen marked either read as it was read, so the pair goes to its output
+    Read *readsToAlign[NUM_READS_PER_PAIR][batchSize];
+    PairedAlignmentResult results[batchSize];
+    _int64 alignTicks[batchSize];
+    IdPairVector secondaryAlignments[batchSize];  // Reused for every batch, so they only allocate when they grow
+    IdPairVector* secondary = options->outputMultipleAlignments ? secondaryAlignments : NULL;
+    unsigned spacingSamples[batchSize];
+
+    //
+    // Copies of a recent pair reuse its result.  Only the primary result's kept, so not when writing secondary alignments.
+    //
+    PairedResultCache *resultCache = NULL;
+    if (resultCacheEntries > 0 && NULL == secondary) {
+        resultCache = new PairedResultCache(resultCacheEntries);
+    }
+    bool reused[batchSize];
+    Read *missedReads[NUM_READS_PER_PAIR][batchSize];
+    unsigned missedIndex[batchSize];
+    PairedAlignmentResult missedResults[batchSize];
+    _int64 missedAlignTicks[batchSize];
+
+    //
+    // When streaming, a batch is cut short rather than waiting for pairs that haven't arrived, and the output is flushed
+    // whenever the input runs dry (and otherwise every streamFlushMillis), so nothing sits in a buffer for long.
+    //
+    bool streaming = options->streamFlushMillis >= 0;
+    _int64 lastFlush = timeInMillis();
+
+    bool morePairs = true;
+    while (morePairs) {
+        unsigned nPairsInBatch = 0;
+        unsigned nPairsToAlign = 0;
+        Read *read0;
+        Read *read1;
+        while (nPairsInBatch < batchSize) {
+            if (streaming && nPairsInBatch > 0 && ! supplier->isReadReady()) {
+                break;
+            }
+            if (! supplier->getNextReadPair(&read0,&read1)) {
+                morePairs = false;
+                break;
+            }
+            // Check that the two IDs form a pair; they will usually be foo/1 and foo/2 for some foo.
+            if (!ignoreMismatchedIDs) {
+                Read::checkIdMatch(read0, read1);
+            }
+
+            stats->totalReads += 2;
+            stats->perf.reads += 2;
+
+            batch[0][nPairsInBatch].set(*read0);
+            batch[1][nPairsInBatch].set(*read1);
+
+            // Skip the pair if there are too many Ns or 2s, or if -keepMapq keeps the input's alignment of both ends.
+            int maxDist = this->maxDist;
+            bool useful0 = read0->getDataLength() >= 50 && (int)read0->countOfNs() <= maxDist;
+            bool useful1 = read1->getDataLength() >= 50 && (int)read1->countOfNs() <= maxDist;
+            isKept[nPairsInBatch] = options->keepsInputAlignment(read0) && options->keepsInputAlignment(read1);
+            isScreened[nPairsInBatch] = read0->isScreened() || read1->isScreened();
+            shouldAlign[nPairsInBatch] = !isKept[nPairsInBatch] && !isScreened[nPairsInBatch] && (useful0 || useful1);
+            if (shouldAlign[nPairsInBatch]) {
+                // Here one the reads might still be hopeless, but maybe we can align the other.
+                stats->usefulReads += (useful0 && useful1) ? 2 : 1;
+                readsToAlign[0][nPairsToAlign] = &batch[0][nPairsInBatch];
+                readsToAlign[1][nPairsToAlign] = &batch[1][nPairsInBatch];
+                nPairsToAlign++;
+            }
+            nPairsInBatch++;
         }
 
-        PairedAlignmentResult result;
+        if (NULL == resultCache) {
+            TraceScope trace("align");
+            aligner->alignPairs(readsToAlign[0], readsToAlign[1], nPairsToAlign, results, secondary,
+                NULL == stats->latencies ? NULL : alignTicks);
+        } else {
+            //
+            // Only the pairs that aren't copies of recent ones go to the aligner.  They're packed into the front of their
+            // own arrays, so their results have to be spread back out afterward.
+            //
+            unsigned nPairsMissed = 0;
+            for (unsigned i = 0; i < nPairsToAlign; i++) {
+                reused[i] = resultCache->lookup(readsToAlign[0][i], readsToAlign[1][i], &results[i]);
+                if (reused[i]) {
+                    results[i].nanosInAlignTogether = 0;
+                    results[i].nLVCalls = 0;
+                    alignTicks[i] = 0;
+                    stats->perf.duplicatePairsReused++;
+                } else {
+                    missedReads[0][nPairsMissed] = readsToAlign[0][i];
+                    missedReads[1][nPairsMissed] = readsToAlign[1][i];
+                    missedIndex[nPairsMissed] = i;
+                    nPairsMissed++;
+                }
+            }
 
-#if     TIME_HISTOGRAM
-        _int64 startTime = timeInNanos();
-#endif // TIME_HISTOGRAM
+            {
+                TraceScope trace("align");
+                aligner->alignPairs(missedReads[0], missedReads[1], nPairsMissed, missedResults, NULL,
+                    NULL == stats->latencies ? NULL : missedAlignTicks);
+            }
 
-        aligner->align(read0, read1, &result, secondary);
+            for (unsigned i = 0; i < nPairsMissed; i++) {
+                results[missedIndex[i]] = missedResults[i];
+                alignTicks[missedIndex[i]] = missedAlignTicks[i];
+                resultCache->insert(missedReads[0][i], missedReads[1][i], &missedResults[i]);
+            }
+        }
 
-#if     TIME_HISTOGRAM
-        _int64 runTime = timeInNanos() - startTime;
-        int timeBucket = min(30, cheezyLogBase2(runTime));
-        stats->countByTimeBucket[timeBucket]++;
-        stats->nanosByTimeBucket[timeBucket] += runTime;
-#endif // TIME_HISTOGRAM
+        if (NULL != stats->latencies && nPairsToAlign > 0) {
+            //
+            // A pair is timed as one, and goes by its first read's ID.
+            //
+            double nanosPerTick = 1e9 / PerfCounters::ticksPerSecond();
+            for (unsigned i = 0; i < nPairsToAlign; i++) {
+                stats->latencies->record(readsToAlign[0][i], (_int64) (alignTicks[i] * nanosPerTick));
+            }
+        }
 
-        if (forceSpacing && isOneLocation(result.status[0]) != isOneLocation(result.status[1])) {
-            // either both align or neither do
-            result.status[0] = result.status[1] = NotFound;
-            result.location[0] = result.location[1] = InvalidGenomeLocation;
+        //
+        // Learn the library's spacing from this batch's confident pairs, and once it's known search only that window.
+        // Pairs outside it come back as not found from the intersecting aligner, and are aligned as chimeras instead.
+        //
+        if (NULL != spacingEstimator && !spacingNarrowed) {
+            if (spacingEstimator->isEstimated()) {
+                unsigned estimatedMinSpacing, estimatedMaxSpacing;
+                spacingEstimator->getSpacing(&estimatedMinSpacing, &estimatedMaxSpacing);
+                intersectingAligner->setSpacing(estimatedMinSpacing, estimatedMaxSpacing);
+                aligner->setSpacing(estimatedMinSpacing, estimatedMaxSpacing);
+                spacingNarrowed = true;
+            } else {
+                unsigned nSpacingSamples = 0;
+                for (unsigned i = 0; i < nPairsToAlign; i++) {
+                    if ((NULL == resultCache || !reused[i]) && InsertSizeEstimator::isGoodSample(&results[i])) {
+                        spacingSamples[nSpacingSamples++] = InsertSizeEstimator::spacingOf(&results[i]);
+                    }
+                }
+                spacingEstimator->addSamples(spacingSamples, nSpacingSamples);
+            }
         }
 
-        writePair(read0, read1, &result);
+        unsigned whichAligned = 0;
+        for (unsigned i = 0; i < nPairsInBatch; i++) {
+            read0 = &batch[0][i];
+            read1 = &batch[1][i];
+
+            if (isScreened[i]) {
+                stats->readsScreened += NUM_READS_PER_PAIR;
+                if (screenedReadWriter != NULL) {
+                    PairedAlignmentResult result;
+                    memset(&result, 0, sizeof(result));
+                    result.status[0] = result.status[1] = NotFound;
+                    result.location[0] = result.location[1] = InvalidGenomeLocation;
+                    screenedReadWriter->writePair(read0, read1, &result);
+                }
+                batch[0][i].dispose();
+                batch[1][i].dispose();
+                continue;
+            }
 
-        updateStats((PairedAlignerStats*) stats, read0, read1, &result);
+            if (isKept[i]) {
+                PairedAlignmentResult result;
+                memset(&result, 0, sizeof(result));
+                for (int r = 0; r < NUM_READS_PER_PAIR; r++) {
+                    Read *read = &batch[r][i];
+                    result.status[r] = SingleHit;
+                    result.location[r] = read->getOriginalAlignedLocation();
+                    result.direction[r] = AlignerOptions::inputDirection(read);
+                    result.mapq[r] = read->getOriginalMAPQ();
+                }
+                stats->readsKeptFromInput += NUM_READS_PER_PAIR;
+                writePair(read0, read1, &result);
+                batch[0][i].dispose();
+                batch[1][i].dispose();
+                continue;
+            }
 
-        if (secondary != NULL && secondary->size() > 0) {
-            // write secondary alignments
-            _ASSERT(secondary->size() % 2 == 0);
-            if (result.status[0] != NotFound) {
-                result.status[0] = SecondaryHit;
+            if (!shouldAlign[i]) {
+                PairedAlignmentResult result;
+                result.status[0] = NotFound;
+                result.status[1] = NotFound;
+                result.location[0] = InvalidGenomeLocation;
+                result.location[1] = InvalidGenomeLocation;
+                result.isSplit[0] = result.isSplit[1] = false;
+                writePair(read0, read1, &result);
+                batch[0][i].dispose();
+                batch[1][i].dispose();
+                continue;
             }
-            if (result.status[1] != NotFound) {
-                result.status[1] = SecondaryHit;
+
+            PairedAlignmentResult &result = results[whichAligned];
+
+            if (forceSpacing && isOneLocation(result.status[0]) != isOneLocation(result.status[1])) {
+                // either both align or neither do
+                result.status[0] = result.status[1] = NotFound;
+                result.location[0] = result.location[1] = InvalidGenomeLocation;
             }
-            for (IdPairVector::iterator i = secondary->begin(); i != secondary->end(); i += 2) {
-                result.location[0] = i->id;
-                result.direction[0] = i->value;
-                result.location[1] = (i+1)->id;
-                result.direction[1] = (i+1)->value;
-                writePair(read0, read1, &result);
+
+            writePair(read0, read1, &result);
+
+            updateStats((PairedAlignerStats*) stats, read0, read1, &result);
+
+            if (secondary != NULL && secondary[whichAligned].size() > 0) {
+                // write secondary alignments
+                _ASSERT(secondary[whichAligned].size() % 2 == 0);
+                if (result.status[0] != NotFound) {
+                    result.status[0] = SecondaryHit;
+                }
+                if (result.status[1] != NotFound) {
+                    result.status[1] = SecondaryHit;
+                }
+                for (IdPairVector::iterator j = secondary[whichAligned].begin(); j != secondary[whichAligned].end(); j += 2) {
+                    result.location[0] = j->id;
+                    result.direction[0] = j->value;
+                    result.location[1] = (j+1)->id;
+                    result.direction[1] = (j+1)->value;
+                    writePair(read0, read1, &result);
+                }
+            }
+
+            batch[0][i].dispose();
+            batch[1][i].dispose();
+            whichAligned++;
+        }
+
+        if (streaming && (! supplier->isReadReady() || timeInMillis() - lastFlush >= options->streamFlushMillis)) {
+            if (readWriter != NULL) {
+                readWriter->flush();
+            }
+            if (screenedReadWriter != NULL) {
+                screenedReadWriter->flush();
             }
+            lastFlush = timeInMillis();
+        }
+
+        //
+        // If the input's decompression or the output's encoding is falling behind, take a turn at it.
+        //
+        while (WorkPool::helpIfBehind()) {
         }
     }
 
-    stats->lvCalls = aligner->getLocationsScored();
+    stats->lvCalls = aligner->getLocationsScored() - lvCallsAtStart;
+    stats->lvCacheLookups = aligner->getLVCacheLookups() - lvCacheLookupsAtStart;
+    stats->lvCacheHits = aligner->getLVCacheHits() - lvCacheHitsAtStart;
+    stats->alignmentsOverLVBudget = aligner->getAlignmentsOverLVBudget() - overLVBudgetAtStart;
 
     allocator->checkCanaries();
 
-    aligner->~ChimericPairedEndAligner();
+    delete resultCache;
     delete supplier;
 
-    intersectingAligner->~IntersectingPairedEndAligner();
-    delete allocator;
+    AlignerCache::give(threadNum, cached, &key, sizeof(key));
 }
 
 void PairedAlignerContext::writePair(Read* read0, Read* read1, PairedAlignmentResult* result)
@@ -518,7 +839,9 @@ void PairedAlignerContext::updateStats(PairedAlignerStats* stats, Read* read0, R
             stats->mapqHistogram[mapq]++;
             stats->mapqErrors[mapq] += wasError ? 1 : 0;
         }
+        stats->perf.splitReads += result->isSplit[r] ? 1 : 0;
     }
+    stats->perf.mateRescues += result->mateRescued ? 1 : 0;
 
     if (result->direction[0] == result->direction[1]) {
         stats->sameComplement++;
@@ -560,10 +883,16 @@ PairedAlignerContext::typeSpecificBeginIteration()
         }
         pairedReadSupplierGenerator = new MultiInputPairedReadSupplierGenerator(options->nInputs,generators);
     }
+
+    if (estimateSpacing) {
+        spacingEstimator = new InsertSizeEstimator(minSpacing, maxSpacing);
+    }
 }
     void 
 PairedAlignerContext::typeSpecificNextIteration()
 {
     delete pairedReadSupplierGenerator;
     pairedReadSupplierGenerator = NULL;
+    delete spacingEstimator;
+    spacingEstimator = NULL;
 }
@@ -26,6 +26,8 @@ Revision History:
 #include "stdafx.h"
 #include "AlignerContext.h"
 #include "ReadSupplierQueue.h"
+#include "InsertSizeEstimator.h"
+#include "PairedResultCache.h"
 
 struct PairedAlignerStats;
 
@@ -47,6 +49,8 @@ protected:
     
     virtual void runIterationThread();
 
+    virtual size_t getAlignerMemoryReservation();
+
     // for subclasses
 
     virtual void writePair(Read* read0, Read* read1, PairedAlignmentResult* result);
@@ -70,6 +74,11 @@ protected:
     const char         *fastqFile1;
     bool                ignoreMismatchedIDs;
     bool                quicklyDropUnpairedReads;
+    bool                estimateSpacing;
+    InsertSizeEstimator *spacingEstimator;  // NULL unless estimateSpacing
+    unsigned            resultCacheEntries;     // per thread; 0 for no PairedResultCache
+    bool                splitReads;
+    bool                mateRescue;
 
 	friend class AlignerContext2;
 };
@@ -90,4 +99,9 @@ struct PairedAlignerOptions : public AlignerOptions
     unsigned    intersectingAlignerMaxHits;
     unsigned    maxCandidatePoolSize;
     bool        quicklyDropUnpairedReads;
+    int         matcherMemory;  // GB
+    bool        estimateSpacing;
+    unsigned    resultCacheEntries;
+    bool        splitReads;
+    bool        mateRescue;
 };
@@ -25,6 +25,7 @@ Revision History:
 #include "Aligner.h"
 #include "directions.h"
 #include "LandauVishkin.h"
+#include "PerfCounters.h"
 
 const int NUM_READS_PER_PAIR = 2;    // This is just to make it clear what the array subscripts are, it doesn't ever make sense to change
 
@@ -32,7 +33,7 @@ struct PairedAlignmentResult {
     AlignmentResult status[NUM_READS_PER_PAIR]; // SingleHit or CertainHit if aligned, MultipleHit if matches DB
                                                 // but not confidently aligned, or NotFound.
 
-    unsigned location[NUM_READS_PER_PAIR];      // Genome location of each read.
+    GenomeLocation location[NUM_READS_PER_PAIR];    // Genome location of each read.
     
     Direction direction[NUM_READS_PER_PAIR];    // Did we match the reverse complement? In general the two reads should have
                                                 // opposite orientations because they're part of the same original fragment,
@@ -44,7 +45,11 @@ struct PairedAlignmentResult {
 
     int mapq[NUM_READS_PER_PAIR];               // mapping quality of each end, encoded like a Phred score (but as an integer, not ASCII Phred + 33).
 
+    bool isSplit[NUM_READS_PER_PAIR];           // Did the end align as two pieces (only ChimericPairedEndAligner with split reads on
+    SplitAlignment split[NUM_READS_PER_PAIR];   // sets it)?  If so, location, direction and mapq are its primary piece's.
+
     bool fromAlignTogether;                     // Was this alignment created by aligning both reads together, rather than from some combination of single-end aligners?
+    bool mateRescued;                           // Was one end found by looking near where the other aligned on its own?
     bool alignedAsPair;                         // Were the reads aligned as a pair, or separately?
     _int64 nanosInAlignTogether;
     unsigned nLVCalls;
@@ -65,11 +70,79 @@ public:
         PairedAlignmentResult *result,
         IdPairVector          *secondary = NULL) = 0;
 
+    //
+    // Get whatever the aligner will need first for this pair on its way to the cache, ahead of calling align on it.
+    //
+    virtual void prefetchPair(
+        Read                  *read0,
+        Read                  *read1)
+    {
+    }
+
+    //
+    // Aligns a batch of pairs, getting the same results as calling align on each of them in turn.  It prefetches for all
+    // of the pairs first, so that the misses for each pair's first lookups overlap with aligning the pairs ahead of it.
+    // secondary is either NULL or an array of nPairs vectors, and so is alignTicks, which gets how long (in PerfTicks)
+    // each pair took.
+    //
+    static const unsigned pairsPerBatch = 8;
+
+    void alignPairs(
+        Read                 **reads0,
+        Read                 **reads1,
+        unsigned               nPairs,
+        PairedAlignmentResult *results,
+        IdPairVector          *secondary = NULL,
+        _int64                *alignTicks = NULL)
+    {
+        for (unsigned i = 0; i < nPairs; i++) {
+            prefetchPair(reads0[i], reads1[i]);
+        }
+        for (unsigned i = 0; i < nPairs; i++) {
+            _int64 start = NULL == alignTicks ? 0 : PerfTicks();
+            align(reads0[i], reads1[i], &results[i], NULL == secondary ? NULL : &secondary[i]);
+            if (NULL != alignTicks) {
+                alignTicks[i] = PerfTicks() - start;
+            }
+        }
+    }
+
     virtual void setLandauVishkin(
         LandauVishkin<1>        *landauVishkin,
         LandauVishkin<-1>       *reverseLandauVishkin)
     {
     }
 
+    //
+    // With a secondary vector: the most secondary pairs to return, and how much worse than the best they can be.
+    //
+    virtual void setSecondaryAlignmentLimits(unsigned maxSecondary, unsigned scoreDelta)
+    {
+    }
+
+    //
+    // If non-zero, the most locations to score for each read of a pair.  A pair that runs out gets the best result so far
+    // with a lowered MAPQ.
+    //
+    virtual void setLVBudget(unsigned lvBudget)
+    {
+    }
+
     virtual _int64 getLocationsScored() const  = 0;
+
+    //
+    // How many alignments were cut short by the LV budget.
+    //
+    virtual _int64 getAlignmentsOverLVBudget() const
+    {
+        return 0;
+    }
+
+    //
+    // The seeds the last call to align looked up for one of the reads, if the aligner can say.
+    //
+    virtual bool getSeedLookups(unsigned whichRead, SeedLookups *lookups) const
+    {
+        return false;
+    }
 };
@@ -28,6 +28,7 @@ Revision History:
 #include "Read.h"
 #include "DataReader.h"
 #include "VariableSizeMap.h"
+#include "VariableSizeVector.h"
 #include "PairedEndAligner.h"
 #include "SAM.h"
 
@@ -53,6 +54,8 @@ public:
     void releaseBatch(DataBatch batch);
 
 private:
+
+    void freeRetiredReads(DataBatch batch);
     
     const bool autoRelease;
     ReadReader* single; // reader for single reads
@@ -72,6 +75,52 @@ private:
     HashSet overflowUsed;
 #endif
     _int64 overflowMatched;
+
+    //
+    // Overflow reads stay in memory until their mates turn up, which for coordinate sorted input can be most of the
+    // file.  Once they take more than MatcherMemoryLimit, further ones are written to a temporary file instead, and
+    // only their offsets are kept.
+    //
+    _int64 overflowBytes;
+    FILE* spillFile;
+    _int64 spillFileSize;
+    typedef VariableSizeMap<StringHash,_int64> SpillMap;
+    SpillMap spilled; // read id -> offset in spillFile
+    char* spillBuffer;
+    unsigned spillBufferSize;
+
+    struct SpilledReadHeader {
+        unsigned            idLength;
+        unsigned            unclippedLength;
+        unsigned            rnextLength;    // 0xffffffff if there's no RNEXT
+        unsigned            auxLength;
+        GenomeLocation      originalAlignedLocation;
+        unsigned            originalMAPQ;
+        unsigned            originalSAMFlags;
+        unsigned            originalFrontClipping;
+        unsigned            originalBackClipping;
+        unsigned            originalFrontHardClipping;
+        unsigned            originalBackHardClipping;
+        unsigned            originalPNEXT;
+        ReadClippingType    clippingState;
+        const char*         readGroup;  // These point at static strings or the header, so live as long as we do
+    };
+
+    void spillRead(StringHash key, const Read& read);
+    void unspillRead(_int64 offset, ReadWithOwnMemory* o_read);
+
+    static _int64 bytesOfOwnMemory(const Read& read);
+
+    //
+    // Overflow reads that have been matched and handed out.  Their memory is freed when the batch they went out
+    // with is released by the consumer, but only a release that comes after the consumer has accounted for them
+    // counts, and it's only sure to have done that once it asks for the next pair.  So the one from the most recent
+    // call waits in lastRetired until then.
+    //
+    ExclusiveLock retiredLock;
+    VariableSizeVector<ReadWithOwnMemory> retired;
+    ReadWithOwnMemory lastRetired;
+    bool haveLastRetired;
     // used only if ! autoRelease:
     bool dependents; // true if pairs from 0->1
     // manage inter-batch dependencies
@@ -101,7 +150,13 @@ PairedReadMatcher::PairedReadMatcher(
     overflowMatched(0),
     quicklyDropUnpairedReads(i_quicklyDropUnpairedReads),
     nReadsQuicklyDropped(0),
-    currentBatch(0, 0), allDroppedInCurrentBatch(false)
+    currentBatch(0, 0), allDroppedInCurrentBatch(false),
+    overflowBytes(0),
+    spillFile(NULL),
+    spillFileSize(0),
+    spillBuffer(NULL),
+    spillBufferSize(0),
+    haveLastRetired(false)
 {
     unmatched[0] = VariableSizeMap<_uint64,Read>(10000);
     unmatched[1] = VariableSizeMap<_uint64,Read>(10000);
@@ -109,6 +164,7 @@ PairedReadMatcher::PairedReadMatcher(
     if (! autoRelease) {
         InitializeExclusiveLock(&lock);
     }
+    InitializeExclusiveLock(&retiredLock);
 }
     
 PairedReadMatcher::~PairedReadMatcher()
@@ -116,9 +172,149 @@ PairedReadMatcher::~PairedReadMatcher()
     if (! autoRelease) {
         DestroyExclusiveLock(&lock);
     }
+    DestroyExclusiveLock(&retiredLock);
+    for (int i = 0; i < retired.size(); i++) {
+        retired[i].dispose();
+    }
+    if (haveLastRetired) {
+        lastRetired.dispose();
+    }
+    if (NULL != spillFile) {
+        fclose(spillFile);
+    }
+    delete [] spillBuffer;
     delete single;
 }
 
+    _int64
+PairedReadMatcher::bytesOfOwnMemory(
+    const Read& read)
+{
+    unsigned auxLength;
+    bool auxIsSAM;
+    read.getAuxiliaryData(&auxLength, &auxIsSAM);
+    return sizeof(ReadWithOwnMemory) + read.getIdLength() + 2 * read.getUnclippedLength() + read.getOriginalRNEXTLength() + auxLength + 5;
+}
+
+    void
+PairedReadMatcher::spillRead(
+    StringHash key,
+    const Read& read)
+{
+    if (NULL == spillFile) {
+        spillFile = tmpfile();
+        if (NULL == spillFile) {
+            fprintf(stderr, "PairedReadMatcher: unable to create a temporary file for unpaired reads; use -mm to allow more memory\n");
+            soft_exit(1);
+        }
+        fprintf(stderr, "PairedReadMatcher: unpaired reads passed %lld MB, keeping the rest in a temporary file\n", PairedReadReader::MatcherMemoryLimit / (1 << 20));
+    }
+
+    SpilledReadHeader header;
+    header.idLength = read.getIdLength();
+    header.unclippedLength = read.getUnclippedLength();
+    header.rnextLength = NULL == read.getOriginalRNEXT() ? 0xffffffff : read.getOriginalRNEXTLength();
+    bool auxIsSAM;
+    char* aux = read.getAuxiliaryData(&header.auxLength, &auxIsSAM);
+    if (NULL == aux) {
+        header.auxLength = 0;
+    }
+    header.originalAlignedLocation = read.getOriginalAlignedLocation();
+    header.originalMAPQ = read.getOriginalMAPQ();
+    header.originalSAMFlags = read.getOriginalSAMFlags();
+    header.originalFrontClipping = read.getOriginalFrontClipping();
+    header.originalBackClipping = read.getOriginalBackClipping();
+    header.originalFrontHardClipping = read.getOriginalFrontHardClipping();
+    header.originalBackHardClipping = read.getOriginalBackHardClipping();
+    header.originalPNEXT = read.getOriginalPNEXT();
+    header.clippingState = read.getClippingState();
+    header.readGroup = read.getReadGroup();
+
+    unsigned rnextLength = 0xffffffff == header.rnextLength ? 0 : header.rnextLength;
+    if (1 != fwrite(&header, sizeof(header), 1, spillFile) ||
+        header.idLength != fwrite(read.getId(), 1, header.idLength, spillFile) ||
+        header.unclippedLength != fwrite(read.getUnclippedData(), 1, header.unclippedLength, spillFile) ||
+        header.unclippedLength != fwrite(read.getUnclippedQuality(), 1, header.unclippedLength, spillFile) ||
+        rnextLength != fwrite(read.getOriginalRNEXT(), 1, rnextLength, spillFile) ||
+        header.auxLength != fwrite(aux, 1, header.auxLength, spillFile)) {
+        fprintf(stderr, "PairedReadMatcher: error writing unpaired reads to temporary file\n");
+        soft_exit(1);
+    }
+
+    spilled.put(key, spillFileSize);
+    spillFileSize += sizeof(header) + header.idLength + 2 * header.unclippedLength + rnextLength + header.auxLength;
+}
+
+    void
+PairedReadMatcher::unspillRead(
+    _int64 offset,
+    ReadWithOwnMemory* o_read)
+{
+    SpilledReadHeader header;
+    if (0 != _fseek64bit(spillFile, offset, SEEK_SET) || 1 != fread(&header, sizeof(header), 1, spillFile)) {
+        fprintf(stderr, "PairedReadMatcher: error reading unpaired reads from temporary file\n");
+        soft_exit(1);
+    }
+
+    unsigned rnextLength = 0xffffffff == header.rnextLength ? 0 : header.rnextLength;
+    unsigned bytes = header.idLength + 2 * header.unclippedLength + rnextLength + header.auxLength;
+    if (bytes > spillBufferSize) {
+        delete [] spillBuffer;
+        spillBufferSize = __max(bytes, 2 * spillBufferSize);
+        spillBuffer = new char[spillBufferSize];
+    }
+
+    if (bytes != fread(spillBuffer, 1, bytes, spillFile)) {
+        fprintf(stderr, "PairedReadMatcher: error reading unpaired reads from temporary file\n");
+        soft_exit(1);
+    }
+
+    //
+    // Point a read at the buffer, and then make a copy that owns its memory, the same way the reads that stay in
+    // memory are copied.
+    //
+    char* id = spillBuffer;
+    char* data = id + header.idLength;
+    char* quality = data + header.unclippedLength;
+    char* rnext = quality + header.unclippedLength;
+    char* aux = rnext + rnextLength;
+
+    Read read;
+    read.init(id, header.idLength, data, quality, header.unclippedLength,
+        header.originalAlignedLocation, header.originalMAPQ, header.originalSAMFlags,
+        header.originalFrontClipping, header.originalBackClipping, header.originalFrontHardClipping, header.originalBackHardClipping,
+        0xffffffff == header.rnextLength ? NULL : rnext, rnextLength, header.originalPNEXT);
+    read.clip(header.clippingState);
+    read.setReadGroup(header.readGroup);
+    read.setAuxiliaryData(0 == header.auxLength ? NULL : aux, header.auxLength);
+
+    o_read->set(read);
+    //
+    // Leave the file position at the end for the next spill.
+    //
+    _fseek64bit(spillFile, 0, SEEK_END);
+}
+
+    void
+PairedReadMatcher::freeRetiredReads(
+    DataBatch batch)
+{
+    AcquireExclusiveLock(&retiredLock);
+    int kept = 0;
+    for (int i = 0; i < retired.size(); i++) {
+        if (retired[i].getBatch() == batch) {
+            retired[i].dispose();
+        } else {
+            if (kept != i) {
+                retired[kept] = retired[i];
+            }
+            kept++;
+        }
+    }
+    retired.truncate(kept);
+    ReleaseExclusiveLock(&retiredLock);
+}
+
     bool
 PairedReadMatcher::getNextReadPair(
     Read *read1,
@@ -130,6 +326,16 @@ PairedReadMatcher::getNextReadPair(
     int readOneToOutputRead;    // This is used to determine which of the output reads corresponds to one (the read that just came from getNextRead())
                                 // That, in turn, is determined by the S/BAM flags in the read saying whether it was first-in-template.
 
+    if (haveLastRetired) {
+        //
+        // The consumer has taken the pair we gave out last time, so it's now covered by the consumer's releases.
+        //
+        AcquireExclusiveLock(&retiredLock);
+        retired.push_back(lastRetired);
+        ReleaseExclusiveLock(&retiredLock);
+        haveLastRetired = false;
+    }
+
     int skipped = 0;
     while (true) {
         if (skipped++ == 10000) {
@@ -141,7 +347,7 @@ PairedReadMatcher::getNextReadPair(
                 single->releaseBatch(currentBatch);
             }
             int n = unmatched[0].size() + unmatched[1].size();
-            int n2 = (int) (overflow.size() - overflowMatched);
+            int n2 = (int) (overflow.size() + spilled.size());
             if (n + n2 > 0) {
                 fprintf(stderr, " warning: PairedReadMatcher discarding %d+%d unpaired reads at eof\n", n, n2);
 #ifdef VALIDATE_MATCH
@@ -224,6 +430,12 @@ PairedReadMatcher::getNextReadPair(
                 //fprintf(stderr, "warning: PairedReadMatcher overflow %d unpaired reads from %d:%d\n", unmatched[1].size(), batch[1].fileID, batch[1].batchID); //!!
                 //char* buf = (char*) alloca(500);
                 for (ReadMap::iterator r = unmatched[1].begin(); r != unmatched[1].end(); r = unmatched[1].next(r)) {
+                    _int64 bytes = bytesOfOwnMemory(r->value);
+                    if (overflowBytes + bytes > PairedReadReader::MatcherMemoryLimit) {
+                        spillRead(r->key, r->value);
+                        continue;
+                    }
+                    overflowBytes += bytes;
                     overflow.put(r->key, ReadWithOwnMemory(r->value));
 #ifdef VALIDATE_MATCH
                     char*s2 = *strings.tryFind(r->key);
@@ -241,9 +453,9 @@ PairedReadMatcher::getNextReadPair(
                 i->value.dispose();
             }
             unmatched[1].clear();
-            unmatched[1] = unmatched[0];
-            unmatched[0].clear();
+            unmatched[1].swap(unmatched[0]);    // Reuse the emptied table rather than allocating one for each batch
             if (autoRelease) {
+                freeRetiredReads(batch[1]);
                 single->releaseBatch(batch[1]);
             }
             DataBatch overflowBatch = batch[1];
@@ -276,14 +488,31 @@ PairedReadMatcher::getNextReadPair(
             if (found == unmatched[1].end()) {
                 // try overflow
                 OverflowMap::iterator found2 = overflow.find(key);
-                if (found2 == overflow.end()) {
+                _int64* spillOffset = NULL;
+                if (found2 == overflow.end() && (0 == spilled.size() || NULL == (spillOffset = spilled.tryFind(key)))) {
                     // no match, remember it for later matching
                     unmatched[0].put(key, localRead);
                     //fprintf(stderr, "unmatched add %d:%d %lx\n", batch[0].fileID, batch[0].batchID, key); //!!
                     continue;
                 } else {
-                    // copy data into read, keep in overflow table indefinitely to preserve memory
-                    *outputReads[1-readOneToOutputRead] = * (Read*) &found2->value;
+                    //
+                    // Move the mate out of overflow (or the spill file) and hand it out; its memory is freed once the
+                    // batch it goes out with is released.
+                    //
+                    ReadWithOwnMemory mate;
+                    if (NULL != spillOffset) {
+                        unspillRead(*spillOffset, &mate);
+                        spilled.erase(key);
+                    } else {
+                        mate = found2->value;
+                        overflowBytes -= bytesOfOwnMemory(mate);
+                        overflow.erase(key);
+                    }
+                    mate.setBatch(batch[0]);
+                    lastRetired = mate;
+                    haveLastRetired = true;
+
+                    *outputReads[1-readOneToOutputRead] = * (Read*) &mate;
                     _ASSERT(outputReads[1-readOneToOutputRead]->getData()[0]);
                     overflowMatched++;
 #ifdef VALIDATE_MATCH
@@ -323,6 +552,7 @@ PairedReadMatcher::releaseBatch(
     if (autoRelease) {
         return;
     }
+    freeRetiredReads(batch);
     for (int i = 0; i < 2; i++) {
       if (batch == this->batch[i]) {
         if (! releasedBatch[i]) {
@@ -374,3 +604,5 @@ PairedReadReader::PairMatcher(
 {
     return new PairedReadMatcher(single, autoRelease, quicklyDropUnpairedReads);
 }
+
+_int64 PairedReadReader::MatcherMemoryLimit = (_int64)4 << 30;
@@ -0,0 +1,104 @@
+/*++
+
+Module Name:
+
+    PairedResultCache.cpp
+
+Abstract:
+
+    Remembers how recent read pairs aligned, so that byte-identical pairs can reuse the result.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "PairedResultCache.h"
+#include "Util.h"
+
+PairedResultCache::PairedResultCache(unsigned i_nEntries, unsigned i_maxReadLength) :
+    nEntries(__max(1, i_nEntries)), maxReadLength(i_maxReadLength)
+{
+    entries = new Entry[nEntries];
+    for (unsigned i = 0; i < nEntries; i++) {
+        entries[i].hashValue = 0;
+        entries[i].length[0] = entries[i].length[1] = 0;
+    }
+    bytes = new char[(size_t)nEntries * maxReadLength * 2 * NUM_READS_PER_PAIR];
+}
+
+PairedResultCache::~PairedResultCache()
+{
+    delete [] entries;
+    delete [] bytes;
+}
+
+    _uint64
+PairedResultCache::hashPair(Read *read0, Read *read1) const
+{
+    Read *reads[NUM_READS_PER_PAIR] = {read0, read1};
+    _uint64 hashValue = 0;
+    for (int r = 0; r < NUM_READS_PER_PAIR; r++) {
+        hashValue = util::hash64(hashValue ^ util::hash64(reads[r]->getData(), reads[r]->getDataLength()));
+        hashValue = util::hash64(hashValue ^ util::hash64(reads[r]->getQuality(), reads[r]->getDataLength()));
+    }
+    return hashValue;
+}
+
+    bool
+PairedResultCache::matches(unsigned whichEntry, Read *read0, Read *read1) const
+{
+    Read *reads[NUM_READS_PER_PAIR] = {read0, read1};
+    const char *entryBytes = bytesOf(whichEntry);
+    for (int r = 0; r < NUM_READS_PER_PAIR; r++) {
+        unsigned length = reads[r]->getDataLength();
+        if (entries[whichEntry].length[r] != length ||
+                memcmp(entryBytes + maxReadLength * 2 * r, reads[r]->getData(), length) != 0 ||
+                memcmp(entryBytes + maxReadLength * (2 * r + 1), reads[r]->getQuality(), length) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+    bool
+PairedResultCache::lookup(Read *read0, Read *read1, PairedAlignmentResult *result)
+{
+    if (!fits(read0, read1)) {
+        return false;
+    }
+
+    _uint64 hashValue = hashPair(read0, read1);
+    unsigned whichEntry = (unsigned)(hashValue % nEntries);
+    if (entries[whichEntry].hashValue != hashValue || !matches(whichEntry, read0, read1)) {
+        return false;
+    }
+
+    *result = entries[whichEntry].result;
+    return true;
+}
+
+    void
+PairedResultCache::insert(Read *read0, Read *read1, const PairedAlignmentResult *result)
+{
+    if (!fits(read0, read1)) {
+        return;
+    }
+
+    Read *reads[NUM_READS_PER_PAIR] = {read0, read1};
+    _uint64 hashValue = hashPair(read0, read1);
+    unsigned whichEntry = (unsigned)(hashValue % nEntries);
+    Entry *entry = &entries[whichEntry];
+    char *entryBytes = bytesOf(whichEntry);
+
+    entry->hashValue = hashValue;
+    for (int r = 0; r < NUM_READS_PER_PAIR; r++) {
+        unsigned length = reads[r]->getDataLength();
+        entry->length[r] = length;
+        memcpy(entryBytes + maxReadLength * 2 * r, reads[r]->getData(), length);
+        memcpy(entryBytes + maxReadLength * (2 * r + 1), reads[r]->getQuality(), length);
+    }
+    entry->result = *result;
+}
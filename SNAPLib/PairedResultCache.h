@@ -0,0 +1,80 @@
+/*++
+
+Module Name:
+
+    PairedResultCache.h
+
+Abstract:
+
+    Remembers how recent read pairs aligned, so that a byte-identical pair (which is most of an amplicon or low input
+    library) can reuse the result rather than being aligned again.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "Read.h"
+#include "PairedEndAligner.h"
+
+//
+// A direct mapped table of pairs by a hash of their bases and qualities, which are what the alignment depends on.  Each
+// entry keeps a copy of them too, so a hit is checked with a memcmp rather than trusted to the hash.  A pair that lands
+// on an occupied entry replaces it, which keeps the most recent pairs, and that's where a duplicate's copies usually are
+// once the input's sorted or has come off a sequencer.
+//
+// Each aligner thread has its own, so there's no locking.  Only the primary result is kept, so it's no use when there
+// are secondary alignments to write.  The CIGAR strings are made from the result when the pair's written, so reusing the
+// result reuses them too, and since the copies end up at exactly the same locations the duplicate marker sees them as
+// duplicates just as it would have had they been aligned.
+//
+class PairedResultCache {
+public:
+    PairedResultCache(unsigned i_nEntries, unsigned i_maxReadLength = DefaultMaxReadLength);
+
+    ~PairedResultCache();
+
+    //
+    // Fills in result and returns true if the pair's in the cache.
+    //
+    bool lookup(Read *read0, Read *read1, PairedAlignmentResult *result);
+
+    //
+    // Pairs with an end longer than maxReadLength aren't kept.
+    //
+    void insert(Read *read0, Read *read1, const PairedAlignmentResult *result);
+
+    static const unsigned DefaultMaxReadLength = 320;
+
+private:
+
+    struct Entry {
+        _uint64                 hashValue;
+        unsigned                length[NUM_READS_PER_PAIR];     // both 0 for an empty entry, since pairs like that aren't aligned
+        PairedAlignmentResult   result;
+    };
+
+    _uint64 hashPair(Read *read0, Read *read1) const;
+
+    bool fits(Read *read0, Read *read1) const {
+        return read0->getDataLength() <= maxReadLength && read1->getDataLength() <= maxReadLength;
+    }
+
+    //
+    // Each entry's data and qualities for both reads, each maxReadLength long, in that order.
+    //
+    char *bytesOf(unsigned whichEntry) const {
+        return bytes + (size_t)whichEntry * maxReadLength * 2 * NUM_READS_PER_PAIR;
+    }
+
+    bool matches(unsigned whichEntry, Read *read0, Read *read1) const;
+
+    unsigned    nEntries;
+    unsigned    maxReadLength;
+    Entry      *entries;
+    char       *bytes;
+};
@@ -19,6 +19,89 @@ Environment:
 
 using std::max;
 
+//
+// An idle thread waits on its own event for TaskThreads::start to give it a function and wake it up.
+//
+struct PooledThread
+{
+    EventObject wakeup;
+    ThreadMainFunction function;
+    void* param;
+    bool reusable;
+    PooledThread* next;     // in the idle list
+};
+
+class TaskThreadPool
+{
+public:
+    TaskThreadPool() : idle(NULL)
+    {
+        InitializeExclusiveLock(&lock);
+    }
+
+    ExclusiveLock lock;
+    PooledThread* idle;
+};
+
+static TaskThreadPool taskThreadPool;
+
+    static void
+PooledThreadMain(
+    void* param)
+{
+    PooledThread* thread = (PooledThread*) param;
+    for (;;) {
+        thread->function(thread->param);
+        if (! thread->reusable) {
+            break;
+        }
+        AcquireExclusiveLock(&taskThreadPool.lock);
+        thread->next = taskThreadPool.idle;
+        taskThreadPool.idle = thread;
+        ReleaseExclusiveLock(&taskThreadPool.lock);
+
+        WaitForEvent(&thread->wakeup);
+        PreventEventWaitersFromProceeding(&thread->wakeup);
+    }
+    DestroyEventObject(&thread->wakeup);
+    delete thread;
+}
+
+    bool
+TaskThreads::start(
+    ThreadMainFunction function,
+    void* param,
+    bool reusable)
+{
+    AcquireExclusiveLock(&taskThreadPool.lock);
+    PooledThread* thread = taskThreadPool.idle;
+    if (thread != NULL) {
+        taskThreadPool.idle = thread->next;
+    }
+    ReleaseExclusiveLock(&taskThreadPool.lock);
+
+    if (thread != NULL) {
+        thread->function = function;
+        thread->param = param;
+        thread->reusable = reusable;
+        AllowEventWaitersToProceed(&thread->wakeup);
+        return true;
+    }
+
+    thread = new PooledThread;
+    CreateEventObject(&thread->wakeup);
+    PreventEventWaitersFromProceeding(&thread->wakeup);
+    thread->function = function;
+    thread->param = param;
+    thread->reusable = reusable;
+    if (! StartNewThread(PooledThreadMain, thread)) {
+        DestroyEventObject(&thread->wakeup);
+        delete thread;
+        return false;
+    }
+    return true;
+}
+
 ParallelCoworker::ParallelCoworker(int i_numThreads, bool i_bindToProcessors, ParallelWorkerManager* i_manager, Callback i_callback, void* i_parameter)
     : stopped(false), numThreads(i_numThreads), bindToProcessors(i_bindToProcessors), manager(i_manager), callback(i_callback), parameter(i_parameter)
 {
@@ -60,7 +143,23 @@ void ParallelCoworker::start()
     context->useTimingBarrier = false;
 #endif
     task = new ParallelTask<WorkerContext>(context);
-    task->fork();
+    if (!StartNewThread(ParallelCoworker::taskThreadMain, this)) {
+        fprintf(stderr, "Unable to fork task thread.\n");
+        soft_exit(1);
+    }
+}
+
+    void
+ParallelCoworker::taskThreadMain(
+    void* param)
+{
+    //
+    // Only say we're finished once the task is completely done with its (and our) memory, since stop() lets the caller
+    // delete us.
+    //
+    ParallelCoworker* coworker = (ParallelCoworker*) param;
+    coworker->task->run();
+    SignalSingleWaiterObject(&coworker->finished);
 }
 
 void ParallelCoworker::step()
@@ -128,9 +227,6 @@ WorkerContext::runThread()
     void
 WorkerContext::finishThread(WorkerContext* common)
 {
-    if (threadNum == totalThreads - 1) {
-        SignalSingleWaiterObject(&shared->finished);
-    }
 }
 
     void
@@ -141,3 +237,245 @@ ParallelWorkerManager::configure(
 {
     worker->configure(this, threadNum, totalThreads);
 }
+
+WorkPool* WorkPool::pool = NULL;
+volatile _uint32 WorkPool::poolState = 0;
+
+WorkPool::Stage::Stage(
+    Priority i_priority)
+    : priority(i_priority), idleStates(NULL)
+{
+    InitializeExclusiveLock(&lock);
+}
+
+WorkPool::Stage::~Stage()
+{
+    _ASSERT(idleStates == NULL);    // the owner should have called deleteThreadStates
+    DestroyExclusiveLock(&lock);
+}
+
+    void*
+WorkPool::Stage::takeState()
+{
+    AcquireExclusiveLock(&lock);
+    StateNode* node = idleStates;
+    if (node != NULL) {
+        idleStates = node->next;
+    }
+    ReleaseExclusiveLock(&lock);
+    if (node == NULL) {
+        return createThreadState();
+    }
+    void* state = node->state;
+    delete node;
+    return state;
+}
+
+    void
+WorkPool::Stage::returnState(
+    void* state)
+{
+    StateNode* node = new StateNode();
+    node->state = state;
+    AcquireExclusiveLock(&lock);
+    node->next = idleStates;
+    idleStates = node;
+    ReleaseExclusiveLock(&lock);
+}
+
+    void
+WorkPool::Stage::deleteThreadStates()
+{
+    AcquireExclusiveLock(&lock);
+    StateNode* node = idleStates;
+    idleStates = NULL;
+    ReleaseExclusiveLock(&lock);
+    while (node != NULL) {
+        StateNode* next = node->next;
+        deleteThreadState(node->state);
+        delete node;
+        node = next;
+    }
+}
+
+    WorkPool*
+WorkPool::get()
+{
+    if (poolState != 2) {
+        if (0 == InterlockedCompareExchange32AndReturnOldValue(&poolState, 1, 0)) {
+            pool = new WorkPool(max(1, (int) GetNumberOfProcessors()));
+            poolState = 2;
+        } else {
+            while (poolState != 2) {
+                // someone else is starting it, which doesn't take long
+            }
+        }
+    }
+    return pool;
+}
+
+WorkPool::WorkPool(
+    int i_numThreads)
+    : numThreads(i_numThreads), queued(0), nextQueue(0), threadsStarted(0), nIdle(0)
+{
+    queues = new Queue[numThreads * NumPriorities];
+    for (int i = 0; i < numThreads * NumPriorities; i++) {
+        InitializeExclusiveLock(&queues[i].lock);
+        queues[i].capacity = 16;
+        queues[i].tasks = new Task[queues[i].capacity];
+        queues[i].head = 0;
+        queues[i].count = 0;
+    }
+    InitializeExclusiveLock(&idleLock);
+    wakeup = new EventObject[numThreads];
+    idleThreads = new int[numThreads];
+    for (int i = 0; i < numThreads; i++) {
+        CreateEventObject(&wakeup[i]);
+        PreventEventWaitersFromProceeding(&wakeup[i]);
+    }
+    for (int i = 0; i < numThreads; i++) {
+        if (! StartNewThread(ThreadMain, this)) {
+            fprintf(stderr, "Unable to start work pool thread\n");
+            soft_exit(1);
+        }
+    }
+    // the pool's threads run until the process exits
+}
+
+    void
+WorkPool::submit(
+    Stage* stage,
+    void* item)
+{
+    Queue* queue = &queues[(((unsigned) InterlockedIncrementAndReturnNewValue(&nextQueue)) % numThreads) * NumPriorities + stage->priority];
+    AcquireExclusiveLock(&queue->lock);
+    if (queue->count == queue->capacity) {
+        Task* tasks = new Task[2 * queue->capacity];
+        for (int i = 0; i < queue->count; i++) {
+            tasks[i] = queue->tasks[(queue->head + i) % queue->capacity];
+        }
+        delete [] queue->tasks;
+        queue->tasks = tasks;
+        queue->head = 0;
+        queue->capacity *= 2;
+    }
+    Task* task = &queue->tasks[(queue->head + queue->count) % queue->capacity];
+    task->stage = stage;
+    task->item = item;
+    queue->count++;
+    ReleaseExclusiveLock(&queue->lock);
+
+    //
+    // Count it before looking for an idle thread; a thread only goes idle after seeing nothing queued under idleLock,
+    // so either it sees this or we see it.
+    //
+    InterlockedIncrementAndReturnNewValue(&queued);
+    AcquireExclusiveLock(&idleLock);
+    if (nIdle > 0) {
+        AllowEventWaitersToProceed(&wakeup[idleThreads[--nIdle]]);
+    }
+    ReleaseExclusiveLock(&idleLock);
+}
+
+    bool
+WorkPool::take(
+    int thread,
+    Task* o_task)
+{
+    if (queued == 0) {
+        return false;
+    }
+    for (int p = 0; p < NumPriorities; p++) {
+        for (int i = 0; i < numThreads; i++) {
+            Queue* queue = &queues[((thread + i) % numThreads) * NumPriorities + p];
+            if (queue->count == 0) {
+                continue;
+            }
+            AcquireExclusiveLock(&queue->lock);
+            bool found = queue->count > 0;
+            if (found) {
+                *o_task = queue->tasks[queue->head];
+                queue->head = (queue->head + 1) % queue->capacity;
+                queue->count--;
+            }
+            ReleaseExclusiveLock(&queue->lock);
+            if (found) {
+                InterlockedDecrementAndReturnNewValue(&queued);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+    void
+WorkPool::runTask(
+    const Task& task)
+{
+    void* state = task.stage->takeState();
+    task.stage->run(state, task.item);
+    task.stage->returnState(state);
+    task.stage->finished(task.item);
+}
+
+    void
+WorkPool::helpUntil(
+    EventObject* event)
+{
+    if (poolState != 2) {
+        WaitForEvent(event);
+        return;
+    }
+    Task task;
+    while (! WaitForEventWithTimeout(event, 0)) {
+        if (! pool->take((unsigned) pool->nextQueue % pool->numThreads, &task)) {
+            WaitForEvent(event);
+            return;
+        }
+        pool->runTask(task);
+    }
+}
+
+    bool
+WorkPool::helpIfBehind()
+{
+    if (poolState != 2 || pool->queued <= 0 || pool->nIdle > 0) {
+        // nothing waiting, or a pool thread's already on its way to it
+        return false;
+    }
+    Task task;
+    if (! pool->take((unsigned) pool->nextQueue % pool->numThreads, &task)) {
+        return false;
+    }
+    pool->runTask(task);
+    return true;
+}
+
+    void
+WorkPool::ThreadMain(
+    void* param)
+{
+    ((WorkPool*) param)->runThread();
+}
+
+    void
+WorkPool::runThread()
+{
+    int thread = InterlockedIncrementAndReturnNewValue(&threadsStarted) - 1;
+    Task task;
+    while (true) {
+        if (take(thread, &task)) {
+            runTask(task);
+            continue;
+        }
+        AcquireExclusiveLock(&idleLock);
+        if (queued > 0) {
+            ReleaseExclusiveLock(&idleLock);
+            continue;
+        }
+        PreventEventWaitersFromProceeding(&wakeup[thread]);
+        idleThreads[nIdle++] = thread;
+        ReleaseExclusiveLock(&idleLock);
+        WaitForEvent(&wakeup[thread]);
+    }
+}
@@ -25,6 +25,17 @@ Revision History:
 #include "Compat.h"
 #include "exit.h"
 
+//
+// The threads ParallelTask runs its workers on.  One that has finished its function waits to be handed the next,
+// rather than exiting, so that chained runs and iterations don't start a new set of threads each time.  Threads that
+// aren't reusable (ones that were bound to a processor, which the next run may not want) exit as before.
+//
+class TaskThreads
+{
+public:
+    static bool start(ThreadMainFunction function, void* param, bool reusable);
+};
+
 /*++
     Simple class to handle parallelized algorithms.
     TContext should extend TContextBase, and provide the following methods:
@@ -130,7 +141,7 @@ ParallelTask<TContext>::run()
         contexts[i].threadNum = i;
         contexts[i].initializeThread();
 
-        if (!StartNewThread(ParallelTask<TContext>::threadWorker, &contexts[i])) {
+        if (!TaskThreads::start(ParallelTask<TContext>::threadWorker, &contexts[i], !common->bindToProcessors)) {
             fprintf(stderr, "Unable to start worker thread.\n");
             soft_exit(1);
         }
@@ -237,6 +248,8 @@ private:
     ParallelTask<WorkerContext>* task;
     SingleWaiterObject finished;
 
+    static void taskThreadMain(void* param);
+
     friend struct WorkerContext;
 };
 
@@ -296,3 +309,126 @@ struct WorkerContext : public TaskContextBase
     void finishThread(WorkerContext* common);
 };
 
+
+//
+// A pool of threads, one per processor, that the stages of the pipeline (decompressing the input and encoding the
+// output) share rather than each starting threads of their own.  Work goes round robin onto the threads' own queues,
+// and a thread whose queues are empty steals from the others; it always takes the most urgent work it can find.
+// Threads that would otherwise block on a stage (an aligner waiting for reads, or for an output buffer to finish
+// encoding) help with the queued work in the meantime, so the stages and alignment share the cores as the load moves
+// between them.
+//
+class WorkPool
+{
+public:
+    enum Priority { Urgent = 0, Normal = 1, NumPriorities = 2 };
+
+    //
+    // A kind of work.  run may be called on several threads at once, each with its own state, which is created the
+    // first time it's needed and then kept for the stage's later items on any thread.  finished is the last thing the
+    // pool does with an item and its stage, so it's where to tell whoever is waiting to free them.  The owner calls
+    // deleteThreadStates once all of the stage's items have finished, before deleting it.
+    //
+    class Stage
+    {
+    public:
+        Stage(Priority i_priority);
+
+        virtual ~Stage();
+
+        virtual void* createThreadState() { return NULL; }
+
+        virtual void deleteThreadState(void* state) {}
+
+        virtual void run(void* state, void* item) = 0;
+
+        virtual void finished(void* item) {}
+
+        void deleteThreadStates();
+
+        const Priority priority;
+
+    private:
+        friend class WorkPool;
+
+        void* takeState();
+        void returnState(void* state);
+
+        struct StateNode
+        {
+            void* state;
+            StateNode* next;
+        };
+
+        ExclusiveLock lock;
+        StateNode* idleStates;
+    };
+
+    // the process's pool, started the first time it's asked for
+    static WorkPool* get();
+
+    // queue item to be run by stage; threadsafe
+    void submit(Stage* stage, void* item);
+
+    //
+    // Wait for event, running queued work until it's set; when there's none left, just wait.  If the pool hasn't been
+    // started there's nothing to help with.
+    //
+    static void helpUntil(EventObject* event);
+
+    //
+    // If there's queued work that none of the pool's threads is free to start, run a piece of it and return true.  The
+    // aligner threads call this between batches, so that when decompression or encoding is what's holding things up they
+    // take turns at it rather than getting further ahead (only to block later).  Otherwise the work is left to the pool.
+    //
+    static bool helpIfBehind();
+
+    int getThreadCount() { return numThreads; }
+
+    // tasks queued and not yet started (0 if the pool hasn't been), for progress reports
+    static int getBacklog() { return poolState == 2 ? pool->queued : 0; }
+
+private:
+    WorkPool(int i_numThreads);
+
+    struct Task
+    {
+        Stage* stage;
+        void* item;
+    };
+
+    // a ring of tasks, grown as needed
+    struct Queue
+    {
+        ExclusiveLock lock;
+        Task* tasks;
+        int capacity;
+        int head;
+        volatile int count;
+    };
+
+    // take the most urgent task, looking at thread's queues first and then stealing; false if everything's empty
+    bool take(int thread, Task* o_task);
+
+    void runTask(const Task& task);
+
+    static void ThreadMain(void* param);
+    void runThread();
+
+    const int numThreads;
+    Queue* queues;          // NumPriorities for each thread
+    volatile int queued;    // tasks in all of the queues
+    volatile int nextQueue; // for round robin
+    volatile int threadsStarted;
+
+    //
+    // Idle threads wait on their own event, and list themselves here under the lock so that submit can wake just one.
+    //
+    ExclusiveLock idleLock;
+    EventObject* wakeup;
+    int* idleThreads;
+    volatile int nIdle;
+
+    static WorkPool* pool;
+    static volatile _uint32 poolState;  // 0 not started, 1 starting, 2 started
+};
@@ -0,0 +1,366 @@
+/*++
+
+Module Name:
+
+    PerfCounters.cpp
+
+Abstract:
+
+    Per-thread performance counters and their JSON reporter.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "PerfCounters.h"
+#include "exit.h"
+#include "ReadSupplierQueue.h"
+#include "ParallelTask.h"
+
+const char* PerfCounters::PhaseNames[PerfCounters::NumPhases] = {
+    "seedLookup", "lvScoring", "cigarGeneration", "outputFormatting", "queueWait"
+};
+
+PERF_THREAD_LOCAL PerfCounters* PerfCounters::threadCounters = NULL;
+
+PerfCounters PerfCounters::discard[PerfCounters::DiscardShards];
+
+PERF_THREAD_LOCAL int PerfCounters::threadDiscardShard = 0;
+
+static volatile int nextDiscardShard = 0;
+
+PerfCounters::PerfCounters()
+    :
+    reads(0),
+    hashTableProbes(0),
+    seedFilterRejections(0),
+    overflowTableLookups(0),
+    duplicatePairsReused(0),
+    splitReads(0),
+    mateRescues(0),
+    lvCacheLookups(0),
+    lvCacheHits(0),
+    currentPhase(NoPhase),
+    phaseStart(0),
+    next(NULL),
+    prev(NULL)
+{
+    for (int i = 0; i <= NumPhases; i++) {
+        ticks[i] = 0;
+        calls[i] = 0;
+    }
+}
+
+    PerfCounters*
+PerfCounters::discardForThisThread()
+{
+    if (threadDiscardShard == 0) {
+        threadDiscardShard = (InterlockedIncrementAndReturnNewValue(&nextDiscardShard) - 1) % DiscardShards + 1;
+    }
+    return &discard[threadDiscardShard - 1];
+}
+
+    void
+PerfCounters::add(
+    const PerfCounters* other)
+{
+    for (int i = 0; i < NumPhases; i++) {
+        ticks[i] += other->ticks[i];
+        calls[i] += other->calls[i];
+    }
+    reads += other->reads;
+    hashTableProbes += other->hashTableProbes;
+    seedFilterRejections += other->seedFilterRejections;
+    overflowTableLookups += other->overflowTableLookups;
+    duplicatePairsReused += other->duplicatePairsReused;
+    splitReads += other->splitReads;
+    mateRescues += other->mateRescues;
+    lvCacheLookups += other->lvCacheLookups;
+    lvCacheHits += other->lvCacheHits;
+    queueWaitTicks.add(&other->queueWaitTicks);
+    writeBatchBytes.add(&other->writeBatchBytes);
+    seedHits.add(&other->seedHits);
+}
+
+//
+// The counters that are attached to running threads, and the sum of the ones that have been detached.  The running
+// threads update theirs without any locking, so a snapshot of them is only approximately consistent, which is good
+// enough for a progress report.
+//
+class PerfRegistry
+{
+public:
+    PerfRegistry() : attached(NULL)
+    {
+        InitializeExclusiveLock(&lock);
+        //
+        // Tie the tick rate to the clock from here, which is near enough to the start of the process.
+        //
+        startTicks = PerfTicks();
+        startNanos = timeInNanos();
+    }
+
+    double ticksPerSecond()
+    {
+        _int64 nanos = timeInNanos() - startNanos;
+        return nanos > 0 ? (PerfTicks() - startTicks) * 1e9 / nanos : 1e9;
+    }
+
+    ExclusiveLock lock;
+    PerfCounters* attached;
+    PerfCounters finished;
+    _int64 startTicks;
+    _int64 startNanos;
+};
+
+static PerfRegistry registry;
+
+    void
+PerfCounters::attach(
+    PerfCounters* counters)
+{
+    _ASSERT(threadCounters == NULL);
+    AcquireExclusiveLock(&registry.lock);
+    counters->prev = NULL;
+    counters->next = registry.attached;
+    if (registry.attached != NULL) {
+        registry.attached->prev = counters;
+    }
+    registry.attached = counters;
+    ReleaseExclusiveLock(&registry.lock);
+    threadCounters = counters;
+}
+
+    void
+PerfCounters::detach()
+{
+    PerfCounters* counters = threadCounters;
+    if (counters == NULL) {
+        return;
+    }
+    threadCounters = NULL;
+    AcquireExclusiveLock(&registry.lock);
+    if (counters->prev != NULL) {
+        counters->prev->next = counters->next;
+    } else {
+        registry.attached = counters->next;
+    }
+    if (counters->next != NULL) {
+        counters->next->prev = counters->prev;
+    }
+    registry.finished.add(counters);
+    ReleaseExclusiveLock(&registry.lock);
+}
+
+    void
+PerfCounters::snapshot(
+    PerfCounters* o_totals)
+{
+    *o_totals = PerfCounters();
+    AcquireExclusiveLock(&registry.lock);
+    o_totals->add(&registry.finished);
+    for (PerfCounters* counters = registry.attached; counters != NULL; counters = counters->next) {
+        o_totals->add(counters);
+    }
+    ReleaseExclusiveLock(&registry.lock);
+}
+
+    void
+PerfCounters::clearFinished()
+{
+    AcquireExclusiveLock(&registry.lock);
+    registry.finished = PerfCounters();
+    ReleaseExclusiveLock(&registry.lock);
+}
+
+    double
+PerfCounters::ticksPerSecond()
+{
+    return registry.ticksPerSecond();
+}
+
+    int
+PerfCounters::formatJson(
+    char* buffer,
+    size_t bufferSize) const
+{
+    double ticksPerSecond = registry.ticksPerSecond();
+    int used = snprintf(buffer, bufferSize, "\"reads\":%lld", reads);
+    for (int i = 0; i < NumPhases; i++) {
+        used += snprintf(buffer + used, bufferSize - __min((size_t) used, bufferSize), ",\"%s\":{\"seconds\":%.3f,\"calls\":%lld}",
+            PhaseNames[i], ticks[i] / ticksPerSecond, calls[i]);
+    }
+    used += snprintf(buffer + used, bufferSize - __min((size_t) used, bufferSize), ",\"hashTableProbes\":%lld,\"seedFilterRejections\":%lld,\"overflowTableLookups\":%lld,\"duplicatePairsReused\":%lld,\"splitReads\":%lld,\"mateRescues\":%lld,\"lvCacheLookups\":%lld,\"lvCacheHits\":%lld",
+        hashTableProbes, seedFilterRejections, overflowTableLookups, duplicatePairsReused, splitReads, mateRescues, lvCacheLookups, lvCacheHits);
+    const Histogram* histograms[] = {&queueWaitTicks, &writeBatchBytes, &seedHits};
+    const char* histogramNames[] = {"queueWaitSeconds", "writeBatchBytes", "seedHits"};
+    double histogramScales[] = {ticksPerSecond, 1.0, 1.0};
+    for (int i = 0; i < 3; i++) {
+        used += snprintf(buffer + used, bufferSize - __min((size_t) used, bufferSize), ",");
+        used += histograms[i]->formatJson(buffer + used, bufferSize - __min((size_t) used, bufferSize), histogramNames[i], histogramScales[i]);
+    }
+    return used;
+}
+
+PerfReporter::PerfReporter(
+    const char* perfFileName,
+    const char* i_statusFileName,
+    int i_intervalSeconds,
+    int i_nThreads)
+    :
+    perfFile(NULL),
+    statusFileName(i_statusFileName),
+    statusTempFileName(NULL),
+    statusWarningPrinted(false),
+    intervalSeconds(i_intervalSeconds),
+    nThreads(i_nThreads),
+    start(timeInMillis()),
+    lastMillis(0),
+    lastReads(0)
+{
+    if (perfFileName != NULL) {
+        perfFile = fopen(perfFileName, "a");
+        if (perfFile == NULL) {
+            fprintf(stderr, "Unable to open perf counter file '%s'\n", perfFileName);
+            soft_exit(1);
+        }
+    }
+    GetProcessUsage(&startUsage);
+    lastUsage = startUsage;
+    PerfCounters::clearFinished();
+
+    if (statusFileName != NULL) {
+        size_t size = strlen(statusFileName) + 5;
+        statusTempFileName = new char[size];
+        snprintf(statusTempFileName, size, "%s.tmp", statusFileName);
+
+        char line[100];
+        snprintf(line, sizeof(line), "{\"event\":\"start\",\"elapsedSeconds\":0,\"threads\":%d}\n", nThreads);
+        if (! writeStatus(line)) {
+            fprintf(stderr, "Unable to write status file '%s'\n", statusFileName);
+            soft_exit(1);
+        }
+    }
+
+    CreateEventObject(&stop);
+    CreateEventObject(&stopped);
+    if (intervalSeconds > 0) {
+        if (! StartNewThread(reporterThreadMain, this)) {
+            fprintf(stderr, "Unable to start the perf counter reporting thread\n");
+            soft_exit(1);
+        }
+    } else {
+        AllowEventWaitersToProceed(&stopped);
+    }
+}
+
+PerfReporter::~PerfReporter()
+{
+    DestroyEventObject(&stop);
+    DestroyEventObject(&stopped);
+    if (perfFile != NULL) {
+        fclose(perfFile);
+    }
+    delete [] statusTempFileName;
+}
+
+    void
+PerfReporter::reporterThreadMain(
+    void* param)
+{
+    PerfReporter* reporter = (PerfReporter*) param;
+    while (! WaitForEventWithTimeout(&reporter->stop, reporter->intervalSeconds * 1000ll)) {
+        PerfCounters totals;
+        PerfCounters::snapshot(&totals);
+        reporter->report("progress", &totals, timeInMillis() - reporter->start);
+    }
+    AllowEventWaitersToProceed(&reporter->stopped);
+}
+
+    void
+PerfReporter::finish(
+    const PerfCounters* totals,
+    _int64 elapsedMillis)
+{
+    AllowEventWaitersToProceed(&stop);
+    WaitForEvent(&stopped);
+
+    //
+    // The final line's rates are over the whole run.
+    //
+    lastMillis = 0;
+    lastReads = 0;
+    lastUsage = startUsage;
+    report("final", totals, elapsedMillis);
+}
+
+//
+// A rate per second over the interval, or -1 if the platform doesn't count it.
+//
+    static double
+Rate(
+    _int64 now,
+    _int64 then,
+    double seconds)
+{
+    return now < 0 || then < 0 ? -1.0 : (now - then) / seconds;
+}
+
+    void
+PerfReporter::report(
+    const char* event,
+    const PerfCounters* totals,
+    _int64 elapsedMillis)
+{
+    ProcessUsage usage;
+    GetProcessUsage(&usage);
+    double seconds = __max(elapsedMillis - lastMillis, (_int64) 1) / 1000.0;
+
+    char line[4096];
+    int used = snprintf(line, sizeof(line), "{\"event\":\"%s\",\"elapsedSeconds\":%.3f,\"threads\":%d,", event, elapsedMillis / 1000.0, nThreads);
+    used += totals->formatJson(line + used, sizeof(line) - used);
+    snprintf(line + used, sizeof(line) - __min((size_t) used, sizeof(line)),
+        ",\"readsPerSecond\":%.0f,\"readQueueDepth\":%lld,\"workPoolBacklog\":%d"
+        ",\"residentBytes\":%lld,\"peakResidentBytes\":%lld"
+        ",\"bytesRead\":%lld,\"bytesWritten\":%lld,\"bytesReadPerSecond\":%.0f,\"bytesWrittenPerSecond\":%.0f"
+        ",\"storageBytesRead\":%lld,\"storageBytesWritten\":%lld}\n",
+        (totals->reads - lastReads) / seconds, (_int64) ReadSupplierQueue::ReadsQueued, WorkPool::getBacklog(),
+        usage.residentBytes, usage.peakResidentBytes,
+        usage.bytesRead, usage.bytesWritten, Rate(usage.bytesRead, lastUsage.bytesRead, seconds), Rate(usage.bytesWritten, lastUsage.bytesWritten, seconds),
+        usage.storageBytesRead, usage.storageBytesWritten);
+
+    lastMillis = elapsedMillis;
+    lastReads = totals->reads;
+    lastUsage = usage;
+
+    if (perfFile != NULL) {
+        fputs(line, perfFile);
+        fflush(perfFile);
+    }
+    if (statusFileName != NULL && ! writeStatus(line) && ! statusWarningPrinted) {
+        //
+        // Losing the status file isn't worth stopping a run for.
+        //
+        statusWarningPrinted = true;
+        fprintf(stderr, "warning: unable to update status file '%s'\n", statusFileName);
+    }
+}
+
+    bool
+PerfReporter::writeStatus(
+    const char* line)
+{
+    FILE* file = fopen(statusTempFileName, "w");
+    if (file == NULL) {
+        return false;
+    }
+    bool worked = fputs(line, file) >= 0;
+    worked = fclose(file) == 0 && worked;
+#ifdef _MSC_VER
+    DeleteSingleFile(statusFileName);   // MoveFile won't replace it
+#endif
+    return worked && MoveSingleFile(statusTempFileName, statusFileName);
+}
@@ -0,0 +1,217 @@
+/*++
+
+Module Name:
+
+    PerfCounters.h
+
+Abstract:
+
+    Per-thread counters of where the aligner threads spend their time, cheap enough to leave on all the time, and the
+    reporter that writes them out as JSON during and at the end of a run, along with the run's progress (throughput,
+    queue depths, I/O and memory use).
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "stdafx.h"
+#include "Compat.h"
+#include "Histogram.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#endif
+
+#ifdef _MSC_VER
+#define PERF_THREAD_LOCAL __declspec(thread)
+#else
+#define PERF_THREAD_LOCAL __thread
+#endif
+
+#define PERF_CACHE_LINE 64
+
+//
+// The timers count in whatever ticks are cheapest to read (the TSC where there is one), and are only turned into
+// seconds when they're reported.
+//
+inline _int64 PerfTicks()
+{
+#if defined(__SSE2__) || defined(_M_X64)
+    return (_int64) __rdtsc();
+#else
+    return timeInNanos();
+#endif
+}
+
+//
+// Each aligner thread's are part of its AlignerStats, and get added up along with the rest of them.  They're cache line
+// aligned (which rounds their size, and the AlignerStats', up to whole lines) so that threads bumping their own counters
+// never write a line another thread is using.
+//
+struct alignas(PERF_CACHE_LINE) PerfCounters
+{
+    //
+    // The phases are timed exclusively: starting one pauses whichever was running on the thread, so output formatting
+    // doesn't include the CIGAR generation or the queue waits that happen inside it.
+    //
+    enum Phase { SeedLookup, LVScoring, CigarGeneration, OutputFormatting, QueueWait, NumPhases, NoPhase = NumPhases };
+
+    static const char* PhaseNames[NumPhases];
+
+    PerfCounters();
+
+    _int64 ticks[NumPhases + 1];        // the last one soaks up NoPhase, and isn't reported
+    _int64 calls[NumPhases + 1];
+    _int64 reads;
+    _int64 hashTableProbes;             // steps along hash chains past the first slot, when looking up seeds
+    _int64 seedFilterRejections;        // seed lookups that the index's SeedFilter answered without the hash tables
+    _int64 overflowTableLookups;        // hit lists read from the overflow table (which -place may have put in slower memory)
+    _int64 duplicatePairsReused;        // read pairs whose result came from a PairedResultCache
+    _int64 splitReads;                  // reads written as a primary and a supplementary alignment (with -split)
+    _int64 mateRescues;                 // pairs with one end found near the other rather than aligned (with -rescue)
+    _int64 lvCacheLookups;
+    _int64 lvCacheHits;
+
+    //
+    // Distributions, for the percentiles: how long each QueueWait lasted (in ticks, including anything the thread
+    // helped with while it waited), how full the output batches the thread wrote were, and how many places each seed
+    // the aligners looked up hit, in both directions together.
+    //
+    Histogram queueWaitTicks;
+    Histogram writeBatchBytes;
+    Histogram seedHits;
+
+    Phase currentPhase;
+    _int64 phaseStart;
+
+    void add(const PerfCounters* other);
+
+    // the counters as JSON object members (without the braces); returns the length, as snprintf does
+    int formatJson(char* buffer, size_t bufferSize) const;
+
+    //
+    // The calling thread's counters.  Threads that haven't attached any (the work pool's and the index build's, say)
+    // get one of DiscardShards sinks whose counts are thrown away, picked round robin the first time, so that they
+    // don't all write the same one.
+    //
+    static PerfCounters* forThisThread()
+    {
+        PerfCounters* counters = threadCounters;
+        return counters != NULL ? counters : discardForThisThread();
+    }
+
+    //
+    // attach makes counters the calling thread's, and visible to snapshot while it runs; detach folds them into the
+    // totals of the threads that have finished, which snapshot also includes.
+    //
+    static void attach(PerfCounters* counters);
+
+    static void detach();
+
+    static void snapshot(PerfCounters* o_totals);
+
+    static void clearFinished();
+
+    // the rate PerfTicks counts at, as measured since the process started
+    static double ticksPerSecond();
+
+private:
+    static PERF_THREAD_LOCAL PerfCounters* threadCounters;
+
+    static PerfCounters* discardForThisThread();
+
+    static const int DiscardShards = 64;
+
+    static PerfCounters discard[DiscardShards];
+
+    static PERF_THREAD_LOCAL int threadDiscardShard;    // one more than the shard, so 0 is none yet
+
+    PerfCounters* next;     // in the list of attached counters
+    PerfCounters* prev;
+};
+
+//
+// Times a scope as one phase (counting count calls to it), and hands the thread back to whatever it interrupted at
+// the end.
+//
+class PerfTimer
+{
+public:
+    PerfTimer(PerfCounters::Phase i_phase, _int64 count = 1) : counters(PerfCounters::forThisThread()), phase(i_phase)
+    {
+        _int64 now = PerfTicks();
+        begin = now;
+        outer = counters->currentPhase;
+        counters->ticks[outer] += now - counters->phaseStart;
+        counters->calls[phase] += count;
+        counters->currentPhase = phase;
+        counters->phaseStart = now;
+    }
+
+    ~PerfTimer()
+    {
+        _int64 now = PerfTicks();
+        counters->ticks[counters->currentPhase] += now - counters->phaseStart;
+        counters->currentPhase = outer;
+        counters->phaseStart = now;
+        if (phase == PerfCounters::QueueWait) {
+            counters->queueWaitTicks.record(now - begin);
+        }
+    }
+
+private:
+    PerfCounters* counters;
+    PerfCounters::Phase phase;
+    PerfCounters::Phase outer;
+    _int64 begin;
+};
+
+//
+// Every intervalSeconds (if that's positive) makes a line of JSON with the counters so far and the run's progress:
+// reads aligned per second and I/O rates since the last line, how deep the read queue and the work pool's backlog
+// are, and the process's memory use.  The line is appended to the perf file and replaces the status file, which is
+// written to the side and renamed into place so that whatever polls it (a scheduler looking for stalled or I/O
+// starved jobs, say) never sees half of one.  There's a "start" line in the status file straight away, and a "final"
+// one with rates over the whole run at the end.  Either file name may be NULL.
+//
+class PerfReporter
+{
+public:
+    PerfReporter(const char* perfFileName, const char* i_statusFileName, int i_intervalSeconds, int i_nThreads);
+
+    ~PerfReporter();
+
+    // stop the periodic reports and write the final totals
+    void finish(const PerfCounters* totals, _int64 elapsedMillis);
+
+private:
+    static void reporterThreadMain(void* param);
+
+    void report(const char* event, const PerfCounters* totals, _int64 elapsedMillis);
+
+    bool writeStatus(const char* line);
+
+    FILE* perfFile;
+    const char* statusFileName;
+    char* statusTempFileName;
+    bool statusWarningPrinted;
+    int intervalSeconds;
+    int nThreads;
+    _int64 start;
+    EventObject stop;
+    EventObject stopped;
+
+    // as of the start and the last report, for the rates
+    ProcessUsage startUsage;
+    _int64 lastMillis;
+    _int64 lastReads;
+    ProcessUsage lastUsage;
+};
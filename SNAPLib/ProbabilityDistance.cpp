@@ -2,6 +2,10 @@
 #include "ProbabilityDistance.h"
 #include "Compat.h"
 
+#if     defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
 
 #ifdef TRACE_PROBABILITY_DISTANCE
 #define TRACE printf
@@ -63,70 +67,96 @@ int ProbabilityDistance::compute(
     _ASSERT(maxShift < MAX_SHIFT);
     _ASSERT(maxStartShift <= maxShift);
 
-    // Fill in the readPos = 0 row to allow us to start only at -maxStartShift..+maxStartShift
-    for (int s = -maxShift-1; s <= maxShift+1; s++) {
-        d[0][MAX_SHIFT+s][READ_GAP] = NO_PROB;
-        d[0][MAX_SHIFT+s][REF_GAP] = NO_PROB;
-        if (s < -maxStartShift || s > maxStartShift) {
-            d[0][MAX_SHIFT+s][NO_GAP] = NO_PROB;
-        } else {
-            d[0][MAX_SHIFT+s][NO_GAP] = log(1.0);
+    // Everything outside -maxShift..maxShift stays at NO_PROB, which gives us the sentinels at the ends of every row
+    for (int g = 0; g < NUM_GAP_STATUSES; g++) {
+        for (int i = 0; i < ROW_SIZE; i++) {
+            row[0][g][i] = NO_PROB;
+            row[1][g][i] = NO_PROB;
         }
     }
 
+    // Fill in the readPos = 0 row to allow us to start only at -maxStartShift..+maxStartShift
+    for (int s = -maxStartShift; s <= maxStartShift; s++) {
+        row[0][NO_GAP][ROW_OFFSET+s] = 0.0f;    // log(1.0)
+    }
+
     // Now go through each readPos from 1 to readLen and compute how to best get there
     for (int r = 1; r <= readLen; r++) {
-        // Add sentinels at the end of the array
-        d[r][MAX_SHIFT-maxShift-1][READ_GAP] = NO_PROB;
-        d[r][MAX_SHIFT+maxShift+1][READ_GAP] = NO_PROB;
-        d[r][MAX_SHIFT-maxShift-1][REF_GAP] = NO_PROB;
-        d[r][MAX_SHIFT+maxShift+1][REF_GAP] = NO_PROB;
-        d[r][MAX_SHIFT-maxShift-1][NO_GAP] = NO_PROB;
-        d[r][MAX_SHIFT+maxShift+1][NO_GAP] = NO_PROB;
-
-        // Fill in the rest of the values using dynamic program recurrence
-        for (int s = -maxShift; s <= maxShift; s++) {
-            // The NO_GAP case; we get here either from a previous NO_GAP or by closing a gap from the
-            // previous readPos, and in either case, we need to match the current base
-            double thisBaseProb = (read[r-1] == reference[r-1+s]) ? matchLogProb[quality[r-1]] : mismatchLogProb[quality[r-1]];
-            d[r][MAX_SHIFT+s][NO_GAP] = max3(d[r-1][MAX_SHIFT+s][NO_GAP] + thisBaseProb,
-                                             d[r-1][MAX_SHIFT+s][REF_GAP] + thisBaseProb,
-                                             d[r-1][MAX_SHIFT+s][READ_GAP] + thisBaseProb);
-
-            // The READ_GAP case; we can either open a new gap from the previous NO_GAP or REF_GAP cases, or
-            // extend a gap computed in the previous READ_GAP case
-            d[r][MAX_SHIFT+s][READ_GAP] = max3(d[r-1][MAX_SHIFT+s+1][NO_GAP] + gapOpenLogProb,
-                                               d[r-1][MAX_SHIFT+s+1][REF_GAP] + gapOpenLogProb,
-                                               d[r-1][MAX_SHIFT+s+1][READ_GAP] + gapExtensionLogProb);
-
-            // The REF_GAP case; we can either open a new gap from NO_GAP/READ_GAP, or extend one
-            d[r][MAX_SHIFT+s][REF_GAP] = max3(d[r][MAX_SHIFT+s-1][NO_GAP] + gapOpenLogProb,
-                                              d[r][MAX_SHIFT+s-1][REF_GAP] + gapExtensionLogProb,
-                                              d[r][MAX_SHIFT+s-1][READ_GAP] + gapOpenLogProb);
+        const float *prevNoGap = row[(r-1) % 2][NO_GAP];
+        const float *prevReadGap = row[(r-1) % 2][READ_GAP];
+        const float *prevRefGap = row[(r-1) % 2][REF_GAP];
+        float *noGap = row[r % 2][NO_GAP];
+        float *readGap = row[r % 2][READ_GAP];
+        float *refGap = row[r % 2][REF_GAP];
+        float matchProb = matchLogProb[(unsigned char)quality[r-1]];
+        float mismatchProb = mismatchLogProb[(unsigned char)quality[r-1]];
+        const char *ref = reference + r - 1;
+
+        // The NO_GAP case; we get here either from a previous NO_GAP or by closing a gap from the
+        // previous readPos, and in either case, we need to match the current base.
+        // The READ_GAP case; we can either open a new gap from the previous NO_GAP or REF_GAP cases, or
+        // extend a gap computed in the previous READ_GAP case.
+        // Neither depends on anything else in this row, so we do them four shifts at a time.
+        int s = -maxShift;
+#if defined(__SSE2__) || defined(_M_X64)
+        __m128 matchProbs = _mm_set1_ps(matchProb);
+        __m128 mismatchProbs = _mm_set1_ps(mismatchProb);
+        __m128 gapOpen = _mm_set1_ps(gapOpenLogProb);
+        __m128 gapExtension = _mm_set1_ps(gapExtensionLogProb);
+        __m128i readBase = _mm_set1_epi8(read[r-1]);
+        for (; s + 3 <= maxShift; s += 4) {
+            int refBases;
+            memcpy(&refBases, ref + s, sizeof(refBases));   // only the four we need, so we can't run off the reference
+            __m128i matches = _mm_cmpeq_epi8(_mm_cvtsi32_si128(refBases), readBase);
+            matches = _mm_unpacklo_epi8(matches, matches);
+            __m128 isMatch = _mm_castsi128_ps(_mm_unpacklo_epi16(matches, matches));
+            __m128 thisBaseProb = _mm_or_ps(_mm_and_ps(isMatch, matchProbs), _mm_andnot_ps(isMatch, mismatchProbs));
+
+            int i = ROW_OFFSET + s;
+            __m128 best = _mm_max_ps(_mm_max_ps(_mm_loadu_ps(prevNoGap + i), _mm_loadu_ps(prevRefGap + i)), _mm_loadu_ps(prevReadGap + i));
+            _mm_storeu_ps(noGap + i, _mm_add_ps(best, thisBaseProb));
+
+            __m128 open = _mm_add_ps(_mm_max_ps(_mm_loadu_ps(prevNoGap + i + 1), _mm_loadu_ps(prevRefGap + i + 1)), gapOpen);
+            _mm_storeu_ps(readGap + i, _mm_max_ps(open, _mm_add_ps(_mm_loadu_ps(prevReadGap + i + 1), gapExtension)));
+        }
+#endif
+        for (; s <= maxShift; s++) {
+            int i = ROW_OFFSET + s;
+            float thisBaseProb = (read[r-1] == ref[s]) ? matchProb : mismatchProb;
+            noGap[i] = (float)max3(prevNoGap[i], prevRefGap[i], prevReadGap[i]) + thisBaseProb;
+            readGap[i] = (float)max3(prevNoGap[i+1] + gapOpenLogProb,
+                                     prevRefGap[i+1] + gapOpenLogProb,
+                                     prevReadGap[i+1] + gapExtensionLogProb);
+        }
+
+        // The REF_GAP case; we can either open a new gap from NO_GAP/READ_GAP, or extend one.  This depends on
+        // the shift before it in the same row, so it's a scan from left to right.
+        for (s = -maxShift; s <= maxShift; s++) {
+            int i = ROW_OFFSET + s;
+            refGap[i] = (float)max3(noGap[i-1] + gapOpenLogProb,
+                                    refGap[i-1] + gapExtensionLogProb,
+                                    readGap[i-1] + gapOpenLogProb);
         }
-    }
 
 #ifdef TRACE_PROBABILITY_DISTANCE
-    printf("Here is the final matrix:\n");
-    for (int r = 0; r <= readLen; r++) {
         printf("%d: ", r);
         for (int g = 0; g < 3; g++) {
-            for (int s = -maxShift; s <= maxShift; s++) {
-                printf("%7.2g ", d[r][MAX_SHIFT+s][g]);
+            for (s = -maxShift; s <= maxShift; s++) {
+                printf("%7.2g ", row[r % 2][g][ROW_OFFSET+s]);
             }
             if (g < 2) {
                 printf("| ");
             }
         }
         printf("\n");
-    }
 #endif
+    }
 
     // Return the best probability, and a somewhat arbitrary score for it (TODO: need to actually compute # of edits)
     double best = NO_PROB;
     for (int s = -maxShift; s <= maxShift; s++) {
         for (int g = 0; g < 3; g++) {
-            best = __max(best, d[readLen][MAX_SHIFT+s][g]);
+            best = __max(best, row[readLen % 2][g][ROW_OFFSET+s]);
         }
     }
     *matchProbability = exp(best);
@@ -27,30 +27,28 @@ public:
             double *matchProbability);
 
 private:
-    double snpLogProb;
-    double gapOpenLogProb;
-    double gapExtensionLogProb;
+    float snpLogProb;
+    float gapOpenLogProb;
+    float gapExtensionLogProb;
 
-    double matchLogProb[256];      // [baseQuality]
-    double mismatchLogProb[256];   // [baseQuality]
+    float matchLogProb[256];      // [baseQuality]
+    float mismatchLogProb[256];   // [baseQuality]
 
 #define NO_PROB  -1000000.0;  // A really negative log probability -- basically zero.  VC compiler won't allow static const double in a class.
 
-    enum GapStatus { NO_GAP, READ_GAP, REF_GAP };
-
-    // d[readPos][shift][gapStatus] is the best possible log probability for aligning the
-    // substring read[0..readPos] to reference[?..readPos + shift]. The "?" in reference is
-    // because we allow starting an alignment from reference[-maxStartShift..maxStartShift]
-    // instead of just reference[0], to deal with indels toward the start of the read.
-    double d[MAX_READ][2*MAX_SHIFT+1][3];   // [readPos][shift][gapStatus]
-
-    // A state in the D array, used for backtracking pointers
-    struct State {
-        int readPos;
-        int shift;
-        int gapStatus;
-    };
-
-    // Previous state in our dynamic program, for backtracking to print CIGAR strings
-    State prev[MAX_READ][2*MAX_SHIFT+1][3];   // [readPos][shift][gapStatus]
+    enum GapStatus { NO_GAP, READ_GAP, REF_GAP, NUM_GAP_STATUSES };
+
+    //
+    // row[readPos % 2][gapStatus][ROW_OFFSET + shift] is the best possible log probability for aligning the substring
+    // read[0..readPos] to reference[?..readPos + shift].  The "?" in reference is because we allow starting an
+    // alignment from reference[-maxStartShift..maxStartShift] instead of just reference[0], to deal with indels toward
+    // the start of the read.  Each row depends only on the one before it, so we keep just two, laid out by gap status so
+    // that a row's shifts can be computed a vector at a time.  There's a sentinel at either end of the shifts in use,
+    // and the rows are rounded up to a whole number of vectors.  Nothing uses the path to the best alignment, so we don't
+    // keep the traceback.
+    //
+    static const int ROW_OFFSET = MAX_SHIFT + 1;
+    static const int ROW_SIZE = (2 * MAX_SHIFT + 3 + 3) & ~3;
+
+    float row[2][NUM_GAP_STATUSES][ROW_SIZE];
 };
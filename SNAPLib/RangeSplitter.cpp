@@ -28,6 +28,7 @@ Revision History:
 #include "RangeSplitter.h"
 #include "SAM.h"
 #include "FASTQ.h"
+#include "GenericFile.h"
 
 using std::max;
 using std::min;
@@ -109,7 +110,10 @@ RangeSplittingReadSupplierGenerator::RangeSplittingReadSupplierGenerator(
 {
     fileName = new char[strlen(i_fileName) + 1];
     strcpy(fileName, i_fileName);
-	splitter = new RangeSplitter(QueryFileSize(fileName),numThreads, 5, 0, 200, 10*MAX_READ_LENGTH);
+    supplier = DataSupplier::ForFile(fileName, false, true);
+    _int64 rangeBegin, rangeEnd;
+    GetRangeOfFile(context, DataSupplier::InputFileSize(fileName), &rangeBegin, &rangeEnd);
+	splitter = new RangeSplitter(rangeEnd, numThreads, 5, rangeBegin, 200, 10*MAX_READ_LENGTH);
 }
 
 ReadSupplier *
@@ -123,9 +127,9 @@ RangeSplittingReadSupplierGenerator::generateNewReadSupplier()
     ReadReader *underlyingReader;
     // todo: implement layered factory model
     if (isSAM) {
-        underlyingReader = SAMReader::create(DataSupplier::Default[true], fileName, context, rangeStart, rangeLength);
+        underlyingReader = SAMReader::create(supplier, fileName, context, rangeStart, rangeLength);
     } else {
-        underlyingReader = FASTQReader::create(DataSupplier::Default[true], fileName, rangeStart, rangeLength, context);
+        underlyingReader = FASTQReader::create(supplier, fileName, rangeStart, rangeLength, context);
     }
     return new RangeSplittingReadSupplier(splitter,underlyingReader);
 }
@@ -198,7 +202,12 @@ RangeSplittingPairedReadSupplierGenerator::RangeSplittingPairedReadSupplierGener
         fileName2 = NULL;
     }
 
-    splitter = new RangeSplitter(QueryFileSize(fileName1),numThreads);
+    supplier = (GenericFile::IsRemote(fileName1) || (NULL != fileName2 && GenericFile::IsRemote(fileName2))) ?
+        DataSupplier::Remote[true] : DataSupplier::Default[true];
+
+    _int64 rangeBegin, rangeEnd;
+    GetRangeOfFile(context, DataSupplier::InputFileSize(fileName1), &rangeBegin, &rangeEnd);
+    splitter = new RangeSplitter(rangeEnd, numThreads, 5, rangeBegin);
 }
 
 RangeSplittingPairedReadSupplierGenerator::~RangeSplittingPairedReadSupplierGenerator()
@@ -219,15 +228,15 @@ RangeSplittingPairedReadSupplierGenerator::generateNewPairedReadSupplier()
     PairedReadReader *underlyingReader;
     switch (fileType) {
     case SAMFile:
-         underlyingReader = SAMReader::createPairedReader(DataSupplier::Default[true], fileName1, rangeStart, rangeLength, true, quicklyDropUnpairedReads, context);
+         underlyingReader = SAMReader::createPairedReader(supplier, fileName1, rangeStart, rangeLength, true, quicklyDropUnpairedReads, context);
          break;
 
     case FASTQFile:
-         underlyingReader = PairedFASTQReader::create(DataSupplier::Default[true], fileName1, fileName2, rangeStart, rangeLength, context);
+         underlyingReader = PairedFASTQReader::create(supplier, fileName1, fileName2, rangeStart, rangeLength, context);
          break;
 
     case InterleavedFASTQFile:
-        underlyingReader = PairedInterleavedFASTQReader::create(DataSupplier::Default[true], fileName1, rangeStart, rangeLength, context);
+        underlyingReader = PairedInterleavedFASTQReader::create(supplier, fileName1, rangeStart, rangeLength, context);
         break;
 
     default:
@@ -238,3 +247,186 @@ RangeSplittingPairedReadSupplierGenerator::generateNewPairedReadSupplier()
     return new RangeSplittingPairedReadSupplier(splitter,underlyingReader);
 }
 
+RecordSplittingPairedReadSupplierGenerator::RecordSplittingPairedReadSupplierGenerator(
+    const char *i_fileName1,
+    const char *i_fileName2,
+    unsigned numThreads,
+    const ReaderContext& i_context)
+    : context(i_context)
+{
+    const char *fileNamesIn[2] = {i_fileName1, i_fileName2};
+    supplier = (GenericFile::IsRemote(i_fileName1) || GenericFile::IsRemote(i_fileName2)) ? DataSupplier::Remote[true] : DataSupplier::Default[true];
+
+    _int64 start = timeInMillis();
+    for (int i = 0; i < 2; i++) {
+        fileNames[i] = new char[strlen(fileNamesIn[i]) + 1];
+        strcpy(fileNames[i], fileNamesIn[i]);
+        indexes[i] = FASTQRecordIndex::create(supplier, fileNames[i], numThreads, context);
+    }
+
+    if (indexes[0]->getRecordCount() != indexes[1]->getRecordCount()) {
+        fprintf(stderr, "%s has %lld reads but %s has %lld.  The FASTQ files don't match.\n", fileNames[0], indexes[0]->getRecordCount(),
+            fileNames[1], indexes[1]->getRecordCount());
+        soft_exit(1);
+    }
+    fprintf(stderr, "Counted %lld read pairs in %llds\n", indexes[0]->getRecordCount(), (timeInMillis() + 500 - start) / 1000);
+
+    _int64 rangeBegin, rangeEnd;
+    GetRangeOfFile(context, indexes[0]->getRecordCount(), &rangeBegin, &rangeEnd);
+    splitter = new RangeSplitter(rangeEnd, numThreads, 5, rangeBegin, 200, 1024);
+}
+
+RecordSplittingPairedReadSupplierGenerator::~RecordSplittingPairedReadSupplierGenerator()
+{
+    for (int i = 0; i < 2; i++) {
+        delete indexes[i];
+        delete [] fileNames[i];
+    }
+    delete splitter;
+}
+
+    PairedReadSupplier *
+RecordSplittingPairedReadSupplierGenerator::generateNewPairedReadSupplier()
+{
+    PairedFASTQReader *underlyingReader = PairedFASTQReader::create(supplier, fileNames[0], fileNames[1], 0, 0, context);
+    if (NULL == underlyingReader) {
+        return NULL;
+    }
+    RecordSplittingPairedReadSupplier *readSupplier = new RecordSplittingPairedReadSupplier(splitter, indexes, underlyingReader);
+    if (!readSupplier->nextRange()) {
+        delete readSupplier;
+        delete underlyingReader;
+        return NULL;
+    }
+    return readSupplier;
+}
+
+    bool
+RecordSplittingPairedReadSupplier::getNextReadPair(Read **read1, Read **read2)
+{
+    *read1 = &internalRead1;
+    *read2 = &internalRead2;
+    if (underlyingReader->getNextReadPair(&internalRead1, &internalRead2)) {
+        return true;
+    }
+
+    return nextRange() && underlyingReader->getNextReadPair(&internalRead1, &internalRead2);
+}
+
+    void
+RecordSplittingPairedReadSupplier::releaseBatch(DataBatch batch)
+{
+    underlyingReader->releaseBatch(batch);
+}
+
+    bool
+RecordSplittingPairedReadSupplier::nextRange()
+{
+    _int64 firstRecord, nRecords;
+    if (!splitter->getNextRange(&firstRecord, &nRecords)) {
+        return false;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        FASTQReader *reader = (FASTQReader *)underlyingReader->getReaderToInitializeRead(i);
+        _int64 end = indexes[i]->getRecordOffset(reader, firstRecord + nRecords);
+        _int64 start = indexes[i]->getRecordOffset(reader, firstRecord);
+        reader->reinitAtRecord(start, end - start);
+    }
+    return true;
+}
+
+    void
+GetRangeOfFile(
+    const ReaderContext& context,
+    _int64 fileSize,
+    _int64 *rangeBegin,
+    _int64 *rangeEnd)
+{
+    _ASSERT(context.rangeCount > 0 && context.rangeIndex < context.rangeCount);
+    *rangeBegin = fileSize * context.rangeIndex / context.rangeCount;
+    *rangeEnd = fileSize * (context.rangeIndex + 1) / context.rangeCount;
+}
+
+    ReadSupplierGenerator *
+RestrictToRange(
+    ReadSupplierGenerator *generator,
+    const ReaderContext& context)
+{
+    if (context.rangeCount <= 1 || NULL == generator) {
+        return generator;
+    }
+    return new RangeFilteringReadSupplierGenerator(generator, context.rangeIndex, context.rangeCount);
+}
+
+    PairedReadSupplierGenerator *
+RestrictPairsToRange(
+    PairedReadSupplierGenerator *generator,
+    const ReaderContext& context)
+{
+    if (context.rangeCount <= 1 || NULL == generator) {
+        return generator;
+    }
+    return new RangeFilteringPairedReadSupplierGenerator(generator, context.rangeIndex, context.rangeCount);
+}
+
+    bool
+RangeFilteringReadSupplier::isInRange(
+    Read *read,
+    unsigned rangeIndex,
+    unsigned rangeCount)
+{
+    //
+    // FNV-1a of the ID.  It only has to spread reads evenly and be the same on every machine.
+    //
+    _uint64 hash = 14695981039346656037ULL;
+    const char *id = read->getId();
+    for (unsigned i = 0; i < read->getIdLength(); i++) {
+        hash = (hash ^ (unsigned char)id[i]) * 1099511628211ULL;
+    }
+    return hash % rangeCount == rangeIndex;
+}
+
+    Read *
+RangeFilteringReadSupplier::getNextRead()
+{
+    Read *read;
+    while (NULL != (read = underlyingSupplier->getNextRead()) && !isInRange(read, rangeIndex, rangeCount)) {
+        // Skip reads in other pieces.  Their batches are released along with everything else from the underlying supplier.
+    }
+    return read;
+}
+
+    ReadSupplier *
+RangeFilteringReadSupplierGenerator::generateNewReadSupplier()
+{
+    ReadSupplier *underlyingSupplier = underlyingGenerator->generateNewReadSupplier();
+    if (NULL == underlyingSupplier) {
+        return NULL;
+    }
+    return new RangeFilteringReadSupplier(underlyingSupplier, rangeIndex, rangeCount);
+}
+
+    bool
+RangeFilteringPairedReadSupplier::getNextReadPair(Read **read1, Read **read2)
+{
+    //
+    // Go by the first read's ID only, since the mates' might differ (/1 and /2, say).
+    //
+    while (underlyingSupplier->getNextReadPair(read1, read2)) {
+        if (RangeFilteringReadSupplier::isInRange(*read1, rangeIndex, rangeCount)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+    PairedReadSupplier *
+RangeFilteringPairedReadSupplierGenerator::generateNewPairedReadSupplier()
+{
+    PairedReadSupplier *underlyingSupplier = underlyingGenerator->generateNewPairedReadSupplier();
+    if (NULL == underlyingSupplier) {
+        return NULL;
+    }
+    return new RangeFilteringPairedReadSupplier(underlyingSupplier, rangeIndex, rangeCount);
+}
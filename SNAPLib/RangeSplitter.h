@@ -31,6 +31,9 @@ Revision History:
 #include "Genome.h"
 #include "AlignerOptions.h"
 
+class FASTQRecordIndex;
+class PairedFASTQReader;
+
 //
 // Utility class for letting multiple threads split chunks of a range to process.
 // This is used by the parallel versions of the aligners.
@@ -83,6 +86,7 @@ private:
     RangeSplitter *splitter;
     char *fileName;
     bool isSAM;
+    DataSupplier *supplier;     // remote if the file is, otherwise the default
     ReaderContext context;
 };
 
@@ -116,7 +120,135 @@ private:
     char *fileName1;
     char *fileName2;
     enum FileType fileType;
+    DataSupplier *supplier;     // remote if either file is, since the remote reader can read local files too
     ReaderContext context;
     bool quicklyDropUnpairedReads;
 };
 
+
+//
+// Splits a pair of FASTQ files into runs of record numbers rather than of offsets, for when the mates aren't at the same
+// offsets in both.  Each thread finds its runs in both files itself, using a FASTQRecordIndex of each, so pairs are still
+// read without any hand-off between threads.
+//
+class RecordSplittingPairedReadSupplier : public PairedReadSupplier {
+public:
+    RecordSplittingPairedReadSupplier(RangeSplitter *i_splitter, FASTQRecordIndex **i_indexes, PairedFASTQReader *i_underlyingReader) :
+        splitter(i_splitter), indexes(i_indexes), underlyingReader(i_underlyingReader) {}
+
+    virtual ~RecordSplittingPairedReadSupplier() {}
+
+    virtual bool getNextReadPair(Read **read1, Read **read2);
+
+    // Points the reader at the next run of records, or returns false if there aren't any more
+    bool nextRange();
+
+    virtual void releaseBatch(DataBatch batch);
+
+private:
+    RangeSplitter *splitter;
+    FASTQRecordIndex **indexes;
+    PairedFASTQReader *underlyingReader;
+    Read internalRead1;
+    Read internalRead2;
+};
+
+class RecordSplittingPairedReadSupplierGenerator: public PairedReadSupplierGenerator {
+public:
+    RecordSplittingPairedReadSupplierGenerator(const char *i_fileName1, const char *i_fileName2, unsigned numThreads, const ReaderContext& context);
+    ~RecordSplittingPairedReadSupplierGenerator();
+
+    PairedReadSupplier *generateNewPairedReadSupplier();
+
+private:
+    RangeSplitter *splitter;
+    FASTQRecordIndex *indexes[2];
+    char *fileNames[2];
+    DataSupplier *supplier;
+    ReaderContext context;
+};
+
+//
+// With -range i/N (ReaderContext's rangeIndex and rangeCount) a run only reads part of each input, so that N runs together
+// cover all of it.  Inputs that go through a RangeSplitter just get the i'th N'th of the file's bytes (a record belongs to
+// the piece that it starts in, the same as with the threads' ranges).  Anything that has to be read sequentially
+// (compressed files, BAM, stdin, mates in two FASTQ files of differing sizes) is read in full and wrapped by
+// RestrictToRange or RestrictPairsToRange, which only pass on the reads (or pairs) whose ID hashes into this piece.  Either
+// way each read goes to exactly one of the N runs.
+//
+void GetRangeOfFile(const ReaderContext& context, _int64 fileSize, _int64 *rangeBegin, _int64 *rangeEnd);
+
+ReadSupplierGenerator *RestrictToRange(ReadSupplierGenerator *generator, const ReaderContext& context);
+PairedReadSupplierGenerator *RestrictPairsToRange(PairedReadSupplierGenerator *generator, const ReaderContext& context);
+
+class RangeFilteringReadSupplier : public ReadSupplier {
+public:
+    RangeFilteringReadSupplier(ReadSupplier *i_underlyingSupplier, unsigned i_rangeIndex, unsigned i_rangeCount) :
+        underlyingSupplier(i_underlyingSupplier), rangeIndex(i_rangeIndex), rangeCount(i_rangeCount) {}
+
+    virtual ~RangeFilteringReadSupplier() {delete underlyingSupplier;}
+
+    virtual Read *getNextRead();
+
+    virtual void releaseBatch(DataBatch batch)
+    { underlyingSupplier->releaseBatch(batch); }
+
+    virtual bool isReadReady() {return underlyingSupplier->isReadReady();}
+
+    static bool isInRange(Read *read, unsigned rangeIndex, unsigned rangeCount);
+
+private:
+    ReadSupplier *underlyingSupplier;
+    unsigned rangeIndex;
+    unsigned rangeCount;
+};
+
+class RangeFilteringReadSupplierGenerator : public ReadSupplierGenerator {
+public:
+    RangeFilteringReadSupplierGenerator(ReadSupplierGenerator *i_underlyingGenerator, unsigned i_rangeIndex, unsigned i_rangeCount) :
+        underlyingGenerator(i_underlyingGenerator), rangeIndex(i_rangeIndex), rangeCount(i_rangeCount) {}
+
+    virtual ~RangeFilteringReadSupplierGenerator() {delete underlyingGenerator;}
+
+    ReadSupplier *generateNewReadSupplier();
+
+private:
+    ReadSupplierGenerator *underlyingGenerator;
+    unsigned rangeIndex;
+    unsigned rangeCount;
+};
+
+class RangeFilteringPairedReadSupplier : public PairedReadSupplier {
+public:
+    RangeFilteringPairedReadSupplier(PairedReadSupplier *i_underlyingSupplier, unsigned i_rangeIndex, unsigned i_rangeCount) :
+        underlyingSupplier(i_underlyingSupplier), rangeIndex(i_rangeIndex), rangeCount(i_rangeCount) {}
+
+    virtual ~RangeFilteringPairedReadSupplier() {delete underlyingSupplier;}
+
+    virtual bool getNextReadPair(Read **read1, Read **read2);
+
+    virtual void releaseBatch(DataBatch batch)
+    { underlyingSupplier->releaseBatch(batch); }
+
+    virtual bool isReadReady() {return underlyingSupplier->isReadReady();}
+
+private:
+    PairedReadSupplier *underlyingSupplier;
+    unsigned rangeIndex;
+    unsigned rangeCount;
+};
+
+class RangeFilteringPairedReadSupplierGenerator : public PairedReadSupplierGenerator {
+public:
+    RangeFilteringPairedReadSupplierGenerator(PairedReadSupplierGenerator *i_underlyingGenerator, unsigned i_rangeIndex, unsigned i_rangeCount) :
+        underlyingGenerator(i_underlyingGenerator), rangeIndex(i_rangeIndex), rangeCount(i_rangeCount) {}
+
+    virtual ~RangeFilteringPairedReadSupplierGenerator() {delete underlyingGenerator;}
+
+    PairedReadSupplier *generateNewPairedReadSupplier();
+
+private:
+    PairedReadSupplierGenerator *underlyingGenerator;
+    unsigned rangeIndex;
+    unsigned rangeCount;
+};
@@ -30,10 +30,13 @@ Revision History:
 #include "DataReader.h"
 #include "DataWriter.h"
 #include "directions.h"
+#include "Genome.h"
 
-class FileFormat;
+#if     defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
 
-class Genome;
+class FileFormat;
 
 struct PairedAlignmentResult;
 
@@ -41,6 +44,40 @@ enum AlignmentResult {NotFound, SingleHit, MultipleHits, SecondaryHit, UnknownAl
 
 bool isAValidAlignmentResult(AlignmentResult result);
 
+//
+// Where a spliced alignment jumps over an intron.  The first readOffset bases of the (clipped) read, in the direction
+// it aligned, go at the alignment's genome location and the rest at secondLocation; the intron is what's in between.
+//
+struct SpliceJunction {
+    unsigned    readOffset;
+    GenomeLocation secondLocation;
+    char        strand;         // The transcript's strand ('+' or '-') going by the splice motif, or 0 if it isn't a known one
+};
+
+//
+// Where a chimeric read aligns as two pieces rather than as a whole: the first readOffset bases of the (clipped) read,
+// as it was read, are the front piece and the rest the back.  The longer piece is the read's primary alignment, whose
+// location, direction and MAPQ are the ones in the alignment result; the other piece's are here.
+//
+struct SplitAlignment {
+    unsigned    readOffset;
+    bool        primaryIsFront;
+    int         primaryScore;   // Edits in the primary piece; the result's score is both pieces'
+    GenomeLocation otherLocation;
+    Direction   otherDirection;
+    int         otherMapq;
+    int         otherScore;
+};
+
+//
+// What a record for one piece of a split read has that an ordinary one doesn't: the supplementary flag, unless it's the
+// primary piece, and an SA tag giving the other piece's alignment.
+//
+struct SplitRecord {
+    bool        supplementary;
+    const char *otherAlignment;     // The SA tag's value: rname,pos,strand,CIGAR,mapQ,NM;
+};
+
 //#define LONG_READS
 #ifdef LONG_READS
 #define MAX_READ_LENGTH 100000
@@ -83,6 +120,8 @@ bool isAValidAlignmentResult(AlignmentResult result);
 const int MaxReadLength = MAX_READ_LENGTH;
 
 class Read;
+class ReadTrimmer;
+class ReadScreen;
 
 enum ReadClippingType {NoClipping, ClipFront, ClipBack, ClipFrontAndBack};
 
@@ -92,11 +131,15 @@ struct ReaderContext
     const char*         defaultReadGroup;
     ReadClippingType    clipping;
     bool                paired;
-    bool                ignoreSecondaryAlignments;   // Should we just ignore reads with the Secondary Alignment bit set?
+    bool                ignoreSecondaryAlignments;   // Should we just ignore reads with the Secondary (or Supplementary) Alignment bit set?
     const char*         header; // allocated buffer for header
     size_t              headerLength; // length of string
     size_t              headerBytes; // bytes used for header in file
     bool                headerMatchesIndex; // header refseq matches current index
+    unsigned            rangeIndex; // with -range, read only this piece (0 based) of each input...
+    unsigned            rangeCount; // ...out of this many; 1 to read all of it
+    const ReadTrimmer*  trimmer;    // for adapter and quality trimming of FASTQ reads as they're parsed, or NULL
+    const ReadScreen*   screen;     // for marking the FASTQ reads to screen out as they're parsed, or NULL
 };
 
 class ReadReader {
@@ -112,6 +155,9 @@ public:
 
     virtual void releaseBatch(DataBatch batch) = 0;
 
+    // Whether getNextRead would return without waiting for more input to arrive.  Readers that can't tell say true.
+    virtual bool isReadReady() {return true;}
+
 protected:
     ReaderContext context;
 };
@@ -127,8 +173,14 @@ public:
 
     virtual void releaseBatch(DataBatch batch) = 0;
 
+    // Same as ReadReader::isReadReady
+    virtual bool isReadReady() {return true;}
+
     // wrap a single read source with a matcher that buffers reads until their mate is found
     static PairedReadReader* PairMatcher(ReadReader* single, bool autoRelease, bool quicklyDropUnpairedReads);
+
+    // bytes of unmatched reads a matcher keeps in memory before it starts spilling them to a temporary file
+    static _int64 MatcherMemoryLimit;
 };
 
 class ReadSupplier {
@@ -137,6 +189,9 @@ public:
     virtual ~ReadSupplier() {}
 
     virtual void releaseBatch(DataBatch batch) = 0;
+
+    // Whether getNextRead would return (a read or the end of the input) without waiting for a reader.  Suppliers that can't tell say true.
+    virtual bool isReadReady() {return true;}
 };
 
 class PairedReadSupplier {
@@ -146,6 +201,9 @@ public:
     virtual ~PairedReadSupplier() {}
 
     virtual void releaseBatch(DataBatch batch) = 0;
+
+    // Same as ReadSupplier::isReadReady
+    virtual bool isReadReady() {return true;}
 };
 
 class ReadSupplierGenerator {
@@ -169,11 +227,23 @@ public:
     virtual bool writeHeader(const ReaderContext& context, bool sorted, int argc, const char **argv, const char *version, const char *rgLine) = 0;
 
     // write a single read, return true if successful
-    virtual bool writeRead(Read *read, AlignmentResult result, int mapQuality, unsigned genomeLocation, Direction direction) = 0;
+    virtual bool writeRead(Read *read, AlignmentResult result, int mapQuality, GenomeLocation genomeLocation, Direction direction,
+        const SpliceJunction *splice = NULL) = 0;
+
+    //
+    // Write count single reads, as writeRead would one at a time, but formatting as many as fit into the buffer with
+    // each call to it.  A read can appear more than once (for its secondary alignments).  splices, if not NULL, has
+    // each read's junction, or NULL if it isn't spliced.  Return true if successful.
+    //
+    virtual bool writeReads(int count, Read **reads, AlignmentResult *results, int *mapQualities, GenomeLocation *genomeLocations,
+        Direction *directions, const SpliceJunction **splices = NULL) = 0;
 
     // write a pair of reads, return true if successful
     virtual bool writePair(Read *read0, Read *read1, PairedAlignmentResult *result) = 0;
 
+    // send what's been written so far on to the file, rather than waiting for the buffer to fill (for -stream)
+    virtual bool flush() = 0;
+
     // close out this thread
     virtual void close() = 0;
 };
@@ -183,15 +253,81 @@ class DataWriterSupplier;
 class ReadWriterSupplier
 {
 public:
+    virtual ~ReadWriterSupplier() {}
+
     virtual ReadWriter* getWriter() = 0;
 
     virtual void close() = 0;
 
+    //
+    // A non-zero gapPenalty makes the writers generate CIGAR strings with affine gap alignment (see -G).
+    //
     static ReadWriterSupplier* create(const FileFormat* format, DataWriterSupplier* dataSupplier,
-        const Genome* genome);
+        const Genome* genome, unsigned gapPenalty = 0);
 };
 
 #define READ_GROUP_FROM_AUX     ((const char*) -1)
+
+#if     defined(__SSE2__) || defined(_M_X64)
+//
+// Reverses the order of the bytes in a vector.
+//
+inline __m128i ReverseBytes(__m128i bytes)
+{
+    bytes = _mm_shuffle_epi32(bytes, _MM_SHUFFLE(0, 1, 2, 3));
+    bytes = _mm_shufflehi_epi16(_mm_shufflelo_epi16(bytes, _MM_SHUFFLE(2, 3, 0, 1)), _MM_SHUFFLE(2, 3, 0, 1));
+    return _mm_or_si128(_mm_slli_epi16(bytes, 8), _mm_srli_epi16(bytes, 8));
+}
+#endif
+
+//
+// Writes the reverse of length bytes of from into to, which mustn't overlap it.
+//
+inline void ReverseBytes(char *to, const char *from, unsigned length)
+{
+    unsigned i = 0;
+#if     defined(__SSE2__) || defined(_M_X64)
+    for (; i + 16 <= length; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(from + length - i - 16));
+        _mm_storeu_si128((__m128i *)(to + i), ReverseBytes(chunk));
+    }
+#endif
+    for (; i < length; i++) {
+        to[i] = from[length - i - 1];
+    }
+}
+
+//
+// Writes the reverse complement of length bases into rc, which mustn't overlap them.  It's the same as looking each
+// one up in COMPLEMENT, but sixteen at a time for the usual A, C, G, T and N.  A and T add up to the same thing, as do
+// C and G, so their complements are that sum minus themselves, and N is its own complement.  Any chunk with something
+// else in it just uses the table.
+//
+inline void ReverseComplement(char *rc, const char *bases, unsigned length)
+{
+    unsigned i = 0;
+#if     defined(__SSE2__) || defined(_M_X64)
+    const __m128i a = _mm_set1_epi8('A'), c = _mm_set1_epi8('C'), g = _mm_set1_epi8('G'), t = _mm_set1_epi8('T'), n = _mm_set1_epi8('N');
+    const __m128i atSum = _mm_set1_epi8((char)('A' + 'T')), cgSum = _mm_set1_epi8((char)('C' + 'G'));
+    for (; i + 16 <= length; i += 16) {
+        __m128i chunk = ReverseBytes(_mm_loadu_si128((const __m128i *)(bases + length - i - 16)));
+        __m128i isAT = _mm_or_si128(_mm_cmpeq_epi8(chunk, a), _mm_cmpeq_epi8(chunk, t));
+        __m128i isCG = _mm_or_si128(_mm_cmpeq_epi8(chunk, c), _mm_cmpeq_epi8(chunk, g));
+        __m128i isN = _mm_cmpeq_epi8(chunk, n);
+        if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(isAT, isCG), isN)) != 0xffff) {
+            for (unsigned j = i; j < i + 16; j++) {
+                rc[j] = COMPLEMENT[(unsigned char)bases[length - j - 1]];
+            }
+            continue;
+        }
+        __m128i complement = _mm_or_si128(_mm_and_si128(isAT, _mm_sub_epi8(atSum, chunk)), _mm_and_si128(isCG, _mm_sub_epi8(cgSum, chunk)));
+        _mm_storeu_si128((__m128i *)(rc + i), _mm_or_si128(complement, _mm_and_si128(isN, chunk)));
+    }
+#endif
+    for (; i < length; i++) {
+        rc[i] = COMPLEMENT[(unsigned char)bases[length - i - 1]];
+    }
+}
     
 class Read {
 public:
@@ -202,7 +338,7 @@ public:
             upcaseForwardRead(NULL), auxiliaryData(NULL), auxiliaryDataLength(0),
             readGroup(NULL), originalAlignedLocation(-1), originalMAPQ(-1), originalSAMFlags(0),
             originalFrontClipping(0), originalBackClipping(0), originalFrontHardClipping(0), originalBackHardClipping(0),
-            originalRNEXT(NULL), originalRNEXTLength(0), originalPNEXT(0)
+            originalRNEXT(NULL), originalRNEXTLength(0), originalPNEXT(0), inputSequence(-1), screened(false)
         {}
 
         Read(const Read& other) :  localBufferAllocationOffset(0)
@@ -311,6 +447,8 @@ public:
 
             clippingState = other.clippingState;
             batch = other.batch;
+            inputSequence = other.inputSequence;
+            screened = other.screened;
             readGroup = other.readGroup;
             auxiliaryData = other.auxiliaryData;
             auxiliaryDataLength = other.auxiliaryDataLength;
@@ -350,7 +488,7 @@ public:
                 const char *i_data, 
                 const char *i_quality, 
                 unsigned i_dataLength,
-                unsigned i_originalAlignedLocation,
+                GenomeLocation i_originalAlignedLocation,
                 unsigned i_originalMAPQ,
                 unsigned i_originalSAMFlags,
                 unsigned i_originalFrontClipping,
@@ -380,6 +518,7 @@ public:
             originalRNEXTLength = i_originalRNEXTLength;
             originalPNEXT = i_originalPNEXT;
             currentReadDirection = FORWARD;
+            screened = false;
 
             localBufferAllocationOffset = 0;    // Clears out any allocations that might previously have been in the buffer
             upcaseForwardRead = rcData = rcQuality = NULL;
@@ -420,18 +559,22 @@ public:
 		inline ReadClippingType getClippingState() const {return clippingState;}
         inline DataBatch getBatch() { return batch; }
         inline void setBatch(DataBatch b) { batch = b; }
+        inline _int64 getInputSequence() const { return inputSequence; }
+        inline void setInputSequence(_int64 sequence) { inputSequence = sequence; }
+        inline bool isScreened() const { return screened; }
+        inline void setScreened(bool s) { screened = s; }
         inline const char* getReadGroup() const { return readGroup; }
         inline void setReadGroup(const char* rg) { readGroup = rg; }
-        inline unsigned getOriginalAlignedLocation() {return originalAlignedLocation;}
-        inline unsigned getOriginalMAPQ() {return originalMAPQ;}
-        inline unsigned getOriginalSAMFlags() {return originalSAMFlags;}
-        inline unsigned getOriginalFrontClipping() {return originalFrontClipping;}
-        inline unsigned getOriginalBackClipping() {return originalBackClipping;}
-        inline unsigned getOriginalFrontHardClipping() {return originalFrontHardClipping;}
-        inline unsigned getOriginalBackHardClipping() {return originalBackHardClipping;}
-        inline const char *getOriginalRNEXT() {return originalRNEXT;}
-        inline unsigned getOriginalRNEXTLength() {return originalRNEXTLength;}
-        inline unsigned getOriginalPNEXT() {return originalPNEXT;}
+        inline GenomeLocation getOriginalAlignedLocation() const {return originalAlignedLocation;}
+        inline unsigned getOriginalMAPQ() const {return originalMAPQ;}
+        inline unsigned getOriginalSAMFlags() const {return originalSAMFlags;}
+        inline unsigned getOriginalFrontClipping() const {return originalFrontClipping;}
+        inline unsigned getOriginalBackClipping() const {return originalBackClipping;}
+        inline unsigned getOriginalFrontHardClipping() const {return originalFrontHardClipping;}
+        inline unsigned getOriginalBackHardClipping() const {return originalBackHardClipping;}
+        inline const char *getOriginalRNEXT() const {return originalRNEXT;}
+        inline unsigned getOriginalRNEXTLength() const {return originalRNEXTLength;}
+        inline unsigned getOriginalPNEXT() const {return originalPNEXT;}
 
         inline char* getAuxiliaryData(unsigned* o_length, bool * o_isSAM) const
         {
@@ -497,6 +640,18 @@ public:
             clippingState = clipping;
         };
         
+        //
+        // Clips the read down to the length bases starting at offset into its (clipped) data, as though the rest had been
+        // clipped for quality, so that it's written with them soft clipped.  For writing a piece of a split read.
+        //
+        void clipToPiece(unsigned offset, unsigned length) {
+            _ASSERT(offset + length <= dataLength);
+            frontClippedLength += offset;
+            data += offset;
+            quality += offset;
+            dataLength = length;
+        }
+
         unsigned countOfTrailing2sInQuality() const {   // 2 here is represented in Phred+33, or ascii '#'
             unsigned count = 0;
             while (count < dataLength && quality[dataLength - 1 - count] == '#') {
@@ -514,9 +669,7 @@ public:
         }
 
         void computeReverseCompliment(char *outputBuffer) { // Caller guarantees that outputBuffer is at least getDataLength() bytes
-            for (unsigned i = 0; i < dataLength; i++) {
-                outputBuffer[i] = COMPLEMENT[data[dataLength - i - 1]];
-            }
+            ReverseComplement(outputBuffer, data, dataLength);
         }
 
         void becomeRC()
@@ -550,10 +703,8 @@ public:
 
                     _ASSERT(localBufferAllocationOffset <= localBufferLength);
 
-                    for (unsigned i = 0; i < unclippedLength; i++) {
-                        rcData[i] = COMPLEMENT[unclippedData[unclippedLength - i - 1]];
-                        rcQuality[unclippedLength-i-1] = unclippedQuality[i];
-                    }
+                    ReverseComplement(rcData, unclippedData, unclippedLength);
+                    ReverseBytes(rcQuality, unclippedQuality, unclippedLength);
 
                     unclippedData = rcData;
                     unclippedQuality = rcQuality;
@@ -630,7 +781,7 @@ private:
         // Alignment data that was in the read when it was read from a file.  While this should probably also be the place to put
         // information that'll be used by the read writer, for now it's not.  Hence, they're all called "original."
         //
-        unsigned originalAlignedLocation;
+        GenomeLocation originalAlignedLocation;
         unsigned originalMAPQ;
         unsigned originalSAMFlags;
         unsigned originalFrontClipping;
@@ -674,6 +825,12 @@ private:
         // batch for managing lifetime during input
         DataBatch batch;
 
+        // for -ordered, the number of the ReadSupplierQueue slice the read came in, or -1 if it didn't come through one
+        _int64 inputSequence;
+
+        // with -screen, whether the reader found the read in the screen's sequences, so it isn't to be aligned
+        bool screened;
+
          // auxiliary data in BAM or SAM format (can tell by looking at 3rd byte), if available
         char* auxiliaryData;
         unsigned auxiliaryDataLength;
@@ -734,7 +891,7 @@ private:
 //
 class ReadWithOwnMemory : public Read {
 public:
-    ReadWithOwnMemory() : Read(), dataBuffer(NULL), idBuffer(NULL), qualityBuffer(NULL), auxBuffer(NULL) {}
+    ReadWithOwnMemory() : Read(), dataBuffer(NULL), idBuffer(NULL), qualityBuffer(NULL), auxBuffer(NULL), rnextBuffer(NULL) {}
 
     ReadWithOwnMemory(const Read &baseRead) {
         set(baseRead);
@@ -746,10 +903,14 @@ public:
         delete [] idBuffer;
         delete [] qualityBuffer;
         delete [] auxBuffer;
+        delete [] rnextBuffer;
     }
 
-private:
-
+    //
+    // Makes this a copy of baseRead.  It's the same as assigning ReadWithOwnMemory(baseRead), but without building a
+    // temporary and then copying it (local buffer and all) into place.  Like the constructor, it doesn't free anything
+    // this already had, so it's only for reads that are new or have been disposed.
+    //
     void set(const Read &baseRead)
     {
         idBuffer = new char[baseRead.getIdLength()+1];
@@ -765,10 +926,24 @@ private:
         memcpy(qualityBuffer,baseRead.getUnclippedQuality(),baseRead.getUnclippedLength());
         qualityBuffer[baseRead.getUnclippedLength()] = '\0';
     
-        init(idBuffer,baseRead.getIdLength(),dataBuffer,qualityBuffer,baseRead.getUnclippedLength());
+        if (NULL != baseRead.getOriginalRNEXT()) {
+            rnextBuffer = new char[baseRead.getOriginalRNEXTLength() + 1];
+            memcpy(rnextBuffer, baseRead.getOriginalRNEXT(), baseRead.getOriginalRNEXTLength());
+            rnextBuffer[baseRead.getOriginalRNEXTLength()] = '\0';
+        } else {
+            rnextBuffer = NULL;
+        }
+
+        init(idBuffer,baseRead.getIdLength(),dataBuffer,qualityBuffer,baseRead.getUnclippedLength(),
+             baseRead.getOriginalAlignedLocation(), baseRead.getOriginalMAPQ(), baseRead.getOriginalSAMFlags(),
+             baseRead.getOriginalFrontClipping(), baseRead.getOriginalBackClipping(),
+             baseRead.getOriginalFrontHardClipping(), baseRead.getOriginalBackHardClipping(),
+             rnextBuffer, baseRead.getOriginalRNEXTLength(), baseRead.getOriginalPNEXT());
 		clip(baseRead.getClippingState());
 
         setReadGroup(baseRead.getReadGroup());
+        setInputSequence(baseRead.getInputSequence());
+        setScreened(baseRead.isScreened());
         
         unsigned auxlen;
         bool auxsam;
@@ -778,12 +953,16 @@ private:
             memcpy(auxBuffer, aux, auxlen);
             setAuxiliaryData(auxBuffer, auxlen);
         } else {
+            auxBuffer = NULL;
             setAuxiliaryData(NULL, 0);
         }
     }
+
+private:
         
     char *idBuffer;
     char *dataBuffer;
     char *qualityBuffer;
     char *auxBuffer;
+    char *rnextBuffer;
 };
@@ -37,7 +37,7 @@ public:
 
     virtual bool getNextRead(Read *readToUpdate);
     
-    virtual bool getNextRead(Read *read, AlignmentResult *alignmentResult, unsigned *genomeLocation, bool *isRC, unsigned *mapQ,
+    virtual bool getNextRead(Read *read, AlignmentResult *alignmentResult, GenomeLocation *genomeLocation, bool *isRC, unsigned *mapQ,
                     unsigned *flag, const char **cigar)
     {
         // return getNextRead(read,alignmentResult,genomeLocation,isRC,mapQ,flag,false,cigar);
@@ -0,0 +1,360 @@
+/*++
+
+Module Name:
+
+    ReadRouter.cpp
+
+Abstract:
+
+    Send each aligned read to whichever of several outputs want it.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "ReadRouter.h"
+#include "AlignerOptions.h"
+#include "PairedEndAligner.h"
+#include "SAM.h"
+#include "Bam.h"
+#include <algorithm>
+
+ReadRouteFilter::~ReadRouteFilter()
+{
+    delete [] regions;
+    for (int i = 0; i < nReadGroups; i++) {
+        delete [] readGroups[i];
+    }
+    delete [] readGroups;
+}
+
+    ReadRouteFilter *
+ReadRouteFilter::create(const char *spec, const Genome *genome)
+{
+    ReadRouteFilter *filter = new ReadRouteFilter(0);
+
+    int maxRegions = 1;
+    for (const char *c = spec; '\0' != *c; c++) {
+        maxRegions += ',' == *c;
+    }
+    filter->regions = new Region[maxRegions];
+    filter->readGroups = new char *[maxRegions];
+
+    for (const char *next = spec; NULL != next; ) {
+        const char *comma = strchr(next, ',');
+        size_t length = NULL == comma ? strlen(next) : comma - next;
+        if (length > 3 && 0 == strncmp(next, "rg:", 3)) {
+            char *readGroup = new char[length - 2];
+            memcpy(readGroup, next + 3, length - 3);
+            readGroup[length - 3] = '\0';
+            filter->readGroups[filter->nReadGroups++] = readGroup;
+        } else if (1 == length && 'u' == *next) {
+            filter->filterFlags |= AlignerOptions::FilterUnaligned;
+        } else if (1 == length && 'a' == *next) {
+            filter->filterFlags |= AlignerOptions::FilterSingleHit | AlignerOptions::FilterMultipleHits;
+        } else if (1 == length && 's' == *next) {
+            filter->filterFlags |= AlignerOptions::FilterSingleHit;
+        } else {
+            const size_t contigNameBufferSize = 512;
+            char contigName[contigNameBufferSize];
+            const char *colon = (const char *)memchr(next, ':', length);
+            size_t nameLength = NULL == colon ? length : colon - next;
+            GenomeLocation contigOffset;
+            if (0 == nameLength || nameLength >= contigNameBufferSize) {
+                fprintf(stderr, "Invalid region '%.*s' for -route\n", (int)length, next);
+                delete filter;
+                return NULL;
+            }
+            memcpy(contigName, next, nameLength);
+            contigName[nameLength] = '\0';
+            if (! genome->getOffsetOfContig(contigName, &contigOffset)) {
+                fprintf(stderr, "-route region '%.*s' is on a contig that isn't in the index\n", (int)length, next);
+                delete filter;
+                return NULL;
+            }
+
+            GenomeLocation contigLength = genome->getContigAtLocation(contigOffset)->length;
+            _uint64 begin = 1, end = contigLength;
+            if (NULL != colon && (2 != sscanf(colon + 1, "%llu-%llu", &begin, &end) || 0 == begin || end < begin)) {
+                fprintf(stderr, "Invalid region '%.*s' for -route; it should look like chr1:1000-2000\n", (int)length, next);
+                delete filter;
+                return NULL;
+            }
+
+            Region *region = &filter->regions[filter->nRegions++];
+            region->begin = contigOffset + (GenomeLocation)(begin - 1);
+            region->end = contigOffset + (GenomeLocation)__min(end, (_uint64)contigLength);
+        }
+        next = NULL == comma ? NULL : comma + 1;
+    }
+
+    //
+    // Merge overlapping regions, so that passes only has to look at the last one that begins at or before a location.
+    //
+    std::sort(filter->regions, filter->regions + filter->nRegions, Region::before);
+    int nMerged = 0;
+    for (int i = 0; i < filter->nRegions; i++) {
+        if (nMerged > 0 && filter->regions[i].begin <= filter->regions[nMerged - 1].end) {
+            filter->regions[nMerged - 1].end = __max(filter->regions[nMerged - 1].end, filter->regions[i].end);
+        } else {
+            filter->regions[nMerged++] = filter->regions[i];
+        }
+    }
+    filter->nRegions = nMerged;
+
+    return filter;
+}
+
+    bool
+ReadRouteFilter::passes(AlignmentResult result, GenomeLocation location) const
+{
+    if (0 == filterFlags && 0 == nRegions) {
+        return true;
+    }
+
+    switch (result) {
+    case NotFound:
+    case UnknownAlignment:
+        return (filterFlags & AlignerOptions::FilterUnaligned) != 0;
+    case SingleHit:
+        if ((filterFlags & AlignerOptions::FilterSingleHit) != 0) {
+            return true;
+        }
+        break;
+    case MultipleHits:
+        if ((filterFlags & AlignerOptions::FilterMultipleHits) != 0) {
+            return true;
+        }
+        break;
+    case SecondaryHit:
+        break;
+    default:
+        return false; // shouldn't happen!
+    }
+
+    Region key;
+    key.begin = location;
+    const Region *region = std::upper_bound(regions, regions + nRegions, key, Region::before);
+    return region != regions && location < (region - 1)->end;
+}
+
+    bool
+ReadRouteFilter::inReadGroups(Read *read) const
+{
+    if (0 == nReadGroups) {
+        return true;
+    }
+
+    //
+    // Find the read's group, which for SAM or BAM input with RG fields is in its optional fields, as text or binary.
+    //
+    const char *readGroup = read->getReadGroup();
+    size_t readGroupLength = 0;
+    if (READ_GROUP_FROM_AUX != readGroup && NULL != readGroup) {
+        readGroupLength = strlen(readGroup);
+    } else if (READ_GROUP_FROM_AUX == readGroup) {
+        readGroup = NULL;
+        unsigned auxLen;
+        bool auxSAM;
+        char *aux = read->getAuxiliaryData(&auxLen, &auxSAM);
+        if (auxSAM) {
+            for (char *p = aux; p != NULL && p < aux + auxLen; p = SAMReader::skipToBeyondNextRunOfSpacesAndTabs(p, aux + auxLen)) {
+                if (strncmp(p, "RG:Z:", 5) == 0) {
+                    size_t fieldLength;
+                    SAMReader::skipToBeyondNextRunOfSpacesAndTabs(p, aux + auxLen, &fieldLength);
+                    readGroup = p + 5;
+                    readGroupLength = __min(fieldLength, (size_t)(aux + auxLen - p)) - 5;
+                    break;
+                }
+            }
+        } else if (NULL != aux) {
+            for (BAMAlignAux *bamAux = (BAMAlignAux *)aux; (char *)bamAux < aux + auxLen; bamAux = bamAux->next()) {
+                if (bamAux->tag[0] == 'R' && bamAux->tag[1] == 'G' && bamAux->val_type == 'Z') {
+                    readGroup = (const char *)bamAux->value();
+                    readGroupLength = strlen(readGroup);
+                    break;
+                }
+            }
+        }
+    }
+
+    if (NULL == readGroup) {
+        return false;
+    }
+    for (int i = 0; i < nReadGroups; i++) {
+        if (strlen(readGroups[i]) == readGroupLength && 0 == memcmp(readGroups[i], readGroup, readGroupLength)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+class RoutingReadWriter : public ReadWriter
+{
+public:
+    RoutingReadWriter(int i_nRoutes, const ReadRoute *i_routes) : nRoutes(i_nRoutes), routes(i_routes)
+    {
+        for (int i = 0; i < nRoutes; i++) {
+            writers[i] = routes[i].supplier->getWriter();
+        }
+    }
+
+    virtual ~RoutingReadWriter()
+    {
+        for (int i = 0; i < nRoutes; i++) {
+            delete writers[i];
+        }
+    }
+
+    virtual bool writeHeader(const ReaderContext& context, bool sorted, int argc, const char **argv, const char *version, const char *rgLine)
+    {
+        bool worked = true;
+        for (int i = 0; i < nRoutes; i++) {
+            worked &= writers[i]->writeHeader(context, routes[i].sorted, argc, argv, version, rgLine);
+        }
+        return worked;
+    }
+
+    virtual bool writeRead(Read *read, AlignmentResult result, int mapQuality, GenomeLocation genomeLocation, Direction direction,
+        const SpliceJunction *splice)
+    {
+        bool worked = true;
+        for (int i = 0; i < nRoutes; i++) {
+            if (routes[i].filter->passes(result, genomeLocation) && routes[i].filter->inReadGroups(read)) {
+                worked &= writers[i]->writeRead(read, result, mapQuality, genomeLocation, direction, splice);
+            }
+        }
+        return worked;
+    }
+
+    virtual bool writeReads(int count, Read **reads, AlignmentResult *results, int *mapQualities, GenomeLocation *genomeLocations,
+        Direction *directions, const SpliceJunction **splices);
+
+    virtual bool writePair(Read *read0, Read *read1, PairedAlignmentResult *result)
+    {
+        bool worked = true;
+        for (int i = 0; i < nRoutes; i++) {
+            if ((routes[i].filter->passes(result->status[0], result->location[0]) ||
+                 routes[i].filter->passes(result->status[1], result->location[1])) &&
+                routes[i].filter->inReadGroups(read0)) {
+                worked &= writers[i]->writePair(read0, read1, result);
+            }
+        }
+        return worked;
+    }
+
+    virtual bool flush()
+    {
+        bool worked = true;
+        for (int i = 0; i < nRoutes; i++) {
+            worked &= writers[i]->flush();
+        }
+        return worked;
+    }
+
+    virtual void close()
+    {
+        for (int i = 0; i < nRoutes; i++) {
+            writers[i]->close();
+        }
+    }
+
+    static const int MaxRoutes = AlignerOptions::MaxOutputRoutes + 1;     // The -o output too
+
+private:
+    int                 nRoutes;
+    const ReadRoute    *routes;
+    ReadWriter         *writers[MaxRoutes];
+};
+
+    bool
+RoutingReadWriter::writeReads(
+    int count,
+    Read **reads,
+    AlignmentResult *results,
+    int *mapQualities,
+    GenomeLocation *genomeLocations,
+    Direction *directions,
+    const SpliceJunction **splices)
+{
+    //
+    // Hand each route the reads it takes a chunk at a time, so that its writer still formats them together.
+    //
+    const int chunkSize = 64;
+    Read *routedReads[chunkSize];
+    AlignmentResult routedResults[chunkSize];
+    int routedMapQualities[chunkSize];
+    GenomeLocation routedLocations[chunkSize];
+    Direction routedDirections[chunkSize];
+    const SpliceJunction *routedSplices[chunkSize];
+
+    bool worked = true;
+    for (int i = 0; i < nRoutes; i++) {
+        for (int chunk = 0; chunk < count; chunk += chunkSize) {
+            int n = 0;
+            for (int j = chunk; j < count && j < chunk + chunkSize; j++) {
+                if (routes[i].filter->passes(results[j], genomeLocations[j]) && routes[i].filter->inReadGroups(reads[j])) {
+                    routedReads[n] = reads[j];
+                    routedResults[n] = results[j];
+                    routedMapQualities[n] = mapQualities[j];
+                    routedLocations[n] = genomeLocations[j];
+                    routedDirections[n] = directions[j];
+                    routedSplices[n] = NULL == splices ? NULL : splices[j];
+                    n++;
+                }
+            }
+            if (n > 0) {
+                worked &= writers[i]->writeReads(n, routedReads, routedResults, routedMapQualities, routedLocations,
+                    routedDirections, routedSplices);
+            }
+        }
+    }
+    return worked;
+}
+
+class RoutingReadWriterSupplier : public ReadWriterSupplier
+{
+public:
+    RoutingReadWriterSupplier(int i_nRoutes, const ReadRoute *i_routes) : nRoutes(i_nRoutes)
+    {
+        _ASSERT(nRoutes <= RoutingReadWriter::MaxRoutes);
+        routes = new ReadRoute[nRoutes];
+        for (int i = 0; i < nRoutes; i++) {
+            routes[i] = i_routes[i];
+        }
+    }
+
+    ~RoutingReadWriterSupplier()
+    {
+        for (int i = 0; i < nRoutes; i++) {
+            delete routes[i].supplier;
+            delete routes[i].filter;
+        }
+        delete [] routes;
+    }
+
+    virtual ReadWriter* getWriter()
+    {
+        return new RoutingReadWriter(nRoutes, routes);
+    }
+
+    virtual void close()
+    {
+        for (int i = 0; i < nRoutes; i++) {
+            routes[i].supplier->close();
+        }
+    }
+
+private:
+    int         nRoutes;
+    ReadRoute  *routes;
+};
+
+    ReadWriterSupplier *
+RouteReads(int nRoutes, const ReadRoute *routes)
+{
+    return new RoutingReadWriterSupplier(nRoutes, routes);
+}
@@ -0,0 +1,82 @@
+/*++
+
+Module Name:
+
+    ReadRouter.h
+
+Abstract:
+
+    Send each aligned read to whichever of several outputs want it.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "Read.h"
+#include "Genome.h"
+
+//
+// Which reads an output gets: some of -F's classes (aligned, single hit, unaligned) and/or the ones aligned within some
+// regions of the genome.  A read passes if it's in any of them, and a pair if either of its reads is.  Read groups
+// narrow that down rather than adding to it, so an output can get one group's reads (or its unaligned ones, and so on)
+// from a multiplexed run.
+//
+class ReadRouteFilter
+{
+public:
+    //
+    // spec is a comma separated list of u (unaligned), a (aligned), s (single hit), regions, each a contig name
+    // optionally followed by :begin-end (1 based and inclusive, as in samtools), and read groups, each rg: and the ID.
+    // Returns NULL, with a message, if it doesn't parse or names a contig that isn't in the genome.
+    //
+    static ReadRouteFilter *create(const char *spec, const Genome *genome);
+
+    //
+    // Just the -F classes (AlignerOptions::FilterFlags), with 0 meaning everything, as AlignerOptions::passFilter does.
+    //
+    ReadRouteFilter(unsigned i_filterFlags) : filterFlags(i_filterFlags), nRegions(0), regions(NULL), nReadGroups(0), readGroups(NULL) {}
+
+    ~ReadRouteFilter();
+
+    bool passes(AlignmentResult result, GenomeLocation location) const;
+
+    //
+    // Whether the read's in one of the filter's read groups, or true if it doesn't have any.  The read group comes from
+    // -R or the input's RG field.
+    //
+    bool inReadGroups(Read *read) const;
+
+    bool picksReadGroups() const {return nReadGroups > 0;}
+
+private:
+    struct Region {
+        GenomeLocation  begin;
+        GenomeLocation  end;    // Exclusive
+
+        static bool before(const Region &a, const Region &b) {return a.begin < b.begin;}
+    };
+
+    unsigned    filterFlags;
+    int         nRegions;
+    Region     *regions;        // Sorted and merged, so at most one can contain a location
+    int         nReadGroups;
+    char      **readGroups;
+};
+
+struct ReadRoute {
+    ReadWriterSupplier     *supplier;
+    ReadRouteFilter        *filter;
+    bool                    sorted;     // For the header
+};
+
+//
+// A writer supplier whose writers write each read (or pair) to every route whose filter passes it, so that one
+// alignment pass can produce, say, the sorted BAM, the unaligned reads as FASTQ and the reads in some target regions.
+// It takes over the routes' suppliers and filters.
+//
+ReadWriterSupplier *RouteReads(int nRoutes, const ReadRoute *routes);
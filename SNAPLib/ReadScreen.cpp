@@ -0,0 +1,117 @@
+/*++
+
+Module Name:
+
+    ReadScreen.cpp
+
+Abstract:
+
+    Pick out contaminant, rRNA and spike-in reads as they're parsed, before they get to the aligners.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "ReadScreen.h"
+#include "FASTA.h"
+#include "Seed.h"
+#include "Tables.h"
+
+//
+// The k-mers along some bases, a base at a time, skipping any that have an N in them.
+//
+class KmerRoller {
+public:
+    KmerRoller() : kmer((SeedBases)(_uint64) 0, (SeedBases)(_uint64) 0), nValid(0) {}
+
+    //
+    // Shift in the next base, and if the last KmerLength bases are all ACGT set key to the one to look up.
+    //
+    inline bool next(char base, _uint64 *key)
+    {
+        int value = BASE_VALUE[(unsigned char) base];
+        if (value > 3) {
+            nValid = 0;
+            return false;
+        }
+        kmer.shiftIn(value, ReadScreen::KmerLength);
+        if (++nValid < ReadScreen::KmerLength) {
+            return false;
+        }
+        *key = FoldSeedBases(kmer.isBiggerThanItsReverseComplement() ? kmer.getRCBases() : kmer.getBases());
+        return true;
+    }
+
+private:
+    Seed        kmer;
+    unsigned    nValid;
+};
+
+    ReadScreen *
+ReadScreen::create(const char *fastaFile)
+{
+    FILE *file = fopen(fastaFile, "rb");     // ReadFASTAGenome expects it to be there
+    if (NULL != file) {
+        fclose(file);
+    }
+    const Genome *genome = NULL == file ? NULL : ReadFASTAGenome(fastaFile, NULL, true, 0);
+    if (NULL == genome) {
+        fprintf(stderr, "Unable to read the FASTA file '%s' to screen reads with\n", fastaFile);
+        return NULL;
+    }
+
+    //
+    // There are at most as many k-mers as bases, and the set has twice the room it needs so that it stays quick.
+    //
+    _int64 nBases = 0;
+    const Genome::Contig *contigs = genome->getContigs();
+    for (int i = 0; i < genome->getNumContigs(); i++) {
+        nBases += contigs[i].length;
+    }
+    if (nBases > MaxKmers) {
+        fprintf(stderr, "'%s' is too big to screen reads with: it has %lld bases, and at most %lld fit\n", fastaFile, nBases, MaxKmers);
+        delete genome;
+        return NULL;
+    }
+    int capacity = 16;
+    while (capacity < 2 * nBases) {
+        capacity *= 2;
+    }
+
+    FixedSizeSet<_uint64> *kmers = new FixedSizeSet<_uint64>(capacity);
+    for (int i = 0; i < genome->getNumContigs(); i++) {
+        const char *bases = genome->getSubstring(contigs[i].beginningOffset, contigs[i].length);
+        KmerRoller roller;
+        _uint64 key;
+        for (unsigned j = 0; j < contigs[i].length; j++) {
+            if (roller.next(bases[j], &key)) {
+                kmers->add(key);
+            }
+        }
+    }
+    delete genome;
+
+    return new ReadScreen(kmers);
+}
+
+ReadScreen::~ReadScreen()
+{
+    delete kmers;
+}
+
+    bool
+ReadScreen::matches(const char *data, unsigned length) const
+{
+    KmerRoller roller;
+    unsigned nHits = 0;
+    _uint64 key;
+    for (unsigned i = 0; i < length; i++) {
+        if (roller.next(data[i], &key) && kmers->contains(key) && ++nHits == MinKmerHits) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,56 @@
+/*++
+
+Module Name:
+
+    ReadScreen.h
+
+Abstract:
+
+    Pick out contaminant, rRNA and spike-in reads as they're parsed, before they get to the aligners.
+
+Environment:
+
+    User mode service.
+
+    Thread safe once it's built; the reader threads all share one.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "FixedSizeSet.h"
+
+//
+// Libraries can be a good share phiX spike-in or rRNA, and aligning those reads only to throw them away afterward is
+// wasted work.  A screen holds every k-mer of a small FASTA file (the sequences to screen out), each as the smaller
+// of its seed encoding and its reverse complement's, in a compact hash set.  A read that shares at least MinKmerHits
+// of its k-mers with it is screened out: the reader marks it, and the aligner threads count it and write it to the
+// screen's output rather than aligning it.  The read's k-mers are rolled along it a base at a time, so checking one is
+// a shift and a set lookup per base, and it stops as soon as it has enough hits.
+//
+class ReadScreen {
+public:
+    //
+    // Returns NULL, with a message, if the FASTA file can't be read or is too big to screen with.
+    //
+    static ReadScreen *create(const char *fastaFile);
+
+    ~ReadScreen();
+
+    //
+    // Whether a read with these (upper case) bases is one to screen out.
+    //
+    bool matches(const char *data, unsigned length) const;
+
+    _int64 getKmerCount() const {return kmers->getSize();}
+
+    static const unsigned KmerLength = 27;
+    static const unsigned MinKmerHits = 2;
+    static const _int64 MaxKmers = 1 << 24;    // It's for spike-ins and rRNA; whole genomes are for -compete
+
+private:
+    ReadScreen(FixedSizeSet<_uint64> *i_kmers) : kmers(i_kmers) {}
+
+    FixedSizeSet<_uint64>  *kmers;
+};
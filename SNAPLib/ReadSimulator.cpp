@@ -0,0 +1,400 @@
+/*++
+
+Module Name:
+
+    ReadSimulator.cpp
+
+Abstract:
+
+    Simulated reads from a genome, in the style of wgsim, for measuring how fast and how accurately SNAP aligns.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include <math.h>
+#include "ReadSimulator.h"
+#include "Tables.h"
+#include "Read.h"
+#include "FASTQ.h"
+#include "DataWriter.h"
+#include "ParallelTask.h"
+#include "exit.h"
+#include "Util.h"
+
+ReadSimulator::Options::Options()
+    : readLength(100), errorRate(0.02), indelRate(0.001), indelExtension(0.3), meanInsert(500), insertStdDev(50),
+      quality('?'), seed(1)
+{
+}
+
+    double
+ReadSimulator::Random::gaussian()
+{
+    //
+    // Box-Muller.  1 - uniform() is in (0, 1], so the log is finite.
+    //
+    double u1 = 1.0 - uniform();
+    double u2 = uniform();
+    return sqrt(-2.0 * log(u1)) * cos(2.0 * 3.14159265358979323846 * u2);
+}
+
+    unsigned
+ReadSimulator::simulateRead(
+    Random     *random,
+    const char *ref,
+    bool        reverse,
+    size_t      refAvailable,
+    char       *data,
+    unsigned   *o_errors) const
+{
+    unsigned length = 0;
+    unsigned errors = 0;
+    size_t refUsed = 0;
+
+    while (length < options.readLength && refUsed < refAvailable) {
+        if (options.indelRate > 0 && random->uniform() < options.indelRate) {
+            unsigned indelLength = 1;
+            while (random->uniform() < options.indelExtension) {
+                indelLength++;
+            }
+            errors++;
+            if (random->next() & 1) {
+                for (unsigned i = 0; i < indelLength && length < options.readLength; i++) {
+                    data[length++] = VALUE_BASE[random->next() & 3];
+                }
+            } else {
+                refUsed += __min((size_t)indelLength, refAvailable - refUsed);
+            }
+            continue;
+        }
+
+        char base = reverse ? COMPLEMENT[(unsigned char)ref[-(_int64)refUsed]] : ref[refUsed];
+        refUsed++;
+
+        if (options.errorRate > 0 && random->uniform() < options.errorRate) {
+            unsigned value = BASE_VALUE[(unsigned char)base];
+            base = value > 3 ? VALUE_BASE[random->next() & 3] : VALUE_BASE[(value + 1 + random->next() % 3) & 3];
+            errors++;
+        }
+        data[length++] = base;
+    }
+
+    *o_errors = errors;
+    return length;
+}
+
+    unsigned
+ReadSimulator::generate(
+    _uint64     readNumber,
+    char       *id,
+    char       *data[2],
+    unsigned    o_lengths[2]) const
+{
+    Random random(options.seed * 0x9e3779b97f4a7c15ULL + readNumber);
+    bool paired = NULL != data[1];
+
+    //
+    // The window around the fragment leaves room for deletions to run past its end.
+    //
+    const unsigned margin = options.readLength;
+    const unsigned MaxAttempts = 1000;
+
+    for (unsigned attempt = 0; attempt < MaxAttempts; attempt++) {
+        unsigned fragmentLength = options.readLength;
+        if (paired) {
+            double length = options.meanInsert + options.insertStdDev * random.gaussian();
+            fragmentLength = length < options.readLength ? options.readLength : (unsigned)length;
+        }
+
+        size_t windowLength = (size_t)fragmentLength + 2 * margin;
+        if (windowLength >= genome->getCountOfBases()) {
+            break;
+        }
+
+        size_t windowStart = (size_t)(random.next() % (genome->getCountOfBases() - windowLength));
+        const char *window = genome->getSubstring(windowStart, windowLength);
+        if (NULL == window) {
+            continue;   // Across a contig boundary
+        }
+
+        const char *fragment = window + margin;
+        unsigned nNs = 0;
+        for (unsigned i = 0; i < fragmentLength; i++) {
+            if (BASE_VALUE[(unsigned char)fragment[i]] > 3) {
+                nNs++;
+            }
+        }
+        if (nNs > fragmentLength / 20) {
+            continue;
+        }
+
+        //
+        // The first read is from either strand; the second is from the other end of the fragment, on the other strand.
+        //
+        bool firstReverse = random.uniform() < 0.5;
+        unsigned errors[2] = {0, 0};
+        for (int i = 0; i < (paired ? 2 : 1); i++) {
+            bool reverse = firstReverse != (1 == i);
+            const char *ref = reverse ? fragment + fragmentLength - 1 : fragment;
+            o_lengths[i] = simulateRead(&random, ref, reverse, fragmentLength + margin, data[i], &errors[i]);
+        }
+
+        GenomeLocation fragmentStart = (GenomeLocation)(windowStart + margin);
+        const Genome::Contig *contig = genome->getContigAtLocation(fragmentStart);
+        _int64 start = (_int64)(fragmentStart - contig->beginningOffset) + 1;
+
+        int idLength = snprintf(id, MaxIdLength, "%.*s_%lld_%lld_%u:0:0_%u:0:0_%llx", contig->nameLength, contig->name,
+            start, start + fragmentLength - 1, errors[0], errors[1], readNumber);
+        return __min((unsigned)idLength, MaxIdLength - 1);
+    }
+
+    fprintf(stderr, "ReadSimulator: couldn't find anywhere in the genome to put a %s of length %u\n", paired ? "pair" : "read",
+        paired ? options.meanInsert : options.readLength);
+    return 0;
+}
+
+namespace {
+
+struct SimulatorContext : public TaskContextBase
+{
+    static const unsigned ChunkSize = 4096;
+
+    const ReadSimulator        *simulator;
+    unsigned                    readLength;
+    char                        quality;
+    _int64                      nReads;                 // Reads, or pairs
+    volatile _int64            *nextChunk;
+    bool                        paired;
+    DataWriterSupplier         *outputs[2];             // outputs[1] is NULL for single-ended or interleaved output
+    FASTQWriter                *sharedWriters[2];       // For two output files, shared so that their batches stay in step
+    ExclusiveLock              *sharedWritersLock;
+
+    _int64                      nGenerated;
+
+    void initializeThread() {}
+    void runThread();
+    void finishThread(SimulatorContext *common) {
+        common->nGenerated += nGenerated;   // ParallelTask calls finishThread for each thread in turn
+    }
+};
+
+    static void
+SimulatorWriteFailed()
+{
+    fprintf(stderr, "snap simulate: unable to write a read\n");
+    soft_exit(1);
+}
+
+    void
+SimulatorContext::runThread()
+{
+    FASTQWriter *writers[2] = {NULL, NULL};
+    bool shared = NULL != outputs[1];
+    if (shared) {
+        writers[0] = sharedWriters[0];
+        writers[1] = sharedWriters[1];
+    } else {
+        writers[0] = new FASTQWriter(outputs[0]);
+    }
+
+    char *ids = new char[ChunkSize * ReadSimulator::MaxIdLength];
+    unsigned *idLengths = new unsigned[ChunkSize];
+    char *bases = new char[ChunkSize * 2 * readLength];
+    unsigned *lengths = new unsigned[ChunkSize * 2];
+    char *qualities = new char[readLength];
+    memset(qualities, quality, readLength);
+
+    Read reads[2];
+    nGenerated = 0;
+
+    for (;;) {
+        _int64 first = (InterlockedAdd64AndReturnNewValue(nextChunk, 1) - 1) * ChunkSize;
+        if (first >= nReads) {
+            break;
+        }
+
+        unsigned n = (unsigned)__min((_int64)ChunkSize, nReads - first);
+        for (unsigned i = 0; i < n; i++) {
+            char *data[2] = {bases + 2 * i * readLength, paired ? bases + (2 * i + 1) * readLength : NULL};
+            idLengths[i] = simulator->generate(first + i, ids + i * ReadSimulator::MaxIdLength, data, lengths + 2 * i);
+            if (0 == idLengths[i]) {
+                soft_exit(1);
+            }
+        }
+
+        if (shared) {
+            AcquireExclusiveLock(sharedWritersLock);
+        }
+
+        for (unsigned i = 0; i < n; i++) {
+            for (int j = 0; j < (paired ? 2 : 1); j++) {
+                reads[j].init(ids + i * ReadSimulator::MaxIdLength, idLengths[i], bases + (2 * i + j) * readLength, qualities,
+                    lengths[2 * i + j]);
+            }
+
+            bool worked;
+            if (!paired) {
+                worked = writers[0]->writeRead(&reads[0]);
+            } else if (!shared) {
+                worked = writers[0]->writePair(&reads[0], &reads[1]);
+            } else {
+                worked = writers[0]->writeRead(&reads[0], 1) && writers[1]->writeRead(&reads[1], 2);
+            }
+            if (!worked) {
+                SimulatorWriteFailed();
+            }
+        }
+
+        if (shared) {
+            ReleaseExclusiveLock(sharedWritersLock);
+        }
+
+        nGenerated += n;
+    }
+
+    if (!shared) {
+        delete writers[0];
+    }
+    delete [] ids;
+    delete [] idLengths;
+    delete [] bases;
+    delete [] lengths;
+    delete [] qualities;
+}
+
+} // namespace
+
+    static void
+SimulateUsage()
+{
+    ReadSimulator::Options defaults;
+    fprintf(stderr,
+            "Usage: snap simulate <index-dir> <nReads> <output.fq> [<output2.fq> | -i] [<options>]\n"
+            "Generates reads sampled uniformly from the genome of an index, with sequencing errors and indels, in the style of\n"
+            "wgsim.  Each read's ID says where it came from, so the alignments can be scored with ComputeROC.  With a second\n"
+            "output file it generates nReads pairs, one end into each file; -i instead interleaves the pairs in output.fq.\n"
+            "Outputs whose names end in .gz are gzip compressed (as BGZF).\n"
+            "Options:\n"
+            "  -l   read length (default %u)\n"
+            "  -e   substitution error rate per base (default %g)\n"
+            "  -r   indel rate per base (default %g), half of them insertions\n"
+            "  -X   chance that an indel is extended by another base (default %g)\n"
+            "  -d   mean fragment length for pairs (default %u)\n"
+            "  -s   standard deviation of the fragment length (default %u)\n"
+            "  -q   Phred quality given to every base (default %d)\n"
+            "  -S   random seed (default %llu); the same seed gives the same reads whatever the number of threads\n"
+            "  -t   number of threads (default is the number of processors)\n",
+            defaults.readLength, defaults.errorRate, defaults.indelRate, defaults.indelExtension, defaults.meanInsert,
+            defaults.insertStdDev, defaults.quality - 33, defaults.seed);
+    soft_exit(1);
+}
+
+    void
+ReadSimulator::runSimulator(
+    int argc,
+    const char **argv)
+{
+    if (argc < 3) {
+        SimulateUsage();
+    }
+
+    const char *indexDir = argv[0];
+    _int64 nReads = strtoll(argv[1], NULL, 10);
+    const char *outputFileName = argv[2];
+    const char *outputFileName2 = NULL;
+    int n = 3;
+    if (n < argc && (argv[n][0] != '-' || !strcmp(argv[n], "-i"))) {
+        outputFileName2 = argv[n];
+        n++;
+    }
+    if (nReads <= 0) {
+        SimulateUsage();
+    }
+
+    Options options;
+    unsigned nThreads = GetNumberOfProcessors();
+    for (; n < argc; n++) {
+        if (n + 1 >= argc || argv[n][0] != '-' || argv[n][1] == '\0' || argv[n][2] != '\0') {
+            SimulateUsage();
+        }
+        const char *value = argv[n + 1];
+        switch (argv[n][1]) {
+            case 'l': options.readLength = atoi(value); break;
+            case 'e': options.errorRate = atof(value); break;
+            case 'r': options.indelRate = atof(value); break;
+            case 'X': options.indelExtension = atof(value); break;
+            case 'd': options.meanInsert = atoi(value); break;
+            case 's': options.insertStdDev = atoi(value); break;
+            case 'q': options.quality = (char)(atoi(value) + 33); break;
+            case 'S': options.seed = strtoull(value, NULL, 10); break;
+            case 't': nThreads = atoi(value); break;
+            default: SimulateUsage();
+        }
+        n++;
+    }
+
+    if (0 == options.readLength || options.readLength > MAX_READ_LENGTH || 0 == nThreads || options.indelExtension >= 1.0 ||
+        options.quality < '!' || options.quality > '~') {
+        SimulateUsage();
+    }
+
+    static const char *genomeSuffix = "Genome";
+    size_t filenameLen = strlen(indexDir) + 1 + strlen(genomeSuffix) + 1;
+    char *fileName = new char[filenameLen];
+    snprintf(fileName, filenameLen, "%s%c%s", indexDir, PATH_SEP, genomeSuffix);
+    const Genome *genome = Genome::loadFromFile(fileName, 0);
+    if (NULL == genome) {
+        fprintf(stderr, "Unable to load genome from file '%s'\n", fileName);
+        soft_exit(1);
+    }
+    delete [] fileName;
+
+    ReadSimulator simulator(genome, options);
+
+    volatile _int64 nextChunk = 0;
+    ExclusiveLock sharedWritersLock;
+    InitializeExclusiveLock(&sharedWritersLock);
+
+    SimulatorContext common;
+    common.totalThreads = nThreads;
+    common.bindToProcessors = false;
+    common.simulator = &simulator;
+    common.readLength = options.readLength;
+    common.quality = options.quality;
+    common.nReads = nReads;
+    common.nextChunk = &nextChunk;
+    common.paired = NULL != outputFileName2;
+    common.outputs[0] = FASTQWriter::createSupplier(outputFileName);
+    common.outputs[1] = NULL;
+    common.sharedWriters[0] = common.sharedWriters[1] = NULL;
+    common.sharedWritersLock = &sharedWritersLock;
+    common.nGenerated = 0;
+
+    if (NULL != outputFileName2 && strcmp(outputFileName2, "-i")) {
+        common.outputs[1] = FASTQWriter::createSupplier(outputFileName2);
+        for (int i = 0; i < 2; i++) {
+            common.sharedWriters[i] = new FASTQWriter(common.outputs[i]);
+        }
+    }
+
+    ParallelTask<SimulatorContext> task(&common);
+    task.run();
+
+    for (int i = 0; i < 2; i++) {
+        delete common.sharedWriters[i];
+        if (NULL != common.outputs[i]) {
+            common.outputs[i]->close();
+            delete common.outputs[i];
+        }
+    }
+    DestroyExclusiveLock(&sharedWritersLock);
+
+    fprintf(stderr, "Simulated %lld %s in %llds (%lld/s)\n", common.nGenerated, common.paired ? "pairs" : "reads",
+        common.time / 1000, common.nGenerated * 1000 / __max(common.time, (_int64)1));
+
+    delete genome;
+}
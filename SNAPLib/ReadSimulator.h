@@ -0,0 +1,98 @@
+/*++
+
+Module Name:
+
+    ReadSimulator.h
+
+Abstract:
+
+    Simulated reads from a genome, in the style of wgsim, for measuring how fast and how accurately SNAP aligns.
+
+Environment:
+
+    User mode service.
+
+    A ReadSimulator is thread safe; all of its state is per read.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "Genome.h"
+
+//
+// Samples reads (or pairs) uniformly from the genome, skipping places with too many Ns, and then adds sequencing errors
+// and indels at the given per-base rates.  Each read's ID says where it came from the way wgsim's do,
+// contig_start_end_e1:0:0_e2:0:0_number, with the (one-based) fragment start and end and each end's count of errors,
+// so that ComputeROC and wgsimReadMisaligned can tell whether it was aligned to the right place.
+//
+// Every read is generated from its own random number stream, seeded from the seed and the read's number, so a given
+// seed always gives the same reads, however many threads make them and in whatever order.
+//
+class ReadSimulator
+{
+public:
+    struct Options {
+        unsigned    readLength;
+        double      errorRate;          // Chance of a substitution at each base
+        double      indelRate;          // Chance of an indel at each base, half of them insertions
+        double      indelExtension;     // Chance that an indel goes on for another base
+        unsigned    meanInsert;         // Of the fragment, for pairs
+        unsigned    insertStdDev;
+        char        quality;            // Given to every base, as Phred+33
+        _uint64     seed;
+
+        Options();
+    };
+
+    ReadSimulator(const Genome *i_genome, const Options &i_options) : genome(i_genome), options(i_options) {}
+
+    //
+    // Generates read readNumber, or pair readNumber if data[1] isn't NULL.  id needs room for MaxIdLength characters and
+    // each data buffer for the read length.  The lengths of the reads go in o_lengths (indels at the very end can leave
+    // them short), and the length of the ID is returned.  Returns 0, with a message, if the genome doesn't have anywhere
+    // to put a read.
+    //
+    unsigned generate(_uint64 readNumber, char *id, char *data[2], unsigned o_lengths[2]) const;
+
+    static const unsigned MaxIdLength = 512;
+
+    //
+    // snap simulate <index-dir> <nReads> <output.fq> [<output2.fq> | -i] [options]
+    //
+    static void runSimulator(int argc, const char **argv);
+
+private:
+
+    //
+    // SplitMix64, which is tiny and good enough for this.
+    //
+    class Random {
+    public:
+        Random(_uint64 seed) : state(seed) {}
+
+        _uint64 next() {
+            _uint64 z = (state += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            return z ^ (z >> 31);
+        }
+
+        double uniform() {return (double)(next() >> 11) * (1.0 / 9007199254740992.0);}    // [0, 1)
+
+        double gaussian();
+
+    private:
+        _uint64 state;
+    };
+
+    //
+    // Copies a read out of the reference, starting at ref and going forward (or backward and complemented, if reverse),
+    // with errors.  There must be room for any deletions in refAvailable.
+    //
+    unsigned simulateRead(Random *random, const char *ref, bool reverse, size_t refAvailable, char *data, unsigned *o_errors) const;
+
+    const Genome   *genome;
+    Options         options;
+};
@@ -26,10 +26,19 @@ Revision History:
 #include "Compat.h"
 #include "ReadSupplierQueue.h"
 #include "exit.h"
+#include "PerfCounters.h"
 #include "SAM.h"
+#include "ParallelTask.h"
+#include "InputOrder.h"
+#include "TraceRecorder.h"
+#include "GenomeIndex.h"
+#include "Seed.h"
 
 //#define PAIR_MATCH_DEBUG
 
+volatile _int64 ReadSupplierQueue::ReadsQueued = 0;
+const GenomeIndex *ReadSupplierQueue::SeedOrderIndex = NULL;
+
  ReadSupplierQueue::ReadSupplierQueue(ReadReader *reader)
      : tracker(64)
 {
@@ -67,6 +76,14 @@ ReadSupplierQueue::commonInit()
     readyQueue[0].next = readyQueue[0].prev = &readyQueue[0];
     readyQueue[1].next = readyQueue[1].prev = &readyQueue[1];
 
+    readyRing = new ReadyRingCell[ReadyRingSize];
+    for (unsigned i = 0; i < ReadyRingSize; i++) {
+        readyRing[i].sequence = i;
+    }
+    readyRingEnqueuePosition = 0;
+    readyRingDequeuePosition = 0;
+    slicesPublished = 0;
+
     InitializeExclusiveLock(&lock);
     CreateEventObject(&readsReady);
     CreateEventObject(&emptyBuffersAvailable);
@@ -97,9 +114,23 @@ ReadSupplierQueue::~ReadSupplierQueue()
     delete singleReader[1];
     delete pairedReader;
 
+    //
+    // Everything's been consumed by now, so all of the elements are back on the empty queue (or, for two readers, still
+    // waiting on a ready queue for a partner that never came).
+    //
+    ReadQueueElement *queues[] = {emptyQueue, &readyQueue[0], &readyQueue[1]};
+    for (int i = 0; i < 3; i++) {
+        while (queues[i]->next != queues[i]) {
+            ReadQueueElement *element = queues[i]->next;
+            element->removeFromQueue();
+            delete element;
+        }
+    }
+
     DestroyEventObject(&throttle[0]);
     DestroyEventObject(&throttle[1]);
     DestroyExclusiveLock(&lock);
+    delete [] readyRing;
 }
 
 
@@ -181,96 +212,205 @@ ReadSupplierQueue::generateNewPairedReadSupplier()
     return new PairedReadSupplierFromQueue(this, singleReader[1] != NULL);
 }
 
-    ReadQueueElement *
-ReadSupplierQueue::getElement()
+    bool
+ReadSupplierQueue::tryEnqueueSlice(const ReadQueueSlice *slice)
 {
-    _ASSERT(singleReader[1] == NULL);   // i.e., we're doing file (but possibly single or paired end) reads
-    //fprintf(stderr, "Thread %u: getElement wait acquire lock\n", GetThreadId());
-    AcquireExclusiveLock(&lock);
-    //fprintf(stderr, "Thread %u: getElement acquired lock\n", GetThreadId());
-    while (!areAnyReadsReady()) {
-        if (allReadsQueued) {
+    _uint32 position = readyRingEnqueuePosition;
+    for (;;) {
+        ReadyRingCell *cell = &readyRing[position & (ReadyRingSize - 1)];
+        int difference = (int)(cell->sequence - position);
+        if (0 == difference) {
+            _uint32 oldPosition = InterlockedCompareExchange32AndReturnOldValue(&readyRingEnqueuePosition, position + 1, position);
+            if (oldPosition == position) {
+                cell->slice = *slice;
+                //
+                // Bumping the sequence number is what lets the suppliers see the cell, so it has to come after the
+                // slice is written, which the interlocked operation guarantees.
+                //
+                InterlockedCompareExchange32AndReturnOldValue(&cell->sequence, position + 1, position);
+                return true;
+            }
+            position = oldPosition;
+        } else if (difference < 0) {
+            return false;   // The ring is full
+        } else {
+            position = readyRingEnqueuePosition;  // Another reader got this cell first
+        }
+    }
+}
+
+    bool
+ReadSupplierQueue::tryDequeueSlice(ReadQueueSlice *slice)
+{
+    _uint32 position = readyRingDequeuePosition;
+    for (;;) {
+        ReadyRingCell *cell = &readyRing[position & (ReadyRingSize - 1)];
+        int difference = (int)(cell->sequence - (position + 1));
+        if (0 == difference) {
+            _uint32 oldPosition = InterlockedCompareExchange32AndReturnOldValue(&readyRingDequeuePosition, position + 1, position);
+            if (oldPosition == position) {
+                *slice = cell->slice;
+                InterlockedAdd64AndReturnNewValue(&ReadsQueued, -slice->nReads);
+                //
+                // Hand the cell back to the readers for their next trip around the ring.
+                //
+                InterlockedCompareExchange32AndReturnOldValue(&cell->sequence, position + ReadyRingSize, position + 1);
+                return true;
+            }
+            position = oldPosition;
+        } else if (difference < 0) {
+            return false;   // The ring is empty
+        } else {
+            position = readyRingDequeuePosition;  // Another supplier got this cell first
+        }
+    }
+}
+
+    void
+ReadSupplierQueue::publishElement(ReadQueueElement *element, ReadQueueElement *secondElement, int nSuppliers)
+{
+    _ASSERT(element->totalReads > 0 && (NULL == secondElement || secondElement->totalReads == element->totalReads));
+
+    //
+    // Aim to have a couple of slices queued for each supplier.  Paired reads from one reader are stored next to each
+    // other, so those slices have to hold an even number of reads.
+    //
+    int queued = (int)(readyRingEnqueuePosition - readyRingDequeuePosition);
+    int readsPerUnit = (NULL == pairedReader) ? 1 : 2;
+    int nSlices = __max(1, __min(__min(2 * nSuppliers - queued, MaxSlicesPerElement), element->totalReads / MinReadsPerSlice));
+    int readsPerSlice = ((element->totalReads + nSlices - 1) / nSlices + readsPerUnit - 1) / readsPerUnit * readsPerUnit;
+    nSlices = (element->totalReads + readsPerSlice - 1) / readsPerSlice;
+
+    element->secondElement = secondElement;
+    element->reordered = false;
+    if (NULL != SeedOrderIndex && !InputOrder::Enabled) {
+        sortBySeed(element, readsPerUnit);
+    }
+    element->slicesOutstanding = nSlices;   // Before any slice is visible to the suppliers
+    InterlockedAdd64AndReturnNewValue(&ReadsQueued, element->totalReads);
+
+    for (int i = 0; i < nSlices; i++) {
+        ReadQueueSlice slice;
+        slice.element = element;
+        slice.firstRead = i * readsPerSlice;
+        slice.nReads = __min(readsPerSlice, element->totalReads - slice.firstRead);
+        slice.sequence = InterlockedAdd64AndReturnNewValue(&slicesPublished, 1) - 1;
+        while (!tryEnqueueSlice(&slice)) {
             //
-            // Everything's queued and the queue is empty.  No more work.
+            // The ring is much bigger than the number of slices the readers ever have outstanding, so this shouldn't
+            // happen, but if it does the suppliers will empty it without needing anything from us.
             //
-            ReleaseExclusiveLock(&lock);
-            return NULL;
+            SleepForMillis(1);
         }
-        ReleaseExclusiveLock(&lock);
-        //fprintf(stderr, "Thread %u: getElement loop released lock\n", GetThreadId());
-        //fprintf(stderr, "Thread %u: getElement loop wait readsReady\n", GetThreadId());
-        WaitForEvent(&readsReady);
-        //fprintf(stderr, "Thread %u: getElement loop wait acquire lock\n", GetThreadId());
-        AcquireExclusiveLock(&lock);
-        //fprintf(stderr, "Thread %u: getElement loop acquired lock\n", GetThreadId());
     }
+}
 
-    ReadQueueElement *element = readyQueue[0].next;
-    _ASSERT(element != &readyQueue[0]);
-    element->removeFromQueue();
-
-    if (!areAnyReadsReady() && !allReadsQueued) {
-        //fprintf(stderr, "Thread %u: getElement block readsReady\n", GetThreadId());
-        PreventEventWaitersFromProceeding(&readsReady);
+    void
+ReadSupplierQueue::sortBySeed(ReadQueueElement *element, int readsPerUnit)
+{
+    //
+    // Sort on (lookup key, unit) packed into one word, where a unit is a read or a pair; the pairs from one reader are
+    // next to each other in the element, and go by the first read's seed.  Reads with no seed go at the end.
+    //
+    const int UnitBits = 16;
+    const _uint64 NoSeed = ((_uint64)1 << (64 - UnitBits)) - 1;
+    _ASSERT(ReadQueueElement::MaxReadsPerElement <= (1 << UnitBits));
+
+    TraceScope trace("sort reads by seed");
+    const GenomeIndex *index = SeedOrderIndex;
+    unsigned seedLength = index->getSeedLength();
+    int nUnits = element->totalReads / readsPerUnit;
+    _uint64 *keys = new _uint64[nUnits];
+    for (int unit = 0; unit < nUnits; unit++) {
+        const Read *read = &element->reads[unit * readsPerUnit];
+        const char *data = read->getData();
+        _uint64 lookupKey = NoSeed;
+        for (unsigned offset = 0; offset + seedLength <= read->getDataLength(); offset++) {
+            if (Seed::DoesTextRepresentASeed(data + offset, seedLength)) {
+                lookupKey = __min(index->getSeedLookupKey(Seed(data + offset, seedLength)), NoSeed - 1);
+                break;
+            }
+        }
+        keys[unit] = (lookupKey << UnitBits) | unit;
     }
-    ReleaseExclusiveLock(&lock);
-    //fprintf(stderr, "Thread %u: getElement released lock\n", GetThreadId());
+    std::sort(keys, keys + nUnits);
 
-    return element;
+    if (NULL == element->order) {
+        element->order = new int[ReadQueueElement::MaxReadsPerElement];
+    }
+    for (int i = 0; i < nUnits; i++) {
+        int unit = (int)(keys[i] & ((1 << UnitBits) - 1));
+        for (int j = 0; j < readsPerUnit; j++) {
+            element->order[i * readsPerUnit + j] = unit * readsPerUnit + j;
+        }
+    }
+    element->reordered = true;
+    delete [] keys;
 }
 
-        bool 
-ReadSupplierQueue::getElements(ReadQueueElement **element1, ReadQueueElement **element2)
+    bool
+ReadSupplierQueue::getSlice(ReadQueueSlice *slice)
 {
-   _ASSERT(singleReader[1] != NULL);   // i.e., we're doing paired file reads
+    if (tryDequeueSlice(slice)) {
+        return true;
+    }
 
-    //fprintf(stderr, "Thread %u: getElements wait acquire lock\n", GetThreadId());
+    //
+    // The ring was empty.  Check again under the lock, since the readers signal readsReady while holding it, so that
+    // we can't miss the wakeup for a slice queued after we looked.
+    //
     AcquireExclusiveLock(&lock);
-    //fprintf(stderr, "Thread %u: getElements acquired lock\n", GetThreadId());
-    while (!areAnyReadsReady()) {
-        ReleaseExclusiveLock(&lock);
-        //fprintf("Thread %u: getElements loop released lock\n", GetThreadId());
+    for (;;) {
+        if (tryDequeueSlice(slice)) {
+            ReleaseExclusiveLock(&lock);
+            return true;
+        }
+
         if (allReadsQueued) {
             //
             // Everything's queued and the queue is empty.  No more work.
             //
-            return NULL;
+            ReleaseExclusiveLock(&lock);
+            return false;
         }
-        //fprintf(stderr, "Thread %u: getElements loop wait readsReady\n", GetThreadId());
-        WaitForEvent(&readsReady);
-        //fprintf(stderr, "Thread %u: getElements loop wait acquire lock\n", GetThreadId());
-        AcquireExclusiveLock(&lock);
-        //fprintf(stderr, "Thread %u: getElements loop acquired lock\n", GetThreadId());
-    }
 
-    *element1 = readyQueue[0].next;
-    (*element1)->removeFromQueue();
-    *element2 = readyQueue[1].next;
-    (*element2)->removeFromQueue();
-    //fprintf(stderr, "getElements %x/%x with %d/%d reads\n", (int) (*element1), (int) (*element2), (*element1)->totalReads, (*element2)->totalReads);
-
-    if (!areAnyReadsReady() && !allReadsQueued) {
-        //fprintf(stderr, "Thread %u: getElements block readsReady\n", GetThreadId());
+        //
+        // Out of reads, most likely because the input is still being decompressed; help with that while we wait.
+        //
         PreventEventWaitersFromProceeding(&readsReady);
+        ReleaseExclusiveLock(&lock);
+        {
+            PerfTimer timer(PerfCounters::QueueWait);
+            TraceScope trace("wait for reads");
+            WorkPool::helpUntil(&readsReady);
+        }
+        AcquireExclusiveLock(&lock);
     }
- 
-    ReleaseExclusiveLock(&lock);
-    //fprintf(stderr, "Thread %u: getElements released lock\n", GetThreadId());
-    return true;
 }
 
     bool
-ReadSupplierQueue::areAnyReadsReady() // must hold the lock to call this.
+ReadSupplierQueue::isSliceReady()
 {
-    if (readyQueue[0].next == &readyQueue[0]) {
-        return false;
-    }
+    //
+    // Peek at the cell that the next dequeue would take, the same test tryDequeueSlice makes.  Once everything's
+    // queued an empty ring means getSlice returns false straight away, which is also ready.
+    //
+    _uint32 position = readyRingDequeuePosition;
+    return readyRing[position & (ReadyRingSize - 1)].sequence == position + 1 || allReadsQueued;
+}
 
-    if (singleReader[1] == NULL) {
-        return true;
+    void
+ReadSupplierQueue::doneWithSlice(const ReadQueueSlice *slice)
+{
+    ReadQueueElement *element = slice->element;
+    if (0 == InterlockedDecrementAndReturnNewValue(&element->slicesOutstanding)) {
+        ReadQueueElement *secondElement = element->secondElement;
+        element->secondElement = NULL;
+        doneWithElement(element);
+        if (NULL != secondElement) {
+            doneWithElement(secondElement);
+        }
     }
-
-    return readyQueue[1].next != &readyQueue[1];
 }
 
     void 
@@ -319,10 +459,13 @@ ReadSupplierQueue::releaseBatch(
     AcquireExclusiveLock(&lock);
     //fprintf(stderr, "Thread %u: releaseBatch acquired lock\n", GetThreadId());
     bool removed = tracker.removeRead(batch);
-    ReleaseExclusiveLock(&lock);
-    //fprintf(stderr, "Thread %u: releaseBatch released lock\n", GetThreadId());
     //fprintf(stderr, "ReadSupplierQueue thread %u releaseBatch %d:%d%s\n", GetThreadId(), batch.fileID, batch.batchID, removed ? " done" : " pending");
 
+    //
+    // Pass the release on while still holding the lock, so that it can't be overtaken by the reader thread adding
+    // more reads from the same batch.  That way a reader sees a release only after everything it had handed
+    // out from the batch by the time it was tracked is done with (PairedReadMatcher depends on this).
+    //
     if (removed) {
         if (pairedReader != NULL) {
             pairedReader->releaseBatch(batch);
@@ -332,6 +475,30 @@ ReadSupplierQueue::releaseBatch(
             singleReader[batch.fileID % 2]->releaseBatch(DataBatch(batch.batchID, batch.fileID / 2));
         }
     }
+    ReleaseExclusiveLock(&lock);
+    //fprintf(stderr, "Thread %u: releaseBatch released lock\n", GetThreadId());
+}
+
+//
+// When streaming input runs dry the reader thread hands on a partly filled element, though the reader is still in the
+// middle of its batch.  The suppliers could finish with the element, and so release the batch, before the reader
+// gets any more of it, so the reader thread keeps an extra hold on it until the next element tracks it or the
+// reader has moved on.
+//
+    void
+ReadSupplierQueue::holdBatch(
+    DataBatch batch,
+    DataBatch* io_heldBatch,
+    bool* io_holdingBatch)
+{
+    AcquireExclusiveLock(&lock);
+    tracker.addRead(batch);
+    ReleaseExclusiveLock(&lock);
+    if (*io_holdingBatch) {
+        releaseBatch(*io_heldBatch);
+    }
+    *io_heldBatch = batch;
+    *io_holdingBatch = true;
 }
 
     void
@@ -369,6 +536,8 @@ ReadSupplierQueue::ReaderThread(ReaderThreadParams *params)
     bool fixedElementSize = false;
     Read* extraReads = NULL;
     int extraReadCount = 0;
+    DataBatch heldBatch;
+    bool holdingBatch = false;
 
     while (!done) {
         if ((!isSingleReader) && balance * balanceIncrement > MaxImbalance) {
@@ -381,7 +550,10 @@ ReadSupplierQueue::ReaderThread(ReaderThreadParams *params)
             processingTime += now - startTime;
             startTime = now;
 
-            WaitForEvent(&throttle[firstOrSecond]);
+            {
+                TraceScope trace("wait for other reader");
+                WaitForEvent(&throttle[firstOrSecond]);
+            }
 
             now = timeInNanos();
             balanceTime += now - startTime;
@@ -399,7 +571,10 @@ ReadSupplierQueue::ReaderThread(ReaderThreadParams *params)
             processingTime += now - startTime;
             startTime = now;
 
-            WaitForEvent(&emptyBuffersAvailable);
+            {
+                TraceScope trace("wait for read buffer");
+                WaitForEvent(&emptyBuffersAvailable);
+            }
 
             now = timeInNanos();
             bufferWaitTime += now - startTime;
@@ -419,7 +594,9 @@ ReadSupplierQueue::ReaderThread(ReaderThreadParams *params)
         // full or the reader finishes or it starts a new batch.
         //
         ReleaseExclusiveLock(&lock);
+        _int64 parseStart = TraceRecorder::Enabled ? PerfTicks() : 0;
         element->totalReads = 0;
+        bool heldThisElement = false;
 read_loop: // might return here once with goto to ensure both threads have same #reads per element
         for (; element->totalReads <= (int) elementSize - increment; element->totalReads += increment) {
             
@@ -444,6 +621,10 @@ read_loop: // might return here once with goto to ensure both threads have same
                 } else if (hasFirstReadForNextElement) {
                     *read = firstReadForNextElement[0];
                     hasFirstReadForNextElement = false;
+                } else if (isSingleReader && element->totalReads > 0 && ! reader->isReadReady()) {
+                    holdBatch(element->reads[element->totalReads - 1].getBatch(), &heldBatch, &holdingBatch);
+                    heldThisElement = true;
+                    break;
                 } else {
                     done = ! reader->getNextRead(read);
                     if (done) {
@@ -473,6 +654,10 @@ read_loop: // might return here once with goto to ensure both threads have same
                     read[0] = firstReadForNextElement[0];
                     read[1] = firstReadForNextElement[1];
                     hasFirstReadForNextElement = false;
+                } else if (element->totalReads > 0 && ! pairedReader->isReadReady()) {
+                    holdBatch(element->reads[element->totalReads - 1].getBatch(), &heldBatch, &holdingBatch);
+                    heldThisElement = true;
+                    break;
                 } else {
                     done = !pairedReader->getNextReadPair(&read[0], &read[1]);
                     if (done) {
@@ -505,6 +690,13 @@ read_loop: // might return here once with goto to ensure both threads have same
                 }
            }
         }
+        if (holdingBatch && (done || ! heldThisElement)) {
+            //
+            // The reader has moved on past the batch it was in the middle of, or this element tracks it.
+            //
+            holdingBatch = false;
+            releaseBatch(heldBatch);
+        }
         if ((! isSingleReader) && (! fixedElementSize)) {
             // one of two paired threads finished first element, try setting shared element size limit
             unsigned n = InterlockedCompareExchange32AndReturnOldValue(&elementSize, element->totalReads, ReadQueueElement::MaxReadsPerElement);
@@ -527,27 +719,30 @@ read_loop: // might return here once with goto to ensure both threads have same
         }
 
         //fprintf(stderr, "ReadSupplierQueue element[%d] %x with %d reads %d batches\n", firstOrSecond, (int) element, element->totalReads, element->batches.size());
-        
-        AcquireExclusiveLock(&lock);
-        
-        // do this before AllowEventWaitersToProceed to avoid race condition
-        if (done && 1 == nReadersRunning) {
-            //fprintf(stderr, "Thread %u: set allReadsQueued (%d) in ReaderThread...\n", GetThreadId(), element->totalReads);
-            allReadsQueued = true;
-            AllowEventWaitersToProceed(&readsReady);    // Even if we have nothing to queue, allow the consumers to wake up so they can exit
+
+        if (0 != parseStart) {
+            TraceRecorder::record("read input", parseStart, PerfTicks());
         }
 
+        AcquireExclusiveLock(&lock);
+
+        ReadQueueElement *elementToPublish = NULL;
+        ReadQueueElement *secondElementToPublish = NULL;
         if (element->totalReads > 0) {
-            element->addToTail(&readyQueue[firstOrSecond]);
-            if (isSingleReader || &readyQueue[1-firstOrSecond] != readyQueue[1-firstOrSecond].next) {
+            if (isSingleReader) {
+                elementToPublish = element;
+            } else {
                 //
-                // Signal that an element is ready.
+                // Hold the element until the other reader has filled its matching half.
                 //
-                //fprintf(stderr, "Thread %u: signal readsReady in ReaderThread...\n", GetThreadId());
-                AllowEventWaitersToProceed(&readsReady);
-            }
+                element->addToTail(&readyQueue[firstOrSecond]);
+                if (&readyQueue[0] != readyQueue[0].next && &readyQueue[1] != readyQueue[1].next) {
+                    elementToPublish = readyQueue[0].next;
+                    elementToPublish->removeFromQueue();
+                    secondElementToPublish = readyQueue[1].next;
+                    secondElementToPublish->removeFromQueue();
+                }
 
-            if (!isSingleReader) {
                 balance += balanceIncrement;
                 if (balance * balanceIncrement > MaxImbalance) {
                     _ASSERT(balance * balanceIncrement == MaxImbalance + 1);  // We can get at most one past the limit
@@ -565,6 +760,44 @@ read_loop: // might return here once with goto to ensure both threads have same
                     AllowEventWaitersToProceed(&throttle[1-firstOrSecond]);
                 }
             }
+        } else {
+            element->addToTail(emptyQueue);
+            AllowEventWaitersToProceed(&emptyBuffersAvailable);
+        }
+
+        if (NULL != elementToPublish) {
+            int nSuppliers = nSuppliersRunning;
+            if (InputOrder::Enabled && !isSingleReader) {
+                //
+                // Either reader can publish a pair of elements, and the slices' order in the ring is the order they're
+                // written out in, so the pairs have to go in in the order they came off the ready queues.
+                //
+                publishElement(elementToPublish, secondElementToPublish, nSuppliers);
+            } else {
+                ReleaseExclusiveLock(&lock);
+
+                publishElement(elementToPublish, secondElementToPublish, nSuppliers);
+
+                AcquireExclusiveLock(&lock);
+            }
+            //
+            // Signal that reads are ready.
+            //
+            //fprintf(stderr, "Thread %u: signal readsReady in ReaderThread...\n", GetThreadId());
+            AllowEventWaitersToProceed(&readsReady);
+        }
+
+        if (done) {
+            //
+            // Everything we queued is in the ring by now, so if we're the last reader the suppliers can stop when it's empty.
+            //
+            _ASSERT(nReadersRunning > 0);
+            nReadersRunning--;
+            if (0 == nReadersRunning) {
+                //fprintf(stderr, "Thread %u: set allReadsQueued in ReaderThread...\n", GetThreadId());
+                allReadsQueued = true;
+                AllowEventWaitersToProceed(&readsReady);    // Even if we have nothing to queue, allow the consumers to wake up so they can exit
+            }
         }
     } // While ! done
 
@@ -572,8 +805,6 @@ read_loop: // might return here once with goto to ensure both threads have same
 
     //fprintf(stderr, "ReadSupplier: %llds processing, %llds waiting for balance, %llds waiting for buffer\n", processingTime / 1000000000, balanceTime / 1000000000, bufferWaitTime / 1000000000);
 
-    _ASSERT(nReadersRunning > 0);
-    nReadersRunning--;
     ReleaseExclusiveLock(&lock);
 }
 
@@ -582,7 +813,7 @@ ReadSupplierFromQueue::ReadSupplierFromQueue(
     :
     queue(i_queue),
     outOfReads(false),
-    currentElement(NULL),
+    haveSlice(false),
     nextReadIndex(0),
     done(false)
 {
@@ -595,22 +826,30 @@ ReadSupplierFromQueue::getNextRead()
         return false;
     }
 
-    if (NULL != currentElement && nextReadIndex >= currentElement->totalReads) {
-        queue->doneWithElement(currentElement);
-        currentElement = NULL;
+    if (haveSlice && nextReadIndex >= currentSlice.firstRead + currentSlice.nReads) {
+        queue->doneWithSlice(&currentSlice);
+        haveSlice = false;
     }
 
-    if (NULL == currentElement) {
-        currentElement = queue->getElement();
-        if (NULL == currentElement) {
+    if (!haveSlice) {
+        if (!queue->getSlice(&currentSlice)) {
             done = true;
             queue->supplierFinished();
             return NULL;
         }
-        nextReadIndex = 0;
+        haveSlice = true;
+        nextReadIndex = currentSlice.firstRead;
     }
 
-    return &currentElement->reads[nextReadIndex++]; // Note the post increment.
+    Read *read = &currentSlice.element->reads[currentSlice.element->readAt(nextReadIndex++)]; // Note the post increment.
+    read->setInputSequence(currentSlice.sequence);
+    return read;
+}
+
+    bool
+ReadSupplierFromQueue::isReadReady()
+{
+    return done || (haveSlice && nextReadIndex < currentSlice.firstRead + currentSlice.nReads) || queue->isSliceReady();
 }
 
     void
@@ -622,7 +861,7 @@ ReadSupplierFromQueue::releaseBatch(
 
 PairedReadSupplierFromQueue::PairedReadSupplierFromQueue(ReadSupplierQueue *i_queue, bool i_twoFiles) :
     queue(i_queue), twoFiles(i_twoFiles), done(false), 
-    currentElement(NULL), currentSecondElement(NULL), nextReadIndex(0) {}
+    haveSlice(false), nextReadIndex(0) {}
 
 PairedReadSupplierFromQueue::~PairedReadSupplierFromQueue()
 {}
@@ -637,67 +876,72 @@ PairedReadSupplierFromQueue::getNextReadPair(Read **read0, Read **read1)
         return false;
     }
 
-    if (NULL != currentElement && nextReadIndex >= currentElement->totalReads) {
-        //fprintf(stderr, "PairedReadSupplierFromQueue finished element %x with %d reads %d batches: %d %d\n", (int) currentElement, currentElement->totalReads, currentElement->batches.size(), currentElement->batches[0].batchID, currentElement->batches.size() > 1 ? currentElement->batches[1].batchID : 0);
-        queue->doneWithElement(currentElement);
-        currentElement = NULL;
-        if (twoFiles) {
-            queue->doneWithElement(currentSecondElement);
-            currentSecondElement = NULL;
-        }
+    if (haveSlice && nextReadIndex >= currentSlice.firstRead + currentSlice.nReads) {
+        queue->doneWithSlice(&currentSlice);
+        haveSlice = false;
     }
 
-    if (NULL == currentElement) {
-        if ((twoFiles && !queue->getElements(&currentElement, &currentSecondElement)) || 
-            (!twoFiles && NULL == (currentElement = queue->getElement()))) {
-
+    if (!haveSlice) {
+        if (!queue->getSlice(&currentSlice)) {
             done = true;
             queue->supplierFinished();
             *read0 = NULL;
             *read1 = NULL;
             return false;
         }
-		nextReadIndex = 0;
-    }
-    if (twoFiles) {
-        // Assert that both elements match.
-        _ASSERT(currentSecondElement->totalReads == currentElement->totalReads);
+        haveSlice = true;
+        nextReadIndex = currentSlice.firstRead;
+
+        ReadQueueElement *element = currentSlice.element;
+        if (twoFiles) {
+            // Assert that both elements match.
+            _ASSERT(NULL != element->secondElement && element->secondElement->totalReads == element->totalReads);
 #ifdef PAIR_MATCH_DEBUG
-        for (int i = 0; i < currentElement->totalReads; i++) {
-            Read::checkIdMatch(&currentElement->reads[i], &currentSecondElement->reads[i]);
-        }
+            for (int i = currentSlice.firstRead; i < currentSlice.firstRead + currentSlice.nReads; i++) {
+                Read::checkIdMatch(&element->reads[i], &element->secondElement->reads[i]);
+            }
 #endif
-    } else {
-        //
-        // Assert that there are an even number of reads (since they're in pairs)
-        //
-        _ASSERT(currentElement->totalReads % 2 == 0);
+        } else {
+            //
+            // Assert that there are an even number of reads (since they're in pairs)
+            //
+            _ASSERT(currentSlice.firstRead % 2 == 0 && currentSlice.nReads % 2 == 0);
 #ifdef PAIR_MATCH_DEBUG
-        for (int i = 0; i < currentElement->totalReads; i += 2) {
-            Read::checkIdMatch(&currentElement->reads[i], &currentElement->reads[i+1]);
-        }
+            for (int i = currentSlice.firstRead; i < currentSlice.firstRead + currentSlice.nReads; i += 2) {
+                Read::checkIdMatch(&element->reads[i], &element->reads[i+1]);
+            }
 #endif
+        }
     }
 
+    ReadQueueElement *element = currentSlice.element;
     if (twoFiles) {
-        *read0 = &currentElement->reads[nextReadIndex];
-        *read1 = &currentSecondElement->reads[nextReadIndex];
+        *read0 = &element->reads[element->readAt(nextReadIndex)];
+        *read1 = &element->secondElement->reads[element->readAt(nextReadIndex)];
 #ifdef PAIR_MATCH_DEBUG
 		Read::checkIdMatch(*read0, *read1);
 #endif
         nextReadIndex++;
     } else {
-        *read0 = &currentElement->reads[nextReadIndex];
-        *read1 = &currentElement->reads[nextReadIndex+1];
+        *read0 = &element->reads[element->readAt(nextReadIndex)];
+        *read1 = &element->reads[element->readAt(nextReadIndex+1)];
 #ifdef PAIR_MATCH_DEBUG
 		Read::checkIdMatch(*read0, *read1);
 #endif
         nextReadIndex += 2;
     }
+    (*read0)->setInputSequence(currentSlice.sequence);
+    (*read1)->setInputSequence(currentSlice.sequence);
 
     return true;
 }
     
+    bool
+PairedReadSupplierFromQueue::isReadReady()
+{
+    return done || (haveSlice && nextReadIndex < currentSlice.firstRead + currentSlice.nReads) || queue->isSliceReady();
+}
+
     void
 PairedReadSupplierFromQueue::releaseBatch(
     DataBatch batch)
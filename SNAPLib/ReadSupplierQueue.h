@@ -30,11 +30,12 @@ Revision History:
 using std::pair;
 
 class ReadSupplierFromQueue;
+class GenomeIndex;
 class PairedReadSupplierFromQueue;
 
 struct ReadQueueElement {
     ReadQueueElement()
-        : next(NULL), prev(NULL)
+        : next(NULL), prev(NULL), secondElement(NULL), slicesOutstanding(0), order(NULL), reordered(false)
     {
         reads = (Read*) BigAlloc(MaxReadsPerElement * sizeof(Read));
     }
@@ -43,6 +44,7 @@ struct ReadQueueElement {
     {
         BigDealloc(reads);
         reads = NULL;
+        delete [] order;
     }
 
     // note this should be about read buffer size for input reads
@@ -53,6 +55,25 @@ struct ReadQueueElement {
     Read*               reads;
     VariableSizeVector<DataBatch> batches;
 
+    //
+    // Once an element is filled it's handed out to the suppliers in one or more slices.  For paired reads from two
+    // files, secondElement holds the other ends (at the same indices), and travels with this one.  The element goes
+    // back on the empty queue when the last slice is done.
+    //
+    ReadQueueElement    *secondElement;
+    volatile int        slicesOutstanding;
+
+    //
+    // The reads go to the suppliers in input order unless -seedOrder sorted them, in which case the i'th one handed
+    // out is reads[order[i]] (and secondElement->reads[order[i]]).  The reads themselves aren't moved; they're big.
+    //
+    int                 *order;
+    bool                reordered;
+
+    int readAt(int i) const {
+        return reordered ? order[i] : i;
+    }
+
     void addToTail(ReadQueueElement *queueHead) {
         next = queueHead;
         prev = queueHead->prev;
@@ -66,6 +87,16 @@ struct ReadQueueElement {
         prev = next = NULL;
     }
 };
+
+//
+// A run of reads from an element that one supplier works through on its own.
+//
+struct ReadQueueSlice {
+    ReadQueueElement    *element;
+    int                 firstRead;
+    int                 nReads;
+    _int64              sequence;   // Slices are numbered in the order they go into the ring, which for -ordered is input order
+};
     
 class ReadSupplierQueue: public ReadSupplierGenerator, public PairedReadSupplierGenerator {
 public:
@@ -105,13 +136,24 @@ public:
     ReadSupplier *generateNewReadSupplier();
     PairedReadSupplier *generateNewPairedReadSupplier();
 
-    ReadQueueElement *getElement();     // Called from the supplier threads
-    bool getElements(ReadQueueElement **element1, ReadQueueElement **element2);   // Called from supplier threads
-    void doneWithElement(ReadQueueElement *element);
+    bool getSlice(ReadQueueSlice *slice);   // Called from the supplier threads, returns false when all reads are consumed
+    bool isSliceReady();                    // Whether getSlice would return without waiting for the readers
+    void doneWithSlice(const ReadQueueSlice *slice);
     void supplierFinished();
 
     void releaseBatch(DataBatch batch);
 
+    // reads (or pairs, from two files) parsed and waiting for the aligners, across all the queues; for progress reports
+    static volatile _int64 ReadsQueued;
+
+    //
+    // For -seedOrder: each element's reads are handed out in order of where their first seed's lookup lands in this
+    // index's hash tables, so that the lookups an aligner makes one after another touch nearby buckets and pages, rather
+    // than in input order.  Set once the index is loaded; elements published before then (or with -ordered) go out in
+    // input order.
+    //
+    static const GenomeIndex *SeedOrderIndex;
+
 private:
 
     void commonInit();
@@ -119,7 +161,7 @@ private:
     ReadReader          *singleReader[2];   // Only [0] is filled in for single ended reads
     PairedReadReader    *pairedReader;      // This is filled in iff there are no single readers
 
-    ReadQueueElement    readyQueue[2];      // Queue [1] is used only when there are two single end readers
+    ReadQueueElement    readyQueue[2];      // Filled elements waiting for their other half; used only when there are two single end readers
 
     BatchTracker        tracker;            // track batches used in queues, use refcount per element (not per read)
 
@@ -133,7 +175,33 @@ private:
     int                 nSuppliersRunning;
     volatile bool       allReadsQueued;
 
-    bool areAnyReadsReady(); // must hold the lock to call this.
+    //
+    // Filled elements are handed to the suppliers through a bounded ring of slices, which the suppliers take from
+    // without the lock (it's a Vyukov-style queue: each cell has a sequence number that says whether it's ready to be
+    // written or to be read at a given position).  The readers cut each element into slices according to how much is
+    // already queued: when the ring is deep an element goes out whole, and when it's shallow it's split so that every
+    // supplier gets something to do.  The lock is then only taken once per element, not once per supplier per element,
+    // and none of the suppliers sit idle while another works through a whole element at the end of the input.
+    //
+    static const unsigned   ReadyRingSize = 1 << 16;       // Must be a power of 2
+    static const int        MaxSlicesPerElement = 64;
+    static const int        MinReadsPerSlice = 500;
+
+    struct ReadyRingCell {
+        volatile _uint32    sequence;
+        ReadQueueSlice      slice;
+    };
+
+    ReadyRingCell       *readyRing;
+    volatile _uint32    readyRingEnqueuePosition;
+    volatile _uint32    readyRingDequeuePosition;
+    volatile _int64     slicesPublished;
+
+    bool tryEnqueueSlice(const ReadQueueSlice *slice);
+    bool tryDequeueSlice(ReadQueueSlice *slice);
+    void publishElement(ReadQueueElement *element, ReadQueueElement *secondElement, int nSuppliers);
+    void sortBySeed(ReadQueueElement *element, int readsPerUnit);
+    void doneWithElement(ReadQueueElement *element);
 
     //
     // Empty buffers waiting for the readers.
@@ -141,7 +209,7 @@ private:
     ReadQueueElement    emptyQueue[1];
   
     //
-    // Just one lock for all of the shared objects (the queues and Waiter objects, and counts of
+    // Just one lock for the rest of the shared objects (the element queues and Waiter objects, and counts of
     // readers and suppliers running, as well as allReadsQueued).
     //
     ExclusiveLock       lock;
@@ -157,6 +225,7 @@ private:
 
     static void ReaderThreadMain(void *);
     void ReaderThread(ReaderThreadParams *params);
+    void holdBatch(DataBatch batch, DataBatch* io_heldBatch, bool* io_holdingBatch);
 };
 
 //
@@ -171,11 +240,14 @@ public:
     
     void releaseBatch(DataBatch batch);
 
+    bool isReadReady();
+
 private:
     bool                done;
     ReadSupplierQueue   *queue;
     bool                outOfReads;
-    ReadQueueElement    *currentElement;
+    ReadQueueSlice      currentSlice;
+    bool                haveSlice;
     int                 nextReadIndex;          
 };
 
@@ -188,11 +260,13 @@ public:
 
     void releaseBatch(DataBatch batch);
 
+    bool isReadReady();
+
 private:
     ReadSupplierQueue   *queue;
     bool                done;
     bool                twoFiles;
-    ReadQueueElement    *currentElement;
-    ReadQueueElement    *currentSecondElement;
+    ReadQueueSlice      currentSlice;
+    bool                haveSlice;
     int                 nextReadIndex;          
 };
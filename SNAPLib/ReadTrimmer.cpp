@@ -0,0 +1,200 @@
+/*++
+
+Module Name:
+
+    ReadTrimmer.cpp
+
+Abstract:
+
+    Adapter and quality trimming for reads as they're parsed.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "ReadTrimmer.h"
+#include "Tables.h"
+
+#if     defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+static const unsigned KmerTableSize = 1 << (2 * ReadTrimmer::KmerLength);
+
+ReadTrimmer::ReadTrimmer(int i_qualityThreshold) : qualityThreshold(i_qualityThreshold), nAdapters(0)
+{
+}
+
+ReadTrimmer::~ReadTrimmer()
+{
+    for (unsigned i = 0; i < nAdapters; i++) {
+        delete [] adapters[i].sequence;
+        delete [] adapters[i].kmerOffsets;
+    }
+}
+
+    ReadTrimmer *
+ReadTrimmer::create(const char *adapterList, int qualityThreshold)
+{
+    ReadTrimmer *trimmer = new ReadTrimmer(qualityThreshold);
+
+    for (const char *next = adapterList; NULL != next && '\0' != *next; ) {
+        const char *comma = strchr(next, ',');
+        unsigned length = (unsigned)(NULL == comma ? strlen(next) : comma - next);
+        if (trimmer->nAdapters == MaxAdapters) {
+            fprintf(stderr, "At most %d adapters can be trimmed\n", MaxAdapters);
+            delete trimmer;
+            return NULL;
+        }
+        if (length < KmerLength || length > MaxAdapterLength) {
+            fprintf(stderr, "Adapter '%.*s' must be from %d to %d bases long\n", length, next, KmerLength, MaxAdapterLength);
+            delete trimmer;
+            return NULL;
+        }
+
+        Adapter *adapter = &trimmer->adapters[trimmer->nAdapters];
+        adapter->length = length;
+        adapter->sequence = new char[length];
+        adapter->kmerOffsets = new unsigned char[KmerTableSize];
+        trimmer->nAdapters++;   // So the destructor frees it if the rest fails
+
+        for (unsigned i = 0; i < length; i++) {
+            adapter->sequence[i] = (char)toupper(next[i]);
+            if (BASE_VALUE[(unsigned char)adapter->sequence[i]] > 3) {
+                fprintf(stderr, "Adapter '%.*s' can only have A, C, G and T in it\n", length, next);
+                delete trimmer;
+                return NULL;
+            }
+        }
+
+        //
+        // Going backwards leaves each k-mer's first offset in the table.
+        //
+        memset(adapter->kmerOffsets, 0, KmerTableSize);
+        for (int offset = length - KmerLength; offset >= 0; offset--) {
+            unsigned kmer = 0;
+            for (unsigned i = 0; i < KmerLength; i++) {
+                kmer = (kmer << 2) | BASE_VALUE[(unsigned char)adapter->sequence[offset + i]];
+            }
+            adapter->kmerOffsets[kmer] = (unsigned char)(offset + 1);
+        }
+
+        next = NULL == comma ? NULL : comma + 1;
+    }
+
+    return trimmer;
+}
+
+    unsigned
+ReadTrimmer::trimmedLength(const char *data, const char *quality, unsigned length) const
+{
+    if (0 != qualityThreshold) {
+        length = qualityTrimmedLength(quality, length);
+    }
+
+    for (unsigned i = 0; i < nAdapters; i++) {
+        length = adapterStart(adapters[i], data, length);
+    }
+
+    return length;
+}
+
+    unsigned
+ReadTrimmer::qualityTrimmedLength(const char *quality, unsigned length) const
+{
+    int sum = 0;
+    int bestSum = 0;
+    unsigned trimmedLength = length;
+    for (int i = (int)length - 1; i >= 0; i--) {
+        sum += qualityThreshold - (quality[i] - 33);
+        if (sum < 0) {
+            break;
+        }
+        if (sum > bestSum) {
+            bestSum = sum;
+            trimmedLength = i;
+        }
+    }
+
+    return trimmedLength;
+}
+
+    unsigned
+ReadTrimmer::adapterStart(const Adapter &adapter, const char *data, unsigned length) const
+{
+    //
+    // Every place that an adapter (with few enough mismatches) starts and still has a whole k-mer in the read gets found
+    // from one of its k-mers.  Nothing can start earlier than the best so far once the k-mers are a whole adapter past it.
+    //
+    unsigned bestStart = length;
+    const unsigned kmerMask = KmerTableSize - 1;
+    unsigned kmer = 0;
+    unsigned validBases = 0;
+    for (unsigned i = 0; i < length && i + 1 < bestStart + adapter.length; i++) {
+        int value = BASE_VALUE[(unsigned char)data[i]];
+        if (value > 3) {
+            validBases = 0;
+            continue;
+        }
+        kmer = ((kmer << 2) | value) & kmerMask;
+        if (++validBases < KmerLength) {
+            continue;
+        }
+
+        unsigned offset = adapter.kmerOffsets[kmer];
+        unsigned kmerStart = i + 1 - KmerLength;
+        if (0 == offset || kmerStart < offset - 1) {
+            continue;   // Not in the adapter, or it would start before the read
+        }
+
+        unsigned start = kmerStart - (offset - 1);
+        unsigned overlap = __min(adapter.length, length - start);
+        if (start < bestStart && matchesWithin(data + start, adapter.sequence, overlap, overlap / ErrorDivisor)) {
+            bestStart = start;
+        }
+    }
+
+    if (bestStart < length) {
+        return bestStart;
+    }
+
+    //
+    // The start of an adapter at the very end of the read, with less than a k-mer of it there.
+    //
+    for (unsigned overlap = __min(KmerLength - 1, length); overlap >= MinOverlap; overlap--) {
+        if (0 == memcmp(data + length - overlap, adapter.sequence, overlap)) {
+            return length - overlap;
+        }
+    }
+
+    return length;
+}
+
+    bool
+ReadTrimmer::matchesWithin(const char *data, const char *adapter, unsigned length, unsigned maxMismatches)
+{
+    unsigned mismatches = 0;
+    unsigned i = 0;
+#if     defined(__SSE2__) || defined(_M_X64)
+    for (; i + 16 <= length; i += 16) {
+        unsigned differ = ~(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i)),
+                                                                      _mm_loadu_si128((const __m128i *)(adapter + i)))) & 0xffff;
+        for (; 0 != differ; differ &= differ - 1) {
+            if (++mismatches > maxMismatches) {
+                return false;
+            }
+        }
+    }
+#endif  // SSE2
+
+    for (; i < length; i++) {
+        if (data[i] != adapter[i] && ++mismatches > maxMismatches) {
+            return false;
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,77 @@
+/*++
+
+Module Name:
+
+    ReadTrimmer.h
+
+Abstract:
+
+    Adapter and quality trimming for reads as they're parsed.
+
+Environment:
+
+    User mode service.
+
+    Thread safe once it's built; the reader threads all share one.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+
+//
+// Cuts reads down before they ever get to the aligners, so that SNAP can take FASTQ straight off the sequencer rather
+// than after a separate trimming pass that reads and writes all of the data again.  The trimmed bases are gone, just as
+// if the FASTQ had been trimmed beforehand, rather than soft clipped.
+//
+// Quality trimming is BWA's: it cuts the read's tail at the point that maximizes the sum of (threshold - quality) over
+// the bases it cuts.  Adapter trimming then cuts the read at the first place that an adapter starts, including a piece
+// of one at the very end.  To find that without trying every offset in the read, each adapter has a table of where in
+// it each k-mer first appears: a read k-mer that's in the table says where an adapter would have to start, and only
+// those places get compared, with up to one mismatch per ErrorDivisor bases of overlap.  An adapter that runs off the end
+// of the read by less than a k-mer only shows up as a match of the read's last few bases to its first few, so those get
+// compared directly (exactly).
+//
+class ReadTrimmer {
+public:
+    //
+    // adapters is a comma separated list of adapter sequences (or NULL for none), and qualityThreshold the Phred score that
+    // quality trimming trims to (or 0 for no quality trimming).  Returns NULL, with a message, if an adapter isn't valid.
+    //
+    static ReadTrimmer *create(const char *adapters, int qualityThreshold);
+
+    ~ReadTrimmer();
+
+    //
+    // The length that a read with this data and (Phred+33) quality should be cut to.
+    //
+    unsigned trimmedLength(const char *data, const char *quality, unsigned length) const;
+
+    static const unsigned KmerLength = 8;
+    static const unsigned MinOverlap = 3;           // The least of an adapter at the end of a read that gets it trimmed
+    static const unsigned ErrorDivisor = 10;        // One mismatch allowed per this many bases of overlap
+    static const unsigned MaxAdapterLength = 254;   // So that offset + 1 fits in the k-mer table's bytes
+    static const unsigned MaxAdapters = 16;
+
+private:
+    ReadTrimmer(int i_qualityThreshold);
+
+    struct Adapter {
+        char           *sequence;
+        unsigned        length;
+        unsigned char  *kmerOffsets;    // 1 + the first offset of each k-mer in the adapter, or 0 if it's not in it
+    };
+
+    unsigned qualityTrimmedLength(const char *quality, unsigned length) const;
+    unsigned adapterStart(const Adapter &adapter, const char *data, unsigned length) const;
+
+    //
+    // Whether data and adapter differ in no more than maxMismatches of their first length bases.
+    //
+    static bool matchesWithin(const char *data, const char *adapter, unsigned length, unsigned maxMismatches);
+
+    int         qualityThreshold;
+    unsigned    nAdapters;
+    Adapter     adapters[MaxAdapters];
+};
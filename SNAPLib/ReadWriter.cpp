@@ -28,13 +28,16 @@ Environment:
 #include "ReadSupplierQueue.h"
 #include "FileFormat.h"
 #include "exit.h"
+#include "PerfCounters.h"
 
 class SimpleReadWriter : public ReadWriter
 {
 public:
-    SimpleReadWriter(const FileFormat* i_format, DataWriter* i_writer, const Genome* i_genome)
+    SimpleReadWriter(const FileFormat* i_format, DataWriter* i_writer, const Genome* i_genome, unsigned gapPenalty)
         : format(i_format), writer(i_writer), genome(i_genome)
-    {}
+    {
+        lvc.setGapPenalty(gapPenalty);
+    }
 
     virtual ~SimpleReadWriter()
     {
@@ -43,13 +46,26 @@ public:
 
     virtual bool writeHeader(const ReaderContext& context, bool sorted, int argc, const char **argv, const char *version, const char *rgLine);
 
-    virtual bool writeRead(Read *read, AlignmentResult result, int mapQuality, unsigned genomeLocation, Direction direction);
+    virtual bool writeRead(Read *read, AlignmentResult result, int mapQuality, GenomeLocation genomeLocation, Direction direction,
+        const SpliceJunction *splice);
+
+    virtual bool writeReads(int count, Read **reads, AlignmentResult *results, int *mapQualities, GenomeLocation *genomeLocations,
+        Direction *directions, const SpliceJunction **splices);
 
     virtual bool writePair(Read *read0, Read *read1, PairedAlignmentResult *result);
 
+    virtual bool flush();
+
     virtual void close();
 
 private:
+    //
+    // The SA tag's entry for one piece of a split read.  Its CIGAR is just the piece as an M with the rest of the read
+    // soft clipped, since the real one (with any indels) isn't worked out until its own record is written.
+    //
+    static const size_t MaxOtherAlignmentLength = 1024;
+    void formatOtherAlignment(char *buffer, Read *piece, GenomeLocation location, Direction direction, int mapq, int editDistance);
+
     const FileFormat* format;
     DataWriter* writer;
     const Genome* genome;
@@ -90,20 +106,23 @@ SimpleReadWriter::writeRead(
     Read *read,
     AlignmentResult result,
     int mapQuality,
-    unsigned genomeLocation,
-    Direction direction)
+    GenomeLocation genomeLocation,
+    Direction direction,
+    const SpliceJunction *splice)
 {
+    PerfTimer timer(PerfCounters::OutputFormatting);
     char* buffer;
     size_t size;
     size_t used;
     if (result == NotFound) {
-        genomeLocation = UINT32_MAX;
+        genomeLocation = InvalidGenomeLocation;
     }
     for (int pass = 0; pass < 2; pass++) {
         if (! writer->getBuffer(&buffer, &size)) {
             return false;
         }
-        if (format->writeRead(genome, &lvc, buffer, size, &used, read->getIdLength(), read, result, mapQuality, genomeLocation, direction)) {
+        if (format->writeRead(genome, &lvc, buffer, size, &used, read->getIdLength(), read, result, mapQuality, genomeLocation, direction,
+                false, false, NULL, NotFound, 0, FORWARD, splice)) {
             _ASSERT(used <= size);
 
         if (used > 0xffffffff) {
@@ -125,19 +144,80 @@ SimpleReadWriter::writeRead(
     return false; // will never get here
 }
 
+    bool
+SimpleReadWriter::writeReads(
+    int count,
+    Read **reads,
+    AlignmentResult *results,
+    int *mapQualities,
+    GenomeLocation *genomeLocations,
+    Direction *directions,
+    const SpliceJunction **splices)
+{
+    //
+    // Format reads into the buffer until one doesn't fit, and only then advance past them (advance is what runs the
+    // filters), so that getBuffer is only asked once per buffer rather than once per read.
+    //
+    PerfTimer timer(PerfCounters::OutputFormatting, count);
+    const int maxPerBuffer = 64;
+    size_t sizeUsed[maxPerBuffer];
+    GenomeLocation locations[maxPerBuffer];
+    int done = 0;
+    bool freshBuffer = false;
+    while (done < count) {
+        char* buffer;
+        size_t size;
+        if (! writer->getBuffer(&buffer, &size)) {
+            return false;
+        }
+        int n = 0;
+        size_t used = 0;
+        while (n < maxPerBuffer && done + n < count) {
+            int i = done + n;
+            locations[n] = results[i] != NotFound ? genomeLocations[i] : InvalidGenomeLocation;
+            if (! format->writeRead(genome, &lvc, buffer + used, size - used, &sizeUsed[n], reads[i]->getIdLength(), reads[i],
+                    results[i], mapQualities[i], locations[n], directions[i], false, false, NULL, NotFound, 0, FORWARD,
+                    NULL == splices ? NULL : splices[i])) {
+                break;
+            }
+            if (sizeUsed[n] > 0xffffffff) {
+                fprintf(stderr,"SimpleReadWriter:writeReads: used too big\n");
+                soft_exit(1);
+            }
+            used += sizeUsed[n];
+            n++;
+        }
+        for (int j = 0; j < n; j++) {
+            writer->advance((unsigned)sizeUsed[j], locations[j]);
+        }
+        if (n == 0) {
+            if (freshBuffer) {
+                fprintf(stderr, "Failed to write into fresh buffer\n");
+                soft_exit(1);
+            }
+            if (! writer->nextBatch()) {
+                return false;
+            }
+        }
+        freshBuffer = n == 0;
+        done += n;
+    }
+    return true;
+}
+
     bool
 SimpleReadWriter::writePair(
     Read *read0,
     Read *read1,
     PairedAlignmentResult *result)
 {
+    PerfTimer timer(PerfCounters::OutputFormatting, 2);
     //
     // We need to write both halves of the pair into the same buffer, so that a write from
     // some other thread doesn't separate them.  So, try the writes and if either doesn't
     // work start IO and try again.
     //
     Read *reads[2] = {read0, read1};
-    size_t sizeUsed[2];
 
     //
     // For paired reads, we need to have the same QNAME for both of them, and it needs to be unique among all other
@@ -156,11 +236,49 @@ SimpleReadWriter::writePair(
                 idLengths[1] -= 2;
         }
     }
-    unsigned locations[2];
-    locations[0] = result->status[0] != NotFound ? result->location[0] : UINT32_MAX;
-    locations[1] = result->status[1] != NotFound ? result->location[1] : UINT32_MAX;
-    int first = locations[0] > locations[1];
+    GenomeLocation locations[2];
+    locations[0] = result->status[0] != NotFound ? result->location[0] : InvalidGenomeLocation;
+    locations[1] = result->status[1] != NotFound ? result->location[1] : InvalidGenomeLocation;
+    int first = locations[0] > locations[1] && ! format->writesMatesInOrder();
     int second = 1 - first;
+
+    //
+    // A split read is written as its primary piece with the rest of it soft clipped, followed (after the pair) by its
+    // other piece as a supplementary alignment, each with an SA tag giving the other's alignment.  Its mate's record
+    // points at the primary piece.  Secondary alignments are of the whole read.
+    //
+    Read *written[2] = {read0, read1};
+    Read pieces[2][2];                          // The primary and other pieces of each split read
+    SplitRecord splitRecords[2][2];
+    char otherAlignments[2][2][MaxOtherAlignmentLength];
+    int whichRead[4] = {first, second};         // For each record
+    int nRecords = 2;
+    for (int r = 0; r < 2; r++) {
+        if (! result->isSplit[r] || SecondaryHit == result->status[r]) {
+            continue;
+        }
+        const SplitAlignment *split = &result->split[r];
+        unsigned frontLength = split->readOffset;
+        unsigned backLength = reads[r]->getDataLength() - frontLength;
+        pieces[r][0] = *reads[r];
+        pieces[r][1] = *reads[r];
+        pieces[r][split->primaryIsFront ? 0 : 1].clipToPiece(0, frontLength);
+        pieces[r][split->primaryIsFront ? 1 : 0].clipToPiece(frontLength, backLength);
+        formatOtherAlignment(otherAlignments[r][0], &pieces[r][1], split->otherLocation, split->otherDirection, split->otherMapq,
+            split->otherScore);
+        formatOtherAlignment(otherAlignments[r][1], &pieces[r][0], result->location[r], result->direction[r], result->mapq[r],
+            split->primaryScore);
+        for (int p = 0; p < 2; p++) {
+            splitRecords[r][p].supplementary = 1 == p;
+            splitRecords[r][p].otherAlignment = otherAlignments[r][p];
+        }
+        written[r] = &pieces[r][0];
+        if (format->writesSupplementaryAlignments()) {
+            whichRead[nRecords++] = r;
+        }
+    }
+
+    size_t sizeUsed[4];
     for (int pass = 0; pass < 2; pass++) {
         
         char* buffer;
@@ -170,18 +288,30 @@ SimpleReadWriter::writePair(
             return false;
         }
 
-        bool writesFit = format->writeRead(genome, &lvc, buffer, size, &sizeUsed[first],
-                            idLengths[first], reads[first], result->status[first], result->mapq[first], locations[first], result->direction[first], true, first == 0,
-                            reads[second], result->status[second], locations[second], result->direction[second]);
-
-        if (writesFit) {
-            writesFit = format->writeRead(genome, &lvc, buffer + sizeUsed[first], size - sizeUsed[first], &sizeUsed[second],
-                idLengths[second], reads[second], result->status[second], result->mapq[second], locations[second], result->direction[second], true, first != 0,
-                reads[first], result->status[first], locations[first], result->direction[first]);
+        bool writesFit = true;
+        size_t used = 0;
+        for (int i = 0; i < nRecords && writesFit; i++) {
+            int r = whichRead[i];
+            int mate = 1 - r;
+            if (i < 2) {
+                writesFit = format->writeRead(genome, &lvc, buffer + used, size - used, &sizeUsed[i],
+                    idLengths[r], written[r], result->status[r], result->mapq[r], locations[r], result->direction[r], true, r == 0,
+                    written[mate], result->status[mate], locations[mate], result->direction[mate],
+                    NULL, written[r] == reads[r] ? NULL : &splitRecords[r][0]);
+            } else {
+                const SplitAlignment *split = &result->split[r];
+                writesFit = format->writeRead(genome, &lvc, buffer + used, size - used, &sizeUsed[i],
+                    idLengths[r], &pieces[r][1], SingleHit, split->otherMapq, split->otherLocation, split->otherDirection, true, r == 0,
+                    written[mate], result->status[mate], locations[mate], result->direction[mate],
+                    NULL, &splitRecords[r][1]);
+            }
             if (writesFit) {
-                break;
+                used += sizeUsed[i];
             }
         }
+        if (writesFit) {
+            break;
+        }
 
         if (pass == 1) {
             fprintf(stderr,"ReadWriter: write into fresh buffer failed\n");
@@ -193,22 +323,66 @@ SimpleReadWriter::writePair(
         }
     }
 
-    if (sizeUsed[0] > 0xffffffff || sizeUsed[1] > 0xffffffff) {
-        fprintf(stderr,"SimpleReadWriter::writePair: one or the other (or both) sizeUsed too big\n");
-        soft_exit(1);
+    for (int i = 0; i < nRecords; i++) {
+        if (sizeUsed[i] > 0xffffffff) {
+            fprintf(stderr,"SimpleReadWriter::writePair: sizeUsed too big\n");
+            soft_exit(1);
+        }
     }
 
     //
     // The strange code that determines the sort key (which uses the coordinate of the mate for unmapped reads) is because we list unmapped reads
     // with mapped mates at their mates' location so they sort together.  If both halves are unmapped, then  
-    writer->advance((unsigned)sizeUsed[first],
-        locations[first] != UINT32_MAX ? locations[first] : locations[second]);
+    writer->advance((unsigned)sizeUsed[0],
+        locations[first] != InvalidGenomeLocation ? locations[first] : locations[second]);
+
+    writer->advance((unsigned)sizeUsed[1],
+        locations[second] != InvalidGenomeLocation ? locations[second] : locations[first]);
 
-    writer->advance((unsigned)sizeUsed[second],
-        locations[second] != UINT32_MAX ? locations[second] : locations[first]);
+    for (int i = 2; i < nRecords; i++) {
+        writer->advance((unsigned)sizeUsed[i], result->split[whichRead[i]].otherLocation);
+    }
     return true;
 }
 
+    void
+SimpleReadWriter::formatOtherAlignment(char *buffer, Read *piece, GenomeLocation location, Direction direction, int mapq, int editDistance)
+{
+    const Genome::Contig *contig = genome->getContigAtLocation(location);
+    unsigned clippedBefore = piece->getFrontClippedLength();
+    unsigned clippedAfter = piece->getUnclippedLength() - piece->getDataLength() - clippedBefore;
+    if (RC == direction) {
+        unsigned temp = clippedBefore;
+        clippedBefore = clippedAfter;
+        clippedAfter = temp;
+    }
+
+    char cigar[64];
+    int used = 0;
+    if (clippedBefore > 0) {
+        used += snprintf(cigar + used, sizeof(cigar) - used, "%uS", clippedBefore);
+    }
+    used += snprintf(cigar + used, sizeof(cigar) - used, "%uM", piece->getDataLength());
+    if (clippedAfter > 0) {
+        snprintf(cigar + used, sizeof(cigar) - used, "%uS", clippedAfter);
+    }
+
+    snprintf(buffer, MaxOtherAlignmentLength, "%s,%u,%c,%s,%d,%d;", NULL == contig ? "*" : contig->name,
+        NULL == contig ? 0 : (unsigned)(location - contig->beginningOffset + 1), RC == direction ? '-' : '+', cigar, __max(0, __min(70, mapq)),
+        editDistance);
+}
+
+    bool
+SimpleReadWriter::flush()
+{
+    char* buffer;
+    size_t used;
+    if (writer->getBatch(0, &buffer, NULL, &used) && used == 0) {
+        return true;
+    }
+    return writer->nextBatch();
+}
+
     void
 SimpleReadWriter::close()
 {
@@ -218,11 +392,12 @@ SimpleReadWriter::close()
 class SimpleReadWriterSupplier : public ReadWriterSupplier
 {
 public:
-    SimpleReadWriterSupplier(const FileFormat* i_format, DataWriterSupplier* i_dataSupplier, const Genome* i_genome)
+    SimpleReadWriterSupplier(const FileFormat* i_format, DataWriterSupplier* i_dataSupplier, const Genome* i_genome, unsigned i_gapPenalty)
         :
         format(i_format),
         dataSupplier(i_dataSupplier),
-        genome(i_genome)
+        genome(i_genome),
+        gapPenalty(i_gapPenalty)
     {}
 
     ~SimpleReadWriterSupplier()
@@ -232,7 +407,7 @@ public:
 
     virtual ReadWriter* getWriter()
     {
-        return new SimpleReadWriter(format, dataSupplier->getWriter(), genome);
+        return new SimpleReadWriter(format, dataSupplier->getWriter(), genome, gapPenalty);
     }
 
     virtual void close()
@@ -244,14 +419,16 @@ private:
     const FileFormat* format;
     DataWriterSupplier* dataSupplier;
     const Genome* genome;
+    unsigned gapPenalty;
 };
 
     ReadWriterSupplier*
 ReadWriterSupplier::create(
     const FileFormat* format,
     DataWriterSupplier* dataSupplier,
-    const Genome* genome)
+    const Genome* genome,
+    unsigned gapPenalty)
 {
-    return new SimpleReadWriterSupplier(format, dataSupplier, genome);
+    return new SimpleReadWriterSupplier(format, dataSupplier, genome, gapPenalty);
 }
 
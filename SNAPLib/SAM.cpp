@@ -31,6 +31,7 @@ Environment:
 #include "AlignerOptions.h"
 #include "directions.h"
 #include "exit.h"
+#include "InputOrder.h"
 
 using std::max;
 using std::min;
@@ -81,12 +82,56 @@ strnchrs(char *str, char charToFind, char charToFind2, size_t maxLen) // Hokey v
     return NULL;
 }
 
+//
+// Parse the decimal number at the start of a field, the way sscanf("%d") would for the fields we care about (which
+// never have signs or leading spaces), but without copying the field to null terminate it and without sscanf's
+// overhead, which is noticeable when it's done for several fields of every line.  Returns false if there are no digits.
+//
+    static inline bool
+parseDecimalField(const char *field, size_t fieldLength, unsigned *value)
+{
+    unsigned result = 0;
+    size_t i;
+    for (i = 0; i < fieldLength && field[i] >= '0' && field[i] <= '9'; i++) {
+        result = result * 10 + (field[i] - '0');
+    }
+
+    if (0 == i) {
+        return false;
+    }
+
+    *value = result;
+    return true;
+}
+
     char *
 SAMReader::skipToBeyondNextRunOfSpacesAndTabs(char *str, const char *endOfBuffer, size_t *charsUntilFirstSpaceOrTab)
 {
     if (NULL == str) return NULL;
 
     char *nextChar = str;
+#if     defined(__SSE2__) || defined(_M_X64)
+    //
+    // Most fields (SEQ, QUAL and the optional ones especially) are long enough that it's worth looking at 16 bytes at
+    // a time for the end.
+    //
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i carriageReturn = _mm_set1_epi8('\r');
+    while (nextChar + 16 <= endOfBuffer) {
+        __m128i block = _mm_loadu_si128((const __m128i *)nextChar);
+        unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, space), _mm_cmpeq_epi8(block, newline)),
+                                                       _mm_or_si128(_mm_cmpeq_epi8(block, tab), _mm_cmpeq_epi8(block, carriageReturn))));
+        if (0 != mask) {
+            unsigned long bit;
+            CountTrailingZeroes(mask, bit);
+            nextChar += bit;
+            break;
+        }
+        nextChar += 16;
+    }
+#endif  // SSE2
     while (nextChar < endOfBuffer && *nextChar != ' ' && *nextChar != '\n' && *nextChar != '\t' && *nextChar != '\r' /* for Windows CRLF text */) {
         nextChar++;
     }
@@ -299,7 +344,7 @@ SAMReader::getReadFromLine(
     char                *endOfBuffer, 
     Read                *read, 
     AlignmentResult     *alignmentResult,
-    unsigned            *out_genomeLocation, 
+    GenomeLocation      *out_genomeLocation, 
     Direction           *direction,
     unsigned            *mapQ,
     size_t              *lineLength,
@@ -322,10 +367,10 @@ SAMReader::getReadFromLine(
     //
     const size_t contigNameBufferSize = 512;
     char contigName[contigNameBufferSize];
-    unsigned offsetOfContig;
+    GenomeLocation offsetOfContig;
     parseContigName(genome, contigName, contigNameBufferSize, &offsetOfContig, NULL, field, fieldLength);
 
-    unsigned genomeLocation = parseLocation(offsetOfContig, field, fieldLength);
+    GenomeLocation genomeLocation = parseLocation(offsetOfContig, field, fieldLength);
 
     if (NULL != out_genomeLocation) {
         *out_genomeLocation = genomeLocation;
@@ -338,14 +383,11 @@ SAMReader::getReadFromLine(
 
     unsigned _flag;
     const size_t flagBufferSize = 20;   // More than enough
-    char flagBuffer[flagBufferSize];
     if (fieldLength[FLAG] >= flagBufferSize) {
         fprintf(stderr,"SAMReader: flag field is too long.\n");
         soft_exit(1);
     }
-    memcpy(flagBuffer,field[FLAG],fieldLength[FLAG]);
-    flagBuffer[fieldLength[FLAG]] = '\0';
-    if (1 != sscanf(flagBuffer,"%d",&_flag)) {
+    if (!parseDecimalField(field[FLAG], fieldLength[FLAG], &_flag)) {
         fprintf(stderr,"SAMReader: couldn't parse FLAG field.\n");
         soft_exit(1);
     }
@@ -425,7 +467,7 @@ SAMReader::parseContigName(
     const Genome* genome,
     char* contigName,
     size_t contigNameBufferSize,
-    unsigned* o_offsetOfContig,
+    GenomeLocation* o_offsetOfContig,
 	int* o_indexOfContig,
     char* field[],
     size_t fieldLength[],
@@ -446,9 +488,9 @@ SAMReader::parseContigName(
     }
 }
 
-    unsigned
+    GenomeLocation
 SAMReader::parseLocation(
-    unsigned offsetOfContig,
+    GenomeLocation offsetOfContig,
     char* field[],
     size_t fieldLength[],
 	unsigned rfield,
@@ -459,18 +501,15 @@ SAMReader::parseLocation(
         //
         // We can't call sscanf directly into the mapped file, becuase it reads to the end of the
         // string even when it's satisfied all of its fields.  Since this can be gigabytes, it's not
-        // really good for perf.  Instead, copy the POS field into a local buffer and null terminate it.
+        // really good for perf.  Instead parse just the field's own characters.
         //
 
         const unsigned posBufferSize = 20;
-        char posBuffer[posBufferSize];
         if (fieldLength[posfield] >= posBufferSize) {
             fprintf(stderr,"SAMReader: POS field too long.\n");
             soft_exit(1);
         }
-        memcpy(posBuffer,field[posfield],fieldLength[posfield]);
-        posBuffer[fieldLength[posfield]] = '\0';
-        if (0 == sscanf(posBuffer,"%d",&oneBasedOffsetWithinContig)) {
+        if (!parseDecimalField(field[posfield], fieldLength[posfield], &oneBasedOffsetWithinContig)) {
             fprintf(stderr,"SAMReader: Unable to parse position when it was expected.\n");
             soft_exit(1);
         }
@@ -532,7 +571,7 @@ SAMReader::reinit(_int64 startingOffset, _int64 amountOfFileToProcess)
 SAMReader::getNextRead(
     Read *read,
     AlignmentResult *alignmentResult,
-    unsigned *genomeLocation,
+    GenomeLocation *genomeLocation,
     Direction *direction,
     unsigned *mapQ, 
     unsigned *flag,
@@ -567,7 +606,7 @@ SAMReader::getNextRead(
         getReadFromLine(context.genome, buffer,buffer + bytes, read, alignmentResult, genomeLocation, direction, mapQ, &lineLength, flag, cigar, clipping);
         read->setBatch(data->getBatch());
         data->advance((newLine + 1) - buffer);
-    } while (context.ignoreSecondaryAlignments && ((*flag) & SAM_SECONDARY));
+    } while (context.ignoreSecondaryAlignments && ((*flag) & (SAM_SECONDARY | SAM_SUPPLEMENTARY)));
 
     return true;
 }
@@ -579,9 +618,17 @@ SAMReader::createReadSupplierGenerator(
     const ReaderContext& context)
 {
     //
-    // single-ended SAM files always can be read with the range splitter.
+    // single-ended SAM files always can be read with the range splitter, unless they have to come out in order.
     //
-    RangeSplitter *splitter = new RangeSplitter(QueryFileSize(fileName), numThreads, 100);
+    if (InputOrder::Enabled) {
+        SAMReader* reader = SAMReader::create(DataSupplier::Default[false], fileName, context, 0, 0);
+        if (reader == NULL) {
+            return NULL;
+        }
+        ReadSupplierQueue* queue = new ReadSupplierQueue((ReadReader*)reader);
+        queue->startReaders();
+        return RestrictToRange(queue, context);
+    }
     return new RangeSplittingReadSupplierGenerator(fileName, true, numThreads, context);
 }
     
@@ -622,18 +669,79 @@ SAMReader::createPairedReadSupplierGenerator(
     }
     ReadSupplierQueue* queue = new ReadSupplierQueue(paired);
     queue->startReaders();
-    return queue;
+    return RestrictPairsToRange(queue, context);
 }
 
 
 const FileFormat* FileFormat::SAM[] = { new SAMFormat(false), new SAMFormat(true) };
 
+const char *SAMFormat::QualityBins = NULL;
+const char *SAMFormat::DroppedTags = NULL;
+
+    bool
+SAMFormat::SetQualityBins(const char *spec)
+{
+    if (0 == strcmp(spec, "illumina")) {
+        spec = "2:2,9:6,19:15,24:22,29:27,34:33,39:37,93:40";
+    }
+
+    char *bins = new char[256];
+    for (int i = 0; i < 256; i++) {
+        bins[i] = (char)i;
+    }
+
+    int previousMax = -1;
+    for (const char *next = spec; '\0' != *next; ) {
+        int max, value, length;
+        if (2 != sscanf(next, "%d:%d%n", &max, &value, &length) || max <= previousMax || max > 93 || value < 0 || value > 93) {
+            delete [] bins;
+            return false;
+        }
+        for (int quality = previousMax + 1; quality <= max; quality++) {
+            bins[quality + '!'] = (char)(value + '!');
+        }
+        previousMax = max;
+        next += length;
+        if (',' == *next) {
+            next++;
+        } else if ('\0' != *next) {
+            delete [] bins;
+            return false;
+        }
+    }
+
+    QualityBins = bins;
+    return true;
+}
+
+//
+// Copy the tab separated optional fields from SAM input that aren't dropped, each after a tab.
+//
+    static char *
+copyKeptSAMTags(char *next, const char *aux, unsigned auxLen)
+{
+    const char *end = aux + auxLen;
+    for (const char *field = aux; field < end; ) {
+        const char *fieldEnd = (const char *)memchr(field, '\t', end - field);
+        if (NULL == fieldEnd) {
+            fieldEnd = end;
+        }
+        if (fieldEnd - field >= 2 && !SAMFormat::dropsTag(field)) {
+            *next++ = '\t';
+            memcpy(next, field, fieldEnd - field);
+            next += fieldEnd - field;
+        }
+        field = fieldEnd + 1;
+    }
+    return next;
+}
+
     void
 SAMFormat::getSortInfo(
     const Genome* genome,
     char* buffer,
     _int64 bytes,
-	unsigned* o_location,
+	GenomeLocation* o_location,
 	unsigned* o_readBytes,
 	int* o_refID,
 	int* o_pos) const
@@ -649,7 +757,7 @@ SAMFormat::getSortInfo(
     if (lengths[SAMReader::POS] == 0 || fields[SAMReader::POS][0] == '*') {
 		if (lengths[SAMReader::PNEXT] == 0 || fields[SAMReader::PNEXT][0] == '*') {
 			if (o_location != NULL) {
-				*o_location = UINT32_MAX;
+				*o_location = UnalignedSortLocation;
 			}
 			if (o_refID != NULL) {
 				*o_refID = -1;
@@ -660,7 +768,7 @@ SAMFormat::getSortInfo(
 		} else {
 			const size_t contigNameBufferSize = 512;
 			char contigName[contigNameBufferSize];
-			unsigned offsetOfContig;
+			GenomeLocation offsetOfContig;
 			SAMReader::parseContigName(genome, contigName, contigNameBufferSize, &offsetOfContig, o_refID, fields, lengths, SAMReader::RNEXT);
 			if (o_location != NULL) {
 				*o_location = SAMReader::parseLocation(offsetOfContig, fields, lengths, SAMReader::RNEXT, SAMReader::PNEXT);
@@ -669,7 +777,7 @@ SAMFormat::getSortInfo(
     } else {
         const size_t contigNameBufferSize = 512;
         char contigName[contigNameBufferSize];
-        unsigned offsetOfContig;
+        GenomeLocation offsetOfContig;
         SAMReader::parseContigName(genome, contigName, contigNameBufferSize, &offsetOfContig, o_refID, fields, lengths);
 		if (o_location != NULL) {
 	        *o_location = SAMReader::parseLocation(offsetOfContig, fields, lengths);
@@ -684,17 +792,15 @@ SAMFormat::getWriterSupplier(
 {
     DataWriterSupplier* dataSupplier;
     if (options->sortOutput) {
-        size_t len = strlen(options->outputFile.fileName);
         // todo: this is going to leak, but there's no easy way to free it, and it's small...
-        char* tempFileName = (char*) malloc(5 + len);
-        strcpy(tempFileName, options->outputFile.fileName);
-        strcpy(tempFileName + len, ".tmp");
-        dataSupplier = DataWriterSupplier::sorted(this, genome, tempFileName, options->sortMemory * (1ULL << 30),
-            options->numThreads, options->outputFile.fileName, NULL);
+        char* tempFileName = DataWriterSupplier::sortTempFileName(options->outputFile.fileName);
+        dataSupplier = DataWriterSupplier::sorted(this, genome, tempFileName, options->getSortMemory(),
+            options->sortKeepMemory * (1ULL << 30), options->numThreads, options->outputFile.fileName, NULL, NULL,
+            options->sortSpillDirectories, options->compressSortSpills);
     } else {
         dataSupplier = DataWriterSupplier::create(options->outputFile.fileName);
     }
-    return ReadWriterSupplier::create(this, dataSupplier, genome);
+    return ReadWriterSupplier::create(this, dataSupplier, genome, options->gapPenalty);
 }
 
     bool
@@ -775,11 +881,11 @@ SAMFormat::writeHeader(
         // Write an @SQ line for each chromosome / contig in the genome
         const Genome::Contig *contigs = context.genome->getContigs();
         int numContigs = context.genome->getNumContigs();
-        unsigned genomeLen = context.genome->getCountOfBases();
+        GenomeLocation genomeLen = context.genome->getCountOfBases();
         for (int i = 0; i < numContigs; i++) {
-            unsigned start = contigs[i].beginningOffset;
-            unsigned end = ((i + 1 < numContigs) ? contigs[i+1].beginningOffset : genomeLen) - context.genome->getChromosomePadding();
-            bytesConsumed += snprintf(header + bytesConsumed, headerBufferSize - bytesConsumed, "@SQ\tSN:%s\tLN:%u\n", contigs[i].name, end - start);
+            GenomeLocation start = contigs[i].beginningOffset;
+            GenomeLocation end = ((i + 1 < numContigs) ? contigs[i+1].beginningOffset : genomeLen) - context.genome->getChromosomePadding();
+            bytesConsumed += snprintf(header + bytesConsumed, headerBufferSize - bytesConsumed, "@SQ\tSN:%s\tLN:%u\n", contigs[i].name, (unsigned)(end - start));
 
             if (bytesConsumed >= headerBufferSize) {
                 fprintf(stderr,"SAMWriter: header buffer too small\n");
@@ -819,14 +925,14 @@ SAMFormat::createSAMLine(
     size_t& qnameLen,
     Read * read,
     AlignmentResult result, 
-    unsigned genomeLocation,
+    GenomeLocation genomeLocation,
     Direction direction,
     bool useM,
     bool hasMate,
     bool firstInPair,
     Read * mate, 
     AlignmentResult mateResult,
-    unsigned mateLocation,
+    GenomeLocation mateLocation,
     Direction mateDirection,
     unsigned *extraBasesClippedBefore,
     unsigned *extraBasesClippedAfter)
@@ -882,6 +988,11 @@ SAMFormat::createSAMLine(
       basesClippedBefore = read->getFrontClippedLength();
       basesClippedAfter = fullLength - clippedLength - basesClippedBefore;
     }
+    if (NULL != QualityBins) {
+        for (unsigned i = 0; i < fullLength; i++) {
+            quality[i] = QualityBins[(unsigned char)quality[i]];
+        }
+    }
 
     int editDistance = -1;
     *extraBasesClippedAfter = 0;
@@ -899,13 +1010,13 @@ SAMFormat::createSAMLine(
             //
             // The read hangs off the end of the contig.  Soft clip it at the end.
             //
-            *extraBasesClippedAfter =genomeLocation + read->getDataLength() - (contig->beginningOffset + contig->length - genome->getChromosomePadding());
+            *extraBasesClippedAfter = (unsigned)(genomeLocation + read->getDataLength() - (contig->beginningOffset + contig->length - genome->getChromosomePadding()));
         }
         genomeLocation += *extraBasesClippedBefore;
 
         contigName = contig->name;
         contigIndex = (int)(contig - genome->getContigs());
-        positionInContig = genomeLocation - contig->beginningOffset + 1; // SAM is 1-based
+        positionInContig = (unsigned)(genomeLocation - contig->beginningOffset + 1); // SAM is 1-based
         mapQuality = max(0, min(70, mapQuality));       // FIXME: manifest constant.
     } else {
         flags |= SAM_UNMAPPED;
@@ -922,7 +1033,7 @@ SAMFormat::createSAMLine(
             mateLocation += mateExtraBasesClippedBefore;
             matecontigName = mateContig->name;
             mateContigIndex = (int)(mateContig - genome->getContigs());
-            matePositionInContig = mateLocation - mateContig->beginningOffset + 1;
+            matePositionInContig = (unsigned)(mateLocation - mateContig->beginningOffset + 1);
 
             if (mateDirection == RC) {
                 flags |= SAM_NEXT_REVERSED;
@@ -987,20 +1098,22 @@ SAMFormat::writeRead(
     Read * read,
     AlignmentResult result, 
     int mapQuality,
-    unsigned genomeLocation,
+    GenomeLocation genomeLocation,
     Direction direction,
     bool hasMate,
     bool firstInPair,
     Read * mate, 
     AlignmentResult mateResult,
-    unsigned mateLocation,
-    Direction mateDirection) const
+    GenomeLocation mateLocation,
+    Direction mateDirection,
+    const SpliceJunction *splice,
+    const SplitRecord *split) const
 {
     const int MAX_READ = MAX_READ_LENGTH;
     const int cigarBufSize = MAX_READ * 2;
     char cigarBuf[cigarBufSize];
 
-    const int cigarBufWithClippingSize = MAX_READ * 2 + 32;
+    const int cigarBufWithClippingSize = MAX_READ * 2 + 48;    // room for four clipping ops
     char cigarBufWithClipping[cigarBufWithClippingSize];
 
     int flags = 0;
@@ -1037,8 +1150,14 @@ SAMFormat::writeRead(
     if (genomeLocation != InvalidGenomeLocation) {
         cigar = computeCigarString(genome, lv, cigarBuf, cigarBufSize, cigarBufWithClipping, cigarBufWithClippingSize, 
                                    clippedData, clippedLength, basesClippedBefore, extraBasesClippedBefore, basesClippedAfter, extraBasesClippedAfter, 
-                                   read->getOriginalFrontHardClipping(), read->getOriginalBackHardClipping(), genomeLocation, direction, useM, &editDistance);
+                                   read->getOriginalFrontHardClipping(), read->getOriginalBackHardClipping(), genomeLocation, direction, useM, &editDistance,
+                                   splice);
+    }
+    if (NULL != split && split->supplementary) {
+        flags |= SAM_SUPPLEMENTARY;
     }
+    const char *otherAlignment = NULL != split && genomeLocation != InvalidGenomeLocation && !dropsTag("SA") ? split->otherAlignment : "";
+    size_t otherAlignmentLen = strlen(otherAlignment);
 
     // Write the SAM entry, which requires the following fields:
     //
@@ -1062,10 +1181,6 @@ SAMFormat::writeRead(
         qnameLen = (unsigned)(firstSpace - read->getId());
     }
 
-    const int nmStringSize = 30;// Big enough that it won't buffer overflow regardless of the value of editDistance
-    char nmString[nmStringSize];  
-    snprintf(nmString, nmStringSize, "\tNM:i:%d",editDistance);
-
     unsigned auxLen;
     bool auxSAM;
     char* aux = read->getAuxiliaryData(&auxLen, &auxSAM);
@@ -1093,38 +1208,186 @@ SAMFormat::writeRead(
         readGroupSeparator = "\tRG:Z:";
         readGroupString = read->getReadGroup();
     }
-    int charsInString = snprintf(buffer, bufferSpace, "%.*s\t%d\t%s\t%u\t%d\t%s\t%s\t%u\t%lld\t%.*s\t%.*s%s%.*s%s%s\tPG:Z:SNAP%s\n",
-        qnameLen, read->getId(),
-        flags,
-        contigName,
-        positionInContig,
-        mapQuality,
-        cigar,
-        matecontigName,
-        matePositionInContig,
-        templateLength,
-        fullLength, data,
-        fullLength, quality,
-        aux != NULL ? "\t" : "", auxLen, aux != NULL ? aux : "",
-        readGroupSeparator, readGroupString,
-        nmString);
-
-    if (charsInString > bufferSpace) {
+    if (dropsTag("RG")) {
+        readGroupSeparator = "";
+        readGroupString = "";
+    }
+    //
+    // Write the line by hand; with snprintf, formatting was one of the bigger costs of writing SAM.  First make sure the
+    // longest it could be will fit: every number is at most 20 digits and a sign, and the fixed text is 32 characters.
+    //
+    size_t contigNameLen = strlen(contigName);
+    size_t cigarLen = strlen(cigar);
+    size_t mateContigNameLen = strlen(matecontigName);
+    size_t readGroupSeparatorLen = strlen(readGroupSeparator);
+    size_t readGroupStringLen = strlen(readGroupString);
+    size_t maxLength = qnameLen + contigNameLen + cigarLen + mateContigNameLen + 2 * (size_t) fullLength + 1 + auxLen +
+        readGroupSeparatorLen + readGroupStringLen + 6 * 21 + 32 + 7 +  // and XS:A for a spliced read
+        6 + otherAlignmentLen;                                          // and SA:Z for a split one
+    if (maxLength > bufferSpace) {
         //
         // Out of buffer space.
         //
         return false;
-    } else if (charsInString == bufferSpace) {
-      buffer[bufferSpace-1] = '\n'; // overwrite trailing null with newline
     }
 
+    char* next = buffer;
+    memcpy(next, read->getId(), qnameLen);
+    next += qnameLen;
+    *next++ = '\t';
+    next = util::formatDecimal(next, (_int64) flags);
+    *next++ = '\t';
+    memcpy(next, contigName, contigNameLen);
+    next += contigNameLen;
+    *next++ = '\t';
+    next = util::formatDecimal(next, (_uint64) positionInContig);
+    *next++ = '\t';
+    next = util::formatDecimal(next, (_int64) mapQuality);
+    *next++ = '\t';
+    memcpy(next, cigar, cigarLen);
+    next += cigarLen;
+    *next++ = '\t';
+    memcpy(next, matecontigName, mateContigNameLen);
+    next += mateContigNameLen;
+    *next++ = '\t';
+    next = util::formatDecimal(next, (_uint64) matePositionInContig);
+    *next++ = '\t';
+    next = util::formatDecimal(next, templateLength);
+    *next++ = '\t';
+    memcpy(next, data, fullLength);
+    next += fullLength;
+    *next++ = '\t';
+    memcpy(next, quality, fullLength);
+    next += fullLength;
+    if (aux != NULL && NULL != DroppedTags) {
+        next = copyKeptSAMTags(next, aux, auxLen);
+    } else if (aux != NULL) {
+        *next++ = '\t';
+        memcpy(next, aux, auxLen);
+        next += auxLen;
+    }
+    memcpy(next, readGroupSeparator, readGroupSeparatorLen);
+    next += readGroupSeparatorLen;
+    memcpy(next, readGroupString, readGroupStringLen);
+    next += readGroupStringLen;
+    if (!dropsTag("PG")) {
+        memcpy(next, "\tPG:Z:SNAP", 10);
+        next += 10;
+    }
+    if (!dropsTag("NM")) {
+        memcpy(next, "\tNM:i:", 6);
+        next += 6;
+        next = util::formatDecimal(next, (_int64) editDistance);
+    }
+    if (NULL != splice && 0 != splice->strand && genomeLocation != InvalidGenomeLocation && !dropsTag("XS")) {
+        memcpy(next, "\tXS:A:", 6);
+        next += 6;
+        *next++ = splice->strand;
+    }
+    if (0 != otherAlignmentLen) {
+        memcpy(next, "\tSA:Z:", 6);
+        next += 6;
+        memcpy(next, otherAlignment, otherAlignmentLen);
+        next += otherAlignmentLen;
+    }
+    *next++ = '\n';
+    _ASSERT((size_t)(next - buffer) <= maxLength);
 
     if (NULL != spaceUsed) {
-        *spaceUsed = charsInString;
+        *spaceUsed = next - buffer;
     }
     return true;
 }
 
+    unsigned
+SAMFormat::referenceLengthForCigar(const Genome *genome, GenomeLocation genomeLocation, unsigned dataLength)
+{
+    unsigned referenceLength = LandauVishkinWithCigar::TextLengthForPattern(dataLength);
+    if (referenceLength > dataLength) {
+        const Genome::Contig *contig = genome->getContigAtLocation(genomeLocation);
+        if (NULL != contig && genomeLocation + referenceLength > contig->beginningOffset + contig->length) {
+            referenceLength = __max(dataLength, (unsigned)(contig->beginningOffset + contig->length - genomeLocation));
+        }
+    }
+    return referenceLength;
+}
+
+//
+// The reference bases (M, D, N, = and X) a CIGAR string covers.
+//
+    static unsigned
+referenceBasesInCigar(const char *cigar)
+{
+    unsigned referenceBases = 0;
+    unsigned count = 0;
+    for (const char *next = cigar; '\0' != *next; next++) {
+        if (*next >= '0' && *next <= '9') {
+            count = count * 10 + (*next - '0');
+        } else {
+            if (NULL != strchr("MDN=X", *next)) {
+                referenceBases += count;
+            }
+            count = 0;
+        }
+    }
+    return referenceBases;
+}
+
+//
+// The CIGAR for a spliced read: the piece before the junction, an N for the intron and then the piece after it, with
+// LV on each piece.  The first piece's reference stops at the second's start, so the intron can't come out negative.
+// Returns the edit distance of both pieces together, or -1 or -2 as LV would.
+//
+    int
+SAMFormat::computeSplicedCigar(
+    const Genome *              genome,
+    LandauVishkinWithCigar *    lv,
+    char *                      cigarBuf,
+    int                         cigarBufLen,
+    const char *                data,
+    unsigned                    dataLength,
+    GenomeLocation              genomeLocation,
+    const SpliceJunction *      splice,
+    bool                        useM)
+{
+    if (splice->readOffset == 0 || splice->readOffset >= dataLength || splice->secondLocation <= genomeLocation) {
+        return -1;
+    }
+
+    char referenceBuffer[MAX_READ_LENGTH + MAX_READ_LENGTH / 4 + 2 * MAX_K];
+    unsigned firstLength = splice->readOffset;
+    unsigned firstReferenceLength = __min(referenceLengthForCigar(genome, genomeLocation, firstLength), splice->secondLocation - genomeLocation);
+    const char *reference = genome->getSubstring(genomeLocation, firstReferenceLength, referenceBuffer, sizeof(referenceBuffer));
+    if (NULL == reference) {
+        return -1;
+    }
+    int firstEditDistance = lv->computeEditDistanceNormalized(reference, firstReferenceLength, data, firstLength, MAX_K - 1, cigarBuf, cigarBufLen, useM);
+    if (firstEditDistance < 0) {
+        return firstEditDistance;
+    }
+
+    size_t used = strlen(cigarBuf);
+    if (used + 12 >= (size_t) cigarBufLen) {
+        return -2;
+    }
+    char *next = util::formatDecimal(cigarBuf + used, (_uint64) (splice->secondLocation - genomeLocation - referenceBasesInCigar(cigarBuf)));
+    *next++ = 'N';
+
+    unsigned secondLength = dataLength - firstLength;
+    unsigned secondReferenceLength = referenceLengthForCigar(genome, splice->secondLocation, secondLength);
+    reference = genome->getSubstring(splice->secondLocation, secondReferenceLength, referenceBuffer, sizeof(referenceBuffer));
+    if (NULL == reference) {
+        return -1;
+    }
+    int secondEditDistance = lv->computeEditDistanceNormalized(reference, secondReferenceLength, data + firstLength, secondLength, MAX_K - 1,
+                                next, cigarBufLen - (int) (next - cigarBuf), useM);
+    if (secondEditDistance < 0) {
+        return secondEditDistance;
+    }
+
+    return firstEditDistance + secondEditDistance;
+}
+
 // Compute the CIGAR edit sequence string for a read against a given genome location.
 // Returns this string if possible or "*" if we fail to compute it (which would likely
 // be a bug due to lack of buffer space). The pointer returned may be to cigarBuf so it
@@ -1145,10 +1408,11 @@ SAMFormat::computeCigarString(
     unsigned                    extraBasesClippedAfter,
     unsigned                    frontHardClipping,
     unsigned                    backHardClipping,
-    unsigned                    genomeLocation,
+    GenomeLocation              genomeLocation,
     Direction                   direction,
 	bool						useM,
-    int *                       editDistance
+    int *                       editDistance,
+    const SpliceJunction *      splice
 )
 {
     //
@@ -1158,22 +1422,27 @@ SAMFormat::computeCigarString(
     data += extraBasesClippedBefore;
     dataLength -= extraBasesClippedBefore;
 
-    const char *reference = genome->getSubstring(genomeLocation, dataLength);
-    if (NULL != reference) {
+    if (NULL != splice && 0 == extraBasesClippedBefore && 0 == extraBasesClippedAfter) {
+        *editDistance = computeSplicedCigar(genome, lv, cigarBuf, cigarBufLen, data, dataLength, genomeLocation, splice, useM);
+    } else {
+        char referenceBuffer[MAX_READ_LENGTH + MAX_READ_LENGTH / 4 + 2 * MAX_K];   // Only used if the genome is packed; room for TextLengthForPattern
+        unsigned referenceLength = referenceLengthForCigar(genome, genomeLocation, dataLength);
+        const char *reference = genome->getSubstring(genomeLocation, referenceLength, referenceBuffer, sizeof(referenceBuffer));
+        if (NULL == reference) {
+            //
+            // Fell off the end of the chromosome.
+            //
+            return "*";
+        }
         *editDistance = lv->computeEditDistanceNormalized(
                             reference,
-                            dataLength - extraBasesClippedAfter,
+                            referenceLength - extraBasesClippedAfter,
                             data,
                             dataLength - extraBasesClippedAfter,
                             MAX_K - 1,
                             cigarBuf,
                             cigarBufLen,
 						    useM);
-    } else {
-        //
-        // Fell off the end of the chromosome.
-        //
-        return "*";
     }
 
     if (*editDistance == -2) {
@@ -1187,24 +1456,35 @@ SAMFormat::computeCigarString(
         }
         return "*";
     } else {
-        // Add some CIGAR instructions for soft-clipping if we've ignored some bases in the read.
-        char clipBefore[16] = {'\0'};
-        char clipAfter[16] = {'\0'};
-        char hardClipBefore[16] = {'\0'};
-        char hardClipAfter[16] = {'\0'};
+        //
+        // Add some CIGAR instructions for soft-clipping if we've ignored some bases in the read.  Each of the four clipping
+        // ops is at most 11 characters.
+        //
+        size_t cigarLen = strlen(cigarBuf);
+        if (cigarLen + 4 * 11 + 1 > (size_t) cigarBufWithClippingLen) {
+            fprintf(stderr, "WARNING: cigarBufWithClipping is too small\n");
+            return "*";
+        }
+        char* next = cigarBufWithClipping;
         if (frontHardClipping > 0) {
-            snprintf(hardClipBefore, sizeof(hardClipBefore), "%uH", frontHardClipping);
+            next = util::formatDecimal(next, (_uint64) frontHardClipping);
+            *next++ = 'H';
         }
         if (basesClippedBefore + extraBasesClippedBefore > 0) {
-            snprintf(clipBefore, sizeof(clipBefore), "%uS", basesClippedBefore + extraBasesClippedBefore);
+            next = util::formatDecimal(next, (_uint64) (basesClippedBefore + extraBasesClippedBefore));
+            *next++ = 'S';
         }
+        memcpy(next, cigarBuf, cigarLen);
+        next += cigarLen;
         if (basesClippedAfter + extraBasesClippedAfter > 0) {
-            snprintf(clipAfter, sizeof(clipAfter), "%uS", basesClippedAfter + extraBasesClippedAfter);
+            next = util::formatDecimal(next, (_uint64) (basesClippedAfter + extraBasesClippedAfter));
+            *next++ = 'S';
         }
         if (backHardClipping > 0) {
-            snprintf(hardClipAfter, sizeof(hardClipAfter), "%uH", backHardClipping);
+            next = util::formatDecimal(next, (_uint64) backHardClipping);
+            *next++ = 'H';
         }
-        snprintf(cigarBufWithClipping, cigarBufWithClippingLen, "%s%s%s%s%s", hardClipBefore, clipBefore, cigarBuf, clipAfter, hardClipAfter);
+        *next = '\0';
 
         return cigarBufWithClipping;
     }
@@ -47,6 +47,7 @@ const int SAM_LAST_SEGMENT       = 0x080; // This is the last segment in the rea
 const int SAM_SECONDARY          = 0x100; // Secondary alignment for a read with multiple hits.
 const int SAM_FAILED_QC          = 0x200; // Not passing quality controls.
 const int SAM_DUPLICATE          = 0x400; // PCR or optical duplicate.
+const int SAM_SUPPLEMENTARY      = 0x800; // Another piece of a chimeric read, whose primary alignment is elsewhere.
 
 class SAMReader : public ReadReader {
 public:
@@ -58,7 +59,7 @@ public:
 
         virtual bool getNextRead(Read *readToUpdate);
     
-        virtual bool getNextRead(Read *read, AlignmentResult *alignmentResult, unsigned *genomeLocation, Direction *direction, unsigned *mapQ,
+        virtual bool getNextRead(Read *read, AlignmentResult *alignmentResult, GenomeLocation *genomeLocation, Direction *direction, unsigned *mapQ,
                         unsigned *flag, const char **cigar)
         {
             return getNextRead(read, alignmentResult, genomeLocation, direction, mapQ, flag, false, cigar);
@@ -114,16 +115,16 @@ protected:
             size_t *lineLength, size_t fieldLengths[]);
 
         static void parseContigName(const Genome* genome, char* contigName,
-            size_t contigNameBufferSize, unsigned* o_offsetOfContig, int* o_indexOfContig,
+            size_t contigNameBufferSize, GenomeLocation* o_offsetOfContig, int* o_indexOfContig,
             char* field[], size_t fieldLength[], unsigned rfield = RNAME);
 
-        static unsigned parseLocation(unsigned offsetOfContig, char* field[], size_t fieldLength[], unsigned rfield = RNAME, unsigned posfield = POS);
+        static GenomeLocation parseLocation(GenomeLocation offsetOfContig, char* field[], size_t fieldLength[], unsigned rfield = RNAME, unsigned posfield = POS);
 
         virtual bool getNextRead(Read *read, AlignmentResult *alignmentResult, 
-                        unsigned *genomeLocation, Direction *direction, unsigned *mapQ, unsigned *flag, bool ignoreEndOfRange, const char **cigar);
+                        GenomeLocation *genomeLocation, Direction *direction, unsigned *mapQ, unsigned *flag, bool ignoreEndOfRange, const char **cigar);
 
         static void getReadFromLine(const Genome *genome, char *line, char *endOfBuffer, Read *read, AlignmentResult *alignmentResult,
-                        unsigned *genomeLocation, Direction *direction, unsigned *mapQ, 
+                        GenomeLocation *genomeLocation, Direction *direction, unsigned *mapQ, 
                         size_t *lineLength, unsigned *flag, const char **cigar, ReadClippingType clipping);
 
 
@@ -144,7 +145,7 @@ class SAMFormat : public FileFormat
 public:
     SAMFormat(bool i_useM) : useM(i_useM) {}
 
-    virtual void getSortInfo(const Genome* genome, char* buffer, _int64 bytes, unsigned* o_location, unsigned* o_readBytes, int* o_refID, int* o_pos) const;
+    virtual void getSortInfo(const Genome* genome, char* buffer, _int64 bytes, GenomeLocation* o_location, unsigned* o_readBytes, int* o_refID, int* o_pos) const;
 
     virtual ReadWriterSupplier* getWriterSupplier(AlignerOptions* options, const Genome* genome) const;
 
@@ -155,9 +156,10 @@ public:
     virtual bool writeRead(
         const Genome * genome, LandauVishkinWithCigar * lv, char * buffer, size_t bufferSpace, 
         size_t * spaceUsed, size_t qnameLen, Read * read, AlignmentResult result, 
-        int mapQuality, unsigned genomeLocation, Direction direction,
+        int mapQuality, GenomeLocation genomeLocation, Direction direction,
         bool hasMate = false, bool firstInPair = false, Read * mate = NULL, 
-        AlignmentResult mateResult = NotFound, unsigned mateLocation = 0, Direction mateDirection = FORWARD) const; 
+        AlignmentResult mateResult = NotFound, GenomeLocation mateLocation = 0, Direction mateDirection = FORWARD,
+        const SpliceJunction *splice = NULL, const SplitRecord *split = NULL) const;
 
     // calculate data needed to write SAM/BAM record
     // very long argument list since this was extracted from
@@ -189,24 +191,58 @@ public:
         size_t& qnameLen,
         Read * read,
         AlignmentResult result, 
-        unsigned genomeLocation,
+        GenomeLocation genomeLocation,
         Direction direction,
         bool useM,
         bool hasMate,
         bool firstInPair,
         Read * mate, 
         AlignmentResult mateResult,
-        unsigned mateLocation,
+        GenomeLocation mateLocation,
         Direction mateDirection,
         unsigned *extraBasesClippedBefore,
         unsigned *extraBasesClippedAfter);
 
+    //
+    // How much of the reference to give LandauVishkinWithCigar::computeEditDistanceNormalized for a read of dataLength
+    // bases at genomeLocation: just as much as the read for ordinary reads, and for long ones the (longer) length it
+    // asks for, if the contig has that much.
+    //
+    static unsigned referenceLengthForCigar(const Genome *genome, GenomeLocation genomeLocation, unsigned dataLength);
+
+    //
+    // Making the output smaller, for all of the SAM, BAM and CRAM writers; set from the options before anything's written.
+    // QualityBins maps each quality character to the one to write, or is NULL to write them as they are.  DroppedTags
+    // is the two character tags not to write, run together, whether they'd come from the input or from SNAP itself.
+    //
+    static const char *QualityBins;
+    static const char *DroppedTags;
+
+    //
+    // "illumina" for Illumina's eight levels, or max:value,... with the maxes in increasing order, so that each quality
+    // up to a max (and over the max before it) is written as the value.  Higher qualities are written as they are.
+    // Returns false if spec doesn't parse.
+    //
+    static bool SetQualityBins(const char *spec);
+
+    static bool dropsTag(const char *tag) {
+        for (const char *dropped = DroppedTags; NULL != dropped && '\0' != dropped[0] && '\0' != dropped[1]; dropped += 2) {
+            if (dropped[0] == tag[0] && dropped[1] == tag[1]) {
+                return true;
+            }
+        }
+        return false;
+    }
+
 private:
     static const char * computeCigarString(const Genome * genome, LandauVishkinWithCigar * lv,
         char * cigarBuf, int cigarBufLen, char * cigarBufWithClipping, int cigarBufWithClippingLen,
         const char * data, unsigned dataLength, unsigned basesClippedBefore, unsigned extraBasesClippedBefore, unsigned basesClippedAfter, 
         unsigned extraBasesClippedAfter, unsigned frontHardCliped, unsigned backHardClipped,
-        unsigned genomeLocation, Direction direction, bool useM, int * editDistance);
+        GenomeLocation genomeLocation, Direction direction, bool useM, int * editDistance, const SpliceJunction * splice);
+
+    static int computeSplicedCigar(const Genome * genome, LandauVishkinWithCigar * lv, char * cigarBuf, int cigarBufLen,
+        const char * data, unsigned dataLength, GenomeLocation genomeLocation, const SpliceJunction * splice, bool useM);
 
     const bool useM;
 };
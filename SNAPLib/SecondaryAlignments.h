@@ -0,0 +1,139 @@
+/*++
+
+Module Name:
+
+    SecondaryAlignments.h
+
+Abstract:
+
+    The candidates an aligner keeps while it scores, for writing as secondary alignments.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "BigAlloc.h"
+#include "VariableSizeVector.h"
+#include <algorithm>
+
+//
+// The best few scored locations (or pairs of locations) seen during the aligner's main pass, kept in a bounded heap
+// with the worst on top, so that -om costs one heap operation per candidate the aligner scores anyway rather than a
+// second search.  A candidate more than scoreDelta worse than the best seen so far is dropped on the way in.  At the
+// end the survivors that aren't just the primary alignment (or each other) shifted by an indel become the secondary
+// alignments.
+//
+class SecondaryAlignments
+{
+public:
+    static const unsigned MaxSecondaryAlignments = 64;
+    static const unsigned DefaultMaxSecondaryAlignments = 16;
+
+    SecondaryAlignments() : maxSecondary(DefaultMaxSecondaryAlignments), scoreDelta(0), count(0), bestScore(0) {}
+
+    void setLimits(unsigned i_maxSecondary, unsigned i_scoreDelta)
+    {
+        maxSecondary = __min(i_maxSecondary, MaxSecondaryAlignments);
+        scoreDelta = i_scoreDelta;
+    }
+
+    inline void reset() {count = 0;}
+
+    //
+    // A scored candidate; second is for the other end of a pair.
+    //
+    void add(int score, double probability, IdPair first, IdPair second = IdPair())
+    {
+        if (count > 0 && score > bestScore + (int)scoreDelta) {
+            return;
+        }
+        if (0 == count || score < bestScore) {
+            bestScore = score;
+        }
+
+        Candidate candidate;
+        candidate.locations[0] = first;
+        candidate.locations[1] = second;
+        candidate.score = score;
+        candidate.probability = probability;
+
+        //
+        // Twice maxSecondary and one more, since the primary alignment is usually among them and so may be a few
+        // near duplicates that emit leaves out.
+        //
+        if (count <= 2 * maxSecondary) {
+            candidates[count++] = candidate;
+            std::push_heap(candidates, candidates + count, Candidate::better);
+        } else if (Candidate::better(candidate, candidates[0])) {
+            std::pop_heap(candidates, candidates + count, Candidate::better);
+            candidates[count - 1] = candidate;
+            std::push_heap(candidates, candidates + count, Candidate::better);
+        }
+    }
+
+    //
+    // Fills in secondary, best first, with nLocations entries per alignment (1 for single end, 2 for paired), leaving out
+    // the ones within mergeDistance of primary or of a better one.
+    //
+    void emit(IdPairVector *secondary, const IdPair *primary, unsigned nLocations, unsigned mergeDistance)
+    {
+        secondary->clear();
+        std::sort(candidates, candidates + count, Candidate::better);
+
+        unsigned nEmitted = 0;
+        for (unsigned i = 0; i < count && nEmitted < maxSecondary; i++) {
+            const Candidate &candidate = candidates[i];
+            if (candidate.score > bestScore + (int)scoreDelta || isNear(candidate.locations, primary, nLocations, mergeDistance)) {
+                continue;
+            }
+
+            bool duplicate = false;
+            for (unsigned j = 0; j < i && !duplicate; j++) {
+                duplicate = isNear(candidate.locations, candidates[j].locations, nLocations, mergeDistance) &&
+                    !isNear(candidates[j].locations, primary, nLocations, mergeDistance);
+            }
+            if (duplicate) {
+                continue;
+            }
+
+            for (unsigned k = 0; k < nLocations; k++) {
+                secondary->push_back(candidate.locations[k]);
+            }
+            nEmitted++;
+        }
+        count = 0;
+    }
+
+private:
+    struct Candidate {
+        IdPair      locations[2];   // Location in id, direction in value
+        int         score;
+        double      probability;
+
+        static bool better(const Candidate &a, const Candidate &b)
+        {
+            return a.score < b.score || (a.score == b.score && a.probability > b.probability);
+        }
+    };
+
+    static bool isNear(const IdPair *a, const IdPair *b, unsigned nLocations, unsigned mergeDistance)
+    {
+        for (unsigned k = 0; k < nLocations; k++) {
+            if (a[k].value != b[k].value || (a[k].id > b[k].id ? a[k].id - b[k].id : b[k].id - a[k].id) > mergeDistance) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    unsigned    maxSecondary;
+    unsigned    scoreDelta;
+    unsigned    count;
+    int         bestScore;
+    Candidate   candidates[2 * MaxSecondaryAlignments + 1];
+};
@@ -25,6 +25,10 @@ Revision History:
 #include "stdafx.h"
 #include "Seed.h"
 
+#if     defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
     bool
 Seed::DoesTextRepresentASeed(const char *textBases, unsigned seedLen)
 {
@@ -43,14 +47,231 @@ Seed::DoesTextRepresentASeed(const char *textBases, unsigned seedLen)
     
     Seed
 Seed::fromBases(
-    _int64 bases,
+    SeedBases bases,
     int seedLength)
 {
-    _int64 rc = 0;
-    _int64 b = bases;
+    SeedBases rc = (_uint64)0;
+    SeedBases b = bases;
     for (int i = 0; i < seedLength; i++) {
-        rc = (rc << 2) | ((b & 3) ^ 3);
+        rc = (rc << 2) | (SeedBases)((LowWord(b) & 3) ^ 3);
         b = b >> 2;
     }
     return Seed(bases, rc);
-}
\ No newline at end of file
+}
+
+    void
+Seed::FindMinimizers(
+    const _uint64 *hashes,
+    unsigned nPositions,
+    unsigned window,
+    bool *o_isMinimizer)
+{
+    memset(o_isMinimizer, 0, nPositions * sizeof(bool));
+    window = __min(window, nPositions);
+    if (0 == window) {
+        return;
+    }
+
+    //
+    // Only rescan a run when the smallest hash of the last one has dropped off its front, which on random sequence
+    // happens about once every window/2 locations.
+    //
+    unsigned best = 0;
+    for (unsigned first = 0; first + window <= nPositions; first++) {
+        unsigned last = first + window - 1;
+        if (0 == first || best < first) {
+            best = first;
+            for (unsigned i = first + 1; i <= last; i++) {
+                if (hashes[i] < hashes[best]) {
+                    best = i;
+                }
+            }
+        } else if (hashes[last] < hashes[best]) {
+            best = last;
+        }
+        if (NotASeedHash != hashes[best]) {
+            o_isMinimizer[best] = true;
+        }
+    }
+}
+
+//
+// Each stream has a word past the last one any read uses, so that extract and isSeed can always look at the word after
+// the one a seed starts in.
+//
+    static unsigned
+PackedWords(
+    unsigned maxReadSize)
+{
+    return (maxReadSize + 31) / 32 + 1;
+}
+
+    static unsigned
+NotACGTWords(
+    unsigned maxReadSize)
+{
+    return (maxReadSize + 63) / 64 + 1;
+}
+
+    size_t
+PackedSeeds::getStorageSize(
+    unsigned maxReadSize)
+{
+    return sizeof(_uint64) * (2 * PackedWords(maxReadSize) + NotACGTWords(maxReadSize));
+}
+
+    void
+PackedSeeds::setStorage(
+    void* storage,
+    unsigned maxReadSize)
+{
+    forward = (_uint64*) storage;
+    backward = forward + PackedWords(maxReadSize);
+    notACGT = backward + PackedWords(maxReadSize);
+}
+
+//
+// Packs 16 bases with the first in the low bits, and returns a bit (again, first in the low one) for each that isn't
+// ACGT.  Those get whatever code falls out, since no seed that includes them is used.
+//
+    static inline unsigned
+Pack16(
+    const char* bases,
+    unsigned* o_notACGT)
+{
+#if     defined(__SSE2__) || defined(_M_X64)
+    __m128i text = _mm_loadu_si128((const __m128i*) bases);
+    __m128i isACGT = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(text, _mm_set1_epi8('A')), _mm_cmpeq_epi8(text, _mm_set1_epi8('C'))),
+        _mm_or_si128(_mm_cmpeq_epi8(text, _mm_set1_epi8('G')), _mm_cmpeq_epi8(text, _mm_set1_epi8('T'))));
+    *o_notACGT = ~_mm_movemask_epi8(isACGT) & 0xffff;
+
+    //
+    // In ASCII, the low bit of BASE_VALUE (A, G, C, T to 0, 1, 2, 3) is bit 2 of the character, and the high bit is
+    // bit 1 xor bit 2.  Movemask gathers the top bit of each byte, so shift the one wanted up there.  The shifts are of
+    // 16 bit lanes, but what crosses between the bytes never lands in a top bit.
+    //
+    _uint64 low = (unsigned) _mm_movemask_epi8(_mm_slli_epi16(text, 5));
+    _uint64 high = (unsigned) _mm_movemask_epi8(_mm_slli_epi16(_mm_xor_si128(text, _mm_srli_epi16(text, 1)), 6));
+
+    //
+    // Spread the bits out so each gets a pair, and put the two bits of each code back together.
+    //
+    _uint64 spread = low | (high << 32);
+    spread = (spread | (spread << 8)) & 0x00ff00ff00ff00ffull;
+    spread = (spread | (spread << 4)) & 0x0f0f0f0f0f0f0f0full;
+    spread = (spread | (spread << 2)) & 0x3333333333333333ull;
+    spread = (spread | (spread << 1)) & 0x5555555555555555ull;
+    return (unsigned) spread | ((unsigned) (spread >> 32) << 1);
+#else   // SSE2
+    unsigned packed = 0;
+    unsigned notACGT = 0;
+    for (unsigned i = 0; i < 16; i++) {
+        unsigned value = BASE_VALUE[(unsigned char) bases[i]];
+        switch (bases[i]) {
+            case 'A':
+            case 'G':
+            case 'C':
+            case 'T':
+                packed |= value << (i * 2);
+                break;
+            default:
+                notACGT |= 1 << i;
+        }
+    }
+    *o_notACGT = notACGT;
+    return packed;
+#endif  // SSE2
+}
+
+//
+// Reverses the order of the 16 two bit codes in a word.
+//
+    static inline unsigned
+Reverse16(
+    unsigned packed)
+{
+    packed = ((packed >> 2) & 0x33333333) | ((packed & 0x33333333) << 2);
+    packed = ((packed >> 4) & 0x0f0f0f0f) | ((packed & 0x0f0f0f0f) << 4);
+    packed = ((packed >> 8) & 0x00ff00ff) | ((packed & 0x00ff00ff) << 8);
+    return (packed >> 16) | (packed << 16);
+}
+
+    void
+PackedSeeds::pack(
+    const char* bases,
+    unsigned length)
+{
+    _ASSERT(NULL != forward);
+    readLen = length;
+    unsigned nChunks = (length + 15) / 16;
+
+    //
+    // Go 16 bases at a time, forwards from the start for the forward stream and the N mask, and backwards from the end
+    // for the backward one.  A last short chunk is copied out and padded with Ns, at the end going forwards and at the
+    // start going backwards, so that the padding lands past the end of the read in both streams.
+    //
+    char partial[16];
+    for (unsigned chunk = 0; chunk < nChunks; chunk++) {
+        unsigned start = chunk * 16;
+        unsigned n = __min(16u, length - start);
+        const char* forwardBases = bases + start;
+        const char* backwardBases = bases + length - start - n;
+        if (n < 16) {
+            memset(partial, 'N', sizeof(partial));
+            memcpy(partial, forwardBases, n);
+            forwardBases = partial;
+        }
+
+        unsigned notACGTBits;
+        _uint64 packed = Pack16(forwardBases, &notACGTBits);
+        if (0 == chunk % 2) {
+            forward[chunk / 2] = packed;
+        } else {
+            forward[chunk / 2] |= packed << 32;
+        }
+        if (0 == chunk % 4) {
+            notACGT[chunk / 4] = notACGTBits;
+        } else {
+            notACGT[chunk / 4] |= (_uint64) notACGTBits << (16 * (chunk % 4));
+        }
+
+        if (n < 16) {
+            memset(partial, 'N', sizeof(partial));
+            memcpy(partial + 16 - n, bases, n);
+            backwardBases = partial;
+        }
+        unsigned ignored;
+        packed = Reverse16(Pack16(backwardBases, &ignored));
+        if (0 == chunk % 2) {
+            backward[chunk / 2] = packed;
+        } else {
+            backward[chunk / 2] |= packed << 32;
+        }
+    }
+
+    //
+    // Make the words after the last chunk hold something, since extract and isSeed look at them even though the bits
+    // they take from them get masked off.
+    //
+    forward[(nChunks + 1) / 2] = 0;
+    backward[(nChunks + 1) / 2] = 0;
+    notACGT[(nChunks + 3) / 4] = 0;
+}
+
+    void
+PackedSeeds::findMinimizers(
+    unsigned seedLen,
+    unsigned window,
+    _uint64* hashes,
+    bool* o_isMinimizer) const
+{
+    if (readLen < seedLen) {
+        return;
+    }
+    unsigned nSeeds = readLen - seedLen + 1;
+    for (unsigned offset = 0; offset < nSeeds; offset++) {
+        hashes[offset] = isSeed(offset, seedLen) ? getSeed(offset, seedLen).hash64() : Seed::NotASeedHash;
+    }
+    Seed::FindMinimizers(hashes, nSeeds, window, o_isMinimizer);
+}
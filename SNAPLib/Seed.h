@@ -25,11 +25,10 @@ Revision History:
 #pragma once
 
 #include "Compat.h"
+#include "SeedBases.h"
 #include "Tables.h"
 #include "Util.h"
 
-const unsigned LargestSeedSize = 32;
-
 
 struct Seed {
     //
@@ -44,42 +43,42 @@ struct Seed {
         reverseComplement = 0;
 
         for (unsigned i = 0; i < seedLen; i++) {
-            _uint64 encodedBase = BASE_VALUE[textBases[i]];
-            _ASSERT(255 != encodedBase);
+            SeedBases encodedBase = (_uint64)BASE_VALUE[textBases[i]];
+            _ASSERT(255 != BASE_VALUE[textBases[i]]);
 
             bases |= encodedBase << ((seedLen - i - 1) * 2);
-            reverseComplement |= (encodedBase ^ 0x3) << (i * 2);
+            reverseComplement |= (encodedBase ^ (_uint64)0x3) << (i * 2);
         }
     }
 
     inline Seed() {}
 
-    inline Seed(_int64 i_bases, _int64 i_reverseComplement)
+    inline Seed(SeedBases i_bases, SeedBases i_reverseComplement)
         : bases(i_bases), reverseComplement(i_reverseComplement)
     {
     }
 
-    inline _uint64 getLowBases(unsigned keySizeInBytes) const {   // Returns the lowest bases as an unsigned
-        if (keySizeInBytes == 8) {
+    inline SeedBases getLowBases(unsigned keySizeInBytes) const {   // Returns the lowest bases, the hash table key
+        if (keySizeInBytes >= sizeof(SeedBases)) {
             return bases;
         } else {
-            return  bases & (((_uint64)1 << (keySizeInBytes * 8)) - 1);
+            return  bases & ~(~(SeedBases)0 << (keySizeInBytes * 8));
         }
     }
 
     inline unsigned getHighBases(unsigned keySizeInBytes) const {   // Returns any high as an unsigned.  If seedLen <= 16, returns 0.
-        if (keySizeInBytes == 8) {
+        if (keySizeInBytes >= sizeof(SeedBases)) {
             return 0;
         } else {
-            return (unsigned)(bases >> (keySizeInBytes * 8));
+            return (unsigned)LowWord(bases >> (keySizeInBytes * 8));
         }
     }
 
-    inline _uint64 getBases() const {
+    inline SeedBases getBases() const {
         return bases;
     }
 
-    inline _uint64 getRCBases() const {
+    inline SeedBases getRCBases() const {
         return reverseComplement;
     }
 
@@ -130,34 +129,34 @@ struct Seed {
 
     inline void setBase(int i, int seedLen, int value) {
         int shift = (seedLen - i - 1) * 2;
-        _int64 mask = (_int64) 3 << shift;
-        bases = (bases & ~mask) | (((_int64) value << shift) & mask);
+        SeedBases mask = (SeedBases)(_uint64) 3 << shift;
+        bases = (bases & ~mask) | (((SeedBases)(_uint64) value << shift) & mask);
         int shift2 = i * 2;
-        _int64 mask2 = (_int64) 3 << shift2;
-        reverseComplement = (reverseComplement & ~mask2) | (((_int64) (value ^ 3) << shift2) & mask2);
+        SeedBases mask2 = (SeedBases)(_uint64) 3 << shift2;
+        reverseComplement = (reverseComplement & ~mask2) | (((SeedBases)(_uint64) (value ^ 3) << shift2) & mask2);
     }
 
     inline int getBase(int i, int seedLen) {
-        return (int) (bases >> ((seedLen - i - 1) * 2)) & 3;
+        return (int) LowWord(bases >> ((seedLen - i - 1) * 2)) & 3;
     }
 
     inline void shiftIn(int b, int seedLen) {
         int shift = (seedLen - 1) * 2;
-        bases = ((bases << 2) & ~((_uint64) 3 << (shift + 2))) | (b & 3);
-        reverseComplement = ((_uint64) reverseComplement >> 2) | (((_uint64) (b ^ 3) & 3) << shift);
+        bases = ((bases << 2) & ~((SeedBases)(_uint64) 3 << (shift + 2))) | (SeedBases)(_uint64) (b & 3);
+        reverseComplement = (reverseComplement >> 2) | ((SeedBases)(_uint64) ((b ^ 3) & 3) << shift);
     }
 
     inline void toString(char* o_bases, int seedLength) {
         for (int i = (seedLength - 1) * 2; i >= 0; i -= 2) {
-            *o_bases++ = VALUE_BASE[(bases >> i) & 3];
+            *o_bases++ = VALUE_BASE[LowWord(bases >> i) & 3];
         }
     }
 
-    static Seed fromBases(_int64 bases, int seedLength);
+    static Seed fromBases(SeedBases bases, int seedLength);
 
     inline _uint64 hash64()
     {
-        return 1+util::hash64(min(bases, reverseComplement));
+        return 1+util::hash64(FoldSeedBases(min(bases, reverseComplement)));
     }
     
     inline unsigned hash()
@@ -167,7 +166,7 @@ struct Seed {
 
     static _uint64 hash64(const char* sequence, int length)
     {
-        if (length <= MaxBases) {
+        if (length <= (int)MaxBases) {
             Seed s(sequence, length);
             return s.hash64();
         } else {
@@ -187,14 +186,103 @@ struct Seed {
         }
     }
 
-    static const int MaxBases = 32;
+    static const unsigned MaxBases = LargestSeedSize;
+
+    //
+    // An index can keep just the seeds that are (window, seed length) minimizers: those with the smallest hash64 of
+    // some run of window consecutive seed locations (the first of them, if there's a tie).  Given the hashes of
+    // nPositions consecutive locations (NotASeedHash for ones that aren't seeds), this marks the ones that are.  Fewer
+    // than window locations count as one run.
+    //
+    static const _uint64 NotASeedHash = ~(_uint64) 0;
+
+    static void FindMinimizers(const _uint64 *hashes, unsigned nPositions, unsigned window, bool *o_isMinimizer);
+
 private:
 
-    _uint64   bases;
+    SeedBases   bases;
 
     //
     // Since we pretty much always compute the reverse complement of a seed, we just keep it
     // here.  That way we only execute the loop once: when the constructor runs.
     //
-    _uint64   reverseComplement;
+    SeedBases   reverseComplement;
+};
+
+//
+// A read's bases packed two bits apiece, along with a bit for each that isn't ACGT, so that the aligners can get any
+// seed in it (and its reverse complement) with a few shifts rather than a pass over its bases.  The bases are packed
+// both forwards, from which come the seeds' reverse complements, and backwards, from which come the seeds themselves.
+// The caller provides the storage, of getStorageSize bytes for reads of up to maxReadSize bases.
+//
+class PackedSeeds {
+public:
+    static size_t getStorageSize(unsigned maxReadSize);
+
+    PackedSeeds() : forward(NULL), backward(NULL), notACGT(NULL), readLen(0) {}
+
+    void setStorage(void* storage, unsigned maxReadSize);
+
+    // pack a read, replacing the last one
+    void pack(const char* bases, unsigned length);
+
+    // the equivalent of Seed::DoesTextRepresentASeed(bases + offset, seedLen)
+    inline bool isSeed(unsigned offset, unsigned seedLen) const {
+        _ASSERT(offset + seedLen <= readLen && seedLen <= LargestSeedSize);
+        unsigned word = offset / 64;
+        unsigned shift = offset % 64;
+        _uint64 bits = notACGT[word] >> shift;
+        if (shift != 0) {
+            bits |= notACGT[word + 1] << (64 - shift);
+        }
+        return 0 == (bits & (seedLen >= 64 ? ~(_uint64) 0 : ((_uint64) 1 << seedLen) - 1));
+    }
+
+    // the equivalent of Seed(bases + offset, seedLen), for an offset where isSeed
+    inline Seed getSeed(unsigned offset, unsigned seedLen) const {
+        _ASSERT(offset + seedLen <= readLen);
+#ifdef LONG_SEEDS
+        if (seedLen > 32) {
+            //
+            // The last 32 bases are the low word of the seed and the first ones of its reverse complement.
+            //
+            unsigned backwardOffset = readLen - offset - seedLen;
+            _uint64 highMask = baseMask(seedLen - 32);
+            return Seed(SeedBases(extract(backward, backwardOffset + 32) & highMask, extract(backward, backwardOffset)),
+                        SeedBases((extract(forward, offset + 32) & highMask) ^ highMask, ~extract(forward, offset)));
+        }
+#endif
+        _uint64 mask = baseMask(seedLen);
+        return Seed((SeedBases)(extract(backward, readLen - offset - seedLen) & mask), (SeedBases)((extract(forward, offset) & mask) ^ mask));
+    }
+
+    //
+    // Which of the read's seeds an index with a minimizer window would have kept (see Seed::FindMinimizers).  hashes
+    // is scratch space for a hash per seed.
+    //
+    void findMinimizers(unsigned seedLen, unsigned window, _uint64* hashes, bool* o_isMinimizer) const;
+
+private:
+    // the low 2 * nBases bits, for up to 32 bases
+    static inline _uint64 baseMask(unsigned nBases) {
+        return nBases >= 32 ? ~(_uint64) 0 : ((_uint64) 1 << (nBases * 2)) - 1;
+    }
+
+    //
+    // The 32 bases starting at offset in a stream packed with the first base in the low bits.
+    //
+    static inline _uint64 extract(const _uint64* packed, unsigned offset) {
+        unsigned word = offset / 32;
+        unsigned shift = (offset % 32) * 2;
+        _uint64 bits = packed[word] >> shift;
+        if (shift != 0) {
+            bits |= packed[word + 1] << (64 - shift);
+        }
+        return bits;
+    }
+
+    _uint64*    forward;
+    _uint64*    backward;
+    _uint64*    notACGT;
+    unsigned    readLen;
 };
@@ -0,0 +1,105 @@
+/*++
+
+Module Name:
+
+    SeedBases.h
+
+Abstract:
+
+    The integer type that seeds keep their bases in, which is also the type of the index's hash table keys.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+
+//
+// Seeds are normally at most 32 bases, two bits apiece in a _uint64.  Building with LONG_SEEDS keeps them in 128 bits
+// instead, which allows seeds of up to 64 bases (and hash table keys of up to 16 bytes).  That makes every seed and
+// hash table operation a little slower, so it's only worth it for indices that use seeds longer than 32 bases, which
+// can cut down the hits on repetitive genomes for long reads.  Indices built either way with seeds of at most 32
+// bases can be used by both.
+//
+//#define LONG_SEEDS
+
+//
+// A 128 bit unsigned integer with just the operations seeds and hash table keys need.  It's laid out low word first,
+// so that on little endian machines the low bytes of one are where the low bytes of a _uint64 would be, which is how
+// the hash tables store keys.
+//
+struct LongSeedBases {
+    _uint64 low;
+    _uint64 high;
+
+    inline LongSeedBases() {}
+
+    inline LongSeedBases(_uint64 i_low) : low(i_low), high(0) {}
+
+    inline LongSeedBases(_uint64 i_high, _uint64 i_low) : low(i_low), high(i_high) {}
+
+    inline LongSeedBases operator<<(unsigned shift) const {
+        if (0 == shift) {
+            return *this;
+        } else if (shift < 64) {
+            return LongSeedBases((high << shift) | (low >> (64 - shift)), low << shift);
+        } else {
+            return LongSeedBases(shift < 128 ? low << (shift - 64) : 0, 0);
+        }
+    }
+
+    inline LongSeedBases operator>>(unsigned shift) const {
+        if (0 == shift) {
+            return *this;
+        } else if (shift < 64) {
+            return LongSeedBases(high >> shift, (low >> shift) | (high << (64 - shift)));
+        } else {
+            return LongSeedBases(0, shift < 128 ? high >> (shift - 64) : 0);
+        }
+    }
+
+    inline LongSeedBases operator|(const LongSeedBases &peer) const { return LongSeedBases(high | peer.high, low | peer.low); }
+    inline LongSeedBases operator&(const LongSeedBases &peer) const { return LongSeedBases(high & peer.high, low & peer.low); }
+    inline LongSeedBases operator^(const LongSeedBases &peer) const { return LongSeedBases(high ^ peer.high, low ^ peer.low); }
+    inline LongSeedBases operator~() const { return LongSeedBases(~high, ~low); }
+
+    inline LongSeedBases &operator|=(const LongSeedBases &peer) { return *this = *this | peer; }
+    inline LongSeedBases &operator&=(const LongSeedBases &peer) { return *this = *this & peer; }
+    inline LongSeedBases &operator^=(const LongSeedBases &peer) { return *this = *this ^ peer; }
+
+    inline bool operator==(const LongSeedBases &peer) const { return low == peer.low && high == peer.high; }
+    inline bool operator!=(const LongSeedBases &peer) const { return !(*this == peer); }
+    inline bool operator<(const LongSeedBases &peer) const { return high < peer.high || (high == peer.high && low < peer.low); }
+    inline bool operator>(const LongSeedBases &peer) const { return peer < *this; }
+    inline bool operator<=(const LongSeedBases &peer) const { return !(peer < *this); }
+    inline bool operator>=(const LongSeedBases &peer) const { return !(*this < peer); }
+};
+
+#ifdef LONG_SEEDS
+typedef LongSeedBases SeedBases;
+#else
+typedef _uint64 SeedBases;
+#endif
+
+const unsigned LargestSeedSize = sizeof(SeedBases) * 4;
+const unsigned LargestKeySize = sizeof(SeedBases);      // in bytes
+
+//
+// The low and high 64 bits of some bases.
+//
+inline _uint64 LowWord(_uint64 bases) { return bases; }
+inline _uint64 LowWord(const LongSeedBases &bases) { return bases.low; }
+
+inline _uint64 HighWord(_uint64 bases) { return 0; }
+inline _uint64 HighWord(const LongSeedBases &bases) { return bases.high; }
+
+//
+// Squeezes some bases into 64 bits for hashing.  It's the identity for a _uint64, so ordinary seeds hash exactly as
+// they always have.
+//
+inline _uint64 FoldSeedBases(_uint64 bases) { return bases; }
+inline _uint64 FoldSeedBases(const LongSeedBases &bases) { return bases.low ^ (bases.high * 0x9e3779b97f4a7c15); }
@@ -0,0 +1,134 @@
+/*++
+
+Module Name:
+
+    SeedFilter.cpp
+
+Abstract:
+
+    A blocked Bloom filter over the seeds in an index.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "SeedFilter.h"
+#include "BigAlloc.h"
+#include "GenericFile.h"
+
+const unsigned SeedFilter::magic = 0x5eedf117;
+const char *SeedFilter::IndexFileName = "SeedFilter";
+
+SeedFilter::SeedFilter(_uint64 nKeys, unsigned bitsPerKey)
+{
+    //
+    // A Bloom filter is most accurate with bitsPerKey * ln(2) probes.
+    //
+    nProbes = __max(1, __min(MaxProbes, (unsigned)(bitsPerKey * 0.693 + 0.5)));
+    nBlocks = __max(1, (nKeys * bitsPerKey + BitsPerBlock - 1) / BitsPerBlock);
+    _ASSERT(nBlocks <= 0xffffffff);     // For fastrange in getBlock
+
+    blocks = (_uint64 *)BigAlloc(GetSizeInBytes(), &virtualAllocSize);
+    memset(blocks, 0, GetSizeInBytes());
+}
+
+SeedFilter::~SeedFilter()
+{
+    if (NULL != blocks) {
+        BigDealloc(blocks);
+    }
+}
+
+    void
+SeedFilter::Insert(SeedBases key)
+{
+    _uint64 hashValue = SNAPHashTable::hash(FoldSeedBases(key));
+    _uint64 *block = getBlock(hashValue);
+
+    //
+    // Gather the bits by word, so each word that changes takes just one interlocked update.
+    //
+    _uint64 newBits[WordsPerBlock];
+    memset(newBits, 0, sizeof(newBits));
+    unsigned position = (unsigned)hashValue & (BitsPerBlock - 1);
+    unsigned step = ((unsigned)(hashValue >> BitsPerPositionShift) & (BitsPerBlock - 1)) | 1;
+    for (unsigned i = 0; i < nProbes; i++) {
+        newBits[position / 64] |= (_uint64)1 << (position % 64);
+        position = (position + step) & (BitsPerBlock - 1);
+    }
+
+    for (unsigned i = 0; i < WordsPerBlock; i++) {
+        _uint64 oldWord;
+        while ((newBits[i] & (oldWord = block[i])) != newBits[i] &&
+               InterlockedCompareExchange64AndReturnOldValue((volatile _uint64 *)&block[i], oldWord | newBits[i], oldWord) != oldWord) {
+            // Someone else changed the word; try again.
+        }
+    }
+}
+
+    bool
+SeedFilter::saveToFile(const char *fileName) const
+{
+    FILE *saveFile = fopen(fileName, "wb");
+    if (NULL == saveFile) {
+        fprintf(stderr, "SeedFilter::saveToFile: unable to open '%s'\n", fileName);
+        return false;
+    }
+
+    bool worked = 1 == fwrite(&magic, sizeof(magic), 1, saveFile) &&
+                  1 == fwrite(&nProbes, sizeof(nProbes), 1, saveFile) &&
+                  1 == fwrite(&nBlocks, sizeof(nBlocks), 1, saveFile) &&
+                  nBlocks == fwrite(blocks, BlockSize, nBlocks, saveFile);
+    worked = 0 == fclose(saveFile) && worked;
+
+    if (!worked) {
+        fprintf(stderr, "SeedFilter::saveToFile: unable to write '%s'\n", fileName);
+    }
+    return worked;
+}
+
+    SeedFilter *
+SeedFilter::loadFromFile(const char *fileName)
+{
+    GenericFile *loadFile = GenericFile::open(fileName, GenericFile::Mode::ReadOnly);
+    if (NULL == loadFile) {
+        fprintf(stderr, "SeedFilter::loadFromFile: unable to open '%s'\n", fileName);
+        return NULL;
+    }
+
+    SeedFilter *filter = new SeedFilter();
+    unsigned fileMagic;
+    if (sizeof(fileMagic) != loadFile->read(&fileMagic, sizeof(fileMagic)) || magic != fileMagic ||
+            sizeof(filter->nProbes) != loadFile->read(&filter->nProbes, sizeof(filter->nProbes)) ||
+            sizeof(filter->nBlocks) != loadFile->read(&filter->nBlocks, sizeof(filter->nBlocks)) ||
+            0 == filter->nProbes || filter->nProbes > MaxProbes || 0 == filter->nBlocks || filter->nBlocks > 0xffffffff) {
+        fprintf(stderr, "SeedFilter::loadFromFile: '%s' isn't a seed filter, or is from a newer version of SNAP\n", fileName);
+        loadFile->close();
+        delete loadFile;
+        delete filter;
+        return NULL;
+    }
+
+    filter->blocks = (_uint64 *)BigAlloc(filter->GetSizeInBytes(), &filter->virtualAllocSize);
+    const size_t maxReadSize = 256 * 1024 * 1024;
+    size_t readOffset = 0;
+    size_t bytesRead;
+    do {
+        size_t amountToRead = __min((size_t)filter->GetSizeInBytes() - readOffset, maxReadSize);
+        bytesRead = loadFile->readInParallel((char *)filter->blocks + readOffset, amountToRead);
+        readOffset += bytesRead;
+    } while (bytesRead > 0 && readOffset < filter->GetSizeInBytes());
+    loadFile->close();
+    delete loadFile;
+
+    if (readOffset != filter->GetSizeInBytes()) {
+        fprintf(stderr, "SeedFilter::loadFromFile: '%s' is truncated\n", fileName);
+        delete filter;
+        return NULL;
+    }
+
+    return filter;
+}
@@ -0,0 +1,99 @@
+/*++
+
+Module Name:
+
+    SeedFilter.h
+
+Abstract:
+
+    A blocked Bloom filter over the seeds in an index, which lets lookups of seeds that aren't in the genome at all
+    (mostly ones with sequencing errors in them) stop after one cache line rather than probing the hash tables.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "HashTable.h"
+#include "SeedBases.h"
+
+//
+// Each key sets nProbes bits in a single 64 byte block, picked by the key's hash, so checking a key touches one cache line
+// however many probes there are.  That makes it a little less accurate than a classic Bloom filter with the same number of
+// bits: at the default of 10 bits per key, about 1% of the absent keys get through.  There are never false negatives.
+//
+// An index has one if it was built (or later given one) with snap index -seedFilter.  It's in the index's SeedFilter file.
+//
+class SeedFilter {
+public:
+    //
+    // A filter sized for nKeys keys at bitsPerKey bits apiece, with nothing in it.
+    //
+    SeedFilter(_uint64 nKeys, unsigned bitsPerKey = DefaultBitsPerKey);
+
+    ~SeedFilter();
+
+    //
+    // Returns NULL (having said why) if the file can't be read or isn't a filter.
+    //
+    static SeedFilter *loadFromFile(const char *fileName);
+
+    bool saveToFile(const char *fileName) const;
+
+    //
+    // Several threads can insert into the same filter at once.
+    //
+    void Insert(SeedBases key);
+
+    inline bool MightContain(SeedBases key) const {
+        _uint64 hashValue = SNAPHashTable::hash(FoldSeedBases(key));
+        const _uint64 *block = getBlock(hashValue);
+        unsigned position = (unsigned)hashValue & (BitsPerBlock - 1);
+        unsigned step = ((unsigned)(hashValue >> BitsPerPositionShift) & (BitsPerBlock - 1)) | 1;
+        for (unsigned i = 0; i < nProbes; i++) {
+            if (0 == (block[position / 64] & ((_uint64)1 << (position % 64)))) {
+                return false;
+            }
+            position = (position + step) & (BitsPerBlock - 1);
+        }
+        return true;
+    }
+
+    inline void Prefetch(SeedBases key) const {
+        _mm_prefetch((const char *)getBlock(SNAPHashTable::hash(FoldSeedBases(key))), _MM_HINT_T0);
+    }
+
+    _uint64 GetSizeInBytes() const {return nBlocks * BlockSize;}
+    unsigned GetNProbes() const {return nProbes;}
+
+    static const unsigned DefaultBitsPerKey = 10;
+    static const char *IndexFileName;
+
+private:
+
+    SeedFilter() : blocks(NULL), nBlocks(0), nProbes(0) {}
+
+    static const unsigned BlockSize = 64;                   // One cache line
+    static const unsigned BitsPerBlock = BlockSize * 8;
+    static const unsigned BitsPerPositionShift = 9;         // log2(BitsPerBlock), for taking the probe step from the hash
+    static const unsigned WordsPerBlock = BlockSize / sizeof(_uint64);
+    static const unsigned MaxProbes = 16;
+    static const unsigned magic;
+
+    //
+    // The block is picked with fastrange on the high 32 bits of the hash (see SNAPHashTable::homeIndex) and the bits within
+    // it by double hashing on the low ones, so the two don't depend on each other.
+    //
+    inline _uint64 *getBlock(_uint64 hashValue) const {
+        return blocks + (((hashValue >> 32) * nBlocks) >> 32) * WordsPerBlock;
+    }
+
+    _uint64    *blocks;
+    _uint64     nBlocks;
+    unsigned    nProbes;
+    size_t      virtualAllocSize;
+};
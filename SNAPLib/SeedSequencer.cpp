@@ -63,8 +63,8 @@ SeedSequencer::SeedSequencer(unsigned i_seedSize) : seedSize(i_seedSize)
         }
 
         unsigned selectedLocation = (itemToProcess->lowerBound + itemToProcess->upperBound) / 2;
-        _ASSERT(offsets[selectedLocation] == 0);
-        offsets[selectedLocation] = nFilledOffsets;
+        _ASSERT(offsets[nFilledOffsets] == 0);
+        offsets[nFilledOffsets] = selectedLocation;
         nFilledOffsets++;
 
         //
@@ -33,18 +33,18 @@ public:
 
     inline unsigned SeedOffset(unsigned wrapCount) {
         _ASSERT(wrapCount < seedSize);
-        return offsets[seedSize];
+        return offsets[wrapCount];
     }
 
     inline unsigned GetWrappedNextSeedToTest(unsigned wrapCount) {
         _ASSERT(wrapCount < seedSize);
-        return(offsets[seedSize]);
+        return(offsets[wrapCount]);
     }
 
 private:
 
     unsigned seedSize;
-    unsigned *offsets;
+    unsigned *offsets;      // The offset to start at on each wrap, spreading them out as evenly as possible
 };
 
 
@@ -25,6 +25,8 @@ Revision History:
 #include "stdafx.h"
 #include "options.h"
 #include "BaseAligner.h"
+#include "LongReadAligner.h"
+#include "SplicedAligner.h"
 #include "Compat.h"
 #include "RangeSplitter.h"
 #include "GenomeIndex.h"
@@ -38,10 +40,96 @@ Revision History:
 #include "Util.h"
 #include "SingleAligner.h"
 #include "MultiInputReadSupplier.h"
+#include "TraceRecorder.h"
 
 using namespace std;
 using util::stringEndsWith;
 
+//
+// The records written for a batch of reads, held until the end of the batch (or until there are too many of them) so
+// that the writer can format them together.  The reads have to stay valid until they're flushed.
+//
+class PendingWrites
+{
+public:
+    PendingWrites(ReadWriter* i_writer) : writer(i_writer), count(0) {}
+
+    void add(Read* read, AlignmentResult result, int mapQuality, GenomeLocation genomeLocation, Direction direction, const SpliceJunction* splice = NULL)
+    {
+        if (count == MaxPending) {
+            flush();
+        }
+        reads[count] = read;
+        results[count] = result;
+        mapQualities[count] = mapQuality;
+        genomeLocations[count] = genomeLocation;
+        directions[count] = direction;
+        splices[count] = splice;
+        count++;
+    }
+
+    void flush()
+    {
+        if (count > 0) {
+            writer->writeReads(count, reads, results, mapQualities, genomeLocations, directions, splices);
+            count = 0;
+        }
+    }
+
+private:
+    static const int MaxPending = 2 * BaseAligner::readsPerBatch;
+
+    ReadWriter* writer;
+    int count;
+    Read* reads[MaxPending];
+    AlignmentResult results[MaxPending];
+    int mapQualities[MaxPending];
+    GenomeLocation genomeLocations[MaxPending];
+    Direction directions[MaxPending];
+    const SpliceJunction* splices[MaxPending];
+};
+
+//
+// A thread's aligner and the memory it lives in, kept for the thread's next run if it's built the same way.
+//
+struct CachedSingleAligner : public CachedAligner
+{
+    CachedSingleAligner(BigAllocator* i_allocator, BaseAligner* i_aligner) : allocator(i_allocator), aligner(i_aligner),
+        competingAllocator(NULL), competingAligner(NULL), longReadAligner(NULL), splicedAligner(NULL) {}
+
+    virtual ~CachedSingleAligner()
+    {
+        aligner->~BaseAligner(); // This calls the destructor without calling operator delete, allocator owns the memory.
+        delete allocator;   // This is what actually frees the memory.
+        if (NULL != competingAligner) {
+            competingAligner->~BaseAligner();
+            delete competingAllocator;
+        }
+        delete longReadAligner;
+        delete splicedAligner;
+    }
+
+    BigAllocator* allocator;
+    BaseAligner* aligner;
+    BigAllocator* competingAllocator;   // With -compete, the aligner for the competing index and its memory
+    BaseAligner* competingAligner;
+    LongReadAligner* longReadAligner;  // Made the first time the thread sees a long read
+    SplicedAligner* splicedAligner;    // Made the first time the thread runs with -splice
+};
+
+struct SingleAlignerKey
+{
+    GenomeIndex* index;
+    GenomeIndex* competingIndex;
+    int maxHits;
+    unsigned maxDist;
+    int maxReadSize;
+    unsigned numSeeds;
+    double seedCoverage;
+    unsigned extraSearchDepth;
+    unsigned maxIntronLength;
+};
+
 SingleAlignerContext::SingleAlignerContext(AlignerExtension* i_extension)
     : AlignerContext(0, NULL, NULL, i_extension)
 {
@@ -54,6 +142,34 @@ SingleAlignerContext::newStats()
     return new AlignerStats();
 }
 
+    size_t
+SingleAlignerContext::getAlignerMemoryReservation()
+{
+    size_t reservation = BaseAligner::getBigAllocatorReservation(true, maxHits, MAX_READ_LENGTH, index->getSeedLength(), numSeedsFromCommandLine, seedCoverage);
+    if (NULL != competingIndex) {
+        reservation += BaseAligner::getBigAllocatorReservation(true, maxHits, MAX_READ_LENGTH, competingIndex->getSeedLength(), numSeedsFromCommandLine,
+            seedCoverage);
+    }
+    return reservation;
+}
+
+//
+// The options that go into an aligner after it's built, which is the same for the main and -compete ones, except that a
+// read's input location is on the main index's genome, so only the main one searches near it.
+//
+    static void
+configureAligner(BaseAligner* aligner, AlignerOptions* options, bool isCompeting)
+{
+    aligner->setExplorePopularSeeds(options->explorePopularSeeds);
+    aligner->setStopOnFirstHit(options->stopOnFirstHit);
+    aligner->setMapqToStopAt(options->mapqToStopAt);
+    aligner->setExactMatchMapq(options->exactMatchMapq);
+    aligner->setRealignRadius(isCompeting ? 0 : options->realignRadius);
+    aligner->setOrderSeedsByHits(options->orderSeedsByHits);
+    aligner->setLVBudget(options->lvBudget);
+    aligner->setSecondaryAlignmentLimits(options->maxSecondaryAlignments, options->secondaryScoreDelta);
+}
+
     void
 SingleAlignerContext::runTask()
 {
@@ -80,6 +196,7 @@ SingleAlignerContext::runIterationThread()
         Read *read;
         while (NULL != (read = supplier->getNextRead())) {
             stats->totalReads++;
+            stats->perf.reads++;
             writeRead(read, NotFound, InvalidGenomeLocation, FORWARD, 0, 0);
         }
         delete supplier;
@@ -87,26 +204,59 @@ SingleAlignerContext::runIterationThread()
     }
 
     int maxReadSize = MAX_READ_LENGTH;
- 
-    BigAllocator *allocator = new BigAllocator(BaseAligner::getBigAllocatorReservation(true, maxHits, maxReadSize, index->getSeedLength(), numSeedsFromCommandLine, seedCoverage));
-   
-    BaseAligner *aligner = new (allocator) BaseAligner(
-            index,
-            maxHits,
-            maxDist,
-            maxReadSize,
-            numSeedsFromCommandLine,
-            seedCoverage,
-            extraSearchDepth,
-            NULL,               // LV (no need to cache in the single aligner)
-            NULL,               // reverse LV
-            stats,
-            allocator);
+
+    SingleAlignerKey key;
+    memset(&key, 0, sizeof(key));   // so the padding compares equal
+    key.index = index;
+    key.competingIndex = competingIndex;
+    key.maxHits = maxHits;
+    key.maxDist = maxDist;
+    key.maxReadSize = maxReadSize;
+    key.numSeeds = numSeedsFromCommandLine;
+    key.seedCoverage = seedCoverage;
+    key.extraSearchDepth = extraSearchDepth;
+    key.maxIntronLength = options->maxIntronLength;
+
+    CachedSingleAligner *cached = (CachedSingleAligner *) AlignerCache::take(threadNum, &key, sizeof(key));
+    if (NULL == cached) {
+        BigAllocator *allocator = new BigAllocator(BaseAligner::getBigAllocatorReservation(true, maxHits, maxReadSize, index->getSeedLength(), numSeedsFromCommandLine, seedCoverage));
+
+        BaseAligner *aligner = new (allocator) BaseAligner(
+                index,
+                maxHits,
+                maxDist,
+                maxReadSize,
+                numSeedsFromCommandLine,
+                seedCoverage,
+                extraSearchDepth,
+                NULL,               // LV (no need to cache in the single aligner)
+                NULL,               // reverse LV
+                stats,
+                allocator);
+
+        cached = new CachedSingleAligner(allocator, aligner);
+    }
+    if (NULL != competingIndex && NULL == cached->competingAligner) {
+        cached->competingAllocator = new BigAllocator(BaseAligner::getBigAllocatorReservation(true, maxHits, maxReadSize, competingIndex->getSeedLength(),
+            numSeedsFromCommandLine, seedCoverage));
+        cached->competingAligner = new (cached->competingAllocator) BaseAligner(competingIndex, maxHits, maxDist, maxReadSize, numSeedsFromCommandLine,
+            seedCoverage, extraSearchDepth, NULL, NULL, stats, cached->competingAllocator);
+    }
+    BigAllocator *allocator = cached->allocator;
+    BaseAligner *aligner = cached->aligner;
+    BaseAligner *competingAligner = cached->competingAligner;
+    aligner->setStats(stats);
 
     allocator->checkCanaries();
 
-    aligner->setExplorePopularSeeds(options->explorePopularSeeds);
-    aligner->setStopOnFirstHit(options->stopOnFirstHit);
+    configureAligner(aligner, options, false);
+    _int64 readsOverLVBudgetAtStart = aligner->getNReadsOverLVBudget();   // The count's cumulative, and the aligner may be reused
+    _int64 competingReadsOverLVBudgetAtStart = 0;
+    if (NULL != competingAligner) {
+        competingAligner->setStats(stats);
+        configureAligner(competingAligner, options, true);
+        competingReadsOverLVBudgetAtStart = competingAligner->getNReadsOverLVBudget();
+    }
 
 #ifdef  _MSC_VER
     if (options->useTimingBarrier) {
@@ -118,73 +268,278 @@ SingleAlignerContext::runIterationThread()
     }
 #endif  // _MSC_VER
 
-    // Align the reads.
-    IdPairVector* secondary = options->outputMultipleAlignments ? new IdPairVector : NULL;
-    Read *read;
-    while (NULL != (read = supplier->getNextRead())) {
-        stats->totalReads++;
+    unsigned longReadLength = options->longReadLength;
 
-        // Skip the read if it has too many Ns or trailing 2 quality scores.
-        if (read->getDataLength() < 50 || read->countOfNs() > maxDist) {
-            if (readWriter != NULL && options->passFilter(read, NotFound)) {
-                readWriter->writeRead(read, NotFound, 0, InvalidGenomeLocation, false);
-            }
-            continue;
-        } else {
-            stats->usefulReads++;
+    SplicedAligner *splicedAligner = NULL;
+    if (0 != options->maxIntronLength) {
+        if (NULL == cached->splicedAligner) {
+            cached->splicedAligner = new SplicedAligner(index, maxHits, maxDist, numSeedsFromCommandLine, seedCoverage, extraSearchDepth,
+                options->maxIntronLength);
         }
+        splicedAligner = cached->splicedAligner;
+    }
 
-        unsigned location = InvalidGenomeLocation;
-        Direction direction;
-        int score;
-        int mapq;
+    //
+    // Align the reads, a batch at a time so that the aligner can overlap their memory stalls.  The supplier only keeps
+    // a read valid until it's asked for the next one, so the batch holds copies.  Reads that get filtered out rather
+    // than aligned stay in the batch so that everything is written in the order it came in.  Long reads go to the long
+    // read aligner instead, one at a time, and get their results after the short ones'.  With -splice, short reads
+    // that aligned badly or not at all get another try as spliced reads.
+    //
+    // With -compete, the short reads are aligned to the competing index as well, and each goes to whichever index it
+    // aligns to with the lower score, with ties going to the main one.  Long reads are only aligned to the main index,
+    // and only the reads that stay with it get the spliced try.
+    //
+    // Reads that -screen marked as they were read aren't aligned at all, just written to its output.
+    //
+    const unsigned batchSize = BaseAligner::readsPerBatch;
+    ReadWithOwnMemory batch[batchSize];
+    bool shouldAlign[batchSize];
+    Read *readsToAlign[batchSize];
+    bool isLongRead[batchSize];
+    bool isKept[batchSize];
+    AlignmentResult results[batchSize];
+    GenomeLocation locations[batchSize];
+    Direction directions[batchSize];
+    int scores[batchSize];
+    int mapqs[batchSize];
+    SpliceJunction splices[batchSize];
+    bool isSpliced[batchSize];
+    _int64 alignTicks[batchSize];
+    IdPairVector secondaryAlignments[batchSize];  // Reused for every batch, so they only allocate when they grow
+    IdPairVector *secondary = options->outputMultipleAlignments ? secondaryAlignments : NULL;
+    PendingWrites pendingWrites(readWriter);
+    AlignmentResult competingResults[batchSize];
+    GenomeLocation competingLocations[batchSize];
+    Direction competingDirections[batchSize];
+    int competingScores[batchSize];
+    int competingMapqs[batchSize];
+    bool isCompeting[batchSize];    // Does the read go to the competing index?
+    IdPairVector competingSecondaryAlignments[batchSize];
+    IdPairVector *competingSecondary = options->outputMultipleAlignments ? competingSecondaryAlignments : NULL;
+    PendingWrites competingPendingWrites(competingReadWriter);
+    PendingWrites screenedPendingWrites(screenedReadWriter);
+
+    //
+    // When streaming, a batch is cut short rather than waiting for reads that haven't arrived, and the output is flushed
+    // whenever the input runs dry (and otherwise every streamFlushMillis), so nothing sits in a buffer for long.
+    //
+    bool streaming = options->streamFlushMillis >= 0;
+    _int64 lastFlush = timeInMillis();
+
+    bool moreReads = true;
+    while (moreReads) {
+        unsigned nReadsInBatch = 0;
+        unsigned nReadsToAlign = 0;
+        unsigned nLongReads = 0;
+        Read *read;
+        while (nReadsInBatch < batchSize) {
+            if (streaming && nReadsInBatch > 0 && ! supplier->isReadReady()) {
+                break;
+            }
+            if (NULL == (read = supplier->getNextRead())) {
+                moreReads = false;
+                break;
+            }
+            stats->totalReads++;
+            stats->perf.reads++;
+            batch[nReadsInBatch].set(*read);
+
+            //
+            // Skip the read if it has too many Ns or trailing 2 quality scores.  maxDist is for short reads; a long
+            // read just needs the anchors to find it.
+            //
+            // With -keepMapq, a read that the input already has aligned well enough is written as it was.
+            //
+            isLongRead[nReadsInBatch] = 0 != longReadLength && read->getDataLength() >= longReadLength;
+            isKept[nReadsInBatch] = options->keepsInputAlignment(read);
+            shouldAlign[nReadsInBatch] = !isKept[nReadsInBatch] && !read->isScreened() && read->getDataLength() >= 50 &&
+                (isLongRead[nReadsInBatch] || read->countOfNs() <= maxDist);
+            if (shouldAlign[nReadsInBatch]) {
+                stats->usefulReads++;
+                if (isLongRead[nReadsInBatch]) {
+                    nLongReads++;
+                } else {
+                    readsToAlign[nReadsToAlign] = &batch[nReadsInBatch];
+                    nReadsToAlign++;
+                }
+            }
+            nReadsInBatch++;
+        }
 
-#if     TIME_HISTOGRAM
-        _int64 startTime = timeInNanos();
-#endif // TIME_HISTOGRAM
+        {
+            TraceScope trace("align");
+            aligner->AlignReads(readsToAlign, nReadsToAlign, results, locations, directions, scores, mapqs, secondary,
+                NULL == stats->latencies ? NULL : alignTicks);
+        }
 
-        AlignmentResult result = aligner->AlignRead(read, &location, &direction, &score, &mapq, secondary);
+        for (unsigned i = 0; i < nReadsToAlign; i++) {
+            isCompeting[i] = false;
+        }
+        if (NULL != competingAligner) {
+            TraceScope trace("compete");
+            competingAligner->AlignReads(readsToAlign, nReadsToAlign, competingResults, competingLocations, competingDirections, competingScores,
+                competingMapqs, competingSecondary, NULL);
+            for (unsigned i = 0; i < nReadsToAlign; i++) {
+                isCompeting[i] = NotFound != competingResults[i] && (NotFound == results[i] || competingScores[i] < scores[i]);
+            }
+        }
 
-#if     TIME_HISTOGRAM
-        _int64 runTime = timeInNanos() - startTime;
-        int timeBucket = min(30, cheezyLogBase2(runTime));
-        stats->countByTimeBucket[timeBucket]++;
-        stats->nanosByTimeBucket[timeBucket] += runTime;
-#endif // TIME_HISTOGRAM
+        if (NULL != stats->latencies && nReadsToAlign > 0) {
+            double nanosPerTick = 1e9 / PerfCounters::ticksPerSecond();
+            for (unsigned i = 0; i < nReadsToAlign; i++) {
+                stats->latencies->record(readsToAlign[i], (_int64) (alignTicks[i] * nanosPerTick));
+            }
+        }
 
         allocator->checkCanaries();
 
-        bool wasError = false;
-        if (result != NotFound && computeError) {
-            wasError = wgsimReadMisaligned(read, location, index, options->misalignThreshold);
+        for (unsigned i = 0; i < nReadsToAlign; i++) {
+            int unsplicedScore = NotFound == results[i] ? -1 : scores[i];
+            isSpliced[i] = NULL != splicedAligner && !isCompeting[i] && SplicedAligner::shouldTry(unsplicedScore) &&
+                splicedAligner->AlignRead(readsToAlign[i], unsplicedScore, &results[i], &locations[i], &directions[i], &scores[i], &mapqs[i],
+                    &splices[i]);
+            if (isSpliced[i] && NULL != secondary) {
+                secondary[i].clear();   // They were unspliced
+            }
+        }
+
+        if (nLongReads > 0) {
+            if (NULL == cached->longReadAligner) {
+                cached->longReadAligner = new LongReadAligner(index, maxHits);
+            }
+            unsigned whichLong = nReadsToAlign;
+            for (unsigned i = 0; i < nReadsInBatch; i++) {
+                if (shouldAlign[i] && isLongRead[i]) {
+                    _int64 start = NULL == stats->latencies ? 0 : PerfTicks();
+                    results[whichLong] = cached->longReadAligner->AlignRead(&batch[i], &locations[whichLong], &directions[whichLong],
+                        &scores[whichLong], &mapqs[whichLong]);
+                    if (NULL != stats->latencies) {
+                        stats->latencies->record(&batch[i], (_int64) ((PerfTicks() - start) * 1e9 / PerfCounters::ticksPerSecond()));
+                    }
+                    if (NULL != secondary) {
+                        secondary[whichLong].clear();
+                    }
+                    isSpliced[whichLong] = false;
+                    isCompeting[whichLong] = false;
+                    whichLong++;
+                }
+            }
         }
 
-        writeRead(read, result, location, direction, score, mapq);
-        
-        updateStats(stats, read, result, location, score, mapq, wasError);
+        unsigned whichAligned = 0;
+        unsigned whichLongAligned = nReadsToAlign;
+        for (unsigned i = 0; i < nReadsInBatch; i++) {
+            read = &batch[i];
+            if (read->isScreened()) {
+                stats->readsScreened++;
+                if (screenedReadWriter != NULL) {
+                    screenedPendingWrites.add(read, NotFound, 0, InvalidGenomeLocation, FORWARD);
+                }
+                continue;
+            }
+
+            if (isKept[i]) {
+                stats->readsKeptFromInput++;
+                if (readWriter != NULL && options->passFilter(read, SingleHit)) {
+                    pendingWrites.add(read, SingleHit, read->getOriginalMAPQ(), read->getOriginalAlignedLocation(), AlignerOptions::inputDirection(read));
+                }
+                continue;
+            }
 
-        if (secondary != NULL && secondary->size() > 0) {
-            // write secondary alignments
-            for (IdPairVector::iterator i = secondary->begin(); i != secondary->end(); i++) {
-                writeRead(read, SecondaryHit, i->id, i->value, score, mapq);
+            if (!shouldAlign[i]) {
+                if (readWriter != NULL && options->passFilter(read, NotFound)) {
+                    pendingWrites.add(read, NotFound, 0, InvalidGenomeLocation, FORWARD);
+                }
+                continue;
+            }
+
+            unsigned which = isLongRead[i] ? whichLongAligned++ : whichAligned++;
+            if (isCompeting[which]) {
+                AlignmentResult result = competingResults[which];
+                int mapq = competingMapqs[which];
+                if (competingReadWriter != NULL && options->passFilter(read, result)) {
+                    competingPendingWrites.add(read, result, mapq, competingLocations[which], competingDirections[which]);
+                }
+                updateStats(stats, read, result, competingLocations[which], competingScores[which], mapq, false);
+                stats->readsToCompetingIndex++;
+
+                if (competingSecondary != NULL && competingReadWriter != NULL && options->passFilter(read, SecondaryHit)) {
+                    for (IdPairVector::iterator j = competingSecondary[which].begin(); j != competingSecondary[which].end(); j++) {
+                        competingPendingWrites.add(read, SecondaryHit, mapq, j->id, j->value);
+                    }
+                }
+                continue;
+            }
+
+            AlignmentResult result = results[which];
+            GenomeLocation location = locations[which];
+            Direction direction = directions[which];
+            int score = scores[which];
+            int mapq = mapqs[which];
+
+            bool wasError = false;
+            if (result != NotFound && computeError) {
+                wasError = wgsimReadMisaligned(read, location, index, options->misalignThreshold);
+            }
+
+            if (readWriter != NULL && options->passFilter(read, result)) {
+                pendingWrites.add(read, result, mapq, location, direction, isSpliced[which] ? &splices[which] : NULL);
+            }
+
+            updateStats(stats, read, result, location, score, mapq, wasError);
+
+            if (secondary != NULL && secondary[which].size() > 0 && readWriter != NULL && options->passFilter(read, SecondaryHit)) {
+                // write secondary alignments
+                for (IdPairVector::iterator j = secondary[which].begin(); j != secondary[which].end(); j++) {
+                    pendingWrites.add(read, SecondaryHit, mapq, j->id, j->value);
+                }
             }
         }
+
+        pendingWrites.flush();
+        competingPendingWrites.flush();
+        screenedPendingWrites.flush();
+        if (streaming && (! supplier->isReadReady() || timeInMillis() - lastFlush >= options->streamFlushMillis)) {
+            if (readWriter != NULL) {
+                readWriter->flush();
+            }
+            if (competingReadWriter != NULL) {
+                competingReadWriter->flush();
+            }
+            if (screenedReadWriter != NULL) {
+                screenedReadWriter->flush();
+            }
+            lastFlush = timeInMillis();
+        }
+        for (unsigned i = 0; i < nReadsInBatch; i++) {
+            batch[i].dispose();
+        }
+
+        //
+        // If the input's decompression or the output's encoding is falling behind, take a turn at it.
+        //
+        while (WorkPool::helpIfBehind()) {
+        }
+    }
+
+    stats->alignmentsOverLVBudget += aligner->getNReadsOverLVBudget() - readsOverLVBudgetAtStart;
+    if (NULL != competingAligner) {
+        stats->alignmentsOverLVBudget += competingAligner->getNReadsOverLVBudget() - competingReadsOverLVBudgetAtStart;
     }
 
-    aligner->~BaseAligner(); // This calls the destructor without calling operator delete, allocator owns the memory.
- 
     if (supplier != NULL) {
         delete supplier;
     }
 
-    delete allocator;   // This is what actually frees the memory.
+    AlignerCache::give(threadNum, cached, &key, sizeof(key));
 }
     
     void
 SingleAlignerContext::writeRead(
     Read* read,
     AlignmentResult result,
-    unsigned location,
+    GenomeLocation location,
     Direction direction,
     int score,
     int mapq)
@@ -199,7 +554,7 @@ SingleAlignerContext::updateStats(
     AlignerStats* stats,
     Read* read,
     AlignmentResult result,
-    unsigned location, 
+    GenomeLocation location, 
     int score,
     int mapq,
     bool wasError)
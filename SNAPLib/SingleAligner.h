@@ -48,11 +48,13 @@ protected:
     virtual void typeSpecificBeginIteration();
     virtual void typeSpecificNextIteration();
 
+    virtual size_t getAlignerMemoryReservation();
+
     // for subclasses
 
-    virtual void writeRead(Read* read, AlignmentResult result, unsigned location, Direction direction, int score, int mapq);
+    virtual void writeRead(Read* read, AlignmentResult result, GenomeLocation location, Direction direction, int score, int mapq);
 
-    virtual void updateStats(AlignerStats* stats, Read* read, AlignmentResult result, unsigned location, int score, int mapq, bool wasError);
+    virtual void updateStats(AlignerStats* stats, Read* read, AlignmentResult result, GenomeLocation location, int score, int mapq, bool wasError);
 
     //RangeSplittingReadSupplierGenerator   *readSupplierGenerator;
 
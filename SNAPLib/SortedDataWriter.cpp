@@ -6,7 +6,8 @@ Module Name:
 
 Abstract:
 
-    File writer that sorts records using a temporary file.
+    File writer that sorts records using a temporary file, or memory for as much as it's allowed, or spill files striped
+    across several directories and optionally compressed.
 
 Environment:
 
@@ -21,54 +22,81 @@ Environment:
 #include "Compat.h"
 #include "Util.h"
 #include "DataWriter.h"
+#include "GenericFile.h"
 #include "BufferedAsync.h"
 #include "VariableSizeVector.h"
 #include "FileFormat.h"
-#include "PriorityQueue.h"
+#include "LoserTree.h"
 #include "exit.h"
 #include "Bam.h"
+#include "zlib.h"
 
 #define USE_DEVTEAM_OPTIONS 1
 //#define VALIDATE_SORT 1
 
 using std::max;
+using std::min;
 
 #pragma pack(push, 4)
 struct SortEntry
 {
     SortEntry() : offset(0), length(0), location(0) {}
-    SortEntry(size_t i_offset, unsigned i_length, unsigned i_location)
+    SortEntry(size_t i_offset, unsigned i_length, GenomeLocation i_location)
         : offset(i_offset), length(i_length), location(i_location) {}
     size_t                      offset; // offset in file
     unsigned                    length; // number of bytes
-    unsigned                    location; // location in genome
+    GenomeLocation              location; // location in genome
     static bool comparator(const SortEntry& e1, const SortEntry& e2)
     {
         return e1.location < e2.location;
     }
 };
+
+//
+// A record in a batch that's being sorted.  Its offset is within the batch, which is never 4GB, so this packs into 4
+// bytes less than SortEntry, which matters since there's one for every record in every buffered batch.
+//
+struct BatchEntry
+{
+    BatchEntry() : offset(0), length(0), location(0) {}
+    BatchEntry(unsigned i_offset, unsigned i_length, GenomeLocation i_location)
+        : offset(i_offset), length(i_length), location(i_location) {}
+    unsigned                    offset; // offset in batch
+    unsigned                    length; // number of bytes
+    GenomeLocation              location; // location in genome
+};
 #pragma pack(pop)
 
 typedef VariableSizeVector<SortEntry> SortVector;
+typedef VariableSizeVector<BatchEntry> BatchVector;
 
 struct SortBlock
 {
 #ifdef VALIDATE_SORT
-    SortBlock() : start(0), bytes(0), location(0), length(0), reader(NULL), minLocation(0), maxLocation(0) {}
+    SortBlock() : start(0), bytes(0), memory(NULL), firstSample(0), nSamples(0), spillFile(-1), firstChunk(0), nChunks(0), location(0), length(0), reader(NULL), minLocation(0), maxLocation(0) {}
 #else
-    SortBlock() : start(0), bytes(0), location(0), length(0), reader(NULL) {}
+    SortBlock() : start(0), bytes(0), memory(NULL), firstSample(0), nSamples(0), spillFile(-1), firstChunk(0), nChunks(0), location(0), length(0), reader(NULL) {}
 #endif
 	SortBlock(const SortBlock& other) { *this = other; }
     void operator=(const SortBlock& other);
 
     size_t      start;
     size_t      bytes;
+    char*       memory; // if the block was kept in memory rather than the temp file, start is relative to this
+    // every SampleInterval'th record of the block, in SortedDataFilterSupplier::samples, for splitting the merge by location
+    int         firstSample;
+    int         nSamples;
+    // if the block was spilled, which spill file it's in (else -1), and its chunks in SortedDataFilterSupplier::chunks;
+    // start is relative to the block, as for one in memory
+    int         spillFile;
+    int         firstChunk;
+    int         nChunks;
 #ifdef VALIDATE_SORT
-	unsigned	minLocation, maxLocation;
+	GenomeLocation	minLocation, maxLocation;
 #endif
     // for mergesort phase
     DataReader* reader;
-    unsigned    location; // genome location of current read
+    GenomeLocation location; // genome location of current read
     char*       data; // read data in read buffer
     unsigned    length; // length in bytes
 };
@@ -79,6 +107,12 @@ SortBlock::operator=(
 {
     start = other.start;
     bytes = other.bytes;
+    memory = other.memory;
+    firstSample = other.firstSample;
+    nSamples = other.nSamples;
+    spillFile = other.spillFile;
+    firstChunk = other.firstChunk;
+    nChunks = other.nChunks;
     location = other.location;
     length = other.length;
     reader = other.reader;
@@ -89,6 +123,267 @@ SortBlock::operator=(
 }
 
 typedef VariableSizeVector<SortBlock> SortBlockVector;
+
+static const int SampleInterval = 256;
+
+//
+// A spilled block is written as one chunk per SampleInterval records, each compressed on its own, so that the merge can
+// start reading it at any of its samples.  A chunk that doesn't get any smaller is stored as is.
+//
+struct SpillChunk
+{
+    SpillChunk() : fileOffset(0), rawOffset(0), rawBytes(0), storedBytes(0) {}
+    SpillChunk(_int64 i_fileOffset, size_t i_rawOffset, unsigned i_rawBytes, unsigned i_storedBytes)
+        : fileOffset(i_fileOffset), rawOffset(i_rawOffset), rawBytes(i_rawBytes), storedBytes(i_storedBytes) {}
+
+    _int64      fileOffset;
+    size_t      rawOffset;  // in the block
+    unsigned    rawBytes;
+    unsigned    storedBytes;
+};
+
+typedef VariableSizeVector<SpillChunk> SpillChunkVector;
+
+//
+// Sort locations are all under 2^GenomeLocationBits (unaligned reads sort at FileFormat::UnalignedSortLocation), so this
+// is past all of them.
+//
+static const _int64 EndOfLocations = (_int64)1 << GenomeLocationBits;
+
+//
+// A part of the location space that one thread merges into memory, for a parallel merge.
+//
+struct MergeRange
+{
+    _int64                      beginLocation;
+    _int64                      endLocation;
+    char*                       buffer;
+    size_t                      bufferSize;
+    size_t                      used;
+    VariableSizeVector<unsigned> lengths;   // of each record in the buffer
+    _int64                      total;
+    bool                        ok;
+    SingleWaiterObject          merged;     // buffer is ready to write out
+    SingleWaiterObject          consumed;   // buffer has been written out and freed
+
+    //
+    // The part of DataWriter that MergeSortBlocks uses.  buffer is big enough for everything in the range, so there's
+    // never a next batch.
+    //
+    bool getBuffer(char** o_buffer, size_t* o_bytes)
+    {
+        *o_buffer = buffer + used;
+        *o_bytes = bufferSize - used;
+        return true;
+    }
+
+    void nextBatch() {}
+
+    void advance(unsigned bytes)
+    {
+        used += bytes;
+        lengths.push_back(bytes);
+    }
+};
+
+//
+// Reads a block that was kept in memory, so that the merge can treat it just like one in the temp file.  It's all one
+// batch, and there's nothing to wait for.
+//
+class MemoryDataReader : public DataReader
+{
+public:
+    MemoryDataReader(char* i_data) : DataReader(true), data(i_data), current(0), end(0) {}
+
+    virtual ~MemoryDataReader() {}
+
+    virtual bool init(const char* fileName) { return true; }
+
+    virtual char* readHeader(_int64* io_headerSize) { *io_headerSize = 0; return data; }
+
+    virtual void reinit(_int64 startingOffset, _int64 amountOfFileToProcess)
+    {
+        current = startingOffset;
+        end = startingOffset + amountOfFileToProcess;
+    }
+
+    virtual bool getData(char** o_buffer, _int64* o_validBytes, _int64* o_startBytes = NULL)
+    {
+        if (current >= end) {
+            return false;
+        }
+        *o_buffer = data + current;
+        *o_validBytes = end - current;
+        if (o_startBytes != NULL) {
+            *o_startBytes = end - current;
+        }
+        return true;
+    }
+
+    virtual void advance(_int64 bytes) { current = min(end, current + bytes); }
+
+    virtual void nextBatch() {}
+
+    virtual bool isEOF() { return current >= end; }
+
+    virtual DataBatch getBatch() { return DataBatch(); }
+
+    virtual void releaseBatch(DataBatch batch) {}
+
+    virtual _int64 getFileOffset() { return current; }
+
+    virtual void getExtra(char** o_extra, _int64* o_length) { *o_extra = NULL; *o_length = 0; }
+
+private:
+    char*   data;
+    _int64  current;
+    _int64  end;
+};
+
+//
+// Reads a block from a spill file, decompressing a window of its chunks at a time.  Each reader has its own handle on
+// the file, so the threads of a parallel merge read their ranges of it (and of the other spill files) at the same time.
+//
+class SpillDataReader : public DataReader
+{
+public:
+    SpillDataReader(const char* i_fileName, const SpillChunk* i_chunks, int i_nChunks)
+        : DataReader(true), fileName(i_fileName), file(NULL), chunks(i_chunks), nChunks(i_nChunks), nextChunk(0),
+        window(NULL), windowSize(0), stored(NULL), storedSize(0), windowStart(0), windowEnd(0), current(0), end(0) {}
+
+    virtual ~SpillDataReader()
+    {
+        if (file != NULL) {
+            fclose(file);
+        }
+        delete [] window;
+        delete [] stored;
+    }
+
+    virtual bool init(const char* ignored)
+    {
+        file = fopen(fileName, "rb");
+        return file != NULL;
+    }
+
+    virtual char* readHeader(_int64* io_headerSize) { *io_headerSize = 0; return NULL; }
+
+    virtual void reinit(_int64 startingOffset, _int64 amountOfFileToProcess);
+
+    virtual bool getData(char** o_buffer, _int64* o_validBytes, _int64* o_startBytes = NULL)
+    {
+        if (current >= windowEnd) {
+            return false;
+        }
+        *o_buffer = window + (current - windowStart);
+        *o_validBytes = windowEnd - current;
+        if (o_startBytes != NULL) {
+            *o_startBytes = windowEnd - current;
+        }
+        return true;
+    }
+
+    virtual void advance(_int64 bytes) { current = min(windowEnd, current + bytes); }
+
+    virtual void nextBatch();
+
+    virtual bool isEOF() { return current >= end; }
+
+    virtual DataBatch getBatch() { return DataBatch(); }
+
+    virtual void releaseBatch(DataBatch batch) {}
+
+    virtual _int64 getFileOffset() { return current; }
+
+    virtual void getExtra(char** o_extra, _int64* o_length) { *o_extra = NULL; *o_length = 0; }
+
+private:
+    static const size_t WindowBytes = 1024 * 1024;  // of decompressed data, unless one chunk is bigger
+
+    const char*         fileName;
+    FILE*               file;
+    const SpillChunk*   chunks;
+    int                 nChunks;
+    int                 nextChunk;  // to read into the window
+    char*               window;
+    size_t              windowSize;
+    char*               stored;     // as read from the file
+    size_t              storedSize;
+    _int64              windowStart;    // offsets in the block
+    _int64              windowEnd;
+    _int64              current;
+    _int64              end;
+};
+
+    void
+SpillDataReader::reinit(
+    _int64 startingOffset,
+    _int64 amountOfFileToProcess)
+{
+    // the merge only starts at samples, which are where the chunks start
+    nextChunk = 0;
+    while (nextChunk < nChunks && (_int64) chunks[nextChunk].rawOffset < startingOffset) {
+        nextChunk++;
+    }
+    _ASSERT(nextChunk == nChunks || (_int64) chunks[nextChunk].rawOffset == startingOffset);
+    windowStart = windowEnd = current = startingOffset;
+    end = startingOffset + amountOfFileToProcess;
+}
+
+    void
+SpillDataReader::nextBatch()
+{
+    if (current < windowEnd || nextChunk >= nChunks || (_int64) chunks[nextChunk].rawOffset >= end) {
+        return;
+    }
+
+    //
+    // A block's chunks are next to each other in the file, so the window's worth is one read.
+    //
+    int first = nextChunk;
+    size_t rawTotal = 0;
+    size_t storedTotal = 0;
+    while (nextChunk < nChunks && (_int64) chunks[nextChunk].rawOffset < end &&
+            (nextChunk == first || rawTotal + chunks[nextChunk].rawBytes <= WindowBytes)) {
+        rawTotal += chunks[nextChunk].rawBytes;
+        storedTotal += chunks[nextChunk].storedBytes;
+        nextChunk++;
+    }
+    if (rawTotal > windowSize) {
+        delete [] window;
+        windowSize = max(rawTotal, WindowBytes);
+        window = new char[windowSize];
+    }
+    if (storedTotal > storedSize) {
+        delete [] stored;
+        storedSize = max(storedTotal, WindowBytes);
+        stored = new char[storedSize];
+    }
+    if (_fseek64bit(file, chunks[first].fileOffset, SEEK_SET) != 0 || fread(stored, 1, storedTotal, file) != storedTotal) {
+        fprintf(stderr, "SpillDataReader: unable to read %lld bytes at %lld from %s\n", (_int64) storedTotal, chunks[first].fileOffset, fileName);
+        soft_exit(1);
+    }
+
+    size_t rawUsed = 0;
+    size_t storedUsed = 0;
+    for (int i = first; i < nextChunk; i++) {
+        const SpillChunk* chunk = &chunks[i];
+        if (chunk->storedBytes == chunk->rawBytes) {
+            memcpy(window + rawUsed, stored + storedUsed, chunk->rawBytes);
+        } else {
+            uLongf rawBytes = chunk->rawBytes;
+            if (uncompress((Bytef*) window + rawUsed, &rawBytes, (const Bytef*) stored + storedUsed, chunk->storedBytes) != Z_OK ||
+                    rawBytes != chunk->rawBytes) {
+                fprintf(stderr, "SpillDataReader: corrupt chunk at %lld in %s\n", chunk->fileOffset, fileName);
+                soft_exit(1);
+            }
+        }
+        rawUsed += chunk->rawBytes;
+        storedUsed += chunk->storedBytes;
+    }
+    windowStart = current = chunks[first].rawOffset;
+    windowEnd = min(end, windowStart + (_int64) rawTotal);
+}
     
 class SortedDataFilterSupplier;
 
@@ -96,18 +391,19 @@ class SortedDataFilter : public DataWriter::Filter
 {
 public:
     SortedDataFilter(SortedDataFilterSupplier* i_parent)
-        : Filter(DataWriter::CopyFilter), parent(i_parent), locations()
+        : Filter(DataWriter::CopyFilter), parent(i_parent), locations(), scratch()
     {}
 
     virtual ~SortedDataFilter() {}
 
-    virtual void onAdvance(DataWriter* writer, size_t batchOffset, char* data, unsigned bytes, unsigned location);
+    virtual void onAdvance(DataWriter* writer, size_t batchOffset, char* data, unsigned bytes, GenomeLocation location);
 
     virtual size_t onNextBatch(DataWriter* writer, size_t offset, size_t bytes);
 
 private:
     SortedDataFilterSupplier*   parent;
-    SortVector                  locations;
+    BatchVector                 locations;
+    BatchVector                 scratch; // for sorting locations
 };
 
 class SortedDataFilterSupplier : public DataWriter::FilterSupplier
@@ -120,7 +416,11 @@ public:
         const char* i_tempFileName,
         const char* i_sortedFileName,
         DataWriter::FilterSupplier* i_sortedFilterSupplier,
-        FileEncoder* i_encoder = NULL)
+        int i_numThreads,
+        size_t i_keepMemory,
+        FileEncoder* i_encoder = NULL,
+        const char* i_spillDirectories = NULL,
+        bool i_compressSpills = false)
         :
         format(i_fileFormat),
         genome(i_genome),
@@ -129,9 +429,22 @@ public:
         tempFileName(i_tempFileName),
         sortedFileName(i_sortedFileName),
         sortedFilterSupplier(i_sortedFilterSupplier),
-        blocks()
+        numThreads(i_numThreads),
+        keepMemory(i_keepMemory),
+        keptMemory(0),
+        headerData(NULL),
+        blocks(),
+        samples(),
+        spillFiles(NULL),
+        nSpillFiles(0),
+        nextSpillFile(0),
+        compressSpills(i_compressSpills),
+        chunks()
     {
         InitializeExclusiveLock(&lock);
+        if (i_spillDirectories != NULL || i_compressSpills) {
+            openSpillFiles(i_spillDirectories);
+        }
     }
 
     virtual ~SortedDataFilterSupplier()
@@ -147,15 +460,66 @@ public:
     void setHeaderSize(size_t bytes)
     { headerSize = bytes; }
 
+    //
+    // Memory for a sorted run to be kept in rather than the temp file, or NULL if that would go over keepMemory.
+    //
+    char* keepBlockInMemory(size_t bytes);
+
+    void keepHeaderInMemory(const char* data, size_t bytes);
+
+    bool spills()
+    { return nSpillFiles > 0; }
+
+    //
+    // Write a sorted run to the next spill file, one chunk per sample, compressing the chunks into scratch, which has
+    // to be at least as big as the run.  Returns which spill file it went to.
+    //
+    int spillBlock(const char* data, size_t bytes, const SortVector& blockSamples, char* scratch, size_t scratchSize,
+        SpillChunkVector* o_chunks);
+
 #ifndef VALIDATE_SORT
-	void addBlock(size_t start, size_t bytes);
+	void addBlock(size_t start, size_t bytes, char* memory, const SortVector& blockSamples, int spillFile, const SpillChunkVector& blockChunks);
 #else
-    void addBlock(size_t start, size_t bytes, unsigned minLocation, unsigned maxLocation);
+    void addBlock(size_t start, size_t bytes, char* memory, const SortVector& blockSamples, int spillFile, const SpillChunkVector& blockChunks,
+        GenomeLocation minLocation, GenomeLocation maxLocation);
 #endif
 
 private:
+    //
+    // One spill file in each of the comma separated directories, or just one next to the temp file if there are none.
+    //
+    void openSpillFiles(const char* directories);
+
+    void deleteSpillFiles();
+
     bool mergeSort();
 
+    DataReader* getBlockReader(const SortBlock& block, size_t start, size_t bytes);
+
+    //
+    // The merge can be split by location into ranges, which numThreads threads take one at a time and merge into
+    // memory, while the ranges that are done are written out in order.  splitForParallelMerge returns NULL if there's
+    // not enough to be worth splitting.
+    //
+    MergeRange* splitForParallelMerge(int* o_nRanges);
+
+    bool parallelMergeSort(DataWriter* writer, MergeRange* ranges, int nRanges, _int64* o_total);
+
+    struct ParallelMergeContext {
+        SortedDataFilterSupplier*   supplier;
+        MergeRange*                 ranges;
+        int                         nRanges;
+        int                         maxRangesOutstanding;
+        bool                        rangeHooks; // sortedFilterSupplier wants to see the merged ranges
+        volatile int*               nextRange;
+        volatile int*               runningThreadCount;
+        SingleWaiterObject*         doneObject;
+    };
+
+    static void MergeRangeThreadMain(void* param);
+
+    void mergeRange(MergeRange* range);
+
     const Genome*                   genome;
     const FileFormat*               format;
     const char*                     tempFileName;
@@ -163,8 +527,26 @@ private:
     DataWriter::FilterSupplier*     sortedFilterSupplier;
     FileEncoder*                    encoder;
     size_t                          headerSize;
-    ExclusiveLock                   lock; // for adding blocks
+    int                             numThreads;
+    size_t                          keepMemory;
+    size_t                          keptMemory; // in blocks that are in memory
+    char*                           headerData; // if the header was kept in memory
+    ExclusiveLock                   lock; // for adding blocks and keeping memory
     SortBlockVector                 blocks;
+    SortVector                      samples; // file offset, length and location of every SampleInterval'th record of each block
+
+    struct SpillFile {
+        char*                       fileName;
+        FILE*                       file;   // while it's being written
+        _int64                      size;
+        ExclusiveLock               lock;
+    };
+
+    SpillFile*                      spillFiles;
+    int                             nSpillFiles;
+    volatile int                    nextSpillFile; // round robin
+    bool                            compressSpills;
+    SpillChunkVector                chunks; // of all of the spilled blocks
 
 	friend class SortedDataFilter;
 };
@@ -175,12 +557,17 @@ SortedDataFilter::onAdvance(
     size_t batchOffset,
     char* data,
     unsigned bytes,
-    unsigned location)
+    GenomeLocation location)
 {
-    SortEntry entry(batchOffset, bytes, location);
+    _ASSERT(batchOffset <= UINT32_MAX);
+    if (InvalidGenomeLocation == location) {
+        location = FileFormat::UnalignedSortLocation;   // which is where getSortInfo puts unaligned reads
+    }
+    BatchEntry entry((unsigned) batchOffset, bytes, location);
 #ifdef VALIDATE_SORT
 		if (memcmp(data, "BAM", 3) != 0 && memcmp(data, "@HD", 3) != 0) { // skip header block
-			unsigned loc, len;
+			GenomeLocation loc;
+			unsigned len;
 			parent->format->getSortInfo(parent->genome, data, bytes, &loc, &len);
 			_ASSERT(loc == location);
 		}
@@ -188,6 +575,61 @@ SortedDataFilter::onAdvance(
     locations.push_back(entry);
 }
 
+//
+// Sort a batch's entries by location with an LSD radix sort, a byte at a time, bouncing between entries and scratch and
+// copying back at the end if the result landed in scratch.  It's stable, which the header relies on to stay in front of
+// any reads at location 0.  The counts for all of the location's bytes are taken in one pass, and a byte that's the same
+// for every entry (such as the top one for a small genome) is skipped.
+//
+    static void
+RadixSortBatchEntries(
+    BatchEntry* entries,
+    int nEntries,
+    BatchEntry* scratch)
+{
+    if (nEntries < 2) {
+        return;
+    }
+
+    const int nPasses = sizeof(GenomeLocation);
+    int counts[nPasses][256];
+    memset(counts, 0, sizeof(counts));
+    for (int i = 0; i < nEntries; i++) {
+        GenomeLocation location = entries[i].location;
+        for (int pass = 0; pass < nPasses; pass++) {
+            counts[pass][(location >> (pass * 8)) & 0xff]++;
+        }
+    }
+
+    BatchEntry* from = entries;
+    BatchEntry* to = scratch;
+    for (int pass = 0; pass < nPasses; pass++) {
+        unsigned shift = pass * 8;
+        if (counts[pass][(from[0].location >> shift) & 0xff] == nEntries) {
+            continue;   // Every entry has the same byte here, so this pass wouldn't change anything.
+        }
+
+        int bucketStart[256];
+        int sum = 0;
+        for (int b = 0; b < 256; b++) {
+            bucketStart[b] = sum;
+            sum += counts[pass][b];
+        }
+
+        for (int i = 0; i < nEntries; i++) {
+            to[bucketStart[(from[i].location >> shift) & 0xff]++] = from[i];
+        }
+
+        BatchEntry* temp = from;
+        from = to;
+        to = temp;
+    }
+
+    if (from != entries) {
+        memcpy(entries, from, nEntries * sizeof(BatchEntry));
+    }
+}
+
     size_t
 SortedDataFilter::onNextBatch(
     DataWriter* writer,
@@ -195,7 +637,8 @@ SortedDataFilter::onNextBatch(
     size_t bytes)
 {
     // sort buffered reads by location for later merge sort
-    std::stable_sort(locations.begin(), locations.end(), SortEntry::comparator);
+    scratch.reserve(locations.size());
+    RadixSortBatchEntries(locations.begin(), locations.size(), scratch.begin());
     
     // copy from previous buffer into current in sorted order
     char* fromBuffer;
@@ -208,39 +651,65 @@ SortedDataFilter::onNextBatch(
         fprintf(stderr, "SortedDataFilter::onNextBatch getBatch failed\n");
         soft_exit(1);
     }
-    size_t target = 0;
 	unsigned previous = 0;
-    for (VariableSizeVector<SortEntry>::iterator i = locations.begin(); i != locations.end(); i++) {
+    size_t header = offset > 0 ? 0 : locations[0].length;
+
+    //
+    // If there's memory for it, the sorted records go there instead of to the temp file, and nothing from this batch
+    // gets written.  Otherwise, if there are spill files, they're sorted in place and go to one of those, and again
+    // nothing gets written.  Either way the header stays separate, at the front of the temp file or in its own memory.
+    //
+    char* memory = parent->keepBlockInMemory(bytes - header);
+    bool spill = memory == NULL && parent->spills();
+    char* blockBuffer = memory != NULL ? memory : spill ? toBuffer : toBuffer + header;
+    size_t blockStart = memory != NULL || spill ? 0 : offset + header;
+    if (header > 0) {
+        parent->setHeaderSize(header);
+        if (memory != NULL || spill) {
+            parent->keepHeaderInMemory(fromBuffer + locations[0].offset, header);
+        } else {
+            memcpy(toBuffer, fromBuffer + locations[0].offset, header);
+        }
+    }
+
+    size_t target = 0;
+    SortVector blockSamples;
+    for (BatchVector::iterator i = locations.begin() + (header > 0); i != locations.end(); i++) {
+        int index = (int) (i - locations.begin()) - (header > 0);
+        if (index % SampleInterval == 0) {
+            blockSamples.push_back(SortEntry(blockStart + target, i->length, i->location));
+        }
 #ifdef VALIDATE_SORT
-		if (locations.size() > 1) { // skip header block
-			unsigned loc, len;
-			parent->format->getSortInfo(parent->genome, fromBuffer + i->offset, i->length, &loc, &len);
-			_ASSERT(loc >= previous);
-			previous = loc;
-		}
+		unsigned loc, len;
+		parent->format->getSortInfo(parent->genome, fromBuffer + i->offset, i->length, &loc, &len);
+		_ASSERT(loc >= previous);
+		previous = loc;
 #endif
-        memcpy(toBuffer + target, fromBuffer + i->offset, i->length);
+        memcpy(blockBuffer + target, fromBuffer + i->offset, i->length);
         target += i->length;
     }
     
-    // remember block extent for later merge sort
-    SortBlock block;
-    // handle header specially
-    size_t header = offset > 0 ? 0 : locations[0].length;
-    if (header > 0) {
-        parent->setHeaderSize(header);
+    //
+    // The unsorted records have all been copied out, so their buffer is free to compress the spilled ones into.
+    //
+    int spillFile = -1;
+    SpillChunkVector blockChunks;
+    if (spill && target > 0) {
+        spillFile = parent->spillBlock(blockBuffer, target, blockSamples, fromBuffer, fromSize, &blockChunks);
     }
+
+    // remember block extent for later merge sort
 	int first = offset == 0;
 #ifdef VALIDATE_SORT
-	unsigned minLocation = locations.size() > first ? locations[first].location : 0;
-	unsigned maxLocation = locations.size() > first ? locations[locations.size()-1].location : UINT32_MAX;
-    parent->addBlock(offset + header, bytes - header, minLocation, maxLocation);
+	GenomeLocation minLocation = locations.size() > first ? locations[first].location : 0;
+	GenomeLocation maxLocation = locations.size() > first ? locations[locations.size()-1].location : FileFormat::UnalignedSortLocation;
+    parent->addBlock(blockStart, bytes - header, memory, blockSamples, spillFile, blockChunks, minLocation, maxLocation);
 #else
-    parent->addBlock(offset + header, bytes - header);
+    parent->addBlock(blockStart, bytes - header, memory, blockSamples, spillFile, blockChunks);
 #endif
     locations.clear();
 
-    return target;
+    return memory != NULL || spill ? 0 : header + target;
 }
     
     DataWriter::Filter*
@@ -253,13 +722,15 @@ SortedDataFilterSupplier::getFilter()
 SortedDataFilterSupplier::onClosed(
     DataWriterSupplier* supplier)
 {
-    if (blocks.size() == 1 && sortedFilterSupplier == NULL) {
-        // just rename/move temp file to real file, we're done
+    if (blocks.size() == 1 && blocks[0].memory == NULL && blocks[0].spillFile < 0 && headerData == NULL && sortedFilterSupplier == NULL &&
+        ! GenericFile::IsRemote(sortedFileName)) {
+        // just rename/move temp file to real file, we're done (a remote one gets it copied up by the merge)
         DeleteSingleFile(sortedFileName); // if it exists
         if (! MoveSingleFile(tempFileName, sortedFileName)) {
             fprintf(stderr, "unable to move temp file %s to final sorted file %s\n", tempFileName, sortedFileName);
             soft_exit(1);
         }
+        deleteSpillFiles();
         return;
     }
     // merge sort into final file
@@ -272,10 +743,14 @@ SortedDataFilterSupplier::onClosed(
     void
 SortedDataFilterSupplier::addBlock(
     size_t start,
-    size_t bytes
+    size_t bytes,
+    char* memory,
+    const SortVector& blockSamples,
+    int spillFile,
+    const SpillChunkVector& blockChunks
 #ifdef VALIDATE_SORT
-	, unsigned minLocation
-	, unsigned maxLocation
+	, GenomeLocation minLocation
+	, GenomeLocation maxLocation
 #endif
 	)
 {
@@ -289,6 +764,18 @@ SortedDataFilterSupplier::addBlock(
         SortBlock block;
         block.start = start;
         block.bytes = bytes;
+        block.memory = memory;
+        block.firstSample = (int) samples.size();
+        block.nSamples = (int) blockSamples.size();
+        for (int i = 0; i < blockSamples.size(); i++) {
+            samples.push_back(blockSamples[i]);
+        }
+        block.spillFile = spillFile;
+        block.firstChunk = (int) chunks.size();
+        block.nChunks = (int) blockChunks.size();
+        for (int i = 0; i < blockChunks.size(); i++) {
+            chunks.push_back(blockChunks[i]);
+        }
 #if VALIDATE_SORT
 		block.minLocation = minLocation;
 		block.maxLocation = maxLocation;
@@ -298,115 +785,363 @@ SortedDataFilterSupplier::addBlock(
     }
 }
 
-    bool
-SortedDataFilterSupplier::mergeSort()
+    char*
+SortedDataFilterSupplier::keepBlockInMemory(
+    size_t bytes)
 {
-    // merge sort from temp file into sorted file
-#if USE_DEVTEAM_OPTIONS
-    fprintf(stderr, "sorting...");
-    _int64 start = timeInMillis();
-    _int64 startReadWaitTime = DataReader::ReadWaitTime;
-    _int64 startReleaseWaitTime = DataReader::ReleaseWaitTime;
-    _int64 startWriteWaitTime = DataWriter::WaitTime;
-    _int64 startWriteFilterTime = DataWriter::FilterTime;
-#endif
+    if (bytes == 0) {
+        return NULL;
+    }
+    AcquireExclusiveLock(&lock);
+    bool fits = keptMemory + bytes <= keepMemory;
+    if (fits) {
+        keptMemory += bytes;
+    }
+    ReleaseExclusiveLock(&lock);
+    return fits ? (char*) BigAlloc(bytes) : NULL;
+}
 
-    // set up buffered output
-    DataWriterSupplier* writerSupplier = DataWriterSupplier::create(sortedFileName, sortedFilterSupplier,
-        encoder, encoder != NULL ? 6 : 4); // use more buffers to let encoder run async
-    DataWriter* writer = writerSupplier->getWriter();
-    if (writer == NULL) {
-        fprintf(stderr, "open sorted file for write failed\n");
-        return false;
+    void
+SortedDataFilterSupplier::keepHeaderInMemory(
+    const char* data,
+    size_t bytes)
+{
+    // only the first batch has the header, so no lock needed
+    headerData = (char*) BigAlloc(bytes);
+    memcpy(headerData, data, bytes);
+}
+
+    void
+SortedDataFilterSupplier::openSpillFiles(
+    const char* directories)
+{
+    const char* baseName = strrchr(tempFileName, PATH_SEP);
+    baseName = baseName != NULL ? baseName + 1 : tempFileName;
+
+    nSpillFiles = 1;
+    for (const char* p = directories; p != NULL && *p != '\0'; p++) {
+        nSpillFiles += *p == ',';
     }
-    DataSupplier* readerSupplier = DataSupplier::Default[true]; // autorelease
-    // setup - open all files, read first block, begin read for second
-    for (SortBlockVector::iterator i = blocks.begin(); i != blocks.end(); i++) {
-        i->reader = readerSupplier->getDataReader(MAX_READ_LENGTH * 8); // todo: standardize max length
-        i->reader->init(tempFileName);
-        i->reader->reinit(i->start, i->bytes);
+    spillFiles = new SpillFile[nSpillFiles];
+
+    const char* directory = directories;
+    for (int i = 0; i < nSpillFiles; i++) {
+        SpillFile* spill = &spillFiles[i];
+        if (directories != NULL) {
+            const char* comma = strchr(directory, ',');
+            size_t directoryLength = comma != NULL ? comma - directory : strlen(directory);
+            size_t length = directoryLength + strlen(baseName) + 20;
+            spill->fileName = new char[length];
+            snprintf(spill->fileName, length, "%.*s%c%s.%d", (int) directoryLength, directory, PATH_SEP, baseName, i);
+            directory = comma != NULL ? comma + 1 : directory + directoryLength;
+        } else {
+            size_t length = strlen(tempFileName) + 20;
+            spill->fileName = new char[length];
+            snprintf(spill->fileName, length, "%s.%d", tempFileName, i);
+        }
+        spill->file = fopen(spill->fileName, "wb");
+        if (spill->file == NULL) {
+            fprintf(stderr, "unable to create sort spill file %s\n", spill->fileName);
+            soft_exit(1);
+        }
+        spill->size = 0;
+        InitializeExclusiveLock(&spill->lock);
     }
+}
 
-    // write out header
-    if (headerSize > 0xffffffff) {
-        fprintf(stderr,"SortedDataFilterSupplier: headerSize too big\n");
+    void
+SortedDataFilterSupplier::deleteSpillFiles()
+{
+    for (int i = 0; i < nSpillFiles; i++) {
+        SpillFile* spill = &spillFiles[i];
+        if (spill->file != NULL) {
+            fclose(spill->file);
+        }
+        if (! DeleteSingleFile(spill->fileName)) {
+            fprintf(stderr, "warning: failure deleting sort spill file %s\n", spill->fileName);
+        }
+        delete [] spill->fileName;
+        DestroyExclusiveLock(&spill->lock);
+    }
+    delete [] spillFiles;
+    spillFiles = NULL;
+    nSpillFiles = 0;
+}
+
+    int
+SortedDataFilterSupplier::spillBlock(
+    const char* data,
+    size_t bytes,
+    const SortVector& blockSamples,
+    char* scratch,
+    size_t scratchSize,
+    SpillChunkVector* o_chunks)
+{
+    //
+    // Level 1, since this is about getting the runs to disk and back faster, not making them small.  A chunk is never
+    // stored any bigger than it is, so the stored block always fits in scratch.
+    //
+    size_t stored = 0;
+    for (int i = 0; i < blockSamples.size(); i++) {
+        size_t rawOffset = blockSamples[i].offset;
+        unsigned rawBytes = (unsigned) ((i + 1 < blockSamples.size() ? blockSamples[i + 1].offset : bytes) - rawOffset);
+        uLongf storedBytes = (uLongf) min(scratchSize - stored, (size_t) compressBound(rawBytes));
+        if ((! compressSpills) ||
+                compress2((Bytef*) scratch + stored, &storedBytes, (const Bytef*) data + rawOffset, rawBytes, 1) != Z_OK ||
+                storedBytes >= rawBytes) {
+            memcpy(scratch + stored, data + rawOffset, rawBytes);
+            storedBytes = rawBytes;
+        }
+        o_chunks->push_back(SpillChunk(stored, rawOffset, rawBytes, (unsigned) storedBytes));
+        stored += storedBytes;
+    }
+
+    int which = (InterlockedIncrementAndReturnNewValue(&nextSpillFile) - 1) % nSpillFiles;
+    SpillFile* spill = &spillFiles[which];
+    AcquireExclusiveLock(&spill->lock);
+    _int64 fileOffset = spill->size;
+    if (_fseek64bit(spill->file, fileOffset, SEEK_SET) != 0 || fwrite(scratch, 1, stored, spill->file) != stored) {
+        fprintf(stderr, "unable to write %lld bytes to sort spill file %s\n", (_int64) stored, spill->fileName);
         soft_exit(1);
     }
-    if (headerSize > 0) {
-        blocks[0].reader->reinit(0, headerSize);
-		writer->inHeader(true);
-        char* rbuffer;
-        _int64 rbytes;
-        char* wbuffer;
-        size_t wbytes;
-		for (size_t left = headerSize; left > 0; ) {
-			if ((! blocks[0].reader->getData(&rbuffer, &rbytes)) || rbytes == 0) {
-				blocks[0].reader->nextBatch();
-				if (! blocks[0].reader->getData(&rbuffer, &rbytes)) {
-					fprintf(stderr, "read header failed\n");
-					soft_exit(1);
-				}
-			}
-			if ((! writer->getBuffer(&wbuffer, &wbytes)) || wbytes == 0) {
-				writer->nextBatch();
-				if (! writer->getBuffer(&wbuffer, &wbytes)) {
-					fprintf(stderr, "write header failed\n");
-					soft_exit(1);
-				}
-			}
-			size_t xfer = min(left, min((size_t) rbytes, wbytes));
-			_ASSERT(xfer > 0 && xfer <= UINT32_MAX);
-			memcpy(wbuffer, rbuffer, xfer);
-			blocks[0].reader->advance(xfer);
-			writer->advance((unsigned) xfer);
-			left -= xfer;
-		}
-        blocks[0].reader->reinit(blocks[0].start, blocks[0].bytes);
-		writer->nextBatch();
-		writer->inHeader(false);
+    spill->size += stored;
+    ReleaseExclusiveLock(&spill->lock);
+
+    for (int i = 0; i < o_chunks->size(); i++) {
+        (*o_chunks)[i].fileOffset += fileOffset;
     }
+    return which;
+}
 
-    // merge temp blocks into output
+    DataReader*
+SortedDataFilterSupplier::getBlockReader(
+    const SortBlock& block,
+    size_t start,
+    size_t bytes)
+{
+    DataReader* reader;
+    if (block.memory != NULL) {
+        reader = new MemoryDataReader(block.memory);
+    } else if (block.spillFile >= 0) {
+        reader = new SpillDataReader(spillFiles[block.spillFile].fileName, &chunks[block.firstChunk], block.nChunks);
+        if (! reader->init(NULL)) {
+            fprintf(stderr, "unable to open spill file %s\n", spillFiles[block.spillFile].fileName);
+            soft_exit(1);
+        }
+    } else {
+        reader = DataSupplier::Default[true]->getDataReader(MAX_READ_LENGTH * 8); // todo: standardize max length
+        reader->init(tempFileName);
+    }
+    reader->reinit(start, bytes);
+    return reader;
+}
+
+//
+// Copy headerBytes bytes from where reader is to writer (which is then left at the start of a new batch), or just skip
+// over them if writer is NULL.
+//
+    static bool
+CopyHeader(
+    DataReader* reader,
+    size_t headerBytes,
+    DataWriter* writer)
+{
+    if (writer != NULL) {
+        writer->inHeader(true);
+    }
+    char* rbuffer;
+    _int64 rbytes;
+    char* wbuffer;
+    size_t wbytes;
+    for (size_t left = headerBytes; left > 0; ) {
+        if ((! reader->getData(&rbuffer, &rbytes)) || rbytes == 0) {
+            reader->nextBatch();
+            if (! reader->getData(&rbuffer, &rbytes)) {
+                fprintf(stderr, "read header failed\n");
+                return false;
+            }
+        }
+        size_t xfer = min(left, (size_t) rbytes);
+        if (writer != NULL) {
+            if ((! writer->getBuffer(&wbuffer, &wbytes)) || wbytes == 0) {
+                writer->nextBatch();
+                if (! writer->getBuffer(&wbuffer, &wbytes)) {
+                    fprintf(stderr, "write header failed\n");
+                    return false;
+                }
+            }
+            xfer = min(xfer, wbytes);
+            _ASSERT(xfer > 0 && xfer <= UINT32_MAX);
+            memcpy(wbuffer, rbuffer, xfer);
+            writer->advance((unsigned) xfer);
+        }
+        reader->advance(xfer);
+        left -= xfer;
+    }
+    if (writer != NULL) {
+        writer->nextBatch();
+        writer->inHeader(false);
+    }
+    return true;
+}
+
+//
+// Get the sort info for the record that b's reader is at, going on to the next batch if need be.  Returns false if the
+// block has no more records before endLocation, leaving it to the caller to delete the reader.
+//
+    static bool
+ReadSortInfo(
+    const FileFormat* format,
+    const Genome* genome,
+    SortBlock* b,
+    _int64 endLocation)
+{
+    _int64 bytes;
+    if (! b->reader->getData(&b->data, &bytes)) {
+        b->reader->nextBatch();
+        if (! b->reader->getData(&b->data, &bytes)) {
+            return false;
+        }
+    }
+    format->getSortInfo(genome, b->data, bytes, &b->location, &b->length);
+    _ASSERT(b->length <= bytes);
+    return (_int64) b->location < endLocation;
+}
+
+//
+// The merge's key for a block's current record: its location, then the block, so that records at the same location
+// come out in block order and no two keys are the same.  The block gets the bits that the location doesn't use.
+//
+static const unsigned MergeKeyBlockBits = 64 - GenomeLocationBits;
+
+    static inline _uint64
+MergeKey(
+    GenomeLocation location,
+    int blockIndex)
+{
+    _ASSERT((_uint64) blockIndex < ((_uint64) 1 << MergeKeyBlockBits));
+    return ((_uint64) location << MergeKeyBlockBits) | (unsigned) blockIndex;
+}
+
+//
+// Records that are next to each other in one block's read buffer, waiting to be copied to the writer together.  They
+// have to be copied before the writer's advance() for each of them, since that's where its filters look at them, and
+// before the block's reader goes on to its next batch or is deleted, which can free them.
+//
+template <class Writer>
+struct PendingRecords
+{
+    PendingRecords(Writer* i_writer) : writer(i_writer), data(NULL), bytes(0), count(0)
+    {
+        writer->getBuffer(&writeBuffer, &writeBytes);
+    }
+
+    //
+    // Returns false if the record won't fit even in an empty batch.
+    //
+    bool add(char* record, unsigned length)
+    {
+        if (record != data + bytes || bytes + length > writeBytes || count == MaxRecords) {
+            flush();
+            data = record;
+            if (writeBytes < length) {
+                writer->nextBatch();
+                writer->getBuffer(&writeBuffer, &writeBytes);
+                if (writeBytes < length) {
+                    fprintf(stderr, "mergeSort: buffer size too small\n");
+                    return false;
+                }
+            }
+        }
+        lengths[count++] = length;
+        bytes += length;
+        return true;
+    }
+
+    void flush()
+    {
+        if (count == 0) {
+            return;
+        }
+        memcpy(writeBuffer, data, bytes);
+        for (int i = 0; i < count; i++) {
+            writer->advance(lengths[i]);
+        }
+        writeBuffer += bytes;
+        writeBytes -= bytes;
+        bytes = 0;
+        count = 0;
+    }
+
+    static const int MaxRecords = 256;
+
+    Writer*     writer;
+    char*       writeBuffer;
+    size_t      writeBytes;
+    char*       data;
+    size_t      bytes;
+    int         count;
+    unsigned    lengths[MaxRecords];
+};
+
+//
+// Merge the records with locations in [beginLocation, endLocation) from the blocks, each of which is a run of records
+// in sorted order with its reader set up at or before the first of them, into writer.  The readers are deleted as they
+// run out.  Writer is a DataWriter, or anything else with the getBuffer, nextBatch and advance that this uses.
+//
+// The blocks' current records play off in a LoserTree, and the winner keeps going without going back to the tree until
+// it passes the best of the rest, which for runs that don't overlap much is a long way.
+//
+template <class Writer>
+    static bool
+MergeSortBlocks(
+    const FileFormat* format,
+    const Genome* genome,
+    SortBlockVector& blocks,
+    Writer* writer,
+    _int64* o_total,
+    _int64 beginLocation = 0,
+    _int64 endLocation = EndOfLocations)
+{
     _int64 total = 0;
+    *o_total = 0;
+    if (blocks.size() == 0) {
+        return true;
+    }
     // get initial merge sort data
-    // queue using complement of location since priority queue is largest first
-    typedef PriorityQueue<unsigned,int,-3> BlockQueue;
-    BlockQueue queue;
+    LoserTree tree(blocks.size());
     for (SortBlockVector::iterator b = blocks.begin(); b != blocks.end(); b++) {
-        _int64 bytes;
-        b->reader->getData(&b->data, &bytes);
-        format->getSortInfo(genome, b->data, bytes, &b->location, &b->length);
-        queue.put((_uint32) (b - blocks.begin()), ~b->location); 
+        if (b->reader == NULL) {
+            continue;   // Nothing in this one
+        }
+        bool any = ReadSortInfo(format, genome, b, endLocation);
+        while (any && (_int64) b->location < beginLocation) {
+            b->reader->advance(b->length);
+            any = ReadSortInfo(format, genome, b, endLocation);
+        }
+        if (any) {
+            tree.set((int) (b - blocks.begin()), MergeKey(b->location, (int) (b - blocks.begin())));
+        } else {
+            delete b->reader;
+            b->reader = NULL;
+        }
     }
-    unsigned current = 0; // current location for validation
+    tree.build();
+    PendingRecords<Writer> pending(writer);
+    GenomeLocation current = 0; // current location for validation
 	int lastRefID = -1, lastPos = 0;
-    while (queue.size() > 0) {
-#if VALIDATE_SORT
-		unsigned check;
-		queue.peek(&check);
-		_ASSERT(~check >= current);
-#endif
-        unsigned secondLocation;
-        int smallestIndex = queue.pop();
-        int secondIndex = queue.size() > 0 ? queue.peek(&secondLocation) : -1;
-        unsigned limit = secondIndex != -1 ? ~secondLocation : UINT32_MAX;
-        SortBlock* b = &blocks[smallestIndex];
-        char* writeBuffer;
-        size_t writeBytes;
-        writer->getBuffer(&writeBuffer, &writeBytes);
-        while (b->location <= limit) {
+    while (tree.winnerKey() != LoserTree::Exhausted) {
+        int index = tree.winner();
+        _uint64 limit = tree.runnerUpKey();
+        SortBlock* b = &blocks[index];
+        _uint64 key;
+        for (;;) {
 #if VALIDATE_SORT
 			_ASSERT(b->location >= b->minLocation && b->location <= b->maxLocation);
 #endif
-            if (writeBytes < b->length) {
-                writer->nextBatch();
-                writer->getBuffer(&writeBuffer, &writeBytes);
-                if (writeBytes < b->length) {
-                    fprintf(stderr, "mergeSort: buffer size too small\n");
-                    return false;
-                }
+            if (! pending.add(b->data, b->length)) {
+                return false;
             }
-            memcpy(writeBuffer, b->data, b->length);
 #ifdef VALIDATE_BAM
             if (format == FileFormat::BAM[0] || format == FileFormat::BAM[1]) {
                 ((BAMAlignment*)b->data)->validate();
@@ -422,28 +1157,99 @@ SortedDataFilterSupplier::mergeSort()
 			}
 #endif
 			total++;
-            writer->advance(b->length);
-            writeBytes -= b->length;
-            writeBuffer += b->length;
             b->reader->advance(b->length);
             _ASSERT(b->location >= current);
             current = b->location;
-            _int64 readBytes;
-            if (! b->reader->getData(&b->data, &readBytes)) {
-                b->reader->nextBatch();
-                if (! b->reader->getData(&b->data, &readBytes)) {
-                    _ASSERT(b->reader->isEOF());
-                    delete b->reader;
-                    b->reader = NULL;
-                    break;
-                }
+            char* next;
+            _int64 bytes;
+            if (! b->reader->getData(&next, &bytes)) {
+                pending.flush();    // Going on to the next batch can free this one
+            }
+            if (! ReadSortInfo(format, genome, b, endLocation)) {
+                pending.flush();
+                delete b->reader;
+                b->reader = NULL;
+                key = LoserTree::Exhausted;
+                break;
             }
-            unsigned previous = b->location;
-            format->getSortInfo(genome, b->data, readBytes, &b->location, &b->length);
-            _ASSERT(b->length <= readBytes && b->location >= previous);
+            _ASSERT(b->location >= current);
+            key = MergeKey(b->location, index);
+            if (key > limit) {
+                break;
+            }
+        }
+        tree.replaceWinner(key);
+    }
+    pending.flush();
+    *o_total = total;
+    return true;
+}
+
+    bool
+SortedDataFilterSupplier::mergeSort()
+{
+    // merge sort from temp file into sorted file
+#if USE_DEVTEAM_OPTIONS
+    fprintf(stderr, "sorting...");
+    _int64 start = timeInMillis();
+    _int64 startReadWaitTime = DataReader::ReadWaitTime;
+    _int64 startReleaseWaitTime = DataReader::ReleaseWaitTime;
+    _int64 startWriteWaitTime = DataWriter::WaitTime;
+    _int64 startWriteFilterTime = DataWriter::FilterTime;
+#endif
+
+    // set up buffered output
+    DataWriterSupplier* writerSupplier = DataWriterSupplier::create(sortedFileName, sortedFilterSupplier,
+        encoder, encoder != NULL ? 6 : 4); // use more buffers to let encoder run async
+    DataWriter* writer = writerSupplier->getWriter();
+    if (writer == NULL) {
+        fprintf(stderr, "open sorted file for write failed\n");
+        return false;
+    }
+    DataSupplier* readerSupplier = DataSupplier::Default[true]; // autorelease
+
+    // everything's been spilled, so the spill files can be closed for the readers to open
+    for (int i = 0; i < nSpillFiles; i++) {
+        fclose(spillFiles[i].file);
+        spillFiles[i].file = NULL;
+    }
+
+    // write out header
+    if (headerSize > 0xffffffff) {
+        fprintf(stderr,"SortedDataFilterSupplier: headerSize too big\n");
+        soft_exit(1);
+    }
+    if (headerSize > 0) {
+        DataReader* headerReader;
+        if (headerData != NULL) {
+            headerReader = new MemoryDataReader(headerData);
+        } else {
+            headerReader = readerSupplier->getDataReader(MAX_READ_LENGTH * 8);
+            headerReader->init(tempFileName);
+        }
+        headerReader->reinit(0, headerSize);
+        if (! CopyHeader(headerReader, headerSize, writer)) {
+            soft_exit(1);
+        }
+        delete headerReader;
+    }
+
+    // merge temp blocks into output
+    _int64 total;
+    int nRanges;
+    MergeRange* ranges = splitForParallelMerge(&nRanges);
+    if (ranges != NULL) {
+        if (! parallelMergeSort(writer, ranges, nRanges, &total)) {
+            return false;
+        }
+    } else {
+        // setup - open all files, read first block, begin read for second
+        for (SortBlockVector::iterator i = blocks.begin(); i != blocks.end(); i++) {
+            i->reader = getBlockReader(*i, i->start, i->bytes);
         }
-        if (b->reader != NULL) {
-            queue.put(smallestIndex, ~b->location);
+
+        if (! MergeSortBlocks(format, genome, blocks, writer, &total)) {
+            return false;
         }
     }
     
@@ -455,6 +1261,17 @@ SortedDataFilterSupplier::mergeSort()
     if (! DeleteSingleFile(tempFileName)) {
         fprintf(stderr, "warning: failure deleting temp file %s\n", tempFileName);
     }
+    deleteSpillFiles();
+    for (SortBlockVector::iterator i = blocks.begin(); i != blocks.end(); i++) {
+        if (i->memory != NULL) {
+            BigDealloc(i->memory);
+            i->memory = NULL;
+        }
+    }
+    if (headerData != NULL) {
+        BigDealloc(headerData);
+        headerData = NULL;
+    }
 
 #if USE_DEVTEAM_OPTIONS
     fprintf(stderr, "sorted %lld reads in %u blocks, %lld s\n"
@@ -469,22 +1286,331 @@ SortedDataFilterSupplier::mergeSort()
     return true;
 }
 
+//
+// For lower_bound on a block's samples.
+//
+    static bool
+SampleBeforeLocation(
+    const SortEntry& sample,
+    _int64 location)
+{
+    return (_int64) sample.location < location;
+}
+
+    MergeRange*
+SortedDataFilterSupplier::splitForParallelMerge(
+    int* o_nRanges)
+{
+    if (numThreads < 2 || blocks.size() < 2) {
+        return NULL;
+    }
+
+    //
+    // Weigh each sample by the bytes from it to the next one in its block, and cut the location space every time
+    // about rangeBytes have gone by.  There should be several ranges for each thread, so that they stay busy when
+    // the ranges come out uneven, but each range is held in memory until it's written, so they can't be too big.
+    //
+    static const size_t MinRangeBytes = 1024 * 1024;
+    static const size_t MaxRangeBytes = 16 * 1024 * 1024;
+
+    SortVector weights; // offset holds the bytes
+    size_t totalBytes = 0;
+    for (SortBlockVector::iterator b = blocks.begin(); b != blocks.end(); b++) {
+        for (int i = 0; i < b->nSamples; i++) {
+            const SortEntry& sample = samples[b->firstSample + i];
+            size_t next = i + 1 < b->nSamples ? samples[b->firstSample + i + 1].offset : b->start + b->bytes;
+            weights.push_back(SortEntry(next - sample.offset, 0, sample.location));
+            totalBytes += next - sample.offset;
+        }
+    }
+    size_t rangeBytes = min(MaxRangeBytes, max(MinRangeBytes, totalBytes / (4 * numThreads)));
+    if (totalBytes < 2 * rangeBytes) {
+        return NULL;
+    }
+
+    std::sort(weights.begin(), weights.end(), SortEntry::comparator);
+    VariableSizeVector<_int64> boundaries;
+    size_t bytes = 0;
+    _int64 previous = 0;
+    for (SortVector::iterator i = weights.begin(); i != weights.end(); i++) {
+        if (bytes >= rangeBytes && (_int64) i->location > previous) {
+            boundaries.push_back(i->location);
+            previous = i->location;
+            bytes = 0;
+        }
+        bytes += i->offset;
+    }
+    if (boundaries.size() == 0) {
+        return NULL;    // All in a few locations
+    }
+
+    int nRanges = boundaries.size() + 1;
+    MergeRange* ranges = new MergeRange[nRanges];
+    for (int i = 0; i < nRanges; i++) {
+        ranges[i].beginLocation = i == 0 ? 0 : boundaries[i - 1];
+        ranges[i].endLocation = i == nRanges - 1 ? EndOfLocations : boundaries[i];
+    }
+    *o_nRanges = nRanges;
+    return ranges;
+}
+
+    void
+SortedDataFilterSupplier::mergeRange(
+    MergeRange* range)
+{
+    //
+    // Each block is sorted, so its samples say where in it the range's records are: after the last sample before the
+    // range, and before the first one past it.  MergeSortBlocks skips the few records at either end that are outside.
+    //
+    SortBlockVector rangeBlocks;
+    size_t bound = 0;
+    for (SortBlockVector::iterator b = blocks.begin(); b != blocks.end(); b++) {
+        const SortEntry* first = b->nSamples > 0 ? &samples[b->firstSample] : NULL;
+        const SortEntry* end = first + b->nSamples;
+        const SortEntry* s = std::lower_bound(first, end, range->beginLocation, SampleBeforeLocation);
+        size_t start = s == first ? b->start : (s - 1)->offset;
+        const SortEntry* e = range->endLocation == EndOfLocations ? end : std::lower_bound(s, end, range->endLocation, SampleBeforeLocation);
+        size_t stop = e == end ? b->start + b->bytes : e->offset;
+        if (stop <= start) {
+            continue;
+        }
+        SortBlock block;
+        block.start = start;
+        block.bytes = stop - start;
+        block.memory = b->memory;
+        block.spillFile = b->spillFile;
+        block.firstChunk = b->firstChunk;
+        block.nChunks = b->nChunks;
+        block.reader = getBlockReader(block, block.start, block.bytes);
+        rangeBlocks.push_back(block);
+        bound += block.bytes;
+    }
+
+    range->bufferSize = bound;
+    range->buffer = (char*) BigAlloc(max(bound, (size_t) 1));
+    range->used = 0;
+    range->ok = MergeSortBlocks(format, genome, rangeBlocks, range, &range->total, range->beginLocation, range->endLocation);
+}
+
+    void
+SortedDataFilterSupplier::MergeRangeThreadMain(
+    void* param)
+{
+    ParallelMergeContext* context = (ParallelMergeContext*) param;
+    for (;;) {
+        int r = InterlockedIncrementAndReturnNewValue(context->nextRange) - 1;
+        if (r >= context->nRanges) {
+            break;
+        }
+        //
+        // Don't get too far ahead of the writer, since each range that's waiting to be written holds all of its records.
+        //
+        if (r >= context->maxRangesOutstanding) {
+            WaitForSingleWaiterObject(&context->ranges[r - context->maxRangesOutstanding].consumed);
+        }
+        MergeRange* range = &context->ranges[r];
+        context->supplier->mergeRange(range);
+        if (context->rangeHooks && range->ok) {
+            context->supplier->sortedFilterSupplier->onRangeMerged(r, range->buffer, range->lengths.begin(), range->lengths.size(),
+                range->beginLocation, range->endLocation);
+        }
+        SignalSingleWaiterObject(&range->merged);
+    }
+
+    if (0 == InterlockedDecrementAndReturnNewValue(context->runningThreadCount)) {
+        SignalSingleWaiterObject(context->doneObject);
+    }
+}
+
+    bool
+SortedDataFilterSupplier::parallelMergeSort(
+    DataWriter* writer,
+    MergeRange* ranges,
+    int nRanges,
+    _int64* o_total)
+{
+    for (int i = 0; i < nRanges; i++) {
+        CreateSingleWaiterObject(&ranges[i].merged);
+        CreateSingleWaiterObject(&ranges[i].consumed);
+    }
+
+    int nWorkers = min(numThreads, nRanges);
+    volatile int nextRange = 0;
+    volatile int runningThreadCount = nWorkers;
+    SingleWaiterObject doneObject;
+    CreateSingleWaiterObject(&doneObject);
+    ParallelMergeContext context;
+    context.supplier = this;
+    context.ranges = ranges;
+    context.nRanges = nRanges;
+    context.maxRangesOutstanding = 2 * nWorkers;
+    context.rangeHooks = sortedFilterSupplier != NULL && sortedFilterSupplier->beginMergeRanges(nRanges);
+    context.nextRange = &nextRange;
+    context.runningThreadCount = &runningThreadCount;
+    context.doneObject = &doneObject;
+    for (int i = 0; i < nWorkers; i++) {
+        StartNewThread(MergeRangeThreadMain, &context);
+    }
+
+    //
+    // Write the ranges out in order.  The records have to go through the writer one at a time for the filters (such as
+    // duplicate marking and the BAM index), and each has to fit in a batch, but they can be copied a batch at a time.
+    // After a failure keep going without writing, so that the merge threads all finish.
+    //
+    _int64 total = 0;
+    bool ok = true;
+    for (int r = 0; r < nRanges; r++) {
+        MergeRange* range = &ranges[r];
+        WaitForSingleWaiterObject(&range->merged);
+        ok = ok && range->ok;
+        if (ok && context.rangeHooks) {
+            sortedFilterSupplier->onRangeWriting(r, range->buffer, range->lengths.begin(), range->lengths.size());
+        }
+        size_t offset = 0;
+        for (int i = 0; ok && i < range->lengths.size(); ) {
+            char* writeBuffer;
+            size_t writeBytes;
+            writer->getBuffer(&writeBuffer, &writeBytes);
+            size_t chunk = 0;
+            int n = i;
+            while (n < range->lengths.size() && chunk + range->lengths[n] <= writeBytes) {
+                chunk += range->lengths[n++];
+            }
+            if (n == i) {
+                writer->nextBatch();
+                writer->getBuffer(&writeBuffer, &writeBytes);
+                if (writeBytes < range->lengths[i]) {
+                    fprintf(stderr, "mergeSort: buffer size too small\n");
+                    ok = false;
+                }
+                continue;
+            }
+            memcpy(writeBuffer, range->buffer + offset, chunk);
+            for (; i < n; i++) {
+                writer->advance(range->lengths[i]);
+            }
+            offset += chunk;
+        }
+        total += range->total;
+        BigDealloc(range->buffer);
+        range->buffer = NULL;
+        range->lengths.clean();
+        SignalSingleWaiterObject(&range->consumed);
+    }
+
+    WaitForSingleWaiterObject(&doneObject);
+    DestroySingleWaiterObject(&doneObject);
+    if (context.rangeHooks) {
+        sortedFilterSupplier->endMergeRanges();
+    }
+    for (int i = 0; i < nRanges; i++) {
+        DestroySingleWaiterObject(&ranges[i].merged);
+        DestroySingleWaiterObject(&ranges[i].consumed);
+    }
+    delete [] ranges;
+
+    *o_total = total;
+    return ok;
+}
+
+    bool
+DataWriterSupplier::mergeSortedFiles(
+    const FileFormat* format,
+    const Genome* genome,
+    DataSupplier* inputSupplier,
+    int nInputs,
+    const char** inputFileNames,
+    const size_t* headerBytes,
+    const char* outputFileName,
+    DataWriter::FilterSupplier* filterSupplier,
+    FileEncoder* encoder)
+{
+    DataWriterSupplier* writerSupplier = DataWriterSupplier::create(outputFileName, filterSupplier,
+        encoder, encoder != NULL ? 6 : 4);
+    DataWriter* writer = writerSupplier->getWriter();
+    if (writer == NULL) {
+        fprintf(stderr, "unable to open %s for write\n", outputFileName);
+        return false;
+    }
+
+    //
+    // Each input is one sorted block.  The header comes from the first one; the rest just get theirs skipped.
+    //
+    SortBlockVector blocks;
+    for (int i = 0; i < nInputs; i++) {
+        SortBlock block;
+        block.reader = inputSupplier->getDataReader(MAX_READ_LENGTH * 8);
+        if (! block.reader->init(inputFileNames[i])) {
+            fprintf(stderr, "unable to open %s for read\n", inputFileNames[i]);
+            return false;
+        }
+        block.reader->reinit(0, 0);
+        if (! CopyHeader(block.reader, headerBytes[i], 0 == i ? writer : NULL)) {
+            fprintf(stderr, "unable to read the header of %s\n", inputFileNames[i]);
+            return false;
+        }
+        blocks.push_back(block);
+    }
+
+    _int64 total;
+    if (! MergeSortBlocks(format, genome, blocks, writer, &total)) {
+        return false;
+    }
+
+    writer->close();
+    delete writer;
+    writerSupplier->close();
+    delete writerSupplier;
+
+    fprintf(stderr, "merged %lld reads from %d files\n", total, nInputs);
+    return true;
+}
+
+    char*
+DataWriterSupplier::sortTempFileName(
+    const char* outputFileName)
+{
+    const char* base = outputFileName;
+    if (GenericFile::IsRemote(outputFileName)) {
+        const char* slash = strrchr(outputFileName, '/');
+        base = slash != NULL ? slash + 1 : outputFileName;
+    }
+    size_t len = strlen(base);
+    char* tempFileName = (char*) malloc(5 + len);
+    strcpy(tempFileName, base);
+    strcpy(tempFileName + len, ".tmp");
+    return tempFileName;
+}
+
     DataWriterSupplier*
 DataWriterSupplier::sorted(
     const FileFormat* format,
     const Genome* genome,
     const char* tempFileName,
     size_t tempBufferMemory,
+    size_t keepMemory,
     int numThreads,
     const char* sortedFileName,
     DataWriter::FilterSupplier* sortedFilterSuppler,
-    FileEncoder* encoder)
+    FileEncoder* encoder,
+    const char* spillDirectories,
+    bool compressSpills)
 {
-    const int bufferCount = 3;
-    const size_t bufferSize = tempBufferMemory > 0
-        ? tempBufferMemory / (bufferCount * numThreads)
-        : max((size_t) 16 * 1024 * 1024, ((size_t) (genome ? genome->getCountOfBases() : 0) / 3) / bufferCount);
+    size_t bufferSize = (tempBufferMemory > 0 ? tempBufferMemory : defaultSortMemory(genome, numThreads)) / (SortBufferCount * numThreads);
+    if (bufferSize > UINT32_MAX) {
+        bufferSize = UINT32_MAX;    // offsets within a batch are kept in 32 bits for sorting
+    }
     DataWriter::FilterSupplier* filterSupplier =
-        new SortedDataFilterSupplier(format, genome, tempFileName, sortedFileName, sortedFilterSuppler, encoder);
-    return DataWriterSupplier::create(tempFileName, filterSupplier, NULL, bufferCount, bufferSize);
+        new SortedDataFilterSupplier(format, genome, tempFileName, sortedFileName, sortedFilterSuppler, numThreads, keepMemory, encoder,
+            spillDirectories, compressSpills);
+    return DataWriterSupplier::create(tempFileName, filterSupplier, NULL, SortBufferCount, bufferSize);
+}
+
+    size_t
+DataWriterSupplier::defaultSortMemory(
+    const Genome* genome,
+    int numThreads)
+{
+    size_t bufferSize = max((size_t) 16 * 1024 * 1024, ((size_t) (genome ? genome->getCountOfBases() : 0) / 3) / SortBufferCount);
+    return bufferSize * SortBufferCount * numThreads;
 }
@@ -0,0 +1,220 @@
+/*++
+
+Module Name:
+
+    SortedMerger.cpp
+
+Abstract:
+
+    Merge sorted SAM or BAM files, such as the pieces of one input aligned separately with -range.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "SortedMerger.h"
+#include "GenomeIndex.h"
+#include "FileFormat.h"
+#include "DataReader.h"
+#include "DataWriter.h"
+#include "SAM.h"
+#include "Bam.h"
+#include "GzipDataWriter.h"
+#include "Util.h"
+#include "exit.h"
+
+using std::max;
+
+static void usage()
+{
+    fprintf(stderr,
+            "Usage: snap merge <index-dir> <output> <input> [<input> ...] [<options>]\n"
+            "Merges SAM or BAM files that are each sorted by location (for instance the pieces of one input aligned with\n"
+            "-range i/N and -so) into one sorted file.  The inputs and output must all be SAM or all BAM (by their names\n"
+            "ending in .sam or .bam), and must have been aligned against the index in index-dir.  The header is taken from\n"
+            "the first input.  For BAM output duplicates are marked, base quality recalibration tables are gathered and\n"
+            "a .bai index (.csi for contigs over 512M bases) is written, the same as for -so; to mark duplicates across the\n"
+            "whole input, align the pieces with -S d and leave it to the merge.\n"
+            "Options:\n"
+            "  -t   number of threads to compress BAM output with (default is one per core)\n"
+            "  -S   suppress additional processing (BAM output only)\n"
+            "       i=index, d=duplicate marking, q=base quality recalibration tables (written to <output>.recal.txt)\n"
+            "  -od  count duplicates within this many pixels of another on the same flowcell tile as optical; 0 doesn't\n"
+            "       count them (default %d)\n"
+            "  -coverage  also write the depth along each contig to <output>.bedgraph and depth, alignment and insert size\n"
+            "       metrics to <output>.metrics.txt (BAM output only)\n",
+            DataWriterSupplier::DefaultOpticalDuplicateDistance);
+    soft_exit(1);
+}
+
+    static FileType
+GetMergeFileType(const char *fileName)
+{
+    if (util::stringEndsWith(fileName, ".sam")) {
+        return SAMFile;
+    } else if (util::stringEndsWith(fileName, ".bam")) {
+        return BAMFile;
+    }
+    fprintf(stderr, "snap merge: '%s' doesn't end in .sam or .bam\n", fileName);
+    soft_exit(1);
+    return UnknownFileType;
+}
+
+    void
+SortedMerger::runMerger(
+    int argc,
+    const char **argv)
+{
+    if (argc < 3) {
+        usage();
+    }
+
+    const char *indexDir = argv[0];
+    const char *outputFileName = argv[1];
+    int numThreads = GetNumberOfProcessors();
+    bool noIndex = false;
+    bool noDuplicateMarking = false;
+    bool noQualityCalibration = false;
+    bool computeCoverage = false;
+    int opticalDuplicateDistance = DataWriterSupplier::DefaultOpticalDuplicateDistance;
+
+    const char **inputFileNames = new const char *[argc];
+    int nInputs = 0;
+    for (int n = 2; n < argc; n++) {
+        if (strcmp(argv[n], "-t") == 0) {
+            if (n + 1 < argc && atoi(argv[n+1]) > 0) {
+                numThreads = atoi(argv[n+1]);
+                n++;
+            } else {
+                usage();
+            }
+        } else if (strcmp(argv[n], "-S") == 0) {
+            if (n + 1 >= argc) {
+                usage();
+            }
+            n++;
+            for (const char* p = argv[n]; *p; p++) {
+                switch (*p) {
+                case 'i':
+                    noIndex = true;
+                    break;
+                case 'd':
+                    noDuplicateMarking = true;
+                    break;
+                case 'q':
+                    noQualityCalibration = true;
+                    break;
+                default:
+                    usage();
+                }
+            }
+        } else if (strcmp(argv[n], "-coverage") == 0) {
+            computeCoverage = true;
+        } else if (strcmp(argv[n], "-od") == 0) {
+            if (n + 1 < argc && argv[n+1][0] >= '0' && argv[n+1][0] <= '9') {
+                opticalDuplicateDistance = atoi(argv[n+1]);
+                n++;
+            } else {
+                usage();
+            }
+        } else if ('-' == argv[n][0]) {
+            fprintf(stderr, "snap merge: unknown option '%s'\n\n", argv[n]);
+            usage();
+        } else {
+            inputFileNames[nInputs++] = argv[n];
+        }
+    }
+
+    if (0 == nInputs) {
+        usage();
+    }
+
+    FileType fileType = GetMergeFileType(outputFileName);
+    for (int i = 0; i < nInputs; i++) {
+        if (GetMergeFileType(inputFileNames[i]) != fileType) {
+            fprintf(stderr, "snap merge: '%s' isn't the same type as the output file\n", inputFileNames[i]);
+            soft_exit(1);
+        }
+    }
+
+    const Genome *genome = GenomeIndex::loadGenomeFromDirectory(indexDir);
+    if (NULL == genome) {
+        soft_exit(1);
+    }
+
+    //
+    // Find where each input's records start, which also checks that it was aligned against this genome.
+    //
+    size_t *headerBytes = new size_t[nInputs];
+    for (int i = 0; i < nInputs; i++) {
+        ReaderContext context;
+        context.genome = genome;
+        context.defaultReadGroup = "";
+        context.clipping = NoClipping;
+        context.paired = false;
+        context.ignoreSecondaryAlignments = false;
+        context.header = NULL;
+        context.headerLength = 0;
+        context.headerBytes = 0;
+        context.headerMatchesIndex = false;
+        context.rangeIndex = 0;
+        context.rangeCount = 1;
+        context.trimmer = NULL;
+        context.screen = NULL;
+        if (SAMFile == fileType) {
+            SAMReader::readHeader(inputFileNames[i], context);
+        } else {
+            BAMReader::readHeader(inputFileNames[i], context);
+        }
+        if (! context.headerMatchesIndex) {
+            fprintf(stderr, "snap merge: the contigs in the header of '%s' don't match the index in %s\n", inputFileNames[i], indexDir);
+            soft_exit(1);
+        }
+        headerBytes[i] = context.headerBytes;
+        delete [] context.header;
+    }
+
+    //
+    // Build the same output pipeline as the sorted writer does for its final file.
+    //
+    const FileFormat *format;
+    DataSupplier *inputSupplier;
+    DataWriter::FilterSupplier *filters = NULL;
+    FileEncoder *encoder = NULL;
+    if (SAMFile == fileType) {
+        format = FileFormat::SAM[0];
+        inputSupplier = DataSupplier::Default[true];
+    } else {
+        format = FileFormat::BAM[0];
+        inputSupplier = DataSupplier::GzipBamDefault[true];
+        GzipWriterFilterSupplier* gzipSupplier = DataWriterSupplier::gzip(true, BAM_BLOCK, max(1, numThreads - 1), false);
+        filters = gzipSupplier;
+        if (! noQualityCalibration) {
+            filters = DataWriterSupplier::qualityCalibration(outputFileName, genome)->compose(filters);
+        }
+        if (computeCoverage) {
+            filters = DataWriterSupplier::coverage(outputFileName, genome)->compose(filters);
+        }
+        if (! noDuplicateMarking) {
+            filters = DataWriterSupplier::markDuplicates(genome, opticalDuplicateDistance)->compose(filters);
+        }
+        if (! noIndex) {
+            filters = DataWriterSupplier::bamIndex(outputFileName, genome, gzipSupplier)->compose(filters);
+        }
+        encoder = FileEncoder::gzip(gzipSupplier);
+    }
+
+    _int64 start = timeInMillis();
+    if (! DataWriterSupplier::mergeSortedFiles(format, genome, inputSupplier, nInputs, inputFileNames, headerBytes, outputFileName, filters, encoder)) {
+        fprintf(stderr, "snap merge: merge failed\n");
+        soft_exit(1);
+    }
+    fprintf(stderr, "Merged into %s in %llds.\n", outputFileName, (timeInMillis() - start + 500) / 1000);
+
+    delete [] headerBytes;
+    delete [] inputFileNames;
+    delete genome;
+}
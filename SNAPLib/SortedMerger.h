@@ -0,0 +1,26 @@
+/*++
+
+Module Name:
+
+    SortedMerger.h
+
+Abstract:
+
+    Merge sorted SAM or BAM files, such as the pieces of one input aligned separately with -range.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+class SortedMerger
+{
+public:
+    //
+    // snap merge <index-dir> <output> <input> [<input> ...] [<options>]
+    //
+    static void runMerger(int argc, const char **argv);
+};
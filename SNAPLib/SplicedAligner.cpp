@@ -0,0 +1,276 @@
+/*++
+
+Module Name:
+
+    SplicedAligner.cpp
+
+Abstract:
+
+    The aligner for RNA-seq reads that span a splice junction.
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "SplicedAligner.h"
+#include "Tables.h"
+#include "AlignerOptions.h"
+
+static const int NonCanonicalMotifCost = 4;
+
+SplicedAligner::SplicedAligner(
+    GenomeIndex    *i_genomeIndex,
+    unsigned        i_maxHits,
+    unsigned        i_maxK,
+    unsigned        i_numSeedsFromCommandLine,
+    double          i_seedCoverage,
+    unsigned        i_extraSearchDepth,
+    unsigned        i_maxIntronLength) :
+    genomeIndex(i_genomeIndex), genome(i_genomeIndex->getGenome()), maxK(i_maxK), maxIntronLength(i_maxIntronLength)
+{
+    unsigned maxReadSize = MAX_READ_LENGTH;
+    allocator = new BigAllocator(IntersectingPairedEndAligner::getBigAllocatorReservation(genomeIndex, DEFAULT_INTERSECTING_ALIGNER_MAX_HITS,
+        maxReadSize, genomeIndex->getSeedLength(), i_numSeedsFromCommandLine, i_seedCoverage, maxK, i_extraSearchDepth, DEFAULT_MAX_CANDIDATE_POOL_SIZE));
+
+    pairedAligner = new (allocator) IntersectingPairedEndAligner(genomeIndex, maxReadSize, i_maxHits, maxK, i_numSeedsFromCommandLine,
+        i_seedCoverage, 0, maxIntronLength, DEFAULT_INTERSECTING_ALIGNER_MAX_HITS, i_extraSearchDepth, DEFAULT_MAX_CANDIDATE_POOL_SIZE, allocator);
+
+    //
+    // A piece only has to be long enough for a seed.
+    //
+    pairedAligner->setMinReadLength(genomeIndex->getSeedLength());
+    pairedAligner->setLandauVishkin(&lv, &reverseLV);
+}
+
+SplicedAligner::~SplicedAligner()
+{
+    pairedAligner->~IntersectingPairedEndAligner();    // The allocator owns the memory
+    delete allocator;
+}
+
+    int
+SplicedAligner::motifCost(const char *donor, const char *acceptor, char *strand)
+{
+    struct Motif {
+        char    donor[3];
+        char    acceptor[3];
+        char    strand;
+        int     cost;
+    };
+    static const Motif motifs[] = {
+        {"GT", "AG", '+', 0}, {"CT", "AC", '-', 0},     // Canonical
+        {"GC", "AG", '+', 2}, {"CT", "GC", '-', 2},     // Semi-canonical
+        {"AT", "AC", '+', 2}, {"GT", "AT", '-', 2},     // U12
+    };
+
+    for (size_t i = 0; i < sizeof(motifs) / sizeof(motifs[0]); i++) {
+        const Motif &motif = motifs[i];
+        if (donor[0] == motif.donor[0] && donor[1] == motif.donor[1] && acceptor[0] == motif.acceptor[0] && acceptor[1] == motif.acceptor[1]) {
+            *strand = motif.strand;
+            return motif.cost;
+        }
+    }
+
+    *strand = 0;
+    return NonCanonicalMotifCost;
+}
+
+    bool
+SplicedAligner::AlignRead(
+    Read           *read,
+    int             unsplicedScore,
+    AlignmentResult *result,
+    GenomeLocation *genomeLocation,
+    Direction      *direction,
+    int            *score,
+    int            *mapq,
+    SpliceJunction *junction)
+{
+    unsigned readLen = read->getDataLength();
+    unsigned shortPiece = __max(genomeIndex->getSeedLength(), MinOverhang);
+    if (readLen < 3 * shortPiece) {
+        return false;
+    }
+
+    const char *data = read->getData();
+    const char *quality = read->getQuality();
+    for (unsigned i = 0; i < readLen; i++) {
+        rcReadData[i] = COMPLEMENT[(unsigned char)data[readLen - 1 - i]];
+    }
+
+    //
+    // The pieces' lengths for each try.  A third from each end leaves the junctions in the middle third of the read
+    // alone, and a short piece against a half the ones nearer either end.
+    //
+    const int nTries = 3;
+    unsigned pieceLengths[nTries][NUM_READS_PER_PAIR] = {{readLen / 3, readLen / 3}, {shortPiece, readLen / 2}, {readLen / 2, shortPiece}};
+
+    bool found = false;
+    int bestCost = 0;
+    for (int whichTry = 0; whichTry < nTries; whichTry++) {
+        unsigned frontLength = pieceLengths[whichTry][0];
+        unsigned backLength = pieceLengths[whichTry][1];
+
+        //
+        // The back piece goes in reversed, as the other end of a pair would.
+        //
+        for (unsigned i = 0; i < backLength; i++) {
+            rcPieceData[i] = rcReadData[i];
+            rcPieceQuality[i] = quality[readLen - 1 - i];
+        }
+        Read pieces[NUM_READS_PER_PAIR];
+        pieces[0].init(read->getId(), read->getIdLength(), data, quality, frontLength);
+        pieces[1].init(read->getId(), read->getIdLength(), rcPieceData, rcPieceQuality, backLength);
+
+        //
+        // The pieces' starts are the distance between them in the read apart when the read is unspliced, so the
+        // spacing has to be at least that plus the shortest intron.
+        //
+        pairedAligner->setSpacing(readLen - __max(frontLength, backLength) + MinIntronLength, readLen - __min(frontLength, backLength) + maxIntronLength);
+
+        PairedAlignmentResult pairResult;
+        pairResult.status[0] = pairResult.status[1] = NotFound;
+        pairedAligner->align(&pieces[0], &pieces[1], &pairResult, NULL);
+        if (NotFound == pairResult.status[0] || NotFound == pairResult.status[1] || pairResult.direction[0] == pairResult.direction[1]) {
+            continue;
+        }
+
+        //
+        // The diagonals of the two sides of the read in the direction it aligned.  RC, that starts with the back piece.
+        //
+        const char *dirData;
+        GenomeLocation firstDiagonal, secondDiagonal;
+        if (FORWARD == pairResult.direction[0]) {
+            dirData = data;
+            firstDiagonal = pairResult.location[0];
+            secondDiagonal = pairResult.location[1] - (readLen - backLength);
+        } else {
+            dirData = rcReadData;
+            firstDiagonal = pairResult.location[1];
+            secondDiagonal = pairResult.location[0] - (readLen - frontLength);
+        }
+
+        unsigned junctionOffset;
+        int edits, cost;
+        char strand;
+        if (!placeJunction(dirData, readLen, firstDiagonal, secondDiagonal, &junctionOffset, &edits, &cost, &strand)) {
+            continue;
+        }
+
+        if (!found || cost < bestCost) {
+            found = true;
+            bestCost = cost;
+            *result = SingleHit == pairResult.status[0] && SingleHit == pairResult.status[1] ? SingleHit : MultipleHits;
+            *genomeLocation = firstDiagonal;
+            *direction = pairResult.direction[0];
+            *score = edits;
+            *mapq = __min(pairResult.mapq[0], pairResult.mapq[1]);
+            junction->readOffset = junctionOffset;
+            junction->secondLocation = secondDiagonal + junctionOffset;
+            junction->strand = strand;
+        }
+
+        if (bestCost <= SplicePenalty) {
+            break;  // As good as it gets
+        }
+    }
+
+    if (!found || (unsplicedScore >= 0 && bestCost >= unsplicedScore)) {
+        return false;
+    }
+
+    //
+    // The unspliced alignment is the other candidate; being only an edit or two better than it isn't all that sure.
+    //
+    if (unsplicedScore >= 0) {
+        *mapq = __min(*mapq, 10 * (unsplicedScore - bestCost));
+        if (*mapq < MAPQ_LIMIT_FOR_SINGLE_HIT) {
+            *result = MultipleHits;
+        }
+    }
+
+    return true;
+}
+
+    bool
+SplicedAligner::placeJunction(
+    const char     *data,
+    unsigned        dataLength,
+    GenomeLocation  firstDiagonal,
+    GenomeLocation  secondDiagonal,
+    unsigned       *junctionOffset,
+    int            *edits,
+    int            *cost,
+    char           *strand)
+{
+    if (secondDiagonal < firstDiagonal + MinIntronLength || secondDiagonal - firstDiagonal > maxIntronLength) {
+        return false;   // Not an intron, or too long of one
+    }
+
+    const Genome::Contig *contig = genome->getContigAtLocation(firstDiagonal);
+    if (NULL == contig || secondDiagonal + dataLength > contig->beginningOffset + contig->length) {
+        return false;   // The two sides have to be on the one contig
+    }
+    GenomeLocation contigEnd = contig->beginningOffset + contig->length;
+
+    //
+    // Enough reference on each side for LV to have maxK of slack after the junction wherever it goes, and for the
+    // donor's two bases.
+    //
+    unsigned slack = __min(maxK, (unsigned)MAX_K) + 2;
+    unsigned firstTextLength = __min(dataLength + slack, contigEnd - firstDiagonal);
+    unsigned secondTextLength = __min(dataLength + slack, contigEnd - secondDiagonal);
+    const char *first = genome->getSubstring(firstDiagonal, firstTextLength, firstReference, sizeof(firstReference));
+    const char *second = genome->getSubstring(secondDiagonal, secondTextLength, secondReference, sizeof(secondReference));
+    if (NULL == first || NULL == second) {
+        return false;
+    }
+
+    //
+    // Slide the junction along the read, keeping count of the mismatches before it on the first diagonal and after it
+    // on the second.
+    //
+    int mismatchesBefore = 0;
+    int mismatchesAfter = 0;
+    for (unsigned i = 0; i < dataLength; i++) {
+        mismatchesAfter += data[i] != second[i];
+    }
+
+    int bestCost = 0;
+    int bestMotifCost = 0;
+    unsigned bestOffset = 0;
+    char bestStrand = 0;
+    for (unsigned offset = 0; offset + MinOverhang <= dataLength; offset++) {
+        if (offset >= MinOverhang) {
+            char motifStrand;
+            int offsetMotifCost = motifCost(first + offset, second + offset - 2, &motifStrand);
+            int offsetCost = mismatchesBefore + mismatchesAfter + offsetMotifCost;
+            if (0 == bestOffset || offsetCost < bestCost) {
+                bestCost = offsetCost;
+                bestMotifCost = offsetMotifCost;
+                bestOffset = offset;
+                bestStrand = motifStrand;
+            }
+        }
+        mismatchesBefore += data[offset] != first[offset];
+        mismatchesAfter -= data[offset] != second[offset];
+    }
+
+    //
+    // Score the two sides with LV, which can see indels that the mismatch counts can't.
+    //
+    int firstEdits = lv.computeEditDistance(first, __min(firstTextLength, bestOffset + maxK), data, bestOffset, maxK);
+    int secondEdits = lv.computeEditDistance(second + bestOffset, secondTextLength - bestOffset, data + bestOffset, dataLength - bestOffset, maxK);
+    if (firstEdits < 0 || secondEdits < 0 || (unsigned)(firstEdits + secondEdits) > maxK) {
+        return false;
+    }
+
+    *junctionOffset = bestOffset;
+    *edits = firstEdits + secondEdits;
+    *cost = *edits + SplicePenalty + bestMotifCost;
+    *strand = bestStrand;
+    return true;
+}
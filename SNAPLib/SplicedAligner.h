@@ -0,0 +1,94 @@
+/*++
+
+Module Name:
+
+    SplicedAligner.h
+
+Abstract:
+
+    The aligner for RNA-seq reads that span a splice junction, built on the paired-end aligner's intersection of
+    sorted seed hits.
+
+Environment:
+
+    User mode service.
+
+    Not thread safe; each aligner thread needs its own.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "GenomeIndex.h"
+#include "Read.h"
+#include "IntersectingPairedEndAligner.h"
+#include "LandauVishkin.h"
+
+//
+// A read that spans a splice junction doesn't align as it is, but its two sides do, a little way apart on the same
+// strand of the same contig: which is just what a read pair looks like to IntersectingPairedEndAligner, with an intron
+// in place of the insert.  So this hands it a piece from the front of the read and the reverse complement of a piece
+// from the back as the two ends of a pair, with the spacing allowed to go up to the longest intron.  The pieces are
+// tried at a few lengths so that each place the junction can be has a try in which neither piece crosses it.
+//
+// The pair that comes back fixes the diagonal of each side; the junction is wherever between them the mismatches on
+// both sides and its motif's cost add up to the least.  The motif model is the usual one: GT-AG (or CT-AC on the
+// reverse strand) costs nothing, GC-AG and AT-AC a little and anything else more, on top of a flat cost for splicing
+// at all, so that a read only splices when that's clearly better than aligning it unspliced.
+//
+class SplicedAligner {
+public:
+    SplicedAligner(GenomeIndex *i_genomeIndex, unsigned i_maxHits, unsigned i_maxK, unsigned i_numSeedsFromCommandLine, double i_seedCoverage,
+                   unsigned i_extraSearchDepth, unsigned i_maxIntronLength);
+    ~SplicedAligner();
+
+    //
+    // Whether a read that aligned unspliced with unsplicedScore edits (or -1 if it didn't) is worth trying spliced.
+    //
+    static bool shouldTry(int unsplicedScore) {
+        return unsplicedScore < 0 || unsplicedScore > SplicePenalty;
+    }
+
+    //
+    // Aligns the read as two pieces with an intron between them.  Returns true and fills in the rest if it aligns that
+    // way at a lower cost than unsplicedScore (or at all, if that's -1).  score is the edits in the pieces, without the
+    // junction's cost.
+    //
+    bool AlignRead(Read *read, int unsplicedScore, AlignmentResult *result, GenomeLocation *genomeLocation, Direction *direction,
+                   int *score, int *mapq, SpliceJunction *junction);
+
+    static const unsigned MinIntronLength = 20;     // Shorter than this is a deletion
+    static const unsigned MinOverhang = 8;          // The fewest bases either side of the junction can have
+    static const int SplicePenalty = 1;             // What any splice costs, in edits
+
+    //
+    // The cost of the intron's motif in edits, from the two bases after the first piece and the two before the second,
+    // and the transcript strand it implies (or 0).
+    //
+    static int motifCost(const char *donor, const char *acceptor, char *strand);
+
+private:
+    //
+    // Picks the junction for a read (in the direction it aligned, as data) that aligns with the genome starting at
+    // firstDiagonal before it and at secondDiagonal + the junction's offset after it.  Returns false if the two
+    // don't make a valid intron.
+    //
+    bool placeJunction(const char *data, unsigned dataLength, GenomeLocation firstDiagonal, GenomeLocation secondDiagonal,
+                       unsigned *junctionOffset, int *edits, int *cost, char *strand);
+
+    GenomeIndex                    *genomeIndex;
+    const Genome                   *genome;
+    unsigned                        maxK;
+    unsigned                        maxIntronLength;
+    BigAllocator                   *allocator;
+    IntersectingPairedEndAligner   *pairedAligner;
+    LandauVishkin<1>                lv;             // Shared with pairedAligner
+    LandauVishkin<-1>               reverseLV;
+
+    char                            rcReadData[MAX_READ_LENGTH];
+    char                            rcPieceData[MAX_READ_LENGTH];
+    char                            rcPieceQuality[MAX_READ_LENGTH];
+    char                            firstReference[MAX_READ_LENGTH + MAX_K + 2];    // For packed genomes
+    char                            secondReference[MAX_READ_LENGTH + MAX_K + 2];
+};
@@ -15,6 +15,7 @@ const char *PACKED_VALUE_BASE = tables.getPackedValueBase();
 const unsigned *IS_LOWER_CASE = tables.getIsLowerCase();
 extern const char *TO_UPPER_CASE = tables.getToUpperCase();
 const char *PACKED_VALUE_BASE_RC = tables.getPackedValueBaseRC();
+const char *UNPACKED_GENOME_BYTES = tables.getUnpackedGenomeBytes();
 
 
 Tables::Tables()
@@ -67,6 +68,13 @@ Tables::Tables()
     packedBaseValue['C'] = packedBaseValue['c'] = (char) 0x80;
     packedBaseValue['T'] = packedBaseValue['t'] = (char) 0xc0;
     
+    // Packed genomes have four bases per byte, low bits first, using the values from baseValue
+    for (unsigned i = 0; i < 256; i++) {
+        for (unsigned j = 0; j < 4; j++) {
+            unpackedGenomeBytes[i * 4 + j] = valueBase[(i >> (2 * j)) & 3];
+        }
+    }
+
     memset(packedQualityMask, 0, 4);
     memset(packedQualityMask + 4, 0x3f, sizeof(packedQualityMask) - 4);
 
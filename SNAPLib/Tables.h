@@ -26,6 +26,8 @@ class Tables
     char packedValueBase[256];
     char packedValueBaseRC[256];
 
+    char unpackedGenomeBytes[256 * 4];  // The four bases in a byte of a packed genome
+
 public:
     Tables();
 
@@ -39,6 +41,7 @@ public:
     const char* getPackedQualityMask() const { return packedQualityMask; }
     const char* getPackedValueBase() const { return packedValueBase; }
     const char* getPackedValueBaseRC() const { return packedValueBaseRC; }
+    const char *getUnpackedGenomeBytes() const { return unpackedGenomeBytes; }
     const unsigned *getIsLowerCase() const {return isLowerCase; }
     const char *getToUpperCase() const {return toUpperCase; }
 };
@@ -51,6 +54,7 @@ extern const char *PACKED_BASE_VALUE;
 extern const char *PACKED_QUALITY_MASK;
 extern const char *PACKED_VALUE_BASE;
 extern const char *PACKED_VALUE_BASE_RC;
+extern const char *UNPACKED_GENOME_BYTES;
 extern const int  *BASE_VALUE_NO_N;
 extern const unsigned *IS_LOWER_CASE;
 extern const char *TO_UPPER_CASE;
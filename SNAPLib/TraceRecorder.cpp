@@ -0,0 +1,149 @@
+/*++
+
+Module Name:
+
+    TraceRecorder.cpp
+
+Abstract:
+
+    A timeline of what the pipeline's threads were doing, written out as a Chrome trace (-trace).
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#include "stdafx.h"
+#include "TraceRecorder.h"
+
+bool TraceRecorder::Enabled = false;
+
+struct TraceEvent
+{
+    const char     *name;
+    _int64          begin;
+    _int64          end;
+};
+
+struct TraceThread
+{
+    TraceEvent     *events;     // A ring of TraceRecorder::EventsPerThread
+    _int64          nEvents;    // Recorded since start(), including the ones the ring has lost
+    int             id;
+    TraceThread    *next;
+};
+
+//
+// The threads that have recorded anything, which keep their rings after they exit so that write() still has their
+// events.  There's one for each thread the process has had, which isn't many.
+//
+class TraceThreads
+{
+public:
+    TraceThreads() : threads(NULL), nThreads(0), startTicks(0), mergeGapTicks(0)
+    {
+        InitializeExclusiveLock(&lock);
+    }
+
+    ExclusiveLock   lock;
+    TraceThread    *threads;
+    int             nThreads;
+    _int64          startTicks;
+    _int64          mergeGapTicks;
+};
+
+static TraceThreads traceThreads;
+
+static PERF_THREAD_LOCAL TraceThread *currentTraceThread = NULL;
+
+    void
+TraceRecorder::start()
+{
+    AcquireExclusiveLock(&traceThreads.lock);
+    for (TraceThread *thread = traceThreads.threads; NULL != thread; thread = thread->next) {
+        thread->nEvents = 0;
+    }
+    traceThreads.startTicks = PerfTicks();
+    traceThreads.mergeGapTicks = (_int64)(MergeGapMicros * PerfCounters::ticksPerSecond() / 1e6);
+    ReleaseExclusiveLock(&traceThreads.lock);
+
+    Enabled = true;
+}
+
+    void
+TraceRecorder::record(
+    const char *name,
+    _int64 beginTicks,
+    _int64 endTicks)
+{
+    TraceThread *thread = currentTraceThread;
+    if (NULL == thread) {
+        thread = new TraceThread;
+        thread->events = new TraceEvent[EventsPerThread];
+        thread->nEvents = 0;
+
+        AcquireExclusiveLock(&traceThreads.lock);
+        thread->id = traceThreads.nThreads++;
+        thread->next = traceThreads.threads;
+        traceThreads.threads = thread;
+        ReleaseExclusiveLock(&traceThreads.lock);
+
+        currentTraceThread = thread;
+    }
+
+    if (thread->nEvents > 0) {
+        TraceEvent *last = &thread->events[(thread->nEvents - 1) % EventsPerThread];
+        if (last->name == name && beginTicks >= last->end && beginTicks - last->end < traceThreads.mergeGapTicks) {
+            last->end = endTicks;
+            return;
+        }
+    }
+
+    TraceEvent *event = &thread->events[thread->nEvents % EventsPerThread];
+    event->name = name;
+    event->begin = beginTicks;
+    event->end = endTicks;
+    thread->nEvents++;
+}
+
+    bool
+TraceRecorder::write(
+    const char *fileName)
+{
+    Enabled = false;
+
+    FILE *file = fopen(fileName, "w");
+    if (NULL == file) {
+        fprintf(stderr, "Unable to open trace file '%s'\n", fileName);
+        return false;
+    }
+
+    double ticksPerMicro = PerfCounters::ticksPerSecond() / 1e6;
+    bool first = true;
+    fprintf(file, "{\"traceEvents\":[");
+
+    AcquireExclusiveLock(&traceThreads.lock);
+    for (TraceThread *thread = traceThreads.threads; NULL != thread; thread = thread->next) {
+        _int64 nEvents = thread->nEvents;
+        for (_int64 i = __max((_int64)0, nEvents - (_int64)EventsPerThread); i < nEvents; i++) {
+            const TraceEvent *event = &thread->events[i % EventsPerThread];
+            if (event->begin < traceThreads.startTicks) {
+                continue;   // Left from before start() by a thread that's still recording
+            }
+            fprintf(file, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", first ? "" : ",",
+                event->name, thread->id, (event->begin - traceThreads.startTicks) / ticksPerMicro,
+                (event->end - event->begin) / ticksPerMicro);
+            first = false;
+        }
+    }
+    ReleaseExclusiveLock(&traceThreads.lock);
+
+    fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    bool worked = !ferror(file);
+    if (0 != fclose(file) || !worked) {
+        fprintf(stderr, "Error writing trace file '%s'\n", fileName);
+        return false;
+    }
+    return true;
+}
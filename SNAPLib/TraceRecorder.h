@@ -0,0 +1,82 @@
+/*++
+
+Module Name:
+
+    TraceRecorder.h
+
+Abstract:
+
+    A timeline of what the pipeline's threads were doing (reading, decompressing, aligning, compressing, writing and
+    waiting), written out as a Chrome trace (-trace).
+
+Environment:
+
+    User mode service.
+
+--*/
+
+#pragma once
+
+#include "Compat.h"
+#include "PerfCounters.h"
+
+//
+// Each thread that records anything gets a ring of the last EventsPerThread events it recorded, so a long run keeps
+// its most recent stretch.  Recording is a couple of PerfTicks and a store into the calling thread's own ring, with no
+// locking; when Enabled is off it's a test of a bool.  A thread that does the same thing over and over (aligning one
+// batch after another, say) gets one event for the whole run of them, as long as nothing else was recorded on it in
+// between and they follow each other closely, which keeps the rings from filling up with tiny events.
+//
+// write() gives the Chrome trace event format, which chrome://tracing and ui.perfetto.dev load: a complete ("X")
+// event for each one, with times in microseconds since start(), and thread IDs in the order the threads first
+// recorded something.
+//
+class TraceRecorder
+{
+public:
+    static bool Enabled;
+
+    //
+    // Forgets anything recorded so far and starts recording.
+    //
+    static void start();
+
+    //
+    // Stops recording and writes what was recorded.  Threads should be done by then; anything a straggler records
+    // while this runs may or may not make it in.
+    //
+    static bool write(const char *fileName);
+
+    //
+    // name must be a string constant, or otherwise outlive the recorder.
+    //
+    static void record(const char *name, _int64 beginTicks, _int64 endTicks);
+
+    static const unsigned EventsPerThread = 64 * 1024;
+    static const unsigned MergeGapMicros = 20;     // Repeats of the same event closer than this become one
+};
+
+//
+// Records the scope it's in as one event.
+//
+class TraceScope
+{
+public:
+    TraceScope(const char *i_name) : name(TraceRecorder::Enabled ? i_name : NULL)
+    {
+        if (NULL != name) {
+            begin = PerfTicks();
+        }
+    }
+
+    ~TraceScope()
+    {
+        if (NULL != name) {
+            TraceRecorder::record(name, begin, PerfTicks());
+        }
+    }
+
+private:
+    const char *name;
+    _int64      begin;
+};
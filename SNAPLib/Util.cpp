@@ -50,6 +50,25 @@ int cheezyLogBase2(_int64 value)
     return retVal;
 }
 
+    void
+util::Checksum::add(
+    const void* data,
+    size_t bytes)
+{
+    const char* p = (const char*) data;
+    size_t nWords = bytes / 4;
+    for (size_t i = 0; i < nWords; i++) {
+        _uint32 word;
+        memcpy(&word, p + 4 * i, sizeof(word));
+        sum += word;
+        sumOfSums += sum;
+    }
+    for (size_t i = 4 * nWords; i < bytes; i++) {
+        sum += (unsigned char) p[i];
+        sumOfSums += sum;
+    }
+}
+
     void
 util::memrevcpy(
     void* dst,
@@ -3,6 +3,7 @@
 #include "Compat.h"
 #include "BigAlloc.h"
 #include "VariableSizeVector.h"
+#include "exit.h"
 
 //
 // A hash function for numeric types.
@@ -25,12 +26,20 @@ struct VariableSizeMapEntry
     V value;
 };
 
-// 
+//
 // A variable-size hash map that allows automatic growth
 // and does not perform any memory allocation except when growing.
 // Allows multi-threaded put, as long as growth=0 (i.e. fixed-size)
 // Shared base class for single- and multi-valued maps
 //
+// It probes linearly, and erasing shifts the rest of the probe sequence back over the hole instead of leaving a
+// tombstone, so the table never fills up with dead slots and lookups for missing keys stop at the first empty one.
+//
+// Growing doesn't rehash everything at once.  The old table is kept, and each put or erase after that moves a few of
+// its entries into the new one until it's drained; lookups look in both in the meantime.  So no single call pays for
+// rehashing a big map (the duplicate marker's and the paired read matcher's get to millions of entries), at the cost
+// of having both tables around for a while.  Pointers to values are good only until the next put or erase.
+//
 using std::max;
 using std::min;
 template<
@@ -40,13 +49,12 @@ template<
     typename Hash = MapNumericHash<K>,
     int fill = 80,
     int _empty = 0,
-    int _tombstone = -1,
     bool multi = false>
 class VariableSizeMapBase
 {
 protected:
     VariableSizeMapBase(int i_capacity = 16)
-        : entries(NULL), count(0), capacity(i_capacity), occupied(0)
+        : entries(NULL), capacity(i_capacity), count(0), old(NULL), oldCapacity(0), migrated(0)
     {
         reserve(max(16,i_capacity));
     }
@@ -56,32 +64,63 @@ protected:
         capacity(i_capacity),
         count((int) ((_int64*)*data)[0]),
         limit((int) ((_int64*)*data)[1]),
-        occupied((int) ((_int64*)*data)[2])
+        old(NULL), oldCapacity(0), migrated(0)
     {
         *data = ((char*)*data) + (size_t) i_capacity * sizeof(Entry) + 3 * sizeof(_int64);
     }
-    
-    inline void assign(VariableSizeMapBase<K,V>* other)
+
+    inline void assign(VariableSizeMapBase* other)
     {
         if (entries != NULL) {
             delete [] entries;
         }
+        if (old != NULL) {
+            delete [] old;
+        }
         entries = other->entries;
         capacity = other->capacity;
         count = other->count;
         limit = other->limit;
         hash = other->hash;
-        occupied = other->occupied;
+        old = other->old;
+        oldCapacity = other->oldCapacity;
+        migrated = other->migrated;
         other->entries = NULL;
+        other->old = NULL;
         other->count = 0;
     }
 
+    inline void swapWith(VariableSizeMapBase* other)
+    {
+        std::swap(entries, other->entries);
+        std::swap(capacity, other->capacity);
+        std::swap(count, other->count);
+        std::swap(limit, other->limit);
+        std::swap(hash, other->hash);
+        std::swap(old, other->old);
+        std::swap(oldCapacity, other->oldCapacity);
+        std::swap(migrated, other->migrated);
+    }
+
+    //
+    // Start moving everything into a bigger table.
+    //
     inline void grow()
     {
+        if (growth == 0) {
+            fprintf(stderr, "VariableSizeMap overflowed.  Code bug.\n");
+            soft_exit(1);
+        }
         _ASSERT(growth > 100);
+        finishMigration();  // Should already be done, as long as the migration step keeps up with growth and fill
         _int64 larger = ((_int64) capacity * growth) / 100;
         _ASSERT(larger < INT32_MAX);
-        reserve((int) larger);
+        old = entries;
+        oldCapacity = capacity;
+        migrated = 0;
+        capacity = (int) larger;
+        entries = NULL;
+        allocate();
     }
 
 public:
@@ -90,46 +129,51 @@ public:
 
     inline int getCapacity()
     { return capacity; }
-    
+
     ~VariableSizeMapBase()
     {
         if (entries != NULL) {
             delete [] entries;
         }
+        if (old != NULL) {
+            delete [] old;
+        }
         entries = NULL;
+        old = NULL;
         count = 0;
     }
-    
+
+    //
+    // Rehashes into a table of the given size right away, rather than a bit at a time.
+    //
     void reserve(int larger)
     {
-        Entry* old = entries;
+        finishMigration();
+        Entry* previous = entries;
         int small = capacity;
         capacity = larger;
-        entries = new Entry[larger];
-        _ASSERT(entries != NULL);
-        clear();
+        entries = NULL;
+        allocate();
         count = 0;
-        // grow before it gets to a certain fraction; always leave 1 slot for empty sentinel
-        limit = growth == 0 ? capacity - 1 : min(capacity - 1, (int) (((_int64) capacity * fill) / 100));
-        _ASSERT(limit > 0);
-        if (old != NULL) {
+        if (previous != NULL) {
             for (int i = 0; i < small; i++) {
-                K k = old[i].key;
-                if (k != _empty && k != _tombstone) {
-                    Entry* p = this->scan(k, true);
-                    _ASSERT(p != NULL);
-                    p->key = k;
-                    p->value = old[i].value;
+                if (previous[i].key != _empty) {
+                    Entry* p = emptySlot(entries, capacity, previous[i].key);
+                    p->key = previous[i].key;
+                    p->value = previous[i].value;
                     count++;
                 }
             }
-            occupied = count;
-            delete[] old;
+            delete[] previous;
         }
     }
-    
+
     void clear()
     {
+        if (old != NULL) {
+            delete [] old;
+            old = NULL;
+        }
         if (entries != NULL) {
             if (_empty == 0) {
                 // optimize zero case
@@ -141,25 +185,37 @@ public:
                 }
             }
         }
-        count = occupied = 0;
+        count = 0;
     }
-    
+
     typedef VariableSizeMapEntry<K,V> Entry;
 
     typedef Entry* iterator;
 
+    //
+    // Iterates over what's left in the old table (if it's being drained) and then the current one.
+    //
     iterator begin()
     {
-        return next(&entries[-1]);
+        return next(old != NULL ? &old[-1] : &entries[-1]);
     }
 
     iterator next(iterator x)
     {
+        if (old != NULL && x >= &old[-1] && x < &old[oldCapacity]) {
+            do {
+                x++;
+            } while (x < &old[oldCapacity] && x->key == _empty);
+            if (x < &old[oldCapacity]) {
+                return x;
+            }
+            x = &entries[-1];
+        }
         Entry* final = &entries[capacity];
         if (x < final) {
             do {
                 x++;
-            } while (x < final && (x->key == _empty || x->key == _tombstone));
+            } while (x < final && x->key == _empty);
         }
         return x;
     }
@@ -171,115 +227,225 @@ public:
 
     iterator find(K key)
     {
-        Entry* p = this->scan(key, false);
+        Entry* p = this->scan(key);
         return p != NULL ? p : end();
     }
 
     void writeFile(LargeFileHandle* file)
     {
+        finishMigration();
         _int64 x = (_int64) count;
         WriteLargeFile(file, &x, sizeof(_int64));
         x = (_int64) limit;
         WriteLargeFile(file, &x, sizeof(_int64));
-        x = (_int64) occupied;
+        x = (_int64) count; // formerly the count including tombstones, which there aren't any more
         WriteLargeFile(file, &x, sizeof(_int64));
         WriteLargeFile(file, entries, sizeof(Entry) * (size_t) capacity);
     }
-    
+
 protected:
-    
-    static const int MaxQuadraticProbes = 3;
 
-    void init(int& pos, int& i, K key)
+    //
+    // How many slots of the old table each put or erase moves along.  Growing by growth% at fill% full leaves about
+    // (growth - 100) * fill / 100% of the old capacity in puts before the next one, and draining has to look at every
+    // old slot and move every entry, so this is comfortably enough for the default and the fill factors in use.
+    //
+    static const int MigrationStep = 8;
+
+    void allocate()
+    {
+        entries = new Entry[capacity];
+        _ASSERT(entries != NULL);
+        const K e(_empty);
+        for (int i = 0; i < capacity; i++) {
+            entries[i].key = e;
+        }
+        // grow before it gets to a certain fraction; always leave 1 slot for empty sentinel
+        limit = growth == 0 ? capacity - 1 : min(capacity - 1, (int) (((_int64) capacity * fill) / 100));
+        _ASSERT(limit > 0);
+    }
+
+    inline int home(K key, int tableCapacity)
+    {
+        _ASSERT(key != _empty);
+        return (int) (hash(key) % (_uint64) tableCapacity);
+    }
+
+    static inline int advance(int pos, int tableCapacity)
+    {
+        return pos + 1 == tableCapacity ? 0 : pos + 1;
+    }
+
+    //
+    // The entry for key in one table, or NULL.
+    //
+    Entry* scanTable(Entry* table, int tableCapacity, K key)
+    {
+        for (int pos = home(key, tableCapacity); table[pos].key != _empty; pos = advance(pos, tableCapacity)) {
+            if (table[pos].key == key) {
+                return &table[pos];
+            }
+        }
+        return NULL;
+    }
+
+    void ensureAllocated()
     {
-        _ASSERT(key != _empty && key != _tombstone);
-        pos = hash(key) % capacity;
-        i = 1;
         if (entries == NULL) {
-            entries = new Entry[capacity];
-            clear();
+            allocate(); // It's been assigned away and is being used again
         }
     }
 
-    bool advance(int& pos, int& i, K key) const
+    Entry* scan(K key)
     {
-        if (i >= capacity + MaxQuadraticProbes) {
-            pos = capacity;
-            return false;
+        ensureAllocated();
+        Entry* p = scanTable(entries, capacity, key);
+        if (p == NULL && old != NULL) {
+            p = scanTable(old, oldCapacity, key);
         }
-        pos = (pos + (i <= MaxQuadraticProbes ? i : 1)) % capacity;
-        i++;
-        return true;
+        return p;
     }
 
-    Entry* scan(K key, bool add)
+    //
+    // The first empty slot in key's probe sequence.  There's always one, because the tables are never full.
+    //
+    Entry* emptySlot(Entry* table, int tableCapacity, K key)
     {
-        int pos;
-        int i;
-        init(pos, i, key);
-        if (pos == capacity) {
-            return NULL;
+        int pos = home(key, tableCapacity);
+        while (table[pos].key != _empty) {
+            pos = advance(pos, tableCapacity);
         }
-        while (true) {
-            Entry* p = &entries[pos];
-            K k = p->key;
-            if (k == key && ! (multi && add)) {
-                return p;
-            } else if (k == _empty) {
-                return add ? p : NULL;
-            } else if (add && k == _tombstone && ! multi) {
-                return p;
-            } else if (! advance(pos, i, key)) {
-                return NULL;
+        return &table[pos];
+    }
+
+    //
+    // Where a new entry goes, after making room for it.  Nothing moves between this and filling it in.
+    //
+    Entry* slotForNewEntry(K key)
+    {
+        ensureAllocated();
+        if (count >= limit) {
+            grow();
+        }
+        migrateSome();
+        return emptySlot(entries, capacity, key);
+    }
+
+    //
+    // Empties a slot, moving later entries in its probe sequence back so that none of them is left beyond an empty
+    // slot from where it hashes to.
+    //
+    void removeAt(Entry* table, int tableCapacity, int hole)
+    {
+        for (int pos = advance(hole, tableCapacity); table[pos].key != _empty; pos = advance(pos, tableCapacity)) {
+            int h = home(table[pos].key, tableCapacity);
+            bool staysPut = hole <= pos ? (hole < h && h <= pos) : (hole < h || h <= pos);
+            if (! staysPut) {
+                table[hole] = table[pos];
+                hole = pos;
+            }
+        }
+        table[hole].key = K(_empty);
+    }
+
+    void remove(Entry* p)
+    {
+        if (p >= entries && p < &entries[capacity]) {
+            removeAt(entries, capacity, (int) (p - entries));
+        } else {
+            _ASSERT(old != NULL && p >= old && p < &old[oldCapacity]);
+            removeAt(old, oldCapacity, (int) (p - old));
+        }
+        count--;
+    }
+
+    void migrateSome(int slots = MigrationStep)
+    {
+        for (int n = 0; old != NULL && n < slots; n++) {
+            if (migrated == oldCapacity) {
+                delete [] old;
+                old = NULL;
+                return;
+            }
+            Entry* p = &old[migrated];
+            if (p->key == _empty) {
+                migrated++;
+            } else {
+                Entry* q = emptySlot(entries, capacity, p->key);
+                q->key = p->key;
+                q->value = p->value;
+                removeAt(old, oldCapacity, migrated);   // which may move another entry into this slot, so look again
             }
         }
     }
 
+    void finishMigration()
+    {
+        while (old != NULL) {
+            migrateSome(oldCapacity);
+        }
+    }
+
     Entry *entries;
     int capacity;
-    int count;
-    int occupied; // number of non-empty slots (includes tombstones)
+    int count;  // in both tables
     int limit; // current limit (capacity * fill / 100)
     Hash hash;
+
+    Entry *old; // the table being drained into entries after growing, or NULL
+    int oldCapacity;
+    int migrated; // old slots before this one are empty
 };
 
-// 
+//
 // Single-valued map
 //
 template< typename K, typename V, int growth = 150, typename Hash = MapNumericHash<K>,
-    int fill = 80, int _empty = 0, int _tombstone = -1 >
+    int fill = 80, int _empty = 0 >
 class VariableSizeMap
-    : public VariableSizeMapBase<K,V,growth,Hash,fill,_empty,_tombstone,false>
+    : public VariableSizeMapBase<K,V,growth,Hash,fill,_empty,false>
 {
+    typedef VariableSizeMapBase<K,V,growth,Hash,fill,_empty,false> Base;
+
 public:
     VariableSizeMap(int i_capacity = 16)
-        : VariableSizeMapBase<K,V,growth,Hash,fill,_empty,_tombstone,false>(i_capacity)
+        : Base(i_capacity)
     {}
 
-    VariableSizeMap(const VariableSizeMap<K,V>& other)
+    VariableSizeMap(const VariableSizeMap& other)
+        : Base(16)
     {
-        this->assign((VariableSizeMapBase<K,V>*)&other);
+        this->assign((Base*)&other);
     }
 
     VariableSizeMap(void** data, unsigned i_capacity)
-        : VariableSizeMapBase<K,V,growth,Hash,fill,_empty,_tombstone,false>(data, i_capacity)
+        : Base(data, i_capacity)
     {
     }
 
     typedef VariableSizeMapEntry<K,V> Entry;
 
-    inline void operator=(const VariableSizeMap<K,V>& other)
+    inline void operator=(const VariableSizeMap& other)
+    {
+        this->assign((Base*)&other);
+    }
+
+    //
+    // Trades tables with other, so that a map that's emptied and refilled over and over (like the paired read matcher's
+    // unmatched reads for each batch) keeps reusing the same two tables instead of allocating a new one each time.
+    //
+    inline void swap(VariableSizeMap& other)
     {
-        this->assign((VariableSizeMapBase<K,V>*)&other);
+        this->swapWith(&other);
     }
 
     ~VariableSizeMap()
     {}
-    
-    
+
+
     inline bool tryGet(K key, V* o_value)
     {
-        Entry* p = this->scan(key, false);
+        Entry* p = this->scan(key);
         if (p != NULL) {
             *o_value = p->value;
         }
@@ -288,30 +454,30 @@ public:
 
     inline V* tryFind(K key)
     {
-        Entry* p = this->scan(key, false);
+        Entry* p = this->scan(key);
         return p != NULL ? &p->value : NULL;
     }
 
     inline V get(K key)
     {
-        Entry* p = this->scan(key, false);
+        Entry* p = this->scan(key);
         _ASSERT(p != NULL);
         return p->value;
     }
 
     bool erase(K key)
     {
-        Entry* p = this->scan(key, false);
+        this->migrateSome();
+        Entry* p = this->scan(key);
         if (p != NULL) {
-            p->key = K(_tombstone);
-            this->count--;
+            this->remove(p);
         }
         return p != NULL;
     }
-    
+
     inline V& operator[](K key)
     {
-        Entry* p = this->scan(key, false);
+        Entry* p = this->scan(key);
         _ASSERT(p != NULL);
         return p->value;
     }
@@ -335,68 +501,51 @@ public:
 
     inline bool tryAdd(K key, V value, V** o_pvalue)
     {
-        while (true) {
-            Entry* p = this->scan(key, true);
-            if (p == NULL) {
-                this->grow();
-                p = this->scan(key, true);
-                _ASSERT(p != NULL);
-            }
-            K prior = p->key;
-            if (prior == key) {
-                *o_pvalue = &p->value;
-                return false;
-            }
-            if (prior == _empty || prior == _tombstone) {
-                // single-threaded
-                p->key = key;
-                p->value = value;
-                this->count++;
-		        // hack!! to get around gcc bug
-		        int o = this->occupied;
-		        int l = this->limit;
-                bool occupy = prior == _empty;
-                if (o < l || ! occupy) {
-                    this->occupied += occupy;
-                    *o_pvalue = &p->value;
-                } else {
-                    this->grow();
-                    *o_pvalue = &this->scan(key, false)->value; // lookup again after rehashing
-                }
-                return true;
-            }
+        Entry* p = this->scan(key);
+        if (p != NULL) {
+            *o_pvalue = &p->value;
+            return false;
         }
+        // single-threaded
+        p = this->slotForNewEntry(key);
+        p->key = key;
+        p->value = value;
+        this->count++;
+        *o_pvalue = &p->value;
+        return true;
     }
 };
 
 typedef VariableSizeMap<unsigned,unsigned> IdMap;
 typedef VariableSizeMap<unsigned,int> IdIntMap;
-// 
-// Single-valued map
 //
-template< typename K, typename V, int growth = 150, typename Hash = MapNumericHash<K>, int fill = 80, K _empty = K(), K _tombstone = K(-1) >
+// Multi-valued map
+//
+template< typename K, typename V, int growth = 150, typename Hash = MapNumericHash<K>, int fill = 80, K _empty = K() >
 class VariableSizeMultiMap
-    : public VariableSizeMapBase<K,V,growth,Hash,fill,_empty,_tombstone,true>
+    : public VariableSizeMapBase<K,V,growth,Hash,fill,_empty,true>
 {
+    typedef VariableSizeMapBase<K,V,growth,Hash,fill,_empty,true> Base;
+
 public:
     VariableSizeMultiMap(int i_capacity = 16)
-        : VariableSizeMapBase<K,V,growth,Hash,fill,_empty,_tombstone,true>(i_capacity)
+        : Base(i_capacity)
     {}
 
     VariableSizeMultiMap(VariableSizeMultiMap& other)
-        : VariableSizeMapBase<K,V,growth,Hash,fill,_empty,_tombstone,true>(other.capacity)
+        : Base(other.capacity)
     {
         this->assign(&other);
     }
 
     VariableSizeMultiMap(void** data, unsigned i_capacity)
-        : VariableSizeMapBase<K,V,growth,Hash,fill,_empty,_tombstone,true>(data, i_capacity)
+        : Base(data, i_capacity)
     {
     }
 
     typedef VariableSizeMapEntry<K,V> Entry;
 
-    inline void operator=(VariableSizeMultiMap<K,V> other)
+    inline void operator=(VariableSizeMultiMap& other)
     {
         this->assign(&other);
     }
@@ -404,45 +553,44 @@ public:
     ~VariableSizeMultiMap()
     {}
 
+    //
+    // Goes through the entries for one key, in the current table and then in the old one.
+    //
     class valueIterator
     {
     public:
         bool hasValue()
-        { return pos < map->capacity && map->entries[pos].key != _empty; }
+        { return table != NULL; }
 
         Entry* operator*() const
-        { _ASSERT(pos < map->capacity); return &map->entries[pos]; }
-        
+        { _ASSERT(table != NULL); return &table[pos]; }
+
         Entry* operator->() const
-        { _ASSERT(pos < map->capacity); return &map->entries[pos]; }
-        
+        { _ASSERT(table != NULL); return &table[pos]; }
+
         void next()
         {
             if (hasValue()) {
-                K k;
-                do {
-                    if (! map->advance(pos, i, key)) {
-                        pos = map->capacity;
-                        return;
-                    }
-                } while ((k = map->entries[pos].key) != key && k != _empty);
+                pos = map->advance(pos, tableCapacity);
+                skipToMatch();
             }
         }
 
         valueIterator()
-            : map(NULL), pos(0), i(0), key()
+            : map(NULL), table(NULL), tableCapacity(0), pos(0), key()
         {
         }
 
         valueIterator(const valueIterator& other)
-            : map(other.map), pos(other.pos), i(other.i), key(other.key)
+            : map(other.map), table(other.table), tableCapacity(other.tableCapacity), pos(other.pos), key(other.key)
         {}
 
         void operator= (const valueIterator& other)
         {
             map = other.map;
+            table = other.table;
+            tableCapacity = other.tableCapacity;
             pos = other.pos;
-            i = other.i;
             key = other.key;
         }
 
@@ -450,23 +598,45 @@ public:
         valueIterator(VariableSizeMultiMap* i_map, K i_key)
             : map(i_map), key(i_key)
         {
-            map->init(pos, i, key);
-            K k = map->entries[pos].key;
-            if (k != key && k != _empty) {
-                next(); // skip tombstones & other keys
+            map->ensureAllocated();
+            table = map->entries;
+            tableCapacity = map->capacity;
+            pos = map->home(key, tableCapacity);
+            skipToMatch();
+        }
+
+        void skipToMatch()
+        {
+            while (true) {
+                K k = table[pos].key;
+                if (k == key) {
+                    return;
+                }
+                if (k == _empty) {
+                    if (table == map->entries && map->old != NULL) {
+                        table = map->old;
+                        tableCapacity = map->oldCapacity;
+                        pos = map->home(key, tableCapacity);
+                        continue;
+                    }
+                    table = NULL;
+                    return;
+                }
+                pos = map->advance(pos, tableCapacity);
             }
         }
 
         friend class VariableSizeMultiMap;
 
         VariableSizeMultiMap* map;
+        Entry* table;
+        int tableCapacity;
         int pos;
-        int i;
         K key;
     };
 
     friend class valueIterator;
-    
+
     inline valueIterator getAll(K key)
     {
         return valueIterator(this, key);
@@ -474,7 +644,7 @@ public:
 
     inline bool hasKey(K key)
     {
-        return getAll(key).hasValue(); // todo: optimize
+        return getAll(key).hasValue();
     }
 
     inline bool contains(K key, V value)
@@ -490,17 +660,7 @@ public:
     // always add even if value exists for key
     inline void add(K key, V value)
     {
-        if (this->occupied >= this->limit) {
-            this->grow();
-        }
-        Entry* p = this->scan(key, true);
-        if (p == NULL) {
-            // full of tombstones
-            this->grow();
-            p = this->scan(key, true);
-            _ASSERT(p != NULL);
-        }
-        this->occupied += p->key == _empty;
+        Entry* p = this->slotForNewEntry(key);
         p->key = key;
         p->value = value;
         this->count++;
@@ -509,78 +669,37 @@ public:
     // if key-value exists, return false; else add & return true
     inline bool put(K key, V value)
     {
-        int pos; int i;
-        init(pos, i, key);
-        if (pos == this->capacity) {
-            add(key, value);
-            return true;
-        }
-        Entry* slot = NULL;
-        while (pos != this->capacity) {
-            Entry* p = &this->entries[pos];
-            if (p->key == key) {
-                if (p->value == value) {
-                    return false;
-                }
-                // keep looking...
-            } else if (p->key == _tombstone) {
-                if (slot == NULL) {
-                    slot = p; // remember in case we don't find a match
-                }
-                // keep looking...
-            } else if (p->key == _empty) {
-                if (slot == NULL) {
-                    slot = p;
-                }
-                break; // got to end with no match
-            }
-            if (! this->advance(pos, i, key)) {
-                break;
-            }
-        }
-        if (slot != NULL) {
-            _ASSERT(slot->key == _empty || slot->key == _tombstone);
-	        // hack!! to get around gcc bug
-	        int o = this->occupied;
-	        int l = this->limit;
-            bool occupy = slot->key == _empty;
-            if (o < l || ! occupy) {
-                slot->key = key;
-                slot->value = value;
-                this->count++;
-                this->occupied += occupy;
-            } else {
-                this->grow();
-                return this->put(key, value);
-            }
-        } else {
-            this->add(key, value);
+        if (contains(key, value)) {
+            return false;
         }
-        _ASSERT(this->contains(key, value));
+        add(key, value);
         return true;
     }
 
     inline bool erase(K key, V value)
     {
+        this->migrateSome();
         for (valueIterator i = getAll(key); i.hasValue(); i.next()) {
             if (i->value == value) {
-                i->key = _tombstone;
-                this->count--;
+                this->remove(*i);
                 return true;
             }
         }
         return false;
     }
-    
+
     inline int eraseAll(K key)
     {
+        this->migrateSome();
         int n = 0;
-        for (valueIterator i = getAll(key); i.hasValue(); i.next()) {
-            i->key = _tombstone;
-            this->count--;
+        while (true) {
+            valueIterator i = getAll(key);  // start over each time, since removing moves things around
+            if (! i.hasValue()) {
+                return n;
+            }
+            this->remove(*i);
             n++;
         }
-        return n;
     }
 
     // whether a's values are a subset of b's values
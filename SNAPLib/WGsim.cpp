@@ -31,14 +31,14 @@ using namespace std;
 // Is a wgsim-generated read mapped to a given location misaligned, given the source
 // location encoded into its ID and a maximum edit distance maxK?
 // Also optionally outputs the low and high location encoded in the wgsim read's ID.
-bool wgsimReadMisaligned(Read *read, unsigned location, GenomeIndex *index, int maxK,
-                         unsigned *lowOut, unsigned *highOut)
+bool wgsimReadMisaligned(Read *read, GenomeLocation location, GenomeIndex *index, int maxK,
+                         GenomeLocation *lowOut, GenomeLocation *highOut)
 {
     return wgsimReadMisaligned(read, location, index->getGenome(), maxK, lowOut, highOut);
 }
 
-bool wgsimReadMisaligned(Read *read, unsigned genomeLocation, const Genome *genome, int maxK,
-                         unsigned *lowOut, unsigned *highOut)
+bool wgsimReadMisaligned(Read *read, GenomeLocation genomeLocation, const Genome *genome, int maxK,
+                         GenomeLocation *lowOut, GenomeLocation *highOut)
 {
     //
     // The read ID for wgsim-generated reads is of the format:
@@ -136,17 +136,17 @@ bool wgsimReadMisaligned(Read *read, unsigned genomeLocation, const Genome *geno
     memcpy(contigName, id, contigNameLen);
     contigName[contigNameLen] = '\0';
 
-    unsigned offsetOfContig;
+    GenomeLocation offsetOfContig;
     if (!genome->getOffsetOfContig(contigName,&offsetOfContig)) {
         fprintf(stderr, "Couldn't find contig name '%s' in the genome.\n",contigName);
         return false;
     }
 
-    offset1 = offset1 + offsetOfContig - 1;  // It's one-based and the Aligner is zero-based
-    offset2 = offset2 + offsetOfContig - 1;  // It's one-based and the Aligner is zero-based
+    GenomeLocation location1 = offsetOfContig + offset1 - 1;  // It's one-based and the Aligner is zero-based
+    GenomeLocation location2 = offsetOfContig + offset2 - 1;  // It's one-based and the Aligner is zero-based
     
-    unsigned high = max(offset1, offset2);
-    unsigned low = min(offset1, offset2);
+    GenomeLocation high = max(location1, location2);
+    GenomeLocation low = min(location1, location2);
     if (lowOut != NULL)
         *lowOut = low;
     if (highOut != NULL)
@@ -164,11 +164,11 @@ void wgsimGenerateIDString(const Genome::Contig *contig, unsigned offsetInContig
             offsetInContig + readLength, firstHalf ? 1 : 2);
 }
 
-void wgsimGenerateIDString(const Genome *genome, unsigned genomeLocation,
+void wgsimGenerateIDString(const Genome *genome, GenomeLocation genomeLocation,
                            unsigned readLength, bool firstHalf, char *outputBuffer)
 {
     const Genome::Contig *contig = genome->getContigAtLocation(genomeLocation);
 
-    wgsimGenerateIDString(contig, genomeLocation - contig->beginningOffset,
+    wgsimGenerateIDString(contig, (unsigned)(genomeLocation - contig->beginningOffset),
                           readLength, firstHalf, outputBuffer);
 }
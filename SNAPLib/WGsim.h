@@ -31,11 +31,11 @@ Revision History:
 // location encoded into its ID and a maximum edit distance maxK?
 // Also optionally outputs the low and high location encoded in the wgsim read's ID.
 
-bool wgsimReadMisaligned(Read *read, unsigned location, const Genome* genome, int maxK,
-                         unsigned *lowOut = NULL, unsigned *highOut = NULL);
+bool wgsimReadMisaligned(Read *read, GenomeLocation location, const Genome* genome, int maxK,
+                         GenomeLocation *lowOut = NULL, GenomeLocation *highOut = NULL);
 
-bool wgsimReadMisaligned(Read *read, unsigned location, GenomeIndex *index, int maxK,
-                         unsigned *lowOut = NULL, unsigned *highOut = NULL);
+bool wgsimReadMisaligned(Read *read, GenomeLocation location, GenomeIndex *index, int maxK,
+                         GenomeLocation *lowOut = NULL, GenomeLocation *highOut = NULL);
 
 
 // Write a wgsim-style id string.
@@ -43,5 +43,5 @@ bool wgsimReadMisaligned(Read *read, unsigned location, GenomeIndex *index, int
 // <http://www.biostars.org/post/show/6373/what-are-the-advantagesdisadvantages-of-one-based-vs-zero-based-genome-coordinate-systems/>
 void wgsimGenerateIDString(const Genome::Contig *contig, unsigned offsetInContig,
                            unsigned readLength, bool firstHalf, char *outputBuffer);
-void wgsimGenerateIDString(const Genome *genome, unsigned genomeLocation,
+void wgsimGenerateIDString(const Genome *genome, GenomeLocation genomeLocation,
                            unsigned readLength, bool firstHalf, char *outputBuffer);
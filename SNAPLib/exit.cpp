@@ -24,8 +24,20 @@ Revision History:
 #include "stdafx.h"
 #include "exit.h"
 
+static bool softExitThrows = false;
+
+void SetSoftExitThrows(bool throws)
+{
+    softExitThrows = throws;
+}
+
 void soft_exit_function(int n, const char *fileName, int lineNum)
 {
+    if (softExitThrows) {
+        SoftExitException e;
+        e.exitCode = n;
+        throw e;
+    }
     fprintf(stderr,"SNAP exited with exit code %d from line %d of file %s\n", n, lineNum, fileName);
     exit(n);
 }
@@ -26,3 +26,14 @@ Revision History:
 #define soft_exit(n) soft_exit_function(n, __FILE__, __LINE__)
 
 void soft_exit_function(int n, const char *fileName, int lineNum);
+
+//
+// While SetSoftExitThrows(true) is in effect, soft_exit throws a SoftExitException instead of exiting, so that a
+// long-lived process (the daemon) can reject a bad command without losing what it has loaded.  Only use it around
+// code running on the calling thread alone, such as parsing options; it's process wide.
+//
+struct SoftExitException {
+    int exitCode;
+};
+
+void SetSoftExitThrows(bool throws);
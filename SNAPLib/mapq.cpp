@@ -28,6 +28,7 @@ Revision History:
 const int maxMAPQ = 70;
 
 static double mapqToProbabilityTable[maxMAPQ+1];
+static double mapqToErrorProbabilityTable[maxMAPQ+1];     // 10^(-mapq/10), the most error a read can have and still get mapq
 
 void initializeMapqTables()
 {
@@ -36,6 +37,10 @@ void initializeMapqTables()
         mapqToProbabilityTable[i] = 1- pow(10.0,((double)i) / -10.0);
     }
 
+    for (int i = 0; i <= maxMAPQ; i++) {
+        mapqToErrorProbabilityTable[i] = pow(10.0,((double)i) / -10.0);
+    }
+
 }
 
 double mapqToProbability(int mapq)
@@ -43,3 +48,29 @@ double mapqToProbability(int mapq)
     _ASSERT(mapq >= 0 && mapq <= maxMAPQ);
     return mapqToProbabilityTable[mapq];
 }
+
+double mapqToErrorProbability(int mapq)
+{
+    _ASSERT(mapq >= 0 && mapq <= maxMAPQ);
+    return mapqToErrorProbabilityTable[mapq];
+}
+
+int errorProbabilityToMAPQ(double errorProbability)
+{
+    //
+    // This is (int)(-10 * log10(errorProbability)) capped at maxMAPQ, but done as a binary search for the largest
+    // MAPQ whose error probability is at least this one, so that we don't need a log for every read.  The two can
+    // only disagree when errorProbability is within rounding of one of the table's entries, and then by one.
+    //
+    int low = 0;            // mapqToErrorProbabilityTable[low] >= errorProbability
+    int high = maxMAPQ + 1; // and everything from high on is less
+    while (high - low > 1) {
+        int probe = (low + high) / 2;
+        if (mapqToErrorProbabilityTable[probe] >= errorProbability) {
+            low = probe;
+        } else {
+            high = probe;
+        }
+    }
+    return low;
+}
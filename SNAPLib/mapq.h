@@ -29,6 +29,16 @@ void initializeMapqTables();
 
 double mapqToProbability(int mapq); // The probability of a match for the given MAPQ
 
+double mapqToErrorProbability(int mapq);    // 10^(-mapq/10)
+
+int errorProbabilityToMAPQ(double errorProbability);  // -10 * log10(errorProbability), truncated and capped at 70
+
+//
+// A read that used up its LV budget (-lvBudget) before the search finished gets its best hit so far, with its MAPQ divided
+// by this, since whatever it didn't score might have beaten it.
+//
+const int OverLVBudgetMapqDivisor = 3;
+
 inline int computeMAPQ(
     double probabilityOfAllCandidates,
     double probabilityOfBestCandidate,
@@ -51,7 +61,7 @@ inline int computeMAPQ(
     if (correctnessProbability >= 1) {
         baseMAPQ =  70;
     } else {
-        baseMAPQ = __min(70, (int)(-10 * log10(1 - correctnessProbability)));
+        baseMAPQ = errorProbabilityToMAPQ(1 - correctnessProbability);
     }
 
     //
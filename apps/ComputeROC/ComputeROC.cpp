@@ -29,22 +29,25 @@ Revision History:
 #include "Read.h"
 #include "RangeSplitter.h"
 #include "BigAlloc.h"
+#include "ParallelTask.h"
+#include "AlignerOptions.h"
+#include "Util.h"
 
 void usage()
 {
-    fprintf(stderr,"usage: ComputeROC genomeDirectory inputFile {-b}\n");
+    fprintf(stderr,"usage: ComputeROC genomeDirectory inputFile {-b} {-t threads}\n");
+    fprintf(stderr,"       The input is SAM, BAM or CRAM, sorted or not.  Only the genome's contig table is loaded, unless -e or -70\n");
+    fprintf(stderr,"       needs its bases (or the input is CRAM).\n");
     fprintf(stderr,"       -b means to accept reads that match either end of the range regardless of RC\n");
     fprintf(stderr,"       -c means to just count the number of reads that are aligned, not to worry about correctness\n");
     fprintf(stderr,"       -v means to correct for the error in generating the wgsim coordinates in the Venter data\n");
     fprintf(stderr,"       -e means to print out misaligned reads where the aligned location has a lower edit distance than the 'correct' one.\n");
     fprintf(stderr,"       -70 means to print out any misaligned reads with MAPQ 70.\n");
+    fprintf(stderr,"       -t sets the number of threads, which is the number of processors by default.\n");
     fprintf(stderr,"You can specify only one of -b or -c\n");
   	exit(1);
 }
 
-ReadSupplierGenerator *readSupplierGenerator;
-volatile _int64 nRunningThreads;
-SingleWaiterObject allThreadsDone;
 const char *inputFileName;
 const Genome *genome;
 bool matchBothWays = false;
@@ -56,8 +59,13 @@ bool printErrorsAtMAPQ70 = false;
 
 static const int MaxMAPQ = 70;
 const unsigned MaxEditDistance = 100;
-struct ThreadContext {
-    unsigned    whichThread;
+
+//
+// Run by ParallelTask: each thread takes reads from its own supplier until the input runs out, and finishThread adds
+// its counts into the common context.
+//
+struct ROCContext : public TaskContextBase {
+    ReadSupplierGenerator *readSupplierGenerator;
 
     _int64 countOfReads[MaxMAPQ+1];
     _int64 countOfMisalignments[MaxMAPQ+1];
@@ -65,253 +73,262 @@ struct ThreadContext {
     _int64 nUnaligned;
     _int64 totalReads;
 
-    _int64 countOfReadsByEditDistance[MaxMAPQ+1][MaxEditDistance+1];
-    _int64 countOfMisalignmentsByEditDistance[MaxMAPQ+1][MaxEditDistance+1];
-    _int64 countOfMisalignetsWithBetterEditDistanceByEditDistance[MaxMAPQ+1][MaxEditDistance+1];
- 
-
-    ThreadContext() {
+    ROCContext() {
+        readSupplierGenerator = NULL;
         nUnaligned = 0;
         totalReads = 0;
         for (int i = 0; i <= MaxMAPQ; i++) {
             countOfReads[i] = countOfMisalignments[i] = countOfMisalignetsWithBetterEditDistance[i] = 0;
-            for (int j = 0; j <= MaxEditDistance; j++) {
-                countOfReadsByEditDistance[i][j] = 0;
-                countOfMisalignmentsByEditDistance[i][j] = 0;
-                countOfMisalignetsWithBetterEditDistanceByEditDistance[i][j] = 0;
-            }
         }
     }
 
+    void initializeThread() {}
+
+    void runThread();
+
+    void finishThread(ROCContext *common) {
+        common->nUnaligned += nUnaligned;
+        common->totalReads += totalReads;
+        for (int i = 0; i <= MaxMAPQ; i++) {
+            common->countOfReads[i] += countOfReads[i];
+            common->countOfMisalignments[i] += countOfMisalignments[i];
+            common->countOfMisalignetsWithBetterEditDistance[i] += countOfMisalignetsWithBetterEditDistance[i];
+        }
+    }
+
+private:
+    void evaluateRead(Read *read, LandauVishkinWithCigar *lv);
 };
 
 bool inline isADigit(char x) {
     return x >= '0' && x <= '9';
 }
 
-void
-WorkerThreadMain(void *param)
+    void
+ROCContext::runThread()
 {
-    ThreadContext *context = (ThreadContext *)param;
-
     ReadSupplier *readSupplier = readSupplierGenerator->generateNewReadSupplier();
 
     Read *read;
     LandauVishkinWithCigar lv;
     while (NULL != (read = readSupplier->getNextRead())) {
-        unsigned mapQ = read->getOriginalMAPQ();
-        unsigned genomeLocation = read->getOriginalAlignedLocation();
-        unsigned flag = read->getOriginalSAMFlags();
-
-        if (mapQ < 0 || mapQ > MaxMAPQ) {
-            fprintf(stderr,"Invalid MAPQ: %d\n",mapQ);
-            exit(1);
-        }
+        evaluateRead(read, &lv);
+    } // for each read from the sam reader
 
-        context->totalReads++;
+    delete readSupplier;
+}
 
-        if (0xffffffff == genomeLocation) {
-            context->nUnaligned++;
-        } else if (justCount) {
-            context->countOfReads[mapQ]++;
-	    } else if (!justCount) {
-            if (flag & SAM_REVERSE_COMPLEMENT) {
-                read->becomeRC();
-            }
-                            
-            const Genome::Contig *contig = genome->getContigAtLocation(genomeLocation);
-            if (NULL == contig) {
-                fprintf(stderr,"couldn't find genome contig for offset %u\n",genomeLocation);
-                exit(1);
-            }
-            unsigned offsetA, offsetB;
-            bool matched;
+    void
+ROCContext::evaluateRead(Read *read, LandauVishkinWithCigar *lv)
+{
+    unsigned mapQ = read->getOriginalMAPQ();
+    GenomeLocation genomeLocation = read->getOriginalAlignedLocation();
+    unsigned flag = read->getOriginalSAMFlags();
 
-            const unsigned cigarBufLen = 1000;
-            char cigarForAligned[cigarBufLen];
-            const char *alignedGenomeData = genome->getSubstring(genomeLocation, 1); 
-            int editDistance = lv.computeEditDistance(alignedGenomeData, read->getDataLength() + 20, read->getData(), read->getDataLength(), 30, cigarForAligned, cigarBufLen, false);
+    if (mapQ < 0 || mapQ > MaxMAPQ) {
+        fprintf(stderr,"Invalid MAPQ: %d\n",mapQ);
+        exit(1);
+    }
 
-            if (editDistance == -1 || editDistance > MaxEditDistance) {
-                editDistance = MaxEditDistance;
-            }
+    totalReads++;
 
+    if (InvalidGenomeLocation == genomeLocation) {
+        nUnaligned++;
+    } else if (justCount) {
+        countOfReads[mapQ]++;
+    } else {
+        if (flag & SAM_REVERSE_COMPLEMENT) {
+            read->becomeRC();
+        }
+                        
+        const Genome::Contig *contig = genome->getContigAtLocation(genomeLocation);
+        if (NULL == contig) {
+            fprintf(stderr,"couldn't find genome contig for offset %lld\n",(_int64)genomeLocation);
+            exit(1);
+        }
+        unsigned offsetA, offsetB;
+        bool matched;
+
+        const unsigned cigarBufLen = 1000;
+
+        //
+        // Parse the read ID.  The format is ChrName_OffsetA_OffsetB_?:<more stuff>.  This would be simple to parse, except that
+        // ChrName can include "_".  So, we parse it by looking for the first : and then working backward.
+        //
+        char idBuffer[10000];   // Hopefully big enough.  I'm not worried about malicious input data here.
+
+        memcpy(idBuffer,read->getId(),read->getIdLength());
+        idBuffer[read->getIdLength()] = 0;
+                
+        const char *firstColon = strchr(idBuffer,':');
+        bool badParse = true;
+        size_t chrNameLen;
+        const char *beginningOfSecondNumber;
+        const char *beginningOfFirstNumber; int stage = 0;
+        GenomeLocation offsetOfCorrectChromosome;
+ 
+        if (NULL != firstColon && firstColon - 3 > idBuffer && (*(firstColon-1) == '?' || isADigit(*(firstColon - 1)))) {
             //
-            // Parse the read ID.  The format is ChrName_OffsetA_OffsetB_?:<more stuff>.  This would be simple to parse, except that
-            // ChrName can include "_".  So, we parse it by looking for the first : and then working backward.
+            // We've parsed backwards to see that we have at least #: or ?: where '#' is a digit and ? is literal.  If it's
+            // a digit, then scan backwards through that number.
             //
-            char idBuffer[10000];   // Hopefully big enough.  I'm not worried about malicious input data here.
-
-            memcpy(idBuffer,read->getId(),read->getIdLength());
-            idBuffer[read->getIdLength()] = 0;
-                    
-            const char *firstColon = strchr(idBuffer,':');
-            bool badParse = true;
-            size_t chrNameLen;
-            const char *beginningOfSecondNumber;
-            const char *beginningOfFirstNumber; int stage = 0;
-            unsigned offsetOfCorrectChromosome;
- 
-            if (NULL != firstColon && firstColon - 3 > idBuffer && (*(firstColon-1) == '?' || isADigit(*(firstColon - 1)))) {
-                //
-                // We've parsed backwards to see that we have at least #: or ?: where '#' is a digit and ? is literal.  If it's
-                // a digit, then scan backwards through that number.
-                //
-                const char *underscoreBeforeFirstColon = firstColon - 2;
-                while (underscoreBeforeFirstColon > idBuffer && isADigit(*underscoreBeforeFirstColon)) {
-                    underscoreBeforeFirstColon--;
-                }
+            const char *underscoreBeforeFirstColon = firstColon - 2;
+            while (underscoreBeforeFirstColon > idBuffer && isADigit(*underscoreBeforeFirstColon)) {
+                underscoreBeforeFirstColon--;
+            }
 
-                if (*underscoreBeforeFirstColon == '_' && (isADigit(*(underscoreBeforeFirstColon - 1)) || *(underscoreBeforeFirstColon - 1) == '_')) {
-                    stage = 1;
-                    if (isADigit(*(underscoreBeforeFirstColon - 1))) {
-                        beginningOfSecondNumber = firstColon - 3;
-                        while (beginningOfSecondNumber > idBuffer && isADigit(*beginningOfSecondNumber)) {
-                            beginningOfSecondNumber--;
-                        }
-                        beginningOfSecondNumber++; // That loop actually moved us back one char before the beginning;
-                    } else {
-                        //
-                        // There's only one number,  we have two consecutive underscores.
-                        //
-                        beginningOfSecondNumber = underscoreBeforeFirstColon;
+            if (*underscoreBeforeFirstColon == '_' && (isADigit(*(underscoreBeforeFirstColon - 1)) || *(underscoreBeforeFirstColon - 1) == '_')) {
+                stage = 1;
+                if (isADigit(*(underscoreBeforeFirstColon - 1))) {
+                    beginningOfSecondNumber = firstColon - 3;
+                    while (beginningOfSecondNumber > idBuffer && isADigit(*beginningOfSecondNumber)) {
+                        beginningOfSecondNumber--;
                     }
-                    if (beginningOfSecondNumber - 2 > idBuffer && *(beginningOfSecondNumber - 1) == '_' && isADigit(*(beginningOfSecondNumber - 2))) {
-                        stage = 2;
-                        beginningOfFirstNumber = beginningOfSecondNumber - 2;
-                        while (beginningOfFirstNumber > idBuffer && isADigit(*beginningOfFirstNumber)) {
-                            beginningOfFirstNumber--;
-                        }
-                        beginningOfFirstNumber++; // Again, we went one too far.
+                    beginningOfSecondNumber++; // That loop actually moved us back one char before the beginning;
+                } else {
+                    //
+                    // There's only one number,  we have two consecutive underscores.
+                    //
+                    beginningOfSecondNumber = underscoreBeforeFirstColon;
+                }
+                if (beginningOfSecondNumber - 2 > idBuffer && *(beginningOfSecondNumber - 1) == '_' && isADigit(*(beginningOfSecondNumber - 2))) {
+                    stage = 2;
+                    beginningOfFirstNumber = beginningOfSecondNumber - 2;
+                    while (beginningOfFirstNumber > idBuffer && isADigit(*beginningOfFirstNumber)) {
+                        beginningOfFirstNumber--;
+                    }
+                    beginningOfFirstNumber++; // Again, we went one too far.
 
-                        offsetA = -1;
-                        offsetB = -1;
+                    offsetA = -1;
+                    offsetB = -1;
 
-                        if (*(beginningOfFirstNumber - 1) == '_' && 1 == sscanf(beginningOfFirstNumber,"%u",&offsetA) &&
-                            ('_' == *beginningOfSecondNumber || 1 == sscanf(beginningOfSecondNumber,"%u", &offsetB))) {
-                                stage = 3;
+                    if (*(beginningOfFirstNumber - 1) == '_' && 1 == sscanf(beginningOfFirstNumber,"%u",&offsetA) &&
+                        ('_' == *beginningOfSecondNumber || 1 == sscanf(beginningOfSecondNumber,"%u", &offsetB))) {
+                            stage = 3;
 
-                            chrNameLen = (beginningOfFirstNumber - 1) - idBuffer;
-                            char correctChromosomeName[1000];
-                            memcpy(correctChromosomeName, idBuffer, chrNameLen);
-                            correctChromosomeName[chrNameLen] = '\0';
+                        chrNameLen = (beginningOfFirstNumber - 1) - idBuffer;
+                        char correctChromosomeName[1000];
+                        memcpy(correctChromosomeName, idBuffer, chrNameLen);
+                        correctChromosomeName[chrNameLen] = '\0';
 
-                            if (venter && offsetB >= read->getDataLength()) {
-                                offsetB -= read->getDataLength();
-                            }
+                        if (venter && offsetB >= read->getDataLength()) {
+                            offsetB -= read->getDataLength();
+                        }
 
-                            if (!genome->getOffsetOfContig(correctChromosomeName, &offsetOfCorrectChromosome)) {
-                                fprintf(stderr, "Couldn't parse chromosome name '%s' from read id\n", correctChromosomeName);
-                            } else {
-                                badParse = false;
-                            }
+                        if (!genome->getOffsetOfContig(correctChromosomeName, &offsetOfCorrectChromosome)) {
+                            fprintf(stderr, "Couldn't parse chromosome name '%s' from read id\n", correctChromosomeName);
+                        } else {
+                            badParse = false;
                         }
                     }
                 }
+            }
 
-                if (badParse) {
-                    fprintf(stderr,"Unable to parse read ID '%s', perhaps this isn't simulated data.  contiglen = %d, contigName = '%s', contig offset = %u, genome offset = %u\n", idBuffer, strlen(contig->name), contig->name, contig->beginningOffset, genomeLocation);
-                    exit(1);
-                }
+            if (badParse) {
+                fprintf(stderr,"Unable to parse read ID '%s', perhaps this isn't simulated data.  contiglen = %d, contigName = '%s', contig offset = %lld, genome offset = %lld\n", idBuffer, strlen(contig->name), contig->name, (_int64)contig->beginningOffset, (_int64)genomeLocation);
+                exit(1);
+            }
 
  
-                bool match0 = false;
-                bool match1 = false;
-                if (-1 == offsetA || -1 == offsetB) {
-                    matched = false;
-                }  else if(strncmp(contig->name, idBuffer, __min(read->getIdLength(), chrNameLen))) {
-                    matched = false;
+            bool match0 = false;
+            bool match1 = false;
+            if (-1 == offsetA || -1 == offsetB) {
+                matched = false;
+            }  else if(strncmp(contig->name, idBuffer, __min(read->getIdLength(), chrNameLen))) {
+                matched = false;
+            } else {
+                if (isWithin(offsetA, genomeLocation - contig->beginningOffset, slackAmount)) {
+                    matched = true;
+                    match0 = true;
+                } else if (isWithin(offsetB, genomeLocation - contig->beginningOffset, slackAmount)) {
+                    matched = true;
+                    match1 = true;
                 } else {
-                    if (isWithin(offsetA, genomeLocation - contig->beginningOffset, slackAmount)) {
-                        matched = true;
+                    matched = false;
+                    if (flag & SAM_FIRST_SEGMENT) {
                         match0 = true;
-                    } else if (isWithin(offsetB, genomeLocation - contig->beginningOffset, slackAmount)) {
-                        matched = true;
-                        match1 = true;
                     } else {
-                        matched = false;
-                        if (flag & SAM_FIRST_SEGMENT) {
-                            match0 = true;
-                        } else {
-                            match1 = true;
-                        }
+                        match1 = true;
                     }
                 }
+            }
 
-                context->countOfReads[mapQ]++;
-                context->countOfReadsByEditDistance[mapQ][editDistance]++;
+            countOfReads[mapQ]++;
 
-                if (!matched) {
-                    context->countOfMisalignments[mapQ]++;
-                    context->countOfMisalignmentsByEditDistance[mapQ][editDistance]++;
+            if (!matched) {
+                countOfMisalignments[mapQ]++;
 
-                    if ((70 == mapQ && printErrorsAtMAPQ70) || printBetterErrors) {
+                if ((70 == mapQ && printErrorsAtMAPQ70) || printBetterErrors) {
+                    //
+                    // Only these need the genome's bases, so this is the only place that looks at them.
+                    //
+                    char cigarForAligned[cigarBufLen];
+                    const char *alignedGenomeData = genome->getSubstring(genomeLocation, 1);
+                    int editDistance = lv->computeEditDistance(alignedGenomeData, read->getDataLength() + 20, read->getData(), read->getDataLength(), 30, cigarForAligned, cigarBufLen, false);
 
-                        //
-                        // We don't know which offset is correct, because neither one matched.  Just take the one with the lower edit distance.
-                        //
-                        unsigned correctLocationA = offsetOfCorrectChromosome + offsetA;
-                        unsigned correctLocationB = offsetOfCorrectChromosome + offsetB;
+                    if (editDistance == -1 || editDistance > MaxEditDistance) {
+                        editDistance = MaxEditDistance;
+                    }
 
-                        unsigned correctLocation = 0;
-                        const char *correctData = NULL;
+                    //
+                    // We don't know which offset is correct, because neither one matched.  Just take the one with the lower edit distance.
+                    //
+                    GenomeLocation correctLocationA = offsetOfCorrectChromosome + offsetA;
+                    GenomeLocation correctLocationB = offsetOfCorrectChromosome + offsetB;
 
-                        const char *dataA = genome->getSubstring(correctLocationA, 1);
-                        const char *dataB = genome->getSubstring(correctLocationB, 1);
-                        int distanceA, distanceB;
-                        char cigarA[cigarBufLen];
-                        char cigarB[cigarBufLen];
+                    GenomeLocation correctLocation = 0;
+                    const char *correctData = NULL;
 
-                        cigarA[0] = '*'; cigarA[1] = '\0';
-                        cigarB[0] = '*'; cigarB[1] = '\0';
+                    const char *dataA = genome->getSubstring(correctLocationA, 1);
+                    const char *dataB = genome->getSubstring(correctLocationB, 1);
+                    int distanceA, distanceB;
+                    char cigarA[cigarBufLen];
+                    char cigarB[cigarBufLen];
 
-                        if (dataA == NULL) {
-                            distanceA = -1;
-                        } else {
-                            distanceA = lv.computeEditDistance(dataA, read->getDataLength() + 20, read->getData(), read->getDataLength(), 30, cigarA, cigarBufLen, false);
-                        }
+                    cigarA[0] = '*'; cigarA[1] = '\0';
+                    cigarB[0] = '*'; cigarB[1] = '\0';
 
-                        if (dataB == NULL) {
-                            distanceB = -1;
-                        } else {
-                            distanceB = lv.computeEditDistance(dataB, read->getDataLength() + 20, read->getData(), read->getDataLength(), 30, cigarB, cigarBufLen, false);
-                        }
+                    if (dataA == NULL) {
+                        distanceA = -1;
+                    } else {
+                        distanceA = lv->computeEditDistance(dataA, read->getDataLength() + 20, read->getData(), read->getDataLength(), 30, cigarA, cigarBufLen, false);
+                    }
 
-                        const char *correctGenomeData;
-                        char *cigarForCorrect;
+                    if (dataB == NULL) {
+                        distanceB = -1;
+                    } else {
+                        distanceB = lv->computeEditDistance(dataB, read->getDataLength() + 20, read->getData(), read->getDataLength(), 30, cigarB, cigarBufLen, false);
+                    }
 
-                        if (distanceA != -1 && distanceA <= distanceB || distanceB == -1) {
-                            correctGenomeData = dataA;
-                            correctLocation = correctLocationA;
-                            cigarForCorrect = cigarA;
-                        } else {
-                            correctGenomeData = dataB;
-                            correctLocation = correctLocationB;
-                            cigarForCorrect = cigarB;
-                        }
+                    const char *correctGenomeData;
+                    char *cigarForCorrect;
 
-                        bool betterEditDistance = ((distanceA > editDistance && distanceB > editDistance) || (-1 == distanceA && -1 == distanceB));
-                        if (betterEditDistance) {
-                            context->countOfMisalignetsWithBetterEditDistanceByEditDistance[mapQ][editDistance]++;
-                            context->countOfMisalignetsWithBetterEditDistance[mapQ]++;
-                        }
+                    if (distanceA != -1 && distanceA <= distanceB || distanceB == -1) {
+                        correctGenomeData = dataA;
+                        correctLocation = correctLocationA;
+                        cigarForCorrect = cigarA;
+                    } else {
+                        correctGenomeData = dataB;
+                        correctLocation = correctLocationB;
+                        cigarForCorrect = cigarB;
+                    }
 
-                        // if (!printBetterErrors || (printBetterErrors && betterEditDistance)) {
-                           
-                        //     printf("%s\t%d\t%s\t%u\t%d\t%s\t*\t*\t100\t%.*s\t%.*s\tAlignedGenomeLocation:%u\tCorrectGenomeLocation: %u\tCigarForCorrect: %s\tCorrectData: %.*s\tAlignedData: %.*s\n", 
-                        //         idBuffer, flag, contig->name, genomeLocation - contig->beginningOffset, mapQ, cigarForAligned, read.getDataLength(), read.getData(), 
-                        //         read.getDataLength(), read.getQuality(),  genomeLocation, correctLocation, cigarForCorrect, read.getDataLength(),
-                        //         correctGenomeData, read.getDataLength(), alignedGenomeData);
-                        //}
+                    bool betterEditDistance = ((distanceA > editDistance && distanceB > editDistance) || (-1 == distanceA && -1 == distanceB));
+                    if (betterEditDistance) {
+                        countOfMisalignetsWithBetterEditDistance[mapQ]++;
                     }
+
+                    // if (!printBetterErrors || (printBetterErrors && betterEditDistance)) {
+                       
+                    //     printf("%s\t%d\t%s\t%u\t%d\t%s\t*\t*\t100\t%.*s\t%.*s\tAlignedGenomeLocation:%u\tCorrectGenomeLocation: %u\tCigarForCorrect: %s\tCorrectData: %.*s\tAlignedData: %.*s\n", 
+                    //         idBuffer, flag, contig->name, genomeLocation - contig->beginningOffset, mapQ, cigarForAligned, read.getDataLength(), read.getData(), 
+                    //         read.getDataLength(), read.getQuality(),  genomeLocation, correctLocation, cigarForCorrect, read.getDataLength(),
+                    //         correctGenomeData, read.getDataLength(), alignedGenomeData);
+                    //}
                 }
             }
-        } // if it was mapped
-    } // for each read from the sam reader
-
-     if (0 == InterlockedAdd64AndReturnNewValue(&nRunningThreads, -1)) {
-        SignalSingleWaiterObject(&allThreadsDone);
-    }
+        }
+    } // if it was mapped
 }
 
 
@@ -321,8 +338,21 @@ int main(int argc, char * argv[])
 
     if (argc < 3) usage();
 
+    unsigned nThreads;
+#ifdef _DEBUG
+    nThreads = 1;
+#else   // _DEBUG
+    nThreads = GetNumberOfProcessors();
+#endif // _DEBUG
+
     for (int i = 3; i < argc; i++) {
-        if (!strcmp(argv[i], "-b")) {
+        if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+            nThreads = atoi(argv[i + 1]);
+            if (0 == nThreads) {
+                usage();
+            }
+            i++;
+        } else if (!strcmp(argv[i], "-b")) {
             matchBothWays = true;
         } else if (!strcmp(argv[i], "-c")) {
             justCount = true;
@@ -337,11 +367,27 @@ int main(int argc, char * argv[])
         }
     }
 
+    inputFileName = argv[2];
+
+    SNAPFile input;
+    int argsConsumed;
+    if (!(util::stringEndsWith(inputFileName, ".sam") || util::stringEndsWith(inputFileName, ".bam") || util::stringEndsWith(inputFileName, ".cram")) ||
+        !SNAPFile::generateFromCommandLine((const char **)&inputFileName, 1, &argsConsumed, &input, false, true)) {
+        fprintf(stderr, "ComputeROC: input file '%s' must be .sam, .bam or .cram\n", inputFileName);
+        soft_exit(1);
+    }
+
+    //
+    // Telling right from wrong only takes the contigs' names and offsets, so unless something needs the bases (the
+    // edit distances for -e and -70, or decoding CRAM) just the contig table is loaded, with a single base.
+    //
+    bool needBases = printBetterErrors || printErrorsAtMAPQ70 || CRAMFile == input.fileType;
+
     static const char *genomeSuffix = "Genome";
 	size_t filenameLen = strlen(argv[1]) + 1 + strlen(genomeSuffix) + 1;
 	char *fileName = new char[strlen(argv[1]) + 1 + strlen(genomeSuffix) + 1];
 	snprintf(fileName,filenameLen,"%s%c%s",argv[1],PATH_SEP,genomeSuffix);
-	genome = Genome::loadFromFile(fileName, 0);
+	genome = Genome::loadFromFile(fileName, 0, 0, needBases ? 0 : 1);
 	if (NULL == genome) {
 		fprintf(stderr,"Unable to load genome from file '%s'\n",fileName);
 		return -1;
@@ -349,53 +395,33 @@ int main(int argc, char * argv[])
 	delete [] fileName;
 	fileName = NULL;
 
-    inputFileName = argv[2];
-
-    unsigned nThreads;
-#ifdef _DEBUG
-    nThreads = 1;
-#else   // _DEBUG
-    nThreads = GetNumberOfProcessors();
-#endif // _DEBUG
-
-
     DataSupplier::ThreadCount = nThreads;
-    nRunningThreads = nThreads;
 
     ReaderContext readerContext;
     readerContext.clipping = NoClipping;
     readerContext.defaultReadGroup = "";
+    readerContext.rangeIndex = 0;
+    readerContext.rangeCount = 1;
+    readerContext.trimmer = NULL;
+    readerContext.screen = NULL;
     readerContext.genome = genome;
     readerContext.ignoreSecondaryAlignments = true;
 	readerContext.header = NULL;
 	readerContext.headerLength = 0;
 	readerContext.headerBytes = 0;
 
-    if (NULL != strrchr(inputFileName, '.') && !_stricmp(strrchr(inputFileName, '.'), ".bam")) {
-        BAMReader::readHeader(inputFileName, readerContext);
-        readSupplierGenerator = BAMReader::createReadSupplierGenerator(inputFileName, nThreads, readerContext);
-    } else {
-        SAMReader::readHeader(inputFileName, readerContext);
-        readSupplierGenerator = SAMReader::createReadSupplierGenerator(inputFileName, nThreads, readerContext);
-    }
-
-    CreateSingleWaiterObject(&allThreadsDone);
-    ThreadContext *contexts = new ThreadContext[nThreads];
-
-    for (unsigned i = 0; i < nThreads; i++) {
-        contexts[i].whichThread = i;
+    input.readHeader(readerContext);
 
-        StartNewThread(WorkerThreadMain, &contexts[i]);
-    }
+    ROCContext common;
+    common.totalThreads = nThreads;
+    common.bindToProcessors = false;
+    common.readSupplierGenerator = input.createReadSupplierGenerator(nThreads, readerContext);
 
-    WaitForSingleWaiterObject(&allThreadsDone);
+    ParallelTask<ROCContext> task(&common);
+    task.run();
 
-    _int64 nUnaligned = 0;
-    _int64 totalReads = 0;
-    for (unsigned i = 0; i < nThreads; i++) {
-        nUnaligned += contexts[i].nUnaligned;
-        totalReads += contexts[i].totalReads;
-    }
+    _int64 nUnaligned = common.nUnaligned;
+    _int64 totalReads = common.totalReads;
     printf("%lld reads, %lld unaligned (%0.2f%%)\n", totalReads, nUnaligned, 100. * (double)nUnaligned / (double)totalReads);
 
     printf("MAPQ\tnReads\tnMisaligned");
@@ -404,14 +430,9 @@ int main(int argc, char * argv[])
     }
     printf("\n");
     for (int i = 0; i <= MaxMAPQ; i++) {
-        _int64 nReads = 0;
-        _int64 nMisaligned = 0;
-        _int64 betterMisaligned = 0;
-        for (unsigned j = 0; j < nThreads; j++) {
-            nReads += contexts[j].countOfReads[i];
-            nMisaligned += contexts[j].countOfMisalignments[i];
-            betterMisaligned += contexts[j].countOfMisalignetsWithBetterEditDistance[i];
-        }
+        _int64 nReads = common.countOfReads[i];
+        _int64 nMisaligned = common.countOfMisalignments[i];
+        _int64 betterMisaligned = common.countOfMisalignetsWithBetterEditDistance[i];
         printf("%d\t%lld\t%lld", i, nReads, nMisaligned);
         if (printBetterErrors) {
             printf("\t%lld", betterMisaligned);
@@ -419,9 +440,7 @@ int main(int argc, char * argv[])
         printf("\n");
     }
 
-    int maxEditDistanceSeen = 0;
-    for (unsigned i = 0; i < nThreads; i++) {
-    }
+    delete common.readSupplierGenerator;
 
 	return 0;
 }
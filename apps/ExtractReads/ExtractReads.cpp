@@ -2,11 +2,11 @@
 
 Module Name:
 
-    ComputeROC.cpp
+    ExtractReads.cpp
 
 Abstract:
 
-   Take a SAM file with simulated reads and compute a ROC curve from it.
+   Pull the reads in some regions out of a sorted, indexed BAM file.
 
 Authors:
 
@@ -18,91 +18,354 @@ Environment:
 
 Revision History:
 
-    
+    Rewritten to seek straight to the regions with the BAM index, rather than scanning the whole file.
+
 --*/
 
 #include "stdafx.h"
-#include "SAM.h"
-#include "BAM.h"
-#include "Genome.h"
 #include "Compat.h"
-#include "Read.h"
-#include "RangeSplitter.h"
+#include "Bam.h"
+#include "BamIndex.h"
+#include "DataWriter.h"
+#include "GzipDataWriter.h"
 #include "BigAlloc.h"
+#include "exit.h"
 
 void usage()
 {
-    fprintf(stderr,"usage: ExtractReads genomeDirectory input.bam output.sam chromosome\n");
+    fprintf(stderr,"usage: ExtractReads [-t threads] input.bam output.bam region [region ...]\n");
+    fprintf(stderr,"  Regions are contig or contig:begin-end (1 based and inclusive).  The input has to be sorted and have a\n");
+    fprintf(stderr,"  .bai or .csi index (as snap -so writes).  Reads in more than one region are written once.\n");
   	exit(1);
 }
 
+struct Region {
+    int                 refId;
+    _int64              begin;          // Zero based, half open
+    _int64              end;
+};
+
+//
+// A piece of one region, as decompressed and filtered by one thread.  A read belongs to the piece that holds the later of
+// its start and its region's start, so each read lands in just one piece and pieces in order give a sorted file.
+//
+struct Piece {
+    int                 refId;
+    _int64              begin;          // Zero based, half open
+    _int64              end;
+    _int64              regionBegin;
+    _int64              regionEnd;
+    char               *records;        // The reads that passed, as BAM records
+    size_t              recordBytes;
+    _int64              nReads;
+    SingleWaiterObject  done;
+};
+
+struct ExtractContext {
+    const char         *fileName;
+    const BAMIndex     *index;
+    Piece              *pieces;
+    int                 nPieces;
+    volatile int        nextPiece;
+    volatile int        nWritten;       // So that the threads don't get too far ahead of the writer
+    int                 maxAhead;
+    volatile int        nFailed;
+};
+
+    static void
+ExtractThreadMain(void *param)
+{
+    ExtractContext *context = (ExtractContext *)param;
+    FILE *file = fopen(context->fileName, "rb");
+    if (NULL == file) {
+        fprintf(stderr, "Unable to open %s\n", context->fileName);
+        soft_exit(1);
+    }
+
+    BAMIndex::ChunkVector chunks;
+    size_t capacity = BAM_BLOCK;
+    char *data = new char[capacity];
+
+    int i;
+    while ((i = InterlockedIncrementAndReturnNewValue(&context->nextPiece) - 1) < context->nPieces) {
+        while (i >= context->nWritten + context->maxAhead) {
+            SleepForMillis(1);
+        }
+
+        Piece *piece = &context->pieces[i];
+        size_t outputCapacity = BAM_BLOCK;
+        piece->records = new char[outputCapacity];
+        piece->recordBytes = 0;
+        piece->nReads = 0;
+
+        context->index->getChunks(piece->refId, piece->begin, piece->end, &chunks);
+        for (int c = 0; c < chunks.size(); c++) {
+            size_t bytes;
+            if (! BAMIndex::readRange(file, chunks[c].begin, chunks[c].end, &data, &capacity, &bytes)) {
+                InterlockedIncrementAndReturnNewValue(&context->nFailed);
+                break;
+            }
+
+            for (size_t offset = 0; offset + sizeof(BAMAlignment) <= bytes; ) {
+                BAMAlignment *bam = (BAMAlignment *)(data + offset);
+                size_t size = bam->size();
+                if (size < sizeof(BAMAlignment) || offset + size > bytes) {
+                    break;  // Only a chunk's last read can run past it, and then it isn't really in the chunk
+                }
+                offset += size;
+
+                if (bam->refID != piece->refId || bam->pos < 0 || bam->pos >= piece->regionEnd ||
+                        bam->pos + __max(bam->l_ref(), 1) <= piece->regionBegin) {
+                    continue;
+                }
+                _int64 anchor = __max((_int64)bam->pos, piece->regionBegin);
+                if (anchor < piece->begin || anchor >= piece->end) {
+                    continue;
+                }
+
+                if (piece->recordBytes + size > outputCapacity) {
+                    outputCapacity = __max(2 * outputCapacity, piece->recordBytes + size);
+                    char *bigger = new char[outputCapacity];
+                    memcpy(bigger, piece->records, piece->recordBytes);
+                    delete [] piece->records;
+                    piece->records = bigger;
+                }
+                memcpy(piece->records + piece->recordBytes, bam, size);
+                piece->recordBytes += size;
+                piece->nReads++;
+            }
+        }
+
+        SignalSingleWaiterObject(&piece->done);
+    }
+
+    delete [] data;
+    fclose(file);
+}
+
+//
+// Copies bytes into writer, going on to the next batch when they don't fit; a record never spans batches.
+//
+    static void
+WriteBytes(DataWriter *writer, const char *bytes, size_t length)
+{
+    char *buffer;
+    size_t size;
+    if ((! writer->getBuffer(&buffer, &size)) || size < length) {
+        writer->nextBatch();
+        if ((! writer->getBuffer(&buffer, &size)) || size < length) {
+            fprintf(stderr, "ExtractReads: write failed\n");
+            soft_exit(1);
+        }
+    }
+    memcpy(buffer, bytes, length);
+    writer->advance((unsigned)length);
+}
 
 int main(int argc, char * argv[])
 {
     BigAllocUseHugePages = false;
 
-    if (argc != 5) usage();
-
-    static const char *genomeSuffix = "Genome";
-	size_t filenameLen = strlen(argv[1]) + 1 + strlen(genomeSuffix) + 1;
-	char *fileName = new char[strlen(argv[1]) + 1 + strlen(genomeSuffix) + 1];
-	snprintf(fileName,filenameLen,"%s%c%s",argv[1],PATH_SEP,genomeSuffix);
-	const Genome *genome = Genome::loadFromFile(fileName, 0);
-	if (NULL == genome) {
-		fprintf(stderr,"Unable to load genome from file '%s'\n",fileName);
-		return -1;
-	}
-	delete [] fileName;
-	fileName = NULL;
-
-    ReaderContext readerContext;
-    readerContext.header = NULL;
-    readerContext.genome = genome;
-    readerContext.clipping = NoClipping;
-    readerContext.paired = false;
-    readerContext.ignoreSecondaryAlignments = true;
-    readerContext.defaultReadGroup = "";
-
-    ReadSupplierGenerator *readSupplierGenerator = BAMReader::createReadSupplierGenerator(fileName,1, readerContext);
-    ReadSupplier *readSupplier = readSupplierGenerator->generateNewReadSupplier();
-
-    AlignerOptions options("");
-    options.outputFileTemplate = argv[4];
-    options.sortOutput = false;
-    
-    const FileFormat* format = 
-    FileFormat::SAM[0]->isFormatOf(argv[3]) ? FileFormat::SAM[false] :
-    FileFormat::BAM[0]->isFormatOf(argv[3]) ? FileFormat::BAM[false] :
-    NULL;
-
-    if (NULL == format) {
-        fprintf(stderr,"Can't determine format for output file (does it end in .sam or .bam?)\n");
-        return 0;
-    }
-
-    ReadWriterSupplier *writerSupplier = format->getWriterSupplier(&options, readerContext.genome);
-    ReadWriter* writer = writerSupplier->getWriter();
-    writer->writeHeader(readerContext, options.sortOutput, argc, (const char **)argv, "", "");
-
-    Read *read;
-    AlignmentResult alignmentResult;
-    unsigned genomeLocation;
-    bool isRC;
-    unsigned mapQ;
-    _int64 totalReads = 0;
+    int nThreads = GetNumberOfProcessors();
+    int arg = 1;
+    if (arg + 1 < argc && !strcmp(argv[arg], "-t")) {
+        nThreads = __max(1, atoi(argv[arg + 1]));
+        arg += 2;
+    }
+    if (argc - arg < 3) usage();
+
+    const char *inputFileName = argv[arg];
+    const char *outputFileName = argv[arg + 1];
+    const char **regionSpecs = (const char **)argv + arg + 2;
+    int nRegions = argc - arg - 2;
+
+    BAMIndex *index = BAMIndex::load(inputFileName);
+    if (NULL == index) {
+        return 1;
+    }
+
+    //
+    // The header is everything up to the first read, and is copied over as it is.  It ends before the first read's
+    // chunk, but reading up to that needs its length, which is at the start.
+    //
+    FILE *input = fopen(inputFileName, "rb");
+    if (NULL == input) {
+        fprintf(stderr, "Unable to open %s\n", inputFileName);
+        return 1;
+    }
+    size_t headerCapacity = BAM_BLOCK;
+    char *header = new char[headerCapacity];
+    size_t headerRead;
+    _int64 fileSize = QueryFileSize(inputFileName);
+    size_t headerBytes = 0;
+    for (_uint64 headerEnd = (_uint64)BAM_BLOCK << 16; headerBytes == 0; headerEnd <<= 1) {
+        if (! BAMIndex::readRange(input, 0, headerEnd, &header, &headerCapacity, &headerRead)) {
+            return 1;
+        }
+        BAMHeader *bamHeader = (BAMHeader *)header;
+        if (headerRead < BAMHeader::size(0) || bamHeader->magic != BAMHeader::BAM_MAGIC) {
+            fprintf(stderr, "%s isn't a BAM file\n", inputFileName);
+            return 1;
+        }
+        if (headerRead < bamHeader->size()) {
+            if ((_int64)(headerEnd >> 16) > fileSize) {
+                fprintf(stderr, "%s has a truncated header\n", inputFileName);
+                return 1;
+            }
+            continue;
+        }
+        size_t bytes = bamHeader->size();
+        int n_ref = bamHeader->n_ref();
+        int i;
+        for (i = 0; i < n_ref && bytes + sizeof(_int32) <= headerRead; i++) {
+            bytes += BAMHeaderRefSeq::size(((BAMHeaderRefSeq *)(header + bytes))->l_name);
+        }
+        if (i == n_ref && bytes <= headerRead) {
+            headerBytes = bytes;
+        } else if ((_int64)(headerEnd >> 16) > fileSize) {
+            fprintf(stderr, "%s has a truncated header\n", inputFileName);
+            return 1;
+        }
+    }
+    fclose(input);
+
+    //
+    // Find the regions' contigs in the header, and merge the ones that overlap so no read is written twice.
+    //
+    BAMHeader *bamHeader = (BAMHeader *)header;
+    int nRefs = bamHeader->n_ref();
+    Region *regions = new Region[nRegions];
+    for (int r = 0; r < nRegions; r++) {
+        const char *spec = regionSpecs[r];
+        const char *colon = strrchr(spec, ':');
+        size_t nameLength = NULL == colon ? strlen(spec) : colon - spec;
+        regions[r].refId = -1;
+        BAMHeaderRefSeq *ref = bamHeader->firstRefSeq();
+        _int64 refLength = 0;
+        for (int i = 0; i < nRefs; i++, ref = ref->next()) {
+            // l_name includes the terminating NUL
+            if ((size_t)ref->l_name == nameLength + 1 && 0 == memcmp(ref->name(), spec, nameLength)) {
+                regions[r].refId = i;
+                refLength = ref->l_ref();
+                break;
+            }
+        }
+        if (-1 == regions[r].refId) {
+            fprintf(stderr, "Contig of region '%s' isn't in the input's header\n", spec);
+            return 1;
+        }
+
+        unsigned long long begin = 1, end = refLength;
+        if (NULL != colon && (2 != sscanf(colon + 1, "%llu-%llu", &begin, &end) || 0 == begin || end < begin)) {
+            fprintf(stderr, "Invalid region '%s'; it should look like chr1:1000-2000\n", spec);
+            return 1;
+        }
+        regions[r].begin = begin - 1;
+        regions[r].end = __min((_int64)end, refLength);
+    }
+
+    for (int i = 1; i < nRegions; i++) {    // insertion sort by contig and start; there aren't many
+        Region region = regions[i];
+        int j;
+        for (j = i; j > 0 && (regions[j - 1].refId > region.refId ||
+                (regions[j - 1].refId == region.refId && regions[j - 1].begin > region.begin)); j--) {
+            regions[j] = regions[j - 1];
+        }
+        regions[j] = region;
+    }
+    int nMerged = 0;
+    for (int i = 0; i < nRegions; i++) {
+        if (nMerged > 0 && regions[nMerged - 1].refId == regions[i].refId && regions[i].begin <= regions[nMerged - 1].end) {
+            regions[nMerged - 1].end = __max(regions[nMerged - 1].end, regions[i].end);
+        } else {
+            regions[nMerged++] = regions[i];
+        }
+    }
+    nRegions = nMerged;
+
+    //
+    // Cut the regions into pieces of whole index windows, small enough for each to be a modest amount of work and memory.
+    //
+    const _int64 pieceSize = 1 << 20;
+    int nPieces = 0;
+    for (int r = 0; r < nRegions; r++) {
+        nPieces += (int)((regions[r].end - regions[r].begin + pieceSize - 1) / pieceSize);
+    }
+    ExtractContext context;
+    context.fileName = inputFileName;
+    context.index = index;
+    context.pieces = new Piece[nPieces];
+    context.nPieces = 0;
+    context.nextPiece = 0;
+    context.nWritten = 0;
+    context.maxAhead = 4 * nThreads;
+    context.nFailed = 0;
+    for (int r = 0; r < nRegions; r++) {
+        for (_int64 begin = regions[r].begin; begin < regions[r].end; begin += pieceSize) {
+            Piece *piece = &context.pieces[context.nPieces++];
+            piece->refId = regions[r].refId;
+            piece->begin = begin;
+            piece->end = __min(begin + pieceSize, regions[r].end);
+            piece->regionBegin = regions[r].begin;
+            piece->regionEnd = regions[r].end;
+            piece->records = NULL;
+            CreateSingleWaiterObject(&piece->done);
+        }
+    }
+
+    //
+    // The output is BGZF compressed and written the way SNAP writes unsorted BAM.
+    //
+    GzipWriterFilterSupplier *gzipSupplier = DataWriterSupplier::gzip(true, BAM_BLOCK, __max(1, nThreads - 1), false);
+    DataWriterSupplier *writerSupplier = DataWriterSupplier::create(outputFileName, gzipSupplier, FileEncoder::gzip(gzipSupplier));
+    DataWriter *writer = writerSupplier->getWriter();
+    if (NULL == writer) {
+        fprintf(stderr, "Unable to open %s for write\n", outputFileName);
+        return 1;
+    }
+    writer->inHeader(true);
+    WriteBytes(writer, header, headerBytes);
+    writer->nextBatch();
+    writer->inHeader(false);
+
+    _int64 start = timeInMillis();
+    for (int i = 0; i < __min(nThreads, nPieces); i++) {
+        if (! StartNewThread(ExtractThreadMain, &context)) {
+            fprintf(stderr, "Unable to start thread\n");
+            return 1;
+        }
+    }
+
     _int64 emittedReads = 0;
-    while (readSupplier->getNextRead()) {
-        totalReads++;
-        const Genome::Contig *contig = genome->getContigAtLocation(genomeLocation);
-        if (NULL != contig && !strcmp(contig->name, argv[4])) {
-            emittedReads++;
-            writer->writeRead(read, alignmentResult, mapQ, genomeLocation, isRC ? RC : FORWARD);
+    for (int i = 0; i < nPieces; i++) {
+        Piece *piece = &context.pieces[i];
+        WaitForSingleWaiterObject(&piece->done);
+        DestroySingleWaiterObject(&piece->done);
+        for (size_t offset = 0; offset < piece->recordBytes; ) {
+            size_t size = ((BAMAlignment *)(piece->records + offset))->size();
+            WriteBytes(writer, piece->records + offset, size);
+            offset += size;
         }
+        emittedReads += piece->nReads;
+        delete [] piece->records;
+        piece->records = NULL;
+        context.nWritten = i + 1;
     }
+
     writer->close();
+    delete writer;
+    writerSupplier->close();
+    delete writerSupplier;
 
-    printf("Processed %lld reads, of which %lld were emitted\n", totalReads, emittedReads);
+    if (0 != context.nFailed) {
+        fprintf(stderr, "Failed reading %s\n", inputFileName);
+        return 1;
+    }
+    printf("Wrote %lld reads from %d regions in %llds\n", emittedReads, nRegions, (timeInMillis() - start + 500) / 1000);
 
+    delete [] context.pieces;
+    delete [] regions;
+    delete [] header;
+    delete index;
 	return 0;
 }
-
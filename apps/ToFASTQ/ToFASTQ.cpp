@@ -18,7 +18,7 @@ Environment:
 
 Revision History:
 
-    
+
 --*/
 
 #include "stdafx.h"
@@ -30,24 +30,29 @@ Revision History:
 #include "RangeSplitter.h"
 #include "BigAlloc.h"
 #include "FASTQ.h"
+#include "DataWriter.h"
+#include "AlignerOptions.h"
+#include "Util.h"
 
 void usage()
 {
-    fprintf(stderr,"usage: ToFASTQ genomeIndex inputFile outputFile {outputFile2}\n");
+    fprintf(stderr,"usage: ToFASTQ [-t threads] [genomeIndex] inputFile outputFile {outputFile2}\n");
+    fprintf(stderr,"       The input is SAM, BAM or CRAM (going by its extension).  Only CRAM needs the genomeIndex, which must\n");
+    fprintf(stderr,"       be the one used to write it; for SAM and BAM it's optional, and isn't loaded.\n");
     fprintf(stderr,"       Specifying two output files means that the input is paired.  If you specify only one output file, then\n");
     fprintf(stderr,"       ToFASTQ will generate a single-ended FASTQ even for a paired input.\n");
-    fprintf(stderr,"       The genomeIndex must contain the same set of contigs used to align the input file.\n");
     fprintf(stderr,"       To produce interleaved paired-end FASTQ, specify outputFile2 as '-i'.\n");
+    fprintf(stderr,"       Output files whose names end in .gz are gzip compressed (as BGZF).\n");
+    fprintf(stderr,"       -t sets the number of threads, which is the number of processors by default.\n");
   	soft_exit(1);
 }
 
 ReadSupplierGenerator *readSupplierGenerator = NULL;
+PairedReadSupplierGenerator *pairedReadSupplierGenerator = NULL;
 
 volatile _int64 nRunningThreads;
 SingleWaiterObject allThreadsDone;
-const char *inputFileName;
-const Genome *genome;
-FASTQWriter *fastqWriter[2] = {NULL, NULL};
+DataWriterSupplier *outputs[2] = {NULL, NULL};     // outputs[1] is NULL for single-ended or interleaved output
 
 struct ThreadContext {
     unsigned    whichThread;
@@ -59,8 +64,11 @@ struct ThreadContext {
     }
 };
 
-bool inline isADigit(char x) {
-    return x >= '0' && x <= '9';
+    static void
+WriteFailed()
+{
+    fprintf(stderr, "ToFASTQ: unable to write a read\n");
+    soft_exit(1);
 }
 
 void
@@ -69,158 +77,185 @@ WorkerThreadMain(void *param)
     ThreadContext *context = (ThreadContext *)param;
 
     ReadSupplier *readSupplier = readSupplierGenerator->generateNewReadSupplier();
+    FASTQWriter *writer = new FASTQWriter(outputs[0]);
 
     Read *read;
      while (NULL != (read = readSupplier->getNextRead())) {
         context->totalReads++;
-        fastqWriter[0]->writeRead(read);
+        if (!writer->writeRead(read)) {
+            WriteFailed();
+        }
      } // for each read from the reader
 
+    delete writer;
+    delete readSupplier;
+
      if (0 == InterlockedAdd64AndReturnNewValue(&nRunningThreads, -1)) {
         SignalSingleWaiterObject(&allThreadsDone);
     }
 }
 
-_int64
-ProcessPairedInput(PairedReadSupplierGenerator *pairedReadSupplierGenerator)
+void
+PairedWorkerThreadMain(void *param)
 {
+    ThreadContext *context = (ThreadContext *)param;
+
+    PairedReadSupplier *readSupplier = pairedReadSupplierGenerator->generateNewPairedReadSupplier();
+    FASTQWriter *writers[NUM_READS_PER_PAIR];
+    for (int i = 0; i < NUM_READS_PER_PAIR; i++) {
+        writers[i] = NULL == outputs[i] ? NULL : new FASTQWriter(outputs[i]);
+    }
+
     //
-    // This runs single threaded, because it's the only easy way to assure that the two output files match.
+    // The IDs get /1 and /2.  Interleaved pairs go into the same batch, so they stay together however many threads
+    // are writing; with two output files the batches of each file have to line up, so there's only one thread.
     //
-    PairedReadSupplier *readSupplier = pairedReadSupplierGenerator->generateNewPairedReadSupplier();
-    
     Read *read[NUM_READS_PER_PAIR];
-
-    const size_t idBufferSize = 10000;
-    char idBuffer[idBufferSize];
-
-    _int64 totalReads = 0;
-
     while (readSupplier->getNextReadPair(&read[0], &read[1])) {
-        for (int i = 0; i < NUM_READS_PER_PAIR; i++) {
-            //
-            // Create a new read with an ID that includes /1 or /2.  Don't bother to fill in the stuff that the
-            // FASTQ writer doesn't care about anyway.
-            //
-            snprintf(idBuffer, idBufferSize-1,"%.*s/%d", read[i]->getIdLength(), read[i]->getId(), i+1);
-            Read local;
-            local.init(idBuffer, (unsigned)strlen(idBuffer),read[i]->getUnclippedData(), read[i]->getUnclippedQuality(), read[i]->getUnclippedLength(),
-                0,0,0,0,0,0,0,NULL,0,0);
-            fastqWriter[i]->writeRead(&local);
+        if (NULL == writers[1]) {
+            if (!writers[0]->writePair(read[0], read[1])) {
+                WriteFailed();
+            }
+        } else {
+            for (int i = 0; i < NUM_READS_PER_PAIR; i++) {
+                if (!writers[i]->writeRead(read[i], i + 1)) {
+                    WriteFailed();
+                }
+            }
         }
-        totalReads += 2;
+        context->totalReads += 2;
     }
 
-    return totalReads;
+    for (int i = 0; i < NUM_READS_PER_PAIR; i++) {
+        delete writers[i];
+    }
+    delete readSupplier;
+
+    if (0 == InterlockedAdd64AndReturnNewValue(&nRunningThreads, -1)) {
+        SignalSingleWaiterObject(&allThreadsDone);
+    }
 }
 
+    static bool
+IsAlignedReadsFile(const char *fileName)
+{
+    return util::stringEndsWith(fileName, ".sam") || util::stringEndsWith(fileName, ".bam") || util::stringEndsWith(fileName, ".cram");
+}
 
 int main(int argc, char * argv[])
 {
     BigAllocUseHugePages = false;
 
-    if (4 != argc && 5 != argc) usage();
-
-    static const char *genomeSuffix = "Genome";
-	size_t filenameLen = strlen(argv[1]) + 1 + strlen(genomeSuffix) + 1;
-	char *fileName = new char[strlen(argv[1]) + 1 + strlen(genomeSuffix) + 1];
-	snprintf(fileName,filenameLen,"%s%c%s",argv[1],PATH_SEP,genomeSuffix);
-	genome = Genome::loadFromFile(fileName, 0);
-	if (NULL == genome) {
-		fprintf(stderr,"Unable to load genome from file '%s'\n",fileName);
-		return -1;
-	}
-	delete [] fileName;
-	fileName = NULL;
-
-    inputFileName = argv[2];
-
-    fastqWriter[0] = FASTQWriter::Factory(argv[3]);
-    if (NULL == fastqWriter[0]) {
-        fprintf(stderr,"Unable to open FASTQ writer for output file '%s'\n", argv[3]);
-        soft_exit(1);
+    unsigned nThreads = GetNumberOfProcessors();
+    int arg = 1;
+    if (arg + 1 < argc && !strcmp(argv[arg], "-t")) {
+        nThreads = atoi(argv[arg + 1]);
+        if (0 == nThreads) {
+            usage();
+        }
+        arg += 2;
     }
 
-    _int64 totalReads = 0;
-    unsigned nThreads;
+    //
+    // The genome index used to be required, so it's told apart from the input by the input's extension.
+    //
+    const char *genomeIndex = NULL;
+    if (arg < argc && !IsAlignedReadsFile(argv[arg])) {
+        genomeIndex = argv[arg];
+        arg++;
+    }
 
-#ifdef _DEBUG
-    nThreads = 1;
-#else   // _DEBUG
-    if (5 == argc) {
-        nThreads = 1;
-    } else {
-        nThreads = GetNumberOfProcessors();
+    if (argc - arg != 2 && argc - arg != 3) usage();
+
+    const char *inputFileName = argv[arg];
+    const char *outputFileName = argv[arg + 1];
+    const char *outputFileName2 = argc - arg == 3 ? argv[arg + 2] : NULL;
+    bool paired = NULL != outputFileName2;
+
+    SNAPFile input;
+    int argsConsumed;
+    if (!IsAlignedReadsFile(inputFileName) || !SNAPFile::generateFromCommandLine((const char **)&inputFileName, 1, &argsConsumed, &input, paired, true)) {
+        fprintf(stderr, "ToFASTQ: input file '%s' must be .sam, .bam or .cram\n", inputFileName);
+        soft_exit(1);
     }
-#endif // _DEBUG
 
+    const Genome *genome = NULL;
+    if (CRAMFile == input.fileType) {
+        if (NULL == genomeIndex) {
+            fprintf(stderr, "ToFASTQ: reading CRAM needs the genome index that it was written with\n");
+            soft_exit(1);
+        }
+
+        static const char *genomeSuffix = "Genome";
+        size_t filenameLen = strlen(genomeIndex) + 1 + strlen(genomeSuffix) + 1;
+        char *fileName = new char[filenameLen];
+        snprintf(fileName,filenameLen,"%s%c%s",genomeIndex,PATH_SEP,genomeSuffix);
+        genome = Genome::loadFromFile(fileName, 0);
+        if (NULL == genome) {
+            fprintf(stderr,"Unable to load genome from file '%s'\n",fileName);
+            return -1;
+        }
+        delete [] fileName;
+    }
 
+    //
+    // The reader decompresses (and matches up pairs) on all of the threads, whatever the number that write.
+    //
     DataSupplier::ThreadCount = nThreads;
-    nRunningThreads = nThreads;
 
     ReaderContext readerContext;
     readerContext.clipping = NoClipping;
     readerContext.defaultReadGroup = "";
+    readerContext.rangeIndex = 0;
+    readerContext.rangeCount = 1;
+    readerContext.trimmer = NULL;
+    readerContext.screen = NULL;
     readerContext.genome = genome;
     readerContext.ignoreSecondaryAlignments = true;
 	readerContext.header = NULL;
 	readerContext.headerLength = 0;
 	readerContext.headerBytes = 0;
 
-    if (5 == argc) {
-        if (!strcmp(argv[4], "-i")) {
-            fastqWriter[1] = fastqWriter[0];    // Interleaved
-        } else {
-            fastqWriter[1] = FASTQWriter::Factory(argv[4]);
-            if (NULL == fastqWriter[1]) {
-                fprintf(stderr,"Unable to open FASTQ writer for output file '%s'\n", argv[4]);
-                soft_exit(1);
-            }
-        }
-
-        PairedReadSupplierGenerator *pairedReadSupplierGenerator;
-        if (NULL != strrchr(inputFileName, '.') && !_stricmp(strrchr(inputFileName, '.'), ".bam")) {
-            BAMReader::readHeader(inputFileName, readerContext);
-            pairedReadSupplierGenerator = BAMReader::createPairedReadSupplierGenerator(inputFileName, nThreads, true, readerContext);
-        } else {
-            SAMReader::readHeader(inputFileName, readerContext);
-            pairedReadSupplierGenerator = SAMReader::createPairedReadSupplierGenerator(inputFileName, nThreads, true, readerContext);
-        }
+    input.readHeader(readerContext);
 
+    outputs[0] = FASTQWriter::createSupplier(outputFileName);
 
-        totalReads = ProcessPairedInput(pairedReadSupplierGenerator);
-        if (fastqWriter[1] != fastqWriter[0]) {
-            delete fastqWriter[1];
-        } else {
-            fastqWriter[1] = NULL;
+    unsigned nWriterThreads = nThreads;
+    if (paired) {
+        if (strcmp(outputFileName2, "-i")) {
+            outputs[1] = FASTQWriter::createSupplier(outputFileName2);
+            nWriterThreads = 1;
         }
+        pairedReadSupplierGenerator = input.createPairedReadSupplierGenerator(nThreads, true, readerContext);
     } else {
-        if (NULL != strrchr(inputFileName, '.') && !_stricmp(strrchr(inputFileName, '.'), ".bam")) {
-            BAMReader::readHeader(inputFileName, readerContext);
-            readSupplierGenerator = BAMReader::createReadSupplierGenerator(inputFileName, nThreads, readerContext);
-        } else {
-           SAMReader::readHeader(inputFileName, readerContext);
-           readSupplierGenerator = SAMReader::createReadSupplierGenerator(inputFileName, nThreads, readerContext);
-        }
+        readSupplierGenerator = input.createReadSupplierGenerator(nThreads, readerContext);
+    }
 
-        CreateSingleWaiterObject(&allThreadsDone);
-        ThreadContext *contexts = new ThreadContext[nThreads];
+    CreateSingleWaiterObject(&allThreadsDone);
+    nRunningThreads = nWriterThreads;
+    ThreadContext *contexts = new ThreadContext[nWriterThreads];
 
-        for (unsigned i = 0; i < nThreads; i++) {
-            contexts[i].whichThread = i;
+    for (unsigned i = 0; i < nWriterThreads; i++) {
+        contexts[i].whichThread = i;
 
-            StartNewThread(WorkerThreadMain, &contexts[i]);
-        }
+        StartNewThread(paired ? PairedWorkerThreadMain : WorkerThreadMain, &contexts[i]);
+    }
 
-        WaitForSingleWaiterObject(&allThreadsDone);
+    WaitForSingleWaiterObject(&allThreadsDone);
 
-        for (unsigned i = 0; i < nThreads; i++) {
-            totalReads += contexts[i].totalReads;
+    _int64 totalReads = 0;
+    for (unsigned i = 0; i < nWriterThreads; i++) {
+        totalReads += contexts[i].totalReads;
+    }
+
+    for (int i = 0; i < NUM_READS_PER_PAIR; i++) {
+        if (NULL != outputs[i]) {
+            outputs[i]->close();
+            delete outputs[i];
         }
     }
+
     printf("%lld reads\n", totalReads);
-    delete fastqWriter[0];
 
 	return 0;
 }
-
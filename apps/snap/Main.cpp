@@ -32,6 +32,11 @@ Revision History:
 #include "exit.h"
 #include "SeedSequencer.h"
 #include "AlignerOptions.h"
+#include "SortedMerger.h"
+#include "PackedReads.h"
+#include "ReadSimulator.h"
+#include "DistanceHistogram.h"
+#include "IoBench.h"
 
 
 using namespace std;
@@ -44,12 +49,281 @@ static void usage()
             "Usage: snap <command> [<options>]\n"
             "Commands:\n"
             "   index    build a genome index\n"
+            "   indexstats report an index's table sizes, load factors, probe lengths and seed popularity\n"
             "   single   align single-end reads\n"
             "   paired   align paired-end reads\n"
-            "Type a command without arguments to see its help.\n");
+            "   daemon   read single/paired commands from stdin, one per line, keeping the index loaded between them\n"
+            "   batch    run the single/paired commands in a manifest file, several at once, sharing one index\n"
+            "   merge    merge sorted SAM or BAM files, such as the pieces of an input aligned with -range\n"
+            "   pack     convert FASTQ to SNAP's packed read format, which the aligner reads faster\n"
+            "   simulate generate wgsim-style simulated reads from an index's genome, for measuring speed and accuracy\n"
+            "   distancehist histogram the edit distances of aligned or simulated reads from the reference\n"
+            "   iobench  measure how fast the input and output can be read, decompressed, parsed and written, without aligning\n"
+            "Type a command without arguments to see its help.\n"
+            "The processor specific kernels run at the %s level on this machine.\n",
+            CpuDispatchLevel());
     soft_exit(1);
 }
 
+    static void
+RunAlignmentCommands(int argc, const char **argv)
+{
+    //
+    // argv[0] is the first "single" or "paired".  Each command consumes its args up to the next ",", and the
+    // index stays loaded from one to the next as long as they use the same index directory.
+    //
+    for (int i = 0; i < argc; /* i is increased below */) {
+        unsigned nArgsConsumed;
+        if (strcmp(argv[i], "single") == 0) {
+            SingleAlignerContext single;
+            single.runAlignment(argc - (i + 1), argv + i + 1, SNAP_VERSION, &nArgsConsumed);
+        } else if (strcmp(argv[i], "paired") == 0) {
+            PairedAlignerContext paired;
+            paired.runAlignment(argc - (i + 1), argv + i + 1, SNAP_VERSION, &nArgsConsumed);
+        } else {
+            fprintf(stderr, "Invalid command: %s\n\n", argv[i]);
+            usage();
+        }
+        _ASSERT(nArgsConsumed > 0);
+        i += nArgsConsumed + 1;  // +1 for single or paired
+    }
+}
+
+    static bool
+CheckAlignmentCommands(int argc, const char **argv)
+{
+    //
+    // The same walk as RunAlignmentCommands, but only parsing and checking each command, so that the daemon can turn away
+    // a bad one (which would otherwise soft_exit, taking the loaded index with it) before starting any of them.
+    //
+    for (int i = 0; i < argc; /* i is increased below */) {
+        unsigned nArgsConsumed;
+        bool ok;
+        if (strcmp(argv[i], "single") == 0) {
+            SingleAlignerContext single;
+            ok = single.checkCommand(argc - (i + 1), argv + i + 1, SNAP_VERSION, &nArgsConsumed);
+        } else if (strcmp(argv[i], "paired") == 0) {
+            PairedAlignerContext paired;
+            ok = paired.checkCommand(argc - (i + 1), argv + i + 1, SNAP_VERSION, &nArgsConsumed);
+        } else {
+            fprintf(stderr, "Invalid command: %s\n", argv[i]);
+            ok = false;
+        }
+        if (!ok) {
+            return false;
+        }
+        _ASSERT(nArgsConsumed > 0);
+        i += nArgsConsumed + 1;  // +1 for single or paired
+    }
+    return true;
+}
+
+    static void
+RunDaemon()
+{
+    //
+    // Read alignment commands (the same as what would follow "snap" on the command line) from stdin, one per line, and
+    // run each in turn.  Because this is all one process the index is only loaded once, and subsequent jobs on the same
+    // index just use it.  Stops at EOF or a line containing "exit".  To feed it from a FIFO, keep the writing end open
+    // across jobs, or it will see EOF when the first writer closes it.
+    //
+    const size_t lineBufferSize = 64 * 1024;
+    char *lineBuffer = new char[lineBufferSize];
+    const int maxArgs = lineBufferSize / 2;
+    const char **args = new const char *[maxArgs];
+
+    fprintf(stderr, "SNAP daemon: ready for commands.\n");
+    while (NULL != fgets(lineBuffer, lineBufferSize, stdin)) {
+        int nArgs = 0;
+        for (char *token = strtok(lineBuffer, " \t\r\n"); NULL != token && nArgs < maxArgs; token = strtok(NULL, " \t\r\n")) {
+            args[nArgs++] = token;
+        }
+
+        if (0 == nArgs) {
+            continue;
+        }
+
+        if (strcmp(args[0], "exit") == 0) {
+            break;
+        }
+
+        if (strcmp(args[0], "single") != 0 && strcmp(args[0], "paired") != 0) {
+            fprintf(stderr, "SNAP daemon: commands must start with single or paired, ignoring '%s'\n", args[0]);
+            continue;
+        }
+
+        if (!CheckAlignmentCommands(nArgs, args)) {
+            fprintf(stderr, "SNAP daemon: command failed, ignoring it.\n");
+            continue;
+        }
+
+        RunAlignmentCommands(nArgs, args);
+        fprintf(stderr, "SNAP daemon: command complete.\n");
+        fflush(stdout);
+    }
+
+    delete [] args;
+    delete [] lineBuffer;
+}
+
+static void batchUsage()
+{
+    fprintf(stderr,
+            "Usage: snap batch <manifest> [-j <jobs>]\n"
+            "The manifest has one alignment command per line, as it would follow 'snap' on the command line (so single or\n"
+            "paired, the index directory, and the sample's inputs and options).  Blank lines and lines starting with # are\n"
+            "ignored.  Up to <jobs> (default 2) of them run at once, so that one sample's sort, merge and compression overlap\n"
+            "the alignment of the next, and they all share one copy of the index, which has to be the same for every line.\n"
+            "Each command runs its own -t threads, so give them a share of the machine (e.g., -t 8 for two jobs on 16 cores).\n"
+            "Settings that apply to the whole process (-t for the readers, -ordered, -stream, -trace, -perf) should be the\n"
+            "same on every line, and no command may read stdin or write stdout.\n");
+    soft_exit(1);
+}
+
+struct BatchJob {
+    char        *line;      // args point into it
+    int          nArgs;
+    const char **args;
+};
+
+struct BatchContext {
+    BatchJob        *jobs;
+    int              nJobs;
+    volatile int     nextJob;
+    volatile int     runningThreadCount;
+    SingleWaiterObject doneObject;
+};
+
+    static void
+BatchThreadMain(void *param)
+{
+    BatchContext *context = (BatchContext *)param;
+
+    int job;
+    while ((job = InterlockedIncrementAndReturnNewValue(&context->nextJob) - 1) < context->nJobs) {
+        fprintf(stderr, "SNAP batch: starting job %d of %d\n", job + 1, context->nJobs);
+        RunAlignmentCommands(context->jobs[job].nArgs, context->jobs[job].args);
+        fprintf(stderr, "SNAP batch: finished job %d of %d\n", job + 1, context->nJobs);
+    }
+
+    if (0 == InterlockedDecrementAndReturnNewValue(&context->runningThreadCount)) {
+        SignalSingleWaiterObject(&context->doneObject);
+    }
+}
+
+    static void
+RunBatch(int argc, const char **argv)
+{
+    //
+    // Many small samples (exomes, panels) each run one after another spend much of their time starting up and in
+    // the single threaded tail of sorting and compressing their output.  Running several at a time on their own threads
+    // overlaps those with the others' alignment.  The index is loaded once (see AlignerContext::initialize), and
+    // threads come from the same pool.
+    //
+    if (argc < 1) {
+        batchUsage();
+    }
+
+    int maxJobs = 2;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            maxJobs = atoi(argv[i + 1]);
+            i++;
+        } else {
+            fprintf(stderr, "Didn't understand batch option '%s'\n\n", argv[i]);
+            batchUsage();
+        }
+    }
+
+    FILE *manifest = fopen(argv[0], "r");
+    if (NULL == manifest) {
+        fprintf(stderr, "Unable to open batch manifest '%s'\n", argv[0]);
+        soft_exit(1);
+    }
+
+    const size_t lineBufferSize = 64 * 1024;
+    char *lineBuffer = new char[lineBufferSize];
+    std::vector<BatchJob> jobs;
+    const char *indexDir = NULL;
+    int lineNumber = 0;
+    while (NULL != fgets(lineBuffer, lineBufferSize, manifest)) {
+        lineNumber++;
+        BatchJob job;
+        job.line = new char[strlen(lineBuffer) + 1];
+        strcpy(job.line, lineBuffer);
+        job.args = new const char *[strlen(lineBuffer) / 2 + 1];
+        job.nArgs = 0;
+        for (char *token = strtok(job.line, " \t\r\n"); NULL != token; token = strtok(NULL, " \t\r\n")) {
+            job.args[job.nArgs++] = token;
+        }
+
+        if (0 == job.nArgs || '#' == job.args[0][0]) {
+            delete [] job.args;
+            delete [] job.line;
+            continue;
+        }
+
+        if ((strcmp(job.args[0], "single") != 0 && strcmp(job.args[0], "paired") != 0) || job.nArgs < 3) {
+            fprintf(stderr, "SNAP batch: line %d of '%s' isn't a single or paired command with an index and inputs\n", lineNumber, argv[0]);
+            soft_exit(1);
+        }
+
+        //
+        // The jobs share g_index, which a job with a different index would replace out from under the others.
+        //
+        for (int i = 0; i < job.nArgs; i++) {
+            if (0 == i || (strcmp(job.args[i - 1], ",") == 0 && i + 1 < job.nArgs)) {
+                const char *commandIndexDir = job.args[i + 1];
+                if (NULL == indexDir) {
+                    indexDir = commandIndexDir;
+                } else if (strcmp(indexDir, commandIndexDir) != 0) {
+                    fprintf(stderr, "SNAP batch: line %d of '%s' uses index '%s', but the batch shares '%s'\n", lineNumber, argv[0],
+                        commandIndexDir, indexDir);
+                    soft_exit(1);
+                }
+            }
+            if (strcmp(job.args[i], "-") == 0) {
+                fprintf(stderr, "SNAP batch: line %d of '%s' uses stdin or stdout, which the jobs can't share\n", lineNumber, argv[0]);
+                soft_exit(1);
+            }
+        }
+
+        jobs.push_back(job);
+    }
+    fclose(manifest);
+    delete [] lineBuffer;
+
+    if (jobs.empty()) {
+        fprintf(stderr, "SNAP batch: no commands in '%s'\n", argv[0]);
+        return;
+    }
+
+    BatchContext context;
+    context.jobs = &jobs[0];
+    context.nJobs = (int)jobs.size();
+    context.nextJob = 0;
+    CreateSingleWaiterObject(&context.doneObject);
+
+    int nThreads = __min(maxJobs, context.nJobs);
+    fprintf(stderr, "SNAP batch: %d jobs, %d at a time\n", context.nJobs, nThreads);
+    context.runningThreadCount = nThreads;
+    for (int i = 0; i < nThreads; i++) {
+        if (!StartNewThread(BatchThreadMain, &context)) {
+            fprintf(stderr, "SNAP batch: unable to start thread\n");
+            soft_exit(1);
+        }
+    }
+
+    WaitForSingleWaiterObject(&context.doneObject);
+    DestroySingleWaiterObject(&context.doneObject);
+    fflush(stdout);
+
+    for (size_t i = 0; i < jobs.size(); i++) {
+        delete [] jobs[i].args;
+        delete [] jobs[i].line;
+    }
+}
+
 int main(int argc, const char **argv)
 {
     fprintf(stderr, "Welcome to SNAP version %s.\n\n", SNAP_VERSION);
@@ -60,22 +334,24 @@ int main(int argc, const char **argv)
         usage();
     } else if (strcmp(argv[1], "index") == 0) {
         GenomeIndex::runIndexer(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "indexstats") == 0) {
+        GenomeIndex::runIndexStats(argc - 2, argv + 2);
     } else if (strcmp(argv[1], "single") == 0 || strcmp(argv[1], "paired") == 0) {
-        for (int i = 1; i < argc; /* i is increased below */) {
-            unsigned nArgsConsumed;
-            if (strcmp(argv[i], "single") == 0) {
-                SingleAlignerContext single;
-                single.runAlignment(argc - (i + 1), argv + i + 1, SNAP_VERSION, &nArgsConsumed);
-            } else if (strcmp(argv[i], "paired") == 0) {
-                PairedAlignerContext paired;
-                paired.runAlignment(argc - (i + 1), argv + i + 1, SNAP_VERSION, &nArgsConsumed);
-            } else {
-                fprintf(stderr, "Invalid command: %s\n\n", argv[i]);
-                usage();
-            }
-            _ASSERT(nArgsConsumed > 0);
-            i += nArgsConsumed + 1;  // +1 for single or paired
-        }
+        RunAlignmentCommands(argc - 1, argv + 1);
+    } else if (strcmp(argv[1], "daemon") == 0) {
+        RunDaemon();
+    } else if (strcmp(argv[1], "batch") == 0) {
+        RunBatch(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "merge") == 0) {
+        SortedMerger::runMerger(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "pack") == 0) {
+        PackedReadWriter::runPacker(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "simulate") == 0) {
+        ReadSimulator::runSimulator(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "distancehist") == 0) {
+        DistanceHistogram::runDistanceHist(argc - 2, argv + 2);
+    } else if (strcmp(argv[1], "iobench") == 0) {
+        IoBench::runIoBench(argc - 2, argv + 2);
     } else {
         fprintf(stderr, "Invalid command: %s\n\n", argv[1]);
         usage();
@@ -14,58 +14,80 @@ Authors:
 
 Revision History:
 
-    
+    Memory maps files and splits them into chunks that are counted on all of the processors, so that a single huge
+    FASTQ is counted as fast as the storage can deliver it, and counts newlines sixteen bytes at a time when the
+    words aren't wanted.  Reads gzipped files through the parallel decompressor.
+
 --*/
 
 #include "stdafx.h"
 #include "Compat.h"
+#include "DataReader.h"
+#include "Util.h"
 #include "exit.h"
 
+#if     defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
 void usage()
 {
-    fprintf(stderr,"usage: wc [-lwc] [files]\n");
+    fprintf(stderr,"usage: wc [-lwc] [-t threads] [files]\n");
+    fprintf(stderr,"       Files whose names end in .gz are decompressed first.\n");
     soft_exit(1);
 }
 
+//
+// The counts for one chunk of a memory mapped file.  Chunks are counted as if they started outside of a word, so
+// putting them back together needs to know whether a chunk starts in the middle of a word, and whether the previous
+// chunks ended in one.
+//
+struct ChunkCounts {
+    _uint64     lines, words;
+    bool        startsWithWord;     // The first separator or word character is a word character
+    bool        hasBoundary;        // There's a separator or word character at all
+    _uint64     endNotInAWord;      // The state after the last of them, if there is one
+};
+
 struct InputFile {
-    InputFile() : lines(0), words(0), chars(0), next(NULL) {}
+    InputFile() : lines(0), words(0), chars(0), next(NULL), streamed(false), nChunks(0), chunks(NULL) {}
 
     char *fileName;
     _uint64  lines, words, chars;
     InputFile *next;
-};
-
-SingleWaiterObject allThreadsDone;
-volatile _int64 nRunningThreads;
 
-void WorkerThreadMain(void *context)
-{
-    InputFile *inputFile = (InputFile *)context;
+    bool        streamed;           // stdin or gzipped, so it's read in order by one thread and not mapped
+    unsigned    nChunks;
+    ChunkCounts *chunks;
+};
 
-    FILE *file;
+//
+// Each piece of work is either a chunk of a mapped file or the whole of a streamed one.
+//
+struct WorkItem {
+    InputFile  *inputFile;
+    unsigned    chunk;
+};
 
-    if (!strcmp(inputFile->fileName, "-")) {
-        file = stdin;
-    } else {
-        file = fopen(inputFile->fileName, "rb");
-        if (NULL == file) {
-            fprintf(stderr,"wc: unable to open input file '%s'\n", inputFile->fileName);
-            soft_exit(1);
-        }
-    }
+const size_t ChunkSize = 64 * 1024 * 1024;
 
-    const size_t bufferSize = 8 * 1024 * 1024;    // A decent disk IO size
-    unsigned char *buffer = new unsigned char[bufferSize];
+WorkItem *workItems;
+_int64 nWorkItems;
+volatile _int64 nextWorkItem = 0;
+bool countWords;
 
-    _uint64 lines = 0, words = 0, chars = 0;
+SingleWaiterObject allThreadsDone;
+volatile _int64 nRunningThreads;
 
-    //
-    // Rather than using conditional branches, use lookup tables.
-    //
-    int isSeparator[256];
-    int isLineBreak[256];
-    int isWordPart[256];
+//
+// Rather than using conditional branches, use lookup tables.
+//
+int isSeparator[256];
+int isLineBreak[256];
+int isWordPart[256];
 
+void InitializeTables()
+{
     for (int x = 0; x < 256; x++) {
         isSeparator[x] = isLineBreak[x] = isWordPart[x] = 0;
     }
@@ -98,48 +120,202 @@ void WorkerThreadMain(void *context)
     for (int x = '0'; x <= '9'; x++) {
         isWordPart[x] = 1;
     }
+}
+
+    _uint64
+CountLineBreaks(const unsigned char *buffer, size_t length)
+{
+    _uint64 lines = 0;
+    size_t i = 0;
 
+#if     defined(__SSE2__) || defined(_M_X64)
     //
-    // Now process the input file.
+    // Each byte of counts goes down by one (the compare gives -1) for each newline in its lane.  It can only hold 255
+    // of them, so they're summed up into lines every 255 blocks.
     //
-    _uint64 notInAWord = 1;
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+    while (length - i >= 16) {
+        size_t nBlocks = __min((length - i) / 16, (size_t)255);
+        __m128i counts = zero;
+        for (size_t block = 0; block < nBlocks; block++, i += 16) {
+            counts = _mm_sub_epi8(counts, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buffer + i)), newline));
+        }
+        __m128i sums = _mm_sad_epu8(counts, zero);
+        lines += (unsigned)_mm_cvtsi128_si32(sums) + (unsigned)_mm_extract_epi16(sums, 4);
+    }
+#endif  // SSE2
+
+    for (; i < length; i++) {
+        lines += isLineBreak[buffer[i]];
+    }
 
-    size_t validBytes;
-    while (0 != (validBytes = fread(buffer, 1, bufferSize, file))) {
-        chars += validBytes;
+    return lines;
+}
 
-        for (size_t i = 0; i < validBytes; i++) {
-            unsigned char nextChar = buffer[i];
+    void
+CountWordsAndLines(const unsigned char *buffer, size_t length, _uint64 *lines, _uint64 *words, _uint64 *notInAWord)
+{
+    for (size_t i = 0; i < length; i++) {
+        unsigned char nextChar = buffer[i];
 
-            lines += isLineBreak[nextChar];
+        *lines += isLineBreak[nextChar];
 
-            //
-            // Use branch-free logic to compute the word count.
-            //
-            words += notInAWord * isWordPart[nextChar];    // if (notInAWord && isWordPart) words++
+        //
+        // Use branch-free logic to compute the word count.
+        //
+        *words += *notInAWord * isWordPart[nextChar];    // if (notInAWord && isWordPart) words++
 
-            notInAWord = 1 - ((1 - isSeparator[nextChar]) * (1 - notInAWord)); // notInAWord = isSeparator || notInAWord 
-            notInAWord = notInAWord * (1 - isWordPart[nextChar]); // notInAWord = notInAWord && !isWordPart
-        } // for each char of the buffer
-    }
+        *notInAWord = 1 - ((1 - isSeparator[nextChar]) * (1 - *notInAWord)); // notInAWord = isSeparator || notInAWord
+        *notInAWord = *notInAWord * (1 - isWordPart[nextChar]); // notInAWord = notInAWord && !isWordPart
+    } // for each char of the buffer
+}
 
-    if (!feof(file)) {
-        fprintf(stderr,"Error reading file '%s'\n", inputFile->fileName);
+    void
+CountChunk(InputFile *inputFile, unsigned chunk)
+{
+    _int64 offset = (_int64)chunk * ChunkSize;
+    size_t length = (size_t)__min((_int64)ChunkSize, (_int64)inputFile->chars - offset);
+
+    void *contents;
+    MemoryMappedFile *mappedFile = OpenMemoryMappedFile(inputFile->fileName, offset, length, &contents, false, true);
+    if (NULL == mappedFile) {
+        fprintf(stderr,"wc: unable to map input file '%s'\n", inputFile->fileName);
         soft_exit(1);
     }
+    const unsigned char *buffer = (const unsigned char *)contents;
+
+    ChunkCounts *counts = &inputFile->chunks[chunk];
+    counts->lines = counts->words = 0;
+    counts->startsWithWord = counts->hasBoundary = false;
+    counts->endNotInAWord = 1;
+
+    if (!countWords) {
+        counts->lines = CountLineBreaks(buffer, length);
+    } else {
+        _uint64 notInAWord = 1;
+        CountWordsAndLines(buffer, length, &counts->lines, &counts->words, &notInAWord);
+
+        //
+        // Characters that are neither separators nor parts of words leave the state alone, so it's the first and last of
+        // the others that matter.
+        //
+        size_t first;
+        for (first = 0; first < length && !isSeparator[buffer[first]] && !isWordPart[buffer[first]]; first++) {
+            // This loop body intentionally left blank.
+        }
+        if (first < length) {
+            counts->hasBoundary = true;
+            counts->startsWithWord = 0 != isWordPart[buffer[first]];
+            counts->endNotInAWord = notInAWord;
+        }
+    }
+
+    CloseMemoryMappedFile(mappedFile);
+}
+
+    void
+CountStreamedFile(InputFile *inputFile)
+{
+    _uint64 lines = 0, words = 0, chars = 0;
+    _uint64 notInAWord = 1;
+
+    if (!strcmp(inputFile->fileName, "-")) {
+        const size_t bufferSize = 8 * 1024 * 1024;    // A decent disk IO size
+        unsigned char *buffer = new unsigned char[bufferSize];
+
+        size_t validBytes;
+        while (0 != (validBytes = fread(buffer, 1, bufferSize, stdin))) {
+            chars += validBytes;
+            if (countWords) {
+                CountWordsAndLines(buffer, validBytes, &lines, &words, &notInAWord);
+            } else {
+                lines += CountLineBreaks(buffer, validBytes);
+            }
+        }
+
+        if (!feof(stdin)) {
+            fprintf(stderr,"Error reading stdin\n");
+            soft_exit(1);
+        }
+        delete [] buffer;
+    } else {
+        //
+        // Gzipped, which the decompressor does on all of the processors.
+        //
+        DataReader *reader = DataSupplier::ForFile(inputFile->fileName, true, true)->getDataReader();
+        if (!reader->init(inputFile->fileName)) {
+            fprintf(stderr,"wc: unable to open input file '%s'\n", inputFile->fileName);
+            soft_exit(1);
+        }
+        reader->reinit(0, DataSupplier::InputFileSize(inputFile->fileName));
+
+        for (;;) {
+            char *buffer;
+            _int64 validBytes, startBytes;
+            if (!reader->getData(&buffer, &validBytes, &startBytes)) {
+                if (reader->isEOF()) {
+                    break;
+                }
+                reader->nextBatch();
+                continue;
+            }
+
+            chars += startBytes;
+            if (countWords) {
+                CountWordsAndLines((const unsigned char *)buffer, startBytes, &lines, &words, &notInAWord);
+            } else {
+                lines += CountLineBreaks((const unsigned char *)buffer, startBytes);
+            }
+            reader->advance(startBytes);
+            if (reader->isEOF()) {
+                break;
+            }
+            reader->nextBatch();
+        }
+        delete reader;
+    }
 
     inputFile->chars = chars;
     inputFile->words = words;
     inputFile->lines = lines;
+}
+
+void WorkerThreadMain(void *context)
+{
+    _int64 item;
+    while ((item = InterlockedAdd64AndReturnNewValue(&nextWorkItem, 1) - 1) < nWorkItems) {
+        if (workItems[item].inputFile->streamed) {
+            CountStreamedFile(workItems[item].inputFile);
+        } else {
+            CountChunk(workItems[item].inputFile, workItems[item].chunk);
+        }
+    }
 
-    fclose(file);
-    delete [] buffer;
- 
     if (0 == InterlockedAdd64AndReturnNewValue(&nRunningThreads, -1)) {
         SignalSingleWaiterObject(&allThreadsDone);
     }
 }
 
+//
+// Adds up the chunks of a mapped file, not counting the first word of a chunk again if the last one ended inside it.
+//
+void AddUpChunks(InputFile *inputFile)
+{
+    _uint64 notInAWord = 1;
+    for (unsigned i = 0; i < inputFile->nChunks; i++) {
+        ChunkCounts *counts = &inputFile->chunks[i];
+        inputFile->lines += counts->lines;
+        inputFile->words += counts->words;
+        if (counts->startsWithWord && 0 == notInAWord) {
+            inputFile->words--;
+        }
+        if (counts->hasBoundary) {
+            notInAWord = counts->endNotInAWord;
+        }
+    }
+}
+
 void printOutputLine(
     _uint64     chars,
     _uint64     words,
@@ -166,6 +342,7 @@ void printOutputLine(
 int main(int argc, char* argv[])
 {
     bool cmdLinePrintChars = false, cmdLinePrintWords = false, cmdLinePrintLines = false, seenStdin = false;
+    unsigned nThreads = GetNumberOfProcessors();
 
     InputFile *inputFiles = NULL;
     InputFile *lastInputFile = NULL;
@@ -173,7 +350,12 @@ int main(int argc, char* argv[])
     _uint64 nInputFiles = 0;
 
     for (int i = 1; i < argc; i++) {
-        if (argv[i][0] == '-' && argv[i][1] != '\0') {
+        if (!strcmp(argv[i], "-t")) {
+            if (i + 1 >= argc || 0 == (nThreads = atoi(argv[i + 1]))) {
+                usage();
+            }
+            i++;
+        } else if (argv[i][0] == '-' && argv[i][1] != '\0') {
             //
             // Option.
             //
@@ -216,21 +398,6 @@ int main(int argc, char* argv[])
         nInputFiles = 1;
     }
 
-    //
-    // Fire up a thread for each file.
-    //
-    CreateSingleWaiterObject(&allThreadsDone);
-    nRunningThreads = nInputFiles;
-
-    InputFile *inputFile = inputFiles;
-    while (NULL != inputFile) {
-        StartNewThread(WorkerThreadMain, inputFile);
-        inputFile = inputFile->next;
-    }
-    WaitForSingleWaiterObject(&allThreadsDone);
-
-	_uint64 chars = 0, words = 0, lines = 0;
-
     bool printChars, printWords, printLines;
 
     if (cmdLinePrintChars || cmdLinePrintWords || cmdLinePrintLines) {
@@ -241,8 +408,58 @@ int main(int argc, char* argv[])
         printChars = printWords = printLines = true;
     }
 
-    inputFile = inputFiles;
+    countWords = printWords;
+    InitializeTables();
+    DataSupplier::ThreadCount = nThreads;
+
+    //
+    // Streamed files go first, so that they're started before the chunks of the mapped ones, which take up the rest of
+    // the threads.  A mapped file's size is its character count.
+    //
+    nWorkItems = 0;
+    for (InputFile *inputFile = inputFiles; NULL != inputFile; inputFile = inputFile->next) {
+        if (!strcmp(inputFile->fileName, "-") || util::stringEndsWith(inputFile->fileName, ".gz")) {
+            inputFile->streamed = true;
+            nWorkItems++;
+        } else {
+            _int64 size = QueryFileSize(inputFile->fileName);
+            if (size < 0) {
+                fprintf(stderr,"wc: unable to open input file '%s'\n", inputFile->fileName);
+                soft_exit(1);
+            }
+            inputFile->chars = size;
+            inputFile->nChunks = (unsigned)((size + ChunkSize - 1) / ChunkSize);
+            inputFile->chunks = new ChunkCounts[inputFile->nChunks];
+            nWorkItems += inputFile->nChunks;
+        }
+    }
+
+    workItems = new WorkItem[nWorkItems];
+    _int64 item = 0;
+    for (int streamed = 1; streamed >= 0; streamed--) {
+        for (InputFile *inputFile = inputFiles; NULL != inputFile; inputFile = inputFile->next) {
+            if (inputFile->streamed == (1 == streamed)) {
+                for (unsigned chunk = 0; chunk < (inputFile->streamed ? 1 : inputFile->nChunks); chunk++) {
+                    workItems[item].inputFile = inputFile;
+                    workItems[item].chunk = chunk;
+                    item++;
+                }
+            }
+        }
+    }
+
+    CreateSingleWaiterObject(&allThreadsDone);
+    nRunningThreads = nThreads;
+    for (unsigned i = 0; i < nThreads; i++) {
+        StartNewThread(WorkerThreadMain, NULL);
+    }
+    WaitForSingleWaiterObject(&allThreadsDone);
+
+	_uint64 chars = 0, words = 0, lines = 0;
+
+    InputFile *inputFile = inputFiles;
     while (NULL != inputFile) {
+        AddUpChunks(inputFile);
         printOutputLine(inputFile->chars, inputFile->words, inputFile->lines, inputFile->fileName, printChars, printWords, printLines);
 
         chars += inputFile->chars;
@@ -256,4 +473,3 @@ int main(int argc, char* argv[])
         printOutputLine(chars, words, lines, "Totals", printChars, printWords, printLines);
     }
 }
-
@@ -0,0 +1,32 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "ApproximateCounter.h"
+#include <math.h>
+
+//
+// The counts it gives are what the hash tables are sized from, so they need to be close at both ends of the range.
+//
+TEST("ApproximateCounter estimates distinct counts within a few percent") {
+    unsigned counts[] = {10, 1000, 200000};
+    for (unsigned c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        ApproximateCounter counter;
+        for (int pass = 0; pass < 3; pass++) {      // Repeats don't count
+            for (unsigned i = 0; i < counts[c]; i++) {
+                counter.add((_uint64)i * 7919 + 13);
+            }
+        }
+        double error = fabs((double)counter.getCount() - counts[c]) / counts[c];
+        ASSERT(error < 0.05);
+    }
+}
+
+TEST("ApproximateCounter merge counts the union") {
+    ApproximateCounter evens, odds, all;
+    for (_uint64 i = 0; i < 50000; i++) {
+        (i % 2 == 0 ? evens : odds).add(i);
+        all.add(i);
+    }
+    evens.merge(&odds);
+    ASSERT_EQ(all.getCount(), evens.getCount());
+}
@@ -0,0 +1,141 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "BandedAligner.h"
+
+//
+// The plain dynamic program over the whole matrix, with the cells off the band left out.
+//
+static int naiveBandedEditDistance(const char *text, int textLen, const char *pattern, int patternLen, int dLow, int dHigh, bool freeTextEnd,
+                                   bool freeTextStart = false)
+{
+    const int infinity = 1 << 20;
+    int *rows = new int[2 * (textLen + 1)];
+    int *previous = rows;
+    int *current = rows + textLen + 1;
+    for (int j = 0; j <= textLen; j++) {
+        previous[j] = (j >= dLow && j <= dHigh) ? (freeTextStart ? 0 : j) : infinity;
+    }
+    for (int i = 1; i <= patternLen; i++) {
+        for (int j = 0; j <= textLen; j++) {
+            if (j - i < dLow || j - i > dHigh) {
+                current[j] = infinity;
+                continue;
+            }
+            int best = previous[j] + 1;
+            if (j > 0) {
+                best = __min(best, previous[j - 1] + (text[j - 1] == pattern[i - 1] ? 0 : 1));
+                best = __min(best, current[j - 1] + 1);
+            }
+            current[j] = best;
+        }
+        int *swap = previous;
+        previous = current;
+        current = swap;
+    }
+
+    int result = infinity;
+    if (freeTextEnd) {
+        for (int j = 0; j <= textLen; j++) {
+            result = __min(result, previous[j]);
+        }
+    } else {
+        result = previous[textLen];
+    }
+    delete [] rows;
+    return result >= infinity ? -1 : result;
+}
+
+TEST("BandedAligner simple strings") {
+    BandedAligner aligner;
+    ASSERT_EQ(0, aligner.computeEditDistance("ACGTACGT", 8, "ACGTACGT", 8, -2, 2));
+    ASSERT_EQ(1, aligner.computeEditDistance("ACGTACGT", 8, "ACGAACGT", 8, -2, 2));
+    ASSERT_EQ(1, aligner.computeEditDistance("ACGTACGT", 8, "ACGACGT", 7, -2, 2));
+    ASSERT_EQ(1, aligner.computeEditDistance("ACGTACGT", 8, "ACGTTACGT", 9, -2, 2));
+    ASSERT_EQ(-1, aligner.computeEditDistance("ACGTACGT", 8, "ACGT", 4, -2, 2));     // The end is off the band
+
+    int textUsed;
+    ASSERT_EQ(0, aligner.computeEditDistance("ACGTACGTTTTT", 12, "ACGTACGT", 8, -2, 4, &textUsed));
+    ASSERT_EQ(8, textUsed);
+}
+
+TEST("BandedAligner matches the plain dynamic program") {
+    BandedAligner aligner;
+    unsigned seed = 12345;
+    char text[700], pattern[700];
+    for (int trial = 0; trial < 300; trial++) {
+        int patternLen = 1 + (int)((seed = seed * 1103515245 + 12345) >> 16) % 600;
+        for (int i = 0; i < patternLen; i++) {
+            pattern[i] = "ACGT"[((seed = seed * 1103515245 + 12345) >> 16) % 4];
+        }
+
+        //
+        // The text is the pattern with some edits, so the interesting part of the matrix is near the main diagonal.
+        //
+        int textLen = 0;
+        for (int i = 0; i < patternLen && textLen < (int)sizeof(text) - 2; i++) {
+            unsigned r = ((seed = seed * 1103515245 + 12345) >> 16) % 100;
+            if (r < 5) {
+                text[textLen++] = "ACGT"[r % 4];
+            } else if (r < 10) {
+                // Deleted
+            } else if (r < 15) {
+                text[textLen++] = pattern[i];
+                text[textLen++] = "ACGT"[r % 4];
+            } else {
+                text[textLen++] = pattern[i];
+            }
+        }
+
+        int diagonal = textLen - patternLen;
+        int dLow = __min(0, diagonal) - (int)(((seed = seed * 1103515245 + 12345) >> 16) % 40);
+        int dHigh = __max(0, diagonal) + (int)(((seed = seed * 1103515245 + 12345) >> 16) % 40);
+
+        ASSERT_EQ(naiveBandedEditDistance(text, textLen, pattern, patternLen, dLow, dHigh, false),
+                  aligner.computeEditDistance(text, textLen, pattern, patternLen, dLow, dHigh));
+
+        int textUsed;
+        int score = aligner.computeEditDistance(text, textLen, pattern, patternLen, dLow, dHigh, &textUsed);
+        ASSERT_EQ(naiveBandedEditDistance(text, textLen, pattern, patternLen, dLow, dHigh, true), score);
+        if (score >= 0) {
+            ASSERT_EQ(score, naiveBandedEditDistance(text, textUsed, pattern, patternLen, dLow, dHigh, false));
+        }
+    }
+}
+
+TEST("BandedAligner finds a pattern anywhere in a window") {
+    BandedAligner aligner;
+    int textEnd, secondBest, secondEnd;
+    ASSERT_EQ(0, aligner.findPattern("TTTTACGTACGATTTT", 16, "ACGTACGA", 8, &textEnd, &secondBest, &secondEnd));
+    ASSERT_EQ(12, textEnd);
+    ASSERT_EQ(1, aligner.findPattern("GGGGACGTTCGAGGGG", 16, "ACGTACGA", 8, &textEnd, &secondBest, &secondEnd));
+    ASSERT_EQ(12, textEnd);
+    ASSERT_EQ(-1, aligner.findPattern("ACGT", 4, "ACGTACGA", 8, &textEnd, &secondBest, &secondEnd));    // Longer than the window
+
+    unsigned seed = 54321;
+    char text[2000], pattern[200];
+    for (int trial = 0; trial < 100; trial++) {
+        int patternLen = 50 + (int)((seed = seed * 1103515245 + 12345) >> 16) % 150;     // One word to four
+        int textLen = patternLen + (int)((seed = seed * 1103515245 + 12345) >> 16) % 1500;
+        for (int i = 0; i < patternLen; i++) {
+            pattern[i] = "ACGT"[((seed = seed * 1103515245 + 12345) >> 16) % 4];
+        }
+        for (int j = 0; j < textLen; j++) {
+            text[j] = "ACGT"[((seed = seed * 1103515245 + 12345) >> 16) % 4];
+        }
+
+        //
+        // Put the pattern somewhere in the window with a couple of substitutions.
+        //
+        int start = (int)((seed = seed * 1103515245 + 12345) >> 16) % (textLen - patternLen + 1);
+        memcpy(text + start, pattern, patternLen);
+        text[start + patternLen / 3] = text[start + patternLen / 3] == 'A' ? 'C' : 'A';
+        text[start + 2 * patternLen / 3] = text[start + 2 * patternLen / 3] == 'G' ? 'T' : 'G';
+
+        int score = aligner.findPattern(text, textLen, pattern, patternLen, &textEnd, &secondBest, &secondEnd);
+        ASSERT_EQ(naiveBandedEditDistance(text, textLen, pattern, patternLen, -patternLen, textLen, true, true), score);
+        ASSERT(score <= 2);
+        ASSERT(textEnd >= patternLen && textEnd <= textLen);
+        ASSERT(secondBest == -1 || (secondBest >= score && abs(secondEnd - textEnd) > patternLen / 2));
+    }
+}
@@ -0,0 +1,181 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "BaseAligner.h"
+#include "CandidateVerifier.h"
+#include "GenomeIndex.h"
+#include "Read.h"
+#include "SeedSequencer.h"
+
+//
+// A random genome with a 400 base segment repeated, with a few differences each time, all through it, so that reads
+// from the repeats have plenty of candidates, many of them in the same hash table element.
+//
+static const unsigned VerifierGenomeBases = 200 * 1000;
+static const unsigned VerifierPadding = 500;
+static const unsigned RepeatLength = 400;
+static const unsigned RepeatCopies = 60;
+
+static unsigned NextRandom(_uint64 *state)
+{
+    *state = *state * 6364136223846793005ull + 1442695040888963407ull;
+    return (unsigned)(*state >> 33);
+}
+
+static char RandomBase(_uint64 *state)
+{
+    return "ACGT"[NextRandom(state) & 3];
+}
+
+static Genome *BuildVerifierGenome()
+{
+    _uint64 state = 17;
+    char *bases = new char[VerifierGenomeBases + 1];
+    for (unsigned i = 0; i < VerifierGenomeBases; i++) {
+        bases[i] = RandomBase(&state);
+    }
+    for (unsigned copy = 1; copy < RepeatCopies; copy++) {
+        char *to = bases + copy * (VerifierGenomeBases / RepeatCopies);
+        memcpy(to, bases, RepeatLength);
+        for (unsigned i = 0; i < 4; i++) {
+            to[NextRandom(&state) % RepeatLength] = RandomBase(&state);
+        }
+    }
+    bases[VerifierGenomeBases] = '\0';
+
+    char paddingBases[VerifierPadding + 1];
+    memset(paddingBases, 'n', VerifierPadding);
+    paddingBases[VerifierPadding] = '\0';
+    Genome *genome = new Genome(VerifierGenomeBases + 2 * VerifierPadding, VerifierGenomeBases + 2 * VerifierPadding, VerifierPadding);
+    genome->addData(paddingBases);
+    genome->startContig("chr1");
+    genome->addData(bases);
+    genome->addData(paddingBases);
+    genome->fillInContigLengths();
+    delete [] bases;
+    return genome;
+}
+
+//
+// A read from the genome at location, with substitutions and single base indels.
+//
+static void MakeRead(const Genome *genome, unsigned location, unsigned nEdits, _uint64 *state, char *o_data, unsigned readLength)
+{
+    const char *text = genome->getSubstring(location, readLength + 2 * nEdits);
+    unsigned textPos = 0;
+    for (unsigned i = 0; i < readLength; i++) {
+        unsigned edit = nEdits > 0 ? NextRandom(state) % (readLength / nEdits) : 1;
+        if (0 == edit % 7 && edit > 0) {
+            o_data[i] = RandomBase(state);      // substitution
+            textPos++;
+        } else if (0 == edit) {
+            o_data[i] = text[textPos++];        // deletion from the read
+            textPos++;
+        } else if (1 == edit) {
+            o_data[i] = RandomBase(state);      // insertion
+        } else {
+            o_data[i] = text[textPos++];
+        }
+    }
+}
+
+//
+// The host batch verifier scores whole batches at the limit each started with, which has to come to the same
+// alignments as the default verifier's one candidate at a time, whatever the batch size.  So does the SIMD verifier,
+// which also only runs LV on the candidates its vector pass finds within the limit.  Most of this genome's elements have
+// just one candidate, so the SIMD verifiers here make a pass for however few lanes there are.
+//
+TEST("Batched candidate verification gives the same alignments as one at a time") {
+    static const char *directory = "verifiertest.idx";
+    initializeLVProbabilitiesToPhredPlus33();   // as AlignerOptions does
+    InitializeSeedSequencers();                 // and main
+    Genome *genome = BuildVerifierGenome();
+    ASSERT(GenomeIndex::BuildIndexToDirectory(genome, 20, 0.3, NULL, directory, 50, GetNumberOfProcessors(), VerifierPadding, false, 4));  // which deletes the genome
+    GenomeIndex *index = GenomeIndex::loadFromDirectory((char *)directory);
+    ASSERT(NULL != index);
+
+    static const unsigned readLength = 150;
+    static const unsigned maxHits = 300;
+    static const unsigned maxK = 14;
+    static const unsigned batchSizes[] = {1, 3, 48};
+    static const unsigned nHostAligners = sizeof(batchSizes) / sizeof(batchSizes[0]);
+    static const unsigned simdBatchSizes[] = {1, 16, 48};
+    static const unsigned nAligners = nHostAligners + sizeof(simdBatchSizes) / sizeof(simdBatchSizes[0]) + 1;
+    BaseAligner *aligners[nAligners];
+    LandauVishkin<1> *lv[nAligners];
+    LandauVishkin<-1> *reverseLV[nAligners];
+    CandidateVerifier *verifiers[nAligners];
+    for (unsigned i = 0; i < nAligners; i++) {
+        lv[i] = new LandauVishkin<1>;
+        reverseLV[i] = new LandauVishkin<-1>;
+        aligners[i] = new BaseAligner(index, maxHits, maxK, readLength, 25, 0, 2, lv[i], reverseLV[i]);
+        aligners[i]->setExplorePopularSeeds(true);
+        aligners[i]->setMapqToStopAt(20);     // which moves the limit both ways, so batches see it lowered and raised partway through
+        verifiers[i] = NULL;    // aligner 0 keeps its own verifier
+        if (i > nHostAligners) {
+            verifiers[i] = new SimdBatchVerifier(lv[i], reverseLV[i], simdBatchSizes[i - nHostAligners - 1], 1);
+        } else if (i > 0) {
+            verifiers[i] = new HostBatchVerifier(lv[i], reverseLV[i], batchSizes[i - 1]);
+        }
+        aligners[i]->setCandidateVerifier(verifiers[i]);
+    }
+
+    _uint64 state = 5;
+    char data[readLength];
+    char quality[readLength];
+    memset(quality, 'I', readLength);
+    const Genome *indexGenome = index->getGenome();
+    unsigned genomeStart = indexGenome->getContigs()[0].beginningOffset;
+    for (unsigned r = 0; r < 2000; r++) {
+        //
+        // Half of the reads come from the repeats.
+        //
+        unsigned location;
+        if (r % 2 == 0) {
+            location = (NextRandom(&state) % RepeatCopies) * (VerifierGenomeBases / RepeatCopies) + NextRandom(&state) % (RepeatLength - readLength);
+        } else {
+            location = NextRandom(&state) % (VerifierGenomeBases - readLength - 2 * maxK);
+        }
+        MakeRead(indexGenome, genomeStart + location, r % 15, &state, data, readLength);
+        Read read;
+        read.init("read", 4, data, quality, readLength);
+
+        GenomeLocation genomeLocation[nAligners];
+        Direction direction[nAligners];
+        int score[nAligners];
+        int mapq[nAligners];
+        AlignmentResult result[nAligners];
+        for (unsigned i = 0; i < nAligners; i++) {
+            result[i] = aligners[i]->AlignRead(&read, &genomeLocation[i], &direction[i], &score[i], &mapq[i]);
+        }
+        for (unsigned i = 1; i < nAligners; i++) {
+            ASSERT_EQ(result[0], result[i]);
+            ASSERT_EQ(mapq[0], mapq[i]);
+            if (NotFound != result[0]) {
+                ASSERT_EQ(genomeLocation[0], genomeLocation[i]);
+                ASSERT_EQ(direction[0], direction[i]);
+                ASSERT_EQ(score[0], score[i]);
+            }
+        }
+    }
+    for (unsigned i = 1; i < nAligners; i++) {
+        ASSERT_EQ(aligners[0]->getLocationsScored(), aligners[i]->getLocationsScored());
+    }
+
+    for (unsigned i = 0; i < nAligners; i++) {
+        delete aligners[i];
+        delete verifiers[i];
+        delete lv[i];
+        delete reverseLV[i];
+    }
+    delete index;
+
+    // The directory itself stays, as microbench.idx does.
+    static const char *files[] = {"BiasTable", "Genome", "GenomeIndex", "GenomeIndexHash", "GenomeIndexSections", "OverflowTable",
+                                  "OverflowTablePopularity"};
+    for (unsigned i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+        char path[256];
+        snprintf(path, sizeof(path), "%s%c%s", directory, PATH_SEP, files[i]);
+        DeleteSingleFile(path);
+    }
+}
@@ -0,0 +1,466 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "Bam.h"
+#include "Cram.h"
+#include "DataReader.h"
+#include "DataWriter.h"
+#include "Genome.h"
+#include "exit.h"
+
+//
+// Two contigs of pseudo-random bases after 10 bases of padding each.  changedBase, if it's not -1, is a position in chr1
+// that gets a different base, so that the genome no longer matches the one a file was written against.
+//
+static const int Chr1Length = 1000;
+static const int Chr2Length = 600;
+
+static void BuildCramTestGenome(Genome *genome, int changedBase)
+{
+    static const char acgt[] = "ACGT";
+    char bases[Chr1Length + 1];
+    unsigned seed = 12345;
+    const char *names[] = {"chr1", "chr2"};
+    const int lengths[] = {Chr1Length, Chr2Length};
+    for (int contig = 0; contig < 2; contig++) {
+        for (int i = 0; i < lengths[contig]; i++) {
+            seed = seed * 1103515245 + 12345;
+            bases[i] = acgt[(seed >> 16) & 3];
+        }
+        if (contig == 0 && changedBase >= 0) {
+            bases[changedBase] = bases[changedBase] == 'A' ? 'C' : 'A';
+        }
+        bases[lengths[contig]] = '\0';
+        genome->addData("nnnnnnnnnn");
+        genome->startContig(names[contig]);
+        genome->addData(bases);
+    }
+    genome->addData("nnnnnnnnnn");
+    genome->fillInContigLengths();
+    genome->sortContigsByName();
+}
+
+static void CopyReferenceBases(const Genome *genome, int contig, int pos, int length, char *o_bases)
+{
+    ASSERT_EQ((_int64)length, Cram::CopyReference(genome, contig, pos, length, o_bases));
+}
+
+//
+// Appends a BAM record to buffer; qualities are in SAM's printable form and aux is already BAM encoded.
+//
+static size_t AppendBamRecord(char *buffer, const char *name, int flag, int refID, int pos, int mapq, const char *cigar,
+    const char *seq, const char *qual, int nextRefID, int nextPos, int tlen, const char *aux, unsigned auxBytes)
+{
+    _uint32 ops[20];
+    int nOps = 0;
+    for (const char *p = cigar; *p != '\0'; p++) {
+        int count = 0;
+        while (*p >= '0' && *p <= '9') {
+            count = count * 10 + (*p++ - '0');
+        }
+        ops[nOps++] = (count << 4) | BAMAlignment::CigarToCode[(_uint8)*p];
+    }
+    int length = (int)strlen(seq);
+    size_t size = BAMAlignment::size((unsigned)strlen(name) + 1, nOps, length, auxBytes);
+    BAMAlignment *bam = (BAMAlignment *)buffer;
+    bam->block_size = (_int32)(size - sizeof(bam->block_size));
+    bam->refID = refID;
+    bam->pos = pos;
+    bam->l_read_name = (_uint8)(strlen(name) + 1);
+    bam->MAPQ = (_uint8)mapq;
+    bam->n_cigar_op = (_uint16)nOps;
+    bam->FLAG = (_uint16)flag;
+    bam->l_seq = length;
+    bam->next_refID = nextRefID;
+    bam->next_pos = nextPos;
+    bam->tlen = tlen;
+    strcpy(bam->read_name(), name);
+    memcpy(bam->cigar(), ops, nOps * sizeof(_uint32));
+    BAMAlignment::encodeSeq(bam->seq(), (char *)seq, length);
+    for (int i = 0; i < length; i++) {
+        bam->qual()[i] = qual[i] - '!';
+    }
+    memcpy(bam->firstAux(), aux, auxBytes);
+    bam->bin = (_uint16)BAMAlignment::reg2bin(pos, pos + __max(1, Cram::ReferenceLength(bam)));
+    return size;
+}
+
+//
+// Writes the header and then the records, as SimpleReadWriter does.
+//
+static void WriteCram(const char *fileName, const Genome *genome, const char *header, size_t headerBytes, const char *records,
+    size_t recordBytes)
+{
+    DataWriterSupplier *supplier = DataWriterSupplier::create(fileName, DataWriterSupplier::cram(), FileEncoder::cram(genome, true));
+    DataWriter *writer = supplier->getWriter();
+    char *buffer;
+    size_t size;
+    writer->inHeader(true);
+    ASSERT(writer->getBuffer(&buffer, &size) && size >= headerBytes);
+    memcpy(buffer, header, headerBytes);
+    writer->advance((unsigned)headerBytes, 0);
+    writer->nextBatch();
+    writer->inHeader(false);
+    for (size_t offset = 0; offset < recordBytes; ) {
+        size_t bytes = ((BAMAlignment *)(records + offset))->size();
+        ASSERT(writer->getBuffer(&buffer, &size) && size >= bytes);
+        memcpy(buffer, records + offset, bytes);
+        writer->advance((unsigned)bytes, 0);
+        offset += bytes;
+    }
+    writer->close();
+    delete writer;
+    supplier->close();
+    delete supplier;
+}
+
+//
+// Reads the whole file back, header and records, into o_data.
+//
+static void ReadCram(const char *fileName, const Genome *genome, char *o_data, size_t dataSize, size_t *o_headerBytes, size_t *o_bytes)
+{
+    DataSupplier *supplier = DataSupplier::CramSupplier(genome, true);
+    DataReader *reader = supplier->getDataReader();
+    ASSERT(reader->init(fileName));
+    _int64 headerBytes = 0;
+    reader->readHeader(&headerBytes);
+    *o_headerBytes = (size_t)headerBytes;
+    reader->reinit(0, 0);
+    *o_bytes = 0;
+    for (;;) {
+        char *buffer;
+        _int64 bytes;
+        if (reader->getData(&buffer, &bytes)) {
+            ASSERT(*o_bytes + bytes <= dataSize);
+            memcpy(o_data + *o_bytes, buffer, bytes);
+            *o_bytes += bytes;
+            reader->advance(bytes);
+        }
+        if (reader->isEOF()) {
+            break;
+        }
+        reader->nextBatch();
+    }
+    delete reader;
+    delete supplier;
+}
+
+//
+// The records go out against the reference, as substitutions, insertions, deletions and clips of it, with their mates'
+// positions and their tags, and have to come back as the same BAM records.  A genome that differs from the one they were
+// written against has to fail the slice MD5 check rather than quietly give back different bases.
+//
+TEST("CRAM round trip gives back the BAM records, and checks the reference MD5") {
+    Genome genome(Chr1Length + Chr2Length + 30, Chr1Length + Chr2Length + 30, 10);
+    BuildCramTestGenome(&genome, -1);
+
+    static const char headerText[] = "@HD\tVN:1.4\tSO:coordinate\n@SQ\tSN:chr1\tLN:1000\n@SQ\tSN:chr2\tLN:600\n";
+    char header[1024];
+    BAMHeader *bamHeader = (BAMHeader *)header;
+    bamHeader->magic = BAMHeader::BAM_MAGIC;
+    bamHeader->l_text = (_int32)strlen(headerText);
+    memcpy(bamHeader->text(), headerText, strlen(headerText));
+    bamHeader->n_ref() = 2;
+    BAMHeaderRefSeq *refSeq = bamHeader->firstRefSeq();
+    const char *names[] = {"chr1", "chr2"};
+    const int lengths[] = {Chr1Length, Chr2Length};
+    for (int i = 0; i < 2; i++) {
+        refSeq->l_name = (_int32)strlen(names[i]) + 1;
+        strcpy(refSeq->name(), names[i]);
+        refSeq->l_ref() = lengths[i];
+        refSeq = refSeq->next();
+    }
+    size_t headerBytes = (char *)refSeq - header;
+
+    static const char quals[] = "!#%')+-/13579;=?ACEGI#%')+-/13579;=?ACEGI#%')+-/13579;=?ACEGI";
+    static const char nmTag[] = {'N', 'M', 'C', 2};
+    static const char xsTag[] = {'X', 'S', 'Z', 'h', 'i', '\0', 'A', 'S', 'i', 7, 0, 0, 0};
+    char records[4096];
+    size_t recordBytes = 0;
+    char seq[64];
+    char ref[64];
+
+    // exactly the reference, the first end of a pair
+    CopyReferenceBases(&genome, 0, 100, 50, seq);
+    seq[50] = '\0';
+    recordBytes += AppendBamRecord(records + recordBytes, "pair1", SAM_MULTI_SEGMENT | SAM_ALL_ALIGNED | SAM_FIRST_SEGMENT | SAM_NEXT_REVERSED,
+        0, 100, 60, "50M", seq, quals, 0, 300, 250, nmTag, sizeof(nmTag));
+
+    // two substitutions and an N, a soft clip, an insertion and a deletion
+    CopyReferenceBases(&genome, 0, 200, 50, ref);
+    memcpy(seq, "ACGTA", 5);
+    memcpy(seq + 5, ref, 20);
+    memcpy(seq + 25, "GG", 2);
+    memcpy(seq + 27, ref + 20, 10);
+    memcpy(seq + 37, ref + 33, 13);
+    seq[8] = seq[8] == 'A' ? 'T' : 'A';
+    seq[30] = seq[30] == 'C' ? 'G' : 'C';
+    seq[40] = 'N';
+    seq[50] = '\0';
+    recordBytes += AppendBamRecord(records + recordBytes, "edits", SAM_REVERSE_COMPLEMENT, 0, 200, 37, "5S20M2I10M3D13M", seq, quals,
+        -1, -1, 0, xsTag, sizeof(xsTag));
+
+    // the second end of the pair
+    CopyReferenceBases(&genome, 0, 300, 50, seq);
+    seq[50] = '\0';
+    recordBytes += AppendBamRecord(records + recordBytes, "pair1", SAM_MULTI_SEGMENT | SAM_ALL_ALIGNED | SAM_LAST_SEGMENT | SAM_REVERSE_COMPLEMENT,
+        0, 300, 60, "50M", seq, quals + 3, 0, 100, -250, nmTag, sizeof(nmTag));
+
+    // on the other contig, right up against its end
+    CopyReferenceBases(&genome, 1, Chr2Length - 40, 40, seq);
+    seq[40] = '\0';
+    recordBytes += AppendBamRecord(records + recordBytes, "chr2end", 0, 1, Chr2Length - 40, 12, "40M", seq, quals + 5, -1, -1, 0, NULL, 0);
+
+    // and unmapped
+    recordBytes += AppendBamRecord(records + recordBytes, "unmapped", SAM_UNMAPPED, -1, -1, 0, "", "TTGACCANGTACGTAC", quals + 7, -1, -1, 0,
+        NULL, 0);
+
+    const char *fileName = "cramtest.cram";
+    WriteCram(fileName, &genome, header, headerBytes, records, recordBytes);
+
+    static const size_t dataSize = 64 * 1024;
+    char *data = new char[dataSize];
+    size_t readHeaderBytes, readBytes;
+    ReadCram(fileName, &genome, data, dataSize, &readHeaderBytes, &readBytes);
+
+    //
+    // The header gets M5 tags on its @SQ lines, but has the same references.
+    //
+    BAMHeader *readHeader = (BAMHeader *)data;
+    ASSERT_EQ(BAMHeader::BAM_MAGIC, readHeader->magic);
+    ASSERT_EQ(2, readHeader->n_ref());
+    ASSERT(NULL != strstr(readHeader->text(), "\tM5:"));
+    refSeq = readHeader->firstRefSeq();
+    for (int i = 0; i < 2; i++) {
+        ASSERT(0 == strcmp(names[i], refSeq->name()));
+        ASSERT_EQ(lengths[i], refSeq->l_ref());
+        refSeq = refSeq->next();
+    }
+    ASSERT_EQ((size_t)((char *)refSeq - data), readHeaderBytes);
+
+    ASSERT_EQ(recordBytes, readBytes - readHeaderBytes);
+    for (size_t offset = 0; offset < recordBytes; ) {
+        BAMAlignment *written = (BAMAlignment *)(records + offset);
+        BAMAlignment *read = (BAMAlignment *)(data + readHeaderBytes + offset);
+        ASSERT(0 == strcmp(written->read_name(), read->read_name()));
+        ASSERT_EQ(written->size(), read->size());
+        ASSERT(0 == memcmp(written, read, written->size()));
+        offset += written->size();
+    }
+
+    //
+    // Reading it against a genome with a base changed under the first slice has to fail.  The reader soft_exits, so have
+    // that throw instead.
+    //
+    Genome changed(Chr1Length + Chr2Length + 30, Chr1Length + Chr2Length + 30, 10);
+    BuildCramTestGenome(&changed, 250);
+    bool failed = false;
+    SetSoftExitThrows(true);
+    try {
+        ReadCram(fileName, &changed, data, dataSize, &readHeaderBytes, &readBytes);
+    } catch (const SoftExitException &) {
+        failed = true;
+    }
+    SetSoftExitThrows(false);
+    ASSERT(failed);
+
+    delete [] data;
+    DeleteSingleFile(fileName);
+}
+
+//
+// The writer doesn't use rANS, but htslib does by default, so the reader's decoder is checked against an encoder here:
+// rANS 4x8 as htslib writes it, order 0 or 1, with frequencies that add up to 4096.
+//
+static const int RansTotalFrequency = 4096;
+
+//
+// A symbol (or order 1 context) of a table; one that follows a present one is written with the count of present ones
+// after it, and those aren't written at all.
+//
+static void PutRansSymbol(CramBuffer *out, const bool *present, int j, int *io_rle)
+{
+    if (*io_rle > 0) {
+        (*io_rle)--;
+        return;
+    }
+    out->putByte((_uint8)j);
+    if (j > 0 && present[j - 1]) {
+        int end = j + 1;
+        while (end < 256 && present[end]) {
+            end++;
+        }
+        *io_rle = end - (j + 1);
+        out->putByte((_uint8)*io_rle);
+    }
+}
+
+static void PutRansFrequencies(CramBuffer *out, const int *freqs)
+{
+    bool present[256];
+    for (int j = 0; j < 256; j++) {
+        present[j] = freqs[j] > 0;
+    }
+    int rle = 0;
+    for (int j = 0; j < 256; j++) {
+        if (! present[j]) {
+            continue;
+        }
+        PutRansSymbol(out, present, j, &rle);
+        if (freqs[j] < 128) {
+            out->putByte((_uint8)freqs[j]);
+        } else {
+            out->putByte((_uint8)(0x80 | (freqs[j] >> 8)));
+            out->putByte((_uint8)freqs[j]);
+        }
+    }
+    out->putByte(0);
+}
+
+// scales counts to add up to RansTotalFrequency, keeping every symbol that's there
+static void NormalizeRansFrequencies(const int *counts, int *o_freqs, int *o_starts)
+{
+    int total = 0;
+    for (int j = 0; j < 256; j++) {
+        total += counts[j];
+    }
+    int sum = 0;
+    int largest = 0;
+    for (int j = 0; j < 256; j++) {
+        o_freqs[j] = counts[j] == 0 ? 0 : __max(1, (int)((_int64)counts[j] * RansTotalFrequency / total));
+        sum += o_freqs[j];
+        if (o_freqs[j] > o_freqs[largest]) {
+            largest = j;
+        }
+    }
+    if (total > 0) {
+        o_freqs[largest] += RansTotalFrequency - sum;
+    }
+    for (int j = 0, start = 0; j < 256; j++) {
+        o_starts[j] = start;
+        start += o_freqs[j];
+    }
+}
+
+// the order 1 context a symbol is decoded in: each state starts its quarter in context 0, and the last state goes on into the remainder
+static int RansContext(const _uint8 *in, int i, int quarter)
+{
+    bool follows = i < 4 * quarter ? i % quarter != 0 : i > 0;
+    return follows ? in[i - 1] : 0;
+}
+
+static void RansEncodeSymbol(_uint32 *state, int freq, int start, CramBuffer *io_bytes)
+{
+    _uint32 x = *state;
+    _uint32 xMax = (((1u << 23) >> 12) << 8) * freq;
+    while (x >= xMax) {
+        io_bytes->putByte((_uint8)x);
+        x >>= 8;
+    }
+    *state = ((x / freq) << 12) + (x % freq) + start;
+}
+
+static void RansCompress(const _uint8 *in, int n, int order, CramBuffer *out)
+{
+    int nContexts = order == 0 ? 1 : 256;
+    int quarter = n / 4;
+    int *counts = new int[256 * nContexts];
+    int *freqs = new int[256 * nContexts];
+    int *starts = new int[256 * nContexts];
+    memset(counts, 0, 256 * nContexts * sizeof(int));
+    for (int i = 0; i < n; i++) {
+        counts[256 * (order == 0 ? 0 : RansContext(in, i, quarter)) + in[i]]++;
+    }
+
+    CramBuffer tables;
+    bool used[256];
+    for (int context = 0; context < nContexts; context++) {
+        used[context] = false;
+        for (int j = 0; j < 256; j++) {
+            used[context] |= counts[256 * context + j] > 0;
+        }
+        NormalizeRansFrequencies(counts + 256 * context, freqs + 256 * context, starts + 256 * context);
+    }
+    int rle = 0;
+    for (int context = 0; context < nContexts; context++) {
+        if (used[context]) {
+            if (order == 1) {
+                PutRansSymbol(&tables, used, context, &rle);
+            }
+            PutRansFrequencies(&tables, freqs + 256 * context);
+        }
+    }
+    if (order == 1) {
+        tables.putByte(0);
+    }
+
+    //
+    // Encode in the reverse of the order the decoder reads, so that the bytes come out backwards.
+    //
+    _uint32 state[4] = {1u << 23, 1u << 23, 1u << 23, 1u << 23};
+    CramBuffer bytes;
+    if (order == 0) {
+        for (int i = n - 1; i >= 0; i--) {
+            RansEncodeSymbol(&state[i % 4], freqs[in[i]], starts[in[i]], &bytes);
+        }
+    } else {
+        for (int i = n - 1; i >= 4 * quarter; i--) {
+            int at = 256 * RansContext(in, i, quarter) + in[i];
+            RansEncodeSymbol(&state[3], freqs[at], starts[at], &bytes);
+        }
+        for (int i = quarter - 1; i >= 0; i--) {
+            for (int k = 3; k >= 0; k--) {
+                int at = 256 * RansContext(in, i + k * quarter, quarter) + in[i + k * quarter];
+                RansEncodeSymbol(&state[k], freqs[at], starts[at], &bytes);
+            }
+        }
+    }
+
+    out->clear();
+    out->putByte((_uint8)order);
+    out->putInt32((_int32)(tables.used + 4 * sizeof(_uint32) + bytes.used));
+    out->putInt32(n);
+    out->append(tables.data, tables.used);
+    for (int k = 0; k < 4; k++) {
+        out->putInt32((_int32)state[k]);
+    }
+    for (size_t i = bytes.used; i > 0; i--) {
+        out->putByte(bytes.data[i - 1]);
+    }
+    delete [] counts;
+    delete [] freqs;
+    delete [] starts;
+}
+
+TEST("CRAM rANS blocks decode, order 0 and order 1") {
+    static const int sizes[] = {1, 3, 4, 7, 1000, 4099};
+    _uint8 *in = new _uint8[4099];
+    srand(3);
+    for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++) {
+        int n = sizes[s];
+        for (int i = 0; i < n; i++) {
+            // skewed, like qualities, and with runs so that order 1 has something to work with
+            in[i] = i > 0 && rand() % 3 == 0 ? in[i - 1] : (_uint8)('#' + (rand() % 8) * (rand() % 5));
+        }
+        for (int order = 0; order < 2; order++) {
+            CramBuffer compressed;
+            RansCompress(in, n, order, &compressed);
+            Cram::Block block;
+            block.method = Cram::Rans4x8Method;
+            block.contentType = Cram::ExternalContent;
+            block.contentId = 1;
+            block.data = compressed.data;
+            block.compressedBytes = compressed.used;
+            block.rawBytes = n;
+            CramBuffer uncompressed;
+            ASSERT(Cram::uncompressBlock(block, &uncompressed));
+            ASSERT_EQ((size_t)n, uncompressed.used);
+            ASSERT(0 == memcmp(in, uncompressed.data, n));
+
+            // and a block that claims to be longer than it is doesn't decode
+            block.rawBytes = n + 1;
+            ASSERT(! Cram::uncompressBlock(block, &uncompressed));
+        }
+    }
+    delete [] in;
+}
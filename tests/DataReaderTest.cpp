@@ -0,0 +1,114 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "DataReader.h"
+
+//
+// The remote reader has several reads going at once from its own threads, and they have to come back in order and
+// overlap exactly as the local readers' do, over the whole file and over ranges of it.  It reads local files too (via
+// GenericFile), so it's tested on one.
+//
+TEST("RemoteDataReader reads ranges in order") {
+    static const char *fileName = "datareadertest.dat";
+    static const _int64 fileSize = 11 * 1024 * 1024 + 12345;    // several buffers, not a whole number of them
+    static const _int64 overflowBytes = 1000;
+
+    FILE *file = fopen(fileName, "wb");
+    ASSERT(NULL != file);
+    for (_int64 i = 0; i < fileSize; i++) {
+        fputc((int)((i * 7 + i / 251) & 0xff), file);
+    }
+    fclose(file);
+
+    static const _int64 ranges[][2] = {{0, 0}, {5 * 1024 * 1024 + 17, 3 * 1024 * 1024}, {fileSize - 10, 10}};
+    DataReader *reader = DataSupplier::Remote[true]->getDataReader(overflowBytes);
+    ASSERT(reader->init(fileName));
+    for (int range = 0; range < 3; range++) {
+        _int64 start = ranges[range][0];
+        _int64 end = 0 == ranges[range][1] ? fileSize : start + ranges[range][1];
+        reader->reinit(start, ranges[range][1]);
+
+        _int64 expectedOffset = start;
+        char *buffer;
+        _int64 validBytes, startBytes;
+        while (true) {
+            if (!reader->getData(&buffer, &validBytes, &startBytes)) {
+                reader->nextBatch();
+                if (!reader->getData(&buffer, &validBytes, &startBytes)) {
+                    break;
+                }
+            }
+            ASSERT_EQ(expectedOffset, reader->getFileOffset());
+            ASSERT(startBytes <= validBytes && validBytes <= startBytes + overflowBytes);
+            for (_int64 i = 0; i < validBytes; i++) {
+                _int64 offset = expectedOffset + i;
+                ASSERT_EQ((char)((offset * 7 + offset / 251) & 0xff), buffer[i]);
+            }
+            reader->advance(startBytes);
+            expectedOffset += startBytes;
+        }
+        ASSERT_EQ(end, expectedOffset);
+    }
+
+    delete reader;
+    DeleteSingleFile(fileName);
+}
+
+//
+// The readers grow their read-ahead when the consumer has to wait for a read, adding buffers if the consumer is holding
+// on to the ones there are.  Hold on to several batches at a time, as the aligner threads do, and check that the data
+// still comes back in order as the buffers come and go.
+//
+TEST("Read-ahead grows under batches the consumer holds on to") {
+    static const char *fileName = "datareadertest2.dat";
+    static const _int64 fileSize = 60 * 1024 * 1024 + 4321;
+    static const _int64 overflowBytes = 1000;
+    static const int batchesHeld = 5;
+
+    FILE *file = fopen(fileName, "wb");
+    ASSERT(NULL != file);
+    for (_int64 i = 0; i < fileSize; i++) {
+        fputc((int)((i * 13 + i / 509) & 0xff), file);
+    }
+    fclose(file);
+
+    DataReader *reader = DataSupplier::Remote[false]->getDataReader(overflowBytes);
+    ASSERT(reader->init(fileName));
+    reader->reinit(0, 0);
+
+    DataBatch held[batchesHeld];
+    int nHeld = 0;
+    _int64 expectedOffset = 0;
+    char *buffer;
+    _int64 validBytes, startBytes;
+    while (true) {
+        if (!reader->getData(&buffer, &validBytes, &startBytes)) {
+            if (nHeld == batchesHeld) {
+                reader->releaseBatch(held[0]);
+                for (int i = 1; i < batchesHeld; i++) {
+                    held[i - 1] = held[i];
+                }
+                nHeld--;
+            }
+            held[nHeld++] = reader->getBatch();
+            reader->nextBatch();
+            if (!reader->getData(&buffer, &validBytes, &startBytes)) {
+                break;
+            }
+        }
+        ASSERT_EQ(expectedOffset, reader->getFileOffset());
+        for (_int64 i = 0; i < validBytes; i++) {
+            _int64 offset = expectedOffset + i;
+            ASSERT_EQ((char)((offset * 13 + offset / 509) & 0xff), buffer[i]);
+        }
+        reader->advance(startBytes);
+        expectedOffset += startBytes;
+    }
+    ASSERT_EQ(fileSize, expectedOffset);
+    for (int i = 0; i < nHeld; i++) {
+        reader->releaseBatch(held[i]);
+    }
+
+    delete reader;
+    DeleteSingleFile(fileName);
+}
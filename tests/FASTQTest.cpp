@@ -0,0 +1,65 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "FASTQ.h"
+
+//
+// Every record has to be counted in exactly one chunk, including ones that skipPartialRecord won't take as a place to
+// start (an R in the bases) and qualities that start with an @, so that finding a record by number lands on it.
+//
+TEST("FASTQRecordIndex finds records by number") {
+    static const char *fileName = "fastqtest.fq";
+    static const unsigned nRecords = 60000;     // A few of the index's chunks
+
+    ReaderContext context;
+    context.genome = NULL;
+    context.defaultReadGroup = "";
+    context.clipping = NoClipping;
+    context.paired = false;
+    context.ignoreSecondaryAlignments = true;
+    context.header = NULL;
+    context.headerLength = context.headerBytes = 0;
+    context.headerMatchesIndex = false;
+    context.rangeIndex = 0;
+    context.rangeCount = 1;
+    context.trimmer = NULL;
+    context.screen = NULL;
+
+    FILE *file = fopen(fileName, "wb");
+    ASSERT(NULL != file);
+    srand(1);
+    for (unsigned i = 0; i < nRecords; i++) {
+        unsigned length = 50 + rand() % 200;
+        fprintf(file, "@r%u\n", i);
+        for (unsigned j = 0; j < length; j++) {
+            fputc(i % 7 == 0 && j == length / 2 ? 'R' : "ACGT"[rand() % 4], file);
+        }
+        fprintf(file, "\n+\n");
+        for (unsigned j = 0; j < length; j++) {
+            fputc(i % 5 == 0 && j == 0 ? '@' : '!' + rand() % 42, file);
+        }
+        fputc('\n', file);
+    }
+    fclose(file);
+    ASSERT(DataSupplier::InputFileSize(fileName) > 3 * FASTQRecordIndex::ChunkBytes);
+
+    FASTQRecordIndex *index = FASTQRecordIndex::create(DataSupplier::Default[true], fileName, 3, context);
+    ASSERT_EQ((_int64)nRecords, index->getRecordCount());
+
+    FASTQReader *reader = FASTQReader::create(DataSupplier::Default[true], fileName, 0, 0, context);
+    ASSERT_EQ(DataSupplier::InputFileSize(fileName), index->getRecordOffset(reader, nRecords));
+    for (unsigned i = 0; i < nRecords; i += 997) {
+        _int64 offset = index->getRecordOffset(reader, i);
+        reader->reinitAtRecord(offset, 1);
+        Read read;
+        ASSERT(reader->getNextRead(&read));
+        char id[20];
+        snprintf(id, sizeof(id), "r%u", i);
+        ASSERT_EQ(strlen(id), (size_t)read.getIdLength());
+        ASSERT(0 == memcmp(id, read.getId(), read.getIdLength()));
+    }
+
+    delete reader;
+    delete index;
+    remove(fileName);
+}
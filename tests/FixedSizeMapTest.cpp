@@ -0,0 +1,64 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "FixedSizeMap.h"
+#include "FixedSizeSet.h"
+#include <map>
+
+//
+// Checks the map against std::map through puts, overwrites, erases (which leave tombstones once groups fill) and
+// lots of clears, so stale groups from earlier epochs get reused.
+//
+TEST("FixedSizeMap matches std::map across clears") {
+    FixedSizeMap<_uint64, int> *map = new FixedSizeMap<_uint64, int>(64);
+
+    for (int round = 0; round < 300; round++) {
+        std::map<_uint64, int> expected;
+        int nKeys = 1 + (round * 7) % 60;
+        for (int i = 0; i < nKeys * 2; i++) {
+            _uint64 key = (_uint64)((i * 2654435761u + round) % 97) * 1024;   // few distinct keys, so overwrites and erases of present keys
+            if (i % 3 == 2) {
+                map->erase(key);
+                expected.erase(key);
+            } else if ((int)expected.size() < 63 || expected.count(key) != 0) {
+                map->put(key, i + round);
+                expected[key] = i + round;
+            }
+            ASSERT_EQ((int)expected.size(), map->getSize());
+        }
+
+        for (_uint64 key = 0; key < 97 * 1024; key += 1024) {
+            ASSERT_EQ(expected.count(key) == 0 ? 0 : expected[key], map->get(key));
+        }
+
+        int nIterated = 0;
+        for (FixedSizeMap<_uint64, int>::iterator i = map->begin(); i != map->end(); i = map->next(i)) {
+            ASSERT(expected.count(map->key(i)) != 0);
+            ASSERT_EQ(expected[map->key(i)], map->value(i));
+            nIterated++;
+        }
+        ASSERT_EQ((int)expected.size(), nIterated);
+
+        map->clear();
+        ASSERT_EQ(0, map->getSize());
+        ASSERT_EQ(0, map->get(0));
+    }
+
+    delete map;
+}
+
+TEST("FixedSizeSet holds exactly what was added") {
+    FixedSizeSet<unsigned> set(32);
+    for (unsigned i = 0; i < 20; i++) {
+        set.add(i * 16);
+        set.add(i * 16);
+    }
+    ASSERT_EQ(20, set.getSize());
+    for (unsigned i = 0; i < 20 * 16; i++) {
+        ASSERT_EQ(0 == i % 16, set.contains(i));
+    }
+
+    set.clear();
+    ASSERT(!set.contains(0));
+    ASSERT_EQ(0, set.getSize());
+}
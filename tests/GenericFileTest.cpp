@@ -0,0 +1,120 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "GenericFile.h"
+#include "DataWriter.h"
+#include <string>
+
+//
+// A file in memory that reads in parallel the way remote ones do, so it exercises readAtInParallel.
+//
+class MemoryGenericFile : public GenericFile
+{
+public:
+    MemoryGenericFile(const char *i_contents, size_t i_size) : contents(i_contents), size(i_size), position(0) {}
+
+    virtual size_t read(void *ptr, size_t count) {
+        size_t bytesRead = readAt(ptr, count, position);
+        position += bytesRead;
+        return bytesRead;
+    }
+
+    virtual char *gets(char *buf, size_t count) { return NULL; }
+
+    virtual int advance(long byteOffset) { position += byteOffset; return 0; }
+
+    virtual int seek(_int64 offset) { position = offset; return 0; }
+
+    virtual size_t readAt(void *ptr, size_t count, _int64 offset) {
+        size_t amount = offset >= (_int64)size ? 0 : __min(count, size - (size_t)offset);
+        memcpy(ptr, contents + offset, amount);
+        return amount;
+    }
+
+    virtual _int64 getSize() { return size; }
+
+    virtual size_t readInParallel(void *ptr, size_t count) {
+        size_t bytesRead = readAtInParallel(ptr, count, position);
+        position += bytesRead;
+        return bytesRead;
+    }
+
+    virtual size_t write(const void *ptr, size_t count) { return 0; }
+
+    virtual void close() {}
+
+private:
+    const char *contents;
+    size_t size;
+    _int64 position;
+};
+
+TEST("GenericFile::readAtInParallel") {
+    static const size_t fileSize = 100 * 1024 * 1024 + 4321;    // many chunks, and a partial one at the end
+    char *contents = new char[fileSize];
+    for (size_t i = 0; i < fileSize; i++) {
+        contents[i] = (char)(i * 13 + i / 4099);
+    }
+    char *buffer = new char[fileSize];
+
+    MemoryGenericFile file(contents, fileSize);
+    ASSERT_EQ((size_t)99, file.readInParallel(buffer, 99));
+    ASSERT_EQ((size_t)(fileSize - 99 - 1000), file.readInParallel(buffer + 99, fileSize - 99 - 1000));
+    ASSERT_EQ((size_t)1000, file.readInParallel(buffer + fileSize - 1000, 2000));   // short at the end of the file
+    ASSERT_EQ(0, memcmp(contents, buffer, fileSize));
+
+    delete [] contents;
+    delete [] buffer;
+}
+
+//
+// A write-only file that appends to memory it doesn't own, the way a remote one can only be appended to.
+//
+class AppendOnlyGenericFile : public GenericFile
+{
+public:
+    AppendOnlyGenericFile(std::string *i_contents) : contents(i_contents) {}
+
+    virtual size_t read(void *ptr, size_t count) { return 0; }
+    virtual char *gets(char *buf, size_t count) { return NULL; }
+    virtual int advance(long byteOffset) { return -1; }
+    virtual int seek(_int64 offset) { return -1; }
+    virtual size_t readAt(void *ptr, size_t count, _int64 offset) { return 0; }
+    virtual _int64 getSize() { return contents->size(); }
+
+    virtual size_t write(const void *ptr, size_t count) {
+        contents->append((const char *)ptr, count);
+        return count;
+    }
+
+    virtual void close() {}
+
+private:
+    std::string *contents;
+};
+
+TEST("Remote output is appended in order however its writes arrive") {
+    std::string contents;
+    StdoutAsyncFile *file = new StdoutAsyncFile(new AppendOnlyGenericFile(&contents));
+    AsyncFile::Writer *writers[3];
+    for (int i = 0; i < 3; i++) {
+        writers[i] = file->getWriter();
+    }
+
+    char a[] = "aaaa", b[] = "bb", c[] = "cccccc", d[] = "d";
+    size_t aWritten = 0, bWritten = 0, cWritten = 0, dWritten = 0;
+    ASSERT(writers[2]->beginWrite(c, 6, 6, &cWritten));
+    ASSERT(writers[1]->beginWrite(b, 2, 4, &bWritten));
+    ASSERT(writers[0]->beginWrite(a, 4, 0, &aWritten));
+    ASSERT(writers[1]->beginWrite(d, 1, 12, &dWritten));
+    ASSERT(writers[2]->waitForCompletion());
+    for (int i = 0; i < 3; i++) {
+        ASSERT(writers[i]->close());
+        delete writers[i];
+    }
+    ASSERT((size_t)4 == aWritten && (size_t)2 == bWritten && (size_t)6 == cWritten && (size_t)1 == dWritten);
+
+    ASSERT(file->close());
+    ASSERT(contents == "aaaabbccccccd");
+    delete file;
+}
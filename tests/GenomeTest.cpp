@@ -0,0 +1,82 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "Genome.h"
+
+//
+// Three contigs of 5000 bases, each after 10 bases of padding, so that they straddle the contig lookup granules.
+//
+static void BuildThreeContigGenome(Genome *genome)
+{
+    char bases[5001];
+    memset(bases, 'A', 5000);
+    bases[5000] = '\0';
+    const char *names[] = {"chrX", "chrY", "chrM"};
+    for (int contig = 0; contig < 3; contig++) {
+        genome->addData("nnnnnnnnnn");
+        genome->startContig(names[contig]);
+        genome->addData(bases);
+    }
+    genome->addData("nnnnnnnnnn");
+    genome->fillInContigLengths();
+    genome->sortContigsByName();
+}
+
+TEST("Genome excludes just the contigs it's asked to") {
+    Genome genome(15100, 15100, 10);
+    BuildThreeContigGenome(&genome);
+
+    for (GenomeLocation location = 0; location < genome.getCountOfBases(); location++) {
+        ASSERT(!genome.isLocationExcluded(location));
+    }
+
+    ASSERT(genome.excludeContig("chrY"));
+    ASSERT(!genome.excludeContig("chr1"));
+
+    const Genome::Contig *chrY = &genome.getContigs()[1];
+    for (GenomeLocation location = 0; location < genome.getCountOfBases(); location++) {
+        bool inChrY = location >= chrY->beginningOffset && location < chrY->beginningOffset + chrY->length;
+        ASSERT_EQ(inChrY, genome.isLocationExcluded(location));
+    }
+
+    //
+    // The genome itself is just as it was.
+    //
+    ASSERT_EQ(15040, (int)genome.getCountOfBases());
+    ASSERT_EQ(3, genome.getNumContigs());
+    ASSERT(NULL != genome.getSubstring(chrY->beginningOffset, 100));
+}
+
+//
+// Callers read a little past either end of the genome (up to its 100 bases of padding), and get 'n' there whichever way
+// it was loaded.
+//
+TEST("A mapped genome reads the same as a loaded one, padding included") {
+    Genome genome(15100, 15100, 10);
+    BuildThreeContigGenome(&genome);
+    const char *fileName = "genometest-map.genome";
+    ASSERT(genome.saveToFile(fileName));
+
+    const Genome *loaded = Genome::loadFromFile(fileName, 10);
+    const Genome *mapped = Genome::mapFromFile(fileName, 10, false, false);
+    ASSERT(NULL != loaded && NULL != mapped);
+
+    const int padding = 100;
+    GenomeLocation nBases = genome.getCountOfBases();
+    ASSERT_EQ(nBases, mapped->getCountOfBases());
+    for (GenomeLocation location = 0; location < nBases; location += 10) {      // Pieces no longer than the contig padding can cross contigs
+        ASSERT_EQ(0, memcmp(loaded->getSubstring(location, 10), mapped->getSubstring(location, 10), 10));
+    }
+    const char *loadedEnd = loaded->getSubstring(nBases - 10, 10 + padding);
+    const char *mappedEnd = mapped->getSubstring(nBases - 10, 10 + padding);
+    const char *mappedStart = mapped->getSubstring(0, 1);
+    for (int i = 0; i < padding; i++) {
+        ASSERT_EQ('n', loadedEnd[10 + i]);
+        ASSERT_EQ('n', mappedEnd[10 + i]);
+        ASSERT_EQ('n', mappedStart[i - padding]);
+    }
+
+    delete loaded;
+    delete mapped;
+    DeleteSingleFile(fileName);
+}
@@ -0,0 +1,25 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "DataWriter.h"
+#include "GzipDataWriter.h"
+#include "Bam.h"
+
+TEST("Gzip compression level steps down across its range as the backlog grows") {
+    GzipWriterFilterSupplier* adaptive = DataWriterSupplier::gzip(true, BAM_BLOCK, 1, false, 2, 8);
+    ASSERT_EQ(8, adaptive->levelFor(0.0));
+    ASSERT_EQ(5, adaptive->levelFor(0.5));
+    ASSERT_EQ(2, adaptive->levelFor(1.0));
+    int previous = 9;
+    for (int i = 0; i <= 100; i++) {
+        int level = adaptive->levelFor(i / 100.0);
+        ASSERT(level <= previous && level >= 2 && level <= 8);
+        previous = level;
+    }
+    delete adaptive;
+
+    GzipWriterFilterSupplier* fixed = DataWriterSupplier::gzip(true, BAM_BLOCK, 1, false);
+    ASSERT_EQ(DataWriterSupplier::DefaultCompressionLevel, fixed->levelFor(0.0));
+    ASSERT_EQ(DataWriterSupplier::DefaultCompressionLevel, fixed->levelFor(1.0));
+    delete fixed;
+}
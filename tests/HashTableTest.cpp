@@ -0,0 +1,207 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "HashTable.h"
+
+//
+// Fill tables of both layouts most of the way and walk them in two pieces, the way indexstats does on two threads.
+//
+TEST("SeedCountIterator sees every entry once") {
+    for (int bucketized = 0; bucketized < 2; bucketized++) {
+        const unsigned nKeys = 800;
+        SNAPHashTable table(1000, 4, 0 != bucketized);
+        for (unsigned i = 0; i < nKeys; i++) {
+            GenomeLocation values[2] = {i, 0xfffffffe};
+            ASSERT(table.Insert((SeedBases)(i * 7919 + 13), values));
+        }
+
+        std::vector<int> seen(nKeys, 0);
+        unsigned nProbedPastHome = 0;
+        size_t middle = table.GetTableSize() / 2;
+        for (int piece = 0; piece < 2; piece++) {
+            SeedCountIterator iterator(&table, 0 == piece ? 0 : middle, 0 == piece ? middle : table.GetTableSize());
+            SeedBases key;
+            const GenomeLocation *values;
+            unsigned probes;
+            while (iterator.next(&key, &values, &probes)) {
+                ASSERT(values[0] < nKeys);
+                ASSERT(key == (SeedBases)(values[0] * 7919 + 13));
+                ASSERT_EQ(0xfffffffeu, values[1]);
+                seen[values[0]]++;
+                if (probes > 0) {
+                    nProbedPastHome++;
+                }
+            }
+        }
+
+        for (unsigned i = 0; i < nKeys; i++) {
+            ASSERT_EQ(1, seen[i]);
+        }
+        ASSERT(nProbedPastHome > 0);    // At this load, some keys can't be in their home slot (or bucket)
+    }
+}
+
+//
+// The lookups specialized for a key size have to agree with the general one, including for keys that differ only in their
+// last byte.
+//
+template <unsigned KeyBytes> static void checkKeySizedLookup(bool bucketized) {
+    const unsigned nKeys = 500;
+    SNAPHashTable table(700, KeyBytes, bucketized);
+    SeedBases topByte = (SeedBases)1 << ((KeyBytes - 1) * 8);
+    for (unsigned i = 0; i < nKeys; i++) {
+        GenomeLocation values[2] = {i, 0xfffffffe};
+        ASSERT(table.Insert((SeedBases)i * 7919 + 13, values));
+    }
+    for (unsigned i = 0; i < nKeys; i++) {
+        SeedBases key = (SeedBases)i * 7919 + 13;
+        GenomeLocation *entry = table.Lookup<KeyBytes>(key);
+        ASSERT(NULL != entry);
+        ASSERT_EQ(i, entry[0]);
+        ASSERT(entry == table.Lookup(key));
+        ASSERT(NULL == table.Lookup<KeyBytes>(key | topByte));
+    }
+}
+
+TEST("Key size specialized lookups match Lookup") {
+    for (int bucketized = 0; bucketized < 2; bucketized++) {
+        checkKeySizedLookup<4>(0 != bucketized);
+        checkKeySizedLookup<5>(0 != bucketized);
+        checkKeySizedLookup<6>(0 != bucketized);
+        checkKeySizedLookup<7>(0 != bucketized);
+        checkKeySizedLookup<8>(0 != bucketized);
+    }
+}
+
+//
+// Quotiented tables have to find every key, including the ones far enough from home to be escaped at this load, and
+// give each slot's key back, both as built and as saved and loaded back.
+//
+template <unsigned KeyBytes> static void checkQuotientedTable(const SNAPHashTable *table, unsigned nKeys, SeedBases keyMultiplier) {
+    for (unsigned i = 0; i < nKeys; i++) {
+        GenomeLocation *entry = table->Lookup<KeyBytes>((SeedBases)i * keyMultiplier + 13);
+        ASSERT(NULL != entry);
+        ASSERT_EQ(i, entry[0]);
+        ASSERT(NULL == table->Lookup<KeyBytes>((SeedBases)(i + nKeys) * keyMultiplier + 13));
+    }
+
+    std::vector<int> seen(nKeys, 0);
+    unsigned maxProbes = 0;
+    SeedCountIterator iterator(table, 0, table->GetTableSize());
+    SeedBases key;
+    const GenomeLocation *values;
+    unsigned probes;
+    while (iterator.next(&key, &values, &probes)) {
+        ASSERT(values[0] < nKeys);
+        ASSERT(key == (SeedBases)values[0] * keyMultiplier + 13);
+        seen[values[0]]++;
+        maxProbes = __max(maxProbes, probes);
+    }
+    for (unsigned i = 0; i < nKeys; i++) {
+        ASSERT_EQ(1, seen[i]);
+    }
+    ASSERT(maxProbes >= 15);     // So some keys were escaped
+}
+
+template <unsigned KeyBytes> static void checkQuotientedKeys() {
+    const unsigned nKeys = 90000;
+    const SeedBases keyMultiplier = ((SeedBases)1 << (8 * KeyBytes - 1)) / nKeys | 1;     // Spread over the whole key, with room for the misses
+    SNAPHashTable table(100000, KeyBytes, false, true);
+    ASSERT(table.HasQuotientedKeys());
+    ASSERT(table.GetBytesPerSlot() < SNAPHashTable::GetBytesPerSlot(KeyBytes, false));
+    for (unsigned i = 0; i < nKeys; i++) {
+        GenomeLocation values[2] = {i, 0xfffffffe};
+        ASSERT(table.Insert((SeedBases)i * keyMultiplier + 13, values));
+    }
+    ASSERT_EQ((size_t)nKeys, table.GetUsedElementCount());
+    checkQuotientedTable<KeyBytes>(&table, nKeys, keyMultiplier);
+
+    FILE *file = tmpfile();
+    ASSERT(table.saveToFile(file));
+    size_t fileSize = (size_t)_ftell64bit(file);
+    char *memory = new char[fileSize];
+    rewind(file);
+    ASSERT_EQ(fileSize, fread(memory, 1, fileSize, file));
+    fclose(file);
+
+    size_t bytesConsumed;
+    SNAPHashTable *loaded = SNAPHashTable::loadFromMemory(memory, fileSize, &bytesConsumed);
+    ASSERT_EQ(fileSize, bytesConsumed);
+    ASSERT(loaded->HasQuotientedKeys());
+    ASSERT(loaded->GetChecksum() == table.GetChecksum());
+    checkQuotientedTable<KeyBytes>(loaded, nKeys, keyMultiplier);
+    delete loaded;
+    delete [] memory;
+}
+
+TEST("Quotiented keys find every key and give them back") {
+    checkQuotientedKeys<4>();
+    checkQuotientedKeys<5>();
+    checkQuotientedKeys<6>();
+    checkQuotientedKeys<8>();
+
+    //
+    // Too small to save anything, and not for bucketized tables.
+    //
+    ASSERT(!SNAPHashTable(1000, 4, false, true).HasQuotientedKeys());
+    ASSERT(!SNAPHashTable(100000, 4, true, true).HasQuotientedKeys());
+}
+
+//
+// Values are whole GenomeLocations, so with LONG_GENOME_LOCATIONS ones past 4G come back from a saved table as they went in.
+//
+TEST("Values keep all of their bits through a save and load") {
+    const GenomeLocation highLocation = (GenomeLocation)1 << (GenomeLocationBits - 1);
+    for (int bucketized = 0; bucketized < 2; bucketized++) {
+        SNAPHashTable table(1000, 4, 0 != bucketized);
+        for (unsigned i = 0; i < 800; i++) {
+            GenomeLocation values[2] = {highLocation + i, InvalidGenomeLocation - 1};
+            ASSERT(table.Insert((SeedBases)(i * 7919 + 13), values));
+        }
+
+        FILE *file = tmpfile();
+        ASSERT(table.saveToFile(file));
+        size_t fileSize = (size_t)_ftell64bit(file);
+        char *memory = new char[fileSize];
+        rewind(file);
+        ASSERT_EQ(fileSize, fread(memory, 1, fileSize, file));
+        fclose(file);
+
+        size_t bytesConsumed;
+        SNAPHashTable *loaded = SNAPHashTable::loadFromMemory(memory, fileSize, &bytesConsumed);
+        for (unsigned i = 0; i < 800; i++) {
+            GenomeLocation *entry = loaded->Lookup((SeedBases)(i * 7919 + 13));
+            ASSERT(NULL != entry);
+            ASSERT(highLocation + i == entry[0]);
+            ASSERT(InvalidGenomeLocation - 1 == entry[1]);
+        }
+        delete loaded;
+        delete [] memory;
+    }
+}
+
+//
+// Building a table counts each key's steps past its home slot on the inserting thread's counters, which come to what the
+// keys' probe counts say.
+//
+TEST("Inserts count their probes on the thread's PerfCounters") {
+    PerfCounters counters;
+    PerfCounters::attach(&counters);
+    SNAPHashTable table(1000, 4, false);
+    for (unsigned i = 0; i < 800; i++) {
+        GenomeLocation values[2] = {i, 0xfffffffe};
+        ASSERT(table.Insert((SeedBases)(i * 7919 + 13), values));
+    }
+    PerfCounters::detach();
+
+    _int64 probesPastHome = 0;
+    SeedCountIterator iterator(&table, 0, table.GetTableSize());
+    SeedBases key;
+    const GenomeLocation *values;
+    unsigned probes;
+    while (iterator.next(&key, &values, &probes)) {
+        probesPastHome += probes;
+    }
+    ASSERT(probesPastHome > 0);
+    ASSERT_EQ(probesPastHome, counters.hashTableProbes);
+}
@@ -0,0 +1,45 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "Histogram.h"
+
+TEST("Histogram buckets are within a sixteenth of their values") {
+    ASSERT_EQ(0, Histogram::bucketFor(0));
+    ASSERT_EQ(15, Histogram::bucketFor(15));
+    ASSERT_EQ(Histogram::NBuckets - 1, Histogram::bucketFor(Histogram::MaxValue));
+    ASSERT_EQ(Histogram::NBuckets - 1, Histogram::bucketFor(Histogram::MaxValue * 4));
+    for (int b = 0; b < Histogram::NBuckets; b++) {
+        _int64 low = Histogram::getBucketMin(b), high = Histogram::getBucketMax(b);
+        ASSERT_EQ(b, Histogram::bucketFor(low));
+        ASSERT_EQ(b, Histogram::bucketFor(high));
+        ASSERT(high - low <= low / Histogram::SubBuckets);
+        if (b > 0) {
+            ASSERT_EQ(Histogram::getBucketMax(b - 1) + 1, low);
+        }
+    }
+}
+
+TEST("Histogram percentiles survive adding per-thread histograms together") {
+    Histogram threads[3], total;
+    for (_int64 i = 1; i <= 30000; i++) {
+        threads[i % 3].record(i);
+    }
+    for (int i = 0; i < 3; i++) {
+        total.add(&threads[i]);
+    }
+
+    ASSERT_EQ((_int64) 30000, total.getCount());
+    ASSERT_EQ((_int64) 30000 * 30001 / 2, total.getTotal());
+    ASSERT_EQ((_int64) 30000, total.getMax());
+    ASSERT_EQ((_int64) 30000, total.getPercentile(1.0));
+    static const double fractions[] = {0.01, 0.5, 0.9, 0.99};
+    for (int i = 0; i < 4; i++) {
+        _int64 exact = (_int64) (fractions[i] * 30000);
+        _int64 estimate = total.getPercentile(fractions[i]);
+        ASSERT(estimate >= exact && estimate <= exact + exact / Histogram::SubBuckets);
+    }
+
+    total.clear();
+    ASSERT_EQ((_int64) 0, total.getCount());
+    ASSERT_EQ((_int64) 0, total.getPercentile(0.5));
+}
@@ -0,0 +1,146 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "InputOrder.h"
+
+//
+// Each thread takes the next slice number, as it would from a ReadSupplierQueue, and writes a few reads from it through
+// a writer that appends what it's buffered to one shared output when it's flushed, as a data writer would when it
+// hands a batch to the file.
+//
+static const int InputOrderSlices = 2000;
+static const int InputOrderThreads = 8;
+static const int InputOrderBufferSize = 7;
+
+struct InputOrderOutput
+{
+    ExclusiveLock   lock;
+    _int64         *sequences;
+    int             nSequences;
+    volatile int    nextSlice;
+    volatile int    threadsDone;
+};
+
+class InputOrderTestWriter : public ReadWriter
+{
+public:
+    InputOrderTestWriter(InputOrderOutput *i_output) : output(i_output), nBuffered(0) {}
+
+    virtual bool writeHeader(const ReaderContext& context, bool sorted, int argc, const char **argv, const char *version, const char *rgLine)
+    {
+        return true;
+    }
+
+    virtual bool writeRead(Read *read, AlignmentResult result, int mapQuality, GenomeLocation genomeLocation, Direction direction,
+        const SpliceJunction *splice)
+    {
+        buffered[nBuffered++] = read->getInputSequence();
+        if (nBuffered == InputOrderBufferSize) {
+            flush();
+        }
+        return true;
+    }
+
+    virtual bool writeReads(int count, Read **reads, AlignmentResult *results, int *mapQualities, GenomeLocation *genomeLocations,
+        Direction *directions, const SpliceJunction **splices)
+    {
+        for (int i = 0; i < count; i++) {
+            writeRead(reads[i], NotFound, 0, 0, FORWARD, NULL);
+        }
+        return true;
+    }
+
+    virtual bool writePair(Read *read0, Read *read1, PairedAlignmentResult *result)
+    {
+        return false;
+    }
+
+    virtual bool flush()
+    {
+        if (0 == nBuffered) {
+            return true;
+        }
+        InputOrder::waitForTurn();
+        AcquireExclusiveLock(&output->lock);
+        for (int i = 0; i < nBuffered; i++) {
+            output->sequences[output->nSequences++] = buffered[i];
+        }
+        ReleaseExclusiveLock(&output->lock);
+        nBuffered = 0;
+        return true;
+    }
+
+    virtual void close()
+    {
+        flush();
+    }
+
+private:
+    InputOrderOutput   *output;
+    _int64              buffered[InputOrderBufferSize];
+    int                 nBuffered;
+};
+
+static void InputOrderTestThread(void *param)
+{
+    InputOrderOutput *output = (InputOrderOutput *)param;
+    ReadWriter *writer = InputOrder::wrap(new InputOrderTestWriter(output));
+    InputOrder::beginThread();
+
+    Read reads[20];
+    Read *readPointers[20];
+    for (;;) {
+        int slice = InterlockedIncrementAndReturnNewValue(&output->nextSlice) - 1;
+        if (slice >= InputOrderSlices) {
+            break;
+        }
+        // Slices of different sizes, written both ways, so the threads don't keep in step
+        int nReads = 1 + slice * 7 % 20;
+        for (int i = 0; i < nReads; i++) {
+            reads[i].setInputSequence(slice);
+            readPointers[i] = &reads[i];
+        }
+        if (slice % 2 == 0) {
+            writer->writeReads(nReads, readPointers, NULL, NULL, NULL, NULL, NULL);
+        } else {
+            for (int i = 0; i < nReads; i++) {
+                writer->writeRead(&reads[i], NotFound, 0, 0, FORWARD, NULL);
+            }
+        }
+    }
+
+    writer->close();
+    delete writer;
+    InputOrder::finishThread();
+    InterlockedIncrementAndReturnNewValue(&output->threadsDone);
+}
+
+TEST("InputOrder writes slices in order from many threads") {
+    InputOrderOutput output;
+    InitializeExclusiveLock(&output.lock);
+    output.sequences = new _int64[InputOrderSlices * 20];
+    output.nSequences = 0;
+    output.nextSlice = 0;
+    output.threadsDone = 0;
+
+    InputOrder::Enabled = true;
+    for (int i = 0; i < InputOrderThreads; i++) {
+        ASSERT(StartNewThread(InputOrderTestThread, &output));
+    }
+    while (output.threadsDone < InputOrderThreads) {
+        SleepForMillis(10);
+    }
+    InputOrder::Enabled = false;
+
+    int expected = 0;
+    for (int slice = 0; slice < InputOrderSlices; slice++) {
+        expected += 1 + slice * 7 % 20;
+    }
+    ASSERT_EQ(expected, output.nSequences);
+    for (int i = 1; i < output.nSequences; i++) {
+        ASSERT(output.sequences[i - 1] <= output.sequences[i]);
+    }
+
+    delete [] output.sequences;
+    DestroyExclusiveLock(&output.lock);
+}
@@ -0,0 +1,42 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "InsertSizeEstimator.h"
+
+TEST("InsertSizeEstimator narrows the window around the library's spacing") {
+    InsertSizeEstimator estimator(50, 1000, 1000);
+    unsigned spacings[100];
+    for (unsigned batch = 0; batch < 9; batch++) {
+        for (unsigned i = 0; i < 100; i++) {
+            spacings[i] = 300 + (i % 41) - 20;     // 280 to 320
+        }
+        estimator.addSamples(spacings, 100);
+    }
+
+    unsigned minSpacing, maxSpacing;
+    ASSERT(!estimator.isEstimated());
+    estimator.getSpacing(&minSpacing, &maxSpacing);
+    ASSERT_EQ(50u, minSpacing);
+    ASSERT_EQ(1000u, maxSpacing);
+
+    spacings[0] = 900;      // An outlier mustn't drag the window out
+    estimator.addSamples(spacings, 100);
+    ASSERT(estimator.isEstimated());
+    estimator.getSpacing(&minSpacing, &maxSpacing);
+    ASSERT(minSpacing >= 50 && minSpacing <= 280);
+    ASSERT(maxSpacing >= 320 && maxSpacing < 900);
+}
+
+TEST("InsertSizeEstimator stays within the range it was given") {
+    InsertSizeEstimator estimator(50, 400, 100);
+    unsigned spacings[100];
+    for (unsigned i = 0; i < 100; i++) {
+        spacings[i] = 100 + i * 3;
+    }
+    estimator.addSamples(spacings, 100);
+
+    unsigned minSpacing, maxSpacing;
+    estimator.getSpacing(&minSpacing, &maxSpacing);
+    ASSERT_EQ(50u, minSpacing);
+    ASSERT_EQ(400u, maxSpacing);
+}
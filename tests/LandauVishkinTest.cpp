@@ -127,3 +127,164 @@ TEST_F(LandauVishkinTest, "CIGAR strings") {
     lvc.computeEditDistance("abc", 3, "abXde", 5, 3, cigarBuf, bufLen, true);
     ASSERT_STREQ("5M", cigarBuf);
 }
+
+//
+// Long enough strings that the matching runs go through the sixteen at a time compare, with the differences at every
+// offset within and around the blocks, in both directions.
+//
+TEST_F(LandauVishkinTest, "long strings") {
+    const int len = 100;
+    char text[len + 16], pattern[len + 16], reversedTextBuffer[16 + len];
+    for (int i = 0; i < len + 16; i++) {
+        text[i] = "ACGT"[(i + i / 3 * 2) % 4];   // No two the same in a row, so dropping one always costs an edit
+    }
+    LandauVishkin<-1> reverseLV;    // Which reads the text backwards from just before where it's pointed, a word at a time
+    char *reversedText = reversedTextBuffer + 16;
+    for (int i = 0; i < len; i++) {
+        reversedText[len - 1 - i] = text[i];
+    }
+
+    for (int i = 0; i < len; i++) {
+        memcpy(pattern, text, sizeof(pattern));
+        ASSERT_EQ(0, lv.computeEditDistance(text, len, pattern, len, 2));
+
+        pattern[i] = 'N';
+        ASSERT_EQ(1, lv.computeEditDistance(text, len, pattern, len, 2));
+        ASSERT_EQ(1, reverseLV.computeEditDistance(reversedText + len, len, pattern, len, 2));
+        ASSERT_EQ(-1, lv.computeEditDistance(text, len, pattern, len, 0));
+
+        //
+        // Drop base i, so everything after it is on the next diagonal.
+        //
+        memcpy(pattern + i, text + i + 1, len - i);
+        ASSERT_EQ(1, lv.computeEditDistance(text, len + 1, pattern, len, 2));
+    }
+}
+
+//
+// Each range of k is computed in a differently sized band, and they should all agree.
+//
+TEST_F(LandauVishkinTest, "k in each band") {
+    const int len = 200;
+    char text[len + 16], pattern[len + 16];
+    for (int i = 0; i < len + 16; i++) {
+        text[i] = "ACGT"[(i + i / 3 * 2) % 4];
+    }
+    memcpy(pattern, text, sizeof(pattern));
+    for (int nEdits = 0; nEdits <= 40; nEdits++) {
+        if (nEdits > 0) {
+            pattern[nEdits * 4] = 'N';
+        }
+        for (int k = 1; k < MAX_K; k++) {
+            ASSERT_EQ(nEdits <= k ? nEdits : -1, lv.computeEditDistance(text, len, pattern, len, k));
+        }
+    }
+}
+
+//
+// BatchedEditDistance has to come up with LV's distance (or k + 1 where LV says -1) in every lane, whatever the mix of
+// lengths in the batch, in both directions, and with texts that run out before the pattern does.
+//
+TEST_F(LandauVishkinTest, "batched edit distances") {
+    const int Lanes = BatchedEditDistance::Lanes;
+    const int maxPatternLen = 250;
+    const int bufferSize = 2 * (maxPatternLen + 2 * MAX_K) + 32;     // LV looks a little past the ends
+    static char textBuffers[Lanes][bufferSize], patternBuffers[Lanes][bufferSize];
+    LandauVishkin<-1> reverseLV;
+    BatchedEditDistance batched;
+    unsigned seed = 4321;
+    for (int trial = 0; trial < 600; trial++) {
+        int textDirection = trial % 2 == 0 ? 1 : -1;
+        int k = trial % 7 == 0 ? MAX_K - 1 : (trial / 2) % 20;
+        int nPairs = 1 + (trial / 3) % Lanes;
+        const char *texts[Lanes], *patterns[Lanes];
+        int textLens[Lanes], patternLens[Lanes], distances[Lanes];
+        for (int lane = 0; lane < nPairs; lane++) {
+            char *textBuffer = textBuffers[lane], *pattern = patternBuffers[lane] + 16;
+            for (int i = 0; i < bufferSize; i++) {
+                textBuffer[i] = "ACGT"[((seed = seed * 1103515245 + 12345) >> 16) % 4];
+                patternBuffers[lane][i] = "ACGT"[((seed = seed * 1103515245 + 12345) >> 16) % 4];
+            }
+            int patternLen = (int)(((seed = seed * 1103515245 + 12345) >> 16) % (maxPatternLen + 1));
+            if (lane % 5 == 4) {
+                patternLen %= 8;    // Some that finish right away
+            }
+
+            //
+            // The text is the pattern with about nEdits edits, forwards from the start of the buffer or backwards from
+            // its middle, and then whatever else was in the buffer.
+            //
+            int nEdits = (int)(((seed = seed * 1103515245 + 12345) >> 16) % (k + 4));
+            char *text = 1 == textDirection ? textBuffer + 16 : textBuffer + bufferSize / 2;
+            int textLen = 0;
+            for (int i = 0; i < patternLen; i++) {
+                unsigned r = ((seed = seed * 1103515245 + 12345) >> 16) % (unsigned)__max(patternLen, 1);
+                char base = pattern[i];
+                if (r < (unsigned)nEdits) {
+                    if (r % 3 == 0) {
+                        base = "ACGT"[(r / 3) % 4];     // Substitution (or maybe not)
+                    } else if (r % 3 == 1) {
+                        continue;                       // Insertion in the pattern
+                    } else {
+                        text[textDirection * textLen - (1 == textDirection ? 0 : 1)] = "ACGT"[r % 4];   // Deletion from the pattern
+                        textLen++;
+                    }
+                }
+                text[textDirection * textLen - (1 == textDirection ? 0 : 1)] = base;
+                textLen++;
+            }
+            textLen += (int)(((seed = seed * 1103515245 + 12345) >> 16) % (2 * MAX_K)) - MAX_K / 2;
+
+            texts[lane] = text;
+            textLens[lane] = __max(textLen, 0);
+            patterns[lane] = pattern;
+            patternLens[lane] = patternLen;
+        }
+
+        batched.computeEditDistances(textDirection, texts, textLens, patterns, patternLens, nPairs, k, distances);
+        for (int lane = 0; lane < nPairs; lane++) {
+            int lvDistance = 1 == textDirection ?
+                lv.computeEditDistance(texts[lane], textLens[lane], patterns[lane], patternLens[lane], k) :
+                reverseLV.computeEditDistance(texts[lane], textLens[lane], patterns[lane], patternLens[lane], k);
+            ASSERT_EQ(-1 == lvDistance ? k + 1 : lvDistance, distances[lane]);
+        }
+    }
+}
+
+TEST_F(LandauVishkinTest, "affine gap CIGAR strings") {
+    char cigarBuf[1024];
+    int bufLen = sizeof(cigarBuf);
+
+    //
+    // With a gap penalty of 1 it's the same as edit distance.
+    //
+    lvc.setGapPenalty(1);
+    ASSERT_EQ(1, lvc.computeEditDistanceNormalized("abcde", 5, "abde", 4, 2, cigarBuf, bufLen, false));
+    ASSERT_STREQ("2=1D2=", cigarBuf);
+
+    ASSERT_EQ(2, lvc.computeEditDistanceNormalized("abcde", 5, "abXXe", 5, 2, cigarBuf, bufLen, false));
+    ASSERT_STREQ("2=2X1=", cigarBuf);
+
+    //
+    // A one base shift over six bases is a deletion and an insertion, unless
+    // gaps cost enough that six mismatches are cheaper.
+    //
+    lvc.setGapPenalty(2);
+    ASSERT_EQ(2, lvc.computeEditDistanceNormalized("xxxxabcdefyyyy", 14, "xxxxbcdefgyyyy", 14, 8, cigarBuf, bufLen, false));
+    ASSERT_STREQ("4=1D5=1I4=", cigarBuf);
+
+    lvc.setGapPenalty(4);
+    ASSERT_EQ(6, lvc.computeEditDistanceNormalized("xxxxabcdefyyyy", 14, "xxxxbcdefgyyyy", 14, 8, cigarBuf, bufLen, false));
+    ASSERT_STREQ("4=6X4=", cigarBuf);
+
+    ASSERT_EQ(6, lvc.computeEditDistanceNormalized("xxxxabcdefyyyy", 14, "xxxxbcdefgyyyy", 14, 8, cigarBuf, bufLen, true));
+    ASSERT_STREQ("14M", cigarBuf);
+
+    //
+    // A long deletion stays in one piece, as early as it can go.
+    //
+    ASSERT_EQ(2, lvc.computeEditDistanceNormalized("abcdddefghijkl", 14, "abcdefghijk", 11, 8, cigarBuf, bufLen, false));
+    ASSERT_STREQ("3=2D8=", cigarBuf);
+
+    lvc.setGapPenalty(0);
+}
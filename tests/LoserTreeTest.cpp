@@ -0,0 +1,54 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "LoserTree.h"
+
+//
+// Merge sorted runs of different lengths (some empty) through the tree, the way the sorted output's merge does, taking
+// from the winner until it passes the runner up.
+//
+TEST("LoserTree merges sorted runs in order") {
+    static const int nRuns[] = {1, 2, 3, 7, 8, 100};
+    srand(1);
+    for (int r = 0; r < (int) (sizeof(nRuns) / sizeof(nRuns[0])); r++) {
+        int k = nRuns[r];
+        std::vector<std::vector<unsigned> > runs(k);
+        size_t total = 0;
+        for (int i = 0; i < k; i++) {
+            int length = i % 5 == 4 ? 0 : rand() % 200;
+            unsigned value = rand() % 50;
+            for (int j = 0; j < length; j++) {
+                value += rand() % 3;    // Plenty of equal values, within and between runs
+                runs[i].push_back(value);
+            }
+            total += length;
+        }
+
+        LoserTree tree(k);
+        std::vector<size_t> next(k, 0);
+        for (int i = 0; i < k; i++) {
+            if (runs[i].size() > 0) {
+                tree.set(i, ((_uint64) runs[i][0] << 32) | i);
+            }
+        }
+        tree.build();
+
+        _uint64 previous = 0;
+        size_t merged = 0;
+        while (tree.winnerKey() != LoserTree::Exhausted) {
+            int i = tree.winner();
+            _uint64 limit = tree.runnerUpKey();
+            _uint64 key;
+            do {
+                key = ((_uint64) runs[i][next[i]] << 32) | i;
+                ASSERT(key >= previous);
+                previous = key;
+                merged++;
+                next[i]++;
+                key = next[i] < runs[i].size() ? ((_uint64) runs[i][next[i]] << 32) | i : LoserTree::Exhausted;
+            } while (key < limit);
+            tree.replaceWinner(key);
+        }
+        ASSERT_EQ(total, merged);
+    }
+}
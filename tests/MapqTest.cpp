@@ -0,0 +1,24 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "mapq.h"
+
+//
+// The table lookup has to give the same MAPQ as taking the log, except within rounding of the table's entries.
+//
+TEST("errorProbabilityToMAPQ") {
+    initializeMapqTables();
+
+    for (int mapq = 0; mapq <= 70; mapq++) {
+        ASSERT_EQ(mapq, errorProbabilityToMAPQ(mapqToErrorProbability(mapq)));
+    }
+    ASSERT_EQ(70, errorProbabilityToMAPQ(1e-20));
+    ASSERT_EQ(70, errorProbabilityToMAPQ(0.0));
+    ASSERT_EQ(0, errorProbabilityToMAPQ(1.0));
+
+    srand(1);
+    for (int i = 0; i < 100000; i++) {
+        double errorProbability = pow(10.0, -8.0 * rand() / RAND_MAX);
+        ASSERT_EQ(__min(70, (int)(-10 * log10(errorProbability))), errorProbabilityToMAPQ(errorProbability));
+    }
+}
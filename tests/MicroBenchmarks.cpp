@@ -0,0 +1,337 @@
+#include "stdafx.h"
+#include "TestLib.h"
+#include "LandauVishkin.h"
+#include "HashTable.h"
+#include "GenomeIndex.h"
+#include "Seed.h"
+#include "ProbabilityDistance.h"
+
+//
+// Microbenchmarks for the kernels alignment spends its time in, so that changes to them can be judged with numbers.
+// Run them with unit_tests -bench [filter].  Everything here is generated from fixed seeds, so runs are comparable.
+//
+
+namespace {
+
+struct Random {
+    _uint64 state;
+
+    Random(_uint64 seed) : state(seed * 0x9e3779b97f4a7c15 + 1) {}
+
+    _uint64 next() {
+        // xorshift64*
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 0x2545f4914f6cdd1d;
+    }
+
+    unsigned below(unsigned n) {
+        return (unsigned) (next() % n);
+    }
+
+    char base() {
+        return "ACGT"[next() & 3];
+    }
+};
+
+void randomBases(Random &rng, char *bases, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        bases[i] = rng.base();
+    }
+}
+
+//
+// Copies text into pattern with nEdits substitutions and single base indels, stopping at patternLen.
+//
+void mutate(Random &rng, const char *text, char *pattern, int patternLen, int nEdits) {
+    int textPos = 0;
+    for (int i = 0; i < patternLen; i++) {
+        if (nEdits > 0 && rng.below(patternLen) < (unsigned) nEdits * 2) {
+            nEdits--;
+            switch (rng.below(4)) {
+                case 0: // insertion
+                    pattern[i] = rng.base();
+                    continue;
+                case 1: // deletion
+                    textPos++;
+                    break;
+                default: // substitution
+                    pattern[i] = rng.base();
+                    if (pattern[i] == text[textPos]) {
+                        pattern[i] = pattern[i] == 'A' ? 'C' : 'A';
+                    }
+                    textPos++;
+                    continue;
+            }
+        }
+        pattern[i] = text[textPos++];
+    }
+}
+
+//
+// Pushes everything the benchmark has touched out of the caches.
+//
+void evictCaches() {
+    static const size_t evictionBytes = 64 * 1024 * 1024;
+    static char *eviction = NULL;
+    if (NULL == eviction) {
+        eviction = new char[evictionBytes];
+    }
+    for (size_t i = 0; i < evictionBytes; i += 64) {
+        eviction[i]++;
+    }
+}
+
+volatile _int64 sink;   // so the results aren't optimized away
+
+}
+
+BENCHMARK("LandauVishkin::computeEditDistance") {
+    static const int readLengths[] = {100, 250, 1000};
+    static const int ks[] = {2, 8, 16, 30};
+    static const int nPairs = 256;  // pairs per configuration, so that the branch predictor can't just learn one
+    LandauVishkin<> lv;
+
+    for (int l = 0; l < sizeof(readLengths) / sizeof(readLengths[0]); l++) {
+        for (int whichK = 0; whichK < sizeof(ks) / sizeof(ks[0]); whichK++) {
+            for (int far = 0; far < 2; far++) {
+                int readLen = readLengths[l];
+                int k = ks[whichK];
+                int textLen = readLen + k + 1;
+                Random rng(readLen * 100 + k * 2 + far);
+                char *texts = new char[nPairs * textLen];
+                char *patterns = new char[nPairs * readLen];
+                randomBases(rng, texts, nPairs * textLen);
+                for (int i = 0; i < nPairs; i++) {
+                    if (far) {
+                        randomBases(rng, patterns + i * readLen, readLen);  // gives up after k
+                    } else {
+                        mutate(rng, texts + i * textLen, patterns + i * readLen, readLen, k / 2);
+                    }
+                }
+
+                char params[100];
+                snprintf(params, sizeof(params), "\"readLength\":%d,\"k\":%d,\"pattern\":\"%s\"", readLen, k,
+                    far ? "unrelated" : "within k");
+                test::Benchmark b("LandauVishkin::computeEditDistance", params);
+                _int64 total = 0;
+                while (b.more()) {
+                    b.start();
+                    for (int i = 0; i < nPairs; i++) {
+                        total += lv.computeEditDistance(texts + i * textLen, textLen, patterns + i * readLen, readLen, k);
+                    }
+                    b.stop(nPairs);
+                }
+                b.report();
+                sink = total;
+
+                delete [] texts;
+                delete [] patterns;
+            }
+        }
+    }
+}
+
+BENCHMARK("ProbabilityDistance::compute") {
+    static const int readLengths[] = {100, 250};
+    static const int maxShifts[] = {4, 19};
+    static const int nPairs = 64;
+    ProbabilityDistance *pd = new ProbabilityDistance(0.001, 0.001, 0.5);   // the aligner's model
+
+    for (int l = 0; l < sizeof(readLengths) / sizeof(readLengths[0]); l++) {
+        for (int whichShift = 0; whichShift < sizeof(maxShifts) / sizeof(maxShifts[0]); whichShift++) {
+            int readLen = readLengths[l];
+            int maxShift = maxShifts[whichShift];
+            int refLen = readLen + 2 * maxShift;
+            Random rng(readLen * 100 + maxShift);
+            char *refs = new char[nPairs * refLen];
+            char *reads = new char[nPairs * readLen];
+            char *qualities = new char[readLen];
+            randomBases(rng, refs, nPairs * refLen);
+            for (int i = 0; i < nPairs; i++) {
+                mutate(rng, refs + i * refLen + maxShift, reads + i * readLen, readLen, 4);
+            }
+            for (int i = 0; i < readLen; i++) {
+                qualities[i] = (char) ('#' + rng.below(40));
+            }
+
+            char params[100];
+            snprintf(params, sizeof(params), "\"readLength\":%d,\"maxShift\":%d", readLen, maxShift);
+            test::Benchmark b("ProbabilityDistance::compute", params);
+            double total = 0;
+            while (b.more()) {
+                b.start();
+                for (int i = 0; i < nPairs; i++) {
+                    double matchProbability;
+                    pd->compute(refs + i * refLen + maxShift, reads + i * readLen, qualities, readLen, maxShift / 2, maxShift,
+                        &matchProbability);
+                    total += matchProbability;
+                }
+                b.stop(nPairs);
+            }
+            b.report();
+            sink = (_int64) total;
+
+            delete [] refs;
+            delete [] reads;
+            delete [] qualities;
+        }
+    }
+    delete pd;
+}
+
+BENCHMARK("SNAPHashTable::Lookup") {
+    static const unsigned tableKeys[] = {1 << 14, 1 << 23};     // one that fits in L2, one that's way beyond the LLC
+    static const unsigned nLookups = 1 << 16;
+    static const unsigned keySize = 4;
+
+    for (int size = 0; size < sizeof(tableKeys) / sizeof(tableKeys[0]); size++) {
+        for (int bucketized = 0; bucketized < 2; bucketized++) {
+            unsigned nKeys = tableKeys[size];
+            SNAPHashTable *table = new SNAPHashTable((unsigned) (nKeys * 1.3), keySize, bucketized != 0);   // the index's default slack
+            Random rng(nKeys + bucketized);
+            _uint64 *keys = new _uint64[nKeys];
+            for (unsigned i = 0; i < nKeys; i++) {
+                GenomeLocation values[2] = {i, i};
+                do {
+                    keys[i] = rng.next() & 0xffffffff;
+                } while (!table->Insert(keys[i], values));
+            }
+
+            _uint64 *hits = new _uint64[nLookups];
+            _uint64 *misses = new _uint64[nLookups];
+            for (unsigned i = 0; i < nLookups; i++) {
+                hits[i] = keys[rng.below(nKeys)];
+                do {
+                    misses[i] = rng.next() & 0xffffffff;
+                } while (table->Lookup(misses[i]) != NULL);
+            }
+
+            for (int miss = 0; miss < 2; miss++) {
+                const _uint64 *lookups = miss ? misses : hits;
+                char params[100];
+                snprintf(params, sizeof(params), "\"keys\":%u,\"layout\":\"%s\",\"lookup\":\"%s\"", nKeys,
+                    bucketized ? "bucketized" : "classic", miss ? "miss" : "hit");
+                test::Benchmark b("SNAPHashTable::Lookup", params);
+                _int64 total = 0;
+                while (b.more()) {
+                    b.start();
+                    for (unsigned i = 0; i < nLookups; i++) {
+                        total += (_int64) table->Lookup(lookups[i]);
+                    }
+                    b.stop(nLookups);
+                }
+                b.report();
+                sink = total;
+            }
+
+            delete [] hits;
+            delete [] misses;
+            delete [] keys;
+            delete table;
+        }
+    }
+}
+
+//
+// Builds (the first time) and loads a random 8Mbase index in the working directory, unless unit_tests -index gave one.
+//
+static GenomeIndex *loadBenchmarkIndex() {
+    char defaultDirectory[] = "microbench.idx";
+    char *directory = test::benchmarkIndexDirectory != NULL ? (char *) test::benchmarkIndexDirectory : defaultDirectory;
+    FILE *existing = test::benchmarkIndexDirectory == NULL ? fopen("microbench.idx/GenomeIndex", "r") : NULL;
+    if (NULL != existing) {
+        fclose(existing);
+    } else if (test::benchmarkIndexDirectory == NULL) {
+        static const unsigned nBases = 8 * 1024 * 1024;
+        static const unsigned padding = 500;
+        Genome *genome = new Genome(nBases + 2 * padding, nBases + 2 * padding, padding);
+        char *paddingBases = new char[padding + 1];
+        memset(paddingBases, 'n', padding);
+        paddingBases[padding] = '\0';
+        char *bases = new char[nBases];
+        Random rng(1);
+        randomBases(rng, bases, nBases);
+        genome->addData(paddingBases);
+        genome->startContig("chr1");
+        genome->addData(bases, nBases);
+        genome->addData(paddingBases);
+        genome->fillInContigLengths();
+        delete [] bases;
+        delete [] paddingBases;
+        if (!GenomeIndex::BuildIndexToDirectory(genome, 20, 0.3, NULL, directory, 50, GetNumberOfProcessors(), padding,
+                false, 4)) {
+            return NULL;
+        }
+    }
+    return GenomeIndex::loadFromDirectory(directory);
+}
+
+BENCHMARK("GenomeIndex::lookupSeed") {
+    static const unsigned nSeeds = 1 << 16;
+    static const unsigned nWarmSeeds = 64;      // few enough that they all stay in L1
+    static const unsigned coldBatch = 1024;     // lookups between cache evictions
+
+    GenomeIndex *index = loadBenchmarkIndex();
+    if (NULL == index) {
+        FAIL("couldn't build or load the benchmark index");
+    }
+    const Genome *genome = index->getGenome();
+    int seedLen = index->getSeedLength();
+
+    //
+    // Hits are seeds from the genome (skipping the ones with Ns); misses are random, which for any genome much smaller
+    // than 4^seedLen almost never occur in it.
+    //
+    Random rng(2);
+    Seed *hitSeeds = (Seed *) new char[nSeeds * sizeof(Seed)];
+    Seed *missSeeds = (Seed *) new char[nSeeds * sizeof(Seed)];
+    char *randomSeed = new char[seedLen];
+    for (unsigned i = 0; i < nSeeds; i++) {
+        const char *bases;
+        do {
+            bases = genome->getSubstring(rng.below(genome->getCountOfBases() - seedLen), seedLen);
+        } while (NULL == bases || !Seed::DoesTextRepresentASeed(bases, seedLen));
+        hitSeeds[i] = Seed(bases, seedLen);
+        randomBases(rng, randomSeed, seedLen);
+        missSeeds[i] = Seed(randomSeed, seedLen);
+    }
+    delete [] randomSeed;
+
+    for (int miss = 0; miss < 2; miss++) {
+        for (int cold = 0; cold < 2; cold++) {
+            const Seed *seeds = miss ? missSeeds : hitSeeds;
+            unsigned batch = cold ? coldBatch : nWarmSeeds;
+            char params[100];
+            snprintf(params, sizeof(params), "\"cache\":\"%s\",\"lookup\":\"%s\"", cold ? "cold" : "warm", miss ? "miss" : "hit");
+            test::Benchmark b("GenomeIndex::lookupSeed", params);
+            _int64 total = 0;
+            unsigned next = 0;
+            DecodedHitBuffer decodedHits;   // only used if the index's overflow table is compressed
+            while (b.more()) {
+                decodedHits.reset();
+                if (cold) {
+                    evictCaches();
+                    next = (next + batch) % nSeeds;
+                }
+                b.start();
+                for (int repeat = 0; repeat < (cold ? 1 : 16); repeat++) {
+                    for (unsigned i = 0; i < batch; i++) {
+                        unsigned nHits, nRCHits;
+                        const GenomeLocation *hits, *rcHits;
+                        index->lookupSeed(seeds[next + i], &nHits, &hits, &nRCHits, &rcHits, &decodedHits);
+                        total += nHits + nRCHits;
+                    }
+                }
+                b.stop(cold ? batch : 16 * batch);
+            }
+            b.report();
+            sink = total;
+        }
+    }
+
+    delete [] (char *) hitSeeds;
+    delete [] (char *) missSeeds;
+    delete index;
+}
@@ -0,0 +1,72 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "PackedReads.h"
+
+//
+// Reads have to come back out of a packed read file just as they went in, Ns and all, except for binned qualities.
+//
+TEST("PackedReads round trip") {
+    static const unsigned nReads = 500;
+    static const char bases[] = "ACGTACGTACGTACGTNR";
+    static const char *fileName = "packedreadstest.snapreads";
+    char data[nReads][200], quality[nReads][200], id[nReads][20];
+    unsigned length[nReads];
+
+    ReaderContext context;
+    context.genome = NULL;
+    context.defaultReadGroup = "";
+    context.clipping = NoClipping;
+    context.paired = false;
+    context.ignoreSecondaryAlignments = true;
+    context.header = NULL;
+    context.headerLength = context.headerBytes = 0;
+    context.headerMatchesIndex = false;
+    context.rangeIndex = 0;
+    context.rangeCount = 1;
+    context.trimmer = NULL;
+    context.screen = NULL;
+
+    srand(1);
+    for (unsigned i = 0; i < nReads; i++) {
+        length[i] = 1 + rand() % 199;
+        for (unsigned j = 0; j < length[i]; j++) {
+            data[i][j] = bases[rand() % (i % 2 ? sizeof(bases) - 1 : 16)];
+            quality[i][j] = (char)('!' + rand() % 42);
+        }
+        snprintf(id[i], sizeof(id[i]), "read%u", i);
+    }
+
+    for (int binned = 0; binned < 2; binned++) {
+        PackedReadWriter *writer = PackedReadWriter::Factory(fileName, binned != 0);
+        ASSERT(NULL != writer);
+        for (unsigned i = 0; i < nReads; i++) {
+            Read read;
+            read.init(id[i], (unsigned)strlen(id[i]), data[i], quality[i], length[i]);
+            ASSERT(writer->writeRead(&read));
+        }
+        delete writer;
+
+        PackedReadReader *reader = PackedReadReader::create(DataSupplier::Default[true], fileName, context);
+        Read read;
+        for (unsigned i = 0; i < nReads; i++) {
+            ASSERT(reader->getNextRead(&read));
+            ASSERT_EQ(strlen(id[i]), (size_t)read.getIdLength());
+            ASSERT(0 == memcmp(id[i], read.getId(), read.getIdLength()));
+            ASSERT_EQ(length[i], read.getDataLength());
+            ASSERT(0 == memcmp(data[i], read.getData(), length[i]));
+            for (unsigned j = 0; j < length[i]; j++) {
+                if (binned) {
+                    ASSERT(abs(quality[i][j] - read.getQuality()[j]) <= 2);
+                    ASSERT_EQ(quality[i][j] == '#', read.getQuality()[j] == '#');
+                } else {
+                    ASSERT_EQ(quality[i][j], read.getQuality()[j]);
+                }
+            }
+        }
+        ASSERT(! reader->getNextRead(&read));
+        delete reader;
+    }
+
+    DeleteSingleFile(fileName);
+}
@@ -0,0 +1,53 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "PairedResultCache.h"
+
+TEST("PairedResultCache reuses results only for identical pairs") {
+    PairedResultCache cache(64);
+    const char *bases0 = "ACGTACGTACGTACGTACGTACGTACGTACGTACGTACGTACGTACGTACGTACGT";
+    const char *bases1 = "TTTTGGGGCCCCAAAATTTTGGGGCCCCAAAATTTTGGGGCCCCAAAATTTTGGGG";
+    const char *quality = "IIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIII";
+    const char *otherQuality = "IIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIII#";
+    unsigned length = (unsigned)strlen(bases0);
+
+    Read read0, read1, other;
+    read0.init("r", 1, bases0, quality, length);
+    read1.init("r", 1, bases1, quality, length);
+
+    PairedAlignmentResult result;
+    memset(&result, 0, sizeof(result));
+    ASSERT(!cache.lookup(&read0, &read1, &result));
+
+    result.status[0] = result.status[1] = SingleHit;
+    result.location[0] = 1000;
+    result.location[1] = 1300;
+    result.mapq[0] = result.mapq[1] = 60;
+    cache.insert(&read0, &read1, &result);
+
+    PairedAlignmentResult found;
+    memset(&found, 0, sizeof(found));
+    ASSERT(cache.lookup(&read0, &read1, &found));
+    ASSERT_EQ(1000u, found.location[0]);
+    ASSERT_EQ(1300u, found.location[1]);
+    ASSERT_EQ(60, found.mapq[1]);
+
+    // The ends swapped, a different quality, or a shorter read are all different pairs
+    ASSERT(!cache.lookup(&read1, &read0, &found));
+    other.init("r", 1, bases1, otherQuality, length);
+    ASSERT(!cache.lookup(&read0, &other, &found));
+    other.init("r", 1, bases1, quality, length - 1);
+    ASSERT(!cache.lookup(&read0, &other, &found));
+}
+
+TEST("PairedResultCache doesn't keep pairs longer than its limit") {
+    PairedResultCache cache(16, 8);
+    Read read0, read1;
+    read0.init("r", 1, "ACGTACGTA", "IIIIIIIII", 9);
+    read1.init("r", 1, "ACGTACGT", "IIIIIIII", 8);
+
+    PairedAlignmentResult result;
+    memset(&result, 0, sizeof(result));
+    cache.insert(&read0, &read1, &result);
+    ASSERT(!cache.lookup(&read0, &read1, &result));
+}
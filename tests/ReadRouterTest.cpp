@@ -0,0 +1,85 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "ReadRouter.h"
+
+//
+// Two 100 base contigs after 10 bases of padding, so chr2 starts at 110.
+//
+TEST("ReadRouteFilter picks reads by class and region") {
+    Genome genome(220, 220, 10);
+    char bases[101];
+    memset(bases, 'A', 100);
+    bases[100] = '\0';
+    genome.addData("nnnnnnnnnn");
+    genome.startContig("chr1");
+    genome.addData(bases);
+    genome.startContig("chr2");
+    genome.addData(bases);
+    genome.addData("nnnnnnnnnn");
+    genome.fillInContigLengths();
+
+    ReadRouteFilter *filter = ReadRouteFilter::create("u,chr2:11-20,chr2:15-30", &genome);
+    ASSERT(NULL != filter);
+    ASSERT(filter->passes(NotFound, InvalidGenomeLocation));
+    ASSERT(! filter->passes(SingleHit, 50));
+    ASSERT(! filter->passes(SingleHit, 119));
+    ASSERT(filter->passes(SingleHit, 120));
+    ASSERT(filter->passes(SecondaryHit, 139));
+    ASSERT(! filter->passes(MultipleHits, 140));
+    delete filter;
+
+    filter = ReadRouteFilter::create("s,chr1", &genome);
+    ASSERT(NULL != filter);
+    ASSERT(! filter->passes(NotFound, InvalidGenomeLocation));
+    ASSERT(filter->passes(SingleHit, 150));
+    ASSERT(filter->passes(MultipleHits, 10));
+    ASSERT(! filter->passes(MultipleHits, 110));
+    delete filter;
+
+    ASSERT(NULL == ReadRouteFilter::create("chr3", &genome));
+    ASSERT(NULL == ReadRouteFilter::create("chr1:20-10", &genome));
+}
+
+TEST("ReadRouteFilter narrows by read group") {
+    Genome genome(220, 220, 10);
+    char bases[101];
+    memset(bases, 'A', 100);
+    bases[100] = '\0';
+    genome.addData("nnnnnnnnnn");
+    genome.startContig("chr1");
+    genome.addData(bases);
+    genome.addData("nnnnnnnnnn");
+    genome.fillInContigLengths();
+
+    ReadRouteFilter *filter = ReadRouteFilter::create("rg:A,rg:C,u", &genome);
+    ASSERT(NULL != filter);
+    ASSERT(filter->picksReadGroups());
+
+    Read read;
+    read.init("r", 1, "ACGT", "IIII", 4);
+    read.setReadGroup("A");
+    ASSERT(filter->inReadGroups(&read));
+    read.setReadGroup("AB");
+    ASSERT(! filter->inReadGroups(&read));
+
+    //
+    // From SAM input, where the read group's in the optional fields.
+    //
+    char aux[] = "XA:i:1\tRG:Z:C\tXB:i:2";
+    read.setAuxiliaryData(aux, (unsigned)strlen(aux));
+    read.setReadGroup(READ_GROUP_FROM_AUX);
+    ASSERT(filter->inReadGroups(&read));
+    char otherAux[] = "XA:i:1\tRG:Z:CD";
+    read.setAuxiliaryData(otherAux, (unsigned)strlen(otherAux));
+    ASSERT(! filter->inReadGroups(&read));
+
+    ASSERT(filter->passes(NotFound, InvalidGenomeLocation));
+    ASSERT(! filter->passes(SingleHit, 50));
+    delete filter;
+
+    filter = ReadRouteFilter::create("chr1", &genome);
+    ASSERT(! filter->picksReadGroups());
+    ASSERT(filter->inReadGroups(&read));
+    delete filter;
+}
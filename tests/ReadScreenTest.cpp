@@ -0,0 +1,64 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "ReadScreen.h"
+#include "Tables.h"
+
+static void randomBases(char *bases, unsigned length)
+{
+    for (unsigned i = 0; i < length; i++) {
+        bases[i] = "ACGT"[rand() % 4];
+    }
+}
+
+//
+// A read from either strand of the screen's sequence is screened out, and one that only shares a k-mer or two's worth
+// of bases with it, or is too changed to share any k-mers, isn't.
+//
+TEST("ReadScreen picks out reads from its sequences") {
+    static const char *fileName = "readscreentest.fa";
+    static const unsigned contigLength = 2000;
+    static const unsigned readLength = 100;
+
+    srand(1);
+    char contig[contigLength];
+    randomBases(contig, contigLength);
+    FILE *file = fopen(fileName, "wb");
+    ASSERT(NULL != file);
+    fprintf(file, ">phiX\n%.*s\n", contigLength, contig);
+    fclose(file);
+
+    ReadScreen *screen = ReadScreen::create(fileName);
+    remove(fileName);
+    ASSERT(NULL != screen);
+
+    char read[readLength];
+    memcpy(read, contig + 500, readLength);
+    ASSERT(screen->matches(read, readLength));
+
+    for (unsigned i = 0; i < readLength; i++) {
+        read[i] = COMPLEMENT[contig[500 + readLength - 1 - i]];
+    }
+    ASSERT(screen->matches(read, readLength));
+
+    randomBases(read, readLength);
+    ASSERT(!screen->matches(read, readLength));
+
+    //
+    // The end of the read overlaps the start of the contig by exactly one k-mer, and then by two.
+    //
+    memcpy(read + readLength - ReadScreen::KmerLength, contig, ReadScreen::KmerLength);
+    ASSERT(!screen->matches(read, readLength));
+    memcpy(read + readLength - ReadScreen::KmerLength - 1, contig, ReadScreen::KmerLength + 1);
+    ASSERT(screen->matches(read, readLength));
+
+    memcpy(read, contig + 500, readLength);
+    for (unsigned i = 0; i < readLength; i += ReadScreen::KmerLength - 1) {
+        read[i] = 'N';
+    }
+    ASSERT(!screen->matches(read, readLength));
+
+    delete screen;
+
+    ASSERT(NULL == ReadScreen::create("readscreentest-missing.fa"));
+}
@@ -0,0 +1,95 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "ReadSimulator.h"
+#include "Tables.h"
+#include "Read.h"
+#include "WGsim.h"
+
+//
+// Two contigs of 2000 random bases after 10 bases of padding.
+//
+static void BuildRandomGenome(Genome *genome)
+{
+    char bases[2001];
+    bases[2000] = '\0';
+    genome->addData("nnnnnnnnnn");
+    for (int contig = 0; contig < 2; contig++) {
+        for (int i = 0; i < 2000; i++) {
+            bases[i] = VALUE_BASE[rand() & 3];
+        }
+        genome->startContig(0 == contig ? "chr1" : "chr2");
+        genome->addData(bases);
+    }
+    genome->addData("nnnnnnnnnn");
+    genome->fillInContigLengths();
+}
+
+TEST("ReadSimulator reads without errors match where their IDs say they came from") {
+    Genome genome(4100, 4100, 10);
+    BuildRandomGenome(&genome);
+
+    ReadSimulator::Options options;
+    options.readLength = 50;
+    options.errorRate = 0;
+    options.indelRate = 0;
+    options.meanInsert = 200;
+    options.insertStdDev = 20;
+    ReadSimulator simulator(&genome, options);
+
+    char id[ReadSimulator::MaxIdLength];
+    char bases[2][50];
+    char quality[50];
+    memset(quality, '?', sizeof(quality));
+    for (_uint64 n = 0; n < 200; n++) {
+        char *data[2] = {bases[0], bases[1]};
+        unsigned lengths[2];
+        unsigned idLength = simulator.generate(n, id, data, lengths);
+        ASSERT(0 != idLength);
+        ASSERT_EQ(50u, lengths[0]);
+        ASSERT_EQ(50u, lengths[1]);
+
+        GenomeLocation contigOffset;
+        ASSERT(genome.getOffsetOfContig(0 == strncmp(id, "chr1_", 5) ? "chr1" : "chr2", &contigOffset));
+        char *next;
+        GenomeLocation start = (unsigned)strtoul(id + 5, &next, 10) - 1 + contigOffset;
+        GenomeLocation end = (unsigned)strtoul(next + 1, NULL, 10) - 1 + contigOffset;
+
+        //
+        // One end is forward at the start of the fragment, and the other reverse complemented at its end.
+        //
+        const char *fragmentStart = genome.getSubstring(start, 50);
+        const char *fragmentEnd = genome.getSubstring(end - 49, 50);
+        int forward = 0 == memcmp(bases[0], fragmentStart, 50) ? 0 : 1;
+        ASSERT(0 == memcmp(bases[forward], fragmentStart, 50));
+        for (int i = 0; i < 50; i++) {
+            ASSERT_EQ(COMPLEMENT[(unsigned char)fragmentEnd[49 - i]], bases[1 - forward][i]);
+        }
+
+        Read read;
+        read.init(id, idLength, bases[forward], quality, 50);
+        ASSERT(! wgsimReadMisaligned(&read, start, &genome, 0, NULL, NULL));
+        ASSERT(wgsimReadMisaligned(&read, start + 500, &genome, 0, NULL, NULL));
+    }
+}
+
+TEST("ReadSimulator gives the same read for the same seed and number") {
+    Genome genome(4100, 4100, 10);
+    BuildRandomGenome(&genome);
+
+    ReadSimulator::Options options;
+    options.errorRate = 0.05;
+    options.indelRate = 0.01;
+    ReadSimulator simulator(&genome, options);
+
+    char ids[2][ReadSimulator::MaxIdLength];
+    char bases[2][100];
+    unsigned lengths[2][2];
+    for (int i = 0; i < 2; i++) {
+        char *data[2] = {bases[i], NULL};
+        ASSERT(0 != simulator.generate(12345, ids[i], data, lengths[i]));
+    }
+    ASSERT_EQ(lengths[0][0], lengths[1][0]);
+    ASSERT(0 == strcmp(ids[0], ids[1]));
+    ASSERT(0 == memcmp(bases[0], bases[1], lengths[0][0]));
+}
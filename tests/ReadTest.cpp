@@ -0,0 +1,55 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "Read.h"
+
+//
+// The vector reverse and reverse complement have to agree with the table for every length, whatever's in the read.
+//
+TEST("ReverseComplement") {
+    static const unsigned maxLen = 100;
+    static const char bases[] = "ACGTACGTACGTNnx";
+    char read[maxLen], quality[maxLen], rc[maxLen], reversed[maxLen];
+
+    srand(1);
+    for (unsigned len = 0; len <= maxLen; len++) {
+        for (int trial = 0; trial < 4; trial++) {
+            for (unsigned i = 0; i < len; i++) {
+                read[i] = bases[rand() % (trial < 2 ? 13 : sizeof(bases) - 1)];
+                quality[i] = (char)('!' + rand() % 42);
+            }
+            ReverseComplement(rc, read, len);
+            ReverseBytes(reversed, quality, len);
+            for (unsigned i = 0; i < len; i++) {
+                ASSERT_EQ(COMPLEMENT[(unsigned char)read[len - i - 1]], rc[i]);
+                ASSERT_EQ(quality[len - i - 1], reversed[i]);
+            }
+        }
+    }
+}
+
+//
+// A piece of a split read is the same read with the rest of it clipped, so it's written with the rest soft clipped,
+// and the clipping swaps ends when it's reverse complemented like any other.
+//
+TEST("Read clipToPiece clips around the piece") {
+    const char *data = "##ACGTACGTACGTACGTAC##";
+    const char *quality = "##IIIIIIIIIIIIIIIIII##";
+    Read read;
+    read.init("r", 1, data, quality, 22);
+    read.clip(ClipFrontAndBack);
+    ASSERT_EQ(2u, read.getFrontClippedLength());
+    ASSERT_EQ(18u, read.getDataLength());
+
+    Read piece(read);
+    piece.clipToPiece(5, 10);
+    ASSERT_EQ(7u, piece.getFrontClippedLength());
+    ASSERT_EQ(10u, piece.getDataLength());
+    ASSERT_EQ(22u, piece.getUnclippedLength());
+    ASSERT(0 == memcmp(data + 7, piece.getData(), 10));
+    ASSERT(0 == memcmp(quality + 7, piece.getQuality(), 10));
+
+    piece.becomeRC();
+    ASSERT_EQ(5u, piece.getFrontClippedLength());
+    ASSERT_EQ(10u, piece.getDataLength());
+}
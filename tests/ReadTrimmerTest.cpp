@@ -0,0 +1,46 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "ReadTrimmer.h"
+
+static const char *Adapter = "AGATCGGAAGAGCACACGTCTG";
+
+//
+// A whole adapter with a mismatch, one running off the end, and a piece shorter than a k-mer at the very end.
+//
+TEST("ReadTrimmer finds adapters") {
+    ReadTrimmer *trimmer = ReadTrimmer::create(Adapter, 0);
+    ASSERT(NULL != trimmer);
+
+    const char *quality = "IIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIII";
+    const char *whole = "TTGCACCATGTACGAGATCGGAAGTGCACACGTCTGAACTCC";
+    ASSERT_EQ(14u, trimmer->trimmedLength(whole, quality, (unsigned)strlen(whole)));
+
+    const char *offEnd = "TTGCACCATGTACGTTTTAGATCGGAAGAGCA";
+    ASSERT_EQ(18u, trimmer->trimmedLength(offEnd, quality, (unsigned)strlen(offEnd)));
+
+    const char *piece = "TTGCACCATGTACGTTTTAGATC";
+    ASSERT_EQ(18u, trimmer->trimmedLength(piece, quality, (unsigned)strlen(piece)));
+
+    const char *none = "TTGCACCATGTACGTTTTACCTTGCAT";
+    ASSERT_EQ((unsigned)strlen(none), trimmer->trimmedLength(none, quality, (unsigned)strlen(none)));
+
+    delete trimmer;
+}
+
+TEST("ReadTrimmer trims low quality tails") {
+    ReadTrimmer *trimmer = ReadTrimmer::create(NULL, 20);
+    ASSERT(NULL != trimmer);
+
+    //
+    // A good base in the bad tail is trimmed along with it when the bad bases before it outweigh it, and kept otherwise.
+    //
+    const char *data =    "ACGTACGTACGTACGTACGTA";
+    const char *quality = "IIIIIIIIIIIII##I#####";
+    ASSERT_EQ(13u, trimmer->trimmedLength(data, quality, 21));
+    ASSERT_EQ(15u, trimmer->trimmedLength(data, "IIIIIIIIIIIII#I#####", 20));
+    ASSERT_EQ(12u, trimmer->trimmedLength(data, quality, 12));
+
+    delete trimmer;
+    ASSERT(NULL == ReadTrimmer::create("ACGTNACGTACG", 0));
+}
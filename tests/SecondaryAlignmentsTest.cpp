@@ -0,0 +1,54 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "directions.h"
+#include "SecondaryAlignments.h"
+
+//
+// Many more candidates than fit: the survivors are the best ones in score order, and the primary and the candidates
+// that are only it (or a better survivor) shifted by a few bases are left out.
+//
+TEST("SecondaryAlignments keeps the best and drops near duplicates") {
+    SecondaryAlignments candidates;
+    candidates.setLimits(4, 3);
+    candidates.reset();
+
+    IdPair primary(1000, FORWARD);
+    candidates.add(1, 0.5, primary);
+    candidates.add(1, 0.4, IdPair(1002, FORWARD));  // The primary with an indel
+    for (unsigned i = 0; i < 40; i++) {
+        candidates.add(2 + i % 5, 0.01, IdPair(100000 * (i + 1), i % 2));
+    }
+    candidates.add(2, 0.005, IdPair(100000 * 2 + 1, 1));    // Next to a better one
+
+    IdPairVector secondary;
+    candidates.emit(&secondary, &primary, 1, 48);
+    ASSERT_EQ(4, secondary.size());
+    for (int i = 0; i < secondary.size(); i++) {
+        ASSERT_EQ(0u, secondary[i].id % 100000);    // Score 2, and none of the duplicates
+        ASSERT_EQ(((secondary[i].id / 100000 - 1) % 5), 0u);
+    }
+}
+
+//
+// Pairs, with the score delta: a much worse pair never gets in, however much room there is.
+//
+TEST("SecondaryAlignments respects the score delta for pairs") {
+    SecondaryAlignments candidates;
+    candidates.setLimits(16, 1);
+    candidates.reset();
+
+    IdPair primary[2] = {IdPair(5000, FORWARD), IdPair(5300, RC)};
+    candidates.add(3, 0.1, primary[0], primary[1]);
+    candidates.add(4, 0.01, IdPair(90000, FORWARD), IdPair(90300, RC));
+    candidates.add(6, 0.001, IdPair(70000, FORWARD), IdPair(70300, RC));
+    candidates.add(3, 0.1, IdPair(5000, FORWARD), IdPair(9300, RC));   // Same first end, far away second
+
+    IdPairVector secondary;
+    candidates.emit(&secondary, primary, 2, 31);
+    ASSERT_EQ(4, secondary.size());
+    ASSERT_EQ(5000u, secondary[0].id);
+    ASSERT_EQ(9300u, secondary[1].id);
+    ASSERT_EQ(90000u, secondary[2].id);
+    ASSERT_EQ(90300u, secondary[3].id);
+}
@@ -0,0 +1,27 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "SeedFilter.h"
+
+//
+// Every key that's been inserted has to get through, and at the default size only around 1% of the others should.
+//
+TEST("SeedFilter has no false negatives and few false positives") {
+    const unsigned nKeys = 100000;
+    SeedFilter filter(nKeys);
+    for (unsigned i = 0; i < nKeys; i++) {
+        filter.Insert((SeedBases)i * 7919 + 13);
+    }
+
+    for (unsigned i = 0; i < nKeys; i++) {
+        ASSERT(filter.MightContain((SeedBases)i * 7919 + 13));
+    }
+
+    unsigned nFalsePositives = 0;
+    for (unsigned i = 0; i < nKeys; i++) {
+        if (filter.MightContain((SeedBases)i * 7919 + 14)) {
+            nFalsePositives++;
+        }
+    }
+    ASSERT(nFalsePositives < nKeys / 40);
+}
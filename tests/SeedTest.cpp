@@ -0,0 +1,81 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "BigAlloc.h"
+#include "Seed.h"
+
+//
+// PackedSeeds has to agree with Seed and Seed::DoesTextRepresentASeed everywhere in a read, whatever its length and
+// wherever its Ns are.  With LONG_SEEDS that includes the seeds longer than 32 bases.
+//
+TEST("PackedSeeds matches Seed") {
+    static const unsigned maxReadLen = 300;
+    static const char bases[] = "ACGTACGTACGTACGTNacgt";
+    char read[maxReadLen];
+    PackedSeeds packed;
+    void *storage = BigAlloc(PackedSeeds::getStorageSize(maxReadLen));
+    packed.setStorage(storage, maxReadLen);
+
+    srand(1);
+    for (unsigned readLen = 1; readLen <= maxReadLen; readLen += readLen < 70 ? 1 : 23) {
+        for (int trial = 0; trial < 4; trial++) {
+            for (unsigned i = 0; i < readLen; i++) {
+                read[i] = bases[rand() % (trial == 0 ? 4 : sizeof(bases) - 1)];
+            }
+            packed.pack(read, readLen);
+            for (unsigned seedLen = 1; seedLen <= __min(readLen, LargestSeedSize); seedLen += seedLen < 16 ? 5 : 1) {
+                for (unsigned offset = 0; offset + seedLen <= readLen; offset++) {
+                    bool isSeed = Seed::DoesTextRepresentASeed(read + offset, seedLen);
+                    ASSERT_EQ(isSeed, packed.isSeed(offset, seedLen));
+                    if (isSeed) {
+                        Seed expected(read + offset, seedLen);
+                        Seed seed = packed.getSeed(offset, seedLen);
+                        ASSERT_EQ(LowWord(expected.getBases()), LowWord(seed.getBases()));
+                        ASSERT_EQ(HighWord(expected.getBases()), HighWord(seed.getBases()));
+                        ASSERT_EQ(LowWord(expected.getRCBases()), LowWord(seed.getRCBases()));
+                        ASSERT_EQ(HighWord(expected.getRCBases()), HighWord(seed.getRCBases()));
+                    }
+                }
+            }
+        }
+    }
+
+    BigDealloc(storage);
+}
+
+//
+// Every run of window locations with any seeds in it has exactly one minimizer, the first of its smallest hashes.
+//
+TEST("Seed::FindMinimizers") {
+    static const unsigned nPositions = 200;
+    _uint64 hashes[nPositions];
+    bool isMinimizer[nPositions];
+
+    srand(2);
+    for (unsigned window = 1; window <= 20; window += 3) {
+        for (unsigned i = 0; i < nPositions; i++) {
+            hashes[i] = rand() % 10 == 0 ? Seed::NotASeedHash : rand() % 50;
+        }
+        Seed::FindMinimizers(hashes, nPositions, window, isMinimizer);
+        for (unsigned i = 0; i < nPositions; i++) {
+            bool expected = false;
+            for (unsigned first = i < window ? 0 : i - window + 1; first <= i && first + window <= nPositions; first++) {
+                unsigned best = first;
+                for (unsigned j = first + 1; j < first + window; j++) {
+                    if (hashes[j] < hashes[best]) {
+                        best = j;
+                    }
+                }
+                expected |= best == i && hashes[i] != Seed::NotASeedHash;
+            }
+            ASSERT_EQ(expected, isMinimizer[i]);
+        }
+    }
+
+    Seed::FindMinimizers(hashes, 5, 10, isMinimizer);
+    unsigned nMinimizers = 0;
+    for (unsigned i = 0; i < 5; i++) {
+        nMinimizers += isMinimizer[i];
+    }
+    ASSERT_EQ(1u, nMinimizers);
+}
@@ -1,7 +1,9 @@
+#include "stdafx.h"
 #include <iostream>
 #include <cstring>
 
 #include "TestLib.h"
+#include "Compat.h"
 
 using namespace std;
 using namespace test;
@@ -41,3 +43,37 @@ int test::runAllTests(char *filter) {
     cout << endl << passed << " / " << tested << " tests passed." << endl;
     return (passed == tested ? 0 : 1);
 }
+
+long long Benchmark::minNanos = 200000000;
+
+const char *test::benchmarkIndexDirectory = NULL;
+
+Benchmark::Benchmark(const char *name_, const char *params_)
+    : name(name_), params(params_), ops(0), nanos(0), started(0) {
+}
+
+void Benchmark::start() {
+    started = timeInNanos();
+}
+
+void Benchmark::stop(long long ops_) {
+    nanos += timeInNanos() - started;
+    ops += ops_;
+}
+
+void Benchmark::report() const {
+    printf("{\"benchmark\":\"%s\"%s%s,\"ops\":%lld,\"seconds\":%.3f,\"nanosPerOp\":%.2f}\n", name,
+        params[0] != '\0' ? "," : "", params, ops, nanos / 1e9, ops > 0 ? (double) nanos / ops : 0.0);
+    fflush(stdout);
+}
+
+int test::runAllBenchmarks(char *filter) {
+    const std::vector<TestCase*> &benchmarks = TestCase::getBenchmarks();
+    for (int i = 0; i < benchmarks.size(); i++) {
+        TestCase *bc = benchmarks[i];
+        if (filter == NULL || strstr(bc->name, filter) != NULL) {
+            bc->run();
+        }
+    }
+    return 0;
+}
@@ -30,6 +30,25 @@
  *    ASSERT_STRNE(expected, actualValue)
  *    ASSERT_NEAR(expected, actualValue)    (for floats/doubles)
  *    FAIL(message)
+ *
+ * Microbenchmarks live alongside the tests, and run (instead of them) with
+ * unit_tests -bench [filter]:
+ *
+ *    BENCHMARK("description") { body }
+ *
+ * The body times each configuration it measures with a test::Benchmark:
+ *
+ *    test::Benchmark b("kernel", "\"k\":8");   // params are JSON object members, or ""
+ *    while (b.more()) {
+ *        b.start();
+ *        ... n operations ...
+ *        b.stop(n);
+ *    }
+ *    b.report();
+ *
+ * Untimed work (evicting the caches, say) can go between stop and start.  Each
+ * report is one line of JSON on stdout, so the results can be picked out of
+ * anything else that gets printed with grep '^{"benchmark"'.
  */
 
 #include <iostream>
@@ -44,9 +63,9 @@ class TestCase;
 typedef void (*FunctionPtr)();
 
 struct TestCase {
-    TestCase(const char *fixture_, const char *name_, FunctionPtr func_)
+    TestCase(const char *fixture_, const char *name_, FunctionPtr func_, bool benchmark = false)
             : fixture(fixture_), name(name_), func(func_) {
-        getCases().push_back(this);
+        (benchmark ? getBenchmarks() : getCases()).push_back(this);
     }
     
     void run() { func(); };
@@ -59,8 +78,37 @@ struct TestCase {
         static std::vector<TestCase*> cases;
         return cases;
     };
+
+    static std::vector<TestCase*>& getBenchmarks() {
+        static std::vector<TestCase*> benchmarks;
+        return benchmarks;
+    };
 };
 
+class Benchmark {
+public:
+    Benchmark(const char *name_, const char *params_);
+
+    bool more() const { return ops == 0 || nanos < minNanos; }
+
+    void start();
+    void stop(long long ops_);
+
+    void report() const;
+
+    static long long minNanos;  // how long each configuration is timed for
+
+private:
+    const char *name;
+    const char *params;
+    long long ops;
+    long long nanos;
+    long long started;
+};
+
+// An index directory for the benchmarks that need one, from unit_tests -index; NULL to have them build their own.
+extern const char *benchmarkIndexDirectory;
+
 struct TestFailedException {
     TestFailedException(const char *file_, int line_, const std::string& message_)
         : file(file_), line(line_), message(message_) {}
@@ -72,6 +120,8 @@ struct TestFailedException {
 
 int runAllTests(char *filter);
 
+int runAllBenchmarks(char *filter);
+
 }
 
 #define CONCAT1( x, y ) x ## y
@@ -85,6 +135,11 @@ int runAllTests(char *filter);
     static test::TestCase TEST_CASE(__LINE__) (__FILE__, name, &TEST_FUNC(__LINE__)); \
     static void TEST_FUNC(__LINE__) () /* body follows */
 
+#define BENCHMARK(name) \
+    static void TEST_FUNC(__LINE__) (); \
+    static test::TestCase TEST_CASE(__LINE__) (__FILE__, name, &TEST_FUNC(__LINE__), true); \
+    static void TEST_FUNC(__LINE__) () /* body follows */
+
 #define TEST_F(fixture, name) \
     namespace { struct TEST_CLASS(__LINE__) : public fixture { void _run(); }; } \
     static void TEST_FUNC(__LINE__) () { TEST_CLASS(__LINE__) cls; cls._run(); } \
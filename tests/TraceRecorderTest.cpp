@@ -0,0 +1,74 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "TraceRecorder.h"
+
+static int CountOccurrences(const char *text, const char *pattern)
+{
+    int count = 0;
+    for (const char *found = strstr(text, pattern); NULL != found; found = strstr(found + 1, pattern)) {
+        count++;
+    }
+    return count;
+}
+
+static void TraceRecorderTestThread(void *param)
+{
+    volatile int *threadsDone = (volatile int *)param;
+    {
+        // The first event sets up the thread's buffer, which can take longer than the gap that the repeats merge across.
+        TraceScope trace("test thread start");
+    }
+    for (int i = 0; i < 3; i++) {
+        TraceScope trace("test other thread");
+    }
+    InterlockedIncrementAndReturnNewValue(threadsDone);
+}
+
+TEST("TraceRecorder merges runs of the same event and writes each thread's") {
+    TraceScope notRecorded("test before start");
+    TraceRecorder::start();
+
+    //
+    // Back to back, so one event; then something else in between, so three more.
+    //
+    for (int i = 0; i < 5; i++) {
+        TraceScope trace("test repeated");
+    }
+    {
+        TraceScope trace("test between");
+    }
+    {
+        TraceScope trace("test repeated");
+    }
+    _int64 now = PerfTicks();
+    TraceRecorder::record("test between", now, now + 10);
+
+    volatile int threadsDone = 0;
+    ASSERT(StartNewThread(TraceRecorderTestThread, (void *)&threadsDone));
+    while (threadsDone < 1) {
+        SleepForMillis(1);
+    }
+
+    const char *fileName = "TraceRecorderTest.json";
+    ASSERT(TraceRecorder::write(fileName));
+    ASSERT(!TraceRecorder::Enabled);
+    {
+        TraceScope trace("test after write");
+    }
+
+    FILE *file = fopen(fileName, "r");
+    ASSERT(NULL != file);
+    char contents[4096];
+    size_t length = fread(contents, 1, sizeof(contents) - 1, file);
+    contents[length] = '\0';
+    fclose(file);
+    remove(fileName);
+
+    ASSERT(0 == strncmp(contents, "{\"traceEvents\":[", 16));
+    ASSERT_EQ(2, CountOccurrences(contents, "\"test repeated\""));
+    ASSERT_EQ(2, CountOccurrences(contents, "\"test between\""));
+    ASSERT_EQ(1, CountOccurrences(contents, "\"test other thread\""));
+    ASSERT_EQ(0, CountOccurrences(contents, "\"test before start\""));
+    ASSERT_EQ(0, CountOccurrences(contents, "\"test after write\""));
+}
@@ -0,0 +1,36 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "Util.h"
+
+TEST("Checksum is the same in pieces and notices changes") {
+    char data[1003];
+    for (int i = 0; i < (int)sizeof(data); i++) {
+        data[i] = (char)(i * 31 + 7);
+    }
+
+    util::Checksum whole;
+    whole.add(data, sizeof(data));
+
+    util::Checksum pieces;
+    pieces.add(data, 400);
+    pieces.add(data + 400, 0);
+    pieces.add(data + 400, sizeof(data) - 400);
+    ASSERT_EQ(whole.value(), pieces.value());
+
+    //
+    // Swapping two words leaves the plain sum alone, so it takes the sum of sums to see it.
+    //
+    char swapped[sizeof(data)];
+    memcpy(swapped, data, sizeof(data));
+    memcpy(swapped, data + 4, 4);
+    memcpy(swapped + 4, data, 4);
+    util::Checksum swappedChecksum;
+    swappedChecksum.add(swapped, sizeof(swapped));
+    ASSERT(whole.value() != swappedChecksum.value());
+
+    data[sizeof(data) - 1]++;
+    util::Checksum changed;
+    changed.add(data, sizeof(data));
+    ASSERT(whole.value() != changed.value());
+}
@@ -0,0 +1,100 @@
+#include "stdafx.h"
+#include "Compat.h"
+#include "TestLib.h"
+#include "VariableSizeMap.h"
+#include <map>
+
+//
+// Mixes puts and erases through many rounds of growth, so that lookups, erases and iteration all happen while an
+// old table is still being drained, and checks everything against std::map.
+//
+TEST("VariableSizeMap matches std::map while growing") {
+    VariableSizeMap<_uint64, int> map;
+    std::map<_uint64, int> expected;
+
+    _uint64 state = 12345;
+    for (int i = 0; i < 200000; i++) {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        _uint64 key = 1 + (state >> 33) % (i < 100000 ? 150000 : 3000); // then shrink to lots of erases of present keys
+        if ((state >> 20) % 3 == 0) {
+            ASSERT_EQ(expected.erase(key) != 0, map.erase(key));
+        } else {
+            map.put(key, i);
+            expected[key] = i;
+        }
+        ASSERT_EQ((int)expected.size(), map.size());
+
+        if (i % 9973 == 0) {
+            int nIterated = 0;
+            for (VariableSizeMap<_uint64, int>::iterator e = map.begin(); e != map.end(); e = map.next(e)) {
+                ASSERT(expected.count(e->key) != 0);
+                ASSERT_EQ(expected[e->key], e->value);
+                nIterated++;
+            }
+            ASSERT_EQ((int)expected.size(), nIterated);
+        }
+    }
+
+    for (_uint64 key = 1; key <= 150000; key++) {
+        int* value = map.tryFind(key);
+        ASSERT_EQ(expected.count(key) != 0, value != NULL);
+        if (value != NULL) {
+            ASSERT_EQ(expected[key], *value);
+        }
+    }
+
+    map.clear();
+    ASSERT_EQ(0, map.size());
+    ASSERT(map.find(7) == map.end());
+}
+
+TEST("VariableSizeMap swap trades tables") {
+    VariableSizeMap<unsigned, unsigned> current(1000), previous(1000);
+    for (unsigned round = 0; round < 3; round++) {
+        for (unsigned i = 1; i <= 500; i++) {
+            current.put(i + round * 1000, i);
+        }
+        previous.clear();
+        previous.swap(current);
+        ASSERT_EQ(0, current.size());
+        ASSERT(current.find(1 + round * 1000) == current.end());
+        ASSERT_EQ(500, previous.size());
+        for (unsigned i = 1; i <= 500; i++) {
+            ASSERT_EQ(i, previous.get(i + round * 1000));
+        }
+    }
+}
+
+TEST("VariableSizeMultiMap keeps every value") {
+    VariableSizeMultiMap<unsigned, unsigned> map;
+    std::multimap<unsigned, unsigned> expected;
+    for (unsigned i = 0; i < 20000; i++) {
+        unsigned key = 1 + (i * 7919) % 1500;
+        bool present = false;
+        for (std::multimap<unsigned, unsigned>::iterator e = expected.lower_bound(key); e != expected.upper_bound(key); e++) {
+            present |= e->second == i % 5;
+        }
+        ASSERT_EQ(!present, map.put(key, i % 5));
+        ASSERT(!map.put(key, i % 5));   // it's there now either way
+        if (!present) {
+            expected.insert(std::make_pair(key, i % 5));
+        }
+        if (i % 4 == 3) {
+            //
+            // Drop every value for some key, which moves the entries after them.
+            //
+            unsigned victim = 1 + (i * 104729) % 1500;
+            ASSERT_EQ((int)expected.count(victim), map.eraseAll(victim));
+            expected.erase(victim);
+        }
+    }
+
+    ASSERT_EQ((int)expected.size(), map.size());
+    for (unsigned key = 1; key <= 1500; key++) {
+        int n = 0;
+        for (VariableSizeMultiMap<unsigned, unsigned>::valueIterator i = map.getAll(key); i.hasValue(); i.next()) {
+            n++;
+        }
+        ASSERT_EQ((int)expected.count(key), n);
+    }
+}
@@ -0,0 +1,369 @@
+# bench.py
+#
+# Alignment throughput benchmark for SNAP
+#
+# Generates a fixed synthetic reference and wgsim-style read sets from it (the same seeds give the same files
+# every time), runs them through snap single and snap paired at each of a few read lengths, error rates and
+# thread counts, and reports reads/s, where the aligner threads' time went (from -perf) and peak RSS.
+#
+# Results are compared against a baseline file from an earlier run on the same machine; a run fails if any
+# configuration's throughput drops, or its peak RSS grows, by more than the tolerance.  If there is no baseline
+# yet (or with -update) this run's results become it.
+#
+# The generated data, index, outputs and baseline all live in work_dir, which is reused from run to run so the
+# data only has to be made once.
+#
+
+from __future__ import print_function
+
+import json
+import multiprocessing
+import os
+import random
+import subprocess
+import sys
+
+usage = """usage: %s snap work_dir [options]
+  -baseline file      compare against (or create) this baseline; default work_dir/baseline.json
+  -update             replace the baseline with this run's results
+  -tolerance percent  allowed slowdown or memory growth before a run fails; default 10
+  -threads list       comma separated thread counts; default 1 and the number of cores
+  -reads n            reads (or pairs) per dataset; default 100000
+  -repeat n           runs per configuration, of which the fastest counts; default 3
+  -quick              just the first dataset and thread count, once, to check the harness works""" % sys.argv[0]
+
+# Bump this whenever the generated data changes, so that old baselines aren't compared with new data.
+DATA_VERSION = 1
+
+GENOME_SEED = 1
+CONTIG_LENGTHS = [2000000, 1500000, 500000]
+N_REPEATS = 200             # segments copied (with a few changes) around the genome, to give multiple hits
+REPEAT_LENGTH = 1000
+
+MEAN_INSERT = 400
+INSERT_STDDEV = 50
+
+# (read length, per-base error rate), a tenth of the errors being single base indels
+DATASETS = [(100, 0.001), (100, 0.02), (250, 0.001), (250, 0.02)]
+
+COMPLEMENT = {"A": "T", "C": "G", "G": "C", "T": "A", "N": "N"}
+
+def fail(message):
+    print(message)
+    exit(1)
+
+def parse_args(argv):
+    if len(argv) < 3:
+        fail(usage)
+    args = {
+        "snap": argv[1],
+        "work": argv[2],
+        "baseline": None,
+        "update": False,
+        "tolerance": 10.0,
+        "threads": None,
+        "reads": 100000,
+        "repeat": 3,
+        "quick": False,
+    }
+    i = 3
+    while i < len(argv):
+        arg = argv[i]
+        if arg == "-update":
+            args["update"] = True
+        elif arg == "-quick":
+            args["quick"] = True
+        elif arg in ["-baseline", "-tolerance", "-threads", "-reads", "-repeat"] and i + 1 < len(argv):
+            i += 1
+            value = argv[i]
+            if arg == "-baseline":
+                args["baseline"] = value
+            elif arg == "-tolerance":
+                args["tolerance"] = float(value)
+            elif arg == "-threads":
+                args["threads"] = [int(x) for x in value.split(",")]
+            elif arg == "-reads":
+                args["reads"] = int(value)
+            else:
+                args["repeat"] = int(value)
+        else:
+            fail(usage)
+        i += 1
+    if args["baseline"] is None:
+        args["baseline"] = os.path.join(args["work"], "baseline.json")
+    if args["threads"] is None:
+        cores = multiprocessing.cpu_count()
+        args["threads"] = [1] if cores == 1 else [1, cores]
+    return args
+
+#
+# Data generation
+#
+
+def random_bases(rng, n):
+    return "".join(rng.choice("ACGT") for i in range(n))
+
+def mutate(rng, bases, rate):
+    """Returns bases with substitutions (and a tenth as many single base indels) at the given per-base rate."""
+    out = []
+    for b in bases:
+        r = rng.random()
+        if r >= rate:
+            out.append(b)
+        elif r < rate * 0.05:
+            pass                                    # deletion
+        elif r < rate * 0.1:
+            out.append(b)
+            out.append(rng.choice("ACGT"))          # insertion
+        else:
+            out.append(rng.choice([x for x in "ACGT" if x != b]))
+    return "".join(out)
+
+def reverse_complement(bases):
+    return "".join(COMPLEMENT[b] for b in reversed(bases))
+
+def make_genome(path):
+    rng = random.Random(GENOME_SEED)
+    contigs = [list(random_bases(rng, n)) for n in CONTIG_LENGTHS]
+    for i in range(N_REPEATS):
+        source = rng.choice(contigs)
+        start = rng.randint(0, len(source) - REPEAT_LENGTH)
+        segment = mutate(rng, "".join(source[start:start + REPEAT_LENGTH]), 0.01)[:REPEAT_LENGTH]
+        dest = rng.choice(contigs)
+        at = rng.randint(0, len(dest) - len(segment))
+        dest[at:at + len(segment)] = list(segment)
+    with open(path, "w") as f:
+        for i, contig in enumerate(contigs):
+            f.write(">chr%d\n" % (i + 1))
+            bases = "".join(contig)
+            for j in range(0, len(bases), 80):
+                f.write(bases[j:j + 80] + "\n")
+
+def read_genome(path):
+    contigs = []
+    name = None
+    lines = []
+    for line in open(path):
+        line = line.strip()
+        if line.startswith(">"):
+            if name is not None:
+                contigs.append((name, "".join(lines)))
+            name = line[1:]
+            lines = []
+        else:
+            lines.append(line)
+    contigs.append((name, "".join(lines)))
+    return contigs
+
+def sample_read(rng, bases, length, rate):
+    """Mutates the bases and then cuts or pads the result back to length."""
+    read = mutate(rng, bases, rate)[:length]
+    return read + random_bases(rng, length - len(read))
+
+def write_fastq(f, id, bases):
+    f.write("@%s\n%s\n+\n%s\n" % (id, bases, "I" * len(bases)))
+
+def make_reads(genome, length, rate, n, seed, single_path, paired_paths):
+    """
+    Single and paired reads with wgsim style IDs (contig_begin_end_...), so that snap -e can check their alignments.
+    """
+    rng = random.Random(seed)
+    total = sum(len(bases) for name, bases in genome)
+    weights = [float(len(bases)) / total for name, bases in genome]
+
+    def pick_contig():
+        r = rng.random()
+        for (name, bases), w in zip(genome, weights):
+            if r < w:
+                return name, bases
+            r -= w
+        return genome[-1]
+
+    with open(single_path, "w") as f:
+        for i in range(n):
+            name, bases = pick_contig()
+            start = rng.randint(0, len(bases) - length - 2)
+            read = sample_read(rng, bases[start:start + length + 2], length, rate)
+            if rng.random() < 0.5:
+                read = reverse_complement(read)
+            write_fastq(f, "%s_%d_%d_0:0:0_0:0:0_%x" % (name, start + 1, start + length, i), read)
+
+    with open(paired_paths[0], "w") as f1:
+        with open(paired_paths[1], "w") as f2:
+            for i in range(n):
+                name, bases = pick_contig()
+                insert = max(length, int(rng.gauss(MEAN_INSERT, INSERT_STDDEV)))
+                start = rng.randint(0, len(bases) - insert - 2)
+                end = start + insert
+                read1 = sample_read(rng, bases[start:start + length + 2], length, rate)
+                read2 = reverse_complement(sample_read(rng, bases[end - length:end], length, rate))
+                if rng.random() < 0.5:
+                    read1, read2 = read2, read1
+                id = "%s_%d_%d_0:0:0_0:0:0_%x" % (name, start + 1, end, i)
+                write_fastq(f1, id + "/1", read1)
+                write_fastq(f2, id + "/2", read2)
+
+def dataset_name(length, rate):
+    return "len%d-err%g" % (length, rate)
+
+def prepare_data(args, datasets):
+    work = args["work"]
+    data = os.path.join(work, "data-v%d-%d" % (DATA_VERSION, args["reads"]))
+    if not os.path.exists(data):
+        os.makedirs(data)
+    fasta = os.path.join(data, "bench.fa")
+    index = os.path.join(data, "bench.idx")
+    if not os.path.exists(os.path.join(index, "GenomeIndex")):
+        print("Generating the reference and building its index")
+        make_genome(fasta)
+        run([args["snap"], "index", fasta, index], os.path.join(work, "index.out"))
+    genome = None
+    files = {}
+    for k, (length, rate) in enumerate(datasets):
+        name = dataset_name(length, rate)
+        single = os.path.join(data, name + ".fq")
+        paired = [os.path.join(data, name + "_1.fq"), os.path.join(data, name + "_2.fq")]
+        if not all(os.path.exists(p) for p in [single] + paired):
+            print("Generating %s" % name)
+            if genome is None:
+                genome = read_genome(fasta)
+            tmp = [p + ".tmp" for p in [single] + paired]
+            make_reads(genome, length, rate, args["reads"], 100 + k, tmp[0], tmp[1:])
+            for t, p in zip(tmp, [single] + paired):
+                os.rename(t, p)
+        files[name] = {"single": [single], "paired": paired}
+    return index, files
+
+#
+# Running
+#
+
+def run(cmd, out_path):
+    with open(out_path, "w") as out:
+        retcode = subprocess.call(cmd, stdout=out, stderr=subprocess.STDOUT)
+    if retcode != 0:
+        print("> %s" % " ".join(cmd))
+        print(open(out_path).read(), end="")
+        fail("exited with %d" % retcode)
+
+def error_rate(out_path):
+    """The %Error column of snap's summary line, as a fraction, or None."""
+    seen_header = False
+    for line in open(out_path).read().splitlines():
+        fields = line.split("\t")
+        if line.startswith("MaxHits"):
+            seen_header = True
+        elif seen_header and len(fields) > 6:
+            return float(fields[6][:-1]) / 100 if fields[6].endswith("%") else None
+    return None
+
+def run_one(args, index, mode, inputs, threads, tag):
+    work = args["work"]
+    perf_path = os.path.join(work, tag + ".perf")
+    out_path = os.path.join(work, tag + ".out")
+    if os.path.exists(perf_path):
+        os.remove(perf_path)
+    cmd = [args["snap"], mode, index] + inputs + ["-t", str(threads), "-e", "-o", os.path.join(work, "out.bam"),
+        "-perf", perf_path, "-perfInterval", "0"]
+    run(cmd, out_path)
+    final = json.loads(open(perf_path).read().splitlines()[-1])
+    result = {
+        "readsPerSecond": final["readsPerSecond"],
+        "peakResidentBytes": final["peakResidentBytes"],
+        "errorRate": error_rate(out_path),
+        "stageSeconds": {},
+    }
+    for stage in ["seedLookup", "lvScoring", "cigarGeneration", "outputFormatting", "queueWait"]:
+        result["stageSeconds"][stage] = final[stage]["seconds"]
+    return result
+
+def run_all(args, index, files):
+    results = {}
+    for name in sorted(files.keys()):
+        for mode in ["single", "paired"]:
+            for threads in args["threads"]:
+                config = "%s-%s-t%d" % (mode, name, threads)
+                best = None
+                for r in range(args["repeat"]):
+                    result = run_one(args, index, mode, files[name][mode], threads, config)
+                    if best is None or result["readsPerSecond"] > best["readsPerSecond"]:
+                        best = result
+                results[config] = best
+                print_result(config, best)
+    os.remove(os.path.join(args["work"], "out.bam"))
+    return results
+
+#
+# Reporting
+#
+
+def print_header():
+    print("%-28s %10s %9s %8s %8s %8s %8s %8s %8s" % ("config", "reads/s", "peak MB", "%error",
+        "seed s", "lv s", "cigar s", "output s", "wait s"))
+
+def print_result(config, result):
+    stages = result["stageSeconds"]
+    error = "-" if result["errorRate"] is None else "%.3f" % (100 * result["errorRate"])
+    print("%-28s %10.0f %9.0f %8s %8.2f %8.2f %8.2f %8.2f %8.2f" % (config, result["readsPerSecond"],
+        result["peakResidentBytes"] / 1048576.0, error, stages["seedLookup"], stages["lvScoring"],
+        stages["cigarGeneration"], stages["outputFormatting"], stages["queueWait"]))
+
+def compare(args, results, baseline):
+    """Prints how each configuration did against the baseline, and returns how many regressed."""
+    tolerance = args["tolerance"] / 100
+    regressions = 0
+    print("\nAgainst the baseline (tolerance %g%%):" % args["tolerance"])
+    for config in sorted(results.keys()):
+        if config not in baseline["results"]:
+            print("%-28s not in the baseline" % config)
+            continue
+        now = results[config]
+        then = baseline["results"][config]
+        speed = float(now["readsPerSecond"]) / max(then["readsPerSecond"], 1) - 1
+        memory = float(now["peakResidentBytes"]) / max(then["peakResidentBytes"], 1) - 1
+        problems = []
+        if speed < -tolerance:
+            problems.append("SLOWER")
+        if then["peakResidentBytes"] > 0 and memory > tolerance:
+            problems.append("BIGGER")
+        if problems:
+            regressions += 1
+        print("%-28s reads/s %+6.1f%%  peak RSS %+6.1f%%  %s" % (config, 100 * speed, 100 * memory, " ".join(problems)))
+    return regressions
+
+def main():
+    args = parse_args(sys.argv)
+    if not os.path.exists(args["work"]):
+        os.makedirs(args["work"])
+    datasets = DATASETS
+    if args["quick"]:
+        datasets = datasets[:1]
+        args["threads"] = args["threads"][:1]
+        args["repeat"] = 1
+
+    index, files = prepare_data(args, datasets)
+    print_header()
+    results = run_all(args, index, files)
+
+    baseline = None
+    if os.path.exists(args["baseline"]) and not args["update"]:
+        baseline = json.load(open(args["baseline"]))
+        if baseline.get("dataVersion") != DATA_VERSION or baseline.get("reads") != args["reads"]:
+            fail("The baseline %s is for different data; rerun with -update to replace it" % args["baseline"])
+
+    if baseline is None:
+        if args["quick"]:
+            print("\nNot saving a baseline from a -quick run")
+        else:
+            with open(args["baseline"], "w") as f:
+                json.dump({"dataVersion": DATA_VERSION, "reads": args["reads"], "results": results}, f, indent=1,
+                    sort_keys=True)
+            print("\nSaved the results as the baseline %s" % args["baseline"])
+        return
+
+    regressions = compare(args, results, baseline)
+    if regressions > 0:
+        fail("%d configurations regressed" % regressions)
+
+if __name__ == "__main__":
+    main()
@@ -1,7 +1,19 @@
+#include <cstring>
 #include "TestLib.h"
 
 int main(int argc, char **argv) {
-    // Allow passing in a substring to search for in test names
-    char *filter = (argc == 2 ? argv[1] : NULL);
-    return test::runAllTests(filter);
+    // Allow passing in a substring to search for in test names, and -bench (with -index directory) to run the
+    // microbenchmarks instead
+    char *filter = NULL;
+    bool bench = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-bench") == 0) {
+            bench = true;
+        } else if (strcmp(argv[i], "-index") == 0 && i + 1 < argc) {
+            test::benchmarkIndexDirectory = argv[++i];
+        } else {
+            filter = argv[i];
+        }
+    }
+    return bench ? test::runAllBenchmarks(filter) : test::runAllTests(filter);
 }
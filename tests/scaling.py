@@ -0,0 +1,250 @@
+# scaling.py
+#
+# Thread scaling and pipeline saturation benchmark for SNAP
+#
+# Runs one of bench.py's datasets (made in, and shared with, the same work_dir) through snap at 1, 2, 4, ... threads up
+# to the number of cores, with and without -b, for each way of reading the input (a plain file, which snap memory
+# maps; the same file on stdin, which it reads with stdio; and a gzipped copy) and each output (SAM, BAM and sorted
+# BAM).  For each series it prints reads/s, the speedup over its own one thread run and the parallel efficiency, along
+# with how busy each pipeline stage was, from a -trace of the run:
+#
+#   align       the fraction of the aligner threads' time spent aligning (the rest is waiting or handing off)
+#   read, decompress, compress, write
+#               the stage's busy time over the run's wall time, in threads' worth: 1.00 is one thread flat out
+#   wait        the fraction of the aligner threads' time spent waiting for reads
+#
+# A series that stops scaling where the aligners' wait for reads climbs, or one of the I/O stages nears a thread's
+# worth, is input or output bound rather than alignment bound.
+#
+# Nothing is compared with a baseline; the results can be kept with -json.
+#
+
+from __future__ import print_function
+
+import gzip
+import json
+import multiprocessing
+import os
+import shutil
+import subprocess
+import sys
+
+import bench
+
+usage = """usage: %s snap work_dir [options]
+  -dataset name       which of bench.py's datasets to use; default %s
+  -paired             align pairs rather than single reads
+  -threads list       comma separated thread counts; default 1, 2, 4, ... and the number of cores
+  -inputs list        any of file (memory mapped), stdin (stdio) and gzip; default all three
+  -outputs list       any of sam, bam and sortedbam; default all three
+  -binding list       any of off and on (-b); default both
+  -reads n            reads (or pairs) in the dataset; default 100000
+  -repeat n           runs per configuration, of which the fastest counts; default 1
+  -json file          also write the results to file""" % (sys.argv[0], bench.dataset_name(*bench.DATASETS[0]))
+
+INPUTS = ["file", "stdin", "gzip"]
+OUTPUTS = ["sam", "bam", "sortedbam"]
+BINDINGS = ["off", "on"]
+
+# The -trace events that make up each stage, and whether the stage belongs to the aligner threads (so is shown as a
+# fraction of their time) or is a stage of its own (shown in threads' worth)
+STAGES = [
+    ("align", ["align"], True),
+    ("wait", ["wait for reads"], True),
+    ("read", ["read input"], False),
+    ("decompress", ["decompress"], False),
+    ("compress", ["compress"], False),
+    ("write", ["write batch"], False),
+]
+
+def parse_list(value, allowed):
+    values = value.split(",")
+    for v in values:
+        if v not in allowed:
+            bench.fail("'%s' isn't one of %s" % (v, ", ".join(allowed)))
+    return values
+
+def parse_args(argv):
+    if len(argv) < 3:
+        bench.fail(usage)
+    names = [bench.dataset_name(length, rate) for length, rate in bench.DATASETS]
+    args = {
+        "snap": argv[1],
+        "work": argv[2],
+        "dataset": names[0],
+        "paired": False,
+        "threads": None,
+        "inputs": INPUTS,
+        "outputs": OUTPUTS,
+        "binding": BINDINGS,
+        "reads": 100000,
+        "repeat": 1,
+        "json": None,
+    }
+    i = 3
+    while i < len(argv):
+        arg = argv[i]
+        if arg == "-paired":
+            args["paired"] = True
+        elif arg in ["-dataset", "-threads", "-inputs", "-outputs", "-binding", "-reads", "-repeat", "-json"] and \
+                i + 1 < len(argv):
+            i += 1
+            value = argv[i]
+            if arg == "-dataset":
+                if value not in names:
+                    bench.fail("Unknown dataset '%s'; there are %s" % (value, ", ".join(names)))
+                args["dataset"] = value
+            elif arg == "-threads":
+                args["threads"] = [int(x) for x in value.split(",")]
+            elif arg == "-inputs":
+                args["inputs"] = parse_list(value, INPUTS)
+            elif arg == "-outputs":
+                args["outputs"] = parse_list(value, OUTPUTS)
+            elif arg == "-binding":
+                args["binding"] = parse_list(value, BINDINGS)
+            elif arg == "-reads":
+                args["reads"] = int(value)
+            elif arg == "-repeat":
+                args["repeat"] = int(value)
+            else:
+                args["json"] = value
+        else:
+            bench.fail(usage)
+        i += 1
+    if args["threads"] is None:
+        cores = multiprocessing.cpu_count()
+        args["threads"] = []
+        t = 1
+        while t < cores:
+            args["threads"].append(t)
+            t *= 2
+        args["threads"].append(cores)
+    return args
+
+def gzipped(path):
+    """A gzipped copy of path next to it, made the first time it's asked for."""
+    gz = path + ".gz"
+    if not os.path.exists(gz):
+        print("Compressing %s" % os.path.basename(path))
+        with open(path, "rb") as f:
+            with gzip.open(gz + ".tmp", "wb", 6) as out:
+                shutil.copyfileobj(f, out)
+        os.rename(gz + ".tmp", gz)
+    return gz
+
+#
+# Running
+#
+
+def input_args(input, files):
+    """The snap arguments for the inputs, and the file to give it on stdin, if any."""
+    if input == "file":
+        return files, None
+    if input == "gzip":
+        return [gzipped(f) for f in files], None
+    return ["-fastq", "-"] + files[1:], files[0]
+
+def output_args(output, work):
+    if output == "sam":
+        return ["-o", os.path.join(work, "scaling.sam")]
+    elif output == "bam":
+        return ["-o", os.path.join(work, "scaling.bam")]
+    return ["-o", os.path.join(work, "scaling.bam"), "-so"]
+
+def stage_usage(trace_path, threads, seconds):
+    """Each stage's busy time from the trace, as described at the top."""
+    busy = {}
+    for event in json.load(open(trace_path))["traceEvents"]:
+        busy[event["name"]] = busy.get(event["name"], 0.0) + event["dur"] / 1e6
+    usage = {}
+    for stage, events, aligner in STAGES:
+        total = sum(busy.get(e, 0.0) for e in events)
+        usage[stage] = total / seconds / (threads if aligner else 1)
+    return usage
+
+def run_one(args, index, files, input, output, binding, threads, tag):
+    work = args["work"]
+    perf_path = os.path.join(work, tag + ".perf")
+    trace_path = os.path.join(work, tag + ".trace.json")
+    out_path = os.path.join(work, tag + ".out")
+    if os.path.exists(perf_path):
+        os.remove(perf_path)
+    inputs, stdin = input_args(input, files)
+    cmd = [args["snap"], "paired" if args["paired"] else "single", index] + inputs + output_args(output, work) + \
+        ["-t", str(threads), "-perf", perf_path, "-perfInterval", "0", "-trace", trace_path]
+    if binding == "on":
+        cmd.append("-b")
+    with open(out_path, "w") as out:
+        with open(stdin if stdin is not None else os.devnull) as f:
+            retcode = subprocess.call(cmd, stdin=f, stdout=out, stderr=subprocess.STDOUT)
+    if retcode != 0:
+        print("> %s" % " ".join(cmd))
+        print(open(out_path).read(), end="")
+        bench.fail("exited with %d" % retcode)
+
+    final = json.loads(open(perf_path).read().splitlines()[-1])
+    return {
+        "readsPerSecond": final["readsPerSecond"],
+        "stageUsage": stage_usage(trace_path, threads, final["elapsedSeconds"]),
+    }
+
+def run_series(args, index, files, input, output, binding):
+    print("\n%s input, %s output, binding %s" % (input, output, binding))
+    print_header()
+    series = []
+    for threads in args["threads"]:
+        tag = "scaling-%s-%s-%s-t%d" % (input, output, binding, threads)
+        best = None
+        for r in range(args["repeat"]):
+            result = run_one(args, index, files, input, output, binding, threads, tag)
+            if best is None or result["readsPerSecond"] > best["readsPerSecond"]:
+                best = result
+        best["threads"] = threads
+        series.append(best)
+        print_result(best, series[0])
+    return series
+
+#
+# Reporting
+#
+
+def print_header():
+    print("%8s %10s %8s %6s %7s %7s %7s %10s %9s %7s" % ("threads", "reads/s", "speedup", "eff", "align", "wait",
+        "read", "decompress", "compress", "write"))
+
+def print_result(result, first):
+    speedup = float(result["readsPerSecond"]) / max(first["readsPerSecond"], 1)
+    efficiency = speedup * first["threads"] / result["threads"]
+    usage = result["stageUsage"]
+    print("%8d %10.0f %8.2f %5.0f%% %6.0f%% %6.0f%% %7.2f %10.2f %9.2f %7.2f" % (result["threads"],
+        result["readsPerSecond"], speedup, 100 * efficiency, 100 * usage["align"], 100 * usage["wait"], usage["read"],
+        usage["decompress"], usage["compress"], usage["write"]))
+
+def main():
+    args = parse_args(sys.argv)
+    if not os.path.exists(args["work"]):
+        os.makedirs(args["work"])
+    datasets = [d for d in bench.DATASETS if bench.dataset_name(*d) == args["dataset"]]
+    index, files = bench.prepare_data(args, datasets)
+    files = files[args["dataset"]]["paired" if args["paired"] else "single"]
+    if "gzip" in args["inputs"]:
+        for f in files:
+            gzipped(f)
+
+    results = {}
+    for input in args["inputs"]:
+        for output in args["outputs"]:
+            for binding in args["binding"]:
+                results["%s-%s-%s" % (input, output, binding)] = run_series(args, index, files, input, output, binding)
+
+    for path in ["scaling.sam", "scaling.bam", "scaling.bam.bai"]:
+        if os.path.exists(os.path.join(args["work"], path)):
+            os.remove(os.path.join(args["work"], path))
+
+    if args["json"] is not None:
+        with open(args["json"], "w") as f:
+            json.dump({"dataVersion": bench.DATA_VERSION, "dataset": args["dataset"], "paired": args["paired"],
+                "reads": args["reads"], "results": results}, f, indent=1, sort_keys=True)
+
+if __name__ == "__main__":
+    main()